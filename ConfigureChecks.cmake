@@ -44,6 +44,11 @@ endif(CMAKE_COMPILER_IS_GNUCC AND NOT MINGW AND NOT OS2)
 check_include_file(argp.h HAVE_ARGP_H)
 check_include_file(pty.h HAVE_PTY_H)
 check_include_file(terminos.h HAVE_TERMIOS_H)
+check_include_file(linux/io_uring.h HAVE_LINUX_IO_URING_H)
+check_include_file(sys/mman.h HAVE_SYS_MMAN_H)
+if (WITH_PROBES)
+  check_include_file(sys/sdt.h HAVE_SYS_SDT_H)
+endif (WITH_PROBES)
 if (WIN32)
   check_include_file(wspiapi.h HAVE_WSPIAPI_H)
   if (NOT HAVE_WSPIAPI_H)
@@ -67,6 +72,10 @@ check_include_file(openssl/blowfish.h HAVE_OPENSSL_BLOWFISH_H)
 set(CMAKE_REQUIRED_INCLUDES ${OPENSSL_INCLUDE_DIRS})
 check_include_file(openssl/des.h HAVE_OPENSSL_DES_H)
 
+set(CMAKE_REQUIRED_INCLUDES ${OPENSSL_INCLUDE_DIRS})
+check_include_file(openssl/ecdh.h HAVE_OPENSSL_ECDH_H)
+check_include_file(openssl/ecdsa.h HAVE_OPENSSL_ECDSA_H)
+
 if (CMAKE_HAVE_PTHREAD_H)
   set(HAVE_PTHREAD_H 1)
 endif (CMAKE_HAVE_PTHREAD_H)
@@ -113,7 +122,11 @@ if (UNIX)
 
     check_library_exists(util forkpty "" HAVE_LIBUTIL)
     check_function_exists(getaddrinfo HAVE_GETADDRINFO)
+    check_function_exists(accept4 HAVE_ACCEPT4)
     check_function_exists(poll HAVE_POLL)
+    check_function_exists(epoll_create1 HAVE_EPOLL)
+    check_function_exists(kqueue HAVE_KQUEUE)
+    check_function_exists(clock_gettime HAVE_CLOCK_GETTIME)
     check_function_exists(select HAVE_SELECT)
     check_function_exists(cfmakeraw HAVE_CFMAKERAW)
     check_function_exists(regcomp HAVE_REGCOMP)
@@ -149,6 +162,10 @@ if (WITH_DEBUG_CALLTRACE)
   set(DEBUG_CALLTRACE 1)
 endif (WITH_DEBUG_CALLTRACE)
 
+if (WITH_DEBUG_LOGGING)
+  set(DEBUG_LOGGING 1)
+endif (WITH_DEBUG_LOGGING)
+
 # ENDIAN
 if (NOT WIN32)
     test_big_endian(WORDS_BIGENDIAN)
@@ -5,12 +5,19 @@ option(WITH_SERVER "Build with SSH server support" ON)
 option(WITH_STATIC_LIB "Build with a static library" OFF)
 option(WITH_DEBUG_CRYPTO "Build with cryto debug output" OFF)
 option(WITH_DEBUG_CALLTRACE "Build with calltrace debug output" ON)
+option(WITH_DEBUG_LOGGING "Build with packet and function log output" ON)
+option(WITH_PROBES "Build with static tracepoints (USDT) when sys/sdt.h is found" ON)
 option(WITH_GCRYPT "Compile against libgcrypt" OFF)
 option(WITH_PCAP "Compile with Pcap generation support" ON)
 option(WITH_INTERNAL_DOC "Compile doxygen internal documentation" OFF)
 option(WITH_TESTING "Build with unit tests" OFF)
 option(WITH_CLIENT_TESTING "Build with client tests; requires a running sshd" OFF)
 option(WITH_BENCHMARKS "Build benchmarks tools" OFF)
+option(WITH_PROFILING "Build with frame pointers and symbols for profilers, and the benchmarks" OFF)
+
+if(WITH_PROFILING)
+  set(WITH_BENCHMARKS ON)
+endif(WITH_PROFILING)
 
 if(WITH_BENCHMARKS)
   set(WITH_TESTING ON)
@@ -31,6 +31,15 @@ if (UNIX AND NOT WIN32)
         endif (WITH_FORTIFY_SOURCE)
     endif (${CMAKE_C_COMPILER_ID} MATCHES GNU)
 
+    # perf and the flame graphs walk the stacks with the frame pointers
+    if (WITH_PROFILING)
+        set(CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -g -fno-omit-frame-pointer")
+        check_c_compiler_flag("-mno-omit-leaf-frame-pointer" WITH_LEAF_FRAME_POINTER)
+        if (WITH_LEAF_FRAME_POINTER)
+            set(CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -mno-omit-leaf-frame-pointer")
+        endif (WITH_LEAF_FRAME_POINTER)
+    endif (WITH_PROFILING)
+
     #
     # Check for large filesystem support
     #
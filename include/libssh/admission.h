@@ -0,0 +1,60 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+
+/* admission.c: the connections a server lets in before the authentication */
+
+#include "libssh/priv.h"
+#include "libssh/hashtable.h"
+
+/*
+ * Shared by a bind and the sessions it accepted which aren't authenticated
+ * yet, freed by the last of them.
+ */
+struct ssh_admission_struct {
+  int refs; /* the bind, and the unauthenticated sessions */
+};
+
+/* the connections of a source, in a token bucket */
+struct ssh_admission_source {
+  uint64_t last; /* ms */
+  uint32_t tokens; /* thousandths of a connection */
+};
+
+/* the sources of the connections rate limited by a bind */
+struct ssh_admission_sources {
+  struct ssh_hashtable *table;
+  size_t prune; /* the size of the table which gets the full buckets out */
+};
+
+struct ssh_admission_struct *ssh_admission_new(void);
+int ssh_admission_enter(struct ssh_admission_struct *admission,
+    unsigned int max);
+void ssh_admission_leave(struct ssh_admission_struct **admission);
+unsigned int ssh_admission_count(struct ssh_admission_struct *admission);
+
+struct sockaddr;
+uint64_t ssh_admission_key(const struct sockaddr *addr);
+int ssh_admission_rate(struct ssh_admission_sources *sources, uint64_t key,
+    unsigned int rate, unsigned int burst, uint64_t now);
+void ssh_admission_sources_free(struct ssh_admission_sources *sources);
+
+#endif /* ADMISSION_H_ */
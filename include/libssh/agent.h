@@ -51,6 +51,7 @@ struct ssh_agent_struct {
   struct ssh_socket_struct *sock;
   ssh_buffer ident;
   unsigned int count;
+  int busy; /* a request didn't complete, the connection can't be reused */
 };
 
 #ifndef _WIN32
@@ -91,6 +92,8 @@ struct ssh_public_key_struct *agent_get_first_ident(struct ssh_session_struct *s
 ssh_string agent_sign_data(struct ssh_session_struct *session,
     struct ssh_buffer_struct *data,
     struct ssh_public_key_struct *pubkey);
+
+void ssh_agent_cache_finalize(void);
 #endif
 
 #endif /* __AGENT_H */
@@ -49,6 +49,7 @@ typedef struct ssh_kbdint_struct* ssh_kbdint;
 ssh_kbdint kbdint_new(void);
 void kbdint_clean(ssh_kbdint kbd);
 void kbdint_free(ssh_kbdint kbd);
+void ssh_auth_auto_free(ssh_session session);
 
 
 #ifdef WITH_SSH1
@@ -23,6 +23,28 @@
 #define BIND_H_
 
 #include "libssh/priv.h"
+#include "libssh/hostkey.h"
+#include "libssh/admission.h"
+
+/* the connections taken from the listeners at a wakeup */
+#define SSH_BIND_ACCEPT_BATCH 16
+
+/* an address of SSH_BIND_OPTIONS_LISTEN */
+struct ssh_bind_listener {
+  char *host; /* NULL for a unix socket */
+  char *path; /* the unix socket */
+  int port; /* -1 for the port of the bind */
+  socket_t fd;
+  /* the first one polls with the poll of the bind */
+  struct ssh_poll_handle_struct *poll;
+};
+
+/* a connection accepted and not given to ssh_bind_accept() yet */
+struct ssh_bind_pending {
+  socket_t fd;
+  struct sockaddr_storage addr;
+  socklen_t len;
+};
 
 struct ssh_bind_struct {
   struct error_struct error;
@@ -37,19 +59,43 @@ struct ssh_bind_struct {
   char *banner;
   char *dsakey;
   char *rsakey;
-  ssh_private_key dsa;
-  ssh_private_key rsa;
+  char *ecdsakey;
+  char *ed25519key;
+  /* the loaded host keys, indexed by type */
+  struct ssh_hostkey_struct *host_keys[SSH_HOSTKEY_TYPES];
   char *bindaddr;
   socket_t bindfd;
   unsigned int bindport;
   unsigned int log_verbosity;
+  struct ssh_tcp_options tcp;
+  uint32_t channel_window;
+  uint32_t channel_window_max;
+  uint32_t channel_maxpacket;
 
   int blocking;
   int toaccept;
+  int reuseport; /* SSH_BIND_OPTIONS_REUSEPORT */
+
+  /* the addresses of SSH_BIND_OPTIONS_LISTEN, bindfd is the first one */
+  struct ssh_bind_listener *listeners;
+  unsigned int nlisteners;
+  unsigned int next_listener; /* the first one drained by the next accept */
+  struct ssh_bind_pending pending[SSH_BIND_ACCEPT_BATCH];
+  unsigned int pending_start;
+  unsigned int npending;
+
+  /* admission of the connections before the authentication */
+  unsigned int max_unauthenticated;
+  unsigned int rate_limit;
+  unsigned int rate_burst;
+  struct ssh_admission_struct *admission;
+  struct ssh_admission_sources sources;
 };
 
 struct ssh_poll_handle_struct *ssh_bind_get_poll(struct ssh_bind_struct
     *sshbind);
+int ssh_bind_add_listener(struct ssh_bind_struct *sshbind,
+    const char *address);
 
 
 #endif /* BIND_H_ */
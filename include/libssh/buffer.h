@@ -23,6 +23,16 @@
 #define BUFFER_H_
 
 #include "libssh/libssh.h"
+
+/*
+ * buffer_reinit() keeps the memory of a buffer up to this size, so the
+ * packet buffers don't have to grow again for each packet. It can be
+ * overridden at build time.
+ */
+#ifndef BUFFER_REINIT_MAX_SIZE
+#define BUFFER_REINIT_MAX_SIZE (64 * 1024)
+#endif
+
 /*
  * Describes a buffer state
  * [XXXXXXXXXXXXDATA PAYLOAD       XXXXXXXXXXXXXXXXXXXXXXXX]
@@ -35,21 +45,33 @@ struct ssh_buffer_struct {
     uint32_t used;
     uint32_t allocated;
     uint32_t pos;
+    int secure; /* the data is burned when it's released */
+    void *pool_next; /* link while the buffer is in a pool */
 };
 
 LIBSSH_API void ssh_buffer_free(ssh_buffer buffer);
 LIBSSH_API void *ssh_buffer_get_begin(ssh_buffer buffer);
 LIBSSH_API uint32_t ssh_buffer_get_len(ssh_buffer buffer);
 LIBSSH_API ssh_buffer ssh_buffer_new(void);
+ssh_buffer ssh_buffer_new_sized(uint32_t size);
 int buffer_add_ssh_string(ssh_buffer buffer, ssh_string string);
 int buffer_add_u8(ssh_buffer buffer, uint8_t data);
 int buffer_add_u16(ssh_buffer buffer, uint16_t data);
 int buffer_add_u32(ssh_buffer buffer, uint32_t data);
 int buffer_add_u64(ssh_buffer buffer, uint64_t data);
 int buffer_add_data(ssh_buffer buffer, const void *data, uint32_t len);
+void *buffer_allocate(ssh_buffer buffer, uint32_t len);
+void *buffer_reserve(ssh_buffer buffer, uint32_t len);
+int buffer_ensure(ssh_buffer buffer, uint32_t len);
+int buffer_commit(ssh_buffer buffer, uint32_t len);
+int buffer_pack(ssh_buffer buffer, const char *format, ...);
+int buffer_unpack(ssh_buffer buffer, const char *format, ...);
 int buffer_prepend_data(ssh_buffer buffer, const void *data, uint32_t len);
 int buffer_add_buffer(ssh_buffer buffer, ssh_buffer source);
+int buffer_move(ssh_buffer buffer, ssh_buffer source, uint32_t len);
 int buffer_reinit(ssh_buffer buffer);
+void buffer_release(ssh_buffer buffer);
+void buffer_set_secure(ssh_buffer buffer);
 
 /* buffer_get_rest returns a pointer to the current position into the buffer */
 void *buffer_get_rest(ssh_buffer buffer);
@@ -64,6 +86,10 @@ int buffer_get_u64(ssh_buffer buffer, uint64_t *data);
 uint32_t buffer_get_data(ssh_buffer buffer, void *data, uint32_t requestedlen);
 /* buffer_get_ssh_string() is an exception. if the String read is too large or invalid, it will answer NULL. */
 ssh_string buffer_get_ssh_string(ssh_buffer buffer);
+/* the same without copy, the data is valid until the buffer changes */
+const void *buffer_get_ssh_string_view(ssh_buffer buffer, uint32_t *len);
+/* the same as a C string, terminated in the buffer */
+char *buffer_get_ssh_string_cstr(ssh_buffer buffer);
 /* gets a string out of a SSH-1 mpint */
 ssh_string buffer_get_mpint(ssh_buffer buffer);
 /* buffer_pass_bytes acts as if len bytes have been read (used for padding) */
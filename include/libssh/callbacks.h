@@ -110,6 +110,82 @@ typedef void (*ssh_status_callback) (ssh_session session, float status,
 typedef void (*ssh_global_request_callback) (ssh_session session,
                                         ssh_message message, void *userdata);
 
+/**
+ * @brief SSH channel open request callback. Called when the other side opens
+ * a channel, e.g. for a remote port forwarding, instead of queueing the
+ * request for ssh_forward_accept() or ssh_message_get().
+ * @param session Current session handler
+ * @param message the channel open request, freed after the callback
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns 0 if the request was replied (e.g. with
+ *          ssh_message_channel_request_open_reply_accept()), non-zero to
+ *          queue it as usual.
+ */
+typedef int (*ssh_channel_open_request_callback) (ssh_session session,
+                                        ssh_message message, void *userdata);
+
+/**
+ * @brief SSH resolver callback, to resolve the host of ssh_connect() without
+ * blocking, e.g. with an asynchronous DNS library.
+ *
+ * It starts the resolution and returns. The addresses are given to
+ * ssh_resolve_done() later; ssh_connect() returns SSH_AGAIN until then. A
+ * blocking session needs ssh_resolve_done() to be called before the callback
+ * returns. Hosts which are IP addresses don't go through the callback.
+ *
+ * @param session Current session handler
+ * @param host The host to resolve.
+ * @param port The port to connect to.
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns SSH_OK if the resolution is started or done, SSH_ERROR on error.
+ */
+typedef int (*ssh_resolve_callback) (ssh_session session, const char *host,
+                                     int port, void *userdata);
+
+/**
+ * @brief SSH global request response callback. Called when the peer answers
+ * a global request sent with a reply expected, e.g. by ssh_forward_listen().
+ * A nonblocking session gets the answer this way instead of calling the
+ * function again.
+ * @param session Current session handler
+ * @param is_success 1 if the request was accepted, 0 if it was denied.
+ * @param userdata Userdata to be passed to the callback function.
+ */
+typedef void (*ssh_global_request_response_callback) (ssh_session session,
+                                        int is_success, void *userdata);
+
+/**
+ * @brief SSH server session callback. Called when a session accepted by a
+ * server reaches a step of its setup: the end of the key exchange started by
+ * ssh_handle_key_exchange(), or the success of the authentication. A server
+ * driving its nonblocking sessions with an ssh_event learns there when to
+ * go on.
+ * @param session Current session handler
+ * @param userdata Userdata to be passed to the callback function.
+ */
+typedef void (*ssh_server_session_callback) (ssh_session session,
+                                             void *userdata);
+
+/**
+ * @brief SSH host key callback. Called on a client during its first key
+ * exchange, once the server proved it owns its key, to verify the key
+ * without ssh_is_server_known(), e.g. against an inventory service.
+ *
+ * It can answer at once or defer its answer to ssh_host_key_verified();
+ * ssh_connect() returns SSH_AGAIN until then and nothing is sent which
+ * needs the server to be trusted. A blocking session needs
+ * ssh_host_key_verified() to be called before the callback returns.
+ *
+ * @param session Current session handler
+ * @param key The public key blob of the server, as ssh_get_pubkey() gives
+ *            it. It is valid as long as the session is connected.
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns SSH_OK to accept the key, SSH_AGAIN to answer later, SSH_ERROR to
+ *          reject it.
+ */
+typedef int (*ssh_host_key_callback) (ssh_session session, ssh_string key,
+                                      void *userdata);
+
 /**
  * The structure to replace libssh functions with appropriate callbacks.
  */
@@ -137,6 +213,31 @@ struct ssh_callbacks_struct {
    * This function will be called each time a global request is received.
    */
   ssh_global_request_callback global_request_function;
+  /**
+   * This function will be called each time a channel open request is
+   * received.
+   */
+  ssh_channel_open_request_callback channel_open_request_function;
+  /**
+   * This function will be called to resolve the host to connect to.
+   */
+  ssh_resolve_callback resolve_function;
+  /**
+   * This function will be called when the peer answers a global request.
+   */
+  ssh_global_request_response_callback global_request_response_function;
+  /**
+   * This function will be called when the key exchange of a server is done.
+   */
+  ssh_server_session_callback server_kex_done_function;
+  /**
+   * This function will be called when a server authenticated the user.
+   */
+  ssh_server_session_callback server_authenticated_function;
+  /**
+   * This function will be called to verify the host key of a client.
+   */
+  ssh_host_key_callback host_key_function;
 };
 typedef struct ssh_callbacks_struct *ssh_callbacks;
 
@@ -271,6 +372,195 @@ typedef struct ssh_packet_callbacks_struct *ssh_packet_callbacks;
  */
 LIBSSH_API int ssh_set_callbacks(ssh_session session, ssh_callbacks cb);
 
+/**
+ * @brief SSH server none authentication callback.
+ * @param session Current session handler
+ * @param user The user name.
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns SSH_AUTH_SUCCESS, SSH_AUTH_PARTIAL or SSH_AUTH_DENIED, or
+ *          SSH_AUTH_AGAIN to answer later, see ssh_auth_reply_pending().
+ */
+typedef int (*ssh_auth_none_callback) (ssh_session session, const char *user,
+                                       void *userdata);
+
+/**
+ * @brief SSH server password authentication callback.
+ * @param session Current session handler
+ * @param user The user name.
+ * @param password The password, burnt when the callback returns.
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns SSH_AUTH_SUCCESS, SSH_AUTH_PARTIAL or SSH_AUTH_DENIED, or
+ *          SSH_AUTH_AGAIN to answer later, see ssh_auth_reply_pending().
+ */
+typedef int (*ssh_auth_password_callback) (ssh_session session,
+                                           const char *user,
+                                           const char *password,
+                                           void *userdata);
+
+/**
+ * @brief SSH server public key authentication callback. Called once for
+ * the key offered without a signature, then for the signed request.
+ * @param session Current session handler
+ * @param user The user name.
+ * @param pubkey The public key, freed when the callback returns.
+ * @param signature_state SSH_PUBLICKEY_STATE_NONE if the client asks if the
+ *        key is acceptable, SSH_PUBLICKEY_STATE_VALID if it signed the
+ *        request with it, SSH_PUBLICKEY_STATE_WRONG for a bad signature.
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns SSH_AUTH_SUCCESS to accept the key, SSH_AUTH_PARTIAL or
+ *          SSH_AUTH_DENIED, or SSH_AUTH_AGAIN to answer later. A key is only
+ *          accepted with a valid signature, without it the client is told
+ *          the key is acceptable.
+ */
+typedef int (*ssh_auth_pubkey_callback) (ssh_session session,
+                                         const char *user,
+                                         ssh_public_key pubkey,
+                                         char signature_state,
+                                         void *userdata);
+
+/**
+ * @brief SSH server session channel open callback. The channel is made
+ * before the callback, which may set its callbacks before any request of
+ * the client comes.
+ * @param session Current session handler
+ * @param channel The new channel, confirmed to the client if accepted, freed
+ *        if not.
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns 0 to accept the channel, non-zero to refuse it.
+ */
+typedef int (*ssh_channel_open_request_session_callback) (ssh_session session,
+                                        ssh_channel channel, void *userdata);
+
+/**
+ * The typed callbacks of a server. The requests they handle are parsed in
+ * the packet, and answered from the value the callback returns: they don't
+ * go through ssh_message_get() and aren't allocated. The strings are only
+ * valid during the callback. The requests without a callback are queued as
+ * ssh_message objects as before.
+ */
+struct ssh_server_callbacks_struct {
+  /** DON'T SET THIS use ssh_callbacks_init() instead. */
+  size_t size;
+  /**
+   * User-provided data. User is free to set anything he wants here
+   */
+  void *userdata;
+  /**
+   * This function will be called for the none authentication.
+   */
+  ssh_auth_none_callback auth_none_function;
+  /**
+   * This function will be called for the password authentication.
+   */
+  ssh_auth_password_callback auth_password_function;
+  /**
+   * This function will be called for the public key authentication.
+   */
+  ssh_auth_pubkey_callback auth_pubkey_function;
+  /**
+   * This function will be called when the client opens a session channel.
+   */
+  ssh_channel_open_request_session_callback
+      channel_open_request_session_function;
+};
+typedef struct ssh_server_callbacks_struct *ssh_server_callbacks;
+
+/**
+ * @brief Set the typed callback functions of a server session.
+ *
+ * @code
+ * struct ssh_server_callbacks_struct cb = {
+ *   .userdata = data,
+ *   .auth_password_function = my_auth_password_function
+ * };
+ * ssh_callbacks_init(&cb);
+ * ssh_set_server_callbacks(session, &cb);
+ * @endcode
+ *
+ * @param  session      The session to set the callback structure.
+ *
+ * @param  cb           The callback structure itself.
+ *
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_set_server_callbacks(ssh_session session,
+                                        ssh_server_callbacks cb);
+
+/**
+ * @brief Answer the authentication request an authentication callback of
+ * the server left pending.
+ *
+ * A callback returning SSH_AUTH_AGAIN doesn't answer the client, e.g. while
+ * a directory is asked in another thread, and the other sessions of the
+ * thread go on. The requests the client sends meanwhile wait for the answer,
+ * then go to the callbacks in order. The public key of the request is kept
+ * until then, the password isn't.
+ *
+ * This must be called by the thread polling the session, see
+ * ssh_event_auth_reply_pending() for the other threads.
+ *
+ * @param  session      The session with a pending request.
+ *
+ * @param  result       What the callback would have returned:
+ *                      SSH_AUTH_SUCCESS, SSH_AUTH_PARTIAL or SSH_AUTH_DENIED.
+ *
+ * @return SSH_OK on success, SSH_ERROR if no request is pending or on error.
+ */
+LIBSSH_API int ssh_auth_reply_pending(ssh_session session, int result);
+
+/**
+ * @brief Answer a pending authentication request from any thread.
+ *
+ * The answer is posted to the event of the session with ssh_event_post(),
+ * which wakes up its poll, and given by ssh_auth_reply_pending() in its
+ * thread. The session must stay in the event until then.
+ *
+ * @param  event        The event polling the session.
+ *
+ * @param  session      The session with a pending request.
+ *
+ * @param  result       SSH_AUTH_SUCCESS, SSH_AUTH_PARTIAL or SSH_AUTH_DENIED.
+ *
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_event_auth_reply_pending(ssh_event event,
+                                            ssh_session session, int result);
+
+struct addrinfo;
+
+/**
+ * @brief Give the result of the resolver callback to a connecting session.
+ *
+ * The addresses are tried like the ones of getaddrinfo(). The ones with a
+ * port of 0 get the port of the session. Call ssh_connect() again afterwards
+ * in nonblocking mode.
+ *
+ * @param  session      The session which called the resolver callback.
+ *
+ * @param  ai           The addresses of the host, NULL if it couldn't be
+ *                      resolved. They are copied.
+ *
+ * @return SSH_OK if the connection starts, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_resolve_done(ssh_session session,
+                                const struct addrinfo *ai);
+
+/**
+ * @brief Give the answer deferred by the host key callback to a connecting
+ * session.
+ *
+ * Call ssh_connect() again afterwards in nonblocking mode: it goes on if the
+ * key is accepted, and fails otherwise.
+ *
+ * @param  session      The session whose host key callback returned
+ *                      SSH_AGAIN.
+ *
+ * @param  accepted     1 if the key is accepted, 0 if it is rejected.
+ *
+ * @return SSH_OK on success, SSH_ERROR if no answer was awaited.
+ */
+LIBSSH_API int ssh_host_key_verified(ssh_session session, int accepted);
+
 /**
  * @brief SSH channel data callback. Called when data is available on a channel
  * @param session Current session handler
@@ -348,6 +638,98 @@ typedef void (*ssh_channel_exit_signal_callback) (ssh_session session,
                                             const char *lang,
                                             void *userdata);
 
+/**
+ * @brief SSH channel open response callback. Called when the peer accepts or
+ * refuses the opening of a channel. With a nonblocking session, the open
+ * functions return SSH_AGAIN and many opens can wait for their answer at
+ * once.
+ * @param session Current session handler
+ * @param channel the actual channel
+ * @param is_success 1 if the channel is open, 0 if the peer refused it.
+ * @param userdata Userdata to be passed to the callback function.
+ */
+typedef void (*ssh_channel_open_response_callback) (ssh_session session,
+                                            ssh_channel channel,
+                                            int is_success,
+                                            void *userdata);
+
+/**
+ * @brief SSH channel request response callback. Called when the peer answers
+ * a request of the channel, e.g. ssh_channel_request_exec(). A nonblocking
+ * session gets the answer this way instead of calling the function again.
+ * A channel has one request waiting for its answer at a time.
+ * @param session Current session handler
+ * @param channel the actual channel
+ * @param is_success 1 if the request was accepted, 0 if it was denied.
+ * @param userdata Userdata to be passed to the callback function.
+ */
+typedef void (*ssh_channel_request_response_callback) (ssh_session session,
+                                            ssh_channel channel,
+                                            int is_success,
+                                            void *userdata);
+
+/**
+ * @brief SSH channel writable callback. Called when the channel can take
+ * more data without blocking: the peer has grown the window, or the socket
+ * has written its buffer out. An application can produce its data from here
+ * instead of polling ssh_channel_window_size(). The channel must not be
+ * freed from the callback.
+ * @param session Current session handler
+ * @param channel the actual channel
+ * @param bytes the number of bytes the channel can write at once
+ * @param userdata Userdata to be passed to the callback function.
+ */
+typedef void (*ssh_channel_writable_callback) (ssh_session session,
+                                            ssh_channel channel,
+                                            uint32_t bytes,
+                                            void *userdata);
+
+/**
+ * @brief SSH channel pty request callback, for a server. Also called for the
+ * window changes of the pty.
+ * @param session Current session handler
+ * @param channel the actual channel
+ * @param term The type of terminal, NULL for a window change.
+ * @param width The width in characters.
+ * @param height The height in characters.
+ * @param pxwidth The width in pixels.
+ * @param pxheight The height in pixels.
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns 0 if the request is accepted, -1 if not.
+ */
+typedef int (*ssh_channel_pty_request_callback) (ssh_session session,
+                                            ssh_channel channel,
+                                            const char *term,
+                                            int width, int height,
+                                            int pxwidth, int pxheight,
+                                            void *userdata);
+
+/**
+ * @brief SSH channel shell request callback, for a server.
+ * @param session Current session handler
+ * @param channel the actual channel
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns 0 if the request is accepted, -1 if not.
+ */
+typedef int (*ssh_channel_shell_request_callback) (ssh_session session,
+                                            ssh_channel channel,
+                                            void *userdata);
+
+/**
+ * @brief SSH channel exec, subsystem or env request callback, for a server.
+ * @param session Current session handler
+ * @param channel the actual channel
+ * @param name The command, the subsystem, or the name of the variable.
+ * @param value The value of the variable, NULL for the other requests.
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns 0 if the request is accepted, -1 if not.
+ */
+typedef int (*ssh_channel_string_request_callback) (ssh_session session,
+                                            ssh_channel channel,
+                                            const char *name,
+                                            const char *value,
+                                            void *userdata);
+
 struct ssh_channel_callbacks_struct {
   /** DON'T SET THIS use ssh_callbacks_init() instead. */
   size_t size;
@@ -379,6 +761,39 @@ struct ssh_channel_callbacks_struct {
    * This functions will be called when an exit signal has been received
    */
   ssh_channel_exit_signal_callback channel_exit_signal_function;
+  /**
+   * This functions will be called when the peer answers the channel open
+   */
+  ssh_channel_open_response_callback channel_open_response_function;
+  /**
+   * This functions will be called when the peer answers a channel request
+   */
+  ssh_channel_request_response_callback channel_request_response_function;
+  /**
+   * This functions will be called when the channel can be written to
+   */
+  ssh_channel_writable_callback channel_writable_function;
+  /**
+   * This functions will be called when the client asks for a pty, or
+   * changes its window
+   */
+  ssh_channel_pty_request_callback channel_pty_request_function;
+  /**
+   * This functions will be called when the client asks for a shell
+   */
+  ssh_channel_shell_request_callback channel_shell_request_function;
+  /**
+   * This functions will be called when the client runs a command
+   */
+  ssh_channel_string_request_callback channel_exec_request_function;
+  /**
+   * This functions will be called when the client asks for a subsystem
+   */
+  ssh_channel_string_request_callback channel_subsystem_request_function;
+  /**
+   * This functions will be called when the client sets a variable
+   */
+  ssh_channel_string_request_callback channel_env_request_function;
 };
 typedef struct ssh_channel_callbacks_struct *ssh_channel_callbacks;
 
@@ -406,6 +821,298 @@ typedef struct ssh_channel_callbacks_struct *ssh_channel_callbacks;
 LIBSSH_API int ssh_set_channel_callbacks(ssh_channel channel,
                                          ssh_channel_callbacks cb);
 
+/**
+ * @brief Stop buffering the data the channel data callback doesn't consume.
+ *
+ * The callback always gets the data of the packets, in place. The bytes it
+ * doesn't consume are left to the application, which may keep them, and
+ * the window isn't given back for them until ssh_channel_consume() is
+ * called: the peer's sending follows the consumption. Data buffered before
+ * remains readable with ssh_channel_read().
+ *
+ * @param  channel      The channel with the data callback.
+ *
+ * @param  unbuffered   1 to stop buffering, 0 to buffer again.
+ *
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_channel_set_unbuffered(ssh_channel channel, int unbuffered);
+
+/**
+ * @brief Give back the window of the data an unbuffered channel data callback
+ * didn't consume.
+ *
+ * @param  channel      The unbuffered channel.
+ *
+ * @param  len          The number of bytes consumed by the application.
+ *
+ * @return SSH_OK on success, SSH_ERROR if the window couldn't be sent.
+ *
+ * @see ssh_channel_set_unbuffered()
+ */
+LIBSSH_API int ssh_channel_consume(ssh_channel channel, uint32_t len);
+
+struct iovec;
+
+/**
+ * @brief Transport read callback. Reads at most len bytes into buffer.
+ * @param buffer Where to store the data.
+ * @param len Size of the buffer.
+ * @param userdata Userdata of the transport callbacks.
+ * @returns the number of bytes read, 0 on end of file, SSH_AGAIN if there is
+ *          nothing to read right now or SSH_ERROR on error.
+ */
+typedef int (*ssh_transport_read_callback) (void *buffer, uint32_t len,
+                                            void *userdata);
+
+/**
+ * @brief Transport write callback. Writes at most len bytes of buffer.
+ * @param buffer The data to write.
+ * @param len Number of bytes to write.
+ * @param userdata Userdata of the transport callbacks.
+ * @returns the number of bytes written, SSH_AGAIN if nothing can be written
+ *          right now or SSH_ERROR on error.
+ */
+typedef int (*ssh_transport_write_callback) (const void *buffer, uint32_t len,
+                                             void *userdata);
+
+/**
+ * @brief Transport gather write callback, like writev(2).
+ * @returns the number of bytes written, SSH_AGAIN if nothing can be written
+ *          right now or SSH_ERROR on error.
+ */
+typedef int (*ssh_transport_writev_callback) (const struct iovec *iov,
+                                              int iovcnt, void *userdata);
+
+/**
+ * @brief Transport close callback, called once when the session closes its
+ * connection.
+ * @param userdata Userdata of the transport callbacks.
+ */
+typedef void (*ssh_transport_close_callback) (void *userdata);
+
+/**
+ * The structure to replace the system calls a session uses to read from and
+ * write to its connection, e.g. to run it over a user-space TCP stack, a TLS
+ * tunnel or an in-memory pipe.
+ */
+struct ssh_transport_callbacks_struct {
+  /** DON'T SET THIS use ssh_callbacks_init() instead. */
+  size_t size;
+  /**
+   * User-provided data. User is free to set anything he wants here
+   */
+  void *userdata;
+  /** Reads the data received from the peer. Mandatory. */
+  ssh_transport_read_callback read;
+  /** Writes data to the peer. Mandatory. */
+  ssh_transport_write_callback write;
+  /** Writes several buffers at once. Optional, write is used otherwise. */
+  ssh_transport_writev_callback writev;
+  /**
+   * Closes the transport. Optional. libssh doesn't close the poll file
+   * descriptor of a transport itself, this function should.
+   */
+  ssh_transport_close_callback close;
+};
+typedef struct ssh_transport_callbacks_struct *ssh_transport_callbacks;
+
+/**
+ * @brief Set the transport of a session.
+ *
+ * The session will read and write its connection through the transport
+ * callbacks instead of system calls. The file descriptor is only polled: it
+ * must be readable when the read callback has data, and writable when the
+ * write callback accepts data again, e.g. an eventfd or one end of a
+ * socketpair signalled by the transport.
+ *
+ * @code
+ * struct ssh_transport_callbacks_struct cb = {
+ *   .userdata = data,
+ *   .read = my_read_function,
+ *   .write = my_write_function
+ * };
+ * ssh_callbacks_init(&cb);
+ * ssh_set_transport_callbacks(session, &cb, fd);
+ * ssh_connect(session);
+ * @endcode
+ *
+ * A client sets it before ssh_connect(), a server after ssh_bind_accept(),
+ * which closes the accepted connection, and before
+ * ssh_handle_key_exchange().
+ *
+ * @param  session      The session to set the transport on.
+ *
+ * @param  cb           The callback structure itself. It must stay valid as
+ *                      long as the session is connected.
+ *
+ * @param  fd           The file descriptor to poll for the transport.
+ *
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_set_transport_callbacks(ssh_session session,
+                                           ssh_transport_callbacks cb,
+                                           socket_t fd);
+
+/**
+ * @brief Batch setup callback. Called before a host is connected, to set
+ * the options of its session (port, identity, known hosts file, ...).
+ * @param batch The batch.
+ * @param session The session of the host.
+ * @param host The host as given to ssh_batch_add_host().
+ * @param userdata Userdata of the batch callbacks.
+ * @returns SSH_OK to connect, SSH_ERROR to skip the host.
+ */
+typedef int (*ssh_batch_setup_callback) (ssh_batch batch, ssh_session session,
+                                         const char *host, void *userdata);
+
+/**
+ * @brief Batch host key callback. Called once a host is connected, to
+ * verify its key. Without it, the key must be known with
+ * ssh_is_server_known().
+ * @param batch The batch.
+ * @param session The session of the host.
+ * @param host The host as given to ssh_batch_add_host().
+ * @param userdata Userdata of the batch callbacks.
+ * @returns SSH_OK to go on, SSH_ERROR to drop the host.
+ */
+typedef int (*ssh_batch_verify_callback) (ssh_batch batch, ssh_session session,
+                                          const char *host, void *userdata);
+
+/**
+ * @brief Batch host keys callback. Called once per poll of the batch with
+ * the keys of all the hosts which got one, to look them up together, e.g.
+ * with one query to an inventory service. Each session is answered with
+ * ssh_host_key_verified(), during the call or later, e.g. from a descriptor
+ * added to the event of the batch. With it, the host_verify_function
+ * callback isn't called.
+ * @param batch The batch.
+ * @param sessions The sessions of the hosts, valid until they are answered
+ *                 or the hosts are done.
+ * @param hosts The hosts as given to ssh_batch_add_host().
+ * @param keys The public key blobs of the hosts.
+ * @param count The number of hosts.
+ * @param userdata Userdata of the batch callbacks.
+ */
+typedef void (*ssh_batch_host_keys_callback) (ssh_batch batch,
+    ssh_session *sessions, const char **hosts, ssh_string *keys,
+    size_t count, void *userdata);
+
+/**
+ * @brief Batch data callback. Called with the output of the command as it
+ * comes.
+ * @param batch The batch.
+ * @param host The host as given to ssh_batch_add_host().
+ * @param data The data received.
+ * @param len The length of the data.
+ * @param is_stderr 0 for stdout, 1 for stderr.
+ * @param userdata Userdata of the batch callbacks.
+ */
+typedef void (*ssh_batch_data_callback) (ssh_batch batch, const char *host,
+                                         const void *data, uint32_t len,
+                                         int is_stderr, void *userdata);
+
+/**
+ * @brief Batch done callback. Called once per host, when its command exited
+ * or the host failed.
+ * @param batch The batch.
+ * @param host The host as given to ssh_batch_add_host().
+ * @param exit_status The exit status of the command, -1 if there is none.
+ * @param error NULL if the command ran, the reason of the failure
+ *              otherwise.
+ * @param userdata Userdata of the batch callbacks.
+ */
+typedef void (*ssh_batch_done_callback) (ssh_batch batch, const char *host,
+                                         int exit_status, const char *error,
+                                         void *userdata);
+
+/**
+ * @brief Batch line callback. Called with each line of the output of a
+ * command, with SSH_BATCH_CAPTURE_LINES.
+ * @param batch The batch.
+ * @param host The host as given to ssh_batch_add_host().
+ * @param line The line, without its newline, only valid during the call.
+ * @param len The length of the line.
+ * @param is_stderr 0 for stdout, 1 for stderr.
+ * @param userdata Userdata of the batch callbacks.
+ */
+typedef void (*ssh_batch_line_callback) (ssh_batch batch, const char *host,
+                                         const char *line, size_t len,
+                                         int is_stderr, void *userdata);
+
+/**
+ * The end of the command of a host, with its output as captured, see
+ * ssh_batch_set_capture(). Only valid during the result callback.
+ */
+struct ssh_batch_result_struct {
+  /** The exit status, -1 if there is none. */
+  int exit_status;
+  /** The signal which killed the command without "SIG", or NULL. */
+  const char *exit_signal;
+  /** The command dumped a core when it was killed. */
+  int core_dumped;
+  /** NULL if the command ran, the reason of the failure otherwise. */
+  const char *error;
+  /** The output captured on stdout and on stderr. */
+  const char *out;
+  size_t out_len;
+  const char *err;
+  size_t err_len;
+  /** The bytes which weren't captured, over the limit. */
+  uint64_t out_dropped;
+  uint64_t err_dropped;
+};
+
+/**
+ * @brief Batch result callback. Called once per host, before the done
+ * callback, with everything known about its command.
+ * @param batch The batch.
+ * @param host The host as given to ssh_batch_add_host().
+ * @param result The result.
+ * @param userdata Userdata of the batch callbacks.
+ */
+typedef void (*ssh_batch_result_callback) (ssh_batch batch, const char *host,
+    const struct ssh_batch_result_struct *result, void *userdata);
+
+/**
+ * The callbacks through which a batch reports its hosts.
+ */
+struct ssh_batch_callbacks_struct {
+  /** DON'T SET THIS use ssh_callbacks_init() instead. */
+  size_t size;
+  /**
+   * User-provided data. User is free to set anything he wants here
+   */
+  void *userdata;
+  /** Sets the options of the sessions. Optional. */
+  ssh_batch_setup_callback host_setup_function;
+  /** Verifies the host keys. Optional. */
+  ssh_batch_verify_callback host_verify_function;
+  /** Receives the output of the commands. Optional. */
+  ssh_batch_data_callback host_data_function;
+  /** Receives the results. */
+  ssh_batch_done_callback host_done_function;
+  /** Receives the lines of the output. Optional. */
+  ssh_batch_line_callback host_line_function;
+  /** Receives the results with the output captured. Optional. */
+  ssh_batch_result_callback host_result_function;
+  /** Verifies the host keys in bulk. Optional. */
+  ssh_batch_host_keys_callback host_keys_function;
+};
+typedef struct ssh_batch_callbacks_struct *ssh_batch_callbacks;
+
+/**
+ * @brief Set the callbacks of a batch.
+ *
+ * @param  batch        The batch.
+ *
+ * @param  cb           The callback structure itself. It must stay valid as
+ *                      long as the batch runs.
+ *
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_batch_set_callbacks(ssh_batch batch, ssh_batch_callbacks cb);
+
 /** @} */
 
 /** @group libssh_threads
@@ -425,14 +1132,16 @@ struct ssh_threads_callbacks_struct {
 };
 
 /**
- * @brief sets the thread callbacks necessary if your program is using
- * libssh in a multithreaded fashion. This function must be called first,
- * outside of any threading context (in your main() for instance), before
- * ssh_init().
+ * @brief sets the thread callbacks, if your program uses another threading
+ * library than the native one of the system. This function must be called
+ * first, outside of any threading context (in your main() for instance),
+ * before ssh_init().
  * @param cb pointer to a ssh_threads_callbacks_struct structure, which contains
  * the different callbacks to be set.
+ * @returns SSH_OK, or SSH_ERROR if libssh is already initialized with other
+ * callbacks.
  * @see ssh_threads_callbacks_struct
- * @see SSH_THREADS_PTHREAD
+ * @see ssh_threads_get_default
  */
 LIBSSH_API int ssh_threads_set_callbacks(struct ssh_threads_callbacks_struct
     *cb);
@@ -440,15 +1149,24 @@ LIBSSH_API int ssh_threads_set_callbacks(struct ssh_threads_callbacks_struct
 /**
  * @brief returns a pointer on the pthread threads callbacks, to be used with
  * ssh_threads_set_callbacks.
- * @warning you have to link with the library ssh_threads.
+ * @warning you have to link with the library ssh_threads. The callbacks are
+ * the ones of ssh_threads_get_default(), which libssh uses already.
  * @see ssh_threads_set_callbacks
  */
 LIBSSH_API struct ssh_threads_callbacks_struct *ssh_threads_get_pthread(void);
 
+/**
+ * @brief returns a pointer on the threads callbacks used by default: the
+ * pthread mutexes, or the critical sections on Windows. Without either, they
+ * are the noop callbacks.
+ * @see ssh_threads_set_callbacks
+ */
+LIBSSH_API struct ssh_threads_callbacks_struct *ssh_threads_get_default(void);
+
 /**
  * @brief returns a pointer on the noop threads callbacks, to be used with
- * ssh_threads_set_callbacks. These callbacks do nothing and are being used by
- * default.
+ * ssh_threads_set_callbacks. These callbacks do nothing, for the programs
+ * using libssh from a single thread.
  * @see ssh_threads_set_callbacks
  */
 LIBSSH_API struct ssh_threads_callbacks_struct *ssh_threads_get_noop(void);
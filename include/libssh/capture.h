@@ -0,0 +1,69 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef CAPTURE_H_
+#define CAPTURE_H_
+
+/*
+ * capture.c: the output of the commands of a batch, kept in blocks of an
+ * arena shared by its hosts, see ssh_batch_set_capture()
+ */
+
+#include "libssh/priv.h"
+
+#define CAPTURE_BLOCK_SIZE 4096
+/* the free blocks an arena keeps for the next captures */
+#define CAPTURE_ARENA_FREE_MAX 256
+
+struct capture_block {
+  struct capture_block *next;
+  size_t len;
+  unsigned char data[CAPTURE_BLOCK_SIZE];
+};
+
+struct capture_arena {
+  struct capture_block *free;
+  unsigned int nfree;
+  /* a line split between blocks, made whole for the callback */
+  ssh_buffer line;
+};
+
+struct capture {
+  struct capture_block *head;
+  struct capture_block *tail;
+  size_t head_offset; /* the start of the head dropped by a tail */
+  size_t len; /* kept */
+  uint64_t dropped; /* over the limit */
+};
+
+typedef void (*capture_line_callback)(const void *line, size_t len,
+    void *userdata);
+
+void capture_arena_free(struct capture_arena *arena);
+int capture_append(struct capture_arena *arena, struct capture *c,
+    const void *data, size_t len, size_t limit, int tail);
+int capture_lines(struct capture_arena *arena, struct capture *c,
+    const void *data, size_t len, size_t limit, capture_line_callback cb,
+    void *userdata);
+int capture_lines_flush(struct capture_arena *arena, struct capture *c,
+    capture_line_callback cb, void *userdata);
+size_t capture_copy(const struct capture *c, void *dest);
+void capture_clear(struct capture_arena *arena, struct capture *c);
+
+#endif /* CAPTURE_H_ */
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * chachapoly.h is the chacha20-poly1305@openssh.com cipher. It doesn't
+ * depend on the crypto backend and is used by both cipher tables.
+ */
+
+#ifndef CHACHAPOLY_H_
+#define CHACHAPOLY_H_
+
+#include "libssh/crypto.h"
+
+#define CHACHA20_KEYLEN 32
+#define CHACHA20_BLOCKSIZE 64
+#define POLY1305_KEYLEN 32
+#define POLY1305_TAGLEN 16
+
+struct chacha_ctx {
+  uint32_t input[16];
+};
+
+void chacha_keysetup(struct chacha_ctx *ctx, const uint8_t *key);
+void chacha_ivsetup(struct chacha_ctx *ctx, const uint8_t *iv,
+    const uint8_t *counter);
+void chacha_encrypt_bytes(struct chacha_ctx *ctx, const uint8_t *m,
+    uint8_t *c, uint32_t bytes);
+void poly1305_auth(uint8_t out[POLY1305_TAGLEN], const uint8_t *m,
+    size_t inlen, const uint8_t key[POLY1305_KEYLEN]);
+
+int chachapoly_set_key(struct crypto_struct *cipher, void *key, void *IV);
+void chachapoly_encrypt(struct crypto_struct *cipher, void *in, void *out,
+    unsigned long len, unsigned char *tag, uint32_t seq);
+int chachapoly_decrypt_length(struct crypto_struct *cipher, void *in,
+    unsigned char *out, unsigned long len, uint32_t seq);
+int chachapoly_decrypt(struct crypto_struct *cipher, void *complete_packet,
+    unsigned char *out, unsigned long len, const unsigned char *tag,
+    uint32_t seq);
+void chachapoly_cleanup(struct crypto_struct *cipher);
+int chachapoly_copy(struct crypto_struct *cipher, struct crypto_struct *copy);
+
+#endif /* CHACHAPOLY_H_ */
+/* vim: set ts=2 sw=2 et cindent: */
@@ -22,11 +22,15 @@
 #ifndef CHANNELS_H_
 #define CHANNELS_H_
 #include "libssh/priv.h"
+#include "libssh/poll.h"
+#include "libssh/packet.h"
 
 /**  @internal
  * Describes the different possible states in a
  * outgoing (client) channel request
  */
+#define FIRST_CHANNEL 42 // why not ? it helps to find bugs.
+
 enum ssh_channel_request_state_e {
 	/** No request has been made */
 	SSH_CHANNEL_REQ_STATE_NONE = 0,
@@ -42,34 +46,63 @@ enum ssh_channel_request_state_e {
 
 enum ssh_channel_state_e {
   SSH_CHANNEL_STATE_NOT_OPEN = 0,
+  /** The open is sent, the answer is pending */
+  SSH_CHANNEL_STATE_OPENING,
   SSH_CHANNEL_STATE_OPEN_DENIED,
   SSH_CHANNEL_STATE_OPEN,
   SSH_CHANNEL_STATE_CLOSED
 };
 
 struct ssh_channel_struct {
-    struct ssh_channel_struct *prev;
-    struct ssh_channel_struct *next;
+    /*
+     * What the data and the window adjusts use first, then the scheduler,
+     * then what the requests and the statistics seldom touch.
+     */
     ssh_session session; /* SSH_SESSION pointer */
     uint32_t local_channel;
-    uint32_t local_window;
-    int local_eof;
-    uint32_t local_maxpacket;
-
     uint32_t remote_channel;
+    uint32_t local_window;
     uint32_t remote_window;
-    int remote_eof; /* end of file received */
+    uint32_t local_maxpacket;
     uint32_t remote_maxpacket;
     enum ssh_channel_state_e state;
-    int delayed_close;
+    int version;
+    int local_eof;
+    int remote_eof; /* end of file received */
+    int remote_close; /* close received, the peer is done with the id */
+    int unbuffered; /* see ssh_channel_set_unbuffered() */
+    uint32_t window_held; /* data unbuffered and not consumed yet */
+    uint32_t window_size; /* local window granted when it's grown */
+    int window_threshold; /* percentage of window_size kept to the peer */
+    int window_coalesce; /* adjusts are sent by ssh_channels_flush_windows() */
+    uint32_t window_pending; /* coalesced window, 0 if none */
+    uint64_t window_drain_ts; /* start of the drain rate measurement */
+    uint64_t window_drain_bytes; /* window given back since then */
     ssh_buffer stdout_buffer;
     ssh_buffer stderr_buffer;
+    ssh_channel_callbacks callbacks;
+    struct ssh_channel_stats_struct stats; /* see ssh_channel_get_stats() */
+
+    struct ssh_channel_struct *prev;
+    struct ssh_channel_struct *next;
+    ssh_buffer stdout_queue; /* data waiting for the scheduler */
+    ssh_buffer stderr_queue;
+    enum ssh_channel_priority_e priority; /* see ssh_channel_set_priority() */
+    int compress_skip; /* see ssh_channel_set_compression() */
+    int32_t sched_deficit; /* bytes left to the channel in the round */
+
+    uint32_t window_max; /* bound of the auto-tuned window, 0 if fixed */
+    uint32_t window_rtt; /* smoothed round trip time of the adjusts (ms) */
+    uint64_t window_adjust_ts; /* adjust sent while the peer was stalled */
+    uint32_t window_adjust_credit; /* window left to the peer at that time */
+    uint64_t open_ts; /* open request sent, for the latency */
+    struct ssh_channel_fd_struct *fd_bind; /* see ssh_channel_bind_fd() */
+    int delayed_close;
     void *userarg;
-    int version;
     int blocking;
     int exit_status;
     enum ssh_channel_request_state_e request_state;
-    ssh_channel_callbacks callbacks;
+    int request_async; /* the request returned SSH_AGAIN */
 };
 
 SSH_PACKET_CALLBACK(ssh_packet_channel_open_conf);
@@ -88,10 +121,75 @@ SSH_PACKET_CALLBACK(channel_rcv_data);
 ssh_channel ssh_channel_new(ssh_session session);
 int channel_default_bufferize(ssh_channel channel, void *data, int len,
         int is_stderr);
-uint32_t ssh_channel_new_id(ssh_session session);
+uint32_t ssh_channel_new_id(ssh_session session, ssh_channel channel);
 ssh_channel ssh_channel_from_local(ssh_session session, uint32_t id);
 int channel_write_common(ssh_channel channel, const void *data,
     uint32_t len, int is_stderr);
+int channel_write_fill(ssh_channel channel, const void *prefix,
+    uint32_t prefix_len, uint32_t len, packet_fill_callback fill,
+    void *userdata);
+uint32_t ssh_channels_get_buffered(ssh_session session);
+void ssh_channels_dead(ssh_session session);
+int ssh_channels_flush_windows(ssh_session session);
+uint32_t channel_write_window(ssh_channel channel);
+uint32_t channel_maxpacket_out(ssh_channel channel);
+void channel_compression_check(ssh_channel channel, const char *name);
+/* takes data in place, returns how much it took or -1 */
+typedef int (*channel_read_callback)(const void *data, uint32_t len,
+    void *userdata);
+int channel_read_in_place(ssh_channel channel, uint32_t count, int is_stderr,
+    int timeout, channel_read_callback read, void *userdata);
+int ssh_channels_schedule(ssh_session session);
+void ssh_channels_writable(ssh_session session, ssh_channel channel);
+
+/* channelfd.c */
+void ssh_channel_fd_window(ssh_channel channel);
+/* called once the forwarding of the channel stopped */
+typedef void (*channel_fd_done_callback)(ssh_channel channel, void *userdata);
+void ssh_channel_fd_set_done(ssh_channel channel, channel_fd_done_callback done,
+    void *userdata);
+
+/*
+ * A socket forwarded through a channel, e.g. by a SOCKS proxy or a remote
+ * forwarding, which embed it first in their own connections.
+ */
+struct channel_fd_conn {
+  struct channel_fd_conns *conns;
+  socket_t fd;
+  /* before the forwarding, ssh_channel_bind_fd() polls it afterwards */
+  ssh_poll_handle poll;
+  ssh_channel channel;
+  struct ssh_channel_callbacks_struct callbacks;
+  int closing; /* the socket is closed, the channel not yet */
+  int done; /* waiting to be freed */
+  struct channel_fd_conn *prev;
+  struct channel_fd_conn *next;
+};
+
+struct channel_fd_conns {
+  ssh_session session;
+  /* frees the connections which are done, out of their callbacks */
+  ssh_timer reaper;
+  struct channel_fd_conn *conns;
+  struct channel_fd_conn *done;
+  int count; /* the connections not closed */
+  /* called when a connection is done, optional */
+  void (*conn_done)(struct channel_fd_conn *conn);
+  /* frees what embeds the connection */
+  void (*conn_free)(struct channel_fd_conn *conn);
+};
+
+int channel_fd_conns_init(struct channel_fd_conns *conns, ssh_session session);
+void channel_fd_conns_free(struct channel_fd_conns *conns);
+void channel_fd_conn_add(struct channel_fd_conns *conns,
+    struct channel_fd_conn *conn, socket_t fd);
+int channel_fd_conn_poll(struct channel_fd_conn *conn, short events,
+    ssh_poll_callback cb);
+void channel_fd_conn_stop_poll(struct channel_fd_conn *conn);
+void channel_fd_conn_set_channel(struct channel_fd_conn *conn,
+    ssh_channel channel);
+int channel_fd_conn_forward(struct channel_fd_conn *conn);
+void channel_fd_conn_close(struct channel_fd_conn *conn);
 #ifdef WITH_SSH1
 SSH_PACKET_CALLBACK(ssh_packet_data1);
 SSH_PACKET_CALLBACK(ssh_packet_close1);
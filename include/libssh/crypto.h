@@ -32,6 +32,7 @@
 #include <gcrypt.h>
 #endif
 #include "libssh/wrapper.h"
+#include "libssh/curve25519.h"
 
 #ifdef cbc_encrypt
 #undef cbc_encrypt
@@ -40,28 +41,68 @@
 #undef cbc_decrypt
 #endif
 
+/* the packets of a batch are shared by up to this many threads */
+#define CRYPTO_COPIES 8
+
+enum ssh_key_exchange_e {
+    /* diffie-hellman-group1-sha1 */
+    SSH_KEX_DH_GROUP1_SHA1 = 0,
+    /* ecdh-sha2-nistp256 */
+    SSH_KEX_ECDH_SHA2_NISTP256,
+    /* curve25519-sha256, curve25519-sha256@libssh.org */
+    SSH_KEX_CURVE25519_SHA256
+};
+
 struct ssh_crypto_struct {
     bignum e,f,x,k,y;
-    unsigned char session_id[SHA_DIGEST_LEN];
+    enum ssh_key_exchange_e kex_type;
+    /* the ECDH public values Q_C and Q_S, in their wire encoding */
+    ssh_string ecdh_client_pubkey;
+    ssh_string ecdh_server_pubkey;
+#ifdef HAVE_ECDH
+    EC_KEY *ecdh_privkey;
+#endif
+    unsigned char curve25519_privkey[CURVE25519_PRIVKEY_SIZE];
+    /* length of the exchange hash, which depends on the key exchange */
+    unsigned int digest_len;
+    /* H, the exchange hash of this key exchange */
+    unsigned char secret_hash[SHA256_DIGEST_LEN];
+    /* the H of the first key exchange, kept by the key re-exchanges */
+    unsigned char session_id[SHA256_DIGEST_LEN];
+    unsigned int session_id_len;
 
     unsigned char encryptIV[SHA_DIGEST_LEN*2];
     unsigned char decryptIV[SHA_DIGEST_LEN*2];
 
-    unsigned char decryptkey[SHA_DIGEST_LEN*2];
-    unsigned char encryptkey[SHA_DIGEST_LEN*2];
+    /* chacha20-poly1305 needs 512 bits of key */
+    unsigned char decryptkey[SHA_DIGEST_LEN*4];
+    unsigned char encryptkey[SHA_DIGEST_LEN*4];
 
-    unsigned char encryptMAC[SHA_DIGEST_LEN];
-    unsigned char decryptMAC[SHA_DIGEST_LEN];
+    /* hmac-sha2-512 needs 512 bits of key */
+    unsigned char encryptMAC[SHA_DIGEST_LEN*4];
+    unsigned char decryptMAC[SHA_DIGEST_LEN*4];
     unsigned char hmacbuf[EVP_MAX_MD_SIZE];
+    struct ssh_hmac_struct *in_mac, *out_mac; /* the negotiated MACs */
+    HMACCTX in_hmac, out_hmac; /* keyed once by crypt_set_keys() */
     struct crypto_struct *in_cipher, *out_cipher; /* the cipher structures/objects */
     ssh_string server_pubkey;
     const char *server_pubkey_type;
+    unsigned char server_pubkey_md5[MD5_DIGEST_LEN]; /* by ssh_get_pubkey_hash() */
+    int server_pubkey_md5_set;
     int do_compress_out; /* idem */
     int do_compress_in; /* don't set them, set the option instead */
     int delayed_compress_in; /* Use of zlib@openssh.org */
     int delayed_compress_out;
     void *compress_out_ctx; /* don't touch it */
     void *compress_in_ctx; /* really, don't */
+    int compress_level; /* adaptive level, 0 while the data doesn't shrink */
+    int compress_stream_level; /* level set in the output stream */
+    uint32_t compress_packets; /* sent since the last change of level */
+    uint64_t compress_window_in; /* bytes given and produced by deflate */
+    uint64_t compress_window_out; /* since the last change of level */
+    /* copies of the AEAD ciphers for the workers of a crypto pool */
+    struct crypto_struct *out_copies[CRYPTO_COPIES];
+    struct crypto_struct *in_copies[CRYPTO_COPIES];
 };
 
 struct crypto_struct {
@@ -74,6 +115,7 @@ struct crypto_struct {
     void *key; /* a key buffer allocated for the algo */
 #endif
     unsigned int keysize; /* bytes of key used. != keylen */
+    /* in and out of cbc_encrypt/cbc_decrypt may point to the same buffer */
 #ifdef HAVE_LIBGCRYPT
     /* sets the new key for immediate use */
     int (*set_encrypt_key)(struct crypto_struct *cipher, void *key, void *IV);
@@ -91,6 +133,39 @@ struct crypto_struct {
     void (*cbc_decrypt)(struct crypto_struct *cipher, void *in, void *out,
         unsigned long len, void *IV);
 #endif
+    /*
+     * AEAD ciphers (aes-gcm, chacha20-poly1305) authenticate the packets
+     * themselves instead of using the negotiated MAC. tag_size is the size
+     * of their tag, 0 for the other ciphers. The packet length field is
+     * not part of the padded data and is authenticated with the packet.
+     */
+    unsigned int tag_size;
+    int (*aead_set_key)(struct crypto_struct *cipher, void *key, void *IV);
+    /* encrypts len bytes of a complete packet, length field included */
+    void (*aead_encrypt)(struct crypto_struct *cipher, void *in, void *out,
+        unsigned long len, unsigned char *tag, uint32_t seq);
+    int (*aead_decrypt_length)(struct crypto_struct *cipher, void *in,
+        unsigned char *out, unsigned long len, uint32_t seq);
+    /* verifies the tag and decrypts the len bytes following the length */
+    int (*aead_decrypt)(struct crypto_struct *cipher, void *complete_packet,
+        unsigned char *out, unsigned long len, const unsigned char *tag,
+        uint32_t seq);
+    /* frees the key when it isn't a plain buffer of keylen bytes */
+    void (*cleanup)(struct crypto_struct *cipher);
+    /*
+     * sets up in copy (a copy of the structure, without key) an AEAD
+     * cipher which gives the same results for the same sequence numbers,
+     * for the crypto pool. NULL for the ciphers whose packets depend on the
+     * previous ones; it may fail until the cipher processed a packet.
+     */
+    int (*aead_copy)(struct crypto_struct *cipher, struct crypto_struct *copy);
+};
+
+struct ssh_hmac_struct {
+    const char *name; /* ssh name of the algorithm */
+    int type; /* HMAC_SHA1, HMAC_SHA256 or HMAC_SHA512 */
+    unsigned int size; /* length of the digest, and of the key */
+    int etm; /* encrypt-then-mac: the MAC covers the encrypted packet */
 };
 
 /* vim: set ts=2 sw=2 et cindent: */
@@ -0,0 +1,56 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * curve25519.h is the curve25519-sha256 key exchange. Like the
+ * chacha20-poly1305 cipher, the X25519 function doesn't depend on the
+ * crypto backend.
+ */
+
+#ifndef CURVE25519_H_
+#define CURVE25519_H_
+
+#include "libssh/libssh.h"
+
+#define CURVE25519_PUBKEY_SIZE 32
+#define CURVE25519_PRIVKEY_SIZE 32
+
+/* arithmetic modulo 2^255 - 19, also used by ed25519.c */
+typedef int64_t fe25519[16];
+
+void car25519(fe25519 o);
+void sel25519(fe25519 p, fe25519 q, int b);
+void pack25519(uint8_t *o, const fe25519 n);
+void unpack25519(fe25519 o, const uint8_t *n);
+void add25519(fe25519 o, const fe25519 a, const fe25519 b);
+void sub25519(fe25519 o, const fe25519 a, const fe25519 b);
+void mul25519(fe25519 o, const fe25519 a, const fe25519 b);
+void inv25519(fe25519 o, const fe25519 i);
+
+/* q = n * p, as in RFC 7748. All of them are 32 bytes, little endian */
+void crypto_scalarmult_curve25519(uint8_t *q, const uint8_t *n,
+    const uint8_t *p);
+void crypto_scalarmult_curve25519_base(uint8_t *q, const uint8_t *n);
+
+int ssh_client_curve25519_init(ssh_session session);
+int ssh_server_curve25519_init(ssh_session session);
+int curve25519_build_k(ssh_session session);
+
+#endif /* CURVE25519_H_ */
+/* vim: set ts=2 sw=2 et cindent: */
@@ -31,9 +31,11 @@ int dh_generate_e(ssh_session session);
 int dh_generate_f(ssh_session session);
 int dh_generate_x(ssh_session session);
 int dh_generate_y(ssh_session session);
+int dh_generate_keypair(bignum *y, bignum *f);
 
 int ssh_crypto_init(void);
 void ssh_crypto_finalize(void);
+void ssh_crypto_reseed(void);
 
 ssh_string dh_get_e(ssh_session session);
 ssh_string dh_get_f(ssh_session session);
@@ -0,0 +1,45 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * ed25519.h is the ssh-ed25519 signature algorithm of RFC 8709. Like the
+ * curve25519-sha256 key exchange it doesn't depend on the crypto backend,
+ * only on its SHA512.
+ */
+
+#ifndef ED25519_H_
+#define ED25519_H_
+
+#include "libssh/libssh.h"
+
+#define ED25519_PUBKEY_SIZE 32
+/* the 32 bytes seed followed by the public key, as stored by OpenSSH */
+#define ED25519_PRIVKEY_SIZE 64
+#define ED25519_SIG_SIZE 64
+
+int crypto_sign_ed25519_seed_keypair(uint8_t *pk, uint8_t *sk,
+    const uint8_t *seed);
+int crypto_sign_ed25519_detached(uint8_t *sig, const uint8_t *m,
+    size_t mlen, const uint8_t *sk);
+/* returns 0 if the signature is valid, -1 otherwise */
+int crypto_sign_ed25519_verify_detached(const uint8_t *sig, const uint8_t *m,
+    size_t mlen, const uint8_t *pk);
+
+#endif /* ED25519_H_ */
+/* vim: set ts=2 sw=2 et cindent: */
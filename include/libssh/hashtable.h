@@ -0,0 +1,63 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef HASHTABLE_H_
+#define HASHTABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * hashtable.c: maps integer keys (fds, ids, pointers) to data. Several
+ * entries may share a key.
+ */
+
+struct ssh_hashtable_entry {
+  uint64_t key;
+  void *data;
+  struct ssh_hashtable_entry *next;
+};
+
+struct ssh_hashtable {
+  struct ssh_hashtable_entry **buckets;
+  size_t size;
+  size_t count;
+};
+
+#define ssh_hashtable_ptr_key(ptr) ((uint64_t) (uintptr_t) (ptr))
+
+struct ssh_hashtable *ssh_hashtable_new(void);
+void ssh_hashtable_free(struct ssh_hashtable *table);
+int ssh_hashtable_insert(struct ssh_hashtable *table, uint64_t key,
+    void *data);
+int ssh_hashtable_remove(struct ssh_hashtable *table, uint64_t key,
+    const void *data);
+struct ssh_hashtable_entry *ssh_hashtable_find(
+    const struct ssh_hashtable *table, uint64_t key);
+struct ssh_hashtable_entry *ssh_hashtable_find_next(
+    const struct ssh_hashtable_entry *entry);
+void *ssh_hashtable_lookup(const struct ssh_hashtable *table, uint64_t key);
+struct ssh_hashtable_entry *ssh_hashtable_first(
+    const struct ssh_hashtable *table);
+struct ssh_hashtable_entry *ssh_hashtable_next(
+    const struct ssh_hashtable *table,
+    const struct ssh_hashtable_entry *entry);
+
+#endif /* HASHTABLE_H_ */
+/* vim: set ts=2 sw=2 et cindent: */
@@ -0,0 +1,60 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+/* histogram.c: latency histograms of the sessions and of the process */
+
+/*
+ * 8 buckets for each power of two, so a value is known within 12.5%, from
+ * 1 microsecond to 2^36 (19 hours).
+ */
+#define SSH_HISTOGRAM_SUB_BITS 3
+#define SSH_HISTOGRAM_BUCKETS 272
+
+/* enum ssh_latency_e */
+#define SSH_LATENCY_PHASES 5
+/* the sftp request types (SSH_FXP_*), SSH_FXP_EXTENDED counted as 0 */
+#define SSH_LATENCY_SFTP_TYPES 21
+
+struct ssh_histogram_struct {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint32_t buckets[SSH_HISTOGRAM_BUCKETS];
+};
+
+struct ssh_latency_struct;
+
+void ssh_histogram_record(struct ssh_histogram_struct *h, uint64_t value);
+void ssh_histogram_get(const struct ssh_histogram_struct *h,
+    struct ssh_latency_struct *latency);
+
+void ssh_latency_record(ssh_session session, int phase, uint64_t us);
+void ssh_latency_phase(ssh_session session, int phase);
+void ssh_latency_sftp_record(struct ssh_histogram_struct **histograms,
+    uint8_t type, uint64_t us);
+int ssh_latency_sftp_get(struct ssh_histogram_struct **histograms,
+    uint8_t type, struct ssh_latency_struct *latency);
+void ssh_latency_free(struct ssh_histogram_struct **histograms, int count);
+void ssh_latency_finalize(void);
+
+#endif /* HISTOGRAM_H_ */
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef HOSTKEY_H_
+#define HOSTKEY_H_
+
+/* hostkey.c: host keys of a server shared by the bind and its sessions */
+
+#include "libssh/libssh.h"
+
+/* the host keys are indexed by their ssh_keytypes_e */
+#define SSH_HOSTKEY_TYPES (SSH_KEYTYPE_ED25519 + 1)
+
+struct ssh_hostkey_struct {
+  unsigned int refs;
+  ssh_private_key key;
+  /* the public key as sent in SSH_MSG_KEXDH_REPLY */
+  ssh_string blob;
+};
+
+/* takes the private key, NULL on error */
+struct ssh_hostkey_struct *ssh_hostkey_new(ssh_private_key key);
+/* returns a new reference to the key of the slot, which may be NULL */
+struct ssh_hostkey_struct *ssh_hostkey_get(struct ssh_hostkey_struct **slot);
+/* puts the key in the slot and releases the one it replaces */
+void ssh_hostkey_set(struct ssh_hostkey_struct **slot,
+    struct ssh_hostkey_struct *key);
+/* releases a reference */
+void ssh_hostkey_free(struct ssh_hostkey_struct *key);
+void ssh_hostkey_finalize(void);
+
+#endif /* HOSTKEY_H_ */
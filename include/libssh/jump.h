@@ -0,0 +1,32 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef JUMP_H_
+#define JUMP_H_
+
+/* jump.c: the sessions connected through a bastion, see ssh_set_proxy_jump() */
+
+#include "libssh/priv.h"
+
+/* the bastions a session goes through at most, the nested ones included */
+#define SSH_JUMP_HOPS_MAX 8
+
+void ssh_jump_free(ssh_session session);
+
+#endif /* JUMP_H_ */
@@ -0,0 +1,37 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef KEXPOOL_H_
+#define KEXPOOL_H_
+
+/* kexpool.c: ephemeral keys of the server computed in advance */
+
+#include "libssh/crypto.h"
+
+/* they return 0 and give away a key, -1 if the pool is empty */
+int ssh_kex_pool_take_dh(bignum *y, bignum *f);
+int ssh_kex_pool_take_curve25519(unsigned char *privkey,
+    unsigned char *pubkey);
+#ifdef HAVE_ECDH
+EC_KEY *ssh_kex_pool_take_ecdh(void);
+#endif
+void ssh_kex_pool_drop(void);
+void ssh_kex_pool_finalize(void);
+
+#endif /* KEXPOOL_H_ */
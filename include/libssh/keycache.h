@@ -0,0 +1,41 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef KEYCACHE_H_
+#define KEYCACHE_H_
+
+/* keycache.c: private keys parsed once for all the sessions */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "libssh/libssh.h"
+
+/*
+ * Returns a copy of the cached key of the file, NULL if it isn't cached.
+ * st receives the state of the file, given back to ssh_key_cache_put().
+ */
+ssh_private_key ssh_key_cache_get(const char *filename, int type,
+    struct stat *st);
+/* caches a copy of the key read from the file */
+void ssh_key_cache_put(const char *filename, const struct stat *st,
+    ssh_private_key key);
+void ssh_key_cache_finalize(void);
+
+#endif /* KEYCACHE_H_ */
@@ -25,6 +25,7 @@
 #include "config.h"
 #include "libssh/libssh.h"
 #include "libssh/wrapper.h"
+#include "libssh/ed25519.h"
 
 struct ssh_public_key_struct {
     int type;
@@ -36,6 +37,12 @@ struct ssh_public_key_struct {
     DSA *dsa_pub;
     RSA *rsa_pub;
 #endif
+#ifdef HAVE_ECDSA
+    EC_KEY *ecdsa_pub;
+#endif
+    unsigned char ed25519_pub[ED25519_PUBKEY_SIZE];
+    /* the wire format, kept by publickey_to_string() */
+    ssh_string blob;
 };
 
 struct ssh_private_key_struct {
@@ -47,6 +54,10 @@ struct ssh_private_key_struct {
     DSA *dsa_priv;
     RSA *rsa_priv;
 #endif
+#ifdef HAVE_ECDSA
+    EC_KEY *ecdsa_priv;
+#endif
+    unsigned char ed25519_priv[ED25519_PRIVKEY_SIZE];
 };
 
 typedef struct signature_struct {
@@ -58,6 +69,10 @@ typedef struct signature_struct {
     DSA_SIG *dsa_sign;
     ssh_string rsa_sign;
 #endif
+#ifdef HAVE_ECDSA
+    ECDSA_SIG *ecdsa_sign;
+#endif
+    unsigned char ed25519_sign[ED25519_SIG_SIZE];
 } SIGNATURE;
 
 const char *ssh_type_to_char(int type);
@@ -71,6 +86,8 @@ ssh_private_key privatekey_from_string(ssh_session session, ssh_string privkey_s
 
 ssh_public_key publickey_make_dss(ssh_session session, ssh_buffer buffer);
 ssh_public_key publickey_make_rsa(ssh_session session, ssh_buffer buffer, int type);
+ssh_public_key publickey_make_ecdsa(ssh_session session, ssh_buffer buffer);
+ssh_public_key publickey_make_ed25519(ssh_session session, ssh_buffer buffer);
 ssh_public_key publickey_from_string(ssh_session session, ssh_string pubkey_s);
 SIGNATURE *signature_from_string(ssh_session session, ssh_string signature,ssh_public_key pubkey,int needed_type);
 void signature_free(SIGNATURE *sign);
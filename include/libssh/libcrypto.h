@@ -32,10 +32,14 @@
 #include <openssl/md5.h>
 #include <openssl/hmac.h>
 typedef SHA_CTX* SHACTX;
+typedef SHA256_CTX* SHA256CTX;
+typedef SHA512_CTX* SHA512CTX;
 typedef MD5_CTX*  MD5CTX;
 typedef HMAC_CTX* HMACCTX;
 
 #define SHA_DIGEST_LEN SHA_DIGEST_LENGTH
+#define SHA256_DIGEST_LEN SHA256_DIGEST_LENGTH
+#define SHA512_DIGEST_LEN SHA512_DIGEST_LENGTH
 #ifdef MD5_DIGEST_LEN
     #undef MD5_DIGEST_LEN
 #endif
@@ -47,6 +51,23 @@ typedef HMAC_CTX* HMACCTX;
 #if (OPENSSL_VERSION_NUMBER <= OPENSSL_0_9_7b)
 #define BROKEN_AES_CTR
 #endif
+#define OPENSSL_1_0_1 0x10001000L
+#if (OPENSSL_VERSION_NUMBER >= OPENSSL_1_0_1)
+/* GCM mode of the EVP interface, with AES-NI and PCLMUL where available */
+#define HAS_AES_GCM
+/* and the CTR mode */
+#define HAS_EVP_AES_CTR
+#endif
+#ifdef HAVE_OPENSSL_ECDH_H
+#define HAVE_ECDH
+#include <openssl/ec.h>
+#include <openssl/ecdh.h>
+#endif
+#ifdef HAVE_OPENSSL_ECDSA_H
+#define HAVE_ECDSA
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#endif
 typedef BIGNUM*  bignum;
 typedef BN_CTX* bignum_CTX;
 
@@ -28,11 +28,19 @@
 
 #include <gcrypt.h>
 typedef gcry_md_hd_t SHACTX;
+typedef gcry_md_hd_t SHA256CTX;
+typedef gcry_md_hd_t SHA512CTX;
 typedef gcry_md_hd_t MD5CTX;
 typedef gcry_md_hd_t HMACCTX;
 #define SHA_DIGEST_LEN 20
+#define SHA256_DIGEST_LEN 32
+#define SHA512_DIGEST_LEN 64
 #define MD5_DIGEST_LEN 16
-#define EVP_MAX_MD_SIZE 36
+#define EVP_MAX_MD_SIZE 64
+
+#if (GCRYPT_VERSION_NUMBER >= 0x010600)
+#define HAS_AES_GCM
+#endif
 
 typedef gcry_mpi_t bignum;
 
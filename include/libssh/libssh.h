@@ -109,15 +109,24 @@ extern "C" {
 typedef struct ssh_agent_struct* ssh_agent;
 typedef struct ssh_buffer_struct* ssh_buffer;
 typedef struct ssh_channel_struct* ssh_channel;
+typedef struct ssh_channel_set_struct* ssh_channel_set;
 typedef struct ssh_message_struct* ssh_message;
 typedef struct ssh_pcap_file_struct* ssh_pcap_file;
 typedef struct ssh_private_key_struct* ssh_private_key;
 typedef struct ssh_public_key_struct* ssh_public_key;
 typedef struct ssh_key_struct* ssh_key;
+typedef struct ssh_log_entry_struct* ssh_log_entry;
 typedef struct ssh_scp_struct* ssh_scp;
 typedef struct ssh_session_struct* ssh_session;
 typedef struct ssh_string_struct* ssh_string;
 typedef struct ssh_event_struct* ssh_event;
+typedef struct ssh_timer_struct* ssh_timer;
+typedef struct ssh_mux_struct* ssh_mux;
+typedef struct ssh_batch_struct* ssh_batch;
+typedef struct ssh_socks_struct* ssh_socks;
+typedef struct ssh_forward_remote_struct* ssh_forward_remote;
+typedef struct ssh_options_template_struct* ssh_options_template;
+typedef struct ssh_crypto_pool_struct* ssh_crypto_pool;
 
 /* Socket type */
 #ifdef _WIN32
@@ -192,13 +201,15 @@ enum ssh_channel_requests_e {
 	SSH_CHANNEL_REQUEST_SHELL,
 	SSH_CHANNEL_REQUEST_ENV,
 	SSH_CHANNEL_REQUEST_SUBSYSTEM,
-	SSH_CHANNEL_REQUEST_WINDOW_CHANGE
+	SSH_CHANNEL_REQUEST_WINDOW_CHANGE,
+	SSH_CHANNEL_REQUEST_X11
 };
 
 enum ssh_global_requests_e {
 	SSH_GLOBAL_REQUEST_UNKNOWN=0,
 	SSH_GLOBAL_REQUEST_TCPIP_FORWARD,
 	SSH_GLOBAL_REQUEST_CANCEL_TCPIP_FORWARD,
+	SSH_GLOBAL_REQUEST_KEEPALIVE
 };
 
 enum ssh_publickey_state_e {
@@ -239,7 +250,9 @@ enum ssh_keytypes_e{
   SSH_KEYTYPE_UNKNOWN=0,
   SSH_KEYTYPE_DSS=1,
   SSH_KEYTYPE_RSA,
-  SSH_KEYTYPE_RSA1
+  SSH_KEYTYPE_RSA1,
+  SSH_KEYTYPE_ECDSA,
+  SSH_KEYTYPE_ED25519
 };
 
 /* Error return codes */
@@ -274,6 +287,30 @@ enum {
 	 */
 	SSH_LOG_FUNCTIONS
 };
+
+/**
+ * @brief Events of the entries of the log ring
+ */
+enum ssh_log_events_e {
+	/** A message given to ssh_log()
+	 */
+	SSH_LOG_EVENT_MESSAGE=0,
+	/** Entries dropped while the ring was full: count
+	 */
+	SSH_LOG_EVENT_DROPPED,
+	/** A packet read: type, length, padding
+	 */
+	SSH_LOG_EVENT_PACKET_READ,
+	/** A packet written: length, padding, size
+	 */
+	SSH_LOG_EVENT_PACKET_WRITE,
+	/** A packet encrypted: seq, length
+	 */
+	SSH_LOG_EVENT_PACKET_ENCRYPT,
+	/** Data received on a channel: channel, length, stderr, window
+	 */
+	SSH_LOG_EVENT_CHANNEL_DATA
+};
 /** @} */
 
 enum ssh_options_e {
@@ -300,7 +337,52 @@ enum ssh_options_e {
   SSH_OPTIONS_BINDADDR,
   SSH_OPTIONS_STRICTHOSTKEYCHECK,
   SSH_OPTIONS_COMPRESSION,
-  SSH_OPTIONS_COMPRESSION_LEVEL
+  SSH_OPTIONS_COMPRESSION_LEVEL,
+  SSH_OPTIONS_READ_SIZE_MAX,
+  SSH_OPTIONS_CHANNEL_BUFFER_SOFT_LIMIT,
+  SSH_OPTIONS_CHANNEL_BUFFER_HARD_LIMIT,
+  SSH_OPTIONS_SESSION_BUFFER_SOFT_LIMIT,
+  SSH_OPTIONS_SESSION_BUFFER_HARD_LIMIT,
+  SSH_OPTIONS_TCP_PROFILE,
+  SSH_OPTIONS_TCP_NODELAY,
+  SSH_OPTIONS_TCP_SNDBUF,
+  SSH_OPTIONS_TCP_RCVBUF,
+  SSH_OPTIONS_TCP_KEEPALIVE,
+  SSH_OPTIONS_TCP_NOTSENT_LOWAT,
+  SSH_OPTIONS_CHANNEL_WINDOW,
+  SSH_OPTIONS_CHANNEL_WINDOW_MAX,
+  SSH_OPTIONS_CHANNEL_MAXPACKET,
+  SSH_OPTIONS_CHANNEL_WINDOW_THRESHOLD,
+  SSH_OPTIONS_CHANNEL_WINDOW_COALESCE,
+  SSH_OPTIONS_CHANNEL_SCHEDULER,
+  SSH_OPTIONS_REKEY_DATA,
+  SSH_OPTIONS_REKEY_TIME,
+  SSH_OPTIONS_KEX_GUESS,
+  SSH_OPTIONS_COMPRESSION_STRATEGY,
+  SSH_OPTIONS_COMPRESSION_ADAPTIVE,
+  SSH_OPTIONS_COMPRESSION_SKIP,
+  SSH_OPTIONS_KEEPALIVE_INTERVAL,
+  SSH_OPTIONS_KEEPALIVE_MAX,
+  SSH_OPTIONS_KEY_EXCHANGE,
+  SSH_OPTIONS_HOSTKEYS
+};
+
+enum ssh_tcp_profile_e {
+  SSH_TCP_PROFILE_DEFAULT,
+  SSH_TCP_PROFILE_INTERACTIVE,
+  SSH_TCP_PROFILE_BULK
+};
+
+enum ssh_compression_strategy_e {
+  SSH_COMPRESSION_STRATEGY_DEFAULT,
+  SSH_COMPRESSION_STRATEGY_FILTERED,
+  SSH_COMPRESSION_STRATEGY_RLE
+};
+
+enum ssh_channel_priority_e {
+  SSH_CHANNEL_PRIORITY_DEFAULT,
+  SSH_CHANNEL_PRIORITY_INTERACTIVE,
+  SSH_CHANNEL_PRIORITY_BULK
 };
 
 enum {
@@ -308,7 +390,9 @@ enum {
   SSH_SCP_WRITE,
   /** Code is going to read remote files */
   SSH_SCP_READ,
-  SSH_SCP_RECURSIVE=0x10
+  SSH_SCP_RECURSIVE=0x10,
+  /** Don't wait for the acknowledgment of each file, see ssh_scp_flush() */
+  SSH_SCP_PIPELINE=0x20
 };
 
 enum ssh_scp_request_types {
@@ -324,12 +408,72 @@ enum ssh_scp_request_types {
   SSH_SCP_REQUEST_WARNING
 };
 
+/**
+ * @brief Counters of a session, see ssh_session_get_stats()
+ */
+struct ssh_session_stats_struct {
+  /** Bytes of the packets read and written, as on the wire */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  /** Packets read and written */
+  uint64_t packets_in;
+  uint64_t packets_out;
+  /** Microseconds spent encrypting, decrypting and in the MACs */
+  uint64_t crypto_us;
+  /** SSH2_MSG_CHANNEL_WINDOW_ADJUST received and sent */
+  uint64_t window_adjusts_in;
+  uint64_t window_adjusts_out;
+  /** Flushes left incomplete because the socket would block */
+  uint64_t flush_again;
+};
+
+/**
+ * @brief Phases of the connections timed by ssh_session_get_latency()
+ */
+enum ssh_latency_e {
+  SSH_LATENCY_CONNECT,
+  SSH_LATENCY_BANNER,
+  SSH_LATENCY_KEX,
+  SSH_LATENCY_AUTH,
+  SSH_LATENCY_CHANNEL_OPEN
+};
+
+/**
+ * @brief A latency distribution in microseconds, see
+ * ssh_session_get_latency()
+ */
+struct ssh_latency_struct {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t mean;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+};
+
+/**
+ * @brief Counters of a channel, see ssh_channel_get_stats()
+ */
+struct ssh_channel_stats_struct {
+  /** Bytes of data received and sent, stderr included */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  /** SSH2_MSG_CHANNEL_WINDOW_ADJUST received and sent */
+  uint64_t window_adjusts_in;
+  uint64_t window_adjusts_out;
+};
+
 LIBSSH_API ssh_channel ssh_channel_accept_x11(ssh_channel channel, int timeout_ms);
 LIBSSH_API int ssh_channel_change_pty_size(ssh_channel channel,int cols,int rows);
 LIBSSH_API int ssh_channel_close(ssh_channel channel);
 LIBSSH_API void ssh_channel_free(ssh_channel channel);
 LIBSSH_API int ssh_channel_get_exit_status(ssh_channel channel);
 LIBSSH_API ssh_session ssh_channel_get_session(ssh_channel channel);
+LIBSSH_API uint32_t ssh_channel_get_buffered(ssh_channel channel);
+LIBSSH_API int ssh_channel_get_stats(ssh_channel channel,
+    struct ssh_channel_stats_struct *stats);
 LIBSSH_API int ssh_channel_is_closed(ssh_channel channel);
 LIBSSH_API int ssh_channel_is_eof(ssh_channel channel);
 LIBSSH_API int ssh_channel_is_open(ssh_channel channel);
@@ -339,6 +483,13 @@ LIBSSH_API int ssh_channel_open_forward(ssh_channel channel, const char *remoteh
 LIBSSH_API int ssh_channel_open_session(ssh_channel channel);
 LIBSSH_API int ssh_channel_poll(ssh_channel channel, int is_stderr);
 LIBSSH_API int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_stderr);
+LIBSSH_API int ssh_channel_read_timeout(ssh_channel channel, void *dest,
+    uint32_t count, int is_stderr, int timeout);
+typedef int (*ssh_channel_read_callback)(const void *data, uint32_t len,
+    void *userdata);
+LIBSSH_API int ssh_channel_read_in_place(ssh_channel channel, uint32_t count,
+    int is_stderr, int timeout, ssh_channel_read_callback take,
+    void *userdata);
 LIBSSH_API int ssh_channel_read_nonblocking(ssh_channel channel, void *dest, uint32_t count,
     int is_stderr);
 LIBSSH_API int ssh_channel_request_env(ssh_channel channel, const char *name, const char *value);
@@ -356,6 +507,32 @@ LIBSSH_API int ssh_channel_send_eof(ssh_channel channel);
 LIBSSH_API int ssh_channel_select(ssh_channel *readchans, ssh_channel *writechans, ssh_channel *exceptchans, struct
         timeval * timeout);
 LIBSSH_API void ssh_channel_set_blocking(ssh_channel channel, int blocking);
+LIBSSH_API int ssh_channel_set_window(ssh_channel channel, uint32_t window,
+    uint32_t max);
+LIBSSH_API uint32_t ssh_channel_get_window(ssh_channel channel);
+LIBSSH_API uint32_t ssh_channel_window_size(ssh_channel channel);
+LIBSSH_API int ssh_channel_set_window_strategy(ssh_channel channel,
+    int threshold, int coalesce);
+LIBSSH_API int ssh_channel_bind_fd(ssh_channel channel, socket_t fd_in,
+    socket_t fd_out);
+LIBSSH_API int ssh_channel_unbind_fd(ssh_channel channel);
+LIBSSH_API int ssh_channel_set_priority(ssh_channel channel,
+    enum ssh_channel_priority_e priority);
+LIBSSH_API int ssh_channel_set_compression(ssh_channel channel, int enabled);
+
+/* events of ssh_channel_set_add() */
+#define SSH_CHANNEL_SET_READ 0x01
+#define SSH_CHANNEL_SET_WRITE 0x02
+#define SSH_CHANNEL_SET_EXCEPT 0x04
+
+LIBSSH_API ssh_channel_set ssh_channel_set_new(void);
+LIBSSH_API void ssh_channel_set_free(ssh_channel_set set);
+LIBSSH_API int ssh_channel_set_add(ssh_channel_set set, ssh_channel channel,
+    int events);
+LIBSSH_API int ssh_channel_set_remove(ssh_channel_set set, ssh_channel channel);
+LIBSSH_API int ssh_channel_set_select(ssh_channel_set set, int timeout);
+LIBSSH_API ssh_channel ssh_channel_set_get_ready(ssh_channel_set set, int i,
+    int *events);
 LIBSSH_API int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len);
 
 LIBSSH_API int ssh_try_publickey_from_file(ssh_session session, const char *keyfile,
@@ -372,7 +549,31 @@ LIBSSH_API int ssh_finalize(void);
 LIBSSH_API ssh_channel ssh_forward_accept(ssh_session session, int timeout_ms);
 LIBSSH_API int ssh_forward_cancel(ssh_session session, const char *address, int port);
 LIBSSH_API int ssh_forward_listen(ssh_session session, const char *address, int port, int *bound_port);
+
+/**
+ * The counters of a remote forwarding, see ssh_forward_remote_get_stats().
+ */
+struct ssh_forward_remote_stats_struct {
+  /** Connections forwarded, refused over the limit, failed to connect */
+  uint64_t accepted;
+  uint64_t refused;
+  uint64_t failed;
+  /** Connections being made or forwarded */
+  uint32_t active;
+  /** Bytes received from the server and sent to it */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+};
+
+LIBSSH_API ssh_forward_remote ssh_forward_remote_new(ssh_session session,
+    const char *address, int port, const char *host, int host_port);
+LIBSSH_API void ssh_forward_remote_set_limit(ssh_forward_remote fwd,
+    int max_connections);
+LIBSSH_API int ssh_forward_remote_get_stats(ssh_forward_remote fwd,
+    struct ssh_forward_remote_stats_struct *stats);
+LIBSSH_API void ssh_forward_remote_free(ssh_forward_remote fwd);
 LIBSSH_API void ssh_free(ssh_session session);
+LIBSSH_API const char *ssh_get_crypto_implementation(void);
 LIBSSH_API const char *ssh_get_disconnect_message(ssh_session session);
 LIBSSH_API const char *ssh_get_error(void *error);
 LIBSSH_API int ssh_get_error_code(void *error);
@@ -385,11 +586,30 @@ LIBSSH_API int ssh_get_pubkey_hash(ssh_session session, unsigned char **hash);
 LIBSSH_API int ssh_get_random(void *where,int len,int strong);
 LIBSSH_API int ssh_get_version(ssh_session session);
 LIBSSH_API int ssh_get_status(ssh_session session);
+LIBSSH_API uint32_t ssh_get_buffered(ssh_session session);
+LIBSSH_API uint32_t ssh_get_packets_per_read(ssh_session session,
+    uint32_t *max);
 LIBSSH_API int ssh_init(void);
 LIBSSH_API int ssh_is_blocking(ssh_session session);
 LIBSSH_API int ssh_is_connected(ssh_session session);
 LIBSSH_API int ssh_is_server_known(ssh_session session);
+LIBSSH_API int ssh_key_cache_preload(ssh_session session, const char *filename,
+    const char *passphrase);
 LIBSSH_API void ssh_log(ssh_session session, int prioriry, const char *format, ...) PRINTF_ATTRIBUTE(3, 4);
+typedef void (*ssh_log_drain_callback)(ssh_session session,
+    ssh_log_entry entry, void *userdata);
+LIBSSH_API int ssh_log_drain(ssh_session session,
+    ssh_log_drain_callback callback, void *userdata);
+LIBSSH_API int ssh_log_entry_event(ssh_log_entry entry);
+LIBSSH_API const char *ssh_log_entry_name(ssh_log_entry entry);
+LIBSSH_API int ssh_log_entry_verbosity(ssh_log_entry entry);
+LIBSSH_API int ssh_log_entry_field_count(ssh_log_entry entry);
+LIBSSH_API const char *ssh_log_entry_field_key(ssh_log_entry entry,
+    int field);
+LIBSSH_API unsigned int ssh_log_entry_field_value(ssh_log_entry entry,
+    int field);
+LIBSSH_API int ssh_log_entry_format(ssh_log_entry entry, char *buffer,
+    size_t len);
 LIBSSH_API ssh_channel ssh_message_channel_request_open_reply_accept(ssh_message msg);
 LIBSSH_API int ssh_message_channel_request_reply_success(ssh_message msg);
 LIBSSH_API void ssh_message_free(ssh_message msg);
@@ -404,24 +624,42 @@ LIBSSH_API int ssh_options_getopt(ssh_session session, int *argcptr, char **argv
 LIBSSH_API int ssh_options_parse_config(ssh_session session, const char *filename);
 LIBSSH_API int ssh_options_set(ssh_session session, enum ssh_options_e type,
     const void *value);
+LIBSSH_API ssh_options_template ssh_options_template_new(ssh_session session);
+LIBSSH_API int ssh_options_template_apply(ssh_options_template tmpl,
+    ssh_session session);
+LIBSSH_API void ssh_options_template_free(ssh_options_template tmpl);
 LIBSSH_API int ssh_pcap_file_close(ssh_pcap_file pcap);
 LIBSSH_API void ssh_pcap_file_free(ssh_pcap_file pcap);
 LIBSSH_API ssh_pcap_file ssh_pcap_file_new(void);
 LIBSSH_API int ssh_pcap_file_open(ssh_pcap_file pcap, const char *filename);
+LIBSSH_API int ssh_pcap_file_flush(ssh_pcap_file pcap);
+LIBSSH_API int ssh_pcap_file_set_buffer(ssh_pcap_file pcap, size_t size,
+    int background);
+LIBSSH_API int ssh_pcap_file_set_snaplen(ssh_pcap_file pcap, uint32_t snaplen);
+LIBSSH_API int ssh_pcap_file_set_sampling(ssh_pcap_file pcap,
+    unsigned int sessions);
+LIBSSH_API int ssh_pcap_file_set_rotation(ssh_pcap_file pcap, uint64_t size,
+    unsigned int files);
+LIBSSH_API uint64_t ssh_pcap_file_get_dropped(ssh_pcap_file pcap);
 
 LIBSSH_API enum ssh_keytypes_e ssh_privatekey_type(ssh_private_key privatekey);
 
 LIBSSH_API void ssh_print_hexa(const char *descr, const unsigned char *what, size_t len);
+LIBSSH_API int ssh_rekey(ssh_session session);
 LIBSSH_API int ssh_scp_accept_request(ssh_scp scp);
 LIBSSH_API int ssh_scp_close(ssh_scp scp);
 LIBSSH_API int ssh_scp_deny_request(ssh_scp scp, const char *reason);
+LIBSSH_API int ssh_scp_flush(ssh_scp scp);
 LIBSSH_API void ssh_scp_free(ssh_scp scp);
 LIBSSH_API int ssh_scp_init(ssh_scp scp);
 LIBSSH_API int ssh_scp_leave_directory(ssh_scp scp);
 LIBSSH_API ssh_scp ssh_scp_new(ssh_session session, int mode, const char *location);
 LIBSSH_API int ssh_scp_pull_request(ssh_scp scp);
+LIBSSH_API int ssh_scp_pull_to_fd(ssh_scp scp, int fd);
+LIBSSH_API int ssh_scp_pull_tree(ssh_scp scp, const char *path);
 LIBSSH_API int ssh_scp_push_directory(ssh_scp scp, const char *dirname, int mode);
 LIBSSH_API int ssh_scp_push_file(ssh_scp scp, const char *filename, size_t size, int perms);
+LIBSSH_API int ssh_scp_push_tree(ssh_scp scp, const char *path);
 LIBSSH_API int ssh_scp_read(ssh_scp scp, void *buffer, size_t size);
 LIBSSH_API const char *ssh_scp_request_get_filename(ssh_scp scp);
 LIBSSH_API int ssh_scp_request_get_permissions(ssh_scp scp);
@@ -431,12 +669,32 @@ LIBSSH_API int ssh_scp_write(ssh_scp scp, const void *buffer, size_t len);
 LIBSSH_API int ssh_select(ssh_channel *channels, ssh_channel *outchannels, socket_t maxfd,
     fd_set *readfds, struct timeval *timeout);
 LIBSSH_API int ssh_service_request(ssh_session session, const char *service);
+#ifndef _WIN32
+LIBSSH_API int ssh_set_agent_cache_timeout(unsigned int seconds);
+#endif
 LIBSSH_API void ssh_set_blocking(ssh_session session, int blocking);
+LIBSSH_API int ssh_set_crypto_engine(const char *id);
+LIBSSH_API void ssh_session_cork(ssh_session session);
+LIBSSH_API int ssh_session_get_latency(ssh_session session, int phase,
+    struct ssh_latency_struct *latency);
+LIBSSH_API int ssh_session_get_stats(ssh_session session,
+    struct ssh_session_stats_struct *stats);
+LIBSSH_API int ssh_session_uncork(ssh_session session);
 LIBSSH_API void ssh_set_fd_except(ssh_session session);
 LIBSSH_API void ssh_set_fd_toread(ssh_session session);
 LIBSSH_API void ssh_set_fd_towrite(ssh_session session);
 LIBSSH_API void ssh_silent_disconnect(ssh_session session);
+LIBSSH_API int ssh_set_key_cache_size(unsigned int keys);
+LIBSSH_API int ssh_set_log_ring(ssh_session session, unsigned int entries);
 LIBSSH_API int ssh_set_pcap_file(ssh_session session, ssh_pcap_file pcapfile);
+LIBSSH_API int ssh_set_pool_sizes(unsigned int buffers, unsigned int strings);
+#ifndef _WIN32
+LIBSSH_API ssh_crypto_pool ssh_crypto_pool_new(void);
+LIBSSH_API int ssh_crypto_pool_run(ssh_crypto_pool pool);
+LIBSSH_API void ssh_crypto_pool_stop(ssh_crypto_pool pool);
+LIBSSH_API void ssh_crypto_pool_free(ssh_crypto_pool pool);
+LIBSSH_API int ssh_set_crypto_pool(ssh_session session, ssh_crypto_pool pool);
+#endif /* _WIN32 */
 #ifndef _WIN32
 LIBSSH_API int ssh_userauth_agent_pubkey(ssh_session session, const char *username,
     ssh_public_key publickey);
@@ -487,6 +745,75 @@ LIBSSH_API int ssh_event_remove_fd(ssh_event event, socket_t fd);
 LIBSSH_API int ssh_event_remove_session(ssh_event event, ssh_session session);
 LIBSSH_API void ssh_event_free(ssh_event event);
 
+typedef void (*ssh_event_task_callback)(ssh_event event, void *userdata);
+
+LIBSSH_API int ssh_event_post(ssh_event event, ssh_event_task_callback cb,
+                                    void *userdata);
+
+typedef void (*ssh_timer_callback)(ssh_timer timer, void *userdata);
+
+LIBSSH_API ssh_timer ssh_event_add_timer(ssh_event event, unsigned int timeout,
+                                    ssh_timer_callback cb, void *userdata);
+LIBSSH_API ssh_timer ssh_session_add_timer(ssh_session session,
+    unsigned int timeout, ssh_timer_callback cb, void *userdata);
+LIBSSH_API ssh_timer ssh_channel_add_timer(ssh_channel channel,
+    unsigned int timeout, ssh_timer_callback cb, void *userdata);
+LIBSSH_API int ssh_timer_reset(ssh_timer timer, unsigned int timeout);
+LIBSSH_API void ssh_timer_cancel(ssh_timer timer);
+LIBSSH_API int ssh_timer_is_pending(ssh_timer timer);
+LIBSSH_API void ssh_timer_free(ssh_timer timer);
+
+typedef ssh_session (*ssh_mux_connect_callback)(const char *host,
+    const char *user, unsigned int port, void *userdata);
+
+LIBSSH_API ssh_mux ssh_mux_new(void);
+LIBSSH_API void ssh_mux_free(ssh_mux mux);
+LIBSSH_API void ssh_mux_set_limits(ssh_mux mux, int max_channels,
+    int idle_timeout);
+LIBSSH_API void ssh_mux_set_connect_callback(ssh_mux mux,
+    ssh_mux_connect_callback cb, void *userdata);
+LIBSSH_API int ssh_mux_add_session(ssh_mux mux, ssh_session session);
+LIBSSH_API int ssh_mux_remove_session(ssh_mux mux, ssh_session session);
+LIBSSH_API int ssh_mux_expire(ssh_mux mux);
+LIBSSH_API ssh_session ssh_mux_get_session(ssh_mux mux, const char *host,
+    const char *user, unsigned int port);
+LIBSSH_API ssh_channel ssh_mux_channel_new(ssh_mux mux, const char *host,
+    const char *user, unsigned int port);
+
+LIBSSH_API ssh_socks ssh_socks_new(ssh_session session, socket_t listener);
+LIBSSH_API int ssh_socks_get_count(ssh_socks socks);
+LIBSSH_API void ssh_socks_free(ssh_socks socks);
+
+LIBSSH_API int ssh_set_proxy_jump(ssh_session session, ssh_session bastion);
+
+LIBSSH_API ssh_batch ssh_batch_new(const char *command);
+LIBSSH_API void ssh_batch_free(ssh_batch batch);
+LIBSSH_API int ssh_batch_add_host(ssh_batch batch, const char *host);
+LIBSSH_API int ssh_batch_set_auth(ssh_batch batch, const char *user,
+    const char *password, ssh_private_key key);
+LIBSSH_API void ssh_batch_set_limits(ssh_batch batch, int parallel,
+    int timeout);
+
+enum ssh_batch_capture_e {
+  SSH_BATCH_CAPTURE_NONE=0,
+  SSH_BATCH_CAPTURE_TAIL,
+  SSH_BATCH_CAPTURE_FULL,
+  SSH_BATCH_CAPTURE_LINES
+};
+
+LIBSSH_API int ssh_batch_set_capture(ssh_batch batch,
+    enum ssh_batch_capture_e mode, size_t limit);
+LIBSSH_API ssh_event ssh_batch_get_event(ssh_batch batch);
+LIBSSH_API int ssh_batch_dopoll(ssh_batch batch, int timeout);
+LIBSSH_API int ssh_batch_run(ssh_batch batch);
+
+typedef void (*ssh_scp_progress_callback)(const char *path, uint64_t bytes,
+    uint64_t sent, uint64_t total, void *userdata);
+
+LIBSSH_API int ssh_scp_push_files(ssh_scp *scps, size_t count,
+    const char **paths, size_t npaths, ssh_scp_progress_callback progress,
+    void *userdata);
+
 #ifndef LIBSSH_LEGACY_0_4
 #include "libssh/legacy.h"
 #endif
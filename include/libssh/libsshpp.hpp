@@ -36,9 +36,21 @@
  *   linking mode, which the compiler can decide to do in some case. There would be nearly no
  *   performance penalty of using the wrapper rather than native calls.
  *
- * Please visit the documentation of ssh::Session and ssh::Channel
+ * Please visit the documentation of ssh::Session, ssh::Channel,
+ * ssh::ChannelReader, ssh::ChannelWriter, ssh::Event, ssh::Sftp and
+ * ssh::SftpFile
  * @see ssh::Session
  * @see ssh::Channel
+ * @see ssh::ChannelReader
+ * @see ssh::ChannelWriter
+ * @see ssh::Event
+ * @see ssh::Sftp
+ * @see ssh::SftpFile
+ *
+ * The objects own their C counterpart and free it when they are destroyed.
+ * They can't be copied; with C++11 they can be moved. With C++17, the
+ * writes also take a std::string_view, and with C++20 the reads a
+ * std::span<char>.
  *
  * If you wish not to use C++ exceptions, please define SSH_NO_CPP_EXCEPTIONS:
  * @code
@@ -46,6 +58,11 @@
  * #include <libssh/libsshpp.hpp>
  * @endcode
  * All functions will then return SSH_ERROR in case of error.
+ *
+ * The reads and writes also have a try variant (Channel::tryRead,
+ * SftpFile::tryWrite...) which never throws and returns an ssh::Result,
+ * whatever the mode. It is meant for the loops moving the data, the message
+ * of an error being only looked up if asked for.
  * @{
  */
 
@@ -54,13 +71,76 @@
 
 #include <libssh/libssh.h>
 #include <libssh/server.h>
+#include <libssh/sftp.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <string>
+
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1900)
+#define SSH_CPP_MOVE
+#define SSH_NOEXCEPT noexcept
+#else
+#define SSH_NOEXCEPT throw()
+#endif
+#if __cplusplus >= 201703L
+#include <string_view>
+#define SSH_CPP_STRING_VIEW
+#endif
+#if __cplusplus >= 202002L
+#include <cstddef>
+#include <span>
+#define SSH_CPP_SPAN
+#endif
 
 namespace ssh {
 
 class Channel;
+class Sftp;
+class SftpFile;
+
+/** @brief The result of a call which doesn't throw.
+ *
+ * It holds what the C function returned: a number of bytes or a status if
+ * the call succeeded, SSH_ERROR if it failed. The description of the error
+ * stays in the session until getError() is called, nothing is allocated.
+ */
+class Result {
+public:
+  Result(ssh_session csession, int64_t value) SSH_NOEXCEPT
+    : c_session(csession), val(value){
+  }
+  /** @brief returns true unless the call failed */
+  bool ok() const SSH_NOEXCEPT {
+    return val != SSH_ERROR;
+  }
+  /** @brief returns what the call returned, SSH_ERROR if it failed */
+  int64_t value() const SSH_NOEXCEPT {
+    return val;
+  }
+  /** @brief returns the error code of the session
+   * @see ssh_get_error_code
+   */
+  int getCode() const SSH_NOEXCEPT {
+    return ssh_get_error_code(c_session);
+  }
+  /** @brief returns the error message of the session
+   * @see ssh_get_error
+   */
+  const char *getError() const SSH_NOEXCEPT {
+    return ssh_get_error(c_session);
+  }
+private:
+  ssh_session c_session;
+  int64_t val;
+};
 /** Some people do not like C++ exceptions. With this define, we give
  * the choice to use or not exceptions.
  * @brief if defined, disable C++ exceptions for libssh c++ wrapper
@@ -105,6 +185,7 @@ private:
  * @brief Macro to throw exception if there was an error
  */
 #define ssh_throw(x) if((x)==SSH_ERROR) throw SshException(getCSession())
+#define ssh_throw_negative(x) if((x)<0) throw SshException(getCSession())
 #define ssh_throw_null(CSession,x) if((x)==NULL) throw SshException(CSession)
 #define void_throwable void
 #define return_throwable return
@@ -115,6 +196,7 @@ private:
  * of an exception
  */
 #define ssh_throw(x) if((x)==SSH_ERROR) return SSH_ERROR
+#define ssh_throw_negative(x) if((x)<0) return SSH_ERROR
 #define ssh_throw_null(CSession,x) if((x)==NULL) return NULL
 #define void_throwable int
 #define return_throwable return SSH_OK
@@ -125,6 +207,8 @@ private:
  */
 class Session {
   friend class Channel;
+  friend class Event;
+  friend class Sftp;
 public:
   Session(){
     c_session=ssh_new();
@@ -133,6 +217,23 @@ public:
     ssh_free(c_session);
     c_session=NULL;
   }
+#ifdef SSH_CPP_MOVE
+  /** @brief takes the connection of another session, which is left empty
+   * @warning the Channel and Sftp objects refer to the Session they were
+   * created with, which shouldn't be moved while they are in use
+   */
+  Session(Session &&other) noexcept : c_session(other.c_session){
+    other.c_session=NULL;
+  }
+  Session &operator=(Session &&other) noexcept {
+    if(this != &other){
+      ssh_free(c_session);
+      c_session=other.c_session;
+      other.c_session=NULL;
+    }
+    return *this;
+  }
+#endif
   /** @brief sets an SSH session options
    * @param type Type of option
    * @param option cstring containing the value of option
@@ -385,11 +486,12 @@ public:
     return_throwable;
   }
 
-private:
-  ssh_session c_session;
+  /** @brief returns the underlying session */
   ssh_session getCSession(){
     return c_session;
   }
+private:
+  ssh_session c_session;
   /* No copy constructor, no = operator */
   Session(const Session &);
   Session& operator=(const Session &);
@@ -410,6 +512,22 @@ public:
     ssh_channel_free(channel);
     channel=NULL;
   }
+#ifdef SSH_CPP_MOVE
+  /** @brief takes the channel of another object, which is left empty */
+  Channel(Channel &&other) noexcept
+    : session(other.session), channel(other.channel){
+    other.channel=NULL;
+  }
+  Channel &operator=(Channel &&other) noexcept {
+    if(this != &other){
+      ssh_channel_free(channel);
+      session=other.session;
+      channel=other.channel;
+      other.channel=NULL;
+    }
+    return *this;
+  }
+#endif
 
   /** @brief accept an incoming X11 connection
    * @param[in] timeout_ms timeout for waiting, in ms
@@ -506,6 +624,24 @@ public:
     ssh_throw(err);
     return err;
   }
+  /** @brief Reads on a channel, without throwing
+   * @returns the number of bytes read, SSH_ERROR on error
+   * @see Channel::read
+   */
+  Result tryRead(void *dest, size_t count, bool is_stderr=false) SSH_NOEXCEPT {
+    if(count > 0x7fffffff)
+      count = 0x7fffffff;
+    return Result(getCSession(),
+        ssh_channel_read(channel,dest,count,is_stderr));
+  }
+#ifdef SSH_CPP_SPAN
+  int read(std::span<char> dest, bool is_stderr=false){
+    return read(dest.data(),dest.size(),is_stderr);
+  }
+  Result tryRead(std::span<char> dest, bool is_stderr=false) noexcept {
+    return tryRead(dest.data(),dest.size(),is_stderr);
+  }
+#endif
   void_throwable requestEnv(const char *name, const char *value){
     int err=ssh_channel_request_env(channel,name,value);
     ssh_throw(err);
@@ -573,6 +709,32 @@ public:
     ssh_throw(ret);
     return ret;
   }
+  /** @brief Writes on a channel, without throwing
+   * @returns the number of bytes written, SSH_ERROR on error
+   * @see Channel::write
+   */
+  Result tryWrite(const void *data, size_t len, bool is_stderr=false)
+      SSH_NOEXCEPT {
+    int ret;
+    if(is_stderr){
+      ret=ssh_channel_write_stderr(channel,data,len);
+    } else {
+      ret=ssh_channel_write(channel,data,len);
+    }
+    return Result(getCSession(),ret);
+  }
+#ifdef SSH_CPP_STRING_VIEW
+  int write(std::string_view data, bool is_stderr=false){
+    return write(data.data(),data.size(),is_stderr);
+  }
+  Result tryWrite(std::string_view data, bool is_stderr=false) noexcept {
+    return tryWrite(data.data(),data.size(),is_stderr);
+  }
+#endif
+  /** @brief returns the underlying channel */
+  ssh_channel getCChannel(){
+    return channel;
+  }
 private:
   ssh_session getCSession(){
     return session->getCSession();
@@ -588,6 +750,287 @@ private:
   Channel &operator=(const Channel &);
 };
 
+/** @brief the ssh::ChannelReader class reads a Channel where its data was
+ * received: lines are scanned and data copied out of the buffer of the
+ * channel, without reading it byte per byte or into another buffer first.
+ * @see ssh_channel_read_in_place
+ */
+class ChannelReader {
+public:
+  ChannelReader(Channel &channel, bool is_stderr=false){
+    this->channel=&channel;
+    this->is_stderr=is_stderr;
+  }
+  /** @brief Reads what the channel has, waiting for some data
+   * @returns the number of bytes read, 0 at the end of file
+   * @throws SshException on error
+   * @see ssh_channel_read
+   */
+  int read(void *dest, size_t count){
+    int ret;
+    if(count > 0x7fffffff)
+      count = 0x7fffffff;
+    ret=ssh_channel_read(getCChannel(),dest,count,is_stderr);
+    ssh_throw(ret);
+    return ret;
+  }
+  /** @brief Reads up to a delimiter
+   * @param[out] line the data before the delimiter, or up to the end of
+   * file if there is no delimiter left
+   * @param[in] delim the delimiter, taken out of the channel but not added
+   * to line
+   * @returns the number of bytes taken out of the channel, 0 at the end of
+   * file
+   * @throws SshException on error
+   */
+  int readLine(std::string &line, char delim='\n'){
+    struct line_state state;
+    int ret;
+
+    line.clear();
+    state.line=&line;
+    state.delim=delim;
+    state.found=false;
+    state.taken=0;
+    do {
+      ret=ssh_channel_read_in_place(getCChannel(),chunk,is_stderr,-1,
+          takeLine,&state);
+      ssh_throw(ret);
+    } while(ret > 0 && !state.found);
+    return (int) state.taken;
+  }
+#ifdef SSH_CPP_SPAN
+  /** @brief Reads what the channel has into several buffers, filled in
+   * order, waiting for some data
+   * @returns the number of bytes read, 0 at the end of file
+   * @throws SshException on error
+   */
+  int readv(std::span<const std::span<std::byte> > bufs){
+    struct scatter_state state;
+    size_t count=0;
+    int ret;
+
+    for(const std::span<std::byte> &buf : bufs)
+      count+=buf.size();
+    if(count > 0x7fffffff)
+      count = 0x7fffffff;
+    state.bufs=bufs.data();
+    state.count=bufs.size();
+    ret=ssh_channel_read_in_place(getCChannel(),count,is_stderr,-1,
+        takeScatter,&state);
+    ssh_throw(ret);
+    return ret;
+  }
+#endif
+  /** @brief Writes the data of the channel to a file descriptor up to the
+   * end of file, from the buffer of the channel
+   * @returns the number of bytes copied, SSH_ERROR with errno set if
+   * writing to fd failed
+   * @throws SshException on error of the channel
+   */
+  int64_t copyTo(int fd){
+    struct copy_state state;
+    int ret;
+
+    state.fd=fd;
+    state.error=0;
+    state.copied=0;
+    do {
+      ret=ssh_channel_read_in_place(getCChannel(),chunk,is_stderr,-1,
+          takeCopy,&state);
+      if(ret == SSH_ERROR && state.error != 0){
+        errno=state.error;
+        return SSH_ERROR;
+      }
+      ssh_throw(ret);
+    } while(ret > 0);
+    return state.copied;
+  }
+private:
+  /* what a line or copy reads at once, not to grow the window further */
+  enum { chunk = 65536 };
+  struct line_state {
+    std::string *line;
+    char delim;
+    bool found;
+    size_t taken;
+  };
+  struct copy_state {
+    int fd;
+    int error;
+    int64_t copied;
+  };
+  static int takeLine(const void *data, uint32_t len, void *userdata){
+    struct line_state *state=(struct line_state *) userdata;
+    const char *p=(const char *) data;
+    const char *end=(const char *) memchr(p,state->delim,len);
+    uint32_t n=end != NULL ? (uint32_t) (end - p) : len;
+#ifdef __cpp_exceptions
+    try {
+      state->line->append(p,n);
+    } catch(...) {
+      return -1;
+    }
+#else
+    state->line->append(p,n);
+#endif
+    if(end != NULL){
+      state->found=true;
+      n++;
+    }
+    state->taken+=n;
+    return n;
+  }
+  static int takeCopy(const void *data, uint32_t len, void *userdata){
+    struct copy_state *state=(struct copy_state *) userdata;
+    const char *p=(const char *) data;
+    uint32_t done=0;
+    while(done < len){
+#ifdef _WIN32
+      int n=::_write(state->fd,p + done,len - done);
+#else
+      ssize_t n=::write(state->fd,p + done,len - done);
+#endif
+      if(n < 0){
+        if(errno == EINTR)
+          continue;
+        state->error=errno;
+        return -1;
+      }
+      done+=n;
+    }
+    state->copied+=done;
+    return done;
+  }
+#ifdef SSH_CPP_SPAN
+  struct scatter_state {
+    const std::span<std::byte> *bufs;
+    size_t count;
+  };
+  static int takeScatter(const void *data, uint32_t len, void *userdata){
+    struct scatter_state *state=(struct scatter_state *) userdata;
+    const char *p=(const char *) data;
+    uint32_t done=0;
+    size_t i;
+    for(i=0; i < state->count && done < len; i++){
+      size_t n=state->bufs[i].size();
+      if(n > len - done)
+        n=len - done;
+      memcpy(state->bufs[i].data(),p + done,n);
+      done+=n;
+    }
+    return done;
+  }
+#endif
+  ssh_channel getCChannel(){
+    return channel->getCChannel();
+  }
+  ssh_session getCSession(){
+    return channel->getSession().getCSession();
+  }
+  Channel *channel;
+  bool is_stderr;
+};
+
+/** @brief the ssh::ChannelWriter class gathers the small writes on a
+ * Channel, so they go out in full packets.
+ *
+ * The data kept is written by flush() and when the writer is destroyed,
+ * the latter ignoring the errors.
+ */
+class ChannelWriter {
+public:
+  ChannelWriter(Channel &channel, size_t size=32768, bool is_stderr=false){
+    this->channel=&channel;
+    this->is_stderr=is_stderr;
+    this->size=size > 0 ? size : 1;
+    used=0;
+    buf=new char[this->size];
+  }
+  ~ChannelWriter(){
+    if(buf != NULL && used > 0){
+      if(is_stderr)
+        ssh_channel_write_stderr(channel->getCChannel(),buf,used);
+      else
+        ssh_channel_write(channel->getCChannel(),buf,used);
+    }
+    delete[] buf;
+    buf=NULL;
+  }
+#ifdef SSH_CPP_MOVE
+  ChannelWriter(ChannelWriter &&other) noexcept
+    : channel(other.channel), is_stderr(other.is_stderr), buf(other.buf),
+      size(other.size), used(other.used){
+    other.buf=NULL;
+    other.used=0;
+  }
+#endif
+  /** @brief Writes on the channel, through the buffer unless the data fills
+   * it
+   * @returns len
+   * @throws SshException on error
+   */
+  int write(const void *data, size_t len){
+    int ret;
+    if(len > size - used){
+      ret=flush();
+      if(ret == SSH_ERROR)
+        return ret;
+    }
+    if(len >= size){
+      ret=channel->write(data,len,is_stderr);
+      if(ret == SSH_ERROR)
+        return ret;
+      return len;
+    }
+    memcpy(buf + used,data,len);
+    used+=len;
+    return len;
+  }
+#ifdef SSH_CPP_STRING_VIEW
+  int write(std::string_view data){
+    return write(data.data(),data.size());
+  }
+#endif
+#ifdef SSH_CPP_SPAN
+  /** @brief Writes several buffers on the channel, as write() does
+   * @returns the number of bytes written
+   * @throws SshException on error
+   */
+  int writev(std::span<const std::span<const std::byte> > bufs){
+    int total=0;
+    for(const std::span<const std::byte> &data : bufs){
+      int ret=write(data.data(),data.size());
+      if(ret == SSH_ERROR)
+        return ret;
+      total+=ret;
+    }
+    return total;
+  }
+#endif
+  /** @brief Writes the data kept on the channel
+   * @throws SshException on error
+   */
+  int flush(){
+    int ret;
+    if(used == 0)
+      return SSH_OK;
+    ret=channel->write(buf,used,is_stderr);
+    if(ret == SSH_ERROR)
+      return ret;
+    used=0;
+    return SSH_OK;
+  }
+private:
+  Channel *channel;
+  bool is_stderr;
+  char *buf;
+  size_t size;
+  size_t used;
+  /* No copy and no = operator */
+  ChannelWriter(const ChannelWriter &);
+  ChannelWriter &operator=(const ChannelWriter &);
+};
 
 /* This code cannot be put inline due to references to Channel */
 Channel *Session::acceptForward(int timeout_ms){
@@ -598,6 +1041,392 @@ Channel *Session::acceptForward(int timeout_ms){
     return newchan;
   }
 
+/** @brief the ssh::Event class polls several sessions and file descriptors
+ * together.
+ * @see ssh_event
+ */
+class Event {
+public:
+  Event(){
+    c_event=ssh_event_new();
+  }
+  ~Event(){
+    ssh_event_free(c_event);
+    c_event=NULL;
+  }
+#ifdef SSH_CPP_MOVE
+  Event(Event &&other) noexcept : c_event(other.c_event){
+    other.c_event=NULL;
+  }
+  Event &operator=(Event &&other) noexcept {
+    if(this != &other){
+      ssh_event_free(c_event);
+      c_event=other.c_event;
+      other.c_event=NULL;
+    }
+    return *this;
+  }
+#endif
+  /** @brief adds a file descriptor to poll
+   * @returns SSH_OK, SSH_ERROR on error
+   * @see ssh_event_add_fd
+   */
+  int addFd(socket_t fd, short events, ssh_event_callback cb,
+      void *userdata){
+    return ssh_event_add_fd(c_event,fd,events,cb,userdata);
+  }
+  /** @brief removes a file descriptor
+   * @returns SSH_OK, SSH_ERROR if it wasn't polled
+   * @see ssh_event_remove_fd
+   */
+  int removeFd(socket_t fd){
+    return ssh_event_remove_fd(c_event,fd);
+  }
+  /** @brief adds the socket of a session to poll
+   * @returns SSH_OK, SSH_ERROR on error
+   * @see ssh_event_add_session
+   */
+  int addSession(Session &session){
+    return ssh_event_add_session(c_event,session.c_session);
+  }
+  /** @brief removes the socket of a session
+   * @returns SSH_OK, SSH_ERROR if it wasn't polled
+   * @see ssh_event_remove_session
+   */
+  int removeSession(Session &session){
+    return ssh_event_remove_session(c_event,session.c_session);
+  }
+  /** @brief runs a task in the thread polling the event
+   * @see ssh_event_post
+   */
+  int post(ssh_event_task_callback cb, void *userdata){
+    return ssh_event_post(c_event,cb,userdata);
+  }
+  /** @brief arms a timer run by the polling of the event
+   * @returns the timer, NULL on error
+   * @see ssh_event_add_timer
+   */
+  ssh_timer addTimer(unsigned int timeout, ssh_timer_callback cb,
+      void *userdata){
+    return ssh_event_add_timer(c_event,timeout,cb,userdata);
+  }
+  /** @brief polls the event once
+   * @param[in] timeout timeout in ms, -1 for no timeout
+   * @returns SSH_OK, SSH_AGAIN on timeout, SSH_ERROR on error
+   * @see ssh_event_dopoll
+   */
+  int dopoll(int timeout){
+    return ssh_event_dopoll(c_event,timeout);
+  }
+  /** @brief returns the underlying event */
+  ssh_event getCEvent(){
+    return c_event;
+  }
+private:
+  ssh_event c_event;
+  /* No copy and no = operator */
+  Event(const Event &);
+  Event &operator=(const Event &);
+};
+
+/** @brief the ssh::Sftp class describes a SFTP session over a channel of
+ * a Session.
+ * @see sftp_session
+ */
+class Sftp {
+  friend class SftpFile;
+public:
+  Sftp(Session &session){
+    c_sftp=sftp_new(session.c_session);
+    this->session=&session;
+  }
+  ~Sftp(){
+    sftp_free(c_sftp);
+    c_sftp=NULL;
+  }
+#ifdef SSH_CPP_MOVE
+  /** @brief takes the SFTP session of another object, which is left empty
+   * @warning the SftpFile objects refer to the Sftp they were opened with
+   */
+  Sftp(Sftp &&other) noexcept : session(other.session), c_sftp(other.c_sftp){
+    other.c_sftp=NULL;
+  }
+  Sftp &operator=(Sftp &&other) noexcept {
+    if(this != &other){
+      sftp_free(c_sftp);
+      session=other.session;
+      c_sftp=other.c_sftp;
+      other.c_sftp=NULL;
+    }
+    return *this;
+  }
+#endif
+  /** @brief initializes the SFTP session with the server
+   * @throws SshException on error
+   * @see sftp_init
+   */
+  void_throwable init(){
+    ssh_throw(c_sftp == NULL ? SSH_ERROR : sftp_init(c_sftp));
+    return_throwable;
+  }
+  /** @brief returns the last SFTP status of the server
+   * @see sftp_get_error
+   */
+  int getError(){
+    return sftp_get_error(c_sftp);
+  }
+  void_throwable mkdir(const char *directory, mode_t mode){
+    ssh_throw(sftp_mkdir(c_sftp,directory,mode));
+    return_throwable;
+  }
+  void_throwable rename(const char *original, const char *newname){
+    ssh_throw(sftp_rename(c_sftp,original,newname));
+    return_throwable;
+  }
+  void_throwable rmdir(const char *directory){
+    ssh_throw(sftp_rmdir(c_sftp,directory));
+    return_throwable;
+  }
+  void_throwable unlink(const char *file){
+    ssh_throw(sftp_unlink(c_sftp,file));
+    return_throwable;
+  }
+  Session &getSession(){
+    return *session;
+  }
+  /** @brief returns the underlying SFTP session */
+  sftp_session getCSftp(){
+    return c_sftp;
+  }
+private:
+  ssh_session getCSession(){
+    return session->c_session;
+  }
+  Session *session;
+  sftp_session c_sftp;
+  /* No copy and no = operator */
+  Sftp(const Sftp &);
+  Sftp &operator=(const Sftp &);
+};
+
+/** @brief the ssh::SftpFile class describes a file opened over a Sftp
+ * session, closed when the object is destroyed.
+ * @see sftp_file
+ */
+class SftpFile {
+public:
+  SftpFile(Sftp &sftp){
+    file=NULL;
+    this->sftp=&sftp;
+  }
+  ~SftpFile(){
+    if(file != NULL)
+      sftp_close(file);
+    file=NULL;
+  }
+#ifdef SSH_CPP_MOVE
+  /** @brief takes the file of another object, which is left closed */
+  SftpFile(SftpFile &&other) noexcept : sftp(other.sftp), file(other.file){
+    other.file=NULL;
+  }
+  SftpFile &operator=(SftpFile &&other) noexcept {
+    if(this != &other){
+      if(file != NULL)
+        sftp_close(file);
+      sftp=other.sftp;
+      file=other.file;
+      other.file=NULL;
+    }
+    return *this;
+  }
+#endif
+  /** @brief opens a remote file, closing the one opened before
+   * @param[in] path path of the remote file
+   * @param[in] accesstype O_RDONLY, O_WRONLY, O_RDWR with O_CREAT, O_EXCL
+   * and O_TRUNC
+   * @param[in] mode permissions of a file created
+   * @throws SshException on error
+   * @see sftp_open
+   */
+  void_throwable open(const char *path, int accesstype, mode_t mode=0644){
+    sftp_file newfile;
+    close();
+    newfile=sftp_open(sftp->c_sftp,path,accesstype,mode);
+    ssh_throw(newfile == NULL ? SSH_ERROR : SSH_OK);
+    file=newfile;
+    return_throwable;
+  }
+  /** @brief closes the file, if open
+   * @see sftp_close
+   */
+  void close(){
+    if(file != NULL)
+      sftp_close(file);
+    file=NULL;
+  }
+  bool isOpen(){
+    return file != NULL;
+  }
+  /** @brief Reads from the file
+   * @returns the number of bytes read, 0 at the end of the file
+   * @throws SshException on error
+   * @see sftp_read
+   */
+  ssize_t read(void *dest, size_t count){
+    ssize_t ret=sftp_read(file,dest,count);
+    ssh_throw_negative(ret);
+    return ret;
+  }
+  /** @brief Reads from the file, without throwing
+   * @returns the number of bytes read, SSH_ERROR on error
+   * @see SftpFile::read
+   */
+  Result tryRead(void *dest, size_t count) SSH_NOEXCEPT {
+    ssize_t ret=sftp_read(file,dest,count);
+    return Result(getCSession(),ret < 0 ? SSH_ERROR : ret);
+  }
+  /** @brief Writes to the file
+   * @returns the number of bytes written
+   * @throws SshException on error
+   * @see sftp_write
+   */
+  ssize_t write(const void *data, size_t len){
+    ssize_t ret=sftp_write(file,data,len);
+    ssh_throw_negative(ret);
+    return ret;
+  }
+  /** @brief Writes to the file, without throwing
+   * @returns the number of bytes written, SSH_ERROR on error
+   * @see SftpFile::write
+   */
+  Result tryWrite(const void *data, size_t len) SSH_NOEXCEPT {
+    ssize_t ret=sftp_write(file,data,len);
+    return Result(getCSession(),ret < 0 ? SSH_ERROR : ret);
+  }
+#ifdef SSH_CPP_SPAN
+  ssize_t read(std::span<char> dest){
+    return read(dest.data(),dest.size());
+  }
+  Result tryRead(std::span<char> dest) noexcept {
+    return tryRead(dest.data(),dest.size());
+  }
+#endif
+#ifdef SSH_CPP_STRING_VIEW
+  ssize_t write(std::string_view data){
+    return write(data.data(),data.size());
+  }
+  Result tryWrite(std::string_view data) noexcept {
+    return tryWrite(data.data(),data.size());
+  }
+#endif
+  /** @brief Downloads the file from the current offset to its end, with
+   * several reads in flight
+   * @param[in] fd local file descriptor written to
+   * @param[in] requests reads in flight, 0 for the default
+   * @param[in] chunk_size bytes per read, 0 for the default
+   * @returns the number of bytes downloaded
+   * @throws SshException on error
+   * @see sftp_download
+   */
+  int64_t download(int fd, uint32_t requests=0, uint32_t chunk_size=0){
+    struct sftp_download_sink_struct sink;
+    struct sftp_download_options_struct opts;
+    int64_t ret;
+
+    sink.fd=fd;
+    sink.write_function=NULL;
+    sink.userdata=NULL;
+    opts.requests=requests;
+    opts.chunk_size=chunk_size;
+    ret=sftp_download(file,&sink,&opts);
+    ssh_throw_negative(ret);
+    return ret;
+  }
+  /** @brief Downloads the file as download(int) does, the data going to a
+   * callback in file order
+   * @see sftp_download
+   */
+  int64_t download(sftp_download_callback cb, void *userdata,
+      uint32_t requests=0, uint32_t chunk_size=0){
+    struct sftp_download_sink_struct sink;
+    struct sftp_download_options_struct opts;
+    int64_t ret;
+
+    sink.fd=-1;
+    sink.write_function=cb;
+    sink.userdata=userdata;
+    opts.requests=requests;
+    opts.chunk_size=chunk_size;
+    ret=sftp_download(file,&sink,&opts);
+    ssh_throw_negative(ret);
+    return ret;
+  }
+  /** @brief Uploads a local file from the current offset, with several
+   * writes in flight
+   * @param[in] fd local file descriptor read until its end
+   * @param[in] requests writes in flight, 0 for the default
+   * @param[in] chunk_size bytes per write, 0 for the default
+   * @returns the number of bytes uploaded
+   * @throws SshException on error
+   * @see sftp_upload
+   */
+  int64_t upload(int fd, uint32_t requests=0, uint32_t chunk_size=0){
+    struct sftp_upload_source_struct source;
+    struct sftp_upload_options_struct opts;
+    int64_t ret;
+
+    source.fd=fd;
+    source.read_function=NULL;
+    source.userdata=NULL;
+    opts.requests=requests;
+    opts.chunk_size=chunk_size;
+    ret=sftp_upload(&source,file,&opts);
+    ssh_throw_negative(ret);
+    return ret;
+  }
+  /** @brief Uploads as upload(int) does, the data coming from a callback
+   * @see sftp_upload
+   */
+  int64_t upload(sftp_upload_callback cb, void *userdata,
+      uint32_t requests=0, uint32_t chunk_size=0){
+    struct sftp_upload_source_struct source;
+    struct sftp_upload_options_struct opts;
+    int64_t ret;
+
+    source.fd=-1;
+    source.read_function=cb;
+    source.userdata=userdata;
+    opts.requests=requests;
+    opts.chunk_size=chunk_size;
+    ret=sftp_upload(&source,file,&opts);
+    ssh_throw_negative(ret);
+    return ret;
+  }
+  void_throwable seek(uint64_t offset){
+    ssh_throw(sftp_seek64(file,offset));
+    return_throwable;
+  }
+  uint64_t tell(){
+    return sftp_tell64(file);
+  }
+  Sftp &getSftp(){
+    return *sftp;
+  }
+  /** @brief returns the underlying file, NULL if not open */
+  sftp_file getCFile(){
+    return file;
+  }
+private:
+  ssh_session getCSession(){
+    return sftp->getCSession();
+  }
+  Sftp *sftp;
+  sftp_file file;
+  /* No copy and no = operator */
+  SftpFile(const SftpFile &);
+  SftpFile &operator=(const SftpFile &);
+};
+
 } // namespace ssh
 
 /** @} */
@@ -0,0 +1,530 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef LIBSSHPP_CORO_HPP_
+#define LIBSSHPP_CORO_HPP_
+
+/**
+ * @defgroup ssh_cpp_coro The libssh C++20 coroutines
+ * @ingroup ssh_cpp
+ *
+ * The calls of the nonblocking sessions, which return SSH_AGAIN until they
+ * are done, as coroutines. A ssh::coro::Scheduler runs the tasks on one
+ * thread: a task awaiting a call is suspended until the call is done, the
+ * sessions being polled together by a ssh::Event in the meantime.
+ *
+ * @code
+ * ssh::coro::Task<> run(ssh::coro::Scheduler &sched, ssh::Session &session){
+ *   ssh::Channel channel(session);
+ *   char buf[4096];
+ *
+ *   if(!(co_await sched.connect(session)).ok() ||
+ *      (co_await sched.userauthAutopubkey(session)).value() != SSH_AUTH_SUCCESS ||
+ *      !(co_await sched.openSession(channel)).ok())
+ *     co_return;
+ *   ...
+ *   for(;;){
+ *     ssh::Result r = co_await sched.read(channel, buf, sizeof(buf));
+ *     if(!r.ok() || r.value() == 0)
+ *       break;
+ *     ...
+ *   }
+ * }
+ *
+ * ssh::coro::Scheduler sched;
+ * sched.spawn(run(sched, session1));
+ * sched.spawn(run(sched, session2));
+ * sched.run();
+ * @endcode
+ *
+ * The calls return a ssh::Result and don't throw. The sessions are put in
+ * nonblocking mode by connect(). sftp_init() and sftp_open() still block
+ * for their round trip, the reads and writes of a SftpFile don't.
+ * @{
+ */
+
+#include <libssh/libsshpp.hpp>
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define SSH_CPP_COROUTINES
+#endif
+#endif
+
+#ifdef SSH_CPP_COROUTINES
+
+#include <coroutine>
+#include <exception>
+#include <list>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace ssh {
+namespace coro {
+
+class Scheduler;
+
+namespace detail {
+
+struct PromiseBase {
+  std::coroutine_handle<> continuation;
+#ifdef __cpp_exceptions
+  std::exception_ptr exception;
+#endif
+
+  std::suspend_always initial_suspend() noexcept {
+    return {};
+  }
+  /* back to the task awaiting this one, if any */
+  struct FinalAwaiter {
+    bool await_ready() noexcept {
+      return false;
+    }
+    template<typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      std::coroutine_handle<> continuation = h.promise().continuation;
+      if(continuation)
+        return continuation;
+      return std::noop_coroutine();
+    }
+    void await_resume() noexcept {
+    }
+  };
+  FinalAwaiter final_suspend() noexcept {
+    return {};
+  }
+  void unhandled_exception() noexcept {
+#ifdef __cpp_exceptions
+    exception = std::current_exception();
+#else
+    std::terminate();
+#endif
+  }
+  void rethrow(){
+#ifdef __cpp_exceptions
+    if(exception)
+      std::rethrow_exception(exception);
+#endif
+  }
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+  std::optional<T> value;
+
+  void return_value(T v){
+    value.emplace(std::move(v));
+  }
+  T result(){
+    rethrow();
+    return std::move(*value);
+  }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+  void return_void() noexcept {
+  }
+  void result(){
+    rethrow();
+  }
+};
+
+/* a call suspended until the scheduler finds it done */
+class Waiter {
+public:
+  virtual ~Waiter(){
+  }
+  /* returns true once the call is done */
+  virtual bool attempt() = 0;
+  std::coroutine_handle<> handle;
+};
+
+} // namespace detail
+
+/** @brief A coroutine returning a T, started when it is awaited or spawned
+ * on a Scheduler.
+ */
+template<typename T = void>
+class Task {
+public:
+  struct promise_type : detail::Promise<T> {
+    Task get_return_object(){
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  };
+
+  Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)){
+  }
+  Task &operator=(Task &&other) noexcept {
+    if(this != &other){
+      if(handle)
+        handle.destroy();
+      handle=std::exchange(other.handle, nullptr);
+    }
+    return *this;
+  }
+  ~Task(){
+    if(handle)
+      handle.destroy();
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+
+  bool done() const {
+    return !handle || handle.done();
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+      noexcept {
+    handle.promise().continuation=awaiting;
+    return handle;
+  }
+  T await_resume(){
+    return handle.promise().result();
+  }
+
+private:
+  friend class Scheduler;
+  explicit Task(std::coroutine_handle<promise_type> h) : handle(h){
+  }
+  std::coroutine_handle<promise_type> handle;
+};
+
+/** @brief A call retried by the Scheduler until it returns something else
+ * than SSH_AGAIN.
+ */
+template<typename F>
+class Call : private detail::Waiter {
+public:
+  Call(Scheduler &sched, ssh_session session, F f)
+    : sched(sched), session(session), f(std::move(f)), result(SSH_AGAIN){
+  }
+  bool await_ready(){
+    return attempt();
+  }
+  void await_suspend(std::coroutine_handle<> h);
+  Result await_resume() noexcept {
+    return Result(session, result);
+  }
+private:
+  bool attempt() override {
+    result=f();
+    return result != SSH_AGAIN;
+  }
+  Scheduler &sched;
+  ssh_session session;
+  F f;
+  int64_t result;
+};
+
+/** @brief the ssh::coro::Scheduler runs Tasks on one thread, polling their
+ * sessions with an ssh::Event.
+ *
+ * After each poll, every suspended call is tried again, so a poll costs
+ * one nonblocking call per suspended task.
+ */
+class Scheduler {
+public:
+  Scheduler(){
+  }
+  ~Scheduler(){
+    /* the waiters live in the frames of the tasks */
+    waiting.clear();
+    tasks.clear();
+  }
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  /** @brief returns the event polling the sessions, to add file
+   * descriptors or timers of the program
+   */
+  Event &getEvent(){
+    return event;
+  }
+
+  /** @brief adds a task, started by run() */
+  void spawn(Task<> task){
+    ready.push_back(task.handle);
+    tasks.push_back(std::move(task));
+  }
+
+  /** @brief runs the tasks until they are all done
+   * @param[in] timeout the longest a poll waits in ms, -1 for no limit
+   * @returns SSH_OK when the tasks are done, SSH_AGAIN if a poll with a
+   * timeout woke none of them, SSH_ERROR if the poll failed or the tasks
+   * left wait on something else than the scheduler
+   * @throws the exception a spawned task ended with
+   */
+  int run(int timeout=-1){
+    std::vector<detail::Waiter *> attempted;
+    std::vector<std::coroutine_handle<> > resumed;
+    int rc;
+
+    for(;;){
+      while(!ready.empty()){
+        resumed.swap(ready);
+        for(std::coroutine_handle<> h : resumed)
+          h.resume();
+        resumed.clear();
+      }
+      if(reap() == 0)
+        return SSH_OK;
+      if(waiting.empty())
+        return SSH_ERROR;
+
+      rc=event.dopoll(timeout);
+      if(rc == SSH_ERROR)
+        return rc;
+      attempted.swap(waiting);
+      for(detail::Waiter *w : attempted){
+        if(w->attempt())
+          ready.push_back(w->handle);
+        else
+          waiting.push_back(w);
+      }
+      attempted.clear();
+      if(ready.empty() && timeout >= 0)
+        return SSH_AGAIN;
+    }
+  }
+
+  /** @brief any nonblocking call of the session, returning SSH_AGAIN until
+   * it is done
+   */
+  template<typename F>
+  Call<F> call(Session &session, F f){
+    return Call<F>(*this, session.getCSession(), std::move(f));
+  }
+
+  /** @brief connects the session in nonblocking mode and polls it
+   * @see ssh_connect
+   */
+  auto connect(Session &session){
+    ssh_session s=session.getCSession();
+    ssh_event e=event.getCEvent();
+    bool added=false;
+
+    ssh_set_blocking(s, 0);
+    return call(session, [s, e, added]() mutable -> int64_t {
+      int rc=ssh_connect(s);
+      if(rc != SSH_ERROR && !added){
+        if(ssh_event_add_session(e, s) == SSH_ERROR)
+          return SSH_ERROR;
+        added=true;
+      }
+      return rc;
+    });
+  }
+  /** @returns SSH_AUTH_SUCCESS, SSH_AUTH_PARTIAL, SSH_AUTH_DENIED,
+   * SSH_ERROR
+   * @see ssh_userauth_none
+   */
+  auto userauthNone(Session &session){
+    ssh_session s=session.getCSession();
+    return call(session, [s]() -> int64_t {
+      return auth(ssh_userauth_none(s, NULL));
+    });
+  }
+  /** @see ssh_userauth_password */
+  auto userauthPassword(Session &session, const char *password){
+    ssh_session s=session.getCSession();
+    return call(session, [s, password]() -> int64_t {
+      return auth(ssh_userauth_password(s, NULL, password));
+    });
+  }
+  /** @see ssh_userauth_autopubkey */
+  auto userauthAutopubkey(Session &session){
+    ssh_session s=session.getCSession();
+    return call(session, [s]() -> int64_t {
+      return auth(ssh_userauth_autopubkey(s, NULL));
+    });
+  }
+  /** @see ssh_channel_open_session */
+  auto openSession(Channel &channel){
+    ssh_channel c=channel.getCChannel();
+    return call(channel.getSession(), [c]() -> int64_t {
+      return ssh_channel_open_session(c);
+    });
+  }
+  /** @see ssh_channel_request_exec */
+  auto requestExec(Channel &channel, const char *cmd){
+    ssh_channel c=channel.getCChannel();
+    return call(channel.getSession(), [c, cmd]() -> int64_t {
+      return ssh_channel_request_exec(c, cmd);
+    });
+  }
+  /** @brief reads what the channel has, waiting for some data
+   * @returns the number of bytes read, 0 at EOF, SSH_ERROR
+   * @see ssh_channel_read_nonblocking
+   */
+  auto read(Channel &channel, void *dest, size_t count, bool is_stderr=false){
+    ssh_channel c=channel.getCChannel();
+    if(count > 0x7fffffff)
+      count=0x7fffffff;
+    return call(channel.getSession(),
+        [c, dest, count, is_stderr]() -> int64_t {
+      int rc=ssh_channel_read_nonblocking(c, dest, count, is_stderr);
+      if(rc == 0 && !ssh_channel_is_eof(c))
+        return SSH_AGAIN;
+      return rc;
+    });
+  }
+  /** @brief writes all the data, as the window of the peer lets it in
+   * @returns len, SSH_ERROR
+   * @see ssh_channel_write
+   */
+  auto write(Channel &channel, const void *data, size_t len){
+    ssh_channel c=channel.getCChannel();
+    size_t done=0;
+    return call(channel.getSession(),
+        [c, data, len, done]() mutable -> int64_t {
+      while(done < len){
+        uint32_t window=ssh_channel_window_size(c);
+        size_t n=len - done;
+        int rc;
+
+        if(window == 0)
+          return SSH_AGAIN;
+        if(n > window)
+          n=window;
+        rc=ssh_channel_write(c, (const char *) data + done, n);
+        if(rc == SSH_ERROR)
+          return SSH_ERROR;
+        done+=rc;
+      }
+      return len;
+    });
+  }
+  /** @brief reads one chunk of the file, at most SFTP_DOWNLOAD_CHUNK_SIZE
+   * bytes
+   * @returns the number of bytes read, 0 at EOF, SSH_ERROR
+   * @see sftp_async_read
+   */
+  auto read(SftpFile &file, void *dest, size_t count){
+    sftp_file f=file.getCFile();
+    int64_t id=-1;
+
+    if(count > SFTP_DOWNLOAD_CHUNK_SIZE)
+      count=SFTP_DOWNLOAD_CHUNK_SIZE;
+    if(f != NULL)
+      sftp_file_set_nonblocking(f);
+    return call(file.getSftp().getSession(),
+        [f, dest, count, id]() mutable -> int64_t {
+      int rc;
+
+      if(f == NULL)
+        return SSH_ERROR;
+      if(id < 0){
+        id=sftp_async_read_begin(f, count);
+        if(id < 0)
+          return SSH_ERROR;
+      }
+      rc=sftp_async_read(f, dest, count, id);
+      return rc < 0 && rc != SSH_AGAIN ? SSH_ERROR : rc;
+    });
+  }
+  /** @brief writes all the data, one chunk of SFTP_UPLOAD_CHUNK_SIZE bytes
+   * after the other
+   * @returns len, SSH_ERROR
+   * @see sftp_async_write_begin
+   */
+  auto write(SftpFile &file, const void *data, size_t len){
+    sftp_file f=file.getCFile();
+    int64_t id=-1;
+    size_t done=0;
+    size_t n=0;
+
+    if(f != NULL)
+      sftp_file_set_nonblocking(f);
+    return call(file.getSftp().getSession(),
+        [f, data, len, id, done, n]() mutable -> int64_t {
+      int rc;
+
+      if(f == NULL)
+        return SSH_ERROR;
+      while(done < len){
+        if(id < 0){
+          n=len - done;
+          if(n > SFTP_UPLOAD_CHUNK_SIZE)
+            n=SFTP_UPLOAD_CHUNK_SIZE;
+          id=sftp_async_write_begin(f, (const char *) data + done, n);
+          if(id < 0)
+            return SSH_ERROR;
+        }
+        rc=sftp_async_write_end(f, id);
+        if(rc == SSH_AGAIN)
+          return SSH_AGAIN;
+        if(rc != SSH_OK)
+          return SSH_ERROR;
+        id=-1;
+        done+=n;
+      }
+      return len;
+    });
+  }
+
+private:
+  template<typename F> friend class Call;
+
+  static int64_t auth(int rc){
+    return rc == SSH_AUTH_AGAIN ? SSH_AGAIN : rc;
+  }
+  void wait(detail::Waiter *w){
+    waiting.push_back(w);
+  }
+  /* drops the tasks done, returns the number left */
+  size_t reap(){
+    std::list<Task<> >::iterator it=tasks.begin();
+
+    while(it != tasks.end()){
+      if(it->done()){
+        Task<> task=std::move(*it);
+        it=tasks.erase(it);
+        task.handle.promise().result();
+      } else {
+        ++it;
+      }
+    }
+    return tasks.size();
+  }
+
+  Event event;
+  std::list<Task<> > tasks;
+  std::vector<std::coroutine_handle<> > ready;
+  std::vector<detail::Waiter *> waiting;
+};
+
+template<typename F>
+void Call<F>::await_suspend(std::coroutine_handle<> h){
+  handle=h;
+  sched.wait(this);
+}
+
+} // namespace coro
+} // namespace ssh
+
+#endif /* SSH_CPP_COROUTINES */
+
+/** @} */
+#endif /* LIBSSHPP_CORO_HPP_ */
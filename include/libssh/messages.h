@@ -94,6 +94,9 @@ SSH_PACKET_CALLBACK(ssh_packet_global_request);
 int ssh_message_handle_channel_request(ssh_session session, ssh_channel channel, ssh_buffer packet,
     const char *request, uint8_t want_reply);
 void ssh_message_queue(ssh_session session, ssh_message message);
+int ssh_message_channel_request_open_reply_failure(ssh_message msg,
+    uint32_t reason);
 ssh_message ssh_message_pop_head(ssh_session session);
+void ssh_message_auth_pending_free(ssh_session session);
 
 #endif /* MESSAGES_H_ */
@@ -30,6 +30,7 @@ int ssh_file_readaccess_ok(const char *file);
 
 char *ssh_path_expand_tilde(const char *d);
 char *ssh_path_expand_escape(ssh_session session, const char *s);
+int ssh_path_name_valid(const char *name);
 int ssh_analyze_banner(ssh_session session, int server, int *ssh1, int *ssh2);
 int ssh_is_ipaddr_v4(const char *str);
 int ssh_is_ipaddr(const char *str);
@@ -40,13 +41,19 @@ uint64_t ntohll(uint64_t);
 
 /* list processing */
 
+/* the nodes a list keeps for its next elements once they are removed */
+#define SSH_LIST_SPARE 16
+
 struct ssh_list {
   struct ssh_iterator *root;
   struct ssh_iterator *end;
+  struct ssh_iterator *spare; /* free nodes, linked by next */
+  unsigned int nspare;
 };
 
 struct ssh_iterator {
   struct ssh_iterator *next;
+  struct ssh_iterator *prev; /* so that removing is O(1) */
   const void *data;
 };
 
@@ -58,6 +65,8 @@ int ssh_list_prepend(struct ssh_list *list, const void *data);
 void ssh_list_remove(struct ssh_list *list, struct ssh_iterator *iterator);
 char *ssh_lowercase(const char* str);
 char *ssh_hostport(const char *host, int port);
+uint64_t ssh_timestamp_ms(void);
+uint64_t ssh_timestamp_us(void);
 
 const void *_ssh_list_pop_head(struct ssh_list *list);
 
@@ -41,6 +41,14 @@ enum ssh_packet_state_e {
 };
 
 int packet_send(ssh_session session);
+int packet_flush_held(ssh_session session);
+int packet_send_payload(ssh_session session, const void *header,
+    uint32_t header_len, const void *data, uint32_t len);
+/* writes len bytes of data at dest, returns 0, or -1 not to send them */
+typedef int (*packet_fill_callback)(void *dest, uint32_t len, void *userdata);
+int packet_send_payload_fill(ssh_session session, const void *header,
+    uint32_t header_len, uint32_t len, packet_fill_callback fill,
+    void *userdata);
 
 #ifdef WITH_SSH1
 int packet_send1(ssh_session session) ;
@@ -7,8 +7,6 @@
 #ifdef WITH_PCAP
 typedef struct ssh_pcap_context_struct* ssh_pcap_context;
 
-int ssh_pcap_file_write_packet(ssh_pcap_file pcap, ssh_buffer packet, uint32_t original_len);
-
 ssh_pcap_context ssh_pcap_context_new(ssh_session session);
 void ssh_pcap_context_free(ssh_pcap_context ctx);
 
@@ -0,0 +1,69 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+/* pipeline.c: the AEAD packets of a session encrypted by a crypto pool */
+
+#include "libssh/priv.h"
+
+/* the packets encrypted or decrypted at once */
+#define PIPELINE_BATCH 64
+
+struct pipeline_packet {
+  uint32_t offset; /* of the packet in the data of the batch */
+  uint32_t len; /* sent: all of it, received: what follows the length */
+  uint32_t plain; /* received: offset of the decrypted packet */
+  uint32_t seq;
+  int ok; /* received: authenticated and decrypted */
+};
+
+struct ssh_pipeline_struct {
+  ssh_crypto_pool pool;
+  int depth; /* nested pipeline_begin() */
+  /* the packets built and not encrypted yet, with room for their tags */
+  ssh_buffer out;
+  struct pipeline_packet out_packets[PIPELINE_BATCH];
+  unsigned int out_count;
+  /* the packets of the received data decrypted in advance */
+  const unsigned char *in_data;
+  ssh_buffer in_plain;
+  struct pipeline_packet in_packets[PIPELINE_BATCH];
+  unsigned int in_count;
+  unsigned int in_next;
+};
+
+typedef void (*crypto_pool_job_callback)(void *userdata);
+
+int crypto_pool_post(ssh_crypto_pool pool, ssh_event event,
+    crypto_pool_job_callback run, ssh_event_task_callback done,
+    void *userdata);
+void pipeline_begin(ssh_session session);
+int pipeline_end(ssh_session session);
+int pipeline_flush(ssh_session session);
+unsigned char *pipeline_reserve(ssh_session session, uint32_t len);
+int pipeline_commit(ssh_session session, uint32_t len, uint32_t maclen);
+int pipeline_receive(ssh_session session, const void *data, size_t len);
+int pipeline_take(ssh_session session, const void *packet, uint32_t len,
+    void *payload);
+void pipeline_received(ssh_session session);
+void pipeline_free(ssh_session session);
+
+#endif /* PIPELINE_H_ */
@@ -22,6 +22,8 @@
 #ifndef PKI_H_
 #define PKI_H_
 
+#include "libssh/ed25519.h"
+
 #define SSH_KEY_FLAG_EMPTY 0
 #define SSH_KEY_FLAG_PUBLIC  1
 #define SSH_KEY_FLAG_PRIVATE 2
@@ -37,6 +39,10 @@ struct ssh_key_struct {
     DSA *dsa;
     RSA *rsa;
 #endif
+#ifdef HAVE_ECDSA
+    EC_KEY *ecdsa;
+#endif
+    unsigned char ed25519[ED25519_PRIVKEY_SIZE];
 };
 
 ssh_key ssh_key_new (void);
@@ -120,6 +120,16 @@ int ssh_poll(ssh_pollfd_t *fds, nfds_t nfds, int timeout);
 typedef struct ssh_poll_ctx_struct *ssh_poll_ctx;
 typedef struct ssh_poll_handle_struct *ssh_poll_handle;
 
+/* How a poll context waits for the events */
+enum ssh_poll_backend_e {
+  SSH_POLL_BACKEND_AUTO = 0,
+  SSH_POLL_BACKEND_POLL,
+  SSH_POLL_BACKEND_EPOLL,
+  SSH_POLL_BACKEND_KQUEUE,
+  SSH_POLL_BACKEND_IO_URING,
+  SSH_POLL_BACKEND_IOCP
+};
+
 /**
  * @brief SSH poll callback. This callback will be used when an event
  *                      caught on the socket.
@@ -139,6 +149,8 @@ typedef int (*ssh_poll_callback)(ssh_poll_handle p, socket_t fd, int revents,
 ssh_poll_handle ssh_poll_new(socket_t fd, short events, ssh_poll_callback cb,
     void *userdata);
 void ssh_poll_free(ssh_poll_handle p);
+void ssh_poll_set_owner(ssh_poll_handle p, ssh_poll_handle *owner);
+void ssh_polls_move(ssh_poll_handle polls, ssh_poll_ctx ctx);
 ssh_poll_ctx ssh_poll_get_ctx(ssh_poll_handle p);
 short ssh_poll_get_events(ssh_poll_handle p);
 void ssh_poll_set_events(ssh_poll_handle p, short events);
@@ -147,12 +159,18 @@ void ssh_poll_remove_events(ssh_poll_handle p, short events);
 socket_t ssh_poll_get_fd(ssh_poll_handle p);
 void ssh_poll_set_fd(ssh_poll_handle p, socket_t fd);
 void ssh_poll_set_callback(ssh_poll_handle p, ssh_poll_callback cb, void *userdata);
+void ssh_poll_set_edge_triggered(ssh_poll_handle p, int enable);
 ssh_poll_ctx ssh_poll_ctx_new(size_t chunk_size);
 void ssh_poll_ctx_free(ssh_poll_ctx ctx);
+int ssh_poll_ctx_set_backend(ssh_poll_ctx ctx, enum ssh_poll_backend_e type);
+enum ssh_poll_backend_e ssh_poll_ctx_get_backend(ssh_poll_ctx ctx);
 int ssh_poll_ctx_add(ssh_poll_ctx ctx, ssh_poll_handle p);
 int ssh_poll_ctx_add_socket (ssh_poll_ctx ctx, struct ssh_socket_struct *s);
 void ssh_poll_ctx_remove(ssh_poll_ctx ctx, ssh_poll_handle p);
+int ssh_poll_ctx_index_fds(ssh_poll_ctx ctx);
+ssh_poll_handle ssh_poll_ctx_find_fd(ssh_poll_ctx ctx, socket_t fd);
 int ssh_poll_ctx_dopoll(ssh_poll_ctx ctx, int timeout);
+struct ssh_timer_wheel *ssh_poll_ctx_get_timers(ssh_poll_ctx ctx);
 ssh_poll_ctx ssh_poll_get_default_ctx(ssh_session session);
 
 #endif /* POLL_H_ */
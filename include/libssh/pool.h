@@ -0,0 +1,41 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+/* pool.c: free lists of the buffer and string objects */
+
+enum ssh_pool_e {
+  SSH_POOL_BUFFER,
+  SSH_POOL_STRING_SMALL,
+  SSH_POOL_STRING_LARGE,
+  SSH_POOL_MAX
+};
+
+/* capacity of the pooled strings, and data kept with the pooled buffers */
+#define SSH_POOL_STRING_SMALL_SIZE 64
+#define SSH_POOL_STRING_LARGE_SIZE 512
+#define SSH_POOL_BUFFER_DATA_SIZE 4096
+
+void *ssh_pool_get(enum ssh_pool_e type);
+int ssh_pool_put(enum ssh_pool_e type, void *obj);
+void ssh_pool_finalize(void);
+
+#endif /* POOL_H_ */
@@ -116,6 +116,7 @@ extern "C" {
 typedef struct kex_struct {
 	unsigned char cookie[16];
 	char **methods;
+	int first_kex_follows; /* a guessed key exchange packet follows */
 } KEX;
 
 struct error_struct {
@@ -149,6 +150,7 @@ SSH_PACKET_CALLBACK(ssh_packet_service_accept);
 
 /* config.c */
 int ssh_config_parse_file(ssh_session session, const char *filename);
+void ssh_config_finalize(void);
 
 /* errors.c */
 void ssh_set_error(void *error, int code, const char *descr, ...) PRINTF_ATTRIBUTE(3, 4);
@@ -158,11 +160,14 @@ void ssh_set_error_invalid(void *, const char *);
 /* in crypt.c */
 uint32_t packet_decrypt_len(ssh_session session,char *crypted);
 int packet_decrypt(ssh_session session, void *packet,unsigned int len);
+int packet_decrypt_to(ssh_session session, void *dest, void *src,
+    uint32_t len);
 unsigned char *packet_encrypt(ssh_session session,void *packet,unsigned int len);
  /* it returns the hmac buffer if exists*/
 struct ssh_poll_handle_struct;
 
-int packet_hmac_verify(ssh_session session,ssh_buffer buffer,unsigned char *mac);
+int packet_hmac_verify(ssh_session session, const void *data, uint32_t len,
+    unsigned char *mac);
 
 struct ssh_socket_struct;
 
@@ -172,10 +177,50 @@ void ssh_packet_set_callbacks(ssh_session session, ssh_packet_callbacks callback
 void ssh_packet_set_default_callbacks(ssh_session session);
 void ssh_packet_process(ssh_session session, uint8_t type);
 /* connect.c */
+/* RFC 8305 connection attempt delay, in milliseconds */
+#define SSH_CONNECT_ATTEMPT_DELAY 250
+/* number of connection attempts running at once */
+#define SSH_CONNECT_ATTEMPTS_MAX 8
+struct ssh_connect_attempts;
+struct addrinfo;
 socket_t ssh_connect_host(ssh_session session, const char *host,const char
         *bind_addr, int port, long timeout, long usec);
-socket_t ssh_connect_host_nonblocking(ssh_session session, const char *host,
-		const char *bind_addr, int port);
+struct ssh_connect_attempts *ssh_connect_attempts_new(ssh_session session,
+    const struct addrinfo *ai, int port, const char *bind_addr);
+struct ssh_connect_attempts *ssh_connect_attempts_resolve(ssh_session session,
+    const char *host, int port, const char *bind_addr);
+void ssh_connect_attempts_free(struct ssh_connect_attempts *attempts);
+int ssh_connect_attempts_left(struct ssh_connect_attempts *attempts);
+socket_t ssh_connect_attempts_next(ssh_session session,
+    struct ssh_connect_attempts *attempts);
+int ssh_connect_attempt_error(socket_t s);
+int ssh_connect_socket_close(socket_t s);
+/* the keys are renewed after 1GB, RFC 4253 section 9 */
+#define SSH_REKEY_DATA_DEFAULT (1ULL << 30)
+/* and at the latest after 2^31 packets, RFC 4344 section 3.1 */
+#define SSH_REKEY_PACKETS_MAX (1UL << 31)
+/* keepalives left unanswered before the peer is dead, like OpenSSH */
+#define SSH_KEEPALIVE_MAX_DEFAULT 3
+/* default size of the local window of a channel */
+#define SSH_CHANNEL_WINDOW_DEFAULT 128000
+/* an adjust is sent when the window falls under this percentage */
+#define SSH_CHANNEL_WINDOW_THRESHOLD_DEFAULT 50
+/* default and largest max packet size of a channel, room is left for the
+ * headers and the padding within MAX_PACKET_LEN */
+#define SSH_CHANNEL_MAXPACKET_DEFAULT 32000
+#define SSH_CHANNEL_MAXPACKET_MAX (MAX_PACKET_LEN - 1024)
+/* socket options of the TCP connections, 0 keeps the system default */
+struct ssh_tcp_options {
+  int nodelay;
+  int sndbuf;
+  int rcvbuf;
+  int keepalive; /* idle seconds before the probes */
+  int notsent_lowat;
+};
+void ssh_tcp_options_profile(struct ssh_tcp_options *tcp, uint32_t *window,
+    int profile);
+int ssh_sock_set_buffers(socket_t s, const struct ssh_tcp_options *tcp);
+int ssh_sock_set_options(socket_t s, const struct ssh_tcp_options *tcp);
 void ssh_sock_set_nonblocking(socket_t sock);
 void ssh_sock_set_blocking(socket_t sock);
 
@@ -184,6 +229,14 @@ extern const char *ssh_kex_nums[];
 int ssh_send_kex(ssh_session session, int server_kex);
 void ssh_list_kex(ssh_session session, KEX *kex);
 int set_kex(ssh_session session);
+int ssh_kex_set_type(ssh_session session, const char *name);
+int ssh_set_client_kex(ssh_session session);
+int ssh_kex_select_methods(ssh_session session);
+int ssh_kex_guess_right(ssh_session session);
+void ssh_kex_free_methods(KEX *kex);
+int ssh_kex_next_crypto(ssh_session session);
+void ssh_kex_rekey_check(ssh_session session);
+int ssh_kex_newkeys(ssh_session session);
 int verify_existing_algo(int algo, const char *name);
 char **space_tokenize(const char *chain);
 int ssh_get_kex1(ssh_session session);
@@ -195,18 +248,36 @@ ssh_buffer base64_to_bin(const char *source);
 unsigned char *bin_to_base64(const unsigned char *source, int len);
 
 /* gzip.c */
+struct ssh_crypto_struct;
 int compress_buffer(ssh_session session,ssh_buffer buf);
 int decompress_buffer(ssh_session session,ssh_buffer buf, size_t maxlen);
+int compress_start_delayed(ssh_session session);
+void compress_free(struct ssh_crypto_struct *crypto);
 
 /* crc32.c */
 uint32_t ssh_crc32(const char *buf, uint32_t len);
 
 
+/* authorized_keys.c */
+void ssh_authorized_keys_finalize(void);
+
+/* init.c */
+int ssh_init_once(void);
+
+/* known_hosts.c */
+void ssh_known_hosts_finalize(void);
+
 /* match.c */
+struct match_list;
 int match_hostname(const char *host, const char *pattern, unsigned int len);
+struct match_list *match_list_compile(const char *pattern, unsigned int len);
+int match_list_exec(const struct match_list *list, const char *string);
+void match_list_free(struct match_list *list);
 
 int message_handle(ssh_session session, void *user, uint8_t type, ssh_buffer packet);
 /* log.c */
+void ssh_log_event(ssh_session session, int verbosity, int event, ...);
+void ssh_log_ring_free(ssh_session session);
 
 /* misc.c */
 #ifdef _WIN32
@@ -219,9 +290,45 @@ int gettimeofday(struct timeval *__p, void *__t);
 #endif
 #endif
 
+/*
+ * The log calls above this verbosity are compiled out. The builds without
+ * WITH_DEBUG_LOGGING keep the protocol messages but drop the packet and
+ * function traces.
+ */
+#ifdef DEBUG_LOGGING
+#define SSH_LOG_MAX_VERBOSITY SSH_LOG_FUNCTIONS
+#else
+#define SSH_LOG_MAX_VERBOSITY SSH_LOG_PROTOCOL
+#endif
+
+/*
+ * Checks the verbosity of the session before calling ssh_log(), so that the
+ * disabled log calls of the packet paths don't evaluate their arguments.
+ */
+#define SSH_LOG(sess, verbosity, ...) \
+	do { \
+		if ((verbosity) <= SSH_LOG_MAX_VERBOSITY && \
+				(verbosity) <= (sess)->log_verbosity) { \
+			ssh_log((sess), (verbosity), __VA_ARGS__); \
+		} \
+	} while(0)
+
+/*
+ * Records a structured event with the unsigned int fields of the event, as
+ * listed in enum ssh_log_events_e.
+ */
+#define SSH_LOG_EVENT(sess, verbosity, ...) \
+	do { \
+		if ((verbosity) <= SSH_LOG_MAX_VERBOSITY && \
+				(verbosity) <= (sess)->log_verbosity) { \
+			ssh_log_event((sess), (verbosity), __VA_ARGS__); \
+		} \
+	} while(0)
+
 #define _enter_function(sess) \
 	do {\
-		if((sess)->log_verbosity >= SSH_LOG_FUNCTIONS){ \
+		if(SSH_LOG_FUNCTIONS <= SSH_LOG_MAX_VERBOSITY && \
+				(sess)->log_verbosity >= SSH_LOG_FUNCTIONS){ \
 			ssh_log((sess),SSH_LOG_FUNCTIONS,"entering function %s line %d in " __FILE__ , __FUNCTION__,__LINE__);\
 			(sess)->log_indent++; \
 		} \
@@ -229,7 +336,8 @@ int gettimeofday(struct timeval *__p, void *__t);
 
 #define _leave_function(sess) \
 	do { \
-		if((sess)->log_verbosity >= SSH_LOG_FUNCTIONS){ \
+		if(SSH_LOG_FUNCTIONS <= SSH_LOG_MAX_VERBOSITY && \
+				(sess)->log_verbosity >= SSH_LOG_FUNCTIONS){ \
 			(sess)->log_indent--; \
 			ssh_log((sess),SSH_LOG_FUNCTIONS,"leaving function %s line %d in " __FILE__ , __FUNCTION__,__LINE__);\
 		}\
@@ -0,0 +1,61 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef PROBES_H_
+#define PROBES_H_
+
+/*
+ * Static tracepoints of the provider "libssh", for systemtap, perf or
+ * bpftrace, for instance:
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libssh.so:libssh:packet_recv
+ *       { @[arg1] = count(); }'
+ *
+ * A probe is a nop instruction until a tracer attaches to it. Its arguments
+ * have to be cheap expressions, they are computed when the probe is passed.
+ * Without <sys/sdt.h>, or with WITH_PROBES turned off, the probes are
+ * compiled out.
+ *
+ *   packet_recv       session, type, length
+ *   packet_send       session, type, length
+ *   decrypt           session, length
+ *   encrypt           session, length
+ *   kex_init_recv     session, rekey
+ *   kex_init_send     session, rekey
+ *   kex_newkeys       session
+ *   channel_open      channel, local id, remote id
+ *   channel_close     channel, local id, remote id (close sent or received)
+ *   window_send       channel, new window
+ *   window_recv       channel, bytes added
+ *   sftp_send         sftp, type, length
+ *   sftp_reply        sftp, id, type
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define SSH_PROBE1(name, a) DTRACE_PROBE1(libssh, name, a)
+#define SSH_PROBE2(name, a, b) DTRACE_PROBE2(libssh, name, a, b)
+#define SSH_PROBE3(name, a, b, c) DTRACE_PROBE3(libssh, name, a, b, c)
+#else
+#define SSH_PROBE1(name, a) do {} while(0)
+#define SSH_PROBE2(name, a, b) do {} while(0)
+#define SSH_PROBE3(name, a, b, c) do {} while(0)
+#endif
+
+#endif /* PROBES_H_ */
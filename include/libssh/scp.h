@@ -46,6 +46,9 @@ struct ssh_scp_struct {
   char *request_name;
   char *warning;
   int request_mode;
+  int pipeline; /* the acknowledgments are collected later */
+  ssh_buffer output; /* pipelined data waiting for a large write */
+  uint32_t acks; /* pipelined acknowledgments still expected */
 };
 
 int ssh_scp_read_string(ssh_scp scp, char *buffer, size_t len);
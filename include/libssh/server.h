@@ -45,7 +45,23 @@ enum ssh_bind_options_e {
   SSH_BIND_OPTIONS_RSAKEY,
   SSH_BIND_OPTIONS_BANNER,
   SSH_BIND_OPTIONS_LOG_VERBOSITY,
-  SSH_BIND_OPTIONS_LOG_VERBOSITY_STR
+  SSH_BIND_OPTIONS_LOG_VERBOSITY_STR,
+  SSH_BIND_OPTIONS_TCP_PROFILE,
+  SSH_BIND_OPTIONS_TCP_NODELAY,
+  SSH_BIND_OPTIONS_TCP_SNDBUF,
+  SSH_BIND_OPTIONS_TCP_RCVBUF,
+  SSH_BIND_OPTIONS_TCP_KEEPALIVE,
+  SSH_BIND_OPTIONS_TCP_NOTSENT_LOWAT,
+  SSH_BIND_OPTIONS_CHANNEL_WINDOW,
+  SSH_BIND_OPTIONS_CHANNEL_WINDOW_MAX,
+  SSH_BIND_OPTIONS_CHANNEL_MAXPACKET,
+  SSH_BIND_OPTIONS_ECDSAKEY,
+  SSH_BIND_OPTIONS_ED25519KEY,
+  SSH_BIND_OPTIONS_REUSEPORT,
+  SSH_BIND_OPTIONS_MAX_UNAUTHENTICATED,
+  SSH_BIND_OPTIONS_RATE_LIMIT,
+  SSH_BIND_OPTIONS_RATE_BURST,
+  SSH_BIND_OPTIONS_LISTEN
 };
 
 typedef struct ssh_bind_struct* ssh_bind;
@@ -62,6 +78,22 @@ typedef struct ssh_bind_struct* ssh_bind;
 typedef void (*ssh_bind_incoming_connection_callback) (ssh_bind sshbind,
     void *userdata);
 
+/**
+ * @brief Admission callback. Called by ssh_bind_accept() for each connection
+ *        let in by the limits of the bind, before anything is sent to the
+ *        client.
+ * @param sshbind Current sshbind session handler
+ * @param address The numeric address of the client.
+ * @param port The port of the client.
+ * @param unauthenticated The sessions of the bind which aren't authenticated
+ *        yet, without this one.
+ * @param userdata Userdata to be passed to the callback function.
+ * @returns 0 to let the connection in, non-zero to close it.
+ */
+typedef int (*ssh_bind_admission_callback) (ssh_bind sshbind,
+    const char *address, int port, unsigned int unauthenticated,
+    void *userdata);
+
 /**
  * @brief These are the callbacks exported by the ssh_bind structure.
  *
@@ -72,6 +104,8 @@ struct ssh_bind_callbacks_struct {
   size_t size;
   /** A new connection is available. */
   ssh_bind_incoming_connection_callback incoming_connection;
+  /** A connection is about to be accepted. */
+  ssh_bind_admission_callback admission;
 };
 typedef struct ssh_bind_callbacks_struct *ssh_bind_callbacks;
 
@@ -111,6 +145,15 @@ LIBSSH_API ssh_bind ssh_bind_new(void);
  *                This specifies the file containing the private host dsa key
  *                used by SSHv2. (const char *).
  *
+ *              - SSH_BIND_OPTIONS_ECDSAKEY
+ *                This specifies the file containing the private host
+ *                ecdsa-sha2-nistp256 key used by SSHv2. (const char *).
+ *
+ *              - SSH_BIND_OPTIONS_ED25519KEY
+ *                This specifies the file containing the private host
+ *                ssh-ed25519 key used by SSHv2, in the OpenSSH format.
+ *                (const char *).
+ *
  *              - SSH_BIND_OPTIONS_BANNER
  *                That the server banner (version string) for SSH.
  *                (const char *).
@@ -139,6 +182,48 @@ LIBSSH_API ssh_bind ssh_bind_new(void);
  *                \n
  *                See the corresponding numbers in libssh.h.
  *
+ *              - SSH_BIND_OPTIONS_TCP_PROFILE, SSH_BIND_OPTIONS_TCP_NODELAY,
+ *                SSH_BIND_OPTIONS_TCP_SNDBUF, SSH_BIND_OPTIONS_TCP_RCVBUF,
+ *                SSH_BIND_OPTIONS_TCP_KEEPALIVE,
+ *                SSH_BIND_OPTIONS_TCP_NOTSENT_LOWAT,
+ *                SSH_BIND_OPTIONS_CHANNEL_WINDOW,
+ *                SSH_BIND_OPTIONS_CHANNEL_WINDOW_MAX,
+ *                SSH_BIND_OPTIONS_CHANNEL_MAXPACKET
+ *                The socket options and the channel window of the accepted
+ *                connections, see ssh_options_set().
+ *
+ *              - SSH_BIND_OPTIONS_REUSEPORT
+ *                Listen with SO_REUSEPORT (int, 0 or 1), so that several
+ *                binds, in threads or in the processes of ssh_bind_fork(),
+ *                listen on the same port and the kernel spreads the
+ *                connections between them. ssh_bind_listen() fails where
+ *                the system doesn't have it.
+ *
+ *              - SSH_BIND_OPTIONS_MAX_UNAUTHENTICATED
+ *                The sessions accepted and not authenticated yet (int, 0
+ *                for no limit, the default). ssh_bind_accept() closes the
+ *                connections above it.
+ *
+ *              - SSH_BIND_OPTIONS_RATE_LIMIT
+ *                The connections a second from one source (int, 0 for no
+ *                limit, the default). A source is an IPv4 address or an
+ *                IPv6 /64 network. ssh_bind_accept() closes the connections
+ *                above it.
+ *
+ *              - SSH_BIND_OPTIONS_RATE_BURST
+ *                The connections from one source let in at once by the rate
+ *                limit (int, the rate limit by default).
+ *
+ *              - SSH_BIND_OPTIONS_LISTEN
+ *                Add an address to listen on (const char *): "host:port",
+ *                "[ipv6]:port", "host" for the port of the bind, or the
+ *                path of a unix socket starting with '/'. Once an address
+ *                is added, SSH_BIND_OPTIONS_BINDADDR isn't listened on, and
+ *                SSH_BIND_OPTIONS_BINDPORT is the port of the addresses
+ *                without one. The sockets are polled together, and each
+ *                wakeup accepts the connections waiting on them at once.
+ *                ssh_bind_get_fd() gives the first one.
+ *
  * @param  value The value to set. This is a generic pointer and the
  *               datatype which is used should be set according to the
  *               type set.
@@ -157,6 +242,45 @@ LIBSSH_API int ssh_bind_options_set(ssh_bind sshbind,
  */
 LIBSSH_API int ssh_bind_listen(ssh_bind ssh_bind_o);
 
+/**
+ * @brief Read the host key files again without listening again.
+ *
+ * The sessions accepted afterwards use the new keys, the established ones
+ * keep theirs. The keys of the bind are replaced only if every file is read.
+ *
+ * @param  sshbind        The ssh server bind to use.
+ *
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_bind_reload_hostkeys(ssh_bind sshbind);
+
+#ifndef _WIN32
+/**
+ * @brief Fork the server into several processes accepting connections.
+ *
+ * Called after ssh_bind_listen(), and before any thread is started or the
+ * bind is polled. The host keys read by ssh_bind_listen() are shared by the
+ * processes, copied on write. Each child gets fresh entropy in its random
+ * generator and drops the key exchange pool it inherited.
+ *
+ * With SSH_BIND_OPTIONS_REUSEPORT, every child listens on a socket of its
+ * own on the same port, and the kernel spreads the connections. Otherwise
+ * the processes share the socket of the parent and the first one in
+ * ssh_bind_accept() gets the connection.
+ *
+ * The parent gets the exit of the children with waitpid().
+ *
+ * @param  sshbind        The ssh server bind, listening.
+ *
+ * @param  workers        The number of processes, including the parent.
+ *
+ * @return The number of the process: 0 in the parent, 1 to workers - 1 in
+ *         the children, SSH_ERROR on error (the children already forked go
+ *         on).
+ */
+LIBSSH_API int ssh_bind_fork(ssh_bind sshbind, unsigned int workers);
+#endif /* _WIN32 */
+
 /**
  * @brief Set the callback for this bind.
  *
@@ -183,6 +307,9 @@ LIBSSH_API int ssh_bind_set_callbacks(ssh_bind sshbind, ssh_bind_callbacks callb
 /**
  * @brief  Set the session to blocking/nonblocking mode.
  *
+ * A nonblocking bind accepts without waiting for a connection, and its
+ * sessions are nonblocking, see ssh_handle_key_exchange().
+ *
  * @param  ssh_bind_o     The ssh server bind to use.
  *
  * @param  blocking     Zero for nonblocking mode.
@@ -220,19 +347,93 @@ LIBSSH_API void ssh_bind_fd_toaccept(ssh_bind ssh_bind_o);
  * @param  ssh_bind_o     The ssh server bind to accept a connection.
  * @param  session			A preallocated ssh session
  * @see ssh_new
- * @return SSH_OK when a connection is established
+ * The connections over the limits of the bind, or refused by its admission
+ * callback, are closed before anything is sent, and the next one is
+ * accepted.
+ *
+ * @return SSH_OK when a connection is established, SSH_AGAIN if a
+ *         nonblocking bind has no connection waiting.
  */
 LIBSSH_API int ssh_bind_accept(ssh_bind ssh_bind_o, ssh_session session);
 
+/**
+ * @brief Initialize a session on a connection accepted by the caller.
+ *
+ * This is ssh_bind_accept() on a connection which didn't come from the
+ * socket of the bind, e.g. one end of a socketpair or a socket inherited
+ * from inetd. The bind only needs its host keys, read by ssh_bind_listen()
+ * or ssh_bind_reload_hostkeys(). The limits and the admission callback of
+ * the bind don't apply.
+ *
+ * @param  ssh_bind_o     The ssh server bind giving the options.
+ * @param  session        A preallocated ssh session
+ * @param  fd             The connection, owned by the session on success.
+ *
+ * @return SSH_OK on success, SSH_ERROR on error, fd being left open.
+ */
+LIBSSH_API int ssh_bind_accept_fd(ssh_bind ssh_bind_o, ssh_session session,
+    socket_t fd);
+
+/**
+ * @brief Add the listening sockets of a bind to an event.
+ *
+ * The incoming_connection callback of the bind is called by
+ * ssh_event_dopoll() when a connection waits, usually to accept it and to
+ * add its session to the event. With several SSH_BIND_OPTIONS_LISTEN
+ * addresses, it is called for each connection taken from a socket at the
+ * wakeup. ssh_event_remove_bind() removes them.
+ *
+ * @param  event          The ssh_event object.
+ * @param  ssh_bind_o     The ssh server bind, listening.
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_event_add_bind(ssh_event event, ssh_bind ssh_bind_o);
+
+/**
+ * @brief Remove the listening sockets of a bind from an event.
+ *
+ * With a single socket, ssh_event_remove_fd() with the descriptor of the
+ * bind does the same.
+ *
+ * @param  event          The ssh_event object.
+ * @param  ssh_bind_o     The ssh server bind.
+ * @return SSH_OK on success, SSH_ERROR if the bind wasn't in the event.
+ */
+LIBSSH_API int ssh_event_remove_bind(ssh_event event, ssh_bind ssh_bind_o);
+
 /**
  * @brief Handles the key exchange and set up encryption
  *
+ * A nonblocking session, e.g. from a nonblocking bind, gets SSH_AGAIN until
+ * the exchange is done: it goes on in ssh_event_dopoll() once the session is
+ * added to an event, and the server_kex_done_function callback tells when.
+ * The server_authenticated_function callback then tells when the user is
+ * authenticated.
+ *
  * @param  session			A connected ssh session
  * @see ssh_bind_accept
- * @return SSH_OK if the key exchange was successful
+ * @return SSH_OK if the key exchange was successful, SSH_AGAIN while a
+ *         nonblocking one goes on, SSH_ERROR on error.
  */
 LIBSSH_API int ssh_handle_key_exchange(ssh_session session);
 
+/**
+ * @brief Set the number of ephemeral keys computed in advance for each key
+ * exchange method.
+ *
+ * @param  keys         The number of keys to keep, 0 to disable the pool.
+ * @see ssh_kex_pool_refill
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_set_kex_pool_size(unsigned int keys);
+
+/**
+ * @brief Compute the ephemeral keys missing in the key exchange pool.
+ *
+ * @return The number of keys added, SSH_ERROR on error.
+ */
+LIBSSH_API int ssh_kex_pool_refill(void);
+
 /**
  * @brief Free a ssh servers bind.
  *
@@ -244,6 +445,43 @@ LIBSSH_API void ssh_bind_free(ssh_bind ssh_bind_o);
  * SERVER MESSAGING
  **********************************************************/
 
+/* the policies of ssh_message_set_policy() */
+enum ssh_message_policy_e {
+  /* parsed, and given to the callbacks or to ssh_message_get() */
+  SSH_MESSAGE_POLICY_CALLBACK=0,
+  /* refused as soon as it comes */
+  SSH_MESSAGE_POLICY_REJECT,
+  /* accepted as soon as it comes, with nothing done */
+  SSH_MESSAGE_POLICY_ACCEPT
+};
+
+/**
+ * @brief Set how the requests of a type are answered.
+ *
+ * The requests the server doesn't care about, like the x11 or env requests
+ * and the keepalives of the clients, may be answered at once: they are
+ * neither parsed nor allocated, and the callbacks and ssh_message_get()
+ * don't see them.
+ *
+ * @param[in] session   The server session.
+ *
+ * @param[in] type      SSH_REQUEST_CHANNEL_OPEN, SSH_REQUEST_CHANNEL or
+ *                      SSH_REQUEST_GLOBAL.
+ *
+ * @param[in] subtype   The type of channel, of channel request or of global
+ *                      request, as given by ssh_message_subtype(). The
+ *                      unknown ones share the policy of the subtype 0.
+ *
+ * @param[in] policy    A policy of enum ssh_message_policy_e. The channel
+ *                      opens and the tcpip-forward requests can't be
+ *                      accepted this way.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the policy isn't
+ *                      possible for the type.
+ */
+LIBSSH_API int ssh_message_set_policy(ssh_session session, int type,
+    int subtype, int policy);
+
 /**
  * @brief Reply with a standard reject message.
  *
@@ -288,6 +526,39 @@ LIBSSH_API int ssh_message_auth_reply_success(ssh_message msg,int partial);
 LIBSSH_API int ssh_message_auth_reply_pk_ok(ssh_message msg, ssh_string algo, ssh_string pubkey);
 LIBSSH_API int ssh_message_auth_reply_pk_ok_simple(ssh_message msg);
 
+/**
+ * @brief Check the public key of an authentication request against an
+ * authorized keys file.
+ *
+ * The file, in the format of the authorized_keys of OpenSSH, is parsed once
+ * and its keys are indexed: the next requests, of all the sessions, only
+ * look their key up. It is parsed again when its modification time or its
+ * size change.
+ *
+ * Of the options of a key, from="" is checked against the address of the
+ * client (not its host name) and command="" is given back. The other ones
+ * are left to the server.
+ *
+ * The signature is not checked: both the requests probing a key and the
+ * signed ones are accepted, see ssh_message_auth_publickey_state().
+ *
+ * @param[in]  msg      A message of type SSH_REQUEST_AUTH with the method
+ *                      SSH_AUTH_METHOD_PUBLICKEY.
+ *
+ * @param[in]  filename The authorized keys file of the user.
+ *
+ * @param[out] command  A pointer to store the command="" of the key, NULL if
+ *                      it has none. It has to be freed. May be NULL.
+ *
+ * @return              SSH_AUTH_SUCCESS if the key is authorized,
+ *                      SSH_AUTH_DENIED if it is not (a missing file has no
+ *                      key), SSH_AUTH_ERROR on error.
+ *
+ * @see ssh_message_auth_publickey()
+ */
+LIBSSH_API int ssh_message_auth_authorized_key(ssh_message msg,
+    const char *filename, char **command);
+
 LIBSSH_API int ssh_message_auth_set_methods(ssh_message msg, int methods);
 
 LIBSSH_API int ssh_message_auth_interactive_request(ssh_message msg,
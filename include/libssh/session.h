@@ -27,6 +27,8 @@
 #include "libssh/auth.h"
 #include "libssh/channels.h"
 #include "libssh/poll.h"
+#include "libssh/hostkey.h"
+#include "libssh/histogram.h"
 
 /* These are the different states a SSH session can be into its life */
 enum ssh_session_state_e {
@@ -50,6 +52,30 @@ enum ssh_dh_state_e {
   DH_STATE_FINISHED
 };
 
+/* the key re-exchanges, after the first key exchange */
+enum ssh_rekey_state_e {
+  SSH_REKEY_STATE_NONE=0,
+  /* ssh_rekey() was called, our SSH_MSG_KEXINIT is to be sent */
+  SSH_REKEY_STATE_INIT,
+  /* our SSH_MSG_KEXINIT is sent, the one of the peer is awaited */
+  SSH_REKEY_STATE_KEXINIT_SENT,
+  /* the peer started, our SSH_MSG_KEXINIT is to be sent */
+  SSH_REKEY_STATE_KEXINIT_RECEIVED,
+  /* both SSH_MSG_KEXINIT are exchanged, the key exchange can start */
+  SSH_REKEY_STATE_KEXINIT_EXCHANGED,
+  /* the key exchange runs until SSH_MSG_NEWKEYS */
+  SSH_REKEY_STATE_DH
+};
+
+/* the host key of the first key exchange, see ssh_host_key_verified() */
+enum ssh_host_key_state_e {
+  SSH_HOST_KEY_NONE=0,
+  /* the host key callback deferred its answer */
+  SSH_HOST_KEY_PENDING,
+  SSH_HOST_KEY_ACCEPTED,
+  SSH_HOST_KEY_REJECTED
+};
+
 enum ssh_pending_call_e {
 	SSH_PENDING_CALL_NONE = 0,
 	SSH_PENDING_CALL_CONNECT,
@@ -57,22 +83,69 @@ enum ssh_pending_call_e {
 	SSH_PENDING_CALL_AUTH_PASSWORD,
 	SSH_PENDING_CALL_AUTH_OFFER_PUBKEY,
 	SSH_PENDING_CALL_AUTH_PUBKEY,
+	SSH_PENDING_CALL_AUTH_AGENT_PUBKEY,
+	SSH_PENDING_CALL_AUTH_AUTOPUBKEY,
+	SSH_PENDING_CALL_AUTH_KBDINT,
 };
 
 /* libssh calls may block an undefined amount of time */
 #define SSH_SESSION_FLAG_BLOCKING 1
 
+/* the subtypes of a request with a policy, see ssh_message_set_policy() */
+#define SSH_MESSAGE_POLICY_SUBTYPES 8
+
 struct ssh_session_struct {
     struct error_struct error;
+    /*
+     * The packet layer: what each packet sent or received reads or updates,
+     * together on the first cache lines after the error. The handshakes,
+     * the requests and the options below are seldom touched.
+     */
     struct ssh_socket_struct *socket;
+    struct ssh_crypto_struct *current_crypto;
+    ssh_buffer in_buffer;
+    ssh_buffer out_buffer;
+    uint32_t send_seq;
+    uint32_t recv_seq;
+    int packet_state;
+    int version; /* 1 or 2 */
+    PACKET in_packet;
+    enum ssh_rekey_state_e rekey_state;
+    /* packets sent during a key re-exchange, sent after SSH2_MSG_NEWKEYS */
+    ssh_buffer rekey_held;
+    /* traffic with the current keys, see SSH_OPTIONS_REKEY_DATA */
+    uint64_t kex_bytes;
+    uint32_t kex_packets;
+    int keepalive_received; /* a packet came since the last tick */
+    /* the first callbacks of each packet type, see ssh_packet_process() */
+    struct ssh_packet_callbacks_struct **packet_dispatch;
+    int packet_dispatch_valid;
+    int log_verbosity; /*cached copy of the option structure */
+    /* packets processed from a single socket read, see ssh_get_packets_per_read() */
+    uint32_t in_packets_last;
+    uint32_t in_packets_max;
+    struct ssh_session_stats_struct stats; /* see ssh_session_get_stats() */
+    struct ssh_pipeline_struct *pipeline; /* see ssh_set_crypto_pool() */
+    ssh_event event; /* the event polling the session, if any */
+    ssh_buffer compress_buffer; /* output of the zlib streams */
+    int compress_stored; /* the packet being sent skips the compression */
+    ssh_channel *channel_ids; /* channels by local id, see ssh_channel_new_id() */
+    uint32_t channel_ids_size;
+    uint32_t channel_queued; /* bytes in the queues of the channels */
+    int channel_windows_pending; /* a channel coalesced an adjust */
+#ifdef WITH_PCAP
+    ssh_pcap_context pcap_ctx; /* pcap debugging context */
+#endif
+    unsigned int padding_pool_left;
+    /* random bytes for the padding of the packets, refilled in bulk */
+    unsigned char padding_pool[512];
+
     char *serverbanner;
     char *clientbanner;
     int protoversion;
     int server;
     int client;
     int openssh;
-    uint32_t send_seq;
-    uint32_t recv_seq;
 /* status flags */
     int closed;
     int closed_by_except;
@@ -90,58 +163,85 @@ struct ssh_session_struct {
                        the server */
     char *discon_msg; /* disconnect message from
                          the remote host */
-    ssh_buffer in_buffer;
-    PACKET in_packet;
-    ssh_buffer out_buffer;
 
     /* the states are used by the nonblocking stuff to remember */
     /* where it was before being interrupted */
     enum ssh_pending_call_e pending_call_state;
     enum ssh_session_state_e session_state;
-    int packet_state;
     enum ssh_dh_state_e dh_handshake_state;
+    /* our first SSH_MSG_KEXINIT went out with the banner */
+    int kexinit_sent;
+    /* the next packet of the client is a wrong guess, it is ignored */
+    int kex_skip_guess;
+    enum ssh_host_key_state_e host_key_state;
     enum ssh_auth_service_state_e auth_service_state;
     enum ssh_auth_state_e auth_state;
+    /* the answers to pipelined authentication requests, one byte each */
+    ssh_buffer auth_replies;
+    /* ssh_userauth_autopubkey() between its calls in nonblocking mode */
+    struct ssh_auth_auto_struct *auth_auto;
     enum ssh_channel_request_state_e global_req_state;
+    int global_req_async; /* the global request returned SSH_AGAIN */
+    uint32_t global_req_port; /* port bound by a tcpip-forward request */
     ssh_string dh_server_signature; /* information used by dh_handshake. */
     KEX server_kex;
     KEX client_kex;
     ssh_buffer in_hashbuf;
     ssh_buffer out_hashbuf;
-    struct ssh_crypto_struct *current_crypto;
     struct ssh_crypto_struct *next_crypto;  /* next_crypto is going to be used after a SSH2_MSG_NEWKEYS */
+    struct ssh_histogram_struct *latency[SSH_LATENCY_PHASES];
+    uint64_t latency_ts; /* start of the phase of the connection */
+    ssh_timer rekey_timer; /* see SSH_OPTIONS_REKEY_TIME */
+    /* see SSH_OPTIONS_KEEPALIVE_INTERVAL */
+    ssh_timer keepalive_timer;
+    unsigned int keepalive_missed; /* probes left without a packet */
+    unsigned int keepalive_pending; /* keepalives waiting for their reply */
 
     ssh_channel channels; /* linked list of channels */
+    uint32_t channels_buffered; /* unread bytes in the channel buffers */
     int maxchannel;
+    uint32_t *channel_ids_free; /* ids of the freed channels, reused first */
+    uint32_t channel_ids_free_count;
     int exec_channel_opened; /* version 1 only. more
                                 info in channels1.c */
     ssh_agent agent; /* ssh agent */
 
 /* keyb interactive data */
     struct ssh_kbdint_struct *kbdint;
-    int version; /* 1 or 2 */
-    /* server host keys */
-    ssh_private_key rsa_key;
-    ssh_private_key dsa_key;
+    /* server host keys, indexed by type, shared with the bind */
+    struct ssh_hostkey_struct *host_keys[SSH_HOSTKEY_TYPES];
+    /* counts the session with its bind until it is authenticated */
+    struct ssh_admission_struct *admission;
     /* auths accepted by server */
     int auth_methods;
     int hostkeys; /* contains type of host key wanted by client, in server impl */
     struct ssh_list *ssh_message_list; /* list of delayed SSH messages */
     int (*ssh_message_callback)( struct ssh_session_struct *session, ssh_message msg, void *userdata);
     void *ssh_message_callback_data;
-    int log_verbosity; /*cached copy of the option structure */
     int log_indent; /* indentation level in enter_function logs */
+    struct ssh_log_ring_struct *log_ring; /* entries waiting for ssh_log_drain() */
 
     void (*ssh_connection_callback)( struct ssh_session_struct *session);
     ssh_callbacks callbacks; /* Callbacks to user functions */
+    /* the typed callbacks of a server, see ssh_set_server_callbacks() */
+    struct ssh_server_callbacks_struct *server_callbacks;
+    /* the request a server callback answers later, see messages.c */
+    struct ssh_auth_pending_struct *auth_pending;
+    /* see ssh_message_set_policy(), by type and subtype */
+    unsigned char message_policy[SSH_REQUEST_GLOBAL + 1]
+                                [SSH_MESSAGE_POLICY_SUBTYPES];
     struct ssh_packet_callbacks_struct default_packet_callbacks;
     struct ssh_list *packet_callbacks;
     struct ssh_socket_callbacks_struct socket_callbacks;
     ssh_poll_ctx default_poll_ctx;
+    /* see ssh_session_add_timer() */
+    ssh_timer timers;
+    /* the poll objects of its forwardings, see ssh_poll_set_owner() */
+    struct ssh_poll_handle_struct *polls;
+    ssh_socks socks; /* see ssh_socks_new() */
+    struct ssh_jump_struct *jump; /* see ssh_set_proxy_jump() */
+    ssh_forward_remote forwards; /* see ssh_forward_remote_new() */
     /* options */
-#ifdef WITH_PCAP
-    ssh_pcap_context pcap_ctx; /* pcap debugging context */
-#endif
     char *username;
     char *host;
     char *bindaddr; /* bind the client to an ip addr */
@@ -151,6 +251,9 @@ struct ssh_session_struct {
     char *knownhosts;
     char *wanted_methods[10];
     char compressionlevel;
+    int compressionstrategy; /* enum ssh_compression_strategy_e */
+    int compressionadaptive; /* stop compressing what doesn't shrink */
+    char *compression_skip; /* channel types and subsystems sent stored */
     unsigned long timeout; /* seconds */
     unsigned long timeout_usec;
     unsigned int port;
@@ -159,6 +262,27 @@ struct ssh_session_struct {
     int ssh1;
     int StrictHostKeyChecking;
     char *ProxyCommand;
+    uint32_t read_size_max; /* upper bound of the socket read size */
+    uint64_t rekey_data; /* bytes between two key exchanges, 0 = no limit */
+    uint32_t rekey_time; /* seconds between two key exchanges, 0 = none */
+    uint32_t keepalive_interval; /* seconds of silence before a probe */
+    uint32_t keepalive_max; /* probes without an answer before giving up */
+    int kex_guess; /* send the first key exchange packet with the KEXINIT */
+    /* limits of the unread channel data, 0 for none */
+    uint32_t channel_buffer_soft_limit;
+    uint32_t channel_buffer_hard_limit;
+    uint32_t session_buffer_soft_limit;
+    uint32_t session_buffer_hard_limit;
+    struct ssh_tcp_options tcp;
+    uint32_t channel_window; /* local window granted to the channels */
+    uint32_t channel_window_max; /* bound of the auto-tuning, 0 = disabled */
+    uint32_t channel_maxpacket; /* max packet size the peer can send */
+    int channel_window_threshold; /* see ssh_channel_set_window_strategy() */
+    int channel_window_coalesce;
+    int channel_scheduler; /* see SSH_OPTIONS_CHANNEL_SCHEDULER */
+    ssh_channel sched_next; /* next channel of the round */
+    int sched_running;
+    int writable_running; /* writable callbacks are being called */
 };
 
 /** @internal
@@ -167,9 +291,12 @@ struct ssh_session_struct {
  * @returns 1 if the polling routine should terminate, 0 instead
  */
 typedef int (*ssh_termination_function)(void *user);
+ssh_poll_ctx ssh_session_get_poll_ctx(ssh_session session);
 int ssh_handle_packets(ssh_session session, int timeout);
 int ssh_handle_packets_termination(ssh_session session, int timeout,
     ssh_termination_function fct, void *user);
 void ssh_socket_exception_callback(int code, int errno_code, void *user);
+int ssh_keepalive_start(ssh_session session);
+int ssh_keepalive_reply(ssh_session session);
 
 #endif /* SESSION_H_ */
@@ -40,6 +40,9 @@
 #define SFTP_H
 
 #include <sys/types.h>
+#ifndef _WIN32
+#include <dirent.h>
+#endif
 
 #include "libssh.h"
 
@@ -64,14 +67,29 @@ extern "C" {
 typedef struct sftp_attributes_struct* sftp_attributes;
 typedef struct sftp_client_message_struct* sftp_client_message;
 typedef struct sftp_dir_struct* sftp_dir;
+typedef struct sftp_dir_entry_struct* sftp_dir_entry;
+typedef struct sftp_download_options_struct* sftp_download_options;
+typedef struct sftp_download_sink_struct* sftp_download_sink;
+typedef struct sftp_upload_options_struct* sftp_upload_options;
+typedef struct sftp_upload_source_struct* sftp_upload_source;
+typedef struct sftp_transfer_struct* sftp_transfer;
 typedef struct sftp_ext_struct *sftp_ext;
 typedef struct sftp_file_struct* sftp_file;
 typedef struct sftp_message_struct* sftp_message;
 typedef struct sftp_packet_struct* sftp_packet;
-typedef struct sftp_request_queue_struct* sftp_request_queue;
 typedef struct sftp_session_struct* sftp_session;
 typedef struct sftp_status_message_struct* sftp_status_message;
 typedef struct sftp_statvfs_struct* sftp_statvfs_t;
+typedef struct sftp_limits_struct* sftp_limits_t;
+typedef struct sftp_file_hash_struct* sftp_file_hash;
+typedef struct sftp_server_pool_struct* sftp_server_pool;
+
+/* a slot of the handle table of a server */
+struct sftp_handle_slot {
+    void *info; /* NULL if the slot is free */
+    uint32_t generation; /* bumped at each release, to refuse stale handles */
+    uint32_t next_free;
+};
 
 struct sftp_session_struct {
     ssh_session session;
@@ -79,11 +97,26 @@ struct sftp_session_struct {
     int server_version;
     int client_version;
     int version;
-    sftp_request_queue queue;
+    sftp_message *queue; /* replies waiting, hashed by id */
+    uint32_t queue_size;
+    uint32_t queue_count;
+    sftp_message free_messages; /* freed messages kept for reuse */
+    uint32_t free_count;
     uint32_t id_counter;
     int errnum;
-    void **handles;
+    struct sftp_handle_slot *handles; /* server handles, grown as needed */
+    uint32_t handles_size;
+    uint32_t handles_free; /* first free slot, handles_size if none */
     sftp_ext ext;
+    sftp_limits_t limits; /* from limits@openssh.com, once asked */
+    int limits_asked;
+    struct sftp_server_dispatch *dispatch; /* server handlers, if any */
+    sftp_client_message free_client_messages; /* freed requests to reuse */
+    uint32_t free_client_count;
+    struct sftp_latency_struct *latency; /* requests timed, see sftp_get_latency() */
+    struct sftp_stat_cache_struct *stat_cache; /* see sftp_set_stat_cache() */
+    sftp_packet free_packet; /* the last packet read, kept for the next one */
+    int init_state; /* the step of sftp_init_nonblocking() */
 };
 
 struct sftp_packet_struct {
@@ -100,6 +133,14 @@ struct sftp_file_struct {
     ssh_string handle;
     int eof;
     int nonblocking;
+    /* the READs sent ahead of sequential reads */
+    struct sftp_read_ahead_struct *read_ahead;
+    /* the writes gathered and their WRITEs in flight */
+    struct sftp_write_behind_struct *write_behind;
+    /* the OPEN waiting for the handle, see sftp_async_open() */
+    int opening;
+    uint32_t open_id;
+    unsigned int open_reads; /* the READs to send with the handle */
 };
 
 struct sftp_dir_struct {
@@ -109,6 +150,21 @@ struct sftp_dir_struct {
     ssh_buffer buffer; /* contains raw attributes from server which haven't been parsed */
     uint32_t count; /* counts the number of following attributes structures into buffer */
     int eof; /* end of directory listing */
+    uint32_t readdir_id; /* id of the READDIR sent ahead */
+    int readdir_pending;
+    char *arena; /* entries and names of the batch in buffer */
+    size_t arena_size;
+    size_t arena_used;
+    sftp_dir_entry entries;
+    uint32_t entry_count; /* entries of the batch read so far */
+};
+
+/* a directory entry, valid until the next sftp_dir_next() */
+struct sftp_dir_entry_struct {
+    const char *name;
+    const char *longname; /* NULL if the server didn't send one */
+    uint32_t offset; /* where the entry starts in the batch */
+    sftp_attributes attributes; /* parsed on demand */
 };
 
 struct sftp_message_struct {
@@ -116,6 +172,7 @@ struct sftp_message_struct {
     uint8_t packet_type;
     ssh_buffer payload;
     uint32_t id;
+    sftp_message next; /* in the queue or the free messages */
 };
 
 /* this is a bunch of all data that could be into a message */
@@ -132,11 +189,9 @@ struct sftp_client_message_struct {
     int attr_num;
     ssh_buffer attrbuf; /* used by sftp_reply_attrs */
     ssh_string data; /* can be newpath of rename() */
-};
-
-struct sftp_request_queue_struct {
-    sftp_request_queue next;
-    sftp_message message;
+    ssh_buffer payload; /* the request, which the strings can point into */
+    int views; /* the strings pointing into the payload */
+    struct sftp_client_message_struct *next; /* in the free list */
 };
 
 /* SSH_FXP_MESSAGE described into .7 page 26 */
@@ -170,10 +225,142 @@ struct sftp_attributes_struct {
     uint32_t mtime_nseconds;
     ssh_string acl;
     uint32_t extended_count;
-    ssh_string extended_type;
+    ssh_string extended_type; /* of the last pair */
     ssh_string extended_data;
+    const char *extended; /* the pairs as sent, see sftp_attributes_get_extended() */
+    uint32_t extended_len;
+    int packed; /* the strings are in the same allocation, as parsed */
+};
+
+/**
+ * @brief SFTP download callback, receiving the file data in file order.
+ *
+ * @param data          The data read from the file.
+ *
+ * @param len           The length of the data.
+ *
+ * @param offset        The offset of the data in the file.
+ *
+ * @param userdata      Userdata of the sink.
+ *
+ * @return              0 to continue, < 0 to stop the download with an error.
+ */
+typedef int (*sftp_download_callback)(const void *data, size_t len,
+    uint64_t offset, void *userdata);
+
+/* where sftp_download() writes the file */
+struct sftp_download_sink_struct {
+  int fd; /* file descriptor written to if there is no callback */
+  sftp_download_callback write_function;
+  void *userdata;
 };
 
+#define SFTP_DOWNLOAD_REQUESTS 64
+#define SFTP_DOWNLOAD_CHUNK_SIZE 32768
+
+struct sftp_download_options_struct {
+  uint32_t requests; /* reads in flight, 0 for SFTP_DOWNLOAD_REQUESTS */
+  uint32_t chunk_size; /* bytes per read, 0 for SFTP_DOWNLOAD_CHUNK_SIZE */
+};
+
+/**
+ * @brief SFTP upload callback, providing the data of the file in file order.
+ *
+ * @param data          The buffer to fill.
+ *
+ * @param len           The size of the buffer.
+ *
+ * @param offset        The offset of the data in the file.
+ *
+ * @param userdata      Userdata of the source.
+ *
+ * @return              The number of bytes provided, 0 at the end of the data,
+ *                      < 0 to stop the upload with an error.
+ */
+typedef ssize_t (*sftp_upload_callback)(void *data, size_t len,
+    uint64_t offset, void *userdata);
+
+/* where sftp_upload() reads the file */
+struct sftp_upload_source_struct {
+  int fd; /* file descriptor read from if there is no callback */
+  sftp_upload_callback read_function;
+  void *userdata;
+};
+
+#define SFTP_RESUME_CHECK_SIZE (1024 * 1024)
+#define SFTP_DELTA_BLOCK_SIZE 65536
+
+#define SFTP_UPLOAD_REQUESTS 64
+#define SFTP_UPLOAD_CHUNK_SIZE 32768
+
+struct sftp_upload_options_struct {
+  uint32_t requests; /* writes in flight, 0 for SFTP_UPLOAD_REQUESTS */
+  uint32_t chunk_size; /* bytes per write, 0 for SFTP_UPLOAD_CHUNK_SIZE */
+};
+
+/**
+ * @brief SFTP transfer callback, called as the data of a file is transferred.
+ *
+ * @param transfer      The transfer.
+ *
+ * @param remote        The path of the remote file.
+ *
+ * @param local         The path of the local file.
+ *
+ * @param bytes         The number of bytes of the file transferred so far.
+ *
+ * @param userdata      Userdata of the callbacks.
+ */
+typedef void (*sftp_transfer_progress_callback)(sftp_transfer transfer,
+    const char *remote, const char *local, uint64_t bytes, void *userdata);
+
+/**
+ * @brief SFTP transfer callback, called once a file is done.
+ *
+ * @param transfer      The transfer.
+ *
+ * @param remote        The path of the remote file.
+ *
+ * @param local         The path of the local file.
+ *
+ * @param rc            SSH_OK if the file has been transferred, SSH_ERROR
+ *                      otherwise.
+ *
+ * @param error         The error if the transfer of the file failed, NULL
+ *                      otherwise.
+ *
+ * @param userdata      Userdata of the callbacks.
+ */
+typedef void (*sftp_transfer_done_callback)(sftp_transfer transfer,
+    const char *remote, const char *local, int rc, const char *error,
+    void *userdata);
+
+#define SFTP_TRANSFER_FILES 16
+
+/**
+ * @brief SFTP stat callback, called once for each path given to
+ * sftp_stat_many_callback() as its reply arrives.
+ *
+ * @param sftp          The sftp session.
+ *
+ * @param index         The index of the path in the array.
+ *
+ * @param path          The path.
+ *
+ * @param attr          The attributes of the path, to be freed with
+ *                      sftp_attributes_free(), or NULL on error. The sftp
+ *                      error is set then.
+ *
+ * @param userdata      Userdata of the callback.
+ *
+ * @return              0 to go on, anything else to stop sending requests.
+ *                      The replies already in flight are still reported.
+ */
+typedef int (*sftp_stat_callback)(sftp_session sftp, size_t index,
+    const char *path, sftp_attributes attr, void *userdata);
+
+#define SFTP_STAT_REQUESTS 64
+
 struct sftp_statvfs_struct {
   uint64_t f_bsize; /* file system block size */
   uint64_t f_frsize; /* fundamental fs block size */
@@ -188,6 +375,20 @@ struct sftp_statvfs_struct {
   uint64_t f_namemax; /* maximum filename length */
 };
 
+/* the limits of the server, 0 when it has none */
+struct sftp_limits_struct {
+  uint64_t max_packet_length;
+  uint64_t max_read_length;
+  uint64_t max_write_length;
+  uint64_t max_open_handles;
+};
+
+struct sftp_file_hash_struct {
+  char *algorithm; /* the algorithm the server picked */
+  unsigned char *hashes; /* the hash of each block, one after the other */
+  size_t len;
+};
+
 #define LIBSFTP_VERSION 3
 
 /**
@@ -199,6 +400,21 @@ struct sftp_statvfs_struct {
  */
 LIBSSH_API sftp_session sftp_new(ssh_session session);
 
+/**
+ * @brief Allocate a new sftp session without talking to the server.
+ *
+ * The channel of the session is only created: sftp_init_nonblocking() opens
+ * it, asks for the sftp subsystem and initializes the session, so that many
+ * sftp sessions can be brought up from one event loop.
+ *
+ * @param session       The ssh session to use.
+ *
+ * @return              A new sftp session or NULL on error.
+ *
+ * @see                 sftp_init_nonblocking()
+ */
+LIBSSH_API sftp_session sftp_new_nonblocking(ssh_session session);
+
 /**
  * @brief Close and deallocate a sftp session.
  *
@@ -215,6 +431,26 @@ LIBSSH_API void sftp_free(sftp_session sftp);
  */
 LIBSSH_API int sftp_init(sftp_session sftp);
 
+/**
+ * @brief Bring up a sftp session allocated by sftp_new_nonblocking(),
+ *        without waiting for the server.
+ *
+ * The channel is opened, the sftp subsystem asked for and the version of
+ * the server read, each step as its answer arrives. Call it again, e.g. when
+ * the socket of the ssh session is readable, until it doesn't return
+ * SSH_AGAIN. The ssh session has to be nonblocking (see ssh_set_blocking())
+ * for opening the channel and asking for the subsystem not to wait either.
+ *
+ * @param sftp          The sftp session to initialize.
+ *
+ * @return              SSH_OK once the session is initialized, SSH_AGAIN if
+ *                      it has to be called again, SSH_ERROR on error with
+ *                      ssh error set.
+ *
+ * @see                 sftp_new_nonblocking()
+ */
+LIBSSH_API int sftp_init_nonblocking(sftp_session sftp);
+
 /**
  * @brief Get the last sftp error.
  *
@@ -227,6 +463,28 @@ LIBSSH_API int sftp_init(sftp_session sftp);
  */
 LIBSSH_API int sftp_get_error(sftp_session sftp);
 
+/**
+ * @brief Get the latency distribution of a type of request.
+ *
+ * The latency of a request is the time from sending it to parsing its
+ * reply. The replies read by sftp_async_read() and the other functions are
+ * all timed.
+ *
+ * @param sftp          The sftp session, or NULL for the totals of the
+ *                      process, which include all the sftp sessions.
+ *
+ * @param type          The type of request, SSH_FXP_OPEN to SSH_FXP_SYMLINK
+ *                      or SSH_FXP_EXTENDED.
+ *
+ * @param latency       The distribution, in microseconds.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_session_get_latency()
+ */
+LIBSSH_API int sftp_get_latency(sftp_session sftp, uint8_t type,
+    struct ssh_latency_struct *latency);
+
 /**
  * @brief Get the count of extensions provided by the server.
  *
@@ -321,6 +579,50 @@ LIBSSH_API sftp_attributes sftp_readdir(sftp_session session, sftp_dir dir);
  */
 LIBSSH_API int sftp_dir_eof(sftp_dir dir);
 
+/**
+ * @brief Get the next entry of a directory.
+ *
+ * This is a faster sftp_readdir(): the next batch of names is requested while
+ * the current one is read, and only the names are parsed. The attributes of
+ * an entry are parsed when sftp_dir_entry_attributes() asks for them.
+ *
+ * The entry belongs to the directory and is valid until the next call to
+ * sftp_dir_next(), sftp_readdir() or sftp_closedir().
+ *
+ * @param dir           The opened sftp directory handle to read from.
+ *
+ * @return              The next entry, NULL at the end of the directory or on
+ *                      error. Use sftp_dir_eof() to tell them apart.
+ *
+ * @see                 sftp_dir_entry_name()
+ * @see                 sftp_dir_entry_attributes()
+ */
+LIBSSH_API sftp_dir_entry sftp_dir_next(sftp_dir dir);
+
+/**
+ * @brief Get the file name of a directory entry.
+ *
+ * @param entry         The directory entry.
+ *
+ * @return              The file name, valid as long as the entry.
+ */
+LIBSSH_API const char *sftp_dir_entry_name(sftp_dir_entry entry);
+
+/**
+ * @brief Get the attributes of a directory entry.
+ *
+ * They are parsed the first time they are asked for.
+ *
+ * @param dir           The directory handle the entry comes from.
+ *
+ * @param entry         The directory entry.
+ *
+ * @return              The attributes, valid as long as the entry. Don't free
+ *                      them. NULL on error.
+ */
+LIBSSH_API sftp_attributes sftp_dir_entry_attributes(sftp_dir dir,
+    sftp_dir_entry entry);
+
 /**
  * @brief Get information about a file or directory.
  *
@@ -348,6 +650,41 @@ LIBSSH_API sftp_attributes sftp_stat(sftp_session session, const char *path);
  */
 LIBSSH_API sftp_attributes sftp_lstat(sftp_session session, const char *path);
 
+/**
+ * @brief Keep the attributes of the paths to answer sftp_stat() and
+ *        sftp_lstat() without asking the server.
+ *
+ * The attributes come from the replies of sftp_stat() and sftp_lstat(), and
+ * from the entries of the directories read, at the path of the directory
+ * joined to the name. They are kept for the given time. The paths are
+ * compared as given, not resolved.
+ *
+ * Setting the attributes, removing, renaming, creating or writing to a path
+ * through the session forgets it, with its parent directory. What other
+ * sessions change is seen once the time is over, or after
+ * sftp_stat_cache_invalidate().
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param ttl           The time the attributes are kept in milliseconds, 0
+ *                      to stop keeping them.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int sftp_set_stat_cache(sftp_session sftp, unsigned int ttl);
+
+/**
+ * @brief Forget the attributes kept of a path and the paths under it.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param path          The path, NULL to forget everything.
+ *
+ * @see                 sftp_set_stat_cache()
+ */
+LIBSSH_API void sftp_stat_cache_invalidate(sftp_session sftp,
+    const char *path);
+
 /**
  * @brief Get information about a file or directory from a file handle.
  *
@@ -358,13 +695,93 @@ LIBSSH_API sftp_attributes sftp_lstat(sftp_session session, const char *path);
  */
 LIBSSH_API sftp_attributes sftp_fstat(sftp_file file);
 
+/**
+ * @brief Get information about many files or directories at once.
+ *
+ * Up to SFTP_STAT_REQUESTS requests are kept in flight, so stat'ing many
+ * paths takes a few round trips instead of one per path.
+ *
+ * @param session       The sftp session handle.
+ *
+ * @param paths         The paths of the files or directories.
+ *
+ * @param n             The number of paths.
+ *
+ * @param results       An array of n entries receiving the attributes of each
+ *                      path, to be freed with sftp_attributes_free(), or NULL
+ *                      for the paths which failed.
+ *
+ * @return              SSH_OK if every path was stat'ed, SSH_ERROR otherwise.
+ *
+ * @see                 sftp_stat()
+ */
+LIBSSH_API int sftp_stat_many(sftp_session session, const char **paths,
+    size_t n, sftp_attributes *results);
+
+/**
+ * @brief Get information about many files or directories at once, without
+ * following symbolic links.
+ *
+ * @see                 sftp_stat_many()
+ * @see                 sftp_lstat()
+ */
+LIBSSH_API int sftp_lstat_many(sftp_session session, const char **paths,
+    size_t n, sftp_attributes *results);
+
+/**
+ * @brief Get information about many files or directories at once, reporting
+ * each of them as soon as its reply arrives.
+ *
+ * @param session       The sftp session handle.
+ *
+ * @param paths         The paths of the files or directories.
+ *
+ * @param n             The number of paths.
+ *
+ * @param follow_links  1 to stat like sftp_stat(), 0 like sftp_lstat().
+ *
+ * @param callback      Called once for each path, in the order of the
+ *                      replies.
+ *
+ * @param userdata      Userdata passed to the callback.
+ *
+ * @return              SSH_OK if every path was stat'ed, SSH_ERROR otherwise.
+ *
+ * @see                 sftp_stat_many()
+ */
+LIBSSH_API int sftp_stat_many_callback(sftp_session session,
+    const char **paths, size_t n, int follow_links,
+    sftp_stat_callback callback, void *userdata);
+
 /**
  * @brief Free a sftp attribute structure.
  *
+ * The attributes parsed by the library come in one allocation with their
+ * strings, which mustn't be freed or replaced on their own.
+ *
  * @param file          The sftp attribute structure to free.
  */
 LIBSSH_API void sftp_attributes_free(sftp_attributes file);
 
+/**
+ * @brief Get an extended attribute pair.
+ *
+ * The pairs are kept as sent by the server and only walked when asked for.
+ *
+ * @param attr          The sftp attribute structure.
+ *
+ * @param index         The index of the pair, below attr->extended_count.
+ *
+ * @param type          A pointer to receive the type of the pair, or NULL.
+ *
+ * @param data          A pointer to receive the data of the pair, or NULL.
+ *
+ * @return              SSH_OK, SSH_ERROR if there is no such pair. The strings
+ *                      belong to the attributes and go with them.
+ */
+LIBSSH_API int sftp_attributes_get_extended(sftp_attributes attr,
+    uint32_t index, ssh_string *type, ssh_string *data);
+
 /**
  * @brief Close a directory handle opened by sftp_opendir().
  *
@@ -414,6 +831,49 @@ LIBSSH_API int sftp_close(sftp_file file);
 LIBSSH_API sftp_file sftp_open(sftp_session session, const char *file, int accesstype,
     mode_t mode);
 
+/**
+ * @brief Send the request to open a file on the server, without waiting for
+ *        the answer.
+ *
+ * The file returned is opening: sftp_async_open() gets its handle, after
+ * which it can be used as a file returned by sftp_open(). The other requests
+ * can be sent in the meantime, so many files and sessions can be opened at
+ * once.
+ *
+ * @param session       The sftp session handle.
+ *
+ * @param file          The file to be opened.
+ *
+ * @param accesstype    The access of the file, see sftp_open().
+ *
+ * @param mode          The permissions of a created file, see sftp_open().
+ *
+ * @param reads         The READs of the beginning of the file to send as soon
+ *                      as the handle arrives, before sftp_async_open() returns,
+ *                      for the first sftp_read() calls. 0 not to read ahead.
+ *
+ * @return              A sftp file handle waiting for the answer, NULL on error
+ *                      with ssh error set.
+ *
+ * @see                 sftp_async_open()
+ */
+LIBSSH_API sftp_file sftp_async_open_begin(sftp_session session,
+    const char *file, int accesstype, mode_t mode, unsigned int reads);
+
+/**
+ * @brief Wait for the answer to the request of sftp_async_open_begin().
+ *
+ * @param file          The file returned by sftp_async_open_begin().
+ *
+ * @return              SSH_OK once the file is open, SSH_AGAIN if the file is
+ *                      in nonblocking mode and the answer hasn't arrived yet,
+ *                      SSH_ERROR on error with ssh and sftp error set. The
+ *                      file has to be closed with sftp_close() in any case.
+ *
+ * @see                 sftp_file_set_nonblocking()
+ */
+LIBSSH_API int sftp_async_open(sftp_file file);
+
 LIBSSH_API void sftp_file_set_nonblocking(sftp_file handle);
 
 LIBSSH_API void sftp_file_set_blocking(sftp_file handle);
@@ -421,6 +881,12 @@ LIBSSH_API void sftp_file_set_blocking(sftp_file handle);
 /**
  * @brief Read from a file using an opened sftp file handle.
  *
+ * After a few reads in a row, each where the previous one stopped, the reads
+ * are sent ahead of the offset of the file and served from their replies,
+ * so that small sequential reads don't wait for the server each. Seeking
+ * elsewhere or writing drops what was read ahead. Less bytes than asked may
+ * be returned before the end of the file.
+ *
  * @param file          The opened sftp file handle to be read from.
  *
  * @param buf           Pointer to buffer to recieve read data.
@@ -490,6 +956,33 @@ LIBSSH_API int sftp_async_read_begin(sftp_file file, uint32_t len);
  */
 LIBSSH_API int sftp_async_read(sftp_file file, void *data, uint32_t len, uint32_t id);
 
+/**
+ * @brief Download a file from its current offset to the end.
+ *
+ * Several reads are kept in flight, so the transfer isn't limited to one read
+ * per round trip. Short reads are requested again. The write callback of the
+ * sink gets the data in file order, the replies being reordered. A seekable
+ * descriptor is written with pwrite() at the offset of each reply as it
+ * arrives, and left after the data downloaded.
+ *
+ * @param file          The opened sftp file handle to be read from.
+ *
+ * @param sink          Where the data goes: the write callback if set,
+ *                      otherwise the file descriptor.
+ *
+ * @param opts          The number and size of the reads in flight, NULL for
+ *                      the defaults.
+ *
+ * @return              The number of bytes downloaded, < 0 on error with ssh
+ *                      and sftp error set.
+ *
+ * @warning             The download blocks, even on a nonblocking file handle.
+ *
+ * @see                 sftp_open()
+ */
+LIBSSH_API int64_t sftp_download(sftp_file file, sftp_download_sink sink,
+    sftp_download_options opts);
+
 /**
  * @brief Write to a file using an opened sftp file handle.
  *
@@ -508,6 +1001,283 @@ LIBSSH_API int sftp_async_read(sftp_file file, void *data, uint32_t len, uint32_
  */
 LIBSSH_API ssize_t sftp_write(sftp_file file, const void *buf, size_t count);
 
+/**
+ * @brief Gather the writes of a file and don't wait for the server.
+ *
+ * The small contiguous writes of sftp_write() are gathered in WRITEs of up
+ * to 32k, and up to 16 WRITEs are in flight without waiting for their
+ * status. A WRITE which failed is reported by the next sftp_write(),
+ * sftp_flush() or sftp_close() returning an error. The reads and the other
+ * requests on the file send the data gathered first.
+ *
+ * @param file          The open sftp file handle.
+ *
+ * @param enable        1 to write behind, 0 to flush and stop it.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error or if the
+ *                      writes flushed when stopping failed.
+ *
+ * @see                 sftp_flush()
+ */
+LIBSSH_API int sftp_file_set_write_behind(sftp_file file, int enable);
+
+/**
+ * @brief Send the data written behind and wait for all its WRITEs.
+ *
+ * @param file          The open sftp file handle.
+ *
+ * @return              SSH_OK once the server wrote everything, SSH_ERROR
+ *                      if a WRITE failed since the last error reported, with
+ *                      ssh and sftp error set.
+ *
+ * @see                 sftp_file_set_write_behind()
+ */
+LIBSSH_API int sftp_flush(sftp_file file);
+
+/**
+ * @brief Start an asynchronous write to a file using an opened sftp file
+ * handle.
+ *
+ * The data is sent at once and the status of the write is waited for with
+ * sftp_async_write_end(), so several writes can be in flight.
+ *
+ * @param file          Open sftp file handle to write to.
+ *
+ * @param buf           Pointer to buffer to write data.
+ *
+ * @param len           Size of buffer in bytes.
+ *
+ * @return              An identifier corresponding to the sent request, < 0 on
+ *                      error.
+ *
+ * @warning             When calling this function, the internal offset is
+ *                      updated corresponding to the len parameter.
+ *
+ * @warning             Not calling sftp_async_write_end() will lead to memory
+ *                      leaks.
+ *
+ * @see                 sftp_async_write_end()
+ */
+LIBSSH_API int sftp_async_write_begin(sftp_file file, const void *buf,
+    uint32_t len);
+
+/**
+ * @brief Wait for an asynchronous write to complete.
+ *
+ * @param file          Open sftp file handle written to.
+ *
+ * @param id            The identifier returned by the sftp_async_write_begin()
+ *                      function.
+ *
+ * @return              SSH_OK if the data has been written, SSH_ERROR if an
+ *                      error occured, SSH_AGAIN if the file is opened in
+ *                      nonblocking mode and the request hasn't been executed
+ *                      yet.
+ *
+ * @see sftp_async_write_begin()
+ */
+LIBSSH_API int sftp_async_write_end(sftp_file file, uint32_t id);
+
+/**
+ * @brief Upload data to a file from its current offset.
+ *
+ * Several writes are kept in flight and their status is collected as the
+ * replies arrive. The upload stops sending at the first failed write.
+ *
+ * A regular file given as a descriptor is mapped where mmap() is available,
+ * the writes being built from the mapping. It shouldn't be truncated during
+ * the upload. A seekable descriptor is left after the data uploaded.
+ *
+ * @param source        Where the data comes from: the read callback if set,
+ *                      otherwise the file descriptor, until its end.
+ *
+ * @param file          Open sftp file handle to write to.
+ *
+ * @param opts          The number and size of the writes in flight, NULL for
+ *                      the defaults.
+ *
+ * @return              The number of bytes uploaded, < 0 on error with ssh
+ *                      and sftp error set.
+ *
+ * @warning             The upload blocks, even on a nonblocking file handle.
+ *
+ * @see                 sftp_open()
+ */
+LIBSSH_API int64_t sftp_upload(sftp_upload_source source, sftp_file file,
+    sftp_upload_options opts);
+
+/**
+ * @brief Download a file cut in parts moved over several sftp sessions.
+ *
+ * The file is split in contiguous parts, one per session and no smaller than
+ * a read. Each part has its own reads in flight on its session, all of them
+ * being waited for together, and is written at its offset in fd. The
+ * sessions can be channels of one ssh session, to get past the window of
+ * one channel, or of several ones to use several TCP connections.
+ *
+ * @param sessions      The sftp sessions, initialized.
+ *
+ * @param count         The number of sessions.
+ *
+ * @param path          The path of the remote file.
+ *
+ * @param fd            The local file descriptor, written with pwrite() at
+ *                      the offsets of the remote file.
+ *
+ * @param opts          The number and size of the reads in flight of each
+ *                      session, NULL for the defaults.
+ *
+ * @return              The number of bytes downloaded, < 0 on error with the
+ *                      error set on the first session.
+ *
+ * @see                 sftp_download()
+ */
+LIBSSH_API int64_t sftp_download_striped(sftp_session *sessions, size_t count,
+    const char *path, int fd, sftp_download_options opts);
+
+/**
+ * @brief Upload a file cut in parts moved over several sftp sessions.
+ *
+ * The remote file is created or truncated by the first session. The local
+ * file is split as sftp_download_striped() does, each part being written
+ * over its own session.
+ *
+ * @param fd            The local file descriptor, read at its offsets up to
+ *                      its size.
+ *
+ * @param sessions      The sftp sessions, initialized.
+ *
+ * @param count         The number of sessions.
+ *
+ * @param path          The path of the remote file.
+ *
+ * @param opts          The number and size of the writes in flight of each
+ *                      session, NULL for the defaults.
+ *
+ * @return              The number of bytes uploaded, < 0 on error with the
+ *                      error set on the first session.
+ *
+ * @see                 sftp_upload()
+ */
+LIBSSH_API int64_t sftp_upload_striped(int fd, sftp_session *sessions,
+    size_t count, const char *path, sftp_upload_options opts);
+
+/**
+ * @brief Create a transfer of many files over one sftp session.
+ *
+ * The files added to the transfer are downloaded or uploaded by
+ * sftp_transfer_run(). Several files are open at once and their opens,
+ * reads, writes and closes are all in flight together, so a small file
+ * doesn't cost several round trips of its own.
+ *
+ * @param sftp          The sftp session to use.
+ *
+ * @return              A new transfer, NULL on error.
+ *
+ * @see                 sftp_transfer_free()
+ */
+LIBSSH_API sftp_transfer sftp_transfer_new(sftp_session sftp);
+
+/**
+ * @brief Free a transfer.
+ *
+ * @param transfer      The transfer to free.
+ */
+LIBSSH_API void sftp_transfer_free(sftp_transfer transfer);
+
+/**
+ * @brief Set the limits of a transfer.
+ *
+ * @param transfer      The transfer.
+ *
+ * @param files         The number of files open at once, 0 for
+ *                      SFTP_TRANSFER_FILES.
+ *
+ * @param requests      The number of reads and writes in flight for all the
+ *                      files, 0 for SFTP_DOWNLOAD_REQUESTS.
+ *
+ * @param chunk_size    The size of each read or write, 0 for
+ *                      SFTP_DOWNLOAD_CHUNK_SIZE.
+ */
+LIBSSH_API void sftp_transfer_set_limits(sftp_transfer transfer,
+    unsigned int files, uint32_t requests, uint32_t chunk_size);
+
+/**
+ * @brief Set the callbacks reporting the progress of a transfer.
+ *
+ * @param transfer      The transfer.
+ *
+ * @param progress      Called as the data of a file is transferred, or NULL.
+ *
+ * @param done          Called once a file is done, or NULL.
+ *
+ * @param userdata      Userdata passed to the callbacks.
+ */
+LIBSSH_API void sftp_transfer_set_callbacks(sftp_transfer transfer,
+    sftp_transfer_progress_callback progress,
+    sftp_transfer_done_callback done, void *userdata);
+
+/**
+ * @brief Add the download of a remote file to a transfer.
+ *
+ * @param transfer      The transfer.
+ *
+ * @param remote        The path of the remote file.
+ *
+ * @param local         The path of the local file, created or truncated.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int sftp_transfer_add_download(sftp_transfer transfer,
+    const char *remote, const char *local);
+
+/**
+ * @brief Add the upload of a local file to a transfer.
+ *
+ * @param transfer      The transfer.
+ *
+ * @param local         The path of the local file.
+ *
+ * @param remote        The path of the remote file, created or truncated.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int sftp_transfer_add_upload(sftp_transfer transfer,
+    const char *local, const char *remote);
+
+/**
+ * @brief Add the download of a remote directory tree to a transfer.
+ *
+ * The directories are listed at once and created locally, their regular
+ * files are added to the transfer. Symbolic links and special files are
+ * skipped.
+ *
+ * @param transfer      The transfer.
+ *
+ * @param remote        The path of the remote directory.
+ *
+ * @param local         The path of the local directory.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+LIBSSH_API int sftp_transfer_add_tree(sftp_transfer transfer,
+    const char *remote, const char *local);
+
+/**
+ * @brief Transfer all the files added to a transfer.
+ *
+ * The failure of a file doesn't stop the others, it is reported by the done
+ * callback.
+ *
+ * @param transfer      The transfer.
+ *
+ * @return              SSH_OK if all the files have been transferred,
+ *                      SSH_ERROR if some failed or the session failed.
+ *
+ * @warning             The transfer blocks, even on nonblocking file handles.
+ */
+LIBSSH_API int sftp_transfer_run(sftp_transfer transfer);
+
 /**
  * @brief Seek to a specific location in a file.
  *
@@ -722,6 +1492,173 @@ LIBSSH_API sftp_statvfs_t sftp_fstatvfs(sftp_file file);
  */
 LIBSSH_API void sftp_statvfs_free(sftp_statvfs_t statvfs_o);
 
+/**
+ * @brief Get the limits of the server, with the limits@openssh.com extension.
+ *
+ * The limits are asked once per session. sftp_download(), sftp_upload() and
+ * sftp_transfer_run() use them to keep their reads, writes and open files
+ * within what the server accepts.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @return              A limits structure to be freed with sftp_limits_free(),
+ *                      NULL if the server doesn't tell them or on error.
+ */
+LIBSSH_API sftp_limits_t sftp_limits(sftp_session sftp);
+
+/**
+ * @brief Free the memory of a limits structure.
+ *
+ * @param limits        The limits to free.
+ */
+LIBSSH_API void sftp_limits_free(sftp_limits_t limits);
+
+/**
+ * @brief Copy data between two files on the server, with the copy-data
+ * extension. The data doesn't go through the client.
+ *
+ * @param source        The file to read from, opened for reading.
+ *
+ * @param source_offset Where to start reading.
+ *
+ * @param length        The number of bytes to copy, 0 to copy up to the end
+ *                      of the source.
+ *
+ * @param dest          The file to write to, opened for writing. It can be
+ *                      the source if the ranges don't overlap.
+ *
+ * @param dest_offset   Where to start writing.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and sftp
+ *                      error set.
+ */
+LIBSSH_API int sftp_copy_data(sftp_file source, uint64_t source_offset,
+    uint64_t length, sftp_file dest, uint64_t dest_offset);
+
+/**
+ * @brief Get the hash of an open file as computed by the server, with the
+ * check-file-handle extension.
+ *
+ * @param file          The file, opened for reading.
+ *
+ * @param algorithms    The hash algorithms to pick from, in order of
+ *                      preference, separated by commas, e.g. "sha256,md5".
+ *
+ * @param offset        Where the data to hash starts.
+ *
+ * @param length        The number of bytes to hash, 0 up to the end of the
+ *                      file.
+ *
+ * @param block_size    The size of the blocks hashed separately, 0 to hash
+ *                      the whole range at once.
+ *
+ * @return              The hashes, to be freed with sftp_file_hash_free(),
+ *                      NULL on error with ssh and sftp error set.
+ */
+LIBSSH_API sftp_file_hash sftp_check_file_handle(sftp_file file,
+    const char *algorithms, uint64_t offset, uint64_t length,
+    uint32_t block_size);
+
+/**
+ * @brief Get the hash of a file as computed by the server, with the
+ * check-file-name extension.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param path          The path of the file.
+ *
+ * @see                 sftp_check_file_handle()
+ */
+LIBSSH_API sftp_file_hash sftp_check_file_name(sftp_session sftp,
+    const char *path, const char *algorithms, uint64_t offset,
+    uint64_t length, uint32_t block_size);
+
+/**
+ * @brief Free the memory of the hashes of a file.
+ *
+ * @param hash          The hashes to free.
+ */
+LIBSSH_API void sftp_file_hash_free(sftp_file_hash hash);
+
+/**
+ * @brief Get a download ready to go on where an interrupted one stopped.
+ *
+ * The local file is taken as the first part of the remote one if it isn't
+ * bigger. With verify, this is checked: the server hashes that part with
+ * check-file if it can, otherwise its last SFTP_RESUME_CHECK_SIZE bytes are
+ * read back and compared. If the check fails, the local file is truncated
+ * and the download starts over.
+ *
+ * The remote file and the local file descriptor are then both positioned
+ * where the download goes on, for sftp_download() with a sink writing to fd.
+ *
+ * @param file          The remote file, opened for reading.
+ *
+ * @param fd            The local file, opened for reading and writing.
+ *
+ * @param verify        1 to check the data already downloaded, 0 to trust
+ *                      the size of the local file.
+ *
+ * @return              The offset the download goes on from, 0 if it starts
+ *                      over, -1 on error.
+ *
+ * @see                 sftp_download()
+ */
+LIBSSH_API int64_t sftp_download_resume(sftp_file file, int fd, int verify);
+
+/**
+ * @brief Get an upload ready to go on where an interrupted one stopped.
+ *
+ * This is sftp_download_resume() the other way round: the remote file is
+ * taken as the first part of the local one, and truncated if it isn't.
+ *
+ * @param fd            The local file, opened for reading.
+ *
+ * @param file          The remote file, opened for reading and writing.
+ *
+ * @param verify        1 to check the data already uploaded, 0 to trust the
+ *                      size of the remote file.
+ *
+ * @return              The offset the upload goes on from, 0 if it starts
+ *                      over, -1 on error.
+ *
+ * @see                 sftp_upload()
+ */
+LIBSSH_API int64_t sftp_upload_resume(int fd, sftp_file file, int verify);
+
+/**
+ * @brief Update a remote file to the content of a local one, sending only
+ * the blocks which differ.
+ *
+ * Both files are cut in blocks at the same offsets. The server hashes the
+ * blocks of the remote file with check-file if it can; otherwise the remote
+ * file is read through once and compared. The runs of blocks which differ
+ * and the data past the end of the remote file are then written with
+ * pipelined writes, and the remote file is truncated to the local size.
+ *
+ * Data moved to another offset isn't found: this suits files changed in
+ * place, like disk images.
+ *
+ * @param fd            The local file, read with pread() up to its size.
+ *
+ * @param file          The remote file, opened for reading and writing.
+ *
+ * @param block_size    The size of the blocks compared, 0 for
+ *                      SFTP_DELTA_BLOCK_SIZE.
+ *
+ * @param opts          The number and size of the writes in flight, NULL for
+ *                      the defaults.
+ *
+ * @return              The number of bytes sent, < 0 on error with ssh and
+ *                      sftp error set. The remote file offset is left at the
+ *                      end of the file.
+ *
+ * @see                 sftp_check_file_handle()
+ * @see                 sftp_upload()
+ */
+LIBSSH_API int64_t sftp_upload_delta(int fd, sftp_file file,
+    uint32_t block_size, sftp_upload_options opts);
+
 /**
  * @brief Canonicalize a sftp path.
  *
@@ -762,10 +1699,192 @@ LIBSSH_API sftp_session sftp_server_new(ssh_session session, ssh_channel chan);
  * @return             0 on success, < 0 on error.
  */
 LIBSSH_API int sftp_server_init(sftp_session sftp);
+
+/**
+ * @brief SFTP server request handler.
+ *
+ * The handler owns the request: it answers it with one of the sftp_reply_*()
+ * functions and frees it with sftp_client_message_free(), either before
+ * returning or later, e.g. once a slow read of the disk is done. The
+ * requests answered later don't hold up the other ones, and the answers go
+ * out in the order they are given.
+ *
+ * The strings of the request point into the packet it came in, which is
+ * kept until the request is freed. The request is then reused by the next
+ * ones of the session, so it has to be freed before the sftp session.
+ *
+ * The handler must not free the sftp session.
+ *
+ * @param msg           The request of the client.
+ *
+ * @param userdata      Userdata of the handler.
+ *
+ * @return              SSH_OK if the handler took the request, SSH_ERROR to
+ *                      have it answered with SSH_FX_FAILURE; it mustn't be
+ *                      answered nor freed by the handler then.
+ */
+typedef int (*sftp_server_handler)(sftp_client_message msg, void *userdata);
+
+/**
+ * @brief Set the handler of a type of request, e.g. SSH_FXP_OPEN.
+ *
+ * The requests no handler is set for are answered with
+ * SSH_FX_OP_UNSUPPORTED. SSH_FXP_INIT is always answered by the library.
+ *
+ * @param sftp          The sftp server session.
+ *
+ * @param type          The type of the requests.
+ *
+ * @param handler       The handler, NULL to remove it.
+ *
+ * @param userdata      Userdata given to the handler.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see sftp_server_start()
+ */
+LIBSSH_API int sftp_server_set_handler(sftp_session sftp, uint8_t type,
+    sftp_server_handler handler, void *userdata);
+
+/**
+ * @brief Dispatch the requests of a session to their handlers as they
+ * arrive.
+ *
+ * This sets the callbacks of the channel of the session: each request is
+ * given to its handler from the data callback, so from any loop processing
+ * the ssh session, e.g. ssh_event_dopoll() with the session added to the
+ * event. sftp_server_init() doesn't need to be called before.
+ *
+ * If the client breaks the protocol, the channel is closed.
+ *
+ * @param sftp          The sftp server session.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see sftp_server_set_handler()
+ */
+LIBSSH_API int sftp_server_start(sftp_session sftp);
+
+#ifndef _WIN32
+/**
+ * @brief SFTP server pool callback, run by a worker to do the blocking part
+ * of a request, e.g. the pread() of a SSH_FXP_READ.
+ *
+ * It runs in the thread of the worker: it must only read the request and
+ * keep its results in userdata, without calling into the sftp or ssh
+ * session.
+ *
+ * @param msg           The request.
+ *
+ * @param userdata      Userdata given with the request.
+ */
+typedef void (*sftp_server_work_callback)(sftp_client_message msg,
+    void *userdata);
+
+/**
+ * @brief SFTP server pool callback, run in the thread of the event once the
+ * work is done, to answer the request and free it.
+ *
+ * @param msg           The request, to answer with the sftp_reply_*()
+ *                      functions and free with sftp_client_message_free().
+ *
+ * @param userdata      Userdata given with the request.
+ */
+typedef void (*sftp_server_done_callback)(sftp_client_message msg,
+    void *userdata);
+
+/**
+ * @brief Create a pool of workers for the blocking file operations of sftp
+ * server sessions.
+ *
+ * libssh doesn't create threads: the workers are the threads of the
+ * application running sftp_server_pool_run(), as many as the pool should
+ * have.
+ *
+ * @param event         The event the sessions are processed with. The
+ *                      completions are posted to it.
+ *
+ * @param quota         The number of requests of one sftp session given to
+ *                      the workers at once, 0 for no limit. The requests
+ *                      over it wait for one of the session to be done.
+ *
+ * @return              A new pool, NULL on error.
+ */
+LIBSSH_API sftp_server_pool sftp_server_pool_new(ssh_event event,
+    unsigned int quota);
+
+/**
+ * @brief Run a request on a worker of a pool.
+ *
+ * Called from the thread of the event, typically from a handler set with
+ * sftp_server_set_handler(), which returns SSH_OK as the request is taken.
+ * The objects the work needs, like the file descriptor of the handle,
+ * should be looked up there and given in userdata.
+ *
+ * @param pool          The pool.
+ *
+ * @param msg           The request. The pool owns it until the done
+ *                      callback.
+ *
+ * @param work          The work, run by a worker.
+ *
+ * @param done          The completion, run in the thread of the event.
+ *
+ * @param userdata      Userdata given to both callbacks.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error; the request
+ *                      is left to the caller then.
+ */
+LIBSSH_API int sftp_server_pool_submit(sftp_server_pool pool,
+    sftp_client_message msg, sftp_server_work_callback work,
+    sftp_server_done_callback done, void *userdata);
+
+/**
+ * @brief Run the requests given to a pool, as one of its workers.
+ *
+ * @param pool          The pool.
+ *
+ * @return              SSH_OK once the pool is stopped, SSH_ERROR on error.
+ */
+LIBSSH_API int sftp_server_pool_run(sftp_server_pool pool);
+
+/**
+ * @brief Stop the workers of a pool. They return from
+ * sftp_server_pool_run() once the requests already queued are run.
+ *
+ * @param pool          The pool.
+ */
+LIBSSH_API void sftp_server_pool_stop(sftp_server_pool pool);
+
+/**
+ * @brief Get the number of requests of a pool which aren't done yet.
+ *
+ * @param pool          The pool.
+ *
+ * @return              The requests queued, running, or waiting for their
+ *                      completion to run.
+ */
+LIBSSH_API unsigned int sftp_server_pool_jobs(sftp_server_pool pool);
+
+/**
+ * @brief Free a pool.
+ *
+ * The workers must have returned, and the completions must have run: the
+ * sessions of the requests must not be freed before. The requests which
+ * never completed are freed without an answer.
+ *
+ * @param pool          The pool.
+ */
+LIBSSH_API void sftp_server_pool_free(sftp_server_pool pool);
+#endif /* _WIN32 */
 #endif  /* WITH_SERVER */
 
 /* this is not a public interface */
+/* the initial size of the handle table of a server, doubled when full */
 #define SFTP_HANDLES 256
+#define SFTP_HANDLES_MAX (1 << 24)
+/* the biggest packet the server takes, as OpenSSH does */
+#define SFTP_SERVER_PACKET_MAX (256 * 1024)
 sftp_packet sftp_packet_read(sftp_session sftp);
 int sftp_packet_write(sftp_session sftp,uint8_t type, ssh_buffer payload);
 void sftp_packet_free(sftp_packet packet);
@@ -775,6 +1894,7 @@ sftp_attributes sftp_parse_attr(sftp_session session, ssh_buffer buf,int expectn
 
 sftp_client_message sftp_get_client_message(sftp_session sftp);
 void sftp_client_message_free(sftp_client_message msg);
+void sftp_client_messages_free(sftp_session sftp);
 int sftp_reply_name(sftp_client_message msg, const char *name,
     sftp_attributes attr);
 int sftp_reply_handle(sftp_client_message msg, ssh_string handle);
@@ -785,8 +1905,17 @@ int sftp_reply_status(sftp_client_message msg, uint32_t status, const char *mess
 int sftp_reply_names_add(sftp_client_message msg, const char *file,
     const char *longname, sftp_attributes attr);
 int sftp_reply_names(sftp_client_message msg);
+#ifndef _WIN32
+/* the entries of dir which fit in a reply, 0 once at the end */
+int sftp_reply_names_dir(sftp_client_message msg, DIR *dir);
+#endif
 int sftp_reply_data(sftp_client_message msg, const void *data, int len);
+int sftp_reply_data_fd(sftp_client_message msg, int fd, uint64_t offset,
+    uint32_t len);
+int sftp_handle_release(sftp_session sftp, ssh_string handle);
 void sftp_handle_remove(sftp_session sftp, void *handle);
+int sftp_server_reply_init(sftp_session sftp, sftp_packet packet);
+void sftp_server_dispatch_free(struct sftp_server_dispatch *dispatch);
 
 /* SFTP commands and constants */
 #define SSH_FXP_INIT 1
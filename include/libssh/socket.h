@@ -23,12 +23,26 @@
 #define SOCKET_H_
 
 #include "libssh/callbacks.h"
+#ifdef _WIN32
+/* the data is written with one call per element there */
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+#else
+#include <sys/uio.h>
+#endif
 struct ssh_poll_handle_struct;
+struct addrinfo;
 /* socket.c */
 
 struct ssh_socket_struct;
 typedef struct ssh_socket_struct* ssh_socket;
 
+/* bounds of the adaptive number of bytes read from the socket at once */
+#define SSH_SOCKET_READ_MIN 4096
+#define SSH_SOCKET_READ_MAX (256 * 1024)
+
 int ssh_socket_init(void);
 void ssh_socket_cleanup(void);
 ssh_socket ssh_socket_new(ssh_session session);
@@ -43,24 +57,38 @@ int ssh_socket_connect_proxycommand(ssh_socket s, const char *command);
 #endif
 void ssh_socket_close(ssh_socket s);
 int ssh_socket_write(ssh_socket s,const void *buffer, int len);
+int ssh_socket_writev(ssh_socket s, const struct iovec *iov, int iovcnt);
+void *ssh_socket_reserve(ssh_socket s, uint32_t len);
+int ssh_socket_commit(ssh_socket s, uint32_t len);
 int ssh_socket_is_open(ssh_socket s);
 int ssh_socket_fd_isset(ssh_socket s, fd_set *set);
 void ssh_socket_fd_set(ssh_socket s, fd_set *set, socket_t *max_fd);
 void ssh_socket_set_fd_in(ssh_socket s, socket_t fd);
 void ssh_socket_set_fd_out(ssh_socket s, socket_t fd);
 int ssh_socket_nonblocking_flush(ssh_socket s);
+void ssh_socket_cork(ssh_socket s);
+int ssh_socket_uncork(ssh_socket s);
 void ssh_socket_set_write_wontblock(ssh_socket s);
 void ssh_socket_set_read_wontblock(ssh_socket s);
 void ssh_socket_set_except(ssh_socket s);
 int ssh_socket_get_status(ssh_socket s);
 int ssh_socket_data_available(ssh_socket s);
 int ssh_socket_data_writable(ssh_socket s);
+uint32_t ssh_socket_buffered(ssh_socket s);
+uint32_t ssh_socket_buffered_out(ssh_socket s);
 
 void ssh_socket_set_callbacks(ssh_socket s, ssh_socket_callbacks callbacks);
+void ssh_socket_set_transport(ssh_socket s, ssh_transport_callbacks transport,
+    socket_t fd);
 int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int revents, void *v_s);
 struct ssh_poll_handle_struct * ssh_socket_get_poll_handle_in(ssh_socket s);
 struct ssh_poll_handle_struct * ssh_socket_get_poll_handle_out(ssh_socket s);
+struct ssh_poll_ctx_struct * ssh_socket_get_poll_ctx(ssh_socket s);
 
 int ssh_socket_connect(ssh_socket s, const char *host, int port, const char *bind_addr);
+int ssh_socket_connect_ai(ssh_socket s, const struct addrinfo *ai, int port,
+    const char *bind_addr);
+int ssh_socket_connect_fd(ssh_socket s, socket_t fd);
+int ssh_socket_is_resolving(ssh_socket s);
 
 #endif /* SOCKET_H_ */
@@ -28,5 +28,21 @@
 int ssh_threads_init(void);
 void ssh_threads_finalize(void);
 const char *ssh_threads_get_type(void);
+int ssh_threads_mutex_init(void **lock);
+int ssh_threads_mutex_destroy(void **lock);
+int ssh_threads_mutex_lock(void **lock);
+int ssh_threads_mutex_unlock(void **lock);
+int ssh_threads_mutex_once(void **lock, int *initialized);
+void ssh_threads_yield(void);
+void ssh_threads_spin_lock(int *lock);
+void ssh_threads_spin_unlock(int *lock);
+
+int ssh_atomic_load_int(int *ptr);
+void ssh_atomic_store_int(int *ptr, int value);
+int ssh_atomic_cas_int(int *ptr, int expected, int desired);
+void ssh_atomic_add_u32(uint32_t *ptr, uint32_t value);
+void ssh_atomic_add_u64(uint64_t *ptr, uint64_t value);
+uint64_t ssh_atomic_load_u64(uint64_t *ptr);
+void ssh_atomic_max_u64(uint64_t *ptr, uint64_t value);
 
 #endif /* THREADS_H_ */
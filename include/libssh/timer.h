@@ -0,0 +1,47 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include "libssh/libssh.h"
+#include "libssh/poll.h"
+
+/*
+ * timer.c: the timers of a poll context are kept in a hierarchical timer
+ * wheel and run by ssh_poll_ctx_dopoll(), which doesn't wait past the next
+ * expiry.
+ */
+struct ssh_timer_wheel;
+
+struct ssh_timer_wheel *ssh_timer_wheel_new(void);
+void ssh_timer_wheel_free(struct ssh_timer_wheel *wheel);
+int ssh_timer_wheel_pending(struct ssh_timer_wheel *wheel);
+int ssh_timer_wheel_timeout(struct ssh_timer_wheel *wheel, int timeout);
+void ssh_timer_wheel_run(struct ssh_timer_wheel *wheel);
+
+ssh_timer ssh_timer_new(ssh_timer *owner, ssh_poll_ctx ctx,
+    ssh_session session, ssh_channel channel, ssh_timer_callback cb,
+    void *userdata);
+void ssh_timers_move(ssh_timer timers, ssh_poll_ctx ctx);
+void ssh_timers_free(ssh_timer *timers);
+void ssh_timers_free_channel(ssh_timer *timers, ssh_channel channel);
+
+#endif /* TIMER_H_ */
+/* vim: set ts=2 sw=2 et cindent: */
@@ -32,17 +32,36 @@ void md5_final(unsigned char *md,MD5CTX c);
 SHACTX sha1_init(void);
 void sha1_update(SHACTX c, const void *data, unsigned long len);
 void sha1_final(unsigned char *md,SHACTX c);
+SHACTX sha1_duplicate(SHACTX c);
 void sha1(unsigned char *digest,int len,unsigned char *hash);
+SHA256CTX sha256_init(void);
+void sha256_update(SHA256CTX c, const void *data, unsigned long len);
+void sha256_final(unsigned char *md, SHA256CTX c);
+SHA256CTX sha256_duplicate(SHA256CTX c);
+SHA512CTX sha512_init(void);
+void sha512_update(SHA512CTX c, const void *data, unsigned long len);
+void sha512_final(unsigned char *md, SHA512CTX c);
 #define HMAC_SHA1 1
 #define HMAC_MD5 2
+#define HMAC_SHA256 3
+#define HMAC_SHA512 4
 HMACCTX hmac_init(const void *key,int len,int type);
 void hmac_update(HMACCTX c, const void *data, unsigned long len);
 void hmac_final(HMACCTX ctx,unsigned char *hashmacbuf,unsigned int *len);
+/* keyed contexts reused across packets */
+void hmac_reset(HMACCTX ctx);
+void hmac_digest(HMACCTX ctx, unsigned char *hashmacbuf, unsigned int *len);
+void hmac_free(HMACCTX ctx);
 
 int crypt_set_algorithms(ssh_session );
 int crypt_set_algorithms_server(ssh_session session);
 struct ssh_crypto_struct *crypto_new(void);
+struct crypto_struct *cipher_copy(struct crypto_struct *cipher);
+void cipher_free(struct crypto_struct *cipher);
 void crypto_free(struct ssh_crypto_struct *crypto);
+void crypto_free_kex(struct ssh_crypto_struct *crypto);
+int crypt_set_keys(struct ssh_crypto_struct *crypto);
+struct ssh_hmac_struct *ssh_get_hmactab(void);
 
 
 #endif /* WRAPPER_H_ */
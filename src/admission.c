@@ -0,0 +1,228 @@
+/*
+ * admission.c - the connections a server lets in before the authentication
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include "libssh/priv.h"
+#include "libssh/threads.h"
+#include "libssh/admission.h"
+
+/* the table of the sources isn't pruned below this size */
+#define ADMISSION_PRUNE_MIN 1024
+
+struct ssh_admission_struct *ssh_admission_new(void) {
+  struct ssh_admission_struct *admission;
+
+  admission = malloc(sizeof(struct ssh_admission_struct));
+  if (admission == NULL) {
+    return NULL;
+  }
+  admission->refs = 1;
+
+  return admission;
+}
+
+/*
+ * Counts one more unauthenticated session, unless there are already max of
+ * them (0 for no limit). Returns 0 if the session is let in, -1 if not.
+ */
+int ssh_admission_enter(struct ssh_admission_struct *admission,
+    unsigned int max) {
+  int refs;
+
+  do {
+    refs = ssh_atomic_load_int(&admission->refs);
+    if (max > 0 && (unsigned int) (refs - 1) >= max) {
+      return -1;
+    }
+  } while (!ssh_atomic_cas_int(&admission->refs, refs, refs + 1));
+
+  return 0;
+}
+
+/* gives the reference back, the last one frees it */
+void ssh_admission_leave(struct ssh_admission_struct **admission) {
+  int refs;
+
+  if (*admission == NULL) {
+    return;
+  }
+  do {
+    refs = ssh_atomic_load_int(&(*admission)->refs);
+  } while (!ssh_atomic_cas_int(&(*admission)->refs, refs, refs - 1));
+  if (refs == 1) {
+    free(*admission);
+  }
+  *admission = NULL;
+}
+
+/* the unauthenticated sessions, as seen by the bind */
+unsigned int ssh_admission_count(struct ssh_admission_struct *admission) {
+  return ssh_atomic_load_int(&admission->refs) - 1;
+}
+
+/*
+ * The key of the source of a connection: the IPv4 address, or the /64
+ * network of an IPv6 address, which is what a host gets.
+ */
+uint64_t ssh_admission_key(const struct sockaddr *addr) {
+  const struct sockaddr_in *sin;
+  const struct sockaddr_in6 *sin6;
+  const unsigned char *a;
+  uint64_t key = 0;
+  int i;
+
+  if (addr->sa_family == AF_INET) {
+    sin = (const struct sockaddr_in *) addr;
+    return 0xffff00000000ULL | ntohl(sin->sin_addr.s_addr);
+  }
+  if (addr->sa_family != AF_INET6) {
+    return 0;
+  }
+
+  sin6 = (const struct sockaddr_in6 *) addr;
+  a = sin6->sin6_addr.s6_addr;
+  if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+    return 0xffff00000000ULL | ((uint64_t) a[12] << 24) |
+        ((uint64_t) a[13] << 16) | ((uint64_t) a[14] << 8) | a[15];
+  }
+  for (i = 0; i < 8; i++) {
+    key = (key << 8) | a[i];
+  }
+
+  return key;
+}
+
+/* the tokens of a bucket at the time now */
+static uint32_t admission_refill(const struct ssh_admission_source *source,
+    unsigned int rate, unsigned int burst, uint64_t now) {
+  uint64_t tokens = source->tokens;
+
+  if (now > source->last) {
+    tokens += (now - source->last) * rate;
+  }
+  if (tokens > (uint64_t) burst * 1000) {
+    tokens = (uint64_t) burst * 1000;
+  }
+
+  return (uint32_t) tokens;
+}
+
+/* takes the full buckets out, they are the same as no bucket */
+static void admission_prune(struct ssh_admission_sources *sources,
+    unsigned int rate, unsigned int burst, uint64_t now) {
+  struct ssh_hashtable_entry *entry;
+  struct ssh_hashtable_entry *next;
+  struct ssh_admission_source *source;
+
+  for (entry = ssh_hashtable_first(sources->table); entry != NULL;
+      entry = next) {
+    next = ssh_hashtable_next(sources->table, entry);
+    source = entry->data;
+    if (admission_refill(source, rate, burst, now) == burst * 1000) {
+      ssh_hashtable_remove(sources->table, entry->key, source);
+      free(source);
+    }
+  }
+
+  sources->prune = sources->table->count * 2;
+  if (sources->prune < ADMISSION_PRUNE_MIN) {
+    sources->prune = ADMISSION_PRUNE_MIN;
+  }
+}
+
+/*
+ * Lets a connection of the source in if its bucket has a token: the bucket
+ * gets rate tokens a second, up to burst. Returns 0 if the connection is
+ * let in, -1 if not.
+ */
+int ssh_admission_rate(struct ssh_admission_sources *sources, uint64_t key,
+    unsigned int rate, unsigned int burst, uint64_t now) {
+  struct ssh_admission_source *source;
+  uint32_t tokens;
+
+  if (rate == 0) {
+    return 0;
+  }
+  if (burst == 0) {
+    burst = rate;
+  }
+  if (sources->table == NULL) {
+    sources->table = ssh_hashtable_new();
+    if (sources->table == NULL) {
+      return 0;
+    }
+    sources->prune = ADMISSION_PRUNE_MIN;
+  }
+
+  source = ssh_hashtable_lookup(sources->table, key);
+  if (source == NULL) {
+    if (sources->table->count >= sources->prune) {
+      admission_prune(sources, rate, burst, now);
+    }
+    source = malloc(sizeof(struct ssh_admission_source));
+    if (source == NULL) {
+      return 0;
+    }
+    source->last = now;
+    source->tokens = burst * 1000;
+    if (ssh_hashtable_insert(sources->table, key, source) < 0) {
+      free(source);
+      return 0;
+    }
+  }
+
+  tokens = admission_refill(source, rate, burst, now);
+  source->last = now;
+  if (tokens < 1000) {
+    source->tokens = tokens;
+    return -1;
+  }
+  source->tokens = tokens - 1000;
+
+  return 0;
+}
+
+void ssh_admission_sources_free(struct ssh_admission_sources *sources) {
+  struct ssh_hashtable_entry *entry;
+
+  if (sources->table == NULL) {
+    return;
+  }
+  for (entry = ssh_hashtable_first(sources->table); entry != NULL;
+      entry = ssh_hashtable_next(sources->table, entry)) {
+    free(entry->data);
+  }
+  ssh_hashtable_free(sources->table);
+  sources->table = NULL;
+}
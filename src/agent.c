@@ -54,6 +54,8 @@
 #include "libssh/session.h"
 #include "libssh/keys.h"
 #include "libssh/poll.h"
+#include "libssh/misc.h"
+#include "libssh/threads.h"
 
 /* macro to check for "agent failure" message */
 #define agent_failed(x) \
@@ -122,6 +124,233 @@ static size_t atomicio(ssh_socket s, void *buf, size_t n, int do_read) {
   return pos;
 }
 
+/*
+ * The identities of the agent and its idle connections, kept for the next
+ * sessions. Everything belongs to the agent of agent_cache_path and is
+ * dropped when SSH_AUTH_SOCK changes.
+ */
+#define AGENT_POOL_SIZE 4
+
+static char *agent_cache_path = NULL;
+static socket_t agent_pool[AGENT_POOL_SIZE];
+static unsigned int agent_pool_count = 0;
+static ssh_buffer agent_cache_ident = NULL; /* the answer after its count */
+static unsigned int agent_cache_count = 0;
+static uint64_t agent_cache_time = 0;
+static uint64_t agent_cache_timeout = 0; /* in ms, 0 when disabled */
+static void *agent_cache_lock = NULL;
+static int agent_cache_initialized = 0;
+
+/* called with the lock held */
+static void agent_cache_forget_ident(void) {
+  ssh_buffer_free(agent_cache_ident);
+  agent_cache_ident = NULL;
+  agent_cache_count = 0;
+}
+
+/* called with the lock held */
+static void agent_cache_flush(void) {
+  while (agent_pool_count > 0) {
+    close(agent_pool[--agent_pool_count]);
+  }
+  agent_cache_forget_ident();
+  SAFE_FREE(agent_cache_path);
+}
+
+/* called with the lock held, returns 0 if the cache belongs to the agent */
+static int agent_cache_select(const char *path) {
+  if (agent_cache_timeout == 0) {
+    return -1;
+  }
+  if (agent_cache_path != NULL && strcmp(agent_cache_path, path) == 0) {
+    return 0;
+  }
+  agent_cache_flush();
+  agent_cache_path = strdup(path);
+  if (agent_cache_path == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Keep the identities of the ssh agent and its connections for the
+ * next sessions.
+ *
+ * Every session connects to the agent and asks the list of its identities.
+ * With a cache, the list is asked once for all the sessions until it
+ * expires, and the connections of the freed sessions are kept for the next
+ * ones. The identities are asked again after a signature is refused, a key
+ * may have been removed from the agent.
+ *
+ * The cache is disabled by default. Calling this function again drops the
+ * cached list, for instance after keys are added to the agent.
+ *
+ * The cache is shared by the sessions of all the threads.
+ *
+ * @param[in]  seconds  How long the identities are kept, 0 disables the
+ *                      cache and closes the idle connections.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_set_agent_cache_timeout(unsigned int seconds) {
+  if (ssh_threads_mutex_once(&agent_cache_lock, &agent_cache_initialized) < 0) {
+    return SSH_ERROR;
+  }
+
+  ssh_threads_mutex_lock(&agent_cache_lock);
+  agent_cache_flush();
+  agent_cache_timeout = (uint64_t) seconds * 1000;
+  ssh_threads_mutex_unlock(&agent_cache_lock);
+
+  return SSH_OK;
+}
+
+/* returns an idle connection to the agent, SSH_INVALID_SOCKET if none */
+static socket_t agent_pool_take(const char *path) {
+  socket_t fd = SSH_INVALID_SOCKET;
+  ssh_pollfd_t pfd;
+
+  if (!ssh_atomic_load_int(&agent_cache_initialized)) {
+    return SSH_INVALID_SOCKET;
+  }
+
+  ssh_threads_mutex_lock(&agent_cache_lock);
+  if (agent_cache_select(path) == 0) {
+    while (agent_pool_count > 0) {
+      fd = agent_pool[--agent_pool_count];
+
+      /* an idle connection has nothing to read, unless the agent closed it */
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (ssh_poll(&pfd, 1, 0) == 0) {
+        break;
+      }
+      close(fd);
+      fd = SSH_INVALID_SOCKET;
+    }
+  }
+  ssh_threads_mutex_unlock(&agent_cache_lock);
+
+  return fd;
+}
+
+/* keeps the connection for the next sessions, returns 0 if it was kept */
+static int agent_pool_give(const char *path, socket_t fd) {
+  int rc = -1;
+
+  if (!ssh_atomic_load_int(&agent_cache_initialized)) {
+    return -1;
+  }
+
+  ssh_threads_mutex_lock(&agent_cache_lock);
+  if (agent_cache_select(path) == 0 && agent_pool_count < AGENT_POOL_SIZE) {
+    agent_pool[agent_pool_count++] = fd;
+    rc = 0;
+  }
+  ssh_threads_mutex_unlock(&agent_cache_lock);
+
+  return rc;
+}
+
+/* copies what is left to read in the buffer */
+static ssh_buffer agent_buffer_copy(ssh_buffer src) {
+  ssh_buffer copy;
+  uint32_t len = buffer_get_rest_len(src);
+
+  copy = ssh_buffer_new();
+  if (copy == NULL) {
+    return NULL;
+  }
+  if (len > 0 && buffer_add_data(copy, buffer_get_rest(src), len) < 0) {
+    ssh_buffer_free(copy);
+    return NULL;
+  }
+
+  return copy;
+}
+
+/* gives a copy of the cached identities to the agent, returns 0 on a hit */
+static int agent_cache_get_ident(const char *path, ssh_agent agent) {
+  ssh_buffer ident;
+  int rc = -1;
+
+  if (!ssh_atomic_load_int(&agent_cache_initialized)) {
+    return -1;
+  }
+
+  ssh_threads_mutex_lock(&agent_cache_lock);
+  if (agent_cache_select(path) == 0 && agent_cache_ident != NULL) {
+    if (ssh_timestamp_ms() - agent_cache_time >= agent_cache_timeout) {
+      agent_cache_forget_ident();
+    } else {
+      ident = agent_buffer_copy(agent_cache_ident);
+      if (ident != NULL) {
+        ssh_buffer_free(agent->ident);
+        agent->ident = ident;
+        agent->count = agent_cache_count;
+        rc = 0;
+      }
+    }
+  }
+  ssh_threads_mutex_unlock(&agent_cache_lock);
+
+  return rc;
+}
+
+/* caches the identities, reply is read after the count */
+static void agent_cache_put_ident(const char *path, ssh_buffer reply,
+    unsigned int count) {
+  ssh_buffer ident;
+
+  if (!ssh_atomic_load_int(&agent_cache_initialized)) {
+    return;
+  }
+
+  ident = agent_buffer_copy(reply);
+  if (ident == NULL) {
+    return;
+  }
+
+  ssh_threads_mutex_lock(&agent_cache_lock);
+  if (agent_cache_select(path) == 0) {
+    agent_cache_forget_ident();
+    agent_cache_ident = ident;
+    agent_cache_count = count;
+    agent_cache_time = ssh_timestamp_ms();
+    ident = NULL;
+  }
+  ssh_threads_mutex_unlock(&agent_cache_lock);
+
+  ssh_buffer_free(ident);
+}
+
+/* the agent refused a key, the identities are asked again */
+static void agent_cache_invalidate(void) {
+  if (!ssh_atomic_load_int(&agent_cache_initialized)) {
+    return;
+  }
+
+  ssh_threads_mutex_lock(&agent_cache_lock);
+  agent_cache_forget_ident();
+  ssh_threads_mutex_unlock(&agent_cache_lock);
+}
+
+/** @internal
+ * @brief closes the idle agent connections, called by ssh_finalize()
+ */
+void ssh_agent_cache_finalize(void) {
+  if (!ssh_atomic_load_int(&agent_cache_initialized)) {
+    return;
+  }
+  ssh_set_agent_cache_timeout(0);
+  ssh_threads_mutex_destroy(&agent_cache_lock);
+  agent_cache_lock = NULL;
+  agent_cache_initialized = 0;
+}
+
 ssh_agent agent_new(struct ssh_session_struct *session) {
   ssh_agent agent = NULL;
 
@@ -142,11 +371,21 @@ ssh_agent agent_new(struct ssh_session_struct *session) {
 }
 
 void agent_close(struct ssh_agent_struct *agent) {
+  const char *auth_sock;
+  socket_t fd;
+
   if (agent == NULL) {
     return;
   }
 
-  if (getenv("SSH_AUTH_SOCK")) {
+  auth_sock = getenv("SSH_AUTH_SOCK");
+  if (auth_sock) {
+    /* a connection in a known state goes back to the pool */
+    fd = ssh_socket_get_fd_in(agent->sock);
+    if (fd != SSH_INVALID_SOCKET && !agent->busy &&
+        agent_pool_give(auth_sock, fd) == 0) {
+      ssh_socket_set_fd(agent->sock, SSH_INVALID_SOCKET);
+    }
     ssh_socket_close(agent->sock);
   }
 }
@@ -166,6 +405,7 @@ void agent_free(ssh_agent agent) {
 
 static int agent_connect(ssh_session session) {
   const char *auth_sock = NULL;
+  socket_t fd;
 
   if (session == NULL || session->agent == NULL) {
     return -1;
@@ -174,6 +414,12 @@ static int agent_connect(ssh_session session) {
   auth_sock = getenv("SSH_AUTH_SOCK");
 
   if (auth_sock && *auth_sock) {
+    fd = agent_pool_take(auth_sock);
+    if (fd != SSH_INVALID_SOCKET) {
+      ssh_socket_set_fd(session->agent->sock, fd);
+      session->agent->busy = 0;
+      return 0;
+    }
     if (ssh_socket_unix(session->agent->sock, auth_sock) < 0) {
       return -1;
     }
@@ -189,7 +435,7 @@ static int agent_decode_reply(struct ssh_session_struct *session, int type) {
     case SSH_AGENT_FAILURE:
     case SSH2_AGENT_FAILURE:
     case SSH_COM_AGENT2_FAILURE:
-      ssh_log(session, SSH_LOG_RARE, "SSH_AGENT_FAILURE");
+      SSH_LOG(session, SSH_LOG_RARE, "SSH_AGENT_FAILURE");
       return 0;
     case SSH_AGENT_SUCCESS:
       return 1;
@@ -209,19 +455,22 @@ static int agent_talk(struct ssh_session_struct *session,
   uint8_t payload[1024] = {0};
 
   len = buffer_get_rest_len(request);
-  ssh_log(session, SSH_LOG_PACKET, "agent_talk - len of request: %u", len);
+  SSH_LOG(session, SSH_LOG_PACKET, "agent_talk - len of request: %u", len);
   agent_put_u32(payload, len);
 
+  /* cleared once the whole reply is read */
+  session->agent->busy = 1;
+
   /* send length and then the request packet */
   if (atomicio(session->agent->sock, payload, 4, 0) == 4) {
     if (atomicio(session->agent->sock, buffer_get_rest(request), len, 0)
         != len) {
-      ssh_log(session, SSH_LOG_PACKET, "atomicio sending request failed: %s",
+      SSH_LOG(session, SSH_LOG_PACKET, "atomicio sending request failed: %s",
           strerror(errno));
       return -1;
     }
   } else {
-    ssh_log(session, SSH_LOG_PACKET,
+    SSH_LOG(session, SSH_LOG_PACKET,
         "atomicio sending request length failed: %s",
         strerror(errno));
     return -1;
@@ -229,7 +478,7 @@ static int agent_talk(struct ssh_session_struct *session,
 
   /* wait for response, read the length of the response packet */
   if (atomicio(session->agent->sock, payload, 4, 1) != 4) {
-    ssh_log(session, SSH_LOG_PACKET, "atomicio read response length failed: %s",
+    SSH_LOG(session, SSH_LOG_PACKET, "atomicio read response length failed: %s",
         strerror(errno));
     return -1;
   }
@@ -240,7 +489,7 @@ static int agent_talk(struct ssh_session_struct *session,
         "Authentication response too long: %u", len);
     return -1;
   }
-  ssh_log(session, SSH_LOG_PACKET, "agent_talk - response length: %u", len);
+  SSH_LOG(session, SSH_LOG_PACKET, "agent_talk - response length: %u", len);
 
   while (len > 0) {
     size_t n = len;
@@ -248,17 +497,18 @@ static int agent_talk(struct ssh_session_struct *session,
       n = sizeof(payload);
     }
     if (atomicio(session->agent->sock, payload, n, 1) != n) {
-      ssh_log(session, SSH_LOG_RARE,
+      SSH_LOG(session, SSH_LOG_RARE,
           "Error reading response from authentication socket.");
       return -1;
     }
     if (buffer_add_data(reply, payload, n) < 0) {
-      ssh_log(session, SSH_LOG_FUNCTIONS,
+      SSH_LOG(session, SSH_LOG_FUNCTIONS,
           "Not enough space");
       return -1;
     }
     len -= n;
   }
+  session->agent->busy = 0;
 
   return 0;
 }
@@ -269,6 +519,7 @@ int agent_get_ident_count(struct ssh_session_struct *session) {
   unsigned int type = 0;
   unsigned int c1 = 0, c2 = 0;
   uint8_t buf[4] = {0};
+  const char *auth_sock = getenv("SSH_AUTH_SOCK");
 
   switch (session->version) {
     case 1:
@@ -283,6 +534,14 @@ int agent_get_ident_count(struct ssh_session_struct *session) {
       return 0;
   }
 
+  /* the list asked by a previous session */
+  if (session->version == 2 && auth_sock != NULL &&
+      agent_cache_get_ident(auth_sock, session->agent) == 0) {
+    SSH_LOG(session, SSH_LOG_PACKET, "agent_ident_count - cached count: %d",
+        session->agent->count);
+    return session->agent->count;
+  }
+
   /* send message to the agent requesting the list of identities */
   request = ssh_buffer_new();
   if (buffer_add_u8(request, c1) < 0) {
@@ -304,7 +563,7 @@ int agent_get_ident_count(struct ssh_session_struct *session) {
 
   /* get message type and verify the answer */
   buffer_get_u8(reply, (uint8_t *) &type);
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "agent_ident_count - answer type: %d, expected answer: %d",
       type, c2);
   if (agent_failed(type)) {
@@ -317,7 +576,7 @@ int agent_get_ident_count(struct ssh_session_struct *session) {
 
   buffer_get_u32(reply, (uint32_t *) buf);
   session->agent->count = agent_get_u32(buf);
-  ssh_log(session, SSH_LOG_PACKET, "agent_ident_count - count: %d",
+  SSH_LOG(session, SSH_LOG_PACKET, "agent_ident_count - count: %d",
       session->agent->count);
   if (session->agent->count > 1024) {
     ssh_set_error(session, SSH_FATAL,
@@ -327,9 +586,11 @@ int agent_get_ident_count(struct ssh_session_struct *session) {
     return -1;
   }
 
-  if (session->agent->ident) {
-    buffer_reinit(session->agent->ident);
+  if (session->version == 2 && auth_sock != NULL) {
+    agent_cache_put_ident(auth_sock, reply, session->agent->count);
   }
+
+  ssh_buffer_free(session->agent->ident);
   session->agent->ident = reply;
 
   return session->agent->count;
@@ -456,7 +717,8 @@ ssh_string agent_sign_data(struct ssh_session_struct *session,
     goto error;
   }
   if (agent_failed(type)) {
-    ssh_log(session, SSH_LOG_RARE, "Agent reports failure in signing the key");
+    SSH_LOG(session, SSH_LOG_RARE, "Agent reports failure in signing the key");
+    agent_cache_invalidate();
     ssh_buffer_free(reply);
     return NULL;
   } else if (type != SSH2_AGENT_SIGN_RESPONSE) {
@@ -81,6 +81,20 @@ static int ask_userauth(ssh_session session) {
   return rc;
 }
 
+/*
+ * Queues the answer to a pipelined authentication request, when a pipeline
+ * is running.
+ */
+static void auth_add_reply(ssh_session session) {
+  if (session->auth_replies == NULL) {
+    return;
+  }
+  if (buffer_add_u8(session->auth_replies, session->auth_state) < 0) {
+    ssh_set_error_oom(session);
+    session->session_state = SSH_SESSION_STATE_ERROR;
+  }
+}
+
 /**
  * @internal
  *
@@ -95,10 +109,10 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_banner){
   enter_function();
   banner = buffer_get_ssh_string(packet);
   if (banner == NULL) {
-    ssh_log(session, SSH_LOG_RARE,
+    SSH_LOG(session, SSH_LOG_RARE,
         "Invalid SSH_USERAUTH_BANNER packet");
   } else {
-    ssh_log(session, SSH_LOG_PACKET,
+    SSH_LOG(session, SSH_LOG_PACKET,
         "Received SSH_USERAUTH_BANNER packet");
     if(session->banner != NULL)
       ssh_string_free(session->banner);
@@ -128,23 +142,26 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_failure){
     ssh_set_error(session, SSH_FATAL,
         "Invalid SSH_MSG_USERAUTH_FAILURE message");
     session->auth_state=SSH_AUTH_STATE_ERROR;
+    auth_add_reply(session);
     goto end;
   }
 
   auth_methods = ssh_string_to_char(auth);
   if (auth_methods == NULL) {
     ssh_set_error_oom(session);
+    session->auth_state=SSH_AUTH_STATE_ERROR;
+    auth_add_reply(session);
     goto end;
   }
 
   if (partial) {
     session->auth_state=SSH_AUTH_STATE_PARTIAL;
-    ssh_log(session,SSH_LOG_PROTOCOL,
+    SSH_LOG(session,SSH_LOG_PROTOCOL,
         "Partial success. Authentication that can continue: %s",
         auth_methods);
   } else {
     session->auth_state=SSH_AUTH_STATE_FAILED;
-    ssh_log(session, SSH_LOG_PROTOCOL,
+    SSH_LOG(session, SSH_LOG_PROTOCOL,
         "Access denied. Authentication that can continue: %s",
         auth_methods);
     ssh_set_error(session, SSH_REQUEST_DENIED,
@@ -165,6 +182,7 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_failure){
   if (strstr(auth_methods, "hostbased") != NULL) {
     session->auth_methods |= SSH_AUTH_METHOD_HOSTBASED;
   }
+  auth_add_reply(session);
 
 end:
   ssh_string_free(auth);
@@ -185,18 +203,17 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_success){
   (void)packet;
   (void)type;
   (void)user;
-  ssh_log(session,SSH_LOG_PACKET,"Received SSH_USERAUTH_SUCCESS");
-  ssh_log(session,SSH_LOG_PROTOCOL,"Authentication successful");
+  SSH_LOG(session,SSH_LOG_PACKET,"Received SSH_USERAUTH_SUCCESS");
+  SSH_LOG(session,SSH_LOG_PROTOCOL,"Authentication successful");
   session->auth_state=SSH_AUTH_STATE_SUCCESS;
   session->session_state=SSH_SESSION_STATE_AUTHENTICATED;
-  if(session->current_crypto && session->current_crypto->delayed_compress_out){
-  	ssh_log(session,SSH_LOG_PROTOCOL,"Enabling delayed compression OUT");
-  	session->current_crypto->do_compress_out=1;
-  }
-  if(session->current_crypto && session->current_crypto->delayed_compress_in){
-  	ssh_log(session,SSH_LOG_PROTOCOL,"Enabling delayed compression IN");
-  	session->current_crypto->do_compress_in=1;
+  ssh_latency_phase(session, SSH_LATENCY_AUTH);
+  auth_add_reply(session);
+#if defined(HAVE_LIBZ) && defined(WITH_LIBZ)
+  if (compress_start_delayed(session) < 0) {
+    session->session_state = SSH_SESSION_STATE_ERROR;
   }
+#endif
   leave_function();
   return SSH_PACKET_USED;
 }
@@ -212,14 +229,15 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_success){
 SSH_PACKET_CALLBACK(ssh_packet_userauth_pk_ok){
 	int rc;
 	enter_function();
-  ssh_log(session,SSH_LOG_PACKET,"Received SSH_USERAUTH_PK_OK/INFO_REQUEST");
+  SSH_LOG(session,SSH_LOG_PACKET,"Received SSH_USERAUTH_PK_OK/INFO_REQUEST");
   if(session->auth_state==SSH_AUTH_STATE_KBDINT_SENT){
     /* Assuming we are in keyboard-interactive context */
-    ssh_log(session,SSH_LOG_PACKET,"keyboard-interactive context, assuming SSH_USERAUTH_INFO_REQUEST");
+    SSH_LOG(session,SSH_LOG_PACKET,"keyboard-interactive context, assuming SSH_USERAUTH_INFO_REQUEST");
     rc=ssh_packet_userauth_info_request(session,type,packet,user);
   } else {
     session->auth_state=SSH_AUTH_STATE_PK_OK;
-    ssh_log(session,SSH_LOG_PACKET,"assuming SSH_USERAUTH_PK_OK");
+    SSH_LOG(session,SSH_LOG_PACKET,"assuming SSH_USERAUTH_PK_OK");
+    auth_add_reply(session);
     rc=SSH_PACKET_USED;
   }
   leave_function();
@@ -312,9 +330,9 @@ int ssh_auth_list(ssh_session session) {
  * @returns A bitfield of values SSH_AUTH_METHOD_NONE, SSH_AUTH_METHOD_PASSWORD,
             SSH_AUTH_METHOD_PUBLICKEY, SSH_AUTH_METHOD_HOSTBASED,
             SSH_AUTH_METHOD_INTERACTIVE.
+            SSH_AUTH_AGAIN in nonblocking mode, while the "none" request
+            sent to learn them waits for its answer: call it again later.
    @warning Other reserved flags may appear in future versions.
-   @warning This call will block, even in nonblocking mode, if run for the first
-            time before a (complete) call to ssh_userauth_none.
  */
 int ssh_userauth_list(ssh_session session, const char *username) {
   if (session == NULL) {
@@ -326,8 +344,9 @@ int ssh_userauth_list(ssh_session session, const char *username) {
     return SSH_AUTH_METHOD_PASSWORD;
   }
 #endif
-  if (session->auth_methods == 0) {
-    ssh_userauth_none(session, username);
+  if (session->auth_methods == 0 &&
+      ssh_userauth_none(session, username) == SSH_AUTH_AGAIN) {
+    return SSH_AUTH_AGAIN;
   }
   return session->auth_methods;
 }
@@ -365,7 +384,8 @@ int ssh_userauth_none(ssh_session session, const char *username) {
     return rc;
   }
 #endif
-  if(session->auth_methods != 0){
+  if (session->auth_methods != 0 &&
+      session->pending_call_state != SSH_PENDING_CALL_AUTH_NONE) {
     /* userauth_none or other method was already tried before */
     ssh_set_error(session,SSH_REQUEST_DENIED,"None method rejected by server");
     leave_function();
@@ -691,11 +711,17 @@ int ssh_userauth_pubkey(ssh_session session, const char *username,
     rc=SSH_ERROR;
   }
 
-  if (ask_userauth(session) < 0) {
+  rc = ask_userauth(session);
+  if (rc == SSH_AGAIN) {
     ssh_string_free(user);
     leave_function();
-    return rc;
+    return SSH_AUTH_AGAIN;
+  } else if (rc == SSH_ERROR) {
+    ssh_string_free(user);
+    leave_function();
+    return SSH_AUTH_ERROR;
   }
+  rc = SSH_AUTH_ERROR;
 
   service = ssh_string_from_char("ssh-connection");
   if (service == NULL) {
@@ -805,6 +831,8 @@ error:
  *          SSH_AUTH_PARTIAL: You've been partially authenticated, you still
  *                            have to use another method.\n
  *          SSH_AUTH_SUCCESS: Authentication successful.
+ *          SSH_AUTH_AGAIN:   In nonblocking mode, you've got to call this again
+ *                            later.
  *
  * @see publickey_from_file()
  * @see privatekey_from_file()
@@ -831,11 +859,11 @@ int ssh_userauth_privatekey_file(ssh_session session, const char *username,
 
   pubkey = publickey_from_file(session, pubkeyfile, &type);
   if (pubkey == NULL) {
-    ssh_log(session, SSH_LOG_RARE, "Public key file %s not found. Trying to generate it.", pubkeyfile);
+    SSH_LOG(session, SSH_LOG_RARE, "Public key file %s not found. Trying to generate it.", pubkeyfile);
     /* auto-detect the key type with type=0 */
     privkey = privatekey_from_file(session, filename, 0, passphrase);
   } else {
-    ssh_log(session, SSH_LOG_RARE, "Public key file %s loaded.", pubkeyfile);
+    SSH_LOG(session, SSH_LOG_RARE, "Public key file %s loaded.", pubkeyfile);
     privkey = privatekey_from_file(session, filename, type, passphrase);
   }
   if (privkey == NULL) {
@@ -870,6 +898,8 @@ error:
  *          SSH_AUTH_PARTIAL: You've been partially authenticated, you still
  *                            have to use another method.\n
  *          SSH_AUTH_SUCCESS: Authentication successful.
+ *          SSH_AUTH_AGAIN:   In nonblocking mode, you've got to call this again
+ *                            later.
  *
  * @see publickey_from_file()
  * @see privatekey_from_file()
@@ -889,6 +919,7 @@ int ssh_userauth_agent_pubkey(ssh_session session, const char *username,
   enter_function();
 
   if (! agent_is_running(session)) {
+    leave_function();
     return rc;
   }
 
@@ -910,11 +941,29 @@ int ssh_userauth_agent_pubkey(ssh_session session, const char *username,
     return rc;
   }
 
-  if (ask_userauth(session) < 0) {
+  switch(session->pending_call_state){
+  case SSH_PENDING_CALL_NONE:
+    break;
+  case SSH_PENDING_CALL_AUTH_AGENT_PUBKEY:
+    ssh_string_free(user);
+    user=NULL;
+    goto pending;
+  default:
+    ssh_set_error(session,SSH_FATAL,"Bad call during pending SSH call in ssh_userauth_agent_pubkey");
+    goto error;
+  }
+
+  rc = ask_userauth(session);
+  if (rc == SSH_AGAIN) {
     ssh_string_free(user);
     leave_function();
-    return rc;
+    return SSH_AUTH_AGAIN;
+  } else if (rc == SSH_ERROR) {
+    ssh_string_free(user);
+    leave_function();
+    return SSH_AUTH_ERROR;
   }
+  rc = SSH_AUTH_ERROR;
 
   service = ssh_string_from_char("ssh-connection");
   if (service == NULL) {
@@ -949,30 +998,34 @@ int ssh_userauth_agent_pubkey(ssh_session session, const char *username,
     goto error;
   }
 
+  /* the agent is local, it is asked in place */
   sign = ssh_do_sign_with_agent(session, session->out_buffer, publickey);
-
-  if (sign) {
-    if (buffer_add_ssh_string(session->out_buffer, sign) < 0) {
-      ssh_set_error_oom(session);
-      goto error;
-    }
-    ssh_string_free(sign);
-    session->auth_state=SSH_AUTH_STATE_NONE;
-    if (packet_send(session) == SSH_ERROR) {
-      leave_function();
-      return rc;
-    }
-    rc = wait_auth_status(session);
+  if (sign == NULL) {
+    goto error;
+  }
+  if (buffer_add_ssh_string(session->out_buffer, sign) < 0) {
+    ssh_set_error_oom(session);
+    goto error;
   }
 
+  ssh_string_free(sign);
   ssh_string_free(user);
   ssh_string_free(service);
   ssh_string_free(method);
   ssh_string_free(algo);
   ssh_string_free(key);
-
+  session->auth_state=SSH_AUTH_STATE_NONE;
+  session->pending_call_state=SSH_PENDING_CALL_AUTH_AGENT_PUBKEY;
+  if (packet_send(session) == SSH_ERROR) {
+    session->pending_call_state=SSH_PENDING_CALL_NONE;
+    leave_function();
+    return rc;
+  }
+pending:
+  rc = wait_auth_status(session);
+  if (rc != SSH_AUTH_AGAIN)
+    session->pending_call_state=SSH_PENDING_CALL_NONE;
   leave_function();
-
   return rc;
 error:
   buffer_reinit(session->out_buffer);
@@ -1129,28 +1182,68 @@ error:
   return rc;
 }
 
-/**
- * @brief Tries to automatically authenticate with public key and "none"
- *
- * It may fail, for instance it doesn't ask for a password and uses a default
- * asker for passphrases (in case the private key is encrypted).
- *
- * @param[in]  session  The ssh session to authenticate with.
- *
- * @param[in]  passphrase Use this passphrase to unlock the privatekey. Use NULL
- *                        if you don't want to use a passphrase or the user
- *                        should be asked.
- *
- * @returns SSH_AUTH_ERROR:   A serious error happened\n
- *          SSH_AUTH_DENIED:  Authentication failed: use another method\n
- *          SSH_AUTH_PARTIAL: You've been partially authenticated, you still
- *                            have to use another method\n
- *          SSH_AUTH_SUCCESS: Authentication success
- *
- * @see ssh_userauth_kbdint()
- * @see ssh_userauth_password()
+/* the public keys offered before the first one is accepted */
+#define AUTH_PUBKEY_WINDOW 4
+
+/* a public key tried by ssh_userauth_autopubkey() */
+struct auth_probe_struct {
+  ssh_string pubkey;
+  int type;
+  /* the identity file, or the comment of an agent key */
+  char *name;
+  /* set for the keys of the agent */
+  ssh_public_key agent_key;
+  /* the private key, once read */
+  ssh_private_key privkey;
+  /* the server answered SSH_MSG_USERAUTH_PK_OK */
+  int accepted;
+  /* the signed request was sent */
+  int tried;
+};
+
+/* a request waiting for its answer, the server answers in order */
+struct auth_expect_struct {
+  /* the key offered, -1 for the "none" request */
+  int probe;
+  int sign;
+};
+
+static void auth_probes_free(struct auth_probe_struct *probes, int nprobes) {
+  int i;
+
+  for (i = 0; i < nprobes; i++) {
+    ssh_string_free(probes[i].pubkey);
+    SAFE_FREE(probes[i].name);
+    publickey_free(probes[i].agent_key);
+    privatekey_free(probes[i].privkey);
+  }
+  SAFE_FREE(probes);
+}
+
+static struct auth_probe_struct *auth_probe_new(ssh_session session,
+    struct auth_probe_struct **probes, int *nprobes) {
+  struct auth_probe_struct *tmp;
+
+  tmp = realloc(*probes, (*nprobes + 1) * sizeof(struct auth_probe_struct));
+  if (tmp == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  *probes = tmp;
+  tmp = &tmp[*nprobes];
+  ZERO_STRUCTP(tmp);
+  (*nprobes)++;
+
+  return tmp;
+}
+
+/*
+ * Lists the keys of the agent, then the identity files. An identity without
+ * a public key file is read, and its public key file is written.
  */
-int ssh_userauth_autopubkey(ssh_session session, const char *passphrase) {
+static int auth_probes_collect(ssh_session session, const char *passphrase,
+    struct auth_probe_struct **probes, int *nprobes) {
+  struct auth_probe_struct *probe;
   struct ssh_iterator *it;
   ssh_private_key privkey;
   ssh_public_key pubkey;
@@ -1158,133 +1251,84 @@ int ssh_userauth_autopubkey(ssh_session session, const char *passphrase) {
   int type = 0;
   int rc;
 
-  enter_function();
-
-  /* Always test none authentication */
-  rc = ssh_userauth_none(session, NULL);
-  if (rc == SSH_AUTH_ERROR || rc == SSH_AUTH_SUCCESS) {
-    leave_function();
-    return rc;
-  }
-
-  /* Try authentication with ssh-agent first */
 #ifndef _WIN32
   if (agent_is_running(session)) {
     char *privkey_file = NULL;
 
-    ssh_log(session, SSH_LOG_RARE,
-        "Trying to authenticate with SSH agent keys as user: %s",
-        session->username);
-
     for (pubkey = agent_get_first_ident(session, &privkey_file);
         pubkey != NULL;
         pubkey = agent_get_next_ident(session, &privkey_file)) {
-
-      ssh_log(session, SSH_LOG_RARE, "Trying identity %s", privkey_file);
-
       pubkey_string = publickey_to_string(pubkey);
-      if (pubkey_string) {
-        rc = ssh_userauth_offer_pubkey(session, NULL, pubkey->type, pubkey_string);
+      if (pubkey_string == NULL) {
+        SAFE_FREE(privkey_file);
+        publickey_free(pubkey);
+        continue;
+      }
+      probe = auth_probe_new(session, probes, nprobes);
+      if (probe == NULL) {
         ssh_string_free(pubkey_string);
-        if (rc == SSH_AUTH_ERROR) {
-          SAFE_FREE(privkey_file);
-          publickey_free(pubkey);
-          leave_function();
-
-          return rc;
-        } else if (rc != SSH_AUTH_SUCCESS) {
-          ssh_log(session, SSH_LOG_PROTOCOL, "Public key refused by server");
-          SAFE_FREE(privkey_file);
-          publickey_free(pubkey);
-          continue;
-        }
-        ssh_log(session, SSH_LOG_PROTOCOL, "Public key accepted");
-        /* pubkey accepted by server ! */
-        rc = ssh_userauth_agent_pubkey(session, NULL, pubkey);
-        if (rc == SSH_AUTH_ERROR) {
-          SAFE_FREE(privkey_file);
-          publickey_free(pubkey);
-          leave_function();
-
-          return rc;
-        } else if (rc != SSH_AUTH_SUCCESS) {
-          ssh_log(session, SSH_LOG_RARE,
-              "Server accepted public key but refused the signature ;"
-              " It might be a bug of libssh");
-          SAFE_FREE(privkey_file);
-          publickey_free(pubkey);
-          continue;
-        }
-        /* auth success */
-        ssh_log(session, SSH_LOG_PROTOCOL, "Authentication using %s success",
-            privkey_file);
         SAFE_FREE(privkey_file);
         publickey_free(pubkey);
-
-        leave_function();
-
-        return SSH_AUTH_SUCCESS;
-      } /* if pubkey */
-      SAFE_FREE(privkey_file);
-      publickey_free(pubkey);
-    } /* for each privkey */
-  } /* if agent is running */
+        return SSH_ERROR;
+      }
+      probe->pubkey = pubkey_string;
+      probe->type = pubkey->type;
+      probe->name = privkey_file;
+      probe->agent_key = pubkey;
+      privkey_file = NULL;
+    }
+  }
 #endif
 
-
   for (it = ssh_list_get_iterator(session->identity);
        it != NULL;
        it = it->next) {
     const char *privkey_file = it->data;
-    int privkey_open = 0;
 
     privkey = NULL;
 
-    ssh_log(session, SSH_LOG_PROTOCOL, "Trying to read privatekey %s", privkey_file);
-
     rc = ssh_try_publickey_from_file(session, privkey_file, &pubkey_string, &type);
     if (rc == 1) {
       char *publickey_file;
       size_t len;
 
+      SSH_LOG(session, SSH_LOG_PROTOCOL, "Trying to read privatekey %s", privkey_file);
       privkey = privatekey_from_file(session, privkey_file, type, passphrase);
       if (privkey == NULL) {
-        ssh_log(session, SSH_LOG_RARE,
+        SSH_LOG(session, SSH_LOG_RARE,
           "Reading private key %s failed (bad passphrase ?)",
           privkey_file);
-        leave_function();
-        return SSH_AUTH_ERROR;
+        return SSH_ERROR;
       }
-      privkey_open = 1;
 
       pubkey = publickey_from_privatekey(privkey);
       if (pubkey == NULL) {
         privatekey_free(privkey);
         ssh_set_error_oom(session);
-        leave_function();
-        return SSH_AUTH_ERROR;
+        return SSH_ERROR;
       }
 
       pubkey_string = publickey_to_string(pubkey);
       type = pubkey->type;
       publickey_free(pubkey);
       if (pubkey_string == NULL) {
+        privatekey_free(privkey);
         ssh_set_error_oom(session);
-        leave_function();
-        return SSH_AUTH_ERROR;
+        return SSH_ERROR;
       }
 
       len = strlen(privkey_file) + 5;
       publickey_file = malloc(len);
       if (publickey_file == NULL) {
+        ssh_string_free(pubkey_string);
+        privatekey_free(privkey);
         ssh_set_error_oom(session);
-        leave_function();
-        return SSH_AUTH_ERROR;
+        return SSH_ERROR;
       }
       snprintf(publickey_file, len, "%s.pub", privkey_file);
       rc = ssh_publickey_to_file(session, publickey_file, pubkey_string, type);
       if (rc < 0) {
-        ssh_log(session, SSH_LOG_PACKET,
+        SSH_LOG(session, SSH_LOG_PACKET,
             "Could not write public key to file: %s", publickey_file);
       }
       SAFE_FREE(publickey_file);
@@ -1292,67 +1336,398 @@ int ssh_userauth_autopubkey(ssh_session session, const char *passphrase) {
       continue;
     }
 
-    rc = ssh_userauth_offer_pubkey(session, NULL, type, pubkey_string);
-    if (rc == SSH_AUTH_ERROR){
+    probe = auth_probe_new(session, probes, nprobes);
+    if (probe == NULL) {
       ssh_string_free(pubkey_string);
-      ssh_log(session, SSH_LOG_RARE, "Publickey authentication error");
+      privatekey_free(privkey);
+      return SSH_ERROR;
+    }
+    probe->pubkey = pubkey_string;
+    probe->type = type;
+    probe->privkey = privkey;
+    probe->name = strdup(privkey_file);
+    if (probe->name == NULL) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+  }
+
+  return SSH_OK;
+}
+
+/*
+ * Sends a SSH_MSG_USERAUTH_REQUEST without waiting for the answer: "none"
+ * if probe is NULL, else the public key, signed if sign is set.
+ */
+static int auth_send_request(ssh_session session, ssh_string user,
+    struct auth_probe_struct *probe, int sign) {
+  ssh_string service = NULL;
+  ssh_string method = NULL;
+  ssh_string algo = NULL;
+  ssh_string signature = NULL;
+  int rc = SSH_ERROR;
+
+  service = ssh_string_from_char("ssh-connection");
+  method = ssh_string_from_char(probe == NULL ? "none" : "publickey");
+  if (service == NULL || method == NULL) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_USERAUTH_REQUEST) < 0 ||
+      buffer_add_ssh_string(session->out_buffer, user) < 0 ||
+      buffer_add_ssh_string(session->out_buffer, service) < 0 ||
+      buffer_add_ssh_string(session->out_buffer, method) < 0) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+
+  if (probe != NULL) {
+    algo = ssh_string_from_char(ssh_type_to_char(probe->type));
+    if (algo == NULL ||
+        buffer_add_u8(session->out_buffer, sign ? 1 : 0) < 0 ||
+        buffer_add_ssh_string(session->out_buffer, algo) < 0 ||
+        buffer_add_ssh_string(session->out_buffer, probe->pubkey) < 0) {
+      ssh_set_error_oom(session);
+      goto error;
+    }
+  }
+
+  if (sign) {
+#ifndef _WIN32
+    if (probe->agent_key != NULL) {
+      signature = ssh_do_sign_with_agent(session, session->out_buffer,
+          probe->agent_key);
+    } else
+#endif
+    {
+      signature = ssh_do_sign(session, session->out_buffer, probe->privkey);
+    }
+    if (signature == NULL) {
+      ssh_set_error(session, SSH_FATAL, "Signing with %s failed", probe->name);
+      goto error;
+    }
+    if (buffer_add_ssh_string(session->out_buffer, signature) < 0) {
+      ssh_set_error_oom(session);
+      goto error;
+    }
+  }
+
+  rc = packet_send(session);
+  goto end;
+error:
+  buffer_reinit(session->out_buffer);
+end:
+  ssh_string_free(service);
+  ssh_string_free(method);
+  ssh_string_free(algo);
+  ssh_string_free(signature);
+
+  return rc;
+}
+
+static int auth_replies_termination(void *user) {
+  ssh_session session = (ssh_session) user;
+
+  return buffer_get_rest_len(session->auth_replies) > 0 ||
+    session->session_state == SSH_SESSION_STATE_ERROR ||
+    session->auth_service_state == SSH_AUTH_SERVICE_DENIED;
+}
+
+/* what ssh_userauth_autopubkey() keeps between its calls */
+struct ssh_auth_auto_struct {
+  ssh_string user;
+  struct auth_probe_struct *probes;
+  int nprobes;
+  int next_probe;
+  /* the requests sent, in a ring */
+  struct auth_expect_struct expect[AUTH_PUBKEY_WINDOW + 2];
+  int head;
+  int pending;
+  int offers;
+  int signing;
+};
+
+/**
+ * @internal
+ *
+ * @brief Free what ssh_userauth_autopubkey() keeps while it waits.
+ */
+void ssh_auth_auto_free(ssh_session session) {
+  ssh_buffer_free(session->auth_replies);
+  session->auth_replies = NULL;
+  if (session->auth_auto == NULL) {
+    return;
+  }
+  auth_probes_free(session->auth_auto->probes, session->auth_auto->nprobes);
+  ssh_string_free(session->auth_auto->user);
+  SAFE_FREE(session->auth_auto);
+}
+
+/* queues a request, its answer comes in order */
+static void auth_auto_expect(struct ssh_auth_auto_struct *a, int probe,
+    int sign) {
+  struct auth_expect_struct *e;
+
+  e = &a->expect[(a->head + a->pending) % (AUTH_PUBKEY_WINDOW + 2)];
+  e->probe = probe;
+  e->sign = sign;
+  a->pending++;
+}
+
+/* collects the keys and sends the first requests */
+static int auth_auto_start(ssh_session session, const char *passphrase) {
+  struct ssh_auth_auto_struct *a;
+
+  a = malloc(sizeof(struct ssh_auth_auto_struct));
+  if (a == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  ZERO_STRUCTP(a);
+  a->signing = -1;
+  session->auth_auto = a;
+
+  a->user = ssh_string_from_char(session->username);
+  if (a->user == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  if (auth_probes_collect(session, passphrase, &a->probes, &a->nprobes) < 0) {
+    return SSH_ERROR;
+  }
+
+  session->auth_replies = ssh_buffer_new();
+  if (session->auth_replies == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  session->auth_state = SSH_AUTH_STATE_NONE;
+
+  /* the requests follow the service request without waiting for it */
+  if (ssh_service_request(session, "ssh-userauth") == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+  if (session->auth_methods == 0) {
+    if (auth_send_request(session, a->user, NULL, 0) < 0) {
+      return SSH_ERROR;
+    }
+    auth_auto_expect(a, -1, 0);
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Tries to automatically authenticate with public key and "none"
+ *
+ * It may fail, for instance it doesn't ask for a password and uses a default
+ * asker for passphrases (in case the private key is encrypted).
+ *
+ * The requests are pipelined: the service request, the "none" request and
+ * the first public keys are sent together, and a public key accepted by the
+ * server is signed as soon as the answer arrives. At most four keys are
+ * offered ahead, as every key refused counts as an authentication attempt
+ * for the server.
+ *
+ * In nonblocking mode, it returns SSH_AUTH_AGAIN while answers are awaited
+ * and continues where it was at the next call. The keys files and the agent
+ * are local, they are read in place.
+ *
+ * @param[in]  session  The ssh session to authenticate with.
+ *
+ * @param[in]  passphrase Use this passphrase to unlock the privatekey. Use NULL
+ *                        if you don't want to use a passphrase or the user
+ *                        should be asked.
+ *
+ * @returns SSH_AUTH_ERROR:   A serious error happened\n
+ *          SSH_AUTH_DENIED:  Authentication failed: use another method\n
+ *          SSH_AUTH_PARTIAL: You've been partially authenticated, you still
+ *                            have to use another method\n
+ *          SSH_AUTH_SUCCESS: Authentication success
+ *          SSH_AUTH_AGAIN:   In nonblocking mode, you've got to call this again
+ *                            later.
+ *
+ * @see ssh_userauth_kbdint()
+ * @see ssh_userauth_password()
+ */
+int ssh_userauth_autopubkey(ssh_session session, const char *passphrase) {
+  struct ssh_auth_auto_struct *a;
+  struct auth_expect_struct e;
+  struct auth_probe_struct *probe;
+  int accepted;
+  uint8_t reply;
+  int rc = SSH_AUTH_ERROR;
+  int i;
+
+  enter_function();
+
+#ifdef WITH_SSH1
+  /* public key authentication is done with SSH-2 only */
+  if (session->version == 1) {
+    rc = ssh_userauth_none(session, NULL);
+    leave_function();
+    return rc == SSH_AUTH_SUCCESS ? rc : SSH_AUTH_DENIED;
+  }
+#endif
+  switch (session->pending_call_state) {
+    case SSH_PENDING_CALL_NONE:
+      break;
+    case SSH_PENDING_CALL_AUTH_AUTOPUBKEY:
+      goto pending;
+    default:
+      ssh_set_error(session, SSH_FATAL,
+          "Bad call during pending SSH call in ssh_userauth_autopubkey");
       leave_function();
-      return rc;
-    } else {
-      if (rc != SSH_AUTH_SUCCESS){
-        ssh_log(session, SSH_LOG_PROTOCOL, "Publickey refused by server");
-        ssh_string_free(pubkey_string);
-        continue;
+      return SSH_AUTH_ERROR;
+  }
+  if (session->username == NULL) {
+    if (ssh_options_apply(session) < 0) {
+      leave_function();
+      return SSH_AUTH_ERROR;
+    }
+  }
+
+  session->pending_call_state = SSH_PENDING_CALL_AUTH_AUTOPUBKEY;
+  if (auth_auto_start(session, passphrase) < 0) {
+    goto end;
+  }
+
+pending:
+  a = session->auth_auto;
+  for (;;) {
+    /* sign a key already accepted, one at a time */
+    if (a->signing < 0) {
+      for (i = 0; i < a->nprobes; i++) {
+        if (a->probes[i].accepted && !a->probes[i].tried) {
+          break;
+        }
+      }
+      if (i < a->nprobes) {
+        probe = &a->probes[i];
+        probe->tried = 1;
+        if (probe->agent_key == NULL && probe->privkey == NULL) {
+          SSH_LOG(session, SSH_LOG_PROTOCOL, "Trying to read privatekey %s",
+              probe->name);
+          probe->privkey = privatekey_from_file(session, probe->name,
+              probe->type, passphrase);
+          if (probe->privkey == NULL) {
+            SSH_LOG(session, SSH_LOG_RARE,
+                "Reading private key %s failed (bad passphrase ?)",
+                probe->name);
+            continue;
+          }
+        }
+        if (auth_send_request(session, a->user, probe, 1) < 0) {
+          goto end;
+        }
+        auth_auto_expect(a, i, 1);
+        a->signing = i;
       }
     }
 
-    /* Public key accepted by server! */
-    if (!privkey_open) {
-      ssh_log(session, SSH_LOG_PROTOCOL, "Trying to read privatekey %s",
-          privkey_file);
-      privkey = privatekey_from_file(session, privkey_file, type, passphrase);
-      if (privkey == NULL) {
-        ssh_log(session, SSH_LOG_RARE,
-            "Reading private key %s failed (bad passphrase ?)",
-            privkey_file);
-        ssh_string_free(pubkey_string);
-        continue; /* continue the loop with other pubkey */
+    /* offer more keys while none is accepted */
+    accepted = a->signing >= 0;
+    for (i = 0; i < a->nprobes; i++) {
+      accepted |= a->probes[i].accepted && !a->probes[i].tried;
+    }
+    while (!accepted && a->offers < AUTH_PUBKEY_WINDOW &&
+        a->next_probe < a->nprobes) {
+      SSH_LOG(session, SSH_LOG_RARE, "Trying identity %s",
+          a->probes[a->next_probe].name);
+      if (auth_send_request(session, a->user, &a->probes[a->next_probe],
+            0) < 0) {
+        goto end;
       }
+      auth_auto_expect(a, a->next_probe, 0);
+      a->offers++;
+      a->next_probe++;
     }
 
-    rc = ssh_userauth_pubkey(session, NULL, pubkey_string, privkey);
-    if (rc == SSH_AUTH_ERROR) {
-      ssh_string_free(pubkey_string);
-      privatekey_free(privkey);
-      leave_function();
-      return rc;
+    if (a->pending == 0) {
+      break;
+    }
+
+    if (ssh_is_blocking(session)) {
+      if (ssh_handle_packets_termination(session, -1,
+            auth_replies_termination, session) == SSH_ERROR) {
+        goto end;
+      }
     } else {
-      if (rc != SSH_AUTH_SUCCESS){
-        ssh_log(session, SSH_LOG_RARE,
-            "The server accepted the public key but refused the signature");
-        ssh_string_free(pubkey_string);
-        privatekey_free(privkey);
-        continue;
+      if (ssh_handle_packets(session, 0) == SSH_ERROR) {
+        goto end;
+      }
+      if (!auth_replies_termination(session)) {
+        leave_function();
+        return SSH_AUTH_AGAIN;
       }
     }
+    if (buffer_get_rest_len(session->auth_replies) == 0) {
+      if (session->auth_service_state == SSH_AUTH_SERVICE_DENIED) {
+        ssh_set_error(session, SSH_FATAL, "ssh_auth_service request denied");
+      }
+      goto end;
+    }
 
-    /* auth success */
-    ssh_log(session, SSH_LOG_PROTOCOL,
-        "Successfully authenticated using %s", privkey_file);
-    ssh_string_free(pubkey_string);
-    privatekey_free(privkey);
+    while (a->pending > 0 &&
+        buffer_get_u8(session->auth_replies, &reply) == 1) {
+      e = a->expect[a->head];
+      a->head = (a->head + 1) % (AUTH_PUBKEY_WINDOW + 2);
+      a->pending--;
+      if (e.probe >= 0 && !e.sign) {
+        a->offers--;
+      }
 
-    leave_function();
-    return SSH_AUTH_SUCCESS;
+      switch (reply) {
+        case SSH_AUTH_STATE_SUCCESS:
+          if (e.probe >= 0) {
+            SSH_LOG(session, SSH_LOG_PROTOCOL,
+                "Successfully authenticated using %s",
+                a->probes[e.probe].name);
+          }
+          rc = SSH_AUTH_SUCCESS;
+          goto end;
+        case SSH_AUTH_STATE_PK_OK:
+          if (e.probe < 0 || e.sign) {
+            ssh_set_error(session, SSH_FATAL,
+                "Unexpected SSH_MSG_USERAUTH_PK_OK");
+            goto end;
+          }
+          SSH_LOG(session, SSH_LOG_PROTOCOL, "Public key accepted");
+          a->probes[e.probe].accepted = 1;
+          break;
+        case SSH_AUTH_STATE_PARTIAL:
+        case SSH_AUTH_STATE_FAILED:
+          if (e.sign) {
+            a->signing = -1;
+            if (reply == SSH_AUTH_STATE_PARTIAL) {
+              /* the signed request is the last one sent */
+              rc = SSH_AUTH_PARTIAL;
+              goto end;
+            }
+            SSH_LOG(session, SSH_LOG_RARE,
+                "The server accepted the public key but refused the signature");
+          } else if (e.probe >= 0) {
+            SSH_LOG(session, SSH_LOG_PROTOCOL, "Public key refused by server");
+          }
+          break;
+        default:
+          goto end;
+      }
+    }
   }
 
-  /* at this point, pubkey is NULL and so is privkeyfile */
-  ssh_log(session, SSH_LOG_PROTOCOL,
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
       "Tried every public key, none matched");
   ssh_set_error(session,SSH_NO_ERROR,"No public key matched");
+  rc = SSH_AUTH_DENIED;
+
+end:
+  session->pending_call_state = SSH_PENDING_CALL_NONE;
+  ssh_auth_auto_free(session);
 
   leave_function();
-  return SSH_AUTH_DENIED;
+  return rc;
 }
 
 ssh_kbdint kbdint_new(void) {
@@ -1436,14 +1811,14 @@ void kbdint_clean(ssh_kbdint kbd) {
 }
 
 /* this function sends the first packet as explained in section 3.1
- * of the draft */
+ * of the draft, SSH_OK once sent */
 static int kbdauth_init(ssh_session session, const char *user,
     const char *submethods) {
   ssh_string usr = NULL;
   ssh_string sub = NULL;
   ssh_string service = NULL;
   ssh_string method = NULL;
-  int rc = SSH_AUTH_ERROR;
+  int rc = SSH_ERROR;
 
   enter_function();
 
@@ -1483,11 +1858,7 @@ static int kbdauth_init(ssh_session session, const char *user,
   ssh_string_free(method);
   ssh_string_free(sub);
   session->auth_state=SSH_AUTH_STATE_KBDINT_SENT;
-  if (packet_send(session) == SSH_ERROR) {
-    leave_function();
-    return rc;
-  }
-  rc = wait_auth_status(session);
+  rc = packet_send(session);
 
   leave_function();
   return rc;
@@ -1567,7 +1938,7 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_info_request) {
   }
 
   nprompts = ntohl(nprompts);
-  ssh_log(session,SSH_LOG_PACKET,"kbdint: %d prompts",nprompts);
+  SSH_LOG(session,SSH_LOG_PACKET,"kbdint: %d prompts",nprompts);
   if (nprompts > KBDINT_MAX_PROMPT) {
     ssh_set_error(session, SSH_FATAL,
         "Too much prompt asked from server: %u (0x%.4x)",
@@ -1630,16 +2001,13 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_info_request) {
 
 /**
  * @internal
- * @brief Sends the current challenge response and wait for a
- * reply from the server
- * @returns SSH_AUTH_INFO if more info is needed
- * @returns SSH_AUTH_SUCCESS
- * @returns SSH_AUTH_FAILURE
- * @returns SSH_AUTH_PARTIAL
+ * @brief Sends the current challenge response, the reply of the server is
+ * waited for by the caller.
+ * @returns SSH_OK once sent, SSH_ERROR on error
  */
 static int kbdauth_send(ssh_session session) {
   ssh_string answer = NULL;
-  int rc = SSH_AUTH_ERROR;
+  int rc = SSH_ERROR;
   uint32_t i;
 
   enter_function();
@@ -1673,11 +2041,7 @@ static int kbdauth_send(ssh_session session) {
   session->auth_state=SSH_AUTH_STATE_KBDINT_SENT;
   kbdint_free(session->kbdint);
   session->kbdint = NULL;
-  if (packet_send(session) == SSH_ERROR) {
-    leave_function();
-    return rc;
-  }
-  rc = wait_auth_status(session);
+  rc = packet_send(session);
 
   leave_function();
   return rc;
@@ -1707,7 +2071,9 @@ error:
  *                            have to use another method\n
  *          SSH_AUTH_SUCCESS: Authentication success\n
  *          SSH_AUTH_INFO:    The server asked some questions. Use
- *                            ssh_userauth_kbdint_getnprompts() and such.
+ *                            ssh_userauth_kbdint_getnprompts() and such.\n
+ *          SSH_AUTH_AGAIN:   In nonblocking mode, you've got to call this again
+ *                            later, the answers were sent if there were some.
  *
  * @see ssh_userauth_kbdint_getnprompts()
  * @see ssh_userauth_kbdint_getname()
@@ -1726,6 +2092,17 @@ int ssh_userauth_kbdint(ssh_session session, const char *user,
 
   enter_function();
 
+  switch(session->pending_call_state){
+  case SSH_PENDING_CALL_NONE:
+    break;
+  case SSH_PENDING_CALL_AUTH_KBDINT:
+    goto pending;
+  default:
+    ssh_set_error(session,SSH_FATAL,"Bad call during pending SSH call in ssh_userauth_kbdint");
+    leave_function();
+    return SSH_AUTH_ERROR;
+  }
+
   if (session->kbdint == NULL) {
     /* first time we call. we must ask for a challenge */
     if (user == NULL) {
@@ -1739,25 +2116,35 @@ int ssh_userauth_kbdint(ssh_session session, const char *user,
       }
     }
 
-    if (ask_userauth(session)) {
+    rc = ask_userauth(session);
+    if (rc == SSH_AGAIN) {
+      leave_function();
+      return SSH_AUTH_AGAIN;
+    } else if (rc == SSH_ERROR) {
       leave_function();
       return SSH_AUTH_ERROR;
     }
 
     rc = kbdauth_init(session, user, submethods);
-
+  } else {
+    /*
+     * If we are at this point, it is because session->kbdint exists.
+     * It means the user has set some information there we need to send
+     * the server and then we need to ack the status (new questions or ok
+     * pass in).
+     */
+    rc = kbdauth_send(session);
+  }
+  if (rc == SSH_ERROR) {
     leave_function();
-    return rc;
+    return SSH_AUTH_ERROR;
   }
+  session->pending_call_state=SSH_PENDING_CALL_AUTH_KBDINT;
 
-  /*
-   * If we are at this point, it is because session->kbdint exists.
-   * It means the user has set some information there we need to send
-   * the server and then we need to ack the status (new questions or ok
-   * pass in).
-   */
-  rc = kbdauth_send(session);
-
+pending:
+  rc = wait_auth_status(session);
+  if (rc != SSH_AUTH_AGAIN)
+    session->pending_call_state=SSH_PENDING_CALL_NONE;
   leave_function();
   return rc;
 }
@@ -40,7 +40,7 @@ static int wait_auth1_status(ssh_session session) {
   while(session->auth_state == SSH_AUTH_STATE_NONE)
     if (ssh_handle_packets(session,-1) != SSH_OK)
       break;
-  ssh_log(session,SSH_LOG_PROTOCOL,"Auth state : %d",session->auth_state);
+  SSH_LOG(session,SSH_LOG_PROTOCOL,"Auth state : %d",session->auth_state);
   leave_function();
   switch(session->auth_state) {
     case SSH_AUTH_STATE_SUCCESS:
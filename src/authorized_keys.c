@@ -0,0 +1,594 @@
+/*
+ * authorized_keys.c - the authorized keys files of a server, parsed once
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netdb.h>
+#endif
+
+#include "libssh/priv.h"
+#include "libssh/server.h"
+#include "libssh/buffer.h"
+#include "libssh/hashtable.h"
+#include "libssh/keys.h"
+#include "libssh/messages.h"
+#include "libssh/session.h"
+#include "libssh/string.h"
+#include "libssh/threads.h"
+
+/* the files kept parsed, the least recently used are dropped */
+#define AUTHORIZED_KEYS_CACHE_FILES 64
+/* the longest line read, the longer ones are skipped */
+#define AUTHORIZED_KEYS_LINE_MAX 16384
+
+/* a key of the file, with its options */
+struct authkey {
+  unsigned int line;
+  unsigned char *blob;
+  size_t len;
+  char *command; /* command="" */
+  struct match_list *from; /* from="" */
+};
+
+/*
+ * A parsed authorized keys file. The index is shared by the cache and the
+ * sessions looking a key up: it is freed by the last one to release it.
+ */
+struct authkeys_index {
+  struct authkeys_index *next;
+  char *filename;
+  time_t mtime;
+  off_t size;
+  unsigned int refs;
+  /* the keys, by hash of their blob */
+  struct ssh_hashtable *keys;
+};
+
+/* the most recently used file first */
+static struct authkeys_index *authkeys_cache = NULL;
+static void *authkeys_lock = NULL;
+static int authkeys_initialized = 0;
+
+/* FNV-1a */
+static uint64_t authkeys_hash(const void *data, size_t len) {
+  const unsigned char *p = data;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+static void authkey_free(struct authkey *key) {
+  match_list_free(key->from);
+  SAFE_FREE(key->command);
+  SAFE_FREE(key->blob);
+  SAFE_FREE(key);
+}
+
+static void authkeys_index_free(struct authkeys_index *index) {
+  struct ssh_hashtable_entry *it;
+
+  if (index->keys != NULL) {
+    for (it = ssh_hashtable_first(index->keys); it != NULL;
+        it = ssh_hashtable_next(index->keys, it)) {
+      authkey_free(it->data);
+    }
+    ssh_hashtable_free(index->keys);
+  }
+  SAFE_FREE(index->filename);
+  SAFE_FREE(index);
+}
+
+/*
+ * Returns the end of the options starting at p, at the first blank out of
+ * the double quotes.
+ */
+static char *authkeys_options_end(char *p) {
+  int quoted = 0;
+
+  for (; *p != '\0'; p++) {
+    if (!quoted && (*p == ' ' || *p == '\t')) {
+      break;
+    }
+    if (*p == '\\' && quoted && p[1] == '"') {
+      p++;
+    } else if (*p == '"') {
+      quoted = !quoted;
+    }
+  }
+
+  return quoted ? NULL : p;
+}
+
+/*
+ * Parses the value of an option, a double quoted string where \" is a
+ * quote. *p is moved after it. Returns NULL on error.
+ */
+static char *authkeys_option_value(const char **p) {
+  const char *s = *p;
+  char *value;
+  size_t n = 0;
+
+  if (*s++ != '"') {
+    return NULL;
+  }
+  value = malloc(strlen(s) + 1);
+  if (value == NULL) {
+    return NULL;
+  }
+  for (; *s != '\0' && *s != '"'; s++) {
+    if (*s == '\\' && s[1] == '"') {
+      s++;
+    }
+    value[n++] = *s;
+  }
+  if (*s != '"') {
+    SAFE_FREE(value);
+    return NULL;
+  }
+  value[n] = '\0';
+  *p = s + 1;
+
+  return value;
+}
+
+/*
+ * Parses the comma separated options, the ones which don't restrict the
+ * key to a command or to hosts are ignored. Returns -1 if they are
+ * malformed, the line is then skipped as by OpenSSH.
+ */
+static int authkeys_parse_options(struct authkey *key, const char *opts) {
+  const char *p = opts;
+  char *value;
+  size_t len;
+
+  while (*p != '\0') {
+    len = strcspn(p, "=,");
+    if (p[len] != '=') {
+      /* a flag such as no-pty */
+      p += len;
+    } else if (len == 7 && strncasecmp(p, "command", len) == 0) {
+      p += len + 1;
+      value = authkeys_option_value(&p);
+      if (value == NULL) {
+        return -1;
+      }
+      SAFE_FREE(key->command);
+      key->command = value;
+    } else if (len == 4 && strncasecmp(p, "from", len) == 0) {
+      p += len + 1;
+      value = authkeys_option_value(&p);
+      if (value == NULL) {
+        return -1;
+      }
+      match_list_free(key->from);
+      key->from = match_list_compile(value, strlen(value));
+      SAFE_FREE(value);
+      if (key->from == NULL) {
+        return -1;
+      }
+    } else {
+      /* environment="", permitopen="", ... */
+      p += len + 1;
+      value = authkeys_option_value(&p);
+      if (value == NULL) {
+        return -1;
+      }
+      SAFE_FREE(value);
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Indexes a line:
+ * [options] keytype base64-encoded-key [comment]
+ * Returns -1 on error, the lines which can't be parsed are skipped.
+ */
+static int authkeys_index_line(struct authkeys_index *index, char *line,
+    unsigned int lineno) {
+  struct authkey *key;
+  ssh_buffer blob;
+  char *opts = NULL;
+  char *p;
+  char *end;
+  size_t len;
+
+  p = line + strspn(line, " \t");
+  if (*p == '\0' || *p == '#') {
+    return 0;
+  }
+
+  len = strcspn(p, " \t");
+  if (p[len] == '\0') {
+    return 0;
+  }
+  p[len] = '\0';
+  if (ssh_type_from_name(p) < 0) {
+    /* the options come first */
+    p[len] = ' ';
+    end = authkeys_options_end(p);
+    if (end == NULL || *end == '\0') {
+      return 0;
+    }
+    *end = '\0';
+    opts = p;
+    p = end + 1;
+    p += strspn(p, " \t");
+    len = strcspn(p, " \t");
+    if (p[len] == '\0') {
+      return 0;
+    }
+    p[len] = '\0';
+    if (ssh_type_from_name(p) < 0) {
+      return 0;
+    }
+  }
+  p += len + 1;
+  p += strspn(p, " \t");
+  p[strcspn(p, " \t")] = '\0';
+
+  blob = base64_to_bin(p);
+  if (blob == NULL) {
+    return 0;
+  }
+
+  key = malloc(sizeof(struct authkey));
+  if (key == NULL) {
+    ssh_buffer_free(blob);
+    return -1;
+  }
+  ZERO_STRUCTP(key);
+  key->line = lineno;
+  key->len = buffer_get_rest_len(blob);
+  key->blob = malloc(key->len);
+  if (key->blob == NULL) {
+    ssh_buffer_free(blob);
+    authkey_free(key);
+    return -1;
+  }
+  memcpy(key->blob, buffer_get_rest(blob), key->len);
+  ssh_buffer_free(blob);
+
+  if (opts != NULL && authkeys_parse_options(key, opts) < 0) {
+    authkey_free(key);
+    return 0;
+  }
+
+  if (ssh_hashtable_insert(index->keys, authkeys_hash(key->blob, key->len),
+        key) < 0) {
+    authkey_free(key);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* parses an authorized keys file, a missing file gives an empty index */
+static struct authkeys_index *authkeys_index_new(const char *filename,
+    const struct stat *st) {
+  struct authkeys_index *index;
+  unsigned int lineno = 0;
+  FILE *file;
+  char *line;
+  size_t len;
+  int skip = 0;
+
+  index = malloc(sizeof(struct authkeys_index));
+  if (index == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(index);
+  index->refs = 1;
+  index->mtime = st->st_mtime;
+  index->size = st->st_size;
+  index->filename = strdup(filename);
+  index->keys = ssh_hashtable_new();
+  if (index->filename == NULL || index->keys == NULL) {
+    authkeys_index_free(index);
+    return NULL;
+  }
+
+  file = fopen(filename, "r");
+  if (file == NULL) {
+    return index;
+  }
+  line = malloc(AUTHORIZED_KEYS_LINE_MAX);
+  if (line == NULL) {
+    fclose(file);
+    authkeys_index_free(index);
+    return NULL;
+  }
+  while (fgets(line, AUTHORIZED_KEYS_LINE_MAX, file) != NULL) {
+    len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+      if (skip) {
+        /* the end of a line too long */
+        skip = 0;
+        continue;
+      }
+      lineno++;
+    } else if (!feof(file)) {
+      skip = 1;
+      continue;
+    } else {
+      lineno++;
+    }
+    if (len > 0 && line[len - 1] == '\r') {
+      line[--len] = '\0';
+    }
+    if (authkeys_index_line(index, line, lineno) < 0) {
+      SAFE_FREE(line);
+      fclose(file);
+      authkeys_index_free(index);
+      return NULL;
+    }
+  }
+  SAFE_FREE(line);
+  fclose(file);
+
+  return index;
+}
+
+/* called with the lock held if the index is cached */
+static void authkeys_index_release(struct authkeys_index *index) {
+  if (--index->refs > 0) {
+    return;
+  }
+  authkeys_index_free(index);
+}
+
+/*
+ * Returns the index of the file, from the cache if the file didn't change
+ * since it was parsed.
+ */
+static struct authkeys_index *authkeys_index_get(const char *filename) {
+  struct authkeys_index **prev;
+  struct authkeys_index *index;
+  struct stat st;
+  unsigned int i;
+
+  ZERO_STRUCT(st);
+  if (stat(filename, &st) < 0) {
+    return authkeys_index_new(filename, &st);
+  }
+
+  if (ssh_threads_mutex_once(&authkeys_lock, &authkeys_initialized) < 0) {
+    return authkeys_index_new(filename, &st);
+  }
+
+  ssh_threads_mutex_lock(&authkeys_lock);
+  for (prev = &authkeys_cache; *prev != NULL; prev = &(*prev)->next) {
+    index = *prev;
+    if (strcmp(index->filename, filename) != 0) {
+      continue;
+    }
+    *prev = index->next;
+    if (index->mtime == st.st_mtime && index->size == st.st_size) {
+      index->next = authkeys_cache;
+      authkeys_cache = index;
+      index->refs++;
+      ssh_threads_mutex_unlock(&authkeys_lock);
+      return index;
+    }
+    /* the file was written since */
+    index->next = NULL;
+    authkeys_index_release(index);
+    break;
+  }
+  ssh_threads_mutex_unlock(&authkeys_lock);
+
+  /* parsed outside of the lock */
+  index = authkeys_index_new(filename, &st);
+  if (index == NULL) {
+    return NULL;
+  }
+
+  ssh_threads_mutex_lock(&authkeys_lock);
+  /* another session may have parsed the file meanwhile */
+  for (prev = &authkeys_cache; *prev != NULL; prev = &(*prev)->next) {
+    if (strcmp((*prev)->filename, filename) == 0) {
+      struct authkeys_index *old = *prev;
+
+      *prev = old->next;
+      old->next = NULL;
+      authkeys_index_release(old);
+      break;
+    }
+  }
+  index->refs++;
+  index->next = authkeys_cache;
+  authkeys_cache = index;
+  /* drops the least recently used files */
+  prev = &authkeys_cache;
+  for (i = 0; *prev != NULL && i < AUTHORIZED_KEYS_CACHE_FILES; i++) {
+    prev = &(*prev)->next;
+  }
+  while (*prev != NULL) {
+    struct authkeys_index *old = *prev;
+
+    *prev = old->next;
+    old->next = NULL;
+    authkeys_index_release(old);
+  }
+  ssh_threads_mutex_unlock(&authkeys_lock);
+
+  return index;
+}
+
+static void authkeys_index_put(struct authkeys_index *index) {
+  if (!ssh_atomic_load_int(&authkeys_initialized)) {
+    authkeys_index_release(index);
+    return;
+  }
+  ssh_threads_mutex_lock(&authkeys_lock);
+  authkeys_index_release(index);
+  ssh_threads_mutex_unlock(&authkeys_lock);
+}
+
+/* the address of the client for from="", "" if it has none */
+static void authkeys_peer(ssh_session session, char *host, size_t len) {
+  struct sockaddr_storage addr;
+  socklen_t addrlen = sizeof(addr);
+  socket_t fd;
+
+  host[0] = '\0';
+  fd = ssh_get_fd(session);
+  if (fd == SSH_INVALID_SOCKET ||
+      getpeername(fd, (struct sockaddr *) &addr, &addrlen) < 0 ||
+      (addr.ss_family != AF_INET && addr.ss_family != AF_INET6) ||
+      getnameinfo((struct sockaddr *) &addr, addrlen, host, len, NULL, 0,
+        NI_NUMERICHOST) != 0) {
+    host[0] = '\0';
+    return;
+  }
+  /* an IPv4 client of an IPv6 socket */
+  if (strncmp(host, "::ffff:", 7) == 0 && strchr(host + 7, ':') == NULL) {
+    memmove(host, host + 7, strlen(host + 7) + 1);
+  }
+}
+
+int ssh_message_auth_authorized_key(ssh_message msg, const char *filename,
+    char **command) {
+  struct ssh_hashtable_entry *it;
+  struct authkeys_index *index;
+  struct authkey *found = NULL;
+  struct authkey *key;
+  char host[NI_MAXHOST];
+  ssh_string blob;
+  int peer = 0;
+  int rc = SSH_AUTH_DENIED;
+
+  if (command != NULL) {
+    *command = NULL;
+  }
+  if (msg == NULL || filename == NULL) {
+    return SSH_AUTH_ERROR;
+  }
+  if (msg->type != SSH_REQUEST_AUTH ||
+      msg->auth_request.method != SSH_AUTH_METHOD_PUBLICKEY ||
+      msg->auth_request.public_key == NULL) {
+    ssh_set_error(msg->session, SSH_FATAL,
+        "The message is not a public key authentication");
+    return SSH_AUTH_ERROR;
+  }
+
+  blob = publickey_to_string(msg->auth_request.public_key);
+  if (blob == NULL) {
+    ssh_set_error_oom(msg->session);
+    return SSH_AUTH_ERROR;
+  }
+  index = authkeys_index_get(filename);
+  if (index == NULL) {
+    ssh_string_free(blob);
+    ssh_set_error_oom(msg->session);
+    return SSH_AUTH_ERROR;
+  }
+
+  /* the index isn't modified once parsed, its reference keeps it alive */
+  for (it = ssh_hashtable_find(index->keys,
+        authkeys_hash(ssh_string_data(blob), ssh_string_len(blob)));
+      it != NULL; it = ssh_hashtable_find_next(it)) {
+    key = it->data;
+    if (key->len != ssh_string_len(blob) ||
+        memcmp(key->blob, ssh_string_data(blob), key->len) != 0) {
+      continue;
+    }
+    if (key->from != NULL) {
+      if (!peer) {
+        authkeys_peer(msg->session, host, sizeof(host));
+        peer = 1;
+      }
+      if (host[0] == '\0' || match_list_exec(key->from, host) != 1) {
+        SSH_LOG(msg->session, SSH_LOG_PROTOCOL,
+            "Key of %s line %u refused from '%s'", filename, key->line, host);
+        continue;
+      }
+    }
+    /* the first line of the file wins */
+    if (found == NULL || key->line < found->line) {
+      found = key;
+    }
+  }
+  ssh_string_free(blob);
+
+  if (found != NULL) {
+    rc = SSH_AUTH_SUCCESS;
+    if (command != NULL && found->command != NULL) {
+      *command = strdup(found->command);
+      if (*command == NULL) {
+        ssh_set_error_oom(msg->session);
+        rc = SSH_AUTH_ERROR;
+      }
+    }
+  }
+  authkeys_index_put(index);
+
+  return rc;
+}
+
+/** @internal
+ * @brief frees the parsed files, called by ssh_finalize()
+ */
+void ssh_authorized_keys_finalize(void) {
+  struct authkeys_index *index;
+
+  if (!ssh_atomic_load_int(&authkeys_initialized)) {
+    return;
+  }
+  ssh_threads_mutex_lock(&authkeys_lock);
+  while (authkeys_cache != NULL) {
+    index = authkeys_cache;
+    authkeys_cache = index->next;
+    index->next = NULL;
+    authkeys_index_release(index);
+  }
+  ssh_threads_mutex_unlock(&authkeys_lock);
+  ssh_threads_mutex_destroy(&authkeys_lock);
+  authkeys_lock = NULL;
+  authkeys_initialized = 0;
+}
+
+/* vim: set ts=2 sw=2 et cindent: */
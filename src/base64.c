@@ -21,7 +21,6 @@
  * MA 02111-1307, USA.
  */
 
-/* just the dirtiest part of code i ever made */
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,22 +28,37 @@
 #include "libssh/priv.h"
 #include "libssh/buffer.h"
 
-static char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                         "abcdefghijklmnopqrstuvwxyz"
-                         "0123456789+/";
+static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                               "abcdefghijklmnopqrstuvwxyz"
+                               "0123456789+/";
 
-/* Transformations */
-#define SET_A(n, i) do { (n) |= ((i) & 63) <<18; } while (0)
-#define SET_B(n, i) do { (n) |= ((i) & 63) <<12; } while (0)
-#define SET_C(n, i) do { (n) |= ((i) & 63) << 6; } while (0)
-#define SET_D(n, i) do { (n) |= ((i) & 63); } while (0)
-
-#define GET_A(n) (unsigned char) (((n) & 0xff0000) >> 16)
-#define GET_B(n) (unsigned char) (((n) & 0xff00) >> 8)
-#define GET_C(n) (unsigned char) ((n) & 0xff)
-
-static int _base64_to_bin(unsigned char dest[3], const char *source, int num);
-static int get_equals(char *string);
+/*
+ * Reverse lookup of the alphabet: the 6 bit value of every character, XX for
+ * the ones which aren't part of it. XX has the high bit set so a whole
+ * quantum can be checked with a single test.
+ */
+#define XX 0xff
+static const unsigned char reverse[256] = {
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, 62, XX, XX, XX, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61, XX, XX, XX, XX, XX, XX,
+  XX,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, XX, XX, XX, XX, XX,
+  XX, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+  XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX
+};
+#undef XX
+
+#define INVALID(a, b, c, d) ((((a) | (b) | (c) | (d)) & 0x80) != 0)
 
 /* First part: base64 to binary */
 
@@ -57,201 +71,94 @@ static int get_equals(char *string);
  *          wrong (e.g. incorrect char).
  */
 ssh_buffer base64_to_bin(const char *source) {
+  const unsigned char *src = (const unsigned char *) source;
   ssh_buffer buffer = NULL;
-  unsigned char block[3];
-  char *base64;
-  char *ptr;
+  unsigned char *dest;
+  const char *pad;
+  uint32_t block;
+  uint32_t size;
+  size_t equals;
   size_t len;
-  int equals;
-
-  base64 = strdup(source);
-  if (base64 == NULL) {
-    return NULL;
-  }
-  ptr = base64;
-
-  /* Get the number of equals signs, which mirrors the padding */
-  equals = get_equals(ptr);
-  if (equals > 2) {
-    SAFE_FREE(base64);
-    return NULL;
-  }
-
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    SAFE_FREE(base64);
-    return NULL;
-  }
-
-  len = strlen(ptr);
-  while (len > 4) {
-    if (_base64_to_bin(block, ptr, 3) < 0) {
-      goto error;
+  size_t rest;
+  size_t i;
+
+  /* The padding, if any, ends the string */
+  pad = strchr(source, '=');
+  if (pad == NULL) {
+    len = strlen(source);
+    equals = 0;
+  } else {
+    len = pad - source;
+    equals = strspn(pad, "=");
+    if (pad[equals] != '\0') {
+      return NULL;
     }
-    if (buffer_add_data(buffer, block, 3) < 0) {
-      goto error;
-    }
-    len -= 4;
-    ptr += 4;
   }
 
   /*
    * Depending on the number of bytes resting, there are 3 possibilities
-   * from the RFC.
+   * from the RFC: an integral multiple of 24 bits and no "=" padding, two
+   * characters followed by "==" for a final quantum of 8 bits, or three
+   * characters followed by "=" for 16 bits.
    */
-  switch (len) {
-    /*
-     * (1) The final quantum of encoding input is an integral multiple of
-     *     24 bits. Here, the final unit of encoded output will be an integral
-     *     multiple of 4 characters with no "=" padding
-     */
-    case 4:
-      if (equals != 0) {
-        goto error;
-      }
-      if (_base64_to_bin(block, ptr, 3) < 0) {
-        goto error;
-      }
-      if (buffer_add_data(buffer, block, 3) < 0) {
-        goto error;
-      }
-      SAFE_FREE(base64);
-
-      return buffer;
-    /*
-     * (2) The final quantum of encoding input is exactly 8 bits; here, the
-     *     final unit of encoded output will be two characters followed by
-     *     two "=" padding characters.
-     */
-    case 2:
-      if (equals != 2){
-        goto error;
-      }
-
-      if (_base64_to_bin(block, ptr, 1) < 0) {
-        goto error;
-      }
-      if (buffer_add_data(buffer, block, 1) < 0) {
-        goto error;
-      }
-      SAFE_FREE(base64);
-
-      return buffer;
-    /*
-     * The final quantum of encoding input is exactly 16 bits. Here, the final
-     * unit of encoded output will be three characters followed by one "="
-     * padding character.
-     */
-    case 3:
-      if (equals != 1) {
-        goto error;
-      }
-      if (_base64_to_bin(block, ptr, 2) < 0) {
-        goto error;
-      }
-      if (buffer_add_data(buffer,block,2) < 0) {
-        goto error;
-      }
-      SAFE_FREE(base64);
-
-      return buffer;
-    default:
-      /* 4,3,2 are the only padding size allowed */
-      goto error;
+  rest = len % 4;
+  if (len == 0 || len > 0xfffffff0 || equals > 2 || rest == 1 ||
+      (rest + equals) % 4 != 0) {
+    return NULL;
   }
+  size = (len / 4) * 3 + (rest ? rest - 1 : 0);
 
-error:
-  SAFE_FREE(base64);
-  ssh_buffer_free(buffer);
-  return NULL;
-}
-
-#define BLOCK(letter, n) do {ptr = strchr(alphabet, source[n]); \
-                             if(!ptr) return -1; \
-                             i = ptr - alphabet; \
-                             SET_##letter(*block, i); \
-                         } while(0)
-
-/* Returns 0 if ok, -1 if not (ie invalid char into the stuff) */
-static int to_block4(unsigned long *block, const char *source, int num) {
-  char *ptr;
-  unsigned int i;
-
-  *block = 0;
-  if (num < 1) {
-    return 0;
+  buffer = ssh_buffer_new_sized(size);
+  if (buffer == NULL) {
+    return NULL;
   }
+  /* it decodes the private key files */
+  buffer_set_secure(buffer);
 
-  BLOCK(A, 0); /* 6 bit */
-  BLOCK(B,1); /* 12 bit */
-
-  if (num < 2) {
-    return 0;
+  dest = buffer_reserve(buffer, size);
+  if (dest == NULL) {
+    goto error;
   }
 
-  BLOCK(C, 2); /* 18 bit */
+  for (i = 0; i + 4 <= len; i += 4) {
+    unsigned char a = reverse[src[i]];
+    unsigned char b = reverse[src[i + 1]];
+    unsigned char c = reverse[src[i + 2]];
+    unsigned char d = reverse[src[i + 3]];
 
-  if (num < 3) {
-    return 0;
+    if (INVALID(a, b, c, d)) {
+      goto error;
+    }
+    block = (uint32_t) a << 18 | (uint32_t) b << 12 | (uint32_t) c << 6 | d;
+    dest[0] = (unsigned char) (block >> 16);
+    dest[1] = (unsigned char) (block >> 8);
+    dest[2] = (unsigned char) block;
+    dest += 3;
   }
 
-  BLOCK(D, 3); /* 24 bit */
+  if (rest != 0) {
+    unsigned char a = reverse[src[i]];
+    unsigned char b = reverse[src[i + 1]];
+    unsigned char c = rest == 3 ? reverse[src[i + 2]] : 0;
 
-  return 0;
-}
-
-/* num = numbers of final bytes to be decoded */
-static int _base64_to_bin(unsigned char dest[3], const char *source, int num) {
-  unsigned long block;
-
-  if (to_block4(&block, source, num) < 0) {
-    return -1;
+    if (INVALID(a, b, c, 0)) {
+      goto error;
+    }
+    block = (uint32_t) a << 18 | (uint32_t) b << 12 | (uint32_t) c << 6;
+    dest[0] = (unsigned char) (block >> 16);
+    if (rest == 3) {
+      dest[1] = (unsigned char) (block >> 8);
+    }
   }
-  dest[0] = GET_A(block);
-  dest[1] = GET_B(block);
-  dest[2] = GET_C(block);
-
-  return 0;
-}
-
-/* Count the number of "=" signs and replace them by zeroes */
-static int get_equals(char *string) {
-  char *ptr = string;
-  int num = 0;
 
-  while ((ptr=strchr(ptr,'=')) != NULL) {
-    num++;
-    *ptr = '\0';
-    ptr++;
+  if (buffer_commit(buffer, size) < 0) {
+    goto error;
   }
 
-  return num;
-}
-
-/* thanks sysk for debugging my mess :) */
-#define BITS(n) ((1 << (n)) - 1)
-static void _bin_to_base64(unsigned char *dest, const unsigned char source[3],
-    int len) {
-  switch (len) {
-    case 1:
-      dest[0] = alphabet[(source[0] >> 2)];
-      dest[1] = alphabet[((source[0] & BITS(2)) << 4)];
-      dest[2] = '=';
-      dest[3] = '=';
-      break;
-    case 2:
-      dest[0] = alphabet[source[0] >> 2];
-      dest[1] = alphabet[(source[1] >> 4) | ((source[0] & BITS(2)) << 4)];
-      dest[2] = alphabet[(source[1] & BITS(4)) << 2];
-      dest[3] = '=';
-      break;
-    case 3:
-      dest[0] = alphabet[(source[0] >> 2)];
-      dest[1] = alphabet[(source[1] >> 4) | ((source[0] & BITS(2)) << 4)];
-      dest[2] = alphabet[ (source[2] >> 6) | (source[1] & BITS(4)) << 2];
-      dest[3] = alphabet[source[2] & BITS(6)];
-      break;
-  }
+  return buffer;
+error:
+  ssh_buffer_free(buffer);
+  return NULL;
 }
 
 /**
@@ -264,8 +171,12 @@ static void _bin_to_base64(unsigned char *dest, const unsigned char source[3],
 unsigned char *bin_to_base64(const unsigned char *source, int len) {
   unsigned char *base64;
   unsigned char *ptr;
-  int flen = len + (3 - (len % 3)); /* round to upper 3 multiple */
-  flen = (4 * flen) / 3 + 1;
+  size_t flen;
+
+  if (len < 0) {
+    return NULL;
+  }
+  flen = 4 * (((size_t) len + 2) / 3) + 1;
 
   base64 = malloc(flen);
   if (base64 == NULL) {
@@ -273,11 +184,30 @@ unsigned char *bin_to_base64(const unsigned char *source, int len) {
   }
   ptr = base64;
 
-  while(len > 0){
-    _bin_to_base64(ptr, source, len > 3 ? 3 : len);
+  for (; len >= 3; len -= 3) {
+    ptr[0] = alphabet[source[0] >> 2];
+    ptr[1] = alphabet[((source[0] & 0x03) << 4) | (source[1] >> 4)];
+    ptr[2] = alphabet[((source[1] & 0x0f) << 2) | (source[2] >> 6)];
+    ptr[3] = alphabet[source[2] & 0x3f];
     ptr += 4;
     source += 3;
-    len -= 3;
+  }
+
+  switch (len) {
+    case 1:
+      ptr[0] = alphabet[source[0] >> 2];
+      ptr[1] = alphabet[(source[0] & 0x03) << 4];
+      ptr[2] = '=';
+      ptr[3] = '=';
+      ptr += 4;
+      break;
+    case 2:
+      ptr[0] = alphabet[source[0] >> 2];
+      ptr[1] = alphabet[((source[0] & 0x03) << 4) | (source[1] >> 4)];
+      ptr[2] = alphabet[(source[1] & 0x0f) << 2];
+      ptr[3] = '=';
+      ptr += 4;
+      break;
   }
   ptr[0] = '\0';
 
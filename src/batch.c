@@ -0,0 +1,917 @@
+/*
+ * batch.c - run a command on many hosts from one event loop
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/callbacks.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+#include "libssh/keys.h"
+#include "libssh/buffer.h"
+#include "libssh/capture.h"
+
+/**
+ * @defgroup libssh_batch The SSH batch functions.
+ * @ingroup libssh
+ *
+ * A batch runs a command on many hosts at once, from one thread. All the
+ * sessions are nonblocking and driven by one ssh_event, from the connection
+ * to the exit status, and the results come back through callbacks.
+ *
+ * @code
+ * batch = ssh_batch_new("uptime");
+ * for (i = 0; i < nhosts; i++) {
+ *   ssh_batch_add_host(batch, hosts[i]);
+ * }
+ * ssh_batch_set_auth(batch, "admin", NULL, key);
+ * ssh_batch_set_limits(batch, 1000, 30000);
+ * ssh_batch_set_capture(batch, SSH_BATCH_CAPTURE_TAIL, 4096);
+ * ssh_batch_set_callbacks(batch, &cb);
+ * ssh_batch_run(batch);
+ * ssh_batch_free(batch);
+ * @endcode
+ *
+ * @{
+ */
+
+enum ssh_batch_state_e {
+  SSH_BATCH_WAITING,
+  SSH_BATCH_CONNECTING,
+  SSH_BATCH_AUTH_PUBKEY,
+  SSH_BATCH_AUTH_PASSWORD,
+  SSH_BATCH_AUTH_NONE,
+  SSH_BATCH_OPENING,
+  SSH_BATCH_EXEC,
+  SSH_BATCH_RUNNING,
+  SSH_BATCH_DONE
+};
+
+struct ssh_batch_host {
+  ssh_batch batch;
+  char *host;
+  enum ssh_batch_state_e state;
+  ssh_session session;
+  ssh_channel channel;
+  struct ssh_channel_callbacks_struct channel_cb;
+  int exit_status;
+  char *exit_signal;
+  int core_dumped;
+  /* stdout and stderr, see ssh_batch_set_capture() */
+  enum ssh_batch_capture_e capture_mode;
+  size_t capture_limit;
+  struct capture capture[2];
+  /* something happened which the packet counter doesn't show */
+  int dirty;
+  int timed_out;
+  /* the session callbacks deferring the host key to host_keys_function */
+  struct ssh_callbacks_struct session_cb;
+  /* the key waits for the next host_keys_function call */
+  int key_queued;
+  ssh_string key;
+  /* the key was given to host_keys_function, the answer is awaited */
+  int key_asked;
+  /* what the session looked like after the last step */
+  enum ssh_session_state_e session_state;
+  uint32_t recv_seq;
+  /* the list of the running hosts */
+  struct ssh_batch_host *next;
+  struct ssh_batch_host *prev;
+};
+
+struct ssh_batch_struct {
+  char *command;
+  ssh_event event;
+  struct ssh_batch_host **hosts;
+  int count;
+  int allocated;
+  /* the first host which wasn't started */
+  int started;
+  struct ssh_batch_host *running;
+  int nrunning;
+  int parallel;
+  int timeout;
+  char *user;
+  char *password;
+  ssh_private_key key;
+  ssh_batch_callbacks callbacks;
+  /* a host made progress, the next poll doesn't wait */
+  int progress;
+  enum ssh_batch_capture_e capture_mode;
+  size_t capture_limit;
+  /* the blocks of the captures of all the hosts */
+  struct capture_arena arena;
+  /* the output of the host done, made whole for the result callback */
+  ssh_buffer result;
+};
+
+/**
+ * @brief Create a batch running a command.
+ *
+ * @param[in]  command  The command to run on the hosts.
+ *
+ * @return              A new batch, NULL on error.
+ */
+ssh_batch ssh_batch_new(const char *command) {
+  ssh_batch batch;
+
+  if (command == NULL) {
+    return NULL;
+  }
+  batch = malloc(sizeof(struct ssh_batch_struct));
+  if (batch == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(batch);
+
+  batch->command = strdup(command);
+  batch->event = ssh_event_new();
+  if (batch->command == NULL || batch->event == NULL) {
+    ssh_batch_free(batch);
+    return NULL;
+  }
+
+  return batch;
+}
+
+static void batch_host_stop(struct ssh_batch_host *h) {
+  ssh_batch batch = h->batch;
+
+  if (h->channel != NULL) {
+    ssh_channel_free(h->channel);
+    h->channel = NULL;
+  }
+  if (h->session != NULL) {
+    ssh_event_remove_session(batch->event, h->session);
+    ssh_disconnect(h->session);
+    ssh_free(h->session);
+    h->session = NULL;
+  }
+  if (h->state != SSH_BATCH_WAITING && h->state != SSH_BATCH_DONE) {
+    if (h->prev != NULL) {
+      h->prev->next = h->next;
+    } else {
+      batch->running = h->next;
+    }
+    if (h->next != NULL) {
+      h->next->prev = h->prev;
+    }
+    batch->nrunning--;
+  }
+  capture_clear(&batch->arena, &h->capture[0]);
+  capture_clear(&batch->arena, &h->capture[1]);
+  SAFE_FREE(h->exit_signal);
+  h->state = SSH_BATCH_DONE;
+}
+
+/**
+ * @brief Free a batch, stopping the commands still running.
+ *
+ * @param[in]  batch    The batch to free.
+ */
+void ssh_batch_free(ssh_batch batch) {
+  int i;
+
+  if (batch == NULL) {
+    return;
+  }
+  for (i = 0; i < batch->count; i++) {
+    batch_host_stop(batch->hosts[i]);
+    SAFE_FREE(batch->hosts[i]->host);
+    SAFE_FREE(batch->hosts[i]);
+  }
+  SAFE_FREE(batch->hosts);
+  capture_arena_free(&batch->arena);
+  ssh_buffer_free(batch->result);
+  if (batch->event != NULL) {
+    ssh_event_free(batch->event);
+  }
+  if (batch->password != NULL) {
+    BURN_STRING(batch->password);
+  }
+  SAFE_FREE(batch->password);
+  SAFE_FREE(batch->user);
+  SAFE_FREE(batch->command);
+  SAFE_FREE(batch);
+}
+
+/**
+ * @brief Add a host to a batch.
+ *
+ * Hosts can be added while the batch runs.
+ *
+ * @param[in]  batch    The batch.
+ *
+ * @param[in]  host     The host, as given to SSH_OPTIONS_HOST. The port and
+ *                      the other options can be set by the setup callback.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on memory error.
+ */
+int ssh_batch_add_host(ssh_batch batch, const char *host) {
+  struct ssh_batch_host **hosts;
+  struct ssh_batch_host *h;
+  int allocated;
+
+  if (batch == NULL || host == NULL) {
+    return SSH_ERROR;
+  }
+  if (batch->count == batch->allocated) {
+    allocated = batch->allocated > 0 ? batch->allocated * 2 : 16;
+    hosts = realloc(batch->hosts, allocated * sizeof(struct ssh_batch_host *));
+    if (hosts == NULL) {
+      return SSH_ERROR;
+    }
+    batch->hosts = hosts;
+    batch->allocated = allocated;
+  }
+
+  h = malloc(sizeof(struct ssh_batch_host));
+  if (h == NULL) {
+    return SSH_ERROR;
+  }
+  ZERO_STRUCTP(h);
+  h->host = strdup(host);
+  if (h->host == NULL) {
+    SAFE_FREE(h);
+    return SSH_ERROR;
+  }
+  h->batch = batch;
+  h->state = SSH_BATCH_WAITING;
+  h->exit_status = -1;
+  batch->hosts[batch->count++] = h;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Set how the batch authenticates.
+ *
+ * The methods given are tried in order: public key, then password. The
+ * "none" method is used when neither is given.
+ *
+ * @param[in]  batch    The batch.
+ *
+ * @param[in]  user     The user to log in as, NULL for the SSH_OPTIONS_USER
+ *                      default.
+ *
+ * @param[in]  password The password, or NULL.
+ *
+ * @param[in]  key      The private key, or NULL. It is shared by the
+ *                      sessions and must stay valid while the batch runs.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on memory error.
+ */
+int ssh_batch_set_auth(ssh_batch batch, const char *user,
+    const char *password, ssh_private_key key) {
+  if (batch == NULL) {
+    return SSH_ERROR;
+  }
+  SAFE_FREE(batch->user);
+  if (batch->password != NULL) {
+    BURN_STRING(batch->password);
+    SAFE_FREE(batch->password);
+  }
+  if (user != NULL) {
+    batch->user = strdup(user);
+    if (batch->user == NULL) {
+      return SSH_ERROR;
+    }
+  }
+  if (password != NULL) {
+    batch->password = strdup(password);
+    if (batch->password == NULL) {
+      return SSH_ERROR;
+    }
+  }
+  batch->key = key;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Set the limits of a batch.
+ *
+ * @param[in]  batch    The batch.
+ *
+ * @param[in]  parallel The number of hosts handled at once, 0 for all of
+ *                      them. It bounds the descriptors and memory used.
+ *
+ * @param[in]  timeout  The time in milliseconds a host has from the
+ *                      connection to the exit of the command, 0 for no
+ *                      limit.
+ */
+void ssh_batch_set_limits(ssh_batch batch, int parallel, int timeout) {
+  if (batch == NULL) {
+    return;
+  }
+  batch->parallel = parallel > 0 ? parallel : 0;
+  batch->timeout = timeout > 0 ? timeout : 0;
+}
+
+/**
+ * @brief Set what a batch keeps of the output of the commands.
+ *
+ * The output is kept in blocks shared by the hosts of the batch, which go
+ * back to it once a host is done, and given to the host_result_function
+ * callback with the exit status and the signal. With thousands of hosts,
+ * a limit keeps the memory of the batch bounded. The host_data_function
+ * callback gets the output as it comes in every mode.
+ *
+ * Called from the setup callback, it applies to the host set up and to the
+ * next ones.
+ *
+ * @param[in]  batch    The batch.
+ *
+ * @param[in]  mode     SSH_BATCH_CAPTURE_NONE to discard the output (the
+ *                      default), SSH_BATCH_CAPTURE_TAIL to keep its last
+ *                      bytes, SSH_BATCH_CAPTURE_FULL to keep its first
+ *                      bytes, SSH_BATCH_CAPTURE_LINES to give it line by
+ *                      line to the host_line_function callback.
+ *
+ * @param[in]  limit    The bytes kept per stream, or the longest line, 0 for
+ *                      no limit.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_batch_set_capture(ssh_batch batch, enum ssh_batch_capture_e mode,
+    size_t limit) {
+  if (batch == NULL || mode < SSH_BATCH_CAPTURE_NONE ||
+      mode > SSH_BATCH_CAPTURE_LINES) {
+    return SSH_ERROR;
+  }
+  batch->capture_mode = mode;
+  batch->capture_limit = limit;
+
+  return SSH_OK;
+}
+
+int ssh_batch_set_callbacks(ssh_batch batch, ssh_batch_callbacks cb) {
+  if (batch == NULL || (cb != NULL && cb->size <= 0)) {
+    return SSH_ERROR;
+  }
+  batch->callbacks = cb;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Get the event driving the sessions of a batch.
+ *
+ * An application can add its own descriptors and timers to it, they are
+ * polled by ssh_batch_dopoll().
+ *
+ * @param[in]  batch    The batch.
+ *
+ * @return              The event of the batch.
+ */
+ssh_event ssh_batch_get_event(ssh_batch batch) {
+  return batch != NULL ? batch->event : NULL;
+}
+
+/* the context of a line of a host */
+struct batch_line {
+  struct ssh_batch_host *h;
+  int is_stderr;
+};
+
+static void batch_line(const void *line, size_t len, void *userdata) {
+  struct batch_line *l = userdata;
+  ssh_batch batch = l->h->batch;
+
+  if (ssh_callbacks_exists(batch->callbacks, host_line_function)) {
+    batch->callbacks->host_line_function(batch, l->h->host, line, len,
+        l->is_stderr, batch->callbacks->userdata);
+  }
+}
+
+/* gives the output and the end of the command together */
+static void batch_host_result(struct ssh_batch_host *h, const char *error) {
+  struct ssh_batch_result_struct result;
+  ssh_batch batch = h->batch;
+  char *out = NULL;
+
+  ZERO_STRUCT(result);
+  result.exit_status = h->exit_status;
+  result.exit_signal = h->exit_signal;
+  result.core_dumped = h->core_dumped;
+  result.error = error;
+  result.out_dropped = h->capture[0].dropped;
+  result.err_dropped = h->capture[1].dropped;
+  if (h->capture[0].len + h->capture[1].len > 0) {
+    if (batch->result == NULL) {
+      batch->result = ssh_buffer_new();
+    }
+    if (batch->result != NULL && buffer_reinit(batch->result) == 0) {
+      out = buffer_allocate(batch->result,
+          h->capture[0].len + h->capture[1].len);
+    }
+  }
+  if (out != NULL) {
+    result.out = out;
+    result.out_len = capture_copy(&h->capture[0], out);
+    result.err = out + result.out_len;
+    result.err_len = capture_copy(&h->capture[1], out + result.out_len);
+  } else {
+    result.out_dropped += h->capture[0].len;
+    result.err_dropped += h->capture[1].len;
+  }
+
+  batch->callbacks->host_result_function(batch, h->host, &result,
+      batch->callbacks->userdata);
+}
+
+static void batch_host_done(struct ssh_batch_host *h, const char *error) {
+  ssh_batch batch = h->batch;
+  struct batch_line line;
+  int i;
+
+  if (h->capture_mode == SSH_BATCH_CAPTURE_LINES) {
+    /* the last lines without a newline */
+    for (i = 0; i < 2; i++) {
+      line.h = h;
+      line.is_stderr = i;
+      capture_lines_flush(&batch->arena, &h->capture[i], batch_line, &line);
+    }
+  }
+  if (ssh_callbacks_exists(batch->callbacks, host_result_function)) {
+    batch_host_result(h, error);
+  }
+  if (ssh_callbacks_exists(batch->callbacks, host_done_function)) {
+    batch->callbacks->host_done_function(batch, h->host, h->exit_status,
+        error, batch->callbacks->userdata);
+  }
+  batch_host_stop(h);
+  batch->progress = 1;
+}
+
+static void batch_host_fail(struct ssh_batch_host *h, const char *error) {
+  if (error == NULL) {
+    error = ssh_get_error(h->session);
+    if (error == NULL || error[0] == '\0') {
+      error = "Connection closed";
+    }
+  }
+  h->exit_status = -1;
+  batch_host_done(h, error);
+}
+
+static int batch_channel_data(ssh_session session, ssh_channel channel,
+    void *data, uint32_t len, int is_stderr, void *userdata) {
+  struct ssh_batch_host *h = userdata;
+  ssh_batch batch = h->batch;
+  struct capture *c = &h->capture[is_stderr ? 1 : 0];
+  struct batch_line line;
+
+  (void) session;
+  (void) channel;
+
+  if (ssh_callbacks_exists(batch->callbacks, host_data_function)) {
+    batch->callbacks->host_data_function(batch, h->host, data, len,
+        is_stderr, batch->callbacks->userdata);
+  }
+  switch (h->capture_mode) {
+    case SSH_BATCH_CAPTURE_TAIL:
+    case SSH_BATCH_CAPTURE_FULL:
+      capture_append(&batch->arena, c, data, len, h->capture_limit,
+          h->capture_mode == SSH_BATCH_CAPTURE_TAIL);
+      break;
+    case SSH_BATCH_CAPTURE_LINES:
+      line.h = h;
+      line.is_stderr = is_stderr ? 1 : 0;
+      capture_lines(&batch->arena, c, data, len, h->capture_limit,
+          batch_line, &line);
+      break;
+    case SSH_BATCH_CAPTURE_NONE:
+      break;
+  }
+
+  return len;
+}
+
+static void batch_channel_exit_status(ssh_session session,
+    ssh_channel channel, int exit_status, void *userdata) {
+  struct ssh_batch_host *h = userdata;
+
+  (void) session;
+  (void) channel;
+
+  h->exit_status = exit_status;
+}
+
+static void batch_channel_exit_signal(ssh_session session,
+    ssh_channel channel, const char *signal, int core, const char *errmsg,
+    const char *lang, void *userdata) {
+  struct ssh_batch_host *h = userdata;
+
+  (void) session;
+  (void) channel;
+  (void) errmsg;
+  (void) lang;
+
+  SAFE_FREE(h->exit_signal);
+  h->exit_signal = signal != NULL ? strdup(signal) : NULL;
+  h->core_dumped = core;
+}
+
+static void batch_channel_close(ssh_session session, ssh_channel channel,
+    void *userdata) {
+  struct ssh_batch_host *h = userdata;
+
+  (void) session;
+  (void) channel;
+
+  h->dirty = 1;
+}
+
+static void batch_host_timeout(ssh_timer timer, void *userdata) {
+  struct ssh_batch_host *h = userdata;
+
+  (void) timer;
+
+  /* the session is freed by the next step, not from its own poll */
+  h->timed_out = 1;
+  h->dirty = 1;
+}
+
+/*
+ * the authentication method after the one tried: public key, then password,
+ * and "none" only without them
+ */
+static enum ssh_batch_state_e batch_auth_next(ssh_batch batch,
+    enum ssh_batch_state_e tried) {
+  if (tried < SSH_BATCH_AUTH_PUBKEY && batch->key != NULL) {
+    return SSH_BATCH_AUTH_PUBKEY;
+  }
+  if (tried < SSH_BATCH_AUTH_PASSWORD && batch->password != NULL) {
+    return SSH_BATCH_AUTH_PASSWORD;
+  }
+  if (tried < SSH_BATCH_AUTH_PUBKEY) {
+    return SSH_BATCH_AUTH_NONE;
+  }
+
+  return SSH_BATCH_DONE;
+}
+
+static int batch_host_key(ssh_session session, ssh_string key,
+    void *userdata) {
+  struct ssh_batch_host *h = userdata;
+
+  (void) session;
+
+  h->key_queued = 1;
+  h->key = key;
+
+  return SSH_AGAIN;
+}
+
+static int batch_verify(struct ssh_batch_host *h) {
+  ssh_batch batch = h->batch;
+
+  if (ssh_callbacks_exists(batch->callbacks, host_keys_function)) {
+    /* ssh_connect() succeeded, the key was accepted */
+    return SSH_OK;
+  }
+  if (ssh_callbacks_exists(batch->callbacks, host_verify_function)) {
+    return batch->callbacks->host_verify_function(batch, h->session, h->host,
+        batch->callbacks->userdata);
+  }
+
+  return ssh_is_server_known(h->session) == SSH_SERVER_KNOWN_OK ?
+    SSH_OK : SSH_ERROR;
+}
+
+/*
+ * Calls the nonblocking function of the state of a host again. Returns 1 if
+ * the host went on to another state, 0 if it waits for the network.
+ */
+static int batch_host_step(struct ssh_batch_host *h) {
+  ssh_batch batch = h->batch;
+  int rc;
+
+  if (h->timed_out) {
+    batch_host_fail(h, "Timeout");
+    return 1;
+  }
+
+  switch (h->state) {
+    case SSH_BATCH_CONNECTING:
+      rc = ssh_connect(h->session);
+      if (rc == SSH_AGAIN) {
+        return 0;
+      } else if (rc == SSH_ERROR) {
+        batch_host_fail(h, NULL);
+        return 1;
+      }
+      if (batch_verify(h) != SSH_OK) {
+        batch_host_fail(h, "The host key couldn't be verified");
+        return 1;
+      }
+      h->state = batch_auth_next(batch, h->state);
+      return 1;
+    case SSH_BATCH_AUTH_PUBKEY:
+    case SSH_BATCH_AUTH_PASSWORD:
+    case SSH_BATCH_AUTH_NONE:
+      if (h->state == SSH_BATCH_AUTH_PUBKEY) {
+        rc = ssh_userauth_pubkey(h->session, NULL, NULL, batch->key);
+      } else if (h->state == SSH_BATCH_AUTH_PASSWORD) {
+        rc = ssh_userauth_password(h->session, NULL, batch->password);
+      } else {
+        rc = ssh_userauth_none(h->session, NULL);
+      }
+      if (rc == SSH_AUTH_AGAIN) {
+        return 0;
+      } else if (rc == SSH_AUTH_ERROR) {
+        batch_host_fail(h, NULL);
+        return 1;
+      } else if (rc != SSH_AUTH_SUCCESS) {
+        if (batch_auth_next(batch, h->state) == SSH_BATCH_DONE) {
+          batch_host_fail(h, "Authentication denied");
+        } else {
+          h->state = batch_auth_next(batch, h->state);
+        }
+        return 1;
+      }
+      h->state = SSH_BATCH_OPENING;
+      return 1;
+    case SSH_BATCH_OPENING:
+      if (h->channel == NULL) {
+        h->channel = ssh_channel_new(h->session);
+        if (h->channel == NULL) {
+          batch_host_fail(h, NULL);
+          return 1;
+        }
+        h->channel_cb.userdata = h;
+        h->channel_cb.channel_data_function = batch_channel_data;
+        h->channel_cb.channel_exit_status_function = batch_channel_exit_status;
+        h->channel_cb.channel_exit_signal_function = batch_channel_exit_signal;
+        h->channel_cb.channel_close_function = batch_channel_close;
+        ssh_callbacks_init(&h->channel_cb);
+        ssh_set_channel_callbacks(h->channel, &h->channel_cb);
+      }
+      rc = ssh_channel_open_session(h->channel);
+      if (rc == SSH_AGAIN) {
+        return 0;
+      } else if (rc == SSH_ERROR) {
+        batch_host_fail(h, NULL);
+        return 1;
+      }
+      h->state = SSH_BATCH_EXEC;
+      return 1;
+    case SSH_BATCH_EXEC:
+      rc = ssh_channel_request_exec(h->channel, batch->command);
+      if (rc == SSH_AGAIN) {
+        return 0;
+      } else if (rc == SSH_ERROR) {
+        batch_host_fail(h, NULL);
+        return 1;
+      }
+      h->state = SSH_BATCH_RUNNING;
+      return 1;
+    case SSH_BATCH_RUNNING:
+      if (h->channel->state == SSH_CHANNEL_STATE_CLOSED) {
+        batch_host_done(h, NULL);
+        return 1;
+      }
+      if (!ssh_is_connected(h->session) ||
+          h->session->session_state == SSH_SESSION_STATE_ERROR) {
+        batch_host_fail(h, NULL);
+        return 1;
+      }
+      return 0;
+    case SSH_BATCH_WAITING:
+    case SSH_BATCH_DONE:
+      break;
+  }
+
+  return 0;
+}
+
+/* steps a host as long as it goes on */
+static void batch_host_run(struct ssh_batch_host *h) {
+  while (h->state != SSH_BATCH_DONE && batch_host_step(h)) {
+    h->batch->progress = 1;
+  }
+  if (h->state != SSH_BATCH_DONE) {
+    h->dirty = 0;
+    h->session_state = h->session->session_state;
+    h->recv_seq = h->session->recv_seq;
+  }
+}
+
+static void batch_host_start(struct ssh_batch_host *h) {
+  ssh_batch batch = h->batch;
+  int rc;
+
+  h->state = SSH_BATCH_CONNECTING;
+  h->next = batch->running;
+  h->prev = NULL;
+  if (batch->running != NULL) {
+    batch->running->prev = h;
+  }
+  batch->running = h;
+  batch->nrunning++;
+
+  h->session = ssh_new();
+  if (h->session == NULL) {
+    batch_host_done(h, "Out of memory");
+    return;
+  }
+  if (ssh_options_set(h->session, SSH_OPTIONS_HOST, h->host) < 0 ||
+      (batch->user != NULL &&
+       ssh_options_set(h->session, SSH_OPTIONS_USER, batch->user) < 0)) {
+    batch_host_fail(h, NULL);
+    return;
+  }
+  if (ssh_callbacks_exists(batch->callbacks, host_keys_function)) {
+    h->session_cb.userdata = h;
+    h->session_cb.host_key_function = batch_host_key;
+    ssh_callbacks_init(&h->session_cb);
+    ssh_set_callbacks(h->session, &h->session_cb);
+  }
+  if (ssh_callbacks_exists(batch->callbacks, host_setup_function) &&
+      batch->callbacks->host_setup_function(batch, h->session, h->host,
+        batch->callbacks->userdata) != SSH_OK) {
+    batch_host_fail(h, "Skipped by the setup callback");
+    return;
+  }
+  h->capture_mode = batch->capture_mode;
+  h->capture_limit = batch->capture_limit;
+  ssh_set_blocking(h->session, 0);
+
+  rc = ssh_connect(h->session);
+  if (rc == SSH_ERROR) {
+    batch_host_fail(h, NULL);
+    return;
+  }
+  if (ssh_event_add_session(batch->event, h->session) < 0 ||
+      (batch->timeout > 0 && ssh_session_add_timer(h->session,
+        batch->timeout, batch_host_timeout, h) == NULL)) {
+    batch_host_fail(h, NULL);
+    return;
+  }
+  batch_host_run(h);
+}
+
+/* gives the keys received to host_keys_function at once */
+static int batch_host_keys(ssh_batch batch) {
+  struct ssh_batch_host **queued;
+  struct ssh_batch_host *h;
+  ssh_session *sessions;
+  const char **hosts;
+  ssh_string *keys;
+  size_t count = 0;
+  size_t i;
+
+  for (h = batch->running; h != NULL; h = h->next) {
+    if (h->key_queued) {
+      count++;
+    }
+  }
+  if (count == 0) {
+    return SSH_OK;
+  }
+
+  queued = malloc(count * sizeof(struct ssh_batch_host *));
+  sessions = malloc(count * sizeof(ssh_session));
+  hosts = malloc(count * sizeof(const char *));
+  keys = malloc(count * sizeof(ssh_string));
+  if (queued == NULL || sessions == NULL || hosts == NULL || keys == NULL) {
+    SAFE_FREE(queued);
+    SAFE_FREE(sessions);
+    SAFE_FREE(hosts);
+    SAFE_FREE(keys);
+    return SSH_ERROR;
+  }
+  count = 0;
+  for (h = batch->running; h != NULL; h = h->next) {
+    if (h->key_queued) {
+      h->key_queued = 0;
+      h->key_asked = 1;
+      queued[count] = h;
+      sessions[count] = h->session;
+      hosts[count] = h->host;
+      keys[count] = h->key;
+      count++;
+    }
+  }
+
+  batch->callbacks->host_keys_function(batch, sessions, hosts, keys, count,
+      batch->callbacks->userdata);
+
+  /* the hosts answered during the call go on */
+  for (i = 0; i < count; i++) {
+    h = queued[i];
+    if (h->state != SSH_BATCH_DONE && h->key_asked &&
+        h->session->host_key_state != SSH_HOST_KEY_PENDING) {
+      h->key_asked = 0;
+      batch_host_run(h);
+    }
+  }
+  SAFE_FREE(queued);
+  SAFE_FREE(sessions);
+  SAFE_FREE(hosts);
+  SAFE_FREE(keys);
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Make a batch progress.
+ *
+ * The hosts are started within the parallel limit, the event of the batch
+ * is polled once and the hosts whose sessions got something go on.
+ *
+ * @param[in]  batch    The batch.
+ *
+ * @param[in]  timeout  The time to wait for the network in milliseconds, -1
+ *                      for no limit.
+ *
+ * @return              SSH_OK when all the hosts are done, SSH_AGAIN if some
+ *                      are still running, SSH_ERROR on error.
+ */
+int ssh_batch_dopoll(ssh_batch batch, int timeout) {
+  struct ssh_batch_host *h;
+  struct ssh_batch_host *next;
+  int rc;
+
+  if (batch == NULL) {
+    return SSH_ERROR;
+  }
+
+  batch->progress = 0;
+  while (batch->started < batch->count &&
+      (batch->parallel == 0 || batch->nrunning < batch->parallel)) {
+    batch_host_start(batch->hosts[batch->started++]);
+  }
+  if (batch->nrunning == 0) {
+    return batch->started < batch->count ? SSH_AGAIN : SSH_OK;
+  }
+
+  rc = ssh_event_dopoll(batch->event, batch->progress ? 0 : timeout);
+  if (rc == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+
+  /* only the hosts which received something are stepped */
+  for (h = batch->running; h != NULL; h = next) {
+    next = h->next;
+    if (h->key_asked &&
+        h->session->host_key_state != SSH_HOST_KEY_PENDING) {
+      h->key_asked = 0;
+      h->dirty = 1;
+    }
+    if (h->dirty || h->session->session_state != h->session_state ||
+        h->session->recv_seq != h->recv_seq) {
+      batch_host_run(h);
+    }
+  }
+  if (batch_host_keys(batch) < 0) {
+    return SSH_ERROR;
+  }
+
+  if (batch->nrunning == 0 && batch->started == batch->count) {
+    return SSH_OK;
+  }
+  return SSH_AGAIN;
+}
+
+/**
+ * @brief Run a batch until all its hosts are done.
+ *
+ * @param[in]  batch    The batch.
+ *
+ * @return              SSH_OK when all the hosts are done, SSH_ERROR on
+ *                      error.
+ */
+int ssh_batch_run(ssh_batch batch) {
+  int rc;
+
+  do {
+    rc = ssh_batch_dopoll(batch, -1);
+  } while (rc == SSH_AGAIN);
+
+  return rc;
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
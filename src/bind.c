@@ -24,6 +24,11 @@
 
 #include "config.h"
 
+/* accept4() */
+#if defined(HAVE_ACCEPT4) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -39,6 +44,10 @@
 #include "libssh/socket.h"
 #include "libssh/session.h"
 #include "libssh/keys.h"
+#include "libssh/dh.h"
+#include "libssh/kexpool.h"
+#include "libssh/admission.h"
+#include "libssh/misc.h"
 
 /**
  * @addtogroup libssh_server
@@ -76,8 +85,12 @@ static char *hstrerror(int h_errno_val) {
 #else /* _WIN32 */
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #define SOCKOPT_TYPE_ARG4 int
 
 #endif /* _WIN32 */
@@ -125,6 +138,52 @@ static socket_t bind_socket(ssh_bind sshbind, const char *hostname,
         return -1;
     }
 
+#ifdef IPV6_V6ONLY
+    /* the addresses of IPv4 and IPv6 on one port don't conflict */
+    if (sshbind->nlisteners > 0 && ai->ai_family == AF_INET6 &&
+        setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&opt,
+                   sizeof(opt)) < 0) {
+        ssh_set_error(sshbind,
+                      SSH_FATAL,
+                      "Setting IPV6_V6ONLY failed: %s",
+                      strerror(errno));
+        freeaddrinfo (ai);
+        close(s);
+        return -1;
+    }
+#endif
+
+    /* several listeners share the port, the kernel spreads the connections */
+    if (sshbind->reuseport) {
+#ifdef SO_REUSEPORT
+        rc = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char *)&opt,
+                        sizeof(opt));
+#else
+        rc = -1;
+        errno = ENOSYS;
+#endif
+        if (rc < 0) {
+            ssh_set_error(sshbind,
+                          SSH_FATAL,
+                          "Setting SO_REUSEPORT failed: %s",
+                          strerror(errno));
+            freeaddrinfo (ai);
+            close(s);
+            return -1;
+        }
+    }
+
+    /* the accepted sockets inherit the buffers, used for the window scale */
+    if (ssh_sock_set_buffers(s, &sshbind->tcp) < 0) {
+        ssh_set_error(sshbind,
+                      SSH_FATAL,
+                      "Setting socket buffers failed: %s",
+                      strerror(errno));
+        freeaddrinfo (ai);
+        close(s);
+        return -1;
+    }
+
     if (bind(s, ai->ai_addr, ai->ai_addrlen) != 0) {
         ssh_set_error(sshbind,
                       SSH_FATAL,
@@ -141,6 +200,128 @@ static socket_t bind_socket(ssh_bind sshbind, const char *hostname,
     return s;
 }
 
+#ifndef _WIN32
+static socket_t bind_socket_unix(ssh_bind sshbind, const char *path) {
+  struct sockaddr_un sun;
+  struct stat st;
+  size_t len;
+  socket_t s;
+
+  len = strlen(path);
+  if (len >= sizeof(sun.sun_path)) {
+    ssh_set_error(sshbind, SSH_FATAL, "Unix socket path too long: %s", path);
+    return SSH_INVALID_SOCKET;
+  }
+  ZERO_STRUCT(sun);
+  sun.sun_family = AF_UNIX;
+  memcpy(sun.sun_path, path, len + 1);
+
+  /* the socket left by a server which didn't stop */
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+
+  s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s == SSH_INVALID_SOCKET) {
+    ssh_set_error(sshbind, SSH_FATAL, "%s", strerror(errno));
+    return SSH_INVALID_SOCKET;
+  }
+  if (bind(s, (struct sockaddr *) &sun, sizeof(sun)) != 0) {
+    ssh_set_error(sshbind, SSH_FATAL, "Binding to %s: %s", path,
+        strerror(errno));
+    close(s);
+    return SSH_INVALID_SOCKET;
+  }
+
+  return s;
+}
+#endif /* _WIN32 */
+
+/**
+ * @internal
+ *
+ * @brief Add an address of SSH_BIND_OPTIONS_LISTEN: "host:port",
+ *        "[ipv6]:port", "host", or the path of a unix socket.
+ */
+int ssh_bind_add_listener(ssh_bind sshbind, const char *address) {
+  struct ssh_bind_listener *listeners;
+  struct ssh_bind_listener l;
+  const char *host = address;
+  const char *colon;
+  const char *bracket;
+  unsigned long port;
+  size_t len;
+  char *end;
+
+  ZERO_STRUCT(l);
+  l.fd = SSH_INVALID_SOCKET;
+  l.port = -1;
+
+  if (address[0] == '/') {
+#ifdef _WIN32
+    ssh_set_error(sshbind, SSH_FATAL, "Unix sockets aren't supported");
+    return SSH_ERROR;
+#else
+    l.path = strdup(address);
+    if (l.path == NULL) {
+      ssh_set_error_oom(sshbind);
+      return SSH_ERROR;
+    }
+#endif
+  } else {
+    if (address[0] == '[') {
+      host = address + 1;
+      bracket = strchr(host, ']');
+      if (bracket == NULL || (bracket[1] != '\0' && bracket[1] != ':')) {
+        goto invalid;
+      }
+      len = bracket - host;
+      colon = bracket[1] == ':' ? bracket + 1 : NULL;
+    } else {
+      /* a bare IPv6 address has several colons and no port */
+      colon = strchr(address, ':');
+      if (colon != NULL && strchr(colon + 1, ':') != NULL) {
+        colon = NULL;
+      }
+      len = colon != NULL ? (size_t) (colon - address) : strlen(address);
+    }
+    if (len == 0) {
+      goto invalid;
+    }
+    if (colon != NULL) {
+      port = strtoul(colon + 1, &end, 10);
+      if (colon[1] == '\0' || *end != '\0' || port > 65535) {
+        goto invalid;
+      }
+      l.port = port;
+    }
+    l.host = malloc(len + 1);
+    if (l.host == NULL) {
+      ssh_set_error_oom(sshbind);
+      return SSH_ERROR;
+    }
+    memcpy(l.host, host, len);
+    l.host[len] = '\0';
+  }
+
+  listeners = realloc(sshbind->listeners,
+      (sshbind->nlisteners + 1) * sizeof(struct ssh_bind_listener));
+  if (listeners == NULL) {
+    SAFE_FREE(l.host);
+    SAFE_FREE(l.path);
+    ssh_set_error_oom(sshbind);
+    return SSH_ERROR;
+  }
+  sshbind->listeners = listeners;
+  sshbind->listeners[sshbind->nlisteners++] = l;
+
+  return SSH_OK;
+invalid:
+  ssh_set_error(sshbind, SSH_FATAL, "Invalid address to listen on: %s",
+      address);
+  return SSH_ERROR;
+}
+
 ssh_bind ssh_bind_new(void) {
   ssh_bind ptr;
 
@@ -151,56 +332,76 @@ ssh_bind ssh_bind_new(void) {
   ZERO_STRUCTP(ptr);
   ptr->bindfd = SSH_INVALID_SOCKET;
   ptr->bindport= 22;
+  ptr->blocking = 1;
+  ptr->admission = ssh_admission_new();
+  if (ptr->admission == NULL) {
+    SAFE_FREE(ptr);
+    return NULL;
+  }
   ptr->log_verbosity = 0;
+  ptr->channel_window = SSH_CHANNEL_WINDOW_DEFAULT;
+  ptr->channel_maxpacket = SSH_CHANNEL_MAXPACKET_DEFAULT;
 
   return ptr;
 }
 
-int ssh_bind_listen(ssh_bind sshbind) {
-  const char *host;
-  socket_t fd;
+/*
+ * Reads the host key files into new keys, which replace the keys of the
+ * bind only once all of them are read.
+ */
+static int bind_load_hostkeys(ssh_bind sshbind) {
+  struct ssh_hostkey_struct *keys[SSH_HOSTKEY_TYPES] = {NULL};
+  const char *files[SSH_HOSTKEY_TYPES] = {NULL};
+  ssh_private_key key;
+  int i;
 
-  sshbind->dsa = NULL;
-  sshbind->rsa = NULL;
+  files[SSH_KEYTYPE_DSS] = sshbind->dsakey;
+  files[SSH_KEYTYPE_RSA] = sshbind->rsakey;
+  files[SSH_KEYTYPE_ECDSA] = sshbind->ecdsakey;
+  files[SSH_KEYTYPE_ED25519] = sshbind->ed25519key;
 
-  if (ssh_init() < 0) {
-    ssh_set_error(sshbind, SSH_FATAL, "ssh_init() failed");
-    return -1;
-  }
-
-  if (sshbind->dsakey) {
-    if (sshbind->dsakey == NULL && sshbind->rsakey == NULL) {
-      ssh_set_error(sshbind, SSH_FATAL,
-        "DSA or RSA host key file must be set before listen()");
-      return SSH_ERROR;
+  for (i = 0; i < SSH_HOSTKEY_TYPES; i++) {
+    if (files[i] == NULL) {
+      continue;
     }
-    sshbind->dsa = _privatekey_from_file(
-      sshbind, sshbind->dsakey, SSH_KEYTYPE_DSS
-    );
-    if (sshbind->dsa == NULL) {
-      return -1;
+    key = _privatekey_from_file(sshbind, files[i], i);
+    if (key == NULL) {
+      goto error;
+    }
+    keys[i] = ssh_hostkey_new(key);
+    if (keys[i] == NULL) {
+      privatekey_free(key);
+      ssh_set_error(sshbind, SSH_FATAL,
+          "Could not get the public key of %s", files[i]);
+      goto error;
     }
   }
 
-  if (sshbind->rsakey) {
-    sshbind->rsa = _privatekey_from_file(
-      sshbind, sshbind->rsakey, SSH_KEYTYPE_RSA
-    );
-    if (sshbind->rsa == NULL) {
-      privatekey_free(sshbind->dsa);
-      return -1;
-    }
+  /* the sessions keep the keys they have */
+  for (i = 0; i < SSH_HOSTKEY_TYPES; i++) {
+    ssh_hostkey_set(&sshbind->host_keys[i], keys[i]);
   }
 
+  return SSH_OK;
+error:
+  for (i = 0; i < SSH_HOSTKEY_TYPES; i++) {
+    ssh_hostkey_free(keys[i]);
+  }
+  return SSH_ERROR;
+}
+
+/* opens the listening socket of the bind on the given port */
+static int bind_listen_port(ssh_bind sshbind, unsigned int port) {
+  const char *host;
+  socket_t fd;
+
   host = sshbind->bindaddr;
   if (host == NULL) {
     host = "0.0.0.0";
   }
 
-  fd = bind_socket(sshbind, host, sshbind->bindport);
+  fd = bind_socket(sshbind, host, port);
   if (fd == SSH_INVALID_SOCKET) {
-    privatekey_free(sshbind->dsa);
-    privatekey_free(sshbind->rsa);
     return -1;
   }
   sshbind->bindfd = fd;
@@ -210,14 +411,197 @@ int ssh_bind_listen(ssh_bind sshbind) {
         "Listening to socket %d: %s",
         fd, strerror(errno));
     close(fd);
-    privatekey_free(sshbind->dsa);
-    privatekey_free(sshbind->rsa);
+    sshbind->bindfd = SSH_INVALID_SOCKET;
     return -1;
   }
+  if (!sshbind->blocking) {
+    ssh_sock_set_nonblocking(fd);
+  }
 
   return 0;
 }
 
+/* opens the socket of an address of SSH_BIND_OPTIONS_LISTEN */
+static int bind_listener_open(ssh_bind sshbind, struct ssh_bind_listener *l) {
+  socket_t fd;
+
+#ifndef _WIN32
+  if (l->path != NULL) {
+    fd = bind_socket_unix(sshbind, l->path);
+  } else
+#endif
+  fd = bind_socket(sshbind, l->host,
+      l->port >= 0 ? (unsigned int) l->port : sshbind->bindport);
+  if (fd == SSH_INVALID_SOCKET) {
+    return -1;
+  }
+
+  if (listen(fd, 10) < 0) {
+    ssh_set_error(sshbind, SSH_FATAL,
+        "Listening to socket %d: %s",
+        fd, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  /* polled together, an accept never waits on one of them */
+  ssh_sock_set_nonblocking(fd);
+  l->fd = fd;
+
+  return 0;
+}
+
+static void bind_close_listeners(ssh_bind sshbind) {
+  struct ssh_bind_listener *l;
+  unsigned int i;
+
+  for (i = 0; i < sshbind->nlisteners; i++) {
+    l = &sshbind->listeners[i];
+    if (l->poll != NULL) {
+      ssh_poll_free(l->poll);
+      l->poll = NULL;
+    }
+    if (l->fd == SSH_INVALID_SOCKET) {
+      continue;
+    }
+#ifdef _WIN32
+    closesocket(l->fd);
+#else
+    close(l->fd);
+    if (l->path != NULL) {
+      unlink(l->path);
+    }
+#endif
+    l->fd = SSH_INVALID_SOCKET;
+  }
+  sshbind->bindfd = SSH_INVALID_SOCKET;
+}
+
+int ssh_bind_listen(ssh_bind sshbind) {
+  unsigned int i;
+
+  if (ssh_init_once() < 0) {
+    ssh_set_error(sshbind, SSH_FATAL, "ssh_init() failed");
+    return -1;
+  }
+
+  if (bind_load_hostkeys(sshbind) < 0) {
+    return -1;
+  }
+
+  if (sshbind->nlisteners == 0) {
+    return bind_listen_port(sshbind, sshbind->bindport);
+  }
+
+  for (i = 0; i < sshbind->nlisteners; i++) {
+    if (bind_listener_open(sshbind, &sshbind->listeners[i]) < 0) {
+      bind_close_listeners(sshbind);
+      return -1;
+    }
+  }
+  sshbind->bindfd = sshbind->listeners[0].fd;
+
+  return 0;
+}
+
+#ifndef _WIN32
+/* the port a socket got, which may have been chosen by the system */
+static int bind_local_port(ssh_bind sshbind, socket_t fd) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+
+  if (getsockname(fd, (struct sockaddr *) &addr, &len) < 0) {
+    ssh_set_error(sshbind, SSH_FATAL, "getsockname: %s", strerror(errno));
+    return -1;
+  }
+  if (addr.ss_family == AF_INET6) {
+    return ntohs(((struct sockaddr_in6 *) &addr)->sin6_port);
+  }
+
+  return ntohs(((struct sockaddr_in *) &addr)->sin_port);
+}
+
+int ssh_bind_fork(ssh_bind sshbind, unsigned int workers) {
+  struct ssh_bind_listener *l;
+  unsigned int i, j;
+  int port = -1;
+  pid_t pid;
+
+  if (sshbind == NULL) {
+    return SSH_ERROR;
+  }
+  if (workers == 0 || sshbind->bindfd == SSH_INVALID_SOCKET) {
+    ssh_set_error_invalid(sshbind, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  if (sshbind->nlisteners == 0) {
+    port = bind_local_port(sshbind, sshbind->bindfd);
+    if (port < 0) {
+      return SSH_ERROR;
+    }
+  }
+  for (j = 0; j < sshbind->nlisteners; j++) {
+    l = &sshbind->listeners[j];
+    if (l->host != NULL) {
+      l->port = bind_local_port(sshbind, l->fd);
+      if (l->port < 0) {
+        return SSH_ERROR;
+      }
+    }
+  }
+
+  for (i = 1; i < workers; i++) {
+    pid = fork();
+    if (pid < 0) {
+      ssh_set_error(sshbind, SSH_FATAL, "fork: %s", strerror(errno));
+      return SSH_ERROR;
+    }
+    if (pid > 0) {
+      continue;
+    }
+
+    /* the child shares nothing secret with its parent but the host keys */
+    ssh_crypto_reseed();
+    ssh_kex_pool_drop();
+    /* the unix sockets are shared, and left to the parent to remove */
+    for (j = 0; j < sshbind->nlisteners; j++) {
+      SAFE_FREE(sshbind->listeners[j].path);
+    }
+    if (sshbind->reuseport && sshbind->nlisteners == 0) {
+      close(sshbind->bindfd);
+      sshbind->bindfd = SSH_INVALID_SOCKET;
+      if (bind_listen_port(sshbind, port) < 0) {
+        return SSH_ERROR;
+      }
+    } else if (sshbind->reuseport) {
+      for (j = 0; j < sshbind->nlisteners; j++) {
+        l = &sshbind->listeners[j];
+        if (l->host == NULL) {
+          continue;
+        }
+        close(l->fd);
+        l->fd = SSH_INVALID_SOCKET;
+        if (bind_listener_open(sshbind, l) < 0) {
+          return SSH_ERROR;
+        }
+      }
+      sshbind->bindfd = sshbind->listeners[0].fd;
+    }
+    return i;
+  }
+
+  return 0;
+}
+#endif /* _WIN32 */
+
+int ssh_bind_reload_hostkeys(ssh_bind sshbind) {
+  if (sshbind == NULL) {
+    return SSH_ERROR;
+  }
+
+  return bind_load_hostkeys(sshbind);
+}
+
 int ssh_bind_set_callbacks(ssh_bind sshbind, ssh_bind_callbacks callbacks,
     void *userdata){
   if (sshbind == NULL) {
@@ -237,6 +621,105 @@ int ssh_bind_set_callbacks(ssh_bind sshbind, ssh_bind_callbacks callbacks,
   return 0;
 }
 
+static socket_t bind_accept_socket(socket_t s, struct sockaddr_storage *addr,
+    socklen_t *len) {
+#ifdef HAVE_ACCEPT4
+  /* not inherited by the commands of the sessions */
+  return accept4(s, (struct sockaddr *) addr, len, SOCK_CLOEXEC);
+#else
+  return accept(s, (struct sockaddr *) addr, len);
+#endif
+}
+
+/*
+ * Takes the connections waiting on a listener into the queue of the bind,
+ * as many as it holds. Returns -1 on an error other than no connection.
+ */
+static int bind_accept_batch(ssh_bind sshbind, socket_t s) {
+  struct ssh_bind_pending *p;
+  unsigned int i;
+
+  while (sshbind->npending < SSH_BIND_ACCEPT_BATCH) {
+    i = (sshbind->pending_start + sshbind->npending) % SSH_BIND_ACCEPT_BATCH;
+    p = &sshbind->pending[i];
+    p->len = sizeof(p->addr);
+    p->fd = bind_accept_socket(s, &p->addr, &p->len);
+    if (p->fd == SSH_INVALID_SOCKET) {
+#ifdef _WIN32
+      if (WSAGetLastError() == WSAEWOULDBLOCK) {
+#else
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+          errno == ECONNABORTED) {
+#endif
+        return 0;
+      }
+      return -1;
+    }
+    sshbind->npending++;
+  }
+
+  return 0;
+}
+
+/*
+ * The next connection of the listeners of SSH_BIND_OPTIONS_LISTEN, from the
+ * queue or from a new batch. A blocking bind waits on all of them.
+ */
+static int bind_accept_next(ssh_bind sshbind, struct ssh_bind_pending *next) {
+  ssh_pollfd_t *fds;
+  unsigned int n = sshbind->nlisteners;
+  unsigned int i;
+  int rc = 0;
+
+  for (;;) {
+    /* each one gets to fill the batch first in turn */
+    for (i = 0; i < n && sshbind->npending == 0; i++) {
+      rc = bind_accept_batch(sshbind,
+          sshbind->listeners[(sshbind->next_listener + i) % n].fd);
+      if (rc < 0) {
+        break;
+      }
+    }
+    sshbind->next_listener = (sshbind->next_listener + 1) % n;
+
+    if (sshbind->npending > 0) {
+      *next = sshbind->pending[sshbind->pending_start];
+      sshbind->pending_start = (sshbind->pending_start + 1) %
+        SSH_BIND_ACCEPT_BATCH;
+      sshbind->npending--;
+      return SSH_OK;
+    }
+    if (rc < 0) {
+      ssh_set_error(sshbind, SSH_FATAL,
+          "Accepting a new connection: %s",
+          strerror(errno));
+      return SSH_ERROR;
+    }
+    if (!sshbind->blocking) {
+      return SSH_AGAIN;
+    }
+
+    fds = malloc(n * sizeof(ssh_pollfd_t));
+    if (fds == NULL) {
+      ssh_set_error_oom(sshbind);
+      return SSH_ERROR;
+    }
+    for (i = 0; i < n; i++) {
+      fds[i].fd = sshbind->listeners[i].fd;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    rc = ssh_poll(fds, n, -1);
+    SAFE_FREE(fds);
+    if (rc < 0 && errno != EINTR) {
+      ssh_set_error(sshbind, SSH_FATAL,
+          "Waiting for a new connection: %s",
+          strerror(errno));
+      return SSH_ERROR;
+    }
+  }
+}
+
 /** @internal
  * @brief callback being called by poll when an event happens
  *
@@ -244,14 +727,23 @@ int ssh_bind_set_callbacks(ssh_bind sshbind, ssh_bind_callbacks callbacks,
 static int ssh_bind_poll_callback(ssh_poll_handle sshpoll,
     socket_t fd, int revents, void *user){
   ssh_bind sshbind=(ssh_bind)user;
+  unsigned int n;
   (void)sshpoll;
-  (void)fd;
 
   if(revents & POLLIN){
     /* new incoming connection */
     if(ssh_callbacks_exists(sshbind->bind_callbacks,incoming_connection)){
-      sshbind->bind_callbacks->incoming_connection(sshbind,
-          sshbind->bind_callbacks_userdata);
+      if (sshbind->nlisteners == 0) {
+        sshbind->bind_callbacks->incoming_connection(sshbind,
+            sshbind->bind_callbacks_userdata);
+        return 0;
+      }
+      /* the connections waiting are taken at once, given one at a time */
+      bind_accept_batch(sshbind, fd);
+      for (n = sshbind->npending; n > 0 && sshbind->npending > 0; n--) {
+        sshbind->bind_callbacks->incoming_connection(sshbind,
+            sshbind->bind_callbacks_userdata);
+      }
     }
   }
   return 0;
@@ -263,8 +755,21 @@ static int ssh_bind_poll_callback(ssh_poll_handle sshpoll,
  * @returns a ssh_poll handle suitable for operation
  */
 ssh_poll_handle ssh_bind_get_poll(ssh_bind sshbind){
+  struct ssh_bind_listener *l;
+  unsigned int i;
+
   if(sshbind->poll)
     return sshbind->poll;
+  /* the other listeners get theirs with it, see ssh_event_add_bind() */
+  for (i = 1; i < sshbind->nlisteners; i++) {
+    l = &sshbind->listeners[i];
+    if (l->poll == NULL) {
+      l->poll = ssh_poll_new(l->fd, POLLIN, ssh_bind_poll_callback, sshbind);
+      if (l->poll == NULL) {
+        return NULL;
+      }
+    }
+  }
   sshbind->poll=ssh_poll_new(sshbind->bindfd,POLLIN,
       ssh_bind_poll_callback,sshbind);
   return sshbind->poll;
@@ -272,6 +777,15 @@ ssh_poll_handle ssh_bind_get_poll(ssh_bind sshbind){
 
 void ssh_bind_set_blocking(ssh_bind sshbind, int blocking) {
   sshbind->blocking = blocking ? 1 : 0;
+  /* the listeners of SSH_BIND_OPTIONS_LISTEN stay nonblocking */
+  if (sshbind->bindfd == SSH_INVALID_SOCKET || sshbind->nlisteners > 0) {
+    return;
+  }
+  if (sshbind->blocking) {
+    ssh_sock_set_blocking(sshbind->bindfd);
+  } else {
+    ssh_sock_set_nonblocking(sshbind->bindfd);
+  }
 }
 
 socket_t ssh_bind_get_fd(ssh_bind sshbind) {
@@ -293,6 +807,25 @@ void ssh_bind_free(ssh_bind sshbind){
     return;
   }
 
+  if (sshbind->poll != NULL) {
+    ssh_poll_free(sshbind->poll);
+  }
+  /* the connections accepted and not given to ssh_bind_accept() */
+  for (; sshbind->npending > 0; sshbind->npending--) {
+#ifdef _WIN32
+    closesocket(sshbind->pending[sshbind->pending_start].fd);
+#else
+    close(sshbind->pending[sshbind->pending_start].fd);
+#endif
+    sshbind->pending_start = (sshbind->pending_start + 1) %
+      SSH_BIND_ACCEPT_BATCH;
+  }
+  bind_close_listeners(sshbind);
+  for (i = 0; i < (int) sshbind->nlisteners; i++) {
+    SAFE_FREE(sshbind->listeners[i].host);
+    SAFE_FREE(sshbind->listeners[i].path);
+  }
+  SAFE_FREE(sshbind->listeners);
   if (sshbind->bindfd >= 0) {
 #ifdef _WIN32
     closesocket(sshbind->bindfd);
@@ -306,9 +839,16 @@ void ssh_bind_free(ssh_bind sshbind){
   SAFE_FREE(sshbind->banner);
   SAFE_FREE(sshbind->dsakey);
   SAFE_FREE(sshbind->rsakey);
-  SAFE_FREE(sshbind->dsa);
-  SAFE_FREE(sshbind->rsa);
+  SAFE_FREE(sshbind->ecdsakey);
+  SAFE_FREE(sshbind->ed25519key);
+  /* the sessions keep their references */
+  for (i = 0; i < SSH_HOSTKEY_TYPES; i++) {
+    ssh_hostkey_free(sshbind->host_keys[i]);
+  }
   SAFE_FREE(sshbind->bindaddr);
+  /* the sessions not authenticated yet keep the count */
+  ssh_admission_leave(&sshbind->admission);
+  ssh_admission_sources_free(&sshbind->sources);
 
   for (i = 0; i < 10; i++) {
     if (sshbind->wanted_methods[i]) {
@@ -320,9 +860,46 @@ void ssh_bind_free(ssh_bind sshbind){
 }
 
 
+/*
+ * Tells if the connection accepted from addr is let in by the limits of the
+ * bind and its admission callback. It then counts as unauthenticated.
+ */
+static int bind_admit(ssh_bind sshbind, const struct sockaddr *addr,
+    socklen_t len) {
+  char host[NI_MAXHOST];
+  char port[NI_MAXSERV];
+
+  if (sshbind->rate_limit > 0 &&
+      ssh_admission_rate(&sshbind->sources, ssh_admission_key(addr),
+        sshbind->rate_limit, sshbind->rate_burst, ssh_timestamp_ms()) < 0) {
+    return 0;
+  }
+
+  if (ssh_callbacks_exists(sshbind->bind_callbacks, admission)) {
+    if (getnameinfo(addr, len, host, sizeof(host), port, sizeof(port),
+          NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+      host[0] = '\0';
+      port[0] = '\0';
+    }
+    if (sshbind->bind_callbacks->admission(sshbind, host, atoi(port),
+          ssh_admission_count(sshbind->admission),
+          sshbind->bind_callbacks_userdata) != 0) {
+      return 0;
+    }
+  }
+
+  if (ssh_admission_enter(sshbind->admission,
+        sshbind->max_unauthenticated) < 0) {
+    return 0;
+  }
+
+  return 1;
+}
+
 int ssh_bind_accept(ssh_bind sshbind, ssh_session session) {
+  struct ssh_bind_pending next;
   socket_t fd = SSH_INVALID_SOCKET;
-  int i;
+  int rc;
 
   if (sshbind->bindfd == SSH_INVALID_SOCKET) {
     ssh_set_error(sshbind, SSH_FATAL,
@@ -334,16 +911,75 @@ int ssh_bind_accept(ssh_bind sshbind, ssh_session session) {
   	return SSH_ERROR;
   }
 
-  fd = accept(sshbind->bindfd, NULL, NULL);
+  /* the connections which aren't let in are closed before the key exchange */
+  for (;;) {
+    if (sshbind->nlisteners > 0) {
+      rc = bind_accept_next(sshbind, &next);
+      if (rc != SSH_OK) {
+        return rc;
+      }
+    } else {
+      next.len = sizeof(next.addr);
+      next.fd = bind_accept_socket(sshbind->bindfd, &next.addr, &next.len);
+    }
+    fd = next.fd;
+    if (fd == SSH_INVALID_SOCKET) {
+#ifdef _WIN32
+      if (!sshbind->blocking && WSAGetLastError() == WSAEWOULDBLOCK) {
+#else
+      if (!sshbind->blocking && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+#endif
+        return SSH_AGAIN;
+      }
+      ssh_set_error(sshbind, SSH_FATAL,
+          "Accepting a new connection: %s",
+          strerror(errno));
+      return SSH_ERROR;
+    }
+    if (bind_admit(sshbind, (struct sockaddr *) &next.addr, next.len)) {
+      break;
+    }
+#ifdef _WIN32
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+  }
+
+  /* the slot is given back when the session is authenticated or freed */
+  ssh_admission_leave(&session->admission);
+  session->admission = sshbind->admission;
+
+  if (ssh_bind_accept_fd(sshbind, session, fd) != SSH_OK) {
+#ifdef _WIN32
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
+int ssh_bind_accept_fd(ssh_bind sshbind, ssh_session session, socket_t fd) {
+  int i;
+
+  if (session == NULL) {
+    ssh_set_error(sshbind, SSH_FATAL, "session is null");
+    return SSH_ERROR;
+  }
   if (fd == SSH_INVALID_SOCKET) {
-    ssh_set_error(sshbind, SSH_FATAL,
-        "Accepting a new connection: %s",
-        strerror(errno));
+    ssh_set_error_invalid(sshbind, __FUNCTION__);
     return SSH_ERROR;
   }
 
   session->server = 1;
   session->version = 2;
+  /* the key exchange of a nonblocking bind doesn't block either */
+  if (!sshbind->blocking) {
+    ssh_set_blocking(session, 0);
+  }
 
   /* copy options */
   for (i = 0; i < 10; ++i) {
@@ -366,6 +1002,15 @@ int ssh_bind_accept(ssh_bind sshbind, ssh_session session) {
   }
 
   session->log_verbosity = sshbind->log_verbosity;
+  session->tcp = sshbind->tcp;
+  session->channel_window = sshbind->channel_window;
+  session->channel_window_max = sshbind->channel_window_max;
+  session->channel_maxpacket = sshbind->channel_maxpacket;
+
+  if (ssh_sock_set_options(fd, &session->tcp) < 0) {
+    SSH_LOG(session, SSH_LOG_RARE, "Setting socket options: %s",
+        strerror(errno));
+  }
 
   ssh_socket_free(session->socket);
   session->socket = ssh_socket_new(session);
@@ -377,20 +1022,10 @@ int ssh_bind_accept(ssh_bind sshbind, ssh_session session) {
   ssh_socket_set_fd(session->socket, fd);
   ssh_socket_get_poll_handle_out(session->socket);
 
-  if (sshbind->dsa) {
-    //session->dsa_key = privatekey_dup(sshbind->dsa);
-    session->dsa_key = sshbind->dsa;
-  }
-  else {
-    session->dsa_key = NULL;
-  }
-  
-  if (sshbind->rsa) {
-    //session->rsa_key = privatekey_dup(sshbind->rsa);
-    session->rsa_key = sshbind->rsa;
-  }
-  else {
-    session->rsa_key = NULL;
+  /* the session keeps its host keys for the key re-exchanges */
+  for (i = 0; i < SSH_HOSTKEY_TYPES; i++) {
+    ssh_hostkey_free(session->host_keys[i]);
+    session->host_keys[i] = ssh_hostkey_get(&sshbind->host_keys[i]);
   }
 
   return SSH_OK;
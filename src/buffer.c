@@ -21,6 +21,7 @@
  * MA 02111-1307, USA.
  */
 
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -30,6 +31,8 @@
 
 #include "libssh/priv.h"
 #include "libssh/buffer.h"
+#include "libssh/pool.h"
+#include "libssh/misc.h"
 
 /**
  * @defgroup libssh_buffer The SSH buffer functions.
@@ -79,8 +82,19 @@ static void buffer_verify(ssh_buffer buf){
  * @return A newly initialized SSH buffer, NULL on error.
  */
 struct ssh_buffer_struct *ssh_buffer_new(void) {
-  struct ssh_buffer_struct *buf = malloc(sizeof(struct ssh_buffer_struct));
+  struct ssh_buffer_struct *buf = ssh_pool_get(SSH_POOL_BUFFER);
 
+  if (buf != NULL) {
+    /* a pooled buffer comes with its data, already burned if needed */
+    buf->used = 0;
+    buf->pos = 0;
+    buf->secure = 0;
+    buf->pool_next = NULL;
+    buffer_verify(buf);
+    return buf;
+  }
+
+  buf = malloc(sizeof(struct ssh_buffer_struct));
   if (buf == NULL) {
     return NULL;
   }
@@ -89,6 +103,31 @@ struct ssh_buffer_struct *ssh_buffer_new(void) {
   return buf;
 }
 
+/**
+ * @internal
+ *
+ * @brief Create a new SSH buffer with room for size bytes.
+ *
+ * A caller which knows how big the data will be gets a single allocation
+ * instead of a series of doublings.
+ *
+ * @param[in]  size     The number of bytes to allocate.
+ *
+ * @return A newly initialized SSH buffer, NULL on error.
+ */
+struct ssh_buffer_struct *ssh_buffer_new_sized(uint32_t size) {
+  struct ssh_buffer_struct *buf = ssh_buffer_new();
+
+  if (buf == NULL) {
+    return NULL;
+  }
+  if (buffer_ensure(buf, size) < 0) {
+    ssh_buffer_free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
 /**
  * @brief Deallocate a SSH buffer.
  *
@@ -101,10 +140,19 @@ void ssh_buffer_free(struct ssh_buffer_struct *buffer) {
   buffer_verify(buffer);
 
   if (buffer->data) {
-    /* burn the data */
-    memset(buffer->data, 0, buffer->allocated);
-    SAFE_FREE(buffer->data);
+    if (buffer->secure) {
+      /* burn the data */
+      memset(buffer->data, 0, buffer->allocated);
+    }
+    if (buffer->allocated > SSH_POOL_BUFFER_DATA_SIZE) {
+      SAFE_FREE(buffer->data);
+      buffer->allocated = 0;
+    }
   }
+  if (ssh_pool_put(SSH_POOL_BUFFER, buffer) == 0) {
+    return;
+  }
+  SAFE_FREE(buffer->data);
   memset(buffer, 'X', sizeof(*buffer));
   SAFE_FREE(buffer);
 }
@@ -114,13 +162,27 @@ static int realloc_buffer(struct ssh_buffer_struct *buffer, int needed) {
   char *new = NULL;
   buffer_verify(buffer);
   /* Find the smallest power of two which is greater or equal to needed */
-  while(smallest <= needed) {
+  while(smallest < needed) {
     smallest <<= 1;
   }
   needed = smallest;
-  new = realloc(buffer->data, needed);
-  if (new == NULL) {
-    return -1;
+  if (buffer->secure) {
+    /* realloc() could leave a copy of the data behind */
+    new = malloc(needed);
+    if (new == NULL) {
+      return -1;
+    }
+    if (buffer->data) {
+      memcpy(new, buffer->data,
+          buffer->used < (uint32_t) needed ? buffer->used : (uint32_t) needed);
+      memset(buffer->data, 0, buffer->allocated);
+      SAFE_FREE(buffer->data);
+    }
+  } else {
+    new = realloc(buffer->data, needed);
+    if (new == NULL) {
+      return -1;
+    }
   }
   buffer->data = new;
   buffer->allocated = needed;
@@ -138,25 +200,71 @@ static void buffer_shift(ssh_buffer buffer){
     return;
   memmove(buffer->data, buffer->data + buffer->pos, buffer->used - buffer->pos);
   buffer->used -= buffer->pos;
+  if (buffer->secure) {
+    /* burn the copy left after the data */
+    memset(buffer->data + buffer->used, 0, buffer->pos);
+  }
   buffer->pos=0;
   buffer_verify(buffer);
 }
 
+/** @internal
+ * @brief grows a buffer so it can hold at least needed bytes from its
+ * beginning. Only the unread data is copied into the new memory.
+ * @param buffer SSH buffer
+ * @param needed the number of bytes of unread and new data
+ */
+static int buffer_grow(ssh_buffer buffer, uint32_t needed){
+  uint32_t rest = buffer->used - buffer->pos;
+  uint32_t smallest = 1;
+  char *new;
+
+  if (buffer->pos == 0 && !buffer->secure) {
+    return realloc_buffer(buffer, needed);
+  }
+  buffer_verify(buffer);
+  while(smallest < needed) {
+    smallest <<= 1;
+  }
+  new = malloc(smallest);
+  if (new == NULL) {
+    return -1;
+  }
+  if (buffer->data) {
+    memcpy(new, buffer->data + buffer->pos, rest);
+    if (buffer->secure) {
+      memset(buffer->data, 0, buffer->allocated);
+    }
+    SAFE_FREE(buffer->data);
+  }
+  buffer->data = new;
+  buffer->allocated = smallest;
+  buffer->used = rest;
+  buffer->pos = 0;
+  buffer_verify(buffer);
+  return 0;
+}
+
 /**
  * @internal
  *
  * @brief Reinitialize a SSH buffer.
  *
+ * The allocated memory is kept unless it is bigger than
+ * BUFFER_REINIT_MAX_SIZE.
+ *
  * @param[in]  buffer   The buffer to reinitialize.
  *
  * @return              0 on success, < 0 on error.
  */
 int buffer_reinit(struct ssh_buffer_struct *buffer) {
   buffer_verify(buffer);
-  memset(buffer->data, 0, buffer->used);
+  if (buffer->secure) {
+    memset(buffer->data, 0, buffer->used);
+  }
   buffer->used = 0;
   buffer->pos = 0;
-  if(buffer->allocated > 127) {
+  if(buffer->allocated > BUFFER_REINIT_MAX_SIZE) {
     if (realloc_buffer(buffer, 127) < 0) {
       return -1;
     }
@@ -165,6 +273,46 @@ int buffer_reinit(struct ssh_buffer_struct *buffer) {
   return 0;
 }
 
+/**
+ * @internal
+ *
+ * @brief Give the memory of an empty buffer back.
+ *
+ * Sessions and channels which are idle most of the time don't have to keep
+ * the memory of the data they had: the buffer allocates again when it's
+ * written. Nothing is done while unread data remains.
+ *
+ * @param[in]  buffer   The buffer to release.
+ */
+void buffer_release(struct ssh_buffer_struct *buffer) {
+  buffer_verify(buffer);
+  if (buffer->data == NULL || buffer->pos < buffer->used) {
+    return;
+  }
+  if (buffer->secure) {
+    memset(buffer->data, 0, buffer->allocated);
+  }
+  SAFE_FREE(buffer->data);
+  buffer->allocated = 0;
+  buffer->used = 0;
+  buffer->pos = 0;
+  buffer_verify(buffer);
+}
+
+/**
+ * @internal
+ *
+ * @brief Mark a buffer as holding secret data.
+ *
+ * The memory of such a buffer is zeroed when it is reinitialized, moved or
+ * freed. Other buffers, like the ones of the channel data, skip that cost.
+ *
+ * @param[in]  buffer   The buffer to mark.
+ */
+void buffer_set_secure(struct ssh_buffer_struct *buffer) {
+  buffer->secure = 1;
+}
+
 /**
  * @internal
  *
@@ -179,21 +327,129 @@ int buffer_reinit(struct ssh_buffer_struct *buffer) {
  * @return              0 on success, < 0 on error.
  */
 int buffer_add_data(struct ssh_buffer_struct *buffer, const void *data, uint32_t len) {
+  void *ptr;
+
+  ptr = buffer_allocate(buffer, len);
+  if (ptr == NULL) {
+    return -1;
+  }
+  memcpy(ptr, data, len);
+  return 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Reserve space at the tail of a buffer.
+ *
+ * Nothing is added to the buffer: once the caller has written into the
+ * space, it counts the bytes with buffer_commit(). A message can then be
+ * serialized in one pass after a single size check.
+ *
+ * @param[in]  buffer   The buffer to grow.
+ *
+ * @param[in]  len      The number of bytes to reserve.
+ *
+ * @return              A pointer to the reserved space, NULL on error. It
+ *                      is valid until the next modification of the buffer.
+ *                      Reserving 0 bytes always succeeds.
+ */
+void *buffer_reserve(struct ssh_buffer_struct *buffer, uint32_t len) {
+  static char empty;
+
   buffer_verify(buffer);
+  if (len == 0 && buffer->data == NULL) {
+    /* nothing is allocated yet, and nothing will be written there */
+    return &empty;
+  }
+  if (buffer->used + len < buffer->used) {
+    return NULL;
+  }
   if (buffer->allocated < (buffer->used + len)) {
-    if(buffer->pos > 0)
+    uint32_t rest = buffer->used - buffer->pos;
+
+    /*
+     * The unread data is moved to the front only when it is not bigger than
+     * what has been read before it. Each byte is then moved at most once per
+     * byte consumed, which keeps the FIFO use (sockets, channels) as cheap as
+     * a ring buffer. Otherwise, the buffer grows.
+     */
+    if (buffer->pos > 0 && rest <= buffer->pos &&
+        buffer->allocated >= rest + len) {
       buffer_shift(buffer);
-    if (realloc_buffer(buffer, buffer->used + len) < 0) {
-      return -1;
+    } else if (buffer_grow(buffer, rest + len > buffer->allocated ?
+          rest + len : buffer->allocated) < 0) {
+      return NULL;
     }
   }
 
-  memcpy(buffer->data+buffer->used, data, len);
-  buffer->used+=len;
+  return buffer->data + buffer->used;
+}
+
+/**
+ * @internal
+ *
+ * @brief Make room for len more bytes at the tail of a buffer.
+ *
+ * @param[in]  buffer   The buffer to grow.
+ *
+ * @param[in]  len      The number of bytes which will be added.
+ *
+ * @return              0 on success, < 0 on error.
+ */
+int buffer_ensure(struct ssh_buffer_struct *buffer, uint32_t len) {
+  return buffer_reserve(buffer, len) == NULL ? -1 : 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Count bytes written in the space given by buffer_reserve().
+ *
+ * @param[in]  buffer   The buffer.
+ *
+ * @param[in]  len      The number of bytes written.
+ *
+ * @return              0 on success, < 0 if more than the reserved space.
+ */
+int buffer_commit(struct ssh_buffer_struct *buffer, uint32_t len) {
+  if (len > buffer->allocated - buffer->used) {
+    return -1;
+  }
+  buffer->used += len;
   buffer_verify(buffer);
   return 0;
 }
 
+/**
+ * @internal
+ *
+ * @brief Allocate space at the tail of a buffer.
+ *
+ * The returned space is counted as used, so the caller can write (or read
+ * from a socket, or decrypt) directly into the buffer instead of going
+ * through a temporary copy. Unwritten bytes can be given back with
+ * buffer_pass_bytes_end().
+ *
+ * @param[in]  buffer   The buffer to grow.
+ *
+ * @param[in]  len      The number of bytes to allocate.
+ *
+ * @return              A pointer to the allocated space, NULL on error. It
+ *                      is valid until the next modification of the buffer.
+ */
+void *buffer_allocate(struct ssh_buffer_struct *buffer, uint32_t len) {
+  void *ptr;
+
+  ptr = buffer_reserve(buffer, len);
+  if (ptr == NULL) {
+    return NULL;
+  }
+  buffer->used += len;
+  buffer_verify(buffer);
+  return ptr;
+}
+
 /**
  * @internal
  *
@@ -352,6 +608,59 @@ int buffer_add_buffer(struct ssh_buffer_struct *buffer,
   return 0;
 }
 
+/**
+ * @internal
+ *
+ * @brief Move data from the position of a buffer to the tail of another one.
+ *
+ * When the destination is empty and all the data of the source is moved,
+ * the memory of the two buffers is exchanged instead of copying the data.
+ *
+ * @param[in]  buffer   The destination buffer.
+ *
+ * @param[in]  source   The source buffer. The moved data is consumed.
+ *
+ * @param[in]  len      The number of bytes to move.
+ *
+ * @return              0 on success, -1 on error.
+ */
+int buffer_move(struct ssh_buffer_struct *buffer,
+    struct ssh_buffer_struct *source, uint32_t len) {
+  char *data;
+  uint32_t allocated;
+
+  buffer_verify(buffer);
+  buffer_verify(source);
+  if (len > buffer_get_rest_len(source)) {
+    return -1;
+  }
+
+  if (buffer_get_rest_len(buffer) == 0 && len == buffer_get_rest_len(source)) {
+    if (buffer->secure && buffer->data != NULL) {
+      memset(buffer->data, 0, buffer->allocated);
+    }
+    data = buffer->data;
+    allocated = buffer->allocated;
+    buffer->data = source->data;
+    buffer->allocated = source->allocated;
+    buffer->pos = source->pos;
+    buffer->used = source->used;
+    source->data = data;
+    source->allocated = allocated;
+    source->pos = source->used = 0;
+    buffer_verify(buffer);
+    buffer_verify(source);
+    return 0;
+  }
+
+  if (buffer_add_data(buffer, buffer_get_rest(source), len) < 0) {
+    return -1;
+  }
+  buffer_pass_bytes(source, len);
+
+  return 0;
+}
+
 /**
  * @brief Get a pointer on the head of a buffer.
  *
@@ -564,6 +873,70 @@ struct ssh_string_struct *buffer_get_ssh_string(struct ssh_buffer_struct *buffer
   return str;
 }
 
+/**
+ * @internal
+ *
+ * @brief Get a SSH String out of the buffer without copying it.
+ *
+ * The returned pointer points into the buffer: it is only valid until the
+ * buffer is modified or freed (for a packet, until its callback returns).
+ *
+ * @param[in]  buffer   The buffer to read.
+ *
+ * @param[out] len      The length of the string.
+ *
+ * @returns             The content of the string, NULL on error.
+ */
+const void *buffer_get_ssh_string_view(struct ssh_buffer_struct *buffer,
+    uint32_t *len) {
+  uint32_t stringlen;
+  const void *data;
+
+  if (buffer->used - buffer->pos < sizeof(uint32_t)) {
+    return NULL;
+  }
+  memcpy(&stringlen, buffer->data + buffer->pos, sizeof(uint32_t));
+  stringlen = ntohl(stringlen);
+  if (stringlen > buffer->used - buffer->pos - sizeof(uint32_t)) {
+    return NULL;
+  }
+  data = buffer->data + buffer->pos + sizeof(uint32_t);
+  buffer->pos += sizeof(uint32_t) + stringlen;
+  *len = stringlen;
+
+  return data;
+}
+
+/**
+ * @internal
+ *
+ * @brief Get a SSH String out of the buffer as a C string, without copying
+ * it out of the buffer.
+ *
+ * The string is moved over its length field and terminated in place, so the
+ * buffer is changed. Like buffer_get_ssh_string_view(), the pointer is only
+ * valid until the buffer is modified or freed.
+ *
+ * @param[in]  buffer   The buffer to read.
+ *
+ * @returns             The string, NULL on error or if it contains a NUL.
+ */
+char *buffer_get_ssh_string_cstr(struct ssh_buffer_struct *buffer) {
+  const void *data;
+  uint32_t len;
+  char *str;
+
+  data = buffer_get_ssh_string_view(buffer, &len);
+  if (data == NULL || memchr(data, '\0', len) != NULL) {
+    return NULL;
+  }
+  str = (char *) data - sizeof(uint32_t);
+  memmove(str, data, len);
+  str[len] = '\0';
+
+  return str;
+}
+
 /**
  * @internal
  *
@@ -599,6 +972,321 @@ struct ssh_string_struct *buffer_get_mpint(struct ssh_buffer_struct *buffer) {
   return str;
 }
 
+/**
+ * @internal
+ *
+ * @brief Add a whole message to the tail of a buffer.
+ *
+ * The size of the message is computed first, so the buffer is grown once and
+ * the fields are written in a single pass. Each character of the format
+ * gives the type of an argument:
+ *
+ * - 'b': uint8_t
+ * - 'w': uint16_t, in host byte order
+ * - 'd': uint32_t, in host byte order
+ * - 'q': uint64_t, in host byte order
+ * - 'S': ssh_string
+ * - 's': const char *, added as a SSH string
+ * - 'P': uint32_t length followed by a pointer to raw data
+ *
+ * @code
+ * buffer_pack(buf, "bdS", SSH2_MSG_CHANNEL_REQUEST, channel, request);
+ * @endcode
+ *
+ * @param[in]  buffer   The buffer to add the message.
+ *
+ * @param[in]  format   The types of the fields.
+ *
+ * @return              0 on success, < 0 on error (nothing is added).
+ */
+int buffer_pack(struct ssh_buffer_struct *buffer, const char *format, ...) {
+  va_list ap;
+  const char *p;
+  unsigned char *ptr;
+  struct ssh_string_struct *str;
+  const char *cstr;
+  const void *data;
+  uint16_t v16;
+  uint32_t v32;
+  uint64_t v64;
+  uint32_t len = 0;
+  uint32_t l;
+
+  /* first pass: the size of the message */
+  va_start(ap, format);
+  for (p = format; *p != '\0'; p++) {
+    switch (*p) {
+      case 'b':
+        (void) va_arg(ap, int);
+        l = 1;
+        break;
+      case 'w':
+        (void) va_arg(ap, int);
+        l = 2;
+        break;
+      case 'd':
+        (void) va_arg(ap, uint32_t);
+        l = 4;
+        break;
+      case 'q':
+        (void) va_arg(ap, uint64_t);
+        l = 8;
+        break;
+      case 'S':
+        str = va_arg(ap, struct ssh_string_struct *);
+        if (str == NULL) {
+          va_end(ap);
+          return -1;
+        }
+        l = sizeof(uint32_t) + ssh_string_len(str);
+        break;
+      case 's':
+        cstr = va_arg(ap, const char *);
+        if (cstr == NULL) {
+          va_end(ap);
+          return -1;
+        }
+        l = sizeof(uint32_t) + strlen(cstr);
+        break;
+      case 'P':
+        l = va_arg(ap, uint32_t);
+        (void) va_arg(ap, const void *);
+        break;
+      default:
+        va_end(ap);
+        return -1;
+    }
+    if (len + l < len) {
+      va_end(ap);
+      return -1;
+    }
+    len += l;
+  }
+  va_end(ap);
+
+  ptr = buffer_reserve(buffer, len);
+  if (ptr == NULL) {
+    return -1;
+  }
+
+  va_start(ap, format);
+  for (p = format; *p != '\0'; p++) {
+    switch (*p) {
+      case 'b':
+        *ptr++ = (uint8_t) va_arg(ap, int);
+        break;
+      case 'w':
+        v16 = htons((uint16_t) va_arg(ap, int));
+        memcpy(ptr, &v16, sizeof(v16));
+        ptr += sizeof(v16);
+        break;
+      case 'd':
+        v32 = htonl(va_arg(ap, uint32_t));
+        memcpy(ptr, &v32, sizeof(v32));
+        ptr += sizeof(v32);
+        break;
+      case 'q':
+        v64 = htonll(va_arg(ap, uint64_t));
+        memcpy(ptr, &v64, sizeof(v64));
+        ptr += sizeof(v64);
+        break;
+      case 'S':
+        str = va_arg(ap, struct ssh_string_struct *);
+        l = sizeof(uint32_t) + ssh_string_len(str);
+        memcpy(ptr, str, l);
+        ptr += l;
+        break;
+      case 's':
+        cstr = va_arg(ap, const char *);
+        l = strlen(cstr);
+        v32 = htonl(l);
+        memcpy(ptr, &v32, sizeof(v32));
+        memcpy(ptr + sizeof(v32), cstr, l);
+        ptr += sizeof(v32) + l;
+        break;
+      case 'P':
+        l = va_arg(ap, uint32_t);
+        data = va_arg(ap, const void *);
+        memcpy(ptr, data, l);
+        ptr += l;
+        break;
+    }
+  }
+  va_end(ap);
+
+  return buffer_commit(buffer, len);
+}
+
+/**
+ * @internal
+ *
+ * @brief Read a whole message out of a buffer.
+ *
+ * The format is the one of buffer_pack(), the arguments are pointers to the
+ * fields to fill:
+ *
+ * - 'b': uint8_t *
+ * - 'w': uint16_t *, in host byte order
+ * - 'd': uint32_t *, in host byte order
+ * - 'q': uint64_t *, in host byte order
+ * - 'S': ssh_string *, the string is allocated
+ * - 's': char **, a nul-terminated copy is allocated
+ * - 'P': uint32_t length followed by a void **, a copy is allocated
+ *
+ * @param[in]  buffer   The buffer to read.
+ *
+ * @param[in]  format   The types of the fields.
+ *
+ * @return              0 on success, < 0 if the message is truncated or
+ *                      invalid. On error nothing is read and nothing needs
+ *                      to be freed.
+ */
+int buffer_unpack(struct ssh_buffer_struct *buffer, const char *format, ...) {
+  va_list ap;
+  const char *p;
+  const char *q;
+  const unsigned char *data;
+  struct ssh_string_struct *str;
+  char *cstr;
+  void *raw;
+  void **rawp;
+  uint16_t v16;
+  uint32_t v32;
+  uint64_t v64;
+  uint32_t rest;
+  uint32_t off = 0;
+  uint32_t l;
+  int rc = -1;
+
+  data = buffer_get_rest(buffer);
+  rest = buffer_get_rest_len(buffer);
+
+  va_start(ap, format);
+  for (p = format; *p != '\0'; p++) {
+    switch (*p) {
+      case 'b':
+        if (rest - off < 1) {
+          goto out;
+        }
+        *va_arg(ap, uint8_t *) = data[off];
+        off++;
+        break;
+      case 'w':
+        if (rest - off < sizeof(v16)) {
+          goto out;
+        }
+        memcpy(&v16, data + off, sizeof(v16));
+        *va_arg(ap, uint16_t *) = ntohs(v16);
+        off += sizeof(v16);
+        break;
+      case 'd':
+        if (rest - off < sizeof(v32)) {
+          goto out;
+        }
+        memcpy(&v32, data + off, sizeof(v32));
+        *va_arg(ap, uint32_t *) = ntohl(v32);
+        off += sizeof(v32);
+        break;
+      case 'q':
+        if (rest - off < sizeof(v64)) {
+          goto out;
+        }
+        memcpy(&v64, data + off, sizeof(v64));
+        *va_arg(ap, uint64_t *) = ntohll(v64);
+        off += sizeof(v64);
+        break;
+      case 'S':
+      case 's':
+        if (rest - off < sizeof(v32)) {
+          goto out;
+        }
+        memcpy(&v32, data + off, sizeof(v32));
+        l = ntohl(v32);
+        if (l > rest - off - sizeof(v32)) {
+          goto out;
+        }
+        off += sizeof(v32);
+        if (*p == 'S') {
+          str = ssh_string_new(l);
+          if (str == NULL) {
+            goto out;
+          }
+          memcpy(ssh_string_data(str), data + off, l);
+          *va_arg(ap, struct ssh_string_struct **) = str;
+        } else {
+          cstr = malloc(l + 1);
+          if (cstr == NULL) {
+            goto out;
+          }
+          memcpy(cstr, data + off, l);
+          cstr[l] = '\0';
+          *va_arg(ap, char **) = cstr;
+        }
+        off += l;
+        break;
+      case 'P':
+        l = va_arg(ap, uint32_t);
+        rawp = va_arg(ap, void **);
+        if (l > rest - off) {
+          goto out;
+        }
+        raw = malloc(l > 0 ? l : 1);
+        if (raw == NULL) {
+          goto out;
+        }
+        memcpy(raw, data + off, l);
+        *rawp = raw;
+        off += l;
+        break;
+      default:
+        goto out;
+    }
+  }
+  rc = 0;
+out:
+  va_end(ap);
+
+  if (rc == 0) {
+    buffer_pass_bytes(buffer, off);
+    return 0;
+  }
+
+  /* free what was allocated for the fields before the error */
+  va_start(ap, format);
+  for (q = format; q < p; q++) {
+    switch (*q) {
+      case 'S':
+        {
+          struct ssh_string_struct **strp;
+
+          strp = va_arg(ap, struct ssh_string_struct **);
+          ssh_string_free(*strp);
+          *strp = NULL;
+        }
+        break;
+      case 's':
+        {
+          char **cstrp;
+
+          cstrp = va_arg(ap, char **);
+          SAFE_FREE(*cstrp);
+        }
+        break;
+      case 'P':
+        (void) va_arg(ap, uint32_t);
+        rawp = va_arg(ap, void **);
+        SAFE_FREE(*rawp);
+        break;
+      default:
+        (void) va_arg(ap, void *);
+        break;
+    }
+  }
+  va_end(ap);
+
+  return -1;
+}
+
 /** @} */
 
 /* vim: set ts=4 sw=4 et cindent: */
@@ -25,6 +25,7 @@
 
 #include "libssh/callbacks.h"
 #include "libssh/session.h"
+#include "libssh/socket.h"
 
 int ssh_set_callbacks(ssh_session session, ssh_callbacks cb) {
   if (session == NULL || cb == NULL) {
@@ -42,6 +43,22 @@ int ssh_set_callbacks(ssh_session session, ssh_callbacks cb) {
   return 0;
 }
 
+int ssh_set_server_callbacks(ssh_session session, ssh_server_callbacks cb) {
+  if (session == NULL || cb == NULL) {
+    return SSH_ERROR;
+  }
+  enter_function();
+  if(cb->size <= 0 || cb->size > 1024 * sizeof(void *)){
+  	ssh_set_error(session,SSH_FATAL,
+  			"Invalid server callback passed in (badly initialized)");
+  	leave_function();
+  	return SSH_ERROR;
+  }
+  session->server_callbacks = cb;
+  leave_function();
+  return 0;
+}
+
 int ssh_set_channel_callbacks(ssh_channel channel, ssh_channel_callbacks cb) {
   ssh_session session = NULL;
   if (channel == NULL || cb == NULL) {
@@ -59,3 +76,33 @@ int ssh_set_channel_callbacks(ssh_channel channel, ssh_channel_callbacks cb) {
   leave_function();
   return 0;
 }
+
+int ssh_set_transport_callbacks(ssh_session session, ssh_transport_callbacks cb,
+    socket_t fd) {
+  if (session == NULL || cb == NULL) {
+    return SSH_ERROR;
+  }
+  enter_function();
+  if(cb->size <= 0 || cb->size > 1024 * sizeof(void *)){
+  	ssh_set_error(session,SSH_FATAL,
+  			"Invalid transport callback passed in (badly initialized)");
+  	leave_function();
+  	return SSH_ERROR;
+  }
+  if (!ssh_callbacks_exists(cb, read) || !ssh_callbacks_exists(cb, write)) {
+    ssh_set_error(session, SSH_FATAL,
+        "Transport callbacks need a read and a write function");
+    leave_function();
+    return SSH_ERROR;
+  }
+  if (fd == SSH_INVALID_SOCKET) {
+    ssh_set_error(session, SSH_FATAL, "Transport needs a file descriptor");
+    leave_function();
+    return SSH_ERROR;
+  }
+  ssh_socket_set_transport(session->socket, cb, fd);
+  /* ssh_connect() uses the socket as it is */
+  session->fd = fd;
+  leave_function();
+  return SSH_OK;
+}
@@ -0,0 +1,297 @@
+/*
+ * capture.c - the output of commands kept in blocks of a shared arena
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/buffer.h"
+#include "libssh/capture.h"
+
+/*
+ * The captures never grow a buffer: their data goes to blocks of a fixed
+ * size, which go back to the arena when a tail drops them or when the
+ * capture is cleared, for the next hosts.
+ */
+
+static struct capture_block *capture_block_get(struct capture_arena *arena) {
+  struct capture_block *block = arena->free;
+
+  if (block != NULL) {
+    arena->free = block->next;
+    arena->nfree--;
+  } else {
+    block = malloc(sizeof(struct capture_block));
+    if (block == NULL) {
+      return NULL;
+    }
+  }
+  block->next = NULL;
+  block->len = 0;
+
+  return block;
+}
+
+static void capture_block_put(struct capture_arena *arena,
+    struct capture_block *block) {
+  if (arena->nfree < CAPTURE_ARENA_FREE_MAX) {
+    block->next = arena->free;
+    arena->free = block;
+    arena->nfree++;
+  } else {
+    SAFE_FREE(block);
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Free the blocks kept by an arena. Its captures must be cleared.
+ */
+void capture_arena_free(struct capture_arena *arena) {
+  struct capture_block *block;
+
+  while ((block = arena->free) != NULL) {
+    arena->free = block->next;
+    SAFE_FREE(block);
+  }
+  arena->nfree = 0;
+  ssh_buffer_free(arena->line);
+  arena->line = NULL;
+}
+
+/* appends to the blocks, the data which can't be kept is dropped */
+static void capture_add(struct capture_arena *arena, struct capture *c,
+    const unsigned char *data, size_t len) {
+  struct capture_block *block;
+  size_t n;
+
+  while (len > 0) {
+    block = c->tail;
+    if (block == NULL || block->len == CAPTURE_BLOCK_SIZE) {
+      block = capture_block_get(arena);
+      if (block == NULL) {
+        c->dropped += len;
+        return;
+      }
+      if (c->tail != NULL) {
+        c->tail->next = block;
+      } else {
+        c->head = block;
+      }
+      c->tail = block;
+    }
+    n = CAPTURE_BLOCK_SIZE - block->len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(block->data + block->len, data, n);
+    block->len += n;
+    c->len += n;
+    data += n;
+    len -= n;
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Keep output in a capture.
+ *
+ * @param[in]  limit    The bytes kept, 0 for no limit.
+ *
+ * @param[in]  tail     0 to keep the first bytes up to the limit, 1 to keep
+ *                      the last ones.
+ *
+ * @return SSH_OK, the data which can't be allocated is counted as dropped.
+ */
+int capture_append(struct capture_arena *arena, struct capture *c,
+    const void *data, size_t len, size_t limit, int tail) {
+  const unsigned char *p = data;
+  struct capture_block *block;
+  size_t excess;
+  size_t n;
+
+  if (limit == 0) {
+    capture_add(arena, c, p, len);
+    return SSH_OK;
+  }
+
+  if (!tail) {
+    n = limit - c->len;
+    if (n > len) {
+      n = len;
+    }
+    c->dropped += len - n;
+    capture_add(arena, c, p, n);
+    return SSH_OK;
+  }
+
+  /* what goes beyond the tail at once isn't copied */
+  if (len >= limit) {
+    c->dropped += c->len + len - limit;
+    capture_clear(arena, c);
+    capture_add(arena, c, p + len - limit, limit);
+    return SSH_OK;
+  }
+  capture_add(arena, c, p, len);
+  while (c->len > limit) {
+    block = c->head;
+    n = block->len - c->head_offset;
+    excess = c->len - limit;
+    if (excess >= n && block != c->tail) {
+      c->head = block->next;
+      c->head_offset = 0;
+      capture_block_put(arena, block);
+    } else {
+      n = excess;
+      c->head_offset += n;
+    }
+    c->len -= n;
+    c->dropped += n;
+  }
+
+  return SSH_OK;
+}
+
+/* gives the line kept and cleared, with the end given */
+static int capture_line(struct capture_arena *arena, struct capture *c,
+    const unsigned char *end, size_t len, capture_line_callback cb,
+    void *userdata) {
+  unsigned char *line;
+
+  if (c->len == 0) {
+    cb(end, len, userdata);
+    return SSH_OK;
+  }
+
+  capture_add(arena, c, end, len);
+  if (arena->line == NULL) {
+    arena->line = ssh_buffer_new();
+    if (arena->line == NULL) {
+      return SSH_ERROR;
+    }
+  }
+  buffer_reinit(arena->line);
+  line = buffer_allocate(arena->line, c->len);
+  if (line == NULL) {
+    return SSH_ERROR;
+  }
+  len = capture_copy(c, line);
+  capture_clear(arena, c);
+  cb(line, len, userdata);
+
+  return SSH_OK;
+}
+
+/**
+ * @internal
+ *
+ * @brief Give output line by line.
+ *
+ * The lines are given without their newline. The start of a line is kept in
+ * the capture until its end comes, the lines longer than the limit are cut.
+ * The newlines are found by memchr(), which the C libraries vectorize.
+ *
+ * @param[in]  limit    The longest line, 0 for no limit.
+ *
+ * @return SSH_OK on success, SSH_ERROR if a line can't be made whole.
+ */
+int capture_lines(struct capture_arena *arena, struct capture *c,
+    const void *data, size_t len, size_t limit, capture_line_callback cb,
+    void *userdata) {
+  const unsigned char *p = data;
+  const unsigned char *end = p + len;
+  const unsigned char *nl;
+  size_t n;
+
+  while (p < end) {
+    nl = memchr(p, '\n', end - p);
+    n = (nl != NULL ? nl : end) - p;
+    if (limit > 0 && c->len + n > limit) {
+      n = limit - c->len;
+      nl = NULL;
+    } else if (nl == NULL) {
+      capture_add(arena, c, p, n);
+      break;
+    }
+    if (capture_line(arena, c, p, n, cb, userdata) < 0) {
+      return SSH_ERROR;
+    }
+    p += n + (nl != NULL ? 1 : 0);
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @internal
+ *
+ * @brief Give the last line kept by capture_lines(), without a newline.
+ */
+int capture_lines_flush(struct capture_arena *arena, struct capture *c,
+    capture_line_callback cb, void *userdata) {
+  if (c->len == 0) {
+    return SSH_OK;
+  }
+
+  return capture_line(arena, c, NULL, 0, cb, userdata);
+}
+
+/**
+ * @internal
+ *
+ * @brief Copy the data of a capture, of c->len bytes.
+ *
+ * @return The bytes copied.
+ */
+size_t capture_copy(const struct capture *c, void *dest) {
+  const struct capture_block *block;
+  unsigned char *p = dest;
+  size_t offset = c->head_offset;
+
+  for (block = c->head; block != NULL; block = block->next) {
+    memcpy(p, block->data + offset, block->len - offset);
+    p += block->len - offset;
+    offset = 0;
+  }
+
+  return p - (unsigned char *) dest;
+}
+
+/**
+ * @internal
+ *
+ * @brief Give the blocks of a capture back to the arena and empty it.
+ */
+void capture_clear(struct capture_arena *arena, struct capture *c) {
+  struct capture_block *block;
+
+  while ((block = c->head) != NULL) {
+    c->head = block->next;
+    capture_block_put(arena, block);
+  }
+  c->tail = NULL;
+  c->head_offset = 0;
+  c->len = 0;
+}
+
+/* vim: set ts=2 sw=2 et cindent: */
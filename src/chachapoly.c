@@ -0,0 +1,383 @@
+/*
+ * chachapoly.c - the chacha20-poly1305@openssh.com cipher
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * ChaCha20 and Poly1305 follow the public domain reference implementations
+ * of D. J. Bernstein and Andrew Moon. The construction is the one described
+ * in PROTOCOL.chacha20poly1305 of OpenSSH: the 512 bits key is split in a
+ * main key K_2 (first half) and a header key K_1 (second half). K_1 only
+ * encrypts the packet length, K_2 the rest of the packet and gives the
+ * Poly1305 key. The nonce is the packet sequence number.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/crypto.h"
+#include "libssh/chachapoly.h"
+
+struct chachapoly_ctx {
+  struct chacha_ctx main_ctx;
+  struct chacha_ctx header_ctx;
+};
+
+#define U8TO32_LE(p) \
+  (((uint32_t)((p)[0])) | ((uint32_t)((p)[1]) << 8) | \
+   ((uint32_t)((p)[2]) << 16) | ((uint32_t)((p)[3]) << 24))
+
+#define U32TO8_LE(p, v) \
+  do { \
+    (p)[0] = (uint8_t)(v); \
+    (p)[1] = (uint8_t)((v) >> 8); \
+    (p)[2] = (uint8_t)((v) >> 16); \
+    (p)[3] = (uint8_t)((v) >> 24); \
+  } while (0)
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+  a += b; d ^= a; d = ROTL32(d, 16); \
+  c += d; b ^= c; b = ROTL32(b, 12); \
+  a += b; d ^= a; d = ROTL32(d, 8); \
+  c += d; b ^= c; b = ROTL32(b, 7);
+
+static const uint8_t sigma[16] = "expand 32-byte k";
+
+void chacha_keysetup(struct chacha_ctx *ctx, const uint8_t *key) {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    ctx->input[i] = U8TO32_LE(sigma + 4 * i);
+  }
+  for (i = 0; i < 8; i++) {
+    ctx->input[4 + i] = U8TO32_LE(key + 4 * i);
+  }
+}
+
+/* iv is 64 bits, counter is a 64 bits little endian block counter or NULL */
+void chacha_ivsetup(struct chacha_ctx *ctx, const uint8_t *iv,
+    const uint8_t *counter) {
+  ctx->input[12] = counter == NULL ? 0 : U8TO32_LE(counter + 0);
+  ctx->input[13] = counter == NULL ? 0 : U8TO32_LE(counter + 4);
+  ctx->input[14] = U8TO32_LE(iv + 0);
+  ctx->input[15] = U8TO32_LE(iv + 4);
+}
+
+static void chacha_block(const uint32_t input[16],
+    uint8_t output[CHACHA20_BLOCKSIZE]) {
+  uint32_t x[16];
+  int i;
+
+  memcpy(x, input, sizeof(x));
+  for (i = 0; i < 10; i++) {
+    QUARTERROUND(x[0], x[4], x[8], x[12])
+    QUARTERROUND(x[1], x[5], x[9], x[13])
+    QUARTERROUND(x[2], x[6], x[10], x[14])
+    QUARTERROUND(x[3], x[7], x[11], x[15])
+    QUARTERROUND(x[0], x[5], x[10], x[15])
+    QUARTERROUND(x[1], x[6], x[11], x[12])
+    QUARTERROUND(x[2], x[7], x[8], x[13])
+    QUARTERROUND(x[3], x[4], x[9], x[14])
+  }
+  for (i = 0; i < 16; i++) {
+    x[i] += input[i];
+    U32TO8_LE(output + 4 * i, x[i]);
+  }
+}
+
+/* m and c may point to the same buffer */
+void chacha_encrypt_bytes(struct chacha_ctx *ctx, const uint8_t *m,
+    uint8_t *c, uint32_t bytes) {
+  uint8_t block[CHACHA20_BLOCKSIZE];
+  uint32_t n;
+  uint32_t i;
+
+  while (bytes > 0) {
+    chacha_block(ctx->input, block);
+    ctx->input[12]++;
+    if (ctx->input[12] == 0) {
+      ctx->input[13]++;
+    }
+
+    n = bytes < CHACHA20_BLOCKSIZE ? bytes : CHACHA20_BLOCKSIZE;
+    for (i = 0; i < n; i++) {
+      c[i] = m[i] ^ block[i];
+    }
+    bytes -= n;
+    m += n;
+    c += n;
+  }
+
+  memset(block, 0, sizeof(block));
+}
+
+/*
+ * Poly1305 with 26 bits limbs. The accumulator h is kept partially reduced
+ * modulo 2^130 - 5 between the blocks and fully reduced at the end.
+ */
+void poly1305_auth(uint8_t out[POLY1305_TAGLEN], const uint8_t *m,
+    size_t inlen, const uint8_t key[POLY1305_KEYLEN]) {
+  uint32_t r0, r1, r2, r3, r4;
+  uint32_t s1, s2, s3, s4;
+  uint32_t h0 = 0, h1 = 0, h2 = 0, h3 = 0, h4 = 0;
+  uint32_t g0, g1, g2, g3, g4;
+  uint32_t t0, t1, t2, t3;
+  uint32_t hibit, b, nb;
+  uint64_t d0, d1, d2, d3, d4;
+  uint64_t f;
+  uint8_t mp[16];
+  size_t i;
+
+  /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+  t0 = U8TO32_LE(key + 0);
+  t1 = U8TO32_LE(key + 4);
+  t2 = U8TO32_LE(key + 8);
+  t3 = U8TO32_LE(key + 12);
+  r0 = t0 & 0x3ffffff;
+  r1 = ((t0 >> 26) | (t1 << 6)) & 0x3ffff03;
+  r2 = ((t1 >> 20) | (t2 << 12)) & 0x3ffc0ff;
+  r3 = ((t2 >> 14) | (t3 << 18)) & 0x3f03fff;
+  r4 = (t3 >> 8) & 0x00fffff;
+
+  s1 = r1 * 5;
+  s2 = r2 * 5;
+  s3 = r3 * 5;
+  s4 = r4 * 5;
+
+  while (inlen > 0) {
+    if (inlen >= 16) {
+      memcpy(mp, m, 16);
+      hibit = 1 << 24;
+      m += 16;
+      inlen -= 16;
+    } else {
+      /* the last partial block is padded with a 1 byte and zeroes */
+      memset(mp, 0, sizeof(mp));
+      memcpy(mp, m, inlen);
+      mp[inlen] = 1;
+      hibit = 0;
+      inlen = 0;
+    }
+
+    /* h += m */
+    t0 = U8TO32_LE(mp + 0);
+    t1 = U8TO32_LE(mp + 4);
+    t2 = U8TO32_LE(mp + 8);
+    t3 = U8TO32_LE(mp + 12);
+    h0 += t0 & 0x3ffffff;
+    h1 += ((t0 >> 26) | (t1 << 6)) & 0x3ffffff;
+    h2 += ((t1 >> 20) | (t2 << 12)) & 0x3ffffff;
+    h3 += ((t2 >> 14) | (t3 << 18)) & 0x3ffffff;
+    h4 += (t3 >> 8) | hibit;
+
+    /* h *= r */
+    d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 +
+         (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+    d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 +
+         (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+    d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 +
+         (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+    d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 +
+         (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+    d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 +
+         (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+    /* partial reduction */
+    h0 = (uint32_t)d0 & 0x3ffffff;
+    d1 += d0 >> 26;
+    h1 = (uint32_t)d1 & 0x3ffffff;
+    d2 += d1 >> 26;
+    h2 = (uint32_t)d2 & 0x3ffffff;
+    d3 += d2 >> 26;
+    h3 = (uint32_t)d3 & 0x3ffffff;
+    d4 += d3 >> 26;
+    h4 = (uint32_t)d4 & 0x3ffffff;
+    h0 += (uint32_t)(d4 >> 26) * 5;
+    h1 += h0 >> 26;
+    h0 &= 0x3ffffff;
+  }
+
+  /* full carry */
+  b = h1 >> 26; h1 &= 0x3ffffff;
+  h2 += b; b = h2 >> 26; h2 &= 0x3ffffff;
+  h3 += b; b = h3 >> 26; h3 &= 0x3ffffff;
+  h4 += b; b = h4 >> 26; h4 &= 0x3ffffff;
+  h0 += b * 5; b = h0 >> 26; h0 &= 0x3ffffff;
+  h1 += b;
+
+  /* g = h - p = h + 5 - 2^130, selected if h >= p */
+  g0 = h0 + 5; b = g0 >> 26; g0 &= 0x3ffffff;
+  g1 = h1 + b; b = g1 >> 26; g1 &= 0x3ffffff;
+  g2 = h2 + b; b = g2 >> 26; g2 &= 0x3ffffff;
+  g3 = h3 + b; b = g3 >> 26; g3 &= 0x3ffffff;
+  g4 = h4 + b - (1 << 26);
+
+  b = (g4 >> 31) - 1;
+  nb = ~b;
+  h0 = (h0 & nb) | (g0 & b);
+  h1 = (h1 & nb) | (g1 & b);
+  h2 = (h2 & nb) | (g2 & b);
+  h3 = (h3 & nb) | (g3 & b);
+  h4 = (h4 & nb) | (g4 & b);
+
+  /* out = (h + s) mod 2^128 */
+  f = (uint64_t)(h0 | (h1 << 26)) + U8TO32_LE(key + 16);
+  U32TO8_LE(out + 0, (uint32_t)f);
+  f = (uint64_t)((h1 >> 6) | (h2 << 20)) + U8TO32_LE(key + 20) + (f >> 32);
+  U32TO8_LE(out + 4, (uint32_t)f);
+  f = (uint64_t)((h2 >> 12) | (h3 << 14)) + U8TO32_LE(key + 24) + (f >> 32);
+  U32TO8_LE(out + 8, (uint32_t)f);
+  f = (uint64_t)((h3 >> 18) | (h4 << 8)) + U8TO32_LE(key + 28) + (f >> 32);
+  U32TO8_LE(out + 12, (uint32_t)f);
+
+  for (i = 0; i < sizeof(mp); i++) {
+    mp[i] = 0;
+  }
+}
+
+/* the nonce is the 64 bits big endian sequence number */
+static void chachapoly_nonce(uint8_t nonce[8], uint32_t seq) {
+  memset(nonce, 0, 4);
+  nonce[4] = (uint8_t)(seq >> 24);
+  nonce[5] = (uint8_t)(seq >> 16);
+  nonce[6] = (uint8_t)(seq >> 8);
+  nonce[7] = (uint8_t)seq;
+}
+
+/* the Poly1305 key is the first block of the main key stream */
+static void chachapoly_poly_key(struct chachapoly_ctx *ctx,
+    const uint8_t nonce[8], uint8_t poly_key[POLY1305_KEYLEN]) {
+  memset(poly_key, 0, POLY1305_KEYLEN);
+  chacha_ivsetup(&ctx->main_ctx, nonce, NULL);
+  chacha_encrypt_bytes(&ctx->main_ctx, poly_key, poly_key, POLY1305_KEYLEN);
+}
+
+int chachapoly_set_key(struct crypto_struct *cipher, void *key, void *IV) {
+  struct chachapoly_ctx *ctx;
+
+  (void) IV;
+
+  if (cipher->key == NULL) {
+    ctx = malloc(sizeof(struct chachapoly_ctx));
+    if (ctx == NULL) {
+      return -1;
+    }
+    chacha_keysetup(&ctx->main_ctx, key);
+    chacha_keysetup(&ctx->header_ctx, (uint8_t *) key + CHACHA20_KEYLEN);
+    cipher->key = (void *) ctx;
+  }
+
+  return 0;
+}
+
+void chachapoly_encrypt(struct crypto_struct *cipher, void *in, void *out,
+    unsigned long len, unsigned char *tag, uint32_t seq) {
+  struct chachapoly_ctx *ctx = (struct chachapoly_ctx *) (void *) cipher->key;
+  uint8_t one[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+  uint8_t poly_key[POLY1305_KEYLEN];
+  uint8_t nonce[8];
+
+  chachapoly_nonce(nonce, seq);
+  chachapoly_poly_key(ctx, nonce, poly_key);
+
+  chacha_ivsetup(&ctx->header_ctx, nonce, NULL);
+  chacha_encrypt_bytes(&ctx->header_ctx, in, out, sizeof(uint32_t));
+
+  chacha_ivsetup(&ctx->main_ctx, nonce, one);
+  chacha_encrypt_bytes(&ctx->main_ctx, (uint8_t *) in + sizeof(uint32_t),
+      (uint8_t *) out + sizeof(uint32_t), len - sizeof(uint32_t));
+
+  poly1305_auth(tag, out, len, poly_key);
+  memset(poly_key, 0, sizeof(poly_key));
+}
+
+int chachapoly_decrypt_length(struct crypto_struct *cipher, void *in,
+    unsigned char *out, unsigned long len, uint32_t seq) {
+  struct chachapoly_ctx *ctx = (struct chachapoly_ctx *) (void *) cipher->key;
+  uint8_t nonce[8];
+
+  if (len < sizeof(uint32_t)) {
+    return -1;
+  }
+
+  chachapoly_nonce(nonce, seq);
+  chacha_ivsetup(&ctx->header_ctx, nonce, NULL);
+  chacha_encrypt_bytes(&ctx->header_ctx, in, out, sizeof(uint32_t));
+
+  return 0;
+}
+
+int chachapoly_decrypt(struct crypto_struct *cipher, void *complete_packet,
+    unsigned char *out, unsigned long len, const unsigned char *tag,
+    uint32_t seq) {
+  struct chachapoly_ctx *ctx = (struct chachapoly_ctx *) (void *) cipher->key;
+  uint8_t one[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+  uint8_t poly_key[POLY1305_KEYLEN];
+  uint8_t computed[POLY1305_TAGLEN];
+  uint8_t nonce[8];
+  uint8_t diff = 0;
+  int i;
+
+  chachapoly_nonce(nonce, seq);
+  chachapoly_poly_key(ctx, nonce, poly_key);
+  poly1305_auth(computed, complete_packet, len + sizeof(uint32_t), poly_key);
+  memset(poly_key, 0, sizeof(poly_key));
+
+  /* constant time comparison, the packet isn't decrypted if it fails */
+  for (i = 0; i < POLY1305_TAGLEN; i++) {
+    diff |= computed[i] ^ tag[i];
+  }
+  if (diff != 0) {
+    return -1;
+  }
+
+  chacha_ivsetup(&ctx->main_ctx, nonce, one);
+  chacha_encrypt_bytes(&ctx->main_ctx,
+      (uint8_t *) complete_packet + sizeof(uint32_t), out, len);
+
+  return 0;
+}
+
+void chachapoly_cleanup(struct crypto_struct *cipher) {
+  if (cipher->key != NULL) {
+    memset(cipher->key, 0, sizeof(struct chachapoly_ctx));
+    SAFE_FREE(cipher->key);
+  }
+}
+
+/* the key stream only depends on the sequence number */
+int chachapoly_copy(struct crypto_struct *cipher, struct crypto_struct *copy) {
+  if (cipher->key == NULL) {
+    return -1;
+  }
+  copy->key = malloc(sizeof(struct chachapoly_ctx));
+  if (copy->key == NULL) {
+    return -1;
+  }
+  memcpy(copy->key, cipher->key, sizeof(struct chachapoly_ctx));
+
+  return 0;
+}
+
+/* vim: set ts=2 sw=2 et cindent: */
@@ -0,0 +1,709 @@
+/*
+ * channelfd.c - forwarding of channels to file descriptors
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#define SHUT_WR SD_SEND
+#else
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "libssh/priv.h"
+#include "libssh/buffer.h"
+#include "libssh/callbacks.h"
+#include "libssh/channels.h"
+#include "libssh/poll.h"
+#include "libssh/session.h"
+
+/* largest read from the input descriptor */
+#define CHANNEL_FD_READ_MAX 32768
+
+struct ssh_channel_fd_struct {
+  ssh_channel channel;
+  socket_t fd_in;
+  socket_t fd_out;
+  ssh_poll_handle poll_in;
+  ssh_poll_handle poll_out; /* poll_in when it's the same descriptor */
+  /* channel data fd_out didn't take yet, its window isn't given back */
+  ssh_buffer pending;
+  struct ssh_channel_callbacks_struct callbacks;
+  int in_eof; /* fd_in is at its end, the eof was sent */
+  int out_eof; /* the peer sent its eof */
+  channel_fd_done_callback done;
+  void *done_userdata;
+};
+
+/**
+ * @addtogroup libssh_channel
+ *
+ * @{
+ */
+
+static int channel_fd_write(socket_t fd, const void *data, uint32_t len) {
+  int w;
+
+#ifdef _WIN32
+  w = send(fd, data, len, 0);
+  if (w < 0 && WSAGetLastError() == WSAEWOULDBLOCK) {
+    return 0;
+  }
+#else
+  w = write(fd, data, len);
+  if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  }
+#endif
+
+  return w;
+}
+
+static int channel_fd_read(socket_t fd, void *data, uint32_t len) {
+  int r;
+
+#ifdef _WIN32
+  r = recv(fd, data, len, 0);
+  if (r < 0 && WSAGetLastError() == WSAEWOULDBLOCK) {
+    return SSH_AGAIN;
+  }
+#else
+  r = read(fd, data, len);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return SSH_AGAIN;
+  }
+#endif
+
+  return r;
+}
+
+/*
+ * Closes the channel once both directions are done. Returns 1 if the
+ * forwarding was freed.
+ */
+static int channel_fd_check_done(struct ssh_channel_fd_struct *b) {
+  ssh_channel channel = b->channel;
+
+  if (!b->in_eof || !b->out_eof || buffer_get_rest_len(b->pending) > 0) {
+    return 0;
+  }
+
+  ssh_channel_unbind_fd(channel);
+  if (channel->state == SSH_CHANNEL_STATE_OPEN) {
+    ssh_channel_close(channel);
+  }
+
+  return 1;
+}
+
+/* the peer's eof goes to fd_out once its data is written */
+static void channel_fd_shutdown(struct ssh_channel_fd_struct *b) {
+  shutdown(b->fd_out, SHUT_WR);
+}
+
+static int channel_fd_data(ssh_session session, ssh_channel channel,
+    void *data, uint32_t len, int is_stderr, void *userdata) {
+  struct ssh_channel_fd_struct *b = userdata;
+  int w = 0;
+
+  (void) channel;
+  (void) is_stderr;
+
+  if (buffer_get_rest_len(b->pending) == 0) {
+    w = channel_fd_write(b->fd_out, data, len);
+    if (w < 0) {
+      SSH_LOG(session, SSH_LOG_RARE,
+          "Forwarding channel %d:%d: write error: %s",
+          b->channel->local_channel, b->channel->remote_channel,
+          strerror(errno));
+      ssh_channel_close(b->channel);
+      return len;
+    }
+  }
+  if ((uint32_t) w < len) {
+    if (buffer_add_data(b->pending, (uint8_t *) data + w, len - w) < 0) {
+      ssh_set_error_oom(session);
+      return len;
+    }
+    ssh_poll_add_events(b->poll_out, POLLOUT);
+  }
+
+  return w;
+}
+
+static void channel_fd_eof(ssh_session session, ssh_channel channel,
+    void *userdata) {
+  struct ssh_channel_fd_struct *b = userdata;
+
+  (void) session;
+  (void) channel;
+
+  b->out_eof = 1;
+  if (buffer_get_rest_len(b->pending) == 0) {
+    channel_fd_shutdown(b);
+    channel_fd_check_done(b);
+  }
+}
+
+static void channel_fd_close(ssh_session session, ssh_channel channel,
+    void *userdata) {
+  (void) session;
+  (void) userdata;
+
+  ssh_channel_unbind_fd(channel);
+}
+
+/* writes the pending data, returns 1 if the forwarding was freed */
+static int channel_fd_flush(struct ssh_channel_fd_struct *b) {
+  ssh_session session = b->channel->session;
+  int w;
+
+  w = channel_fd_write(b->fd_out, buffer_get_rest(b->pending),
+      buffer_get_rest_len(b->pending));
+  if (w < 0) {
+    SSH_LOG(session, SSH_LOG_RARE,
+        "Forwarding channel %d:%d: write error: %s",
+        b->channel->local_channel, b->channel->remote_channel,
+        strerror(errno));
+    buffer_reinit(b->pending);
+    ssh_channel_close(b->channel);
+    return 0;
+  }
+  buffer_pass_bytes(b->pending, w);
+  /* the peer can send more as fd_out takes it */
+  ssh_channel_consume(b->channel, w);
+
+  if (buffer_get_rest_len(b->pending) == 0) {
+    ssh_poll_remove_events(b->poll_out, POLLOUT);
+    if (b->out_eof) {
+      channel_fd_shutdown(b);
+      return channel_fd_check_done(b);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Reads fd_in within the window of the peer. Returns 1 if the forwarding was
+ * freed or poll_in left its context.
+ */
+static int channel_fd_forward(struct ssh_channel_fd_struct *b) {
+  ssh_channel channel = b->channel;
+  char data[CHANNEL_FD_READ_MAX];
+  uint32_t len;
+  int r;
+
+  len = channel_write_window(channel);
+  if (len == 0) {
+    /* wait for a window adjust, see ssh_channel_fd_window() */
+    ssh_poll_remove_events(b->poll_in, POLLIN);
+    return 0;
+  }
+  if (len > sizeof(data)) {
+    len = sizeof(data);
+  }
+
+  r = channel_fd_read(b->fd_in, data, len);
+  if (r == SSH_AGAIN) {
+    return 0;
+  }
+  if (r > 0) {
+    if (ssh_channel_write(channel, data, r) == SSH_ERROR) {
+      ssh_channel_unbind_fd(channel);
+      return 1;
+    }
+    if (channel_write_window(channel) == 0) {
+      ssh_poll_remove_events(b->poll_in, POLLIN);
+    }
+    return 0;
+  }
+
+  /* end of file or error: half-close the channel */
+  ssh_poll_remove_events(b->poll_in, POLLIN);
+  b->in_eof = 1;
+  if (channel->state == SSH_CHANNEL_STATE_OPEN && !channel->local_eof) {
+    ssh_channel_send_eof(channel);
+  }
+  if (channel_fd_check_done(b)) {
+    return 1;
+  }
+  if (b->poll_in != b->poll_out) {
+    /* a hung up descriptor would be caught by every poll */
+    ssh_poll_ctx_remove(ssh_poll_get_ctx(b->poll_in), b->poll_in);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int channel_fd_poll(ssh_poll_handle p, socket_t fd, int revents,
+    void *userdata) {
+  struct ssh_channel_fd_struct *b = userdata;
+
+  (void) fd;
+
+  if (p == b->poll_out && (revents & (POLLOUT | POLLERR | POLLHUP)) &&
+      buffer_get_rest_len(b->pending) > 0) {
+    if (channel_fd_flush(b)) {
+      return -1;
+    }
+  }
+  if (p == b->poll_in && !b->in_eof &&
+      (revents & (POLLIN | POLLERR | POLLHUP))) {
+    if (channel_fd_forward(b)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Resumes the reading of a forwarded descriptor when the peer grows
+ * its window.
+ */
+void ssh_channel_fd_window(ssh_channel channel) {
+  struct ssh_channel_fd_struct *b = channel->fd_bind;
+
+  if (b != NULL && !b->in_eof && channel_write_window(channel) > 0) {
+    ssh_poll_add_events(b->poll_in, POLLIN);
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Sets the function called once the forwarding of a channel stopped,
+ * from ssh_channel_unbind_fd(). The channel isn't freed yet.
+ */
+void ssh_channel_fd_set_done(ssh_channel channel, channel_fd_done_callback done,
+    void *userdata) {
+  struct ssh_channel_fd_struct *b = channel->fd_bind;
+
+  if (b != NULL) {
+    b->done = done;
+    b->done_userdata = userdata;
+  }
+}
+
+/**
+ * @brief Forward a channel to file descriptors.
+ *
+ * The data of the channel is written to fd_out and what is read from fd_in
+ * is sent on the channel, by the poll context of the session: from
+ * ssh_event_dopoll() when the session is in an event, else from any call
+ * which waits for the session. The descriptors are put in nonblocking mode.
+ *
+ * The reading of fd_in follows the window of the peer. The window of the
+ * channel is only given back once fd_out took the data, without an
+ * intermediate copy while it keeps up. The end of file of fd_in is sent as
+ * the eof of the channel, the eof of the peer shuts fd_out down for writing
+ * once its data is written. The channel is closed when both are done.
+ *
+ * The forwarding uses the callbacks of the channel, they must not be set
+ * meanwhile. It stops when the channel is closed or freed.
+ *
+ * @param[in]  channel  An open channel.
+ *
+ * @param[in]  fd_in    The descriptor read to the channel.
+ *
+ * @param[in]  fd_out   The descriptor written from the channel, it can be the
+ *                      same socket as fd_in.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_channel_unbind_fd()
+ */
+int ssh_channel_bind_fd(ssh_channel channel, socket_t fd_in, socket_t fd_out) {
+  struct ssh_channel_fd_struct *b;
+  ssh_session session;
+  ssh_poll_ctx ctx;
+
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  session = channel->session;
+  if (fd_in == SSH_INVALID_SOCKET || fd_out == SSH_INVALID_SOCKET ||
+      channel->fd_bind != NULL) {
+    ssh_set_error_invalid(session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+  if (channel->state != SSH_CHANNEL_STATE_OPEN) {
+    ssh_set_error(session, SSH_REQUEST_DENIED, "Channel is not open");
+    return SSH_ERROR;
+  }
+  ctx = ssh_session_get_poll_ctx(session);
+  if (ctx == NULL) {
+    return SSH_ERROR;
+  }
+
+  b = malloc(sizeof(struct ssh_channel_fd_struct));
+  if (b == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  ZERO_STRUCTP(b);
+  b->channel = channel;
+  b->fd_in = fd_in;
+  b->fd_out = fd_out;
+
+  b->pending = ssh_buffer_new();
+  b->poll_in = ssh_poll_new(fd_in, POLLIN, channel_fd_poll, b);
+  if (fd_out == fd_in) {
+    b->poll_out = b->poll_in;
+  } else {
+    b->poll_out = ssh_poll_new(fd_out, 0, channel_fd_poll, b);
+  }
+  if (b->pending == NULL || b->poll_in == NULL || b->poll_out == NULL) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+  if (ssh_poll_ctx_add(ctx, b->poll_in) < 0 ||
+      (b->poll_out != b->poll_in && ssh_poll_ctx_add(ctx, b->poll_out) < 0)) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+  /* the descriptors follow the session out of an event */
+  ssh_poll_set_owner(b->poll_in, &session->polls);
+  if (b->poll_out != b->poll_in) {
+    ssh_poll_set_owner(b->poll_out, &session->polls);
+  }
+  ssh_sock_set_nonblocking(fd_in);
+  if (fd_out != fd_in) {
+    ssh_sock_set_nonblocking(fd_out);
+  }
+
+  b->callbacks.userdata = b;
+  b->callbacks.channel_data_function = channel_fd_data;
+  b->callbacks.channel_eof_function = channel_fd_eof;
+  b->callbacks.channel_close_function = channel_fd_close;
+  ssh_callbacks_init(&b->callbacks);
+  channel->callbacks = &b->callbacks;
+  channel->unbuffered = 1;
+  channel->fd_bind = b;
+
+  /* what was buffered before goes first */
+  if (channel->stdout_buffer != NULL &&
+      buffer_get_rest_len(channel->stdout_buffer) > 0) {
+    if (buffer_add_data(b->pending, buffer_get_rest(channel->stdout_buffer),
+          buffer_get_rest_len(channel->stdout_buffer)) < 0) {
+      ssh_set_error_oom(session);
+      ssh_channel_unbind_fd(channel);
+      return SSH_ERROR;
+    }
+    channel->window_held += buffer_get_rest_len(channel->stdout_buffer);
+    session->channels_buffered -= buffer_get_rest_len(channel->stdout_buffer);
+    buffer_reinit(channel->stdout_buffer);
+    buffer_release(channel->stdout_buffer);
+    ssh_poll_add_events(b->poll_out, POLLOUT);
+  }
+  if (channel->remote_eof) {
+    channel_fd_eof(session, channel, b);
+  }
+
+  return SSH_OK;
+error:
+  if (b->poll_out != NULL && b->poll_out != b->poll_in) {
+    ssh_poll_free(b->poll_out);
+  }
+  if (b->poll_in != NULL) {
+    ssh_poll_free(b->poll_in);
+  }
+  ssh_buffer_free(b->pending);
+  SAFE_FREE(b);
+
+  return SSH_ERROR;
+}
+
+/**
+ * @brief Stop forwarding a channel to file descriptors.
+ *
+ * The descriptors are left open. The data not written to fd_out yet is
+ * dropped and its window given back.
+ *
+ * @param[in]  channel  The forwarded channel.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the channel isn't
+ *                      forwarded.
+ *
+ * @see ssh_channel_bind_fd()
+ */
+int ssh_channel_unbind_fd(ssh_channel channel) {
+  struct ssh_channel_fd_struct *b;
+  channel_fd_done_callback done;
+  void *done_userdata;
+
+  if (channel == NULL || channel->fd_bind == NULL) {
+    return SSH_ERROR;
+  }
+  b = channel->fd_bind;
+
+  channel->fd_bind = NULL;
+  if (channel->callbacks == &b->callbacks) {
+    channel->callbacks = NULL;
+  }
+  channel->unbuffered = 0;
+  if (channel->state == SSH_CHANNEL_STATE_OPEN) {
+    ssh_channel_consume(channel, channel->window_held);
+  }
+  channel->window_held = 0;
+
+  if (b->poll_out != b->poll_in) {
+    ssh_poll_free(b->poll_out);
+  }
+  ssh_poll_free(b->poll_in);
+  ssh_buffer_free(b->pending);
+  done = b->done;
+  done_userdata = b->done_userdata;
+  SAFE_FREE(b);
+
+  if (done != NULL) {
+    done(channel, done_userdata);
+  }
+
+  return SSH_OK;
+}
+
+/** @} */
+
+static void channel_fd_close_socket(socket_t fd) {
+#ifdef _WIN32
+  closesocket(fd);
+#else
+  close(fd);
+#endif
+}
+
+static void channel_fd_conn_free(struct channel_fd_conn *conn) {
+  conn->done = 1;
+  channel_fd_conn_stop_poll(conn);
+  ssh_channel_free(conn->channel);
+  conn->channel = NULL;
+  if (conn->fd != SSH_INVALID_SOCKET) {
+    channel_fd_close_socket(conn->fd);
+  }
+  conn->conns->conn_free(conn);
+}
+
+static void channel_fd_conns_reap(ssh_timer timer, void *userdata) {
+  struct channel_fd_conns *conns = userdata;
+  struct channel_fd_conn *conn;
+
+  (void) timer;
+
+  while (conns->done != NULL) {
+    conn = conns->done;
+    conns->done = conn->next;
+    channel_fd_conn_free(conn);
+  }
+}
+
+/** @internal
+ * @brief Sets up the list of the connections of a forwarding
+ * @returns SSH_OK, or SSH_ERROR on memory error
+ */
+int channel_fd_conns_init(struct channel_fd_conns *conns, ssh_session session) {
+  conns->session = session;
+  conns->conns = NULL;
+  conns->done = NULL;
+  conns->count = 0;
+  conns->reaper = ssh_session_add_timer(session, 0, channel_fd_conns_reap,
+      conns);
+  if (conns->reaper == NULL) {
+    return SSH_ERROR;
+  }
+  ssh_timer_cancel(conns->reaper);
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief Frees the connections of a forwarding and their channels
+ */
+void channel_fd_conns_free(struct channel_fd_conns *conns) {
+  struct channel_fd_conn *conn;
+
+  while ((conn = conns->conns) != NULL) {
+    conns->conns = conn->next;
+    channel_fd_conn_free(conn);
+  }
+  channel_fd_conns_reap(conns->reaper, conns);
+  ssh_timer_free(conns->reaper);
+  conns->reaper = NULL;
+}
+
+/** @internal
+ * @brief Adds a connection to a forwarding, with its socket or
+ * SSH_INVALID_SOCKET
+ */
+void channel_fd_conn_add(struct channel_fd_conns *conns,
+    struct channel_fd_conn *conn, socket_t fd) {
+  conn->conns = conns;
+  conn->fd = fd;
+  conn->prev = NULL;
+  conn->next = conns->conns;
+  if (conn->next != NULL) {
+    conn->next->prev = conn;
+  }
+  conns->conns = conn;
+  conns->count++;
+}
+
+/** @internal
+ * @brief Polls the socket of a connection before its forwarding, in the
+ * poll context of the session
+ * @returns SSH_OK, or SSH_ERROR on error
+ */
+int channel_fd_conn_poll(struct channel_fd_conn *conn, short events,
+    ssh_poll_callback cb) {
+  ssh_session session = conn->conns->session;
+  ssh_poll_ctx ctx;
+
+  ctx = ssh_session_get_poll_ctx(session);
+  conn->poll = ssh_poll_new(conn->fd, events, cb, conn);
+  if (ctx == NULL || conn->poll == NULL ||
+      ssh_poll_ctx_add(ctx, conn->poll) < 0) {
+    channel_fd_conn_stop_poll(conn);
+    return SSH_ERROR;
+  }
+  ssh_poll_set_owner(conn->poll, &session->polls);
+
+  return SSH_OK;
+}
+
+void channel_fd_conn_stop_poll(struct channel_fd_conn *conn) {
+  if (conn->poll != NULL) {
+    ssh_poll_free(conn->poll);
+    conn->poll = NULL;
+  }
+}
+
+/* the connection is freed by the reaper, out of the callbacks */
+static void channel_fd_conn_done(struct channel_fd_conn *conn) {
+  struct channel_fd_conns *conns = conn->conns;
+
+  if (conns->conn_done != NULL) {
+    conns->conn_done(conn);
+  }
+  conn->done = 1;
+
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    conns->conns = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  }
+  conn->prev = NULL;
+  conn->next = conns->done;
+  conns->done = conn;
+  ssh_timer_reset(conns->reaper, 0);
+}
+
+static void channel_fd_conn_channel_close(ssh_session session,
+    ssh_channel channel, void *userdata) {
+  struct channel_fd_conn *conn = userdata;
+
+  (void) session;
+  (void) channel;
+
+  if (conn->closing && !conn->done) {
+    channel_fd_conn_done(conn);
+  }
+}
+
+/** @internal
+ * @brief Gives its channel to a connection. The callbacks of the
+ * connection, which can be completed, are set on it.
+ */
+void channel_fd_conn_set_channel(struct channel_fd_conn *conn,
+    ssh_channel channel) {
+  conn->channel = channel;
+  conn->callbacks.userdata = conn;
+  conn->callbacks.channel_close_function = channel_fd_conn_channel_close;
+  ssh_callbacks_init(&conn->callbacks);
+  ssh_set_channel_callbacks(channel, &conn->callbacks);
+}
+
+static void channel_fd_conn_unbound(ssh_channel channel, void *userdata) {
+  (void) channel;
+
+  channel_fd_conn_close(userdata);
+}
+
+/** @internal
+ * @brief Forwards the open channel of a connection to its socket, until
+ * one of them closes
+ * @returns SSH_OK, or SSH_ERROR if the connection was closed
+ */
+int channel_fd_conn_forward(struct channel_fd_conn *conn) {
+  channel_fd_conn_stop_poll(conn);
+  if (ssh_channel_bind_fd(conn->channel, conn->fd, conn->fd) != SSH_OK) {
+    channel_fd_conn_close(conn);
+    return SSH_ERROR;
+  }
+  ssh_channel_fd_set_done(conn->channel, channel_fd_conn_unbound, conn);
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief Closes the socket of a connection. It is freed once its channel is
+ * closed by the peer too, if it has one.
+ */
+void channel_fd_conn_close(struct channel_fd_conn *conn) {
+  ssh_channel channel = conn->channel;
+
+  if (conn->closing || conn->done) {
+    return;
+  }
+  channel_fd_conn_stop_poll(conn);
+  if (conn->fd != SSH_INVALID_SOCKET) {
+    channel_fd_close_socket(conn->fd);
+    conn->fd = SSH_INVALID_SOCKET;
+  }
+  conn->conns->count--;
+  conn->closing = 1;
+
+  if (channel != NULL && !channel->remote_close &&
+      channel->state != SSH_CHANNEL_STATE_OPEN_DENIED &&
+      channel->state != SSH_CHANNEL_STATE_NOT_OPEN) {
+    /* the forwarding dropped its callbacks */
+    channel->callbacks = &conn->callbacks;
+    if (channel->state == SSH_CHANNEL_STATE_OPEN) {
+      ssh_channel_close(channel);
+    }
+    return;
+  }
+
+  channel_fd_conn_done(conn);
+}
+
+/* vim: set ts=2 sw=2 et cindent: */
@@ -41,12 +41,14 @@
 #include "libssh/session.h"
 #include "libssh/misc.h"
 #include "libssh/messages.h"
+#include "libssh/timer.h"
+#include "libssh/hashtable.h"
+#include "libssh/probes.h"
+#include "libssh/pipeline.h"
 #if WITH_SERVER
 #include "libssh/server.h"
 #endif
 
-#define WINDOWBASE 128000
-#define WINDOWLIMIT (WINDOWBASE/2)
 
 /**
  * @defgroup libssh_channel The SSH channel functions
@@ -57,7 +59,22 @@
  * @{
  */
 
+/* the share of a turn of the scheduler, weighted by the priorities */
+#define SSH_CHANNEL_SCHED_QUANTUM 8192
+/* data the scheduler lets wait in the socket */
+#define SSH_CHANNEL_SCHED_BACKLOG 65536
+/* queue of a channel over which a blocking write waits */
+#define SSH_CHANNEL_QUEUE_MAX 262144
+
+static const int channel_sched_weight[] = {
+  4, /* SSH_CHANNEL_PRIORITY_DEFAULT */
+  16, /* SSH_CHANNEL_PRIORITY_INTERACTIVE */
+  1 /* SSH_CHANNEL_PRIORITY_BULK */
+};
+
 static ssh_channel channel_from_msg(ssh_session session, ssh_buffer packet);
+static void channel_queue_drop(ssh_channel channel);
+static int channel_queue_drain(ssh_channel channel);
 
 /**
  * @brief Allocate a new channel.
@@ -80,24 +97,15 @@ ssh_channel ssh_channel_new(ssh_session session) {
   }
   memset(channel,0,sizeof(struct ssh_channel_struct));
 
-  channel->stdout_buffer = ssh_buffer_new();
-  if (channel->stdout_buffer == NULL) {
-    ssh_set_error_oom(session);
-    SAFE_FREE(channel);
-    return NULL;
-  }
-
-  channel->stderr_buffer = ssh_buffer_new();
-  if (channel->stderr_buffer == NULL) {
-    ssh_set_error_oom(session);
-    ssh_buffer_free(channel->stdout_buffer);
-    SAFE_FREE(channel);
-    return NULL;
-  }
-
+  /* stdout_buffer and stderr_buffer are created with their first data */
   channel->session = session;
   channel->version = session->version;
   channel->exit_status = -1;
+  channel->window_size = session->channel_window;
+  channel->window_max = session->channel_window_max;
+  channel->local_maxpacket = session->channel_maxpacket;
+  channel->window_threshold = session->channel_window_threshold;
+  channel->window_coalesce = session->channel_window_coalesce;
 
   if(session->channels == NULL) {
     session->channels = channel;
@@ -112,17 +120,87 @@ ssh_channel ssh_channel_new(ssh_session session) {
   return channel;
 }
 
+/* the slot of an id in the table of the session, size if it has none */
+static uint32_t channel_id_slot(ssh_session session, uint32_t id) {
+  if (id <= FIRST_CHANNEL ||
+      id - FIRST_CHANNEL - 1 >= session->channel_ids_size) {
+    return session->channel_ids_size;
+  }
+
+  return id - FIRST_CHANNEL - 1;
+}
+
 /**
  * @internal
  *
  * @brief Create a new channel identifier.
  *
+ * The ids index the table of the channels, which ssh_channel_from_local()
+ * looks up. The ids of the freed channels are reused first so the table
+ * stays as small as the number of channels open at once.
+ *
  * @param[in]  session  The SSH session to use.
  *
- * @return              The new channel identifier.
+ * @param[in]  channel  The channel to give the identifier to.
+ *
+ * @return              The new channel identifier, 0 on error.
  */
-uint32_t ssh_channel_new_id(ssh_session session) {
-  return ++(session->maxchannel);
+uint32_t ssh_channel_new_id(ssh_session session, ssh_channel channel) {
+  ssh_channel *ids;
+  uint32_t *free_ids;
+  uint32_t size;
+  uint32_t id;
+
+  if (session->channel_ids_free_count > 0) {
+    id = session->channel_ids_free[--session->channel_ids_free_count];
+  } else {
+    id = session->maxchannel + 1;
+    if (id - FIRST_CHANNEL - 1 >= session->channel_ids_size) {
+      size = session->channel_ids_size ? session->channel_ids_size * 2 : 16;
+      ids = realloc(session->channel_ids, size * sizeof(ssh_channel));
+      if (ids == NULL) {
+        ssh_set_error_oom(session);
+        return 0;
+      }
+      session->channel_ids = ids;
+      free_ids = realloc(session->channel_ids_free, size * sizeof(uint32_t));
+      if (free_ids == NULL) {
+        ssh_set_error_oom(session);
+        return 0;
+      }
+      session->channel_ids_free = free_ids;
+      memset(ids + session->channel_ids_size, 0,
+          (size - session->channel_ids_size) * sizeof(ssh_channel));
+      session->channel_ids_size = size;
+    }
+    session->maxchannel = id;
+  }
+
+  session->channel_ids[id - FIRST_CHANNEL - 1] = channel;
+  channel->local_channel = id;
+
+  return id;
+}
+
+/*
+ * Takes the id of a freed channel out of the table. It is reused only once
+ * the peer can't send anything on it anymore.
+ */
+static void channel_id_release(ssh_channel channel) {
+  ssh_session session = channel->session;
+  uint32_t slot = channel_id_slot(session, channel->local_channel);
+
+  if (slot == session->channel_ids_size ||
+      session->channel_ids[slot] != channel) {
+    return;
+  }
+  session->channel_ids[slot] = NULL;
+
+  if (channel->remote_close ||
+      channel->state == SSH_CHANNEL_STATE_OPEN_DENIED) {
+    session->channel_ids_free[session->channel_ids_free_count++] =
+      channel->local_channel;
+  }
 }
 
 /**
@@ -134,15 +212,13 @@ uint32_t ssh_channel_new_id(ssh_session session) {
  */
 SSH_PACKET_CALLBACK(ssh_packet_channel_open_conf){
   uint32_t channelid=0;
-  uint32_t tmp;
   ssh_channel channel;
   (void)type;
   (void)user;
   enter_function();
-  ssh_log(session,SSH_LOG_PACKET,"Received SSH2_MSG_CHANNEL_OPEN_CONFIRMATION");
+  SSH_LOG(session,SSH_LOG_PACKET,"Received SSH2_MSG_CHANNEL_OPEN_CONFIRMATION");
 
-  buffer_get_u32(packet, &channelid);
-  channelid=ntohl(channelid);
+  buffer_unpack(packet, "d", &channelid);
   channel=ssh_channel_from_local(session,channelid);
   if(channel==NULL){
     ssh_set_error(session, SSH_FATAL,
@@ -153,25 +229,34 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_open_conf){
     return SSH_PACKET_USED;
   }
 
-  buffer_get_u32(packet, &tmp);
-  channel->remote_channel = ntohl(tmp);
-
-  buffer_get_u32(packet, &tmp);
-  channel->remote_window = ntohl(tmp);
-
-  buffer_get_u32(packet,&tmp);
-  channel->remote_maxpacket=ntohl(tmp);
+  if (buffer_unpack(packet, "ddd", &channel->remote_channel,
+        &channel->remote_window, &channel->remote_maxpacket) < 0) {
+    ssh_set_error(session, SSH_FATAL,
+        "Invalid SSH2_MSG_CHANNEL_OPEN_CONFIRMATION");
+    leave_function();
+    return SSH_PACKET_USED;
+  }
 
-  ssh_log(session, SSH_LOG_PROTOCOL,
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
       "Received a CHANNEL_OPEN_CONFIRMATION for channel %d:%d",
       channel->local_channel,
       channel->remote_channel);
-  ssh_log(session, SSH_LOG_PROTOCOL,
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
       "Remote window : %lu, maxpacket : %lu",
       (long unsigned int) channel->remote_window,
       (long unsigned int) channel->remote_maxpacket);
 
   channel->state = SSH_CHANNEL_STATE_OPEN;
+  SSH_PROBE3(channel_open, channel, channel->local_channel,
+      channel->remote_channel);
+  if (channel->open_ts != 0) {
+    ssh_latency_record(session, SSH_LATENCY_CHANNEL_OPEN,
+        ssh_timestamp_us() - channel->open_ts);
+  }
+  if (ssh_callbacks_exists(channel->callbacks, channel_open_response_function)) {
+    channel->callbacks->channel_open_response_function(session, channel, 1,
+        channel->callbacks->userdata);
+  }
   leave_function();
   return SSH_PACKET_USED;
 }
@@ -191,7 +276,7 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_open_fail){
   (void)type;
   channel=channel_from_msg(session,packet);
   if(channel==NULL){
-    ssh_log(session,SSH_LOG_RARE,"Invalid channel in packet");
+    SSH_LOG(session,SSH_LOG_RARE,"Invalid channel in packet");
     return SSH_PACKET_USED;
   }
   buffer_get_u32(packet, &code);
@@ -212,6 +297,10 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_open_fail){
       error);
   SAFE_FREE(error);
   channel->state=SSH_CHANNEL_STATE_OPEN_DENIED;
+  if (ssh_callbacks_exists(channel->callbacks, channel_open_response_function)) {
+    channel->callbacks->channel_open_response_function(session, channel, 0,
+        channel->callbacks->userdata);
+  }
   return SSH_PACKET_USED;
 }
 
@@ -236,38 +325,45 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_open_fail){
 static int channel_open(ssh_channel channel, const char *type_c, int window,
     int maxpacket, ssh_buffer payload) {
   ssh_session session = channel->session;
-  ssh_string type = NULL;
   int err=SSH_ERROR;
 
   enter_function();
-  channel->local_channel = ssh_channel_new_id(session);
+  switch (channel->state) {
+    case SSH_CHANNEL_STATE_NOT_OPEN:
+      break;
+    case SSH_CHANNEL_STATE_OPENING:
+      /* called again by a nonblocking session */
+      goto pending;
+    case SSH_CHANNEL_STATE_OPEN:
+    case SSH_CHANNEL_STATE_OPEN_DENIED:
+      goto end;
+    default:
+      ssh_set_error(session, SSH_FATAL, "Bad state in channel_open: %d",
+          channel->state);
+      leave_function();
+      return err;
+  }
+
+  if (ssh_channel_new_id(session, channel) == 0) {
+    leave_function();
+    return err;
+  }
   channel->local_maxpacket = maxpacket;
   channel->local_window = window;
+  channel_compression_check(channel, type_c);
 
-  ssh_log(session, SSH_LOG_PROTOCOL,
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
       "Creating a channel %d with %d window and %d max packet",
       channel->local_channel, window, maxpacket);
 
-  type = ssh_string_from_char(type_c);
-  if (type == NULL) {
-    ssh_set_error_oom(session);
-    leave_function();
-    return err;
-  }
-
-  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_OPEN) < 0 ||
-      buffer_add_ssh_string(session->out_buffer,type) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(channel->local_channel)) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(channel->local_window)) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(channel->local_maxpacket)) < 0) {
+  if (buffer_pack(session->out_buffer, "bsddd", SSH2_MSG_CHANNEL_OPEN,
+        type_c, channel->local_channel, channel->local_window,
+        channel->local_maxpacket) < 0) {
     ssh_set_error_oom(session);
-    ssh_string_free(type);
     leave_function();
     return err;
   }
 
-  ssh_string_free(type);
-
   if (payload != NULL) {
     if (buffer_add_buffer(session->out_buffer, payload) < 0) {
       ssh_set_error_oom(session);
@@ -281,15 +377,29 @@ static int channel_open(ssh_channel channel, const char *type_c, int window,
     return err;
   }
 
-  ssh_log(session, SSH_LOG_PACKET,
+  channel->state = SSH_CHANNEL_STATE_OPENING;
+  channel->open_ts = ssh_timestamp_us();
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Sent a SSH_MSG_CHANNEL_OPEN type %s for channel %d",
       type_c, channel->local_channel);
 
-  /* Todo: fix this into a correct loop */
+pending:
   /* wait until channel is opened by server */
-  while(channel->state == SSH_CHANNEL_STATE_NOT_OPEN){
-    ssh_handle_packets(session,-1);
+  while (channel->state == SSH_CHANNEL_STATE_OPENING) {
+    if (ssh_handle_packets(session, ssh_is_blocking(session) ? -1 : 0) ==
+        SSH_ERROR || session->alive == 0) {
+      leave_function();
+      return err;
+    }
+    if (channel->state == SSH_CHANNEL_STATE_OPENING &&
+        !ssh_is_blocking(session)) {
+      /* the answer goes to the channel_open_response_function callback */
+      leave_function();
+      return SSH_AGAIN;
+    }
   }
+
+end:
   if(channel->state == SSH_CHANNEL_STATE_OPEN)
     err=SSH_OK;
   leave_function();
@@ -298,49 +408,254 @@ static int channel_open(ssh_channel channel, const char *type_c, int window,
 
 /* get ssh channel from local session? */
 ssh_channel ssh_channel_from_local(ssh_session session, uint32_t id) {
-  ssh_channel initchan = session->channels;
-  ssh_channel channel;
+  uint32_t slot = channel_id_slot(session, id);
 
   /* We assume we are always the local */
-  if (initchan == NULL) {
+  if (slot == session->channel_ids_size) {
     return NULL;
   }
 
-  for (channel = initchan; channel->local_channel != id;
-      channel=channel->next) {
-    if (channel->next == initchan) {
-      return NULL;
+  return session->channel_ids[slot];
+}
+
+/**
+ * @internal
+ * @brief returns the number of received bytes waiting in a flow of a
+ * channel
+ */
+static uint32_t channel_pending(ssh_channel channel, int is_stderr) {
+  ssh_buffer buf = is_stderr ? channel->stderr_buffer : channel->stdout_buffer;
+
+  return buf != NULL ? buffer_get_rest_len(buf) : 0;
+}
+
+/**
+ * @internal
+ * @brief returns the number of received bytes waiting in a channel
+ */
+static uint32_t channel_buffered(ssh_channel channel) {
+  uint32_t len = 0;
+
+  if (channel->stdout_buffer != NULL) {
+    len += buffer_get_rest_len(channel->stdout_buffer);
+  }
+  if (channel->stderr_buffer != NULL) {
+    len += buffer_get_rest_len(channel->stderr_buffer);
+  }
+  return len;
+}
+
+/**
+ * @internal
+ * @brief returns the number of received bytes waiting in all the channels
+ * of a session
+ *
+ * The count is kept up to date as the channel buffers grow and drain, the
+ * channels aren't walked.
+ */
+uint32_t ssh_channels_get_buffered(ssh_session session) {
+  return session->channels_buffered;
+}
+
+/**
+ * @internal
+ * @brief closes the channels of a session whose peer is gone. What they
+ * queued for the peer is dropped, what they received stays to be read.
+ */
+void ssh_channels_dead(ssh_session session) {
+  ssh_channel channel;
+  uint32_t slot;
+
+  /* by id, the close callbacks may free channels */
+  for (slot = 0; slot < session->channel_ids_size; slot++) {
+    channel = session->channel_ids[slot];
+    if (channel == NULL || channel->state == SSH_CHANNEL_STATE_CLOSED) {
+      continue;
+    }
+    channel_queue_drop(channel);
+    channel->remote_eof = 1;
+    channel->remote_close = 1;
+    if (channel->state != SSH_CHANNEL_STATE_OPEN) {
+      channel->state = SSH_CHANNEL_STATE_CLOSED;
+      continue;
+    }
+    channel->state = SSH_CHANNEL_STATE_CLOSED;
+    SSH_PROBE3(channel_close, channel, channel->local_channel,
+        channel->remote_channel);
+    if (ssh_callbacks_exists(channel->callbacks, channel_close_function)) {
+      channel->callbacks->channel_close_function(session, channel,
+          channel->callbacks->userdata);
     }
   }
+}
 
-  return channel;
+/**
+ * @internal
+ * @brief checks the soft buffering limits before a window is grown
+ *
+ * The peer then can't send more until the application reads. A channel
+ * without pending data can always grow its window, else its reader would
+ * wait forever. So can the channels with a data callback, their pending
+ * data is only given back to the callback when more arrives.
+ *
+ * @returns 1 if the window can grow, 0 if the peer has to wait.
+ */
+static int channel_window_allowed(ssh_session session, ssh_channel channel) {
+  uint32_t buffered = channel_buffered(channel);
+
+  if (buffered == 0 ||
+      ssh_callbacks_exists(channel->callbacks, channel_data_function)) {
+    return 1;
+  }
+  if (session->channel_buffer_soft_limit > 0 &&
+      buffered >= session->channel_buffer_soft_limit) {
+    return 0;
+  }
+  if (session->session_buffer_soft_limit > 0 &&
+      ssh_channels_get_buffered(session) >= session->session_buffer_soft_limit) {
+    return 0;
+  }
+
+  return 1;
 }
 
 /**
  * @internal
- * @brief grows the local window and send a packet to the other party
- * @param session SSH session
- * @param channel SSH channel
- * @param minimumsize The minimum acceptable size for the new window.
+ * @brief checks the hard buffering limits before data is buffered
+ *
+ * Only a peer which ignores the window gets there: the channel is closed.
+ *
+ * @returns SSH_OK if the data can be buffered, SSH_ERROR if it's refused.
  */
-static int grow_window(ssh_session session, ssh_channel channel, int minimumsize) {
-  uint32_t new_window = minimumsize > WINDOWBASE ? minimumsize : WINDOWBASE;
+static int channel_check_hard_limits(ssh_session session, ssh_channel channel,
+    uint32_t len) {
+  if ((session->channel_buffer_hard_limit > 0 &&
+       channel_buffered(channel) + len > session->channel_buffer_hard_limit) ||
+      (session->session_buffer_hard_limit > 0 &&
+       ssh_channels_get_buffered(session) + len >
+       session->session_buffer_hard_limit)) {
+    ssh_set_error(session, SSH_FATAL,
+        "Channel %d:%d exceeded the buffering limit",
+        channel->local_channel, channel->remote_channel);
+    if (channel->state == SSH_CHANNEL_STATE_OPEN) {
+      ssh_channel_close(channel);
+    }
+    return SSH_ERROR;
+  }
 
-  enter_function();
-  if(new_window <= channel->local_window){
-    ssh_log(session,SSH_LOG_PROTOCOL,
-        "growing window (channel %d:%d) to %d bytes : not needed (%d bytes)",
-        channel->local_channel, channel->remote_channel, new_window,
-        channel->local_window);
-    leave_function();
-    return SSH_OK;
+  return SSH_OK;
+}
+
+/**
+ * @internal
+ * @brief returns the size an auto-tuned window can reach
+ *
+ * Data in flight ends up buffered when the application is slow, on top of
+ * what the soft limits let pile up: the window has to fit between the soft
+ * and the hard limits.
+ */
+static uint32_t channel_window_limit(ssh_session session, ssh_channel channel) {
+  uint32_t limit = channel->window_max;
+
+  if (session->channel_buffer_hard_limit > session->channel_buffer_soft_limit &&
+      session->channel_buffer_hard_limit - session->channel_buffer_soft_limit <
+      limit) {
+    limit = session->channel_buffer_hard_limit -
+      session->channel_buffer_soft_limit;
+  }
+  if (session->session_buffer_hard_limit > session->session_buffer_soft_limit &&
+      session->session_buffer_hard_limit - session->session_buffer_soft_limit <
+      limit) {
+    limit = session->session_buffer_hard_limit -
+      session->session_buffer_soft_limit;
+  }
+
+  return limit;
+}
+
+/**
+ * @internal
+ * @brief measures the round trip time of the window adjusts
+ *
+ * The peer can only send past the window it had when an adjust was sent
+ * once it got the adjust. Called with the length of each data packet.
+ */
+static void channel_window_sample(ssh_channel channel, uint32_t len) {
+  uint64_t rtt;
+
+  if (channel->window_adjust_ts == 0) {
+    return;
+  }
+  if (len <= channel->window_adjust_credit) {
+    channel->window_adjust_credit -= len;
+    return;
+  }
+
+  rtt = ssh_timestamp_ms() - channel->window_adjust_ts;
+  if (rtt == 0) {
+    rtt = 1;
+  }
+  if (channel->window_rtt == 0) {
+    channel->window_rtt = (uint32_t) rtt;
+  } else {
+    channel->window_rtt = (uint32_t) ((7 * (uint64_t) channel->window_rtt +
+          rtt) / 8);
+  }
+  channel->window_adjust_ts = 0;
+}
+
+/**
+ * @internal
+ * @brief grows the window size of an auto-tuned channel
+ *
+ * Over each round trip time, the window given back to the peer is what the
+ * application drained. A peer limited by the window drains it whole: the
+ * window doubles, until it's twice the data drained by round trip, the way
+ * TCP tunes its receive buffers.
+ */
+static void channel_window_autotune(ssh_session session, ssh_channel channel) {
+  uint64_t now = ssh_timestamp_ms();
+  uint64_t elapsed;
+  uint64_t target;
+  uint32_t limit;
+
+  if (channel->window_drain_ts == 0) {
+    channel->window_drain_ts = now;
+    channel->window_drain_bytes = 0;
+    return;
+  }
+  elapsed = now - channel->window_drain_ts;
+  if (channel->window_rtt == 0 || elapsed < channel->window_rtt) {
+    return;
   }
+
+  target = 2 * channel->window_drain_bytes * channel->window_rtt / elapsed;
+  limit = channel_window_limit(session, channel);
+  if (target > limit) {
+    target = limit;
+  }
+  if (target > channel->window_size) {
+    SSH_LOG(session, SSH_LOG_PROTOCOL,
+        "window of channel %d:%d tuned to %u bytes (rtt %u ms)",
+        channel->local_channel, channel->remote_channel,
+        (uint32_t) target, channel->window_rtt);
+    channel->window_size = (uint32_t) target;
+  }
+  channel->window_drain_ts = now;
+  channel->window_drain_bytes = 0;
+}
+
+/**
+ * @internal
+ * @brief sends a WINDOW_ADJUST which grows the local window to new_window
+ */
+static int channel_window_send(ssh_session session, ssh_channel channel,
+    uint32_t new_window) {
   /* WINDOW_ADJUST packet needs a relative increment rather than an absolute
    * value, so we give here the missing bytes needed to reach new_window
    */
-  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_WINDOW_ADJUST) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(channel->remote_channel)) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(new_window - channel->local_window)) < 0) {
+  if (buffer_pack(session->out_buffer, "bdd", SSH2_MSG_CHANNEL_WINDOW_ADJUST,
+        channel->remote_channel, new_window - channel->local_window) < 0) {
     ssh_set_error_oom(session);
     goto error;
   }
@@ -349,23 +664,134 @@ static int grow_window(ssh_session session, ssh_channel channel, int minimumsize
     goto error;
   }
 
-  ssh_log(session, SSH_LOG_PROTOCOL,
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
       "growing window (channel %d:%d) to %d bytes",
       channel->local_channel,
       channel->remote_channel,
       new_window);
-
+  channel->stats.window_adjusts_out++;
+  session->stats.window_adjusts_out++;
+  SSH_PROBE2(window_send, channel, new_window);
+
+  if (channel->window_max > channel->window_size) {
+    /* a peer left with less than a packet waits for this adjust */
+    if (channel->window_adjust_ts == 0 &&
+        channel->local_window < channel->local_maxpacket) {
+      channel->window_adjust_ts = ssh_timestamp_ms();
+      channel->window_adjust_credit = channel->local_window;
+    }
+    channel->window_drain_bytes += new_window - channel->local_window;
+  }
   channel->local_window = new_window;
 
-  leave_function();
   return SSH_OK;
 error:
   buffer_reinit(session->out_buffer);
 
-  leave_function();
   return SSH_ERROR;
 }
 
+/**
+ * @internal
+ * @brief grows the local window and send a packet to the other party
+ *
+ * A channel which coalesces its adjusts only records the window: it's sent
+ * by ssh_channels_flush_windows(), before the session waits for packets.
+ *
+ * @param session SSH session
+ * @param channel SSH channel
+ * @param minimumsize The minimum acceptable size for the new window.
+ */
+static int grow_window(ssh_session session, ssh_channel channel, int minimumsize) {
+  uint32_t new_window;
+  int rc;
+
+  enter_function();
+  if (channel->window_max > channel->window_size) {
+    channel_window_autotune(session, channel);
+  }
+  new_window = (uint32_t) minimumsize > channel->window_size ?
+    (uint32_t) minimumsize : channel->window_size;
+  /* the data the application holds is still accounted to the peer */
+  new_window = new_window > channel->window_held ?
+    new_window - channel->window_held : 0;
+
+  if (!channel_window_allowed(session, channel)) {
+    SSH_LOG(session, SSH_LOG_PROTOCOL,
+        "growing window (channel %d:%d): withheld, %d bytes are buffered",
+        channel->local_channel, channel->remote_channel,
+        channel_buffered(channel));
+    leave_function();
+    return SSH_OK;
+  }
+  if(new_window <= channel->local_window){
+    SSH_LOG(session,SSH_LOG_PROTOCOL,
+        "growing window (channel %d:%d) to %d bytes : not needed (%d bytes)",
+        channel->local_channel, channel->remote_channel, new_window,
+        channel->local_window);
+    leave_function();
+    return SSH_OK;
+  }
+  if (channel->window_coalesce) {
+    if (new_window > channel->window_pending) {
+      channel->window_pending = new_window;
+    }
+    session->channel_windows_pending = 1;
+    leave_function();
+    return SSH_OK;
+  }
+
+  rc = channel_window_send(session, channel, new_window);
+  leave_function();
+  return rc;
+}
+
+/**
+ * @internal
+ * @brief sends the window adjusts coalesced by the channels of a session
+ *
+ * Called before the session waits for packets and once the packets of a
+ * read are processed, so a peer out of window never waits for them.
+ *
+ * @returns SSH_OK, SSH_ERROR if an adjust couldn't be sent.
+ */
+int ssh_channels_flush_windows(ssh_session session) {
+  ssh_channel channel;
+  uint32_t new_window;
+  int rc = SSH_OK;
+
+  if (session == NULL || !session->channel_windows_pending) {
+    return SSH_OK;
+  }
+  session->channel_windows_pending = 0;
+
+  channel = session->channels;
+  if (channel == NULL) {
+    return SSH_OK;
+  }
+  do {
+    new_window = channel->window_pending;
+    channel->window_pending = 0;
+    if (new_window > channel->local_window &&
+        channel->state == SSH_CHANNEL_STATE_OPEN &&
+        channel_window_send(session, channel, new_window) < 0) {
+      rc = SSH_ERROR;
+    }
+    channel = channel->next;
+  } while (channel != session->channels);
+
+  return rc;
+}
+
+/**
+ * @internal
+ * @brief returns the local window under which an adjust is sent
+ */
+static uint32_t channel_window_low(ssh_channel channel) {
+  return (uint32_t) ((uint64_t) channel->window_size *
+      channel->window_threshold / 100);
+}
+
 /**
  * @internal
  *
@@ -415,19 +841,19 @@ SSH_PACKET_CALLBACK(channel_rcv_change_window) {
 
   channel = channel_from_msg(session,packet);
   if (channel == NULL) {
-    ssh_log(session, SSH_LOG_FUNCTIONS, "%s", ssh_get_error(session));
+    SSH_LOG(session, SSH_LOG_FUNCTIONS, "%s", ssh_get_error(session));
   }
 
   rc = buffer_get_u32(packet, &bytes);
   if (channel == NULL || rc != sizeof(uint32_t)) {
-    ssh_log(session, SSH_LOG_PACKET,
+    SSH_LOG(session, SSH_LOG_PACKET,
         "Error getting a window adjust message: invalid packet");
     leave_function();
     return SSH_PACKET_USED;
   }
 
   bytes = ntohl(bytes);
-  ssh_log(session, SSH_LOG_PROTOCOL,
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
       "Adding %d bytes to channel (%d:%d) (from %d bytes)",
       bytes,
       channel->local_channel,
@@ -435,6 +861,12 @@ SSH_PACKET_CALLBACK(channel_rcv_change_window) {
       channel->remote_window);
 
   channel->remote_window += bytes;
+  channel->stats.window_adjusts_in++;
+  session->stats.window_adjusts_in++;
+  SSH_PROBE2(window_recv, channel, bytes);
+  ssh_channels_schedule(session);
+  ssh_channel_fd_window(channel);
+  ssh_channels_writable(session, channel);
 
   leave_function();
   return SSH_PACKET_USED;
@@ -443,9 +875,9 @@ SSH_PACKET_CALLBACK(channel_rcv_change_window) {
 /* is_stderr is set to 1 if the data are extended, ie stderr */
 SSH_PACKET_CALLBACK(channel_rcv_data){
   ssh_channel channel;
-  ssh_string str;
   ssh_buffer buf;
-  size_t len;
+  uint32_t len;
+  void *data;
   int is_stderr;
   int rest;
   (void)user;
@@ -457,7 +889,7 @@ SSH_PACKET_CALLBACK(channel_rcv_data){
 
   channel = channel_from_msg(session,packet);
   if (channel == NULL) {
-    ssh_log(session, SSH_LOG_FUNCTIONS,
+    SSH_LOG(session, SSH_LOG_FUNCTIONS,
         "%s", ssh_get_error(session));
     leave_function();
     return SSH_PACKET_USED;
@@ -469,71 +901,139 @@ SSH_PACKET_CALLBACK(channel_rcv_data){
     buffer_get_u32(packet, &ignore);
   }
 
-  str = buffer_get_ssh_string(packet);
-  if (str == NULL) {
-    ssh_log(session, SSH_LOG_PACKET, "Invalid data packet!");
+  /* the data is used from the packet buffer, without copying it in a string */
+  if (buffer_get_u32(packet, &len) != sizeof(uint32_t)) {
+    SSH_LOG(session, SSH_LOG_PACKET, "Invalid data packet!");
+    leave_function();
+    return SSH_PACKET_USED;
+  }
+  len = ntohl(len);
+  if (len > buffer_get_rest_len(packet)) {
+    SSH_LOG(session, SSH_LOG_PACKET, "Invalid data packet!");
     leave_function();
     return SSH_PACKET_USED;
   }
-  len = ssh_string_len(str);
+  data = buffer_get_rest(packet);
 
-  ssh_log(session, SSH_LOG_PROTOCOL,
-      "Channel receiving %zu bytes data in %d (local win=%d remote win=%d)",
-      len,
-      is_stderr,
-      channel->local_window,
-      channel->remote_window);
+  channel->stats.bytes_in += len;
+  SSH_LOG_EVENT(session, SSH_LOG_PROTOCOL, SSH_LOG_EVENT_CHANNEL_DATA,
+      (unsigned int) channel->local_channel, (unsigned int) len,
+      (unsigned int) is_stderr, (unsigned int) channel->local_window);
 
   /* What shall we do in this case? Let's accept it anyway */
   if (len > channel->local_window) {
-    ssh_log(session, SSH_LOG_RARE,
-        "Data packet too big for our window(%zu vs %d)",
+    SSH_LOG(session, SSH_LOG_RARE,
+        "Data packet too big for our window(%u vs %d)",
         len,
         channel->local_window);
   }
 
-  if (channel_default_bufferize(channel, ssh_string_data(str), len,
-        is_stderr) < 0) {
-    ssh_string_free(str);
-    leave_function();
-    return SSH_PACKET_USED;
-  }
-
   if (len <= channel->local_window) {
     channel->local_window -= len;
   } else {
     channel->local_window = 0; /* buggy remote */
   }
+  channel_window_sample(channel, len);
 
-  ssh_log(session, SSH_LOG_PROTOCOL,
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
       "Channel windows are now (local win=%d remote win=%d)",
       channel->local_window,
       channel->remote_window);
 
-  ssh_string_free(str);
-
   if(ssh_callbacks_exists(channel->callbacks, channel_data_function)) {
-      if(is_stderr) {
-        buf = channel->stderr_buffer;
-      } else {
-        buf = channel->stdout_buffer;
-      }
-      rest = channel->callbacks->channel_data_function(channel->session,
-                                                channel,
-                                                buffer_get_rest(buf),
-                                                buffer_get_rest_len(buf),
-                                                is_stderr,
-                                                channel->callbacks->userdata);
-      if(rest > 0) {
-        buffer_pass_bytes(buf, rest);
-      }
-      if (channel->local_window + buffer_get_rest_len(buf) < WINDOWLIMIT) {
-        if (grow_window(session, channel, 0) < 0) {
-          leave_function();
-          return -1;
+      buf = is_stderr ? channel->stderr_buffer : channel->stdout_buffer;
+      if (channel->unbuffered) {
+        /* the application keeps what it doesn't consume */
+        rest = channel->callbacks->channel_data_function(channel->session,
+                                                  channel,
+                                                  data,
+                                                  len,
+                                                  is_stderr,
+                                                  channel->callbacks->userdata);
+        if (rest < 0) {
+          rest = 0;
+        } else if ((uint32_t) rest > len) {
+          rest = len;
         }
+        channel->window_held += len - rest;
+      } else if (buf == NULL || buffer_get_rest_len(buf) == 0) {
+        /*
+         * Nothing is pending: the callback gets the data of the packet, only
+         * what it doesn't consume is kept in the channel buffer.
+         */
+        rest = channel->callbacks->channel_data_function(channel->session,
+                                                  channel,
+                                                  data,
+                                                  len,
+                                                  is_stderr,
+                                                  channel->callbacks->userdata);
+        if (rest < 0) {
+          rest = 0;
+        } else if ((uint32_t) rest > len) {
+          rest = len;
+        }
+        if ((uint32_t) rest < len &&
+            channel_default_bufferize(channel, (uint8_t *) data + rest,
+              len - rest, is_stderr) < 0) {
+          leave_function();
+          return SSH_PACKET_USED;
+        }
+      } else {
+        /* the pending data has to be given first */
+        if (channel_default_bufferize(channel, data, len, is_stderr) < 0) {
+          leave_function();
+          return SSH_PACKET_USED;
+        }
+        rest = channel->callbacks->channel_data_function(channel->session,
+                                                  channel,
+                                                  buffer_get_rest(buf),
+                                                  buffer_get_rest_len(buf),
+                                                  is_stderr,
+                                                  channel->callbacks->userdata);
+        if(rest > 0) {
+          session->channels_buffered -= buffer_pass_bytes(buf, rest);
+          buffer_release(buf);
+        }
+      }
+      buf = is_stderr ? channel->stderr_buffer : channel->stdout_buffer;
+      if (channel->local_window +
+          (buf != NULL ? buffer_get_rest_len(buf) : 0) +
+          channel->window_held < channel_window_low(channel)) {
+        if (grow_window(session, channel, 0) < 0) {
+          leave_function();
+          return -1;
+        }
+      }
+  } else {
+    /* the memory of the packet goes to the channel when nothing is pending */
+    buf = is_stderr ? channel->stderr_buffer : channel->stdout_buffer;
+    if (buf == NULL) {
+      buf = ssh_buffer_new();
+      if (buf == NULL) {
+        ssh_set_error_oom(session);
+        leave_function();
+        return SSH_PACKET_USED;
       }
+      if (is_stderr) {
+        channel->stderr_buffer = buf;
+      } else {
+        channel->stdout_buffer = buf;
+      }
+    }
+    if (channel_check_hard_limits(session, channel, len) < 0) {
+      leave_function();
+      return SSH_PACKET_USED;
+    }
+    if (buffer_move(buf, packet, len) < 0) {
+      ssh_set_error_oom(session);
+      leave_function();
+      return SSH_PACKET_USED;
+    }
+    session->channels_buffered += len;
+    leave_function();
+    return SSH_PACKET_USED;
   }
+  buffer_pass_bytes(packet, len);
 
   leave_function();
   return SSH_PACKET_USED;
@@ -547,12 +1047,12 @@ SSH_PACKET_CALLBACK(channel_rcv_eof) {
 
   channel = channel_from_msg(session,packet);
   if (channel == NULL) {
-    ssh_log(session, SSH_LOG_FUNCTIONS, "%s", ssh_get_error(session));
+    SSH_LOG(session, SSH_LOG_FUNCTIONS, "%s", ssh_get_error(session));
     leave_function();
     return SSH_PACKET_USED;
   }
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Received eof on channel (%d:%d)",
       channel->local_channel,
       channel->remote_channel);
@@ -577,12 +1077,12 @@ SSH_PACKET_CALLBACK(channel_rcv_close) {
 
 	channel = channel_from_msg(session,packet);
 	if (channel == NULL) {
-		ssh_log(session, SSH_LOG_FUNCTIONS, "%s", ssh_get_error(session));
+		SSH_LOG(session, SSH_LOG_FUNCTIONS, "%s", ssh_get_error(session));
 		leave_function();
 		return SSH_PACKET_USED;
 	}
 
-	ssh_log(session, SSH_LOG_PACKET,
+	SSH_LOG(session, SSH_LOG_PACKET,
 			"Received close on channel (%d:%d)",
 			channel->local_channel,
 			channel->remote_channel);
@@ -595,12 +1095,15 @@ SSH_PACKET_CALLBACK(channel_rcv_close) {
 	} else {
 		channel->state = SSH_CHANNEL_STATE_CLOSED;
 	}
+	SSH_PROBE3(channel_close, channel, channel->local_channel,
+			channel->remote_channel);
 
 	if (channel->remote_eof == 0) {
-		ssh_log(session, SSH_LOG_PACKET,
+		SSH_LOG(session, SSH_LOG_PACKET,
 				"Remote host not polite enough to send an eof before close");
 	}
 	channel->remote_eof = 1;
+	channel->remote_close = 1;
 	/*
 	 * The remote eof doesn't break things if there was still data into read
 	 * buffer because the eof is ignored until the buffer is empty.
@@ -628,14 +1131,14 @@ SSH_PACKET_CALLBACK(channel_rcv_request) {
 
 	channel = channel_from_msg(session,packet);
 	if (channel == NULL) {
-		ssh_log(session, SSH_LOG_FUNCTIONS,"%s", ssh_get_error(session));
+		SSH_LOG(session, SSH_LOG_FUNCTIONS,"%s", ssh_get_error(session));
 		leave_function();
 		return SSH_PACKET_USED;
 	}
 
 	request_s = buffer_get_ssh_string(packet);
 	if (request_s == NULL) {
-		ssh_log(session, SSH_LOG_PACKET, "Invalid MSG_CHANNEL_REQUEST");
+		SSH_LOG(session, SSH_LOG_PACKET, "Invalid MSG_CHANNEL_REQUEST");
 		leave_function();
 		return SSH_PACKET_USED;
 	}
@@ -653,7 +1156,7 @@ SSH_PACKET_CALLBACK(channel_rcv_request) {
 		SAFE_FREE(request);
 		buffer_get_u32(packet, &status);
 		channel->exit_status = ntohl(status);
-		ssh_log(session, SSH_LOG_PACKET, "received exit-status %d", channel->exit_status);
+		SSH_LOG(session, SSH_LOG_PACKET, "received exit-status %d", channel->exit_status);
 
         if(ssh_callbacks_exists(channel->callbacks, channel_exit_status_function)) {
             channel->callbacks->channel_exit_status_function(channel->session,
@@ -671,11 +1174,11 @@ SSH_PACKET_CALLBACK(channel_rcv_request) {
         char *sig;
 
 		SAFE_FREE(request);
-		ssh_log(session, SSH_LOG_PACKET, "received signal");
+		SSH_LOG(session, SSH_LOG_PACKET, "received signal");
 
 		signal = buffer_get_ssh_string(packet);
 		if (signal == NULL) {
-			ssh_log(session, SSH_LOG_PACKET, "Invalid MSG_CHANNEL_REQUEST");
+			SSH_LOG(session, SSH_LOG_PACKET, "Invalid MSG_CHANNEL_REQUEST");
 			leave_function();
 			return SSH_PACKET_USED;
 		}
@@ -688,7 +1191,7 @@ SSH_PACKET_CALLBACK(channel_rcv_request) {
 		}
 
 
-		ssh_log(session, SSH_LOG_PACKET,
+		SSH_LOG(session, SSH_LOG_PACKET,
 				"Remote connection sent a signal SIG %s", sig);
         if(ssh_callbacks_exists(channel->callbacks, channel_signal_function)) {
             channel->callbacks->channel_signal_function(channel->session,
@@ -713,7 +1216,7 @@ SSH_PACKET_CALLBACK(channel_rcv_request) {
 
 		tmp = buffer_get_ssh_string(packet);
 		if (tmp == NULL) {
-			ssh_log(session, SSH_LOG_PACKET, "Invalid MSG_CHANNEL_REQUEST");
+			SSH_LOG(session, SSH_LOG_PACKET, "Invalid MSG_CHANNEL_REQUEST");
 			leave_function();
 			return SSH_PACKET_USED;
 		}
@@ -732,7 +1235,7 @@ SSH_PACKET_CALLBACK(channel_rcv_request) {
 
 		tmp = buffer_get_ssh_string(packet);
 		if (tmp == NULL) {
-			ssh_log(session, SSH_LOG_PACKET, "Invalid MSG_CHANNEL_REQUEST");
+			SSH_LOG(session, SSH_LOG_PACKET, "Invalid MSG_CHANNEL_REQUEST");
             SAFE_FREE(sig);
 			leave_function();
 			return SSH_PACKET_USED;
@@ -748,7 +1251,7 @@ SSH_PACKET_CALLBACK(channel_rcv_request) {
 
 		tmp = buffer_get_ssh_string(packet);
 		if (tmp == NULL) {
-			ssh_log(session, SSH_LOG_PACKET, "Invalid MSG_CHANNEL_REQUEST");
+			SSH_LOG(session, SSH_LOG_PACKET, "Invalid MSG_CHANNEL_REQUEST");
             SAFE_FREE(errmsg);
             SAFE_FREE(sig);
 			leave_function();
@@ -764,7 +1267,7 @@ SSH_PACKET_CALLBACK(channel_rcv_request) {
 			return SSH_PACKET_USED;
 		}
 
-		ssh_log(session, SSH_LOG_PACKET,
+		SSH_LOG(session, SSH_LOG_PACKET,
 				"Remote connection closed by signal SIG %s %s", sig, core);
         if(ssh_callbacks_exists(channel->callbacks, channel_exit_signal_function)) {
             channel->callbacks->channel_exit_signal_function(channel->session,
@@ -782,7 +1285,7 @@ SSH_PACKET_CALLBACK(channel_rcv_request) {
 	}
 	if(strcmp(request,"keepalive@openssh.com")==0){
 	  SAFE_FREE(request);
-	  ssh_log(session, SSH_LOG_PROTOCOL,"Responding to Openssh's keepalive");
+	  SSH_LOG(session, SSH_LOG_PROTOCOL,"Responding to Openssh's keepalive");
 	  buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_FAILURE);
 	  buffer_add_u32(session->out_buffer, htonl(channel->remote_channel));
 	  packet_send(session);
@@ -823,7 +1326,11 @@ int channel_default_bufferize(ssh_channel channel, void *data, int len,
       return -1;
   }
 
-  ssh_log(session, SSH_LOG_RARE,
+  if (channel_check_hard_limits(session, channel, len) < 0) {
+    return -1;
+  }
+
+  SSH_LOG(session, SSH_LOG_RARE,
       "placing %d bytes into channel buffer (stderr=%d)", len, is_stderr);
   if (is_stderr == 0) {
     /* stdout */
@@ -837,6 +1344,8 @@ int channel_default_bufferize(ssh_channel channel, void *data, int len,
 
     if (buffer_add_data(channel->stdout_buffer, data, len) < 0) {
       ssh_set_error_oom(session);
+      session->channels_buffered -=
+        buffer_get_rest_len(channel->stdout_buffer);
       ssh_buffer_free(channel->stdout_buffer);
       channel->stdout_buffer = NULL;
       return -1;
@@ -853,11 +1362,14 @@ int channel_default_bufferize(ssh_channel channel, void *data, int len,
 
     if (buffer_add_data(channel->stderr_buffer, data, len) < 0) {
       ssh_set_error_oom(session);
+      session->channels_buffered -=
+        buffer_get_rest_len(channel->stderr_buffer);
       ssh_buffer_free(channel->stderr_buffer);
       channel->stderr_buffer = NULL;
       return -1;
     }
   }
+  session->channels_buffered += len;
 
   return 0;
 }
@@ -867,7 +1379,10 @@ int channel_default_bufferize(ssh_channel channel, void *data, int len,
  *
  * @param[in]  channel  An allocated channel.
  *
- * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ * @return              SSH_OK on success, SSH_ERROR if an error occured,
+ *                      SSH_AGAIN if the session is nonblocking and the
+ *                      answer is pending (call it again or see the
+ *                      ssh_channel_callbacks_struct).
  *
  * @see channel_open_forward()
  * @see channel_request_env()
@@ -885,7 +1400,8 @@ int ssh_channel_open_session(ssh_channel channel) {
   }
 #endif
 
-  return channel_open(channel,"session",64000,32000,NULL);
+  return channel_open(channel, "session",
+      channel->window_size / 2, channel->local_maxpacket, NULL);
 }
 
 /**
@@ -904,7 +1420,10 @@ int ssh_channel_open_session(ssh_channel channel) {
  * @param[in]  localport  The port on the host from where the connection
  *                        originated. This is mostly for logging purposes.
  *
- * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ * @return              SSH_OK on success, SSH_ERROR if an error occured,
+ *                      SSH_AGAIN if the session is nonblocking and the
+ *                      answer is pending (call it again or see the
+ *                      ssh_channel_callbacks_struct).
  *
  * @warning This function does not bind the local port and does not automatically
  *          forward the content of a socket to the channel. You still have to
@@ -960,7 +1479,8 @@ int ssh_channel_open_forward(ssh_channel channel, const char *remotehost,
     goto error;
   }
 
-  rc = channel_open(channel, "direct-tcpip", 64000, 32000, payload);
+  rc = channel_open(channel, "direct-tcpip", channel->window_size / 2,
+      channel->local_maxpacket, payload);
 
 error:
   ssh_buffer_free(payload);
@@ -991,6 +1511,14 @@ void ssh_channel_free(ssh_channel channel) {
   if (session->alive && channel->state == SSH_CHANNEL_STATE_OPEN) {
     ssh_channel_close(channel);
   }
+  if (channel->fd_bind != NULL) {
+    ssh_channel_unbind_fd(channel);
+  }
+  channel_queue_drop(channel);
+  channel_id_release(channel);
+  if (session->sched_next == channel) {
+    session->sched_next = channel->next != channel ? channel->next : NULL;
+  }
 
   /* handle the "my channel is first on session list" case */
   if (session->channels == channel) {
@@ -1005,8 +1533,12 @@ void ssh_channel_free(ssh_channel channel) {
     channel->next->prev = channel->prev;
   }
 
+  session->channels_buffered -= channel_buffered(channel);
   ssh_buffer_free(channel->stdout_buffer);
   ssh_buffer_free(channel->stderr_buffer);
+  ssh_buffer_free(channel->stdout_queue);
+  ssh_buffer_free(channel->stderr_queue);
+  ssh_timers_free_channel(&session->timers, channel);
 
   /* debug trick to catch use after frees */
   memset(channel, 'X', sizeof(struct ssh_channel_struct));
@@ -1038,16 +1570,19 @@ int ssh_channel_send_eof(ssh_channel channel){
   session = channel->session;
   enter_function();
 
-  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_EOF) < 0) {
-    ssh_set_error_oom(session);
-    goto error;
+  /* the data queued by the scheduler goes first */
+  if (channel_queue_drain(channel) == SSH_ERROR) {
+    leave_function();
+    return rc;
   }
-  if (buffer_add_u32(session->out_buffer,htonl(channel->remote_channel)) < 0) {
+
+  if (buffer_pack(session->out_buffer, "bd", SSH2_MSG_CHANNEL_EOF,
+        channel->remote_channel) < 0) {
     ssh_set_error_oom(session);
     goto error;
   }
   rc = packet_send(session);
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Sent a EOF on client channel (%d:%d)",
       channel->local_channel,
       channel->remote_channel);
@@ -1096,20 +1631,22 @@ int ssh_channel_close(ssh_channel channel){
     return rc;
   }
 
-  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_CLOSE) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(channel->remote_channel)) < 0) {
+  if (buffer_pack(session->out_buffer, "bd", SSH2_MSG_CHANNEL_CLOSE,
+        channel->remote_channel) < 0) {
     ssh_set_error_oom(session);
     goto error;
   }
 
   rc = packet_send(session);
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Sent a close on client channel (%d:%d)",
       channel->local_channel,
       channel->remote_channel);
 
   if(rc == SSH_OK) {
     channel->state=SSH_CHANNEL_STATE_CLOSED;
+    SSH_PROBE3(channel_close, channel, channel->local_channel,
+        channel->remote_channel);
   }
 
   leave_function();
@@ -1121,12 +1658,375 @@ error:
   return rc;
 }
 
+/* the largest data a packet to the peer can carry */
+uint32_t channel_maxpacket_out(ssh_channel channel) {
+  uint32_t maxpacketlen;
+
+  /*
+   * Handle the max packet len from remote side, be nice
+   * 10 bytes for the headers. A larger size than the packets we can send
+   * is clamped.
+   */
+  maxpacketlen = channel->remote_maxpacket > SSH_CHANNEL_MAXPACKET_MAX ?
+    SSH_CHANNEL_MAXPACKET_MAX : channel->remote_maxpacket;
+
+  return maxpacketlen > 10 ? maxpacketlen - 10 : 1;
+}
+
+/* the header of a data packet of len bytes, returns its length */
+static uint32_t channel_data_header(ssh_channel channel, unsigned char *header,
+    uint32_t len, int is_stderr) {
+  uint32_t header_len = 0;
+  uint32_t value;
+
+  header[header_len++] = is_stderr ? SSH2_MSG_CHANNEL_EXTENDED_DATA :
+    SSH2_MSG_CHANNEL_DATA;
+  value = htonl(channel->remote_channel);
+  memcpy(header + header_len, &value, sizeof(uint32_t));
+  header_len += sizeof(uint32_t);
+  /* stderr message has an extra field */
+  if (is_stderr) {
+    value = htonl(SSH2_EXTENDED_DATA_STDERR);
+    memcpy(header + header_len, &value, sizeof(uint32_t));
+    header_len += sizeof(uint32_t);
+  }
+  value = htonl(len);
+  memcpy(header + header_len, &value, sizeof(uint32_t));
+  header_len += sizeof(uint32_t);
+
+  return header_len;
+}
+
+/* sends a data packet, within the window and the max packet size */
+static int channel_send_data(ssh_channel channel, const void *data,
+    uint32_t len, int is_stderr) {
+  ssh_session session = channel->session;
+  unsigned char header[1 + 4 * sizeof(uint32_t)];
+  uint32_t header_len;
+
+  header_len = channel_data_header(channel, header, len, is_stderr);
+
+  /* the data is copied only once, into the socket buffer if it blocks */
+  session->compress_stored = channel->compress_skip;
+  if (packet_send_payload(session, header, header_len, data, len) ==
+      SSH_ERROR) {
+    session->compress_stored = 0;
+    return SSH_ERROR;
+  }
+  session->compress_stored = 0;
+
+  SSH_LOG(session, SSH_LOG_RARE,
+      "channel_write wrote %ld bytes", (long int) len);
+
+  channel->remote_window -= len;
+  channel->stats.bytes_out += len;
+
+  return SSH_OK;
+}
+
+static uint32_t channel_queued(ssh_channel channel) {
+  uint32_t len = 0;
+
+  if (channel->stdout_queue != NULL) {
+    len += buffer_get_rest_len(channel->stdout_queue);
+  }
+  if (channel->stderr_queue != NULL) {
+    len += buffer_get_rest_len(channel->stderr_queue);
+  }
+
+  return len;
+}
+
+static void channel_queue_drop(ssh_channel channel) {
+  uint32_t len = channel_queued(channel);
+
+  if (len == 0) {
+    return;
+  }
+  SSH_LOG(channel->session, SSH_LOG_PROTOCOL,
+      "Dropping %lu bytes queued on channel %d:%d",
+      (unsigned long) len, channel->local_channel, channel->remote_channel);
+  channel->session->channel_queued -= len;
+  if (channel->stdout_queue != NULL) {
+    buffer_reinit(channel->stdout_queue);
+  }
+  if (channel->stderr_queue != NULL) {
+    buffer_reinit(channel->stderr_queue);
+  }
+  channel->sched_deficit = 0;
+}
+
+/*
+ * Sends the next packet queued on a channel, stdout first. Returns the
+ * bytes sent, SSH_ERROR on error.
+ */
+static int channel_queue_send(ssh_channel channel) {
+  ssh_buffer queue = channel->stdout_queue;
+  uint32_t len;
+
+  if (queue == NULL || buffer_get_rest_len(queue) == 0) {
+    queue = channel->stderr_queue;
+  }
+  len = buffer_get_rest_len(queue);
+  if (len > channel->remote_window) {
+    len = channel->remote_window;
+  }
+  if (len > channel_maxpacket_out(channel)) {
+    len = channel_maxpacket_out(channel);
+  }
+
+  if (channel_send_data(channel, buffer_get_rest(queue), len,
+        queue == channel->stderr_queue) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+  buffer_pass_bytes(queue, len);
+  channel->session->channel_queued -= len;
+
+  return len;
+}
+
+/* sends all the data queued on a channel, waiting for the window if needed */
+static int channel_queue_drain(ssh_channel channel) {
+  ssh_session session = channel->session;
+
+  while (channel_queued(channel) > 0) {
+    if (channel->state != SSH_CHANNEL_STATE_OPEN || session->alive == 0) {
+      channel_queue_drop(channel);
+      break;
+    }
+    if (channel->remote_window == 0) {
+      if (ssh_handle_packets(session, -1) == SSH_ERROR) {
+        return SSH_ERROR;
+      }
+      continue;
+    }
+    if (channel_queue_send(channel) == SSH_ERROR) {
+      return SSH_ERROR;
+    }
+  }
+  channel->sched_deficit = 0;
+
+  return SSH_OK;
+}
+
+/*
+ * Queues the data for the scheduler. A blocking session waits until the
+ * queue is short enough, like a direct write waits for the window.
+ */
+static int channel_queue(ssh_channel channel, const void *data,
+    uint32_t len, int is_stderr) {
+  ssh_session session = channel->session;
+  ssh_buffer *queue = is_stderr ? &channel->stderr_queue :
+    &channel->stdout_queue;
+
+  if (*queue == NULL) {
+    *queue = ssh_buffer_new();
+    if (*queue == NULL) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+  }
+  if (buffer_add_data(*queue, data, len) < 0) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  session->channel_queued += len;
+
+  if (ssh_channels_schedule(session) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+
+  while (ssh_is_blocking(session) &&
+      channel_queued(channel) > SSH_CHANNEL_QUEUE_MAX) {
+    if (channel->state != SSH_CHANNEL_STATE_OPEN || session->alive == 0) {
+      ssh_set_error(session, SSH_REQUEST_DENIED, "Remote channel is closed");
+      return SSH_ERROR;
+    }
+    if (ssh_handle_packets(session, -1) == SSH_ERROR) {
+      return SSH_ERROR;
+    }
+  }
+
+  return len;
+}
+
+/*
+ * One turn of a channel in the round: it sends up to its weight in
+ * quanta. The last packet may go over, the excess is taken from its next
+ * turn. Returns the bytes sent, SSH_ERROR on error.
+ */
+static int channel_sched_turn(ssh_channel channel) {
+  ssh_session session = channel->session;
+  int sent = 0;
+  int rc;
+
+  if (channel->state != SSH_CHANNEL_STATE_OPEN) {
+    channel_queue_drop(channel);
+    return 0;
+  }
+  if (channel_queued(channel) == 0) {
+    channel->sched_deficit = 0;
+    return 0;
+  }
+  if (channel->sched_deficit <= 0) {
+    channel->sched_deficit += channel_sched_weight[channel->priority] *
+      SSH_CHANNEL_SCHED_QUANTUM;
+  }
+
+  while (channel->sched_deficit > 0 && channel->remote_window > 0 &&
+      channel_queued(channel) > 0 &&
+      ssh_socket_buffered_out(session->socket) < SSH_CHANNEL_SCHED_BACKLOG) {
+    rc = channel_queue_send(channel);
+    if (rc == SSH_ERROR) {
+      return SSH_ERROR;
+    }
+    channel->sched_deficit -= rc;
+    sent += rc;
+  }
+  /* an idle channel doesn't save its share for later */
+  if (channel_queued(channel) == 0) {
+    channel->sched_deficit = 0;
+  }
+
+  return sent;
+}
+
+/**
+ * @internal
+ *
+ * @brief Sends the data queued on the channels of a session
+ *
+ * The channels take turns, in deficit round-robin weighted by their
+ * priority. The socket output is kept under SSH_CHANNEL_SCHED_BACKLOG so
+ * the data of a channel never waits behind more than a round of the others.
+ * Called when data is queued, when a window grows and when the socket has
+ * written its buffer.
+ *
+ * @returns SSH_OK, SSH_ERROR if a packet couldn't be sent.
+ */
+int ssh_channels_schedule(ssh_session session) {
+  ssh_channel channel;
+  ssh_channel start;
+  int progress;
+  int rc;
+
+  if (session == NULL || session->channel_queued == 0 ||
+      session->sched_running || session->socket == NULL ||
+      session->channels == NULL) {
+    return SSH_OK;
+  }
+  /* the queues wait for the new keys of a key re-exchange */
+  if (session->rekey_state != SSH_REKEY_STATE_NONE) {
+    return SSH_OK;
+  }
+  session->sched_running = 1;
+
+  if (session->sched_next == NULL) {
+    session->sched_next = session->channels;
+  }
+  channel = start = session->sched_next;
+  progress = 0;
+  while (session->channel_queued > 0) {
+    rc = channel_sched_turn(channel);
+    if (rc == SSH_ERROR) {
+      session->sched_running = 0;
+      return SSH_ERROR;
+    }
+    progress += rc;
+    if (ssh_socket_buffered_out(session->socket) >=
+        SSH_CHANNEL_SCHED_BACKLOG) {
+      /* a turn cut short goes on at the next call */
+      if (channel->sched_deficit <= 0 || channel_queued(channel) == 0) {
+        channel = channel->next;
+      }
+      break;
+    }
+    channel = channel->next;
+    if (channel == start) {
+      if (progress == 0) {
+        /* the rest waits for windows */
+        break;
+      }
+      progress = 0;
+    }
+  }
+  session->sched_next = channel;
+  session->sched_running = 0;
+
+  return SSH_OK;
+}
+
+/* calls the writable callback of a channel which has room for data */
+static void channel_writable(ssh_channel channel) {
+  ssh_session session = channel->session;
+  uint32_t window;
+
+  if (!ssh_callbacks_exists(channel->callbacks, channel_writable_function) ||
+      channel->state != SSH_CHANNEL_STATE_OPEN || channel->local_eof) {
+    return;
+  }
+  window = channel_write_window(channel);
+  if (window == 0 || ssh_socket_buffered_out(session->socket) >=
+      SSH_CHANNEL_SCHED_BACKLOG) {
+    return;
+  }
+  channel->callbacks->channel_writable_function(session, channel, window,
+      channel->callbacks->userdata);
+}
+
+/**
+ * @internal
+ *
+ * @brief Calls the writable callbacks of the channels which can take data
+ *
+ * Called when a window grows, for that channel only, and when the socket
+ * has written its buffer, for all of them.
+ *
+ * @param[in]  session  The session of the channels.
+ *
+ * @param[in]  channel  The channel whose window grew, NULL for all of them.
+ */
+void ssh_channels_writable(ssh_session session, ssh_channel channel) {
+  ssh_channel next;
+
+  if (session == NULL || session->writable_running ||
+      session->socket == NULL || session->channels == NULL) {
+    return;
+  }
+  session->writable_running = 1;
+
+  if (channel != NULL) {
+    channel_writable(channel);
+  } else {
+    channel = session->channels;
+    do {
+      next = channel->next;
+      channel_writable(channel);
+      channel = next;
+    } while (session->channels != NULL && channel != session->channels);
+  }
+  session->writable_running = 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Returns the window left to the data written on a channel, once
+ * its queue is sent.
+ */
+uint32_t channel_write_window(ssh_channel channel) {
+  uint32_t queued = channel_queued(channel);
+
+  return channel->remote_window > queued ? channel->remote_window - queued : 0;
+}
+
 int channel_write_common(ssh_channel channel, const void *data,
     uint32_t len, int is_stderr) {
   ssh_session session;
   int origlen = len;
   size_t effectivelen;
   size_t maxpacketlen;
+  int rc;
 
   if(channel == NULL) {
       return -1;
@@ -1138,11 +2038,7 @@ int channel_write_common(ssh_channel channel, const void *data,
   }
   enter_function();
 
-  /*
-   * Handle the max packet len from remote side, be nice
-   * 10 bytes for the headers
-   */
-  maxpacketlen = channel->remote_maxpacket - 10;
+  maxpacketlen = channel_maxpacket_out(channel);
 
   if (channel->local_eof) {
     ssh_set_error(session, SSH_REQUEST_DENIED,
@@ -1161,26 +2057,40 @@ int channel_write_common(ssh_channel channel, const void *data,
 
 #ifdef WITH_SSH1
   if (channel->version == 1) {
-    int rc = channel_write1(channel, data, len);
+    rc = channel_write1(channel, data, len);
     leave_function();
     return rc;
   }
 #endif
 
+  if (session->channel_scheduler) {
+    rc = channel_queue(channel, data, len, is_stderr);
+    leave_function();
+    return rc;
+  }
+
+  /* the packets of a large write are encrypted at once by a crypto pool */
+  pipeline_begin(session);
   while (len > 0) {
     if (channel->remote_window < len) {
-      ssh_log(session, SSH_LOG_PROTOCOL,
+      SSH_LOG(session, SSH_LOG_PROTOCOL,
           "Remote window is %d bytes. going to write %d bytes",
           channel->remote_window,
           len);
-      ssh_log(session, SSH_LOG_PROTOCOL,
+      SSH_LOG(session, SSH_LOG_PROTOCOL,
           "Waiting for a growing window message...");
+      /* the packets kept so far go out before waiting */
+      if (channel->remote_window == 0 &&
+          pipeline_flush(session) == SSH_ERROR) {
+        rc = SSH_ERROR;
+        goto end;
+      }
       /* What happens when the channel window is zero? */
       while(channel->remote_window == 0) {
         /* parse every incoming packet */
         if (ssh_handle_packets(session,-1) == SSH_ERROR) {
-          leave_function();
-          return SSH_ERROR;
+          rc = SSH_ERROR;
+          goto end;
         }
       }
       effectivelen = len > channel->remote_window ? channel->remote_window : len;
@@ -1188,73 +2098,153 @@ int channel_write_common(ssh_channel channel, const void *data,
       effectivelen = len;
     }
     effectivelen = effectivelen > maxpacketlen ? maxpacketlen : effectivelen;
-    if (buffer_add_u8(session->out_buffer, is_stderr ?
-				SSH2_MSG_CHANNEL_EXTENDED_DATA : SSH2_MSG_CHANNEL_DATA) < 0 ||
-        buffer_add_u32(session->out_buffer,
-          htonl(channel->remote_channel)) < 0) {
-        ssh_set_error_oom(session);
-        goto error;
-    }
-    /* stderr message has an extra field */
-    if (is_stderr && 
-        buffer_add_u32(session->out_buffer, htonl(SSH2_EXTENDED_DATA_STDERR)) < 0) {
-        ssh_set_error_oom(session);
-        goto error;
-    }
-    /* append payload data */
-    if (buffer_add_u32(session->out_buffer, htonl(effectivelen)) < 0 ||
-        buffer_add_data(session->out_buffer, data, effectivelen) < 0) {
-      ssh_set_error_oom(session);
-      goto error;
+    if (channel_send_data(channel, data, effectivelen, is_stderr) == SSH_ERROR) {
+      rc = SSH_ERROR;
+      goto end;
     }
 
-    if (packet_send(session) == SSH_ERROR) {
-      leave_function();
-      return SSH_ERROR;
-    }
-
-    ssh_log(session, SSH_LOG_RARE,
-        "channel_write wrote %ld bytes", (long int) effectivelen);
-
-    channel->remote_window -= effectivelen;
     len -= effectivelen;
     data = ((uint8_t*)data + effectivelen);
   }
+  rc = origlen;
 
+end:
+  if (pipeline_end(session) == SSH_ERROR) {
+    rc = SSH_ERROR;
+  }
   leave_function();
-  return origlen;
-error:
-  buffer_reinit(session->out_buffer);
+  return rc;
+}
 
-  leave_function();
-  return SSH_ERROR;
+struct channel_fill_struct {
+  const void *prefix;
+  uint32_t prefix_len;
+  packet_fill_callback fill;
+  void *userdata;
+};
+
+static int channel_fill_prefixed(void *dest, uint32_t len, void *userdata) {
+  struct channel_fill_struct *f = userdata;
+
+  memcpy(dest, f->prefix, f->prefix_len);
+
+  return f->fill((uint8_t *) dest + f->prefix_len, len - f->prefix_len,
+      f->userdata);
 }
 
 /**
- * @brief Blocking write on a channel.
+ * @internal
  *
- * @param[in]  channel  The channel to write to.
+ * @brief Write a prefix and data produced in place as one data packet.
  *
- * @param[in]  data     A pointer to the data to write.
+ * The data is written by fill straight into the buffer the packet is built
+ * in. The packet is only sent if it fits in the window and the maximum
+ * packet size without waiting, and if the channel writes directly (SSH2,
+ * no channel scheduler).
  *
- * @param[in]  len      The length of the buffer to write to.
+ * @param[in]  channel     The channel to write to.
  *
- * @return              The number of bytes written, SSH_ERROR on error.
+ * @param[in]  prefix      The start of the data.
  *
- * @see channel_read()
- */
-int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len) {
-  return channel_write_common(channel, data, len, 0);
-}
-
-/**
- * @brief Check if the channel is open or not.
+ * @param[in]  prefix_len  The length of the prefix.
  *
- * @param[in]  channel  The channel to check.
+ * @param[in]  len         The length of the data following the prefix.
  *
- * @return              0 if channel is closed, nonzero otherwise.
+ * @param[in]  fill        Writes the len bytes after the prefix.
  *
- * @see channel_is_closed()
+ * @param[in]  userdata    Userdata of fill.
+ *
+ * @return SSH_OK if the packet was sent, SSH_AGAIN if it can't be sent
+ *         this way and nothing was written, SSH_ERROR on error or if fill
+ *         failed (then without an error set and nothing written).
+ */
+int channel_write_fill(ssh_channel channel, const void *prefix,
+    uint32_t prefix_len, uint32_t len, packet_fill_callback fill,
+    void *userdata) {
+  struct channel_fill_struct f;
+  unsigned char header[1 + 4 * sizeof(uint32_t)];
+  ssh_session session;
+  uint32_t header_len;
+  uint32_t total;
+  int rc;
+
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  session = channel->session;
+  if (fill == NULL || (prefix == NULL && prefix_len > 0)) {
+    ssh_set_error_invalid(session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  if (channel->local_eof) {
+    ssh_set_error(session, SSH_REQUEST_DENIED,
+        "Can't write to channel %d:%d  after EOF was sent",
+        channel->local_channel,
+        channel->remote_channel);
+    return SSH_ERROR;
+  }
+  if (channel->state != SSH_CHANNEL_STATE_OPEN || channel->delayed_close != 0) {
+    ssh_set_error(session, SSH_REQUEST_DENIED, "Remote channel is closed");
+    return SSH_ERROR;
+  }
+
+  total = prefix_len + len;
+  if (total < len || channel->version == 1 || session->channel_scheduler ||
+      total > channel_maxpacket_out(channel) ||
+      total > channel->remote_window) {
+    return SSH_AGAIN;
+  }
+
+  enter_function();
+  f.prefix = prefix;
+  f.prefix_len = prefix_len;
+  f.fill = fill;
+  f.userdata = userdata;
+  header_len = channel_data_header(channel, header, total, 0);
+  session->compress_stored = channel->compress_skip;
+  rc = packet_send_payload_fill(session, header, header_len, total,
+      channel_fill_prefixed, &f);
+  session->compress_stored = 0;
+  if (rc == SSH_ERROR) {
+    leave_function();
+    return SSH_ERROR;
+  }
+
+  SSH_LOG(session, SSH_LOG_RARE,
+      "channel_write_fill wrote %ld bytes", (long int) total);
+  channel->remote_window -= total;
+  channel->stats.bytes_out += total;
+
+  leave_function();
+  return SSH_OK;
+}
+
+/**
+ * @brief Blocking write on a channel.
+ *
+ * @param[in]  channel  The channel to write to.
+ *
+ * @param[in]  data     A pointer to the data to write.
+ *
+ * @param[in]  len      The length of the buffer to write to.
+ *
+ * @return              The number of bytes written, SSH_ERROR on error.
+ *
+ * @see channel_read()
+ */
+int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len) {
+  return channel_write_common(channel, data, len, 0);
+}
+
+/**
+ * @brief Check if the channel is open or not.
+ *
+ * @param[in]  channel  The channel to check.
+ *
+ * @return              0 if channel is closed, nonzero otherwise.
+ *
+ * @see channel_is_closed()
  */
 int ssh_channel_is_open(ssh_channel channel) {
     if(channel == NULL) {
@@ -1317,6 +2307,263 @@ void ssh_channel_set_blocking(ssh_channel channel, int blocking) {
   channel->blocking = (blocking == 0 ? 0 : 1);
 }
 
+/**
+ * @brief Set the window granted to the peer on a channel.
+ *
+ * The defaults come from the SSH_OPTIONS_CHANNEL_WINDOW and
+ * SSH_OPTIONS_CHANNEL_WINDOW_MAX options of the session. The window given
+ * when the channel is opened is half of it, so it must be set before.
+ *
+ * @param[in]  channel  The channel to use.
+ *
+ * @param[in]  window   The window size.
+ *
+ * @param[in]  max      The size up to which the window is auto-tuned, 0 for a
+ *                      fixed window.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_options_set()
+ */
+int ssh_channel_set_window(ssh_channel channel, uint32_t window,
+    uint32_t max) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  if (window == 0) {
+    ssh_set_error_invalid(channel->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  channel->window_size = window;
+  channel->window_max = max;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Get the window granted to the peer when it's grown, which the
+ * auto-tuning may have raised.
+ *
+ * @param[in]  channel  The channel to use.
+ *
+ * @return              The window size, 0 on error.
+ */
+uint32_t ssh_channel_get_window(ssh_channel channel) {
+  if (channel == NULL) {
+    return 0;
+  }
+
+  return channel->window_size;
+}
+
+/**
+ * @brief Get the window granted by the peer: what can be written on the
+ * channel without waiting for it to grow.
+ *
+ * @param[in]  channel  The channel to use.
+ *
+ * @return              The number of bytes, 0 on error.
+ */
+uint32_t ssh_channel_window_size(ssh_channel channel) {
+  if (channel == NULL) {
+    return 0;
+  }
+
+  return channel->remote_window;
+}
+
+/**
+ * @brief Get the counters of a channel.
+ *
+ * The counters start when the channel is created and only grow.
+ *
+ * @param[in]  channel  The channel to use.
+ *
+ * @param[out] stats    The structure to fill.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_session_get_stats()
+ */
+int ssh_channel_get_stats(ssh_channel channel,
+    struct ssh_channel_stats_struct *stats) {
+  if (channel == NULL || stats == NULL) {
+    return SSH_ERROR;
+  }
+
+  *stats = channel->stats;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Set when the window adjusts of a channel are sent.
+ *
+ * An adjust is sent when the window left to the peer falls under the
+ * threshold. When they are coalesced, the adjusts of the reads made before
+ * the session polls again go in a single packet, sent before the session
+ * waits: the peer doesn't stall on them. The defaults come from the
+ * SSH_OPTIONS_CHANNEL_WINDOW_THRESHOLD and SSH_OPTIONS_CHANNEL_WINDOW_COALESCE
+ * options of the session.
+ *
+ * @param[in]  channel   The channel to use.
+ *
+ * @param[in]  threshold The percentage of the window, from 1 to 100.
+ *
+ * @param[in]  coalesce  Whether the adjusts are coalesced.
+ *
+ * @return               SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_channel_set_window_strategy(ssh_channel channel, int threshold,
+    int coalesce) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  if (threshold < 1 || threshold > 100) {
+    ssh_set_error_invalid(channel->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  channel->window_threshold = threshold;
+  channel->window_coalesce = coalesce ? 1 : 0;
+  if (!channel->window_coalesce && channel->window_pending != 0) {
+    channel->session->channel_windows_pending = 1;
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Set the priority class of a channel for the scheduler.
+ *
+ * With the SSH_OPTIONS_CHANNEL_SCHEDULER option, the channels with queued
+ * data take turns: an interactive channel sends 16 times the share of a bulk
+ * channel in a round, a default channel 4 times. The data of a shell then
+ * doesn't wait behind a transfer.
+ *
+ * @param[in]  channel  The channel to use.
+ *
+ * @param[in]  priority One of the ssh_channel_priority_e values.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_channel_set_priority(ssh_channel channel,
+    enum ssh_channel_priority_e priority) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  if ((int) priority < 0 || priority > SSH_CHANNEL_PRIORITY_BULK) {
+    ssh_set_error_invalid(channel->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  channel->priority = priority;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Turn the compression on or off for the data of a channel.
+ *
+ * The compression streams are shared by the whole session, so the data of
+ * a channel without compression is sent in stored blocks of the stream.
+ * It saves the time spent on data which is already compressed, like the
+ * files of an sftp transfer. The compression is on by default, see also
+ * SSH_OPTIONS_COMPRESSION_SKIP.
+ *
+ * @param[in]  channel  The channel to use.
+ *
+ * @param[in]  enabled  0 to send the data as is, 1 to compress it.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_channel_set_compression(ssh_channel channel, int enabled) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+
+  channel->compress_skip = enabled ? 0 : 1;
+
+  return SSH_OK;
+}
+
+/**
+ * @internal
+ *
+ * @brief Turn the compression off on a channel whose type or subsystem is
+ * listed in the SSH_OPTIONS_COMPRESSION_SKIP option.
+ *
+ * @param[in]  channel  The channel.
+ *
+ * @param[in]  name     The type of the channel or its subsystem.
+ */
+void channel_compression_check(ssh_channel channel, const char *name) {
+  ssh_session session = channel->session;
+  const char *skip = session->compression_skip;
+
+  if (skip == NULL || name == NULL ||
+      match_hostname(name, skip, strlen(skip)) != 1) {
+    return;
+  }
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
+      "Sending the data of channel %d (%s) without compression",
+      channel->local_channel, name);
+  channel->compress_skip = 1;
+}
+
+int ssh_channel_set_unbuffered(ssh_channel channel, int unbuffered) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+
+  channel->unbuffered = unbuffered ? 1 : 0;
+
+  return SSH_OK;
+}
+
+int ssh_channel_consume(ssh_channel channel, uint32_t len) {
+  ssh_session session;
+  int rc = SSH_OK;
+
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  session = channel->session;
+
+  enter_function();
+  if (len > channel->window_held) {
+    len = channel->window_held;
+  }
+  channel->window_held -= len;
+  if (channel->state == SSH_CHANNEL_STATE_OPEN &&
+      channel->local_window + channel->window_held <
+      channel_window_low(channel)) {
+    rc = grow_window(session, channel, 0);
+  }
+
+  leave_function();
+  return rc;
+}
+
+/*
+ * Gives the answer of a request to the callback. A nonblocking request isn't
+ * waited for anymore then: the channel can send the next one.
+ */
+static void channel_request_done(ssh_channel channel) {
+  if (!ssh_callbacks_exists(channel->callbacks,
+        channel_request_response_function)) {
+    return;
+  }
+  channel->callbacks->channel_request_response_function(channel->session,
+      channel, channel->request_state == SSH_CHANNEL_REQ_STATE_ACCEPTED,
+      channel->callbacks->userdata);
+  if (channel->request_async) {
+    channel->request_async = 0;
+    channel->request_state = SSH_CHANNEL_REQ_STATE_NONE;
+  }
+}
+
 /**
  * @internal
  *
@@ -1331,20 +2578,21 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_success){
   enter_function();
   channel=channel_from_msg(session,packet);
   if (channel == NULL) {
-    ssh_log(session, SSH_LOG_FUNCTIONS, "%s", ssh_get_error(session));
+    SSH_LOG(session, SSH_LOG_FUNCTIONS, "%s", ssh_get_error(session));
     leave_function();
     return SSH_PACKET_USED;
   }
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Received SSH_CHANNEL_SUCCESS on channel (%d:%d)",
       channel->local_channel,
       channel->remote_channel);
   if(channel->request_state != SSH_CHANNEL_REQ_STATE_PENDING){
-    ssh_log(session, SSH_LOG_RARE, "SSH_CHANNEL_SUCCESS received in incorrect state %d",
+    SSH_LOG(session, SSH_LOG_RARE, "SSH_CHANNEL_SUCCESS received in incorrect state %d",
         channel->request_state);
   } else {
     channel->request_state=SSH_CHANNEL_REQ_STATE_ACCEPTED;
+    channel_request_done(channel);
   }
 
   leave_function();
@@ -1365,20 +2613,21 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_failure){
   enter_function();
   channel=channel_from_msg(session,packet);
   if (channel == NULL) {
-    ssh_log(session, SSH_LOG_FUNCTIONS, "%s", ssh_get_error(session));
+    SSH_LOG(session, SSH_LOG_FUNCTIONS, "%s", ssh_get_error(session));
     leave_function();
     return SSH_PACKET_USED;
   }
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Received SSH_CHANNEL_FAILURE on channel (%d:%d)",
       channel->local_channel,
       channel->remote_channel);
   if(channel->request_state != SSH_CHANNEL_REQ_STATE_PENDING){
-    ssh_log(session, SSH_LOG_RARE, "SSH_CHANNEL_FAILURE received in incorrect state %d",
+    SSH_LOG(session, SSH_LOG_RARE, "SSH_CHANNEL_FAILURE received in incorrect state %d",
         channel->request_state);
   } else {
     channel->request_state=SSH_CHANNEL_REQ_STATE_DENIED;
+    channel_request_done(channel);
   }
   leave_function();
   return SSH_PACKET_USED;
@@ -1387,30 +2636,25 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_failure){
 static int channel_request(ssh_channel channel, const char *request,
     ssh_buffer buffer, int reply) {
   ssh_session session = channel->session;
-  ssh_string req = NULL;
   int rc = SSH_ERROR;
 
   enter_function();
-  if(channel->request_state != SSH_CHANNEL_REQ_STATE_NONE){
-  	ssh_set_error(session,SSH_REQUEST_DENIED,"channel_request_* used in incorrect state");
-  	leave_function();
-  	return SSH_ERROR;
-  }
-
-  req = ssh_string_from_char(request);
-  if (req == NULL) {
-    ssh_set_error_oom(session);
-    goto error;
+  switch (channel->request_state) {
+    case SSH_CHANNEL_REQ_STATE_NONE:
+      break;
+    case SSH_CHANNEL_REQ_STATE_PENDING:
+      /* called again by a nonblocking session */
+      goto pending;
+    default:
+      /* answered since */
+      goto end;
   }
 
-  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_REQUEST) < 0 ||
-      buffer_add_u32(session->out_buffer, htonl(channel->remote_channel)) < 0 ||
-      buffer_add_ssh_string(session->out_buffer, req) < 0 ||
-      buffer_add_u8(session->out_buffer, reply == 0 ? 0 : 1) < 0) {
+  if (buffer_pack(session->out_buffer, "bdsb", SSH2_MSG_CHANNEL_REQUEST,
+        channel->remote_channel, request, reply == 0 ? 0 : 1) < 0) {
     ssh_set_error_oom(session);
     goto error;
   }
-  ssh_string_free(req);
 
   if (buffer != NULL) {
     if (buffer_add_data(session->out_buffer, buffer_get_rest(buffer),
@@ -1425,16 +2669,37 @@ static int channel_request(ssh_channel channel, const char *request,
     return rc;
   }
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Sent a SSH_MSG_CHANNEL_REQUEST %s", request);
   if (reply == 0) {
     channel->request_state = SSH_CHANNEL_REQ_STATE_NONE;
     leave_function();
     return SSH_OK;
   }
+  channel->request_async = 0;
+
+pending:
   while(channel->request_state == SSH_CHANNEL_REQ_STATE_PENDING){
-    ssh_handle_packets(session,-1);
+    if (ssh_handle_packets(session, ssh_is_blocking(session) ? -1 : 0) ==
+        SSH_ERROR || session->alive == 0) {
+      channel->request_state = SSH_CHANNEL_REQ_STATE_ERROR;
+      break;
+    }
+    if (channel->request_state == SSH_CHANNEL_REQ_STATE_PENDING &&
+        !ssh_is_blocking(session)) {
+      /* the answer goes to the channel_request_response_function callback */
+      channel->request_async = 1;
+      leave_function();
+      return SSH_AGAIN;
+    }
+  }
+  if (channel->request_state == SSH_CHANNEL_REQ_STATE_NONE) {
+    /* the callback got the answer */
+    leave_function();
+    return SSH_OK;
   }
+
+end:
   /* we received something */
   switch (channel->request_state){
     case SSH_CHANNEL_REQ_STATE_ERROR:
@@ -1446,7 +2711,7 @@ static int channel_request(ssh_channel channel, const char *request,
       rc=SSH_ERROR;
       break;
     case SSH_CHANNEL_REQ_STATE_ACCEPTED:
-      ssh_log(session, SSH_LOG_PROTOCOL,
+      SSH_LOG(session, SSH_LOG_PROTOCOL,
           "Channel request %s success",request);
       rc=SSH_OK;
       break;
@@ -1462,7 +2727,6 @@ static int channel_request(ssh_channel channel, const char *request,
   return rc;
 error:
   buffer_reinit(session->out_buffer);
-  ssh_string_free(req);
 
   leave_function();
   return rc;
@@ -1479,12 +2743,14 @@ error:
  *
  * @param[in]  row      The number of rows.
  *
- * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ * @return              SSH_OK on success, SSH_ERROR if an error occured,
+ *                      SSH_AGAIN if the session is nonblocking and the
+ *                      answer is pending (call it again or see the
+ *                      ssh_channel_callbacks_struct).
  */
 int ssh_channel_request_pty_size(ssh_channel channel, const char *terminal,
     int col, int row) {
   ssh_session session = channel->session;
-  ssh_string term = NULL;
   ssh_buffer buffer = NULL;
   int rc = SSH_ERROR;
 
@@ -1510,19 +2776,9 @@ int ssh_channel_request_pty_size(ssh_channel channel, const char *terminal,
     goto error;
   }
 
-  term = ssh_string_from_char(terminal);
-  if (term == NULL) {
-    ssh_set_error_oom(session);
-    goto error;
-  }
-
-  if (buffer_add_ssh_string(buffer, term) < 0 ||
-      buffer_add_u32(buffer, htonl(col)) < 0 ||
-      buffer_add_u32(buffer, htonl(row)) < 0 ||
-      buffer_add_u32(buffer, 0) < 0 ||
-      buffer_add_u32(buffer, 0) < 0 ||
-      buffer_add_u32(buffer, htonl(1)) < 0 || /* Add a 0byte string */
-      buffer_add_u8(buffer, 0) < 0) {
+  /* the terminal modes are a string holding only TTY_OP_END */
+  if (buffer_pack(buffer, "sdddddb", terminal, (uint32_t) col,
+        (uint32_t) row, 0, 0, 1, 0) < 0) {
     ssh_set_error_oom(session);
     goto error;
   }
@@ -1530,7 +2786,6 @@ int ssh_channel_request_pty_size(ssh_channel channel, const char *terminal,
   rc = channel_request(channel, "pty-req", buffer, 1);
 error:
   ssh_buffer_free(buffer);
-  ssh_string_free(term);
 
   leave_function();
   return rc;
@@ -1606,7 +2861,10 @@ error:
  *
  * @param[in]  channel  The channel to send the request.
  *
- * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ * @return              SSH_OK on success, SSH_ERROR if an error occured,
+ *                      SSH_AGAIN if the session is nonblocking and the
+ *                      answer is pending (call it again or see the
+ *                      ssh_channel_callbacks_struct).
  */
 int ssh_channel_request_shell(ssh_channel channel) {
     if(channel == NULL) {
@@ -1627,7 +2885,10 @@ int ssh_channel_request_shell(ssh_channel channel) {
  *
  * @param[in]  subsys   The subsystem to request (for example "sftp").
  *
- * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ * @return              SSH_OK on success, SSH_ERROR if an error occured,
+ *                      SSH_AGAIN if the session is nonblocking and the
+ *                      answer is pending (call it again or see the
+ *                      ssh_channel_callbacks_struct).
  *
  * @warning You normally don't have to call it for sftp, see sftp_new().
  */
@@ -1661,6 +2922,7 @@ int ssh_channel_request_subsystem(ssh_channel channel, const char *subsys) {
     goto error;
   }
 
+  channel_compression_check(channel, subsys);
   rc = channel_request(channel, "subsystem", buffer, 1);
 error:
   ssh_buffer_free(buffer);
@@ -1763,21 +3025,16 @@ error:
 
 static ssh_channel ssh_channel_accept(ssh_session session, int channeltype,
     int timeout_ms) {
-#ifndef _WIN32
-  static const struct timespec ts = {
-    .tv_sec = 0,
-    .tv_nsec = 50000000 /* 50ms */
-  };
-#endif
   ssh_message msg = NULL;
   ssh_channel channel = NULL;
   struct ssh_iterator *iterator;
-  int t;
-
-  for (t = timeout_ms; t >= 0; t -= 50)
-  {
-    ssh_handle_packets(session,50);
+  uint64_t start;
+  uint64_t elapsed;
+  int polled = 0;
+  int timeout;
 
+  start = ssh_timestamp_ms();
+  for (;;) {
     if (session->ssh_message_list) {
       iterator = ssh_list_get_iterator(session->ssh_message_list);
       while (iterator) {
@@ -1792,13 +3049,21 @@ static ssh_channel ssh_channel_accept(ssh_session session, int channeltype,
         iterator = iterator->next;
       }
     }
-    if(t>0){
-#ifdef _WIN32
-      Sleep(50); /* 50ms */
-#else
-      nanosleep(&ts, NULL);
-#endif
+
+    /* wait for the next packets rather than for a fixed delay */
+    timeout = -1;
+    if (timeout_ms >= 0) {
+      elapsed = ssh_timestamp_ms() - start;
+      if (polled && elapsed >= (uint64_t) timeout_ms) {
+        break;
+      }
+      timeout = elapsed < (uint64_t) timeout_ms ?
+        timeout_ms - (int) elapsed : 0;
+    }
+    if (ssh_handle_packets(session, timeout) == SSH_ERROR) {
+      return NULL;
     }
+    polled = 1;
   }
 
   ssh_set_error(session, SSH_NO_ERROR, "No channel request of this type from server");
@@ -1810,15 +3075,34 @@ static ssh_channel ssh_channel_accept(ssh_session session, int channeltype,
  *
  * @param[in]  channel  An x11-enabled session channel.
  *
- * @param[in]  timeout_ms Timeout in milliseconds.
+ * @param[in]  timeout_ms Timeout in milliseconds, a negative value waits
+ *                        until the request arrives.
  *
  * @return              A newly created channel, or NULL if no X11 request from
  *                      the server.
+ *
+ * @see ssh_callbacks_struct::channel_open_request_function
  */
 ssh_channel ssh_channel_accept_x11(ssh_channel channel, int timeout_ms) {
   return ssh_channel_accept(channel->session, SSH_CHANNEL_X11, timeout_ms);
 }
 
+/* gives the answer of a global request to the callback, like
+ * channel_request_done() */
+static void global_request_done(ssh_session session) {
+  if (!ssh_callbacks_exists(session->callbacks,
+        global_request_response_function)) {
+    return;
+  }
+  session->callbacks->global_request_response_function(session,
+      session->global_req_state == SSH_CHANNEL_REQ_STATE_ACCEPTED,
+      session->callbacks->userdata);
+  if (session->global_req_async) {
+    session->global_req_async = 0;
+    session->global_req_state = SSH_CHANNEL_REQ_STATE_NONE;
+  }
+}
+
 /**
  * @internal
  *
@@ -1828,16 +3112,26 @@ ssh_channel ssh_channel_accept_x11(ssh_channel channel, int timeout_ms) {
 SSH_PACKET_CALLBACK(ssh_request_success){
   (void)type;
   (void)user;
-  (void)packet;
   enter_function();
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Received SSH_REQUEST_SUCCESS");
+  if (ssh_keepalive_reply(session)) {
+    leave_function();
+    return SSH_PACKET_USED;
+  }
   if(session->global_req_state != SSH_CHANNEL_REQ_STATE_PENDING){
-    ssh_log(session, SSH_LOG_RARE, "SSH_REQUEST_SUCCESS received in incorrect state %d",
+    SSH_LOG(session, SSH_LOG_RARE, "SSH_REQUEST_SUCCESS received in incorrect state %d",
         session->global_req_state);
   } else {
+    /* the port allocated for a tcpip-forward on port 0 */
+    if (buffer_get_u32(packet, &session->global_req_port) == sizeof(uint32_t)) {
+      session->global_req_port = ntohl(session->global_req_port);
+    } else {
+      session->global_req_port = 0;
+    }
     session->global_req_state=SSH_CHANNEL_REQ_STATE_ACCEPTED;
+    global_request_done(session);
   }
 
   leave_function();
@@ -1856,13 +3150,18 @@ SSH_PACKET_CALLBACK(ssh_request_denied){
   (void)packet;
   enter_function();
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Received SSH_REQUEST_FAILURE");
-  if(session->global_req_state != SSH_CHANNEL_REQ_STATE_PENDING){
-    ssh_log(session, SSH_LOG_RARE, "SSH_REQUEST_DENIED received in incorrect state %d",
+  if (ssh_keepalive_reply(session)) {
+    leave_function();
+    return SSH_PACKET_USED;
+  }
+  if(session->global_req_state != SSH_CHANNEL_REQ_STATE_PENDING){
+    SSH_LOG(session, SSH_LOG_RARE, "SSH_REQUEST_DENIED received in incorrect state %d",
         session->global_req_state);
   } else {
     session->global_req_state=SSH_CHANNEL_REQ_STATE_DENIED;
+    global_request_done(session);
   }
 
   leave_function();
@@ -1888,29 +3187,24 @@ SSH_PACKET_CALLBACK(ssh_request_denied){
  */
 static int global_request(ssh_session session, const char *request,
     ssh_buffer buffer, int reply) {
-  ssh_string req = NULL;
   int rc = SSH_ERROR;
 
   enter_function();
-  if(session->global_req_state != SSH_CHANNEL_REQ_STATE_NONE){
-    ssh_set_error(session,SSH_FATAL,"Invalid state in start of global_request()");
-    leave_function();
-    return rc;
-  }
-  req = ssh_string_from_char(request);
-  if (req == NULL) {
-    ssh_set_error_oom(session);
-    goto error;
-  }
-
-  if (buffer_add_u8(session->out_buffer, SSH2_MSG_GLOBAL_REQUEST) < 0 ||
-      buffer_add_ssh_string(session->out_buffer, req) < 0 ||
-      buffer_add_u8(session->out_buffer, reply == 0 ? 0 : 1) < 0) {
+  switch (session->global_req_state) {
+    case SSH_CHANNEL_REQ_STATE_NONE:
+      break;
+    case SSH_CHANNEL_REQ_STATE_PENDING:
+      /* called again by a nonblocking session */
+      goto pending;
+    default:
+      /* answered since */
+      goto end;
+  }
+  if (buffer_pack(session->out_buffer, "bsb", SSH2_MSG_GLOBAL_REQUEST,
+        request, reply == 0 ? 0 : 1) < 0) {
     ssh_set_error_oom(session);
     goto error;
   }
-  ssh_string_free(req);
-  req=NULL;
 
   if (buffer != NULL) {
     if (buffer_add_data(session->out_buffer, buffer_get_rest(buffer),
@@ -1925,27 +3219,44 @@ static int global_request(ssh_session session, const char *request,
     return rc;
   }
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Sent a SSH_MSG_GLOBAL_REQUEST %s", request);
   if (reply == 0) {
     session->global_req_state=SSH_CHANNEL_REQ_STATE_NONE;
     leave_function();
     return SSH_OK;
   }
+  session->global_req_async = 0;
+
+pending:
   while(session->global_req_state == SSH_CHANNEL_REQ_STATE_PENDING){
-    rc=ssh_handle_packets(session,-1);
-    if(rc==SSH_ERROR){
+    rc=ssh_handle_packets(session, ssh_is_blocking(session) ? -1 : 0);
+    if(rc==SSH_ERROR || session->alive == 0){
       session->global_req_state = SSH_CHANNEL_REQ_STATE_ERROR;
       break;
     }
+    if (session->global_req_state == SSH_CHANNEL_REQ_STATE_PENDING &&
+        !ssh_is_blocking(session)) {
+      /* the answer goes to the global_request_response_function callback */
+      session->global_req_async = 1;
+      leave_function();
+      return SSH_AGAIN;
+    }
+  }
+  if (session->global_req_state == SSH_CHANNEL_REQ_STATE_NONE) {
+    /* the callback got the answer */
+    leave_function();
+    return SSH_OK;
   }
+
+end:
   switch(session->global_req_state){
     case SSH_CHANNEL_REQ_STATE_ACCEPTED:
-      ssh_log(session, SSH_LOG_PROTOCOL, "Global request %s success",request);
+      SSH_LOG(session, SSH_LOG_PROTOCOL, "Global request %s success",request);
       rc=SSH_OK;
       break;
     case SSH_CHANNEL_REQ_STATE_DENIED:
-      ssh_log(session, SSH_LOG_PACKET,
+      SSH_LOG(session, SSH_LOG_PACKET,
           "Global request %s failed", request);
       ssh_set_error(session, SSH_REQUEST_DENIED,
           "Global request %s failed", request);
@@ -1958,11 +3269,11 @@ static int global_request(ssh_session session, const char *request,
       break;
 
   }
+  session->global_req_state = SSH_CHANNEL_REQ_STATE_NONE;
 
   leave_function();
   return rc;
 error:
-  ssh_string_free(req);
   leave_function();
   return rc;
 }
@@ -1984,13 +3295,15 @@ error:
  * @param[in]  bound_port The pointer to get actual bound port. Pass NULL to
  *                        ignore.
  *
- * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ * @return              SSH_OK on success, SSH_ERROR if an error occured,
+ *                      SSH_AGAIN if the session is nonblocking and the
+ *                      answer is pending (call it again or see the
+ *                      ssh_callbacks_struct).
  */
 int ssh_forward_listen(ssh_session session, const char *address, int port, int *bound_port) {
   ssh_buffer buffer = NULL;
   ssh_string addr = NULL;
   int rc = SSH_ERROR;
-  uint32_t tmp;
 
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
@@ -2013,8 +3326,7 @@ int ssh_forward_listen(ssh_session session, const char *address, int port, int *
   rc = global_request(session, "tcpip-forward", buffer, 1);
 
   if (rc == SSH_OK && port == 0 && bound_port) {
-    buffer_get_u32(session->in_buffer, &tmp);
-    *bound_port = ntohl(tmp);
+    *bound_port = session->global_req_port;
   }
 
 error:
@@ -2028,10 +3340,13 @@ error:
  *
  * @param[in]  session    The ssh session to use.
  *
- * @param[in]  timeout_ms A timeout in milliseconds.
+ * @param[in]  timeout_ms A timeout in milliseconds, a negative value waits
+ *                        until the request arrives.
  *
  * @return Newly created channel, or NULL if no incoming channel request from
  *         the server
+ *
+ * @see ssh_callbacks_struct::channel_open_request_function
  */
 ssh_channel ssh_forward_accept(ssh_session session, int timeout_ms) {
   return ssh_channel_accept(session, SSH_CHANNEL_FORWARDED_TCPIP, timeout_ms);
@@ -2047,7 +3362,10 @@ ssh_channel ssh_forward_accept(ssh_session session, int timeout_ms) {
  *
  * @param[in]  port     The bound port on the server.
  *
- * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ * @return              SSH_OK on success, SSH_ERROR if an error occured,
+ *                      SSH_AGAIN if the session is nonblocking and the
+ *                      answer is pending (call it again or see the
+ *                      ssh_callbacks_struct).
  */
 int ssh_forward_cancel(ssh_session session, const char *address, int port) {
   ssh_buffer buffer = NULL;
@@ -2089,7 +3407,10 @@ error:
  *
  * @param[in]  value    The value to set.
  *
- * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ * @return              SSH_OK on success, SSH_ERROR if an error occured,
+ *                      SSH_AGAIN if the session is nonblocking and the
+ *                      answer is pending (call it again or see the
+ *                      ssh_channel_callbacks_struct).
  *
  * @warning Some environment variables may be refused by security reasons.
  */
@@ -2153,7 +3474,10 @@ error:
  * @param[in]  cmd      The command to execute
  *                      (e.g. "ls ~/ -al | grep -i reports").
  *
- * @return              SSH_OK on success, SSH_ERROR if an error occured.
+ * @return              SSH_OK on success, SSH_ERROR if an error occured,
+ *                      SSH_AGAIN if the session is nonblocking and the
+ *                      answer is pending (call it again or see the
+ *                      ssh_channel_callbacks_struct).
  *
  * @code
  *   rc = channel_request_exec(channel, "ps aux");
@@ -2378,12 +3702,44 @@ int channel_read_buffer(ssh_channel channel, ssh_buffer buffer, uint32_t count,
  *          block until count bytes have been read.
  * @warning The read function using a buffer has been renamed to
  *          channel_read_buffer().
+ *
+ * @see ssh_channel_read_timeout()
  */
 int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_stderr) {
-  ssh_session session;
-  ssh_buffer stdbuf;
-  uint32_t len;
+  return ssh_channel_read_timeout(channel, dest, count, is_stderr, -1);
+}
 
+/* the callback of ssh_channel_read_timeout(): the data is copied */
+static int channel_read_copy(const void *data, uint32_t len, void *userdata) {
+  memcpy(userdata, data, len);
+  return len;
+}
+
+/**
+ * @brief Reads data from a channel, waiting for it at most a given time.
+ *
+ * The session is polled by its poll context while waiting, so the other
+ * descriptors and sessions of an event keep being served. To wait for the
+ * first of many channels, use a ssh_channel_set instead.
+ *
+ * @param[in]  channel  The channel to read from.
+ *
+ * @param[in]  dest     The destination buffer which will get the data.
+ *
+ * @param[in]  count    The count of bytes to be read.
+ *
+ * @param[in]  is_stderr A boolean value to mark reading from the stderr flow.
+ *
+ * @param[in]  timeout  The time to wait in milliseconds, -1 to wait until
+ *                      data or the end of file arrives.
+ *
+ * @return              The number of bytes read, 0 on end of file, SSH_AGAIN
+ *                      if nothing arrived in time or SSH_ERROR on error.
+ *
+ * @see ssh_channel_set_select()
+ */
+int ssh_channel_read_timeout(ssh_channel channel, void *dest, uint32_t count,
+    int is_stderr, int timeout) {
   if(channel == NULL) {
       return SSH_ERROR;
   }
@@ -2392,8 +3748,95 @@ int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_std
       return SSH_ERROR;
   }
 
+  return channel_read_in_place(channel, count, is_stderr, timeout,
+      channel_read_copy, dest);
+}
+
+/**
+ * @brief Reads data from a channel where it was received, without copying
+ * it.
+ *
+ * This is ssh_channel_read_timeout() with the data given to a callback in
+ * the buffer of the channel: it can be parsed or written elsewhere in
+ * place. What the callback doesn't take stays buffered for the next read.
+ *
+ * @param[in]  channel  The channel to read from.
+ *
+ * @param[in]  count    The count of bytes to be read.
+ *
+ * @param[in]  is_stderr A boolean value to mark reading from the stderr flow.
+ *
+ * @param[in]  timeout  The time to wait in milliseconds, -1 to wait until
+ *                      data or the end of file arrives.
+ *
+ * @param[in]  take     Gets up to count bytes, valid during the call only.
+ *                      Returns the number of bytes it took, or -1 to fail
+ *                      the read.
+ *
+ * @param[in]  userdata Userdata of take.
+ *
+ * @return              The number of bytes taken, 0 on end of file, SSH_AGAIN
+ *                      if nothing arrived in time or SSH_ERROR on error, also
+ *                      if take failed.
+ *
+ * @see ssh_channel_read_timeout()
+ */
+int ssh_channel_read_in_place(ssh_channel channel, uint32_t count,
+    int is_stderr, int timeout, ssh_channel_read_callback take,
+    void *userdata) {
+  if (channel == NULL) {
+    return SSH_ERROR;
+  }
+  if (take == NULL) {
+    ssh_set_error_invalid(channel->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  return channel_read_in_place(channel, count, is_stderr, timeout, take,
+      userdata);
+}
+
+/**
+ * @internal
+ *
+ * @brief Reads data from a channel where it was received.
+ *
+ * This is ssh_channel_read_timeout() with the data given to a callback in
+ * the buffer of the channel instead of being copied.
+ *
+ * @param[in]  channel  The channel to read from.
+ *
+ * @param[in]  count    The count of bytes to be read.
+ *
+ * @param[in]  is_stderr A boolean value to mark reading from the stderr flow.
+ *
+ * @param[in]  timeout  The time to wait in milliseconds, -1 to wait until
+ *                      data or the end of file arrives.
+ *
+ * @param[in]  take     Takes up to count bytes, returns the number of bytes
+ *                      it took, or -1 on error. The rest stays buffered.
+ *
+ * @param[in]  userdata Userdata of take.
+ *
+ * @return              The number of bytes taken, 0 on end of file, SSH_AGAIN
+ *                      if nothing arrived in time or SSH_ERROR on error, also
+ *                      if take failed.
+ */
+int channel_read_in_place(ssh_channel channel, uint32_t count, int is_stderr,
+    int timeout, channel_read_callback take, void *userdata) {
+  ssh_session session;
+  ssh_buffer stdbuf;
+  uint64_t start = 0;
+  uint64_t elapsed;
+  uint32_t len;
+  int wait = -1;
+  int rc;
+
+  if(channel == NULL) {
+      return SSH_ERROR;
+  }
+
   session = channel->session;
-  stdbuf = channel->stdout_buffer;
   enter_function();
 
   if (count == 0) {
@@ -2401,32 +3844,33 @@ int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_std
     return 0;
   }
 
-  if (is_stderr) {
-    stdbuf=channel->stderr_buffer;
-  }
-
   /*
    * We may have problem if the window is too small to accept as much data
    * as asked
    */
-  ssh_log(session, SSH_LOG_PROTOCOL,
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
       "Read (%d) buffered : %d bytes. Window: %d",
       count,
-      buffer_get_rest_len(stdbuf),
+      channel_pending(channel, is_stderr),
       channel->local_window);
 
-  if (count > buffer_get_rest_len(stdbuf) + channel->local_window) {
-    if (grow_window(session, channel, count - buffer_get_rest_len(stdbuf)) < 0) {
+  if (count > channel_pending(channel, is_stderr) + channel->local_window) {
+    if (grow_window(session, channel,
+          count - channel_pending(channel, is_stderr)) < 0) {
       leave_function();
       return -1;
     }
   }
 
+  if (timeout >= 0) {
+    start = ssh_timestamp_ms();
+  }
+
   /* block reading until at least one byte is read 
   *  and ignore the trivial case count=0
   */
-  while (buffer_get_rest_len(stdbuf) == 0 && count > 0) {
-    if (channel->remote_eof && buffer_get_rest_len(stdbuf) == 0) {
+  while (channel_pending(channel, is_stderr) == 0 && count > 0) {
+    if (channel->remote_eof && channel_pending(channel, is_stderr) == 0) {
       leave_function();
       return 0;
     }
@@ -2436,21 +3880,43 @@ int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count, int is_std
       break;
     }
 
-    if (buffer_get_rest_len(stdbuf) >= count) {
+    if (channel_pending(channel, is_stderr) >= count) {
       /* Stop reading when buffer is full enough */
       break;
     }
 
-    ssh_handle_packets(session,-1);
+    if (timeout >= 0) {
+      elapsed = ssh_timestamp_ms() - start;
+      wait = elapsed < (uint64_t) timeout ? timeout - (int) elapsed : 0;
+    }
+    if (ssh_handle_packets(session, wait) == SSH_ERROR) {
+      leave_function();
+      return SSH_ERROR;
+    }
+    if (timeout >= 0 && channel_pending(channel, is_stderr) == 0 &&
+        !channel->remote_eof &&
+        ssh_timestamp_ms() - start >= (uint64_t) timeout) {
+      leave_function();
+      return SSH_AGAIN;
+    }
   }
 
+  /* the data is there, so is its buffer */
+  stdbuf = is_stderr ? channel->stderr_buffer : channel->stdout_buffer;
   len = buffer_get_rest_len(stdbuf);
   /* Read count bytes if len is greater, everything otherwise */
   len = (len > count ? count : len);
-  memcpy(dest, buffer_get_rest(stdbuf), len);
-  buffer_pass_bytes(stdbuf,len);
+  rc = take(buffer_get_rest(stdbuf), len, userdata);
+  if (rc < 0 || (uint32_t) rc > len) {
+    leave_function();
+    return SSH_ERROR;
+  }
+  len = rc;
+  session->channels_buffered -= buffer_pass_bytes(stdbuf, len);
+  /* an idle channel doesn't keep the memory of what it received */
+  buffer_release(stdbuf);
   /* Authorize some buffering while userapp is busy */
-  if (channel->local_window < WINDOWLIMIT) {
+  if (channel->local_window < channel_window_low(channel)) {
     if (grow_window(session, channel, 0) < 0) {
       leave_function();
       return -1;
@@ -2531,30 +3997,24 @@ int ssh_channel_read_nonblocking(ssh_channel channel, void *dest, uint32_t count
  */
 int ssh_channel_poll(ssh_channel channel, int is_stderr){
   ssh_session session;
-  ssh_buffer stdbuf;
 
   if(channel == NULL) {
       return SSH_ERROR;
   }
 
   session = channel->session;
-  stdbuf = channel->stdout_buffer;
   enter_function();
 
-  if (is_stderr) {
-    stdbuf = channel->stderr_buffer;
-  }
-
-  if (buffer_get_rest_len(stdbuf) == 0 && channel->remote_eof == 0) {
+  if (channel_pending(channel, is_stderr) == 0 && channel->remote_eof == 0) {
     if (ssh_handle_packets(channel->session,0)==SSH_ERROR) {
       leave_function();
       return SSH_ERROR;
     }
   }
 
-  if (buffer_get_rest_len(stdbuf) > 0){
+  if (channel_pending(channel, is_stderr) > 0){
     leave_function();
-  	return buffer_get_rest_len(stdbuf);
+  	return channel_pending(channel, is_stderr);
   }
 
   if (channel->remote_eof) {
@@ -2563,7 +4023,7 @@ int ssh_channel_poll(ssh_channel channel, int is_stderr){
   }
 
   leave_function();
-  return buffer_get_rest_len(stdbuf);
+  return 0;
 }
 
 /**
@@ -2581,6 +4041,24 @@ ssh_session ssh_channel_get_session(ssh_channel channel) {
   return channel->session;
 }
 
+/**
+ * @brief Get the number of received bytes waiting to be read in a channel.
+ *
+ * @param[in]  channel  The channel to query.
+ *
+ * @return              The number of bytes of its stdout and stderr buffers.
+ *
+ * @see ssh_get_buffered()
+ * @see ssh_options_set() SSH_OPTIONS_CHANNEL_BUFFER_SOFT_LIMIT
+ */
+uint32_t ssh_channel_get_buffered(ssh_channel channel) {
+  if (channel == NULL) {
+    return 0;
+  }
+
+  return channel_buffered(channel);
+}
+
 /**
  * @brief Get the exit status of the channel (error code from the executed
  *        instruction).
@@ -2617,70 +4095,181 @@ int ssh_channel_get_exit_status(ssh_channel channel) {
   return channel->exit_status;
 }
 
+/* the events of a channel which are ready */
+static int channel_select_ready(ssh_channel chan, int events) {
+  ssh_socket s = chan->session->socket;
+  int revents = 0;
+
+  if ((events & SSH_CHANNEL_SET_READ) &&
+      ((chan->stdout_buffer && buffer_get_rest_len(chan->stdout_buffer) > 0) ||
+       (chan->stderr_buffer && buffer_get_rest_len(chan->stderr_buffer) > 0) ||
+       chan->remote_eof)) {
+    revents |= SSH_CHANNEL_SET_READ;
+  }
+  /* It's not our business to seek if the file descriptor is writable */
+  if ((events & SSH_CHANNEL_SET_WRITE) && ssh_socket_data_writable(s) &&
+      ssh_channel_is_open(chan) && channel_write_window(chan) > 0) {
+    revents |= SSH_CHANNEL_SET_WRITE;
+  }
+  if ((events & SSH_CHANNEL_SET_EXCEPT) &&
+      (!ssh_socket_is_open(s) || ssh_channel_is_closed(chan))) {
+    revents |= SSH_CHANNEL_SET_EXCEPT;
+  }
+
+  return revents;
+}
+
 /*
- * This function acts as a meta select.
- *
- * First, channels are analyzed to seek potential can-write or can-read ones,
- * then if no channel has been elected, it goes in a loop with the posix
- * select(2).
- * This is made in two parts: protocol select and network select. The protocol
- * select does not use the network functions at all
+ * Prepare the socket of a channel to wait for its events. The poll callback
+ * of the socket marks it writable again.
  */
-static int channel_protocol_select(ssh_channel *rchans, ssh_channel *wchans,
-    ssh_channel *echans, ssh_channel *rout, ssh_channel *wout, ssh_channel *eout) {
-  ssh_channel chan;
-  int i;
-  int j = 0;
+static void channel_select_arm(ssh_channel chan, int events) {
+  ssh_socket s = chan->session->socket;
 
-  for (i = 0; rchans[i] != NULL; i++) {
-    chan = rchans[i];
+  ssh_channels_flush_windows(chan->session);
+  if ((events & SSH_CHANNEL_SET_WRITE) && !ssh_socket_data_writable(s) &&
+      ssh_socket_is_open(s)) {
+    ssh_poll_add_events(ssh_socket_get_poll_handle_out(s), POLLOUT);
+  }
+}
+
+static const int channel_select_events[3] = {
+  SSH_CHANNEL_SET_READ,
+  SSH_CHANNEL_SET_WRITE,
+  SSH_CHANNEL_SET_EXCEPT
+};
 
-    while (ssh_channel_is_open(chan) && ssh_socket_data_available(chan->session->socket)) {
-      ssh_handle_packets(chan->session,-1);
+/*
+ * Keep the ready channels at the beginning of the arrays, in their order.
+ * Returns 0 when no channel is ready, the arrays are left untouched then.
+ */
+static int channel_select_filter(ssh_channel *chans[3]) {
+  int found = 0;
+  int i, j, k;
+
+  for (k = 0; k < 3 && !found; k++) {
+    for (i = 0; chans[k][i] != NULL; i++) {
+      if (channel_select_ready(chans[k][i], channel_select_events[k])) {
+        found = 1;
+        break;
+      }
     }
+  }
+  if (!found) {
+    return 0;
+  }
 
-    if ((chan->stdout_buffer && buffer_get_rest_len(chan->stdout_buffer) > 0) ||
-        (chan->stderr_buffer && buffer_get_rest_len(chan->stderr_buffer) > 0) ||
-        chan->remote_eof) {
-      rout[j] = chan;
-      j++;
+  for (k = 0; k < 3; k++) {
+    j = 0;
+    for (i = 0; chans[k][i] != NULL; i++) {
+      if (channel_select_ready(chans[k][i], channel_select_events[k])) {
+        chans[k][j++] = chans[k][i];
+      }
     }
+    chans[k][j] = NULL;
   }
-  rout[j] = NULL;
 
-  j = 0;
-  for(i = 0; wchans[i] != NULL; i++) {
-    chan = wchans[i];
-    /* It's not our business to seek if the file descriptor is writable */
-    if (ssh_socket_data_writable(chan->session->socket) &&
-        ssh_channel_is_open(chan) && (chan->remote_window > 0)) {
-      wout[j] = chan;
-      j++;
+  return 1;
+}
+
+/* number of sessions polled with an array on the stack */
+#define CHANNEL_SELECT_FDS 32
+
+/*
+ * Wait on the sockets of channels of sessions polled by different contexts,
+ * then let each context process the sessions which got an event.
+ */
+static int channel_select_poll_sessions(ssh_channel *chans[3], int timeout) {
+  ssh_pollfd_t stack_fds[CHANNEL_SELECT_FDS];
+  ssh_session stack_sessions[CHANNEL_SELECT_FDS];
+  ssh_pollfd_t *fds = stack_fds;
+  ssh_session *sessions = stack_sessions;
+  ssh_session session;
+  size_t count = 0;
+  size_t size = 0;
+  size_t n;
+  int rc;
+  int i, k;
+
+  for (k = 0; k < 3; k++) {
+    for (i = 0; chans[k][i] != NULL; i++) {
+      size++;
+    }
+  }
+  if (size > CHANNEL_SELECT_FDS) {
+    /* large sets are meant to use a ssh_channel_set instead */
+    fds = malloc(sizeof(ssh_pollfd_t) * size);
+    sessions = malloc(sizeof(ssh_session) * size);
+    if (fds == NULL || sessions == NULL) {
+      SAFE_FREE(fds);
+      SAFE_FREE(sessions);
+      return SSH_ERROR;
     }
   }
-  wout[j] = NULL;
 
-  j = 0;
-  for (i = 0; echans[i] != NULL; i++) {
-    chan = echans[i];
+  for (k = 0; k < 3; k++) {
+    for (i = 0; chans[k][i] != NULL; i++) {
+      session = chans[k][i]->session;
+      for (n = 0; n < count && sessions[n] != session; n++)
+        ;
+      if (n < count) {
+        continue;
+      }
+      sessions[count] = session;
+      fds[count].fd = ssh_get_fd(session);
+      fds[count].events =
+        ssh_poll_get_events(ssh_socket_get_poll_handle_in(session->socket)) |
+        ssh_poll_get_events(ssh_socket_get_poll_handle_out(session->socket));
+      fds[count].revents = 0;
+      count++;
+    }
+  }
 
-    if (!ssh_socket_is_open(chan->session->socket) || ssh_channel_is_closed(chan)) {
-      eout[j] = chan;
-      j++;
+  rc = ssh_poll(fds, count, timeout);
+  for (n = 0; rc > 0 && n < count; n++) {
+    if (fds[n].revents != 0) {
+      ssh_handle_packets(sessions[n], 0);
     }
   }
-  eout[j] = NULL;
 
-  return 0;
+  if (fds != stack_fds) {
+    SAFE_FREE(fds);
+    SAFE_FREE(sessions);
+  }
+
+  return rc < 0 ? SSH_ERROR : SSH_OK;
 }
 
-/* Just count number of pointers in the array */
-static int count_ptrs(ssh_channel *ptrs) {
-  int c;
-  for (c = 0; ptrs[c] != NULL; c++)
-    ;
+/*
+ * Wait for an event on the sessions of the channels. The common case of
+ * channels polled by a single context only runs that context.
+ */
+static int channel_select_wait(ssh_channel *chans[3], int timeout) {
+  ssh_poll_ctx ctx = NULL;
+  ssh_poll_ctx c;
+  int shared = 1;
+  int i, k;
+
+  for (k = 0; k < 3; k++) {
+    for (i = 0; chans[k][i] != NULL; i++) {
+      c = ssh_session_get_poll_ctx(chans[k][i]->session);
+      if (c == NULL) {
+        return SSH_ERROR;
+      }
+      channel_select_arm(chans[k][i], channel_select_events[k]);
+      if (ctx == NULL) {
+        ctx = c;
+      } else if (c != ctx) {
+        shared = 0;
+      }
+    }
+  }
+
+  if (!shared) {
+    return channel_select_poll_sessions(chans, timeout);
+  }
 
-  return c;
+  return ssh_poll_ctx_dopoll(ctx, timeout);
 }
 
 /**
@@ -2690,6 +4279,10 @@ static int count_ptrs(ssh_channel *ptrs) {
  * channels that are respectively readable, writable or have an exception to
  * trap.
  *
+ * The sessions of the channels are polled by their poll context, without
+ * allocation when they share one. Use a ssh_channel_set to select repeatedly
+ * over the same large set of channels.
+ *
  * @param[in]  readchans A NULL pointer or an array of channel pointers,
  *                       terminated by a NULL.
  *
@@ -2699,22 +4292,25 @@ static int count_ptrs(ssh_channel *ptrs) {
  * @param[in]  exceptchans A NULL pointer or an array of channel pointers,
  *                         terminated by a NULL.
  *
- * @param[in]  timeout  Timeout as defined by select(2).
+ * @param[in]  timeout  Timeout as defined by select(2), NULL to wait forever.
  *
- * @return             SSH_OK on a successful operation, SSH_EINTR if the
- *                     select(2) syscall was interrupted, then relaunch the
- *                     function.
+ * @return             SSH_OK on a successful operation, the arrays are empty
+ *                     if the timeout expired. SSH_EINTR if the poll was
+ *                     interrupted, then relaunch the function. SSH_ERROR on
+ *                     error.
+ *
+ * @see ssh_channel_set_new()
  */
 int ssh_channel_select(ssh_channel *readchans, ssh_channel *writechans,
     ssh_channel *exceptchans, struct timeval * timeout) {
-  ssh_channel *rchans, *wchans, *echans;
   ssh_channel dummy = NULL;
-  fd_set rset;
-  fd_set wset;
-  fd_set eset;
-  socket_t max_fd = SSH_INVALID_SOCKET;
+  ssh_channel *chans[3];
+  uint64_t start;
+  int timeout_ms = -1;
+  int remaining = -1;
+  int expired = 0;
+  int elapsed;
   int rc;
-  int i;
 
   /* don't allow NULL pointers */
   if (readchans == NULL) {
@@ -2733,102 +4329,372 @@ int ssh_channel_select(ssh_channel *readchans, ssh_channel *writechans,
     /* No channel to poll?? Go away! */
     return 0;
   }
+  chans[0] = readchans;
+  chans[1] = writechans;
+  chans[2] = exceptchans;
 
-  /* Prepare the outgoing temporary arrays */
-  rchans = malloc(sizeof(ssh_channel ) * (count_ptrs(readchans) + 1));
-  if (rchans == NULL) {
-    return SSH_ERROR;
-  }
-
-  wchans = malloc(sizeof(ssh_channel ) * (count_ptrs(writechans) + 1));
-  if (wchans == NULL) {
-    SAFE_FREE(rchans);
-    return SSH_ERROR;
-  }
-
-  echans = malloc(sizeof(ssh_channel ) * (count_ptrs(exceptchans) + 1));
-  if (echans == NULL) {
-    SAFE_FREE(rchans);
-    SAFE_FREE(wchans);
-    return SSH_ERROR;
+  if (timeout != NULL) {
+    timeout_ms = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
   }
+  start = ssh_timestamp_ms();
 
   /*
-   * First, try without doing network stuff then, select and redo the
+   * First, try without doing network stuff then, poll and redo the
    * networkless stuff
    */
-  do {
-    channel_protocol_select(readchans, writechans, exceptchans,
-        rchans, wchans, echans);
-    if (rchans[0] != NULL || wchans[0] != NULL || echans[0] != NULL) {
-      /* We've got one without doing any select overwrite the beginning arrays */
-      memcpy(readchans, rchans, (count_ptrs(rchans) + 1) * sizeof(ssh_channel ));
-      memcpy(writechans, wchans, (count_ptrs(wchans) + 1) * sizeof(ssh_channel ));
-      memcpy(exceptchans, echans, (count_ptrs(echans) + 1) * sizeof(ssh_channel ));
-      SAFE_FREE(rchans);
-      SAFE_FREE(wchans);
-      SAFE_FREE(echans);
-      return 0;
+  for (;;) {
+    if (channel_select_filter(chans)) {
+      return SSH_OK;
     }
-    /*
-     * Since we verified the invalid fd cases into the networkless select,
-     * we can be sure all fd are valid ones
-     */
-    FD_ZERO(&rset);
-    FD_ZERO(&wset);
-    FD_ZERO(&eset);
-
-    for (i = 0; readchans[i] != NULL; i++) {
-      if (!ssh_socket_fd_isset(readchans[i]->session->socket, &rset)) {
-        ssh_socket_fd_set(readchans[i]->session->socket, &rset, &max_fd);
-      }
+    if (expired) {
+      readchans[0] = writechans[0] = exceptchans[0] = NULL;
+      return SSH_OK;
     }
 
-    for (i = 0; writechans[i] != NULL; i++) {
-      if (!ssh_socket_fd_isset(writechans[i]->session->socket, &wset)) {
-        ssh_socket_fd_set(writechans[i]->session->socket, &wset, &max_fd);
-      }
+    if (timeout_ms >= 0) {
+      elapsed = (int) (ssh_timestamp_ms() - start);
+      remaining = elapsed < timeout_ms ? timeout_ms - elapsed : 0;
     }
-
-    for (i = 0; exceptchans[i] != NULL; i++) {
-      if (!ssh_socket_fd_isset(exceptchans[i]->session->socket, &eset)) {
-        ssh_socket_fd_set(exceptchans[i]->session->socket, &eset, &max_fd);
-      }
+    rc = channel_select_wait(chans, remaining);
+    if (rc == SSH_ERROR) {
+      return errno == EINTR ? SSH_EINTR : SSH_ERROR;
     }
+    if (timeout_ms >= 0 &&
+        ssh_timestamp_ms() - start >= (uint64_t) timeout_ms) {
+      expired = 1;
+    }
+  }
+
+  /* not reached */
+  return 0;
+}
+
+struct ssh_channel_set_entry {
+  ssh_channel channel;
+  int events;
+  size_t index; /* in the entries array */
+};
+
+struct ssh_channel_set_struct {
+  ssh_event event;
+  /* the entries, keyed by their channel */
+  struct ssh_hashtable *channels;
+  /* the channels, keyed by their session added to the event */
+  struct ssh_hashtable *sessions;
+  struct ssh_channel_set_entry **entries;
+  size_t count;
+  size_t allocated;
+  /* result of the last select, as large as the entries array */
+  struct ssh_channel_set_entry **ready;
+  int *revents;
+  size_t nready;
+};
+
+/**
+ * @brief Create a set of channels to select repeatedly.
+ *
+ * The sessions of the channels are added to an event of the set, which is
+ * set up once for all the calls to ssh_channel_set_select(). A session must
+ * not be in another event meanwhile.
+ *
+ * @return              The new set, NULL on error.
+ *
+ * @see ssh_channel_set_add()
+ */
+ssh_channel_set ssh_channel_set_new(void) {
+  ssh_channel_set set;
+
+  set = malloc(sizeof(struct ssh_channel_set_struct));
+  if (set == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(set);
+
+  set->event = ssh_event_new();
+  set->channels = ssh_hashtable_new();
+  set->sessions = ssh_hashtable_new();
+  if (set->event == NULL || set->channels == NULL || set->sessions == NULL) {
+    ssh_channel_set_free(set);
+    return NULL;
+  }
+
+  return set;
+}
+
+/**
+ * @brief Free a set of channels. The sessions go back to their own poll
+ * context, the channels are not freed.
+ *
+ * @param[in]  set      The set to free.
+ */
+void ssh_channel_set_free(ssh_channel_set set) {
+  if (set == NULL) {
+    return;
+  }
+
+  set->nready = 0;
+  while (set->count > 0) {
+    ssh_channel_set_remove(set, set->entries[set->count - 1]->channel);
+  }
+  ssh_hashtable_free(set->channels);
+  ssh_hashtable_free(set->sessions);
+  ssh_event_free(set->event);
+  SAFE_FREE(set->entries);
+  SAFE_FREE(set->ready);
+  SAFE_FREE(set->revents);
+  SAFE_FREE(set);
+}
+
+static int ssh_channel_set_grow(ssh_channel_set set) {
+  struct ssh_channel_set_entry **entries;
+  struct ssh_channel_set_entry **ready;
+  size_t size = set->allocated > 0 ? set->allocated * 2 : 16;
+  int *revents;
+
+  entries = realloc(set->entries, sizeof(*entries) * size);
+  if (entries == NULL) {
+    return -1;
+  }
+  set->entries = entries;
+  ready = realloc(set->ready, sizeof(*ready) * size);
+  if (ready == NULL) {
+    return -1;
+  }
+  set->ready = ready;
+  revents = realloc(set->revents, sizeof(*revents) * size);
+  if (revents == NULL) {
+    return -1;
+  }
+  set->revents = revents;
+  set->allocated = size;
+
+  return 0;
+}
+
+/**
+ * @brief Add a channel to a set, or change the events it is selected for.
+ *
+ * @param[in]  set      The set of channels.
+ *
+ * @param[in]  channel  The channel to add. It must be removed from the set
+ *                      before being freed.
+ *
+ * @param[in]  events   The events to select: a mask of SSH_CHANNEL_SET_READ,
+ *                      SSH_CHANNEL_SET_WRITE and SSH_CHANNEL_SET_EXCEPT.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_channel_set_add(ssh_channel_set set, ssh_channel channel, int events) {
+  struct ssh_channel_set_entry *entry;
+  ssh_session session;
+  ssh_poll_ctx ctx;
 
-    /* Here we go */
-    rc = select(max_fd, &rset, &wset, &eset, timeout);
-    /* Leave if select was interrupted */
-    if (rc == EINTR) {
-      SAFE_FREE(rchans);
-      SAFE_FREE(wchans);
-      SAFE_FREE(echans);
-      return SSH_EINTR;
+  if (set == NULL || channel == NULL || events == 0) {
+    return SSH_ERROR;
+  }
+  session = channel->session;
+
+  entry = ssh_hashtable_lookup(set->channels, ssh_hashtable_ptr_key(channel));
+  if (entry != NULL) {
+    entry->events = events;
+    return SSH_OK;
+  }
+
+  if (ssh_hashtable_find(set->sessions,
+        ssh_hashtable_ptr_key(session)) == NULL) {
+    /* the socket must be in the default context to join the event */
+    ctx = ssh_session_get_poll_ctx(session);
+    if (ctx == NULL) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+    if (ctx != session->default_poll_ctx) {
+      ssh_set_error(session, SSH_FATAL,
+          "The session is already polled by another event");
+      return SSH_ERROR;
     }
+    if (ssh_event_add_session(set->event, session) != SSH_OK) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+  }
 
-    for (i = 0; readchans[i] != NULL; i++) {
-      if (ssh_socket_fd_isset(readchans[i]->session->socket, &rset)) {
-        ssh_socket_set_read_wontblock(readchans[i]->session->socket);
-      }
+  if (set->count == set->allocated && ssh_channel_set_grow(set) < 0) {
+    goto error;
+  }
+  entry = malloc(sizeof(struct ssh_channel_set_entry));
+  if (entry == NULL) {
+    goto error;
+  }
+  entry->channel = channel;
+  entry->events = events;
+  entry->index = set->count;
+
+  if (ssh_hashtable_insert(set->channels, ssh_hashtable_ptr_key(channel),
+        entry) < 0) {
+    SAFE_FREE(entry);
+    goto error;
+  }
+  if (ssh_hashtable_insert(set->sessions, ssh_hashtable_ptr_key(session),
+        channel) < 0) {
+    ssh_hashtable_remove(set->channels, ssh_hashtable_ptr_key(channel), entry);
+    SAFE_FREE(entry);
+    goto error;
+  }
+  set->entries[set->count++] = entry;
+
+  return SSH_OK;
+error:
+  if (ssh_hashtable_find(set->sessions,
+        ssh_hashtable_ptr_key(session)) == NULL) {
+    ssh_event_remove_session(set->event, session);
+  }
+  ssh_set_error_oom(session);
+  return SSH_ERROR;
+}
+
+/**
+ * @brief Remove a channel from a set.
+ *
+ * @param[in]  set      The set of channels.
+ *
+ * @param[in]  channel  The channel to remove.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the channel isn't in
+ *                      the set.
+ */
+int ssh_channel_set_remove(ssh_channel_set set, ssh_channel channel) {
+  struct ssh_channel_set_entry *entry;
+  ssh_session session;
+  size_t i;
+
+  if (set == NULL || channel == NULL) {
+    return SSH_ERROR;
+  }
+  entry = ssh_hashtable_lookup(set->channels, ssh_hashtable_ptr_key(channel));
+  if (entry == NULL) {
+    return SSH_ERROR;
+  }
+  session = channel->session;
+
+  ssh_hashtable_remove(set->channels, ssh_hashtable_ptr_key(channel), entry);
+  ssh_hashtable_remove(set->sessions, ssh_hashtable_ptr_key(session), channel);
+  if (ssh_hashtable_find(set->sessions,
+        ssh_hashtable_ptr_key(session)) == NULL) {
+    ssh_event_remove_session(set->event, session);
+  }
+
+  /* the last entry takes the free slot */
+  set->count--;
+  if (entry->index != set->count) {
+    set->entries[entry->index] = set->entries[set->count];
+    set->entries[entry->index]->index = entry->index;
+  }
+  /* the result of the last select doesn't refer to it anymore */
+  for (i = 0; i < set->nready; i++) {
+    if (set->ready[i] == entry) {
+      set->nready--;
+      set->ready[i] = set->ready[set->nready];
+      set->revents[i] = set->revents[set->nready];
+      break;
     }
+  }
+  SAFE_FREE(entry);
+
+  return SSH_OK;
+}
 
-    for (i = 0; writechans[i] != NULL; i++) {
-      if (ssh_socket_fd_isset(writechans[i]->session->socket, &wset)) {
-        ssh_socket_set_write_wontblock(writechans[i]->session->socket);
+/**
+ * @brief Wait until channels of a set are ready. It doesn't allocate
+ * memory.
+ *
+ * @param[in]  set      The set of channels.
+ *
+ * @param[in]  timeout  The maximum time to wait in milliseconds, a negative
+ *                      value to wait forever.
+ *
+ * @return              The number of ready channels, 0 if the timeout
+ *                      expired, SSH_EINTR if the poll was interrupted,
+ *                      SSH_ERROR on error.
+ *
+ * @see ssh_channel_set_get_ready()
+ */
+int ssh_channel_set_select(ssh_channel_set set, int timeout) {
+  struct ssh_channel_set_entry *entry;
+  uint64_t start;
+  int remaining = timeout;
+  int expired = 0;
+  int elapsed;
+  int revents;
+  size_t i;
+  int rc;
+
+  if (set == NULL) {
+    return SSH_ERROR;
+  }
+  start = ssh_timestamp_ms();
+
+  for (;;) {
+    set->nready = 0;
+    for (i = 0; i < set->count; i++) {
+      entry = set->entries[i];
+      revents = channel_select_ready(entry->channel, entry->events);
+      if (revents != 0) {
+        set->ready[set->nready] = entry;
+        set->revents[set->nready] = revents;
+        set->nready++;
       }
     }
+    if (set->nready > 0 || expired || set->count == 0) {
+      return set->nready;
+    }
 
-    for (i = 0; exceptchans[i] != NULL; i++) {
-      if (ssh_socket_fd_isset(exceptchans[i]->session->socket, &eset)) {
-        ssh_socket_set_except(exceptchans[i]->session->socket);
-      }
+    for (i = 0; i < set->count; i++) {
+      channel_select_arm(set->entries[i]->channel, set->entries[i]->events);
+    }
+    if (timeout >= 0) {
+      elapsed = (int) (ssh_timestamp_ms() - start);
+      remaining = elapsed < timeout ? timeout - elapsed : 0;
+    }
+    rc = ssh_event_dopoll(set->event, remaining);
+    if (rc == SSH_ERROR) {
+      return errno == EINTR ? SSH_EINTR : SSH_ERROR;
     }
-  } while(1); /* Return to do loop */
+    if (timeout >= 0 && ssh_timestamp_ms() - start >= (uint64_t) timeout) {
+      expired = 1;
+    }
+  }
 
   /* not reached */
   return 0;
 }
 
+/**
+ * @brief Get a channel found ready by the last ssh_channel_set_select().
+ *
+ * @param[in]  set      The set of channels.
+ *
+ * @param[in]  i        The index of the ready channel, from 0 to the result
+ *                      of ssh_channel_set_select() excluded.
+ *
+ * @param[out] events   A pointer to store the ready events, a mask of
+ *                      SSH_CHANNEL_SET_READ, SSH_CHANNEL_SET_WRITE and
+ *                      SSH_CHANNEL_SET_EXCEPT. It may be NULL.
+ *
+ * @return              The channel, NULL if the index is out of range.
+ */
+ssh_channel ssh_channel_set_get_ready(ssh_channel_set set, int i,
+    int *events) {
+  if (set == NULL || i < 0 || (size_t) i >= set->nready) {
+    return NULL;
+  }
+  if (events != NULL) {
+    *events = set->revents[i];
+  }
+
+  return set->ready[i]->channel;
+}
+
 #if WITH_SERVER
 /**
  * @brief Blocking write on a channel stderr.
@@ -2918,7 +4784,8 @@ int ssh_channel_open_reverse_forward(ssh_channel channel, const char *remotehost
     goto error;
   }
 
-  rc = channel_open(channel, "forwarded-tcpip", 64000, 32000, payload);
+  rc = channel_open(channel, "forwarded-tcpip", channel->window_size / 2,
+      channel->local_maxpacket, payload);
 
 error:
   ssh_buffer_free(payload);
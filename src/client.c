@@ -36,6 +36,8 @@
 #include "libssh/socket.h"
 #include "libssh/session.h"
 #include "libssh/dh.h"
+#include "libssh/ecdh.h"
+#include "libssh/curve25519.h"
 #include "libssh/threads.h"
 #include "libssh/misc.h"
 
@@ -61,10 +63,11 @@ static void socket_callback_connected(int code, int errno_code, void *user){
 		leave_function();
 		return;
 	}
-	ssh_log(session,SSH_LOG_RARE,"Socket connection callback: %d (%d)",code, errno_code);
-	if(code == SSH_SOCKET_CONNECTED_OK)
+	SSH_LOG(session,SSH_LOG_RARE,"Socket connection callback: %d (%d)",code, errno_code);
+	if(code == SSH_SOCKET_CONNECTED_OK) {
 		session->session_state=SSH_SESSION_STATE_SOCKET_CONNECTED;
-	else {
+		ssh_latency_phase(session, SSH_LATENCY_CONNECT);
+	} else {
 		session->session_state=SSH_SESSION_STATE_ERROR;
 		ssh_set_error(session,SSH_FATAL,"%s",strerror(errno_code));
 	}
@@ -110,7 +113,8 @@ static int callback_receive_banner(const void *data, size_t len, void *user) {
   		ret=i+1;
   		session->serverbanner=str;
   		session->session_state=SSH_SESSION_STATE_BANNER_RECEIVED;
-  		ssh_log(session,SSH_LOG_PACKET,"Received banner: %s",str);
+  		ssh_latency_phase(session, SSH_LATENCY_BANNER);
+  		SSH_LOG(session,SSH_LOG_PACKET,"Received banner: %s",str);
 		session->ssh_connection_callback(session);
   		leave_function();
   		return ret;
@@ -184,7 +188,7 @@ SSH_PACKET_CALLBACK(ssh_packet_dh_reply){
   ssh_string signature = NULL;
   (void)type;
   (void)user;
-  ssh_log(session,SSH_LOG_PROTOCOL,"Received SSH_KEXDH_REPLY");
+  SSH_LOG(session,SSH_LOG_PROTOCOL,"Received SSH_KEXDH_REPLY");
   if(session->session_state!= SSH_SESSION_STATE_DH &&
     		session->dh_handshake_state != DH_STATE_INIT_SENT){
     	ssh_set_error(session,SSH_FATAL,"ssh_packet_dh_reply called in wrong state : %d:%d",
@@ -204,13 +208,19 @@ SSH_PACKET_CALLBACK(ssh_packet_dh_reply){
     ssh_set_error(session,SSH_FATAL, "No F number in packet");
     goto error;
   }
-  if (dh_import_f(session, f) < 0) {
-    ssh_set_error(session, SSH_FATAL, "Cannot import f number");
-    goto error;
+  if (session->next_crypto->kex_type != SSH_KEX_DH_GROUP1_SHA1) {
+    /* Q_S, it is hashed as it is */
+    session->next_crypto->ecdh_server_pubkey = f;
+    f = NULL;
+  } else {
+    if (dh_import_f(session, f) < 0) {
+      ssh_set_error(session, SSH_FATAL, "Cannot import f number");
+      goto error;
+    }
+    ssh_string_burn(f);
+    ssh_string_free(f);
+    f=NULL;
   }
-  ssh_string_burn(f);
-  ssh_string_free(f);
-  f=NULL;
   signature = buffer_get_ssh_string(packet);
   if (signature == NULL) {
     ssh_set_error(session, SSH_FATAL, "No signature in packet");
@@ -218,9 +228,28 @@ SSH_PACKET_CALLBACK(ssh_packet_dh_reply){
   }
   session->dh_server_signature = signature;
   signature=NULL; /* ownership changed */
-  if (dh_build_k(session) < 0) {
-    ssh_set_error(session, SSH_FATAL, "Cannot build k number");
-    goto error;
+  switch (session->next_crypto->kex_type) {
+    case SSH_KEX_DH_GROUP1_SHA1:
+      if (dh_build_k(session) < 0) {
+        ssh_set_error(session, SSH_FATAL, "Cannot build k number");
+        goto error;
+      }
+      break;
+#ifdef HAVE_ECDH
+    case SSH_KEX_ECDH_SHA2_NISTP256:
+      if (ecdh_build_k(session) < 0) {
+        goto error;
+      }
+      break;
+#endif
+    case SSH_KEX_CURVE25519_SHA256:
+      if (curve25519_build_k(session) < 0) {
+        goto error;
+      }
+      break;
+    default:
+      ssh_set_error(session, SSH_FATAL, "Unknown key exchange type");
+      goto error;
   }
 
   /* Send the MSG_NEWKEYS */
@@ -229,7 +258,7 @@ SSH_PACKET_CALLBACK(ssh_packet_dh_reply){
   }
 
   packet_send(session);
-  ssh_log(session, SSH_LOG_PROTOCOL, "SSH_MSG_NEWKEYS sent");
+  SSH_LOG(session, SSH_LOG_PROTOCOL, "SSH_MSG_NEWKEYS sent");
 
   session->dh_handshake_state = DH_STATE_NEWKEYS_SENT;
   return SSH_PACKET_USED;
@@ -238,13 +267,48 @@ error:
   return SSH_PACKET_USED;
 }
 
+/*
+ * asks the host key callback about the key of the first key exchange, the
+ * session waits in SSH_SESSION_STATE_DH while the answer is deferred
+ */
+static int ssh_client_host_key(ssh_session session) {
+  int rc;
+
+  if (!ssh_callbacks_exists(session->callbacks, host_key_function)) {
+    return SSH_OK;
+  }
+  session->host_key_state = SSH_HOST_KEY_PENDING;
+  rc = session->callbacks->host_key_function(session,
+      session->current_crypto->server_pubkey, session->callbacks->userdata);
+  if (rc == SSH_OK && session->host_key_state == SSH_HOST_KEY_PENDING) {
+    session->host_key_state = SSH_HOST_KEY_ACCEPTED;
+  } else if (rc != SSH_AGAIN) {
+    session->host_key_state = SSH_HOST_KEY_REJECTED;
+  }
+
+  if (session->host_key_state == SSH_HOST_KEY_PENDING &&
+      ssh_is_blocking(session)) {
+    ssh_set_error(session, SSH_FATAL,
+        "The host key callback didn't verify the key of a blocking session");
+    return SSH_ERROR;
+  }
+  if (session->host_key_state == SSH_HOST_KEY_REJECTED) {
+    ssh_set_error(session, SSH_FATAL, "The host key was rejected");
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
 SSH_PACKET_CALLBACK(ssh_packet_newkeys){
   ssh_string signature = NULL;
+  ssh_string old_pubkey;
+  ssh_string new_pubkey;
   int rc;
   (void)packet;
   (void)user;
   (void)type;
-  ssh_log(session, SSH_LOG_PROTOCOL, "Received SSH_MSG_NEWKEYS");
+  SSH_LOG(session, SSH_LOG_PROTOCOL, "Received SSH_MSG_NEWKEYS");
   if(session->session_state!= SSH_SESSION_STATE_DH &&
   		session->dh_handshake_state != DH_STATE_NEWKEYS_SENT){
   	ssh_set_error(session,SSH_FATAL,"ssh_packet_newkeys called in wrong state : %d:%d",
@@ -273,6 +337,11 @@ SSH_PACKET_CALLBACK(ssh_packet_newkeys){
       goto error;
     }
 
+    if (crypt_set_keys(session->next_crypto) < 0) {
+      ssh_set_error(session, SSH_FATAL, "Could not set up the cipher keys");
+      goto error;
+    }
+
     /* Verify the host's signature. FIXME do it sooner */
     signature = session->dh_server_signature;
     session->dh_server_signature = NULL;
@@ -284,21 +353,29 @@ SSH_PACKET_CALLBACK(ssh_packet_newkeys){
     ssh_string_burn(signature);
     ssh_string_free(signature);
     signature=NULL;
+
+    /* the host was verified with its first key, it can't change */
+    old_pubkey = session->current_crypto ?
+      session->current_crypto->server_pubkey : NULL;
+    new_pubkey = session->next_crypto->server_pubkey;
+    if (old_pubkey != NULL && (new_pubkey == NULL ||
+          ssh_string_len(old_pubkey) != ssh_string_len(new_pubkey) ||
+          memcmp(ssh_string_data(old_pubkey), ssh_string_data(new_pubkey),
+            ssh_string_len(old_pubkey)) != 0)) {
+      ssh_set_error(session, SSH_FATAL,
+          "The host key changed during a key re-exchange");
+      goto error;
+    }
+
     /*
      * Once we got SSH2_MSG_NEWKEYS we can switch next_crypto and
      * current_crypto
      */
-    if (session->current_crypto) {
-      crypto_free(session->current_crypto);
-      session->current_crypto=NULL;
+    if (ssh_kex_newkeys(session) < 0) {
+      goto error;
     }
 
-    /* FIXME later, include a function to change keys */
-    session->current_crypto = session->next_crypto;
-
-    session->next_crypto = crypto_new();
-    if (session->next_crypto == NULL) {
-      ssh_set_error_oom(session);
+    if (old_pubkey == NULL && ssh_client_host_key(session) < 0) {
       goto error;
     }
   }
@@ -327,6 +404,22 @@ static int dh_handshake(ssh_session session) {
 
   switch (session->dh_handshake_state) {
     case DH_STATE_INIT:
+      if (session->next_crypto->kex_type == SSH_KEX_CURVE25519_SHA256) {
+        if (ssh_client_curve25519_init(session) == SSH_ERROR) {
+          goto error;
+        }
+        session->dh_handshake_state = DH_STATE_INIT_SENT;
+        break;
+      }
+#ifdef HAVE_ECDH
+      if (session->next_crypto->kex_type == SSH_KEX_ECDH_SHA2_NISTP256) {
+        if (ssh_client_ecdh_init(session) == SSH_ERROR) {
+          goto error;
+        }
+        session->dh_handshake_state = DH_STATE_INIT_SENT;
+        break;
+      }
+#endif
       if (buffer_add_u8(session->out_buffer, SSH2_MSG_KEXDH_INIT) < 0) {
         goto error;
       }
@@ -403,7 +496,7 @@ SSH_PACKET_CALLBACK(ssh_packet_service_accept){
 	(void)user;
 	enter_function();
 	session->auth_service_state=SSH_AUTH_SERVICE_ACCEPTED;
-	ssh_log(session, SSH_LOG_PACKET,
+	SSH_LOG(session, SSH_LOG_PACKET,
 	      "Received SSH_MSG_SERVICE_ACCEPT");
 	leave_function();
 	return SSH_PACKET_USED;
@@ -450,7 +543,7 @@ int ssh_service_request(ssh_session session, const char *service) {
   			break;
   		}
 
-  		ssh_log(session, SSH_LOG_PACKET,
+  		SSH_LOG(session, SSH_LOG_PACKET,
   				"Sent SSH_MSG_SERVICE_REQUEST (service %s)", service);
   		session->auth_service_state=SSH_AUTH_SERVICE_SENT;
   		rc=SSH_AGAIN;
@@ -486,20 +579,146 @@ int ssh_service_request(ssh_session session, const char *service) {
  * @brief A function to be called each time a step has been done in the
  * connection.
  */
+/*
+ * Sends our SSH_MSG_KEXINIT, without waiting for the one of the server. With
+ * SSH_OPTIONS_KEX_GUESS, the first packet of our preferred key exchange
+ * method follows it.
+ */
+static int ssh_client_send_kex(ssh_session session) {
+  char *guess;
+  int rc;
+
+  if (ssh_set_client_kex(session) < 0) {
+    return SSH_ERROR;
+  }
+  session->client_kex.first_kex_follows = session->kex_guess;
+  if (ssh_send_kex(session, 0) < 0) {
+    return SSH_ERROR;
+  }
+  session->kexinit_sent = 1;
+  if (!session->kex_guess) {
+    return SSH_OK;
+  }
+
+  guess = strdup(session->client_kex.methods[SSH_KEX]);
+  if (guess == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  guess[strcspn(guess, ",")] = '\0';
+  rc = ssh_kex_set_type(session, guess);
+  SAFE_FREE(guess);
+  if (rc < 0) {
+    return SSH_ERROR;
+  }
+  session->dh_handshake_state = DH_STATE_INIT;
+  if (dh_handshake(session) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
+/*
+ * Agrees on the methods with the server. A guessed key exchange packet
+ * stands when the server prefers the same methods, otherwise the server
+ * ignores it and the packet of the agreed method is sent.
+ */
+static int ssh_client_select_kex(ssh_session session) {
+  int guessed = session->client_kex.first_kex_follows;
+  int right = guessed && ssh_kex_guess_right(session);
+
+  if (ssh_kex_select_methods(session) < 0) {
+    return SSH_ERROR;
+  }
+  if (right) {
+    SSH_LOG(session, SSH_LOG_PROTOCOL, "The key exchange guess was right");
+    return SSH_OK;
+  }
+  if (guessed) {
+    SSH_LOG(session, SSH_LOG_PROTOCOL, "Wrong key exchange guess, resending");
+    crypto_free(session->next_crypto);
+    session->next_crypto = crypto_new();
+    if (session->next_crypto == NULL) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+    session->dh_handshake_state = DH_STATE_INIT;
+  }
+
+  return ssh_kex_set_type(session, session->client_kex.methods[SSH_KEX]);
+}
+
+/* the steps of a key re-exchange */
+static int ssh_client_rekey(ssh_session session) {
+  if (ssh_kex_next_crypto(session) < 0) {
+    return SSH_ERROR;
+  }
+  switch (session->rekey_state) {
+    case SSH_REKEY_STATE_INIT:
+    case SSH_REKEY_STATE_KEXINIT_RECEIVED:
+      if (ssh_set_client_kex(session) < 0 || ssh_send_kex(session, 0) < 0) {
+        return SSH_ERROR;
+      }
+      if (session->rekey_state == SSH_REKEY_STATE_INIT) {
+        session->rekey_state = SSH_REKEY_STATE_KEXINIT_SENT;
+        break;
+      }
+      /* FALL THROUGH */
+    case SSH_REKEY_STATE_KEXINIT_EXCHANGED:
+      if (ssh_kex_select_methods(session) < 0 ||
+          ssh_kex_set_type(session,
+            session->client_kex.methods[SSH_KEX]) < 0) {
+        return SSH_ERROR;
+      }
+      session->rekey_state = SSH_REKEY_STATE_DH;
+      session->dh_handshake_state = DH_STATE_INIT;
+      if (dh_handshake(session) == SSH_ERROR) {
+        return SSH_ERROR;
+      }
+      break;
+    default:
+      break;
+  }
+
+  return SSH_OK;
+}
+
 static void ssh_client_connection_callback(ssh_session session){
 	int ssh1,ssh2;
 	enter_function();
+	if (session->rekey_state != SSH_REKEY_STATE_NONE &&
+	    session->session_state != SSH_SESSION_STATE_ERROR) {
+		if (ssh_client_rekey(session) < 0) {
+			goto error;
+		}
+		leave_function();
+		return;
+	}
 	switch(session->session_state){
 		case SSH_SESSION_STATE_NONE:
 		case SSH_SESSION_STATE_CONNECTING:
+			break;
 		case SSH_SESSION_STATE_SOCKET_CONNECTED:
+			/*
+			 * Without SSH-1, the version doesn't depend on the server: the
+			 * banner and the key exchange go out at once.
+			 */
+			if (session->ssh2 && !session->ssh1 &&
+			    session->clientbanner == NULL) {
+				session->version = 2;
+				if (ssh_send_banner(session, 0) < 0 ||
+				    ssh_client_send_kex(session) < 0) {
+					goto error;
+				}
+			}
 			break;
 		case SSH_SESSION_STATE_BANNER_RECEIVED:
 		  if (session->serverbanner == NULL) {
 		    goto error;
 		  }
 		  set_status(session, 0.4f);
-		  ssh_log(session, SSH_LOG_RARE,
+		  SSH_LOG(session, SSH_LOG_RARE,
 		      "SSH server banner: %s", session->serverbanner);
 
 		  /* Here we analyze the different protocols the server allows. */
@@ -538,7 +757,13 @@ static void ssh_client_connection_callback(ssh_session session){
 #endif
 		  ssh_packet_set_default_callbacks(session);
 		  session->session_state=SSH_SESSION_STATE_INITIAL_KEX;
-		  ssh_send_banner(session, 0);
+		  if (session->clientbanner == NULL) {
+		    ssh_send_banner(session, 0);
+		  }
+		  if (session->version == 2 && !session->kexinit_sent &&
+		      ssh_client_send_kex(session) < 0) {
+		    goto error;
+		  }
 		  set_status(session, 0.5f);
 		  break;
 		case SSH_SESSION_STATE_INITIAL_KEX:
@@ -556,10 +781,7 @@ static void ssh_client_connection_callback(ssh_session session){
 		case SSH_SESSION_STATE_KEXINIT_RECEIVED:
 			set_status(session,0.6f);
 			ssh_list_kex(session, &session->server_kex);
-			if (set_kex(session) < 0) {
-				goto error;
-			}
-			if (ssh_send_kex(session, 0) < 0) {
+			if (ssh_client_select_kex(session) < 0) {
 				goto error;
 			}
 			set_status(session,0.8f);
@@ -568,10 +790,12 @@ static void ssh_client_connection_callback(ssh_session session){
 				goto error;
 			}
 		case SSH_SESSION_STATE_DH:
-			if(session->dh_handshake_state==DH_STATE_FINISHED){
+			if(session->dh_handshake_state==DH_STATE_FINISHED &&
+			   session->host_key_state != SSH_HOST_KEY_PENDING){
 				set_status(session,1.0f);
 				session->connected = 1;
 				session->session_state=SSH_SESSION_STATE_AUTHENTICATING;
+				ssh_latency_phase(session, SSH_LATENCY_KEX);
 			}
 			break;
 		case SSH_SESSION_STATE_AUTHENTICATING:
@@ -639,7 +863,7 @@ int ssh_connect(ssh_session session) {
   session->alive = 0;
   session->client = 1;
 
-  if (ssh_init() < 0) {
+  if (ssh_init_once() < 0) {
     leave_function();
     return SSH_ERROR;
   }
@@ -655,17 +879,23 @@ int ssh_connect(ssh_session session) {
       leave_function();
       return SSH_ERROR;
   }
-  ssh_log(session,SSH_LOG_RARE,"libssh %s, using threading %s", ssh_copyright(), ssh_threads_get_type());
+  /* the crypto of a previous connection went away with its keys */
+  if (ssh_kex_next_crypto(session) < 0) {
+      leave_function();
+      return SSH_ERROR;
+  }
+  session->host_key_state = SSH_HOST_KEY_NONE;
+  SSH_LOG(session,SSH_LOG_RARE,"libssh %s, using threading %s", ssh_copyright(), ssh_threads_get_type());
   session->ssh_connection_callback = ssh_client_connection_callback;
   session->session_state=SSH_SESSION_STATE_CONNECTING;
+  session->latency_ts = ssh_timestamp_us();
   ssh_socket_set_callbacks(session->socket,&session->socket_callbacks);
   session->socket_callbacks.connected=socket_callback_connected;
   session->socket_callbacks.data=callback_receive_banner;
   session->socket_callbacks.exception=ssh_socket_exception_callback;
   session->socket_callbacks.userdata=session;
   if (session->fd != SSH_INVALID_SOCKET) {
-    ssh_socket_set_fd(session->socket, session->fd);
-    ret=SSH_OK;
+    ret=ssh_socket_connect_fd(session->socket, session->fd);
 #ifndef _WIN32
   } else if (session->ProxyCommand != NULL){
     ret=ssh_socket_connect_proxycommand(session->socket, session->ProxyCommand);
@@ -684,14 +914,27 @@ int ssh_connect(ssh_session session) {
   set_status(session, 0.2f);
 
   session->alive = 1;
-  ssh_log(session,SSH_LOG_PROTOCOL,"Socket connecting, now waiting for the callbacks to work");
+  SSH_LOG(session,SSH_LOG_PROTOCOL,"Socket connecting, now waiting for the callbacks to work");
 pending:
 	session->pending_call_state=SSH_PENDING_CALL_CONNECT;
+  if (ssh_socket_is_resolving(session->socket)) {
+    /* there is nothing to poll before ssh_resolve_done() */
+    if (ssh_is_blocking(session)) {
+      ssh_set_error(session, SSH_FATAL,
+          "The resolver callback didn't resolve the host of a blocking session");
+      session->pending_call_state=SSH_PENDING_CALL_NONE;
+      session->session_state=SSH_SESSION_STATE_ERROR;
+      leave_function();
+      return SSH_ERROR;
+    }
+    leave_function();
+    return SSH_AGAIN;
+  }
   if(ssh_is_blocking(session))
     ssh_handle_packets_termination(session,-1,ssh_connect_termination,session);
   else
     ssh_handle_packets_termination(session,0,ssh_connect_termination, session);
-  ssh_log(session,SSH_LOG_PACKET,"ssh_connect: Actual state : %d",session->session_state);
+  SSH_LOG(session,SSH_LOG_PACKET,"ssh_connect: Actual state : %d",session->session_state);
   if(!ssh_is_blocking(session) && !ssh_connect_termination(session)){
     leave_function();
     return SSH_AGAIN;
@@ -703,6 +946,66 @@ pending:
   return SSH_OK;
 }
 
+int ssh_resolve_done(ssh_session session, const struct addrinfo *ai) {
+  int rc;
+
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  enter_function();
+  if (!ssh_socket_is_resolving(session->socket)) {
+    ssh_set_error(session, SSH_FATAL,
+        "ssh_resolve_done called on a session not resolving its host");
+    leave_function();
+    return SSH_ERROR;
+  }
+  if (ai == NULL) {
+    ssh_set_error(session, SSH_FATAL, "Failed to resolve hostname %s",
+        session->host);
+    rc = SSH_ERROR;
+  } else {
+    rc = ssh_socket_connect_ai(session->socket, ai, session->port,
+        session->bindaddr);
+  }
+  if (rc == SSH_ERROR) {
+    ssh_socket_close(session->socket);
+    session->session_state = SSH_SESSION_STATE_ERROR;
+  }
+  leave_function();
+  return rc;
+}
+
+int ssh_host_key_verified(ssh_session session, int accepted) {
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  enter_function();
+  if (session->host_key_state != SSH_HOST_KEY_PENDING) {
+    ssh_set_error(session, SSH_FATAL,
+        "ssh_host_key_verified called on a session not verifying its host key");
+    leave_function();
+    return SSH_ERROR;
+  }
+  if (!accepted) {
+    session->host_key_state = SSH_HOST_KEY_REJECTED;
+    ssh_set_error(session, SSH_FATAL, "The host key was rejected");
+    ssh_socket_close(session->socket);
+    session->alive = 0;
+    session->session_state = SSH_SESSION_STATE_ERROR;
+    leave_function();
+    return SSH_OK;
+  }
+  session->host_key_state = SSH_HOST_KEY_ACCEPTED;
+  /* the key exchange may be done already, it waited for the answer */
+  if (session->session_state == SSH_SESSION_STATE_DH &&
+      session->dh_handshake_state == DH_STATE_FINISHED) {
+    session->ssh_connection_callback(session);
+  }
+  leave_function();
+
+  return SSH_OK;
+}
+
 /**
  * @brief Get the issue banner from the server.
  *
@@ -776,6 +1079,8 @@ void ssh_disconnect(ssh_session session) {
     ssh_string_free(str);
 
     packet_send(session);
+    /* don't lose the message if the session is corked */
+    ssh_socket_nonblocking_flush(session->socket);
     ssh_socket_close(session->socket);
   }
 error:
@@ -829,6 +1134,7 @@ error:
   if (session->packet_callbacks){
     ssh_list_free(session->packet_callbacks);
     session->packet_callbacks=NULL;
+    session->packet_dispatch_valid=0;
   }
 
   leave_function();
@@ -22,12 +22,18 @@
  */
 
 #include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #include "libssh/priv.h"
 #include "libssh/session.h"
 #include "libssh/misc.h"
+#include "libssh/threads.h"
+#include "libssh/hashtable.h"
 
 enum ssh_config_opcode_e {
   SOC_UNSUPPORTED = -1,
@@ -155,15 +161,159 @@ static int ssh_config_get_yesno(char **str, int notfound) {
   return notfound;
 }
 
-static int ssh_config_parse_line(ssh_session session, const char *line,
-    unsigned int count, int *parsing) {
+/* the configuration files kept parsed */
+#define SSH_CONFIG_CACHE_FILES 8
+
+/* a line of a configuration file, with its argument parsed */
+struct ssh_config_line {
+  enum ssh_config_opcode_e opcode;
+  /* the argument, NULL if it has none */
+  char *str;
+  /* the integer or yes/no argument, -1 if it has none */
+  int i;
+  /* for a Host line, the line of the next one */
+  unsigned int next;
+};
+
+/* a host name or a compiled pattern of a Host line */
+struct ssh_config_host {
+  unsigned int line;
+  char *pattern;
+  struct match_list *match;
+};
+
+/*
+ * A parsed configuration file. It is shared by the cache and the sessions
+ * reading it: it is freed by the last one to release it.
+ */
+struct ssh_config_file {
+  struct ssh_config_file *next;
+  char *filename;
+  time_t mtime;
+  off_t size;
+  unsigned int refs;
+  struct ssh_config_line *lines;
+  unsigned int count;
+  /* the plain host names of the Host lines, by hash of the name */
+  struct ssh_hashtable *names;
+  /* the other patterns of the Host lines, matched one by one */
+  struct ssh_config_host *patterns;
+  unsigned int npatterns;
+};
+
+/* the most recently used file first */
+static struct ssh_config_file *config_cache = NULL;
+static void *config_lock = NULL;
+static int config_initialized = 0;
+
+/* FNV-1a */
+static uint64_t ssh_config_hash(const char *name) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (; *name != '\0'; name++) {
+    h ^= (unsigned char) *name;
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+static void ssh_config_file_free(struct ssh_config_file *file) {
+  struct ssh_hashtable_entry *it;
+  struct ssh_config_host *name;
+  unsigned int i;
+
+  if (file->names != NULL) {
+    for (it = ssh_hashtable_first(file->names); it != NULL;
+        it = ssh_hashtable_next(file->names, it)) {
+      name = it->data;
+      SAFE_FREE(name->pattern);
+      SAFE_FREE(name);
+    }
+    ssh_hashtable_free(file->names);
+  }
+  for (i = 0; i < file->npatterns; i++) {
+    match_list_free(file->patterns[i].match);
+  }
+  for (i = 0; i < file->count; i++) {
+    SAFE_FREE(file->lines[i].str);
+  }
+  SAFE_FREE(file->patterns);
+  SAFE_FREE(file->lines);
+  SAFE_FREE(file->filename);
+  SAFE_FREE(file);
+}
+
+/* indexes a host pattern of a Host line */
+static int ssh_config_add_host(struct ssh_config_file *file,
+    unsigned int line, const char *pattern) {
+  struct ssh_config_host *host;
+  const char *p;
+  size_t len;
+  size_t i;
+
+  if (strpbrk(pattern, "*?!") != NULL) {
+    /* grown by steps of 16 */
+    if (file->npatterns % 16 == 0) {
+      host = realloc(file->patterns,
+          (file->npatterns + 16) * sizeof(struct ssh_config_host));
+      if (host == NULL) {
+        return -1;
+      }
+      file->patterns = host;
+    }
+    host = &file->patterns[file->npatterns];
+    host->line = line;
+    host->pattern = NULL;
+    host->match = match_list_compile(pattern, strlen(pattern));
+    if (host->match == NULL) {
+      return -1;
+    }
+    file->npatterns++;
+    return 0;
+  }
+
+  /* a list of plain names, compared in lowercase like match_hostname() */
+  for (p = pattern; *p != '\0'; p += len + (p[len] == ',')) {
+    len = strcspn(p, ",");
+    if (len == 0) {
+      continue;
+    }
+    host = malloc(sizeof(struct ssh_config_host));
+    if (host == NULL) {
+      return -1;
+    }
+    host->line = line;
+    host->match = NULL;
+    host->pattern = malloc(len + 1);
+    if (host->pattern == NULL) {
+      SAFE_FREE(host);
+      return -1;
+    }
+    for (i = 0; i < len; i++) {
+      host->pattern[i] = (char) tolower((unsigned char) p[i]);
+    }
+    host->pattern[len] = '\0';
+    if (ssh_hashtable_insert(file->names, ssh_config_hash(host->pattern),
+          host) < 0) {
+      SAFE_FREE(host->pattern);
+      SAFE_FREE(host);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int ssh_config_parse_line(ssh_session session,
+    struct ssh_config_file *file, const char *line, unsigned int count,
+    unsigned int *host) {
+  struct ssh_config_line *l;
   enum ssh_config_opcode_e opcode;
   const char *p;
   char *s, *x;
   char *keyword;
-  char *lowerhost;
   size_t len;
-  int i;
 
   x = s = strdup(line);
   if (s == NULL) {
@@ -187,58 +337,278 @@ static int ssh_config_parse_line(ssh_session session, const char *line,
   }
 
   opcode = ssh_config_get_opcode(keyword);
+  if (opcode == SOC_UNSUPPORTED) {
+    SSH_LOG(session, SSH_LOG_RARE, "Unsupported option: %s, line: %d\n",
+            keyword, count);
+    SAFE_FREE(x);
+    return 0;
+  }
+
+  /* grown by steps of 64 */
+  if (file->count % 64 == 0) {
+    l = realloc(file->lines,
+        (file->count + 64) * sizeof(struct ssh_config_line));
+    if (l == NULL) {
+      SAFE_FREE(x);
+      ssh_set_error_oom(session);
+      return -1;
+    }
+    file->lines = l;
+  }
+  l = &file->lines[file->count];
+  ZERO_STRUCTP(l);
+  l->opcode = opcode;
+  l->i = -1;
 
   switch (opcode) {
     case SOC_HOST:
-      *parsing = 0;
-      lowerhost = (session->host) ? ssh_lowercase(session->host) : NULL;
+      if (*host < file->count) {
+        file->lines[*host].next = file->count;
+      }
+      *host = file->count;
+      l->next = UINT_MAX;
       for (p = ssh_config_get_str(&s, NULL); p && *p;
           p = ssh_config_get_str(&s, NULL)) {
-        if (match_hostname(lowerhost, p, strlen(p))) {
-          *parsing = 1;
+        if (ssh_config_add_host(file, file->count, p) < 0) {
+          SAFE_FREE(x);
+          ssh_set_error_oom(session);
+          return -1;
         }
       }
-      SAFE_FREE(lowerhost);
       break;
-    case SOC_HOSTNAME:
+    case SOC_COMPRESSION:
+    case SOC_STRICTHOSTKEYCHECK:
+      l->i = ssh_config_get_yesno(&s, -1);
+      break;
+    case SOC_TIMEOUT:
+      l->i = ssh_config_get_int(&s, -1);
+      break;
+    default:
       p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p != NULL) {
+        l->str = strdup(p);
+        if (l->str == NULL) {
+          SAFE_FREE(x);
+          ssh_set_error_oom(session);
+          return -1;
+        }
+      }
+      break;
+  }
+  file->count++;
+
+  SAFE_FREE(x);
+  return 0;
+}
+
+/* parses a configuration file, a missing file has no line */
+static struct ssh_config_file *ssh_config_file_new(ssh_session session,
+    const char *filename, const struct stat *st) {
+  struct ssh_config_file *file;
+  char line[1024] = {0};
+  unsigned int count = 0;
+  unsigned int host = UINT_MAX;
+  FILE *f;
+
+  file = malloc(sizeof(struct ssh_config_file));
+  if (file == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  ZERO_STRUCTP(file);
+  file->refs = 1;
+  file->mtime = st->st_mtime;
+  file->size = st->st_size;
+  file->filename = strdup(filename);
+  file->names = ssh_hashtable_new();
+  if (file->filename == NULL || file->names == NULL) {
+    ssh_config_file_free(file);
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+
+  if ((f = fopen(filename, "r")) == NULL) {
+    return file;
+  }
+
+  SSH_LOG(session, SSH_LOG_RARE, "Reading configuration data from %s", filename);
+
+  while (fgets(line, sizeof(line), f)) {
+    count++;
+    if (ssh_config_parse_line(session, file, line, count, &host) < 0) {
+      fclose(f);
+      ssh_config_file_free(file);
+      return NULL;
+    }
+  }
+
+  fclose(f);
+  return file;
+}
+
+/* called with the lock held if the file is cached */
+static void ssh_config_file_release(struct ssh_config_file *file) {
+  if (--file->refs > 0) {
+    return;
+  }
+  ssh_config_file_free(file);
+}
+
+/* called with the lock held, drops the least recently used files */
+static void ssh_config_cache_trim(unsigned int max) {
+  struct ssh_config_file **prev;
+  struct ssh_config_file *file;
+  unsigned int i;
+
+  prev = &config_cache;
+  for (i = 0; *prev != NULL && i < max; i++) {
+    prev = &(*prev)->next;
+  }
+  while (*prev != NULL) {
+    file = *prev;
+    *prev = file->next;
+    file->next = NULL;
+    ssh_config_file_release(file);
+  }
+}
+
+/*
+ * Returns the parsed file, from the cache if the file didn't change since it
+ * was parsed.
+ */
+static struct ssh_config_file *ssh_config_file_get(ssh_session session,
+    const char *filename) {
+  struct ssh_config_file **prev;
+  struct ssh_config_file *file;
+  struct stat st;
+
+  ZERO_STRUCT(st);
+  if (stat(filename, &st) < 0) {
+    return ssh_config_file_new(session, filename, &st);
+  }
+
+  if (ssh_threads_mutex_once(&config_lock, &config_initialized) < 0) {
+    return ssh_config_file_new(session, filename, &st);
+  }
+
+  ssh_threads_mutex_lock(&config_lock);
+  for (prev = &config_cache; *prev != NULL; prev = &(*prev)->next) {
+    if (strcmp((*prev)->filename, filename) == 0) {
+      file = *prev;
+      *prev = file->next;
+      if (file->mtime == st.st_mtime && file->size == st.st_size) {
+        file->next = config_cache;
+        config_cache = file;
+        file->refs++;
+        ssh_threads_mutex_unlock(&config_lock);
+        return file;
+      }
+      /* the file was written since */
+      file->next = NULL;
+      ssh_config_file_release(file);
+      break;
+    }
+  }
+  ssh_threads_mutex_unlock(&config_lock);
+
+  /* parsed outside of the lock */
+  file = ssh_config_file_new(session, filename, &st);
+  if (file == NULL) {
+    return NULL;
+  }
+
+  ssh_threads_mutex_lock(&config_lock);
+  /* another session may have parsed the file meanwhile */
+  for (prev = &config_cache; *prev != NULL; prev = &(*prev)->next) {
+    if (strcmp((*prev)->filename, filename) == 0) {
+      struct ssh_config_file *old = *prev;
+
+      *prev = old->next;
+      old->next = NULL;
+      ssh_config_file_release(old);
+      break;
+    }
+  }
+  file->refs++;
+  file->next = config_cache;
+  config_cache = file;
+  ssh_config_cache_trim(SSH_CONFIG_CACHE_FILES);
+  ssh_threads_mutex_unlock(&config_lock);
+
+  return file;
+}
+
+static void ssh_config_file_put(struct ssh_config_file *file) {
+  if (!ssh_atomic_load_int(&config_initialized)) {
+    ssh_config_file_release(file);
+    return;
+  }
+  ssh_threads_mutex_lock(&config_lock);
+  ssh_config_file_release(file);
+  ssh_threads_mutex_unlock(&config_lock);
+}
+
+/* flags the Host lines matching the host */
+static void ssh_config_match_host(struct ssh_config_file *file,
+    const char *host, unsigned char *matched) {
+  struct ssh_hashtable_entry *it;
+  struct ssh_config_host *name;
+  unsigned int i;
+
+  memset(matched, 0, file->count);
+  for (it = ssh_hashtable_find(file->names, ssh_config_hash(host));
+      it != NULL; it = ssh_hashtable_find_next(it)) {
+    name = it->data;
+    if (strcmp(name->pattern, host) == 0) {
+      matched[name->line] = 1;
+    }
+  }
+  for (i = 0; i < file->npatterns; i++) {
+    if (match_list_exec(file->patterns[i].match, host)) {
+      matched[file->patterns[i].line] = 1;
+    }
+  }
+}
+
+static int ssh_config_apply_line(ssh_session session,
+    const struct ssh_config_line *l) {
+  const char *p = l->str;
+  int i;
+
+  switch (l->opcode) {
+    case SOC_HOSTNAME:
+      if (p) {
         ssh_options_set(session, SSH_OPTIONS_HOST, p);
       }
       break;
     case SOC_PORT:
       if (session->port == 22) {
-          p = ssh_config_get_str(&s, NULL);
-          if (p && *parsing) {
+          if (p) {
               ssh_options_set(session, SSH_OPTIONS_PORT_STR, p);
           }
       }
       break;
     case SOC_USERNAME:
       if (session->username == NULL) {
-          p = ssh_config_get_str(&s, NULL);
-          if (p && *parsing) {
+          if (p) {
             ssh_options_set(session, SSH_OPTIONS_USER, p);
          }
       }
       break;
     case SOC_IDENTITY:
-      p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         ssh_options_set(session, SSH_OPTIONS_ADD_IDENTITY, p);
       }
       break;
     case SOC_CIPHERS:
-      p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, p);
         ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, p);
       }
       break;
     case SOC_COMPRESSION:
-      i = ssh_config_get_yesno(&s, -1);
-      if (i >= 0 && *parsing) {
-        if (i) {
+      if (l->i >= 0) {
+        if (l->i) {
           ssh_options_set(session, SSH_OPTIONS_COMPRESSION, "yes");
         } else {
           ssh_options_set(session, SSH_OPTIONS_COMPRESSION, "no");
@@ -246,12 +616,10 @@ static int ssh_config_parse_line(ssh_session session, const char *line,
       }
       break;
     case SOC_PROTOCOL:
-      p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         char *a, *b;
         b = strdup(p);
         if (b == NULL) {
-          SAFE_FREE(x);
           ssh_set_error_oom(session);
           return -1;
         }
@@ -277,67 +645,113 @@ static int ssh_config_parse_line(ssh_session session, const char *line,
       }
       break;
     case SOC_TIMEOUT:
-      i = ssh_config_get_int(&s, -1);
-      if (i >= 0 && *parsing) {
+      if (l->i >= 0) {
+        i = l->i;
         ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &i);
       }
       break;
     case SOC_STRICTHOSTKEYCHECK:
-      i = ssh_config_get_yesno(&s, -1);
-      if (i >= 0 && *parsing) {
+      if (l->i >= 0) {
+        i = l->i;
         ssh_options_set(session, SSH_OPTIONS_STRICTHOSTKEYCHECK, &i);
       }
       break;
     case SOC_KNOWNHOSTS:
-      p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         ssh_options_set(session, SSH_OPTIONS_KNOWNHOSTS, p);
       }
       break;
     case SOC_PROXYCOMMAND:
-      p = ssh_config_get_str(&s, NULL);
-      if (p && *parsing) {
+      if (p) {
         ssh_options_set(session, SSH_OPTIONS_PROXYCOMMAND, p);
       }
       break;
-    case SOC_UNSUPPORTED:
-      ssh_log(session, SSH_LOG_RARE, "Unsupported option: %s, line: %d\n",
-              keyword, count);
-      break;
     default:
       ssh_set_error(session, SSH_FATAL, "ERROR - unimplemented opcode: %d\n",
-              opcode);
-      SAFE_FREE(x);
+              l->opcode);
       return -1;
       break;
   }
 
-  SAFE_FREE(x);
   return 0;
 }
 
-/* ssh_config_parse_file */
+/*
+ * ssh_config_parse_file
+ *
+ * The file is parsed once for all the sessions and parsed again when its
+ * modification time or its size changes. The Host lines not matching the
+ * host are skipped with their options.
+ */
 int ssh_config_parse_file(ssh_session session, const char *filename) {
-  char line[1024] = {0};
-  unsigned int count = 0;
-  FILE *f;
-  int parsing;
-
-  if ((f = fopen(filename, "r")) == NULL) {
+  struct ssh_config_file *file;
+  unsigned char *matched = NULL;
+  char *host = NULL;
+  unsigned int i;
+  int rc = 0;
+
+  file = ssh_config_file_get(session, filename);
+  if (file == NULL) {
+    return -1;
+  }
+  if (file->count == 0) {
+    ssh_config_file_put(file);
     return 0;
   }
 
-  ssh_log(session, SSH_LOG_RARE, "Reading configuration data from %s", filename);
+  matched = malloc(file->count);
+  if (matched == NULL) {
+    ssh_set_error_oom(session);
+    ssh_config_file_put(file);
+    return -1;
+  }
 
-  parsing = 1;
-  while (fgets(line, sizeof(line), f)) {
-    count++;
-    if (ssh_config_parse_line(session, line, count, &parsing) < 0) {
-      fclose(f);
-      return -1;
+  for (i = 0; i < file->count; i++) {
+    if (file->lines[i].opcode != SOC_HOST) {
+      if (ssh_config_apply_line(session, &file->lines[i]) < 0) {
+        rc = -1;
+        break;
+      }
+      continue;
+    }
+
+    /* a HostName line changes the host matched by the next Host lines */
+    if (host == NULL || session->host == NULL ||
+        strcasecmp(host, session->host) != 0) {
+      SAFE_FREE(host);
+      host = session->host ? ssh_lowercase(session->host) : NULL;
+      if (host == NULL) {
+        memset(matched, 0, file->count);
+      } else {
+        ssh_config_match_host(file, host, matched);
+      }
+    }
+    if (!matched[i]) {
+      /* skips the options of the Host line */
+      if (file->lines[i].next == UINT_MAX) {
+        break;
+      }
+      i = file->lines[i].next - 1;
     }
   }
 
-  fclose(f);
-  return 0;
+  SAFE_FREE(host);
+  SAFE_FREE(matched);
+  ssh_config_file_put(file);
+  return rc;
+}
+
+/** @internal
+ * @brief frees the cached configuration files, called by ssh_finalize()
+ */
+void ssh_config_finalize(void) {
+  if (!ssh_atomic_load_int(&config_initialized)) {
+    return;
+  }
+  ssh_threads_mutex_lock(&config_lock);
+  ssh_config_cache_trim(0);
+  ssh_threads_mutex_unlock(&config_lock);
+  ssh_threads_mutex_destroy(&config_lock);
+  config_lock = NULL;
+  config_initialized = 0;
 }
@@ -70,6 +70,7 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #endif /* _WIN32 */
 
@@ -115,7 +116,7 @@ void ssh_sock_set_blocking(socket_t sock) {
 
 #endif /* _WIN32 */
 
-static int ssh_connect_socket_close(socket_t s){
+int ssh_connect_socket_close(socket_t s){
 #ifdef _WIN32
   return closesocket(s);
 #else
@@ -147,251 +148,500 @@ static int getai(ssh_session session, const char *host, int port, struct addrinf
 
   if (ssh_is_ipaddr(host)) {
     /* this is an IP address */
-    ssh_log(session,SSH_LOG_PACKET,"host %s matches an IP address",host);
+    SSH_LOG(session,SSH_LOG_PACKET,"host %s matches an IP address",host);
     hints.ai_flags |= AI_NUMERICHOST;
   }
 
   return getaddrinfo(host, service, &hints, ai);
 }
 
-static int ssh_connect_ai_timeout(ssh_session session, const char *host,
-    int port, struct addrinfo *ai, long timeout, long usec, socket_t s) {
-  int timeout_ms;
-  ssh_pollfd_t fds;
-  int rc = 0;
-  unsigned int len = sizeof(rc);
-
-  enter_function();
-
-  /* I know we're losing some precision. But it's not like poll-like family
-   * type of mechanisms are precise up to the microsecond.
-   */
-  timeout_ms=timeout * 1000 + usec / 1000;
-
-  ssh_sock_set_nonblocking(s);
+/*
+ * The addresses of a host are tried the happy eyeballs way (RFC 8305): the
+ * address families alternate, and the next address is tried every
+ * SSH_CONNECT_ATTEMPT_DELAY ms, or as soon as an attempt fails, while the
+ * earlier attempts keep running. The first connected one wins.
+ */
+struct ssh_connect_attempts {
+  struct sockaddr_storage *addrs;
+  socklen_t *lens;
+  int count;
+  int next;
+  char *bind_addr;
+};
+
+/* the next usable address of the family, or of the other ones */
+static const struct addrinfo *ssh_connect_ai_skip(const struct addrinfo *ai,
+    int family, int same) {
+  for (; ai != NULL; ai = ai->ai_next) {
+    if ((ai->ai_family != AF_INET && ai->ai_family != AF_INET6) ||
+        ai->ai_addrlen > sizeof(struct sockaddr_storage)) {
+      continue;
+    }
+    if ((ai->ai_family == family) == same) {
+      return ai;
+    }
+  }
 
-  ssh_log(session, SSH_LOG_RARE, "Trying to connect to host: %s:%d with "
-      "timeout %d ms", host, port, timeout_ms);
+  return NULL;
+}
 
-  /* The return value is checked later */
-  connect(s, ai->ai_addr, ai->ai_addrlen);
-  freeaddrinfo(ai);
+static void ssh_connect_attempts_add(struct ssh_connect_attempts *attempts,
+    const struct addrinfo *ai, int port) {
+  struct sockaddr_storage *addr = &attempts->addrs[attempts->count];
+
+  memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+  /* addresses from a resolver callback may come without the port */
+  if (ai->ai_family == AF_INET &&
+      ((struct sockaddr_in *) addr)->sin_port == 0) {
+    ((struct sockaddr_in *) addr)->sin_port = htons(port);
+  } else if (ai->ai_family == AF_INET6 &&
+      ((struct sockaddr_in6 *) addr)->sin6_port == 0) {
+    ((struct sockaddr_in6 *) addr)->sin6_port = htons(port);
+  }
+  attempts->lens[attempts->count] = ai->ai_addrlen;
+  attempts->count++;
+}
 
-  fds.fd=s;
-  fds.revents=0;
-  fds.events=POLLOUT;
-#ifdef _WIN32
-  fds.events |= POLLWRNORM;
-#endif
-  rc = ssh_poll(&fds,1,timeout_ms);
+/**
+ * @internal
+ *
+ * @brief Prepare the connection attempts to a list of addresses, in the order
+ * given by getaddrinfo() but alternating the address families.
+ *
+ * @param[in]  session   The session to set the errors on.
+ *
+ * @param[in]  ai        The addresses. They are copied.
+ *
+ * @param[in]  port      The port of the addresses which have none.
+ *
+ * @param[in]  bind_addr The local address to bind to, or NULL.
+ *
+ * @returns The connection attempts, NULL on error.
+ */
+struct ssh_connect_attempts *ssh_connect_attempts_new(ssh_session session,
+    const struct addrinfo *ai, int port, const char *bind_addr) {
+  struct ssh_connect_attempts *attempts;
+  const struct addrinfo *first = NULL;
+  const struct addrinfo *other = NULL;
+  const struct addrinfo *itr;
+  int family = AF_UNSPEC;
+  int count = 0;
+
+  for (itr = ssh_connect_ai_skip(ai, AF_UNSPEC, 0); itr != NULL;
+      itr = ssh_connect_ai_skip(itr->ai_next, AF_UNSPEC, 0)) {
+    if (family == AF_UNSPEC) {
+      family = itr->ai_family;
+    }
+    count++;
+  }
+  if (count == 0) {
+    ssh_set_error(session, SSH_FATAL, "No address to connect to");
+    return NULL;
+  }
 
-  if (rc == 0) {
-    /* timeout */
-    ssh_set_error(session, SSH_FATAL,
-        "Timeout while connecting to %s:%d", host, port);
-    ssh_connect_socket_close(s);
-    leave_function();
-    return -1;
+  attempts = malloc(sizeof(struct ssh_connect_attempts));
+  if (attempts == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  ZERO_STRUCTP(attempts);
+  attempts->addrs = malloc(count * sizeof(struct sockaddr_storage));
+  attempts->lens = malloc(count * sizeof(socklen_t));
+  if (bind_addr != NULL) {
+    attempts->bind_addr = strdup(bind_addr);
+  }
+  if (attempts->addrs == NULL || attempts->lens == NULL ||
+      (bind_addr != NULL && attempts->bind_addr == NULL)) {
+    ssh_set_error_oom(session);
+    ssh_connect_attempts_free(attempts);
+    return NULL;
   }
 
-  if (rc < 0) {
-    ssh_set_error(session, SSH_FATAL,
-        "poll error: %s", strerror(errno));
-    ssh_connect_socket_close(s);
-    leave_function();
-    return -1;
+  /* merge the addresses of the first family with the others */
+  first = ssh_connect_ai_skip(ai, family, 1);
+  other = ssh_connect_ai_skip(ai, family, 0);
+  while (first != NULL || other != NULL) {
+    if (first != NULL) {
+      ssh_connect_attempts_add(attempts, first, port);
+      first = ssh_connect_ai_skip(first->ai_next, family, 1);
+    }
+    if (other != NULL) {
+      ssh_connect_attempts_add(attempts, other, port);
+      other = ssh_connect_ai_skip(other->ai_next, family, 0);
+    }
   }
-  rc = 0;
 
-  /* Get connect(2) return code. Zero means no error */
-  getsockopt(s, SOL_SOCKET, SO_ERROR,(char *) &rc, &len);
+  return attempts;
+}
+
+/**
+ * @internal
+ *
+ * @brief Resolve a host and prepare the connection attempts to its addresses.
+ *
+ * @returns The connection attempts, NULL on error.
+ */
+struct ssh_connect_attempts *ssh_connect_attempts_resolve(ssh_session session,
+    const char *host, int port, const char *bind_addr) {
+  struct ssh_connect_attempts *attempts;
+  struct addrinfo *ai;
+  int rc;
+
+  rc = getai(session, host, port, &ai);
   if (rc != 0) {
     ssh_set_error(session, SSH_FATAL,
-        "Connect to %s:%d failed: %s", host, port, strerror(rc));
-    ssh_connect_socket_close(s);
-    leave_function();
-    return -1;
+        "Failed to resolve hostname %s (%s)", host, gai_strerror(rc));
+    return NULL;
   }
+  attempts = ssh_connect_attempts_new(session, ai, port, bind_addr);
+  freeaddrinfo(ai);
 
-  /* s is connected ? */
-  ssh_log(session, SSH_LOG_PACKET, "Socket connected with timeout\n");
-  ssh_sock_set_blocking(s);
-
-  leave_function();
-  return s;
+  return attempts;
 }
 
 /**
  * @internal
  *
- * @brief Connect to an IPv4 or IPv6 host specified by its IP address or
- * hostname.
+ * @brief Free connection attempts. The sockets already returned by
+ * ssh_connect_attempts_next() are left alone.
+ */
+void ssh_connect_attempts_free(struct ssh_connect_attempts *attempts) {
+  if (attempts == NULL) {
+    return;
+  }
+  SAFE_FREE(attempts->addrs);
+  SAFE_FREE(attempts->lens);
+  SAFE_FREE(attempts->bind_addr);
+  SAFE_FREE(attempts);
+}
+
+/**
+ * @internal
  *
- * @returns A file descriptor, < 0 on error.
+ * @brief Get the number of addresses not tried yet.
  */
-socket_t ssh_connect_host(ssh_session session, const char *host,
-    const char *bind_addr, int port, long timeout, long usec) {
-  socket_t s = -1;
+int ssh_connect_attempts_left(struct ssh_connect_attempts *attempts) {
+  return attempts->count - attempts->next;
+}
+
+static int ssh_connect_bind(ssh_session session, socket_t s,
+    const char *bind_addr) {
+  struct addrinfo *bind_ai;
+  struct addrinfo *bind_itr;
   int rc;
-  struct addrinfo *ai;
-  struct addrinfo *itr;
 
-  enter_function();
+  SSH_LOG(session, SSH_LOG_PACKET, "Resolving %s\n", bind_addr);
 
-  rc = getai(session,host, port, &ai);
+  rc = getai(session,bind_addr, 0, &bind_ai);
   if (rc != 0) {
     ssh_set_error(session, SSH_FATAL,
-        "Failed to resolve hostname %s (%s)", host, gai_strerror(rc));
-    leave_function();
+        "Failed to resolve bind address %s (%s)",
+        bind_addr,
+        gai_strerror(rc));
     return -1;
   }
 
-  for (itr = ai; itr != NULL; itr = itr->ai_next){
-    /* create socket */
-    s = socket(itr->ai_family, itr->ai_socktype, itr->ai_protocol);
-    if (s < 0) {
+  for (bind_itr = bind_ai; bind_itr != NULL; bind_itr = bind_itr->ai_next) {
+    if (bind(s, bind_itr->ai_addr, bind_itr->ai_addrlen) < 0) {
       ssh_set_error(session, SSH_FATAL,
-          "Socket create failed: %s", strerror(errno));
+          "Binding local address: %s", strerror(errno));
       continue;
+    } else {
+      break;
     }
+  }
+  freeaddrinfo(bind_ai);
 
-    if (bind_addr) {
-      struct addrinfo *bind_ai;
-      struct addrinfo *bind_itr;
-
-      ssh_log(session, SSH_LOG_PACKET, "Resolving %s\n", bind_addr);
+  /* Cannot bind to any local addresses */
+  return bind_itr != NULL ? 0 : -1;
+}
 
-      rc = getai(session,bind_addr, 0, &bind_ai);
-      if (rc != 0) {
-        ssh_set_error(session, SSH_FATAL,
-            "Failed to resolve bind address %s (%s)",
-            bind_addr,
-            gai_strerror(rc));
-        leave_function();
-        return -1;
-      }
+/**
+ * @internal
+ *
+ * @brief Launch a nonblocking connect to the next address. The addresses
+ * which fail right away are skipped.
+ *
+ * @returns A file descriptor with a connect in progress, SSH_INVALID_SOCKET
+ *          when no address is left.
+ */
+socket_t ssh_connect_attempts_next(ssh_session session,
+    struct ssh_connect_attempts *attempts) {
+  struct sockaddr *addr;
+  socklen_t len;
+  socket_t s;
+  int rc;
 
-      for (bind_itr = bind_ai; bind_itr != NULL; bind_itr = bind_itr->ai_next) {
-        if (bind(s, bind_itr->ai_addr, bind_itr->ai_addrlen) < 0) {
-          ssh_set_error(session, SSH_FATAL,
-              "Binding local address: %s", strerror(errno));
-          continue;
-        } else {
-          break;
-        }
-      }
-      freeaddrinfo(bind_ai);
+  while (attempts->next < attempts->count) {
+    addr = (struct sockaddr *) &attempts->addrs[attempts->next];
+    len = attempts->lens[attempts->next];
+    attempts->next++;
 
-      /* Cannot bind to any local addresses */
-      if (bind_itr == NULL) {
-        ssh_connect_socket_close(s);
-        s = -1;
-        continue;
-      }
+    /* create socket */
+    s = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == SSH_INVALID_SOCKET) {
+      ssh_set_error(session, SSH_FATAL,
+          "Socket create failed: %s", strerror(errno));
+      continue;
     }
-
-    if (timeout || usec) {
-      socket_t ret = ssh_connect_ai_timeout(session, host, port, itr,
-          timeout, usec, s);
-      leave_function();
-      return ret;
+    if (attempts->bind_addr != NULL &&
+        ssh_connect_bind(session, s, attempts->bind_addr) < 0) {
+      ssh_connect_socket_close(s);
+      continue;
+    }
+    if (ssh_sock_set_options(s, &session->tcp) < 0) {
+      SSH_LOG(session, SSH_LOG_RARE, "Setting socket options: %s",
+          strerror(errno));
     }
+    ssh_sock_set_nonblocking(s);
 
-    if (connect(s, itr->ai_addr, itr->ai_addrlen) < 0) {
+    rc = connect(s, addr, len);
+#ifdef _WIN32
+    if (rc < 0 && WSAGetLastError() != WSAEWOULDBLOCK) {
+#else
+    if (rc < 0 && errno != EINPROGRESS) {
+#endif
       ssh_set_error(session, SSH_FATAL, "Connect failed: %s", strerror(errno));
       ssh_connect_socket_close(s);
-      s = -1;
-      leave_function();
       continue;
-    } else {
-      /* We are connected */
-      break;
     }
+    SSH_LOG(session, SSH_LOG_PROTOCOL, "Connecting to address %d of %d: %d",
+        attempts->next, attempts->count, s);
+
+    return s;
   }
 
-  freeaddrinfo(ai);
-  leave_function();
+  return SSH_INVALID_SOCKET;
+}
 
-  return s;
+/**
+ * @internal
+ *
+ * @brief Get the result of a nonblocking connect once the socket got an event.
+ *
+ * @returns 0 if the socket is connected, the error of the connect otherwise.
+ */
+int ssh_connect_attempt_error(socket_t s) {
+  int rc = 0;
+  socklen_t len = sizeof(rc);
+
+  /* Get connect(2) return code. Zero means no error */
+  if (getsockopt(s, SOL_SOCKET, SO_ERROR, (char *) &rc, &len) < 0) {
+    return errno;
+  }
+
+  return rc;
 }
 
 /**
  * @internal
  *
- * @brief Launches a nonblocking connect to an IPv4 or IPv6 host
- * specified by its IP address or hostname.
+ * @brief Fill the socket options and the channel window of a profile.
+ *
+ * @param tcp           The socket options to overwrite.
+ *
+ * @param window        The channel window to overwrite.
+ *
+ * @param profile       One of the ssh_tcp_profile_e values.
+ */
+void ssh_tcp_options_profile(struct ssh_tcp_options *tcp, uint32_t *window,
+    int profile) {
+  ZERO_STRUCTP(tcp);
+  *window = SSH_CHANNEL_WINDOW_DEFAULT;
+
+  switch (profile) {
+    case SSH_TCP_PROFILE_INTERACTIVE:
+      /* send the keystrokes right away, keep the queue of the kernel short */
+      tcp->nodelay = 1;
+      tcp->notsent_lowat = 16 * 1024;
+      break;
+    case SSH_TCP_PROFILE_BULK:
+      /* fill a long fat link: the window must cover the bandwidth-delay */
+      tcp->sndbuf = 4 * 1024 * 1024;
+      tcp->rcvbuf = 4 * 1024 * 1024;
+      *window = 2 * 1024 * 1024;
+      break;
+    default:
+      break;
+  }
+}
+
+static int ssh_sock_set_int(socket_t s, int level, int name, int value) {
+  return setsockopt(s, level, name, (const char *) &value, sizeof(value));
+}
+
+/**
+ * @internal
+ *
+ * @brief Set the buffer sizes of a socket. They must be set before the
+ * connect or the listen, to be used for the TCP window scale.
+ *
+ * @returns 0 on success, < 0 if an option was refused (see errno).
+ */
+int ssh_sock_set_buffers(socket_t s, const struct ssh_tcp_options *tcp) {
+  int rc = 0;
+
+  if (tcp->sndbuf > 0 &&
+      ssh_sock_set_int(s, SOL_SOCKET, SO_SNDBUF, tcp->sndbuf) < 0) {
+    rc = -1;
+  }
+  if (tcp->rcvbuf > 0 &&
+      ssh_sock_set_int(s, SOL_SOCKET, SO_RCVBUF, tcp->rcvbuf) < 0) {
+    rc = -1;
+  }
+
+  return rc;
+}
+
+/**
+ * @internal
+ *
+ * @brief Set the socket options of a TCP connection. The options unknown to
+ * the platform are ignored.
+ *
+ * @returns 0 on success, < 0 if an option was refused (see errno).
+ */
+int ssh_sock_set_options(socket_t s, const struct ssh_tcp_options *tcp) {
+  int rc;
+
+  rc = ssh_sock_set_buffers(s, tcp);
+  if (tcp->nodelay &&
+      ssh_sock_set_int(s, IPPROTO_TCP, TCP_NODELAY, 1) < 0) {
+    rc = -1;
+  }
+  if (tcp->keepalive > 0) {
+    if (ssh_sock_set_int(s, SOL_SOCKET, SO_KEEPALIVE, 1) < 0) {
+      rc = -1;
+    }
+#if defined(TCP_KEEPIDLE)
+    if (ssh_sock_set_int(s, IPPROTO_TCP, TCP_KEEPIDLE, tcp->keepalive) < 0) {
+      rc = -1;
+    }
+#elif defined(TCP_KEEPALIVE)
+    if (ssh_sock_set_int(s, IPPROTO_TCP, TCP_KEEPALIVE, tcp->keepalive) < 0) {
+      rc = -1;
+    }
+#endif
+  }
+#ifdef TCP_NOTSENT_LOWAT
+  if (tcp->notsent_lowat > 0 &&
+      ssh_sock_set_int(s, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+        tcp->notsent_lowat) < 0) {
+    rc = -1;
+  }
+#endif
+
+  return rc;
+}
+
+/**
+ * @internal
+ *
+ * @brief Connect to an IPv4 or IPv6 host specified by its IP address or
+ * hostname.
  *
  * @returns A file descriptor, < 0 on error.
- * @warning very ugly !!!
  */
-socket_t ssh_connect_host_nonblocking(ssh_session session, const char *host,
-    const char *bind_addr, int port) {
-  socket_t s = -1;
+socket_t ssh_connect_host(ssh_session session, const char *host,
+    const char *bind_addr, int port, long timeout, long usec) {
+  struct ssh_connect_attempts *attempts;
+  ssh_pollfd_t fds[SSH_CONNECT_ATTEMPTS_MAX];
+  socket_t s = SSH_INVALID_SOCKET;
+  uint64_t start, next = 0, now;
+  int timeout_ms = -1;
+  int nfds = 0;
+  int wait;
   int rc;
-  struct addrinfo *ai;
-  struct addrinfo *itr;
+  int i;
 
   enter_function();
 
-  rc = getai(session,host, port, &ai);
-  if (rc != 0) {
-    ssh_set_error(session, SSH_FATAL,
-        "Failed to resolve hostname %s (%s)", host, gai_strerror(rc));
+  attempts = ssh_connect_attempts_resolve(session, host, port, bind_addr);
+  if (attempts == NULL) {
     leave_function();
     return -1;
   }
 
-  for (itr = ai; itr != NULL; itr = itr->ai_next){
-    /* create socket */
-    s = socket(itr->ai_family, itr->ai_socktype, itr->ai_protocol);
-    if (s < 0) {
-      ssh_set_error(session, SSH_FATAL,
-          "Socket create failed: %s", strerror(errno));
-      continue;
+  /* I know we're losing some precision. But it's not like poll-like family
+   * type of mechanisms are precise up to the microsecond.
+   */
+  if (timeout || usec) {
+    timeout_ms = timeout * 1000 + usec / 1000;
+  }
+  start = ssh_timestamp_ms();
+
+  for (;;) {
+    now = ssh_timestamp_ms();
+    if (now >= next && nfds < SSH_CONNECT_ATTEMPTS_MAX) {
+      s = ssh_connect_attempts_next(session, attempts);
+      if (s != SSH_INVALID_SOCKET) {
+        fds[nfds].fd = s;
+        fds[nfds].events = POLLOUT;
+#ifdef _WIN32
+        fds[nfds].events |= POLLWRNORM;
+#endif
+        fds[nfds].revents = 0;
+        nfds++;
+        next = now + SSH_CONNECT_ATTEMPT_DELAY;
+      }
+      s = SSH_INVALID_SOCKET;
+    }
+    if (nfds == 0) {
+      /* the error of the last attempt is set */
+      break;
     }
 
-    if (bind_addr) {
-      struct addrinfo *bind_ai;
-      struct addrinfo *bind_itr;
-
-      ssh_log(session, SSH_LOG_PACKET, "Resolving %s\n", bind_addr);
-
-      rc = getai(session,bind_addr, 0, &bind_ai);
-      if (rc != 0) {
+    wait = -1;
+    if (timeout_ms >= 0) {
+      wait = timeout_ms - (int) (now - start);
+      if (wait <= 0) {
         ssh_set_error(session, SSH_FATAL,
-            "Failed to resolve bind address %s (%s)",
-            bind_addr,
-            gai_strerror(rc));
-        close(s);
-        s=-1;
+            "Timeout while connecting to %s:%d", host, port);
         break;
       }
+    }
+    if (ssh_connect_attempts_left(attempts) > 0 &&
+        nfds < SSH_CONNECT_ATTEMPTS_MAX &&
+        (wait < 0 || (uint64_t) wait > next - now)) {
+      wait = next - now;
+    }
 
-      for (bind_itr = bind_ai; bind_itr != NULL; bind_itr = bind_itr->ai_next) {
-        if (bind(s, bind_itr->ai_addr, bind_itr->ai_addrlen) < 0) {
-          ssh_set_error(session, SSH_FATAL,
-              "Binding local address: %s", strerror(errno));
-          continue;
-        } else {
-          break;
-        }
-      }
-      freeaddrinfo(bind_ai);
+    rc = ssh_poll(fds, nfds, wait);
+    if (rc < 0) {
+      ssh_set_error(session, SSH_FATAL,
+          "poll error: %s", strerror(errno));
+      break;
+    }
 
-      /* Cannot bind to any local addresses */
-      if (bind_itr == NULL) {
-        ssh_connect_socket_close(s);
-        s = -1;
+    for (i = 0; i < nfds; i++) {
+      if (fds[i].revents == 0) {
         continue;
       }
+      rc = ssh_connect_attempt_error(fds[i].fd);
+      if (rc == 0) {
+        s = fds[i].fd;
+        fds[i] = fds[--nfds];
+        break;
+      }
+      ssh_set_error(session, SSH_FATAL,
+          "Connect to %s:%d failed: %s", host, port, strerror(rc));
+      ssh_connect_socket_close(fds[i].fd);
+      fds[i--] = fds[--nfds];
+      /* don't wait for the delay after a failure */
+      next = 0;
+    }
+    if (s != SSH_INVALID_SOCKET) {
+      /* s is connected ? */
+      SSH_LOG(session, SSH_LOG_PACKET, "Socket connected with timeout\n");
+      ssh_sock_set_blocking(s);
+      break;
     }
-    ssh_sock_set_nonblocking(s);
-
-    connect(s, itr->ai_addr, itr->ai_addrlen);
-    break;
   }
 
-  freeaddrinfo(ai);
+  for (i = 0; i < nfds; i++) {
+    ssh_connect_socket_close(fds[i].fd);
+  }
+  ssh_connect_attempts_free(attempts);
   leave_function();
 
   return s;
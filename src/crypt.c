@@ -41,6 +41,7 @@
 #include "libssh/wrapper.h"
 #include "libssh/crypto.h"
 #include "libssh/buffer.h"
+#include "libssh/probes.h"
 
 uint32_t packet_decrypt_len(ssh_session session, char *crypted){
   uint32_t decrypted;
@@ -53,7 +54,7 @@ uint32_t packet_decrypt_len(ssh_session session, char *crypted){
   }
 
   memcpy(&decrypted,crypted,sizeof(decrypted));
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Packet size decrypted: %lu (0x%lx)",
       (long unsigned int) ntohl(decrypted),
       (long unsigned int) ntohl(decrypted));
@@ -61,108 +62,119 @@ uint32_t packet_decrypt_len(ssh_session session, char *crypted){
 }
 
 int packet_decrypt(ssh_session session, void *data,uint32_t len) {
+  return packet_decrypt_to(session, data, data, len);
+}
+
+/**
+ * @internal
+ *
+ * @brief Decrypt len bytes of a packet from src into dest.
+ *
+ * The source may be the socket buffer and the destination the session input
+ * buffer, so the ciphertext doesn't have to be copied before being decrypted.
+ * Both pointers may be equal. The SSH-1 des3 cipher uses src as scratch
+ * space.
+ */
+int packet_decrypt_to(ssh_session session, void *dest, void *src,
+    uint32_t len) {
   struct crypto_struct *crypto = session->current_crypto->in_cipher;
-  char *out = NULL;
+
   if(len % session->current_crypto->in_cipher->blocksize != 0){
     ssh_set_error(session, SSH_FATAL, "Cryptographic functions must be set on at least one blocksize (received %d)",len);
     return SSH_ERROR;
   }
-  out = malloc(len);
-  if (out == NULL) {
-    return -1;
-  }
 
-  ssh_log(session,SSH_LOG_PACKET, "Decrypting %d bytes", len);
+  SSH_LOG(session,SSH_LOG_PACKET, "Decrypting %d bytes", len);
+  SSH_PROBE2(decrypt, session, len);
 
+  /*
+   * The key schedule was set up by crypt_set_keys() and the ciphers of
+   * ssh_ciphertab work both in place and out of place.
+   */
 #ifdef HAVE_LIBGCRYPT
-  if (crypto->set_decrypt_key(crypto, session->current_crypto->decryptkey,
-        session->current_crypto->decryptIV) < 0) {
-    SAFE_FREE(out);
-    return -1;
-  }
-  crypto->cbc_decrypt(crypto,data,out,len);
+  crypto->cbc_decrypt(crypto,src,dest,len);
 #elif defined HAVE_LIBCRYPTO
-  if (crypto->set_decrypt_key(crypto, session->current_crypto->decryptkey) < 0) {
-    SAFE_FREE(out);
-    return -1;
-  }
-  crypto->cbc_decrypt(crypto,data,out,len,session->current_crypto->decryptIV);
+  crypto->cbc_decrypt(crypto,src,dest,len,session->current_crypto->decryptIV);
 #endif
 
-  memcpy(data,out,len);
-  memset(out,0,len);
-
-  SAFE_FREE(out);
   return 0;
 }
 
+/* computes the MAC of a packet with its (network order) sequence number */
+static void packet_hmac(HMACCTX ctx, uint32_t seq, void *data, uint32_t len,
+    unsigned char *hmacbuf) {
+  unsigned int finallen;
+
+  hmac_reset(ctx);
+  hmac_update(ctx,(unsigned char *)&seq,sizeof(uint32_t));
+  hmac_update(ctx,data,len);
+  hmac_digest(ctx,hmacbuf,&finallen);
+#ifdef DEBUG_CRYPTO
+  ssh_print_hexa("mac: ",data,len);
+  ssh_print_hexa("Packet hmac", hmacbuf, finallen);
+#endif
+}
+
 unsigned char *packet_encrypt(ssh_session session, void *data, uint32_t len) {
   struct crypto_struct *crypto = NULL;
   HMACCTX ctx = NULL;
-  char *out = NULL;
-  unsigned int finallen;
+  uint32_t offset;
   uint32_t seq;
+  int etm = 0;
 
   if (!session->current_crypto) {
     return NULL; /* nothing to do here */
   }
-  if(len % session->current_crypto->in_cipher->blocksize != 0){
-      ssh_set_error(session, SSH_FATAL, "Cryptographic functions must be set on at least one blocksize (received %d)",len);
-      return NULL;
-  }
-  out = malloc(len);
-  if (out == NULL) {
-    return NULL;
-  }
-
-  seq = ntohl(session->send_seq);
   crypto = session->current_crypto->out_cipher;
+  SSH_PROBE2(encrypt, session, len);
 
-  ssh_log(session, SSH_LOG_PACKET, 
-      "Encrypting packet with seq num: %d, len: %d",
-      session->send_seq,len);
-
-#ifdef HAVE_LIBGCRYPT
-  if (crypto->set_encrypt_key(crypto, session->current_crypto->encryptkey,
-      session->current_crypto->encryptIV) < 0) {
-    SAFE_FREE(out);
-    return NULL;
-  }
-#elif defined HAVE_LIBCRYPTO
-  if (crypto->set_encrypt_key(crypto, session->current_crypto->encryptkey) < 0) {
-    SAFE_FREE(out);
-    return NULL;
+  if (crypto->tag_size > 0) {
+    /* the length field is not part of the padded data */
+    if ((len - sizeof(uint32_t)) % crypto->blocksize != 0) {
+      ssh_set_error(session, SSH_FATAL, "Cryptographic functions must be set on at least one blocksize (received %d)",len);
+      return NULL;
+    }
+    crypto->aead_encrypt(crypto, data, data, len,
+        session->current_crypto->hmacbuf, session->send_seq);
+    return session->current_crypto->hmacbuf;
   }
-#endif
 
   if (session->version == 2) {
-    ctx = hmac_init(session->current_crypto->encryptMAC,20,HMAC_SHA1);
+    ctx = session->current_crypto->out_hmac;
     if (ctx == NULL) {
-      SAFE_FREE(out);
       return NULL;
     }
-    hmac_update(ctx,(unsigned char *)&seq,sizeof(uint32_t));
-    hmac_update(ctx,data,len);
-    hmac_final(ctx,session->current_crypto->hmacbuf,&finallen);
-#ifdef DEBUG_CRYPTO
-    ssh_print_hexa("mac: ",data,len);
-    if (finallen != 20) {
-      printf("Final len is %d\n",finallen);
-    }
-    ssh_print_hexa("Packet hmac", session->current_crypto->hmacbuf, 20);
-#endif
+    etm = session->current_crypto->out_mac->etm;
+  }
+  /* with encrypt-then-mac, the length field is not encrypted */
+  offset = etm ? sizeof(uint32_t) : 0;
+
+  if((len - offset) % crypto->blocksize != 0){
+      ssh_set_error(session, SSH_FATAL, "Cryptographic functions must be set on at least one blocksize (received %d)",len);
+      return NULL;
+  }
+
+  seq = ntohl(session->send_seq);
+
+  SSH_LOG_EVENT(session, SSH_LOG_PACKET, SSH_LOG_EVENT_PACKET_ENCRYPT,
+      (unsigned int) session->send_seq, (unsigned int) len);
+
+  if (ctx != NULL && !etm) {
+    packet_hmac(ctx, seq, data, len, session->current_crypto->hmacbuf);
   }
 
 #ifdef HAVE_LIBGCRYPT
-  crypto->cbc_encrypt(crypto, data, out, len);
+  crypto->cbc_encrypt(crypto, (uint8_t *) data + offset,
+      (uint8_t *) data + offset, len - offset);
 #elif defined HAVE_LIBCRYPTO
-  crypto->cbc_encrypt(crypto, data, out, len,
+  crypto->cbc_encrypt(crypto, (uint8_t *) data + offset,
+      (uint8_t *) data + offset, len - offset,
       session->current_crypto->encryptIV);
 #endif
 
-  memcpy(data, out, len);
-  memset(out, 0, len);
-  SAFE_FREE(out);
+  if (ctx != NULL && etm) {
+    packet_hmac(ctx, seq, data, len, session->current_crypto->hmacbuf);
+  }
 
   if (session->version == 2) {
     return session->current_crypto->hmacbuf;
@@ -177,36 +189,37 @@ unsigned char *packet_encrypt(ssh_session session, void *data, uint32_t len) {
  * @brief Verify the hmac of a packet
  *
  * @param  session      The session to use.
- * @param  buffer       The buffer to verify the hmac from.
+ * @param  data         The packet to verify the hmac from.
+ *
+ * @param  len          The length of the packet.
  * @param  mac          The mac to compare with the hmac.
  *
  * @return              0 if hmac and mac are equal, < 0 if not or an error
  *                      occurred.
  */
-int packet_hmac_verify(ssh_session session, ssh_buffer buffer,
+int packet_hmac_verify(ssh_session session, const void *data, uint32_t len,
     unsigned char *mac) {
   unsigned char hmacbuf[EVP_MAX_MD_SIZE] = {0};
   HMACCTX ctx;
-  unsigned int len;
+  unsigned int maclen;
   uint32_t seq;
 
-  ctx = hmac_init(session->current_crypto->decryptMAC, 20, HMAC_SHA1);
+  ctx = session->current_crypto->in_hmac;
   if (ctx == NULL) {
     return -1;
   }
 
   seq = htonl(session->recv_seq);
 
-  hmac_update(ctx, (unsigned char *) &seq, sizeof(uint32_t));
-  hmac_update(ctx, buffer_get_rest(buffer), buffer_get_rest_len(buffer));
-  hmac_final(ctx, hmacbuf, &len);
+  packet_hmac(ctx, seq, (void *) data, len, hmacbuf);
+  maclen = session->current_crypto->in_mac->size;
 
 #ifdef DEBUG_CRYPTO
-  ssh_print_hexa("received mac",mac,len);
-  ssh_print_hexa("Computed mac",hmacbuf,len);
+  ssh_print_hexa("received mac",mac,maclen);
+  ssh_print_hexa("Computed mac",hmacbuf,maclen);
   ssh_print_hexa("seq",(unsigned char *)&seq,sizeof(uint32_t));
 #endif
-  if (memcmp(mac, hmacbuf, len) == 0) {
+  if (memcmp(mac, hmacbuf, maclen) == 0) {
     return 0;
   }
 
@@ -0,0 +1,345 @@
+/*
+ * curve25519.c - the curve25519-sha256 key exchange
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * The X25519 function follows the public domain TweetNaCl implementation:
+ * field elements are 16 limbs of 16 bits and the Montgomery ladder swaps
+ * its points without branches. The field arithmetic is shared with the
+ * ed25519 signatures. The key exchange is the one of RFC 8731,
+ * also known as curve25519-sha256@libssh.org.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/ssh2.h"
+#include "libssh/buffer.h"
+#include "libssh/packet.h"
+#include "libssh/session.h"
+#include "libssh/crypto.h"
+#include "libssh/dh.h"
+#include "libssh/curve25519.h"
+#include "libssh/kexpool.h"
+
+static const fe25519 gf_121665 = {0xDB41, 1};
+
+static const uint8_t curve25519_basepoint[CURVE25519_PUBKEY_SIZE] = {9};
+
+/* propagates the carries, 2^256 is 38 modulo 2^255 - 19 */
+void car25519(fe25519 o) {
+  int64_t c;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    o[i] += (1LL << 16);
+    c = o[i] >> 16;
+    if (i < 15) {
+      o[i + 1] += c - 1;
+    } else {
+      o[0] += 38 * (c - 1);
+    }
+    o[i] -= c * 65536;
+  }
+}
+
+/* swaps p and q if b is 1, in constant time */
+void sel25519(fe25519 p, fe25519 q, int b) {
+  int64_t t, c = ~(b - 1);
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    t = c & (p[i] ^ q[i]);
+    p[i] ^= t;
+    q[i] ^= t;
+  }
+}
+
+void pack25519(uint8_t *o, const fe25519 n) {
+  fe25519 m, t;
+  int i, j, b;
+
+  for (i = 0; i < 16; i++) {
+    t[i] = n[i];
+  }
+  car25519(t);
+  car25519(t);
+  car25519(t);
+  for (j = 0; j < 2; j++) {
+    m[0] = t[0] - 0xffed;
+    for (i = 1; i < 15; i++) {
+      m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+      m[i - 1] &= 0xffff;
+    }
+    m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+    b = (int) ((m[15] >> 16) & 1);
+    m[14] &= 0xffff;
+    sel25519(t, m, 1 - b);
+  }
+  for (i = 0; i < 16; i++) {
+    o[2 * i] = (uint8_t) (t[i] & 0xff);
+    o[2 * i + 1] = (uint8_t) (t[i] >> 8);
+  }
+}
+
+void unpack25519(fe25519 o, const uint8_t *n) {
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    o[i] = n[2 * i] + ((int64_t) n[2 * i + 1] << 8);
+  }
+  o[15] &= 0x7fff;
+}
+
+void add25519(fe25519 o, const fe25519 a, const fe25519 b) {
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    o[i] = a[i] + b[i];
+  }
+}
+
+void sub25519(fe25519 o, const fe25519 a, const fe25519 b) {
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    o[i] = a[i] - b[i];
+  }
+}
+
+void mul25519(fe25519 o, const fe25519 a, const fe25519 b) {
+  int64_t t[31];
+  int i, j;
+
+  for (i = 0; i < 31; i++) {
+    t[i] = 0;
+  }
+  for (i = 0; i < 16; i++) {
+    for (j = 0; j < 16; j++) {
+      t[i + j] += a[i] * b[j];
+    }
+  }
+  for (i = 0; i < 15; i++) {
+    t[i] += 38 * t[i + 16];
+  }
+  for (i = 0; i < 16; i++) {
+    o[i] = t[i];
+  }
+  car25519(o);
+  car25519(o);
+}
+
+/* o = i^(p - 2) */
+void inv25519(fe25519 o, const fe25519 i) {
+  fe25519 c;
+  int a;
+
+  for (a = 0; a < 16; a++) {
+    c[a] = i[a];
+  }
+  for (a = 253; a >= 0; a--) {
+    mul25519(c, c, c);
+    if (a != 2 && a != 4) {
+      mul25519(c, c, i);
+    }
+  }
+  for (a = 0; a < 16; a++) {
+    o[a] = c[a];
+  }
+}
+
+void crypto_scalarmult_curve25519(uint8_t *q, const uint8_t *n,
+    const uint8_t *p) {
+  uint8_t z[32];
+  fe25519 x, a, b, c, d, e, f;
+  int i, r;
+
+  memcpy(z, n, 32);
+  z[31] = (z[31] & 127) | 64;
+  z[0] &= 248;
+
+  unpack25519(x, p);
+  for (i = 0; i < 16; i++) {
+    b[i] = x[i];
+    a[i] = c[i] = d[i] = 0;
+  }
+  a[0] = d[0] = 1;
+
+  for (i = 254; i >= 0; i--) {
+    r = (z[i >> 3] >> (i & 7)) & 1;
+    sel25519(a, b, r);
+    sel25519(c, d, r);
+    add25519(e, a, c);
+    sub25519(a, a, c);
+    add25519(c, b, d);
+    sub25519(b, b, d);
+    mul25519(d, e, e);
+    mul25519(f, a, a);
+    mul25519(a, c, a);
+    mul25519(c, b, e);
+    add25519(e, a, c);
+    sub25519(a, a, c);
+    mul25519(b, a, a);
+    sub25519(c, d, f);
+    mul25519(a, c, gf_121665);
+    add25519(a, a, d);
+    mul25519(c, c, a);
+    mul25519(a, d, f);
+    mul25519(d, b, x);
+    mul25519(b, e, e);
+    sel25519(a, b, r);
+    sel25519(c, d, r);
+  }
+  inv25519(c, c);
+  mul25519(a, a, c);
+  pack25519(q, a);
+
+  memset(z, 0, sizeof(z));
+}
+
+void crypto_scalarmult_curve25519_base(uint8_t *q, const uint8_t *n) {
+  crypto_scalarmult_curve25519(q, n, curve25519_basepoint);
+}
+
+/*
+ * Gets our key pair, from the key exchange pool for a server. The public key
+ * is returned in a new string.
+ */
+static ssh_string curve25519_keypair(ssh_session session) {
+  struct ssh_crypto_struct *crypto = session->next_crypto;
+  uint8_t pubkey[CURVE25519_PUBKEY_SIZE];
+  ssh_string str;
+  int pooled = 0;
+
+#ifdef WITH_SERVER
+  if (session->server) {
+    pooled = ssh_kex_pool_take_curve25519(crypto->curve25519_privkey,
+        pubkey) == 0;
+  }
+#endif
+  if (!pooled) {
+    if (ssh_get_random(crypto->curve25519_privkey,
+          CURVE25519_PRIVKEY_SIZE, 1) != 1) {
+      ssh_set_error(session, SSH_FATAL, "PRNG error");
+      return NULL;
+    }
+    crypto_scalarmult_curve25519_base(pubkey, crypto->curve25519_privkey);
+  }
+
+  str = ssh_string_new(CURVE25519_PUBKEY_SIZE);
+  if (str == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  ssh_string_fill(str, pubkey, CURVE25519_PUBKEY_SIZE);
+
+  return str;
+}
+
+/** @internal
+ * @brief Starts a curve25519-sha256 key exchange by sending our public key
+ * in SSH2_MSG_KEX_ECDH_INIT.
+ */
+int ssh_client_curve25519_init(ssh_session session) {
+  ssh_string pubkey;
+
+  pubkey = curve25519_keypair(session);
+  if (pubkey == NULL) {
+    return SSH_ERROR;
+  }
+  session->next_crypto->ecdh_client_pubkey = pubkey;
+
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_KEX_ECDH_INIT) < 0 ||
+      buffer_add_ssh_string(session->out_buffer, pubkey) < 0) {
+    ssh_set_error_oom(session);
+    buffer_reinit(session->out_buffer);
+    return SSH_ERROR;
+  }
+
+  return packet_send(session);
+}
+
+/** @internal
+ * @brief Answers the public key of the client: generates the key pair of
+ * the server and the shared secret. The reply itself is sent by the
+ * server handshake.
+ */
+int ssh_server_curve25519_init(ssh_session session) {
+  ssh_string pubkey;
+
+  pubkey = curve25519_keypair(session);
+  if (pubkey == NULL) {
+    return SSH_ERROR;
+  }
+  session->next_crypto->ecdh_server_pubkey = pubkey;
+
+  return curve25519_build_k(session);
+}
+
+int curve25519_build_k(ssh_session session) {
+  struct ssh_crypto_struct *crypto = session->next_crypto;
+  ssh_string peer;
+  uint8_t k[CURVE25519_PUBKEY_SIZE];
+  uint8_t zero = 0;
+  int i;
+
+  peer = session->client ? crypto->ecdh_server_pubkey :
+    crypto->ecdh_client_pubkey;
+  if (peer == NULL || ssh_string_len(peer) != CURVE25519_PUBKEY_SIZE) {
+    ssh_set_error(session, SSH_FATAL, "Invalid curve25519 public key");
+    return SSH_ERROR;
+  }
+
+  crypto_scalarmult_curve25519(k, crypto->curve25519_privkey,
+      ssh_string_data(peer));
+  memset(crypto->curve25519_privkey, 0, CURVE25519_PRIVKEY_SIZE);
+
+  /* a low order point gives an all zero secret, RFC 8731 section 3 */
+  for (i = 0; i < CURVE25519_PUBKEY_SIZE; i++) {
+    zero |= k[i];
+  }
+  if (zero == 0) {
+    ssh_set_error(session, SSH_FATAL, "Invalid curve25519 shared secret");
+    return SSH_ERROR;
+  }
+
+  /* K is the 32 bytes of the secret read as a big endian number */
+#ifdef HAVE_LIBGCRYPT
+  bignum_bin2bn(k, CURVE25519_PUBKEY_SIZE, &crypto->k);
+#elif defined HAVE_LIBCRYPTO
+  crypto->k = bignum_bin2bn(k, CURVE25519_PUBKEY_SIZE, NULL);
+#endif
+  memset(k, 0, sizeof(k));
+  if (crypto->k == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+
+#ifdef DEBUG_CRYPTO
+  ssh_print_bignum("Shared secret key", crypto->k);
+#endif
+
+  return SSH_OK;
+}
+
+/* vim: set ts=2 sw=2 et cindent: */
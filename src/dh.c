@@ -47,6 +47,8 @@
 
 #ifndef _WIN32
 #include <arpa/inet.h>
+#include <sys/time.h>
+#include <unistd.h>
 #endif
 
 #include "libssh/priv.h"
@@ -104,6 +106,31 @@ int ssh_get_random(void *where, int len, int strong){
   return 1;
 }
 
+#ifndef _WIN32
+/** @internal
+ * @brief stirs the random generator in a forked process
+ *
+ * The child starts with a copy of the state of its parent: without new
+ * entropy, both would draw the same numbers.
+ */
+void ssh_crypto_reseed(void) {
+#ifdef HAVE_LIBGCRYPT
+  /* libgcrypt notices the new pid, this also mixes the time in */
+  gcry_fast_random_poll();
+#elif defined HAVE_LIBCRYPTO
+  struct {
+    pid_t pid;
+    struct timeval tv;
+  } seed;
+
+  seed.pid = getpid();
+  gettimeofday(&seed.tv, NULL);
+  RAND_add(&seed, sizeof(seed), 0.0);
+  RAND_poll();
+#endif
+}
+#endif /* _WIN32 */
+
 /*
  * This inits the values g and p which are used for DH key agreement
  * FIXME: Make the function thread safe by adding a semaphore or mutex.
@@ -154,6 +181,7 @@ void ssh_crypto_finalize(void) {
     g = NULL;
     bignum_free(p);
     p = NULL;
+    ssh_set_crypto_engine(NULL);
     ssh_crypto_initialized=0;
 
   }
@@ -333,6 +361,51 @@ int dh_generate_f(ssh_session session) {
   return 0;
 }
 
+/*
+ * Makes a server key pair (y, f) without a session, for the key exchange
+ * pool. The caller frees both numbers.
+ */
+int dh_generate_keypair(bignum *y, bignum *f) {
+#ifdef HAVE_LIBCRYPTO
+  bignum_CTX ctx;
+#endif
+
+  if (!ssh_crypto_initialized) {
+    return -1;
+  }
+
+  *y = bignum_new();
+  *f = bignum_new();
+  if (*y == NULL || *f == NULL) {
+    goto error;
+  }
+
+#ifdef HAVE_LIBGCRYPT
+  bignum_rand(*y, 128);
+  bignum_mod_exp(*f, g, *y, p);
+#elif defined HAVE_LIBCRYPTO
+  ctx = bignum_ctx_new();
+  if (ctx == NULL) {
+    goto error;
+  }
+  bignum_rand(*y, 128, 0, -1);
+  bignum_mod_exp(*f, g, *y, p, ctx);
+  bignum_ctx_free(ctx);
+#endif
+
+  return 0;
+error:
+  if (*y != NULL) {
+    bignum_free(*y);
+    *y = NULL;
+  }
+  if (*f != NULL) {
+    bignum_free(*f);
+    *f = NULL;
+  }
+  return -1;
+}
+
 ssh_string make_bignum_string(bignum num) {
   ssh_string ptr = NULL;
   int pad = 0;
@@ -349,11 +422,10 @@ ssh_string make_bignum_string(bignum num) {
   fprintf(stderr, "%d bits, %d bytes, %d padding\n", bits, len, pad);
 #endif /* DEBUG_CRYPTO */
 /* TODO: fix that crap !! */
-  ptr = malloc(4 + len + pad);
+  ptr = ssh_string_new(len + pad);
   if (ptr == NULL) {
     return NULL;
   }
-  ptr->size = htonl(len + pad);
   if (pad) {
     ptr->string[0] = 0;
   }
@@ -482,46 +554,109 @@ static void sha_add(ssh_string str,SHACTX ctx){
 }
 */
 
-int make_sessionid(ssh_session session) {
-  SHACTX ctx;
-  ssh_string num = NULL;
-  ssh_string str = NULL;
-  ssh_buffer server_hash = NULL;
-  ssh_buffer client_hash = NULL;
-  ssh_buffer buf = NULL;
-  uint32_t len;
-  int rc = SSH_ERROR;
-
-  enter_function();
-
-  ctx = sha1_init();
-  if (ctx == NULL) {
-    return rc;
+/*
+ * The exchange hash and the key derivation use the hash of the key exchange
+ * method: SHA1 for the DH group, SHA256 for ECDH.
+ */
+struct kex_digest {
+  unsigned int len;
+  SHACTX sha1;
+  SHA256CTX sha256;
+};
+
+static int kex_digest_init(struct kex_digest *d, unsigned int len) {
+  d->len = len;
+  if (len == SHA256_DIGEST_LEN) {
+    d->sha256 = sha256_init();
+    return d->sha256 == NULL ? -1 : 0;
   }
+  d->sha1 = sha1_init();
+  return d->sha1 == NULL ? -1 : 0;
+}
 
-  buf = ssh_buffer_new();
-  if (buf == NULL) {
-    return rc;
+static void kex_digest_update(struct kex_digest *d, const void *data,
+    unsigned long len) {
+  if (d->len == SHA256_DIGEST_LEN) {
+    sha256_update(d->sha256, data, len);
+  } else {
+    sha1_update(d->sha1, data, len);
   }
+}
 
-  str = ssh_string_from_char(session->clientbanner);
-  if (str == NULL) {
-    goto error;
+static void kex_digest_final(struct kex_digest *d, unsigned char *md) {
+  if (d->len == SHA256_DIGEST_LEN) {
+    sha256_final(md, d->sha256);
+  } else {
+    sha1_final(md, d->sha1);
   }
+}
 
-  if (buffer_add_ssh_string(buf, str) < 0) {
-    goto error;
+/* starts dst where src is, src can still be used */
+static int kex_digest_duplicate(struct kex_digest *dst,
+    struct kex_digest *src) {
+  dst->len = src->len;
+  if (src->len == SHA256_DIGEST_LEN) {
+    dst->sha256 = sha256_duplicate(src->sha256);
+    return dst->sha256 == NULL ? -1 : 0;
   }
-  ssh_string_free(str);
+  dst->sha1 = sha1_duplicate(src->sha1);
+  return dst->sha1 == NULL ? -1 : 0;
+}
 
-  str = ssh_string_from_char(session->serverbanner);
-  if (str == NULL) {
-    goto error;
+/* releases a digest without using its result */
+static void kex_digest_free(struct kex_digest *d) {
+  unsigned char md[SHA256_DIGEST_LEN];
+
+  kex_digest_final(d, md);
+  memset(md, 0, sizeof(md));
+}
+
+/* hashes data as an SSH string, its length first */
+static void kex_digest_string(struct kex_digest *d, const void *data,
+    uint32_t len) {
+  uint32_t netlen = htonl(len);
+
+  kex_digest_update(d, &netlen, sizeof(netlen));
+  kex_digest_update(d, data, len);
+}
+
+/* hashes a public value of the key exchange, e and f or Q_C and Q_S */
+static int kex_add_public(ssh_session session, struct kex_digest *d,
+    int client) {
+  struct ssh_crypto_struct *crypto = session->next_crypto;
+  ssh_string num;
+
+  if (crypto->kex_type != SSH_KEX_DH_GROUP1_SHA1) {
+    num = client ? crypto->ecdh_client_pubkey : crypto->ecdh_server_pubkey;
+    if (num == NULL) {
+      return -1;
+    }
+    kex_digest_update(d, num, ssh_string_len(num) + 4);
+    return 0;
   }
 
-  if (buffer_add_ssh_string(buf, str) < 0) {
-    goto error;
+  num = make_bignum_string(client ? crypto->e : crypto->f);
+  if (num == NULL) {
+    return -1;
   }
+  kex_digest_update(d, num, ssh_string_len(num) + 4);
+  ssh_string_free(num);
+
+  return 0;
+}
+
+/*
+ * H = HASH(V_C || V_S || I_C || I_S || K_S || e || f || K), the parts are
+ * hashed as they come without being copied in a buffer first.
+ */
+int make_sessionid(ssh_session session) {
+  struct kex_digest ctx;
+  ssh_string num = NULL;
+  ssh_buffer server_hash = NULL;
+  ssh_buffer client_hash = NULL;
+  int rc = SSH_ERROR;
+
+  enter_function();
 
   if (session->client) {
     server_hash = session->in_hashbuf;
@@ -531,96 +666,70 @@ int make_sessionid(ssh_session session) {
     client_hash = session->in_hashbuf;
   }
 
-  if (buffer_add_u32(server_hash, 0) < 0) {
-    goto error;
-  }
-  if (buffer_add_u8(server_hash, 0) < 0) {
-    goto error;
-  }
-  if (buffer_add_u32(client_hash, 0) < 0) {
-    goto error;
-  }
-  if (buffer_add_u8(client_hash, 0) < 0) {
+  if (session->clientbanner == NULL || session->serverbanner == NULL ||
+      kex_digest_init(&ctx, session->next_crypto->digest_len) < 0) {
     goto error;
   }
 
-  len = ntohl(buffer_get_rest_len(client_hash));
-  if (buffer_add_u32(buf,len) < 0) {
-    goto error;
-  }
-  if (buffer_add_data(buf, buffer_get_rest(client_hash),
-        buffer_get_rest_len(client_hash)) < 0) {
-    goto error;
-  }
+  kex_digest_string(&ctx, session->clientbanner,
+      strlen(session->clientbanner));
+  kex_digest_string(&ctx, session->serverbanner,
+      strlen(session->serverbanner));
 
-  len = ntohl(buffer_get_rest_len(server_hash));
-  if (buffer_add_u32(buf, len) < 0) {
-    goto error;
-  }
-  if (buffer_add_data(buf, buffer_get_rest(server_hash),
-        buffer_get_rest_len(server_hash)) < 0) {
-    goto error;
-  }
-
-  len = ssh_string_len(session->next_crypto->server_pubkey) + 4;
-  if (buffer_add_data(buf, session->next_crypto->server_pubkey, len) < 0) {
-    goto error;
-  }
+  /* the hash buffers hold the whole SSH_MSG_KEXINIT payloads */
+  kex_digest_string(&ctx, buffer_get_rest(client_hash),
+      buffer_get_rest_len(client_hash));
+  kex_digest_string(&ctx, buffer_get_rest(server_hash),
+      buffer_get_rest_len(server_hash));
 
-  num = make_bignum_string(session->next_crypto->e);
-  if (num == NULL) {
-    goto error;
-  }
+  kex_digest_update(&ctx, session->next_crypto->server_pubkey,
+      ssh_string_len(session->next_crypto->server_pubkey) + 4);
 
-  len = ssh_string_len(num) + 4;
-  if (buffer_add_data(buf, num, len) < 0) {
+  if (kex_add_public(session, &ctx, 1) < 0 ||
+      kex_add_public(session, &ctx, 0) < 0) {
+    kex_digest_free(&ctx);
     goto error;
   }
 
-  ssh_string_free(num);
-  num = make_bignum_string(session->next_crypto->f);
-  if (num == NULL) {
-    goto error;
-  }
-
-  len = ssh_string_len(num) + 4;
-  if (buffer_add_data(buf, num, len) < 0) {
-    goto error;
-  }
-
-  ssh_string_free(num);
   num = make_bignum_string(session->next_crypto->k);
   if (num == NULL) {
+    kex_digest_free(&ctx);
     goto error;
   }
-
-  len = ssh_string_len(num) + 4;
-  if (buffer_add_data(buf, num, len) < 0) {
-    goto error;
+  kex_digest_update(&ctx, num, ssh_string_len(num) + 4);
+  kex_digest_final(&ctx, session->next_crypto->secret_hash);
+
+  /* the session identifier is the H of the first key exchange */
+  if (session->current_crypto != NULL) {
+    memcpy(session->next_crypto->session_id,
+        session->current_crypto->session_id,
+        session->current_crypto->session_id_len);
+    session->next_crypto->session_id_len =
+      session->current_crypto->session_id_len;
+  } else {
+    memcpy(session->next_crypto->session_id,
+        session->next_crypto->secret_hash, session->next_crypto->digest_len);
+    session->next_crypto->session_id_len = session->next_crypto->digest_len;
   }
 
-#ifdef DEBUG_CRYPTO
-  ssh_print_hexa("hash buffer", ssh_buffer_get_begin(buf), ssh_buffer_get_len(buf));
-#endif
-
-  sha1_update(ctx, buffer_get_rest(buf), buffer_get_rest_len(buf));
-  sha1_final(session->next_crypto->session_id, ctx);
-
 #ifdef DEBUG_CRYPTO
   printf("Session hash: ");
-  ssh_print_hexa("session id", session->next_crypto->session_id, SHA_DIGEST_LEN);
+  ssh_print_hexa("exchange hash", session->next_crypto->secret_hash,
+      session->next_crypto->digest_len);
+  ssh_print_hexa("session id", session->next_crypto->session_id,
+      session->next_crypto->session_id_len);
 #endif
 
   rc = SSH_OK;
 error:
-  ssh_buffer_free(buf);
   ssh_buffer_free(client_hash);
   ssh_buffer_free(server_hash);
 
   session->in_hashbuf = NULL;
   session->out_hashbuf = NULL;
 
-  ssh_string_free(str);
+  /* the shared secret */
+  ssh_string_burn(num);
   ssh_string_free(num);
 
   leave_function();
@@ -657,7 +766,9 @@ int hashbufout_add_cookie(ssh_session session) {
 }
 
 int hashbufin_add_cookie(ssh_session session, unsigned char *cookie) {
-  session->in_hashbuf = ssh_buffer_new();
+  /* the rest of the KEXINIT packet is added after the cookie */
+  session->in_hashbuf = ssh_buffer_new_sized(1 + 16 +
+      buffer_get_rest_len(session->in_buffer));
   if (session->in_hashbuf == NULL) {
     return -1;
   }
@@ -674,73 +785,109 @@ int hashbufin_add_cookie(ssh_session session, unsigned char *cookie) {
   return 0;
 }
 
-static int generate_one_key(ssh_string k,
-    unsigned char session_id[SHA_DIGEST_LEN],
-    unsigned char output[SHA_DIGEST_LEN],
+/* HASH(K || H || letter || session_id), prefix has hashed K || H */
+static int generate_one_key(struct kex_digest *prefix,
+    struct ssh_crypto_struct *crypto,
+    unsigned char *output,
     char letter) {
-  SHACTX ctx = NULL;
+  struct kex_digest ctx;
 
-  ctx = sha1_init();
-  if (ctx == NULL) {
+  if (kex_digest_duplicate(&ctx, prefix) < 0) {
     return -1;
   }
 
-  sha1_update(ctx, k, ssh_string_len(k) + 4);
-  sha1_update(ctx, session_id, SHA_DIGEST_LEN);
-  sha1_update(ctx, &letter, 1);
-  sha1_update(ctx, session_id, SHA_DIGEST_LEN);
-  sha1_final(output, ctx);
+  kex_digest_update(&ctx, &letter, 1);
+  kex_digest_update(&ctx, crypto->session_id, crypto->session_id_len);
+  kex_digest_final(&ctx, output);
+
+  return 0;
+}
+
+/*
+ * Extend a key to keysize bits as described in RFC 4253 section 7.2:
+ * K2 = HASH(K || H || K1), K3 = HASH(K || H || K1 || K2), ...
+ * key must have room for keysize bits rounded up to the digest length.
+ */
+static int extend_key(struct kex_digest *prefix,
+    struct ssh_crypto_struct *crypto,
+    unsigned char *key,
+    unsigned int keysize) {
+  struct kex_digest ctx;
+  unsigned int len;
+
+  for (len = crypto->digest_len; len * 8 < keysize;
+      len += crypto->digest_len) {
+    if (kex_digest_duplicate(&ctx, prefix) < 0) {
+      return -1;
+    }
+    kex_digest_update(&ctx, key, len);
+    kex_digest_final(&ctx, key + len);
+  }
 
   return 0;
 }
 
 int generate_session_keys(ssh_session session) {
+  struct kex_digest prefix;
   ssh_string k_string = NULL;
-  SHACTX ctx = NULL;
   int rc = -1;
 
   enter_function();
 
   k_string = make_bignum_string(session->next_crypto->k);
   if (k_string == NULL) {
-    goto error;
+    leave_function();
+    return -1;
   }
 
+  /* K || H starts every derived key, it is hashed once */
+  if (kex_digest_init(&prefix, session->next_crypto->digest_len) < 0) {
+    ssh_string_burn(k_string);
+    ssh_string_free(k_string);
+    leave_function();
+    return -1;
+  }
+  kex_digest_update(&prefix, k_string, ssh_string_len(k_string) + 4);
+  kex_digest_update(&prefix, session->next_crypto->secret_hash,
+      session->next_crypto->digest_len);
+  ssh_string_burn(k_string);
+  ssh_string_free(k_string);
+
   /* IV */
   if (session->client) {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->encryptIV, 'A') < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->decryptIV, 'B') < 0) {
       goto error;
     }
   } else {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->decryptIV, 'A') < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->encryptIV, 'B') < 0) {
       goto error;
     }
   }
   if (session->client) {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->encryptkey, 'C') < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->decryptkey, 'D') < 0) {
       goto error;
     }
   } else {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->decryptkey, 'C') < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->encryptkey, 'D') < 0) {
       goto error;
     }
@@ -748,43 +895,46 @@ int generate_session_keys(ssh_session session) {
 
   /* some ciphers need more than 20 bytes of input key */
   /* XXX verify it's ok for server implementation */
-  if (session->next_crypto->out_cipher->keysize > SHA_DIGEST_LEN * 8) {
-    ctx = sha1_init();
-    if (ctx == NULL) {
-      goto error;
-    }
-    sha1_update(ctx, k_string, ssh_string_len(k_string) + 4);
-    sha1_update(ctx, session->next_crypto->session_id, SHA_DIGEST_LEN);
-    sha1_update(ctx, session->next_crypto->encryptkey, SHA_DIGEST_LEN);
-    sha1_final(session->next_crypto->encryptkey + SHA_DIGEST_LEN, ctx);
+  if (extend_key(&prefix, session->next_crypto,
+        session->next_crypto->encryptkey,
+        session->next_crypto->out_cipher->keysize) < 0) {
+    goto error;
   }
-
-  if (session->next_crypto->in_cipher->keysize > SHA_DIGEST_LEN * 8) {
-    ctx = sha1_init();
-    sha1_update(ctx, k_string, ssh_string_len(k_string) + 4);
-    sha1_update(ctx, session->next_crypto->session_id, SHA_DIGEST_LEN);
-    sha1_update(ctx, session->next_crypto->decryptkey, SHA_DIGEST_LEN);
-    sha1_final(session->next_crypto->decryptkey + SHA_DIGEST_LEN, ctx);
+  if (extend_key(&prefix, session->next_crypto,
+        session->next_crypto->decryptkey,
+        session->next_crypto->in_cipher->keysize) < 0) {
+    goto error;
   }
   if(session->client) {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->encryptMAC, 'E') < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->decryptMAC, 'F') < 0) {
       goto error;
     }
   } else {
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->decryptMAC, 'E') < 0) {
       goto error;
     }
-    if (generate_one_key(k_string, session->next_crypto->session_id,
+    if (generate_one_key(&prefix, session->next_crypto,
           session->next_crypto->encryptMAC, 'F') < 0) {
       goto error;
     }
   }
+  /* the MAC keys are as long as the digests */
+  if (extend_key(&prefix, session->next_crypto,
+        session->next_crypto->encryptMAC,
+        session->next_crypto->out_mac->size * 8) < 0) {
+    goto error;
+  }
+  if (extend_key(&prefix, session->next_crypto,
+        session->next_crypto->decryptMAC,
+        session->next_crypto->in_mac->size * 8) < 0) {
+    goto error;
+  }
 
 #ifdef DEBUG_CRYPTO
   ssh_print_hexa("Encrypt IV", session->next_crypto->encryptIV, SHA_DIGEST_LEN);
@@ -793,13 +943,15 @@ int generate_session_keys(ssh_session session) {
       session->next_crypto->out_cipher->keysize);
   ssh_print_hexa("Decryption key", session->next_crypto->decryptkey,
       session->next_crypto->in_cipher->keysize);
-  ssh_print_hexa("Encryption MAC", session->next_crypto->encryptMAC, SHA_DIGEST_LEN);
-  ssh_print_hexa("Decryption MAC", session->next_crypto->decryptMAC, 20);
+  ssh_print_hexa("Encryption MAC", session->next_crypto->encryptMAC,
+      session->next_crypto->out_mac->size);
+  ssh_print_hexa("Decryption MAC", session->next_crypto->decryptMAC,
+      session->next_crypto->in_mac->size);
 #endif
 
   rc = 0;
 error:
-  ssh_string_free(k_string);
+  kex_digest_free(&prefix);
   leave_function();
 
   return rc;
@@ -829,6 +981,7 @@ error:
  * @see ssh_print_hexa()
  */
 int ssh_get_pubkey_hash(ssh_session session, unsigned char **hash) {
+  struct ssh_crypto_struct *crypto;
   ssh_string pubkey;
   MD5CTX ctx;
   unsigned char *h;
@@ -843,21 +996,28 @@ int ssh_get_pubkey_hash(ssh_session session, unsigned char **hash) {
     return SSH_ERROR;
   }
 
+  crypto = session->current_crypto;
+
   h = malloc(sizeof(unsigned char *) * MD5_DIGEST_LEN);
   if (h == NULL) {
     return SSH_ERROR;
   }
 
-  ctx = md5_init();
-  if (ctx == NULL) {
-    SAFE_FREE(h);
-    return SSH_ERROR;
-  }
+  /* the host key doesn't change until the next key exchange */
+  if (!crypto->server_pubkey_md5_set) {
+    ctx = md5_init();
+    if (ctx == NULL) {
+      SAFE_FREE(h);
+      return SSH_ERROR;
+    }
 
-  pubkey = session->current_crypto->server_pubkey;
+    pubkey = crypto->server_pubkey;
 
-  md5_update(ctx, pubkey->string, ssh_string_len(pubkey));
-  md5_final(h, ctx);
+    md5_update(ctx, pubkey->string, ssh_string_len(pubkey));
+    md5_final(crypto->server_pubkey_md5, ctx);
+    crypto->server_pubkey_md5_set = 1;
+  }
+  memcpy(h, crypto->server_pubkey_md5, MD5_DIGEST_LEN);
 
   *hash = h;
 
@@ -911,6 +1071,55 @@ static int match(const char *group, const char *object){
   return 0;
 }
 
+/*
+ * Verifies an ecdsa-sha2-nistp256 or ssh-ed25519 signature. Their hash is
+ * part of the algorithm: ECDSA uses SHA256 and ed25519 the data itself.
+ */
+static int sig_verify_data(ssh_session session, ssh_public_key pubkey,
+    SIGNATURE *signature, unsigned char *digest, int size) {
+#ifdef HAVE_ECDSA
+  unsigned char hash[SHA256_DIGEST_LEN] = {0};
+  SHA256CTX ctx;
+  int valid;
+#endif
+
+  switch (pubkey->type) {
+    case SSH_KEYTYPE_ECDSA:
+#ifdef HAVE_ECDSA
+      ctx = sha256_init();
+      if (ctx == NULL) {
+        ssh_set_error_oom(session);
+        return -1;
+      }
+      sha256_update(ctx, digest, size);
+      sha256_final(hash, ctx);
+
+      valid = ECDSA_do_verify(hash, SHA256_DIGEST_LEN, signature->ecdsa_sign,
+          pubkey->ecdsa_pub);
+      if (valid == 1) {
+        return 0;
+      }
+      if (valid == -1) {
+        ssh_set_error(session, SSH_FATAL,
+            "ECDSA error: %s", ERR_error_string(ERR_get_error(), NULL));
+        return -1;
+      }
+#endif
+      ssh_set_error(session, SSH_FATAL, "Invalid ECDSA signature");
+      return -1;
+    case SSH_KEYTYPE_ED25519:
+      if (crypto_sign_ed25519_verify_detached(signature->ed25519_sign,
+            digest, size, pubkey->ed25519_pub) == 0) {
+        return 0;
+      }
+      ssh_set_error(session, SSH_FATAL, "Invalid ED25519 signature");
+      return -1;
+  }
+
+  ssh_set_error(session, SSH_FATAL, "Unknown public key type");
+  return -1;
+}
+
 int sig_verify(ssh_session session, ssh_public_key pubkey,
     SIGNATURE *signature, unsigned char *digest, int size) {
 #ifdef HAVE_LIBGCRYPT
@@ -921,6 +1130,11 @@ int sig_verify(ssh_session session, ssh_public_key pubkey,
 #endif
   unsigned char hash[SHA_DIGEST_LEN + 1] = {0};
 
+  if (pubkey->type == SSH_KEYTYPE_ECDSA ||
+      pubkey->type == SSH_KEYTYPE_ED25519) {
+    return sig_verify_data(session, pubkey, signature, digest, size);
+  }
+
   sha1(digest, size, hash + 1);
 
 #ifdef DEBUG_CRYPTO
@@ -1038,11 +1252,12 @@ int signature_verify(ssh_session session, ssh_string signature) {
     return -1;
   }
 
-  ssh_log(session, SSH_LOG_FUNCTIONS,
+  SSH_LOG(session, SSH_LOG_FUNCTIONS,
       "Going to verify a %s type signature", pubkey->type_c);
 
   err = sig_verify(session,pubkey,sign,
-                            session->next_crypto->session_id,SHA_DIGEST_LEN);
+                            session->next_crypto->secret_hash,
+                            session->next_crypto->digest_len);
   signature_free(sign);
   session->next_crypto->server_pubkey_type = pubkey->type_c;
   publickey_free(pubkey);
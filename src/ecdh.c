@@ -0,0 +1,199 @@
+/*
+ * ecdh.c - the ecdh-sha2-nistp256 key exchange
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/ssh2.h"
+#include "libssh/buffer.h"
+#include "libssh/packet.h"
+#include "libssh/session.h"
+#include "libssh/dh.h"
+#include "libssh/ecdh.h"
+#include "libssh/kexpool.h"
+
+#ifdef HAVE_ECDH
+
+#define NISTP256_SECRET_SIZE 32
+
+/* generates a key pair on the curve, also used by the key exchange pool */
+EC_KEY *ecdh_generate_key(void) {
+  EC_KEY *key;
+
+  key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  if (key == NULL) {
+    return NULL;
+  }
+  if (EC_KEY_generate_key(key) != 1) {
+    EC_KEY_free(key);
+    return NULL;
+  }
+
+  return key;
+}
+
+/*
+ * Gets our key pair, from the key exchange pool for a server. The public key
+ * is returned in its uncompressed octet string encoding (SEC1 2.3.3) in a
+ * new string.
+ */
+static ssh_string ecdh_keypair(ssh_session session) {
+  const EC_GROUP *group;
+  const EC_POINT *pubkey;
+  EC_KEY *key = NULL;
+  ssh_string str;
+  size_t len;
+
+#ifdef WITH_SERVER
+  if (session->server) {
+    key = ssh_kex_pool_take_ecdh();
+  }
+#endif
+  if (key == NULL) {
+    key = ecdh_generate_key();
+  }
+  if (key == NULL) {
+    ssh_set_error(session, SSH_FATAL, "Could not generate the ECDH key");
+    return NULL;
+  }
+
+  group = EC_KEY_get0_group(key);
+  pubkey = EC_KEY_get0_public_key(key);
+  len = EC_POINT_point2oct(group, pubkey, POINT_CONVERSION_UNCOMPRESSED,
+      NULL, 0, NULL);
+  str = ssh_string_new(len);
+  if (str == NULL) {
+    ssh_set_error_oom(session);
+    EC_KEY_free(key);
+    return NULL;
+  }
+  EC_POINT_point2oct(group, pubkey, POINT_CONVERSION_UNCOMPRESSED,
+      ssh_string_data(str), len, NULL);
+
+  session->next_crypto->ecdh_privkey = key;
+
+  return str;
+}
+
+/** @internal
+ * @brief Starts an ecdh-sha2-nistp256 key exchange by sending our public
+ * key in SSH2_MSG_KEX_ECDH_INIT.
+ */
+int ssh_client_ecdh_init(ssh_session session) {
+  ssh_string pubkey;
+
+  pubkey = ecdh_keypair(session);
+  if (pubkey == NULL) {
+    return SSH_ERROR;
+  }
+  session->next_crypto->ecdh_client_pubkey = pubkey;
+
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_KEX_ECDH_INIT) < 0 ||
+      buffer_add_ssh_string(session->out_buffer, pubkey) < 0) {
+    ssh_set_error_oom(session);
+    buffer_reinit(session->out_buffer);
+    return SSH_ERROR;
+  }
+
+  return packet_send(session);
+}
+
+/** @internal
+ * @brief Answers the public key of the client: generates the key pair of
+ * the server and the shared secret. The reply itself is sent by the
+ * server handshake.
+ */
+int ssh_server_ecdh_init(ssh_session session) {
+  ssh_string pubkey;
+
+  pubkey = ecdh_keypair(session);
+  if (pubkey == NULL) {
+    return SSH_ERROR;
+  }
+  session->next_crypto->ecdh_server_pubkey = pubkey;
+
+  return ecdh_build_k(session);
+}
+
+int ecdh_build_k(ssh_session session) {
+  struct ssh_crypto_struct *crypto = session->next_crypto;
+  const EC_GROUP *group;
+  EC_POINT *point;
+  ssh_string peer;
+  unsigned char k[NISTP256_SECRET_SIZE];
+  int len;
+
+  if (crypto->ecdh_privkey == NULL) {
+    ssh_set_error(session, SSH_FATAL, "No ECDH key");
+    return SSH_ERROR;
+  }
+  peer = session->client ? crypto->ecdh_server_pubkey :
+    crypto->ecdh_client_pubkey;
+  if (peer == NULL) {
+    ssh_set_error(session, SSH_FATAL, "No ECDH public key");
+    return SSH_ERROR;
+  }
+
+  group = EC_KEY_get0_group(crypto->ecdh_privkey);
+  point = EC_POINT_new(group);
+  if (point == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  /* the point must be on the curve, RFC 5656 section 4 */
+  if (EC_POINT_oct2point(group, point, ssh_string_data(peer),
+        ssh_string_len(peer), NULL) != 1 ||
+      EC_POINT_is_on_curve(group, point, NULL) != 1) {
+    ssh_set_error(session, SSH_FATAL, "Invalid ECDH public key");
+    EC_POINT_clear_free(point);
+    return SSH_ERROR;
+  }
+
+  /* K is the x coordinate of the shared point */
+  len = ECDH_compute_key(k, sizeof(k), point, crypto->ecdh_privkey, NULL);
+  EC_POINT_clear_free(point);
+  EC_KEY_free(crypto->ecdh_privkey);
+  crypto->ecdh_privkey = NULL;
+  if (len != NISTP256_SECRET_SIZE) {
+    ssh_set_error(session, SSH_FATAL, "Could not compute the ECDH secret");
+    memset(k, 0, sizeof(k));
+    return SSH_ERROR;
+  }
+
+  crypto->k = bignum_bin2bn(k, len, NULL);
+  memset(k, 0, sizeof(k));
+  if (crypto->k == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+
+#ifdef DEBUG_CRYPTO
+  ssh_print_bignum("Shared secret key", crypto->k);
+#endif
+
+  return SSH_OK;
+}
+
+#endif /* HAVE_ECDH */
+
+/* vim: set ts=2 sw=2 et cindent: */
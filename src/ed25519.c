@@ -0,0 +1,433 @@
+/*
+ * ed25519.c - the ssh-ed25519 signature algorithm
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * Ed25519 of RFC 8032, following the public domain TweetNaCl implementation
+ * like curve25519.c, whose field arithmetic it uses. Points are in extended
+ * coordinates (X, Y, Z, T) and the scalar multiplication swaps its points
+ * without branches. The signatures are detached: SSH sends them apart from
+ * the signed data.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/wrapper.h"
+#include "libssh/curve25519.h"
+#include "libssh/ed25519.h"
+
+static const fe25519 fe_zero = {0};
+static const fe25519 fe_one = {1};
+
+/* d = -121665/121666 of the twisted Edwards curve, and 2 * d */
+static const fe25519 ed_d = {
+  0x78a3, 0x1359, 0x4dca, 0x75eb, 0xd8ab, 0x4141, 0x0a4d, 0x0070,
+  0xe898, 0x7779, 0x4079, 0x8cc7, 0xfe73, 0x2b6f, 0x6cee, 0x5203
+};
+static const fe25519 ed_d2 = {
+  0xf159, 0x26b2, 0x9b94, 0xebd6, 0xb156, 0x8283, 0x149a, 0x00e0,
+  0xd130, 0xeef3, 0x80f2, 0x198e, 0xfce7, 0x56df, 0xd9dc, 0x2406
+};
+
+/* the base point B */
+static const fe25519 ed_bx = {
+  0xd51a, 0x8f25, 0x2d60, 0xc956, 0xa7b2, 0x9525, 0xc760, 0x692c,
+  0xdc5c, 0xfdd6, 0xe231, 0xc0a4, 0x53fe, 0xcd6e, 0x36d3, 0x2169
+};
+static const fe25519 ed_by = {
+  0x6658, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666,
+  0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666, 0x6666
+};
+
+/* sqrt(-1) */
+static const fe25519 ed_sqrtm1 = {
+  0xa0b0, 0x4a0e, 0x1b27, 0xc4ee, 0xe478, 0xad2f, 0x1806, 0x2f43,
+  0xd7a7, 0x3dfb, 0x0099, 0x2b4d, 0xdf0b, 0x4fc1, 0x2480, 0x2b83
+};
+
+/* the order of B, little endian */
+static const int64_t ed_l[32] = {
+  0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+  0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+  0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0x10
+};
+
+/* 0 if the 32 bytes are equal, -1 otherwise, in constant time */
+static int verify32(const uint8_t *x, const uint8_t *y) {
+  uint32_t d = 0;
+  int i;
+
+  for (i = 0; i < 32; i++) {
+    d |= x[i] ^ y[i];
+  }
+
+  return (1 & ((d - 1) >> 8)) - 1;
+}
+
+static void set25519(fe25519 r, const fe25519 a) {
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    r[i] = a[i];
+  }
+}
+
+static int neq25519(const fe25519 a, const fe25519 b) {
+  uint8_t c[32];
+  uint8_t d[32];
+
+  pack25519(c, a);
+  pack25519(d, b);
+
+  return verify32(c, d);
+}
+
+static uint8_t par25519(const fe25519 a) {
+  uint8_t d[32];
+
+  pack25519(d, a);
+
+  return d[0] & 1;
+}
+
+/* o = i^((p - 5) / 8) */
+static void pow2523(fe25519 o, const fe25519 i) {
+  fe25519 c;
+  int a;
+
+  set25519(c, i);
+  for (a = 250; a >= 0; a--) {
+    mul25519(c, c, c);
+    if (a != 1) {
+      mul25519(c, c, i);
+    }
+  }
+  set25519(o, c);
+}
+
+/* p = p + q */
+static void ed_add(fe25519 p[4], fe25519 q[4]) {
+  fe25519 a, b, c, d, t, e, f, g, h;
+
+  sub25519(a, p[1], p[0]);
+  sub25519(t, q[1], q[0]);
+  mul25519(a, a, t);
+  add25519(b, p[0], p[1]);
+  add25519(t, q[0], q[1]);
+  mul25519(b, b, t);
+  mul25519(c, p[3], q[3]);
+  mul25519(c, c, ed_d2);
+  mul25519(d, p[2], q[2]);
+  add25519(d, d, d);
+  sub25519(e, b, a);
+  sub25519(f, d, c);
+  add25519(g, d, c);
+  add25519(h, b, a);
+
+  mul25519(p[0], e, f);
+  mul25519(p[1], h, g);
+  mul25519(p[2], g, f);
+  mul25519(p[3], e, h);
+}
+
+static void ed_cswap(fe25519 p[4], fe25519 q[4], int b) {
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    sel25519(p[i], q[i], b);
+  }
+}
+
+static void ed_pack(uint8_t *r, fe25519 p[4]) {
+  fe25519 tx, ty, zi;
+
+  inv25519(zi, p[2]);
+  mul25519(tx, p[0], zi);
+  mul25519(ty, p[1], zi);
+  pack25519(r, ty);
+  r[31] ^= par25519(tx) << 7;
+}
+
+/* p = s * q, q is modified */
+static void ed_scalarmult(fe25519 p[4], fe25519 q[4], const uint8_t *s) {
+  int b;
+  int i;
+
+  set25519(p[0], fe_zero);
+  set25519(p[1], fe_one);
+  set25519(p[2], fe_one);
+  set25519(p[3], fe_zero);
+  for (i = 255; i >= 0; i--) {
+    b = (s[i / 8] >> (i & 7)) & 1;
+    ed_cswap(p, q, b);
+    ed_add(q, p);
+    ed_add(p, p);
+    ed_cswap(p, q, b);
+  }
+}
+
+static void ed_scalarbase(fe25519 p[4], const uint8_t *s) {
+  fe25519 q[4];
+
+  set25519(q[0], ed_bx);
+  set25519(q[1], ed_by);
+  set25519(q[2], fe_one);
+  mul25519(q[3], ed_bx, ed_by);
+  ed_scalarmult(p, q, s);
+}
+
+/* decodes the point and negates it, for the verification */
+static int ed_unpackneg(fe25519 r[4], const uint8_t p[32]) {
+  fe25519 t, chk, num, den, den2, den4, den6;
+
+  set25519(r[2], fe_one);
+  unpack25519(r[1], p);
+  mul25519(num, r[1], r[1]);
+  mul25519(den, num, ed_d);
+  sub25519(num, num, r[2]);
+  add25519(den, r[2], den);
+
+  mul25519(den2, den, den);
+  mul25519(den4, den2, den2);
+  mul25519(den6, den4, den2);
+  mul25519(t, den6, num);
+  mul25519(t, t, den);
+
+  pow2523(t, t);
+  mul25519(t, t, num);
+  mul25519(t, t, den);
+  mul25519(t, t, den);
+  mul25519(r[0], t, den);
+
+  mul25519(chk, r[0], r[0]);
+  mul25519(chk, chk, den);
+  if (neq25519(chk, num)) {
+    mul25519(r[0], r[0], ed_sqrtm1);
+  }
+
+  mul25519(chk, r[0], r[0]);
+  mul25519(chk, chk, den);
+  if (neq25519(chk, num)) {
+    return -1;
+  }
+
+  if (par25519(r[0]) == (p[31] >> 7)) {
+    sub25519(r[0], fe_zero, r[0]);
+  }
+
+  mul25519(r[3], r[0], r[1]);
+
+  return 0;
+}
+
+/* r = x modulo l, x is 64 limbs of 8 bits */
+static void ed_modl(uint8_t *r, int64_t x[64]) {
+  int64_t carry;
+  int i, j;
+
+  for (i = 63; i >= 32; i--) {
+    carry = 0;
+    for (j = i - 32; j < i - 12; j++) {
+      x[j] += carry - 16 * x[i] * ed_l[j - (i - 32)];
+      carry = (x[j] + 128) >> 8;
+      x[j] -= carry * 256;
+    }
+    x[j] += carry;
+    x[i] = 0;
+  }
+  carry = 0;
+  for (j = 0; j < 32; j++) {
+    x[j] += carry - (x[31] >> 4) * ed_l[j];
+    carry = x[j] >> 8;
+    x[j] &= 255;
+  }
+  for (j = 0; j < 32; j++) {
+    x[j] -= carry * ed_l[j];
+  }
+  for (i = 0; i < 32; i++) {
+    x[i + 1] += x[i] >> 8;
+    r[i] = (uint8_t) (x[i] & 255);
+  }
+}
+
+/* reduces the 64 bytes of a SHA512 modulo l, in place */
+static void ed_reduce(uint8_t *r) {
+  int64_t x[64];
+  int i;
+
+  for (i = 0; i < 64; i++) {
+    x[i] = r[i];
+    r[i] = 0;
+  }
+  ed_modl(r, x);
+}
+
+/* the scalar of a signature must be lower than l, RFC 8032 section 5.1.7 */
+static int ed_scalar_is_canonical(const uint8_t *s) {
+  int i;
+
+  for (i = 31; i >= 0; i--) {
+    if (s[i] < ed_l[i]) {
+      return 1;
+    }
+    if (s[i] > ed_l[i]) {
+      return 0;
+    }
+  }
+
+  return 0;
+}
+
+/* az = SHA512(seed) with the scalar in the first half clamped */
+static int ed_expand_seed(uint8_t *az, const uint8_t *seed) {
+  SHA512CTX ctx;
+
+  ctx = sha512_init();
+  if (ctx == NULL) {
+    return -1;
+  }
+  sha512_update(ctx, seed, 32);
+  sha512_final(az, ctx);
+
+  az[0] &= 248;
+  az[31] &= 127;
+  az[31] |= 64;
+
+  return 0;
+}
+
+int crypto_sign_ed25519_seed_keypair(uint8_t *pk, uint8_t *sk,
+    const uint8_t *seed) {
+  uint8_t az[64];
+  fe25519 p[4];
+
+  if (ed_expand_seed(az, seed) < 0) {
+    return -1;
+  }
+  ed_scalarbase(p, az);
+  ed_pack(pk, p);
+
+  memmove(sk, seed, 32);
+  memcpy(sk + 32, pk, ED25519_PUBKEY_SIZE);
+  memset(az, 0, sizeof(az));
+
+  return 0;
+}
+
+int crypto_sign_ed25519_detached(uint8_t *sig, const uint8_t *m,
+    size_t mlen, const uint8_t *sk) {
+  uint8_t az[64];
+  uint8_t r[64];
+  uint8_t h[64];
+  int64_t x[64];
+  fe25519 p[4];
+  SHA512CTX ctx;
+  int i, j;
+
+  if (ed_expand_seed(az, sk) < 0) {
+    return -1;
+  }
+
+  /* r = SHA512(prefix || M), R = rB */
+  ctx = sha512_init();
+  if (ctx == NULL) {
+    memset(az, 0, sizeof(az));
+    return -1;
+  }
+  sha512_update(ctx, az + 32, 32);
+  sha512_update(ctx, m, mlen);
+  sha512_final(r, ctx);
+  ed_reduce(r);
+  ed_scalarbase(p, r);
+  ed_pack(sig, p);
+
+  /* h = SHA512(R || A || M) */
+  ctx = sha512_init();
+  if (ctx == NULL) {
+    memset(az, 0, sizeof(az));
+    memset(r, 0, sizeof(r));
+    return -1;
+  }
+  sha512_update(ctx, sig, 32);
+  sha512_update(ctx, sk + 32, ED25519_PUBKEY_SIZE);
+  sha512_update(ctx, m, mlen);
+  sha512_final(h, ctx);
+  ed_reduce(h);
+
+  /* S = r + h * a */
+  for (i = 0; i < 64; i++) {
+    x[i] = 0;
+  }
+  for (i = 0; i < 32; i++) {
+    x[i] = r[i];
+  }
+  for (i = 0; i < 32; i++) {
+    for (j = 0; j < 32; j++) {
+      x[i + j] += h[i] * (int64_t) az[j];
+    }
+  }
+  ed_modl(sig + 32, x);
+
+  memset(az, 0, sizeof(az));
+  memset(r, 0, sizeof(r));
+  memset(x, 0, sizeof(x));
+
+  return 0;
+}
+
+int crypto_sign_ed25519_verify_detached(const uint8_t *sig, const uint8_t *m,
+    size_t mlen, const uint8_t *pk) {
+  uint8_t h[64];
+  uint8_t t[32];
+  fe25519 p[4];
+  fe25519 q[4];
+  SHA512CTX ctx;
+
+  if (!ed_scalar_is_canonical(sig + 32)) {
+    return -1;
+  }
+  if (ed_unpackneg(q, pk) < 0) {
+    return -1;
+  }
+
+  ctx = sha512_init();
+  if (ctx == NULL) {
+    return -1;
+  }
+  sha512_update(ctx, sig, 32);
+  sha512_update(ctx, pk, ED25519_PUBKEY_SIZE);
+  sha512_update(ctx, m, mlen);
+  sha512_final(h, ctx);
+  ed_reduce(h);
+
+  /* R must be SB - hA */
+  ed_scalarmult(p, q, h);
+  ed_scalarbase(q, sig + 32);
+  ed_add(p, q);
+  ed_pack(t, p);
+
+  return verify32(sig, t);
+}
+
+/* vim: set ts=2 sw=2 et cindent: */
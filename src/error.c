@@ -39,7 +39,8 @@
  *
  * @brief Registers an error with a description.
  *
- * @param  error       The place to store the error.
+ * @param  error       The place to store the error, NULL to drop it, e.g.
+ *                     in a worker of a crypto pool.
  *
  * @param  code        The class of error.
  *
@@ -50,6 +51,10 @@
 void ssh_set_error(void *error, int code, const char *descr, ...) {
   struct error_struct *err = error;
   va_list va;
+
+  if (err == NULL) {
+    return;
+  }
   va_start(va, descr);
   vsnprintf(err->error_buffer, ERROR_BUFFERLEN, descr, va);
   va_end(va);
@@ -0,0 +1,399 @@
+/*
+ * forward.c - dispatching of the remote forwarded connections
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+
+#include "libssh/priv.h"
+#include "libssh/callbacks.h"
+#include "libssh/channels.h"
+#include "libssh/forward.h"
+#include "libssh/messages.h"
+#include "libssh/poll.h"
+#include "libssh/session.h"
+#include "libssh/ssh2.h"
+
+/**
+ * @addtogroup libssh_channel
+ *
+ * @{
+ */
+
+struct ssh_forward_conn {
+  /* its poll while it connects, ssh_channel_bind_fd() polls it afterwards */
+  struct channel_fd_conn base;
+  ssh_forward_remote fwd;
+  ssh_message msg; /* the open, answered once connected */
+};
+
+struct ssh_forward_remote_struct {
+  ssh_session session;
+  char *address; /* NULL for any */
+  int port;
+  /* the local address, resolved once */
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  int max_connections;
+  struct channel_fd_conns conns;
+  struct ssh_forward_remote_stats_struct stats;
+  ssh_forward_remote next; /* the other forwardings of the session */
+};
+
+/* the bytes of a connection are counted once it is done */
+static void forward_conn_done(struct channel_fd_conn *base) {
+  struct ssh_forward_conn *conn = (struct ssh_forward_conn *) base;
+  struct ssh_channel_stats_struct stats;
+
+  if (base->channel != NULL &&
+      ssh_channel_get_stats(base->channel, &stats) == SSH_OK) {
+    conn->fwd->stats.bytes_in += stats.bytes_in;
+    conn->fwd->stats.bytes_out += stats.bytes_out;
+  }
+}
+
+static void forward_free_conn(struct channel_fd_conn *base) {
+  struct ssh_forward_conn *conn = (struct ssh_forward_conn *) base;
+
+  ssh_message_free(conn->msg);
+  SAFE_FREE(conn);
+}
+
+/* the local connection failed: the open is refused */
+static void forward_fail(struct ssh_forward_conn *conn) {
+  ssh_message_channel_request_open_reply_failure(conn->msg,
+      SSH2_OPEN_CONNECT_FAILED);
+  ssh_message_free(conn->msg);
+  conn->msg = NULL;
+  conn->fwd->stats.failed++;
+  channel_fd_conn_close(&conn->base);
+}
+
+/* the local connection is made: the open is accepted and forwarded */
+static void forward_connected(struct ssh_forward_conn *conn) {
+  ssh_channel channel;
+
+  channel_fd_conn_stop_poll(&conn->base);
+  channel = ssh_message_channel_request_open_reply_accept(conn->msg);
+  ssh_message_free(conn->msg);
+  conn->msg = NULL;
+  if (channel == NULL) {
+    channel_fd_conn_close(&conn->base);
+    return;
+  }
+
+  channel_fd_conn_set_channel(&conn->base, channel);
+  if (channel_fd_conn_forward(&conn->base) != SSH_OK) {
+    return;
+  }
+  conn->fwd->stats.accepted++;
+}
+
+static int forward_conn_poll(ssh_poll_handle p, socket_t fd, int revents,
+    void *userdata) {
+  struct ssh_forward_conn *conn = userdata;
+  socklen_t len = sizeof(int);
+  int error = 0;
+
+  (void) p;
+
+  if (!(revents & (POLLOUT | POLLERR | POLLHUP))) {
+    return 0;
+  }
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *) &error, &len) < 0 ||
+      error != 0) {
+    SSH_LOG(conn->fwd->session, SSH_LOG_PROTOCOL,
+        "Forwarded connection to port %d failed: %s", conn->fwd->port,
+        strerror(error != 0 ? error : errno));
+    forward_fail(conn);
+  } else {
+    forward_connected(conn);
+  }
+
+  return -1;
+}
+
+/* starts the local connection of a forwarded-tcpip open */
+static void forward_connect(ssh_forward_remote fwd, ssh_message msg) {
+  ssh_session session = fwd->session;
+  struct ssh_forward_conn *conn;
+  socket_t fd;
+  int rc;
+
+  conn = malloc(sizeof(struct ssh_forward_conn));
+  if (conn == NULL) {
+    ssh_message_channel_request_open_reply_failure(msg,
+        SSH2_OPEN_RESOURCE_SHORTAGE);
+    ssh_message_free(msg);
+    return;
+  }
+  ZERO_STRUCTP(conn);
+  conn->fwd = fwd;
+  conn->msg = msg;
+  fd = socket(fwd->addr.ss_family, SOCK_STREAM, 0);
+  channel_fd_conn_add(&fwd->conns, &conn->base, fd);
+  if (fd == SSH_INVALID_SOCKET) {
+    forward_fail(conn);
+    return;
+  }
+  ssh_sock_set_nonblocking(fd);
+  rc = connect(fd, (struct sockaddr *) &fwd->addr, fwd->addrlen);
+  if (rc == 0) {
+    forward_connected(conn);
+    return;
+  }
+#ifdef _WIN32
+  if (WSAGetLastError() != WSAEWOULDBLOCK) {
+#else
+  if (errno != EINPROGRESS) {
+#endif
+    SSH_LOG(session, SSH_LOG_PROTOCOL,
+        "Forwarded connection to port %d failed: %s", fwd->port,
+        strerror(errno));
+    forward_fail(conn);
+    return;
+  }
+
+  if (channel_fd_conn_poll(&conn->base, POLLOUT, forward_conn_poll) < 0) {
+    forward_fail(conn);
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Takes a forwarded-tcpip open for the forwarding of its port, if
+ * there is one.
+ *
+ * @return              0 if the message was taken, -1 otherwise.
+ */
+int ssh_forward_remote_dispatch(ssh_session session, ssh_message msg) {
+  struct ssh_channel_request_open *req = &msg->channel_request_open;
+  ssh_forward_remote fwd;
+
+  for (fwd = session->forwards; fwd != NULL; fwd = fwd->next) {
+    if (fwd->port == req->destination_port &&
+        (fwd->address == NULL || (req->destination != NULL &&
+          strcmp(fwd->address, req->destination) == 0))) {
+      break;
+    }
+  }
+  if (fwd == NULL) {
+    return -1;
+  }
+
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
+      "Forwarded connection from %s:%d to port %d",
+      req->originator != NULL ? req->originator : "?",
+      req->originator_port, fwd->port);
+  if (fwd->max_connections > 0 &&
+      fwd->conns.count >= fwd->max_connections) {
+    fwd->stats.refused++;
+    ssh_message_channel_request_open_reply_failure(msg,
+        SSH2_OPEN_RESOURCE_SHORTAGE);
+    ssh_message_free(msg);
+    return 0;
+  }
+  forward_connect(fwd, msg);
+
+  return 0;
+}
+
+/**
+ * @brief Forward the connections of a remote port to a local host and port.
+ *
+ * Each connection the server forwards to the port, see ssh_forward_listen(),
+ * is connected to host and port without blocking, then forwarded with
+ * ssh_channel_bind_fd(). It runs in the poll context of the session: from
+ * ssh_event_dopoll() when the session is in an event, else from any call
+ * which waits for the session. The connections don't go to
+ * ssh_forward_accept() anymore.
+ *
+ * When the local connection fails, the server is told so by refusing the
+ * channel.
+ *
+ * @param[in]  session  The session, whose server listens on the port.
+ *
+ * @param[in]  address  The address the server listens on, as given to
+ *                      ssh_forward_listen(), or NULL for any.
+ *
+ * @param[in]  port     The port the server listens on.
+ *
+ * @param[in]  host     The host to connect to, resolved once here.
+ *
+ * @param[in]  host_port The port to connect to.
+ *
+ * @return              The forwarding, NULL on error. It is freed with the
+ *                      session, or by ssh_forward_remote_free().
+ *
+ * @see ssh_forward_remote_set_limit()
+ */
+ssh_forward_remote ssh_forward_remote_new(ssh_session session,
+    const char *address, int port, const char *host, int host_port) {
+  ssh_forward_remote fwd;
+  struct addrinfo hints;
+  struct addrinfo *ai = NULL;
+  char service[16];
+  int rc;
+
+  if (session == NULL) {
+    return NULL;
+  }
+  if (host == NULL || port <= 0 || host_port <= 0) {
+    ssh_set_error_invalid(session, __FUNCTION__);
+    return NULL;
+  }
+
+  ZERO_STRUCT(hints);
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%d", host_port);
+  rc = getaddrinfo(host, service, &hints, &ai);
+  if (rc != 0) {
+    ssh_set_error(session, SSH_FATAL, "Failed to resolve hostname %s (%s)",
+        host, gai_strerror(rc));
+    return NULL;
+  }
+
+  fwd = malloc(sizeof(struct ssh_forward_remote_struct));
+  if (fwd == NULL) {
+    freeaddrinfo(ai);
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  ZERO_STRUCTP(fwd);
+  fwd->session = session;
+  fwd->port = port;
+  memcpy(&fwd->addr, ai->ai_addr, ai->ai_addrlen);
+  fwd->addrlen = ai->ai_addrlen;
+  freeaddrinfo(ai);
+
+  if (address != NULL) {
+    fwd->address = strdup(address);
+  }
+  if ((address != NULL && fwd->address == NULL) ||
+      channel_fd_conns_init(&fwd->conns, session) < 0) {
+    ssh_set_error_oom(session);
+    SAFE_FREE(fwd->address);
+    SAFE_FREE(fwd);
+    return NULL;
+  }
+  fwd->conns.conn_done = forward_conn_done;
+  fwd->conns.conn_free = forward_free_conn;
+
+  fwd->next = session->forwards;
+  session->forwards = fwd;
+
+  return fwd;
+}
+
+/**
+ * @brief Limit the connections of a remote forwarding.
+ *
+ * The channels opened beyond the limit are refused.
+ *
+ * @param[in]  fwd      The forwarding.
+ *
+ * @param[in]  max_connections The connections being made or forwarded at
+ *                      most, 0 for no limit (the default).
+ */
+void ssh_forward_remote_set_limit(ssh_forward_remote fwd,
+    int max_connections) {
+  if (fwd == NULL) {
+    return;
+  }
+  fwd->max_connections = max_connections > 0 ? max_connections : 0;
+}
+
+/**
+ * @brief Get the statistics of a remote forwarding.
+ *
+ * @param[in]  fwd      The forwarding.
+ *
+ * @param[out] stats    The counters since its creation. The bytes count the
+ *                      connections still open.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_forward_remote_get_stats(ssh_forward_remote fwd,
+    struct ssh_forward_remote_stats_struct *stats) {
+  struct ssh_channel_stats_struct channel;
+  struct channel_fd_conn *conn;
+
+  if (fwd == NULL || stats == NULL) {
+    return SSH_ERROR;
+  }
+  *stats = fwd->stats;
+  stats->active = fwd->conns.count;
+  for (conn = fwd->conns.conns; conn != NULL; conn = conn->next) {
+    if (conn->channel != NULL &&
+        ssh_channel_get_stats(conn->channel, &channel) == SSH_OK) {
+      stats->bytes_in += channel.bytes_in;
+      stats->bytes_out += channel.bytes_out;
+    }
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Stop a remote forwarding.
+ *
+ * Its connections are closed and their channels freed. The server keeps
+ * listening, see ssh_forward_cancel().
+ *
+ * @param[in]  fwd      The forwarding to free.
+ */
+void ssh_forward_remote_free(ssh_forward_remote fwd) {
+  ssh_forward_remote *prev;
+
+  if (fwd == NULL) {
+    return;
+  }
+  for (prev = &fwd->session->forwards; *prev != NULL;
+      prev = &(*prev)->next) {
+    if (*prev == fwd) {
+      *prev = fwd->next;
+      break;
+    }
+  }
+
+  channel_fd_conns_free(&fwd->conns);
+  SAFE_FREE(fwd->address);
+  SAFE_FREE(fwd);
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
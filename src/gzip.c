@@ -26,6 +26,7 @@
 #include "libssh/priv.h"
 #include "libssh/buffer.h"
 #include "libssh/session.h"
+#include "libssh/crypto.h"
 
 #if defined(HAVE_LIBZ) && defined(WITH_LIBZ)
 
@@ -35,6 +36,61 @@
 
 #define BLOCKSIZE 4092
 
+/* room left before the compressed data for the header of the packet */
+#define COMPRESS_HEADROOM 5
+
+/* packets over which the adaptive compression measures the ratio */
+#define COMPRESS_WINDOW 32
+/* percentage of the size above which the packets are sent stored */
+#define COMPRESS_RATIO 90
+/* stored packets sent before the compression is tried again */
+#define COMPRESS_RETRY 1024
+
+static int compress_strategy(ssh_session session) {
+  switch (session->compressionstrategy) {
+    case SSH_COMPRESSION_STRATEGY_FILTERED:
+      return Z_FILTERED;
+    case SSH_COMPRESSION_STRATEGY_RLE:
+      return Z_RLE;
+    default:
+      return Z_DEFAULT_STRATEGY;
+  }
+}
+
+/*
+ * The output of the streams goes into a buffer of the session, which then
+ * exchanges its memory with the packet buffer. The two areas are reused one
+ * after the other, without an allocation or a copy per packet.
+ */
+static ssh_buffer compress_get_buffer(ssh_session session) {
+  if (session->compress_buffer == NULL) {
+    session->compress_buffer = ssh_buffer_new();
+    if (session->compress_buffer == NULL) {
+      ssh_set_error_oom(session);
+      return NULL;
+    }
+    /* it holds a copy of a packet */
+    buffer_set_secure(session->compress_buffer);
+  }
+  if (buffer_reinit(session->compress_buffer) < 0) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+
+  return session->compress_buffer;
+}
+
+/* replaces the content of buf with the output of a stream */
+static int compress_swap(ssh_session session, ssh_buffer buf, ssh_buffer dest) {
+  buffer_pass_bytes(buf, buffer_get_rest_len(buf));
+  if (buffer_move(buf, dest, buffer_get_rest_len(dest)) < 0) {
+    ssh_set_error_oom(session);
+    return -1;
+  }
+
+  return 0;
+}
+
 static z_stream *initcompress(ssh_session session, int level) {
   z_stream *stream = NULL;
   int status;
@@ -45,81 +101,155 @@ static z_stream *initcompress(ssh_session session, int level) {
   }
   memset(stream, 0, sizeof(z_stream));
 
-  status = deflateInit(stream, level);
+  status = deflateInit2(stream, level, Z_DEFLATED, MAX_WBITS, 8,
+      compress_strategy(session));
   if (status != Z_OK) {
     SAFE_FREE(stream);
     ssh_set_error(session, SSH_FATAL,
         "status %d inititalising zlib deflate", status);
     return NULL;
   }
+  session->current_crypto->compress_level = level;
+  session->current_crypto->compress_stream_level = level;
 
   return stream;
 }
 
-static ssh_buffer gzip_compress(ssh_session session,ssh_buffer source,int level){
-  z_stream *zout = session->current_crypto->compress_out_ctx;
+/*
+ * Sends stored blocks while the packets don't shrink, and compresses again
+ * from time to time to see if the data changed. The peer keeps inflating
+ * the same stream.
+ */
+static void compress_adapt(ssh_session session) {
+  struct ssh_crypto_struct *crypto = session->current_crypto;
+  int level;
+
+  crypto->compress_packets++;
+  if (crypto->compress_level > 0) {
+    if (crypto->compress_packets < COMPRESS_WINDOW) {
+      return;
+    }
+    if (crypto->compress_window_out * 100 <=
+        crypto->compress_window_in * COMPRESS_RATIO) {
+      crypto->compress_packets = 0;
+      crypto->compress_window_in = crypto->compress_window_out = 0;
+      return;
+    }
+    level = 0;
+  } else {
+    if (crypto->compress_packets < COMPRESS_RETRY) {
+      return;
+    }
+    level = session->compressionlevel;
+  }
+
+  SSH_LOG(session, SSH_LOG_PROTOCOL, "Compression level set to %d", level);
+  crypto->compress_level = level;
+  crypto->compress_packets = 0;
+  crypto->compress_window_in = crypto->compress_window_out = 0;
+}
+
+/*
+ * Gives the stream the level of the next packet: stored for the channels
+ * which skip the compression, the adaptive level otherwise.
+ */
+static void compress_set_level(ssh_session session, z_stream *zout) {
+  struct ssh_crypto_struct *crypto = session->current_crypto;
+  int level = session->compress_stored ? 0 : crypto->compress_level;
+  int status;
+
+  if (level == crypto->compress_stream_level) {
+    return;
+  }
+  /* nothing is pending after the partial flush of the last packet */
+  status = deflateParams(zout, level, compress_strategy(session));
+  if (status != Z_OK) {
+    SSH_LOG(session, SSH_LOG_PACKET,
+        "status %d changing the zlib compression level", status);
+    return;
+  }
+  crypto->compress_stream_level = level;
+}
+
+static int gzip_compress(ssh_session session, ssh_buffer source,
+    ssh_buffer dest) {
+  struct ssh_crypto_struct *crypto = session->current_crypto;
+  z_stream *zout = crypto->compress_out_ctx;
   void *in_ptr = buffer_get_rest(source);
-  unsigned long in_size = buffer_get_rest_len(source);
-  ssh_buffer dest = NULL;
-  unsigned char out_buf[BLOCKSIZE] = {0};
-  unsigned long len;
+  uint32_t in_size = buffer_get_rest_len(source);
+  unsigned char *out;
+  uint32_t len;
   int status;
 
   if(zout == NULL) {
-    zout = session->current_crypto->compress_out_ctx = initcompress(session, level);
+    zout = crypto->compress_out_ctx =
+      initcompress(session, session->compressionlevel);
     if (zout == NULL) {
-      return NULL;
+      return -1;
     }
   }
 
-  dest = ssh_buffer_new();
-  if (dest == NULL) {
-    return NULL;
+  if (buffer_allocate(dest, COMPRESS_HEADROOM) == NULL) {
+    ssh_set_error_oom(session);
+    return -1;
   }
 
-  zout->next_out = out_buf;
-  zout->next_in = in_ptr;
-  zout->avail_in = in_size;
-  do {
-    zout->avail_out = BLOCKSIZE;
+  /* the flush markers come on top of the bound */
+  len = deflateBound(zout, in_size) + 16;
+  for (;;) {
+    out = buffer_reserve(dest, len);
+    if (out == NULL) {
+      ssh_set_error_oom(session);
+      return -1;
+    }
+    zout->next_out = out;
+    zout->avail_out = len;
+    if (in_ptr != NULL) {
+      /* a change of level may flush, so it needs the output area */
+      if (session->compressionadaptive && !session->compress_stored) {
+        compress_adapt(session);
+      }
+      compress_set_level(session, zout);
+      zout->next_in = in_ptr;
+      zout->avail_in = in_size;
+      in_ptr = NULL;
+    }
     status = deflate(zout, Z_PARTIAL_FLUSH);
     if (status != Z_OK) {
-      ssh_buffer_free(dest);
       ssh_set_error(session, SSH_FATAL,
           "status %d deflating zlib packet", status);
-      return NULL;
+      return -1;
     }
-    len = BLOCKSIZE - zout->avail_out;
-    if (buffer_add_data(dest, out_buf, len) < 0) {
-      ssh_buffer_free(dest);
-      return NULL;
+    buffer_commit(dest, len - zout->avail_out);
+    if (zout->avail_out > 0) {
+      break;
     }
-    zout->next_out = out_buf;
-  } while (zout->avail_out == 0);
+    len = BLOCKSIZE;
+  }
 
-  return dest;
+  if (!session->compress_stored) {
+    crypto->compress_window_in += buffer_get_rest_len(source);
+    crypto->compress_window_out +=
+      buffer_get_rest_len(dest) - COMPRESS_HEADROOM;
+  }
+  buffer_pass_bytes(dest, COMPRESS_HEADROOM);
+
+  return 0;
 }
 
 int compress_buffer(ssh_session session, ssh_buffer buf) {
-  ssh_buffer dest = NULL;
+  ssh_buffer dest;
 
-  dest = gzip_compress(session, buf, session->compressionlevel);
+  dest = compress_get_buffer(session);
   if (dest == NULL) {
     return -1;
   }
 
-  if (buffer_reinit(buf) < 0) {
-    ssh_buffer_free(dest);
-    return -1;
-  }
-
-  if (buffer_add_data(buf, buffer_get_rest(dest), buffer_get_rest_len(dest)) < 0) {
-    ssh_buffer_free(dest);
+  if (gzip_compress(session, buf, dest) < 0) {
     return -1;
   }
 
-  ssh_buffer_free(dest);
-  return 0;
+  return compress_swap(session, buf, dest);
 }
 
 /* decompression */
@@ -145,77 +275,139 @@ static z_stream *initdecompress(ssh_session session) {
   return stream;
 }
 
-static ssh_buffer gzip_decompress(ssh_session session, ssh_buffer source, size_t maxlen) {
+static int gzip_decompress(ssh_session session, ssh_buffer source,
+    ssh_buffer dest, size_t maxlen) {
   z_stream *zin = session->current_crypto->compress_in_ctx;
-  void *in_ptr = buffer_get_rest(source);
-  unsigned long in_size = buffer_get_rest_len(source);
-  unsigned char out_buf[BLOCKSIZE] = {0};
-  ssh_buffer dest = NULL;
-  unsigned long len;
+  uint32_t in_size = buffer_get_rest_len(source);
+  unsigned char *out;
+  uint32_t len;
   int status;
 
   if (zin == NULL) {
     zin = session->current_crypto->compress_in_ctx = initdecompress(session);
     if (zin == NULL) {
-      return NULL;
+      return -1;
     }
   }
 
-  dest = ssh_buffer_new();
-  if (dest == NULL) {
-    return NULL;
-  }
-
-  zin->next_out = out_buf;
-  zin->next_in = in_ptr;
+  zin->next_in = buffer_get_rest(source);
   zin->avail_in = in_size;
-
+  /* most packets fit at once, the area doubles for the others */
+  len = in_size < BLOCKSIZE / 4 ? BLOCKSIZE : in_size * 4;
   do {
-    zin->avail_out = BLOCKSIZE;
+    out = buffer_reserve(dest, len);
+    if (out == NULL) {
+      ssh_set_error_oom(session);
+      return -1;
+    }
+    zin->next_out = out;
+    zin->avail_out = len;
     status = inflate(zin, Z_PARTIAL_FLUSH);
+    /* no progress: the output ended right at the end of the area */
+    if (status == Z_BUF_ERROR && zin->avail_in == 0) {
+      break;
+    }
     if (status != Z_OK) {
       ssh_set_error(session, SSH_FATAL,
           "status %d inflating zlib packet", status);
-      ssh_buffer_free(dest);
-      return NULL;
+      return -1;
     }
 
-    len = BLOCKSIZE - zin->avail_out;
-    if (buffer_add_data(dest,out_buf,len) < 0) {
-      ssh_buffer_free(dest);
-      return NULL;
-    }
+    buffer_commit(dest, len - zin->avail_out);
     if (buffer_get_rest_len(dest) > maxlen){
       /* Size of packet exceeded, avoid a denial of service attack */
-      ssh_buffer_free(dest);
-      return NULL;
+      ssh_set_error(session, SSH_FATAL,
+          "Inflated packet bigger than %lu bytes", (unsigned long) maxlen);
+      return -1;
     }
-    zin->next_out = out_buf;
+    len = buffer_get_rest_len(dest);
   } while (zin->avail_out == 0);
 
-  return dest;
+  return 0;
 }
 
 int decompress_buffer(ssh_session session,ssh_buffer buf, size_t maxlen){
-  ssh_buffer dest = NULL;
+  ssh_buffer dest;
 
-  dest = gzip_decompress(session,buf, maxlen);
+  dest = compress_get_buffer(session);
   if (dest == NULL) {
     return -1;
   }
 
-  if (buffer_reinit(buf) < 0) {
-    ssh_buffer_free(dest);
+  if (gzip_decompress(session, buf, dest, maxlen) < 0) {
     return -1;
   }
 
-  if (buffer_add_data(buf, buffer_get_rest(dest), buffer_get_rest_len(dest)) < 0) {
-    ssh_buffer_free(dest);
-    return -1;
+  return compress_swap(session, buf, dest);
+}
+
+/**
+ * @internal
+ *
+ * @brief Start the delayed compression (zlib@openssh.com).
+ *
+ * It is called once the user is authenticated, right after the
+ * SSH_MSG_USERAUTH_SUCCESS on both sides. The streams are created here, so
+ * an error shows up now rather than on the first compressed packet. They go
+ * on across the key re-exchanges, see ssh_kex_newkeys().
+ *
+ * @param[in]  session  The authenticated session.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int compress_start_delayed(ssh_session session) {
+  struct ssh_crypto_struct *crypto = session->current_crypto;
+
+  if (crypto == NULL) {
+    return SSH_OK;
   }
 
-  ssh_buffer_free(dest);
-  return 0;
+  if (crypto->delayed_compress_out && !crypto->do_compress_out) {
+    if (crypto->compress_out_ctx == NULL) {
+      crypto->compress_out_ctx =
+        initcompress(session, session->compressionlevel);
+      if (crypto->compress_out_ctx == NULL) {
+        return SSH_ERROR;
+      }
+    }
+    SSH_LOG(session, SSH_LOG_PROTOCOL, "Enabling delayed compression OUT");
+    crypto->do_compress_out = 1;
+  }
+  if (crypto->delayed_compress_in && !crypto->do_compress_in) {
+    if (crypto->compress_in_ctx == NULL) {
+      crypto->compress_in_ctx = initdecompress(session);
+      if (crypto->compress_in_ctx == NULL) {
+        return SSH_ERROR;
+      }
+    }
+    SSH_LOG(session, SSH_LOG_PROTOCOL, "Enabling delayed compression IN");
+    crypto->do_compress_in = 1;
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @internal
+ *
+ * @brief Release the zlib streams of a crypto structure.
+ *
+ * @param[in]  crypto   The crypto structure, the streams may be NULL.
+ */
+void compress_free(struct ssh_crypto_struct *crypto) {
+  z_stream *stream;
+
+  stream = crypto->compress_out_ctx;
+  if (stream != NULL) {
+    deflateEnd(stream);
+    SAFE_FREE(stream);
+  }
+  stream = crypto->compress_in_ctx;
+  if (stream != NULL) {
+    inflateEnd(stream);
+    SAFE_FREE(stream);
+  }
+  crypto->compress_out_ctx = crypto->compress_in_ctx = NULL;
 }
 
 #endif /* HAVE_LIBZ && WITH_LIBZ */
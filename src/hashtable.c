@@ -0,0 +1,300 @@
+/*
+ * hashtable.c - hash tables with integer keys
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/hashtable.h"
+
+/**
+ * @addtogroup libssh_misc
+ *
+ * @{
+ */
+
+#define SSH_HASHTABLE_MIN_SIZE 16
+
+/* Fibonacci hashing: the high bits of the product are well mixed */
+static size_t ssh_hashtable_bucket(size_t size, uint64_t key) {
+  return (size_t) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (size - 1);
+}
+
+static int ssh_hashtable_resize(struct ssh_hashtable *table, size_t size) {
+  struct ssh_hashtable_entry **buckets;
+  struct ssh_hashtable_entry *entry, *next;
+  size_t i, b;
+
+  buckets = malloc(sizeof(struct ssh_hashtable_entry *) * size);
+  if (buckets == NULL) {
+    return -1;
+  }
+  memset(buckets, 0, sizeof(struct ssh_hashtable_entry *) * size);
+
+  for (i = 0; i < table->size; i++) {
+    for (entry = table->buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      b = ssh_hashtable_bucket(size, entry->key);
+      entry->next = buckets[b];
+      buckets[b] = entry;
+    }
+  }
+
+  SAFE_FREE(table->buckets);
+  table->buckets = buckets;
+  table->size = size;
+
+  return 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Create a new hash table.
+ *
+ * @return              The new hash table, NULL on error.
+ */
+struct ssh_hashtable *ssh_hashtable_new(void) {
+  struct ssh_hashtable *table;
+
+  table = malloc(sizeof(struct ssh_hashtable));
+  if (table == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(table);
+
+  if (ssh_hashtable_resize(table, SSH_HASHTABLE_MIN_SIZE) < 0) {
+    SAFE_FREE(table);
+    return NULL;
+  }
+
+  return table;
+}
+
+/**
+ * @internal
+ *
+ * @brief Free a hash table. The data of the entries isn't freed.
+ *
+ * @param[in]  table    The hash table to free.
+ */
+void ssh_hashtable_free(struct ssh_hashtable *table) {
+  struct ssh_hashtable_entry *entry, *next;
+  size_t i;
+
+  if (table == NULL) {
+    return;
+  }
+
+  for (i = 0; i < table->size; i++) {
+    for (entry = table->buckets[i]; entry != NULL; entry = next) {
+      next = entry->next;
+      SAFE_FREE(entry);
+    }
+  }
+  SAFE_FREE(table->buckets);
+  SAFE_FREE(table);
+}
+
+/**
+ * @internal
+ *
+ * @brief Add an entry to a hash table. Existing entries with the same key
+ *        are kept.
+ *
+ * @param[in]  table    The hash table.
+ *
+ * @param[in]  key      The key of the entry.
+ *
+ * @param[in]  data     The data of the entry.
+ *
+ * @return              0 on success, < 0 on error.
+ */
+int ssh_hashtable_insert(struct ssh_hashtable *table, uint64_t key,
+    void *data) {
+  struct ssh_hashtable_entry *entry;
+  size_t b;
+
+  /* keep about one entry per bucket */
+  if (table->count >= table->size &&
+      ssh_hashtable_resize(table, table->size * 2) < 0) {
+    return -1;
+  }
+
+  entry = malloc(sizeof(struct ssh_hashtable_entry));
+  if (entry == NULL) {
+    return -1;
+  }
+  entry->key = key;
+  entry->data = data;
+
+  b = ssh_hashtable_bucket(table->size, key);
+  entry->next = table->buckets[b];
+  table->buckets[b] = entry;
+  table->count++;
+
+  return 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Remove the entry with the given key and data from a hash table.
+ *
+ * @param[in]  table    The hash table.
+ *
+ * @param[in]  key      The key of the entry.
+ *
+ * @param[in]  data     The data of the entry.
+ *
+ * @return              0 on success, < 0 if there is no such entry.
+ */
+int ssh_hashtable_remove(struct ssh_hashtable *table, uint64_t key,
+    const void *data) {
+  struct ssh_hashtable_entry **ptr;
+  struct ssh_hashtable_entry *entry;
+
+  ptr = &table->buckets[ssh_hashtable_bucket(table->size, key)];
+  for (entry = *ptr; entry != NULL; ptr = &entry->next, entry = *ptr) {
+    if (entry->key == key && entry->data == data) {
+      *ptr = entry->next;
+      SAFE_FREE(entry);
+      table->count--;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * @internal
+ *
+ * @brief Find the first entry with a key.
+ *
+ * @param[in]  table    The hash table.
+ *
+ * @param[in]  key      The key to look for.
+ *
+ * @return              The entry, NULL if there is none.
+ */
+struct ssh_hashtable_entry *ssh_hashtable_find(
+    const struct ssh_hashtable *table, uint64_t key) {
+  struct ssh_hashtable_entry *entry;
+
+  entry = table->buckets[ssh_hashtable_bucket(table->size, key)];
+  while (entry != NULL && entry->key != key) {
+    entry = entry->next;
+  }
+
+  return entry;
+}
+
+/**
+ * @internal
+ *
+ * @brief Find the next entry with the same key.
+ *
+ * @param[in]  entry    An entry returned by ssh_hashtable_find().
+ *
+ * @return              The next entry, NULL if there is none.
+ */
+struct ssh_hashtable_entry *ssh_hashtable_find_next(
+    const struct ssh_hashtable_entry *entry) {
+  struct ssh_hashtable_entry *next = entry->next;
+
+  while (next != NULL && next->key != entry->key) {
+    next = next->next;
+  }
+
+  return next;
+}
+
+/**
+ * @internal
+ *
+ * @brief Get the data of the first entry with a key.
+ *
+ * @param[in]  table    The hash table.
+ *
+ * @param[in]  key      The key to look for.
+ *
+ * @return              The data, NULL if there is no entry with the key.
+ */
+void *ssh_hashtable_lookup(const struct ssh_hashtable *table, uint64_t key) {
+  struct ssh_hashtable_entry *entry;
+
+  entry = ssh_hashtable_find(table, key);
+  return entry != NULL ? entry->data : NULL;
+}
+
+static struct ssh_hashtable_entry *ssh_hashtable_from(
+    const struct ssh_hashtable *table, size_t b) {
+  for (; b < table->size; b++) {
+    if (table->buckets[b] != NULL) {
+      return table->buckets[b];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @internal
+ *
+ * @brief Start iterating over all the entries of a hash table, in no
+ *        particular order. Nothing may be added during the iteration, the
+ *        current entry may be removed once the next one is known.
+ *
+ * @param[in]  table    The hash table.
+ *
+ * @return              The first entry, NULL if the table is empty.
+ */
+struct ssh_hashtable_entry *ssh_hashtable_first(
+    const struct ssh_hashtable *table) {
+  return ssh_hashtable_from(table, 0);
+}
+
+/**
+ * @internal
+ *
+ * @brief Get the entry after another one when iterating over a hash table.
+ *
+ * @param[in]  table    The hash table.
+ *
+ * @param[in]  entry    The current entry.
+ *
+ * @return              The next entry, NULL at the end of the table.
+ */
+struct ssh_hashtable_entry *ssh_hashtable_next(
+    const struct ssh_hashtable *table,
+    const struct ssh_hashtable_entry *entry) {
+  if (entry->next != NULL) {
+    return entry->next;
+  }
+
+  return ssh_hashtable_from(table,
+      ssh_hashtable_bucket(table->size, entry->key) + 1);
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
@@ -0,0 +1,304 @@
+/*
+ * histogram.c - latency histograms of the sessions and of the process
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/threads.h"
+#include "libssh/misc.h"
+#include "libssh/histogram.h"
+
+/**
+ * @addtogroup libssh_session
+ *
+ * @{
+ */
+
+#define SUB_BUCKETS (1 << SSH_HISTOGRAM_SUB_BITS)
+
+/*
+ * The totals of the process, updated with atomic operations by the sessions
+ * of all the threads, without a lock. Their min field holds the complement
+ * of the minimum, so that it is a maximum too and starts at zero.
+ */
+static struct ssh_histogram_struct latency_process[SSH_LATENCY_PHASES];
+static struct ssh_histogram_struct latency_sftp[SSH_LATENCY_SFTP_TYPES];
+
+/*
+ * The values under SUB_BUCKETS have their own bucket. Above, the buckets of
+ * each power of two split it in SUB_BUCKETS, like in a HDR histogram.
+ */
+static unsigned int histogram_index(uint64_t value) {
+  unsigned int exp = 0;
+  unsigned int index;
+
+  if (value < SUB_BUCKETS) {
+    return (unsigned int) value;
+  }
+  while ((value >> exp) >= 2 * SUB_BUCKETS) {
+    exp++;
+  }
+  /* value >> exp is in [SUB_BUCKETS, 2 * SUB_BUCKETS) */
+  index = (exp + 1) * SUB_BUCKETS + (unsigned int) (value >> exp) - SUB_BUCKETS;
+
+  return index < SSH_HISTOGRAM_BUCKETS ? index : SSH_HISTOGRAM_BUCKETS - 1;
+}
+
+/* the highest value of a bucket */
+static uint64_t histogram_value(unsigned int index) {
+  unsigned int exp;
+
+  if (index < SUB_BUCKETS) {
+    return index;
+  }
+  exp = index / SUB_BUCKETS - 1;
+
+  return (((uint64_t) (index % SUB_BUCKETS + SUB_BUCKETS + 1)) << exp) - 1;
+}
+
+void ssh_histogram_record(struct ssh_histogram_struct *h, uint64_t value) {
+  if (h->count == 0 || value < h->min) {
+    h->min = value;
+  }
+  if (value > h->max) {
+    h->max = value;
+  }
+  h->count++;
+  h->sum += value;
+  h->buckets[histogram_index(value)]++;
+}
+
+/* the highest value of the bucket holding the given rank, bounded by max */
+static uint64_t histogram_percentile(const struct ssh_histogram_struct *h,
+    uint64_t rank) {
+  uint64_t seen = 0;
+  uint64_t value;
+  unsigned int i;
+
+  for (i = 0; i < SSH_HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > rank) {
+      break;
+    }
+  }
+  value = histogram_value(i);
+
+  return value < h->max ? value : h->max;
+}
+
+void ssh_histogram_get(const struct ssh_histogram_struct *h,
+    struct ssh_latency_struct *latency) {
+  ZERO_STRUCTP(latency);
+  if (h == NULL || h->count == 0) {
+    return;
+  }
+
+  latency->count = h->count;
+  latency->min = h->min;
+  latency->max = h->max;
+  latency->mean = h->sum / h->count;
+  latency->p50 = histogram_percentile(h, h->count / 2);
+  latency->p90 = histogram_percentile(h, h->count * 9 / 10);
+  latency->p99 = histogram_percentile(h, h->count * 99 / 100);
+  latency->p999 = histogram_percentile(h, h->count * 999 / 1000);
+}
+
+/* records in the histogram, allocated on the first value */
+static void latency_add(struct ssh_histogram_struct **h, uint64_t us) {
+  if (*h == NULL) {
+    *h = malloc(sizeof(struct ssh_histogram_struct));
+    if (*h == NULL) {
+      return;
+    }
+    ZERO_STRUCTP(*h);
+  }
+  ssh_histogram_record(*h, us);
+}
+
+/* records in a histogram of the process */
+static void latency_add_shared(struct ssh_histogram_struct *h, uint64_t us) {
+  ssh_atomic_max_u64(&h->min, ~us);
+  ssh_atomic_max_u64(&h->max, us);
+  ssh_atomic_add_u64(&h->sum, us);
+  ssh_atomic_add_u32(&h->buckets[histogram_index(us)], 1);
+  ssh_atomic_add_u64(&h->count, 1);
+}
+
+/*
+ * Reads a histogram of the process while it may be updated: the buckets can
+ * be a few values ahead of the count, which doesn't change the percentiles
+ * much.
+ */
+static void latency_get_shared(struct ssh_histogram_struct *h,
+    struct ssh_latency_struct *latency) {
+  struct ssh_histogram_struct copy;
+  unsigned int i;
+
+  copy.count = ssh_atomic_load_u64(&h->count);
+  copy.sum = ssh_atomic_load_u64(&h->sum);
+  copy.min = ~ssh_atomic_load_u64(&h->min);
+  copy.max = ssh_atomic_load_u64(&h->max);
+  for (i = 0; i < SSH_HISTOGRAM_BUCKETS; i++) {
+    copy.buckets[i] = h->buckets[i];
+  }
+  ssh_histogram_get(&copy, latency);
+}
+
+/** @internal
+ * @brief records a latency of a phase in the session and the process
+ */
+void ssh_latency_record(ssh_session session, int phase, uint64_t us) {
+  if (phase < 0 || phase >= SSH_LATENCY_PHASES) {
+    return;
+  }
+
+  latency_add(&session->latency[phase], us);
+  latency_add_shared(&latency_process[phase], us);
+}
+
+/** @internal
+ * @brief ends a phase of the connection, which started when the previous
+ * one ended
+ */
+void ssh_latency_phase(ssh_session session, int phase) {
+  uint64_t now = ssh_timestamp_us();
+
+  if (session->latency_ts != 0) {
+    ssh_latency_record(session, phase, now - session->latency_ts);
+  }
+  session->latency_ts = now;
+}
+
+static int latency_sftp_index(uint8_t type) {
+  if (type == 200) {
+    /* SSH_FXP_EXTENDED */
+    return 0;
+  }
+  if (type < 3 || type >= SSH_LATENCY_SFTP_TYPES) {
+    return -1;
+  }
+
+  return type;
+}
+
+/** @internal
+ * @brief records the latency of a sftp request in the sftp session and the
+ * process
+ */
+void ssh_latency_sftp_record(struct ssh_histogram_struct **histograms,
+    uint8_t type, uint64_t us) {
+  int i = latency_sftp_index(type);
+
+  if (i < 0) {
+    return;
+  }
+
+  latency_add(&histograms[i], us);
+  latency_add_shared(&latency_sftp[i], us);
+}
+
+/** @internal
+ * @brief gets the latencies of a sftp request type, of the process if
+ * histograms is NULL
+ */
+int ssh_latency_sftp_get(struct ssh_histogram_struct **histograms,
+    uint8_t type, struct ssh_latency_struct *latency) {
+  int i = latency_sftp_index(type);
+
+  if (i < 0 || latency == NULL) {
+    return SSH_ERROR;
+  }
+
+  if (histograms != NULL) {
+    ssh_histogram_get(histograms[i], latency);
+    return SSH_OK;
+  }
+
+  latency_get_shared(&latency_sftp[i], latency);
+
+  return SSH_OK;
+}
+
+void ssh_latency_free(struct ssh_histogram_struct **histograms, int count) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    SAFE_FREE(histograms[i]);
+  }
+}
+
+/**
+ * @brief Get the latency distribution of a phase of the connections.
+ *
+ * The phases are timed on the client side:
+ * - SSH_LATENCY_CONNECT: from ssh_connect() to the TCP connection,
+ * - SSH_LATENCY_BANNER: from then to the banner of the server,
+ * - SSH_LATENCY_KEX: from then to the end of the first key exchange,
+ * - SSH_LATENCY_AUTH: from then to the successful authentication, the time
+ *   spent by the application between the attempts included,
+ * - SSH_LATENCY_CHANNEL_OPEN: from the open request of a channel to its
+ *   confirmation.
+ *
+ * The latencies are kept in histograms with a precision of 12.5%, the
+ * percentiles are the highest values of their bucket.
+ *
+ * @param[in]  session  The session, or NULL for the totals of the process,
+ *                      which include all the sessions since ssh_init().
+ *
+ * @param[in]  phase    The phase, one of enum ssh_latency_e.
+ *
+ * @param[out] latency  The distribution, in microseconds.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_session_get_stats()
+ */
+int ssh_session_get_latency(ssh_session session, int phase,
+    struct ssh_latency_struct *latency) {
+  if (phase < 0 || phase >= SSH_LATENCY_PHASES || latency == NULL) {
+    return SSH_ERROR;
+  }
+
+  if (session != NULL) {
+    ssh_histogram_get(session->latency[phase], latency);
+    return SSH_OK;
+  }
+
+  latency_get_shared(&latency_process[phase], latency);
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief clears the histograms of the process, called by ssh_finalize()
+ */
+void ssh_latency_finalize(void) {
+  memset(latency_process, 0, sizeof(latency_process));
+  memset(latency_sftp, 0, sizeof(latency_sftp));
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
@@ -0,0 +1,139 @@
+/*
+ * hostkey.c - host keys of a server shared by the bind and its sessions
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * A host key is loaded once by the bind. Every accepted session takes a
+ * reference and keeps it for the key re-exchanges, so reloading the keys of
+ * the bind doesn't change the key of the established sessions. The public
+ * key blob is serialized once, when the key is loaded.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "libssh/priv.h"
+#include "libssh/threads.h"
+#include "libssh/keys.h"
+#include "libssh/hostkey.h"
+
+/* protects the reference counts and the slots of the binds */
+static void *hostkey_lock = NULL;
+static int hostkey_initialized = 0;
+
+struct ssh_hostkey_struct *ssh_hostkey_new(ssh_private_key key) {
+  struct ssh_hostkey_struct *hostkey;
+  ssh_public_key pub;
+
+  if (ssh_threads_mutex_once(&hostkey_lock, &hostkey_initialized) < 0) {
+    return NULL;
+  }
+
+  hostkey = malloc(sizeof(struct ssh_hostkey_struct));
+  if (hostkey == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(hostkey);
+
+  pub = publickey_from_privatekey(key);
+  if (pub == NULL) {
+    SAFE_FREE(hostkey);
+    return NULL;
+  }
+  hostkey->blob = publickey_to_string(pub);
+  publickey_free(pub);
+  if (hostkey->blob == NULL) {
+    SAFE_FREE(hostkey);
+    return NULL;
+  }
+  hostkey->key = key;
+  hostkey->refs = 1;
+
+  return hostkey;
+}
+
+struct ssh_hostkey_struct *ssh_hostkey_get(struct ssh_hostkey_struct **slot) {
+  struct ssh_hostkey_struct *hostkey;
+
+  if (!ssh_atomic_load_int(&hostkey_initialized)) {
+    return NULL;
+  }
+
+  ssh_threads_mutex_lock(&hostkey_lock);
+  hostkey = *slot;
+  if (hostkey != NULL) {
+    hostkey->refs++;
+  }
+  ssh_threads_mutex_unlock(&hostkey_lock);
+
+  return hostkey;
+}
+
+void ssh_hostkey_set(struct ssh_hostkey_struct **slot,
+    struct ssh_hostkey_struct *key) {
+  struct ssh_hostkey_struct *old;
+
+  if (!ssh_atomic_load_int(&hostkey_initialized)) {
+    *slot = key;
+    return;
+  }
+
+  ssh_threads_mutex_lock(&hostkey_lock);
+  old = *slot;
+  *slot = key;
+  ssh_threads_mutex_unlock(&hostkey_lock);
+
+  ssh_hostkey_free(old);
+}
+
+void ssh_hostkey_free(struct ssh_hostkey_struct *key) {
+  unsigned int refs;
+
+  if (key == NULL) {
+    return;
+  }
+
+  ssh_threads_mutex_lock(&hostkey_lock);
+  refs = --key->refs;
+  ssh_threads_mutex_unlock(&hostkey_lock);
+  if (refs > 0) {
+    return;
+  }
+
+  privatekey_free(key->key);
+  ssh_string_free(key->blob);
+  SAFE_FREE(key);
+}
+
+/** @internal
+ * @brief releases the lock, called by ssh_finalize() once the binds and
+ * the sessions are freed
+ */
+void ssh_hostkey_finalize(void) {
+  if (!ssh_atomic_load_int(&hostkey_initialized)) {
+    return;
+  }
+  ssh_threads_mutex_destroy(&hostkey_lock);
+  hostkey_lock = NULL;
+  hostkey_initialized = 0;
+}
+
+/* vim: set ts=2 sw=2 et cindent: */
@@ -27,6 +27,12 @@
 #include "libssh/dh.h"
 #include "libssh/poll.h"
 #include "libssh/threads.h"
+#include "libssh/pool.h"
+#include "libssh/kexpool.h"
+#include "libssh/hostkey.h"
+#include "libssh/keycache.h"
+#include "libssh/agent.h"
+#include "libssh/session.h"
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -42,15 +48,16 @@
  * @{
  */
 
-/**
- * @brief Initialize global cryptographic data structures.
- *
- * This function should only be called once, at the beginning of the program, in
- * the main thread. It may be omitted if your program is not multithreaded.
- *
- * @returns             0 on success, -1 if an error occured.
+/*
+ * The calls of ssh_init() not finalized yet. The spin lock serializes the
+ * initialization and the teardown; once initialized, ssh_init_once() is a
+ * single atomic read, so the sessions don't share a lock to connect.
  */
-int ssh_init(void) {
+static int init_count = 0;
+static int init_done = 0;
+static int init_lock = 0;
+
+static int init_global(void) {
   if(ssh_threads_init())
     return -1;
   if(ssh_crypto_init())
@@ -60,17 +67,97 @@ int ssh_init(void) {
   return 0;
 }
 
+/**
+ * @internal
+ *
+ * @brief Initialize libssh if it isn't, as ssh_connect() and
+ * ssh_bind_listen() do.
+ *
+ * It doesn't count as a call of ssh_init().
+ *
+ * @returns             0 on success, -1 if an error occured.
+ */
+int ssh_init_once(void) {
+  int rc = 0;
+
+  if (ssh_atomic_load_int(&init_done)) {
+    return 0;
+  }
+
+  ssh_threads_spin_lock(&init_lock);
+  if (!init_done) {
+    rc = init_global();
+    if (rc == 0) {
+      ssh_atomic_store_int(&init_done, 1);
+    }
+  }
+  ssh_threads_spin_unlock(&init_lock);
+
+  return rc;
+}
+
+/**
+ * @brief Initialize global cryptographic data structures.
+ *
+ * It should be called at the beginning of the program, after
+ * ssh_threads_set_callbacks() if the threads aren't the native ones. The
+ * calls are counted: the global state is released by the ssh_finalize()
+ * matching the first ssh_init(), so a library using libssh can call both
+ * on its own. It is safe to call them from several threads. See @ref
+ * libssh_tutor_threads.
+ *
+ * @returns             0 on success, -1 if an error occured.
+ */
+int ssh_init(void) {
+  int rc = 0;
+
+  ssh_threads_spin_lock(&init_lock);
+  if (!init_done) {
+    rc = init_global();
+  }
+  if (rc == 0) {
+    ssh_atomic_store_int(&init_done, 1);
+    init_count++;
+  }
+  ssh_threads_spin_unlock(&init_lock);
+
+  return rc;
+}
+
 
 /**
  * @brief Finalize and cleanup all libssh and cryptographic data structures.
  *
- * This function should only be called once, at the end of the program!
+ * The last call, matching the first ssh_init(), releases the global state:
+ * no session may be in use in any thread anymore.
  *
  * @returns             0 on succes, -1 if an error occured.
  *
    @returns 0 otherwise
  */
 int ssh_finalize(void) {
+  ssh_threads_spin_lock(&init_lock);
+  if (init_count > 0) {
+    init_count--;
+  }
+  if (init_count > 0) {
+    ssh_threads_spin_unlock(&init_lock);
+    return 0;
+  }
+
+  ssh_pool_finalize();
+  ssh_key_cache_finalize();
+  ssh_known_hosts_finalize();
+  ssh_config_finalize();
+  ssh_latency_finalize();
+#ifndef _WIN32
+  ssh_agent_cache_finalize();
+#endif
+#ifdef WITH_SERVER
+  ssh_kex_pool_finalize();
+  ssh_hostkey_finalize();
+  ssh_authorized_keys_finalize();
+#endif
   ssh_threads_finalize();
   ssh_crypto_finalize();
   ssh_socket_cleanup();
@@ -82,6 +169,8 @@ int ssh_finalize(void) {
 #ifdef _WIN32
   WSACleanup();
 #endif
+  ssh_atomic_store_int(&init_done, 0);
+  ssh_threads_spin_unlock(&init_lock);
   return 0;
 }
 
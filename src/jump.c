@@ -0,0 +1,424 @@
+/*
+ * jump.c - sessions connected through a direct-tcpip channel of a bastion
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "libssh/priv.h"
+#include "libssh/buffer.h"
+#include "libssh/callbacks.h"
+#include "libssh/channels.h"
+#include "libssh/jump.h"
+#include "libssh/poll.h"
+#include "libssh/session.h"
+#include "libssh/socket.h"
+
+/*
+ * The session reads and writes the channel through transport callbacks. Its
+ * poll context also watches the sockets of the bastions, which are read
+ * from there: the channel data then wakes the session up through a
+ * socketpair.
+ */
+
+/* a bastion read from the poll context of the session */
+struct ssh_jump_pump {
+  ssh_session session;
+  ssh_poll_handle poll;
+  struct ssh_jump_struct *jump;
+};
+
+struct ssh_jump_struct {
+  ssh_session session;
+  ssh_session bastion;
+  ssh_channel channel; /* direct-tcpip, on the bastion */
+  struct ssh_channel_callbacks_struct channel_cb;
+  struct ssh_transport_callbacks_struct transport;
+  /* signal[0] is polled by the session, readable while the read has data */
+  socket_t signal[2];
+  int signalled;
+  /* the bastion, and the ones it goes through */
+  struct ssh_jump_pump pumps[SSH_JUMP_HOPS_MAX];
+  int npumps;
+};
+
+/**
+ * @addtogroup libssh_session
+ *
+ * @{
+ */
+
+#ifndef _WIN32
+static void jump_signal(struct ssh_jump_struct *jump, int on) {
+  char c[64];
+
+  if (on && !jump->signalled) {
+    if (send(jump->signal[1], "", 1, 0) == 1) {
+      jump->signalled = 1;
+    }
+  } else if (!on && jump->signalled) {
+    while (recv(jump->signal[0], c, sizeof(c), 0) > 0) {
+      ;
+    }
+    jump->signalled = 0;
+  }
+}
+
+/* the read of the transport has data, the end or an error to give */
+static int jump_pending(struct ssh_jump_struct *jump) {
+  ssh_channel channel = jump->channel;
+
+  return (channel->stdout_buffer != NULL &&
+      buffer_get_rest_len(channel->stdout_buffer) > 0) ||
+    channel->remote_eof || channel->state != SSH_CHANNEL_STATE_OPEN ||
+    !jump->bastion->alive;
+}
+
+static int jump_channel_data(ssh_session session, ssh_channel channel,
+    void *data, uint32_t len, int is_stderr, void *userdata) {
+  struct ssh_jump_struct *jump = userdata;
+
+  (void) session;
+  (void) channel;
+  (void) data;
+
+  if (is_stderr) {
+    return len;
+  }
+  /* kept in the channel buffer for the transport */
+  jump_signal(jump, 1);
+
+  return 0;
+}
+
+static void jump_channel_end(ssh_session session, ssh_channel channel,
+    void *userdata) {
+  (void) session;
+  (void) channel;
+
+  jump_signal(userdata, 1);
+}
+
+static int jump_read(void *buffer, uint32_t len, void *userdata) {
+  struct ssh_jump_struct *jump = userdata;
+  int rc;
+
+  rc = ssh_channel_read_nonblocking(jump->channel, buffer, len, 0);
+  jump_signal(jump, jump_pending(jump));
+  if (rc == SSH_EOF) {
+    return 0;
+  }
+  if (rc == 0) {
+    if (!jump->bastion->alive) {
+      return SSH_ERROR;
+    }
+    /* closed without an eof */
+    if (jump->channel->state != SSH_CHANNEL_STATE_OPEN) {
+      return 0;
+    }
+    return SSH_AGAIN;
+  }
+
+  return rc;
+}
+
+/*
+ * the pumps also flush the bastions, whose own poll handles are not in the
+ * poll context of the session
+ */
+static void jump_pump_events(struct ssh_jump_struct *jump) {
+  struct ssh_jump_pump *pump;
+  short events;
+  int i;
+
+  for (i = 0; i < jump->npumps; i++) {
+    pump = &jump->pumps[i];
+    if (!pump->session->alive) {
+      events = 0;
+    } else if (ssh_socket_buffered_out(pump->session->socket) > 0) {
+      events = POLLIN | POLLOUT;
+    } else {
+      events = POLLIN;
+    }
+    ssh_poll_set_events(pump->poll, events);
+  }
+}
+
+static int jump_write(const void *buffer, uint32_t len, void *userdata) {
+  struct ssh_jump_struct *jump = userdata;
+  uint32_t window;
+
+  window = channel_write_window(jump->channel);
+  if (window == 0) {
+    ssh_handle_packets(jump->bastion, 0);
+    window = channel_write_window(jump->channel);
+    if (window == 0) {
+      return jump->bastion->alive ? SSH_AGAIN : SSH_ERROR;
+    }
+  }
+  if (len > window) {
+    len = window;
+  }
+  if (ssh_channel_write(jump->channel, buffer, len) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+  jump_pump_events(jump);
+
+  return len;
+}
+
+static void jump_close(void *userdata) {
+  struct ssh_jump_struct *jump = userdata;
+
+  ssh_jump_free(jump->session);
+}
+
+static int jump_pump_poll(ssh_poll_handle p, socket_t fd, int revents,
+    void *userdata) {
+  struct ssh_jump_pump *pump = userdata;
+
+  (void) fd;
+
+  (void) p;
+
+  if (revents & (POLLIN | POLLOUT | POLLERR | POLLHUP)) {
+    ssh_handle_packets(pump->session, 0);
+    if (!pump->session->alive) {
+      /* the read of the transport gives the error */
+      jump_signal(pump->jump, 1);
+    }
+    jump_pump_events(pump->jump);
+  }
+
+  return 0;
+}
+
+/* the channel is open: the session goes through it */
+static int jump_start(ssh_session session, struct ssh_jump_struct *jump) {
+  struct ssh_jump_pump *pump;
+  ssh_poll_ctx ctx;
+  ssh_session b;
+  int i;
+
+  for (b = jump->bastion; b != NULL;
+      b = b->jump != NULL ? b->jump->bastion : NULL) {
+    if (jump->npumps == SSH_JUMP_HOPS_MAX) {
+      ssh_set_error(session, SSH_FATAL, "Too many bastions to go through");
+      return SSH_ERROR;
+    }
+    jump->pumps[jump->npumps].session = b;
+    jump->pumps[jump->npumps].jump = jump;
+    jump->npumps++;
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, jump->signal) < 0) {
+    jump->signal[0] = jump->signal[1] = SSH_INVALID_SOCKET;
+    ssh_set_error(session, SSH_FATAL, "socketpair: %s", strerror(errno));
+    return SSH_ERROR;
+  }
+  ssh_sock_set_nonblocking(jump->signal[0]);
+  ssh_sock_set_nonblocking(jump->signal[1]);
+
+  ctx = ssh_poll_get_default_ctx(session);
+  if (ctx == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  for (i = 0; i < jump->npumps; i++) {
+    pump = &jump->pumps[i];
+    pump->poll = ssh_poll_new(ssh_get_fd(pump->session), POLLIN,
+        jump_pump_poll, pump);
+    if (pump->poll == NULL || ssh_poll_ctx_add(ctx, pump->poll) < 0) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+    /* they follow the session into an event and out of it */
+    ssh_poll_set_owner(pump->poll, &session->polls);
+  }
+
+  ZERO_STRUCT(jump->channel_cb);
+  ssh_callbacks_init(&jump->channel_cb);
+  jump->channel_cb.userdata = jump;
+  jump->channel_cb.channel_data_function = jump_channel_data;
+  jump->channel_cb.channel_eof_function = jump_channel_end;
+  jump->channel_cb.channel_close_function = jump_channel_end;
+  ssh_set_channel_callbacks(jump->channel, &jump->channel_cb);
+
+  ZERO_STRUCT(jump->transport);
+  ssh_callbacks_init(&jump->transport);
+  jump->transport.userdata = jump;
+  jump->transport.read = jump_read;
+  jump->transport.write = jump_write;
+  jump->transport.close = jump_close;
+  if (ssh_set_transport_callbacks(session, &jump->transport,
+        jump->signal[0]) < 0) {
+    return SSH_ERROR;
+  }
+
+  /* the banner may have come with the confirmation */
+  jump_signal(jump, jump_pending(jump));
+
+  return SSH_OK;
+}
+#endif /* _WIN32 */
+
+/**
+ * @brief Connect a session through a bastion, like the ProxyJump option of
+ * OpenSSH.
+ *
+ * A direct-tcpip channel of the bastion is opened to the host and the port
+ * of the session, which then runs over it instead of a socket of its own,
+ * without a ProxyCommand process. Many sessions can go through one bastion,
+ * e.g. one kept by a mux, see ssh_mux_get_session(). The bastion can itself
+ * go through another one.
+ *
+ * The poll context of the session also reads the bastions, so the blocking
+ * calls of the session work alone. In an event, the bastions are read by
+ * the event as well.
+ *
+ * @code
+ * ssh_options_set(session, SSH_OPTIONS_HOST, "internal.example.com");
+ * if (ssh_set_proxy_jump(session, bastion) != SSH_OK) {
+ *   ...
+ * }
+ * ssh_connect(session);
+ * @endcode
+ *
+ * @param[in]  session  The session to connect, with its host and port set.
+ *
+ * @param[in]  bastion  An authenticated session. It must be freed after the
+ *                      sessions which go through it.
+ *
+ * @return              SSH_OK on success, SSH_AGAIN if the bastion is
+ *                      nonblocking and the channel isn't open yet (call it
+ *                      again), SSH_ERROR on error.
+ */
+int ssh_set_proxy_jump(ssh_session session, ssh_session bastion) {
+#ifdef _WIN32
+  if (session != NULL) {
+    ssh_set_error(session, SSH_FATAL, "ProxyJump isn't supported");
+  }
+  (void) bastion;
+  return SSH_ERROR;
+#else
+  struct ssh_jump_struct *jump = session != NULL ? session->jump : NULL;
+  int rc;
+
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  if (bastion == NULL || bastion == session ||
+      (jump != NULL && jump->bastion != bastion)) {
+    ssh_set_error_invalid(session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+  if (jump != NULL && jump->signal[0] != SSH_INVALID_SOCKET) {
+    return SSH_OK;
+  }
+  if (session->host == NULL) {
+    ssh_set_error(session, SSH_FATAL, "Hostname required");
+    return SSH_ERROR;
+  }
+
+  if (jump == NULL) {
+    jump = malloc(sizeof(struct ssh_jump_struct));
+    if (jump == NULL) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+    ZERO_STRUCTP(jump);
+    jump->session = session;
+    jump->bastion = bastion;
+    jump->signal[0] = jump->signal[1] = SSH_INVALID_SOCKET;
+    jump->channel = ssh_channel_new(bastion);
+    if (jump->channel == NULL) {
+      ssh_set_error(session, SSH_FATAL, "Opening a channel on the bastion: %s",
+          ssh_get_error(bastion));
+      SAFE_FREE(jump);
+      return SSH_ERROR;
+    }
+    session->jump = jump;
+  }
+
+  rc = ssh_channel_open_forward(jump->channel, session->host, session->port,
+      "127.0.0.1", 0);
+  if (rc == SSH_AGAIN) {
+    return SSH_AGAIN;
+  }
+  if (rc != SSH_OK) {
+    ssh_set_error(session, SSH_FATAL,
+        "Opening a channel to %s:%u through the bastion: %s",
+        session->host, session->port, ssh_get_error(bastion));
+    ssh_jump_free(session);
+    return SSH_ERROR;
+  }
+
+  if (jump_start(session, jump) < 0) {
+    ssh_jump_free(session);
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+#endif /* _WIN32 */
+}
+
+/**
+ * @internal
+ *
+ * @brief Close the channel of a session through a bastion, from the close
+ * of its transport or from ssh_free().
+ */
+void ssh_jump_free(ssh_session session) {
+  struct ssh_jump_struct *jump = session->jump;
+  int i;
+
+  if (jump == NULL) {
+    return;
+  }
+  session->jump = NULL;
+
+  for (i = 0; i < jump->npumps; i++) {
+    if (jump->pumps[i].poll != NULL) {
+      ssh_poll_free(jump->pumps[i].poll);
+    }
+  }
+  jump->channel->callbacks = NULL;
+  ssh_channel_free(jump->channel);
+#ifndef _WIN32
+  if (jump->signal[0] != SSH_INVALID_SOCKET) {
+    close(jump->signal[0]);
+    close(jump->signal[1]);
+  }
+#endif
+  SAFE_FREE(jump);
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
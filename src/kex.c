@@ -38,10 +38,21 @@
 #include "libssh/packet.h"
 #include "libssh/session.h"
 #include "libssh/wrapper.h"
+#include "libssh/crypto.h"
 #include "libssh/keys.h"
 #include "libssh/dh.h"
 #include "libssh/kex.h"
 #include "libssh/string.h"
+#include "libssh/channels.h"
+#include "libssh/probes.h"
+#include "libssh/pipeline.h"
+
+#ifdef HAS_AES_GCM
+#define AEAD "aes256-gcm@openssh.com,aes128-gcm@openssh.com," \
+  "chacha20-poly1305@openssh.com,"
+#else
+#define AEAD "chacha20-poly1305@openssh.com,"
+#endif
 
 #ifdef HAVE_LIBGCRYPT
 #define BLOWFISH "blowfish-cbc,"
@@ -66,6 +77,27 @@
 #define DES "3des-cbc"
 #endif
 
+#define MACS "hmac-sha2-256-etm@openssh.com,hmac-sha2-512-etm@openssh.com," \
+  "hmac-sha1-etm@openssh.com,hmac-sha2-256,hmac-sha2-512,hmac-sha1"
+
+#ifdef HAVE_ECDH
+#define KEX_ECDH "ecdh-sha2-nistp256,"
+#else
+#define KEX_ECDH ""
+#endif
+
+#define KEX_METHODS "curve25519-sha256,curve25519-sha256@libssh.org," \
+  KEX_ECDH "diffie-hellman-group1-sha1"
+
+#ifdef HAVE_ECDSA
+#define HOSTKEY_ECDSA ",ecdsa-sha2-nistp256"
+#else
+#define HOSTKEY_ECDSA ""
+#endif
+
+/* the new types come last, not to break the known_hosts files */
+#define HOSTKEYS "ssh-rsa,ssh-dss,ssh-ed25519" HOSTKEY_ECDSA
+
 #if defined(HAVE_LIBZ) && defined(WITH_LIBZ)
 #define ZLIB "none,zlib,zlib@openssh.com"
 #else
@@ -73,12 +105,12 @@
 #endif
 
 const char *default_methods[] = {
-  "diffie-hellman-group1-sha1",
-  "ssh-rsa,ssh-dss",
-  AES BLOWFISH DES,
-  AES BLOWFISH DES,
-  "hmac-sha1",
-  "hmac-sha1",
+  KEX_METHODS,
+  HOSTKEYS,
+  AEAD AES BLOWFISH DES,
+  AEAD AES BLOWFISH DES,
+  MACS,
+  MACS,
   "none",
   "none",
   "",
@@ -87,12 +119,12 @@ const char *default_methods[] = {
 };
 
 const char *supported_methods[] = {
-  "diffie-hellman-group1-sha1",
-  "ssh-rsa,ssh-dss",
-  AES BLOWFISH DES,
-  AES BLOWFISH DES,
-  "hmac-sha1",
-  "hmac-sha1",
+  KEX_METHODS,
+  HOSTKEYS,
+  AEAD AES BLOWFISH DES,
+  AEAD AES BLOWFISH DES,
+  MACS,
+  MACS,
   ZLIB,
   ZLIB,
   "",
@@ -249,15 +281,32 @@ char *ssh_find_matching(const char *available_d, const char *preferred_d){
 
 SSH_PACKET_CALLBACK(ssh_packet_kexinit){
 	int server_kex=session->server;
+  KEX *kex = server_kex ? &session->client_kex : &session->server_kex;
   ssh_string str = NULL;
   char *strings[10];
+  uint8_t first_kex_follows = 0;
+  uint32_t reserved = 0;
+  int rekey = 0;
   int i;
 
   enter_function();
   (void)type;
   (void)user;
   memset(strings, 0, sizeof(strings));
-  if(session->session_state != SSH_SESSION_STATE_INITIAL_KEX){
+  if (session->session_state == SSH_SESSION_STATE_AUTHENTICATING ||
+      session->session_state == SSH_SESSION_STATE_AUTHENTICATED) {
+    /* a key re-exchange, started by the peer or answering ours */
+    if (session->rekey_state != SSH_REKEY_STATE_NONE &&
+        session->rekey_state != SSH_REKEY_STATE_INIT &&
+        session->rekey_state != SSH_REKEY_STATE_KEXINIT_SENT) {
+      ssh_set_error(session, SSH_FATAL,
+          "SSH_KEXINIT received during a key exchange");
+      goto error;
+    }
+    ssh_kex_free_methods(server_kex ? &session->client_kex :
+        &session->server_kex);
+    rekey = 1;
+  } else if(session->session_state != SSH_SESSION_STATE_INITIAL_KEX){
   	ssh_set_error(session,SSH_FATAL,"SSH_KEXINIT received in wrong state");
   	goto error;
   }
@@ -303,6 +352,16 @@ SSH_PACKET_CALLBACK(ssh_packet_kexinit){
     str = NULL;
   }
 
+  /* the rest of the payload is hashed too */
+  buffer_get_u8(packet, &first_kex_follows);
+  buffer_get_u32(packet, &reserved);
+  if (buffer_add_u8(session->in_hashbuf, first_kex_follows) < 0 ||
+      buffer_add_u32(session->in_hashbuf, reserved) < 0) {
+    ssh_set_error_oom(session);
+    goto error;
+  }
+  kex->first_kex_follows = first_kex_follows != 0;
+
   /* copy the server kex info into an array of strings */
   if (server_kex) {
     session->client_kex.methods = malloc(10 * sizeof(char **));
@@ -327,7 +386,16 @@ SSH_PACKET_CALLBACK(ssh_packet_kexinit){
   }
 
   leave_function();
-  session->session_state=SSH_SESSION_STATE_KEXINIT_RECEIVED;
+  SSH_PROBE2(kex_init_recv, session, rekey);
+  if (rekey) {
+    if (session->rekey_state == SSH_REKEY_STATE_KEXINIT_SENT) {
+      session->rekey_state = SSH_REKEY_STATE_KEXINIT_EXCHANGED;
+    } else {
+      session->rekey_state = SSH_REKEY_STATE_KEXINIT_RECEIVED;
+    }
+  } else {
+    session->session_state=SSH_SESSION_STATE_KEXINIT_RECEIVED;
+  }
   session->ssh_connection_callback(session);
   return SSH_PACKET_USED;
 error:
@@ -348,11 +416,11 @@ void ssh_list_kex(ssh_session session, KEX *kex) {
   ssh_print_hexa("session cookie", kex->cookie, 16);
 #endif
   if(kex->methods==NULL){
-    ssh_log(session, SSH_LOG_RARE,"kex->methods is NULL");
+    SSH_LOG(session, SSH_LOG_RARE,"kex->methods is NULL");
     return;
   }
   for(i = 0; i < 10; i++) {
-    ssh_log(session, SSH_LOG_FUNCTIONS, "%s: %s",
+    SSH_LOG(session, SSH_LOG_FUNCTIONS, "%s: %s",
         ssh_kex_nums[i], kex->methods[i]);
   }
 }
@@ -398,10 +466,53 @@ int set_kex(ssh_session session){
     return 0;
 }
 
+/**
+ * @internal
+ *
+ * @brief Set the key exchange method negotiated for the next crypto.
+ *
+ * The exchange hash of the ECDH methods is SHA256, the one of the DH group
+ * is SHA1.
+ *
+ * @param[in]  session  The session of the key exchange.
+ *
+ * @param[in]  name     The name of the negotiated method.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the method is unknown.
+ */
+int ssh_kex_set_type(ssh_session session, const char *name) {
+  struct ssh_crypto_struct *crypto = session->next_crypto;
+
+  if (name == NULL) {
+    ssh_set_error(session, SSH_FATAL, "No key exchange method negotiated");
+    return SSH_ERROR;
+  }
+
+  if (strcmp(name, "diffie-hellman-group1-sha1") == 0) {
+    crypto->kex_type = SSH_KEX_DH_GROUP1_SHA1;
+    crypto->digest_len = SHA_DIGEST_LEN;
+#ifdef HAVE_ECDH
+  } else if (strcmp(name, "ecdh-sha2-nistp256") == 0) {
+    crypto->kex_type = SSH_KEX_ECDH_SHA2_NISTP256;
+    crypto->digest_len = SHA256_DIGEST_LEN;
+#endif
+  } else if (strcmp(name, "curve25519-sha256") == 0 ||
+      strcmp(name, "curve25519-sha256@libssh.org") == 0) {
+    crypto->kex_type = SSH_KEX_CURVE25519_SHA256;
+    crypto->digest_len = SHA256_DIGEST_LEN;
+  } else {
+    ssh_set_error(session, SSH_FATAL, "Unknown key exchange method %s", name);
+    return SSH_ERROR;
+  }
+  SSH_LOG(session, SSH_LOG_PACKET, "Set key exchange method %s", name);
+
+  return SSH_OK;
+}
+
 /* this function only sends the predefined set of kex methods */
 int ssh_send_kex(ssh_session session, int server_kex) {
   KEX *kex = (server_kex ? &session->server_kex : &session->client_kex);
-  ssh_string str = NULL;
+  uint32_t len = 0;
   int i;
 
   enter_function();
@@ -420,24 +531,30 @@ int ssh_send_kex(ssh_session session, int server_kex) {
   ssh_list_kex(session, kex);
 
   for (i = 0; i < 10; i++) {
-    str = ssh_string_from_char(kex->methods[i]);
-    if (str == NULL) {
+    if (kex->methods[i] == NULL) {
       goto error;
     }
+    len += sizeof(uint32_t) + strlen(kex->methods[i]);
+  }
+  if (buffer_ensure(session->out_hashbuf, len) < 0 ||
+      buffer_ensure(session->out_buffer, len + 5) < 0) {
+    goto error;
+  }
 
-    if (buffer_add_ssh_string(session->out_hashbuf, str) < 0) {
-      goto error;
-    }
-    if (buffer_add_ssh_string(session->out_buffer, str) < 0) {
+  for (i = 0; i < 10; i++) {
+    if (buffer_pack(session->out_hashbuf, "s", kex->methods[i]) < 0 ||
+        buffer_pack(session->out_buffer, "s", kex->methods[i]) < 0) {
       goto error;
     }
-    ssh_string_free(str);
   }
 
-  if (buffer_add_u8(session->out_buffer, 0) < 0) {
+  /* first_kex_packet_follows and the reserved field */
+  if (buffer_add_u8(session->out_buffer, kex->first_kex_follows ? 1 : 0) < 0 ||
+      buffer_add_u8(session->out_hashbuf, kex->first_kex_follows ? 1 : 0) < 0) {
     goto error;
   }
-  if (buffer_add_u32(session->out_buffer, 0) < 0) {
+  if (buffer_add_u32(session->out_buffer, 0) < 0 ||
+      buffer_add_u32(session->out_hashbuf, 0) < 0) {
     goto error;
   }
 
@@ -445,18 +562,291 @@ int ssh_send_kex(ssh_session session, int server_kex) {
     leave_function();
     return -1;
   }
+  SSH_PROBE2(kex_init_send, session, session->current_crypto != NULL);
 
   leave_function();
   return 0;
 error:
   buffer_reinit(session->out_buffer);
   buffer_reinit(session->out_hashbuf);
-  ssh_string_free(str);
 
   leave_function();
   return -1;
 }
 
+/**
+ * @internal
+ *
+ * @brief Set the SSH_MSG_KEXINIT of a client: the methods of the options,
+ * or the default ones.
+ *
+ * It doesn't depend on the methods of the server, so it can be sent with
+ * the banner. See ssh_kex_select_methods().
+ *
+ * @param[in]  session  The session of the key exchange.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_set_client_kex(ssh_session session) {
+  KEX *client = &session->client_kex;
+  const char *wanted;
+  int i;
+
+  ssh_kex_free_methods(client);
+  ssh_get_random(client->cookie, 16, 0);
+  client->first_kex_follows = 0;
+
+  client->methods = malloc(10 * sizeof(char **));
+  if (client->methods == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  memset(client->methods, 0, 10 * sizeof(char **));
+  for (i = 0; i < 10; i++) {
+    wanted = session->wanted_methods[i];
+    if (wanted == NULL) {
+      wanted = default_methods[i];
+    }
+    client->methods[i] = strdup(wanted);
+    if (client->methods[i] == NULL) {
+      ssh_kex_free_methods(client);
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @internal
+ *
+ * @brief Replace the methods proposed by a client with the ones agreed with
+ * the server: the first of the client which the server supports, RFC 4253
+ * section 7.1.
+ *
+ * @param[in]  session  The session, both SSH_MSG_KEXINIT were exchanged.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if a method can't be
+ *                      agreed on.
+ */
+int ssh_kex_select_methods(ssh_session session) {
+  KEX *server = &session->server_kex;
+  KEX *client = &session->client_kex;
+  char *match;
+  int i;
+
+  for (i = 0; i < 10; i++) {
+    match = ssh_find_matching(server->methods[i], client->methods[i]);
+    if (match == NULL && i < SSH_LANG_C_S) {
+      ssh_set_error(session, SSH_FATAL,
+          "kex error : did not find one of algos %s in list %s for %s",
+          client->methods[i], server->methods[i], ssh_kex_nums[i]);
+      return SSH_ERROR;
+    }
+    if (match == NULL) {
+      /* we can safely do that for languages */
+      match = strdup("");
+      if (match == NULL) {
+        ssh_set_error_oom(session);
+        return SSH_ERROR;
+      }
+    }
+    SAFE_FREE(client->methods[i]);
+    client->methods[i] = match;
+  }
+
+  return SSH_OK;
+}
+
+/* compares the first methods of two lists */
+static int kex_same_first_method(const char *a, const char *b) {
+  size_t len = strcspn(a, ",");
+
+  return len == strcspn(b, ",") && strncmp(a, b, len) == 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Check the guess of a first key exchange packet sent with the
+ * SSH_MSG_KEXINIT: it is right if both sides prefer the same key exchange
+ * and host key methods, RFC 4253 section 7.1.
+ *
+ * @param[in]  session  The session, with the lists of both sides.
+ *
+ * @return              1 if the guess is right, 0 if it is wrong.
+ */
+int ssh_kex_guess_right(ssh_session session) {
+  KEX *server = &session->server_kex;
+  KEX *client = &session->client_kex;
+
+  if (server->methods == NULL || client->methods == NULL) {
+    return 0;
+  }
+
+  return kex_same_first_method(server->methods[SSH_KEX],
+      client->methods[SSH_KEX]) &&
+    kex_same_first_method(server->methods[SSH_HOSTKEYS],
+      client->methods[SSH_HOSTKEYS]);
+}
+
+/** @internal
+ * @brief frees the methods of a SSH_MSG_KEXINIT
+ */
+void ssh_kex_free_methods(KEX *kex) {
+  int i;
+
+  if (kex->methods == NULL) {
+    return;
+  }
+  for (i = 0; i < 10; i++) {
+    SAFE_FREE(kex->methods[i]);
+  }
+  SAFE_FREE(kex->methods);
+}
+
+/** @internal
+ * @brief gives a key re-exchange the crypto structure it fills, the
+ * previous one was freed by ssh_kex_newkeys()
+ * @returns SSH_OK or SSH_ERROR
+ */
+int ssh_kex_next_crypto(ssh_session session) {
+  if (session->next_crypto != NULL) {
+    return SSH_OK;
+  }
+  session->next_crypto = crypto_new();
+  if (session->next_crypto == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  return SSH_OK;
+}
+
+/* the keys are too old, see SSH_OPTIONS_REKEY_TIME */
+static void ssh_kex_rekey_timer(ssh_timer timer, void *userdata) {
+  ssh_session session = (ssh_session) userdata;
+
+  (void) timer;
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
+      "Renewing the session keys after %u seconds", session->rekey_time);
+  ssh_rekey(session);
+}
+
+/** @internal
+ * @brief starts a key re-exchange when the keys reached their limits, see
+ * SSH_OPTIONS_REKEY_DATA
+ */
+void ssh_kex_rekey_check(ssh_session session) {
+  if (session->rekey_state != SSH_REKEY_STATE_NONE ||
+      (session->session_state != SSH_SESSION_STATE_AUTHENTICATING &&
+       session->session_state != SSH_SESSION_STATE_AUTHENTICATED)) {
+    return;
+  }
+
+  if ((session->rekey_data > 0 && session->kex_bytes >= session->rekey_data) ||
+      session->kex_packets >= SSH_REKEY_PACKETS_MAX) {
+    SSH_LOG(session, SSH_LOG_PROTOCOL,
+        "Renewing the session keys after %llu bytes in %lu packets",
+        (unsigned long long) session->kex_bytes,
+        (unsigned long) session->kex_packets);
+    ssh_rekey(session);
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Switch to the keys of the key exchange which just ended.
+ *
+ * Both directions change at once, when the SSH2_MSG_NEWKEYS of the peer is
+ * received. The compression streams go on with the new keys. After a key
+ * re-exchange, the packets held meanwhile are sent and the channels resume.
+ *
+ * @param[in]  session  The session, next_crypto has its keys set.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_kex_newkeys(ssh_session session) {
+  struct ssh_crypto_struct *old = session->current_crypto;
+  struct ssh_crypto_struct *new = session->next_crypto;
+  int authenticated;
+
+  /* the packets kept or decrypted in advance belong to the old keys */
+  if (pipeline_flush(session) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+  pipeline_received(session);
+
+  if (old != NULL) {
+    /* the server doesn't record the authentication, its compression does */
+    authenticated =
+      session->session_state == SSH_SESSION_STATE_AUTHENTICATED ||
+      old->do_compress_out || old->do_compress_in;
+    new->compress_out_ctx = old->compress_out_ctx;
+    new->compress_in_ctx = old->compress_in_ctx;
+    new->compress_level = old->compress_level;
+    new->compress_stream_level = old->compress_stream_level;
+    new->compress_packets = old->compress_packets;
+    new->compress_window_in = old->compress_window_in;
+    new->compress_window_out = old->compress_window_out;
+    old->compress_out_ctx = NULL;
+    old->compress_in_ctx = NULL;
+    if (authenticated && new->delayed_compress_out) {
+      new->do_compress_out = 1;
+    }
+    if (authenticated && new->delayed_compress_in) {
+      new->do_compress_in = 1;
+    }
+    crypto_free(old);
+  }
+
+  SSH_PROBE1(kex_newkeys, session);
+  /*
+   * Nothing of the key exchange is needed until the next one, which gets
+   * its crypto structure and methods when it starts.
+   */
+  crypto_free_kex(new);
+  session->current_crypto = new;
+  session->next_crypto = NULL;
+  ssh_kex_free_methods(&session->client_kex);
+  ssh_kex_free_methods(&session->server_kex);
+
+  session->kex_bytes = 0;
+  session->kex_packets = 0;
+  if (session->rekey_time > 0) {
+    if (session->rekey_timer == NULL) {
+      session->rekey_timer = ssh_session_add_timer(session,
+          session->rekey_time * 1000, ssh_kex_rekey_timer, session);
+      if (session->rekey_timer == NULL) {
+        return SSH_ERROR;
+      }
+    } else if (ssh_timer_reset(session->rekey_timer,
+          session->rekey_time * 1000) < 0) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+  }
+
+  /* the peer is probed from the first keys on */
+  if (session->keepalive_interval > 0 && session->keepalive_timer == NULL &&
+      ssh_keepalive_start(session) < 0) {
+    return SSH_ERROR;
+  }
+
+  if (session->rekey_state != SSH_REKEY_STATE_NONE) {
+    SSH_LOG(session, SSH_LOG_PROTOCOL, "Session keys renewed");
+    session->rekey_state = SSH_REKEY_STATE_NONE;
+    if (packet_flush_held(session) == SSH_ERROR) {
+      return SSH_ERROR;
+    }
+    ssh_channels_schedule(session);
+    ssh_channels_writable(session, NULL);
+  }
+
+  return SSH_OK;
+}
+
 /* returns 1 if at least one of the name algos is in the default algorithms table */
 int verify_existing_algo(int algo, const char *name){
     char *ptr;
@@ -585,7 +975,7 @@ static ssh_string encrypt_session_key(ssh_session session, ssh_public_key srvkey
   }
   ssh_string_fill(data1, buffer, 32);
   if (ABS(hlen - slen) < 128){
-    ssh_log(session, SSH_LOG_FUNCTIONS,
+    SSH_LOG(session, SSH_LOG_FUNCTIONS,
         "Difference between server modulus and host modulus is only %d. "
         "It's illegal and may not work",
         ABS(hlen - slen));
@@ -657,7 +1047,7 @@ SSH_PACKET_CALLBACK(ssh_packet_publickey1){
   enter_function();
   (void)type;
   (void)user;
-  ssh_log(session, SSH_LOG_PROTOCOL, "Got a SSH_SMSG_PUBLIC_KEY");
+  SSH_LOG(session, SSH_LOG_PROTOCOL, "Got a SSH_SMSG_PUBLIC_KEY");
   if(session->session_state != SSH_SESSION_STATE_INITIAL_KEX){
     ssh_set_error(session,SSH_FATAL,"SSH_KEXINIT received in wrong state");
     goto error;
@@ -691,7 +1081,7 @@ SSH_PACKET_CALLBACK(ssh_packet_publickey1){
 
   if ((ko != sizeof(uint32_t)) || !host_mod || !host_exp
       || !server_mod || !server_exp) {
-    ssh_log(session, SSH_LOG_RARE, "Invalid SSH_SMSG_PUBLIC_KEY packet");
+    SSH_LOG(session, SSH_LOG_RARE, "Invalid SSH_SMSG_PUBLIC_KEY packet");
     ssh_set_error(session, SSH_FATAL, "Invalid SSH_SMSG_PUBLIC_KEY packet");
     goto error;
   }
@@ -701,7 +1091,7 @@ SSH_PACKET_CALLBACK(ssh_packet_publickey1){
   protocol_flags = ntohl(protocol_flags);
   supported_ciphers_mask = ntohl(supported_ciphers_mask);
   supported_authentications_mask = ntohl(supported_authentications_mask);
-  ssh_log(session, SSH_LOG_PROTOCOL,
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
       "Server bits: %d; Host bits: %d; Protocol flags: %.8lx; "
       "Cipher mask: %.8lx; Auth mask: %.8lx",
       server_bits,
@@ -743,7 +1133,7 @@ SSH_PACKET_CALLBACK(ssh_packet_publickey1){
     ssh_set_error(session, SSH_FATAL, "Remote server doesn't accept 3DES");
     goto error;
   }
-  ssh_log(session, SSH_LOG_PROTOCOL, "Sending SSH_CMSG_SESSION_KEY");
+  SSH_LOG(session, SSH_LOG_PROTOCOL, "Sending SSH_CMSG_SESSION_KEY");
 
    if (buffer_add_u8(session->out_buffer, SSH_CMSG_SESSION_KEY) < 0) {
      goto error;
@@ -761,7 +1151,7 @@ SSH_PACKET_CALLBACK(ssh_packet_publickey1){
    }
 
    bits = ssh_string_len(enc_session) * 8 - 7;
-   ssh_log(session, SSH_LOG_PROTOCOL, "%d bits, %zu bytes encrypted session",
+   SSH_LOG(session, SSH_LOG_PROTOCOL, "%d bits, %zu bytes encrypted session",
        bits, ssh_string_len(enc_session));
    bits = htons(bits);
    /* the encrypted mpint */
@@ -785,6 +1175,10 @@ SSH_PACKET_CALLBACK(ssh_packet_publickey1){
    if (crypt_set_algorithms(session)) {
      goto error;
    }
+   if (crypt_set_keys(session->next_crypto) < 0) {
+     ssh_set_error(session, SSH_FATAL, "Could not set up the cipher keys");
+     goto error;
+   }
 
    session->current_crypto = session->next_crypto;
    session->next_crypto = NULL;
@@ -811,21 +1205,21 @@ end:
 int ssh_get_kex1(ssh_session session) {
   int ret=SSH_ERROR;
   enter_function();
-  ssh_log(session, SSH_LOG_PROTOCOL, "Waiting for a SSH_SMSG_PUBLIC_KEY");
+  SSH_LOG(session, SSH_LOG_PROTOCOL, "Waiting for a SSH_SMSG_PUBLIC_KEY");
   /* Here the callback is called */
   while(session->session_state==SSH_SESSION_STATE_INITIAL_KEX){
     ssh_handle_packets(session,-1);
   }
   if(session->session_state==SSH_SESSION_STATE_ERROR)
     goto error;
-  ssh_log(session, SSH_LOG_PROTOCOL, "Waiting for a SSH_SMSG_SUCCESS");
+  SSH_LOG(session, SSH_LOG_PROTOCOL, "Waiting for a SSH_SMSG_SUCCESS");
   /* Waiting for SSH_SMSG_SUCCESS */
   while(session->session_state==SSH_SESSION_STATE_KEXINIT_RECEIVED){
     ssh_handle_packets(session,-1);
   }
   if(session->session_state==SSH_SESSION_STATE_ERROR)
       goto error;
-  ssh_log(session, SSH_LOG_PROTOCOL, "received SSH_SMSG_SUCCESS\n");
+  SSH_LOG(session, SSH_LOG_PROTOCOL, "received SSH_SMSG_SUCCESS\n");
   ret=SSH_OK;
 error:
   leave_function();
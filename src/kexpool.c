@@ -0,0 +1,362 @@
+/*
+ * kexpool.c - ephemeral keys of the server computed in advance
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/server.h"
+#include "libssh/threads.h"
+#include "libssh/dh.h"
+#include "libssh/ecdh.h"
+#include "libssh/curve25519.h"
+#include "libssh/kexpool.h"
+
+/**
+ * @addtogroup libssh_server
+ *
+ * @{
+ */
+
+/* an ephemeral key, only the fields of its key exchange method are set */
+struct ssh_kex_key_struct {
+  struct ssh_kex_key_struct *next;
+  /* diffie-hellman-group1-sha1 */
+  bignum y;
+  bignum f;
+  /* curve25519-sha256 */
+  unsigned char curve25519_privkey[CURVE25519_PRIVKEY_SIZE];
+  unsigned char curve25519_pubkey[CURVE25519_PUBKEY_SIZE];
+#ifdef HAVE_ECDH
+  /* ecdh-sha2-nistp256 */
+  EC_KEY *ecdh_key;
+#endif
+};
+
+/* one pool for each key exchange method, indexed by ssh_key_exchange_e */
+#define KEX_POOL_TYPES (SSH_KEX_CURVE25519_SHA256 + 1)
+
+struct ssh_kex_pool_struct {
+  struct ssh_kex_key_struct *head;
+  unsigned int count;
+};
+
+static struct ssh_kex_pool_struct kex_pools[KEX_POOL_TYPES];
+static unsigned int kex_pool_max = 0;
+static void *kex_pool_lock = NULL;
+static int kex_pool_initialized = 0;
+
+static void kex_key_free(struct ssh_kex_key_struct *key) {
+  if (key == NULL) {
+    return;
+  }
+  if (key->y != NULL) {
+    bignum_free(key->y);
+  }
+  if (key->f != NULL) {
+    bignum_free(key->f);
+  }
+#ifdef HAVE_ECDH
+  if (key->ecdh_key != NULL) {
+    EC_KEY_free(key->ecdh_key);
+  }
+#endif
+  memset(key, 0, sizeof(struct ssh_kex_key_struct));
+  SAFE_FREE(key);
+}
+
+/* computes a key, outside of the lock: it is the slow part */
+static struct ssh_kex_key_struct *kex_key_new(enum ssh_key_exchange_e type) {
+  struct ssh_kex_key_struct *key;
+
+  key = malloc(sizeof(struct ssh_kex_key_struct));
+  if (key == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(key);
+
+  switch (type) {
+    case SSH_KEX_DH_GROUP1_SHA1:
+      if (dh_generate_keypair(&key->y, &key->f) < 0) {
+        goto error;
+      }
+      break;
+#ifdef HAVE_ECDH
+    case SSH_KEX_ECDH_SHA2_NISTP256:
+      key->ecdh_key = ecdh_generate_key();
+      if (key->ecdh_key == NULL) {
+        goto error;
+      }
+      break;
+#endif
+    case SSH_KEX_CURVE25519_SHA256:
+      if (ssh_get_random(key->curve25519_privkey,
+            CURVE25519_PRIVKEY_SIZE, 1) != 1) {
+        goto error;
+      }
+      crypto_scalarmult_curve25519_base(key->curve25519_pubkey,
+          key->curve25519_privkey);
+      break;
+    default:
+      goto error;
+  }
+
+  return key;
+error:
+  kex_key_free(key);
+  return NULL;
+}
+
+static struct ssh_kex_key_struct *kex_pool_take(enum ssh_key_exchange_e type) {
+  struct ssh_kex_key_struct *key;
+
+  if (!ssh_atomic_load_int(&kex_pool_initialized)) {
+    return NULL;
+  }
+
+  ssh_threads_mutex_lock(&kex_pool_lock);
+  key = kex_pools[type].head;
+  if (key != NULL) {
+    kex_pools[type].head = key->next;
+    kex_pools[type].count--;
+  }
+  ssh_threads_mutex_unlock(&kex_pool_lock);
+
+  return key;
+}
+
+/* frees the keys of each method beyond the given count */
+static void kex_pool_trim(unsigned int keep) {
+  struct ssh_kex_key_struct *key;
+  int i;
+
+  for (i = 0; i < KEX_POOL_TYPES; i++) {
+    for (;;) {
+      ssh_threads_mutex_lock(&kex_pool_lock);
+      if (kex_pools[i].count <= keep) {
+        ssh_threads_mutex_unlock(&kex_pool_lock);
+        break;
+      }
+      key = kex_pools[i].head;
+      kex_pools[i].head = key->next;
+      kex_pools[i].count--;
+      ssh_threads_mutex_unlock(&kex_pool_lock);
+
+      kex_key_free(key);
+    }
+  }
+}
+
+/**
+ * @brief Set the number of ephemeral keys computed in advance for each key
+ * exchange method.
+ *
+ * A server computes an ephemeral key pair for every key exchange while the
+ * client waits for the reply. With a pool, the key pairs are computed in
+ * advance by ssh_kex_pool_refill(), and the key exchange only computes the
+ * shared secret. Every key is used once. The pool is disabled by default.
+ *
+ * The pool is shared by all the sessions, and may be refilled by another
+ * thread.
+ *
+ * @param[in]  keys     The number of keys to keep for each method, 0 to
+ *                      disable the pool.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_set_kex_pool_size(unsigned int keys) {
+  if (ssh_threads_mutex_once(&kex_pool_lock, &kex_pool_initialized) < 0) {
+    return SSH_ERROR;
+  }
+
+  ssh_threads_mutex_lock(&kex_pool_lock);
+  kex_pool_max = keys;
+  ssh_threads_mutex_unlock(&kex_pool_lock);
+
+  /* release what doesn't fit anymore */
+  kex_pool_trim(keys);
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Compute the ephemeral keys missing in the key exchange pool.
+ *
+ * This is meant to be called by a worker thread of the server, while the
+ * sessions use the keys:
+ *
+ * @code
+ * static void *kex_pool_worker(void *arg) {
+ *   while (running) {
+ *     if (ssh_kex_pool_refill() == 0) {
+ *       usleep(10000);
+ *     }
+ *   }
+ *   return NULL;
+ * }
+ * @endcode
+ *
+ * The keys are computed without holding the lock of the pool, so the
+ * sessions never wait for them.
+ *
+ * @return              The number of keys added, SSH_ERROR on error.
+ *
+ * @see ssh_set_kex_pool_size()
+ */
+int ssh_kex_pool_refill(void) {
+  struct ssh_kex_key_struct *key;
+  int added = 0;
+  int full;
+  int i;
+
+  if (!ssh_atomic_load_int(&kex_pool_initialized)) {
+    return 0;
+  }
+
+  for (i = 0; i < KEX_POOL_TYPES; i++) {
+#ifndef HAVE_ECDH
+    if (i == SSH_KEX_ECDH_SHA2_NISTP256) {
+      continue;
+    }
+#endif
+    for (;;) {
+      ssh_threads_mutex_lock(&kex_pool_lock);
+      full = kex_pools[i].count >= kex_pool_max;
+      ssh_threads_mutex_unlock(&kex_pool_lock);
+      if (full) {
+        break;
+      }
+
+      key = kex_key_new(i);
+      if (key == NULL) {
+        return SSH_ERROR;
+      }
+
+      ssh_threads_mutex_lock(&kex_pool_lock);
+      full = kex_pools[i].count >= kex_pool_max;
+      if (!full) {
+        key->next = kex_pools[i].head;
+        kex_pools[i].head = key;
+        kex_pools[i].count++;
+        added++;
+      }
+      ssh_threads_mutex_unlock(&kex_pool_lock);
+
+      /* the pool was shrunk meanwhile */
+      if (full) {
+        kex_key_free(key);
+        break;
+      }
+    }
+  }
+
+  return added;
+}
+
+/** @internal
+ * @brief takes a diffie-hellman-group1-sha1 key pair, y and f belong to
+ * the caller
+ */
+int ssh_kex_pool_take_dh(bignum *y, bignum *f) {
+  struct ssh_kex_key_struct *key;
+
+  key = kex_pool_take(SSH_KEX_DH_GROUP1_SHA1);
+  if (key == NULL) {
+    return -1;
+  }
+  *y = key->y;
+  *f = key->f;
+  key->y = NULL;
+  key->f = NULL;
+  kex_key_free(key);
+
+  return 0;
+}
+
+/** @internal
+ * @brief takes a curve25519 key pair, copied in the two 32 bytes arrays
+ */
+int ssh_kex_pool_take_curve25519(unsigned char *privkey,
+    unsigned char *pubkey) {
+  struct ssh_kex_key_struct *key;
+
+  key = kex_pool_take(SSH_KEX_CURVE25519_SHA256);
+  if (key == NULL) {
+    return -1;
+  }
+  memcpy(privkey, key->curve25519_privkey, CURVE25519_PRIVKEY_SIZE);
+  memcpy(pubkey, key->curve25519_pubkey, CURVE25519_PUBKEY_SIZE);
+  kex_key_free(key);
+
+  return 0;
+}
+
+#ifdef HAVE_ECDH
+/** @internal
+ * @brief takes a nistp256 key, NULL if the pool is empty
+ */
+EC_KEY *ssh_kex_pool_take_ecdh(void) {
+  struct ssh_kex_key_struct *key;
+  EC_KEY *ecdh_key;
+
+  key = kex_pool_take(SSH_KEX_ECDH_SHA2_NISTP256);
+  if (key == NULL) {
+    return NULL;
+  }
+  ecdh_key = key->ecdh_key;
+  key->ecdh_key = NULL;
+  kex_key_free(key);
+
+  return ecdh_key;
+}
+#endif
+
+/** @internal
+ * @brief frees the pooled keys in a forked process
+ *
+ * A child has a copy of the keys of its parent, they must not be used by
+ * both. The pool is refilled as usual.
+ */
+void ssh_kex_pool_drop(void) {
+  if (!ssh_atomic_load_int(&kex_pool_initialized)) {
+    return;
+  }
+  kex_pool_trim(0);
+}
+
+/** @internal
+ * @brief frees the pooled keys, called by ssh_finalize()
+ */
+void ssh_kex_pool_finalize(void) {
+  if (!ssh_atomic_load_int(&kex_pool_initialized)) {
+    return;
+  }
+  ssh_set_kex_pool_size(0);
+  ssh_threads_mutex_destroy(&kex_pool_lock);
+  kex_pool_lock = NULL;
+  kex_pool_initialized = 0;
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
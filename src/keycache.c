@@ -0,0 +1,270 @@
+/*
+ * keycache.c - private keys parsed once for all the sessions
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/threads.h"
+#include "libssh/keys.h"
+#include "libssh/keycache.h"
+
+/**
+ * @addtogroup libssh_auth
+ *
+ * @{
+ */
+
+/*
+ * A key read from a file. The entry is shared by the cache and the sessions
+ * copying the key: it is freed by the last one to release it.
+ */
+struct ssh_key_cache_entry_struct {
+  struct ssh_key_cache_entry_struct *next;
+  char *filename;
+  time_t mtime;
+  off_t size;
+  ssh_private_key key;
+  unsigned int refs;
+};
+
+/* the most recently used entry first */
+static struct ssh_key_cache_entry_struct *key_cache = NULL;
+static unsigned int key_cache_max = 0;
+static void *key_cache_lock = NULL;
+static int key_cache_initialized = 0;
+
+/* called with the lock held */
+static void key_cache_release(struct ssh_key_cache_entry_struct *entry) {
+  if (--entry->refs > 0) {
+    return;
+  }
+  privatekey_free(entry->key);
+  SAFE_FREE(entry->filename);
+  SAFE_FREE(entry);
+}
+
+/* called with the lock held */
+static void key_cache_unlink(struct ssh_key_cache_entry_struct **prev) {
+  struct ssh_key_cache_entry_struct *entry = *prev;
+
+  *prev = entry->next;
+  entry->next = NULL;
+  key_cache_release(entry);
+}
+
+/* called with the lock held, drops the least recently used keys */
+static void key_cache_trim(void) {
+  struct ssh_key_cache_entry_struct **prev;
+  unsigned int i;
+
+  prev = &key_cache;
+  for (i = 0; *prev != NULL && i < key_cache_max; i++) {
+    prev = &(*prev)->next;
+  }
+  while (*prev != NULL) {
+    key_cache_unlink(prev);
+  }
+}
+
+/**
+ * @brief Set the number of private keys kept in the key cache.
+ *
+ * Every session reading a key with privatekey_from_file(), for instance
+ * with ssh_userauth_privatekey_file() or ssh_userauth_autopubkey(), parses
+ * the file and derives the key from the passphrase again. With a cache, the
+ * key read from a file is kept and the next sessions get a copy of it, as
+ * long as the modification time and the size of the file don't change.
+ *
+ * The keys are kept decrypted, and a cached key is given without asking
+ * the passphrase again. The cache is disabled by default.
+ *
+ * The cache is shared by all the sessions, of all the threads.
+ *
+ * @param[in]  keys     The number of keys to keep, the least recently used
+ *                      are dropped first. 0 disables and empties the cache.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ *
+ * @see ssh_key_cache_preload()
+ */
+int ssh_set_key_cache_size(unsigned int keys) {
+  if (ssh_threads_mutex_once(&key_cache_lock, &key_cache_initialized) < 0) {
+    return SSH_ERROR;
+  }
+
+  ssh_threads_mutex_lock(&key_cache_lock);
+  key_cache_max = keys;
+  key_cache_trim();
+  ssh_threads_mutex_unlock(&key_cache_lock);
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Read a private key file into the key cache.
+ *
+ * The sessions reading the file afterwards don't parse it nor ask its
+ * passphrase.
+ *
+ * @param[in]  session  The session used for the errors and the passphrase
+ *                      callback.
+ *
+ * @param[in]  filename The file of the private key.
+ *
+ * @param[in]  passphrase The passphrase of the key, NULL if it has none or
+ *                      if it has to be asked.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the key can't be read
+ *                      or if the cache is disabled.
+ *
+ * @see ssh_set_key_cache_size()
+ */
+int ssh_key_cache_preload(ssh_session session, const char *filename,
+    const char *passphrase) {
+  ssh_private_key key;
+
+  if (session == NULL || filename == NULL) {
+    return SSH_ERROR;
+  }
+  if (!ssh_atomic_load_int(&key_cache_initialized) || key_cache_max == 0) {
+    ssh_set_error(session, SSH_FATAL, "The key cache is disabled");
+    return SSH_ERROR;
+  }
+
+  key = privatekey_from_file(session, filename, 0, passphrase);
+  if (key == NULL) {
+    return SSH_ERROR;
+  }
+  privatekey_free(key);
+
+  return SSH_OK;
+}
+
+ssh_private_key ssh_key_cache_get(const char *filename, int type,
+    struct stat *st) {
+  struct ssh_key_cache_entry_struct **prev;
+  struct ssh_key_cache_entry_struct *entry;
+  ssh_private_key copy;
+
+  ZERO_STRUCTP(st);
+  if (!ssh_atomic_load_int(&key_cache_initialized) || key_cache_max == 0 ||
+      stat(filename, st) < 0) {
+    return NULL;
+  }
+
+  ssh_threads_mutex_lock(&key_cache_lock);
+  for (prev = &key_cache; *prev != NULL; prev = &(*prev)->next) {
+    if (strcmp((*prev)->filename, filename) == 0) {
+      break;
+    }
+  }
+  entry = *prev;
+  if (entry == NULL) {
+    ssh_threads_mutex_unlock(&key_cache_lock);
+    return NULL;
+  }
+  if (entry->mtime != st->st_mtime || entry->size != st->st_size) {
+    /* the file was written since */
+    key_cache_unlink(prev);
+    ssh_threads_mutex_unlock(&key_cache_lock);
+    return NULL;
+  }
+  if (type != 0 && type != entry->key->type) {
+    ssh_threads_mutex_unlock(&key_cache_lock);
+    return NULL;
+  }
+
+  *prev = entry->next;
+  entry->next = key_cache;
+  key_cache = entry;
+  entry->refs++;
+  ssh_threads_mutex_unlock(&key_cache_lock);
+
+  /* copied outside of the lock, the reference keeps the entry alive */
+  copy = privatekey_dup(entry->key);
+
+  ssh_threads_mutex_lock(&key_cache_lock);
+  key_cache_release(entry);
+  ssh_threads_mutex_unlock(&key_cache_lock);
+
+  return copy;
+}
+
+void ssh_key_cache_put(const char *filename, const struct stat *st,
+    ssh_private_key key) {
+  struct ssh_key_cache_entry_struct **prev;
+  struct ssh_key_cache_entry_struct *entry;
+
+  if (!ssh_atomic_load_int(&key_cache_initialized) || key_cache_max == 0 ||
+      st->st_mtime == 0) {
+    return;
+  }
+
+  entry = malloc(sizeof(struct ssh_key_cache_entry_struct));
+  if (entry == NULL) {
+    return;
+  }
+  ZERO_STRUCTP(entry);
+  entry->filename = strdup(filename);
+  entry->key = privatekey_dup(key);
+  if (entry->filename == NULL || entry->key == NULL) {
+    privatekey_free(entry->key);
+    SAFE_FREE(entry->filename);
+    SAFE_FREE(entry);
+    return;
+  }
+  entry->mtime = st->st_mtime;
+  entry->size = st->st_size;
+  entry->refs = 1;
+
+  ssh_threads_mutex_lock(&key_cache_lock);
+  /* another session may have read the file meanwhile */
+  for (prev = &key_cache; *prev != NULL; prev = &(*prev)->next) {
+    if (strcmp((*prev)->filename, filename) == 0) {
+      key_cache_unlink(prev);
+      break;
+    }
+  }
+  entry->next = key_cache;
+  key_cache = entry;
+  key_cache_trim();
+  ssh_threads_mutex_unlock(&key_cache_lock);
+}
+
+/** @internal
+ * @brief frees the cached keys, called by ssh_finalize()
+ */
+void ssh_key_cache_finalize(void) {
+  if (!ssh_atomic_load_int(&key_cache_initialized)) {
+    return;
+  }
+  ssh_set_key_cache_size(0);
+  ssh_threads_mutex_destroy(&key_cache_lock);
+  key_cache_lock = NULL;
+  key_cache_initialized = 0;
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
@@ -53,6 +53,10 @@ const char *ssh_type_to_char(int type) {
       return "ssh-rsa";
     case SSH_KEYTYPE_RSA1:
       return "ssh-rsa1";
+    case SSH_KEYTYPE_ECDSA:
+      return "ecdsa-sha2-nistp256";
+    case SSH_KEYTYPE_ED25519:
+      return "ssh-ed25519";
     default:
       return NULL;
   }
@@ -71,6 +75,14 @@ int ssh_type_from_name(const char *name) {
     return SSH_KEYTYPE_RSA;
   } else if (strcmp(name, "ssh-dss") == 0) {
     return SSH_KEYTYPE_DSS;
+  } else if (strcmp(name, "ecdsa") == 0) {
+    return SSH_KEYTYPE_ECDSA;
+  } else if (strcmp(name, "ed25519") == 0) {
+    return SSH_KEYTYPE_ED25519;
+  } else if (strcmp(name, "ecdsa-sha2-nistp256") == 0) {
+    return SSH_KEYTYPE_ECDSA;
+  } else if (strcmp(name, "ssh-ed25519") == 0) {
+    return SSH_KEYTYPE_ED25519;
   }
 
   return -1;
@@ -88,6 +100,7 @@ ssh_public_key publickey_make_dss(ssh_session session, ssh_buffer buffer) {
     ssh_buffer_free(buffer);
     return NULL;
   }
+  ZERO_STRUCTP(key);
 
   key->type = SSH_KEYTYPE_DSS;
   key->type_c = ssh_type_to_char(key->type);
@@ -173,6 +186,7 @@ ssh_public_key publickey_make_rsa(ssh_session session, ssh_buffer buffer,
     ssh_buffer_free(buffer);
     return NULL;
   }
+  ZERO_STRUCTP(key);
 
   key->type = type;
   key->type_c = ssh_type_to_char(key->type);
@@ -229,6 +243,113 @@ error:
   return NULL;
 }
 
+ssh_public_key publickey_make_ecdsa(ssh_session session, ssh_buffer buffer) {
+  ssh_string curve = NULL;
+  ssh_string q = NULL;
+  ssh_public_key key = NULL;
+#ifdef HAVE_ECDSA
+  const EC_GROUP *group;
+  EC_POINT *point = NULL;
+#endif
+
+  key = malloc(sizeof(struct ssh_public_key_struct));
+  if (key == NULL) {
+    ssh_buffer_free(buffer);
+    return NULL;
+  }
+  ZERO_STRUCTP(key);
+
+  key->type = SSH_KEYTYPE_ECDSA;
+  key->type_c = ssh_type_to_char(key->type);
+
+  curve = buffer_get_ssh_string(buffer);
+  q = buffer_get_ssh_string(buffer);
+
+  ssh_buffer_free(buffer); /* we don't need it anymore */
+
+  /* the name of the curve repeats the one of the key type */
+  if (curve == NULL || q == NULL || ssh_string_len(curve) != 8 ||
+      memcmp(ssh_string_data(curve), "nistp256", 8) != 0) {
+    ssh_set_error(session, SSH_FATAL, "Invalid ECDSA public key");
+    goto error;
+  }
+
+#ifdef HAVE_ECDSA
+  key->ecdsa_pub = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+  if (key->ecdsa_pub == NULL) {
+    goto error;
+  }
+  group = EC_KEY_get0_group(key->ecdsa_pub);
+
+  /* the decoding checks the point is on the curve, its cofactor is 1 */
+  point = EC_POINT_new(group);
+  if (point == NULL ||
+      EC_POINT_oct2point(group, point, ssh_string_data(q),
+        ssh_string_len(q), NULL) != 1 ||
+      EC_KEY_set_public_key(key->ecdsa_pub, point) != 1) {
+    ssh_set_error(session, SSH_FATAL, "Invalid ECDSA public key");
+    goto error;
+  }
+  EC_POINT_free(point);
+#else
+  ssh_set_error(session, SSH_FATAL, "ECDSA keys are not supported");
+  goto error;
+#endif
+
+#ifdef DEBUG_CRYPTO
+  ssh_print_hexa("Q", ssh_string_data(q), ssh_string_len(q));
+#endif
+
+  ssh_string_free(curve);
+  ssh_string_free(q);
+
+  return key;
+error:
+#ifdef HAVE_ECDSA
+  EC_POINT_free(point);
+#endif
+  ssh_string_free(curve);
+  ssh_string_free(q);
+  publickey_free(key);
+
+  return NULL;
+}
+
+ssh_public_key publickey_make_ed25519(ssh_session session, ssh_buffer buffer) {
+  ssh_string pubkey = NULL;
+  ssh_public_key key = NULL;
+
+  key = malloc(sizeof(struct ssh_public_key_struct));
+  if (key == NULL) {
+    ssh_buffer_free(buffer);
+    return NULL;
+  }
+  ZERO_STRUCTP(key);
+
+  key->type = SSH_KEYTYPE_ED25519;
+  key->type_c = ssh_type_to_char(key->type);
+
+  pubkey = buffer_get_ssh_string(buffer);
+
+  ssh_buffer_free(buffer); /* we don't need it anymore */
+
+  if (pubkey == NULL || ssh_string_len(pubkey) != ED25519_PUBKEY_SIZE) {
+    ssh_set_error(session, SSH_FATAL, "Invalid ED25519 public key");
+    ssh_string_free(pubkey);
+    publickey_free(key);
+    return NULL;
+  }
+  memcpy(key->ed25519_pub, ssh_string_data(pubkey), ED25519_PUBKEY_SIZE);
+
+#ifdef DEBUG_CRYPTO
+  ssh_print_hexa("A", key->ed25519_pub, ED25519_PUBKEY_SIZE);
+#endif
+
+  ssh_string_free(pubkey);
+
+  return key;
+}
+
 void publickey_free(ssh_public_key key) {
   if (key == NULL) {
     return;
@@ -248,15 +369,22 @@ void publickey_free(ssh_public_key key) {
       gcry_sexp_release(key->rsa_pub);
 #elif defined HAVE_LIBCRYPTO
       RSA_free(key->rsa_pub);
+#endif
+      break;
+    case SSH_KEYTYPE_ECDSA:
+#ifdef HAVE_ECDSA
+      EC_KEY_free(key->ecdsa_pub);
 #endif
       break;
     default:
       break;
   }
+  ssh_string_free(key->blob);
   SAFE_FREE(key);
 }
 
 ssh_public_key publickey_from_string(ssh_session session, ssh_string pubkey_s) {
+  ssh_public_key key;
   ssh_buffer tmpbuf = NULL;
   ssh_string type_s = NULL;
   char *type_c = NULL;
@@ -288,14 +416,29 @@ ssh_public_key publickey_from_string(ssh_session session, ssh_string pubkey_s) {
 
   switch (type) {
     case SSH_KEYTYPE_DSS:
-      return publickey_make_dss(session, tmpbuf);
+      key = publickey_make_dss(session, tmpbuf);
+      break;
     case SSH_KEYTYPE_RSA:
     case SSH_KEYTYPE_RSA1:
-      return publickey_make_rsa(session, tmpbuf, type);
+      key = publickey_make_rsa(session, tmpbuf, type);
+      break;
+    case SSH_KEYTYPE_ECDSA:
+      key = publickey_make_ecdsa(session, tmpbuf);
+      break;
+    case SSH_KEYTYPE_ED25519:
+      key = publickey_make_ed25519(session, tmpbuf);
+      break;
+    default:
+      ssh_set_error(session, SSH_FATAL, "Unknown public key protocol %s",
+          ssh_type_to_char(type));
+      goto error;
   }
 
-  ssh_set_error(session, SSH_FATAL, "Unknown public key protocol %s",
-      ssh_type_to_char(type));
+  /* publickey_to_string() gives it back without serializing the key */
+  if (key != NULL) {
+    key->blob = ssh_string_copy(pubkey_s);
+  }
+  return key;
 
 error:
   ssh_buffer_free(tmpbuf);
@@ -466,6 +609,20 @@ ssh_public_key publickey_from_privatekey(ssh_private_key prv) {
       }
 #endif
       break;
+#ifdef HAVE_ECDSA
+    case SSH_KEYTYPE_ECDSA:
+      key->ecdsa_pub = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+      if (key->ecdsa_pub == NULL ||
+          EC_KEY_set_public_key(key->ecdsa_pub,
+            EC_KEY_get0_public_key(prv->ecdsa_priv)) != 1) {
+        goto error;
+      }
+      break;
+#endif
+    case SSH_KEYTYPE_ED25519:
+      /* the private key ends with the public one */
+      memcpy(key->ed25519_pub, prv->ed25519_priv + 32, ED25519_PUBKEY_SIZE);
+      break;
     default:
     	publickey_free(key);
     	return NULL;
@@ -667,6 +824,64 @@ error:
   return rc;
 }
 
+#ifdef HAVE_ECDSA
+static int ecdsa_public_to_string(EC_KEY *key, ssh_buffer buffer) {
+  ssh_string curve = NULL;
+  ssh_string q = NULL;
+  const EC_GROUP *group = EC_KEY_get0_group(key);
+  const EC_POINT *point = EC_KEY_get0_public_key(key);
+  size_t len;
+  int rc = -1;
+
+  curve = ssh_string_from_char("nistp256");
+  if (curve == NULL) {
+    goto error;
+  }
+
+  len = EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED,
+      NULL, 0, NULL);
+  q = ssh_string_new(len);
+  if (q == NULL) {
+    goto error;
+  }
+  if (EC_POINT_point2oct(group, point, POINT_CONVERSION_UNCOMPRESSED,
+        ssh_string_data(q), len, NULL) != len) {
+    goto error;
+  }
+
+  if (buffer_add_ssh_string(buffer, curve) < 0) {
+    goto error;
+  }
+  if (buffer_add_ssh_string(buffer, q) < 0) {
+    goto error;
+  }
+
+  rc = 0;
+error:
+  ssh_string_free(curve);
+  ssh_string_free(q);
+
+  return rc;
+}
+#endif /* HAVE_ECDSA */
+
+static int ed25519_public_to_string(const unsigned char *key,
+    ssh_buffer buffer) {
+  ssh_string pubkey;
+  int rc;
+
+  pubkey = ssh_string_new(ED25519_PUBKEY_SIZE);
+  if (pubkey == NULL) {
+    return -1;
+  }
+  ssh_string_fill(pubkey, key, ED25519_PUBKEY_SIZE);
+
+  rc = buffer_add_ssh_string(buffer, pubkey);
+  ssh_string_free(pubkey);
+
+  return rc < 0 ? -1 : 0;
+}
+
 /**
  * @brief Convert a public_key object into a a SSH string.
  *
@@ -682,6 +897,11 @@ ssh_string publickey_to_string(ssh_public_key key) {
   ssh_string ret = NULL;
   ssh_buffer buf = NULL;
 
+  /* serialized once */
+  if (key->blob != NULL) {
+    return ssh_string_copy(key->blob);
+  }
+
   buf = ssh_buffer_new();
   if (buf == NULL) {
     return NULL;
@@ -708,6 +928,20 @@ ssh_string publickey_to_string(ssh_public_key key) {
         goto error;
       }
       break;
+#ifdef HAVE_ECDSA
+    case SSH_KEYTYPE_ECDSA:
+      if (ecdsa_public_to_string(key->ecdsa_pub, buf) < 0) {
+        goto error;
+      }
+      break;
+#endif
+    case SSH_KEYTYPE_ED25519:
+      if (ed25519_public_to_string(key->ed25519_pub, buf) < 0) {
+        goto error;
+      }
+      break;
+    default:
+      goto error;
   }
 
   ret = ssh_string_new(buffer_get_rest_len(buf));
@@ -716,6 +950,7 @@ ssh_string publickey_to_string(ssh_public_key key) {
   }
 
   ssh_string_fill(ret, buffer_get_rest(buf), buffer_get_rest_len(buf));
+  key->blob = ssh_string_copy(ret);
 error:
   ssh_buffer_free(buf);
   if(type != NULL)
@@ -725,6 +960,79 @@ error:
 }
 
 /* Signature decoding functions */
+#ifdef HAVE_ECDSA
+static ssh_string ecdsa_signature_to_string(ECDSA_SIG *sig) {
+  ssh_buffer buffer;
+  ssh_string rs = NULL;
+  ssh_string r;
+  ssh_string s;
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    return NULL;
+  }
+
+  r = make_bignum_string(sig->r);
+  s = make_bignum_string(sig->s);
+  if (r == NULL || s == NULL ||
+      buffer_add_ssh_string(buffer, r) < 0 ||
+      buffer_add_ssh_string(buffer, s) < 0) {
+    goto error;
+  }
+
+  rs = ssh_string_new(buffer_get_rest_len(buffer));
+  if (rs == NULL) {
+    goto error;
+  }
+  ssh_string_fill(rs, buffer_get_rest(buffer), buffer_get_rest_len(buffer));
+
+error:
+  ssh_string_free(r);
+  ssh_string_free(s);
+  ssh_buffer_free(buffer);
+
+  return rs;
+}
+
+static ECDSA_SIG *ecdsa_signature_from_string(ssh_string rs) {
+  ssh_buffer buffer;
+  ssh_string r = NULL;
+  ssh_string s = NULL;
+  ECDSA_SIG *sig = NULL;
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    return NULL;
+  }
+  if (buffer_add_data(buffer, ssh_string_data(rs), ssh_string_len(rs)) < 0) {
+    goto error;
+  }
+
+  r = buffer_get_ssh_string(buffer);
+  s = buffer_get_ssh_string(buffer);
+  if (r == NULL || s == NULL || buffer_get_rest_len(buffer) != 0) {
+    goto error;
+  }
+
+  sig = ECDSA_SIG_new();
+  if (sig == NULL) {
+    goto error;
+  }
+  if (BN_bin2bn(ssh_string_data(r), ssh_string_len(r), sig->r) == NULL ||
+      BN_bin2bn(ssh_string_data(s), ssh_string_len(s), sig->s) == NULL) {
+    ECDSA_SIG_free(sig);
+    sig = NULL;
+  }
+
+error:
+  ssh_string_free(r);
+  ssh_string_free(s);
+  ssh_buffer_free(buffer);
+
+  return sig;
+}
+#endif /* HAVE_ECDSA */
+
 static ssh_string signature_to_string(SIGNATURE *sign) {
   unsigned char buffer[40] = {0};
   ssh_buffer tmpbuf = NULL;
@@ -855,6 +1163,36 @@ static ssh_string signature_to_string(SIGNATURE *sign) {
       }
 #endif
       break;
+#ifdef HAVE_ECDSA
+    case SSH_KEYTYPE_ECDSA:
+      /* r and s are two mpints in a string, RFC 5656 section 3.1.2 */
+      rs = ecdsa_signature_to_string(sign->ecdsa_sign);
+      if (rs == NULL) {
+        ssh_buffer_free(tmpbuf);
+        return NULL;
+      }
+      rc = buffer_add_ssh_string(tmpbuf, rs);
+      ssh_string_free(rs);
+      if (rc < 0) {
+        ssh_buffer_free(tmpbuf);
+        return NULL;
+      }
+      break;
+#endif
+    case SSH_KEYTYPE_ED25519:
+      rs = ssh_string_new(ED25519_SIG_SIZE);
+      if (rs == NULL) {
+        ssh_buffer_free(tmpbuf);
+        return NULL;
+      }
+      ssh_string_fill(rs, sign->ed25519_sign, ED25519_SIG_SIZE);
+      rc = buffer_add_ssh_string(tmpbuf, rs);
+      ssh_string_free(rs);
+      if (rc < 0) {
+        ssh_buffer_free(tmpbuf);
+        return NULL;
+      }
+      break;
   }
 
   str = ssh_string_new(buffer_get_rest_len(tmpbuf));
@@ -893,6 +1231,7 @@ SIGNATURE *signature_from_string(ssh_session session, ssh_string signature,
     ssh_set_error(session, SSH_FATAL, "Not enough space");
     return NULL;
   }
+  ZERO_STRUCTP(sign);
 
   tmpbuf = ssh_buffer_new();
   if (tmpbuf == NULL) {
@@ -1021,7 +1360,7 @@ SIGNATURE *signature_from_string(ssh_session session, ssh_string signature,
       }
 
       if (len < rsalen) {
-        ssh_log(session, SSH_LOG_RARE, "RSA signature len %d < %d",
+        SSH_LOG(session, SSH_LOG_RARE, "RSA signature len %d < %d",
             len, rsalen);
       }
       sign->type = SSH_KEYTYPE_RSA;
@@ -1039,7 +1378,7 @@ SIGNATURE *signature_from_string(ssh_session session, ssh_string signature,
 #endif
 
 #ifdef DEBUG_CRYPTO
-      ssh_log(session, SSH_LOG_FUNCTIONS, "len e: %d", len);
+      SSH_LOG(session, SSH_LOG_FUNCTIONS, "len e: %d", len);
       ssh_print_hexa("RSA signature", ssh_string_data(e), len);
 #endif
 
@@ -1047,8 +1386,47 @@ SIGNATURE *signature_from_string(ssh_session session, ssh_string signature,
       ssh_string_free(e);
 #endif
 
+      return sign;
+    case SSH_KEYTYPE_ECDSA:
+      rs = buffer_get_ssh_string(tmpbuf);
+      ssh_buffer_free(tmpbuf);
+      if (rs == NULL) {
+        signature_free(sign);
+        return NULL;
+      }
+      sign->type = SSH_KEYTYPE_ECDSA;
+#ifdef HAVE_ECDSA
+      sign->ecdsa_sign = ecdsa_signature_from_string(rs);
+      ssh_string_free(rs);
+      if (sign->ecdsa_sign == NULL) {
+        ssh_set_error(session, SSH_FATAL, "Invalid ECDSA signature");
+        signature_free(sign);
+        return NULL;
+      }
+
+      return sign;
+#else
+      ssh_string_free(rs);
+      signature_free(sign);
+      return NULL;
+#endif
+    case SSH_KEYTYPE_ED25519:
+      rs = buffer_get_ssh_string(tmpbuf);
+      ssh_buffer_free(tmpbuf);
+      if (rs == NULL || ssh_string_len(rs) != ED25519_SIG_SIZE) {
+        ssh_set_error(session, SSH_FATAL, "Invalid ED25519 signature");
+        ssh_string_free(rs);
+        signature_free(sign);
+        return NULL;
+      }
+      sign->type = SSH_KEYTYPE_ED25519;
+      memcpy(sign->ed25519_sign, ssh_string_data(rs), ED25519_SIG_SIZE);
+      ssh_string_free(rs);
+
       return sign;
     default:
+      signature_free(sign);
+      ssh_buffer_free(tmpbuf);
       return NULL;
   }
 
@@ -1074,6 +1452,11 @@ void signature_free(SIGNATURE *sign) {
       gcry_sexp_release(sign->rsa_sign);
 #elif defined HAVE_LIBCRYPTO
       SAFE_FREE(sign->rsa_sign);
+#endif
+      break;
+    case SSH_KEYTYPE_ECDSA:
+#ifdef HAVE_ECDSA
+      ECDSA_SIG_free(sign->ecdsa_sign);
 #endif
       break;
     default:
@@ -1121,6 +1504,73 @@ static ssh_string RSA_do_sign(const unsigned char *payload, int len, RSA *privke
 }
 #endif
 
+/*
+ * Signs with an ecdsa-sha2-nistp256 or a ssh-ed25519 key. Unlike DSA and RSA
+ * whose callers hash the data with SHA1, the hash is part of the algorithm:
+ * SHA256 for ECDSA, and ed25519 signs the data itself.
+ */
+static ssh_string ssh_sign_data(ssh_session session,
+    ssh_private_key privatekey, const void *data, uint32_t len) {
+  ssh_string signature = NULL;
+  SIGNATURE *sign = NULL;
+#ifdef HAVE_ECDSA
+  unsigned char hash[SHA256_DIGEST_LEN] = {0};
+  SHA256CTX ctx = NULL;
+#endif
+
+  sign = malloc(sizeof(SIGNATURE));
+  if (sign == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  ZERO_STRUCTP(sign);
+  sign->type = privatekey->type;
+
+  switch (privatekey->type) {
+#ifdef HAVE_ECDSA
+    case SSH_KEYTYPE_ECDSA:
+      ctx = sha256_init();
+      if (ctx == NULL) {
+        ssh_set_error_oom(session);
+        signature_free(sign);
+        return NULL;
+      }
+      sha256_update(ctx, data, len);
+      sha256_final(hash, ctx);
+
+#ifdef DEBUG_CRYPTO
+      ssh_print_hexa("Hash being signed with ecdsa", hash, SHA256_DIGEST_LEN);
+#endif
+
+      sign->ecdsa_sign = ECDSA_do_sign(hash, SHA256_DIGEST_LEN,
+          privatekey->ecdsa_priv);
+      if (sign->ecdsa_sign == NULL) {
+        ssh_set_error(session, SSH_FATAL, "Signing: openssl error");
+        signature_free(sign);
+        return NULL;
+      }
+      break;
+#endif
+    case SSH_KEYTYPE_ED25519:
+      if (crypto_sign_ed25519_detached(sign->ed25519_sign, data, len,
+            privatekey->ed25519_priv) < 0) {
+        ssh_set_error(session, SSH_FATAL, "Signing: ed25519 error");
+        signature_free(sign);
+        return NULL;
+      }
+      break;
+    default:
+      ssh_set_error(session, SSH_FATAL, "Signing: unsupported key type");
+      signature_free(sign);
+      return NULL;
+  }
+
+  signature = signature_to_string(sign);
+  signature_free(sign);
+
+  return signature;
+}
+
 #ifndef _WIN32
 ssh_string ssh_do_sign_with_agent(ssh_session session,
     struct ssh_buffer_struct *buf, struct ssh_public_key_struct *publickey) {
@@ -1136,11 +1586,11 @@ ssh_string ssh_do_sign_with_agent(ssh_session session,
   }
 
   /* prepend session identifier */
-  session_id = ssh_string_new(SHA_DIGEST_LEN);
+  session_id = ssh_string_new(crypto->session_id_len);
   if (session_id == NULL) {
     return NULL;
   }
-  ssh_string_fill(session_id, crypto->session_id, SHA_DIGEST_LEN);
+  ssh_string_fill(session_id, crypto->session_id, crypto->session_id_len);
 
   sigbuf = ssh_buffer_new();
   if (sigbuf == NULL) {
@@ -1203,13 +1653,13 @@ ssh_buffer ssh_userauth_build_digest(ssh_session session, ssh_message msg, char
   if (buffer == NULL) {
     goto error;
   }
-  session_id = ssh_string_new(SHA_DIGEST_LEN);
+  session_id = ssh_string_new(crypto->session_id_len);
   if (session_id == NULL) {
     ssh_buffer_free(buffer);
     buffer = NULL;
     goto error;
   }
-  ssh_string_fill(session_id, crypto->session_id, SHA_DIGEST_LEN);
+  ssh_string_fill(session_id, crypto->session_id, crypto->session_id_len);
 
   if(buffer_add_ssh_string(buffer, session_id) < 0 ||
      buffer_add_u8(buffer, type) < 0 ||
@@ -1244,17 +1694,39 @@ ssh_string ssh_do_sign(ssh_session session, ssh_buffer sigbuf,
   unsigned char hash[SHA_DIGEST_LEN + 1] = {0};
   ssh_string session_str = NULL;
   ssh_string signature = NULL;
+  ssh_buffer data = NULL;
   SIGNATURE *sign = NULL;
   SHACTX ctx = NULL;
 #ifdef HAVE_LIBGCRYPT
   gcry_sexp_t gcryhash;
 #endif
 
-  session_str = ssh_string_new(SHA_DIGEST_LEN);
+  session_str = ssh_string_new(crypto->session_id_len);
   if (session_str == NULL) {
     return NULL;
   }
-  ssh_string_fill(session_str, crypto->session_id, SHA_DIGEST_LEN);
+  ssh_string_fill(session_str, crypto->session_id, crypto->session_id_len);
+
+  if (privatekey->type == SSH_KEYTYPE_ECDSA ||
+      privatekey->type == SSH_KEYTYPE_ED25519) {
+    data = ssh_buffer_new();
+    if (data == NULL ||
+        buffer_add_ssh_string(data, session_str) < 0 ||
+        buffer_add_data(data, buffer_get_rest(sigbuf),
+          buffer_get_rest_len(sigbuf)) < 0) {
+      ssh_set_error_oom(session);
+      ssh_string_free(session_str);
+      ssh_buffer_free(data);
+      return NULL;
+    }
+    ssh_string_free(session_str);
+
+    signature = ssh_sign_data(session, privatekey, buffer_get_rest(data),
+        buffer_get_rest_len(data));
+    ssh_buffer_free(data);
+
+    return signature;
+  }
 
   ctx = sha1_init();
   if (ctx == NULL) {
@@ -1406,8 +1878,8 @@ ssh_string ssh_encrypt_rsa1(ssh_session session, ssh_string data, ssh_public_key
 
 /* this function signs the session id */
 ssh_string ssh_sign_session_id(ssh_session session, ssh_private_key privatekey) {
-	struct ssh_crypto_struct *crypto=session->current_crypto ? session->current_crypto :
-    session->next_crypto;
+  /* H of the key exchange running, not the session identifier */
+  struct ssh_crypto_struct *crypto = session->next_crypto;
   unsigned char hash[SHA_DIGEST_LEN + 1] = {0};
   ssh_string signature = NULL;
   SIGNATURE *sign = NULL;
@@ -1416,11 +1888,17 @@ ssh_string ssh_sign_session_id(ssh_session session, ssh_private_key privatekey)
   gcry_sexp_t data_sexp;
 #endif
 
+  if (privatekey->type == SSH_KEYTYPE_ECDSA ||
+      privatekey->type == SSH_KEYTYPE_ED25519) {
+    return ssh_sign_data(session, privatekey, crypto->secret_hash,
+        crypto->digest_len);
+  }
+
   ctx = sha1_init();
   if (ctx == NULL) {
     return NULL;
   }
-  sha1_update(ctx,crypto->session_id,SHA_DIGEST_LEN);
+  sha1_update(ctx,crypto->secret_hash,crypto->digest_len);
   sha1_final(hash + 1,ctx);
   hash[0] = 0;
 
@@ -1500,28 +1978,63 @@ ssh_string ssh_sign_session_id(ssh_session session, ssh_private_key privatekey)
 
 ssh_private_key privatekey_dup(ssh_private_key key) {
   ssh_private_key copy = (ssh_private_key) malloc(
-    sizeof(ssh_private_key)
+    sizeof(struct ssh_private_key_struct)
   );
-  copy->dsa_priv = NULL;
-  copy->rsa_priv = NULL;
+  if (copy == NULL) return NULL;
+  ZERO_STRUCTP(copy);
   copy->type = key->type;
-  
-#ifdef HAVE_LIBGCRYPT
-  #error not sure what a gcry_sexp is
-#elif defined HAVE_LIBCRYPTO
+
   switch (key->type) {
     case SSH_KEYTYPE_DSS :
+#ifdef HAVE_LIBGCRYPT
+      /* the expressions are immutable, the copy is a new reference */
+      if (gcry_sexp_build(&copy->dsa_priv, NULL, "%S", key->dsa_priv)) {
+        goto error;
+      }
+#elif defined HAVE_LIBCRYPTO
+      /* DSAparams_dup() only copies p, q and g */
       copy->dsa_priv = DSAparams_dup(key->dsa_priv);
-      if (copy->dsa_priv == NULL) return NULL;
+      if (copy->dsa_priv == NULL) {
+        goto error;
+      }
+      copy->dsa_priv->pub_key = BN_dup(key->dsa_priv->pub_key);
+      copy->dsa_priv->priv_key = BN_dup(key->dsa_priv->priv_key);
+      if (copy->dsa_priv->pub_key == NULL ||
+          copy->dsa_priv->priv_key == NULL) {
+        goto error;
+      }
+#endif
       break;
     case SSH_KEYTYPE_RSA :
     case SSH_KEYTYPE_RSA1 :
+#ifdef HAVE_LIBGCRYPT
+      if (gcry_sexp_build(&copy->rsa_priv, NULL, "%S", key->rsa_priv)) {
+        goto error;
+      }
+#elif defined HAVE_LIBCRYPTO
       copy->rsa_priv = RSAPrivateKey_dup(key->rsa_priv);
-      if (copy->rsa_priv == NULL) return NULL;
-  }
+      if (copy->rsa_priv == NULL) {
+        goto error;
+      }
+#endif
+      break;
+#ifdef HAVE_ECDSA
+    case SSH_KEYTYPE_ECDSA :
+      copy->ecdsa_priv = EC_KEY_dup(key->ecdsa_priv);
+      if (copy->ecdsa_priv == NULL) {
+        goto error;
+      }
+      break;
 #endif
-  
+    case SSH_KEYTYPE_ED25519 :
+      memcpy(copy->ed25519_priv, key->ed25519_priv, ED25519_PRIVKEY_SIZE);
+      break;
+  }
+
   return copy;
+error:
+  privatekey_free(copy);
+  return NULL;
 }
 
 /** @} */
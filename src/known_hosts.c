@@ -27,12 +27,24 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
 
 #include "libssh/priv.h"
 #include "libssh/session.h"
 #include "libssh/buffer.h"
 #include "libssh/misc.h"
 #include "libssh/keys.h"
+#include "libssh/threads.h"
+#include "libssh/hashtable.h"
 
 /*todo: remove this include */
 #include "libssh/string.h"
@@ -85,6 +97,37 @@ static void tokens_free(char **tokens) {
   SAFE_FREE(tokens);
 }
 
+/**
+ * @internal
+ *
+ * @brief Get the key type of the tokens of a known host line.
+ *
+ * @returns             The key type, pointing in the tokens or static. NULL
+ *                      if the line isn't valid.
+ */
+static const char *knownhost_line_type(char **tokens) {
+  if(!tokens[0] || !tokens[1] || !tokens[2]) {
+    /* it should have at least 3 tokens */
+    return NULL;
+  }
+
+  if (tokens[3]) {
+    /* openssh rsa1 format has 4 tokens on the line. Recognize it
+       by the fact that everything is all digits */
+    if (tokens[4]) {
+      /* that's never valid */
+      return NULL;
+    }
+    if (alldigits(tokens[1]) && alldigits(tokens[2]) && alldigits(tokens[3])) {
+      return "ssh-rsa1";
+    }
+    /* 3 tokens only, not four */
+    return NULL;
+  }
+
+  return tokens[1];
+}
+
 /**
  * @internal
  *
@@ -143,29 +186,11 @@ static char **ssh_get_knownhost_line(ssh_session session, FILE **file,
       return NULL;
     }
 
-    if(!tokens[0] || !tokens[1] || !tokens[2]) {
-      /* it should have at least 3 tokens */
+    *found_type = knownhost_line_type(tokens);
+    if (*found_type == NULL) {
       tokens_free(tokens);
       continue;
     }
-
-    *found_type = tokens[1];
-    if (tokens[3]) {
-      /* openssh rsa1 format has 4 tokens on the line. Recognize it
-         by the fact that everything is all digits */
-      if (tokens[4]) {
-        /* that's never valid */
-        tokens_free(tokens);
-        continue;
-      }
-      if (alldigits(tokens[1]) && alldigits(tokens[2]) && alldigits(tokens[3])) {
-        *found_type = "ssh-rsa1";
-      } else {
-        /* 3 tokens only, not four */
-        tokens_free(tokens);
-        continue;
-      }
-    }
     leave_function();
     return tokens;
   }
@@ -232,14 +257,12 @@ static int check_public_key(ssh_session session, char **tokens) {
       /* tmpstring = make_bignum_string(tmpbn); */
       /* do it manually instead */
       len = bignum_num_bytes(tmpbn);
-      tmpstring = malloc(4 + len);
+      tmpstring = ssh_string_new(len);
       if (tmpstring == NULL) {
         ssh_buffer_free(pubkey_buffer);
         bignum_free(tmpbn);
         return -1;
       }
-      /* TODO: fix the hardcoding */
-      tmpstring->size = htonl(len);
 #ifdef HAVE_LIBGCRYPT
       bignum_bn2bin(tmpbn, len, tmpstring->string);
 #elif defined HAVE_LIBCRYPTO
@@ -282,101 +305,934 @@ static int check_public_key(ssh_session session, char **tokens) {
   return 1;
 }
 
-/**
- * @brief Check if a hostname matches a openssh-style hashed known host.
- *
- * @param[in]  host     The host to check.
- *
- * @param[in]  hashed   The hashed value.
- *
- * @returns             1 if it matches, 0 otherwise.
+/* the known hosts files kept parsed */
+#define KNOWN_HOSTS_CACHE_FILES 8
+/* the hosts remembered per file with the hashed names they match */
+#define KNOWN_HOSTS_MEMO_SIZE 1024
+
+/* a line of a known hosts file */
+struct knownhost_entry {
+  char **tokens;
+  const char *type;
+};
+
+/* a plain host name, or the hash of a hashed one, and its line */
+struct knownhost_name {
+  unsigned int entry;
+  char *name;
+  unsigned char hash[SHA_DIGEST_LEN];
+};
+
+/* the compiled host patterns of a line */
+struct knownhost_pattern {
+  unsigned int entry;
+  struct match_list *match;
+};
+
+/* the hashed host names sharing a salt, by the start of their hash */
+struct knownhost_salt {
+  ssh_buffer salt;
+  struct ssh_hashtable *hashes;
+};
+
+/* the lines of the hashed host names matching a host */
+struct knownhost_memo {
+  char *host;
+  unsigned int *entries;
+  unsigned int count;
+};
+
+/*
+ * A parsed known hosts file. The index is shared by the cache and the
+ * sessions looking a host up: it is freed by the last one to release it.
  */
-static int match_hashed_host(ssh_session session, const char *host,
-    const char *sourcehash) {
-  /* Openssh hash structure :
-   * |1|base64 encoded salt|base64 encoded hash
-   * hash is produced that way :
-   * hash := HMAC_SHA1(key=salt,data=host)
-   */
-  unsigned char buffer[256] = {0};
+struct knownhost_index {
+  struct knownhost_index *next;
+  char *filename;
+  time_t mtime;
+  off_t size;
+  unsigned int refs;
+  struct knownhost_entry *entries;
+  unsigned int count;
+  /* the plain host names, by hash of the name */
+  struct ssh_hashtable *names;
+  /* the groups of hashed host names, by hash of the salt */
+  struct ssh_hashtable *salts;
+  /* the lines with wildcards or negations, matched one by one */
+  struct knownhost_pattern *patterns;
+  unsigned int npatterns;
+  /* the hosts already hashed with every salt */
+  struct ssh_hashtable *memo;
+};
+
+/*
+ * The lines added to a known hosts file. They are written in batches by one
+ * session at a time, the others only queue theirs.
+ */
+struct knownhost_writer {
+  struct knownhost_writer *next;
+  char *filename;
+  ssh_buffer pending;
+  /* the lines being written, NULL if no session is writing */
+  ssh_buffer batch;
+};
+
+/* the most recently used file first */
+static struct knownhost_index *known_hosts_cache = NULL;
+static struct knownhost_writer *known_hosts_writers = NULL;
+static void *known_hosts_lock = NULL;
+static int known_hosts_initialized = 0;
+
+/* FNV-1a */
+static uint64_t knownhost_hash(const void *data, size_t len) {
+  const unsigned char *p = data;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+/*
+ * Makes room for one more element in an array grown by powers of two.
+ * Returns NULL on error, the array is then left untouched.
+ */
+static void *knownhost_grow(void *array, unsigned int count, size_t size) {
+  if (count & (count - 1)) {
+    return array;
+  }
+
+  return realloc(array, (count ? 2 * count : 1) * size);
+}
+
+static int knownhost_append(unsigned int **array, unsigned int *count,
+    unsigned int value) {
+  unsigned int *tmp;
+
+  tmp = knownhost_grow(*array, *count, sizeof(unsigned int));
+  if (tmp == NULL) {
+    return -1;
+  }
+  tmp[(*count)++] = value;
+  *array = tmp;
+
+  return 0;
+}
+
+static void knownhost_memo_free(struct ssh_hashtable *table) {
+  struct ssh_hashtable_entry *it;
+  struct knownhost_memo *memo;
+
+  for (it = ssh_hashtable_first(table); it != NULL;
+      it = ssh_hashtable_next(table, it)) {
+    memo = it->data;
+    SAFE_FREE(memo->host);
+    SAFE_FREE(memo->entries);
+    SAFE_FREE(memo);
+  }
+  ssh_hashtable_free(table);
+}
+
+static void knownhost_index_free(struct knownhost_index *index) {
+  struct ssh_hashtable_entry *it;
+  struct ssh_hashtable_entry *hit;
+  struct knownhost_salt *group;
+  struct knownhost_name *name;
+  unsigned int i;
+
+  if (index->names != NULL) {
+    for (it = ssh_hashtable_first(index->names); it != NULL;
+        it = ssh_hashtable_next(index->names, it)) {
+      name = it->data;
+      SAFE_FREE(name->name);
+      SAFE_FREE(name);
+    }
+    ssh_hashtable_free(index->names);
+  }
+  if (index->salts != NULL) {
+    for (it = ssh_hashtable_first(index->salts); it != NULL;
+        it = ssh_hashtable_next(index->salts, it)) {
+      group = it->data;
+      for (hit = ssh_hashtable_first(group->hashes); hit != NULL;
+          hit = ssh_hashtable_next(group->hashes, hit)) {
+        SAFE_FREE(hit->data);
+      }
+      ssh_hashtable_free(group->hashes);
+      ssh_buffer_free(group->salt);
+      SAFE_FREE(group);
+    }
+    ssh_hashtable_free(index->salts);
+  }
+  if (index->memo != NULL) {
+    knownhost_memo_free(index->memo);
+  }
+  for (i = 0; i < index->count; i++) {
+    tokens_free(index->entries[i].tokens);
+  }
+  for (i = 0; i < index->npatterns; i++) {
+    match_list_free(index->patterns[i].match);
+  }
+  SAFE_FREE(index->entries);
+  SAFE_FREE(index->patterns);
+  SAFE_FREE(index->filename);
+  SAFE_FREE(index);
+}
+
+/*
+ * Indexes the comma separated plain host names of a line. Returns 1 if a
+ * name is too long for match_hostname(), the line is then a pattern.
+ */
+static int knownhost_add_names(struct knownhost_index *index,
+    unsigned int entry, const char *hosts) {
+  struct knownhost_name *name;
+  const char *p;
+  size_t len;
+  size_t i;
+
+  for (p = hosts; *p != '\0'; p += len + (p[len] == ',')) {
+    len = strcspn(p, ",");
+    if (len >= 1023) {
+      return 1;
+    }
+  }
+
+  for (p = hosts; *p != '\0'; p += len + (p[len] == ',')) {
+    len = strcspn(p, ",");
+    if (len == 0) {
+      continue;
+    }
+    name = malloc(sizeof(struct knownhost_name));
+    if (name == NULL) {
+      return -1;
+    }
+    ZERO_STRUCTP(name);
+    name->entry = entry;
+    name->name = malloc(len + 1);
+    if (name->name == NULL) {
+      SAFE_FREE(name);
+      return -1;
+    }
+    for (i = 0; i < len; i++) {
+      name->name[i] = (char) tolower((unsigned char) p[i]);
+    }
+    name->name[len] = '\0';
+    if (ssh_hashtable_insert(index->names,
+          knownhost_hash(name->name, len), name) < 0) {
+      SAFE_FREE(name->name);
+      SAFE_FREE(name);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Indexes an openssh hashed host name:
+ * |1|base64 encoded salt|base64 encoded hash
+ * Returns 1 if it can't be decoded, the line is then a pattern.
+ */
+static int knownhost_add_hashed(struct knownhost_index *index,
+    unsigned int entry, const char *sourcehash) {
+  struct knownhost_salt *group = NULL;
+  struct knownhost_name *name;
+  struct ssh_hashtable_entry *it;
   ssh_buffer salt;
   ssh_buffer hash;
-  HMACCTX mac;
   char *source;
   char *b64hash;
-  int match;
-  unsigned int size;
-
-  enter_function();
-
-  if (strncmp(sourcehash, "|1|", 3) != 0) {
-  	leave_function();
-    return 0;
-  }
+  uint64_t key;
 
   source = strdup(sourcehash + 3);
   if (source == NULL) {
-    leave_function();
-    return 0;
+    return -1;
   }
-
   b64hash = strchr(source, '|');
   if (b64hash == NULL) {
-    /* Invalid hash */
     SAFE_FREE(source);
-    leave_function();
-    return 0;
+    return 1;
   }
-
   *b64hash = '\0';
   b64hash++;
 
   salt = base64_to_bin(source);
-  if (salt == NULL) {
-    SAFE_FREE(source);
-    leave_function();
-    return 0;
-  }
-
   hash = base64_to_bin(b64hash);
   SAFE_FREE(source);
-  if (hash == NULL) {
+  if (salt == NULL || hash == NULL ||
+      buffer_get_rest_len(hash) != SHA_DIGEST_LEN) {
     ssh_buffer_free(salt);
-    leave_function();
-    return 0;
+    ssh_buffer_free(hash);
+    return 1;
   }
 
-  mac = hmac_init(buffer_get_rest(salt), buffer_get_rest_len(salt), HMAC_SHA1);
-  if (mac == NULL) {
+  name = malloc(sizeof(struct knownhost_name));
+  if (name == NULL) {
     ssh_buffer_free(salt);
     ssh_buffer_free(hash);
-    leave_function();
-    return 0;
+    return -1;
   }
-  size = sizeof(buffer);
-  hmac_update(mac, host, strlen(host));
-  hmac_final(mac, buffer, &size);
+  ZERO_STRUCTP(name);
+  name->entry = entry;
+  memcpy(name->hash, buffer_get_rest(hash), SHA_DIGEST_LEN);
+  ssh_buffer_free(hash);
 
-  if (size == buffer_get_rest_len(hash) &&
-      memcmp(buffer, buffer_get_rest(hash), size) == 0) {
-    match = 1;
+  key = knownhost_hash(buffer_get_rest(salt), buffer_get_rest_len(salt));
+  for (it = ssh_hashtable_find(index->salts, key); it != NULL;
+      it = ssh_hashtable_find_next(it)) {
+    group = it->data;
+    if (buffer_get_rest_len(group->salt) == buffer_get_rest_len(salt) &&
+        memcmp(buffer_get_rest(group->salt), buffer_get_rest(salt),
+          buffer_get_rest_len(salt)) == 0) {
+      break;
+    }
+    group = NULL;
+  }
+  if (group == NULL) {
+    group = malloc(sizeof(struct knownhost_salt));
+    if (group == NULL) {
+      ssh_buffer_free(salt);
+      SAFE_FREE(name);
+      return -1;
+    }
+    group->salt = salt;
+    group->hashes = ssh_hashtable_new();
+    if (group->hashes == NULL ||
+        ssh_hashtable_insert(index->salts, key, group) < 0) {
+      ssh_hashtable_free(group->hashes);
+      ssh_buffer_free(group->salt);
+      SAFE_FREE(group);
+      SAFE_FREE(name);
+      return -1;
+    }
   } else {
-    match = 0;
+    ssh_buffer_free(salt);
   }
 
-  ssh_buffer_free(salt);
-  ssh_buffer_free(hash);
+  memcpy(&key, name->hash, sizeof(key));
+  if (ssh_hashtable_insert(group->hashes, key, name) < 0) {
+    SAFE_FREE(name);
+    return -1;
+  }
 
-  ssh_log(session, SSH_LOG_PACKET,
-      "Matching a hashed host: %s match=%d", host, match);
+  return 0;
+}
 
-  leave_function();
-  return match;
+static int knownhost_index_add(struct knownhost_index *index, char **tokens,
+    const char *type) {
+  struct knownhost_entry *entries;
+  struct knownhost_pattern *patterns;
+  unsigned int entry = index->count;
+  int rc;
+
+  entries = knownhost_grow(index->entries, index->count,
+      sizeof(struct knownhost_entry));
+  if (entries == NULL) {
+    tokens_free(tokens);
+    return -1;
+  }
+  entries[entry].tokens = tokens;
+  entries[entry].type = type;
+  index->entries = entries;
+  index->count++;
+
+  if (strncmp(tokens[0], "|1|", 3) == 0) {
+    rc = knownhost_add_hashed(index, entry, tokens[0]);
+  } else if (strpbrk(tokens[0], "*?!") == NULL) {
+    rc = knownhost_add_names(index, entry, tokens[0]);
+  } else {
+    rc = 1;
+  }
+  if (rc > 0) {
+    patterns = knownhost_grow(index->patterns, index->npatterns,
+        sizeof(struct knownhost_pattern));
+    if (patterns == NULL) {
+      return -1;
+    }
+    index->patterns = patterns;
+    patterns[index->npatterns].entry = entry;
+    patterns[index->npatterns].match = match_list_compile(tokens[0],
+        strlen(tokens[0]));
+    if (patterns[index->npatterns].match == NULL) {
+      return -1;
+    }
+    index->npatterns++;
+    rc = 0;
+  }
+
+  return rc;
+}
+
+/* parses a known hosts file, a missing file gives an empty index */
+static struct knownhost_index *knownhost_index_new(ssh_session session,
+    const char *filename, const struct stat *st) {
+  struct knownhost_index *index;
+  FILE *file = NULL;
+  const char *type;
+  char **tokens;
+
+  index = malloc(sizeof(struct knownhost_index));
+  if (index == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(index);
+  index->refs = 1;
+  index->mtime = st->st_mtime;
+  index->size = st->st_size;
+  index->filename = strdup(filename);
+  index->names = ssh_hashtable_new();
+  index->salts = ssh_hashtable_new();
+  index->memo = ssh_hashtable_new();
+  if (index->filename == NULL || index->names == NULL ||
+      index->salts == NULL || index->memo == NULL) {
+    knownhost_index_free(index);
+    return NULL;
+  }
+
+  while ((tokens = ssh_get_knownhost_line(session, &file, filename,
+          &type)) != NULL) {
+    if (knownhost_index_add(index, tokens, type) < 0) {
+      fclose(file);
+      knownhost_index_free(index);
+      return NULL;
+    }
+  }
+
+  return index;
+}
+
+/* called with the lock held */
+static struct knownhost_index *knownhost_cache_find(const char *filename) {
+  struct knownhost_index *index;
+
+  for (index = known_hosts_cache; index != NULL; index = index->next) {
+    if (strcmp(index->filename, filename) == 0) {
+      break;
+    }
+  }
+
+  return index;
+}
+
+/* called with the lock held */
+static struct knownhost_writer *knownhost_writer_find(const char *filename) {
+  struct knownhost_writer *writer;
+
+  for (writer = known_hosts_writers; writer != NULL; writer = writer->next) {
+    if (strcmp(writer->filename, filename) == 0) {
+      break;
+    }
+  }
+
+  return writer;
+}
+
+/*
+ * Adds the lines written to a file to its index, before they reach the
+ * file. Called with the lock held. On error the index is left stale, the
+ * next lookup parses the file again.
+ */
+static void knownhost_index_add_lines(struct knownhost_index *index,
+    const char *data, size_t len) {
+  const char *type;
+  char **tokens;
+  char *line;
+  size_t n;
+
+  while (len > 0) {
+    for (n = 0; n < len && data[n] != '\n'; n++)
+      ;
+    line = malloc(n + 1);
+    if (line == NULL) {
+      index->size = (off_t) -1;
+      return;
+    }
+    memcpy(line, data, n);
+    line[n] = '\0';
+    tokens = space_tokenize(line);
+    SAFE_FREE(line);
+    if (tokens == NULL) {
+      index->size = (off_t) -1;
+      return;
+    }
+
+    type = knownhost_line_type(tokens);
+    if (type == NULL) {
+      tokens_free(tokens);
+    } else {
+      if (strncmp(tokens[0], "|1|", 3) == 0 && index->memo != NULL) {
+        /* the hosts have to be hashed with the new salt */
+        knownhost_memo_free(index->memo);
+        index->memo = NULL;
+      }
+      if (knownhost_index_add(index, tokens, type) < 0) {
+        index->size = (off_t) -1;
+        return;
+      }
+    }
+
+    if (n < len) {
+      n++;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+/* called with the lock held if the index is cached */
+static void knownhost_index_release(struct knownhost_index *index) {
+  if (--index->refs > 0) {
+    return;
+  }
+  knownhost_index_free(index);
+}
+
+/*
+ * Returns the index of the file, from the cache if the file didn't change
+ * since it was parsed.
+ */
+static struct knownhost_index *knownhost_index_get(ssh_session session,
+    const char *filename) {
+  struct knownhost_writer *writer;
+  struct knownhost_index **prev;
+  struct knownhost_index *index;
+  struct stat st;
+  unsigned int i;
+
+  ZERO_STRUCT(st);
+  if (stat(filename, &st) < 0) {
+    /* ssh_get_knownhost_line() won't open it either */
+    return knownhost_index_new(session, filename, &st);
+  }
+
+  if (ssh_threads_mutex_once(&known_hosts_lock, &known_hosts_initialized) < 0) {
+    return knownhost_index_new(session, filename, &st);
+  }
+
+  ssh_threads_mutex_lock(&known_hosts_lock);
+  for (prev = &known_hosts_cache; *prev != NULL; prev = &(*prev)->next) {
+    index = *prev;
+    if (strcmp(index->filename, filename) != 0) {
+      continue;
+    }
+    *prev = index->next;
+    if (index->mtime == st.st_mtime && index->size == st.st_size) {
+      index->next = known_hosts_cache;
+      known_hosts_cache = index;
+      index->refs++;
+      ssh_threads_mutex_unlock(&known_hosts_lock);
+      return index;
+    }
+    /* the file was written since */
+    index->next = NULL;
+    knownhost_index_release(index);
+    break;
+  }
+  ssh_threads_mutex_unlock(&known_hosts_lock);
+
+  /* parsed outside of the lock */
+  index = knownhost_index_new(session, filename, &st);
+  if (index == NULL) {
+    return NULL;
+  }
+
+  ssh_threads_mutex_lock(&known_hosts_lock);
+  /* another session may have parsed the file meanwhile */
+  for (prev = &known_hosts_cache; *prev != NULL; prev = &(*prev)->next) {
+    if (strcmp((*prev)->filename, filename) == 0) {
+      struct knownhost_index *old = *prev;
+
+      *prev = old->next;
+      old->next = NULL;
+      knownhost_index_release(old);
+      break;
+    }
+  }
+  index->refs++;
+  index->next = known_hosts_cache;
+  known_hosts_cache = index;
+  /* the lines not written yet */
+  writer = knownhost_writer_find(filename);
+  if (writer != NULL) {
+    if (writer->batch != NULL) {
+      knownhost_index_add_lines(index, buffer_get_rest(writer->batch),
+          buffer_get_rest_len(writer->batch));
+    }
+    knownhost_index_add_lines(index, buffer_get_rest(writer->pending),
+        buffer_get_rest_len(writer->pending));
+  }
+  /* drops the least recently used files */
+  prev = &known_hosts_cache;
+  for (i = 0; *prev != NULL && i < KNOWN_HOSTS_CACHE_FILES; i++) {
+    prev = &(*prev)->next;
+  }
+  while (*prev != NULL) {
+    struct knownhost_index *old = *prev;
+
+    *prev = old->next;
+    old->next = NULL;
+    knownhost_index_release(old);
+  }
+  ssh_threads_mutex_unlock(&known_hosts_lock);
+
+  return index;
+}
+
+static void knownhost_index_put(struct knownhost_index *index) {
+  if (!ssh_atomic_load_int(&known_hosts_initialized)) {
+    knownhost_index_release(index);
+    return;
+  }
+  ssh_threads_mutex_lock(&known_hosts_lock);
+  knownhost_index_release(index);
+  ssh_threads_mutex_unlock(&known_hosts_lock);
+}
+
+/*
+ * Hashes the host with every salt of the file, the lines it matches are
+ * remembered for the next lookups.
+ */
+static struct knownhost_memo *knownhost_match_hashed(ssh_session session,
+    struct knownhost_index *index, const char *host) {
+  unsigned char buffer[SHA_DIGEST_LEN];
+  struct ssh_hashtable_entry *it;
+  struct ssh_hashtable_entry *hit;
+  struct knownhost_salt *group;
+  struct knownhost_name *name;
+  struct knownhost_memo *memo;
+  HMACCTX mac;
+  unsigned int size;
+  uint64_t key;
+
+  if (index->memo == NULL) {
+    index->memo = ssh_hashtable_new();
+    if (index->memo == NULL) {
+      return NULL;
+    }
+  }
+
+  key = knownhost_hash(host, strlen(host));
+  for (it = ssh_hashtable_find(index->memo, key); it != NULL;
+      it = ssh_hashtable_find_next(it)) {
+    memo = it->data;
+    if (strcmp(memo->host, host) == 0) {
+      return memo;
+    }
+  }
+
+  memo = malloc(sizeof(struct knownhost_memo));
+  if (memo == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(memo);
+  memo->host = strdup(host);
+  if (memo->host == NULL) {
+    SAFE_FREE(memo);
+    return NULL;
+  }
+
+  for (it = ssh_hashtable_first(index->salts); it != NULL;
+      it = ssh_hashtable_next(index->salts, it)) {
+    group = it->data;
+    mac = hmac_init(buffer_get_rest(group->salt),
+        buffer_get_rest_len(group->salt), HMAC_SHA1);
+    if (mac == NULL) {
+      goto error;
+    }
+    size = sizeof(buffer);
+    hmac_update(mac, host, strlen(host));
+    hmac_final(mac, buffer, &size);
+
+    memcpy(&key, buffer, sizeof(key));
+    for (hit = ssh_hashtable_find(group->hashes, key); hit != NULL;
+        hit = ssh_hashtable_find_next(hit)) {
+      name = hit->data;
+      if (memcmp(name->hash, buffer, SHA_DIGEST_LEN) == 0 &&
+          knownhost_append(&memo->entries, &memo->count, name->entry) < 0) {
+        goto error;
+      }
+    }
+  }
+  SSH_LOG(session, SSH_LOG_PACKET,
+      "Matching a hashed host: %s matches=%u", host, memo->count);
+
+  if (index->memo->count >= KNOWN_HOSTS_MEMO_SIZE) {
+    knownhost_memo_free(index->memo);
+    index->memo = ssh_hashtable_new();
+  }
+  if (index->memo == NULL ||
+      ssh_hashtable_insert(index->memo, knownhost_hash(host, strlen(host)),
+        memo) < 0) {
+    goto error;
+  }
+
+  return memo;
+error:
+  SAFE_FREE(memo->entries);
+  SAFE_FREE(memo->host);
+  SAFE_FREE(memo);
+  return NULL;
+}
+
+static int knownhost_cmp(const void *a, const void *b) {
+  unsigned int x = *(const unsigned int *) a;
+  unsigned int y = *(const unsigned int *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Collects the lines matching the host or the host:port, sorted in the order
+ * of the file. Called with the lock held if the index is cached.
+ */
+static int knownhost_lookup(ssh_session session,
+    struct knownhost_index *index, const char *host, const char *hostport,
+    unsigned int **matches, unsigned int *count) {
+  const char *hosts[2] = {host, hostport};
+  struct ssh_hashtable_entry *it;
+  struct knownhost_name *name;
+  struct knownhost_memo *memo;
+  unsigned int i;
+  unsigned int j;
+
+  *matches = NULL;
+  *count = 0;
+
+  for (i = 0; i < 2; i++) {
+    for (it = ssh_hashtable_find(index->names,
+          knownhost_hash(hosts[i], strlen(hosts[i]))); it != NULL;
+        it = ssh_hashtable_find_next(it)) {
+      name = it->data;
+      if (strcmp(name->name, hosts[i]) == 0 &&
+          knownhost_append(matches, count, name->entry) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  for (i = 0; i < index->npatterns; i++) {
+    if ((match_list_exec(index->patterns[i].match, host) ||
+          match_list_exec(index->patterns[i].match, hostport)) &&
+        knownhost_append(matches, count, index->patterns[i].entry) < 0) {
+      return -1;
+    }
+  }
+
+  if (index->salts->count > 0) {
+    for (i = 0; i < 2; i++) {
+      memo = knownhost_match_hashed(session, index, hosts[i]);
+      if (memo == NULL) {
+        return -1;
+      }
+      for (j = 0; j < memo->count; j++) {
+        if (knownhost_append(matches, count, memo->entries[j]) < 0) {
+          return -1;
+        }
+      }
+    }
+  }
+
+  /* a line may match both names */
+  qsort(*matches, *count, sizeof(unsigned int), knownhost_cmp);
+  for (i = j = 0; i < *count; i++) {
+    if (j == 0 || (*matches)[j - 1] != (*matches)[i]) {
+      (*matches)[j++] = (*matches)[i];
+    }
+  }
+  *count = j;
+
+  return 0;
+}
+
+/*
+ * Appends lines to a known hosts file, locked against the other processes.
+ * before and after receive the state of the file around the write.
+ */
+static int knownhost_flush(ssh_session session, const char *filename,
+    const char *data, size_t len, struct stat *before, struct stat *after) {
+#ifndef _WIN32
+  struct flock lock;
+#endif
+  ssize_t n;
+  int rc = 0;
+  int fd;
+
+  fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0666);
+  if (fd < 0) {
+    ssh_set_error(session, SSH_FATAL,
+        "Couldn't open known_hosts file %s for appending: %s",
+        filename, strerror(errno));
+    return -1;
+  }
+
+#ifndef _WIN32
+  /* the file system may not support it, the lines are appended anyway */
+  ZERO_STRUCT(lock);
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  while (fcntl(fd, F_SETLKW, &lock) < 0 && errno == EINTR)
+    ;
+#endif
+
+  if (fstat(fd, before) < 0) {
+    ZERO_STRUCTP(before);
+  }
+  while (len > 0) {
+    n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ssh_set_error(session, SSH_FATAL,
+          "Couldn't write known_hosts file %s: %s",
+          filename, strerror(errno));
+      rc = -1;
+      break;
+    }
+    data += n;
+    len -= n;
+  }
+  if (fstat(fd, after) < 0) {
+    ZERO_STRUCTP(after);
+  }
+
+  /* releases the lock */
+  close(fd);
+
+  return rc;
+}
+
+/*
+ * Queues a line for the file and adds it to the cached index, so the other
+ * sessions find the host at once. A session finding no other one writing
+ * the file writes the queued lines until none is left.
+ */
+static int knownhost_write(ssh_session session, const char *filename,
+    const char *line) {
+  struct knownhost_writer *writer;
+  struct knownhost_index *index;
+  struct stat before;
+  struct stat after;
+  int rc = SSH_OK;
+
+  if (ssh_threads_mutex_once(&known_hosts_lock, &known_hosts_initialized) < 0) {
+    return knownhost_flush(session, filename, line, strlen(line),
+        &before, &after);
+  }
+
+  ssh_threads_mutex_lock(&known_hosts_lock);
+  writer = knownhost_writer_find(filename);
+  if (writer == NULL) {
+    writer = malloc(sizeof(struct knownhost_writer));
+    if (writer == NULL) {
+      ssh_threads_mutex_unlock(&known_hosts_lock);
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+    ZERO_STRUCTP(writer);
+    writer->filename = strdup(filename);
+    writer->pending = ssh_buffer_new();
+    if (writer->filename == NULL || writer->pending == NULL) {
+      ssh_threads_mutex_unlock(&known_hosts_lock);
+      ssh_buffer_free(writer->pending);
+      SAFE_FREE(writer->filename);
+      SAFE_FREE(writer);
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+    writer->next = known_hosts_writers;
+    known_hosts_writers = writer;
+  }
+
+  if (buffer_add_data(writer->pending, line, strlen(line)) < 0) {
+    ssh_threads_mutex_unlock(&known_hosts_lock);
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  index = knownhost_cache_find(filename);
+  if (index != NULL) {
+    knownhost_index_add_lines(index, line, strlen(line));
+  }
+
+  if (writer->batch != NULL) {
+    /* written with the batch following the current one */
+    ssh_threads_mutex_unlock(&known_hosts_lock);
+    return SSH_OK;
+  }
+
+  while (buffer_get_rest_len(writer->pending) > 0) {
+    writer->batch = writer->pending;
+    writer->pending = ssh_buffer_new();
+    if (writer->pending == NULL) {
+      writer->pending = writer->batch;
+      writer->batch = NULL;
+      ssh_set_error_oom(session);
+      rc = SSH_ERROR;
+      break;
+    }
+    ssh_threads_mutex_unlock(&known_hosts_lock);
+
+    if (knownhost_flush(session, filename, buffer_get_rest(writer->batch),
+          buffer_get_rest_len(writer->batch), &before, &after) < 0) {
+      rc = SSH_ERROR;
+    }
+
+    ssh_threads_mutex_lock(&known_hosts_lock);
+    index = knownhost_cache_find(filename);
+    if (index != NULL) {
+      if (rc == SSH_OK && index->mtime == before.st_mtime &&
+          index->size == before.st_size) {
+        /* the index already has the lines */
+        index->mtime = after.st_mtime;
+        index->size = after.st_size;
+      } else {
+        index->size = (off_t) -1;
+      }
+    }
+    ssh_buffer_free(writer->batch);
+    writer->batch = NULL;
+  }
+  ssh_threads_mutex_unlock(&known_hosts_lock);
+
+  return rc;
+}
+
+/** @internal
+ * @brief frees the cached known hosts files, called by ssh_finalize()
+ */
+void ssh_known_hosts_finalize(void) {
+  struct knownhost_writer *writer;
+  struct knownhost_index *index;
+
+  if (!ssh_atomic_load_int(&known_hosts_initialized)) {
+    return;
+  }
+  ssh_threads_mutex_lock(&known_hosts_lock);
+  while (known_hosts_cache != NULL) {
+    index = known_hosts_cache;
+    known_hosts_cache = index->next;
+    index->next = NULL;
+    knownhost_index_release(index);
+  }
+  while (known_hosts_writers != NULL) {
+    writer = known_hosts_writers;
+    known_hosts_writers = writer->next;
+    ssh_buffer_free(writer->pending);
+    SAFE_FREE(writer->filename);
+    SAFE_FREE(writer);
+  }
+  ssh_threads_mutex_unlock(&known_hosts_lock);
+  ssh_threads_mutex_destroy(&known_hosts_lock);
+  known_hosts_lock = NULL;
+  known_hosts_initialized = 0;
 }
 
 /* How it's working :
- * 1- we open the known host file and bitch if it doesn't exist
- * 2- we need to examine each line of the file, until going on state SSH_SERVER_KNOWN_OK:
+ * 1- we get the index of the known host file, parsed again if it changed
+ * 2- we need to examine each matching line of the file, until going on state SSH_SERVER_KNOWN_OK:
  *  - there's a match. if the key is good, state is SSH_SERVER_KNOWN_OK,
  *    else it's SSH_SERVER_KNOWN_CHANGED (or SSH_SERVER_FOUND_OTHER)
  *  - there's no match : no change
@@ -388,6 +1244,10 @@ static int match_hashed_host(ssh_session session, const char *host,
  * Checks the user's known host file for a previous connection to the
  * current server.
  *
+ * The file is parsed once and its hosts are indexed, for all the sessions
+ * of the process. It is parsed again when its modification time or its size
+ * changes. The index is shared by the sessions of all the threads.
+ *
  * @param[in]  session  The SSH session to use.
  *
  * @returns SSH_SERVER_KNOWN_OK:       The server is known and has not changed.\n
@@ -411,11 +1271,14 @@ static int match_hashed_host(ssh_session session, const char *host,
  *      host table.
  */
 int ssh_is_server_known(ssh_session session) {
-  FILE *file = NULL;
-  char **tokens;
+  struct knownhost_index *index;
+  struct knownhost_entry *entry;
+  unsigned int *matches = NULL;
+  unsigned int count = 0;
+  unsigned int i;
   char *host;
   char *hostport;
-  const char *type;
+  int locked;
   int match;
   int ret = SSH_SERVER_NOT_KNOWN;
 
@@ -453,52 +1316,57 @@ int ssh_is_server_known(ssh_session session) {
     return SSH_SERVER_ERROR;
   }
 
-  do {
-    tokens = ssh_get_knownhost_line(session, &file,
-        session->knownhosts, &type);
+  index = knownhost_index_get(session, session->knownhosts);
+  if (index == NULL) {
+    ssh_set_error_oom(session);
+    SAFE_FREE(host);
+    SAFE_FREE(hostport);
+    leave_function();
+    return SSH_SERVER_ERROR;
+  }
 
-    /* End of file, return the current state */
-    if (tokens == NULL) {
-      break;
-    }
-    match = match_hashed_host(session, host, tokens[0]);
-    if (match == 0){
-    	match = match_hostname(hostport, tokens[0], strlen(tokens[0]));
-    }
-    if (match == 0) {
-      match = match_hostname(host, tokens[0], strlen(tokens[0]));
-    }
-    if (match == 0) {
-      match = match_hashed_host(session, hostport, tokens[0]);
-    }
-    if (match) {
-      /* We got a match. Now check the key type */
-      if (strcmp(session->current_crypto->server_pubkey_type, type) != 0) {
-        /* Different type. We don't override the known_changed error which is
-         * more important */
-        if (ret != SSH_SERVER_KNOWN_CHANGED)
-          ret = SSH_SERVER_FOUND_OTHER;
-        tokens_free(tokens);
-        continue;
-      }
-      /* so we know the key type is good. We may get a good key or a bad key. */
-      match = check_public_key(session, tokens);
-      tokens_free(tokens);
+  /* a cached index is shared, and grown by ssh_write_knownhost() */
+  locked = ssh_atomic_load_int(&known_hosts_initialized);
+  if (locked) {
+    ssh_threads_mutex_lock(&known_hosts_lock);
+  }
+  if (knownhost_lookup(session, index, host, hostport, &matches,
+        &count) < 0) {
+    ssh_set_error_oom(session);
+    ret = SSH_SERVER_ERROR;
+    count = 0;
+  }
 
-      if (match < 0) {
-        ret = SSH_SERVER_ERROR;
-        break;
-      } else if (match == 1) {
-        ret = SSH_SERVER_KNOWN_OK;
-        break;
-      } else if(match == 0) {
-        /* We override the status with the wrong key state */
-        ret = SSH_SERVER_KNOWN_CHANGED;
-      }
-    } else {
-      tokens_free(tokens);
+  /* the matching lines, in the order of the file */
+  for (i = 0; i < count; i++) {
+    entry = &index->entries[matches[i]];
+    /* We got a match. Now check the key type */
+    if (strcmp(session->current_crypto->server_pubkey_type,
+          entry->type) != 0) {
+      /* Different type. We don't override the known_changed error which is
+       * more important */
+      if (ret != SSH_SERVER_KNOWN_CHANGED)
+        ret = SSH_SERVER_FOUND_OTHER;
+      continue;
+    }
+    /* so we know the key type is good. We may get a good key or a bad key. */
+    match = check_public_key(session, entry->tokens);
+    if (match < 0) {
+      ret = SSH_SERVER_ERROR;
+      break;
+    } else if (match == 1) {
+      ret = SSH_SERVER_KNOWN_OK;
+      break;
+    } else if(match == 0) {
+      /* We override the status with the wrong key state */
+      ret = SSH_SERVER_KNOWN_CHANGED;
     }
-  } while (1);
+  }
+  if (locked) {
+    ssh_threads_mutex_unlock(&known_hosts_lock);
+  }
+  SAFE_FREE(matches);
+  knownhost_index_put(index);
 
   if ( (ret == SSH_SERVER_NOT_KNOWN) && (session->StrictHostKeyChecking == 0) ) {
     ssh_write_knownhost(session);
@@ -507,9 +1375,6 @@ int ssh_is_server_known(ssh_session session) {
 
   SAFE_FREE(host);
   SAFE_FREE(hostport);
-  if (file != NULL) {
-    fclose(file);
-  }
 
   /* Return the current state at end of file */
   leave_function();
@@ -522,6 +1387,11 @@ int ssh_is_server_known(ssh_session session) {
  * This will create the known hosts file if it does not exist. You generaly use
  * it when ssh_is_server_known() answered SSH_SERVER_NOT_KNOWN.
  *
+ * The host is known at once by the other sessions of the process. The file
+ * is locked while the line is appended. If several sessions write at the
+ * same time, the first one appends the lines of the others with its own and
+ * the others return without waiting.
+ *
  * @param[in]  session  The ssh session to use.
  *
  * @return              SSH_OK on success, SSH_ERROR on error.
@@ -530,11 +1400,9 @@ int ssh_write_knownhost(ssh_session session) {
   ssh_string pubkey;
   unsigned char *pubkey_64;
   char buffer[4096] = {0};
-  FILE *file;
   char *dir;
   char *host;
   char *hostport;
-  size_t len = 0;
 
   if (session->host == NULL) {
     ssh_set_error(session, SSH_FATAL,
@@ -585,15 +1453,6 @@ int ssh_write_knownhost(ssh_session session) {
   }
   SAFE_FREE(dir);
 
-  file = fopen(session->knownhosts, "a");
-  if (file == NULL) {
-    ssh_set_error(session, SSH_FATAL,
-        "Couldn't open known_hosts file %s for appending: %s",
-        session->knownhosts, strerror(errno));
-    SAFE_FREE(host);
-    return -1;
-  }
-
   if (strcmp(session->current_crypto->server_pubkey_type, "ssh-rsa1") == 0) {
     /* openssh uses a different format for ssh-rsa1 keys.
        Be compatible --kv */
@@ -609,7 +1468,6 @@ int ssh_write_knownhost(ssh_session session) {
 
     key = publickey_from_string(session, pubkey);
     if (key == NULL) {
-      fclose(file);
       SAFE_FREE(host);
       return -1;
     }
@@ -618,7 +1476,6 @@ int ssh_write_knownhost(ssh_session session) {
     sexp = gcry_sexp_find_token(key->rsa_pub, "e", 0);
     if (sexp == NULL) {
       publickey_free(key);
-      fclose(file);
       SAFE_FREE(host);
       return -1;
     }
@@ -626,7 +1483,6 @@ int ssh_write_knownhost(ssh_session session) {
     gcry_sexp_release(sexp);
     if (e == NULL) {
       publickey_free(key);
-      fclose(file);
       SAFE_FREE(host);
       return -1;
     }
@@ -635,7 +1491,6 @@ int ssh_write_knownhost(ssh_session session) {
     if (sexp == NULL) {
       publickey_free(key);
       bignum_free(e);
-      fclose(file);
       SAFE_FREE(host);
       return -1;
     }
@@ -644,7 +1499,6 @@ int ssh_write_knownhost(ssh_session session) {
     if (n == NULL) {
       publickey_free(key);
       bignum_free(e);
-      fclose(file);
       SAFE_FREE(host);
       return -1;
     }
@@ -669,7 +1523,6 @@ int ssh_write_knownhost(ssh_session session) {
       OPENSSL_free(n_string);
 #endif
       publickey_free(key);
-      fclose(file);
       SAFE_FREE(host);
       return -1;
     }
@@ -695,7 +1548,6 @@ int ssh_write_knownhost(ssh_session session) {
   } else {
     pubkey_64 = bin_to_base64(pubkey->string, ssh_string_len(pubkey));
     if (pubkey_64 == NULL) {
-      fclose(file);
       SAFE_FREE(host);
       return -1;
     }
@@ -709,14 +1561,8 @@ int ssh_write_knownhost(ssh_session session) {
     SAFE_FREE(pubkey_64);
   }
   SAFE_FREE(host);
-  len = strlen(buffer);
-  if (fwrite(buffer, len, 1, file) != 1 || ferror(file)) {
-    fclose(file);
-    return -1;
-  }
 
-  fclose(file);
-  return 0;
+  return knownhost_write(session, session->knownhosts, buffer);
 }
 
 /** @} */
@@ -29,6 +29,7 @@
 #include "libssh/crypto.h"
 #include "libssh/wrapper.h"
 #include "libssh/libcrypto.h"
+#include "libssh/chachapoly.h"
 
 #ifdef HAVE_LIBCRYPTO
 
@@ -38,6 +39,7 @@
 #include <openssl/rsa.h>
 #include <openssl/hmac.h>
 #include <openssl/opensslv.h>
+#include <openssl/evp.h>
 #ifdef HAVE_OPENSSL_AES_H
 #define HAS_AES
 #include <openssl/aes.h>
@@ -51,6 +53,17 @@
 #include <openssl/des.h>
 #endif
 
+#ifndef OPENSSL_NO_ENGINE
+#include <openssl/engine.h>
+#endif
+#include <openssl/crypto.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <cpuid.h>
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#endif
+
 #if (OPENSSL_VERSION_NUMBER<0x00907000L)
 #define OLD_CRYPTO
 #endif
@@ -85,10 +98,69 @@ void sha1_final(unsigned char *md, SHACTX c) {
   SAFE_FREE(c);
 }
 
+/* a context in the same state, to hash a common prefix once */
+SHACTX sha1_duplicate(SHACTX c) {
+  SHACTX copy = malloc(sizeof(*copy));
+  if (copy == NULL) {
+    return NULL;
+  }
+  memcpy(copy, c, sizeof(*copy));
+
+  return copy;
+}
+
 void sha1(unsigned char *digest, int len, unsigned char *hash) {
   SHA1(digest, len, hash);
 }
 
+SHA256CTX sha256_init(void) {
+  SHA256CTX c = malloc(sizeof(*c));
+  if (c == NULL) {
+    return NULL;
+  }
+  SHA256_Init(c);
+
+  return c;
+}
+
+void sha256_update(SHA256CTX c, const void *data, unsigned long len) {
+  SHA256_Update(c, data, len);
+}
+
+void sha256_final(unsigned char *md, SHA256CTX c) {
+  SHA256_Final(md, c);
+  SAFE_FREE(c);
+}
+
+SHA256CTX sha256_duplicate(SHA256CTX c) {
+  SHA256CTX copy = malloc(sizeof(*copy));
+  if (copy == NULL) {
+    return NULL;
+  }
+  memcpy(copy, c, sizeof(*copy));
+
+  return copy;
+}
+
+SHA512CTX sha512_init(void) {
+  SHA512CTX c = malloc(sizeof(*c));
+  if (c == NULL) {
+    return NULL;
+  }
+  SHA512_Init(c);
+
+  return c;
+}
+
+void sha512_update(SHA512CTX c, const void *data, unsigned long len) {
+  SHA512_Update(c, data, len);
+}
+
+void sha512_final(unsigned char *md, SHA512CTX c) {
+  SHA512_Final(md, c);
+  SAFE_FREE(c);
+}
+
 MD5CTX md5_init(void) {
   MD5CTX c = malloc(sizeof(*c));
   if (c == NULL) {
@@ -125,6 +197,12 @@ HMACCTX hmac_init(const void *key, int len, int type) {
     case HMAC_SHA1:
       HMAC_Init(ctx, key, len, EVP_sha1());
       break;
+    case HMAC_SHA256:
+      HMAC_Init(ctx, key, len, EVP_sha256());
+      break;
+    case HMAC_SHA512:
+      HMAC_Init(ctx, key, len, EVP_sha512());
+      break;
     case HMAC_MD5:
       HMAC_Init(ctx, key, len, EVP_md5());
       break;
@@ -152,50 +230,272 @@ void hmac_final(HMACCTX ctx, unsigned char *hashmacbuf, unsigned int *len) {
   SAFE_FREE(ctx);
 }
 
+void hmac_reset(HMACCTX ctx) {
+  /* without a key and a digest, the keyed inner state is copied back */
+  HMAC_Init(ctx, NULL, 0, NULL);
+}
+
+void hmac_digest(HMACCTX ctx, unsigned char *hashmacbuf, unsigned int *len) {
+  HMAC_Final(ctx, hashmacbuf, len);
+}
+
+void hmac_free(HMACCTX ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+
+#ifndef OLD_CRYPTO
+  HMAC_CTX_cleanup(ctx);
+#else
+  HMAC_cleanup(ctx);
+#endif
+
+  SAFE_FREE(ctx);
+}
+
+/*
+ * The block ciphers go through the EVP interface: OpenSSL picks the fastest
+ * implementation at runtime, with AES-NI or the ARMv8 instructions when the
+ * CPU has them, or the one of the engine set by ssh_set_crypto_engine().
+ */
+#ifndef OPENSSL_NO_ENGINE
+static ENGINE *crypto_engine = NULL;
+#endif
+static char crypto_implementation[128];
+
+static const struct {
+  const char *name;
+  const EVP_CIPHER *(*type)(void);
+} evp_ciphers[] = {
 #ifdef HAS_BLOWFISH
-/* the wrapper functions for blowfish */
-static int blowfish_set_key(struct crypto_struct *cipher, void *key){
-  if (cipher->key == NULL) {
-    if (alloc_key(cipher) < 0) {
-      return -1;
+  { "blowfish-cbc", EVP_bf_cbc },
+#endif
+#ifdef HAS_AES
+#ifdef HAS_EVP_AES_CTR
+  { "aes128-ctr", EVP_aes_128_ctr },
+  { "aes192-ctr", EVP_aes_192_ctr },
+  { "aes256-ctr", EVP_aes_256_ctr },
+#endif
+  { "aes128-cbc", EVP_aes_128_cbc },
+  { "aes192-cbc", EVP_aes_192_cbc },
+  { "aes256-cbc", EVP_aes_256_cbc },
+#endif
+#ifdef HAS_DES
+  { "3des-cbc", EVP_des_ede3_cbc },
+#endif
+  { NULL, NULL }
+};
+
+struct evp_ctx {
+  EVP_CIPHER_CTX *ctx;
+  int iv_set; /* the IV is given with the first data */
+};
+
+static int evp_set_key(struct crypto_struct *cipher, void *key, int enc) {
+  const EVP_CIPHER *type = NULL;
+  struct evp_ctx *evp;
+  int rc = 0;
+  int i;
+
+  if (cipher->key != NULL) {
+    return 0;
+  }
+
+  for (i = 0; evp_ciphers[i].name != NULL; i++) {
+    if (strcmp(evp_ciphers[i].name, cipher->name) == 0) {
+      type = evp_ciphers[i].type();
+      break;
+    }
+  }
+  if (type == NULL) {
+    return -1;
+  }
+
+  if (alloc_key(cipher) < 0) {
+    return -1;
+  }
+  evp = cipher->key;
+  evp->iv_set = 0;
+  evp->ctx = EVP_CIPHER_CTX_new();
+  if (evp->ctx == NULL) {
+    SAFE_FREE(cipher->key);
+    return -1;
+  }
+
+#ifndef OPENSSL_NO_ENGINE
+  if (crypto_engine != NULL) {
+    rc = EVP_CipherInit_ex(evp->ctx, type, crypto_engine, key, NULL, enc);
+    if (rc != 1) {
+      /* the engine doesn't implement this cipher */
+      EVP_CIPHER_CTX_cleanup(evp->ctx);
     }
-    BF_set_key(cipher->key, 16, key);
   }
+#endif
+  if (rc != 1) {
+    rc = EVP_CipherInit_ex(evp->ctx, type, NULL, key, NULL, enc);
+  }
+  if (rc != 1) {
+    EVP_CIPHER_CTX_free(evp->ctx);
+    SAFE_FREE(cipher->key);
+    return -1;
+  }
+  /* the packets are padded by the protocol */
+  EVP_CIPHER_CTX_set_padding(evp->ctx, 0);
 
   return 0;
 }
 
-static void blowfish_encrypt(struct crypto_struct *cipher, void *in,
-    void *out, unsigned long len, void *IV) {
-  BF_cbc_encrypt(in, out, len, cipher->key, IV, BF_ENCRYPT);
+static int evp_set_encrypt_key(struct crypto_struct *cipher, void *key) {
+  return evp_set_key(cipher, key, 1);
 }
 
-static void blowfish_decrypt(struct crypto_struct *cipher, void *in,
-    void *out, unsigned long len, void *IV) {
-  BF_cbc_encrypt(in, out, len, cipher->key, IV, BF_DECRYPT);
+static int evp_set_decrypt_key(struct crypto_struct *cipher, void *key) {
+  return evp_set_key(cipher, key, 0);
 }
-#endif /* HAS_BLOWFISH */
 
-#ifdef HAS_AES
-static int aes_set_encrypt_key(struct crypto_struct *cipher, void *key) {
-  if (cipher->key == NULL) {
-    if (alloc_key(cipher) < 0) {
-      return -1;
+/* the context chains the blocks, IV is only read for the first packet */
+static void evp_crypt(struct crypto_struct *cipher, void *in, void *out,
+    unsigned long len, void *IV) {
+  struct evp_ctx *evp = cipher->key;
+  int outlen;
+
+  if (!evp->iv_set) {
+    EVP_CipherInit_ex(evp->ctx, NULL, NULL, NULL, IV, -1);
+    evp->iv_set = 1;
+  }
+  EVP_CipherUpdate(evp->ctx, out, &outlen, in, len);
+}
+
+static void evp_cleanup(struct crypto_struct *cipher) {
+  struct evp_ctx *evp = cipher->key;
+
+  if (evp != NULL) {
+    EVP_CIPHER_CTX_free(evp->ctx);
+    SAFE_FREE(cipher->key);
+  }
+}
+
+/**
+ * @addtogroup libssh_session
+ *
+ * @{
+ */
+
+/**
+ * @brief Use the ciphers of an OpenSSL engine.
+ *
+ * The block ciphers use the implementation chosen by OpenSSL for the CPU
+ * by default, with AES-NI for instance. An engine, built in OpenSSL or
+ * registered by the application with ENGINE_add(), can provide its own.
+ * The ciphers the engine doesn't implement keep the default one.
+ *
+ * It applies to the keys set afterwards, it should be called before the
+ * sessions are connected.
+ *
+ * @param[in]  id       The identifier of the engine, NULL to go back to
+ *                      the default implementation.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the engine can't be
+ *                      loaded or if OpenSSL has no engine support.
+ *
+ * @see ssh_get_crypto_implementation()
+ */
+int ssh_set_crypto_engine(const char *id) {
+#ifndef OPENSSL_NO_ENGINE
+  ENGINE *e = NULL;
+
+  if (id != NULL) {
+    ENGINE_load_builtin_engines();
+    e = ENGINE_by_id(id);
+    if (e == NULL) {
+      return SSH_ERROR;
     }
-    if (AES_set_encrypt_key(key,cipher->keysize,cipher->key) < 0) {
-      SAFE_FREE(cipher->key);
-      return -1;
+    if (ENGINE_init(e) != 1) {
+      ENGINE_free(e);
+      return SSH_ERROR;
     }
+    /* the functional reference is kept */
+    ENGINE_free(e);
+  }
+
+  if (crypto_engine != NULL) {
+    ENGINE_finish(crypto_engine);
   }
+  crypto_engine = e;
+  crypto_implementation[0] = '\0';
 
+  return SSH_OK;
+#else
+  if (id == NULL) {
+    return SSH_OK;
+  }
+  return SSH_ERROR;
+#endif
+}
+
+/*
+ * Whether the CPU has the AES instructions: bit 25 of ECX from CPUID 1.
+ * OpenSSL uses them when they are there.
+ */
+static int crypto_has_aesni(void) {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  unsigned int eax, ebx, ecx, edx;
+
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0) {
+    return 0;
+  }
+  return (ecx >> 25) & 1;
+#elif defined(_M_X64) || defined(_M_IX86)
+  int regs[4];
+
+  __cpuid(regs, 1);
+  return (regs[2] >> 25) & 1;
+#else
   return 0;
+#endif
 }
-static int aes_set_decrypt_key(struct crypto_struct *cipher, void *key) {
+
+/**
+ * @brief Describe the implementation of the ciphers, for diagnostics.
+ *
+ * @return              A string naming the crypto library and the engine
+ *                      or the CPU instructions used for the block ciphers.
+ *
+ * @see ssh_set_crypto_engine()
+ */
+const char *ssh_get_crypto_implementation(void) {
+  const char *impl = "generic";
+
+  if (crypto_implementation[0] != '\0') {
+    return crypto_implementation;
+  }
+
+#ifndef OPENSSL_NO_ENGINE
+  if (crypto_engine != NULL) {
+    impl = ENGINE_get_id(crypto_engine);
+  } else
+#endif
+  if (crypto_has_aesni()) {
+    impl = "aes-ni";
+  }
+  snprintf(crypto_implementation, sizeof(crypto_implementation), "%s, %s",
+      SSLeay_version(SSLEAY_VERSION), impl);
+
+  return crypto_implementation;
+}
+
+/** @} */
+
+#if defined(HAS_AES) && !defined(HAS_EVP_AES_CTR) && !defined(BROKEN_AES_CTR)
+/* OpenSSL until 0.9.7c has a broken AES_ctr128_encrypt implementation which
+ * increments the counter from 2^64 instead of 1. It's better not to use it
+ */
+static int aes_set_encrypt_key(struct crypto_struct *cipher, void *key) {
   if (cipher->key == NULL) {
     if (alloc_key(cipher) < 0) {
       return -1;
     }
-    if (AES_set_decrypt_key(key,cipher->keysize,cipher->key) < 0) {
+    if (AES_set_encrypt_key(key,cipher->keysize,cipher->key) < 0) {
       SAFE_FREE(cipher->key);
       return -1;
     }
@@ -204,21 +504,6 @@ static int aes_set_decrypt_key(struct crypto_struct *cipher, void *key) {
   return 0;
 }
 
-static void aes_encrypt(struct crypto_struct *cipher, void *in, void *out,
-    unsigned long len, void *IV) {
-  AES_cbc_encrypt(in, out, len, cipher->key, IV, AES_ENCRYPT);
-}
-
-static void aes_decrypt(struct crypto_struct *cipher, void *in, void *out,
-    unsigned long len, void *IV) {
-  AES_cbc_encrypt(in, out, len, cipher->key, IV, AES_DECRYPT);
-}
-
-#ifndef BROKEN_AES_CTR
-/* OpenSSL until 0.9.7c has a broken AES_ctr128_encrypt implementation which
- * increments the counter from 2^64 instead of 1. It's better not to use it
- */
-
 /** @internal
  * @brief encrypts/decrypts data with stream cipher AES_ctr128. 128 bits is actually
  * the size of the CTR counter and incidentally the blocksize, but not the keysize.
@@ -236,8 +521,167 @@ static void aes_ctr128_encrypt(struct crypto_struct *cipher, void *in, void *out
    */
   AES_ctr128_encrypt(in, out, len, cipher->key, IV, tmp_buffer, &num);
 }
-#endif /* BROKEN_AES_CTR */
-#endif /* HAS_AES */
+#endif /* HAS_AES && !HAS_EVP_AES_CTR && !BROKEN_AES_CTR */
+
+#ifdef HAS_AES_GCM
+#define GCM_IV_LEN 12
+#define GCM_TAG_LEN 16
+
+/*
+ * aes-gcm@openssh.com (RFC 5647): the 64 bits invocation counter at the end
+ * of the IV is incremented for each packet. The packets are numbered from
+ * the first one seen with the key, so the IV of a packet only depends on
+ * its sequence number and a copy of the cipher can process any packet.
+ */
+struct gcm_ctx {
+  EVP_CIPHER_CTX *ctx;
+  unsigned char iv[GCM_IV_LEN];
+  uint32_t first_seq;
+  int seq_set;
+};
+
+static void gcm_packet_iv(struct gcm_ctx *gcm, uint32_t seq,
+    unsigned char *iv) {
+  uint64_t count = seq;
+  int i;
+
+  if (!gcm->seq_set) {
+    gcm->first_seq = seq;
+    gcm->seq_set = 1;
+  }
+  /* the sequence numbers wrap at 2^32 */
+  count = (uint32_t) (seq - gcm->first_seq);
+
+  memcpy(iv, gcm->iv, GCM_IV_LEN);
+  for (i = GCM_IV_LEN - 1; i >= GCM_IV_LEN - 8 && count > 0; i--) {
+    count += iv[i];
+    iv[i] = count & 0xff;
+    count >>= 8;
+  }
+}
+
+static int aes_gcm_set_key(struct crypto_struct *cipher, void *key,
+    void *IV) {
+  struct gcm_ctx *gcm;
+  const EVP_CIPHER *type = cipher->keysize == 128 ?
+      EVP_aes_128_gcm() : EVP_aes_256_gcm();
+
+  if (cipher->key == NULL) {
+    if (alloc_key(cipher) < 0) {
+      return -1;
+    }
+    gcm = cipher->key;
+    gcm->ctx = EVP_CIPHER_CTX_new();
+    if (gcm->ctx == NULL) {
+      SAFE_FREE(cipher->key);
+      return -1;
+    }
+    if (EVP_EncryptInit_ex(gcm->ctx, type, NULL, key, NULL) != 1) {
+      EVP_CIPHER_CTX_free(gcm->ctx);
+      SAFE_FREE(cipher->key);
+      return -1;
+    }
+    memcpy(gcm->iv, IV, GCM_IV_LEN);
+    gcm->seq_set = 0;
+  }
+
+  return 0;
+}
+
+/* the copy needs the first sequence number, known once a packet is seen */
+static int aes_gcm_copy(struct crypto_struct *cipher,
+    struct crypto_struct *copy) {
+  struct gcm_ctx *gcm = cipher->key;
+  struct gcm_ctx *c;
+
+  if (gcm == NULL || !gcm->seq_set) {
+    return -1;
+  }
+  if (alloc_key(copy) < 0) {
+    return -1;
+  }
+  c = copy->key;
+  c->ctx = EVP_CIPHER_CTX_new();
+  if (c->ctx == NULL || EVP_CIPHER_CTX_copy(c->ctx, gcm->ctx) != 1) {
+    EVP_CIPHER_CTX_free(c->ctx);
+    SAFE_FREE(copy->key);
+    return -1;
+  }
+  memcpy(c->iv, gcm->iv, GCM_IV_LEN);
+  c->first_seq = gcm->first_seq;
+  c->seq_set = 1;
+
+  return 0;
+}
+
+static void aes_gcm_encrypt(struct crypto_struct *cipher, void *in, void *out,
+    unsigned long len, unsigned char *tag, uint32_t seq) {
+  struct gcm_ctx *gcm = cipher->key;
+  unsigned char lastblock[GCM_TAG_LEN];
+  unsigned char iv[GCM_IV_LEN];
+  int outlen;
+
+  gcm_packet_iv(gcm, seq, iv);
+  EVP_EncryptInit_ex(gcm->ctx, NULL, NULL, NULL, iv);
+  /* the packet length is the additional authenticated data */
+  EVP_EncryptUpdate(gcm->ctx, NULL, &outlen, in, sizeof(uint32_t));
+  if (out != in) {
+    memcpy(out, in, sizeof(uint32_t));
+  }
+  EVP_EncryptUpdate(gcm->ctx, (unsigned char *) out + sizeof(uint32_t),
+      &outlen, (unsigned char *) in + sizeof(uint32_t),
+      len - sizeof(uint32_t));
+  EVP_EncryptFinal_ex(gcm->ctx, lastblock, &outlen);
+  EVP_CIPHER_CTX_ctrl(gcm->ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_LEN, tag);
+}
+
+static int aes_gcm_decrypt_length(struct crypto_struct *cipher, void *in,
+    unsigned char *out, unsigned long len, uint32_t seq) {
+  (void) cipher;
+  (void) seq;
+
+  if (len < sizeof(uint32_t)) {
+    return -1;
+  }
+  /* the length isn't encrypted */
+  memcpy(out, in, sizeof(uint32_t));
+
+  return 0;
+}
+
+static int aes_gcm_decrypt(struct crypto_struct *cipher,
+    void *complete_packet, unsigned char *out, unsigned long len,
+    const unsigned char *tag, uint32_t seq) {
+  struct gcm_ctx *gcm = cipher->key;
+  unsigned char lastblock[GCM_TAG_LEN];
+  unsigned char iv[GCM_IV_LEN];
+  int outlen;
+
+  gcm_packet_iv(gcm, seq, iv);
+  EVP_DecryptInit_ex(gcm->ctx, NULL, NULL, NULL, iv);
+  EVP_CIPHER_CTX_ctrl(gcm->ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_LEN,
+      (void *) tag);
+  EVP_DecryptUpdate(gcm->ctx, NULL, &outlen, complete_packet,
+      sizeof(uint32_t));
+  EVP_DecryptUpdate(gcm->ctx, out, &outlen,
+      (unsigned char *) complete_packet + sizeof(uint32_t), len);
+  if (EVP_DecryptFinal_ex(gcm->ctx, lastblock, &outlen) != 1) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void aes_gcm_cleanup(struct crypto_struct *cipher) {
+  struct gcm_ctx *gcm = cipher->key;
+
+  if (gcm != NULL) {
+    EVP_CIPHER_CTX_free(gcm->ctx);
+    memset(gcm, 0, sizeof(struct gcm_ctx));
+    SAFE_FREE(cipher->key);
+  }
+}
+#endif /* HAS_AES_GCM */
 
 #ifdef HAS_DES
 static int des3_set_key(struct crypto_struct *cipher, void *key) {
@@ -257,22 +701,6 @@ static int des3_set_key(struct crypto_struct *cipher, void *key) {
   return 0;
 }
 
-static void des3_encrypt(struct crypto_struct *cipher, void *in,
-    void *out, unsigned long len, void *IV) {
-  DES_ede3_cbc_encrypt(in, out, len, cipher->key,
-      (void*)((uint8_t*)cipher->key + sizeof(DES_key_schedule)),
-      (void*)((uint8_t*)cipher->key + 2 * sizeof(DES_key_schedule)),
-      IV, 1);
-}
-
-static void des3_decrypt(struct crypto_struct *cipher, void *in,
-    void *out, unsigned long len, void *IV) {
-  DES_ede3_cbc_encrypt(in, out, len, cipher->key,
-      (void*)((uint8_t*)cipher->key + sizeof(DES_key_schedule)),
-      (void*)((uint8_t*)cipher->key + 2 * sizeof(DES_key_schedule)),
-      IV, 0);
-}
-
 static void des3_1_encrypt(struct crypto_struct *cipher, void *in,
     void *out, unsigned long len, void *IV) {
 #ifdef DEBUG_CRYPTO
@@ -318,17 +746,79 @@ static struct crypto_struct ssh_ciphertab[] = {
   {
     "blowfish-cbc",
     8,
-    sizeof (BF_KEY),
+    sizeof(struct evp_ctx),
     NULL,
     128,
-    blowfish_set_key,
-    blowfish_set_key,
-    blowfish_encrypt,
-    blowfish_decrypt
+    evp_set_encrypt_key,
+    evp_set_decrypt_key,
+    evp_crypt,
+    evp_crypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    evp_cleanup,
+    NULL
   },
 #endif /* HAS_BLOWFISH */
 #ifdef HAS_AES
-#ifndef BROKEN_AES_CTR
+#ifdef HAS_EVP_AES_CTR
+  {
+    "aes128-ctr",
+    16,
+    sizeof(struct evp_ctx),
+    NULL,
+    128,
+    evp_set_encrypt_key,
+    evp_set_encrypt_key,
+    evp_crypt,
+    evp_crypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    evp_cleanup,
+    NULL
+  },
+  {
+    "aes192-ctr",
+    16,
+    sizeof(struct evp_ctx),
+    NULL,
+    192,
+    evp_set_encrypt_key,
+    evp_set_encrypt_key,
+    evp_crypt,
+    evp_crypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    evp_cleanup,
+    NULL
+  },
+  {
+    "aes256-ctr",
+    16,
+    sizeof(struct evp_ctx),
+    NULL,
+    256,
+    evp_set_encrypt_key,
+    evp_set_encrypt_key,
+    evp_crypt,
+    evp_crypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    evp_cleanup,
+    NULL
+  },
+#elif !defined(BROKEN_AES_CTR)
   {
     "aes128-ctr",
     16,
@@ -338,7 +828,14 @@ static struct crypto_struct ssh_ciphertab[] = {
     aes_set_encrypt_key,
     aes_set_encrypt_key,
     aes_ctr128_encrypt,
-    aes_ctr128_encrypt
+    aes_ctr128_encrypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
   },
   {
     "aes192-ctr",
@@ -349,7 +846,14 @@ static struct crypto_struct ssh_ciphertab[] = {
     aes_set_encrypt_key,
     aes_set_encrypt_key,
     aes_ctr128_encrypt,
-    aes_ctr128_encrypt
+    aes_ctr128_encrypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
   },
   {
     "aes256-ctr",
@@ -360,54 +864,145 @@ static struct crypto_struct ssh_ciphertab[] = {
     aes_set_encrypt_key,
     aes_set_encrypt_key,
     aes_ctr128_encrypt,
-    aes_ctr128_encrypt
+    aes_ctr128_encrypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
   },
-#endif /* BROKEN_AES_CTR */
+#endif /* HAS_EVP_AES_CTR */
   {
     "aes128-cbc",
     16,
-    sizeof(AES_KEY),
+    sizeof(struct evp_ctx),
     NULL,
     128,
-    aes_set_encrypt_key,
-    aes_set_decrypt_key,
-    aes_encrypt,
-    aes_decrypt
+    evp_set_encrypt_key,
+    evp_set_decrypt_key,
+    evp_crypt,
+    evp_crypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    evp_cleanup,
+    NULL
   },
   {
     "aes192-cbc",
     16,
-    sizeof(AES_KEY),
+    sizeof(struct evp_ctx),
     NULL,
     192,
-    aes_set_encrypt_key,
-    aes_set_decrypt_key,
-    aes_encrypt,
-    aes_decrypt
+    evp_set_encrypt_key,
+    evp_set_decrypt_key,
+    evp_crypt,
+    evp_crypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    evp_cleanup,
+    NULL
   },
   {
     "aes256-cbc",
     16,
-    sizeof(AES_KEY),
+    sizeof(struct evp_ctx),
     NULL,
     256,
-    aes_set_encrypt_key,
-    aes_set_decrypt_key,
-    aes_encrypt,
-    aes_decrypt
+    evp_set_encrypt_key,
+    evp_set_decrypt_key,
+    evp_crypt,
+    evp_crypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    evp_cleanup,
+    NULL
   },
 #endif /* HAS_AES */
+#ifdef HAS_AES_GCM
+  {
+    "aes128-gcm@openssh.com",
+    16,
+    sizeof(struct gcm_ctx),
+    NULL,
+    128,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    GCM_TAG_LEN,
+    aes_gcm_set_key,
+    aes_gcm_encrypt,
+    aes_gcm_decrypt_length,
+    aes_gcm_decrypt,
+    aes_gcm_cleanup,
+    aes_gcm_copy
+  },
+  {
+    "aes256-gcm@openssh.com",
+    16,
+    sizeof(struct gcm_ctx),
+    NULL,
+    256,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    GCM_TAG_LEN,
+    aes_gcm_set_key,
+    aes_gcm_encrypt,
+    aes_gcm_decrypt_length,
+    aes_gcm_decrypt,
+    aes_gcm_cleanup,
+    aes_gcm_copy
+  },
+#endif /* HAS_AES_GCM */
+  {
+    "chacha20-poly1305@openssh.com",
+    8,
+    0,
+    NULL,
+    512,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    POLY1305_TAGLEN,
+    chachapoly_set_key,
+    chachapoly_encrypt,
+    chachapoly_decrypt_length,
+    chachapoly_decrypt,
+    chachapoly_cleanup,
+    chachapoly_copy
+  },
 #ifdef HAS_DES
   {
     "3des-cbc",
     8,
-    sizeof(DES_key_schedule) * 3,
+    sizeof(struct evp_ctx),
     NULL,
     192,
-    des3_set_key,
-    des3_set_key,
-    des3_encrypt,
-    des3_decrypt
+    evp_set_encrypt_key,
+    evp_set_decrypt_key,
+    evp_crypt,
+    evp_crypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    evp_cleanup,
+    NULL
   },
   {
     "3des-cbc-ssh1",
@@ -418,7 +1013,14 @@ static struct crypto_struct ssh_ciphertab[] = {
     des3_set_key,
     des3_set_key,
     des3_1_encrypt,
-    des3_1_decrypt
+    des3_1_decrypt,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL
   },
 #endif /* HAS_DES */
   {
@@ -430,6 +1032,13 @@ static struct crypto_struct ssh_ciphertab[] = {
     NULL,
     NULL,
     NULL,
+    NULL,
+    0,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
     NULL
   }
 };
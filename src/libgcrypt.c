@@ -27,6 +27,7 @@
 #include "libssh/session.h"
 #include "libssh/crypto.h"
 #include "libssh/wrapper.h"
+#include "libssh/chachapoly.h"
 
 #ifdef HAVE_LIBGCRYPT
 #include <gcrypt.h>
@@ -58,10 +59,65 @@ void sha1_final(unsigned char *md, SHACTX c) {
   gcry_md_close(c);
 }
 
+/* a context in the same state, to hash a common prefix once */
+SHACTX sha1_duplicate(SHACTX c) {
+  SHACTX copy = NULL;
+
+  if (gcry_md_copy(&copy, c) != 0) {
+    return NULL;
+  }
+
+  return copy;
+}
+
 void sha1(unsigned char *digest, int len, unsigned char *hash) {
   gcry_md_hash_buffer(GCRY_MD_SHA1, hash, digest, len);
 }
 
+SHA256CTX sha256_init(void) {
+  SHA256CTX ctx = NULL;
+  gcry_md_open(&ctx, GCRY_MD_SHA256, 0);
+
+  return ctx;
+}
+
+void sha256_update(SHA256CTX c, const void *data, unsigned long len) {
+  gcry_md_write(c, data, len);
+}
+
+void sha256_final(unsigned char *md, SHA256CTX c) {
+  gcry_md_final(c);
+  memcpy(md, gcry_md_read(c, 0), SHA256_DIGEST_LEN);
+  gcry_md_close(c);
+}
+
+SHA256CTX sha256_duplicate(SHA256CTX c) {
+  SHA256CTX copy = NULL;
+
+  if (gcry_md_copy(&copy, c) != 0) {
+    return NULL;
+  }
+
+  return copy;
+}
+
+SHA512CTX sha512_init(void) {
+  SHA512CTX ctx = NULL;
+  gcry_md_open(&ctx, GCRY_MD_SHA512, 0);
+
+  return ctx;
+}
+
+void sha512_update(SHA512CTX c, const void *data, unsigned long len) {
+  gcry_md_write(c, data, len);
+}
+
+void sha512_final(unsigned char *md, SHA512CTX c) {
+  gcry_md_final(c);
+  memcpy(md, gcry_md_read(c, 0), SHA512_DIGEST_LEN);
+  gcry_md_close(c);
+}
+
 MD5CTX md5_init(void) {
   MD5CTX c = NULL;
   gcry_md_open(&c, GCRY_MD_MD5, 0);
@@ -86,12 +142,21 @@ HMACCTX hmac_init(const void *key, int len, int type) {
     case HMAC_SHA1:
       gcry_md_open(&c, GCRY_MD_SHA1, GCRY_MD_FLAG_HMAC);
       break;
+    case HMAC_SHA256:
+      gcry_md_open(&c, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
+      break;
+    case HMAC_SHA512:
+      gcry_md_open(&c, GCRY_MD_SHA512, GCRY_MD_FLAG_HMAC);
+      break;
     case HMAC_MD5:
       gcry_md_open(&c, GCRY_MD_MD5, GCRY_MD_FLAG_HMAC);
       break;
     default:
       c = NULL;
   }
+  if (c == NULL) {
+    return NULL;
+  }
 
   gcry_md_setkey(c, key, len);
 
@@ -108,6 +173,45 @@ void hmac_final(HMACCTX c, unsigned char *hashmacbuf, unsigned int *len) {
   gcry_md_close(c);
 }
 
+void hmac_reset(HMACCTX c) {
+  /* gcrypt keeps the keyed state of HMAC contexts across a reset */
+  gcry_md_reset(c);
+}
+
+void hmac_digest(HMACCTX c, unsigned char *hashmacbuf, unsigned int *len) {
+  *len = gcry_md_get_algo_dlen(gcry_md_get_algo(c));
+  memcpy(hashmacbuf, gcry_md_read(c, 0), *len);
+}
+
+void hmac_free(HMACCTX c) {
+  if (c == NULL) {
+    return;
+  }
+  gcry_md_close(c);
+}
+
+/*
+ * gcrypt refuses overlapping buffers: in-place operation is requested by
+ * passing a NULL input buffer.
+ */
+static void cipher_encrypt(gcry_cipher_hd_t hd, void *in, void *out,
+    unsigned long len) {
+  if (in == out) {
+    gcry_cipher_encrypt(hd, out, len, NULL, 0);
+  } else {
+    gcry_cipher_encrypt(hd, out, len, in, len);
+  }
+}
+
+static void cipher_decrypt(gcry_cipher_hd_t hd, void *in, void *out,
+    unsigned long len) {
+  if (in == out) {
+    gcry_cipher_decrypt(hd, out, len, NULL, 0);
+  } else {
+    gcry_cipher_decrypt(hd, out, len, in, len);
+  }
+}
+
 /* the wrapper functions for blowfish */
 static int blowfish_set_key(struct crypto_struct *cipher, void *key, void *IV){
   if (cipher->key == NULL) {
@@ -135,12 +239,12 @@ static int blowfish_set_key(struct crypto_struct *cipher, void *key, void *IV){
 
 static void blowfish_encrypt(struct crypto_struct *cipher, void *in,
     void *out, unsigned long len) {
-  gcry_cipher_encrypt(cipher->key[0], out, len, in, len);
+  cipher_encrypt(cipher->key[0], in, out, len);
 }
 
 static void blowfish_decrypt(struct crypto_struct *cipher, void *in,
     void *out, unsigned long len) {
-  gcry_cipher_decrypt(cipher->key[0], out, len, in, len);
+  cipher_decrypt(cipher->key[0], in, out, len);
 }
 
 static int aes_set_key(struct crypto_struct *cipher, void *key, void *IV) {
@@ -197,14 +301,124 @@ static int aes_set_key(struct crypto_struct *cipher, void *key, void *IV) {
 
 static void aes_encrypt(struct crypto_struct *cipher, void *in, void *out,
     unsigned long len) {
-  gcry_cipher_encrypt(cipher->key[0], out, len, in, len);
+  cipher_encrypt(cipher->key[0], in, out, len);
 }
 
 static void aes_decrypt(struct crypto_struct *cipher, void *in, void *out,
     unsigned long len) {
-  gcry_cipher_decrypt(cipher->key[0], out, len, in, len);
+  cipher_decrypt(cipher->key[0], in, out, len);
+}
+
+#ifdef HAS_AES_GCM
+#define GCM_IV_LEN 12
+#define GCM_TAG_LEN 16
+
+/*
+ * aes-gcm@openssh.com (RFC 5647): the 64 bits invocation counter at the end
+ * of the IV is incremented for each packet.
+ */
+struct gcm_ctx {
+  gcry_cipher_hd_t hd;
+  unsigned char iv[GCM_IV_LEN];
+};
+
+static void gcm_increment_iv(unsigned char *iv) {
+  int i;
+
+  for (i = GCM_IV_LEN - 1; i >= GCM_IV_LEN - 8; i--) {
+    if (++iv[i] != 0) {
+      break;
+    }
+  }
+}
+
+static int aes_gcm_set_key(struct crypto_struct *cipher, void *key,
+    void *IV) {
+  struct gcm_ctx *ctx;
+  int algo = cipher->keysize == 128 ? GCRY_CIPHER_AES128 : GCRY_CIPHER_AES256;
+
+  if (cipher->key == NULL) {
+    if (alloc_key(cipher) < 0) {
+      return -1;
+    }
+    ctx = (struct gcm_ctx *) (void *) cipher->key;
+    if (gcry_cipher_open(&ctx->hd, algo, GCRY_CIPHER_MODE_GCM, 0)) {
+      SAFE_FREE(cipher->key);
+      return -1;
+    }
+    if (gcry_cipher_setkey(ctx->hd, key, cipher->keysize / 8)) {
+      gcry_cipher_close(ctx->hd);
+      SAFE_FREE(cipher->key);
+      return -1;
+    }
+    memcpy(ctx->iv, IV, GCM_IV_LEN);
+  }
+
+  return 0;
 }
 
+static void aes_gcm_encrypt(struct crypto_struct *cipher, void *in, void *out,
+    unsigned long len, unsigned char *tag, uint32_t seq) {
+  struct gcm_ctx *ctx = (struct gcm_ctx *) (void *) cipher->key;
+
+  (void) seq;
+
+  gcry_cipher_setiv(ctx->hd, ctx->iv, GCM_IV_LEN);
+  gcm_increment_iv(ctx->iv);
+  /* the packet length is the additional authenticated data */
+  gcry_cipher_authenticate(ctx->hd, in, sizeof(uint32_t));
+  if (out != in) {
+    memcpy(out, in, sizeof(uint32_t));
+  }
+  cipher_encrypt(ctx->hd, (uint8_t *) in + sizeof(uint32_t),
+      (uint8_t *) out + sizeof(uint32_t), len - sizeof(uint32_t));
+  gcry_cipher_gettag(ctx->hd, tag, GCM_TAG_LEN);
+}
+
+static int aes_gcm_decrypt_length(struct crypto_struct *cipher, void *in,
+    unsigned char *out, unsigned long len, uint32_t seq) {
+  (void) cipher;
+  (void) seq;
+
+  if (len < sizeof(uint32_t)) {
+    return -1;
+  }
+  /* the length isn't encrypted */
+  memcpy(out, in, sizeof(uint32_t));
+
+  return 0;
+}
+
+static int aes_gcm_decrypt(struct crypto_struct *cipher,
+    void *complete_packet, unsigned char *out, unsigned long len,
+    const unsigned char *tag, uint32_t seq) {
+  struct gcm_ctx *ctx = (struct gcm_ctx *) (void *) cipher->key;
+
+  (void) seq;
+
+  gcry_cipher_setiv(ctx->hd, ctx->iv, GCM_IV_LEN);
+  gcm_increment_iv(ctx->iv);
+  gcry_cipher_authenticate(ctx->hd, complete_packet, sizeof(uint32_t));
+  cipher_decrypt(ctx->hd, (uint8_t *) complete_packet + sizeof(uint32_t),
+      out, len);
+  if (gcry_cipher_checktag(ctx->hd, tag, GCM_TAG_LEN)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void aes_gcm_cleanup(struct crypto_struct *cipher) {
+  struct gcm_ctx *ctx = (struct gcm_ctx *) (void *) cipher->key;
+
+  if (ctx != NULL) {
+    gcry_cipher_close(ctx->hd);
+    memset(ctx, 0, sizeof(struct gcm_ctx));
+    SAFE_FREE(cipher->key);
+  }
+}
+#endif /* HAS_AES_GCM */
+
 static int des3_set_key(struct crypto_struct *cipher, void *key, void *IV) {
   if (cipher->key == NULL) {
     if (alloc_key(cipher) < 0) {
@@ -230,12 +444,12 @@ static int des3_set_key(struct crypto_struct *cipher, void *key, void *IV) {
 
 static void des3_encrypt(struct crypto_struct *cipher, void *in,
     void *out, unsigned long len) {
-  gcry_cipher_encrypt(cipher->key[0], out, len, in, len);
+  cipher_encrypt(cipher->key[0], in, out, len);
 }
 
 static void des3_decrypt(struct crypto_struct *cipher, void *in,
     void *out, unsigned long len) {
-  gcry_cipher_decrypt(cipher->key[0], out, len, in, len);
+  cipher_decrypt(cipher->key[0], in, out, len);
 }
 
 static int des3_1_set_key(struct crypto_struct *cipher, void *key, void *IV) {
@@ -291,16 +505,16 @@ static int des3_1_set_key(struct crypto_struct *cipher, void *key, void *IV) {
 
 static void des3_1_encrypt(struct crypto_struct *cipher, void *in,
     void *out, unsigned long len) {
-  gcry_cipher_encrypt(cipher->key[0], out, len, in, len);
-  gcry_cipher_decrypt(cipher->key[1], in, len, out, len);
-  gcry_cipher_encrypt(cipher->key[2], out, len, in, len);
+  cipher_encrypt(cipher->key[0], in, out, len);
+  cipher_decrypt(cipher->key[1], out, in, len);
+  cipher_encrypt(cipher->key[2], in, out, len);
 }
 
 static void des3_1_decrypt(struct crypto_struct *cipher, void *in,
     void *out, unsigned long len) {
-  gcry_cipher_decrypt(cipher->key[2], out, len, in, len);
-  gcry_cipher_encrypt(cipher->key[1], in, len, out, len);
-  gcry_cipher_decrypt(cipher->key[0], out, len, in, len);
+  cipher_decrypt(cipher->key[2], in, out, len);
+  cipher_encrypt(cipher->key[1], out, in, len);
+  cipher_decrypt(cipher->key[0], in, out, len);
 }
 
 /* the table of supported ciphers */
@@ -349,6 +563,48 @@ static struct crypto_struct ssh_ciphertab[] = {
       .cbc_encrypt     = aes_encrypt,
       .cbc_decrypt     = aes_encrypt
   },
+#ifdef HAS_AES_GCM
+  {
+    .name                = "aes128-gcm@openssh.com",
+    .blocksize           = 16,
+    .keylen              = sizeof(struct gcm_ctx),
+    .key                 = NULL,
+    .keysize             = 128,
+    .tag_size            = GCM_TAG_LEN,
+    .aead_set_key        = aes_gcm_set_key,
+    .aead_encrypt        = aes_gcm_encrypt,
+    .aead_decrypt_length = aes_gcm_decrypt_length,
+    .aead_decrypt        = aes_gcm_decrypt,
+    .cleanup             = aes_gcm_cleanup
+  },
+  {
+    .name                = "aes256-gcm@openssh.com",
+    .blocksize           = 16,
+    .keylen              = sizeof(struct gcm_ctx),
+    .key                 = NULL,
+    .keysize             = 256,
+    .tag_size            = GCM_TAG_LEN,
+    .aead_set_key        = aes_gcm_set_key,
+    .aead_encrypt        = aes_gcm_encrypt,
+    .aead_decrypt_length = aes_gcm_decrypt_length,
+    .aead_decrypt        = aes_gcm_decrypt,
+    .cleanup             = aes_gcm_cleanup
+  },
+#endif /* HAS_AES_GCM */
+  {
+    .name                = "chacha20-poly1305@openssh.com",
+    .blocksize           = 8,
+    .keylen              = 0,
+    .key                 = NULL,
+    .keysize             = 512,
+    .tag_size            = POLY1305_TAGLEN,
+    .aead_set_key        = chachapoly_set_key,
+    .aead_encrypt        = chachapoly_encrypt,
+    .aead_decrypt_length = chachapoly_decrypt_length,
+    .aead_decrypt        = chachapoly_decrypt,
+    .cleanup             = chachapoly_cleanup,
+    .aead_copy           = chachapoly_copy
+  },
   {
     .name            = "aes128-cbc",
     .blocksize       = 16,
@@ -420,4 +676,23 @@ static struct crypto_struct ssh_ciphertab[] = {
 struct crypto_struct *ssh_get_ciphertab(){
   return ssh_ciphertab;
 }
+
+/* libgcrypt selects the CPU instructions itself and has no engines */
+int ssh_set_crypto_engine(const char *id) {
+  if (id == NULL) {
+    return SSH_OK;
+  }
+  return SSH_ERROR;
+}
+
+const char *ssh_get_crypto_implementation(void) {
+  static char implementation[64];
+
+  if (implementation[0] == '\0') {
+    snprintf(implementation, sizeof(implementation), "libgcrypt %s",
+        gcry_check_version(NULL));
+  }
+
+  return implementation;
+}
 #endif
@@ -23,6 +23,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "libssh/priv.h"
@@ -37,44 +38,685 @@
  * @{
  */
 
+/* arguments and text kept by an entry, the rest is dropped */
+#define LOG_ENTRY_ARGS 8
+#define LOG_ENTRY_TEXT 256
+
+enum log_arg_e {
+  LOG_ARG_NONE = 0,
+  LOG_ARG_INT,
+  LOG_ARG_UINT,
+  LOG_ARG_LONG,
+  LOG_ARG_SIZE,
+  LOG_ARG_POINTER,
+  LOG_ARG_STRING
+};
+
+struct log_arg {
+  int type;
+  union {
+    int i;
+    unsigned int u;
+    long l;
+    size_t z;
+    const void *p;
+    size_t offset; /* of a string in the text of the entry */
+  } v;
+};
+
+/*
+ * An entry of the ring. The arguments of the message are copied, and the
+ * message is only formatted when the entry is drained. The format is the
+ * string given to ssh_log(), which is a literal for all the calls of the
+ * library, or NULL when the text holds the message formatted at once.
+ */
+struct ssh_log_entry_struct {
+  int verbosity;
+  int event;
+  const char *format;
+  int count;
+  struct log_arg args[LOG_ENTRY_ARGS];
+  size_t used;
+  char text[LOG_ENTRY_TEXT];
+};
+
+/*
+ * The ring belongs to its session, it is filled and drained by the thread
+ * using the session, so no lock is taken. The counters only grow, the slot
+ * of an entry is its counter modulo the size.
+ */
+struct ssh_log_ring_struct {
+  struct ssh_log_entry_struct *entries;
+  unsigned int size;
+  unsigned int head; /* next entry written */
+  unsigned int tail; /* next entry drained */
+};
+
+static const struct {
+  const char *name;
+  const char *keys[LOG_ENTRY_ARGS];
+} log_events[] = {
+  {"message", {NULL}},
+  {"dropped", {"count", NULL}},
+  {"packet_read", {"type", "length", "padding", NULL}},
+  {"packet_write", {"length", "padding", "size", NULL}},
+  {"packet_encrypt", {"seq", "length", NULL}},
+  {"channel_data", {"channel", "length", "stderr", "window", NULL}},
+};
+
+#define LOG_EVENTS ((int) (sizeof(log_events) / sizeof(log_events[0])))
+
+static void log_output(ssh_session session, int verbosity,
+    const char *buffer) {
+  char indent[256];
+  int min;
+
+  if (session->callbacks && session->callbacks->log_function) {
+    session->callbacks->log_function(session, verbosity, buffer,
+        session->callbacks->userdata);
+  } else if (verbosity == SSH_LOG_FUNCTIONS) {
+    if (session->log_indent > 255) {
+      min = 255;
+    } else {
+      min = session->log_indent;
+    }
+
+    memset(indent, ' ', min);
+    indent[min] = '\0';
+
+    fprintf(stderr, "[func] %s%s\n", indent, buffer);
+  } else {
+    fprintf(stderr, "[%d] %s\n", verbosity, buffer);
+  }
+}
+
+/*
+ * Reads the conversion after a '%', returns its length or 0 if it can't be
+ * kept for later. *type is LOG_ARG_NONE for "%%", *star is set by ".*".
+ */
+static size_t log_conversion(const char *p, int *type, int *star) {
+  const char *start = p;
+  int length = 0;
+
+  *star = 0;
+  while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+    p++;
+  }
+  while (*p >= '0' && *p <= '9') {
+    p++;
+  }
+  if (*p == '.') {
+    p++;
+    if (*p == '*') {
+      *star = 1;
+      p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+      p++;
+    }
+  }
+  if (*p == 'h') {
+    p++;
+    if (*p == 'h') {
+      p++;
+    }
+  } else if (*p == 'l' || *p == 'z') {
+    length = *p++;
+  }
+
+  switch (*p) {
+    case '%':
+      *type = LOG_ARG_NONE;
+      break;
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'c':
+      *type = length == 'l' ? LOG_ARG_LONG :
+          length == 'z' ? LOG_ARG_SIZE : LOG_ARG_INT;
+      break;
+    case 'p':
+      *type = LOG_ARG_POINTER;
+      break;
+    case 's':
+      *type = LOG_ARG_STRING;
+      break;
+    default:
+      return 0;
+  }
+  if (*star && *type != LOG_ARG_STRING) {
+    return 0;
+  }
+
+  return p + 1 - start;
+}
+
+/* the number of arguments of the format, -1 if they can't be kept */
+static int log_format_args(const char *format) {
+  const char *p;
+  size_t len;
+  int count = 0;
+  int type;
+  int star;
+
+  for (p = format; (p = strchr(p, '%')) != NULL; p += len) {
+    p++;
+    len = log_conversion(p, &type, &star);
+    if (len == 0) {
+      return -1;
+    }
+    if (type != LOG_ARG_NONE) {
+      count++;
+    }
+  }
+
+  return count <= LOG_ENTRY_ARGS ? count : -1;
+}
+
+/* copies the string in the text of the entry, truncated if it is full */
+static size_t log_copy_string(struct ssh_log_entry_struct *entry,
+    const char *string, size_t max) {
+  size_t room = LOG_ENTRY_TEXT - entry->used;
+  size_t offset;
+  size_t len;
+
+  if (room == 0) {
+    /* the last byte is the end of the previous string */
+    return LOG_ENTRY_TEXT - 1;
+  }
+  for (len = 0; len < max && len < room - 1 && string[len] != '\0'; len++);
+
+  offset = entry->used;
+  memcpy(entry->text + offset, string, len);
+  entry->text[offset + len] = '\0';
+  entry->used += len + 1;
+
+  return offset;
+}
+
+static void log_capture(struct ssh_log_entry_struct *entry,
+    const char *format, va_list va) {
+  struct log_arg *arg;
+  const char *string;
+  const char *p;
+  size_t len;
+  int max;
+  int type;
+  int star;
+
+  entry->format = format;
+  for (p = format; (p = strchr(p, '%')) != NULL; p += len) {
+    p++;
+    len = log_conversion(p, &type, &star);
+    if (type == LOG_ARG_NONE) {
+      continue;
+    }
+
+    arg = &entry->args[entry->count++];
+    arg->type = type;
+    switch (type) {
+      case LOG_ARG_INT:
+        arg->v.i = va_arg(va, int);
+        break;
+      case LOG_ARG_LONG:
+        arg->v.l = va_arg(va, long);
+        break;
+      case LOG_ARG_SIZE:
+        arg->v.z = va_arg(va, size_t);
+        break;
+      case LOG_ARG_POINTER:
+        arg->v.p = va_arg(va, const void *);
+        break;
+      case LOG_ARG_STRING:
+        max = star ? va_arg(va, int) : -1;
+        string = va_arg(va, const char *);
+        if (string == NULL) {
+          string = "(null)";
+        }
+        arg->v.offset = log_copy_string(entry, string,
+            max < 0 ? (size_t) -1 : (size_t) max);
+        break;
+    }
+  }
+}
+
+/*
+ * Takes the next entry of the ring, or NULL if it is full. The last free
+ * entry counts the entries dropped until the ring is drained.
+ */
+static struct ssh_log_entry_struct *log_ring_push(
+    struct ssh_log_ring_struct *ring, int verbosity, int event) {
+  struct ssh_log_entry_struct *entry;
+  unsigned int used = ring->head - ring->tail;
+
+  if (used == ring->size) {
+    entry = &ring->entries[(ring->head - 1) % ring->size];
+    entry->args[0].v.u++;
+    return NULL;
+  }
+
+  entry = &ring->entries[ring->head % ring->size];
+  ring->head++;
+  entry->verbosity = verbosity;
+  entry->event = event;
+  entry->format = NULL;
+  entry->count = 0;
+  entry->used = 0;
+  entry->text[0] = '\0';
+
+  if (used == ring->size - 1) {
+    entry->verbosity = SSH_LOG_RARE;
+    entry->event = SSH_LOG_EVENT_DROPPED;
+    entry->count = 1;
+    entry->args[0].type = LOG_ARG_UINT;
+    entry->args[0].v.u = 1;
+    return NULL;
+  }
+
+  return entry;
+}
+
 /**
  * @brief Log a SSH event.
  *
+ * If the session has a log ring, the message is kept in the ring and only
+ * formatted by ssh_log_drain().
+ *
  * @param session       The SSH session.
  *
  * @param verbosity     The verbosity of the event.
  *
  * @param format        The format string of the log entry.
+ *
+ * @see ssh_set_log_ring()
  */
 void ssh_log(ssh_session session, int verbosity, const char *format, ...) {
+  struct ssh_log_entry_struct *entry;
   char buffer[1024];
-  char indent[256];
-  int min;
   va_list va;
 
-  if (verbosity <= session->log_verbosity) {
+  if (verbosity > session->log_verbosity) {
+    return;
+  }
+
+  if (session->log_ring != NULL) {
+    entry = log_ring_push(session->log_ring, verbosity, SSH_LOG_EVENT_MESSAGE);
+    if (entry == NULL) {
+      return;
+    }
     va_start(va, format);
-    vsnprintf(buffer, sizeof(buffer), format, va);
+    if (log_format_args(format) >= 0) {
+      log_capture(entry, format, va);
+    } else {
+      vsnprintf(entry->text, sizeof(entry->text), format, va);
+    }
     va_end(va);
+    return;
+  }
 
-    if (session->callbacks && session->callbacks->log_function) {
-      session->callbacks->log_function(session, verbosity, buffer,
-          session->callbacks->userdata);
-    } else if (verbosity == SSH_LOG_FUNCTIONS) {
-      if (session->log_indent > 255) {
-        min = 255;
-      } else {
-        min = session->log_indent;
-      }
+  va_start(va, format);
+  vsnprintf(buffer, sizeof(buffer), format, va);
+  va_end(va);
+
+  log_output(session, verbosity, buffer);
+}
+
+/** @internal
+ * @brief Log a structured event, with the unsigned int fields listed in
+ * enum ssh_log_events_e.
+ *
+ * Without a log ring, the event is written as "name key=value ...".
+ */
+void ssh_log_event(ssh_session session, int verbosity, int event, ...) {
+  struct ssh_log_entry_struct tmp;
+  struct ssh_log_entry_struct *entry;
+  char buffer[1024];
+  va_list va;
+
+  if (verbosity > session->log_verbosity || event <= SSH_LOG_EVENT_MESSAGE ||
+      event >= LOG_EVENTS) {
+    return;
+  }
+
+  if (session->log_ring != NULL) {
+    entry = log_ring_push(session->log_ring, verbosity, event);
+    if (entry == NULL) {
+      return;
+    }
+  } else {
+    entry = &tmp;
+    entry->verbosity = verbosity;
+    entry->event = event;
+    entry->format = NULL;
+    entry->count = 0;
+    entry->used = 0;
+  }
+
+  va_start(va, event);
+  while (entry->count < LOG_ENTRY_ARGS &&
+      log_events[event].keys[entry->count] != NULL) {
+    entry->args[entry->count].type = LOG_ARG_UINT;
+    entry->args[entry->count].v.u = va_arg(va, unsigned int);
+    entry->count++;
+  }
+  va_end(va);
+
+  if (entry == &tmp) {
+    ssh_log_entry_format(entry, buffer, sizeof(buffer));
+    log_output(session, verbosity, buffer);
+  }
+}
+
+/**
+ * @brief Keep the log messages of a session in a ring instead of writing
+ * them.
+ *
+ * The messages given to ssh_log() are not formatted when they are logged:
+ * their arguments are copied in the ring, and they are formatted when the
+ * application drains the ring with ssh_log_drain(), or never if it only
+ * looks at the structured fields of the events. Logging the packets this way
+ * costs a copy of a few words per packet.
+ *
+ * The ring is not locked: it is filled by the functions using the session,
+ * and has to be drained by the thread using the session, or under the lock
+ * the application takes around the session. When the ring is full, the new
+ * entries are dropped and counted by a SSH_LOG_EVENT_DROPPED entry.
+ *
+ * @param[in]  session  The session to log.
+ *
+ * @param[in]  entries  The number of entries of the ring, 0 removes the ring
+ *                      and writes the messages at once again. The entries
+ *                      not drained yet are dropped.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_set_log_ring(ssh_session session, unsigned int entries) {
+  struct ssh_log_ring_struct *ring;
+
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+
+  ssh_log_ring_free(session);
+  if (entries == 0) {
+    return SSH_OK;
+  }
+  if (entries < 2) {
+    entries = 2;
+  }
+
+  ring = malloc(sizeof(struct ssh_log_ring_struct));
+  if (ring == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  ring->entries = malloc(entries * sizeof(struct ssh_log_entry_struct));
+  if (ring->entries == NULL) {
+    SAFE_FREE(ring);
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  ring->size = entries;
+  ring->head = ring->tail = 0;
+  session->log_ring = ring;
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief frees the log ring of the session, called by ssh_free()
+ */
+void ssh_log_ring_free(ssh_session session) {
+  if (session->log_ring == NULL) {
+    return;
+  }
+  SAFE_FREE(session->log_ring->entries);
+  SAFE_FREE(session->log_ring);
+}
+
+/**
+ * @brief Drain the log ring of a session.
+ *
+ * @param[in]  session  The session set with ssh_set_log_ring().
+ *
+ * @param[in]  callback The function called for each entry, from the oldest.
+ *                      The entry is only valid during the call. If NULL,
+ *                      the entries are formatted and written like without
+ *                      a ring, through the log callback of the session or
+ *                      on stderr.
+ *
+ * @param[in]  userdata The pointer given to the callback.
+ *
+ * @return              The number of entries drained, SSH_ERROR on error.
+ */
+int ssh_log_drain(ssh_session session, ssh_log_drain_callback callback,
+    void *userdata) {
+  struct ssh_log_ring_struct *ring;
+  struct ssh_log_entry_struct *entry;
+  char buffer[1024];
+  int count = 0;
 
-      memset(indent, ' ', min);
-      indent[min] = '\0';
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  ring = session->log_ring;
+  if (ring == NULL) {
+    return 0;
+  }
 
-      fprintf(stderr, "[func] %s%s\n", indent, buffer);
+  while (ring->tail != ring->head) {
+    entry = &ring->entries[ring->tail % ring->size];
+    if (callback != NULL) {
+      callback(session, entry, userdata);
     } else {
-      fprintf(stderr, "[%d] %s\n", verbosity, buffer);
+      ssh_log_entry_format(entry, buffer, sizeof(buffer));
+      log_output(session, entry->verbosity, buffer);
+    }
+    /* the callback may have removed the ring */
+    ring = session->log_ring;
+    if (ring == NULL) {
+      break;
     }
+    ring->tail++;
+    count++;
   }
+
+  return count;
+}
+
+/**
+ * @brief Get the event of a log entry.
+ *
+ * @param[in]  entry    The entry given to the drain callback.
+ *
+ * @return              The event, one of enum ssh_log_events_e.
+ */
+int ssh_log_entry_event(ssh_log_entry entry) {
+  return entry->event;
+}
+
+/**
+ * @brief Get the name of the event of a log entry, like "packet_read".
+ *
+ * @param[in]  entry    The entry given to the drain callback.
+ */
+const char *ssh_log_entry_name(ssh_log_entry entry) {
+  return log_events[entry->event].name;
+}
+
+/**
+ * @brief Get the verbosity of a log entry.
+ *
+ * @param[in]  entry    The entry given to the drain callback.
+ */
+int ssh_log_entry_verbosity(ssh_log_entry entry) {
+  return entry->verbosity;
+}
+
+/**
+ * @brief Get the number of structured fields of a log entry.
+ *
+ * @param[in]  entry    The entry given to the drain callback.
+ *
+ * @return              The number of fields, 0 for the messages of ssh_log().
+ */
+int ssh_log_entry_field_count(ssh_log_entry entry) {
+  if (entry->event == SSH_LOG_EVENT_MESSAGE) {
+    return 0;
+  }
+  return entry->count;
+}
+
+/**
+ * @brief Get the name of a field of a log entry.
+ *
+ * @param[in]  entry    The entry given to the drain callback.
+ *
+ * @param[in]  field    The field, from 0.
+ *
+ * @return              The name, or NULL if the entry has no such field.
+ */
+const char *ssh_log_entry_field_key(ssh_log_entry entry, int field) {
+  if (field < 0 || field >= ssh_log_entry_field_count(entry)) {
+    return NULL;
+  }
+  return log_events[entry->event].keys[field];
+}
+
+/**
+ * @brief Get the value of a field of a log entry.
+ *
+ * @param[in]  entry    The entry given to the drain callback.
+ *
+ * @param[in]  field    The field, from 0.
+ *
+ * @return              The value, or 0 if the entry has no such field.
+ */
+unsigned int ssh_log_entry_field_value(ssh_log_entry entry, int field) {
+  if (field < 0 || field >= ssh_log_entry_field_count(entry)) {
+    return 0;
+  }
+  return entry->args[field].v.u;
+}
+
+/* snprintf() may return -1 or more than the room when truncating */
+static size_t log_advance(size_t pos, size_t len, int rc) {
+  if (rc < 0 || (size_t) rc >= len - pos) {
+    return len - 1;
+  }
+  return pos + rc;
+}
+
+/**
+ * @brief Format a log entry like it would have been written without a ring.
+ *
+ * The events are formatted as "name key=value ...".
+ *
+ * @param[in]  entry    The entry given to the drain callback.
+ *
+ * @param[out] buffer   The buffer for the text, always terminated.
+ *
+ * @param[in]  len      The size of the buffer.
+ *
+ * @return              The length of the text.
+ */
+int ssh_log_entry_format(ssh_log_entry entry, char *buffer, size_t len) {
+  struct log_arg *arg;
+  const char *string;
+  const char *p;
+  const char *next;
+  char spec[32];
+  size_t pos = 0;
+  size_t clen;
+  int type;
+  int star;
+  int i = 0;
+  int rc;
+
+  if (buffer == NULL || len == 0) {
+    return SSH_ERROR;
+  }
+  buffer[0] = '\0';
+
+  if (entry->event != SSH_LOG_EVENT_MESSAGE) {
+    rc = snprintf(buffer, len, "%s", log_events[entry->event].name);
+    pos = log_advance(pos, len, rc);
+    for (i = 0; i < entry->count; i++) {
+      rc = snprintf(buffer + pos, len - pos, " %s=%u",
+          log_events[entry->event].keys[i], entry->args[i].v.u);
+      pos = log_advance(pos, len, rc);
+    }
+    return (int) pos;
+  }
+
+  if (entry->format == NULL) {
+    rc = snprintf(buffer, len, "%s", entry->text);
+    return (int) log_advance(pos, len, rc);
+  }
+
+  for (p = entry->format; *p != '\0' && pos < len - 1; p = next) {
+    if (*p != '%') {
+      next = strchr(p, '%');
+      if (next == NULL) {
+        next = p + strlen(p);
+      }
+      clen = next - p;
+      if (clen > len - 1 - pos) {
+        clen = len - 1 - pos;
+      }
+      memcpy(buffer + pos, p, clen);
+      pos += clen;
+      buffer[pos] = '\0';
+      continue;
+    }
+
+    clen = log_conversion(p + 1, &type, &star) + 1;
+    next = p + clen;
+    if (type == LOG_ARG_NONE) {
+      buffer[pos++] = '%';
+      buffer[pos] = '\0';
+      continue;
+    }
+    if (clen >= sizeof(spec) || i >= entry->count) {
+      break;
+    }
+    memcpy(spec, p, clen);
+    spec[clen] = '\0';
+
+    arg = &entry->args[i++];
+    switch (arg->type) {
+      case LOG_ARG_INT:
+        rc = snprintf(buffer + pos, len - pos, spec, arg->v.i);
+        break;
+      case LOG_ARG_LONG:
+        rc = snprintf(buffer + pos, len - pos, spec, arg->v.l);
+        break;
+      case LOG_ARG_SIZE:
+        rc = snprintf(buffer + pos, len - pos, spec, arg->v.z);
+        break;
+      case LOG_ARG_POINTER:
+        rc = snprintf(buffer + pos, len - pos, spec, arg->v.p);
+        break;
+      case LOG_ARG_STRING:
+        string = entry->text + arg->v.offset;
+        if (star) {
+          /* the string was copied up to the precision */
+          rc = snprintf(buffer + pos, len - pos, spec, (int) strlen(string),
+              string);
+        } else {
+          rc = snprintf(buffer + pos, len - pos, spec, string);
+        }
+        break;
+      default:
+        rc = -1;
+        break;
+    }
+    pos = log_advance(pos, len, rc);
+  }
+
+  return (int) pos;
 }
 
 /** @} */
@@ -36,91 +36,167 @@
  */
 
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
 #include "libssh/priv.h"
 
+/* the subpatterns as long are not matched, as in OpenSSH */
+#define MATCH_SUBPATTERN_MAX 1024
+
 /*
- * Returns true if the given string matches the pattern (which may contain ?
- * and * as wildcards), and zero if it does not match.
+ * A subpattern split at its runs of '*' into pieces, matched with '?' as a
+ * wildcard. The pieces are in lowercase.
  */
-static int match_pattern(const char *s, const char *pattern) {
-  for (;;) {
-    /* If at end of pattern, accept if also at end of string. */
-    if (!*pattern) {
-      return !*s;
+struct match_glob {
+  int negated;
+  char *text;
+  const char **pieces;
+  size_t *lens;
+  /*
+   * set when the piece is followed by several '*', which the recursive
+   * matcher of OpenSSH never matches with the end of the string
+   */
+  unsigned char *runs;
+  unsigned int count;
+  /* the length of the pieces */
+  size_t minlen;
+};
+
+struct match_list {
+  struct match_glob *globs;
+  unsigned int count;
+  /* the subpatterns after this one can't be reached */
+  int truncated;
+};
+
+static int match_piece(const char *s, const char *piece, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (piece[i] != '?' && piece[i] != s[i]) {
+      return 0;
     }
+  }
 
-    if (*pattern == '*') {
-      /* Skip the asterisk. */
-      pattern++;
-
-      /* If at end of pattern, accept immediately. */
-      if (!*pattern)
-        return 1;
-
-      /* If next character in pattern is known, optimize. */
-      if (*pattern != '?' && *pattern != '*') {
-        /*
-         * Look instances of the next character in
-         * pattern, and try to match starting from
-         * those.
-         */
-        for (; *s; s++)
-          if (*s == *pattern && match_pattern(s + 1, pattern + 1)) {
-            return 1;
-          }
-        /* Failed. */
-        return 0;
-      }
-      /*
-       * Move ahead one character at a time and try to
-       * match at each position.
-       */
-      for (; *s; s++) {
-        if (match_pattern(s, pattern)) {
-          return 1;
-        }
+  return 1;
+}
+
+/*
+ * Returns true if the given string matches the subpattern, and zero if it
+ * does not match. The first and the last pieces are anchored, the others
+ * are searched from left to right: the leftmost match of a piece leaves the
+ * most room to the next ones.
+ */
+static int match_glob(const struct match_glob *glob, const char *s,
+    size_t len) {
+  unsigned int last = glob->count - 1;
+  size_t start;
+  size_t end;
+  size_t n;
+  unsigned int i;
+
+  if (len < glob->minlen) {
+    return 0;
+  }
+  if (glob->count == 1) {
+    return len == glob->lens[0] && match_piece(s, glob->pieces[0], len);
+  }
+
+  /* the literal prefix and suffix reject most strings at once */
+  if (!match_piece(s, glob->pieces[0], glob->lens[0]) ||
+      !match_piece(s + len - glob->lens[last], glob->pieces[last],
+        glob->lens[last])) {
+    return 0;
+  }
+
+  start = glob->lens[0];
+  end = len - glob->lens[last];
+  if (glob->runs[0] && start >= len) {
+    return 0;
+  }
+  for (i = 1; i < last; i++) {
+    n = glob->lens[i];
+    for (; start + n <= end; start++) {
+      if (match_piece(s + start, glob->pieces[i], n)) {
+        break;
       }
-      /* Failed. */
+    }
+    if (start + n > end) {
       return 0;
     }
-    /*
-     * There must be at least one more character in the string.
-     * If we are at the end, fail.
-     */
-    if (!*s) {
+    start += n;
+    if (glob->runs[i] && start >= len) {
       return 0;
     }
+  }
 
-    /* Check if the next character of the string is acceptable. */
-    if (*pattern != '?' && *pattern != *s) {
-      return 0;
+  return 1;
+}
+
+static int match_glob_compile(struct match_glob *glob, const char *sub,
+    size_t len) {
+  unsigned int i;
+  size_t j;
+
+  glob->text = malloc(len + 1);
+  if (glob->text == NULL) {
+    return -1;
+  }
+  memcpy(glob->text, sub, len);
+  glob->text[len] = '\0';
+
+  glob->count = 1;
+  for (j = 0; j < len; j++) {
+    if (sub[j] == '*' && (j == 0 || sub[j - 1] != '*')) {
+      glob->count++;
     }
+  }
+  glob->pieces = malloc(glob->count * sizeof(const char *));
+  glob->lens = malloc(glob->count * sizeof(size_t));
+  glob->runs = calloc(glob->count, 1);
+  if (glob->pieces == NULL || glob->lens == NULL || glob->runs == NULL) {
+    return -1;
+  }
 
-    /* Move to the next character, both in string and in pattern. */
-    s++;
-    pattern++;
+  glob->pieces[0] = glob->text;
+  for (i = 0, j = 0; j < len; j++) {
+    if (glob->text[j] != '*') {
+      continue;
+    }
+    glob->text[j] = '\0';
+    glob->lens[i] = glob->text + j - glob->pieces[i];
+    glob->minlen += glob->lens[i];
+    while (j + 1 < len && glob->text[j + 1] == '*') {
+      glob->runs[i] = 1;
+      j++;
+    }
+    glob->pieces[++i] = glob->text + j + 1;
   }
+  glob->lens[i] = glob->text + len - glob->pieces[i];
+  glob->minlen += glob->lens[i];
 
-  /* NOTREACHED */
+  return 0;
 }
 
 /*
- * Tries to match the string against the comma-separated sequence of subpatterns
- * (each possibly preceded by ! to indicate negation).
- * Returns -1 if negation matches, 1 if there is a positive match, 0 if there is
- * no match at all.
+ * Compiles a comma-separated sequence of subpatterns (each possibly preceded
+ * by ! to indicate negation), converted to lowercase.
  */
-static int match_pattern_list(const char *string, const char *pattern,
-    unsigned int len, int dolower) {
-  char sub[1024];
-  int negated;
-  int got_positive;
+struct match_list *match_list_compile(const char *pattern, unsigned int len) {
+  struct match_list *list;
+  struct match_glob *glob;
+  char sub[MATCH_SUBPATTERN_MAX];
   unsigned int i, subi;
+  int negated;
+
+  list = malloc(sizeof(struct match_list));
+  if (list == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(list);
 
-  got_positive = 0;
   for (i = 0; i < len;) {
     /* Check if the subpattern is negated. */
     if (pattern[i] == '!') {
@@ -137,13 +213,13 @@ static int match_pattern_list(const char *string, const char *pattern,
     for (subi = 0;
         i < len && subi < sizeof(sub) - 1 && pattern[i] != ',';
         subi++, i++) {
-      sub[subi] = dolower && isupper(pattern[i]) ?
-        (char)tolower(pattern[i]) : pattern[i];
+      sub[subi] = isupper(pattern[i]) ? (char)tolower(pattern[i]) : pattern[i];
     }
 
-    /* If subpattern too long, return failure (no match). */
+    /* If subpattern too long, the matching fails there. */
     if (subi >= sizeof(sub) - 1) {
-      return 0;
+      list->truncated = 1;
+      break;
     }
 
     /* If the subpattern was terminated by a comma, skip the comma. */
@@ -151,19 +227,48 @@ static int match_pattern_list(const char *string, const char *pattern,
       i++;
     }
 
-    /* Null-terminate the subpattern. */
-    sub[subi] = '\0';
+    glob = realloc(list->globs, (list->count + 1) * sizeof(struct match_glob));
+    if (glob == NULL) {
+      match_list_free(list);
+      return NULL;
+    }
+    list->globs = glob;
+    glob = &list->globs[list->count++];
+    ZERO_STRUCTP(glob);
+    glob->negated = negated;
+    if (match_glob_compile(glob, sub, subi) < 0) {
+      match_list_free(list);
+      return NULL;
+    }
+  }
+
+  return list;
+}
+
+/*
+ * Tries to match the string against a compiled list of subpatterns.
+ * Returns -1 if negation matches, 1 if there is a positive match, 0 if there
+ * is no match at all.
+ */
+int match_list_exec(const struct match_list *list, const char *string) {
+  size_t len = strlen(string);
+  int got_positive = 0;
+  unsigned int i;
 
-    /* Try to match the subpattern against the string. */
-    if (match_pattern(string, sub)) {
-      if (negated) {
+  for (i = 0; i < list->count; i++) {
+    if (match_glob(&list->globs[i], string, len)) {
+      if (list->globs[i].negated) {
         return -1;        /* Negative */
-      } else {
-        got_positive = 1; /* Positive */
       }
+      got_positive = 1;   /* Positive */
     }
   }
 
+  /* A subpattern too long makes the whole list fail. */
+  if (list->truncated) {
+    return 0;
+  }
+
   /*
    * Return success if got a positive match.  If there was a negative
    * match, we have already returned -1 and never get here.
@@ -171,6 +276,22 @@ static int match_pattern_list(const char *string, const char *pattern,
   return got_positive;
 }
 
+void match_list_free(struct match_list *list) {
+  unsigned int i;
+
+  if (list == NULL) {
+    return;
+  }
+  for (i = 0; i < list->count; i++) {
+    SAFE_FREE(list->globs[i].text);
+    SAFE_FREE(list->globs[i].pieces);
+    SAFE_FREE(list->globs[i].lens);
+    SAFE_FREE(list->globs[i].runs);
+  }
+  SAFE_FREE(list->globs);
+  SAFE_FREE(list);
+}
+
 /*
  * Tries to match the host name (which must be in all lowercase) against the
  * comma-separated sequence of subpatterns (each possibly preceded by ! to
@@ -179,7 +300,17 @@ static int match_pattern_list(const char *string, const char *pattern,
  * is no match at all.
  */
 int match_hostname(const char *host, const char *pattern, unsigned int len) {
-  return match_pattern_list(host, pattern, len, 1);
+  struct match_list *list;
+  int rc;
+
+  list = match_list_compile(pattern, len);
+  if (list == NULL) {
+    return 0;
+  }
+  rc = match_list_exec(list, host);
+  match_list_free(list);
+
+  return rc;
 }
 
 /* vim: set ts=2 sw=2 et cindent: */
@@ -41,6 +41,9 @@
 #include "libssh/keys.h"
 #include "libssh/dh.h"
 #include "libssh/messages.h"
+#include "libssh/forward.h"
+#include "libssh/probes.h"
+#include "libssh/pipeline.h"
 #if WITH_SERVER
 #include "libssh/server.h"
 #endif
@@ -246,7 +249,7 @@ SSH_PACKET_CALLBACK(ssh_packet_service_request){
   if (service_c == NULL) {
     goto error;
   }
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
         "Received a SERVICE_REQUEST for service %s", service_c);
   msg=ssh_message_new(session);
   if(!msg){
@@ -263,6 +266,482 @@ error:
   return SSH_PACKET_USED;
 }
 
+/* checks the signature which ends a public key authentication request */
+static int message_auth_verify(ssh_session session, ssh_message msg,
+    ssh_buffer packet, char *service) {
+  ssh_public_key public_key = msg->auth_request.public_key;
+  SIGNATURE *signature = NULL;
+  ssh_string sign = NULL;
+  ssh_buffer digest = NULL;
+  int state = SSH_PUBLICKEY_STATE_VALID;
+
+  sign = buffer_get_ssh_string(packet);
+  if (sign == NULL) {
+    SSH_LOG(session, SSH_LOG_PACKET, "Invalid signature packet from peer");
+    return SSH_PUBLICKEY_STATE_ERROR;
+  }
+  signature = signature_from_string(session, sign, public_key,
+                                    public_key->type);
+  digest = ssh_userauth_build_digest(session, msg, service);
+  if (digest == NULL || signature == NULL ||
+      sig_verify(session, public_key, signature,
+                 buffer_get_rest(digest), buffer_get_rest_len(digest)) < 0) {
+    SSH_LOG(session, SSH_LOG_PACKET, "Wrong signature from peer");
+    state = SSH_PUBLICKEY_STATE_WRONG;
+  } else {
+    SSH_LOG(session, SSH_LOG_PACKET, "Valid signature received");
+  }
+
+  ssh_buffer_free(digest);
+  ssh_string_free(sign);
+  signature_free(signature);
+
+  return state;
+}
+
+#ifdef WITH_SERVER
+/* compares a string seen in a packet with a C string */
+static int message_view_equal(const void *view, uint32_t len,
+    const char *str) {
+  return view != NULL && len == strlen(str) && memcmp(view, str, len) == 0;
+}
+
+/* the authentication requests received while one is pending */
+#define MESSAGE_AUTH_POSTPONED_MAX 32
+
+/* a signature verified by a worker of the crypto pool of the session */
+struct message_auth_verify {
+  ssh_session session; /* NULL once the session is freed */
+  char *user;
+  ssh_public_key public_key;
+  SIGNATURE *signature;
+  ssh_buffer digest;
+  int state;
+};
+
+/* a request a server callback answers later, see ssh_auth_reply_pending() */
+struct ssh_auth_pending_struct {
+  int method;
+  int signature_state;
+  ssh_public_key public_key;
+  /* the requests received meanwhile, handled in order once it is answered */
+  struct ssh_list *postponed;
+  int count;
+  /* the signature verified by the crypto pool, before the callback */
+  struct message_auth_verify *verify;
+};
+
+/* answers an authentication request with the value of a server callback */
+static void message_auth_reply(ssh_message msg, int rc) {
+  if (msg->auth_request.method == SSH_AUTH_METHOD_PUBLICKEY) {
+    /* a key is only accepted with a valid signature */
+    if (msg->auth_request.signature_state == SSH_PUBLICKEY_STATE_NONE &&
+        rc == SSH_AUTH_SUCCESS) {
+      ssh_message_auth_reply_pk_ok_simple(msg);
+      return;
+    }
+    if (msg->auth_request.signature_state != SSH_PUBLICKEY_STATE_VALID) {
+      rc = SSH_AUTH_DENIED;
+    }
+  }
+
+  switch (rc) {
+    case SSH_AUTH_SUCCESS:
+      ssh_message_auth_reply_success(msg, 0);
+      break;
+    case SSH_AUTH_PARTIAL:
+      ssh_message_auth_reply_success(msg, 1);
+      break;
+    default:
+      ssh_message_reply_default(msg);
+      break;
+  }
+}
+
+/*
+ * Keeps a request the callback didn't answer yet, with the key it offered.
+ * It is denied if it can't be kept.
+ */
+static void message_auth_defer(ssh_message msg) {
+  ssh_session session = msg->session;
+  struct ssh_auth_pending_struct *pending;
+
+  pending = malloc(sizeof(struct ssh_auth_pending_struct));
+  if (pending == NULL) {
+    ssh_message_reply_default(msg);
+    return;
+  }
+  ZERO_STRUCTP(pending);
+  pending->method = msg->auth_request.method;
+  pending->signature_state = msg->auth_request.signature_state;
+  pending->public_key = msg->auth_request.public_key;
+  msg->auth_request.public_key = NULL;
+  session->auth_pending = pending;
+  SSH_LOG(session, SSH_LOG_PACKET, "Authentication request pending");
+}
+
+/* answers a request now, or later if the callback returned SSH_AUTH_AGAIN */
+static void message_auth_answer(ssh_message msg, int rc) {
+  if (rc == SSH_AUTH_AGAIN) {
+    message_auth_defer(msg);
+  } else {
+    message_auth_reply(msg, rc);
+  }
+}
+
+/*
+ * Copies a request received while another is pending: the client may send
+ * several without waiting for the answers, which must keep their order.
+ */
+static void message_auth_postpone(ssh_session session, ssh_buffer packet) {
+  struct ssh_auth_pending_struct *pending = session->auth_pending;
+  ssh_buffer copy;
+
+  if (pending->count >= MESSAGE_AUTH_POSTPONED_MAX) {
+    ssh_set_error(session, SSH_FATAL,
+        "Too many authentication requests while one is pending");
+    session->session_state = SSH_SESSION_STATE_ERROR;
+    return;
+  }
+  if (pending->postponed == NULL) {
+    pending->postponed = ssh_list_new();
+    if (pending->postponed == NULL) {
+      ssh_set_error_oom(session);
+      return;
+    }
+  }
+  copy = ssh_buffer_new();
+  if (copy == NULL ||
+      buffer_add_data(copy, buffer_get_rest(packet),
+        buffer_get_rest_len(packet)) < 0 ||
+      ssh_list_append(pending->postponed, copy) < 0) {
+    ssh_buffer_free(copy);
+    ssh_set_error_oom(session);
+    return;
+  }
+  pending->count++;
+}
+
+static void message_auth_pending_free(struct ssh_auth_pending_struct *pending) {
+  ssh_buffer packet;
+
+  if (pending->verify != NULL) {
+    /* freed once the worker is done with it */
+    pending->verify->session = NULL;
+  }
+
+  if (pending->postponed != NULL) {
+    while ((packet = ssh_list_pop_head(ssh_buffer, pending->postponed))
+        != NULL) {
+      ssh_buffer_free(packet);
+    }
+    ssh_list_free(pending->postponed);
+  }
+  publickey_free(pending->public_key);
+  SAFE_FREE(pending);
+}
+
+/**
+ * @internal
+ *
+ * @brief Forget the authentication request pending in a session, and the
+ * ones received after it.
+ *
+ * @param[in]  session  The SSH session.
+ */
+void ssh_message_auth_pending_free(ssh_session session) {
+  if (session->auth_pending != NULL) {
+    message_auth_pending_free(session->auth_pending);
+    session->auth_pending = NULL;
+  }
+}
+
+int ssh_auth_reply_pending(ssh_session session, int result) {
+  struct ssh_auth_pending_struct *pending;
+  struct ssh_message_struct msg;
+  ssh_buffer packet;
+
+  if (session == NULL || session->auth_pending == NULL ||
+      session->auth_pending->verify != NULL || result == SSH_AUTH_AGAIN) {
+    return SSH_ERROR;
+  }
+  pending = session->auth_pending;
+  session->auth_pending = NULL;
+
+  ZERO_STRUCT(msg);
+  msg.session = session;
+  msg.type = SSH_REQUEST_AUTH;
+  msg.auth_request.method = pending->method;
+  msg.auth_request.signature_state = pending->signature_state;
+  msg.auth_request.public_key = pending->public_key;
+  message_auth_reply(&msg, result);
+
+  /* the next requests, until one of them is pending in turn */
+  while (pending->postponed != NULL &&
+      (packet = ssh_list_pop_head(ssh_buffer, pending->postponed)) != NULL) {
+    ssh_packet_userauth_request(session, SSH2_MSG_USERAUTH_REQUEST, packet,
+        NULL);
+    ssh_buffer_free(packet);
+  }
+  message_auth_pending_free(pending);
+
+  return session->session_state == SSH_SESSION_STATE_ERROR ? SSH_ERROR :
+    SSH_OK;
+}
+
+/* an answer given by another thread, see ssh_event_auth_reply_pending() */
+struct message_auth_result {
+  ssh_session session;
+  int result;
+};
+
+static void message_auth_result_task(ssh_event event, void *userdata) {
+  struct message_auth_result *answer = userdata;
+
+  (void) event;
+  ssh_auth_reply_pending(answer->session, answer->result);
+  SAFE_FREE(answer);
+}
+
+int ssh_event_auth_reply_pending(ssh_event event, ssh_session session,
+    int result) {
+  struct message_auth_result *answer;
+
+  if (event == NULL || session == NULL || result == SSH_AUTH_AGAIN) {
+    return SSH_ERROR;
+  }
+  answer = malloc(sizeof(struct message_auth_result));
+  if (answer == NULL) {
+    return SSH_ERROR;
+  }
+  answer->session = session;
+  answer->result = result;
+  if (ssh_event_post(event, message_auth_result_task, answer) < 0) {
+    SAFE_FREE(answer);
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
+static void message_auth_verify_free(struct message_auth_verify *verify) {
+  SAFE_FREE(verify->user);
+  publickey_free(verify->public_key);
+  signature_free(verify->signature);
+  ssh_buffer_free(verify->digest);
+  SAFE_FREE(verify);
+}
+
+/* in the worker: only the members of the verification are used */
+static void message_auth_verify_run(void *userdata) {
+  struct message_auth_verify *verify = userdata;
+
+  if (sig_verify(NULL, verify->public_key, verify->signature,
+        buffer_get_rest(verify->digest),
+        buffer_get_rest_len(verify->digest)) < 0) {
+    verify->state = SSH_PUBLICKEY_STATE_WRONG;
+  } else {
+    verify->state = SSH_PUBLICKEY_STATE_VALID;
+  }
+}
+
+/* back in the thread of the session: the request goes to the callback */
+static void message_auth_verify_done(ssh_event event, void *userdata) {
+  struct message_auth_verify *verify = userdata;
+  ssh_session session = verify->session;
+  struct ssh_auth_pending_struct *pending;
+  ssh_server_callbacks cb;
+  int rc = SSH_AUTH_DENIED;
+
+  (void) event;
+
+  if (session == NULL) {
+    message_auth_verify_free(verify);
+    return;
+  }
+  SSH_LOG(session, SSH_LOG_PACKET, "%s signature received",
+      verify->state == SSH_PUBLICKEY_STATE_VALID ? "Valid" : "Wrong");
+  pending = session->auth_pending;
+  pending->verify = NULL;
+  pending->signature_state = verify->state;
+  pending->public_key = verify->public_key;
+  verify->public_key = NULL;
+
+  cb = session->server_callbacks;
+  if (cb != NULL && ssh_callbacks_exists(cb, auth_pubkey_function)) {
+    rc = cb->auth_pubkey_function(session, verify->user, pending->public_key,
+        verify->state, cb->userdata);
+  }
+  message_auth_verify_free(verify);
+  if (rc != SSH_AUTH_AGAIN) {
+    ssh_auth_reply_pending(session, rc);
+  }
+}
+
+/*
+ * Hands the signature of a request to the crypto pool of the session, which
+ * is pending until the callback has it. Returns 0 if the session has no
+ * pool or isn't in an event, or if the signature can't be read: it is
+ * verified here then.
+ */
+static int message_auth_verify_later(ssh_session session, ssh_message msg,
+    ssh_buffer packet, const char *user, char *service) {
+  struct message_auth_verify *verify;
+  uint32_t pos = packet->pos;
+  ssh_string sign;
+
+  if (session->event == NULL || session->pipeline == NULL) {
+    return 0;
+  }
+  verify = malloc(sizeof(struct message_auth_verify));
+  if (verify == NULL) {
+    return 0;
+  }
+  ZERO_STRUCTP(verify);
+  verify->session = session;
+  verify->user = strdup(user);
+  sign = buffer_get_ssh_string(packet);
+  if (sign != NULL) {
+    verify->signature = signature_from_string(session, sign,
+        msg->auth_request.public_key, msg->auth_request.public_key->type);
+    ssh_string_free(sign);
+  }
+  verify->digest = ssh_userauth_build_digest(session, msg, service);
+  if (verify->user == NULL || verify->signature == NULL ||
+      verify->digest == NULL) {
+    message_auth_verify_free(verify);
+    packet->pos = pos;
+    return 0;
+  }
+
+  /* the key is the worker's until it is done */
+  message_auth_defer(msg);
+  if (session->auth_pending == NULL) {
+    message_auth_verify_free(verify);
+    return 1;
+  }
+  verify->public_key = session->auth_pending->public_key;
+  session->auth_pending->public_key = NULL;
+  session->auth_pending->verify = verify;
+  if (crypto_pool_post(session->pipeline->pool, session->event,
+        message_auth_verify_run, message_auth_verify_done, verify) < 0) {
+    message_auth_verify_run(verify);
+    message_auth_verify_done(NULL, verify);
+    return 1;
+  }
+  SSH_LOG(session, SSH_LOG_PACKET, "Signature given to the crypto pool");
+
+  return 1;
+}
+
+/*
+ * Handles an authentication request with the typed callbacks of the server,
+ * without a ssh_message allocated: the strings are terminated in the packet.
+ * Returns 0 if there is no callback for the method, the packet isn't read
+ * then.
+ */
+static int message_auth_callbacks(ssh_session session, ssh_buffer packet) {
+  ssh_server_callbacks cb = session->server_callbacks;
+  struct ssh_message_struct msg;
+  const void *method;
+  uint32_t len = 0;
+  uint32_t pos;
+  char *user;
+  char *service;
+  int rc;
+
+  if (cb == NULL) {
+    return 0;
+  }
+
+  /* the method comes after the user and the service */
+  pos = packet->pos;
+  method = NULL;
+  if (buffer_get_ssh_string_view(packet, &len) != NULL &&
+      buffer_get_ssh_string_view(packet, &len) != NULL) {
+    method = buffer_get_ssh_string_view(packet, &len);
+  }
+  packet->pos = pos;
+  if (!(message_view_equal(method, len, "none") &&
+        ssh_callbacks_exists(cb, auth_none_function)) &&
+      !(message_view_equal(method, len, "password") &&
+        ssh_callbacks_exists(cb, auth_password_function)) &&
+      !(message_view_equal(method, len, "publickey") &&
+        ssh_callbacks_exists(cb, auth_pubkey_function))) {
+    return 0;
+  }
+
+  user = buffer_get_ssh_string_cstr(packet);
+  service = buffer_get_ssh_string_cstr(packet);
+  method = buffer_get_ssh_string_view(packet, &len);
+  if (user == NULL || service == NULL) {
+    return 1;
+  }
+  SSH_LOG(session, SSH_LOG_PACKET,
+      "Auth request for service %s, method %.*s for user '%s'",
+      service, (int) len, (const char *) method, user);
+
+  ZERO_STRUCT(msg);
+  msg.session = session;
+  msg.type = SSH_REQUEST_AUTH;
+  msg.auth_request.username = user;
+
+  if (message_view_equal(method, len, "none")) {
+    msg.auth_request.method = SSH_AUTH_METHOD_NONE;
+    rc = cb->auth_none_function(session, user, cb->userdata);
+    message_auth_answer(&msg, rc);
+  } else if (message_view_equal(method, len, "password")) {
+    char *password;
+    uint8_t tmp;
+
+    msg.auth_request.method = SSH_AUTH_METHOD_PASSWORD;
+    buffer_get_u8(packet, &tmp);
+    password = buffer_get_ssh_string_cstr(packet);
+    if (password == NULL) {
+      return 1;
+    }
+    rc = cb->auth_password_function(session, user, password, cb->userdata);
+    memset(password, 0, strlen(password));
+    message_auth_answer(&msg, rc);
+  } else {
+    ssh_string publickey;
+    uint8_t has_sign = 0;
+    int state = SSH_PUBLICKEY_STATE_NONE;
+
+    msg.auth_request.method = SSH_AUTH_METHOD_PUBLICKEY;
+    buffer_get_u8(packet, &has_sign);
+    if (buffer_get_ssh_string_view(packet, &len) == NULL) {
+      return 1;
+    }
+    publickey = buffer_get_ssh_string(packet);
+    if (publickey == NULL) {
+      return 1;
+    }
+    msg.auth_request.public_key = publickey_from_string(session, publickey);
+    ssh_string_free(publickey);
+    if (msg.auth_request.public_key == NULL) {
+      return 1;
+    }
+    if (has_sign &&
+        message_auth_verify_later(session, &msg, packet, user, service)) {
+      /* the callback has the request once it is verified */
+      state = SSH_PUBLICKEY_STATE_ERROR;
+    } else if (has_sign) {
+      state = message_auth_verify(session, &msg, packet, service);
+    }
+    msg.auth_request.signature_state = state;
+    if (state != SSH_PUBLICKEY_STATE_ERROR) {
+      rc = cb->auth_pubkey_function(session, user,
+          msg.auth_request.public_key, state, cb->userdata);
+      message_auth_answer(&msg, rc);
+    }
+    publickey_free(msg.auth_request.public_key);
+  }
+
+  return 1;
+}
+#endif /* WITH_SERVER */
+
 /**
  * @internal
  *
@@ -282,6 +761,17 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_request){
 
   (void)user;
   (void)type;
+#ifdef WITH_SERVER
+  if (session->auth_pending != NULL) {
+    message_auth_postpone(session, packet);
+    leave_function();
+    return SSH_PACKET_USED;
+  }
+  if (message_auth_callbacks(session, packet)) {
+    leave_function();
+    return SSH_PACKET_USED;
+  }
+#endif
   msg = ssh_message_new(session);
   if (msg == NULL) {
     ssh_set_error_oom(session);
@@ -324,7 +814,7 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_request){
   ssh_string_free(method);
   method = NULL;
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Auth request for service %s, method %s for user '%s'",
       service_c, method_c,
       msg->auth_request.username);
@@ -420,47 +910,11 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_request){
     msg->auth_request.signature_state = SSH_PUBLICKEY_STATE_NONE;
     // has a valid signature ?
     if(has_sign) {
-      SIGNATURE *signature = NULL;
-      ssh_public_key public_key = msg->auth_request.public_key;
-      ssh_string sign = NULL;
-      ssh_buffer digest = NULL;
-
-      sign = buffer_get_ssh_string(packet);
-      if(sign == NULL) {
-        ssh_log(session, SSH_LOG_PACKET, "Invalid signature packet from peer");
-        msg->auth_request.signature_state = SSH_PUBLICKEY_STATE_ERROR;
+      msg->auth_request.signature_state =
+          message_auth_verify(session, msg, packet, service_c);
+      if (msg->auth_request.signature_state != SSH_PUBLICKEY_STATE_VALID) {
         goto error;
       }
-      signature = signature_from_string(session, sign, public_key,
-                                                       public_key->type);
-      digest = ssh_userauth_build_digest(session, msg, service_c);
-      if ((digest == NULL || signature == NULL) ||
-          (digest != NULL && signature != NULL &&
-          sig_verify(session, public_key, signature,
-                     buffer_get_rest(digest), buffer_get_rest_len(digest)) < 0)) {
-        ssh_log(session, SSH_LOG_PACKET, "Wrong signature from peer");
-
-        ssh_string_free(sign);
-        sign = NULL;
-        ssh_buffer_free(digest);
-        digest = NULL;
-        signature_free(signature);
-        signature = NULL;
-
-        msg->auth_request.signature_state = SSH_PUBLICKEY_STATE_WRONG;
-        goto error;
-      }         
-      else
-        ssh_log(session, SSH_LOG_PACKET, "Valid signature received");
-
-      ssh_buffer_free(digest);
-      digest = NULL;
-      ssh_string_free(sign);
-      sign = NULL;
-      signature_free(signature);
-      signature = NULL;
-
-      msg->auth_request.signature_state = SSH_PUBLICKEY_STATE_VALID;
     }
     SAFE_FREE(service_c);
     goto end;
@@ -532,7 +986,7 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_info_response){
   buffer_get_u32(packet, &nanswers);
 
   if (session->kbdint == NULL) {
-    ssh_log(session, SSH_LOG_PROTOCOL, "Warning: Got a keyboard-interactive "
+    SSH_LOG(session, SSH_LOG_PROTOCOL, "Warning: Got a keyboard-interactive "
                         "response but it seems we didn't send the request.");
 
     session->kbdint = kbdint_new();
@@ -545,7 +999,7 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_info_response){
   }
 
   nanswers = ntohl(nanswers);
-  ssh_log(session,SSH_LOG_PACKET,"kbdint: %d answers",nanswers);
+  SSH_LOG(session,SSH_LOG_PACKET,"kbdint: %d answers",nanswers);
   if (nanswers > KBDINT_MAX_PROMPT) {
     ssh_set_error(session, SSH_FATAL,
         "Too much answers received from client: %u (0x%.4x)",
@@ -558,7 +1012,7 @@ SSH_PACKET_CALLBACK(ssh_packet_userauth_info_response){
 
   if(nanswers != session->kbdint->nprompts) {
     /* warn but let the application handle this case */
-    ssh_log(session, SSH_LOG_PROTOCOL, "Warning: Number of prompts and answers"
+    SSH_LOG(session, SSH_LOG_PROTOCOL, "Warning: Number of prompts and answers"
                 " mismatch: p=%u a=%u", session->kbdint->nprompts, nanswers);
   }
   session->kbdint->nanswers = nanswers;
@@ -610,6 +1064,174 @@ end:
 }
 #endif
 
+/* the name on the wire of a channel type */
+static const char *message_channel_type_name(int type) {
+  switch (type) {
+    case SSH_CHANNEL_SESSION:
+      return "session";
+    case SSH_CHANNEL_DIRECT_TCPIP:
+      return "direct-tcpip";
+    case SSH_CHANNEL_FORWARDED_TCPIP:
+      return "forwarded-tcpip";
+    case SSH_CHANNEL_X11:
+      return "x11";
+    default:
+      return NULL;
+  }
+}
+
+/* makes the channel of an open request of the client, not confirmed yet */
+static ssh_channel message_channel_open(ssh_session session,
+    ssh_message msg) {
+  ssh_channel chan;
+
+  chan = ssh_channel_new(session);
+  if (chan == NULL) {
+    return NULL;
+  }
+
+  if (ssh_channel_new_id(session, chan) == 0) {
+    ssh_channel_free(chan);
+    return NULL;
+  }
+  chan->local_window = chan->window_size / 4;
+  chan->remote_channel = msg->channel_request_open.sender;
+  chan->remote_maxpacket = msg->channel_request_open.packet_size;
+  chan->remote_window = msg->channel_request_open.window;
+  channel_compression_check(chan,
+      message_channel_type_name(msg->channel_request_open.type));
+
+  return chan;
+}
+
+/* opens the channel, and tells the client */
+static int message_channel_open_confirm(ssh_channel chan) {
+  ssh_session session = chan->session;
+
+  chan->state = SSH_CHANNEL_STATE_OPEN;
+  SSH_PROBE3(channel_open, chan, chan->local_channel, chan->remote_channel);
+
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_OPEN_CONFIRMATION) < 0) {
+    return SSH_ERROR;
+  }
+  if (buffer_add_u32(session->out_buffer, htonl(chan->remote_channel)) < 0) {
+    return SSH_ERROR;
+  }
+  if (buffer_add_u32(session->out_buffer, htonl(chan->local_channel)) < 0) {
+    return SSH_ERROR;
+  }
+  if (buffer_add_u32(session->out_buffer, htonl(chan->local_window)) < 0) {
+    return SSH_ERROR;
+  }
+  if (buffer_add_u32(session->out_buffer, htonl(chan->local_maxpacket)) < 0) {
+    return SSH_ERROR;
+  }
+
+  SSH_LOG(session, SSH_LOG_PACKET,
+      "Accepting a channel request_open for chan %d", chan->remote_channel);
+
+  return packet_send(session);
+}
+
+#ifdef WITH_SERVER
+/*
+ * Refuses a channel open at once if its type has a policy, see
+ * ssh_message_set_policy(). Returns 0 if the open is to be parsed, the
+ * packet isn't read then.
+ */
+static int message_channel_open_policy(ssh_session session,
+    ssh_buffer packet) {
+  struct ssh_message_struct msg;
+  const void *type_v;
+  uint32_t len = 0;
+  uint32_t pos;
+  uint32_t sender;
+  int type;
+
+  pos = packet->pos;
+  type_v = buffer_get_ssh_string_view(packet, &len);
+  for (type = SSH_CHANNEL_X11; type > SSH_CHANNEL_UNKNOWN; type--) {
+    if (message_view_equal(type_v, len, message_channel_type_name(type))) {
+      break;
+    }
+  }
+  if (type_v == NULL ||
+      session->message_policy[SSH_REQUEST_CHANNEL_OPEN][type] ==
+      SSH_MESSAGE_POLICY_CALLBACK) {
+    packet->pos = pos;
+    return 0;
+  }
+  SSH_LOG(session, SSH_LOG_PACKET, "Refusing a %.*s channel by policy",
+      (int) len, (const char *) type_v);
+
+  sender = 0;
+  buffer_get_u32(packet, &sender);
+  ZERO_STRUCT(msg);
+  msg.session = session;
+  msg.type = SSH_REQUEST_CHANNEL_OPEN;
+  msg.channel_request_open.sender = ntohl(sender);
+  ssh_message_reply_default(&msg);
+
+  return 1;
+}
+
+/*
+ * Opens a session channel for the typed callback of the server, without a
+ * ssh_message allocated. Returns 0 if there is no callback, the packet isn't
+ * read then.
+ */
+static int message_channel_open_callbacks(ssh_session session,
+    ssh_buffer packet) {
+  ssh_server_callbacks cb = session->server_callbacks;
+  struct ssh_message_struct msg;
+  ssh_channel chan;
+  const void *type_v;
+  uint32_t len = 0;
+  uint32_t pos;
+  uint32_t sender, window, packet_size;
+
+  if (!ssh_callbacks_exists(cb, channel_open_request_session_function)) {
+    return 0;
+  }
+  pos = packet->pos;
+  type_v = buffer_get_ssh_string_view(packet, &len);
+  if (!message_view_equal(type_v, len, "session")) {
+    packet->pos = pos;
+    return 0;
+  }
+  SSH_LOG(session, SSH_LOG_PACKET, "Clients wants to open a session channel");
+
+  buffer_get_u32(packet, &sender);
+  buffer_get_u32(packet, &window);
+  buffer_get_u32(packet, &packet_size);
+
+  ZERO_STRUCT(msg);
+  msg.session = session;
+  msg.type = SSH_REQUEST_CHANNEL_OPEN;
+  msg.channel_request_open.type = SSH_CHANNEL_SESSION;
+  msg.channel_request_open.sender = ntohl(sender);
+  msg.channel_request_open.window = ntohl(window);
+  msg.channel_request_open.packet_size = ntohl(packet_size);
+
+  chan = message_channel_open(session, &msg);
+  if (chan == NULL) {
+    ssh_message_reply_default(&msg);
+    return 1;
+  }
+  if (cb->channel_open_request_session_function(session, chan,
+        cb->userdata) != 0) {
+    ssh_channel_free(chan);
+    ssh_message_reply_default(&msg);
+    return 1;
+  }
+  if (message_channel_open_confirm(chan) < 0) {
+    ssh_channel_free(chan);
+  }
+
+  return 1;
+}
+#endif /* WITH_SERVER */
+
 SSH_PACKET_CALLBACK(ssh_packet_channel_open){
   ssh_message msg = NULL;
   ssh_string type_s = NULL, originator = NULL, destination = NULL;
@@ -619,6 +1241,13 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_open){
   enter_function();
   (void)type;
   (void)user;
+#ifdef WITH_SERVER
+  if (message_channel_open_policy(session, packet) ||
+      message_channel_open_callbacks(session, packet)) {
+    leave_function();
+    return SSH_PACKET_USED;
+  }
+#endif
   msg = ssh_message_new(session);
   if (msg == NULL) {
     ssh_set_error_oom(session);
@@ -638,7 +1267,7 @@ SSH_PACKET_CALLBACK(ssh_packet_channel_open){
     goto error;
   }
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Clients wants to open a %s channel", type_c);
   ssh_string_free(type_s);
   type_s=NULL;
@@ -762,12 +1391,46 @@ end:
   if(type_s != NULL)
     ssh_string_free(type_s);
   SAFE_FREE(type_c);
+  if (msg != NULL &&
+      msg->channel_request_open.type == SSH_CHANNEL_FORWARDED_TCPIP &&
+      ssh_forward_remote_dispatch(session, msg) == 0) {
+    /* see ssh_forward_remote_new() */
+    msg = NULL;
+  }
+  if(msg != NULL &&
+     ssh_callbacks_exists(session->callbacks, channel_open_request_function) &&
+     session->callbacks->channel_open_request_function(session, msg,
+       session->callbacks->userdata) == 0) {
+    ssh_message_free(msg);
+    msg = NULL;
+  }
   if(msg != NULL)
     ssh_message_queue(session,msg);
   leave_function();
   return SSH_PACKET_USED;
 }
 
+/**
+ * @internal
+ *
+ * @brief Refuses a channel open with the reason given, one of the
+ * SSH2_OPEN_* codes.
+ */
+int ssh_message_channel_request_open_reply_failure(ssh_message msg,
+    uint32_t reason) {
+  ssh_session session = msg->session;
+
+  if (buffer_pack(session->out_buffer, "bdddd", SSH2_MSG_CHANNEL_OPEN_FAILURE,
+        msg->channel_request_open.sender, reason,
+        0, /* reason is an empty string */
+        0) /* language too */ < 0) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+
+  return packet_send(session);
+}
+
 /* TODO: make this function accept a ssh_channel */
 ssh_channel ssh_message_channel_request_open_reply_accept(ssh_message msg) {
   ssh_session session = msg->session;
@@ -780,51 +1443,167 @@ ssh_channel ssh_message_channel_request_open_reply_accept(ssh_message msg) {
     return NULL;
   }
 
-  chan = ssh_channel_new(session);
+  chan = message_channel_open(session, msg);
   if (chan == NULL) {
     leave_function();
     return NULL;
   }
 
-  chan->local_channel = ssh_channel_new_id(session);
-  chan->local_maxpacket = 35000;
-  chan->local_window = 32000;
-  chan->remote_channel = msg->channel_request_open.sender;
-  chan->remote_maxpacket = msg->channel_request_open.packet_size;
-  chan->remote_window = msg->channel_request_open.window;
-  chan->state = SSH_CHANNEL_STATE_OPEN;
+  if (message_channel_open_confirm(chan) == SSH_ERROR) {
+    ssh_channel_free(chan);
+    leave_function();
+    return NULL;
+  }
 
-  if (buffer_add_u8(session->out_buffer, SSH2_MSG_CHANNEL_OPEN_CONFIRMATION) < 0) {
-    goto error;
+  leave_function();
+  return chan;
+}
+
+#ifdef WITH_SERVER
+/* the names on the wire of the channel requests */
+static const struct {
+  const char *name;
+  int type;
+} message_channel_requests[] = {
+  { "pty-req", SSH_CHANNEL_REQUEST_PTY },
+  { "exec", SSH_CHANNEL_REQUEST_EXEC },
+  { "shell", SSH_CHANNEL_REQUEST_SHELL },
+  { "env", SSH_CHANNEL_REQUEST_ENV },
+  { "subsystem", SSH_CHANNEL_REQUEST_SUBSYSTEM },
+  { "window-change", SSH_CHANNEL_REQUEST_WINDOW_CHANGE },
+  { "x11-req", SSH_CHANNEL_REQUEST_X11 },
+};
+
+/*
+ * Answers a channel request at once if its type has a policy, see
+ * ssh_message_set_policy(). Returns 0 if the request is to be parsed.
+ */
+static int message_channel_request_policy(ssh_session session,
+    ssh_channel channel, const char *request, uint8_t want_reply) {
+  struct ssh_message_struct msg;
+  int policy;
+  size_t i;
+
+  policy = session->message_policy[SSH_REQUEST_CHANNEL]
+      [SSH_CHANNEL_REQUEST_UNKNOWN];
+  for (i = 0; i < sizeof(message_channel_requests) /
+      sizeof(message_channel_requests[0]); i++) {
+    if (strcmp(request, message_channel_requests[i].name) == 0) {
+      policy = session->message_policy[SSH_REQUEST_CHANNEL]
+          [message_channel_requests[i].type];
+      break;
+    }
   }
-  if (buffer_add_u32(session->out_buffer, htonl(chan->remote_channel)) < 0) {
-    goto error;
+  if (policy == SSH_MESSAGE_POLICY_CALLBACK) {
+    return 0;
   }
-  if (buffer_add_u32(session->out_buffer, htonl(chan->local_channel)) < 0) {
-    goto error;
+  SSH_LOG(session, SSH_LOG_PACKET,
+      "%s a %s channel_request for channel (%d:%d) by policy",
+      policy == SSH_MESSAGE_POLICY_ACCEPT ? "Accepting" : "Refusing",
+      request, channel->local_channel, channel->remote_channel);
+
+  ZERO_STRUCT(msg);
+  msg.session = session;
+  msg.type = SSH_REQUEST_CHANNEL;
+  msg.channel_request.channel = channel;
+  msg.channel_request.want_reply = want_reply;
+  if (policy == SSH_MESSAGE_POLICY_ACCEPT) {
+    ssh_message_channel_request_reply_success(&msg);
+  } else {
+    ssh_message_reply_default(&msg);
   }
-  if (buffer_add_u32(session->out_buffer, htonl(chan->local_window)) < 0) {
-    goto error;
+
+  return 1;
+}
+
+/*
+ * Handles a channel request with the typed callbacks of the channel, without
+ * a ssh_message allocated. Returns 0 if there is no callback for the
+ * request, the packet isn't read then.
+ */
+static int message_channel_request_callbacks(ssh_session session,
+    ssh_channel channel, ssh_buffer packet, const char *request,
+    uint8_t want_reply) {
+  ssh_channel_callbacks cb = channel->callbacks;
+  struct ssh_message_struct msg;
+  uint32_t size[4];
+  char *name;
+  char *value;
+  int rc;
+  int i;
+
+  if (cb == NULL) {
+    return 0;
   }
-  if (buffer_add_u32(session->out_buffer, htonl(chan->local_maxpacket)) < 0) {
-    goto error;
+
+  if ((strcmp(request, "pty-req") == 0 ||
+       strcmp(request, "window-change") == 0) &&
+      ssh_callbacks_exists(cb, channel_pty_request_function)) {
+    name = NULL;
+    if (strcmp(request, "pty-req") == 0) {
+      name = buffer_get_ssh_string_cstr(packet);
+      if (name == NULL) {
+        return 1;
+      }
+    }
+    for (i = 0; i < 4; i++) {
+      size[i] = 0;
+      buffer_get_u32(packet, &size[i]);
+      size[i] = ntohl(size[i]);
+    }
+    rc = cb->channel_pty_request_function(session, channel, name,
+        size[0], size[1], size[2], size[3], cb->userdata);
+  } else if (strcmp(request, "shell") == 0 &&
+      ssh_callbacks_exists(cb, channel_shell_request_function)) {
+    rc = cb->channel_shell_request_function(session, channel, cb->userdata);
+  } else if (strcmp(request, "exec") == 0 &&
+      ssh_callbacks_exists(cb, channel_exec_request_function)) {
+    name = buffer_get_ssh_string_cstr(packet);
+    if (name == NULL) {
+      return 1;
+    }
+    rc = cb->channel_exec_request_function(session, channel, name, NULL,
+        cb->userdata);
+  } else if (strcmp(request, "subsystem") == 0 &&
+      ssh_callbacks_exists(cb, channel_subsystem_request_function)) {
+    name = buffer_get_ssh_string_cstr(packet);
+    if (name == NULL) {
+      return 1;
+    }
+    channel_compression_check(channel, name);
+    rc = cb->channel_subsystem_request_function(session, channel, name, NULL,
+        cb->userdata);
+  } else if (strcmp(request, "env") == 0 &&
+      ssh_callbacks_exists(cb, channel_env_request_function)) {
+    name = buffer_get_ssh_string_cstr(packet);
+    value = buffer_get_ssh_string_cstr(packet);
+    if (name == NULL || value == NULL) {
+      return 1;
+    }
+    rc = cb->channel_env_request_function(session, channel, name, value,
+        cb->userdata);
+  } else {
+    return 0;
   }
 
-  ssh_log(session, SSH_LOG_PACKET,
-      "Accepting a channel request_open for chan %d", chan->remote_channel);
+  SSH_LOG(session, SSH_LOG_PACKET,
+      "Handled a %s channel_request for channel (%d:%d) (want_reply=%hhd)",
+      request, channel->local_channel, channel->remote_channel, want_reply);
 
-  if (packet_send(session) == SSH_ERROR) {
-    goto error;
+  ZERO_STRUCT(msg);
+  msg.session = session;
+  msg.type = SSH_REQUEST_CHANNEL;
+  msg.channel_request.channel = channel;
+  msg.channel_request.want_reply = want_reply;
+  if (rc == 0) {
+    ssh_message_channel_request_reply_success(&msg);
+  } else {
+    ssh_message_reply_default(&msg);
   }
 
-  leave_function();
-  return chan;
-error:
-  ssh_channel_free(chan);
-
-  leave_function();
-  return NULL;
+  return 1;
 }
+#endif /* WITH_SERVER */
 
 /**
  * @internal
@@ -849,13 +1628,21 @@ int ssh_message_handle_channel_request(ssh_session session, ssh_channel channel,
     const char *request, uint8_t want_reply) {
   ssh_message msg = NULL;
   enter_function();
+#ifdef WITH_SERVER
+  if (message_channel_request_policy(session, channel, request, want_reply) ||
+      message_channel_request_callbacks(session, channel, packet, request,
+        want_reply)) {
+    leave_function();
+    return SSH_OK;
+  }
+#endif
   msg = ssh_message_new(session);
   if (msg == NULL) {
     ssh_set_error_oom(session);
     goto error;
   }
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Received a %s channel_request for channel (%d:%d) (want_reply=%hhd)",
       request, channel->local_channel, channel->remote_channel, want_reply);
 
@@ -933,6 +1720,7 @@ int ssh_message_handle_channel_request(ssh_session session, ssh_channel channel,
 
     msg->channel_request.type = SSH_CHANNEL_REQUEST_SUBSYSTEM;
     msg->channel_request.subsystem = subsys_c;
+    channel_compression_check(channel, subsys_c);
 
     goto end;
   }
@@ -988,6 +1776,11 @@ int ssh_message_handle_channel_request(ssh_session session, ssh_channel channel,
     goto end;
   }
 
+  if (strcmp(request, "x11-req") == 0) {
+    msg->channel_request.type = SSH_CHANNEL_REQUEST_X11;
+    goto end;
+  }
+
   msg->channel_request.type = SSH_CHANNEL_UNKNOWN;
 end:
   ssh_message_queue(session,msg);
@@ -1010,7 +1803,7 @@ int ssh_message_channel_request_reply_success(ssh_message msg) {
   if (msg->channel_request.want_reply) {
     channel = msg->channel_request.channel->remote_channel;
 
-    ssh_log(msg->session, SSH_LOG_PACKET,
+    SSH_LOG(msg->session, SSH_LOG_PACKET,
         "Sending a channel_request success to channel %d", channel);
 
     if (buffer_add_u8(msg->session->out_buffer, SSH2_MSG_CHANNEL_SUCCESS) < 0) {
@@ -1023,13 +1816,68 @@ int ssh_message_channel_request_reply_success(ssh_message msg) {
     return packet_send(msg->session);
   }
 
-  ssh_log(msg->session, SSH_LOG_PACKET,
+  SSH_LOG(msg->session, SSH_LOG_PACKET,
       "The client doesn't want to know the request succeeded");
 
   return SSH_OK;
 }
 
 #ifdef WITH_SERVER
+/*
+ * Answers a global request at once if its type has a policy, see
+ * ssh_message_set_policy(). Returns 0 if the request is to be parsed, the
+ * packet isn't read then.
+ */
+static int message_global_request_policy(ssh_session session,
+    ssh_buffer packet) {
+  struct ssh_message_struct msg;
+  const void *request;
+  uint32_t len = 0;
+  uint32_t pos;
+  uint8_t want_reply = 0;
+  int type;
+  int policy;
+
+  pos = packet->pos;
+  request = buffer_get_ssh_string_view(packet, &len);
+  if (request == NULL) {
+    packet->pos = pos;
+    return 0;
+  }
+  if (message_view_equal(request, len, "tcpip-forward")) {
+    type = SSH_GLOBAL_REQUEST_TCPIP_FORWARD;
+  } else if (message_view_equal(request, len, "cancel-tcpip-forward")) {
+    type = SSH_GLOBAL_REQUEST_CANCEL_TCPIP_FORWARD;
+  } else if (message_view_equal(request, len, "keepalive@openssh.com")) {
+    type = SSH_GLOBAL_REQUEST_KEEPALIVE;
+  } else {
+    type = SSH_GLOBAL_REQUEST_UNKNOWN;
+  }
+  policy = session->message_policy[SSH_REQUEST_GLOBAL][type];
+  if (policy == SSH_MESSAGE_POLICY_CALLBACK) {
+    packet->pos = pos;
+    return 0;
+  }
+  buffer_get_u8(packet, &want_reply);
+  SSH_LOG(session, SSH_LOG_PROTOCOL,
+      "%s SSH_MSG_GLOBAL_REQUEST %.*s %d by policy",
+      policy == SSH_MESSAGE_POLICY_ACCEPT ? "Accepting" : "Refusing",
+      (int) len, (const char *) request, want_reply);
+
+  ZERO_STRUCT(msg);
+  msg.session = session;
+  msg.type = SSH_REQUEST_GLOBAL;
+  msg.global_request.type = type;
+  msg.global_request.want_reply = want_reply;
+  if (policy == SSH_MESSAGE_POLICY_ACCEPT) {
+    ssh_message_global_request_reply_success(&msg, 0);
+  } else {
+    ssh_message_reply_default(&msg);
+  }
+
+  return 1;
+}
+
 SSH_PACKET_CALLBACK(ssh_packet_global_request){
     ssh_message msg = NULL;
     ssh_string request_s=NULL;
@@ -1042,6 +1890,10 @@ SSH_PACKET_CALLBACK(ssh_packet_global_request){
     (void)type;
     (void)packet;
 
+    if (message_global_request_policy(session, packet)) {
+        return SSH_PACKET_USED;
+    }
+
     request_s = buffer_get_ssh_string(packet);
     if (request_s != NULL) {
         request = ssh_string_to_char(request_s);
@@ -1050,7 +1902,7 @@ SSH_PACKET_CALLBACK(ssh_packet_global_request){
 
     buffer_get_u8(packet, &want_reply);
 
-    ssh_log(session,SSH_LOG_PROTOCOL,"Received SSH_MSG_GLOBAL_REQUEST packet");
+    SSH_LOG(session,SSH_LOG_PROTOCOL,"Received SSH_MSG_GLOBAL_REQUEST packet");
 
     msg = ssh_message_new(session);
     msg->type = SSH_REQUEST_GLOBAL;
@@ -1070,10 +1922,10 @@ SSH_PACKET_CALLBACK(ssh_packet_global_request){
         msg->global_request.bind_address = bind_addr;
         msg->global_request.bind_port = bind_port;
 
-        ssh_log(session, SSH_LOG_PROTOCOL, "Received SSH_MSG_GLOBAL_REQUEST %s %d %s:%d", request, want_reply, bind_addr, bind_port);
+        SSH_LOG(session, SSH_LOG_PROTOCOL, "Received SSH_MSG_GLOBAL_REQUEST %s %d %s:%d", request, want_reply, bind_addr, bind_port);
 
         if(ssh_callbacks_exists(session->callbacks, global_request_function)) {
-            ssh_log(session, SSH_LOG_PROTOCOL, "Calling callback for SSH_MSG_GLOBAL_REQUEST %s %d %s:%d", request, want_reply, bind_addr, bind_port);
+            SSH_LOG(session, SSH_LOG_PROTOCOL, "Calling callback for SSH_MSG_GLOBAL_REQUEST %s %d %s:%d", request, want_reply, bind_addr, bind_port);
             session->callbacks->global_request_function(session, msg, session->callbacks->userdata);
         } else {
             ssh_message_reply_default(msg);
@@ -1092,7 +1944,7 @@ SSH_PACKET_CALLBACK(ssh_packet_global_request){
         msg->global_request.bind_address = bind_addr;
         msg->global_request.bind_port = bind_port;
 
-        ssh_log(session, SSH_LOG_PROTOCOL, "Received SSH_MSG_GLOBAL_REQUEST %s %d %s:%d", request, want_reply, bind_addr, bind_port);
+        SSH_LOG(session, SSH_LOG_PROTOCOL, "Received SSH_MSG_GLOBAL_REQUEST %s %d %s:%d", request, want_reply, bind_addr, bind_port);
 
         if(ssh_callbacks_exists(session->callbacks, global_request_function)) {
             session->callbacks->global_request_function(session, msg, session->callbacks->userdata);
@@ -1100,7 +1952,10 @@ SSH_PACKET_CALLBACK(ssh_packet_global_request){
             ssh_message_reply_default(msg);
         }
     } else {
-        ssh_log(session, SSH_LOG_PROTOCOL, "UNKNOWN SSH_MSG_GLOBAL_REQUEST %s %d", request, want_reply);
+        SSH_LOG(session, SSH_LOG_PROTOCOL, "UNKNOWN SSH_MSG_GLOBAL_REQUEST %s %d", request, want_reply);
+        /* the client waits for an answer, keepalives included */
+        msg->global_request.want_reply = want_reply;
+        ssh_message_reply_default(msg);
     }
 
     SAFE_FREE(msg);
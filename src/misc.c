@@ -30,11 +30,15 @@
 #include <pwd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #endif
 
 #include <limits.h>
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -313,6 +317,54 @@ char *ssh_lowercase(const char* str) {
   return new;
 }
 
+/**
+ * @internal
+ *
+ * @brief Get the current time in milliseconds, from a clock which doesn't
+ *        jump with the system time when available, to measure timeouts.
+ *
+ * @return              The timestamp in milliseconds.
+ */
+uint64_t ssh_timestamp_ms(void) {
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  }
+#endif
+  {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Get the current time in microseconds from the same clock as
+ *        ssh_timestamp_ms(), to measure short operations.
+ *
+ * @return              The timestamp in microseconds.
+ */
+uint64_t ssh_timestamp_us(void) {
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+#endif
+  {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+  }
+}
+
 char *ssh_hostport(const char *host, int port){
     char *dest;
     size_t len;
@@ -364,17 +416,23 @@ struct ssh_list *ssh_list_new(){
   if(!ret)
     return NULL;
   ret->root=ret->end=NULL;
+  ret->spare=NULL;
+  ret->nspare=0;
   return ret;
 }
 
-void ssh_list_free(struct ssh_list *list){
-  struct ssh_iterator *ptr,*next;
-  ptr=list->root;
+static void ssh_iterators_free(struct ssh_iterator *ptr){
+  struct ssh_iterator *next;
   while(ptr){
     next=ptr->next;
     SAFE_FREE(ptr);
     ptr=next;
   }
+}
+
+void ssh_list_free(struct ssh_list *list){
+  ssh_iterators_free(list->root);
+  ssh_iterators_free(list->spare);
   SAFE_FREE(list);
 }
 
@@ -382,17 +440,42 @@ struct ssh_iterator *ssh_list_get_iterator(const struct ssh_list *list){
   return list->root;
 }
 
-static struct ssh_iterator *ssh_iterator_new(const void *data){
-  struct ssh_iterator *iterator=malloc(sizeof(struct ssh_iterator));
-  if(!iterator)
-    return NULL;
-  iterator->next=NULL;
+/*
+ * a node of the list for data, a spare one when there is: a queue whose
+ * elements come and go doesn't allocate once it reached its size
+ */
+static struct ssh_iterator *ssh_iterator_new(struct ssh_list *list,
+    const void *data){
+  struct ssh_iterator *iterator=list->spare;
+  if(iterator != NULL){
+    list->spare=iterator->next;
+    list->nspare--;
+  } else {
+    iterator=malloc(sizeof(struct ssh_iterator));
+    if(!iterator)
+      return NULL;
+  }
+  iterator->next=iterator->prev=NULL;
   iterator->data=data;
   return iterator;
 }
 
+/* keeps a node removed from the list for the next elements */
+static void ssh_iterator_release(struct ssh_list *list,
+    struct ssh_iterator *iterator){
+  if(list->nspare >= SSH_LIST_SPARE){
+    SAFE_FREE(iterator);
+    return;
+  }
+  iterator->data=NULL;
+  iterator->prev=NULL;
+  iterator->next=list->spare;
+  list->spare=iterator;
+  list->nspare++;
+}
+
 int ssh_list_append(struct ssh_list *list,const void *data){
-  struct ssh_iterator *iterator=ssh_iterator_new(data);
+  struct ssh_iterator *iterator=ssh_iterator_new(list,data);
   if(!iterator)
     return SSH_ERROR;
   if(!list->end){
@@ -400,6 +483,7 @@ int ssh_list_append(struct ssh_list *list,const void *data){
     list->root=list->end=iterator;
   } else {
     /* put it on end of list */
+    iterator->prev=list->end;
     list->end->next=iterator;
     list->end=iterator;
   }
@@ -407,7 +491,7 @@ int ssh_list_append(struct ssh_list *list,const void *data){
 }
 
 int ssh_list_prepend(struct ssh_list *list, const void *data){
-  struct ssh_iterator *it = ssh_iterator_new(data);
+  struct ssh_iterator *it = ssh_iterator_new(list, data);
 
   if (it == NULL) {
     return SSH_ERROR;
@@ -419,34 +503,25 @@ int ssh_list_prepend(struct ssh_list *list, const void *data){
   } else {
     /* set as new root */
     it->next = list->root;
+    list->root->prev = it;
     list->root = it;
   }
 
   return SSH_OK;
 }
 
+/* iterator must be a node of the list */
 void ssh_list_remove(struct ssh_list *list, struct ssh_iterator *iterator){
-  struct ssh_iterator *ptr,*prev;
-  prev=NULL;
-  ptr=list->root;
-  while(ptr && ptr != iterator){
-    prev=ptr;
-    ptr=ptr->next;
-  }
-  if(!ptr){
-    /* we did not find the element */
-    return;
-  }
   /* unlink it */
-  if(prev)
-    prev->next=ptr->next;
-  /* if iterator was the head */
-  if(list->root == iterator)
+  if(iterator->prev)
+    iterator->prev->next=iterator->next;
+  else
     list->root=iterator->next;
-  /* if iterator was the tail */
-  if(list->end == iterator)
-    list->end = prev;
-  SAFE_FREE(iterator);
+  if(iterator->next)
+    iterator->next->prev=iterator->prev;
+  else
+    list->end=iterator->prev;
+  ssh_iterator_release(list,iterator);
 }
 
 /**
@@ -467,9 +542,11 @@ const void *_ssh_list_pop_head(struct ssh_list *list){
     return NULL;
   data=iterator->data;
   list->root=iterator->next;
+  if(list->root)
+    list->root->prev=NULL;
   if(list->end==iterator)
     list->end=NULL;
-  SAFE_FREE(iterator);
+  ssh_iterator_release(list,iterator);
   return data;
 }
 
@@ -607,6 +684,33 @@ int ssh_mkdir(const char *pathname, mode_t mode) {
   return r;
 }
 
+/**
+ * @internal
+ *
+ * @brief Check a name given by the peer for a file of a local directory.
+ *
+ * It has to stay in the directory: a name with a separator, "." or ".." is
+ * refused.
+ *
+ * @param[in]  name     The name to check.
+ *
+ * @return              1 if the name can be joined to the directory, 0 if
+ *                      not.
+ */
+int ssh_path_name_valid(const char *name) {
+  if (name == NULL || name[0] == '\0' || strchr(name, '/') != NULL ||
+      strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return 0;
+  }
+#ifdef _WIN32
+  if (strchr(name, '\\') != NULL || strchr(name, ':') != NULL) {
+    return 0;
+  }
+#endif
+
+  return 1;
+}
+
 /**
  * @brief Expand a directory starting with a tilde '~'
  *
@@ -810,7 +914,7 @@ int ssh_analyze_banner(ssh_session session, int server, int *ssh1, int *ssh2) {
     return -1;
   }
 
-  ssh_log(session, SSH_LOG_RARE, "Analyzing banner: %s", banner);
+  SSH_LOG(session, SSH_LOG_RARE, "Analyzing banner: %s", banner);
 
   switch(banner[4]) {
     case '1':
@@ -845,7 +949,7 @@ int ssh_analyze_banner(ssh_session session, int server, int *ssh1, int *ssh2) {
           major = strtol(openssh + 8, (char **) NULL, 10);
           minor = strtol(openssh + 10, (char **) NULL, 10);
           session->openssh = SSH_VERSION_INT(major, minor, 0);
-          ssh_log(session, SSH_LOG_RARE,
+          SSH_LOG(session, SSH_LOG_RARE,
                   "We are talking to an OpenSSH client version: %d.%d (%x)",
                   major, minor, session->openssh);
       }
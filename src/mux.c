@@ -0,0 +1,433 @@
+/*
+ * mux.c - sharing of authenticated sessions between channels
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/misc.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+
+/**
+ * @defgroup libssh_mux The SSH connection sharing functions.
+ * @ingroup libssh
+ *
+ * A mux keeps authenticated sessions and hands out channels on them, like
+ * the ControlMaster option of OpenSSH does between processes. Opening a
+ * channel on a host already connected costs a channel open instead of a
+ * connection, a key exchange and an authentication.
+ *
+ * @{
+ */
+
+struct ssh_mux_entry {
+  ssh_session session;
+  /* when the session lost its last channel, 0 while it has some */
+  uint64_t idle_since;
+};
+
+struct ssh_mux_struct {
+  struct ssh_list *entries;
+  int max_channels;
+  int idle_timeout;
+  ssh_mux_connect_callback connect;
+  void *userdata;
+};
+
+/* the channels of a session which haven't been closed */
+static int mux_channels(ssh_session session) {
+  ssh_channel channel = session->channels;
+  int count = 0;
+
+  if (channel == NULL) {
+    return 0;
+  }
+  do {
+    if (channel->state != SSH_CHANNEL_STATE_CLOSED) {
+      count++;
+    }
+    channel = channel->next;
+  } while (channel != session->channels);
+
+  return count;
+}
+
+static int mux_usable(ssh_session session) {
+  return ssh_is_connected(session) &&
+    session->session_state == SSH_SESSION_STATE_AUTHENTICATED;
+}
+
+static int mux_match(ssh_session session, const char *host, const char *user,
+    unsigned int port) {
+  if (session->host == NULL || strcmp(session->host, host) != 0) {
+    return 0;
+  }
+  if (user != NULL &&
+      (session->username == NULL || strcmp(session->username, user) != 0)) {
+    return 0;
+  }
+
+  return session->port == (port == 0 ? 22 : port);
+}
+
+static void mux_entry_free(struct ssh_mux_entry *entry) {
+  ssh_disconnect(entry->session);
+  ssh_free(entry->session);
+  SAFE_FREE(entry);
+}
+
+/**
+ * @brief Create a new mux.
+ *
+ * By default, the channels of a session aren't limited and the idle
+ * sessions are kept until ssh_mux_free().
+ *
+ * @return              A new mux, NULL on error.
+ *
+ * @see ssh_mux_set_limits()
+ */
+ssh_mux ssh_mux_new(void) {
+  ssh_mux mux;
+
+  mux = malloc(sizeof(struct ssh_mux_struct));
+  if (mux == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(mux);
+
+  mux->entries = ssh_list_new();
+  if (mux->entries == NULL) {
+    SAFE_FREE(mux);
+    return NULL;
+  }
+
+  return mux;
+}
+
+/**
+ * @brief Disconnect and free the sessions of a mux, and the mux.
+ *
+ * @param[in]  mux      The mux to free.
+ */
+void ssh_mux_free(ssh_mux mux) {
+  struct ssh_mux_entry *entry;
+
+  if (mux == NULL) {
+    return;
+  }
+  while ((entry = ssh_list_pop_head(struct ssh_mux_entry *, mux->entries))
+      != NULL) {
+    mux_entry_free(entry);
+  }
+  ssh_list_free(mux->entries);
+  SAFE_FREE(mux);
+}
+
+/**
+ * @brief Set the limits of the sessions of a mux.
+ *
+ * @param[in]  mux          The mux.
+ *
+ * @param[in]  max_channels The number of channels a session carries at most,
+ *                          0 for no limit. A channel counts until it is
+ *                          closed.
+ *
+ * @param[in]  idle_timeout The time in milliseconds a session is kept
+ *                          without channels, 0 to keep it.
+ */
+void ssh_mux_set_limits(ssh_mux mux, int max_channels, int idle_timeout) {
+  if (mux == NULL) {
+    return;
+  }
+  mux->max_channels = max_channels > 0 ? max_channels : 0;
+  mux->idle_timeout = idle_timeout > 0 ? idle_timeout : 0;
+}
+
+/**
+ * @brief Set the function connecting new sessions.
+ *
+ * It is called when no session of the mux matches a request, or they all
+ * carry the maximum of channels. It returns a connected and authenticated
+ * session, which the mux takes, or NULL on error.
+ *
+ * @param[in]  mux      The mux.
+ *
+ * @param[in]  cb       The connect function, NULL to only use the sessions
+ *                      added with ssh_mux_add_session().
+ *
+ * @param[in]  userdata The userdata passed to the function.
+ */
+void ssh_mux_set_connect_callback(ssh_mux mux, ssh_mux_connect_callback cb,
+    void *userdata) {
+  if (mux == NULL) {
+    return;
+  }
+  mux->connect = cb;
+  mux->userdata = userdata;
+}
+
+/**
+ * @brief Add an authenticated session to a mux.
+ *
+ * The session is matched with the host, user and port of its options. The
+ * mux owns it from now on: it is disconnected and freed when it expires,
+ * and by ssh_mux_free().
+ *
+ * @param[in]  mux      The mux.
+ *
+ * @param[in]  session  The session to share.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the session isn't
+ *                      authenticated, is already in the mux or on memory
+ *                      error.
+ */
+int ssh_mux_add_session(ssh_mux mux, ssh_session session) {
+  struct ssh_mux_entry *entry;
+  struct ssh_iterator *it;
+
+  if (mux == NULL || session == NULL) {
+    return SSH_ERROR;
+  }
+  if (!mux_usable(session) || session->host == NULL) {
+    ssh_set_error(session, SSH_REQUEST_DENIED,
+        "Only authenticated sessions can be shared");
+    return SSH_ERROR;
+  }
+  for (it = ssh_list_get_iterator(mux->entries); it != NULL; it = it->next) {
+    if (ssh_iterator_value(struct ssh_mux_entry *, it)->session == session) {
+      ssh_set_error(session, SSH_REQUEST_DENIED,
+          "The session is already shared");
+      return SSH_ERROR;
+    }
+  }
+
+  entry = malloc(sizeof(struct ssh_mux_entry));
+  if (entry == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  entry->session = session;
+  entry->idle_since = mux_channels(session) > 0 ? 0 : ssh_timestamp_ms();
+  if (ssh_list_append(mux->entries, entry) < 0) {
+    ssh_set_error_oom(session);
+    SAFE_FREE(entry);
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Take a session back from a mux.
+ *
+ * The session isn't disconnected, the caller owns it again.
+ *
+ * @param[in]  mux      The mux.
+ *
+ * @param[in]  session  The session to remove.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if the session isn't in
+ *                      the mux.
+ */
+int ssh_mux_remove_session(ssh_mux mux, ssh_session session) {
+  struct ssh_mux_entry *entry;
+  struct ssh_iterator *it;
+
+  if (mux == NULL) {
+    return SSH_ERROR;
+  }
+  for (it = ssh_list_get_iterator(mux->entries); it != NULL; it = it->next) {
+    entry = ssh_iterator_value(struct ssh_mux_entry *, it);
+    if (entry->session == session) {
+      ssh_list_remove(mux->entries, it);
+      SAFE_FREE(entry);
+      return SSH_OK;
+    }
+  }
+
+  return SSH_ERROR;
+}
+
+/**
+ * @brief Free the sessions which are idle for too long or disconnected.
+ *
+ * This is done by the functions getting a session, an application can also
+ * call it from a timer to close them on time.
+ *
+ * @param[in]  mux      The mux.
+ *
+ * @return              The number of sessions freed.
+ */
+int ssh_mux_expire(ssh_mux mux) {
+  struct ssh_mux_entry *entry;
+  struct ssh_iterator *it;
+  struct ssh_iterator *next;
+  uint64_t now;
+  int count = 0;
+
+  if (mux == NULL) {
+    return 0;
+  }
+  now = ssh_timestamp_ms();
+  for (it = ssh_list_get_iterator(mux->entries); it != NULL; it = next) {
+    next = it->next;
+    entry = ssh_iterator_value(struct ssh_mux_entry *, it);
+    if (mux_usable(entry->session)) {
+      if (mux_channels(entry->session) > 0) {
+        entry->idle_since = 0;
+        continue;
+      }
+      if (entry->idle_since == 0) {
+        entry->idle_since = now;
+      }
+      if (mux->idle_timeout == 0 ||
+          now - entry->idle_since < (uint64_t) mux->idle_timeout) {
+        continue;
+      }
+    }
+    ssh_list_remove(mux->entries, it);
+    mux_entry_free(entry);
+    count++;
+  }
+
+  return count;
+}
+
+static struct ssh_mux_entry *mux_find(ssh_mux mux, const char *host,
+    const char *user, unsigned int port) {
+  struct ssh_mux_entry *entry;
+  struct ssh_iterator *it;
+  ssh_session session;
+
+  ssh_mux_expire(mux);
+  for (it = ssh_list_get_iterator(mux->entries); it != NULL; it = it->next) {
+    entry = ssh_iterator_value(struct ssh_mux_entry *, it);
+    if (mux_match(entry->session, host, user, port) &&
+        (mux->max_channels == 0 ||
+         mux_channels(entry->session) < mux->max_channels)) {
+      return entry;
+    }
+  }
+
+  if (mux->connect == NULL) {
+    return NULL;
+  }
+  session = mux->connect(host, user, port, mux->userdata);
+  if (session == NULL) {
+    return NULL;
+  }
+  if (ssh_mux_add_session(mux, session) < 0) {
+    ssh_disconnect(session);
+    ssh_free(session);
+    return NULL;
+  }
+
+  return ssh_iterator_value(struct ssh_mux_entry *, mux->entries->end);
+}
+
+/**
+ * @brief Get a session of a mux which can carry one more channel.
+ *
+ * A new session is connected with the connect callback when none of them
+ * can. The session stays owned by the mux.
+ *
+ * @param[in]  mux      The mux.
+ *
+ * @param[in]  host     The host of the session.
+ *
+ * @param[in]  user     The user of the session, NULL for any user.
+ *
+ * @param[in]  port     The port of the session, 0 for the default port.
+ *
+ * @return              A session, NULL if there is none.
+ *
+ * @see ssh_mux_set_connect_callback()
+ */
+ssh_session ssh_mux_get_session(ssh_mux mux, const char *host,
+    const char *user, unsigned int port) {
+  struct ssh_mux_entry *entry;
+
+  if (mux == NULL || host == NULL) {
+    return NULL;
+  }
+  entry = mux_find(mux, host, user, port);
+
+  return entry != NULL ? entry->session : NULL;
+}
+
+/**
+ * @brief Open a session channel on a shared session.
+ *
+ * This is what ssh_channel_new() and ssh_channel_open_session() do on a new
+ * connection, without the connection. A nonblocking session returns the
+ * channel while it is being opened, ssh_channel_open_session() is called
+ * again to know when it is done.
+ *
+ * @param[in]  mux      The mux.
+ *
+ * @param[in]  host     The host to connect to.
+ *
+ * @param[in]  user     The user to log in as, NULL for any user.
+ *
+ * @param[in]  port     The port to connect to, 0 for the default port.
+ *
+ * @return              A channel to free with ssh_channel_free(), NULL on
+ *                      error.
+ */
+ssh_channel ssh_mux_channel_new(ssh_mux mux, const char *host,
+    const char *user, unsigned int port) {
+  struct ssh_mux_entry *entry;
+  ssh_channel channel;
+  int rc;
+  int i;
+
+  if (mux == NULL || host == NULL) {
+    return NULL;
+  }
+
+  /* a session found dead by the open is replaced once */
+  for (i = 0; i < 2; i++) {
+    entry = mux_find(mux, host, user, port);
+    if (entry == NULL) {
+      return NULL;
+    }
+    channel = ssh_channel_new(entry->session);
+    if (channel == NULL) {
+      return NULL;
+    }
+    entry->idle_since = 0;
+    rc = ssh_channel_open_session(channel);
+    if (rc != SSH_ERROR) {
+      return channel;
+    }
+    ssh_channel_free(channel);
+    if (mux_usable(entry->session)) {
+      return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
@@ -23,6 +23,7 @@
  */
 
 #include "config.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,97 +46,93 @@
  * @{
  */
 
-/**
- * @brief Duplicate the options of a session structure.
- *
- * If you make several sessions with the same options this is useful. You
- * cannot use twice the same option structure in ssh_session_connect.
- *
- * @param src           The session to use to copy the options.
- *
- * @param dest          The session to copy the options to.
- *
- * @returns             0 on sucess, -1 on error with errno set.
- *
- * @see ssh_session_connect()
- */
-int ssh_options_copy(ssh_session src, ssh_session *dest) {
-  ssh_session new;
-  int i;
+/* replaces the string of dest by a copy of src, if src is set */
+static int options_copy_string(char **dest, const char *src) {
+  char *tmp;
 
-  if (src == NULL || dest == NULL || *dest == NULL) {
+  if (src == NULL) {
+    return 0;
+  }
+  tmp = strdup(src);
+  if (tmp == NULL) {
     return -1;
   }
+  SAFE_FREE(*dest);
+  *dest = tmp;
 
-  new = *dest;
+  return 0;
+}
 
-  if (src->username) {
-    new->username = strdup(src->username);
-    if (new->username == NULL) {
-      return -1;
-    }
-  }
+/* copies the options of src over the ones of new */
+static int options_copy(ssh_session src, ssh_session new) {
+  int i;
 
-  if (src->host) {
-    new->host = strdup(src->host);
-    if (new->host == NULL) {
-      return -1;
-    }
+  if (options_copy_string(&new->username, src->username) < 0 ||
+      options_copy_string(&new->host, src->host) < 0 ||
+      options_copy_string(&new->bindaddr, src->bindaddr) < 0) {
+    return -1;
   }
 
   if (src->identity) {
+    struct ssh_list *identity;
     struct ssh_iterator *it;
+    char *id;
 
-    new->identity = ssh_list_new();
-    if (new->identity == NULL) {
+    identity = ssh_list_new();
+    if (identity == NULL) {
       return -1;
     }
 
     it = ssh_list_get_iterator(src->identity);
     while (it) {
-      char *id;
       int rc;
 
       id = strdup((char *) it->data);
       if (id == NULL) {
-        return -1;
+        rc = -1;
+      } else {
+        rc = ssh_list_append(identity, id);
       }
-
-      rc = ssh_list_append(new->identity, id);
       if (rc < 0) {
+        SAFE_FREE(id);
+        for (id = ssh_list_pop_head(char *, identity);
+             id != NULL;
+             id = ssh_list_pop_head(char *, identity)) {
+          SAFE_FREE(id);
+        }
+        ssh_list_free(identity);
         return -1;
       }
       it = it->next;
     }
-  }
 
-  if (src->sshdir) {
-    new->sshdir = strdup(src->sshdir);
-    if (new->sshdir == NULL) {
-      return -1;
+    if (new->identity) {
+      for (id = ssh_list_pop_head(char *, new->identity);
+           id != NULL;
+           id = ssh_list_pop_head(char *, new->identity)) {
+        SAFE_FREE(id);
+      }
+      ssh_list_free(new->identity);
     }
+    new->identity = identity;
   }
 
-  if (src->knownhosts) {
-    new->knownhosts = strdup(src->knownhosts);
-    if (new->knownhosts == NULL) {
-      return -1;
-    }
+  if (options_copy_string(&new->sshdir, src->sshdir) < 0 ||
+      options_copy_string(&new->knownhosts, src->knownhosts) < 0) {
+    return -1;
   }
 
   for (i = 0; i < 10; ++i) {
-    if (src->wanted_methods[i]) {
-      new->wanted_methods[i] = strdup(src->wanted_methods[i]);
-      if (new->wanted_methods[i] == NULL) {
-        return -1;
-      }
+    if (options_copy_string(&new->wanted_methods[i],
+          src->wanted_methods[i]) < 0) {
+      return -1;
     }
   }
 
-  if(src->ProxyCommand) {
-    new->ProxyCommand = strdup(src->ProxyCommand);
-    if(new->ProxyCommand == NULL)
-      return -1;
+  if (options_copy_string(&new->ProxyCommand, src->ProxyCommand) < 0 ||
+      options_copy_string(&new->compression_skip,
+        src->compression_skip) < 0) {
+    return -1;
   }
   new->fd = src->fd;
   new->port = src->port;
@@ -144,8 +141,216 @@ int ssh_options_copy(ssh_session src, ssh_session *dest) {
   new->timeout_usec = src->timeout_usec;
   new->ssh2 = src->ssh2;
   new->ssh1 = src->ssh1;
+  new->StrictHostKeyChecking = src->StrictHostKeyChecking;
   new->log_verbosity = src->log_verbosity;
   new->compressionlevel = src->compressionlevel;
+  new->compressionstrategy = src->compressionstrategy;
+  new->compressionadaptive = src->compressionadaptive;
+  new->read_size_max = src->read_size_max;
+  new->channel_buffer_soft_limit = src->channel_buffer_soft_limit;
+  new->channel_buffer_hard_limit = src->channel_buffer_hard_limit;
+  new->session_buffer_soft_limit = src->session_buffer_soft_limit;
+  new->session_buffer_hard_limit = src->session_buffer_hard_limit;
+  new->tcp = src->tcp;
+  new->channel_window = src->channel_window;
+  new->channel_window_max = src->channel_window_max;
+  new->channel_maxpacket = src->channel_maxpacket;
+  new->channel_window_threshold = src->channel_window_threshold;
+  new->channel_window_coalesce = src->channel_window_coalesce;
+  new->channel_scheduler = src->channel_scheduler;
+  new->rekey_data = src->rekey_data;
+  new->rekey_time = src->rekey_time;
+  new->keepalive_interval = src->keepalive_interval;
+  new->keepalive_max = src->keepalive_max;
+  new->kex_guess = src->kex_guess;
+
+  return 0;
+}
+
+/**
+ * @brief Duplicate the options of a session structure.
+ *
+ * If you make several sessions with the same options this is useful. You
+ * cannot use twice the same option structure in ssh_session_connect.
+ *
+ * @param src           The session to use to copy the options.
+ *
+ * @param dest          The session to copy the options to.
+ *
+ * @returns             0 on sucess, -1 on error with errno set.
+ *
+ * @see ssh_session_connect()
+ * @see ssh_options_template_new()
+ */
+int ssh_options_copy(ssh_session src, ssh_session *dest) {
+  if (src == NULL || dest == NULL || *dest == NULL) {
+    return -1;
+  }
+
+  return options_copy(src, *dest);
+}
+
+/* the options of a session, resolved once for many sessions */
+struct ssh_options_template_struct {
+  ssh_session options;
+};
+
+/**
+ * @brief Make an options template from the options of a session.
+ *
+ * Setting up many sessions the same way repeats the same work for every
+ * session: the ssh directory and the user name are looked up in the
+ * password database and the configuration files are read. A template keeps
+ * the options of a configured session with these resolved, and gives them
+ * to the new sessions with ssh_options_template_apply().
+ *
+ * The template doesn't change once made, it may be applied by several
+ * threads at the same time.
+ *
+ * @param session       The session holding the options, for instance after
+ *                      ssh_options_set() and ssh_options_parse_config(). It
+ *                      can be freed afterwards.
+ *
+ * @return              The template, NULL on error.
+ *
+ * @see ssh_options_template_apply()
+ * @see ssh_options_template_free()
+ */
+ssh_options_template ssh_options_template_new(ssh_session session) {
+  ssh_options_template tmpl;
+
+  if (session == NULL) {
+    return NULL;
+  }
+
+  tmpl = malloc(sizeof(struct ssh_options_template_struct));
+  if (tmpl == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  tmpl->options = ssh_new();
+  if (tmpl->options == NULL) {
+    SAFE_FREE(tmpl);
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+
+  if (options_copy(session, tmpl->options) < 0 ||
+      (tmpl->options->sshdir == NULL &&
+       ssh_options_set(tmpl->options, SSH_OPTIONS_SSH_DIR, NULL) < 0) ||
+      (tmpl->options->username == NULL &&
+       ssh_options_set(tmpl->options, SSH_OPTIONS_USER, NULL) < 0)) {
+    ssh_options_template_free(tmpl);
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+
+  return tmpl;
+}
+
+/**
+ * @brief Give the options of a template to a session.
+ *
+ * The options set in the template replace the ones of the session. The
+ * options of the session set with ssh_options_set() afterwards override the
+ * template.
+ *
+ * @param tmpl          The template made with ssh_options_template_new().
+ *
+ * @param session       The session to configure.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_options_template_apply(ssh_options_template tmpl,
+    ssh_session session) {
+  if (tmpl == NULL || session == NULL) {
+    return SSH_ERROR;
+  }
+
+  if (options_copy(tmpl->options, session) < 0) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Free an options template.
+ *
+ * The sessions configured with the template keep their options.
+ *
+ * @param tmpl          The template to free.
+ */
+void ssh_options_template_free(ssh_options_template tmpl) {
+  if (tmpl == NULL) {
+    return;
+  }
+  ssh_free(tmpl->options);
+  SAFE_FREE(tmpl);
+}
+
+/*
+ * Set one of the TCP options shared by the sessions and the binds, the bind
+ * options being mapped to the session ones.
+ */
+static int ssh_tcp_options_set(struct ssh_tcp_options *tcp, uint32_t *window,
+    uint32_t *window_max, uint32_t *maxpacket, enum ssh_options_e type,
+    const void *value) {
+  int x;
+
+  if (value == NULL) {
+    return -1;
+  }
+  if (type == SSH_OPTIONS_CHANNEL_WINDOW) {
+    if (*(const unsigned int *) value == 0) {
+      return -1;
+    }
+    *window = *(const unsigned int *) value;
+    return 0;
+  }
+  if (type == SSH_OPTIONS_CHANNEL_WINDOW_MAX) {
+    *window_max = *(const unsigned int *) value;
+    return 0;
+  }
+  if (type == SSH_OPTIONS_CHANNEL_MAXPACKET) {
+    if (*(const unsigned int *) value == 0 ||
+        *(const unsigned int *) value > SSH_CHANNEL_MAXPACKET_MAX) {
+      return -1;
+    }
+    *maxpacket = *(const unsigned int *) value;
+    return 0;
+  }
+  x = *(const int *) value;
+  if (x < 0) {
+    return -1;
+  }
+
+  switch (type) {
+    case SSH_OPTIONS_TCP_PROFILE:
+      if (x > SSH_TCP_PROFILE_BULK) {
+        return -1;
+      }
+      ssh_tcp_options_profile(tcp, window, x);
+      break;
+    case SSH_OPTIONS_TCP_NODELAY:
+      tcp->nodelay = x ? 1 : 0;
+      break;
+    case SSH_OPTIONS_TCP_SNDBUF:
+      tcp->sndbuf = x;
+      break;
+    case SSH_OPTIONS_TCP_RCVBUF:
+      tcp->rcvbuf = x;
+      break;
+    case SSH_OPTIONS_TCP_KEEPALIVE:
+      tcp->keepalive = x;
+      break;
+    case SSH_OPTIONS_TCP_NOTSENT_LOWAT:
+      tcp->notsent_lowat = x;
+      break;
+    default:
+      return -1;
+  }
 
   return 0;
 }
@@ -228,7 +433,8 @@ int ssh_options_set_algo(ssh_session session, int algo,
  *              - SSH_OPTIONS_IDENTITY:
  *                Set the identity file name (const char *,format string).\n
  *                \n
- *                By default identity, id_dsa and id_rsa are checked.\n
+ *                By default identity, id_dsa, id_ed25519, id_ecdsa and
+ *                id_rsa are checked.\n
  *                \n
  *                The identity file used authenticate with public key.
  *                It may include "%s" which will be replaced by the
@@ -331,6 +537,27 @@ int ssh_options_set_algo(ssh_session session, int algo,
  *                Set the compression level to use for zlib functions. (int,
  *                value from 1 to 9, 9 being the most efficient but slower).
  *
+ *              - SSH_OPTIONS_COMPRESSION_STRATEGY:
+ *                Set the zlib strategy of the compression (int, one of
+ *                enum ssh_compression_strategy_e). SSH_COMPRESSION_STRATEGY_RLE
+ *                is much faster on data made of repeated bytes,
+ *                SSH_COMPRESSION_STRATEGY_FILTERED on small variations of
+ *                values, like images.
+ *
+ *              - SSH_OPTIONS_COMPRESSION_ADAPTIVE:
+ *                Stop compressing the packets while they don't shrink, as
+ *                with data which is already compressed or encrypted (int, 0
+ *                or 1, default 0). The stream goes on with stored blocks, so
+ *                the peer sees no difference, and the compression is tried
+ *                again from time to time.
+ *
+ *              - SSH_OPTIONS_COMPRESSION_SKIP:
+ *                Send the data of some channels without compression (const
+ *                char *, a comma-separated list of channel types and
+ *                subsystems, wildcards allowed, like "sftp,direct-tcpip").
+ *                For the channels carrying data which is already
+ *                compressed. See ssh_channel_set_compression().
+ *
  *              - SSH_OPTIONS_STRICTHOSTKEYCHECK:
  *                Set the parameter StrictHostKeyChecking to avoid
  *                asking about a fingerprint (int, 0 = false).
@@ -339,6 +566,143 @@ int ssh_options_set_algo(ssh_session session, int algo,
  *                Set the command to be executed in order to connect to
  *                server (const char *).
  *
+ *              - SSH_OPTIONS_READ_SIZE_MAX:
+ *                Set the maximum number of bytes read from the socket at
+ *                once (unsigned int, default 256 KB). The read size starts
+ *                at 4 KB and grows while the reads fill it.
+ *
+ *              - SSH_OPTIONS_CHANNEL_BUFFER_SOFT_LIMIT:
+ *                Set the number of received bytes waiting to be read in a
+ *                channel above which its window isn't grown anymore, so the
+ *                peer stops sending (unsigned int, 0 = no limit, default).
+ *
+ *              - SSH_OPTIONS_CHANNEL_BUFFER_HARD_LIMIT:
+ *                Set the number of received bytes waiting to be read in a
+ *                channel above which the data is refused. Only a peer
+ *                ignoring the window can reach it, the channel is closed
+ *                (unsigned int, 0 = no limit, default). It should be more
+ *                than the soft limit plus a window (128 KB).
+ *
+ *              - SSH_OPTIONS_SESSION_BUFFER_SOFT_LIMIT:
+ *                The same as SSH_OPTIONS_CHANNEL_BUFFER_SOFT_LIMIT, for the
+ *                total of the channels of the session (unsigned int).
+ *
+ *              - SSH_OPTIONS_SESSION_BUFFER_HARD_LIMIT:
+ *                The same as SSH_OPTIONS_CHANNEL_BUFFER_HARD_LIMIT, for the
+ *                total of the channels of the session (unsigned int).
+ *
+ *              - SSH_OPTIONS_TCP_PROFILE:
+ *                Set the TCP options and the channel window of a use case
+ *                (int). It overwrites the options below, which may be
+ *                set afterwards to adjust it.
+ *                - SSH_TCP_PROFILE_DEFAULT: the system defaults
+ *                - SSH_TCP_PROFILE_INTERACTIVE: TCP_NODELAY and a
+ *                  TCP_NOTSENT_LOWAT of 16 KB, for the terminals
+ *                - SSH_TCP_PROFILE_BULK: 4 MB socket buffers and a 2 MB
+ *                  channel window, for the transfers over long fat links
+ *
+ *              - SSH_OPTIONS_TCP_NODELAY:
+ *                Disable the Nagle algorithm on the socket (int, 0 = false).
+ *
+ *              - SSH_OPTIONS_TCP_SNDBUF:
+ *                Set the size of the send buffer of the socket (int, 0 = the
+ *                system default).
+ *
+ *              - SSH_OPTIONS_TCP_RCVBUF:
+ *                Set the size of the receive buffer of the socket (int, 0 =
+ *                the system default).
+ *
+ *              - SSH_OPTIONS_TCP_KEEPALIVE:
+ *                Send TCP keepalive probes after this number of idle
+ *                seconds (int, 0 = no probes).
+ *
+ *              - SSH_OPTIONS_TCP_NOTSENT_LOWAT:
+ *                Set the number of unsent bytes the kernel queues before the
+ *                socket isn't writable anymore (int, 0 = the system default).
+ *                Ignored where TCP_NOTSENT_LOWAT doesn't exist.
+ *
+ *              - SSH_OPTIONS_CHANNEL_WINDOW:
+ *                Set the window granted to the peer on the channels
+ *                (unsigned int, default 128 KB). A large window is needed to
+ *                fill links with a long round trip time.
+ *
+ *              - SSH_OPTIONS_CHANNEL_WINDOW_MAX:
+ *                Auto-tune the channel windows up to this size (unsigned
+ *                int, 0 = fixed windows, the default). A window grows when
+ *                the peer runs out of it: to twice the data the application
+ *                drains in a round trip time, measured on the window
+ *                adjusts. The buffering limits also bound it.
+ *
+ *              - SSH_OPTIONS_CHANNEL_MAXPACKET:
+ *                Set the largest data packet the peer can send on the
+ *                channels (unsigned int, default 32000, up to about 255 KB).
+ *                Larger packets cost less MAC, padding and system calls per
+ *                byte on bulk transfers. The packets sent are split at the
+ *                size advertised by the peer.
+ *
+ *              - SSH_OPTIONS_CHANNEL_WINDOW_THRESHOLD:
+ *                Send a window adjust when the window left to the peer falls
+ *                under this percentage of the window (int, 1 to 100,
+ *                default 50). A low threshold sends fewer and larger
+ *                adjusts.
+ *
+ *              - SSH_OPTIONS_CHANNEL_WINDOW_COALESCE:
+ *                Coalesce the window adjusts of the reads made until the
+ *                session polls again, in a single packet (int, 0 or 1,
+ *                default 0). See ssh_channel_set_window_strategy().
+ *
+ *              - SSH_OPTIONS_CHANNEL_SCHEDULER:
+ *                Queue the data written on the channels and send it in
+ *                deficit round-robin, weighted by the priority of the
+ *                channels (int, 0 or 1, default 0). A bulk transfer then
+ *                doesn't delay the other channels by more than a round. See
+ *                ssh_channel_set_priority().
+ *
+ *                The socket options apply to the connections made after
+ *                they are set. They don't apply to SSH_OPTIONS_FD.
+ *
+ *              - SSH_OPTIONS_REKEY_DATA:
+ *                Renew the session keys after this many bytes were sent or
+ *                received with them (uint64_t, 0 = no limit, default 1 GB).
+ *                The keys are also renewed after 2^31 packets. The channels
+ *                keep running during the key exchange, their data is sent
+ *                with the new keys. See ssh_rekey().
+ *
+ *              - SSH_OPTIONS_REKEY_TIME:
+ *                Renew the session keys after this many seconds (unsigned
+ *                int, 0 = never, the default).
+ *
+ *              - SSH_OPTIONS_KEX_GUESS:
+ *                Send the first packet of the key exchange with the
+ *                SSH_MSG_KEXINIT, guessing that the server prefers the same
+ *                key exchange and host key methods as the client (int, 0 or
+ *                1, default 0). A right guess saves a round trip, a wrong
+ *                one is ignored by the server and costs a key pair. Useful
+ *                when the methods are set on both sides.
+ *
+ *              - SSH_OPTIONS_KEEPALIVE_INTERVAL:
+ *                Send a keepalive@openssh.com request when nothing came
+ *                from the peer for this many seconds (unsigned int, 0 =
+ *                never, the default). The requests are sent by the timers
+ *                of the session, from ssh_event_dopoll() or while the
+ *                session waits for packets, without blocking.
+ *
+ *              - SSH_OPTIONS_KEEPALIVE_MAX:
+ *                Give the peer up after this many keepalives without
+ *                anything coming (unsigned int, default 3). The socket is
+ *                closed at once, what was waiting to be sent is freed and
+ *                the channels are closed, the session is in error.
+ *
+ *              - SSH_OPTIONS_KEY_EXCHANGE:
+ *                Set the key exchange methods, in the order of preference
+ *                (const char *, comma-separated list), e.g.
+ *                "curve25519-sha256@libssh.org".
+ *
+ *              - SSH_OPTIONS_HOSTKEYS:
+ *                Set the host key algorithms the server may prove itself
+ *                with, in the order of preference (const char *,
+ *                comma-separated list), e.g. "ssh-ed25519,ssh-rsa".
+ *
  * @param  value The value to set. This is a generic pointer and the
  *               datatype which is used should be set according to the
  *               type set.
@@ -641,6 +1005,20 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
         session->compressionlevel=*x & 0xff;
       }
       break;
+    case SSH_OPTIONS_COMPRESSION_STRATEGY:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        int *x = (int *) value;
+        if (*x < SSH_COMPRESSION_STRATEGY_DEFAULT ||
+            *x > SSH_COMPRESSION_STRATEGY_RLE) {
+          ssh_set_error_invalid(session, __FUNCTION__);
+          return -1;
+        }
+        session->compressionstrategy = *x;
+      }
+      break;
     case SSH_OPTIONS_STRICTHOSTKEYCHECK:
       if (value == NULL) {
         ssh_set_error_invalid(session, __FUNCTION__);
@@ -662,6 +1040,167 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
         session->ProxyCommand = q;
       }
       break;
+    case SSH_OPTIONS_COMPRESSION_SKIP:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        q = strdup(value);
+        if (q == NULL) {
+          ssh_set_error_oom(session);
+          return -1;
+        }
+        SAFE_FREE(session->compression_skip);
+        session->compression_skip = q;
+      }
+      break;
+    case SSH_OPTIONS_READ_SIZE_MAX:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        unsigned int *x = (unsigned int *) value;
+        if (*x == 0) {
+          ssh_set_error_invalid(session, __FUNCTION__);
+          return -1;
+        }
+        session->read_size_max = *x;
+      }
+      break;
+    case SSH_OPTIONS_CHANNEL_BUFFER_SOFT_LIMIT:
+    case SSH_OPTIONS_CHANNEL_BUFFER_HARD_LIMIT:
+    case SSH_OPTIONS_SESSION_BUFFER_SOFT_LIMIT:
+    case SSH_OPTIONS_SESSION_BUFFER_HARD_LIMIT:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        unsigned int *x = (unsigned int *) value;
+        if (type == SSH_OPTIONS_CHANNEL_BUFFER_SOFT_LIMIT) {
+          session->channel_buffer_soft_limit = *x;
+        } else if (type == SSH_OPTIONS_CHANNEL_BUFFER_HARD_LIMIT) {
+          session->channel_buffer_hard_limit = *x;
+        } else if (type == SSH_OPTIONS_SESSION_BUFFER_SOFT_LIMIT) {
+          session->session_buffer_soft_limit = *x;
+        } else {
+          session->session_buffer_hard_limit = *x;
+        }
+      }
+      break;
+    case SSH_OPTIONS_TCP_PROFILE:
+    case SSH_OPTIONS_TCP_NODELAY:
+    case SSH_OPTIONS_TCP_SNDBUF:
+    case SSH_OPTIONS_TCP_RCVBUF:
+    case SSH_OPTIONS_TCP_KEEPALIVE:
+    case SSH_OPTIONS_TCP_NOTSENT_LOWAT:
+    case SSH_OPTIONS_CHANNEL_WINDOW:
+    case SSH_OPTIONS_CHANNEL_WINDOW_MAX:
+    case SSH_OPTIONS_CHANNEL_MAXPACKET:
+      if (ssh_tcp_options_set(&session->tcp, &session->channel_window,
+            &session->channel_window_max, &session->channel_maxpacket,
+            type, value) < 0) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      }
+      break;
+    case SSH_OPTIONS_CHANNEL_WINDOW_THRESHOLD:
+    case SSH_OPTIONS_CHANNEL_WINDOW_COALESCE:
+    case SSH_OPTIONS_CHANNEL_SCHEDULER:
+    case SSH_OPTIONS_KEX_GUESS:
+    case SSH_OPTIONS_COMPRESSION_ADAPTIVE:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        int *x = (int *) value;
+        if (type == SSH_OPTIONS_CHANNEL_WINDOW_COALESCE) {
+          session->channel_window_coalesce = *x ? 1 : 0;
+        } else if (type == SSH_OPTIONS_CHANNEL_SCHEDULER) {
+          session->channel_scheduler = *x ? 1 : 0;
+        } else if (type == SSH_OPTIONS_KEX_GUESS) {
+          session->kex_guess = *x ? 1 : 0;
+        } else if (type == SSH_OPTIONS_COMPRESSION_ADAPTIVE) {
+          session->compressionadaptive = *x ? 1 : 0;
+        } else if (*x < 1 || *x > 100) {
+          ssh_set_error_invalid(session, __FUNCTION__);
+          return -1;
+        } else {
+          session->channel_window_threshold = *x;
+        }
+      }
+      break;
+    case SSH_OPTIONS_REKEY_DATA:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        session->rekey_data = *(const uint64_t *) value;
+      }
+      break;
+    case SSH_OPTIONS_REKEY_TIME:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        unsigned int *x = (unsigned int *) value;
+        /* the timers count milliseconds in an unsigned int */
+        if (*x > UINT_MAX / 1000) {
+          ssh_set_error_invalid(session, __FUNCTION__);
+          return -1;
+        }
+        session->rekey_time = *x;
+      }
+      break;
+    case SSH_OPTIONS_KEEPALIVE_INTERVAL:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        unsigned int *x = (unsigned int *) value;
+        /* the timers count milliseconds in an unsigned int */
+        if (*x > UINT_MAX / 1000) {
+          ssh_set_error_invalid(session, __FUNCTION__);
+          return -1;
+        }
+        session->keepalive_interval = *x;
+        /* a connected session starts or stops probing now */
+        if (session->current_crypto != NULL &&
+            ssh_keepalive_start(session) < 0) {
+          return -1;
+        }
+      }
+      break;
+    case SSH_OPTIONS_KEEPALIVE_MAX:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      } else {
+        unsigned int *x = (unsigned int *) value;
+        if (*x == 0) {
+          ssh_set_error_invalid(session, __FUNCTION__);
+          return -1;
+        }
+        session->keepalive_max = *x;
+      }
+      break;
+    case SSH_OPTIONS_KEY_EXCHANGE:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      }
+      if (ssh_options_set_algo(session, SSH_KEX, value) < 0) {
+        return -1;
+      }
+      break;
+    case SSH_OPTIONS_HOSTKEYS:
+      if (value == NULL) {
+        ssh_set_error_invalid(session, __FUNCTION__);
+        return -1;
+      }
+      if (ssh_options_set_algo(session, SSH_HOSTKEYS, value) < 0) {
+        return -1;
+      }
+      break;
     default:
       ssh_set_error(session, SSH_REQUEST_DENIED, "Unknown ssh option %d", type);
       return -1;
@@ -1032,9 +1571,35 @@ static int ssh_bind_options_set_algo(ssh_bind sshbind, int algo,
  *                      SSH_BIND_OPTIONS_RSAKEY:
  *                        Set the path to the ssh host rsa key (string).
  *
+ *                      SSH_BIND_OPTIONS_ECDSAKEY:
+ *                        Set the path to the ssh host ecdsa key (string).
+ *
+ *                      SSH_BIND_OPTIONS_ED25519KEY:
+ *                        Set the path to the ssh host ed25519 key (string).
+ *
  *                      SSH_BIND_OPTIONS_BANNER:
  *                        Set the server banner sent to clients (string).
  *
+ *                      SSH_BIND_OPTIONS_TCP_PROFILE,
+ *                      SSH_BIND_OPTIONS_TCP_NODELAY,
+ *                      SSH_BIND_OPTIONS_TCP_SNDBUF,
+ *                      SSH_BIND_OPTIONS_TCP_RCVBUF,
+ *                      SSH_BIND_OPTIONS_TCP_KEEPALIVE,
+ *                      SSH_BIND_OPTIONS_TCP_NOTSENT_LOWAT,
+ *                      SSH_BIND_OPTIONS_CHANNEL_WINDOW,
+ *                      SSH_BIND_OPTIONS_CHANNEL_WINDOW_MAX,
+ *                      SSH_BIND_OPTIONS_CHANNEL_MAXPACKET:
+ *                        The same as the SSH_OPTIONS_TCP_* options and the
+ *                        SSH_OPTIONS_CHANNEL_* options of ssh_options_set(),
+ *                        for the accepted connections. The buffer sizes
+ *                        are also set on the listening socket, they must
+ *                        be set before ssh_bind_listen().
+ *
+ *                      SSH_BIND_OPTIONS_LISTEN:
+ *                        Add an address to listen on, "host:port",
+ *                        "[ipv6]:port" or the path of a unix socket
+ *                        (string). It replaces SSH_BIND_OPTIONS_BINDADDR.
+ *
  * @param  value        The value to set. This is a generic pointer and the
  *                      datatype which is used should be set according to the
  *                      type set.
@@ -1153,6 +1718,32 @@ int ssh_bind_options_set(ssh_bind sshbind, enum ssh_bind_options_e type,
         }
       }
       break;
+    case SSH_BIND_OPTIONS_ECDSAKEY:
+      if (value == NULL) {
+        ssh_set_error_invalid(sshbind, __FUNCTION__);
+        return -1;
+      } else {
+        SAFE_FREE(sshbind->ecdsakey);
+        sshbind->ecdsakey = strdup(value);
+        if (sshbind->ecdsakey == NULL) {
+          ssh_set_error_oom(sshbind);
+          return -1;
+        }
+      }
+      break;
+    case SSH_BIND_OPTIONS_ED25519KEY:
+      if (value == NULL) {
+        ssh_set_error_invalid(sshbind, __FUNCTION__);
+        return -1;
+      } else {
+        SAFE_FREE(sshbind->ed25519key);
+        sshbind->ed25519key = strdup(value);
+        if (sshbind->ed25519key == NULL) {
+          ssh_set_error_oom(sshbind);
+          return -1;
+        }
+      }
+      break;
     case SSH_BIND_OPTIONS_BANNER:
       if (value == NULL) {
         ssh_set_error_invalid(sshbind, __FUNCTION__);
@@ -1166,6 +1757,54 @@ int ssh_bind_options_set(ssh_bind sshbind, enum ssh_bind_options_e type,
         }
       }
       break;
+    case SSH_BIND_OPTIONS_REUSEPORT:
+      if (value == NULL) {
+        ssh_set_error_invalid(sshbind, __FUNCTION__);
+        return -1;
+      }
+      sshbind->reuseport = *(const int *) value ? 1 : 0;
+      break;
+    case SSH_BIND_OPTIONS_MAX_UNAUTHENTICATED:
+    case SSH_BIND_OPTIONS_RATE_LIMIT:
+    case SSH_BIND_OPTIONS_RATE_BURST:
+      if (value == NULL || *(const int *) value < 0) {
+        ssh_set_error_invalid(sshbind, __FUNCTION__);
+        return -1;
+      }
+      if (type == SSH_BIND_OPTIONS_MAX_UNAUTHENTICATED) {
+        sshbind->max_unauthenticated = *(const int *) value;
+      } else if (type == SSH_BIND_OPTIONS_RATE_LIMIT) {
+        sshbind->rate_limit = *(const int *) value;
+      } else {
+        sshbind->rate_burst = *(const int *) value;
+      }
+      break;
+    case SSH_BIND_OPTIONS_LISTEN:
+      if (value == NULL) {
+        ssh_set_error_invalid(sshbind, __FUNCTION__);
+        return -1;
+      }
+      if (ssh_bind_add_listener(sshbind, value) < 0) {
+        return -1;
+      }
+      break;
+    case SSH_BIND_OPTIONS_TCP_PROFILE:
+    case SSH_BIND_OPTIONS_TCP_NODELAY:
+    case SSH_BIND_OPTIONS_TCP_SNDBUF:
+    case SSH_BIND_OPTIONS_TCP_RCVBUF:
+    case SSH_BIND_OPTIONS_TCP_KEEPALIVE:
+    case SSH_BIND_OPTIONS_TCP_NOTSENT_LOWAT:
+    case SSH_BIND_OPTIONS_CHANNEL_WINDOW:
+    case SSH_BIND_OPTIONS_CHANNEL_WINDOW_MAX:
+    case SSH_BIND_OPTIONS_CHANNEL_MAXPACKET:
+      if (ssh_tcp_options_set(&sshbind->tcp, &sshbind->channel_window,
+            &sshbind->channel_window_max, &sshbind->channel_maxpacket,
+            SSH_OPTIONS_TCP_PROFILE + (type - SSH_BIND_OPTIONS_TCP_PROFILE),
+            value) < 0) {
+        ssh_set_error_invalid(sshbind, __FUNCTION__);
+        return -1;
+      }
+      break;
     default:
       ssh_set_error(sshbind, SSH_REQUEST_DENIED, "Unknown ssh option %d", type);
       return -1;
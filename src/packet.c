@@ -45,6 +45,8 @@
 #include "libssh/pcap.h"
 #include "libssh/kex.h"
 #include "libssh/auth.h"
+#include "libssh/probes.h"
+#include "libssh/pipeline.h"
 
 ssh_packet_callback default_packet_handlers[]= {
   ssh_packet_disconnect_callback,          // SSH2_MSG_DISCONNECT                 1
@@ -106,42 +108,51 @@ ssh_packet_callback default_packet_handlers[]= {
   ssh_packet_channel_failure,              // SSH2_MSG_CHANNEL_FAILURE            100
 };
 
-/* XXX include selected mac size */
-static int macsize=SHA_DIGEST_LEN;
-
 /* in nonblocking mode, socket_read will read as much as it can, and return */
 /* SSH_OK if it has read at least len bytes, otherwise, SSH_AGAIN. */
 /* in blocking mode, it will read at least len bytes and will block until it's ok. */
 
 /** @internal
- * @handles a data received event. It then calls the handlers for the different packet types
- * or and exception handler callback.
- * @param user pointer to current ssh_session
+ * @brief reads one packet from the received data and calls the handlers of
+ * its type.
+ * @param session current ssh_session
  * @param data pointer to the data received
- * @len length of data received. It might not be enough for a complete packet
- * @returns number of bytes read and processed.
+ * @param receivedlen length of data received. It might not be enough for a
+ * complete packet
+ * @param consumed pointer to store the number of bytes read and processed
+ * @returns 1 if a packet was processed, 0 if more data is needed, -1 on error.
  */
-int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user){
-  ssh_session session=(ssh_session) user;
-  unsigned int blocksize = (session->current_crypto ?
-      session->current_crypto->in_cipher->blocksize : 8);
-  int current_macsize = session->current_crypto ? macsize : 0;
-  unsigned char mac[30] = {0};
+static int ssh_packet_read_one(ssh_session session, const void *data,
+    size_t receivedlen, size_t *consumed){
+  struct crypto_struct *cipher = (session->current_crypto ?
+      session->current_crypto->in_cipher : NULL);
+  unsigned int blocksize = (cipher ? cipher->blocksize : 8);
+  struct ssh_hmac_struct *hmac = (session->current_crypto ?
+      session->current_crypto->in_mac : NULL);
+  /*
+   * the length field of AEAD and encrypt-then-mac packets is not
+   * encrypted with the rest of the packet
+   */
+  int aead = (cipher && cipher->tag_size > 0);
+  int etm = (!aead && hmac && hmac->etm);
+  unsigned int lenfield_blocksize = ((aead || etm) ? sizeof(uint32_t) : blocksize);
+  int current_macsize = cipher ?
+      (aead ? (int) cipher->tag_size : (hmac ? (int) hmac->size : 0)) : 0;
   char buffer[16] = {0};
-  void *packet=NULL;
+  unsigned char *packet=NULL;
+  void *payload;
   int to_be_read;
-  int rc;
   uint32_t len;
   uint8_t padding;
-  size_t processed=0; /* number of byte processed from the callback */
+  size_t processed=0; /* number of byte processed from the data */
+  uint64_t start = 0;
 
-  enter_function();
+  *consumed = 0;
 
   switch(session->packet_state) {
     case PACKET_STATE_INIT:
-    	if(receivedlen < blocksize){
+    	if(receivedlen < lenfield_blocksize){
     		/* We didn't receive enough data to read at least one block size, give up */
-    		leave_function();
     		return 0;
     	}
       memset(&session->in_packet, 0, sizeof(PACKET));
@@ -155,14 +166,23 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
         if (session->in_buffer == NULL) {
           goto error;
         }
+        buffer_set_secure(session->in_buffer);
       }
 
-      memcpy(buffer,data,blocksize);
-      processed += blocksize;
-      len = packet_decrypt_len(session, buffer);
-
-      if (buffer_add_data(session->in_buffer, buffer, blocksize) < 0) {
-        goto error;
+      memcpy(buffer,data,lenfield_blocksize);
+      if (aead) {
+        if (cipher->aead_decrypt_length(cipher, buffer, (unsigned char *) &len,
+              sizeof(uint32_t), session->recv_seq) < 0) {
+          ssh_set_error(session, SSH_FATAL, "Decrypt error");
+          goto error;
+        }
+        /* the tag covers the length as received */
+        len = ntohl(len);
+      } else if (etm) {
+        memcpy(&len, buffer, sizeof(uint32_t));
+        len = ntohl(len);
+      } else {
+        len = packet_decrypt_len(session, buffer);
       }
 
       if(len > MAX_PACKET_LEN) {
@@ -170,8 +190,33 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
             "read_packet(): Packet len too high(%u %.4x)", len, len);
         goto error;
       }
+      if ((aead || etm) && len % blocksize != 0) {
+        ssh_set_error(session, SSH_FATAL,
+            "read_packet(): Packet len not a multiple of the block size (%u)",
+            len);
+        goto error;
+      }
 
-      to_be_read = len - blocksize + sizeof(uint32_t);
+      if (aead || etm) {
+        /*
+         * The length can be read again without changing the cipher state, so
+         * nothing is consumed until the whole packet is in the socket buffer.
+         * It is then authenticated and decrypted from there.
+         */
+        if (receivedlen < sizeof(uint32_t) + len + current_macsize) {
+          return 0;
+        }
+      } else {
+        processed += lenfield_blocksize;
+      }
+
+      /* the size is known, the whole packet gets a single allocation */
+      if (buffer_ensure(session->in_buffer, sizeof(uint32_t) + len) < 0 ||
+          buffer_add_data(session->in_buffer, buffer, lenfield_blocksize) < 0) {
+        goto error;
+      }
+
+      to_be_read = len - lenfield_blocksize + sizeof(uint32_t);
       if (to_be_read < 0) {
         /* remote sshd sends invalid sizes? */
         ssh_set_error(session, SSH_FATAL,
@@ -184,47 +229,102 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
       session->packet_state = PACKET_STATE_SIZEREAD;
     case PACKET_STATE_SIZEREAD:
       len = session->in_packet.len;
-      to_be_read = len - blocksize + sizeof(uint32_t) + current_macsize;
-      /* if to_be_read is zero, the whole packet was blocksize bytes. */
-      if (to_be_read != 0) {
-        if(receivedlen - processed < (unsigned int)to_be_read){
-        	/* give up, not enough data in buffer */
-        	return processed;
+      if (session->current_crypto) {
+        start = ssh_timestamp_us();
+      }
+      if (aead || etm) {
+        /* the whole packet is at the beginning of data, see above */
+        packet = (unsigned char *) data;
+        SSH_LOG(session,SSH_LOG_PACKET,"Read a %d bytes packet",len);
+
+        payload = buffer_allocate(session->in_buffer, len);
+        if (payload == NULL) {
+          goto error;
+        }
+        if (aead) {
+          /* verify the tag, then decrypt the packet after its length */
+          SSH_PROBE2(decrypt, session, len);
+          if (!pipeline_take(session, packet, len, payload) &&
+              cipher->aead_decrypt(cipher, packet, payload, len,
+                packet + sizeof(uint32_t) + len, session->recv_seq) < 0) {
+            ssh_set_error(session, SSH_FATAL, "Packet authentication error");
+            goto error;
+          }
+        } else {
+          /* reject a forged packet before decrypting anything */
+          if (packet_hmac_verify(session, packet, sizeof(uint32_t) + len,
+                packet + sizeof(uint32_t) + len) < 0) {
+            ssh_set_error(session, SSH_FATAL, "HMAC error");
+            goto error;
+          }
+          if (packet_decrypt_to(session, payload, packet + sizeof(uint32_t),
+                len) < 0) {
+            ssh_set_error(session, SSH_FATAL, "Decrypt error");
+            goto error;
+          }
         }
+        processed = sizeof(uint32_t) + len + current_macsize;
+      } else {
+        to_be_read = len - lenfield_blocksize + sizeof(uint32_t) + current_macsize;
+        /* if to_be_read is zero, the whole packet was blocksize bytes. */
+        if (to_be_read != 0) {
+          if(receivedlen - processed < (unsigned int)to_be_read){
+            /* give up, not enough data in buffer */
+            *consumed = processed;
+            return 0;
+          }
 
-        packet = (unsigned char *)data + processed;
-//        ssh_socket_read(session->socket,packet,to_be_read-current_macsize);
+          packet = (unsigned char *)data + processed;
 
-        ssh_log(session,SSH_LOG_PACKET,"Read a %d bytes packet",len);
+          SSH_LOG(session,SSH_LOG_PACKET,"Read a %d bytes packet",len);
 
-        if (buffer_add_data(session->in_buffer, packet,
-              to_be_read - current_macsize) < 0) {
-          goto error;
+          if (session->current_crypto) {
+            /*
+             * decrypt the rest of the packet (blocksize bytes already
+             * have been decrypted) straight from the socket buffer
+             */
+            payload = buffer_allocate(session->in_buffer,
+                to_be_read - current_macsize);
+            if (payload == NULL) {
+              goto error;
+            }
+            if (packet_decrypt_to(session, payload, packet,
+                  to_be_read - current_macsize) < 0) {
+              ssh_set_error(session, SSH_FATAL, "Decrypt error");
+              goto error;
+            }
+          } else if (buffer_add_data(session->in_buffer, packet,
+                to_be_read - current_macsize) < 0) {
+            goto error;
+          }
+          processed += to_be_read - current_macsize;
         }
-        processed += to_be_read - current_macsize;
-      }
 
-      if (session->current_crypto) {
-        /*
-         * decrypt the rest of the packet (blocksize bytes already
-         * have been decrypted)
-         */
-        if (packet_decrypt(session,
-              ((uint8_t*)buffer_get_rest(session->in_buffer) + blocksize),
-              buffer_get_rest_len(session->in_buffer) - blocksize) < 0) {
-          ssh_set_error(session, SSH_FATAL, "Decrypt error");
-          goto error;
+        if (session->current_crypto) {
+          /* the mac is the last part of the packet in the socket buffer */
+          if (packet_hmac_verify(session,
+                buffer_get_rest(session->in_buffer),
+                buffer_get_rest_len(session->in_buffer),
+                packet + to_be_read - current_macsize) < 0) {
+            ssh_set_error(session, SSH_FATAL, "HMAC error");
+            goto error;
+          }
+          processed += current_macsize;
         }
-        /* copy the last part from the incoming buffer */
-        memcpy(mac,(unsigned char *)packet + to_be_read - current_macsize, macsize);
+      }
 
-        if (packet_hmac_verify(session, session->in_buffer, mac) < 0) {
-          ssh_set_error(session, SSH_FATAL, "HMAC error");
-          goto error;
-        }
-        processed += current_macsize;
+      if (start != 0) {
+        session->stats.crypto_us += ssh_timestamp_us() - start;
       }
 
+#ifdef WITH_PCAP
+      if (session->pcap_ctx) {
+        ssh_pcap_context_write(session->pcap_ctx, SSH_PCAP_DIR_IN,
+            buffer_get_rest(session->in_buffer),
+            buffer_get_rest_len(session->in_buffer),
+            buffer_get_rest_len(session->in_buffer));
+      }
+#endif
       /* skip the size field which has been processed before */
       buffer_pass_bytes(session->in_buffer, sizeof(uint32_t));
 
@@ -233,10 +333,6 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
         goto error;
       }
 
-      ssh_log(session, SSH_LOG_PACKET,
-          "%hhd bytes padding, %d bytes left in buffer",
-          padding, buffer_get_rest_len(session->in_buffer));
-
       if (padding > buffer_get_rest_len(session->in_buffer)) {
         ssh_set_error(session, SSH_FATAL,
             "Invalid padding: %d (%d resting)",
@@ -250,37 +346,35 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
         goto error;
       }
       buffer_pass_bytes_end(session->in_buffer, padding);
-
-      ssh_log(session, SSH_LOG_PACKET,
-          "After padding, %d bytes left in buffer",
-          buffer_get_rest_len(session->in_buffer));
 #if defined(HAVE_LIBZ) && defined(WITH_LIBZ)
       if (session->current_crypto && session->current_crypto->do_compress_in) {
-        ssh_log(session, SSH_LOG_PACKET, "Decompressing in_buffer ...");
+        SSH_LOG(session, SSH_LOG_PACKET, "Decompressing in_buffer ...");
         if (decompress_buffer(session, session->in_buffer,MAX_PACKET_LEN) < 0) {
           goto error;
         }
       }
 #endif
       session->recv_seq++;
+      session->kex_bytes += len;
+      session->kex_packets++;
+      session->stats.bytes_in += sizeof(uint32_t) + len + current_macsize;
+      session->stats.packets_in++;
       /* We don't want to rewrite a new packet while still executing the packet callbacks */
       session->packet_state = PACKET_STATE_PROCESSING;
       ssh_packet_parse_type(session);
+      SSH_PROBE3(packet_recv, session, session->in_packet.type, len);
+      SSH_LOG_EVENT(session, SSH_LOG_PACKET, SSH_LOG_EVENT_PACKET_READ,
+          (unsigned int) session->in_packet.type, (unsigned int) len,
+          (unsigned int) padding);
       /* execute callbacks */
       ssh_packet_process(session, session->in_packet.type);
       session->packet_state = PACKET_STATE_INIT;
-      if(processed < receivedlen){
-      	/* Handle a potential packet left in socket buffer */
-      	ssh_log(session,SSH_LOG_PACKET,"Processing %" PRIdS " bytes left in socket buffer",
-      			receivedlen-processed);
-      	rc = ssh_packet_socket_callback((char *)data + processed,
-      			receivedlen - processed,user);
-      	processed += rc;
-      }
-      leave_function();
-      return processed;
+      *consumed = processed;
+      return 1;
     case PACKET_STATE_PROCESSING:
-    	ssh_log(session, SSH_LOG_RARE, "Nested packet processing. Delaying.");
+    	/* the socket keeps the data read by a nested poll aside and gives it
+    	 * back as soon as the outer callback returns */
+    	SSH_LOG(session, SSH_LOG_RARE, "Nested packet processing. Delaying.");
     	return 0;
   }
 
@@ -289,14 +383,77 @@ int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user)
       session->packet_state);
 
 error:
+  *consumed = processed;
+  return -1;
+}
+
+/** @internal
+ * @handles a data received event. It then calls the handlers for the different packet types
+ * or and exception handler callback.
+ * @param user pointer to current ssh_session
+ * @param data pointer to the data received
+ * @len length of data received. It might not be enough for a complete packet
+ * @returns number of bytes read and processed.
+ */
+int ssh_packet_socket_callback(const void *data, size_t receivedlen, void *user){
+  ssh_session session=(ssh_session) user;
+  size_t processed=0;
+  size_t consumed;
+  uint32_t packets=0;
+  int pipelined;
+  int rc;
+
+  enter_function();
+  /* with a crypto pool, the packets of the data are decrypted at once */
+  pipelined = pipeline_receive(session, data, receivedlen);
+  /*
+   * Drain all the complete packets of the data. The cipher is looked up
+   * again for each one, a packet may have changed the keys.
+   */
+  do {
+    rc = ssh_packet_read_one(session, (const char *)data + processed,
+        receivedlen - processed, &consumed);
+    processed += consumed;
+    if (rc <= 0) {
+      break;
+    }
+    packets++;
+  } while (processed < receivedlen);
+  if (pipelined) {
+    pipeline_received(session);
+  }
+
+  if (packets > 1) {
+    SSH_LOG(session, SSH_LOG_PACKET, "Processed %u packets at once", packets);
+  }
+  /* one adjust per channel for all the data of the read */
+  ssh_channels_flush_windows(session);
+  ssh_kex_rekey_check(session);
+  if (packets > 0) {
+    session->in_packets_last = packets;
+    if (packets > session->in_packets_max) {
+      session->in_packets_max = packets;
+    }
+  }
   leave_function();
   return processed;
 }
 
+/* the socket has written its buffer: the channel queues can go on */
+static void ssh_packet_socket_controlflow(int code, void *userdata){
+	ssh_session session=userdata;
+
+	if(code == SSH_SOCKET_FLOW_WRITEWONTBLOCK){
+		ssh_kex_rekey_check(session);
+		ssh_channels_schedule(session);
+		ssh_channels_writable(session, NULL);
+	}
+}
+
 void ssh_packet_register_socket_callback(ssh_session session, ssh_socket s){
 	session->socket_callbacks.data=ssh_packet_socket_callback;
 	session->socket_callbacks.connected=NULL;
-	session->socket_callbacks.controlflow=NULL;
+	session->socket_callbacks.controlflow=ssh_packet_socket_controlflow;
 	session->socket_callbacks.exception=NULL;
 	session->socket_callbacks.userdata=session;
 	ssh_socket_set_callbacks(s,&session->socket_callbacks);
@@ -310,6 +467,7 @@ void ssh_packet_set_callbacks(ssh_session session, ssh_packet_callbacks callback
 		session->packet_callbacks = ssh_list_new();
 	}
   ssh_list_append(session->packet_callbacks, callbacks);
+  session->packet_dispatch_valid = 0;
 }
 
 /** @internal
@@ -329,21 +487,86 @@ void ssh_packet_set_default_callbacks(ssh_session session){
 	ssh_packet_set_callbacks(session, &session->default_packet_callbacks);
 }
 
+/*
+ * builds the table of the first callbacks of each packet type, in the order
+ * of packet_callbacks, once they changed
+ */
+static int ssh_packet_dispatch_build(ssh_session session) {
+  struct ssh_iterator *i;
+  ssh_packet_callbacks cb;
+  unsigned int type;
+
+  if (session->packet_dispatch == NULL) {
+    session->packet_dispatch = malloc(256 * sizeof(ssh_packet_callbacks));
+    if (session->packet_dispatch == NULL) {
+      return SSH_ERROR;
+    }
+  }
+  memset(session->packet_dispatch, 0, 256 * sizeof(ssh_packet_callbacks));
+  for (i = ssh_list_get_iterator(session->packet_callbacks); i != NULL;
+      i = i->next) {
+    cb = ssh_iterator_value(ssh_packet_callbacks, i);
+    if (cb == NULL) {
+      continue;
+    }
+    for (type = cb->start; type < cb->start + cb->n_callbacks && type < 256;
+        type++) {
+      if (session->packet_dispatch[type] == NULL &&
+          cb->callbacks[type - cb->start] != NULL) {
+        session->packet_dispatch[type] = cb;
+      }
+    }
+  }
+  session->packet_dispatch_valid = 1;
+
+  return SSH_OK;
+}
+
 /** @internal
  * @brief dispatch the call of packet handlers callbacks for a received packet
+ *
+ * The first callback of the type is found in a table, the channel data of a
+ * transfer go straight to it. The list of callbacks is only walked when a
+ * callback doesn't use its packet, from the next one on.
+ *
  * @param type type of packet
  */
 void ssh_packet_process(ssh_session session, uint8_t type){
 	struct ssh_iterator *i;
 	int r=SSH_PACKET_NOT_USED;
 	ssh_packet_callbacks cb;
+	ssh_packet_callbacks first = NULL;
 	enter_function();
-	ssh_log(session,SSH_LOG_PACKET, "Dispatching handler for packet type %d",type);
+	SSH_LOG(session,SSH_LOG_PACKET, "Dispatching handler for packet type %d",type);
+	/* the peer is alive, see SSH_OPTIONS_KEEPALIVE_INTERVAL */
+	session->keepalive_received = 1;
 	if(session->packet_callbacks == NULL){
-		ssh_log(session,SSH_LOG_RARE,"Packet callback is not initialized !");
+		SSH_LOG(session,SSH_LOG_RARE,"Packet callback is not initialized !");
 		goto error;
 	}
-	i=ssh_list_get_iterator(session->packet_callbacks);
+	if (session->packet_dispatch_valid ||
+	    ssh_packet_dispatch_build(session) == SSH_OK) {
+	  first = session->packet_dispatch[type];
+	  if (first == NULL) {
+	    goto unused;
+	  }
+	  r = first->callbacks[type - first->start](session, type,
+	      session->in_buffer, first->user);
+	  if (r == SSH_PACKET_USED) {
+	    goto error;
+	  }
+	}
+	/* the first callback may have disconnected the session */
+	i = session->packet_callbacks != NULL ?
+	    ssh_list_get_iterator(session->packet_callbacks) : NULL;
+	/* the callbacks following the first one */
+	while (first != NULL && i != NULL) {
+	  cb = ssh_iterator_value(ssh_packet_callbacks, i);
+	  i = i->next;
+	  if (cb == first) {
+	    break;
+	  }
+	}
 	while(i != NULL){
 		cb=ssh_iterator_value(ssh_packet_callbacks,i);
 		i=i->next;
@@ -359,8 +582,9 @@ void ssh_packet_process(ssh_session session, uint8_t type){
 		if(r==SSH_PACKET_USED)
 			break;
 	}
+unused:
 	if(r==SSH_PACKET_NOT_USED){
-		ssh_log(session,SSH_LOG_RARE,"Couldn't do anything with packet type %d",type);
+		SSH_LOG(session,SSH_LOG_RARE,"Couldn't do anything with packet type %d",type);
 		ssh_packet_send_unimplemented(session, session->recv_seq-1);
 	}
 error:
@@ -392,7 +616,7 @@ SSH_PACKET_CALLBACK(ssh_packet_unimplemented){
   (void)user;
   buffer_get_u32(packet,&seq);
   seq=ntohl(seq);
-  ssh_log(session,SSH_LOG_RARE,
+  SSH_LOG(session,SSH_LOG_RARE,
       "Received SSH_MSG_UNIMPLEMENTED (sequence number %d)",seq);
   return SSH_PACKET_USED;
 }
@@ -409,7 +633,7 @@ int ssh_packet_parse_type(ssh_session session) {
     return SSH_ERROR;
   }
 
-  ssh_log(session, SSH_LOG_PACKET, "Final size %d",
+  SSH_LOG(session, SSH_LOG_PACKET, "Final size %d",
       buffer_get_rest_len(session->in_buffer));
 
   if(buffer_get_u8(session->in_buffer, &session->in_packet.type) == 0) {
@@ -418,7 +642,7 @@ int ssh_packet_parse_type(ssh_session session) {
     return SSH_ERROR;
   }
 
-  ssh_log(session, SSH_LOG_PACKET, "Type %hhd", session->in_packet.type);
+  SSH_LOG(session, SSH_LOG_PACKET, "Type %hhd", session->in_packet.type);
   session->in_packet.valid = 1;
 
   leave_function();
@@ -429,62 +653,220 @@ int ssh_packet_parse_type(ssh_session session) {
  * This function places the outgoing packet buffer into an outgoing
  * socket buffer
  */
-static int ssh_packet_write(ssh_session session) {
+/*
+ * writes the packet of out_buffer followed by its mac, which is left where
+ * packet_encrypt() computed it
+ */
+static int ssh_packet_write(ssh_session session, unsigned char *mac,
+    unsigned int maclen) {
+  struct iovec iov[2];
   int rc = SSH_ERROR;
 
   enter_function();
 
-  rc=ssh_socket_write(session->socket,
-      buffer_get_rest(session->out_buffer),
-      buffer_get_rest_len(session->out_buffer));
+  iov[0].iov_base = buffer_get_rest(session->out_buffer);
+  iov[0].iov_len = buffer_get_rest_len(session->out_buffer);
+  iov[1].iov_base = mac;
+  iov[1].iov_len = maclen;
+  rc = ssh_socket_writev(session->socket, iov, mac != NULL ? 2 : 1);
   leave_function();
   return rc;
 }
 
-static int packet_send2(ssh_session session) {
+/*
+ * takes len random padding bytes from the pool of the session, which
+ * saves a call to the random generator for each packet
+ */
+static void packet_get_padding(ssh_session session, char *padstring,
+    uint8_t len) {
+  unsigned int pool_size = sizeof(session->padding_pool);
+
+  if (session->padding_pool_left < len) {
+    ssh_get_random(session->padding_pool, pool_size, 0);
+    session->padding_pool_left = pool_size;
+  }
+  memcpy(padstring, session->padding_pool +
+      (pool_size - session->padding_pool_left), len);
+  session->padding_pool_left -= len;
+}
+
+/*
+ * returns the number of padding bytes of a packet with a payload of len
+ * bytes, and fills padstring with them
+ */
+static uint8_t packet_padding(ssh_session session, uint32_t len,
+    char *padstring) {
   unsigned int blocksize = (session->current_crypto ?
       session->current_crypto->out_cipher->blocksize : 8);
+  unsigned int tag_size = (session->current_crypto ?
+      session->current_crypto->out_cipher->tag_size : 0);
+  struct ssh_hmac_struct *hmac_type = (session->current_crypto ?
+      session->current_crypto->out_mac : NULL);
+  uint8_t padding;
+
+  if (tag_size > 0 || (hmac_type && hmac_type->etm)) {
+    /* the length field of these packets is not part of the padded data */
+    padding = (blocksize - ((len + 1) % blocksize));
+  } else {
+    padding = (blocksize - ((len + 5) % blocksize));
+  }
+  if(padding < 4) {
+    padding += blocksize;
+  }
+
+  if (session->current_crypto) {
+    packet_get_padding(session, padstring, padding);
+  } else {
+    memset(padstring,0,padding);
+  }
+
+  return padding;
+}
+
+/* returns the size of the mac or tag following the packets */
+static unsigned int packet_mac_size(ssh_session session) {
+  if (session->current_crypto == NULL) {
+    return 0;
+  }
+  if (session->current_crypto->out_cipher->tag_size > 0) {
+    return session->current_crypto->out_cipher->tag_size;
+  }
+  return session->current_crypto->out_mac->size;
+}
+
+/* the fill callback of packet_send_payload(): the data is in memory */
+static int packet_fill_copy(void *dest, uint32_t len, void *userdata) {
+  memcpy(dest, userdata, len);
+  return 0;
+}
+
+/*
+ * Once a key re-exchange started, only its own messages can be sent until
+ * SSH2_MSG_NEWKEYS (RFC 4253 section 7.1). The keys of both directions
+ * change at once when the one of the peer is received, so everything else
+ * waits for the new keys.
+ */
+static int packet_is_held(ssh_session session, uint8_t type) {
+  return session->rekey_state != SSH_REKEY_STATE_NONE &&
+    (type < SSH2_MSG_KEXINIT || type >= 50);
+}
+
+/* keeps a payload for packet_flush_held(), as its length and its bytes */
+static int packet_hold(ssh_session session, const void *header,
+    uint32_t header_len, uint32_t len, packet_fill_callback fill,
+    void *userdata) {
+  void *data;
+
+  if (session->rekey_held == NULL) {
+    session->rekey_held = ssh_buffer_new();
+    if (session->rekey_held == NULL) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+    buffer_set_secure(session->rekey_held);
+  }
+
+  if (buffer_add_u32(session->rekey_held, htonl(header_len + len)) < 0 ||
+      buffer_add_data(session->rekey_held, header, header_len) < 0 ||
+      (data = buffer_allocate(session->rekey_held, len)) == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  if (fill(data, len, userdata) < 0) {
+    buffer_pass_bytes_end(session->rekey_held,
+        sizeof(uint32_t) + header_len + len);
+    return SSH_ERROR;
+  }
+  SSH_LOG(session, SSH_LOG_PACKET,
+      "Holding a packet of type %d until the new keys",
+      *(const uint8_t *) header);
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief sends the packets held during a key re-exchange, with the new keys
+ */
+int packet_flush_held(ssh_session session) {
+  ssh_buffer held = session->rekey_held;
+  unsigned char *payload;
+  uint32_t len;
+  int rc;
+
+  if (held == NULL) {
+    return SSH_OK;
+  }
+
+  while (buffer_get_u32(held, &len) == sizeof(uint32_t)) {
+    len = ntohl(len);
+    payload = buffer_get_rest(held);
+    rc = packet_send_payload(session, payload, 1, payload + 1, len - 1);
+    buffer_pass_bytes(held, len);
+    if (rc == SSH_ERROR) {
+      return SSH_ERROR;
+    }
+  }
+  buffer_reinit(held);
+
+  return SSH_OK;
+}
+
+static int packet_send2(ssh_session session) {
+  unsigned int tag_size = (session->current_crypto ?
+      session->current_crypto->out_cipher->tag_size : 0);
+  struct ssh_hmac_struct *hmac_type = (session->current_crypto ?
+      session->current_crypto->out_mac : NULL);
+  int aead = (tag_size > 0);
   uint32_t currentlen = buffer_get_rest_len(session->out_buffer);
+  uint8_t type = *(uint8_t *) buffer_get_rest(session->out_buffer);
   unsigned char *hmac = NULL;
   char padstring[32] = {0};
+  unsigned char header[5];
   int rc = SSH_ERROR;
   uint32_t finallen;
+  uint32_t maclen;
   uint8_t padding;
+  uint64_t start = 0;
 
   enter_function();
 
-  ssh_log(session, SSH_LOG_PACKET,
+  /* the packets kept for the crypto pool go first */
+  if (pipeline_flush(session) == SSH_ERROR) {
+    leave_function();
+    return SSH_ERROR;
+  }
+
+  if (packet_is_held(session, type)) {
+    rc = packet_hold(session, buffer_get_rest(session->out_buffer), currentlen,
+        0, packet_fill_copy, NULL);
+    buffer_reinit(session->out_buffer);
+    leave_function();
+    return rc;
+  }
+
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Writing on the wire a packet having %u bytes before", currentlen);
 
 #if defined(HAVE_LIBZ) && defined(WITH_LIBZ)
   if (session->current_crypto && session->current_crypto->do_compress_out) {
-    ssh_log(session, SSH_LOG_PACKET, "Compressing out_buffer ...");
+    SSH_LOG(session, SSH_LOG_PACKET, "Compressing out_buffer ...");
     if (compress_buffer(session,session->out_buffer) < 0) {
       goto error;
     }
     currentlen = buffer_get_rest_len(session->out_buffer);
   }
 #endif
-  padding = (blocksize - ((currentlen +5) % blocksize));
-  if(padding < 4) {
-    padding += blocksize;
-  }
-
-  if (session->current_crypto) {
-    ssh_get_random(padstring, padding, 0);
-  } else {
-    memset(padstring,0,padding);
-  }
+  padding = packet_padding(session, currentlen, padstring);
 
   finallen = htonl(currentlen + padding + 1);
-  ssh_log(session, SSH_LOG_PACKET,
-      "%d bytes after comp + %d padding bytes = %lu bytes packet",
-      currentlen, padding, (long unsigned int) ntohl(finallen));
+  SSH_LOG_EVENT(session, SSH_LOG_PACKET, SSH_LOG_EVENT_PACKET_WRITE,
+      (unsigned int) currentlen, (unsigned int) padding,
+      (unsigned int) ntohl(finallen));
 
-  if (buffer_prepend_data(session->out_buffer, &padding, sizeof(uint8_t)) < 0) {
-    goto error;
-  }
-  if (buffer_prepend_data(session->out_buffer, &finallen, sizeof(uint32_t)) < 0) {
+  /* the length and the padding length are prepended at once */
+  memcpy(header, &finallen, sizeof(uint32_t));
+  header[sizeof(uint32_t)] = padding;
+  if (buffer_prepend_data(session->out_buffer, header, sizeof(header)) < 0) {
     goto error;
   }
   if (buffer_add_data(session->out_buffer, padstring, padding) < 0) {
@@ -497,16 +879,23 @@ static int packet_send2(ssh_session session) {
   			,buffer_get_rest_len(session->out_buffer));
   }
 #endif
+  if (session->current_crypto) {
+    start = ssh_timestamp_us();
+  }
   hmac = packet_encrypt(session, buffer_get_rest(session->out_buffer),
       buffer_get_rest_len(session->out_buffer));
-  if (hmac) {
-    if (buffer_add_data(session->out_buffer, hmac, 20) < 0) {
-      goto error;
-    }
+  if (start != 0) {
+    session->stats.crypto_us += ssh_timestamp_us() - start;
   }
+  maclen = hmac ? (aead ? tag_size : hmac_type->size) : 0;
 
-  rc = ssh_packet_write(session);
+  rc = ssh_packet_write(session, hmac, maclen);
   session->send_seq++;
+  session->kex_bytes += ntohl(finallen);
+  session->kex_packets++;
+  session->stats.bytes_out += sizeof(uint32_t) + ntohl(finallen) + maclen;
+  session->stats.packets_out++;
+  SSH_PROBE3(packet_send, session, type, ntohl(finallen));
 
   if (buffer_reinit(session->out_buffer) < 0) {
     rc = SSH_ERROR;
@@ -516,6 +905,166 @@ error:
   return rc; /* SSH_OK, AGAIN or ERROR */
 }
 
+/** @internal
+ * @brief sends a packet made of a header and of data
+ *
+ * When the write would be buffered by the socket anyway, the packet is
+ * built and encrypted directly at the tail of the socket output buffer, so
+ * the data is copied once instead of going through session->out_buffer.
+ * Otherwise, this is the same as adding both to session->out_buffer and
+ * calling packet_send().
+ *
+ * @param[in]  session     The session to send the packet on.
+ *
+ * @param[in]  header      The start of the payload (type, channel, ...).
+ *
+ * @param[in]  header_len  The length of the header.
+ *
+ * @param[in]  data        The data following the header.
+ *
+ * @param[in]  len         The length of the data.
+ *
+ * @return SSH_OK, SSH_AGAIN or SSH_ERROR like packet_send().
+ */
+int packet_send_payload(ssh_session session, const void *header,
+    uint32_t header_len, const void *data, uint32_t len) {
+  return packet_send_payload_fill(session, header, header_len, len,
+      packet_fill_copy, (void *) data);
+}
+
+/** @internal
+ * @brief sends a packet made of a header and of data produced in place
+ *
+ * This is packet_send_payload(), with the data written by fill where the
+ * packet is built: the socket buffer, or session->out_buffer when it can't
+ * be used. During a bulk write with a crypto pool, the packet is kept
+ * in the pipeline of the session instead, see pipeline_reserve(). Nothing
+ * is sent if fill fails.
+ *
+ * @param[in]  session     The session to send the packet on.
+ *
+ * @param[in]  header      The start of the payload (type, channel, ...).
+ *
+ * @param[in]  header_len  The length of the header.
+ *
+ * @param[in]  len         The length of the data following the header.
+ *
+ * @param[in]  fill        Writes the len bytes of data, returns 0 or -1.
+ *
+ * @param[in]  userdata    Userdata of fill.
+ *
+ * @return SSH_OK, SSH_AGAIN or SSH_ERROR like packet_send(), SSH_ERROR
+ *         without an error set if fill fails.
+ */
+int packet_send_payload_fill(ssh_session session, const void *header,
+    uint32_t header_len, uint32_t len, packet_fill_callback fill,
+    void *userdata) {
+  unsigned int maclen = packet_mac_size(session);
+  char padstring[32] = {0};
+  unsigned char *hmac;
+  unsigned char *packet;
+  uint32_t packet_len;
+  uint32_t finallen;
+  uint8_t padding;
+  uint64_t start = 0;
+  int staged = 0;
+  int rc = SSH_OK;
+  void *data;
+
+  if (session->version == 2 &&
+      packet_is_held(session, *(const uint8_t *) header)) {
+    return packet_hold(session, header, header_len, len, fill, userdata);
+  }
+
+  packet = NULL;
+  if (session->version == 2 && buffer_get_rest_len(session->out_buffer) == 0) {
+    /* kept for the crypto pool during a bulk write */
+    packet = pipeline_reserve(session,
+        5 + header_len + len + sizeof(padstring) + maclen);
+    staged = (packet != NULL);
+  }
+  if (packet == NULL && pipeline_flush(session) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+  if (packet == NULL && session->version == 2 &&
+      buffer_get_rest_len(session->out_buffer) == 0
+#if defined(HAVE_LIBZ) && defined(WITH_LIBZ)
+      && !(session->current_crypto && session->current_crypto->do_compress_out)
+#endif
+      ) {
+    /* packet_padding() never needs more than padstring */
+    packet = ssh_socket_reserve(session->socket,
+        5 + header_len + len + sizeof(padstring) + maclen);
+  }
+  if (packet == NULL) {
+    if (buffer_add_data(session->out_buffer, header, header_len) < 0 ||
+        (data = buffer_allocate(session->out_buffer, len)) == NULL) {
+      ssh_set_error_oom(session);
+      buffer_reinit(session->out_buffer);
+      return SSH_ERROR;
+    }
+    if (fill(data, len, userdata) < 0) {
+      buffer_reinit(session->out_buffer);
+      return SSH_ERROR;
+    }
+    return packet_send(session);
+  }
+
+  /* nothing is committed if the data can't be produced */
+  if (fill(packet + 5 + header_len, len, userdata) < 0) {
+    return SSH_ERROR;
+  }
+
+  enter_function();
+  padding = packet_padding(session, header_len + len, padstring);
+  packet_len = 5 + header_len + len + padding;
+  finallen = htonl(packet_len - 4);
+  SSH_LOG(session, SSH_LOG_PACKET,
+      "Building in %s a packet of %u bytes (%d padding bytes)",
+      staged ? "the pipeline" : "the socket buffer",
+      packet_len, padding);
+
+  memcpy(packet, &finallen, sizeof(uint32_t));
+  packet[4] = padding;
+  memcpy(packet + 5, header, header_len);
+  memcpy(packet + 5 + header_len + len, padstring, padding);
+#ifdef WITH_PCAP
+  if(session->pcap_ctx){
+    ssh_pcap_context_write(session->pcap_ctx, SSH_PCAP_DIR_OUT,
+        packet, packet_len, packet_len);
+  }
+#endif
+  if (staged) {
+    /* encrypted with the next ones, its tag is written after it */
+    rc = pipeline_commit(session, packet_len, maclen);
+    packet_len += maclen;
+  } else {
+    if (session->current_crypto) {
+      start = ssh_timestamp_us();
+    }
+    hmac = packet_encrypt(session, packet, packet_len);
+    if (start != 0) {
+      session->stats.crypto_us += ssh_timestamp_us() - start;
+    }
+    if (hmac != NULL) {
+      memcpy(packet + packet_len, hmac, maclen);
+      packet_len += maclen;
+    }
+  }
+  session->send_seq++;
+  session->kex_bytes += packet_len;
+  session->kex_packets++;
+  session->stats.bytes_out += packet_len;
+  session->stats.packets_out++;
+  SSH_PROBE3(packet_send, session, *(const uint8_t *) header,
+      ntohl(finallen));
+  leave_function();
+
+  if (staged) {
+    return rc;
+  }
+  return ssh_socket_commit(session->socket, packet_len);
+}
 
 int packet_send(ssh_session session) {
 #ifdef WITH_SSH1
@@ -38,6 +38,7 @@
 #include "libssh/session.h"
 #include "libssh/buffer.h"
 #include "libssh/socket.h"
+#include "libssh/threads.h"
 
 /**
  * @internal
@@ -117,8 +118,35 @@ struct ssh_pcap_context_struct {
 struct ssh_pcap_file_struct {
 	FILE *output;
 	uint16_t ipsequence;
+	/* the lock protects the buffers, the counters and the ip sequence. The
+	 * write lock protects the output, it is taken before releasing the lock
+	 * so that the records are written in order */
+	void *lock;
+	void *write_lock;
+	/* the records not written yet, and the buffer being written */
+	unsigned char *buffer;
+	unsigned char *spare;
+	size_t size;
+	size_t used;
+	int background;
+	uint64_t dropped;
+	uint32_t snaplen;
+	unsigned int sampling;
+	unsigned int sessions;
+	/* the ring of files */
+	char *filename;
+	uint64_t rotate_size;
+	unsigned int rotate_files;
+	unsigned int rotate_index;
+	uint64_t written;
 };
 
+#define PCAP_HDR_LEN 24
+#define PCAPREC_HDR_LEN 16
+#define IPHDR_LEN 20
+#define TCPHDR_LEN 20
+#define TCPIPHDR_LEN (IPHDR_LEN + TCPHDR_LEN)
+
 /**
  * @brief create a new ssh_pcap_file object
  */
@@ -130,44 +158,168 @@ ssh_pcap_file ssh_pcap_file_new(){
         return NULL;
     }
     ZERO_STRUCTP(pcap);
+    if (ssh_threads_mutex_init(&pcap->lock) < 0) {
+        SAFE_FREE(pcap);
+        return NULL;
+    }
+    if (ssh_threads_mutex_init(&pcap->write_lock) < 0) {
+        ssh_threads_mutex_destroy(&pcap->lock);
+        SAFE_FREE(pcap);
+        return NULL;
+    }
 
     return pcap;
 }
 
 /** @internal
- * @brief writes a packet on file
+ * @brief writes the header of the pcap file, called with the write lock held
  */
-static int ssh_pcap_file_write(ssh_pcap_file pcap, ssh_buffer packet){
-	int err;
-	uint32_t len;
-	if(pcap == NULL || pcap->output==NULL)
+static int ssh_pcap_file_write_header(ssh_pcap_file pcap){
+	unsigned char header[PCAP_HDR_LEN];
+	uint32_t u32;
+	uint16_t u16;
+
+	u32=htonl(PCAP_MAGIC);
+	memcpy(header,&u32,4);
+	u16=htons(PCAP_VERSION_MAJOR);
+	memcpy(header+4,&u16,2);
+	u16=htons(PCAP_VERSION_MINOR);
+	memcpy(header+6,&u16,2);
+	/* currently hardcode GMT to 0 */
+	memset(header+8,0,4);
+	/* accuracy */
+	memset(header+12,0,4);
+	/* size of the biggest packet */
+	u32=htonl(pcap->snaplen ? pcap->snaplen : MAX_PACKET_LEN);
+	memcpy(header+16,&u32,4);
+	/* we will write sort-of IP */
+	u32=htonl(DLT_RAW);
+	memcpy(header+20,&u32,4);
+	if(fwrite(header,sizeof(header),1,pcap->output) != 1)
+		return SSH_ERROR;
+	pcap->written=sizeof(header);
+	return SSH_OK;
+}
+
+/** @internal
+ * @brief opens a file and writes the pcap header, called with the write
+ * lock held
+ */
+static int ssh_pcap_file_open_output(ssh_pcap_file pcap, const char *filename){
+	pcap->output=fopen(filename,"wb");
+	if(pcap->output==NULL)
+		return SSH_ERROR;
+	return ssh_pcap_file_write_header(pcap);
+}
+
+/** @internal
+ * @brief closes the current file of the ring and opens the next one,
+ * called with the write lock held
+ */
+static int ssh_pcap_file_rotate(ssh_pcap_file pcap){
+	char *name;
+	size_t len;
+
+	fclose(pcap->output);
+	pcap->output=NULL;
+	pcap->rotate_index=(pcap->rotate_index + 1) % pcap->rotate_files;
+	if(pcap->rotate_index == 0)
+		return ssh_pcap_file_open_output(pcap,pcap->filename);
+
+	len=strlen(pcap->filename) + 12;
+	name=malloc(len);
+	if(name == NULL)
 		return SSH_ERROR;
-	len=buffer_get_rest_len(packet);
-	err=fwrite(buffer_get_rest(packet),len,1,pcap->output);
-	if(err<0)
+	snprintf(name,len,"%s.%u",pcap->filename,pcap->rotate_index);
+	if(ssh_pcap_file_open_output(pcap,name) < 0){
+		SAFE_FREE(name);
 		return SSH_ERROR;
-	else
-		return SSH_OK;
+	}
+	SAFE_FREE(name);
+	return SSH_OK;
 }
 
 /** @internal
- * @brief prepends a packet with the pcap header and writes packet
- * on file
+ * @brief writes records on file, called with the write lock held. The
+ * records of a call are kept in the same file of the ring.
  */
-int ssh_pcap_file_write_packet(ssh_pcap_file pcap, ssh_buffer packet, uint32_t original_len){
-	ssh_buffer header=ssh_buffer_new();
-	struct timeval now;
+static int ssh_pcap_file_write(ssh_pcap_file pcap, const void *data,
+		size_t len, const void *more, size_t more_len){
+	if(pcap->output == NULL)
+		return SSH_ERROR;
+	if(pcap->rotate_size > 0 && pcap->written > PCAP_HDR_LEN &&
+			pcap->written + len + more_len > pcap->rotate_size){
+		if(ssh_pcap_file_rotate(pcap) < 0)
+			return SSH_ERROR;
+	}
+	if(len > 0 && fwrite(data,len,1,pcap->output) != 1)
+		return SSH_ERROR;
+	if(more_len > 0 && fwrite(more,more_len,1,pcap->output) != 1)
+		return SSH_ERROR;
+	pcap->written+=len + more_len;
+	return SSH_OK;
+}
+
+/** @internal
+ * @brief writes the buffered records, called with the lock held which is
+ * released. The write lock is kept if keep is set.
+ */
+static int ssh_pcap_file_flush_unlock(ssh_pcap_file pcap, int keep){
+	unsigned char *full;
+	size_t len;
+	int err=SSH_OK;
+
+	ssh_threads_mutex_lock(&pcap->write_lock);
+	full=pcap->buffer;
+	len=pcap->used;
+	pcap->buffer=pcap->spare;
+	pcap->spare=full;
+	pcap->used=0;
+	ssh_threads_mutex_unlock(&pcap->lock);
+
+	if(len > 0)
+		err=ssh_pcap_file_write(pcap,full,len,NULL,0);
+	if(!keep)
+		ssh_threads_mutex_unlock(&pcap->write_lock);
+	return err;
+}
+
+/** @internal
+ * @brief adds a record to the file, with the pcap, IP and TCP headers of
+ * the record and its data. The IP id is set in the header.
+ */
+static int ssh_pcap_file_add(ssh_pcap_file pcap, unsigned char *header,
+		size_t header_len, const void *data, size_t len){
+	uint16_t ipsequence;
 	int err;
-	if(header == NULL)
+
+	ssh_threads_mutex_lock(&pcap->lock);
+	if(pcap->output == NULL){
+		ssh_threads_mutex_unlock(&pcap->lock);
 		return SSH_ERROR;
-	gettimeofday(&now,NULL);
-	buffer_add_u32(header,htonl(now.tv_sec));
-	buffer_add_u32(header,htonl(now.tv_usec));
-	buffer_add_u32(header,htonl(buffer_get_rest_len(packet)));
-	buffer_add_u32(header,htonl(original_len));
-	buffer_add_buffer(header,packet);
-	err=ssh_pcap_file_write(pcap,header);
-	ssh_buffer_free(header);
+	}
+	ipsequence=htons(pcap->ipsequence);
+	memcpy(header + PCAPREC_HDR_LEN + 4,&ipsequence,sizeof(ipsequence));
+	pcap->ipsequence++;
+
+	if(pcap->used + header_len + len <= pcap->size){
+		memcpy(pcap->buffer + pcap->used,header,header_len);
+		memcpy(pcap->buffer + pcap->used + header_len,data,len);
+		pcap->used+=header_len + len;
+		ssh_threads_mutex_unlock(&pcap->lock);
+		return SSH_OK;
+	}
+	if(pcap->background){
+		/* the writer has to keep up, the sessions never wait for the disk */
+		pcap->dropped++;
+		ssh_threads_mutex_unlock(&pcap->lock);
+		return SSH_OK;
+	}
+
+	err=ssh_pcap_file_flush_unlock(pcap,1);
+	if(err == SSH_OK)
+		err=ssh_pcap_file_write(pcap,header,header_len,data,len);
+	ssh_threads_mutex_unlock(&pcap->write_lock);
 	return err;
 }
 
@@ -175,53 +327,208 @@ int ssh_pcap_file_write_packet(ssh_pcap_file pcap, ssh_buffer packet, uint32_t o
  * @brief opens a new pcap file and create header
  */
 int ssh_pcap_file_open(ssh_pcap_file pcap, const char *filename){
-	ssh_buffer header;
+	char *name;
 	int err;
 	if(pcap == NULL)
 		return SSH_ERROR;
-	if(pcap->output){
-		fclose(pcap->output);
-		pcap->output=NULL;
-	}
-	pcap->output=fopen(filename,"wb");
-	if(pcap->output==NULL)
+	name=strdup(filename);
+	if(name == NULL)
 		return SSH_ERROR;
-	header=ssh_buffer_new();
-	if(header==NULL)
+	ssh_pcap_file_close(pcap);
+
+	ssh_threads_mutex_lock(&pcap->lock);
+	ssh_threads_mutex_lock(&pcap->write_lock);
+	SAFE_FREE(pcap->filename);
+	pcap->filename=name;
+	pcap->rotate_index=0;
+	err=ssh_pcap_file_open_output(pcap,filename);
+	ssh_threads_mutex_unlock(&pcap->write_lock);
+	ssh_threads_mutex_unlock(&pcap->lock);
+	return err;
+}
+
+/**
+ * @brief writes the records kept in the buffer of the pcap file
+ *
+ * With a background writer (see ssh_pcap_file_set_buffer()), the records
+ * are only written by this function, which is called periodically by a
+ * thread of the application. The sessions keep adding records while the
+ * buffer is written.
+ *
+ * @param pcap the pcap file
+ * @returns SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_pcap_file_flush(ssh_pcap_file pcap){
+	int err;
+	if(pcap == NULL)
 		return SSH_ERROR;
-	buffer_add_u32(header,htonl(PCAP_MAGIC));
-	buffer_add_u16(header,htons(PCAP_VERSION_MAJOR));
-	buffer_add_u16(header,htons(PCAP_VERSION_MINOR));
-	/* currently hardcode GMT to 0 */
-	buffer_add_u32(header,htonl(0));
-	/* accuracy */
-	buffer_add_u32(header,htonl(0));
-	/* size of the biggest packet */
-	buffer_add_u32(header,htonl(MAX_PACKET_LEN));
-	/* we will write sort-of IP */
-	buffer_add_u32(header,htonl(DLT_RAW));
-	err=ssh_pcap_file_write(pcap,header);
-	ssh_buffer_free(header);
+	ssh_threads_mutex_lock(&pcap->lock);
+	if(pcap->output == NULL){
+		ssh_threads_mutex_unlock(&pcap->lock);
+		return SSH_ERROR;
+	}
+	err=ssh_pcap_file_flush_unlock(pcap,1);
+	if(err == SSH_OK && fflush(pcap->output) != 0)
+		err=SSH_ERROR;
+	ssh_threads_mutex_unlock(&pcap->write_lock);
 	return err;
 }
 
 int ssh_pcap_file_close(ssh_pcap_file pcap){
 	int err;
-	if(pcap ==NULL || pcap->output==NULL)
+	if(pcap ==NULL)
 		return SSH_ERROR;
-	err=fclose(pcap->output);
-	pcap->output=NULL;
-	if(err != 0)
+	ssh_threads_mutex_lock(&pcap->lock);
+	if(pcap->output==NULL){
+		ssh_threads_mutex_unlock(&pcap->lock);
 		return SSH_ERROR;
-	else
-		return SSH_OK;
+	}
+	err=ssh_pcap_file_flush_unlock(pcap,1);
+	if(fclose(pcap->output) != 0)
+		err=SSH_ERROR;
+	pcap->output=NULL;
+	ssh_threads_mutex_unlock(&pcap->write_lock);
+	return err;
 }
 
 void ssh_pcap_file_free(ssh_pcap_file pcap){
+	if(pcap == NULL)
+		return;
 	ssh_pcap_file_close(pcap);
+	ssh_threads_mutex_destroy(&pcap->lock);
+	ssh_threads_mutex_destroy(&pcap->write_lock);
+	SAFE_FREE(pcap->buffer);
+	SAFE_FREE(pcap->spare);
+	SAFE_FREE(pcap->filename);
 	SAFE_FREE(pcap);
 }
 
+/**
+ * @brief sets the buffer of the records of a pcap file
+ *
+ * Without a buffer, each packet is written on the file by the session
+ * sending or receiving it. With a buffer, the packets are written once it
+ * is full, or by ssh_pcap_file_flush().
+ *
+ * @param pcap the pcap file
+ * @param size the size of the buffer in bytes, 0 to write each packet
+ * @param background if set, the sessions never write on the file: the
+ * application calls ssh_pcap_file_flush() from a thread of its own, and the
+ * packets not fitting in the buffer are dropped and counted.
+ * @returns SSH_OK on success, SSH_ERROR on error.
+ * @see ssh_pcap_file_get_dropped()
+ */
+int ssh_pcap_file_set_buffer(ssh_pcap_file pcap, size_t size, int background){
+	unsigned char *buffer=NULL;
+	unsigned char *spare=NULL;
+	int err=SSH_OK;
+	if(pcap == NULL || (background && size == 0))
+		return SSH_ERROR;
+	if(size > 0){
+		buffer=malloc(size);
+		spare=malloc(size);
+		if(buffer == NULL || spare == NULL){
+			SAFE_FREE(buffer);
+			SAFE_FREE(spare);
+			return SSH_ERROR;
+		}
+	}
+
+	ssh_threads_mutex_lock(&pcap->lock);
+	ssh_threads_mutex_lock(&pcap->write_lock);
+	if(pcap->used > 0)
+		err=ssh_pcap_file_write(pcap,pcap->buffer,pcap->used,NULL,0);
+	SAFE_FREE(pcap->buffer);
+	SAFE_FREE(pcap->spare);
+	pcap->buffer=buffer;
+	pcap->spare=spare;
+	pcap->size=size;
+	pcap->used=0;
+	pcap->background=background;
+	ssh_threads_mutex_unlock(&pcap->write_lock);
+	ssh_threads_mutex_unlock(&pcap->lock);
+	return err;
+}
+
+/**
+ * @brief sets the number of bytes of each packet kept in the file
+ *
+ * The packets are truncated, their IP and TCP headers included, and the
+ * file still gives their original size. It is used by the next files.
+ *
+ * @param pcap the pcap file
+ * @param snaplen the bytes kept, 0 to keep the whole packets
+ * @returns SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_pcap_file_set_snaplen(ssh_pcap_file pcap, uint32_t snaplen){
+	if(pcap == NULL || (snaplen > 0 && snaplen < TCPIPHDR_LEN))
+		return SSH_ERROR;
+	ssh_threads_mutex_lock(&pcap->lock);
+	pcap->snaplen=snaplen;
+	ssh_threads_mutex_unlock(&pcap->lock);
+	return SSH_OK;
+}
+
+/**
+ * @brief sets the sessions traced by a pcap file
+ *
+ * Only one session in the given number is traced, the others given to
+ * ssh_set_pcap_file() are ignored.
+ *
+ * @param pcap the pcap file
+ * @param sessions trace one session in sessions, 0 or 1 for all of them
+ * @returns SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_pcap_file_set_sampling(ssh_pcap_file pcap, unsigned int sessions){
+	if(pcap == NULL)
+		return SSH_ERROR;
+	ssh_threads_mutex_lock(&pcap->lock);
+	pcap->sampling=sessions;
+	pcap->sessions=0;
+	ssh_threads_mutex_unlock(&pcap->lock);
+	return SSH_OK;
+}
+
+/**
+ * @brief writes a pcap file as a ring of files
+ *
+ * Once a file reaches the given size, the next one is written. The files
+ * are the one given to ssh_pcap_file_open(), then the same name followed
+ * by .1, .2 and so on, up to the number of files, when the first file is
+ * written again.
+ *
+ * @param pcap the pcap file
+ * @param size the size of each file in bytes, 0 to write a single file
+ * @param files the number of files of the ring
+ * @returns SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_pcap_file_set_rotation(ssh_pcap_file pcap, uint64_t size,
+		unsigned int files){
+	if(pcap == NULL || (size > 0 && files == 0))
+		return SSH_ERROR;
+	ssh_threads_mutex_lock(&pcap->lock);
+	ssh_threads_mutex_lock(&pcap->write_lock);
+	pcap->rotate_size=size;
+	pcap->rotate_files=files;
+	ssh_threads_mutex_unlock(&pcap->write_lock);
+	ssh_threads_mutex_unlock(&pcap->lock);
+	return SSH_OK;
+}
+
+/**
+ * @brief gets the number of packets dropped by a pcap file with a
+ * background writer, when its buffer was full
+ */
+uint64_t ssh_pcap_file_get_dropped(ssh_pcap_file pcap){
+	uint64_t dropped;
+	if(pcap == NULL)
+		return 0;
+	ssh_threads_mutex_lock(&pcap->lock);
+	dropped=pcap->dropped;
+	ssh_threads_mutex_unlock(&pcap->lock);
+	return dropped;
+}
+
 
 /** @internal
  * @brief allocates a new ssh_pcap_context object
@@ -285,9 +592,6 @@ static int ssh_pcap_context_connect(ssh_pcap_context ctx){
 	return SSH_OK;
 }
 
-#define IPHDR_LEN 20
-#define TCPHDR_LEN 20
-#define TCPIPHDR_LEN (IPHDR_LEN + TCPHDR_LEN)
 /** @internal
  * @brief write a SSH packet as a TCP over IP in a pcap file
  * @param ctx open pcap context
@@ -301,90 +605,115 @@ static int ssh_pcap_context_connect(ssh_pcap_context ctx){
  */
 int ssh_pcap_context_write(ssh_pcap_context ctx,enum ssh_pcap_direction direction
 		, void *data, uint32_t len, uint32_t origlen){
-	ssh_buffer ip;
-	int err;
+	/* the pcap record header, then the IP and TCP headers */
+	unsigned char header[PCAPREC_HDR_LEN + TCPIPHDR_LEN];
+	unsigned char *ip=header + PCAPREC_HDR_LEN;
+	unsigned char *tcp=ip + IPHDR_LEN;
+	struct timeval now;
+	uint32_t snaplen;
+	uint32_t u32;
+	uint16_t u16;
 	if(ctx==NULL || ctx->file ==NULL)
 		return SSH_ERROR;
 	if(ctx->connected==0)
 		if(ssh_pcap_context_connect(ctx)==SSH_ERROR)
 			return SSH_ERROR;
-	ip=ssh_buffer_new();
-	if(ip==NULL){
-		ssh_set_error_oom(ctx->session);
-		return SSH_ERROR;
-	}
+	/* read without the lock, a new snaplen is used by the next packets */
+	snaplen=ctx->file->snaplen;
+	if(snaplen > 0 && len + TCPIPHDR_LEN > snaplen)
+		len=snaplen - TCPIPHDR_LEN;
+
+	gettimeofday(&now,NULL);
+	u32=htonl(now.tv_sec);
+	memcpy(header,&u32,4);
+	u32=htonl(now.tv_usec);
+	memcpy(header+4,&u32,4);
+	u32=htonl(len + TCPIPHDR_LEN);
+	memcpy(header+8,&u32,4);
+	u32=htonl(origlen + TCPIPHDR_LEN);
+	memcpy(header+12,&u32,4);
+
 	/* build an IP packet */
 	/* V4, 20 bytes */
-	buffer_add_u8(ip,4 << 4 | 5);
+	ip[0]=4 << 4 | 5;
 	/* tos */
-	buffer_add_u8(ip,0);
+	ip[1]=0;
 	/* total len */
-	buffer_add_u16(ip,htons(origlen + TCPIPHDR_LEN));
-	/* IP id number */
-	buffer_add_u16(ip,htons(ctx->file->ipsequence));
-	ctx->file->ipsequence++;
+	u16=htons(origlen + TCPIPHDR_LEN);
+	memcpy(ip+2,&u16,2);
+	/* IP id number, set by the file */
 	/* fragment offset */
-	buffer_add_u16(ip,htons(0));
+	memset(ip+6,0,2);
 	/* TTL */
-	buffer_add_u8(ip,64);
+	ip[8]=64;
 	/* protocol TCP=6 */
-	buffer_add_u8(ip,6);
+	ip[9]=6;
 	/* checksum */
-	buffer_add_u16(ip,0);
+	memset(ip+10,0,2);
 	if(direction==SSH_PCAP_DIR_OUT){
-		buffer_add_u32(ip,ctx->ipsource);
-		buffer_add_u32(ip,ctx->ipdest);
+		memcpy(ip+12,&ctx->ipsource,4);
+		memcpy(ip+16,&ctx->ipdest,4);
 	} else {
-		buffer_add_u32(ip,ctx->ipdest);
-		buffer_add_u32(ip,ctx->ipsource);
+		memcpy(ip+12,&ctx->ipdest,4);
+		memcpy(ip+16,&ctx->ipsource,4);
 	}
 	/* TCP */
 	if(direction==SSH_PCAP_DIR_OUT){
-		buffer_add_u16(ip,ctx->portsource);
-		buffer_add_u16(ip,ctx->portdest);
+		memcpy(tcp,&ctx->portsource,2);
+		memcpy(tcp+2,&ctx->portdest,2);
 	} else {
-		buffer_add_u16(ip,ctx->portdest);
-		buffer_add_u16(ip,ctx->portsource);
+		memcpy(tcp,&ctx->portdest,2);
+		memcpy(tcp+2,&ctx->portsource,2);
 	}
 	/* sequence number */
 	if(direction==SSH_PCAP_DIR_OUT){
-		buffer_add_u32(ip,ntohl(ctx->outsequence));
+		u32=htonl(ctx->outsequence);
 		ctx->outsequence+=origlen;
 	} else {
-		buffer_add_u32(ip,ntohl(ctx->insequence));
+		u32=htonl(ctx->insequence);
 		ctx->insequence+=origlen;
 	}
+	memcpy(tcp+4,&u32,4);
 	/* ack number */
 	if(direction==SSH_PCAP_DIR_OUT){
-		buffer_add_u32(ip,ntohl(ctx->insequence));
+		u32=htonl(ctx->insequence);
 	} else {
-		buffer_add_u32(ip,ntohl(ctx->outsequence));
+		u32=htonl(ctx->outsequence);
 	}
+	memcpy(tcp+8,&u32,4);
 	/* header len = 20 = 5 * 32 bits, at offset 4*/
-	buffer_add_u8(ip,5 << 4);
+	tcp[12]=5 << 4;
 	/* flags */
-	buffer_add_u8(ip,TH_PUSH | TH_ACK);
+	tcp[13]=TH_PUSH | TH_ACK;
 	/* window */
-	buffer_add_u16(ip,htons(65535));
+	u16=htons(65535);
+	memcpy(tcp+14,&u16,2);
 	/* checksum */
-	buffer_add_u16(ip,htons(0));
+	memset(tcp+16,0,2);
 	/* urgent data ptr */
-	buffer_add_u16(ip,0);
+	memset(tcp+18,0,2);
 	/* actual data */
-	buffer_add_data(ip,data,len);
-	err=ssh_pcap_file_write_packet(ctx->file,ip,origlen + TCPIPHDR_LEN);
-	ssh_buffer_free(ip);
-	return err;
+	return ssh_pcap_file_add(ctx->file,header,sizeof(header),data,len);
 }
 
 /** @brief sets the pcap file used to trace the session
  * @param current session
  * @param pcap an handler to a pcap file. A pcap file may be used in several
- * sessions.
+ * sessions. With ssh_pcap_file_set_sampling(), some of them are not traced.
  * @returns SSH_ERROR in case of error, SSH_OK otherwise.
  */
 int ssh_set_pcap_file(ssh_session session, ssh_pcap_file pcap){
-	ssh_pcap_context ctx=ssh_pcap_context_new(session);
+	ssh_pcap_context ctx;
+	int skip=0;
+	if(pcap != NULL){
+		ssh_threads_mutex_lock(&pcap->lock);
+		if(pcap->sampling > 1)
+			skip=(pcap->sessions++ % pcap->sampling) != 0;
+		ssh_threads_mutex_unlock(&pcap->lock);
+		if(skip)
+			return SSH_OK;
+	}
+	ctx=ssh_pcap_context_new(session);
 	if(ctx==NULL){
 		ssh_set_error_oom(session);
 		return SSH_ERROR;
@@ -422,6 +751,43 @@ int ssh_pcap_file_open(ssh_pcap_file pcap, const char *filename){
 	return SSH_ERROR;
 }
 
+int ssh_pcap_file_flush(ssh_pcap_file pcap){
+	(void) pcap;
+	return SSH_ERROR;
+}
+
+int ssh_pcap_file_set_buffer(ssh_pcap_file pcap, size_t size, int background){
+	(void) pcap;
+	(void) size;
+	(void) background;
+	return SSH_ERROR;
+}
+
+int ssh_pcap_file_set_snaplen(ssh_pcap_file pcap, uint32_t snaplen){
+	(void) pcap;
+	(void) snaplen;
+	return SSH_ERROR;
+}
+
+int ssh_pcap_file_set_sampling(ssh_pcap_file pcap, unsigned int sessions){
+	(void) pcap;
+	(void) sessions;
+	return SSH_ERROR;
+}
+
+int ssh_pcap_file_set_rotation(ssh_pcap_file pcap, uint64_t size,
+		unsigned int files){
+	(void) pcap;
+	(void) size;
+	(void) files;
+	return SSH_ERROR;
+}
+
+uint64_t ssh_pcap_file_get_dropped(ssh_pcap_file pcap){
+	(void) pcap;
+	return 0;
+}
+
 int ssh_set_pcap_file(ssh_session session, ssh_pcap_file pcapfile){
 	(void) pcapfile;
 	ssh_set_error(session,SSH_REQUEST_DENIED,"Pcap support not compiled in");
@@ -0,0 +1,758 @@
+/*
+ * pipeline.c - AEAD packets encrypted and decrypted by several threads
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <arpa/inet.h>
+#endif
+
+#include "libssh/priv.h"
+#include "libssh/buffer.h"
+#include "libssh/crypto.h"
+#include "libssh/wrapper.h"
+#include "libssh/packet.h"
+#include "libssh/session.h"
+#include "libssh/socket.h"
+#include "libssh/threads.h"
+#include "libssh/misc.h"
+#include "libssh/pipeline.h"
+
+/**
+ * @defgroup libssh_crypto_pool The SSH crypto pool
+ * @ingroup libssh
+ *
+ * Threads sharing the encryption of the bulk data of sessions.
+ *
+ * With the AEAD ciphers (aes128-gcm@openssh.com, aes256-gcm@openssh.com and
+ * chacha20-poly1305@openssh.com), every packet is encrypted and
+ * authenticated from its sequence number alone, so the packets of a session
+ * don't depend on each other. The packets of a large ssh_channel_write(),
+ * and the packets read at once from the socket, are then split between the
+ * thread of the session and the workers of a pool, each with its own copy
+ * of the keys. They are still sent and processed in order by the thread of
+ * the session.
+ *
+ * libssh doesn't start any thread: the workers are threads of the
+ * application running ssh_crypto_pool_run(). The other ciphers, and the
+ * compressed sessions, are not affected by a pool.
+ *
+ * The workers also verify the signatures of the public key authentications
+ * of the server sessions added to an event, so that the other sessions of
+ * the event don't wait for them.
+ *
+ * @{
+ */
+
+/* a part of a batch, run by a worker or by the thread of the session */
+struct pipeline_chunk {
+  struct pipeline_chunk *next;
+  struct crypto_struct *cipher;
+  struct pipeline_packet *packets;
+  unsigned int count;
+  unsigned char *data;
+  unsigned char *plain; /* NULL to encrypt */
+  unsigned int *pending; /* the chunks of the batch not done, under the lock */
+};
+
+/* a job of crypto_pool_post(), its result given back to an event */
+struct crypto_pool_job {
+  struct crypto_pool_job *next;
+  crypto_pool_job_callback run;
+  ssh_event_task_callback done;
+  ssh_event event;
+  void *userdata;
+};
+
+struct ssh_crypto_pool_struct {
+  void *lock; /* for the queues, pending, workers and stopping */
+  int wakeup_fds[2]; /* a byte per chunk or job queued, and one to stop */
+  struct pipeline_chunk *queue;
+  struct pipeline_chunk *queue_tail;
+  /* after the chunks, which the thread of a session waits for */
+  struct crypto_pool_job *jobs;
+  struct crypto_pool_job *jobs_tail;
+  unsigned int workers; /* in ssh_crypto_pool_run() */
+  int stopping;
+};
+
+static void pipeline_chunk_run(struct pipeline_chunk *chunk) {
+  struct crypto_struct *cipher = chunk->cipher;
+  struct pipeline_packet *p;
+  unsigned char *packet;
+  unsigned int i;
+
+  for (i = 0; i < chunk->count; i++) {
+    p = &chunk->packets[i];
+    packet = chunk->data + p->offset;
+    if (chunk->plain == NULL) {
+      /* the room of the tag follows the packet */
+      cipher->aead_encrypt(cipher, packet, packet, p->len, packet + p->len,
+          p->seq);
+    } else {
+      p->ok = cipher->aead_decrypt(cipher, packet, chunk->plain + p->plain,
+          p->len, packet + sizeof(uint32_t) + p->len, p->seq) == 0;
+    }
+  }
+}
+
+/* takes the next chunk of the queue, with the lock held */
+static struct pipeline_chunk *crypto_pool_pop(ssh_crypto_pool pool) {
+  struct pipeline_chunk *chunk = pool->queue;
+
+  if (chunk != NULL) {
+    pool->queue = chunk->next;
+    if (pool->queue == NULL) {
+      pool->queue_tail = NULL;
+    }
+  }
+
+  return chunk;
+}
+
+/* takes the next job, with the lock held */
+static struct crypto_pool_job *crypto_pool_pop_job(ssh_crypto_pool pool) {
+  struct crypto_pool_job *job = pool->jobs;
+
+  if (job != NULL) {
+    pool->jobs = job->next;
+    if (pool->jobs == NULL) {
+      pool->jobs_tail = NULL;
+    }
+  }
+
+  return job;
+}
+
+static void crypto_pool_done(ssh_crypto_pool pool,
+    struct pipeline_chunk *chunk) {
+  ssh_threads_mutex_lock(&pool->lock);
+  (*chunk->pending)--;
+  ssh_threads_mutex_unlock(&pool->lock);
+}
+
+/* wakes a worker up for a chunk queued; the caller runs it otherwise */
+static void crypto_pool_wakeup(ssh_crypto_pool pool) {
+#ifndef _WIN32
+  ssize_t n;
+
+  do {
+    n = write(pool->wakeup_fds[1], "", 1);
+  } while (n < 0 && errno == EINTR);
+#else
+  (void) pool;
+#endif
+}
+
+/*
+ * Encrypts or decrypts the packets of a batch: the first chunk by the
+ * calling thread with the cipher of the session, the others by the workers
+ * with copies of it, made once per key. The copies which can't be made
+ * leave fewer chunks.
+ */
+static void pipeline_run(ssh_crypto_pool pool, struct crypto_struct *cipher,
+    struct crypto_struct **copies, struct pipeline_packet *packets,
+    unsigned int count, unsigned char *data, unsigned char *plain) {
+  struct pipeline_chunk chunks[CRYPTO_COPIES];
+  struct pipeline_chunk *chunk;
+  unsigned int pending;
+  unsigned int nchunks;
+  unsigned int first = 0;
+  unsigned int i;
+
+  ssh_threads_mutex_lock(&pool->lock);
+  nchunks = pool->workers + 1;
+  ssh_threads_mutex_unlock(&pool->lock);
+  if (nchunks > CRYPTO_COPIES) {
+    nchunks = CRYPTO_COPIES;
+  }
+  if (nchunks > count) {
+    nchunks = count;
+  }
+  for (i = 1; i < nchunks; i++) {
+    if (copies[i] == NULL) {
+      copies[i] = cipher_copy(cipher);
+    }
+    if (copies[i] == NULL) {
+      nchunks = i;
+      break;
+    }
+  }
+
+  pending = nchunks - 1;
+  for (i = 0; i < nchunks; i++) {
+    chunks[i].cipher = i == 0 ? cipher : copies[i];
+    chunks[i].packets = packets + first;
+    chunks[i].count = count / nchunks + (i < count % nchunks ? 1 : 0);
+    chunks[i].data = data;
+    chunks[i].plain = plain;
+    chunks[i].pending = &pending;
+    first += chunks[i].count;
+  }
+
+  if (nchunks > 1) {
+    ssh_threads_mutex_lock(&pool->lock);
+    for (i = 1; i < nchunks; i++) {
+      chunks[i].next = NULL;
+      if (pool->queue_tail != NULL) {
+        pool->queue_tail->next = &chunks[i];
+      } else {
+        pool->queue = &chunks[i];
+      }
+      pool->queue_tail = &chunks[i];
+    }
+    ssh_threads_mutex_unlock(&pool->lock);
+    for (i = 1; i < nchunks; i++) {
+      crypto_pool_wakeup(pool);
+    }
+  }
+
+  pipeline_chunk_run(&chunks[0]);
+
+  /* the chunks no worker took yet are run here */
+  for (;;) {
+    ssh_threads_mutex_lock(&pool->lock);
+    if (pending == 0) {
+      ssh_threads_mutex_unlock(&pool->lock);
+      break;
+    }
+    chunk = crypto_pool_pop(pool);
+    ssh_threads_mutex_unlock(&pool->lock);
+
+    if (chunk != NULL) {
+      pipeline_chunk_run(chunk);
+      crypto_pool_done(pool, chunk);
+    } else {
+      ssh_threads_yield();
+    }
+  }
+}
+
+#ifndef _WIN32
+/**
+ * @brief Create a pool of threads encrypting the packets of sessions.
+ *
+ * The pool has no worker until threads of the application call
+ * ssh_crypto_pool_run(). It is given to sessions with ssh_set_crypto_pool().
+ *
+ * @return              A new pool, NULL on error.
+ */
+ssh_crypto_pool ssh_crypto_pool_new(void) {
+  ssh_crypto_pool pool;
+
+  pool = malloc(sizeof(struct ssh_crypto_pool_struct));
+  if (pool == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(pool);
+
+  if (pipe(pool->wakeup_fds) < 0) {
+    SAFE_FREE(pool);
+    return NULL;
+  }
+  if (ssh_threads_mutex_init(&pool->lock) != 0) {
+    close(pool->wakeup_fds[0]);
+    close(pool->wakeup_fds[1]);
+    SAFE_FREE(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+/**
+ * @brief Encrypt the packets given to a pool, as one of its workers.
+ *
+ * Called from a thread of the application, it returns once the pool is
+ * stopped. Up to 7 workers are used by a batch of packets.
+ *
+ * @param[in]  pool     The pool.
+ *
+ * @return              SSH_OK once stopped, SSH_ERROR on error.
+ */
+int ssh_crypto_pool_run(ssh_crypto_pool pool) {
+  struct pipeline_chunk *chunk;
+  struct crypto_pool_job *job = NULL;
+  ssize_t n;
+  int stop;
+  int rc;
+  char c;
+
+  if (pool == NULL) {
+    return SSH_ERROR;
+  }
+
+  ssh_threads_mutex_lock(&pool->lock);
+  pool->workers++;
+  ssh_threads_mutex_unlock(&pool->lock);
+
+  for (;;) {
+    do {
+      n = read(pool->wakeup_fds[0], &c, 1);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      rc = SSH_ERROR;
+      break;
+    }
+
+    ssh_threads_mutex_lock(&pool->lock);
+    chunk = crypto_pool_pop(pool);
+    if (chunk == NULL) {
+      job = crypto_pool_pop_job(pool);
+    }
+    stop = chunk == NULL && job == NULL && pool->stopping;
+    ssh_threads_mutex_unlock(&pool->lock);
+
+    if (chunk != NULL) {
+      pipeline_chunk_run(chunk);
+      crypto_pool_done(pool, chunk);
+    } else if (job != NULL) {
+      job->run(job->userdata);
+      ssh_event_post(job->event, job->done, job->userdata);
+      SAFE_FREE(job);
+    } else if (stop) {
+      /* the byte of the stop goes on to the next worker */
+      rc = write(pool->wakeup_fds[1], "", 1) < 0 ? SSH_ERROR : SSH_OK;
+      break;
+    }
+    /* otherwise the thread of the session ran the chunk itself */
+  }
+
+  ssh_threads_mutex_lock(&pool->lock);
+  pool->workers--;
+  ssh_threads_mutex_unlock(&pool->lock);
+
+  return rc;
+}
+
+/**
+ * @brief Stop the workers of a pool.
+ *
+ * The workers return from ssh_crypto_pool_run() once the packets and the
+ * signatures already queued are done. The sessions using the pool go on
+ * alone.
+ *
+ * @param[in]  pool     The pool.
+ */
+void ssh_crypto_pool_stop(ssh_crypto_pool pool) {
+  if (pool == NULL) {
+    return;
+  }
+
+  ssh_threads_mutex_lock(&pool->lock);
+  if (!pool->stopping) {
+    pool->stopping = 1;
+    if (write(pool->wakeup_fds[1], "", 1) < 0) {
+      pool->stopping = 0;
+    }
+  }
+  ssh_threads_mutex_unlock(&pool->lock);
+}
+
+/**
+ * @brief Free a pool.
+ *
+ * Its workers must have returned, and the sessions using it must be freed
+ * or given another pool first.
+ *
+ * @param[in]  pool     The pool to free.
+ */
+void ssh_crypto_pool_free(ssh_crypto_pool pool) {
+  if (pool == NULL) {
+    return;
+  }
+
+  close(pool->wakeup_fds[0]);
+  close(pool->wakeup_fds[1]);
+  ssh_threads_mutex_destroy(&pool->lock);
+  SAFE_FREE(pool);
+}
+
+/**
+ * @brief Encrypt the packets of a session with a crypto pool.
+ *
+ * It only matters with an AEAD cipher and without compression, and for the
+ * signatures of a server session added to an event. Several sessions can
+ * share a pool.
+ *
+ * @param[in]  session  The SSH session.
+ *
+ * @param[in]  pool     The pool, NULL to encrypt in the thread of the session
+ *                      again.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_set_crypto_pool(ssh_session session, ssh_crypto_pool pool) {
+  struct ssh_pipeline_struct *pipeline;
+
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  if (session->pipeline != NULL && session->pipeline->depth > 0) {
+    ssh_set_error(session, SSH_REQUEST_DENIED,
+        "The crypto pool can't change during a write");
+    return SSH_ERROR;
+  }
+
+  if (pool == NULL) {
+    pipeline_free(session);
+    return SSH_OK;
+  }
+
+  if (session->pipeline == NULL) {
+    pipeline = malloc(sizeof(struct ssh_pipeline_struct));
+    if (pipeline == NULL) {
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+    ZERO_STRUCTP(pipeline);
+    pipeline->out = ssh_buffer_new();
+    if (pipeline->out == NULL) {
+      SAFE_FREE(pipeline);
+      ssh_set_error_oom(session);
+      return SSH_ERROR;
+    }
+    buffer_set_secure(pipeline->out);
+    session->pipeline = pipeline;
+  }
+  session->pipeline->pool = pool;
+
+  return SSH_OK;
+}
+#endif /* _WIN32 */
+
+/** @} */
+
+/** @internal
+ * @brief runs a job in a worker of a pool
+ *
+ * The done callback is then posted to the event, see ssh_event_post(), with
+ * the same userdata.
+ *
+ * @return SSH_OK if the job is queued, SSH_ERROR if the pool has no worker
+ *         or on error: the caller runs it itself then.
+ */
+int crypto_pool_post(ssh_crypto_pool pool, ssh_event event,
+    crypto_pool_job_callback run, ssh_event_task_callback done,
+    void *userdata) {
+  struct crypto_pool_job *job;
+
+  if (pool == NULL || event == NULL) {
+    return SSH_ERROR;
+  }
+  job = malloc(sizeof(struct crypto_pool_job));
+  if (job == NULL) {
+    return SSH_ERROR;
+  }
+  job->next = NULL;
+  job->run = run;
+  job->done = done;
+  job->event = event;
+  job->userdata = userdata;
+
+  /* a stopped pool may have no worker left to take it */
+  ssh_threads_mutex_lock(&pool->lock);
+  if (pool->workers == 0 || pool->stopping) {
+    ssh_threads_mutex_unlock(&pool->lock);
+    SAFE_FREE(job);
+    return SSH_ERROR;
+  }
+  if (pool->jobs_tail != NULL) {
+    pool->jobs_tail->next = job;
+  } else {
+    pool->jobs = job;
+  }
+  pool->jobs_tail = job;
+  ssh_threads_mutex_unlock(&pool->lock);
+  crypto_pool_wakeup(pool);
+
+  return SSH_OK;
+}
+
+/* the packets of the session can be encrypted by its pool */
+static int pipeline_active(ssh_session session) {
+  struct ssh_pipeline_struct *pipeline = session->pipeline;
+  struct crypto_struct *cipher;
+
+  if (pipeline == NULL || pipeline->depth == 0 ||
+      session->version != 2 || session->current_crypto == NULL) {
+    return 0;
+  }
+#if defined(HAVE_LIBZ) && defined(WITH_LIBZ)
+  if (session->current_crypto->do_compress_out) {
+    return 0;
+  }
+#endif
+  cipher = session->current_crypto->out_cipher;
+
+  return cipher->tag_size > 0 && cipher->aead_copy != NULL;
+}
+
+/** @internal
+ * @brief starts a bulk write: the packets are kept until pipeline_end()
+ */
+void pipeline_begin(ssh_session session) {
+  if (session->pipeline != NULL) {
+    session->pipeline->depth++;
+  }
+}
+
+/** @internal
+ * @brief ends a bulk write, and sends the packets kept
+ */
+int pipeline_end(ssh_session session) {
+  if (session->pipeline == NULL) {
+    return SSH_OK;
+  }
+  session->pipeline->depth--;
+  if (session->pipeline->depth > 0) {
+    return SSH_OK;
+  }
+
+  return pipeline_flush(session);
+}
+
+/** @internal
+ * @brief encrypts the packets kept, and gives them to the socket
+ *
+ * Called before anything else is sent or waited for, so the packets keep
+ * their order.
+ *
+ * @return SSH_OK, SSH_AGAIN or SSH_ERROR like ssh_socket_write().
+ */
+int pipeline_flush(ssh_session session) {
+  struct ssh_pipeline_struct *pipeline = session->pipeline;
+  struct ssh_crypto_struct *crypto = session->current_crypto;
+  unsigned char *data;
+  uint64_t start;
+  int rc;
+
+  if (pipeline == NULL || pipeline->out_count == 0) {
+    return SSH_OK;
+  }
+
+  start = ssh_timestamp_us();
+  data = buffer_get_rest(pipeline->out);
+  pipeline_run(pipeline->pool, crypto->out_cipher, crypto->out_copies,
+      pipeline->out_packets, pipeline->out_count, data, NULL);
+  session->stats.crypto_us += ssh_timestamp_us() - start;
+  pipeline->out_count = 0;
+
+  rc = ssh_socket_write(session->socket, data,
+      buffer_get_rest_len(pipeline->out));
+  buffer_reinit(pipeline->out);
+
+  return rc;
+}
+
+/** @internal
+ * @brief gives the room of a packet and of its tag, kept for the pool
+ *
+ * @return The room, NULL if the packet goes the usual way.
+ */
+unsigned char *pipeline_reserve(ssh_session session, uint32_t len) {
+  if (!pipeline_active(session)) {
+    return NULL;
+  }
+
+  return buffer_reserve(session->pipeline->out, len);
+}
+
+/** @internal
+ * @brief keeps a packet built in the room of pipeline_reserve()
+ *
+ * It gets the sequence number the session is at. A full batch is sent.
+ *
+ * @param[in]  len      The length of the packet, without its tag.
+ *
+ * @param[in]  maclen   The size of the tag.
+ */
+int pipeline_commit(ssh_session session, uint32_t len, uint32_t maclen) {
+  struct ssh_pipeline_struct *pipeline = session->pipeline;
+  struct pipeline_packet *p = &pipeline->out_packets[pipeline->out_count];
+
+  p->offset = buffer_get_rest_len(pipeline->out);
+  p->len = len;
+  p->seq = session->send_seq;
+  if (buffer_commit(pipeline->out, len + maclen) < 0) {
+    return SSH_ERROR;
+  }
+  pipeline->out_count++;
+  if (pipeline->out_count == PIPELINE_BATCH) {
+    return pipeline_flush(session);
+  }
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief decrypts in advance the complete packets of received data
+ *
+ * The packets are decrypted by the pool when there are several of them.
+ * ssh_packet_read_one() takes them with pipeline_take(), as long as the
+ * keys don't change.
+ *
+ * @return 1 if packets were decrypted, pipeline_received() is called after
+ *         the data is processed then, 0 otherwise.
+ */
+int pipeline_receive(ssh_session session, const void *data, size_t len) {
+  struct ssh_pipeline_struct *pipeline = session->pipeline;
+  struct crypto_struct *cipher;
+  struct pipeline_packet *p;
+  unsigned char *plain;
+  uint32_t seq = session->recv_seq;
+  uint32_t total = 0;
+  uint32_t plen;
+  size_t offset = 0;
+  unsigned int count = 0;
+  uint64_t start;
+
+  /* a nested read leaves the batch of the outer one */
+  if (pipeline == NULL || session->version != 2 ||
+      session->current_crypto == NULL ||
+      session->packet_state != PACKET_STATE_INIT) {
+    return 0;
+  }
+  cipher = session->current_crypto->in_cipher;
+  if (cipher->tag_size == 0 || cipher->aead_copy == NULL) {
+    return 0;
+  }
+
+  /* the lengths are checked again when the packets are read */
+  while (count < PIPELINE_BATCH && len - offset >= sizeof(uint32_t)) {
+    if (cipher->aead_decrypt_length(cipher,
+          (unsigned char *) data + offset, (unsigned char *) &plen,
+          sizeof(uint32_t), seq) < 0) {
+      break;
+    }
+    plen = ntohl(plen);
+    if (plen > MAX_PACKET_LEN || plen % cipher->blocksize != 0 ||
+        len - offset < sizeof(uint32_t) + plen + cipher->tag_size) {
+      break;
+    }
+    p = &pipeline->in_packets[count];
+    p->offset = offset;
+    p->len = plen;
+    p->plain = total;
+    p->seq = seq;
+    p->ok = 0;
+    total += plen;
+    offset += sizeof(uint32_t) + plen + cipher->tag_size;
+    seq++;
+    count++;
+  }
+  if (count < 2) {
+    return 0;
+  }
+
+  if (pipeline->in_plain == NULL) {
+    pipeline->in_plain = ssh_buffer_new();
+    if (pipeline->in_plain == NULL) {
+      return 0;
+    }
+    buffer_set_secure(pipeline->in_plain);
+  }
+  buffer_reinit(pipeline->in_plain);
+  plain = buffer_allocate(pipeline->in_plain, total);
+  if (plain == NULL) {
+    return 0;
+  }
+
+  start = ssh_timestamp_us();
+  pipeline_run(pipeline->pool, cipher, session->current_crypto->in_copies,
+      pipeline->in_packets, count, (unsigned char *) data, plain);
+  session->stats.crypto_us += ssh_timestamp_us() - start;
+
+  pipeline->in_data = data;
+  pipeline->in_count = count;
+  pipeline->in_next = 0;
+
+  return 1;
+}
+
+/** @internal
+ * @brief gives a packet decrypted by pipeline_receive()
+ *
+ * @param[in]  packet   The packet in the received data, at its length.
+ *
+ * @param[in]  len      Its length.
+ *
+ * @param[out] payload  Where the len bytes after the length are written.
+ *
+ * @return 1 if the packet was decrypted and authenticated, 0 if it has to
+ *         be decrypted the usual way.
+ */
+int pipeline_take(ssh_session session, const void *packet, uint32_t len,
+    void *payload) {
+  struct ssh_pipeline_struct *pipeline = session->pipeline;
+  struct pipeline_packet *p;
+
+  if (pipeline == NULL || pipeline->in_next >= pipeline->in_count) {
+    return 0;
+  }
+  p = &pipeline->in_packets[pipeline->in_next];
+  if ((const unsigned char *) packet != pipeline->in_data + p->offset ||
+      p->len != len || p->seq != session->recv_seq || !p->ok) {
+    /* a forged packet fails again, with the usual error */
+    pipeline->in_count = 0;
+    return 0;
+  }
+  memcpy(payload, buffer_get_rest(pipeline->in_plain) + p->plain, len);
+  pipeline->in_next++;
+
+  return 1;
+}
+
+/** @internal
+ * @brief forgets the packets decrypted in advance
+ *
+ * Called once the data is processed, and when the keys change.
+ */
+void pipeline_received(ssh_session session) {
+  struct ssh_pipeline_struct *pipeline = session->pipeline;
+
+  if (pipeline != NULL) {
+    pipeline->in_data = NULL;
+    pipeline->in_count = 0;
+    pipeline->in_next = 0;
+  }
+}
+
+/** @internal
+ * @brief frees the pipeline of a session
+ */
+void pipeline_free(ssh_session session) {
+  struct ssh_pipeline_struct *pipeline = session->pipeline;
+
+  if (pipeline == NULL) {
+    return;
+  }
+  ssh_buffer_free(pipeline->out);
+  ssh_buffer_free(pipeline->in_plain);
+  SAFE_FREE(session->pipeline);
+}
+
+/* vim: set ts=2 sw=2 et cindent: */
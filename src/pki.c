@@ -30,6 +30,8 @@
  * @{
  */
 
+#include <string.h>
+
 #include "libssh/priv.h"
 #include "libssh/pki.h"
 #include "libssh/keys.h"
@@ -61,6 +63,11 @@ void ssh_key_clean (ssh_key key){
   DSA_free(key->dsa);
   RSA_free(key->rsa);
 #endif
+#ifdef HAVE_ECDSA
+  EC_KEY_free(key->ecdsa);
+  key->ecdsa = NULL;
+#endif
+  memset(key->ed25519, 0, sizeof(key->ed25519));
   key->flags=SSH_KEY_FLAG_EMPTY;
   key->type=SSH_KEYTYPE_UNKNOWN;
   key->type_c=NULL;
@@ -80,7 +87,8 @@ void ssh_key_free (ssh_key key){
 /**
  * @brief returns the type of a ssh key
  * @param[in] key the ssh_key handle
- * @returns one of SSH_KEYTYPE_RSA,SSH_KEYTYPE_DSS,SSH_KEYTYPE_RSA1
+ * @returns one of SSH_KEYTYPE_RSA,SSH_KEYTYPE_DSS,SSH_KEYTYPE_RSA1,
+ *          SSH_KEYTYPE_ECDSA,SSH_KEYTYPE_ED25519
  * @returns SSH_KEYTYPE_UNKNOWN if the type is unknown
  */
 enum ssh_keytypes_e ssh_key_type(ssh_key key){
@@ -106,9 +114,14 @@ int ssh_key_import_private(ssh_key key, ssh_session session, const char *filenam
   ssh_key_clean(key);
   key->dsa=priv->dsa_priv;
   key->rsa=priv->rsa_priv;
+#ifdef HAVE_ECDSA
+  key->ecdsa=priv->ecdsa_priv;
+#endif
+  memcpy(key->ed25519, priv->ed25519_priv, sizeof(key->ed25519));
   key->type=priv->type;
   key->flags=SSH_KEY_FLAG_PRIVATE | SSH_KEY_FLAG_PUBLIC;
   key->type_c=ssh_type_to_char(key->type);
+  memset(priv, 0, sizeof(struct ssh_private_key_struct));
   SAFE_FREE(priv);
   return SSH_OK;
 }
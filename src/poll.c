@@ -28,14 +28,56 @@
 #include "config.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <windows.h>
+/* CancelIoEx() and GetQueuedCompletionStatusEx() need Vista */
+#if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0600
+#define HAVE_IOCP 1
+#endif
+#endif
+
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_KQUEUE
+#include <sys/types.h>
+#include <unistd.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+/* multishot polls and wait timeouts need Linux 5.13 headers */
+#if defined(__NR_io_uring_setup) && defined(IORING_POLL_ADD_MULTI) && \
+    defined(IORING_ENTER_EXT_ARG)
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #include "libssh/priv.h"
 #include "libssh/libssh.h"
 #include "libssh/poll.h"
+#include "libssh/hashtable.h"
+#include "libssh/timer.h"
+#include "libssh/threads.h"
 #include "libssh/socket.h"
 #include "libssh/session.h"
+#include "libssh/channels.h"
 #ifdef WITH_SERVER
 #include "libssh/server.h"
+#include "libssh/bind.h"
 #include "libssh/misc.h"
 #endif
 
@@ -44,6 +86,11 @@
 #define SSH_POLL_CTX_CHUNK			5
 #endif
 
+/* poll contexts bigger than this switch to a scalable backend if available */
+#ifndef SSH_POLL_CTX_SCALABLE
+#define SSH_POLL_CTX_SCALABLE			64
+#endif
+
 /**
  * @defgroup libssh_poll The SSH poll functions.
  * @ingroup libssh
@@ -68,8 +115,50 @@ struct ssh_poll_handle_struct {
     size_t idx;
   } x;
   short events;
+  /* events caught by the last poll and not dispatched yet */
+  short revents;
+  unsigned int ready_serial;
+  int edge_triggered;
+  /* what the readiness backend is watching for this poll object */
+  socket_t backend_fd;
+  int backend_events;
+  /* the io_uring request or the IOCP watch */
+  uint64_t backend_id;
   ssh_poll_callback cb;
   void *cb_data;
+  /* the list of the session it follows, see ssh_poll_set_owner() */
+  struct ssh_poll_handle_struct **owner;
+  struct ssh_poll_handle_struct *owner_next;
+  struct ssh_poll_handle_struct *owner_prev;
+};
+
+/*
+ * A readiness backend waits for the events of the poll objects of a context.
+ * The pollfds array of the context always holds the file descriptors and the
+ * events, update() tells the backend that they changed for a poll object.
+ * wait() stores the poll objects with events and ORs the events into their
+ * revents field.
+ */
+struct ssh_poll_backend_struct {
+  enum ssh_poll_backend_e type;
+  int (*init)(ssh_poll_ctx ctx);
+  void (*cleanup)(ssh_poll_ctx ctx);
+  int (*update)(ssh_poll_ctx ctx, ssh_poll_handle p);
+  void (*remove)(ssh_poll_ctx ctx, ssh_poll_handle p);
+  int (*wait)(ssh_poll_ctx ctx, ssh_poll_handle *ready, size_t size,
+      int timeout);
+};
+
+/*
+ * The poll objects caught by a ssh_poll_ctx_dopoll() call, which are
+ * dispatched from pos. Callbacks may poll the context again, so the calls in
+ * progress are chained.
+ */
+struct ssh_poll_dispatch_struct {
+  ssh_poll_handle *ready;
+  size_t pos;
+  size_t count;
+  struct ssh_poll_dispatch_struct *prev;
 };
 
 struct ssh_poll_ctx_struct {
@@ -78,6 +167,21 @@ struct ssh_poll_ctx_struct {
   size_t polls_allocated;
   size_t polls_used;
   size_t chunk_size;
+  const struct ssh_poll_backend_struct *backend;
+  int auto_backend;
+  int backend_fd;
+  void *backend_events;
+  size_t backend_events_allocated;
+  /* private to the backend */
+  void *backend_data;
+  ssh_poll_handle *ready;
+  size_t ready_allocated;
+  unsigned int ready_serial;
+  struct ssh_poll_dispatch_struct *dispatch;
+  /* the poll objects by fd, see ssh_poll_ctx_index_fds() */
+  struct ssh_hashtable *fd_index;
+  /* allocated by the first timer */
+  struct ssh_timer_wheel *timers;
 };
 
 #ifdef HAVE_POLL
@@ -298,6 +402,1143 @@ int ssh_poll(ssh_pollfd_t *fds, nfds_t nfds, int timeout) {
 
 #endif /* HAVE_POLL */
 
+/* Readiness backends */
+
+static int ssh_poll_ctx_switch(ssh_poll_ctx ctx,
+    const struct ssh_poll_backend_struct *backend);
+
+/*
+ * Add the events caught by the current wait() for a poll object. It is stored
+ * once per wait(), even if a call in progress has it already.
+ */
+static void ssh_poll_ready(ssh_poll_ctx ctx, ssh_poll_handle p, short revents,
+    ssh_poll_handle *ready, size_t *count) {
+  if (p->ready_serial != ctx->ready_serial) {
+    p->ready_serial = ctx->ready_serial;
+    ready[(*count)++] = p;
+  }
+  p->revents |= revents;
+}
+
+static int poll_backend_init(ssh_poll_ctx ctx) {
+  (void) ctx;
+  return 0;
+}
+
+static void poll_backend_cleanup(ssh_poll_ctx ctx) {
+  (void) ctx;
+}
+
+static int poll_backend_update(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  (void) ctx;
+  (void) p;
+  return 0;
+}
+
+static void poll_backend_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  (void) ctx;
+  (void) p;
+}
+
+static int poll_backend_wait(ssh_poll_ctx ctx, ssh_poll_handle *ready,
+    size_t size, int timeout) {
+  ssh_poll_handle p;
+  size_t count = 0;
+  size_t i;
+  int rc;
+
+  rc = ssh_poll(ctx->pollfds, ctx->polls_used, timeout);
+  if (rc <= 0) {
+    return rc;
+  }
+
+  for (i = 0; i < ctx->polls_used && count < size && rc > 0; i++) {
+    if (ctx->pollfds[i].revents == 0) {
+      continue;
+    }
+    p = ctx->pollptrs[i];
+    ssh_poll_ready(ctx, p, ctx->pollfds[i].revents, ready, &count);
+    ctx->pollfds[i].revents = 0;
+    rc--;
+  }
+
+  return count;
+}
+
+static const struct ssh_poll_backend_struct ssh_poll_backend_poll = {
+  .type = SSH_POLL_BACKEND_POLL,
+  .init = poll_backend_init,
+  .cleanup = poll_backend_cleanup,
+  .update = poll_backend_update,
+  .remove = poll_backend_remove,
+  .wait = poll_backend_wait
+};
+
+/* the events to watch for a poll object, with the edge triggered flag */
+#define SSH_POLL_BACKEND_ET 0x10000
+
+static int ssh_poll_backend_events(ssh_poll_handle p) {
+  return p->events | (p->edge_triggered ? SSH_POLL_BACKEND_ET : 0);
+}
+
+/*
+ * The poll object doesn't need to be watched anymore and the ones from the
+ * whole context get registered again when switching the backend.
+ */
+static void ssh_poll_backend_forget(ssh_poll_ctx ctx) {
+  size_t i;
+
+  for (i = 0; i < ctx->polls_used; i++) {
+    ctx->pollptrs[i]->backend_fd = SSH_INVALID_SOCKET;
+    ctx->pollptrs[i]->backend_events = 0;
+  }
+  SAFE_FREE(ctx->backend_events);
+  ctx->backend_events_allocated = 0;
+}
+
+static int ssh_poll_backend_reserve(ssh_poll_ctx ctx, size_t count,
+    size_t event_size) {
+  void *events;
+
+  if (ctx->backend_events_allocated >= count) {
+    return 0;
+  }
+  events = realloc(ctx->backend_events, count * event_size);
+  if (events == NULL) {
+    return -1;
+  }
+  ctx->backend_events = events;
+  ctx->backend_events_allocated = count;
+
+  return 0;
+}
+
+#ifdef HAVE_EPOLL
+static int epoll_backend_init(ssh_poll_ctx ctx) {
+  ctx->backend_fd = epoll_create1(EPOLL_CLOEXEC);
+  return ctx->backend_fd < 0 ? -1 : 0;
+}
+
+static void epoll_backend_cleanup(ssh_poll_ctx ctx) {
+  if (ctx->backend_fd >= 0) {
+    close(ctx->backend_fd);
+    ctx->backend_fd = -1;
+  }
+  ssh_poll_backend_forget(ctx);
+}
+
+static int epoll_backend_update(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  socket_t fd = ctx->pollfds[p->x.idx].fd;
+  int events = ssh_poll_backend_events(p);
+  struct epoll_event ev;
+  int op;
+
+  ZERO_STRUCT(ev);
+
+  if (p->backend_fd != SSH_INVALID_SOCKET && p->backend_fd != fd) {
+    epoll_ctl(ctx->backend_fd, EPOLL_CTL_DEL, p->backend_fd, &ev);
+    p->backend_fd = SSH_INVALID_SOCKET;
+  }
+  if (fd == SSH_INVALID_SOCKET ||
+      (p->backend_fd == fd && p->backend_events == events)) {
+    return 0;
+  }
+
+  if (p->events & (POLLIN | POLLRDNORM)) {
+    ev.events |= EPOLLIN;
+  }
+  if (p->events & (POLLPRI | POLLRDBAND)) {
+    ev.events |= EPOLLPRI;
+  }
+  if (p->events & (POLLOUT | POLLWRNORM | POLLWRBAND)) {
+    ev.events |= EPOLLOUT;
+  }
+  if (p->edge_triggered) {
+    ev.events |= EPOLLET;
+  }
+  ev.data.ptr = p;
+
+  op = p->backend_fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(ctx->backend_fd, op, fd, &ev) < 0) {
+    return -1;
+  }
+  p->backend_fd = fd;
+  p->backend_events = events;
+
+  return 0;
+}
+
+static void epoll_backend_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  struct epoll_event ev;
+
+  if (p->backend_fd != SSH_INVALID_SOCKET) {
+    ZERO_STRUCT(ev);
+    epoll_ctl(ctx->backend_fd, EPOLL_CTL_DEL, p->backend_fd, &ev);
+    p->backend_fd = SSH_INVALID_SOCKET;
+  }
+}
+
+static int epoll_backend_wait(ssh_poll_ctx ctx, ssh_poll_handle *ready,
+    size_t size, int timeout) {
+  struct epoll_event *events;
+  ssh_poll_handle p;
+  size_t count = 0;
+  short revents;
+  int rc;
+  int i;
+
+  if (size > INT_MAX) {
+    size = INT_MAX;
+  }
+  if (ssh_poll_backend_reserve(ctx, size, sizeof(struct epoll_event)) < 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  events = ctx->backend_events;
+
+  rc = epoll_wait(ctx->backend_fd, events, (int) size, timeout);
+  if (rc <= 0) {
+    return rc;
+  }
+
+  for (i = 0; i < rc; i++) {
+    p = events[i].data.ptr;
+    revents = 0;
+    if (events[i].events & EPOLLIN) {
+      revents |= POLLIN;
+    }
+    if (events[i].events & EPOLLPRI) {
+      revents |= POLLPRI;
+    }
+    if (events[i].events & EPOLLOUT) {
+      revents |= POLLOUT;
+    }
+    if (events[i].events & EPOLLERR) {
+      revents |= POLLERR;
+    }
+    if (events[i].events & EPOLLHUP) {
+      revents |= POLLHUP;
+    }
+    ssh_poll_ready(ctx, p, revents, ready, &count);
+  }
+
+  return count;
+}
+
+static const struct ssh_poll_backend_struct ssh_poll_backend_epoll = {
+  .type = SSH_POLL_BACKEND_EPOLL,
+  .init = epoll_backend_init,
+  .cleanup = epoll_backend_cleanup,
+  .update = epoll_backend_update,
+  .remove = epoll_backend_remove,
+  .wait = epoll_backend_wait
+};
+#endif /* HAVE_EPOLL */
+
+#ifdef HAVE_KQUEUE
+static int kqueue_backend_init(ssh_poll_ctx ctx) {
+  ctx->backend_fd = kqueue();
+  return ctx->backend_fd < 0 ? -1 : 0;
+}
+
+static void kqueue_backend_cleanup(ssh_poll_ctx ctx) {
+  if (ctx->backend_fd >= 0) {
+    close(ctx->backend_fd);
+    ctx->backend_fd = -1;
+  }
+  ssh_poll_backend_forget(ctx);
+}
+
+/* kqueue has a filter for reading and one for writing */
+#define KQUEUE_READ(events) ((events) & (POLLIN | POLLRDNORM | \
+                                         POLLPRI | POLLRDBAND))
+#define KQUEUE_WRITE(events) ((events) & (POLLOUT | POLLWRNORM | POLLWRBAND))
+
+static int kqueue_backend_change(ssh_poll_ctx ctx, ssh_poll_handle p,
+    socket_t fd, int old_events, int events) {
+  struct kevent changes[2];
+  int flags = EV_ADD | ((events & SSH_POLL_BACKEND_ET) ? EV_CLEAR : 0);
+  int n = 0;
+
+  if (KQUEUE_READ(events)) {
+    EV_SET(&changes[n++], fd, EVFILT_READ, flags, 0, 0, p);
+  } else if (KQUEUE_READ(old_events)) {
+    EV_SET(&changes[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, p);
+  }
+  if (KQUEUE_WRITE(events)) {
+    EV_SET(&changes[n++], fd, EVFILT_WRITE, flags, 0, 0, p);
+  } else if (KQUEUE_WRITE(old_events)) {
+    EV_SET(&changes[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, p);
+  }
+  if (n == 0) {
+    return 0;
+  }
+
+  return kevent(ctx->backend_fd, changes, n, NULL, 0, NULL) < 0 ? -1 : 0;
+}
+
+static int kqueue_backend_update(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  socket_t fd = ctx->pollfds[p->x.idx].fd;
+  int events = ssh_poll_backend_events(p);
+
+  if (p->backend_fd != SSH_INVALID_SOCKET && p->backend_fd != fd) {
+    kqueue_backend_change(ctx, p, p->backend_fd, p->backend_events, 0);
+    p->backend_fd = SSH_INVALID_SOCKET;
+    p->backend_events = 0;
+  }
+  if (fd == SSH_INVALID_SOCKET ||
+      (p->backend_fd == fd && p->backend_events == events)) {
+    return 0;
+  }
+
+  if (kqueue_backend_change(ctx, p, fd,
+        p->backend_fd == fd ? p->backend_events : 0, events) < 0) {
+    return -1;
+  }
+  p->backend_fd = fd;
+  p->backend_events = events;
+
+  return 0;
+}
+
+static void kqueue_backend_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  if (p->backend_fd != SSH_INVALID_SOCKET) {
+    kqueue_backend_change(ctx, p, p->backend_fd, p->backend_events, 0);
+    p->backend_fd = SSH_INVALID_SOCKET;
+    p->backend_events = 0;
+  }
+}
+
+static int kqueue_backend_wait(ssh_poll_ctx ctx, ssh_poll_handle *ready,
+    size_t size, int timeout) {
+  struct timespec ts, *pts = NULL;
+  struct kevent *events;
+  ssh_poll_handle p;
+  size_t count = 0;
+  short revents;
+  int rc;
+  int i;
+
+  /* up to two filters per poll object */
+  if (size > INT_MAX / 2) {
+    size = INT_MAX / 2;
+  }
+  if (ssh_poll_backend_reserve(ctx, size * 2, sizeof(struct kevent)) < 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  events = ctx->backend_events;
+
+  if (timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    pts = &ts;
+  }
+
+  rc = kevent(ctx->backend_fd, NULL, 0, events, (int) size * 2, pts);
+  if (rc <= 0) {
+    return rc;
+  }
+
+  for (i = 0; i < rc; i++) {
+    p = events[i].udata;
+    revents = 0;
+    if (events[i].flags & EV_ERROR) {
+      revents |= POLLERR;
+    } else if (events[i].filter == EVFILT_READ) {
+      revents |= POLLIN;
+    } else if (events[i].filter == EVFILT_WRITE) {
+      revents |= POLLOUT;
+    }
+    if (events[i].flags & EV_EOF) {
+      revents |= POLLHUP;
+    }
+    ssh_poll_ready(ctx, p, revents, ready, &count);
+  }
+
+  return count;
+}
+
+static const struct ssh_poll_backend_struct ssh_poll_backend_kqueue = {
+  .type = SSH_POLL_BACKEND_KQUEUE,
+  .init = kqueue_backend_init,
+  .cleanup = kqueue_backend_cleanup,
+  .update = kqueue_backend_update,
+  .remove = kqueue_backend_remove,
+  .wait = kqueue_backend_wait
+};
+#endif /* HAVE_KQUEUE */
+
+#ifdef HAVE_IO_URING
+/*
+ * io_uring watches the poll objects with POLL_ADD requests: one-shot ones for
+ * the level triggered poll objects, armed again after each event, and
+ * multishot ones for the edge triggered ones. The new requests are submitted
+ * by the wait, so a loop costs a single system call however many events
+ * changed.
+ */
+#define IO_URING_ENTRIES 256
+
+struct io_uring_ring {
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int *sq_array;
+  /* queued and not submitted yet */
+  unsigned int sq_pending;
+  struct io_uring_sqe *sqes;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  /* the poll objects by request, the completions of stale ones are ignored */
+  struct ssh_hashtable *requests;
+  uint64_t last_id;
+};
+
+static int io_uring_backend_enter(ssh_poll_ctx ctx, unsigned int wait_nr,
+    int timeout) {
+  struct io_uring_ring *ring = ctx->backend_data;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned int flags = 0;
+  long rc;
+
+  ZERO_STRUCT(arg);
+  if (wait_nr > 0) {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout >= 0) {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (timeout % 1000) * 1000000L;
+      arg.ts = (uint64_t) (uintptr_t) &ts;
+      flags |= IORING_ENTER_EXT_ARG;
+    }
+  }
+
+  rc = syscall(__NR_io_uring_enter, ctx->backend_fd, ring->sq_pending,
+      wait_nr, flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+      (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+  if (rc < 0) {
+    return -1;
+  }
+  ring->sq_pending -= (unsigned int) rc;
+
+  return 0;
+}
+
+static int io_uring_backend_queue(ssh_poll_ctx ctx, uint8_t opcode,
+    socket_t fd, uint32_t events, uint32_t flags, uint64_t addr,
+    uint64_t user_data) {
+  struct io_uring_ring *ring = ctx->backend_data;
+  struct io_uring_sqe *sqe;
+  unsigned int tail = *ring->sq_tail;
+  unsigned int idx;
+
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+      ring->sq_entries) {
+    if (io_uring_backend_enter(ctx, 0, 0) < 0 ||
+        tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries) {
+      return -1;
+    }
+  }
+
+  idx = tail & ring->sq_mask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->len = flags;
+  sqe->addr = addr;
+  sqe->user_data = user_data;
+  ring->sq_array[idx] = idx;
+
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->sq_pending++;
+
+  return 0;
+}
+
+/* cancel the request of a poll object, its last completion is ignored */
+static void io_uring_backend_disarm(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  struct io_uring_ring *ring = ctx->backend_data;
+
+  if (p->backend_fd == SSH_INVALID_SOCKET) {
+    return;
+  }
+  ssh_hashtable_remove(ring->requests, p->backend_id, p);
+  io_uring_backend_queue(ctx, IORING_OP_POLL_REMOVE, -1, 0, 0,
+      p->backend_id, 0);
+  p->backend_fd = SSH_INVALID_SOCKET;
+  p->backend_events = 0;
+}
+
+static int io_uring_backend_arm(ssh_poll_ctx ctx, ssh_poll_handle p,
+    socket_t fd) {
+  struct io_uring_ring *ring = ctx->backend_data;
+  uint64_t id = ++ring->last_id;
+
+  if (ssh_hashtable_insert(ring->requests, id, p) < 0) {
+    return -1;
+  }
+  if (io_uring_backend_queue(ctx, IORING_OP_POLL_ADD, fd,
+        (uint32_t) (unsigned short) p->events,
+        p->edge_triggered ? IORING_POLL_ADD_MULTI : 0, 0, id) < 0) {
+    ssh_hashtable_remove(ring->requests, id, p);
+    return -1;
+  }
+  p->backend_fd = fd;
+  p->backend_events = ssh_poll_backend_events(p);
+  p->backend_id = id;
+
+  return 0;
+}
+
+static void io_uring_backend_cleanup(ssh_poll_ctx ctx) {
+  struct io_uring_ring *ring = ctx->backend_data;
+
+  if (ring != NULL) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    ssh_hashtable_free(ring->requests);
+    SAFE_FREE(ctx->backend_data);
+  }
+  if (ctx->backend_fd >= 0) {
+    close(ctx->backend_fd);
+    ctx->backend_fd = -1;
+  }
+  ssh_poll_backend_forget(ctx);
+}
+
+static int io_uring_backend_init(ssh_poll_ctx ctx) {
+  struct io_uring_params params;
+  struct io_uring_ring *ring;
+  unsigned char *sq, *cq;
+
+  ring = malloc(sizeof(struct io_uring_ring));
+  if (ring == NULL) {
+    return -1;
+  }
+  ZERO_STRUCTP(ring);
+  ctx->backend_data = ring;
+
+  ZERO_STRUCT(params);
+  ctx->backend_fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+  /* the wait timeout needs Linux 5.11 */
+  if (ctx->backend_fd < 0 || !(params.features & IORING_FEAT_EXT_ARG)) {
+    goto error;
+  }
+
+  ring->sq_ring_size = params.sq_off.array +
+    params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ctx->backend_fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ctx->backend_fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ctx->backend_fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    goto error;
+  }
+
+  sq = ring->sq_ring;
+  ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+  ring->sq_entries = *(unsigned int *) (sq + params.sq_off.ring_entries);
+  ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+  cq = ring->cq_ring;
+  ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  ring->requests = ssh_hashtable_new();
+  if (ring->requests == NULL) {
+    goto error;
+  }
+
+  return 0;
+
+error:
+  io_uring_backend_cleanup(ctx);
+  return -1;
+}
+
+static int io_uring_backend_update(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  socket_t fd = ctx->pollfds[p->x.idx].fd;
+
+  if (p->backend_fd == fd && p->backend_events == ssh_poll_backend_events(p)) {
+    return 0;
+  }
+  io_uring_backend_disarm(ctx, p);
+  if (fd == SSH_INVALID_SOCKET) {
+    return 0;
+  }
+
+  return io_uring_backend_arm(ctx, p, fd);
+}
+
+static void io_uring_backend_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  if (p->backend_fd == SSH_INVALID_SOCKET) {
+    return;
+  }
+  io_uring_backend_disarm(ctx, p);
+  /* the request holds the file: let it go before it gets closed */
+  io_uring_backend_enter(ctx, 0, 0);
+}
+
+static int io_uring_backend_wait(ssh_poll_ctx ctx, ssh_poll_handle *ready,
+    size_t size, int timeout) {
+  struct io_uring_ring *ring = ctx->backend_data;
+  struct io_uring_cqe *cqe;
+  ssh_poll_handle p;
+  unsigned int head, tail;
+  size_t count = 0;
+  short revents;
+
+  (void) size;
+
+  if ((timeout != 0 || ring->sq_pending > 0) &&
+      io_uring_backend_enter(ctx, timeout != 0 ? 1 : 0, timeout) < 0 &&
+      errno != ETIME) {
+    return -1;
+  }
+
+  head = *ring->cq_head;
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    cqe = &ring->cqes[head & ring->cq_mask];
+    p = cqe->user_data != 0 ?
+      ssh_hashtable_lookup(ring->requests, cqe->user_data) : NULL;
+    if (p == NULL) {
+      continue;
+    }
+
+    if (cqe->res < 0) {
+      revents = POLLERR;
+    } else {
+      revents = (short) cqe->res;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      /* the request is over, watch again unless it failed */
+      ssh_hashtable_remove(ring->requests, cqe->user_data, p);
+      p->backend_fd = SSH_INVALID_SOCKET;
+      p->backend_events = 0;
+      if (cqe->res >= 0) {
+        io_uring_backend_arm(ctx, p, ctx->pollfds[p->x.idx].fd);
+      }
+    }
+    ssh_poll_ready(ctx, p, revents, ready, &count);
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+  return count;
+}
+
+static const struct ssh_poll_backend_struct ssh_poll_backend_io_uring = {
+  .type = SSH_POLL_BACKEND_IO_URING,
+  .init = io_uring_backend_init,
+  .cleanup = io_uring_backend_cleanup,
+  .update = io_uring_backend_update,
+  .remove = io_uring_backend_remove,
+  .wait = io_uring_backend_wait
+};
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_IOCP
+/*
+ * An I/O completion port only tells when an overlapped operation is over. A
+ * zero byte overlapped WSARecv() is over when data, the end of the stream or
+ * an error arrives, without taking anything from the socket: the callback
+ * reads it into the session buffers as with the other backends. The reads
+ * which are over get posted again by the next wait, once the callbacks
+ * emptied the sockets. There is nothing like it for writing, and POLLOUT is
+ * only asked for after a send would have blocked, so the few poll objects
+ * waiting for it are checked with ssh_poll() between slices of the wait.
+ *
+ * A socket stays with the first port it is associated with: a context which
+ * gets a socket of another one goes back to poll().
+ */
+#define IOCP_ENTRIES 64
+/* how often the poll objects waiting for POLLOUT are checked, in ms */
+#define IOCP_WRITE_SLICE 10
+
+#define IOCP_READ(events) ((events) & (POLLIN | POLLRDNORM | \
+                                       POLLPRI | POLLRDBAND))
+#define IOCP_WRITE(events) ((events) & (POLLOUT | POLLWRNORM | POLLWRBAND))
+
+struct iocp_watch {
+  /* first, the completions give it back */
+  OVERLAPPED ov;
+  /* NULL once the poll object is gone, freed when its read is over */
+  ssh_poll_handle p;
+  socket_t fd;
+  int pending;
+  int rearm;
+  struct iocp_watch *prev;
+  struct iocp_watch *next;
+};
+
+struct iocp_port {
+  HANDLE port;
+  struct iocp_watch *watches;
+  size_t watches_count;
+  size_t pending;
+  /* the watches to post a read for, room for all of them */
+  struct iocp_watch **rearm;
+  size_t rearm_count;
+  size_t rearm_allocated;
+  /* the sockets associated with the port, by fd */
+  struct ssh_hashtable *sockets;
+  /* the poll objects waiting for POLLOUT, by pointer */
+  struct ssh_hashtable *writers;
+  ssh_pollfd_t *pollfds;
+  ssh_poll_handle *pollptrs;
+  size_t pollfds_allocated;
+};
+
+static void iocp_watch_free(struct iocp_port *port, struct iocp_watch *w) {
+  if (w->prev != NULL) {
+    w->prev->next = w->next;
+  } else {
+    port->watches = w->next;
+  }
+  if (w->next != NULL) {
+    w->next->prev = w->prev;
+  }
+  port->watches_count--;
+  SAFE_FREE(w);
+}
+
+static int iocp_backend_post(struct iocp_port *port, struct iocp_watch *w) {
+  WSABUF buf;
+  DWORD flags = 0;
+
+  buf.buf = NULL;
+  buf.len = 0;
+  ZERO_STRUCT(w->ov);
+  if (WSARecv(w->fd, &buf, 1, NULL, &flags, &w->ov, NULL) == SOCKET_ERROR &&
+      WSAGetLastError() != WSA_IO_PENDING) {
+    return -1;
+  }
+  w->pending = 1;
+  port->pending++;
+
+  return 0;
+}
+
+static void iocp_backend_queue(struct iocp_port *port, struct iocp_watch *w) {
+  if (!w->rearm) {
+    w->rearm = 1;
+    port->rearm[port->rearm_count++] = w;
+  }
+}
+
+static int iocp_backend_associate(struct iocp_port *port, socket_t fd) {
+  uint64_t key = (uint64_t) fd;
+
+  if (CreateIoCompletionPort((HANDLE) fd, port->port, 0, 0) == NULL) {
+    /* it can't be done twice */
+    return ssh_hashtable_lookup(port->sockets, key) != NULL ? 0 : -1;
+  }
+  if (ssh_hashtable_lookup(port->sockets, key) == NULL &&
+      ssh_hashtable_insert(port->sockets, key, port) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void iocp_backend_cleanup(ssh_poll_ctx ctx) {
+  struct iocp_port *port = ctx->backend_data;
+  OVERLAPPED_ENTRY entries[IOCP_ENTRIES];
+  struct iocp_watch *w, *next;
+  ULONG n, j;
+  size_t i;
+
+  for (i = 0; i < ctx->polls_used; i++) {
+    ctx->pollptrs[i]->backend_id = 0;
+  }
+
+  if (port != NULL) {
+    for (w = port->watches; w != NULL; w = w->next) {
+      w->p = NULL;
+      if (w->pending) {
+        CancelIoEx((HANDLE) w->fd, &w->ov);
+      }
+    }
+    /* the cancelled reads still write into their watch */
+    while (port->pending > 0 &&
+        GetQueuedCompletionStatusEx(port->port, entries, IOCP_ENTRIES, &n,
+          1000, FALSE)) {
+      for (j = 0; j < n; j++) {
+        w = (struct iocp_watch *) entries[j].lpOverlapped;
+        w->pending = 0;
+        port->pending--;
+      }
+    }
+    for (w = port->watches; w != NULL; w = next) {
+      next = w->next;
+      /* leaked rather than written into after being freed */
+      if (!w->pending) {
+        iocp_watch_free(port, w);
+      }
+    }
+    if (port->port != NULL) {
+      CloseHandle(port->port);
+    }
+    ssh_hashtable_free(port->sockets);
+    ssh_hashtable_free(port->writers);
+    SAFE_FREE(port->rearm);
+    SAFE_FREE(port->pollfds);
+    SAFE_FREE(port->pollptrs);
+    SAFE_FREE(ctx->backend_data);
+  }
+  ssh_poll_backend_forget(ctx);
+}
+
+static int iocp_backend_init(ssh_poll_ctx ctx) {
+  struct iocp_port *port;
+
+  port = malloc(sizeof(struct iocp_port));
+  if (port == NULL) {
+    return -1;
+  }
+  ZERO_STRUCTP(port);
+  ctx->backend_data = port;
+
+  port->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+  port->sockets = ssh_hashtable_new();
+  port->writers = ssh_hashtable_new();
+  if (port->port == NULL || port->sockets == NULL || port->writers == NULL) {
+    iocp_backend_cleanup(ctx);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void iocp_backend_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  struct iocp_port *port = ctx->backend_data;
+  struct iocp_watch *w = (struct iocp_watch *) (uintptr_t) p->backend_id;
+
+  ssh_hashtable_remove(port->writers, ssh_hashtable_ptr_key(p), p);
+  p->backend_fd = SSH_INVALID_SOCKET;
+  p->backend_events = 0;
+  if (w == NULL) {
+    return;
+  }
+  p->backend_id = 0;
+
+  w->p = NULL;
+  if (w->pending) {
+    CancelIoEx((HANDLE) w->fd, &w->ov);
+  } else if (!w->rearm) {
+    iocp_watch_free(port, w);
+  }
+}
+
+static int iocp_backend_update(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  struct iocp_port *port = ctx->backend_data;
+  struct iocp_watch *w = (struct iocp_watch *) (uintptr_t) p->backend_id;
+  socket_t fd = ctx->pollfds[p->x.idx].fd;
+  uint64_t key = ssh_hashtable_ptr_key(p);
+  struct iocp_watch **rearm;
+
+  if (w != NULL && w->fd != fd) {
+    iocp_backend_remove(ctx, p);
+    w = NULL;
+  }
+  if (fd == SSH_INVALID_SOCKET) {
+    return 0;
+  }
+
+  if (w == NULL) {
+    if (iocp_backend_associate(port, fd) < 0) {
+      return -1;
+    }
+    if (port->rearm_allocated <= port->watches_count) {
+      rearm = realloc(port->rearm,
+          sizeof(struct iocp_watch *) * (port->rearm_allocated * 2 + 8));
+      if (rearm == NULL) {
+        return -1;
+      }
+      port->rearm = rearm;
+      port->rearm_allocated = port->rearm_allocated * 2 + 8;
+    }
+    w = malloc(sizeof(struct iocp_watch));
+    if (w == NULL) {
+      return -1;
+    }
+    ZERO_STRUCTP(w);
+    w->p = p;
+    w->fd = fd;
+    w->next = port->watches;
+    if (w->next != NULL) {
+      w->next->prev = w;
+    }
+    port->watches = w;
+    port->watches_count++;
+    p->backend_id = (uint64_t) (uintptr_t) w;
+  }
+  p->backend_fd = fd;
+  p->backend_events = ssh_poll_backend_events(p);
+
+  if (IOCP_READ(p->events) && !w->pending) {
+    iocp_backend_queue(port, w);
+  }
+  if (!IOCP_WRITE(p->events)) {
+    ssh_hashtable_remove(port->writers, key, p);
+  } else if (ssh_hashtable_lookup(port->writers, key) == NULL &&
+      ssh_hashtable_insert(port->writers, key, p) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* the poll objects waiting for POLLOUT which can write */
+static int iocp_backend_writable(ssh_poll_ctx ctx, ssh_poll_handle *ready,
+    size_t *count) {
+  struct iocp_port *port = ctx->backend_data;
+  struct ssh_hashtable_entry *entry;
+  ssh_pollfd_t *pollfds;
+  ssh_poll_handle *pollptrs;
+  ssh_poll_handle p;
+  size_t n = 0;
+  size_t i;
+  int rc;
+
+  if (port->writers->count == 0) {
+    return 0;
+  }
+  if (port->pollfds_allocated < port->writers->count) {
+    pollfds = realloc(port->pollfds,
+        sizeof(ssh_pollfd_t) * port->writers->count);
+    if (pollfds == NULL) {
+      return -1;
+    }
+    port->pollfds = pollfds;
+    pollptrs = realloc(port->pollptrs,
+        sizeof(ssh_poll_handle) * port->writers->count);
+    if (pollptrs == NULL) {
+      return -1;
+    }
+    port->pollptrs = pollptrs;
+    port->pollfds_allocated = port->writers->count;
+  }
+
+  for (entry = ssh_hashtable_first(port->writers); entry != NULL;
+      entry = ssh_hashtable_next(port->writers, entry)) {
+    p = entry->data;
+    port->pollfds[n].fd = p->backend_fd;
+    /* WSAPoll() rejects the other write events */
+    port->pollfds[n].events = POLLOUT;
+    port->pollfds[n].revents = 0;
+    port->pollptrs[n++] = p;
+  }
+
+  rc = ssh_poll(port->pollfds, n, 0);
+  if (rc <= 0) {
+    return rc;
+  }
+  for (i = 0; i < n; i++) {
+    if (port->pollfds[i].revents != 0) {
+      ssh_poll_ready(ctx, port->pollptrs[i], port->pollfds[i].revents, ready,
+          count);
+    }
+  }
+
+  return 0;
+}
+
+static int iocp_backend_wait(ssh_poll_ctx ctx, ssh_poll_handle *ready,
+    size_t size, int timeout) {
+  struct iocp_port *port = ctx->backend_data;
+  OVERLAPPED_ENTRY entries[IOCP_ENTRIES];
+  struct iocp_watch *w;
+  size_t count = 0;
+  short revents;
+  DWORD slice;
+  ULONG n, j;
+  size_t i;
+
+  (void) size;
+
+  /* the callbacks had their chance to empty the sockets */
+  for (i = 0; i < port->rearm_count; i++) {
+    w = port->rearm[i];
+    w->rearm = 0;
+    if (w->p == NULL) {
+      if (!w->pending) {
+        iocp_watch_free(port, w);
+      }
+      continue;
+    }
+    if (w->pending || !IOCP_READ(w->p->events)) {
+      continue;
+    }
+    if (iocp_backend_post(port, w) < 0) {
+      ssh_poll_ready(ctx, w->p, POLLIN | POLLERR, ready, &count);
+    }
+  }
+  port->rearm_count = 0;
+
+  for (;;) {
+    if (iocp_backend_writable(ctx, ready, &count) < 0) {
+      errno = ENOMEM;
+      return -1;
+    }
+    if (count > 0) {
+      timeout = 0;
+    }
+    slice = timeout < 0 ? INFINITE : (DWORD) timeout;
+    if (port->writers->count > 0 && slice > IOCP_WRITE_SLICE) {
+      slice = IOCP_WRITE_SLICE;
+    }
+
+    if (!GetQueuedCompletionStatusEx(port->port, entries, IOCP_ENTRIES, &n,
+          slice, FALSE)) {
+      if (GetLastError() != WAIT_TIMEOUT) {
+        errno = EINVAL;
+        return -1;
+      }
+      n = 0;
+    }
+
+    for (j = 0; j < n; j++) {
+      w = (struct iocp_watch *) entries[j].lpOverlapped;
+      w->pending = 0;
+      port->pending--;
+      if (w->p == NULL) {
+        if (!w->rearm) {
+          iocp_watch_free(port, w);
+        }
+        continue;
+      }
+      if (!IOCP_READ(w->p->events)) {
+        continue;
+      }
+      /* the status of the read */
+      revents = entries[j].Internal != 0 ? POLLIN | POLLERR : POLLIN;
+      ssh_poll_ready(ctx, w->p, revents, ready, &count);
+      iocp_backend_queue(port, w);
+    }
+
+    if (count > 0 || timeout == 0 ||
+        (timeout > 0 && (DWORD) timeout <= slice)) {
+      break;
+    }
+    if (timeout > 0) {
+      timeout -= slice;
+    }
+  }
+
+  return count;
+}
+
+static const struct ssh_poll_backend_struct ssh_poll_backend_iocp = {
+  .type = SSH_POLL_BACKEND_IOCP,
+  .init = iocp_backend_init,
+  .cleanup = iocp_backend_cleanup,
+  .update = iocp_backend_update,
+  .remove = iocp_backend_remove,
+  .wait = iocp_backend_wait
+};
+#endif /* HAVE_IOCP */
+
+/* the scalable backend of the platform, NULL if there isn't any */
+static const struct ssh_poll_backend_struct *ssh_poll_backend_scalable(void) {
+#if defined(HAVE_EPOLL)
+  return &ssh_poll_backend_epoll;
+#elif defined(HAVE_KQUEUE)
+  return &ssh_poll_backend_kqueue;
+#elif defined(HAVE_IOCP)
+  return &ssh_poll_backend_iocp;
+#else
+  return NULL;
+#endif
+}
+
+/*
+ * Keep the fd index in sync. If it can't grow, the lookups go back to
+ * scanning the context.
+ */
+static void ssh_poll_ctx_index_add(ssh_poll_ctx ctx, socket_t fd,
+    ssh_poll_handle p) {
+  if (ctx->fd_index != NULL && fd != SSH_INVALID_SOCKET &&
+      ssh_hashtable_insert(ctx->fd_index, (uint64_t) fd, p) < 0) {
+    ssh_hashtable_free(ctx->fd_index);
+    ctx->fd_index = NULL;
+  }
+}
+
+static void ssh_poll_ctx_index_remove(ssh_poll_ctx ctx, socket_t fd,
+    ssh_poll_handle p) {
+  if (ctx->fd_index != NULL && fd != SSH_INVALID_SOCKET) {
+    ssh_hashtable_remove(ctx->fd_index, (uint64_t) fd, p);
+  }
+}
+
+/*
+ * Tell the backend that the fd or the events of a poll object changed. A
+ * backend which can't watch it (e.g. epoll with a regular file or the same fd
+ * twice) is replaced by poll() for the whole context.
+ */
+static void ssh_poll_ctx_update(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  if (ctx->backend->update(ctx, p) < 0) {
+    ctx->auto_backend = 0;
+    ssh_poll_ctx_switch(ctx, &ssh_poll_backend_poll);
+  }
+}
+
+static int ssh_poll_ctx_switch(ssh_poll_ctx ctx,
+    const struct ssh_poll_backend_struct *backend) {
+  size_t i;
+
+  if (backend == ctx->backend) {
+    return 0;
+  }
+
+  ctx->backend->cleanup(ctx);
+  ctx->backend = &ssh_poll_backend_poll;
+  if (backend->init(ctx) < 0) {
+    return -1;
+  }
+  ctx->backend = backend;
+
+  for (i = 0; i < ctx->polls_used; i++) {
+    if (backend->update(ctx, ctx->pollptrs[i]) < 0) {
+      backend->cleanup(ctx);
+      ctx->backend = &ssh_poll_backend_poll;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
 /**
  * @brief  Allocate a new poll object, which could be used within a poll context.
  *
@@ -326,6 +1567,7 @@ ssh_poll_handle ssh_poll_new(socket_t fd, short events, ssh_poll_callback cb,
 
     p->x.fd = fd;
     p->events = events;
+    p->backend_fd = SSH_INVALID_SOCKET;
     p->cb = cb;
     p->cb_data = userdata;
 
@@ -344,9 +1586,67 @@ void ssh_poll_free(ssh_poll_handle p) {
 		ssh_poll_ctx_remove(p->ctx,p);
 		p->ctx=NULL;
 	}
+  ssh_poll_set_owner(p, NULL);
   SAFE_FREE(p);
 }
 
+/**
+ * @internal
+ *
+ * @brief  Make a poll object follow a session from a poll context to
+ *         another, see ssh_polls_move(). It leaves the list when it is freed.
+ *
+ * @param  p            Pointer to an already allocated poll object.
+ *
+ * @param  owner        The list of poll objects of the session, NULL to
+ *                      leave the list it is in.
+ */
+void ssh_poll_set_owner(ssh_poll_handle p, ssh_poll_handle *owner) {
+  if (p->owner != NULL) {
+    if (p->owner_prev != NULL) {
+      p->owner_prev->owner_next = p->owner_next;
+    } else {
+      *p->owner = p->owner_next;
+    }
+    if (p->owner_next != NULL) {
+      p->owner_next->owner_prev = p->owner_prev;
+    }
+    p->owner = NULL;
+    p->owner_next = p->owner_prev = NULL;
+  }
+  if (owner != NULL) {
+    p->owner = owner;
+    p->owner_next = *owner;
+    if (*owner != NULL) {
+      (*owner)->owner_prev = p;
+    }
+    *owner = p;
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief  Move the poll objects of a session to the poll context it now runs
+ *         in. The ones which left their context stay out.
+ *
+ * @param  polls        The list of poll objects of the session.
+ *
+ * @param  ctx          The new poll context.
+ */
+void ssh_polls_move(ssh_poll_handle polls, ssh_poll_ctx ctx) {
+  ssh_poll_handle p;
+  ssh_poll_ctx old;
+
+  for (p = polls; p != NULL; p = p->owner_next) {
+    old = p->ctx;
+    if (old != NULL && old != ctx) {
+      ssh_poll_ctx_remove(old, p);
+      ssh_poll_ctx_add(ctx, p);
+    }
+  }
+}
+
 /**
  * @brief  Get the poll context of a poll object.
  *
@@ -380,6 +1680,7 @@ void ssh_poll_set_events(ssh_poll_handle p, short events) {
   p->events = events;
   if (p->ctx != NULL) {
     p->ctx->pollfds[p->x.idx].events = events;
+    ssh_poll_ctx_update(p->ctx, p);
   }
 }
 
@@ -392,12 +1693,32 @@ void ssh_poll_set_events(ssh_poll_handle p, short events) {
  */
 void ssh_poll_set_fd(ssh_poll_handle p, socket_t fd) {
   if (p->ctx != NULL) {
+    ssh_poll_ctx_index_remove(p->ctx, p->ctx->pollfds[p->x.idx].fd, p);
     p->ctx->pollfds[p->x.idx].fd = fd;
+    ssh_poll_ctx_index_add(p->ctx, fd, p);
+    ssh_poll_ctx_update(p->ctx, p);
   } else {
   	p->x.fd = fd;
   }
 }
 
+/**
+ * @brief  Make the poll object edge triggered, if the backend of its poll
+ *         context supports it (epoll, kqueue): the callback is only called
+ *         again once new events happen after it, so it has to consume
+ *         everything until the operations would block. Poll objects are
+ *         level triggered by default.
+ *
+ * @param  p            Pointer to an already allocated poll object.
+ * @param  enable       1 to make it edge triggered, 0 for level triggered.
+ */
+void ssh_poll_set_edge_triggered(ssh_poll_handle p, int enable) {
+  p->edge_triggered = enable ? 1 : 0;
+  if (p->ctx != NULL) {
+    ssh_poll_ctx_update(p->ctx, p);
+  }
+}
+
 /**
  * @brief  Add extra events to a poll object. Duplicates are ignored.
  *         The events will also be propagated to an associated poll context.
@@ -470,13 +1791,94 @@ ssh_poll_ctx ssh_poll_ctx_new(size_t chunk_size) {
     }
     ZERO_STRUCTP(ctx);
 
-    if (chunk_size == 0) {
-        chunk_size = SSH_POLL_CTX_CHUNK;
-    }
+    if (chunk_size == 0) {
+        chunk_size = SSH_POLL_CTX_CHUNK;
+    }
+
+    ctx->chunk_size = chunk_size;
+    ctx->backend = &ssh_poll_backend_poll;
+    ctx->auto_backend = 1;
+    ctx->backend_fd = -1;
+
+    return ctx;
+}
+
+/**
+ * @brief  Choose how a poll context waits for the events. By default
+ *         (SSH_POLL_BACKEND_AUTO) it uses poll() and switches to epoll,
+ *         kqueue or an I/O completion port when it grows big enough.
+ *         SSH_POLL_BACKEND_IO_URING has to be chosen explicitly, it isn't
+ *         allowed everywhere (e.g. by container seccomp profiles).
+ *
+ * @param  ctx          Pointer to an already allocated poll context.
+ * @param  type         The backend to use.
+ *
+ * @return              0 on success, < 0 if the backend isn't available, in
+ *                      which case poll() is used.
+ */
+int ssh_poll_ctx_set_backend(ssh_poll_ctx ctx, enum ssh_poll_backend_e type) {
+  const struct ssh_poll_backend_struct *backend = NULL;
+
+  switch (type) {
+    case SSH_POLL_BACKEND_AUTO:
+      ctx->auto_backend = 1;
+      if (ctx->polls_used < SSH_POLL_CTX_SCALABLE) {
+        return 0;
+      }
+      backend = ssh_poll_backend_scalable();
+      if (backend == NULL) {
+        return 0;
+      }
+      break;
+    case SSH_POLL_BACKEND_POLL:
+      backend = &ssh_poll_backend_poll;
+      break;
+#ifdef HAVE_EPOLL
+    case SSH_POLL_BACKEND_EPOLL:
+      backend = &ssh_poll_backend_epoll;
+      break;
+#endif
+#ifdef HAVE_KQUEUE
+    case SSH_POLL_BACKEND_KQUEUE:
+      backend = &ssh_poll_backend_kqueue;
+      break;
+#endif
+#ifdef HAVE_IO_URING
+    case SSH_POLL_BACKEND_IO_URING:
+      backend = &ssh_poll_backend_io_uring;
+      break;
+#endif
+#ifdef HAVE_IOCP
+    case SSH_POLL_BACKEND_IOCP:
+      backend = &ssh_poll_backend_iocp;
+      break;
+#endif
+    default:
+      break;
+  }
+
+  if (type != SSH_POLL_BACKEND_AUTO) {
+    ctx->auto_backend = 0;
+  }
+  if (backend == NULL) {
+    ssh_poll_ctx_switch(ctx, &ssh_poll_backend_poll);
+    return -1;
+  }
 
-    ctx->chunk_size = chunk_size;
+  return ssh_poll_ctx_switch(ctx, backend);
+}
 
-    return ctx;
+/**
+ * @brief  Get the backend a poll context is currently using.
+ *
+ * @param  ctx          Pointer to an already allocated poll context.
+ *
+ * @return              SSH_POLL_BACKEND_POLL, SSH_POLL_BACKEND_EPOLL,
+ *                      SSH_POLL_BACKEND_KQUEUE, SSH_POLL_BACKEND_IO_URING or
+ *                      SSH_POLL_BACKEND_IOCP.
+ */
+enum ssh_poll_backend_e ssh_poll_ctx_get_backend(ssh_poll_ctx ctx) {
+  return ctx->backend->type;
 }
 
 /**
@@ -505,6 +1907,11 @@ void ssh_poll_ctx_free(ssh_poll_ctx ctx) {
     SAFE_FREE(ctx->pollfds);
   }
 
+  ctx->backend->cleanup(ctx);
+  SAFE_FREE(ctx->backend_events);
+  SAFE_FREE(ctx->ready);
+  ssh_hashtable_free(ctx->fd_index);
+  ssh_timer_wheel_free(ctx->timers);
   SAFE_FREE(ctx);
 }
 
@@ -546,9 +1953,16 @@ int ssh_poll_ctx_add(ssh_poll_ctx ctx, ssh_poll_handle p) {
     return -1;
   }
 
-  if (ctx->polls_used == ctx->polls_allocated &&
-      ssh_poll_ctx_resize(ctx, ctx->polls_allocated + ctx->chunk_size) < 0) {
-    return -1;
+  /* grow by half, at least by chunk_size, to add in amortized O(1) */
+  if (ctx->polls_used == ctx->polls_allocated) {
+    size_t grow = ctx->polls_allocated / 2;
+
+    if (grow < ctx->chunk_size) {
+      grow = ctx->chunk_size;
+    }
+    if (ssh_poll_ctx_resize(ctx, ctx->polls_allocated + grow) < 0) {
+      return -1;
+    }
   }
 
   fd = p->x.fd;
@@ -558,6 +1972,21 @@ int ssh_poll_ctx_add(ssh_poll_ctx ctx, ssh_poll_handle p) {
   ctx->pollfds[p->x.idx].events = p->events;
   ctx->pollfds[p->x.idx].revents = 0;
   p->ctx = ctx;
+  p->revents = 0;
+  p->backend_fd = SSH_INVALID_SOCKET;
+  p->backend_events = 0;
+  ssh_poll_ctx_index_add(ctx, fd, p);
+
+  if (ctx->auto_backend && ctx->backend == &ssh_poll_backend_poll &&
+      ctx->polls_used >= SSH_POLL_CTX_SCALABLE &&
+      ssh_poll_backend_scalable() != NULL) {
+    /* stay with poll() if the scalable backend can't handle the fds */
+    if (ssh_poll_ctx_switch(ctx, ssh_poll_backend_scalable()) < 0) {
+      ctx->auto_backend = 0;
+    }
+  } else {
+    ssh_poll_ctx_update(ctx, p);
+  }
 
   return 0;
 }
@@ -593,11 +2022,25 @@ int ssh_poll_ctx_add_socket (ssh_poll_ctx ctx, ssh_socket s) {
  * @param  p            Pointer to an already allocated poll object.
  */
 void ssh_poll_ctx_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
+  struct ssh_poll_dispatch_struct *dispatch;
   size_t i;
 
+  ctx->backend->remove(ctx, p);
+
+  /* don't dispatch the events caught for it */
+  for (dispatch = ctx->dispatch; dispatch != NULL; dispatch = dispatch->prev) {
+    for (i = dispatch->pos; i < dispatch->count; i++) {
+      if (dispatch->ready[i] == p) {
+        dispatch->ready[i] = NULL;
+      }
+    }
+  }
+  p->revents = 0;
+
   i = p->x.idx;
   p->x.fd = ctx->pollfds[i].fd;
   p->ctx = NULL;
+  ssh_poll_ctx_index_remove(ctx, p->x.fd, p);
 
   ctx->polls_used--;
 
@@ -605,12 +2048,102 @@ void ssh_poll_ctx_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
   if (ctx->polls_used > 0 && ctx->polls_used != i) {
     ctx->pollfds[i] = ctx->pollfds[ctx->polls_used];
     ctx->pollptrs[i] = ctx->pollptrs[ctx->polls_used];
+    ctx->pollptrs[i]->x.idx = i;
   }
 
-  /* this will always leave at least chunk_size polls allocated */
-  if (ctx->polls_allocated - ctx->polls_used > ctx->chunk_size) {
-    ssh_poll_ctx_resize(ctx, ctx->polls_allocated - ctx->chunk_size);
+  /*
+   * Shrink by half once a quarter is used, so adding and removing around a
+   * size doesn't realloc each time. This will always leave at least
+   * chunk_size polls allocated.
+   */
+  if (ctx->polls_allocated - ctx->polls_used > ctx->chunk_size &&
+      ctx->polls_used < ctx->polls_allocated / 4) {
+    ssh_poll_ctx_resize(ctx, ctx->polls_allocated / 2 > ctx->chunk_size ?
+        ctx->polls_allocated / 2 : ctx->chunk_size);
+  }
+}
+
+/**
+ * @brief  Index the poll objects of a poll context by fd, for the contexts
+ *         holding many of them.
+ *
+ * @param  ctx          Pointer to an already allocated poll context.
+ *
+ * @return              0 on success, < 0 on error
+ */
+int ssh_poll_ctx_index_fds(ssh_poll_ctx ctx) {
+  size_t i;
+
+  if (ctx->fd_index != NULL) {
+    return 0;
+  }
+  ctx->fd_index = ssh_hashtable_new();
+  if (ctx->fd_index == NULL) {
+    return -1;
+  }
+  for (i = 0; i < ctx->polls_used && ctx->fd_index != NULL; i++) {
+    ssh_poll_ctx_index_add(ctx, ctx->pollfds[i].fd, ctx->pollptrs[i]);
+  }
+
+  return ctx->fd_index != NULL ? 0 : -1;
+}
+
+/**
+ * @brief  Find a poll object of a poll context by its fd.
+ *
+ * @param  ctx          Pointer to an already allocated poll context.
+ * @param  fd           The fd to look for.
+ *
+ * @return              A poll object with this fd, NULL if there is none.
+ */
+ssh_poll_handle ssh_poll_ctx_find_fd(ssh_poll_ctx ctx, socket_t fd) {
+  size_t i;
+
+  if (fd == SSH_INVALID_SOCKET) {
+    return NULL;
+  }
+  if (ctx->fd_index != NULL) {
+    return ssh_hashtable_lookup(ctx->fd_index, (uint64_t) fd);
+  }
+  for (i = 0; i < ctx->polls_used; i++) {
+    if (ctx->pollfds[i].fd == fd) {
+      return ctx->pollptrs[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @internal
+ *
+ * @brief  Get the timer wheel of a poll context, creating it if needed.
+ *
+ * @param  ctx          The poll context.
+ *
+ * @return The timer wheel, NULL on error.
+ */
+struct ssh_timer_wheel *ssh_poll_ctx_get_timers(ssh_poll_ctx ctx) {
+  if (ctx->timers == NULL) {
+    ctx->timers = ssh_timer_wheel_new();
   }
+
+  return ctx->timers;
+}
+
+/* wait for the next timer when there is no socket to poll */
+static void ssh_poll_sleep(int timeout) {
+#if defined(_WIN32)
+  Sleep(timeout);
+#elif defined(HAVE_POLL)
+  poll(NULL, 0, timeout);
+#else
+  struct timeval tv;
+
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  select(0, NULL, NULL, NULL, &tv);
+#endif
 }
 
 /**
@@ -623,49 +2156,97 @@ void ssh_poll_ctx_remove(ssh_poll_ctx ctx, ssh_poll_handle p) {
  * @param  timeout      An upper limit on the time for which ssh_poll_ctx() will
  *                      block, in milliseconds. Specifying a negative value
  *                      means an infinite timeout. This parameter is passed to
- *                      the poll() function.
+ *                      the poll() function. It ends at the next expiry of
+ *                      the timers of the context, which are run after the
+ *                      poll.
  * @returns SSH_OK      No error.
  *          SSH_ERROR   Error happened during the poll.
  */
 
 int ssh_poll_ctx_dopoll(ssh_poll_ctx ctx, int timeout) {
-  int rc;
-  int i, used;
+  struct ssh_poll_dispatch_struct dispatch;
+  ssh_poll_handle *ready;
   ssh_poll_handle p;
-  socket_t fd;
+  size_t size;
   int revents;
+  int rc;
+
+  if (ssh_timer_wheel_pending(ctx->timers)) {
+    timeout = ssh_timer_wheel_timeout(ctx->timers, timeout);
+    if (!ctx->polls_used) {
+      if (timeout > 0) {
+        ssh_poll_sleep(timeout);
+      }
+      ssh_timer_wheel_run(ctx->timers);
+      return 0;
+    }
+  }
 
   if (!ctx->polls_used)
     return 0;
 
-  rc = ssh_poll(ctx->pollfds, ctx->polls_used, timeout);
-  if(rc < 0)
-    rc=SSH_ERROR;
-  if(rc <= 0)
-    return rc;
-  used = ctx->polls_used;
-  for (i = 0; i < used && rc > 0; ) {
-    if (!ctx->pollfds[i].revents) {
-      i++;
-    } else {
-      p = ctx->pollptrs[i];
-      fd = ctx->pollfds[i].fd;
-      revents = ctx->pollfds[i].revents;
-
-      if (p->cb && p->cb(p, fd, revents, p->cb_data) < 0) {
-        /* the poll was removed, reload the used counter and start again */
-        used = ctx->polls_used;
-        i=0;
-      } else {
-        ctx->pollfds[i].revents = 0;
-        i++;
+  /*
+   * A poll object is caught at most once per call. Nested calls from the
+   * callbacks can't reuse the array of the call in progress.
+   */
+  size = ctx->polls_used;
+  if (ctx->dispatch == NULL) {
+    if (ctx->ready_allocated < size) {
+      ready = realloc(ctx->ready, sizeof(ssh_poll_handle) * size);
+      if (ready == NULL) {
+        return SSH_ERROR;
       }
+      ctx->ready = ready;
+      ctx->ready_allocated = size;
+    }
+    ready = ctx->ready;
+  } else {
+    ready = malloc(sizeof(ssh_poll_handle) * size);
+    if (ready == NULL) {
+      return SSH_ERROR;
+    }
+  }
 
-      rc--;
+  ctx->ready_serial++;
+  rc = ctx->backend->wait(ctx, ready, size, timeout);
+  if (rc <= 0) {
+    if (ready != ctx->ready) {
+      SAFE_FREE(ready);
+    }
+    if (rc < 0) {
+      return SSH_ERROR;
     }
+    ssh_timer_wheel_run(ctx->timers);
+    return 0;
   }
 
-  return rc;
+  dispatch.ready = ready;
+  dispatch.pos = 0;
+  dispatch.count = rc;
+  dispatch.prev = ctx->dispatch;
+  ctx->dispatch = &dispatch;
+
+  while (dispatch.pos < dispatch.count) {
+    p = ready[dispatch.pos++];
+    if (p == NULL || p->revents == 0) {
+      /* removed, or already dispatched by a nested call */
+      continue;
+    }
+    revents = p->revents;
+    p->revents = 0;
+
+    if (p->cb) {
+      p->cb(p, ssh_poll_get_fd(p), revents, p->cb_data);
+    }
+  }
+
+  ctx->dispatch = dispatch.prev;
+  if (ready != ctx->ready) {
+    SAFE_FREE(ready);
+  }
+  ssh_timer_wheel_run(ctx->timers);
+
+  return 0;
 }
 
 /**
@@ -690,18 +2271,69 @@ struct ssh_event_fd_wrapper {
     void * userdata;
 };
 
+struct ssh_event_task {
+    ssh_event_task_callback cb;
+    void *userdata;
+    struct ssh_event_task *next;
+};
+
 struct ssh_event_struct {
     ssh_poll_ctx ctx;
+    /* see ssh_event_add_timer() */
+    ssh_timer timers;
+    /* see ssh_event_post(), the only members used by other threads */
+    void *tasks_lock;
+    struct ssh_event_task *tasks;
+    struct ssh_event_task *tasks_tail;
+#ifndef _WIN32
+    socket_t wakeup_fds[2];
+    ssh_poll_handle wakeup;
+#endif
 #ifdef WITH_SERVER
-    struct ssh_list *sessions;
+    /* the sessions, keyed by their address */
+    struct ssh_hashtable *sessions;
 #endif
 };
 
+#ifndef _WIN32
+static int ssh_event_wakeup_callback(ssh_poll_handle p, socket_t fd,
+                                     int revents, void *userdata) {
+    char buf[64];
+
+    (void) p;
+    (void) revents;
+    (void) userdata;
+
+    /* the tasks run at the end of ssh_event_dopoll() */
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    return 0;
+}
+#endif
+
+/* run the tasks posted so far, the new ones wait for the next call */
+static void ssh_event_run_tasks(ssh_event event) {
+    struct ssh_event_task *task;
+    struct ssh_event_task *next;
+
+    ssh_threads_mutex_lock(&event->tasks_lock);
+    task = event->tasks;
+    event->tasks = event->tasks_tail = NULL;
+    ssh_threads_mutex_unlock(&event->tasks_lock);
+
+    for (; task != NULL; task = next) {
+        next = task->next;
+        task->cb(event, task->userdata);
+        SAFE_FREE(task);
+    }
+}
+
 /**
  * @brief  Create a new event context. It could be associated with many
  *         ssh_session objects and socket fd which are going to be polled at the
  *         same time as the event context. You would need a single event context
- *         per thread.
+ *         per thread, see ssh_event_post() to hand work to it from other
+ *         threads.
  * 
  * @return  The ssh_event object on success, NULL on failure.
  */
@@ -714,17 +2346,46 @@ ssh_event ssh_event_new(void) {
     }
     ZERO_STRUCTP(event);
 
+#ifndef _WIN32
+    event->wakeup_fds[0] = event->wakeup_fds[1] = SSH_INVALID_SOCKET;
+#endif
+    if (ssh_threads_mutex_init(&event->tasks_lock) != 0) {
+        free(event);
+        return NULL;
+    }
+
     event->ctx = ssh_poll_ctx_new(2);
     if(event->ctx == NULL) {
-        free(event);
+        ssh_event_free(event);
+        return NULL;
+    }
+    if (ssh_poll_ctx_index_fds(event->ctx) < 0) {
+        ssh_event_free(event);
         return NULL;
     }
 
 #ifdef WITH_SERVER
-    event->sessions = ssh_list_new();
+    event->sessions = ssh_hashtable_new();
     if(event->sessions == NULL) {
-        ssh_poll_ctx_free(event->ctx);
-        free(event);
+        ssh_event_free(event);
+        return NULL;
+    }
+#endif
+
+#ifndef _WIN32
+    /* the other threads interrupt the poll by writing to the pipe */
+    if (pipe(event->wakeup_fds) < 0) {
+        event->wakeup_fds[0] = event->wakeup_fds[1] = SSH_INVALID_SOCKET;
+        ssh_event_free(event);
+        return NULL;
+    }
+    ssh_sock_set_nonblocking(event->wakeup_fds[0]);
+    ssh_sock_set_nonblocking(event->wakeup_fds[1]);
+    event->wakeup = ssh_poll_new(event->wakeup_fds[0], POLLIN,
+                                 ssh_event_wakeup_callback, event);
+    if (event->wakeup == NULL || ssh_poll_ctx_add(event->ctx,
+                                                  event->wakeup) < 0) {
+        ssh_event_free(event);
         return NULL;
     }
 #endif
@@ -791,6 +2452,63 @@ int ssh_event_add_fd(ssh_event event, socket_t fd, short events,
     return SSH_OK;
 }
 
+#ifdef WITH_SERVER
+static int ssh_event_add_bind_poll(ssh_event event, ssh_poll_handle p) {
+    if(ssh_poll_get_ctx(p) == event->ctx) {
+        return SSH_OK;
+    }
+    if(ssh_poll_get_ctx(p) != NULL) {
+        ssh_poll_ctx_remove(ssh_poll_get_ctx(p), p);
+    }
+    if(ssh_poll_ctx_add(event->ctx, p) < 0) {
+        return SSH_ERROR;
+    }
+    return SSH_OK;
+}
+
+int ssh_event_add_bind(ssh_event event, ssh_bind sshbind) {
+    ssh_poll_handle p;
+    unsigned int i;
+
+    if(event == NULL || event->ctx == NULL || sshbind == NULL ||
+       ssh_bind_get_fd(sshbind) == SSH_INVALID_SOCKET) {
+        return SSH_ERROR;
+    }
+    p = ssh_bind_get_poll(sshbind);
+    if(p == NULL) {
+        return SSH_ERROR;
+    }
+    if(ssh_event_add_bind_poll(event, p) < 0) {
+        return SSH_ERROR;
+    }
+    /* the other listeners, the first one polls with p */
+    for(i = 1; i < sshbind->nlisteners; i++) {
+        if(ssh_event_add_bind_poll(event, sshbind->listeners[i].poll) < 0) {
+            return SSH_ERROR;
+        }
+    }
+    return SSH_OK;
+}
+
+int ssh_event_remove_bind(ssh_event event, ssh_bind sshbind) {
+    ssh_poll_handle p;
+    unsigned int i;
+    int rc = SSH_ERROR;
+
+    if(event == NULL || event->ctx == NULL || sshbind == NULL) {
+        return SSH_ERROR;
+    }
+    for(i = 0; i == 0 || i < sshbind->nlisteners; i++) {
+        p = i == 0 ? sshbind->poll : sshbind->listeners[i].poll;
+        if(p != NULL && ssh_poll_get_ctx(p) == event->ctx) {
+            ssh_poll_ctx_remove(event->ctx, p);
+            rc = SSH_OK;
+        }
+    }
+    return rc;
+}
+#endif /* WITH_SERVER */
+
 /**
  * @brief remove the poll handle from session and assign them to a event,
  * when used in blocking mode.
@@ -802,33 +2520,30 @@ int ssh_event_add_fd(ssh_event event, socket_t fd, short events,
  *          SSH_ERROR   on failure
  */
 int ssh_event_add_session(ssh_event event, ssh_session session) {
-    unsigned int i;
     ssh_poll_handle p;
-#ifdef WITH_SERVER
-    struct ssh_iterator *iterator;
-#endif
-    
+
     if(event == NULL || event->ctx == NULL || session == NULL) {
         return SSH_ERROR;
     }
     if(session->default_poll_ctx == NULL) {
         return SSH_ERROR;
     }
-    for(i = 0; i < session->default_poll_ctx->polls_used; i++) {
-        p = session->default_poll_ctx->pollptrs[i];
+    /* the removal moves the last poll object to the first slot */
+    while (session->default_poll_ctx->polls_used > 0) {
+        p = session->default_poll_ctx->pollptrs[0];
         ssh_poll_ctx_remove(session->default_poll_ctx, p);
         ssh_poll_ctx_add(event->ctx, p);
     }
+    ssh_timers_move(session->timers, event->ctx);
+    session->event = event;
 #ifdef WITH_SERVER
-    iterator = ssh_list_get_iterator(event->sessions);
-    while(iterator != NULL) {
-        if((ssh_session)iterator->data == session) {
-            /* allow only one instance of this session */
-            return SSH_OK;
-        }
-        iterator = iterator->next;
+    if (ssh_hashtable_lookup(event->sessions,
+          ssh_hashtable_ptr_key(session)) != NULL) {
+        /* allow only one instance of this session */
+        return SSH_OK;
     }
-    if(ssh_list_append(event->sessions, session) == SSH_ERROR) {
+    if (ssh_hashtable_insert(event->sessions, ssh_hashtable_ptr_key(session),
+          session) < 0) {
         return SSH_ERROR;
     }
 #endif
@@ -852,27 +2567,141 @@ int ssh_event_add_session(ssh_event event, ssh_session session) {
 int ssh_event_dopoll(ssh_event event, int timeout) {
     int rc;
 #ifdef WITH_SERVER
-    ssh_session session;
-    struct ssh_iterator *iterator;
+    struct ssh_hashtable_entry *entry;
+    ssh_session *sessions;
+    size_t count = 0;
+    size_t i;
 #endif
 
     if(event == NULL || event->ctx == NULL) {
         return SSH_ERROR;
     }
-    rc = ssh_poll_ctx_dopoll(event->ctx, timeout);
 #ifdef WITH_SERVER
+    /* the peers may wait for coalesced window adjusts */
+    for (entry = ssh_hashtable_first(event->sessions); entry != NULL;
+         entry = ssh_hashtable_next(event->sessions, entry)) {
+        ssh_channels_flush_windows(entry->data);
+    }
+#endif
+    rc = ssh_poll_ctx_dopoll(event->ctx, timeout);
     if(rc == SSH_OK) {
-        iterator = ssh_list_get_iterator(event->sessions);
-        while(iterator != NULL) {
-            session = (ssh_session)iterator->data;
-            ssh_execute_message_callbacks(session);
-            iterator = iterator->next;
+        ssh_event_run_tasks(event);
+    }
+#ifdef WITH_SERVER
+    if(rc == SSH_OK && event->sessions->count > 0) {
+        /*
+         * The message callbacks may add or remove sessions, so walk a copy
+         * and skip the ones which were removed in the meantime.
+         */
+        sessions = malloc(sizeof(ssh_session) * event->sessions->count);
+        if (sessions == NULL) {
+            return SSH_ERROR;
         }
+        for (entry = ssh_hashtable_first(event->sessions); entry != NULL;
+             entry = ssh_hashtable_next(event->sessions, entry)) {
+            sessions[count++] = entry->data;
+        }
+        for (i = 0; i < count; i++) {
+            if (ssh_hashtable_lookup(event->sessions,
+                  ssh_hashtable_ptr_key(sessions[i])) != NULL) {
+                ssh_execute_message_callbacks(sessions[i]);
+            }
+        }
+        SAFE_FREE(sessions);
     }
 #endif
     return rc;
 }
 
+/**
+ * @brief  Create a timer run by an event context.
+ *
+ * It is freed with the event, unless ssh_timer_free() is called before.
+ *
+ * @param  event        The ssh_event object.
+ * @param  timeout      The time until the expiry, in milliseconds.
+ * @param  cb           The function to call on expiry. It has to call
+ *                      ssh_timer_reset() to run again.
+ * @param  userdata     Userdata to be passed to the callback function.
+ *
+ * @returns The scheduled timer, NULL on failure.
+ */
+ssh_timer ssh_event_add_timer(ssh_event event, unsigned int timeout,
+                              ssh_timer_callback cb, void *userdata) {
+    ssh_timer timer;
+
+    if(event == NULL || event->ctx == NULL || cb == NULL) {
+        return NULL;
+    }
+
+    timer = ssh_timer_new(&event->timers, event->ctx, NULL, NULL, cb,
+                          userdata);
+    if(timer == NULL) {
+        return NULL;
+    }
+    if(ssh_timer_reset(timer, timeout) < 0) {
+        ssh_timer_free(timer);
+        return NULL;
+    }
+
+    return timer;
+}
+
+/**
+ * @brief  Run a function in the thread polling an event context.
+ *
+ * This is the only function of an event which can be called from any
+ * thread. It lets a thread hand work to the thread looping on
+ * ssh_event_dopoll(), e.g. an accepted session to add to the event: each
+ * session of an event may only be used by the thread polling it.
+ *
+ * @param  event        The ssh_event object.
+ * @param  cb           The function to run at the end of the current or
+ *                      next ssh_event_dopoll(), which is woken up.
+ * @param  userdata     Userdata to be passed to the callback function.
+ *
+ * @returns SSH_OK      on success
+ *          SSH_ERROR   on failure
+ */
+int ssh_event_post(ssh_event event, ssh_event_task_callback cb,
+                   void *userdata) {
+    struct ssh_event_task *task;
+    int wakeup;
+
+    if(event == NULL || cb == NULL) {
+        return SSH_ERROR;
+    }
+
+    task = malloc(sizeof(struct ssh_event_task));
+    if(task == NULL) {
+        return SSH_ERROR;
+    }
+    task->cb = cb;
+    task->userdata = userdata;
+    task->next = NULL;
+
+    ssh_threads_mutex_lock(&event->tasks_lock);
+    wakeup = event->tasks == NULL;
+    if(event->tasks_tail != NULL) {
+        event->tasks_tail->next = task;
+    } else {
+        event->tasks = task;
+    }
+    event->tasks_tail = task;
+#ifndef _WIN32
+    /* one byte is enough until the tasks are taken */
+    if(wakeup && write(event->wakeup_fds[1], "", 1) < 0 && errno != EAGAIN) {
+        ssh_threads_mutex_unlock(&event->tasks_lock);
+        return SSH_ERROR;
+    }
+#else
+    (void) wakeup;
+#endif
+    ssh_threads_mutex_unlock(&event->tasks_lock);
+
+    return SSH_OK;
+}
+
 /**
  * @brief  Remove a socket fd from an event context.
  *
@@ -884,20 +2713,20 @@ int ssh_event_dopoll(ssh_event event, int timeout) {
  */
 int ssh_event_remove_fd(ssh_event event, socket_t fd) {
     ssh_poll_handle p;
-    register size_t i, used;
     int rc = SSH_ERROR;
 
     if(event == NULL || event->ctx == NULL) {
         return SSH_ERROR;
     }
 
-    used = event->ctx->polls_used;
-    for (i = 0; i < used; i++) {
-        if(fd == event->ctx->pollfds[i].fd) {
-            p = event->ctx->pollptrs[i];
-            ssh_poll_ctx_remove(event->ctx, p);
-            rc = SSH_OK;
+    while ((p = ssh_poll_ctx_find_fd(event->ctx, fd)) != NULL) {
+        ssh_poll_ctx_remove(event->ctx, p);
+        if (p->cb == ssh_event_fd_wrapper_callback) {
+            /* allocated by ssh_event_add_fd() */
+            SAFE_FREE(p->cb_data);
+            ssh_poll_free(p);
         }
+        rc = SSH_OK;
     }
 
     return rc;
@@ -914,37 +2743,28 @@ int ssh_event_remove_fd(ssh_event event, socket_t fd) {
  */
 int ssh_event_remove_session(ssh_event event, ssh_session session) {
     ssh_poll_handle p;
-    register size_t i, used;
     int rc = SSH_ERROR;
     socket_t session_fd;
-#ifdef WITH_SERVER
-    struct ssh_iterator *iterator;
-#endif
 
     if(event == NULL || event->ctx == NULL || session == NULL) {
         return SSH_ERROR;
     }
 
     session_fd = ssh_get_fd(session);
-    used = event->ctx->polls_used;
-    for(i = 0; i < used; i++) {
-        if(session_fd == event->ctx->pollfds[i].fd) {
-            p = event->ctx->pollptrs[i];
-            ssh_poll_ctx_remove(event->ctx, p);
-            ssh_poll_ctx_add(session->default_poll_ctx, p);
-            rc = SSH_OK;
-        }
+    while ((p = ssh_poll_ctx_find_fd(event->ctx, session_fd)) != NULL) {
+        ssh_poll_ctx_remove(event->ctx, p);
+        ssh_poll_ctx_add(session->default_poll_ctx, p);
+        rc = SSH_OK;
     }
-#ifdef WITH_SERVER
-    iterator = ssh_list_get_iterator(event->sessions);
-    while(iterator != NULL) {
-        if((ssh_session)iterator->data == session) {
-            ssh_list_remove(event->sessions, iterator);
-            /* there should be only one instance of this session */
-            break;
-        }
-        iterator = iterator->next;
+    ssh_timers_move(session->timers, session->default_poll_ctx);
+    ssh_polls_move(session->polls, session->default_poll_ctx);
+    if (session->event == event) {
+        session->event = NULL;
     }
+#ifdef WITH_SERVER
+    /* there should be only one instance of this session */
+    ssh_hashtable_remove(event->sessions, ssh_hashtable_ptr_key(session),
+        session);
 #endif
 
     return rc;
@@ -962,14 +2782,30 @@ void ssh_event_free(ssh_event event) {
     if(event == NULL) {
         return;
     }
+    ssh_timers_free(&event->timers);
+#ifndef _WIN32
+    if(event->wakeup != NULL) {
+        ssh_poll_free(event->wakeup);
+    }
+    if(event->wakeup_fds[0] != SSH_INVALID_SOCKET) {
+        close(event->wakeup_fds[0]);
+        close(event->wakeup_fds[1]);
+    }
+#endif
     if(event->ctx != NULL) {
         ssh_poll_ctx_free(event->ctx);
     }
 #ifdef WITH_SERVER
-    if(event->sessions != NULL) {
-        ssh_list_free(event->sessions);
-    }
+    ssh_hashtable_free(event->sessions);
 #endif
+    /* the tasks which didn't run */
+    while(event->tasks != NULL) {
+        struct ssh_event_task *task = event->tasks;
+
+        event->tasks = task->next;
+        SAFE_FREE(task);
+    }
+    ssh_threads_mutex_destroy(&event->tasks_lock);
     free(event);
 }
 
@@ -0,0 +1,186 @@
+/*
+ * pool.c - free lists of buffer and string objects
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libssh/priv.h"
+#include "libssh/buffer.h"
+#include "libssh/threads.h"
+#include "libssh/pool.h"
+
+/**
+ * @addtogroup libssh_misc
+ *
+ * @{
+ */
+
+/*
+ * The objects of a free list are linked through a pointer stored at
+ * link_offset in them. The strings don't need their content once freed, the
+ * buffers have a field for it so their data stays attached.
+ */
+struct ssh_pool_struct {
+  void *head;
+  unsigned int count;
+  unsigned int max;
+  size_t link_offset;
+};
+
+static struct ssh_pool_struct pools[SSH_POOL_MAX] = {
+  { NULL, 0, 0, offsetof(struct ssh_buffer_struct, pool_next) },
+  { NULL, 0, 0, 0 },
+  { NULL, 0, 0, 0 }
+};
+static void *pool_lock = NULL;
+static int pool_initialized = 0;
+
+static void *pool_next(struct ssh_pool_struct *pool, void *obj) {
+  void *next;
+
+  memcpy(&next, (char *) obj + pool->link_offset, sizeof(void *));
+  return next;
+}
+
+static void pool_set_next(struct ssh_pool_struct *pool, void *obj,
+    void *next) {
+  memcpy((char *) obj + pool->link_offset, &next, sizeof(void *));
+}
+
+/**
+ * @brief Set the number of objects kept for reuse once they are freed.
+ *
+ * The ssh_buffer and ssh_string objects are allocated for nearly every
+ * message. With pools, the freed objects (and the small data of the buffers)
+ * are kept in free lists shared by all the sessions, and reused by the next
+ * allocations. The pools are disabled by default.
+ *
+ * The pools are shared by the threads, behind a lock taken for every
+ * object.
+ *
+ * @param[in]  buffers  The number of buffers to keep, 0 to disable.
+ *
+ * @param[in]  strings  The number of strings to keep for each of the two
+ *                      size classes (64 and 512 bytes), 0 to disable.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_set_pool_sizes(unsigned int buffers, unsigned int strings) {
+  int i;
+
+  if (ssh_threads_mutex_once(&pool_lock, &pool_initialized) < 0) {
+    return SSH_ERROR;
+  }
+
+  ssh_threads_mutex_lock(&pool_lock);
+  pools[SSH_POOL_BUFFER].max = buffers;
+  pools[SSH_POOL_STRING_SMALL].max = strings;
+  pools[SSH_POOL_STRING_LARGE].max = strings;
+  ssh_threads_mutex_unlock(&pool_lock);
+
+  /* release what doesn't fit anymore */
+  for (i = 0; i < SSH_POOL_MAX; i++) {
+    void *obj;
+
+    for (;;) {
+      ssh_threads_mutex_lock(&pool_lock);
+      if (pools[i].count <= pools[i].max) {
+        ssh_threads_mutex_unlock(&pool_lock);
+        break;
+      }
+      obj = pools[i].head;
+      pools[i].head = pool_next(&pools[i], obj);
+      pools[i].count--;
+      ssh_threads_mutex_unlock(&pool_lock);
+
+      if (i == SSH_POOL_BUFFER) {
+        SAFE_FREE(((struct ssh_buffer_struct *) obj)->data);
+      }
+      SAFE_FREE(obj);
+    }
+  }
+
+  return SSH_OK;
+}
+
+/** @internal
+ * @brief takes an object from a pool
+ * @returns the object, NULL if the pool is empty.
+ */
+void *ssh_pool_get(enum ssh_pool_e type) {
+  void *obj;
+
+  if (!ssh_atomic_load_int(&pool_initialized)) {
+    return NULL;
+  }
+
+  ssh_threads_mutex_lock(&pool_lock);
+  obj = pools[type].head;
+  if (obj != NULL) {
+    pools[type].head = pool_next(&pools[type], obj);
+    pools[type].count--;
+  }
+  ssh_threads_mutex_unlock(&pool_lock);
+
+  return obj;
+}
+
+/** @internal
+ * @brief gives an object back to a pool
+ * @returns 0 if the pool kept it, -1 if it is full and the caller has to
+ * free the object.
+ */
+int ssh_pool_put(enum ssh_pool_e type, void *obj) {
+  int rc = -1;
+
+  if (!ssh_atomic_load_int(&pool_initialized)) {
+    return -1;
+  }
+
+  ssh_threads_mutex_lock(&pool_lock);
+  if (pools[type].count < pools[type].max) {
+    pool_set_next(&pools[type], obj, pools[type].head);
+    pools[type].head = obj;
+    pools[type].count++;
+    rc = 0;
+  }
+  ssh_threads_mutex_unlock(&pool_lock);
+
+  return rc;
+}
+
+/** @internal
+ * @brief frees the pooled objects, called by ssh_finalize()
+ */
+void ssh_pool_finalize(void) {
+  if (!ssh_atomic_load_int(&pool_initialized)) {
+    return;
+  }
+  ssh_set_pool_sizes(0, 0);
+  ssh_threads_mutex_destroy(&pool_lock);
+  pool_lock = NULL;
+  pool_initialized = 0;
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
@@ -21,11 +21,28 @@
  * MA 02111-1307, USA.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
 #include "libssh/priv.h"
+#include "libssh/buffer.h"
+#include "libssh/channels.h"
+#include "libssh/misc.h"
 #include "libssh/scp.h"
+#include "libssh/session.h"
+
+/* the pipelined data is written once there is that much of it */
+#define SCP_PIPELINE_WRITE 65536
+/* the most a read takes from the channel at once */
+#define SCP_READ_MAX (1024 * 1024)
 
 /**
  * @defgroup libssh_scp The SSH scp functions
@@ -44,6 +61,9 @@
  * @param[in]  mode     One of SSH_SCP_WRITE or SSH_SCP_READ, depending if you
  *                      need to drop files remotely or read them.
  *                      It is not possible to combine read and write.
+ *                      SSH_SCP_RECURSIVE allows directories, SSH_SCP_PIPELINE
+ *                      sends the files of SSH_SCP_WRITE without waiting for
+ *                      each acknowledgment (see ssh_scp_flush()).
  *
  * @param[in]  location The directory in which write or read will be done. Any
  *                      push or pull will be relative to this place.
@@ -57,7 +77,8 @@ ssh_scp ssh_scp_new(ssh_session session, int mode, const char *location){
     return NULL;
   }
   ZERO_STRUCTP(scp);
-  if((mode&~SSH_SCP_RECURSIVE) != SSH_SCP_WRITE && (mode &~SSH_SCP_RECURSIVE) != SSH_SCP_READ){
+  if((mode&~(SSH_SCP_RECURSIVE|SSH_SCP_PIPELINE)) != SSH_SCP_WRITE &&
+      (mode&~(SSH_SCP_RECURSIVE|SSH_SCP_PIPELINE)) != SSH_SCP_READ){
     ssh_set_error(session,SSH_FATAL,"Invalid mode %d for ssh_scp_new()",mode);
     ssh_scp_free(scp);
     return NULL;
@@ -69,8 +90,9 @@ ssh_scp ssh_scp_new(ssh_session session, int mode, const char *location){
     return NULL;
   }
   scp->session=session;
-  scp->mode=mode & ~SSH_SCP_RECURSIVE;
+  scp->mode=mode & ~(SSH_SCP_RECURSIVE|SSH_SCP_PIPELINE);
   scp->recursive = (mode & SSH_SCP_RECURSIVE) != 0;
+  scp->pipeline = (mode & SSH_SCP_PIPELINE) != 0 && scp->mode == SSH_SCP_WRITE;
   scp->channel=NULL;
   scp->state=SSH_SCP_NEW;
   return scp;
@@ -86,7 +108,7 @@ int ssh_scp_init(ssh_scp scp){
     ssh_set_error(scp->session,SSH_FATAL,"ssh_scp_init called under invalid state");
     return SSH_ERROR;
   }
-  ssh_log(scp->session,SSH_LOG_PROTOCOL,"Initializing scp session %s %son location '%s'",
+  SSH_LOG(scp->session,SSH_LOG_PROTOCOL,"Initializing scp session %s %son location '%s'",
 		  scp->mode==SSH_SCP_WRITE?"write":"read",
 				  scp->recursive?"recursive ":"",
 						  scp->location);
@@ -135,9 +157,14 @@ int ssh_scp_init(ssh_scp scp){
 int ssh_scp_close(ssh_scp scp){
   char buffer[128];
   int err;
+  int rc = SSH_OK;
   if(scp==NULL)
     return SSH_ERROR;
   if(scp->channel != NULL){
+    /* the pipelined files are only written once acknowledged */
+    if (scp->state == SSH_SCP_WRITE_INITED && ssh_scp_flush(scp) != SSH_OK) {
+      rc = SSH_ERROR;
+    }
     if(ssh_channel_send_eof(scp->channel) == SSH_ERROR){
       scp->state=SSH_SCP_ERROR;
       return SSH_ERROR;
@@ -158,8 +185,12 @@ int ssh_scp_close(ssh_scp scp){
     ssh_channel_free(scp->channel);
     scp->channel=NULL;
   }
+  scp->acks = 0;
+  if (scp->output != NULL) {
+    buffer_reinit(scp->output);
+  }
   scp->state=SSH_SCP_NEW;
-  return SSH_OK;
+  return rc;
 }
 
 void ssh_scp_free(ssh_scp scp){
@@ -169,12 +200,174 @@ void ssh_scp_free(ssh_scp scp){
     ssh_scp_close(scp);
   if(scp->channel)
     ssh_channel_free(scp->channel);
+  ssh_buffer_free(scp->output);
   SAFE_FREE(scp->location);
   SAFE_FREE(scp->request_name);
   SAFE_FREE(scp->warning);
   SAFE_FREE(scp);
 }
 
+/* writes what the pipeline holds */
+static int scp_write_output(ssh_scp scp) {
+  uint32_t len;
+
+  if (scp->output == NULL) {
+    return SSH_OK;
+  }
+  len = buffer_get_rest_len(scp->output);
+  if (len > 0 &&
+      ssh_channel_write(scp->channel, buffer_get_rest(scp->output), len) < 0) {
+    scp->state = SSH_SCP_ERROR;
+    return SSH_ERROR;
+  }
+  buffer_reinit(scp->output);
+
+  return SSH_OK;
+}
+
+/*
+ * Sends data to the sink. When pipelined, small writes are gathered to be
+ * sent in large ones.
+ */
+static int scp_send(ssh_scp scp, const void *data, size_t len) {
+  if (!scp->pipeline) {
+    if (ssh_channel_write(scp->channel, data, len) == SSH_ERROR) {
+      scp->state = SSH_SCP_ERROR;
+      return SSH_ERROR;
+    }
+    return SSH_OK;
+  }
+
+  if (scp->output == NULL) {
+    scp->output = ssh_buffer_new();
+    if (scp->output == NULL) {
+      ssh_set_error_oom(scp->session);
+      scp->state = SSH_SCP_ERROR;
+      return SSH_ERROR;
+    }
+  }
+  if (len >= SCP_PIPELINE_WRITE) {
+    /* written as it is, behind what is gathered */
+    if (scp_write_output(scp) < 0 ||
+        ssh_channel_write(scp->channel, data, len) == SSH_ERROR) {
+      scp->state = SSH_SCP_ERROR;
+      return SSH_ERROR;
+    }
+    return SSH_OK;
+  }
+  if (buffer_add_data(scp->output, data, len) < 0) {
+    ssh_set_error_oom(scp->session);
+    scp->state = SSH_SCP_ERROR;
+    return SSH_ERROR;
+  }
+  if (buffer_get_rest_len(scp->output) >= SCP_PIPELINE_WRITE) {
+    return scp_write_output(scp);
+  }
+
+  return SSH_OK;
+}
+
+/*
+ * Takes the acknowledgments received, or waits for all of them if blocking.
+ * Any answer but a success fails the transfer: the sink doesn't read what
+ * was sent behind the refused request.
+ */
+static int scp_collect_acks(ssh_scp scp, int blocking) {
+  char *response = NULL;
+  int rc;
+
+  while (scp->acks > 0) {
+    if (!blocking) {
+      rc = ssh_channel_poll(scp->channel, 0);
+      if (rc == 0) {
+        break;
+      }
+      if (rc < 0) {
+        ssh_set_error(scp->session, SSH_FATAL,
+            "Error reading status code: %s", ssh_get_error(scp->session));
+        scp->state = SSH_SCP_ERROR;
+        return SSH_ERROR;
+      }
+    }
+    rc = ssh_scp_response(scp, &response);
+    if (rc != 0) {
+      if (rc == 1) {
+        /* a warning, with the rest of the stream lost */
+        ssh_set_error(scp->session, SSH_FATAL,
+            "SCP: pipelined transfer refused: %s",
+            response != NULL ? response : "");
+      }
+      SAFE_FREE(response);
+      scp->state = SSH_SCP_ERROR;
+      return SSH_ERROR;
+    }
+    scp->acks--;
+  }
+
+  return SSH_OK;
+}
+
+/* waits for the acknowledgment of what was just sent, or counts it */
+static int scp_wait_ack(ssh_scp scp) {
+  int r;
+  uint8_t code;
+
+  if (scp->pipeline) {
+    scp->acks++;
+    return scp_collect_acks(scp, 0);
+  }
+
+  r=ssh_channel_read(scp->channel,&code,1,0);
+  if(r<=0){
+    ssh_set_error(scp->session,SSH_FATAL, "Error reading status code: %s",ssh_get_error(scp->session));
+    scp->state=SSH_SCP_ERROR;
+    return SSH_ERROR;
+  }
+  if(code != 0){
+    ssh_set_error(scp->session,SSH_FATAL, "scp status code %ud not valid", code);
+    scp->state=SSH_SCP_ERROR;
+    return SSH_ERROR;
+  }
+  return SSH_OK;
+}
+
+/**
+ * @brief Wait until the sink acknowledged all that was pushed.
+ *
+ * With SSH_SCP_PIPELINE, the pushes don't wait for the sink: the headers
+ * and the contents of the files are sent back to back, gathered in large
+ * writes, and the acknowledgments are taken as they come. This sends what
+ * is still gathered and waits for the acknowledgments left. Without
+ * SSH_SCP_PIPELINE, there is nothing to wait for.
+ *
+ * A refusal of the sink fails the whole transfer, as the sink doesn't read
+ * what was sent behind the refused request.
+ *
+ * @param[in]  scp      The scp handle.
+ *
+ * @returns             SSH_OK if everything was acknowledged, SSH_ERROR if
+ *                      the sink refused something or an error occured.
+ *
+ * @see ssh_scp_new()
+ */
+int ssh_scp_flush(ssh_scp scp) {
+  if (scp == NULL) {
+    return SSH_ERROR;
+  }
+  if (scp->state == SSH_SCP_ERROR) {
+    return SSH_ERROR;
+  }
+  if (!scp->pipeline || scp->channel == NULL) {
+    return SSH_OK;
+  }
+
+  if (scp_write_output(scp) < 0) {
+    return SSH_ERROR;
+  }
+
+  return scp_collect_acks(scp, 1);
+}
+
 /**
  * @brief Create a directory in a scp in sink mode.
  *
@@ -191,8 +384,6 @@ void ssh_scp_free(ssh_scp scp){
  */
 int ssh_scp_push_directory(ssh_scp scp, const char *dirname, int mode){
   char buffer[1024];
-  int r;
-  uint8_t code;
   char *dir;
   char *perms;
   if(scp==NULL)
@@ -206,20 +397,7 @@ int ssh_scp_push_directory(ssh_scp scp, const char *dirname, int mode){
   snprintf(buffer, sizeof(buffer), "D%s 0 %s\n", perms, dir);
   SAFE_FREE(dir);
   SAFE_FREE(perms);
-  r=ssh_channel_write(scp->channel,buffer,strlen(buffer));
-  if(r==SSH_ERROR){
-    scp->state=SSH_SCP_ERROR;
-    return SSH_ERROR;
-  }
-  r=ssh_channel_read(scp->channel,&code,1,0);
-  if(r<=0){
-    ssh_set_error(scp->session,SSH_FATAL, "Error reading status code: %s",ssh_get_error(scp->session));
-    scp->state=SSH_SCP_ERROR;
-    return SSH_ERROR;
-  }
-  if(code != 0){
-    ssh_set_error(scp->session,SSH_FATAL, "scp status code %ud not valid", code);
-    scp->state=SSH_SCP_ERROR;
+  if (scp_send(scp, buffer, strlen(buffer)) < 0 || scp_wait_ack(scp) < 0) {
     return SSH_ERROR;
   }
   return SSH_OK;
@@ -235,28 +413,13 @@ int ssh_scp_push_directory(ssh_scp scp, const char *dirname, int mode){
  */
  int ssh_scp_leave_directory(ssh_scp scp){
   char buffer[]="E\n";
-  int r;
-  uint8_t code;
   if(scp==NULL)
       return SSH_ERROR;
   if(scp->state != SSH_SCP_WRITE_INITED){
     ssh_set_error(scp->session,SSH_FATAL,"ssh_scp_leave_directory called under invalid state");
     return SSH_ERROR;
   }
-  r=ssh_channel_write(scp->channel,buffer,strlen(buffer));
-  if(r==SSH_ERROR){
-    scp->state=SSH_SCP_ERROR;
-    return SSH_ERROR;
-  }
-  r=ssh_channel_read(scp->channel,&code,1,0);
-  if(r<=0){
-    ssh_set_error(scp->session,SSH_FATAL, "Error reading status code: %s",ssh_get_error(scp->session));
-    scp->state=SSH_SCP_ERROR;
-    return SSH_ERROR;
-  }
-  if(code != 0){
-    ssh_set_error(scp->session,SSH_FATAL, "scp status code %ud not valid", code);
-    scp->state=SSH_SCP_ERROR;
+  if (scp_send(scp, buffer, strlen(buffer)) < 0 || scp_wait_ack(scp) < 0) {
     return SSH_ERROR;
   }
   return SSH_OK;
@@ -279,8 +442,6 @@ int ssh_scp_push_directory(ssh_scp scp, const char *dirname, int mode){
  */
 int ssh_scp_push_file(ssh_scp scp, const char *filename, size_t size, int mode){
   char buffer[1024];
-  int r;
-  uint8_t code;
   char *file;
   char *perms;
   if(scp==NULL)
@@ -291,24 +452,11 @@ int ssh_scp_push_file(ssh_scp scp, const char *filename, size_t size, int mode){
   }
   file=ssh_basename(filename);
   perms=ssh_scp_string_mode(mode);
-  ssh_log(scp->session,SSH_LOG_PROTOCOL,"SCP pushing file %s, size %" PRIdS " with permissions '%s'",file,size,perms);
+  SSH_LOG(scp->session,SSH_LOG_PROTOCOL,"SCP pushing file %s, size %" PRIdS " with permissions '%s'",file,size,perms);
   snprintf(buffer, sizeof(buffer), "C%s %" PRIdS " %s\n", perms, size, file);
   SAFE_FREE(file);
   SAFE_FREE(perms);
-  r=ssh_channel_write(scp->channel,buffer,strlen(buffer));
-  if(r==SSH_ERROR){
-    scp->state=SSH_SCP_ERROR;
-    return SSH_ERROR;
-  }
-  r=ssh_channel_read(scp->channel,&code,1,0);
-  if(r<=0){
-    ssh_set_error(scp->session,SSH_FATAL, "Error reading status code: %s",ssh_get_error(scp->session));
-    scp->state=SSH_SCP_ERROR;
-    return SSH_ERROR;
-  }
-  if(code != 0){
-    ssh_set_error(scp->session,SSH_FATAL, "scp status code %ud not valid", code);
-    scp->state=SSH_SCP_ERROR;
+  if (scp_send(scp, buffer, strlen(buffer)) < 0 || scp_wait_ack(scp) < 0) {
     return SSH_ERROR;
   }
   scp->filelen = size;
@@ -338,6 +486,11 @@ int ssh_scp_response(ssh_scp scp, char **response){
 	r=ssh_channel_read(scp->channel,&code,1,0);
 	if(r == SSH_ERROR)
 		return SSH_ERROR;
+	if(r == 0){
+		ssh_set_error(scp->session,SSH_FATAL, "SCP: end of file while reading status code");
+		scp->state=SSH_SCP_ERROR;
+		return SSH_ERROR;
+	}
 	if(code == 0)
 		return 0;
 	if(code > 2){
@@ -351,7 +504,7 @@ int ssh_scp_response(ssh_scp scp, char **response){
 	/* Warning */
 	if(code == 1){
 		ssh_set_error(scp->session,SSH_REQUEST_DENIED, "SCP: Warning: status code 1 received: %s", msg);
-		ssh_log(scp->session,SSH_LOG_RARE,"SCP: Warning: status code 1 received: %s", msg);
+		SSH_LOG(scp->session,SSH_LOG_RARE,"SCP: Warning: status code 1 received: %s", msg);
 		if(response)
 			*response=strdup(msg);
 		return 1;
@@ -390,6 +543,21 @@ int ssh_scp_write(ssh_scp scp, const void *buffer, size_t len){
   }
   if(scp->processed + len > scp->filelen)
     len = scp->filelen - scp->processed;
+  if (scp->pipeline) {
+    if (scp_send(scp, buffer, len) < 0) {
+      return SSH_ERROR;
+    }
+    scp->processed += len;
+    /* the end of the file is acknowledged like its header */
+    if (scp->processed == scp->filelen) {
+      scp->processed = scp->filelen = 0;
+      scp->state = SSH_SCP_WRITE_INITED;
+      if (scp_send(scp, "", 1) < 0 || scp_wait_ack(scp) < 0) {
+        return SSH_ERROR;
+      }
+    }
+    return SSH_OK;
+  }
   /* hack to avoid waiting for window change */
   ssh_channel_poll(scp->channel,0);
   w=ssh_channel_write(scp->channel,buffer,len);
@@ -419,6 +587,474 @@ int ssh_scp_write(ssh_scp scp, const void *buffer, size_t len){
   return SSH_OK;
 }
 
+#ifndef _WIN32
+/* pushes a file, or a directory and what it holds */
+static int scp_push_path(ssh_scp scp, const char *path, char *data,
+    size_t size) {
+  struct dirent *entry;
+  struct stat st;
+  char *child;
+  size_t len;
+  ssize_t r;
+  DIR *dir;
+  int fd;
+  int rc;
+
+  if (stat(path, &st) < 0) {
+    ssh_set_error(scp->session, SSH_FATAL, "Can't stat %s: %s", path,
+        strerror(errno));
+    return SSH_ERROR;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    if (!scp->recursive) {
+      ssh_set_error(scp->session, SSH_FATAL,
+          "%s is a directory and the scp isn't recursive", path);
+      return SSH_ERROR;
+    }
+    dir = opendir(path);
+    if (dir == NULL) {
+      ssh_set_error(scp->session, SSH_FATAL, "Can't open %s: %s", path,
+          strerror(errno));
+      return SSH_ERROR;
+    }
+    if (ssh_scp_push_directory(scp, path, st.st_mode & 07777) < 0) {
+      closedir(dir);
+      return SSH_ERROR;
+    }
+    rc = SSH_OK;
+    while (rc == SSH_OK && (entry = readdir(dir)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      len = strlen(path) + strlen(entry->d_name) + 2;
+      child = malloc(len);
+      if (child == NULL) {
+        ssh_set_error_oom(scp->session);
+        rc = SSH_ERROR;
+        break;
+      }
+      snprintf(child, len, "%s/%s", path, entry->d_name);
+      rc = scp_push_path(scp, child, data, size);
+      SAFE_FREE(child);
+    }
+    closedir(dir);
+    if (rc < 0) {
+      return SSH_ERROR;
+    }
+    return ssh_scp_leave_directory(scp);
+  }
+
+  if (!S_ISREG(st.st_mode)) {
+    SSH_LOG(scp->session, SSH_LOG_PROTOCOL, "SCP skipping %s, not a file",
+        path);
+    return SSH_OK;
+  }
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    ssh_set_error(scp->session, SSH_FATAL, "Can't open %s: %s", path,
+        strerror(errno));
+    return SSH_ERROR;
+  }
+  if (ssh_scp_push_file(scp, path, st.st_size, st.st_mode & 07777) < 0) {
+    close(fd);
+    return SSH_ERROR;
+  }
+  /* the size was announced, the file can't change it */
+  len = st.st_size;
+  do {
+    r = read(fd, data, len < size ? len : size);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0 || (r == 0 && len > 0)) {
+      ssh_set_error(scp->session, SSH_FATAL, "Can't read %s: %s", path,
+          r < 0 ? strerror(errno) : "file truncated");
+      scp->state = SSH_SCP_ERROR;
+      close(fd);
+      return SSH_ERROR;
+    }
+    if (ssh_scp_write(scp, data, r) < 0) {
+      close(fd);
+      return SSH_ERROR;
+    }
+    len -= r;
+  } while (len > 0);
+  close(fd);
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Push a local file or directory tree to a scp in sink mode.
+ *
+ * The files and directories are pushed with the pipelining of
+ * SSH_SCP_PIPELINE, whatever the mode of the scp, and this returns once
+ * the sink acknowledged all of them. The directories need an scp opened
+ * with SSH_SCP_RECURSIVE. What is neither a file nor a directory is
+ * skipped, symbolic links are followed.
+ *
+ * @param[in]  scp      The scp handle.
+ *
+ * @param[in]  path     The local file or directory to push, with the
+ *                      permissions it has.
+ *
+ * @returns             SSH_OK if the tree has been sent and written,
+ *                      SSH_ERROR if an error occured.
+ *
+ * @see ssh_scp_flush()
+ */
+int ssh_scp_push_tree(ssh_scp scp, const char *path) {
+  int pipeline;
+  char *data;
+  int rc;
+
+  if (scp == NULL) {
+    return SSH_ERROR;
+  }
+  if (path == NULL) {
+    ssh_set_error_invalid(scp->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+  if (scp->state != SSH_SCP_WRITE_INITED) {
+    ssh_set_error(scp->session, SSH_FATAL,
+        "ssh_scp_push_tree called under invalid state");
+    return SSH_ERROR;
+  }
+
+  data = malloc(SCP_PIPELINE_WRITE);
+  if (data == NULL) {
+    ssh_set_error_oom(scp->session);
+    return SSH_ERROR;
+  }
+
+  pipeline = scp->pipeline;
+  scp->pipeline = 1;
+  rc = scp_push_path(scp, path, data, SCP_PIPELINE_WRITE);
+  if (rc == SSH_OK) {
+    rc = ssh_scp_flush(scp);
+  }
+  scp->pipeline = pipeline;
+  SAFE_FREE(data);
+
+  return rc;
+}
+
+/* a scp of ssh_scp_push_files() and the file it is sending */
+struct scp_lane {
+  ssh_scp scp;
+  int pipeline; /* the mode to restore */
+  int fd;
+  size_t file; /* index in the list */
+  uint64_t sent;
+};
+
+/* opens the next file of the list and sends its header */
+static int scp_lane_start(struct scp_lane *lane, const char *path,
+    uint64_t size) {
+  struct stat st;
+
+  lane->fd = open(path, O_RDONLY);
+  if (lane->fd < 0 || fstat(lane->fd, &st) < 0) {
+    ssh_set_error(lane->scp->session, SSH_FATAL, "Can't open %s: %s", path,
+        strerror(errno));
+    return SSH_ERROR;
+  }
+  lane->sent = 0;
+  if (ssh_scp_push_file(lane->scp, path, size, st.st_mode & 07777) < 0) {
+    return SSH_ERROR;
+  }
+  if (size == 0) {
+    /* only the end of the file is left */
+    return ssh_scp_write(lane->scp, "", 0);
+  }
+
+  return SSH_OK;
+}
+
+/* sends what the window of the channel takes of the file, 0 if nothing */
+static int64_t scp_lane_send(struct scp_lane *lane, const char *path,
+    uint64_t size, char *data) {
+  ssh_scp scp = lane->scp;
+  uint32_t window;
+  uint32_t gathered;
+  size_t len;
+  ssize_t r;
+
+  window = channel_write_window(scp->channel);
+  gathered = scp->output != NULL ? buffer_get_rest_len(scp->output) : 0;
+  if (window == 0) {
+    return 0;
+  }
+  if (window <= gathered) {
+    /* a header larger than the window, the rest of it comes soon */
+    return scp_write_output(scp) < 0 ? SSH_ERROR : 0;
+  }
+  len = window - gathered;
+  if (len > SCP_PIPELINE_WRITE) {
+    len = SCP_PIPELINE_WRITE;
+  }
+  if (len > size - lane->sent) {
+    len = size - lane->sent;
+  }
+
+  do {
+    r = read(lane->fd, data, len);
+  } while (r < 0 && errno == EINTR);
+  if (r <= 0) {
+    ssh_set_error(scp->session, SSH_FATAL, "Can't read %s: %s", path,
+        r < 0 ? strerror(errno) : "file truncated");
+    scp->state = SSH_SCP_ERROR;
+    return SSH_ERROR;
+  }
+  /* nothing stays gathered, so no write waits for the window */
+  if (ssh_scp_write(scp, data, r) < 0 || scp_write_output(scp) < 0) {
+    return SSH_ERROR;
+  }
+  lane->sent += r;
+
+  return r;
+}
+
+/**
+ * @brief Push local files over several scps in sink mode at once.
+ *
+ * Each scp sends one file at a time, the next file of the list going to the
+ * first scp done with its own. The scps can be channels of one ssh session,
+ * each one with its window, or of several sessions. The files are sent with
+ * the pipelining of SSH_SCP_PIPELINE and each scp only writes what the
+ * window of its channel takes, waiting for all of them together when none
+ * can, so one slow channel doesn't hold the others. This returns once the
+ * sinks acknowledged all the files.
+ *
+ * @param[in]  scps     The scp handles, initialized in SSH_SCP_WRITE mode.
+ *
+ * @param[in]  count    The number of scps.
+ *
+ * @param[in]  paths    The local files to push, with the permissions they
+ *                      have. Only their names are sent.
+ *
+ * @param[in]  npaths   The number of files.
+ *
+ * @param[in]  progress Called after each write with the file, the bytes of
+ *                      it sent, the bytes of all the files sent and the
+ *                      total to send, or NULL.
+ *
+ * @param[in]  userdata Userdata of progress.
+ *
+ * @returns             SSH_OK if the files have been sent and written,
+ *                      SSH_ERROR if an error occured, set on the session of
+ *                      the first scp.
+ *
+ * @see ssh_scp_push_tree()
+ */
+int ssh_scp_push_files(ssh_scp *scps, size_t count, const char **paths,
+    size_t npaths, ssh_scp_progress_callback progress, void *userdata) {
+  struct scp_lane *lanes = NULL;
+  struct scp_lane *lane;
+  struct scp_lane *failed = NULL;
+  ssh_channel_set set = NULL;
+  uint64_t *sizes = NULL;
+  uint64_t total = 0;
+  uint64_t sent = 0;
+  struct stat st;
+  size_t next = 0;
+  size_t i;
+  char *data = NULL;
+  int64_t n;
+  int active;
+  int moved;
+  int rc = SSH_ERROR;
+
+  if (scps == NULL || count == 0 || scps[0] == NULL) {
+    return SSH_ERROR;
+  }
+  if (paths == NULL && npaths > 0) {
+    ssh_set_error_invalid(scps[0]->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+  for (i = 0; i < count; i++) {
+    if (scps[i] == NULL || scps[i]->state != SSH_SCP_WRITE_INITED) {
+      ssh_set_error(scps[0]->session, SSH_FATAL,
+          "ssh_scp_push_files called under invalid state");
+      return SSH_ERROR;
+    }
+  }
+
+  lanes = calloc(count, sizeof(struct scp_lane));
+  sizes = calloc(npaths + 1, sizeof(uint64_t));
+  data = malloc(SCP_PIPELINE_WRITE);
+  set = ssh_channel_set_new();
+  if (lanes == NULL || sizes == NULL || data == NULL || set == NULL) {
+    ssh_set_error_oom(scps[0]->session);
+    goto out;
+  }
+  for (i = 0; i < count; i++) {
+    lanes[i].scp = scps[i];
+    lanes[i].pipeline = scps[i]->pipeline;
+    lanes[i].fd = -1;
+    scps[i]->pipeline = 1;
+  }
+
+  /* the sizes are announced, and give the total */
+  for (i = 0; i < npaths; i++) {
+    if (paths[i] == NULL) {
+      ssh_set_error_invalid(scps[0]->session, __FUNCTION__);
+      goto out;
+    }
+    if (stat(paths[i], &st) < 0) {
+      ssh_set_error(scps[0]->session, SSH_FATAL, "Can't stat %s: %s",
+          paths[i], strerror(errno));
+      goto out;
+    }
+    if (!S_ISREG(st.st_mode)) {
+      ssh_set_error(scps[0]->session, SSH_FATAL, "%s is not a file",
+          paths[i]);
+      goto out;
+    }
+    sizes[i] = st.st_size;
+    total += sizes[i];
+  }
+
+  for (;;) {
+    active = 0;
+    moved = 0;
+    for (i = 0; i < count; i++) {
+      lane = &lanes[i];
+      if (lane->fd < 0) {
+        if (next == npaths) {
+          continue;
+        }
+        lane->file = next++;
+        if (scp_lane_start(lane, paths[lane->file], sizes[lane->file]) < 0) {
+          failed = lane;
+          goto out;
+        }
+      }
+      if (lane->sent < sizes[lane->file]) {
+        n = scp_lane_send(lane, paths[lane->file], sizes[lane->file], data);
+        if (n < 0) {
+          failed = lane;
+          goto out;
+        }
+        if (n > 0) {
+          sent += n;
+          moved = 1;
+          if (progress != NULL) {
+            progress(paths[lane->file], lane->sent, sent, total, userdata);
+          }
+        }
+      }
+      if (lane->sent == sizes[lane->file]) {
+        close(lane->fd);
+        lane->fd = -1;
+        if (sizes[lane->file] == 0 && progress != NULL) {
+          progress(paths[lane->file], 0, sent, total, userdata);
+        }
+        /* the lane takes the next file in the next round */
+        moved = 1;
+        continue;
+      }
+      active = 1;
+    }
+    if (!active && next == npaths) {
+      break;
+    }
+    if (moved) {
+      continue;
+    }
+
+    /* none could write, wait for the windows to grow */
+    for (i = 0; i < count; i++) {
+      lane = &lanes[i];
+      if (lane->fd >= 0 && ssh_channel_set_add(set, lane->scp->channel,
+            SSH_CHANNEL_SET_WRITE | SSH_CHANNEL_SET_EXCEPT) < 0) {
+        ssh_set_error_oom(scps[0]->session);
+        goto out;
+      }
+    }
+    if (ssh_channel_set_select(set, -1) == SSH_ERROR) {
+      ssh_set_error(scps[0]->session, SSH_FATAL,
+          "Error waiting for the scp channels: %s", strerror(errno));
+      goto out;
+    }
+    for (i = 0; i < count; i++) {
+      lane = &lanes[i];
+      if (lane->fd >= 0) {
+        ssh_channel_set_remove(set, lane->scp->channel);
+        if (!ssh_channel_is_open(lane->scp->channel)) {
+          ssh_set_error(lane->scp->session, SSH_FATAL,
+              "The scp channel has been closed");
+          lane->scp->state = SSH_SCP_ERROR;
+          failed = lane;
+          goto out;
+        }
+      }
+    }
+  }
+
+  rc = SSH_OK;
+  for (i = 0; i < count; i++) {
+    if (ssh_scp_flush(lanes[i].scp) < 0) {
+      failed = &lanes[i];
+      rc = SSH_ERROR;
+      break;
+    }
+  }
+
+out:
+  /* the error goes to the first session, where the caller looks */
+  if (failed != NULL && failed->scp->session != scps[0]->session) {
+    ssh_set_error(scps[0]->session, ssh_get_error_code(failed->scp->session),
+        "%s", ssh_get_error(failed->scp->session));
+  }
+  if (lanes != NULL) {
+    for (i = 0; i < count; i++) {
+      if (lanes[i].fd >= 0) {
+        close(lanes[i].fd);
+      }
+      scps[i]->pipeline = lanes[i].pipeline;
+    }
+  }
+  ssh_channel_set_free(set);
+  SAFE_FREE(lanes);
+  SAFE_FREE(sizes);
+  SAFE_FREE(data);
+
+  return rc;
+}
+#else /* _WIN32 */
+int ssh_scp_push_tree(ssh_scp scp, const char *path) {
+  (void) path;
+
+  if (scp == NULL) {
+    return SSH_ERROR;
+  }
+  ssh_set_error(scp->session, SSH_FATAL,
+      "ssh_scp_push_tree is not supported on this platform");
+
+  return SSH_ERROR;
+}
+
+int ssh_scp_push_files(ssh_scp *scps, size_t count, const char **paths,
+    size_t npaths, ssh_scp_progress_callback progress, void *userdata) {
+  (void) count;
+  (void) paths;
+  (void) npaths;
+  (void) progress;
+  (void) userdata;
+
+  if (scps == NULL || scps[0] == NULL) {
+    return SSH_ERROR;
+  }
+  ssh_set_error(scps[0]->session, SSH_FATAL,
+      "ssh_scp_push_files is not supported on this platform");
+
+  return SSH_ERROR;
+}
+#endif /* _WIN32 */
+
 /**
  * @brief Read a string on a channel, terminated by '\n'
  *
@@ -496,7 +1132,7 @@ int ssh_scp_pull_request(ssh_scp scp){
   p=strchr(buffer,'\n');
   if(p!=NULL)
 	  *p='\0';
-  ssh_log(scp->session,SSH_LOG_PROTOCOL,"Received SCP request: '%s'",buffer);
+  SSH_LOG(scp->session,SSH_LOG_PROTOCOL,"Received SCP request: '%s'",buffer);
   switch(buffer[0]){
     case 'C':
       /* File */
@@ -618,6 +1254,26 @@ int ssh_scp_accept_request(ssh_scp scp){
   return SSH_OK;
 }
 
+/* acknowledges the end of the file being read and takes the status of it */
+static int scp_read_end(ssh_scp scp) {
+  int code;
+
+  scp->processed = scp->filelen = 0;
+  ssh_channel_write(scp->channel, "", 1);
+  code = ssh_scp_response(scp, NULL);
+  if (code == 0) {
+    scp->state = SSH_SCP_READ_INITED;
+    return SSH_OK;
+  }
+  if (code == 1) {
+    scp->state = SSH_SCP_READ_INITED;
+    return SSH_ERROR;
+  }
+  scp->state = SSH_SCP_ERROR;
+
+  return SSH_ERROR;
+}
+
 /** @brief Read from a remote scp file
  * @param[in]  scp      The scp handle.
  *
@@ -630,7 +1286,6 @@ int ssh_scp_accept_request(ssh_scp scp){
  */
 int ssh_scp_read(ssh_scp scp, void *buffer, size_t size){
   int r;
-  int code;
   if(scp==NULL)
       return SSH_ERROR;
   if(scp->state == SSH_SCP_READ_REQUESTED && scp->request_type == SSH_SCP_REQUEST_NEWFILE){
@@ -644,8 +1299,8 @@ int ssh_scp_read(ssh_scp scp, void *buffer, size_t size){
   }
   if(scp->processed + size > scp->filelen)
     size = scp->filelen - scp->processed;
-  if(size > 65536)
-    size=65536; /* avoid too large reads */
+  if(size > SCP_READ_MAX)
+    size=SCP_READ_MAX; /* avoid too large reads */
   r=ssh_channel_read(scp->channel,buffer,size,0);
   if(r != SSH_ERROR)
     scp->processed += r;
@@ -655,22 +1310,255 @@ int ssh_scp_read(ssh_scp scp, void *buffer, size_t size){
   }
   /* Check if we arrived at end of file */
   if(scp->processed == scp->filelen) {
-    scp->processed=scp->filelen=0;
-    ssh_channel_write(scp->channel,"",1);
-    code=ssh_scp_response(scp,NULL);
-    if(code == 0){
-    	scp->state=SSH_SCP_READ_INITED;
-    	return r;
-    }
-    if(code==1){
-    	scp->state=SSH_SCP_READ_INITED;
-    	return SSH_ERROR;
+    if(scp_read_end(scp) < 0)
+      return SSH_ERROR;
+  }
+  return r;
+}
+
+#ifndef _WIN32
+struct scp_pull_output {
+  int fd;
+  int error; /* errno of the failed write */
+};
+
+/* the callback of ssh_scp_pull_to_fd(): the data is written where it is */
+static int scp_pull_write(const void *data, uint32_t len, void *userdata) {
+  struct scp_pull_output *out = userdata;
+  uint32_t done = 0;
+  ssize_t w;
+
+  while (done < len) {
+    w = write(out->fd, (const char *) data + done, len - done);
+    if (w < 0 && errno == EINTR) {
+      continue;
     }
-    scp->state=SSH_SCP_ERROR;
+    if (w <= 0) {
+      out->error = w < 0 ? errno : ENOSPC;
+      return -1;
+    }
+    done += w;
+  }
+
+  return done;
+}
+
+/**
+ * @brief Write the file being pulled from a remote scp into a descriptor.
+ *
+ * The file request is accepted if it wasn't, then all the data left in the
+ * file is written to fd as it arrives, without being copied out of the
+ * channel, and the end of the file is acknowledged. Unlike ssh_scp_read(),
+ * this returns only once the whole file has been transferred.
+ *
+ * @param[in]  scp      The scp handle.
+ *
+ * @param[in]  fd       The descriptor to write the file to.
+ *
+ * @returns             SSH_OK if the file has been written, SSH_ERROR if an
+ *                      error occured while reading it or writing it.
+ *
+ * @see ssh_scp_pull_request()
+ */
+int ssh_scp_pull_to_fd(ssh_scp scp, int fd) {
+  struct scp_pull_output out;
+  size_t left;
+  int r;
+
+  if (scp == NULL) {
     return SSH_ERROR;
   }
-  return r;
+  if (fd < 0) {
+    ssh_set_error_invalid(scp->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+  if (scp->state == SSH_SCP_READ_REQUESTED &&
+      scp->request_type == SSH_SCP_REQUEST_NEWFILE) {
+    if (ssh_scp_accept_request(scp) == SSH_ERROR) {
+      return SSH_ERROR;
+    }
+  }
+  if (scp->state != SSH_SCP_READ_READING) {
+    ssh_set_error(scp->session, SSH_FATAL,
+        "ssh_scp_pull_to_fd called under invalid state");
+    return SSH_ERROR;
+  }
+
+  out.fd = fd;
+  out.error = 0;
+  while (scp->processed < scp->filelen) {
+    left = scp->filelen - scp->processed;
+    r = channel_read_in_place(scp->channel,
+        left > SCP_READ_MAX ? SCP_READ_MAX : left, 0, -1,
+        scp_pull_write, &out);
+    if (r <= 0) {
+      if (r == 0) {
+        ssh_set_error(scp->session, SSH_FATAL,
+            "End of file while reading %s", scp->request_name);
+      } else if (out.error != 0) {
+        ssh_set_error(scp->session, SSH_FATAL, "Can't write %s: %s",
+            scp->request_name, strerror(out.error));
+      }
+      scp->state = SSH_SCP_ERROR;
+      return SSH_ERROR;
+    }
+    scp->processed += r;
+  }
+
+  return scp_read_end(scp);
+}
+
+/* pulls the requests into a directory, until its end or the end of all */
+static int scp_pull_dir(ssh_scp scp, const char *path, int depth) {
+  const char *name;
+  char *child;
+  size_t len;
+  int fd;
+  int rc;
+
+  for (;;) {
+    rc = ssh_scp_pull_request(scp);
+    switch (rc) {
+      case SSH_SCP_REQUEST_NEWFILE:
+      case SSH_SCP_REQUEST_NEWDIR:
+        break;
+      case SSH_SCP_REQUEST_ENDDIR:
+        if (depth == 0) {
+          ssh_set_error(scp->session, SSH_FATAL,
+              "SCP: end of a directory that wasn't entered");
+          return SSH_ERROR;
+        }
+        return SSH_OK;
+      case SSH_SCP_REQUEST_EOF:
+        if (depth > 0) {
+          ssh_set_error(scp->session, SSH_FATAL,
+              "SCP: end of file inside a directory");
+          return SSH_ERROR;
+        }
+        return SSH_OK;
+      case SSH_SCP_REQUEST_WARNING:
+        SSH_LOG(scp->session, SSH_LOG_PROTOCOL, "SCP warning: %s",
+            scp->warning);
+        continue;
+      default:
+        return SSH_ERROR;
+    }
+
+    name = ssh_scp_request_get_filename(scp);
+    if (!ssh_path_name_valid(name)) {
+      ssh_scp_deny_request(scp, "invalid file name");
+      ssh_set_error(scp->session, SSH_FATAL, "SCP: invalid file name %s",
+          name != NULL ? name : "(null)");
+      return SSH_ERROR;
+    }
+    len = strlen(path) + strlen(name) + 2;
+    child = malloc(len);
+    if (child == NULL) {
+      ssh_set_error_oom(scp->session);
+      return SSH_ERROR;
+    }
+    snprintf(child, len, "%s/%s", path, name);
+
+    if (rc == SSH_SCP_REQUEST_NEWDIR) {
+      if (mkdir(child, scp->request_mode) < 0 && errno != EEXIST) {
+        ssh_set_error(scp->session, SSH_FATAL, "Can't create %s: %s", child,
+            strerror(errno));
+        ssh_scp_deny_request(scp, "can't create the directory");
+        SAFE_FREE(child);
+        return SSH_ERROR;
+      }
+      rc = ssh_scp_accept_request(scp);
+      if (rc == SSH_OK) {
+        rc = scp_pull_dir(scp, child, depth + 1);
+      }
+      SAFE_FREE(child);
+      if (rc < 0) {
+        return SSH_ERROR;
+      }
+      continue;
+    }
+
+    fd = open(child, O_WRONLY | O_CREAT | O_TRUNC, scp->request_mode);
+    if (fd < 0) {
+      ssh_set_error(scp->session, SSH_FATAL, "Can't open %s: %s", child,
+          strerror(errno));
+      ssh_scp_deny_request(scp, "can't create the file");
+      SAFE_FREE(child);
+      return SSH_ERROR;
+    }
+    SAFE_FREE(child);
+    rc = ssh_scp_pull_to_fd(scp, fd);
+    if (close(fd) < 0 && rc == SSH_OK) {
+      ssh_set_error(scp->session, SSH_FATAL, "Can't write %s: %s", name,
+          strerror(errno));
+      return SSH_ERROR;
+    }
+    if (rc < 0) {
+      return SSH_ERROR;
+    }
+  }
+}
+
+/**
+ * @brief Pull the files and directories of a remote scp into a local
+ * directory.
+ *
+ * The requests are taken with ssh_scp_pull_request() until the remote side
+ * has sent everything. The files are written with ssh_scp_pull_to_fd() and
+ * the directories are created, both with the permissions requested.
+ * Existing files are overwritten. A name that would leave its directory
+ * is refused and fails the transfer.
+ *
+ * @param[in]  scp      The scp handle, in SSH_SCP_READ mode.
+ *
+ * @param[in]  path     The existing local directory to pull into.
+ *
+ * @returns             SSH_OK if everything has been pulled, SSH_ERROR if an
+ *                      error occured.
+ *
+ * @see ssh_scp_push_tree()
+ */
+int ssh_scp_pull_tree(ssh_scp scp, const char *path) {
+  if (scp == NULL) {
+    return SSH_ERROR;
+  }
+  if (path == NULL) {
+    ssh_set_error_invalid(scp->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+  if (scp->state != SSH_SCP_READ_INITED) {
+    ssh_set_error(scp->session, SSH_FATAL,
+        "ssh_scp_pull_tree called under invalid state");
+    return SSH_ERROR;
+  }
+
+  return scp_pull_dir(scp, path, 0);
+}
+#else /* _WIN32 */
+int ssh_scp_pull_to_fd(ssh_scp scp, int fd) {
+  (void) fd;
+
+  if (scp == NULL) {
+    return SSH_ERROR;
+  }
+  ssh_set_error(scp->session, SSH_FATAL,
+      "ssh_scp_pull_to_fd is not supported on this platform");
+
+  return SSH_ERROR;
+}
+
+int ssh_scp_pull_tree(ssh_scp scp, const char *path) {
+  (void) path;
+
+  if (scp == NULL) {
+    return SSH_ERROR;
+  }
+  ssh_set_error(scp->session, SSH_FATAL,
+      "ssh_scp_pull_tree is not supported on this platform");
+
+  return SSH_ERROR;
 }
+#endif /* _WIN32 */
 
 /**
  * @brief Get the name of the directory or file being pushed from the other
@@ -56,7 +56,11 @@
 #include "libssh/misc.h"
 #include "libssh/keys.h"
 #include "libssh/dh.h"
+#include "libssh/ecdh.h"
+#include "libssh/curve25519.h"
+#include "libssh/kexpool.h"
 #include "libssh/messages.h"
+#include "libssh/admission.h"
 
 #define set_status(session, status) do {\
         if (session->callbacks && session->callbacks->connect_status_function) \
@@ -84,24 +88,33 @@ extern char *supported_methods[];
 
 static int server_set_kex(ssh_session session) {
   KEX *server = &session->server_kex;
+  char hostkeys[128];
   int i, j;
   char *wanted;
 
-  ZERO_STRUCTP(server);
+  /* the methods of the last key exchange */
+  ssh_kex_free_methods(server);
   ssh_get_random(server->cookie, 16, 0);
-  if (session->dsa_key != NULL && session->rsa_key != NULL) {
-    if (ssh_options_set_algo(session, SSH_HOSTKEYS,
-          "ssh-dss,ssh-rsa") < 0) {
-      return -1;
-    }
-  } else if (session->dsa_key != NULL) {
-    if (ssh_options_set_algo(session, SSH_HOSTKEYS, "ssh-dss") < 0) {
-      return -1;
-    }
-  } else {
-    if (ssh_options_set_algo(session, SSH_HOSTKEYS, "ssh-rsa") < 0) {
-      return -1;
-    }
+  server->first_kex_follows = 0;
+  /* the host keys which are loaded, the strongest first */
+  hostkeys[0] = '\0';
+  if (session->host_keys[SSH_KEYTYPE_ED25519] != NULL) {
+    strcat(hostkeys, ",ssh-ed25519");
+  }
+  if (session->host_keys[SSH_KEYTYPE_ECDSA] != NULL) {
+    strcat(hostkeys, ",ecdsa-sha2-nistp256");
+  }
+  if (session->host_keys[SSH_KEYTYPE_DSS] != NULL) {
+    strcat(hostkeys, ",ssh-dss");
+  }
+  if (session->host_keys[SSH_KEYTYPE_RSA] != NULL) {
+    strcat(hostkeys, ",ssh-rsa");
+  }
+  if (hostkeys[0] == '\0') {
+    strcat(hostkeys, ",ssh-rsa");
+  }
+  if (ssh_options_set_algo(session, SSH_HOSTKEYS, hostkeys + 1) < 0) {
+    return -1;
   }
 
   server->methods = malloc(10 * sizeof(char **));
@@ -130,9 +143,16 @@ SSH_PACKET_CALLBACK(ssh_packet_kexdh_init){
   ssh_string e;
   (void)type;
   (void)user;enter_function();
-  ssh_log(session,SSH_LOG_PACKET,"Received SSH_MSG_KEXDH_INIT");
+  SSH_LOG(session,SSH_LOG_PACKET,"Received SSH_MSG_KEXDH_INIT");
+  if (session->kex_skip_guess) {
+    /* all our methods start with this message */
+    SSH_LOG(session, SSH_LOG_PROTOCOL, "Ignoring the wrong guess of the client");
+    session->kex_skip_guess = 0;
+    leave_function();
+    return SSH_PACKET_USED;
+  }
   if(session->dh_handshake_state != DH_STATE_INIT){
-    ssh_log(session,SSH_LOG_RARE,"Invalid state for SSH_MSG_KEXDH_INIT");
+    SSH_LOG(session,SSH_LOG_RARE,"Invalid state for SSH_MSG_KEXDH_INIT");
     goto error;
   }
   e = buffer_get_ssh_string(packet);
@@ -140,12 +160,19 @@ SSH_PACKET_CALLBACK(ssh_packet_kexdh_init){
     ssh_set_error(session, SSH_FATAL, "No e number in client request");
     return -1;
   }
-  if (dh_import_e(session, e) < 0) {
+  if (session->next_crypto->kex_type != SSH_KEX_DH_GROUP1_SHA1) {
+    /* Q_C, it is hashed as it is */
+    session->next_crypto->ecdh_client_pubkey = e;
+    e = NULL;
+  } else if (dh_import_e(session, e) < 0) {
     ssh_set_error(session, SSH_FATAL, "Cannot import e number");
     session->session_state=SSH_SESSION_STATE_ERROR;
-  } else {
-    session->dh_handshake_state=DH_STATE_INIT_SENT;
-    dh_handshake_server(session);
+    ssh_string_free(e);
+    goto error;
+  }
+  session->dh_handshake_state=DH_STATE_INIT_SENT;
+  if (dh_handshake_server(session) < 0) {
+    session->session_state=SSH_SESSION_STATE_ERROR;
   }
   ssh_string_free(e);
 
@@ -158,44 +185,61 @@ static int dh_handshake_server(ssh_session session) {
   ssh_string f;
   ssh_string pubkey;
   ssh_string sign;
-  ssh_public_key pub;
+  struct ssh_hostkey_struct *hostkey;
   ssh_private_key prv;
 
-  if (dh_generate_y(session) < 0) {
-    ssh_set_error(session, SSH_FATAL, "Could not create y number");
-    return -1;
-  }
-  if (dh_generate_f(session) < 0) {
-    ssh_set_error(session, SSH_FATAL, "Could not create f number");
-    return -1;
+  /* f is Q_S for ECDH, the shared secret is computed with it */
+  switch (session->next_crypto->kex_type) {
+    case SSH_KEX_DH_GROUP1_SHA1:
+      if (ssh_kex_pool_take_dh(&session->next_crypto->y,
+            &session->next_crypto->f) < 0) {
+        if (dh_generate_y(session) < 0) {
+          ssh_set_error(session, SSH_FATAL, "Could not create y number");
+          return -1;
+        }
+        if (dh_generate_f(session) < 0) {
+          ssh_set_error(session, SSH_FATAL, "Could not create f number");
+          return -1;
+        }
+      }
+      f = dh_get_f(session);
+      break;
+#ifdef HAVE_ECDH
+    case SSH_KEX_ECDH_SHA2_NISTP256:
+      if (ssh_server_ecdh_init(session) < 0) {
+        return -1;
+      }
+      f = ssh_string_copy(session->next_crypto->ecdh_server_pubkey);
+      break;
+#endif
+    case SSH_KEX_CURVE25519_SHA256:
+      if (ssh_server_curve25519_init(session) < 0) {
+        return -1;
+      }
+      f = ssh_string_copy(session->next_crypto->ecdh_server_pubkey);
+      break;
+    default:
+      ssh_set_error(session, SSH_FATAL, "Unknown key exchange type");
+      return -1;
   }
-
-  f = dh_get_f(session);
   if (f == NULL) {
     ssh_set_error(session, SSH_FATAL, "Could not get the f number");
     return -1;
   }
 
-  switch(session->hostkeys){
-    case SSH_KEYTYPE_DSS:
-      prv = session->dsa_key;
-      break;
-    case SSH_KEYTYPE_RSA:
-      prv = session->rsa_key;
-      break;
-    default:
-      prv = NULL;
+  hostkey = NULL;
+  if (session->hostkeys > 0 && session->hostkeys < SSH_HOSTKEY_TYPES) {
+    hostkey = session->host_keys[session->hostkeys];
   }
-
-  pub = publickey_from_privatekey(prv);
-  if (pub == NULL) {
-    ssh_set_error(session, SSH_FATAL,
-        "Could not get the public key from the private key");
+  if (hostkey == NULL) {
+    ssh_set_error(session, SSH_FATAL, "No host key of the negotiated type");
     ssh_string_free(f);
     return -1;
   }
-  pubkey = publickey_to_string(pub);
-  publickey_free(pub);
+  prv = hostkey->key;
+
+  /* serialized once by the bind */
+  pubkey = ssh_string_copy(hostkey->blob);
   if (pubkey == NULL) {
     ssh_set_error(session, SSH_FATAL, "Not enough space");
     ssh_string_free(f);
@@ -203,7 +247,8 @@ static int dh_handshake_server(ssh_session session) {
   }
 
   dh_import_pubkey(session, pubkey);
-  if (dh_build_k(session) < 0) {
+  if (session->next_crypto->kex_type == SSH_KEX_DH_GROUP1_SHA1 &&
+      dh_build_k(session) < 0) {
     ssh_set_error(session, SSH_FATAL, "Could not import the public key");
     ssh_string_free(f);
     return -1;
@@ -222,16 +267,6 @@ static int dh_handshake_server(ssh_session session) {
     return -1;
   }
 
-  /* Free private keys as they should not be readable after this point */
-  if (session->rsa_key) {
-    privatekey_free(session->rsa_key);
-    session->rsa_key = NULL;
-  }
-  if (session->dsa_key) {
-    privatekey_free(session->dsa_key);
-    session->dsa_key = NULL;
-  }
-
   if (buffer_add_u8(session->out_buffer, SSH2_MSG_KEXDH_REPLY) < 0 ||
       buffer_add_ssh_string(session->out_buffer, pubkey) < 0 ||
       buffer_add_ssh_string(session->out_buffer, f) < 0 ||
@@ -256,12 +291,78 @@ static int dh_handshake_server(ssh_session session) {
   if (packet_send(session) == SSH_ERROR) {
     return -1;
   }
-  ssh_log(session, SSH_LOG_PACKET, "SSH_MSG_NEWKEYS sent");
+  SSH_LOG(session, SSH_LOG_PACKET, "SSH_MSG_NEWKEYS sent");
   session->dh_handshake_state=DH_STATE_NEWKEYS_SENT;
 
   return 0;
 }
 
+/*
+ * Negotiates the algorithms of the two SSH_MSG_KEXINIT. The result
+ * replaces the proposal of the client.
+ */
+static int server_negotiate_kex(ssh_session session) {
+  ssh_list_kex(session, &session->client_kex);
+  if (crypt_set_algorithms_server(session) != SSH_OK) {
+    return -1;
+  }
+  /* a guessed packet follows the SSH_MSG_KEXINIT, RFC 4253 section 7.1 */
+  session->kex_skip_guess = session->client_kex.first_kex_follows &&
+    !ssh_kex_guess_right(session);
+  ssh_kex_free_methods(&session->client_kex);
+
+  return set_kex(session);
+}
+
+/* the SSH2_MSG_NEWKEYS of the client was received */
+static int server_switch_keys(ssh_session session) {
+  if (generate_session_keys(session) < 0) {
+    return -1;
+  }
+
+  if (crypt_set_keys(session->next_crypto) < 0) {
+    ssh_set_error(session, SSH_FATAL, "Could not set up the cipher keys");
+    return -1;
+  }
+
+  return ssh_kex_newkeys(session);
+}
+
+/* the steps of a key re-exchange */
+static int ssh_server_rekey(ssh_session session) {
+  if (ssh_kex_next_crypto(session) < 0) {
+    return -1;
+  }
+  switch (session->rekey_state) {
+    case SSH_REKEY_STATE_INIT:
+    case SSH_REKEY_STATE_KEXINIT_RECEIVED:
+      if (server_set_kex(session) < 0 || ssh_send_kex(session, 1) < 0) {
+        return -1;
+      }
+      if (session->rekey_state == SSH_REKEY_STATE_INIT) {
+        session->rekey_state = SSH_REKEY_STATE_KEXINIT_SENT;
+        break;
+      }
+      /* FALL THROUGH */
+    case SSH_REKEY_STATE_KEXINIT_EXCHANGED:
+      if (server_negotiate_kex(session) < 0) {
+        return -1;
+      }
+      session->rekey_state = SSH_REKEY_STATE_DH;
+      session->dh_handshake_state = DH_STATE_INIT;
+      break;
+    case SSH_REKEY_STATE_DH:
+      if (session->dh_handshake_state == DH_STATE_FINISHED) {
+        return server_switch_keys(session);
+      }
+      break;
+    default:
+      break;
+  }
+
+  return 0;
+}
+
 /**
  * @internal
  *
@@ -271,6 +372,14 @@ static int dh_handshake_server(ssh_session session) {
 static void ssh_server_connection_callback(ssh_session session){
 	int ssh1,ssh2;
 	enter_function();
+	if (session->rekey_state != SSH_REKEY_STATE_NONE &&
+	    session->session_state != SSH_SESSION_STATE_ERROR) {
+		if (ssh_server_rekey(session) < 0) {
+			goto error;
+		}
+		leave_function();
+		return;
+	}
 	switch(session->session_state){
 		case SSH_SESSION_STATE_NONE:
 		case SSH_SESSION_STATE_CONNECTING:
@@ -281,7 +390,7 @@ static void ssh_server_connection_callback(ssh_session session){
 		    goto error;
 		  }
 		  set_status(session, 0.4f);
-		  ssh_log(session, SSH_LOG_RARE,
+		  SSH_LOG(session, SSH_LOG_RARE,
 		      "SSH client banner: %s", session->clientbanner);
 
 		  /* Here we analyze the different protocols the server allows. */
@@ -319,7 +428,7 @@ static void ssh_server_connection_callback(ssh_session session){
 		  ssh_packet_set_default_callbacks(session);
 		  set_status(session, 0.5f);
 		  session->session_state=SSH_SESSION_STATE_INITIAL_KEX;
-          if (ssh_send_kex(session, 1) < 0) {
+		  if (!session->kexinit_sent && ssh_send_kex(session, 1) < 0) {
 			goto error;
 		  }
 		  break;
@@ -337,9 +446,7 @@ static void ssh_server_connection_callback(ssh_session session){
 			break;
 		case SSH_SESSION_STATE_KEXINIT_RECEIVED:
 			set_status(session,0.6f);
-			ssh_list_kex(session, &session->client_kex); // log client kex
-            crypt_set_algorithms_server(session);
-			if (set_kex(session) < 0) {
+			if (server_negotiate_kex(session) < 0) {
 				goto error;
 			}
 			set_status(session,0.8f);
@@ -347,30 +454,25 @@ static void ssh_server_connection_callback(ssh_session session){
             break;
 		case SSH_SESSION_STATE_DH:
 			if(session->dh_handshake_state==DH_STATE_FINISHED){
-                if (generate_session_keys(session) < 0) {
-                  goto error;
-                }
-
                 /*
                  * Once we got SSH2_MSG_NEWKEYS we can switch next_crypto and
                  * current_crypto
                  */
-                if (session->current_crypto) {
-                  crypto_free(session->current_crypto);
-                }
-
-                /* FIXME TODO later, include a function to change keys */
-                session->current_crypto = session->next_crypto;
-                session->next_crypto = crypto_new();
-                if (session->next_crypto == NULL) {
+                if (server_switch_keys(session) < 0) {
                   goto error;
                 }
 				set_status(session,1.0f);
 				session->connected = 1;
 				session->session_state=SSH_SESSION_STATE_AUTHENTICATING;
+				if (ssh_callbacks_exists(session->callbacks,
+				      server_kex_done_function)) {
+					session->callbacks->server_kex_done_function(session,
+					    session->callbacks->userdata);
+				}
             }
 			break;
 		case SSH_SESSION_STATE_AUTHENTICATING:
+		case SSH_SESSION_STATE_AUTHENTICATED:
 			break;
 		case SSH_SESSION_STATE_ERROR:
 			goto error;
@@ -428,7 +530,7 @@ static int callback_receive_banner(const void *data, size_t len, void *user) {
             ret = i + 1;
             session->clientbanner = str;
             session->session_state = SSH_SESSION_STATE_BANNER_RECEIVED;
-            ssh_log(session, SSH_LOG_PACKET, "Received banner: %s", str);
+            SSH_LOG(session, SSH_LOG_PACKET, "Received banner: %s", str);
             session->ssh_connection_callback(session);
 
             leave_function();
@@ -449,15 +551,28 @@ static int callback_receive_banner(const void *data, size_t len, void *user) {
     return ret;
 }
 
-/* Do the banner and key exchange */
-int ssh_handle_key_exchange(ssh_session session) {
+/* sends the banner and the first packets, the rest is done by the callbacks */
+static int server_start_key_exchange(ssh_session session) {
     int rc;
 
+    rc = server_set_kex(session);
+    if (rc < 0) {
+        return SSH_ERROR;
+    }
+
     rc = ssh_send_banner(session, 1);
     if (rc < 0) {
         return SSH_ERROR;
     }
 
+    /* without SSH-1, our SSH_MSG_KEXINIT doesn't wait for the client banner */
+    if (!session->ssh1) {
+        if (ssh_send_kex(session, 1) < 0) {
+            return SSH_ERROR;
+        }
+        session->kexinit_sent = 1;
+    }
+
     session->alive = 1;
 
     session->ssh_connection_callback = ssh_server_connection_callback;
@@ -467,27 +582,46 @@ int ssh_handle_key_exchange(ssh_session session) {
     session->socket_callbacks.exception=ssh_socket_exception_callback;
     session->socket_callbacks.userdata=session;
 
-    rc = server_set_kex(session);
-    if (rc < 0) {
-        return SSH_ERROR;
+    return SSH_OK;
+}
+
+static int server_key_exchange_terminated(ssh_session session) {
+    return session->session_state == SSH_SESSION_STATE_ERROR ||
+           session->session_state == SSH_SESSION_STATE_AUTHENTICATING ||
+           session->session_state == SSH_SESSION_STATE_AUTHENTICATED ||
+           session->session_state == SSH_SESSION_STATE_DISCONNECTED;
+}
+
+/* Do the banner and key exchange */
+int ssh_handle_key_exchange(ssh_session session) {
+    int blocking = ssh_is_blocking(session);
+
+    if (session->session_state == SSH_SESSION_STATE_NONE) {
+        if (server_start_key_exchange(session) < 0) {
+            return SSH_ERROR;
+        }
     }
 
-    while (session->session_state != SSH_SESSION_STATE_ERROR &&
-           session->session_state != SSH_SESSION_STATE_AUTHENTICATING &&
-           session->session_state != SSH_SESSION_STATE_DISCONNECTED) {
-        /*
-         * loop until SSH_SESSION_STATE_BANNER_RECEIVED or
-         * SSH_SESSION_STATE_ERROR
-         */
-        ssh_handle_packets(session,-1);
-        ssh_log(session,SSH_LOG_PACKET, "ssh_handle_key_exchange: Actual state : %d",
+    /*
+     * a nonblocking session only takes what was received, the exchange goes
+     * on in ssh_event_dopoll() once the session is added to an event
+     */
+    while (!server_key_exchange_terminated(session)) {
+        ssh_handle_packets(session, blocking ? -1 : 0);
+        SSH_LOG(session,SSH_LOG_PACKET, "ssh_handle_key_exchange: Actual state : %d",
                 session->session_state);
+        if (!blocking) {
+            break;
+        }
     }
 
     if (session->session_state == SSH_SESSION_STATE_ERROR ||
         session->session_state == SSH_SESSION_STATE_DISCONNECTED) {
         return SSH_ERROR;
     }
+    if (!server_key_exchange_terminated(session)) {
+        return SSH_AGAIN;
+    }
 
   return SSH_OK;
 }
@@ -525,7 +659,7 @@ static int ssh_message_auth_reply_default(ssh_message msg,int partial) {
   /* Strip the comma. */
   methods_c[strlen(methods_c) - 1] = '\0'; // strip the comma. We are sure there is at
 
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Sending a auth failure. methods that can continue: %s", methods_c);
 
   methods = ssh_string_from_char(methods_c);
@@ -556,32 +690,10 @@ error:
 }
 
 static int ssh_message_channel_request_open_reply_default(ssh_message msg) {
-  ssh_log(msg->session, SSH_LOG_FUNCTIONS, "Refusing a channel");
-
-  if (buffer_add_u8(msg->session->out_buffer
-        , SSH2_MSG_CHANNEL_OPEN_FAILURE) < 0) {
-    goto error;
-  }
-  if (buffer_add_u32(msg->session->out_buffer,
-        htonl(msg->channel_request_open.sender)) < 0) {
-    goto error;
-  }
-  if (buffer_add_u32(msg->session->out_buffer,
-        htonl(SSH2_OPEN_ADMINISTRATIVELY_PROHIBITED)) < 0) {
-    goto error;
-  }
-  /* reason is an empty string */
-  if (buffer_add_u32(msg->session->out_buffer, 0) < 0) {
-    goto error;
-  }
-  /* language too */
-  if (buffer_add_u32(msg->session->out_buffer, 0) < 0) {
-    goto error;
-  }
+  SSH_LOG(msg->session, SSH_LOG_FUNCTIONS, "Refusing a channel");
 
-  return packet_send(msg->session);
-error:
-  return SSH_ERROR;
+  return ssh_message_channel_request_open_reply_failure(msg,
+      SSH2_OPEN_ADMINISTRATIVELY_PROHIBITED);
 }
 
 static int ssh_message_channel_request_reply_default(ssh_message msg) {
@@ -590,7 +702,7 @@ static int ssh_message_channel_request_reply_default(ssh_message msg) {
   if (msg->channel_request.want_reply) {
     channel = msg->channel_request.channel->remote_channel;
 
-    ssh_log(msg->session, SSH_LOG_PACKET,
+    SSH_LOG(msg->session, SSH_LOG_PACKET,
         "Sending a default channel_request denied to channel %d", channel);
 
     if (buffer_add_u8(msg->session->out_buffer, SSH2_MSG_CHANNEL_FAILURE) < 0) {
@@ -603,7 +715,7 @@ static int ssh_message_channel_request_reply_default(ssh_message msg) {
     return packet_send(msg->session);
   }
 
-  ssh_log(msg->session, SSH_LOG_PACKET,
+  SSH_LOG(msg->session, SSH_LOG_PACKET,
       "The client doesn't want to know the request failed!");
 
   return SSH_OK;
@@ -620,7 +732,7 @@ int ssh_message_service_reply_success(ssh_message msg) {
   if (msg == NULL) {
     return SSH_ERROR;
   }
-  ssh_log(session, SSH_LOG_PACKET,
+  SSH_LOG(session, SSH_LOG_PACKET,
       "Sending a SERVICE_ACCEPT for service %s", msg->service_request.service);
   if (buffer_add_u8(session->out_buffer, SSH2_MSG_SERVICE_ACCEPT) < 0) {
     return -1;
@@ -635,7 +747,7 @@ int ssh_message_service_reply_success(ssh_message msg) {
 }
 
 int ssh_message_global_request_reply_success(ssh_message msg, uint16_t bound_port) {
-    ssh_log(msg->session, SSH_LOG_FUNCTIONS, "Accepting a global request");
+    SSH_LOG(msg->session, SSH_LOG_FUNCTIONS, "Accepting a global request");
 
     if (msg->global_request.want_reply) {
         if (buffer_add_u8(msg->session->out_buffer
@@ -655,7 +767,7 @@ int ssh_message_global_request_reply_success(ssh_message msg, uint16_t bound_por
 
     if(msg->global_request.type == SSH_GLOBAL_REQUEST_TCPIP_FORWARD 
                                 && msg->global_request.bind_port == 0) {
-        ssh_log(msg->session, SSH_LOG_PACKET,
+        SSH_LOG(msg->session, SSH_LOG_PACKET,
                 "The client doesn't want to know the remote port!");
     }
 
@@ -665,7 +777,7 @@ error:
 }
 
 static int ssh_message_global_request_reply_default(ssh_message msg) {
-    ssh_log(msg->session, SSH_LOG_FUNCTIONS, "Refusing a global request");
+    SSH_LOG(msg->session, SSH_LOG_FUNCTIONS, "Refusing a global request");
 
     if (msg->global_request.want_reply) {
         if (buffer_add_u8(msg->session->out_buffer
@@ -674,7 +786,7 @@ static int ssh_message_global_request_reply_default(ssh_message msg) {
         }
         return packet_send(msg->session);
     }
-    ssh_log(msg->session, SSH_LOG_PACKET,
+    SSH_LOG(msg->session, SSH_LOG_PACKET,
             "The client doesn't want to know the request failed!");
 
     return SSH_OK;
@@ -682,6 +794,50 @@ error:
     return SSH_ERROR;
 }
 
+int ssh_message_set_policy(ssh_session session, int type, int subtype,
+    int policy) {
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  if (subtype < 0 || subtype >= SSH_MESSAGE_POLICY_SUBTYPES) {
+    ssh_set_error_invalid(session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  switch (policy) {
+    case SSH_MESSAGE_POLICY_CALLBACK:
+    case SSH_MESSAGE_POLICY_REJECT:
+      break;
+    case SSH_MESSAGE_POLICY_ACCEPT:
+      /* nobody would handle the channel, nor give the port */
+      if (type == SSH_REQUEST_CHANNEL_OPEN ||
+          (type == SSH_REQUEST_GLOBAL &&
+           subtype == SSH_GLOBAL_REQUEST_TCPIP_FORWARD)) {
+        ssh_set_error(session, SSH_REQUEST_DENIED,
+            "The request type %d can't be accepted by a policy", type);
+        return SSH_ERROR;
+      }
+      break;
+    default:
+      ssh_set_error_invalid(session, __FUNCTION__);
+      return SSH_ERROR;
+  }
+
+  switch (type) {
+    case SSH_REQUEST_CHANNEL_OPEN:
+    case SSH_REQUEST_CHANNEL:
+    case SSH_REQUEST_GLOBAL:
+      break;
+    default:
+      ssh_set_error(session, SSH_REQUEST_DENIED,
+          "The request type %d has no policy", type);
+      return SSH_ERROR;
+  }
+  session->message_policy[type][subtype] = policy;
+
+  return SSH_OK;
+}
+
 int ssh_message_reply_default(ssh_message msg) {
   if (msg == NULL) {
     return -1;
@@ -699,7 +855,7 @@ int ssh_message_reply_default(ssh_message msg) {
     case SSH_REQUEST_GLOBAL:
       return ssh_message_global_request_reply_default(msg);
     default:
-      ssh_log(msg->session, SSH_LOG_PACKET,
+      SSH_LOG(msg->session, SSH_LOG_PACKET,
           "Don't know what to default reply to %d type",
           msg->type);
       break;
@@ -827,7 +983,7 @@ int ssh_message_auth_interactive_request(ssh_message msg, const char *name,
 
   /* fill in the kbdint structure */
   if (msg->session->kbdint == NULL) {
-    ssh_log(msg->session, SSH_LOG_PROTOCOL, "Warning: Got a "
+    SSH_LOG(msg->session, SSH_LOG_PROTOCOL, "Warning: Got a "
                                         "keyboard-interactive response but it "
                                         "seems we didn't send the request.");
 
@@ -906,13 +1062,21 @@ int ssh_message_auth_reply_success(ssh_message msg, int partial) {
   }
 
   r = packet_send(msg->session);
-  if(msg->session->current_crypto && msg->session->current_crypto->delayed_compress_out){
-  	ssh_log(msg->session,SSH_LOG_PROTOCOL,"Enabling delayed compression OUT");
-  	msg->session->current_crypto->do_compress_out=1;
+  if (r == SSH_ERROR) {
+    return r;
+  }
+#if defined(HAVE_LIBZ) && defined(WITH_LIBZ)
+  /* the packets after the SSH_MSG_USERAUTH_SUCCESS are compressed */
+  if (compress_start_delayed(msg->session) < 0) {
+    return SSH_ERROR;
   }
-  if(msg->session->current_crypto && msg->session->current_crypto->delayed_compress_in){
-  	ssh_log(msg->session,SSH_LOG_PROTOCOL,"Enabling delayed compression IN");
-  	msg->session->current_crypto->do_compress_in=1;
+#endif
+  msg->session->session_state = SSH_SESSION_STATE_AUTHENTICATED;
+  ssh_admission_leave(&msg->session->admission);
+  if (ssh_callbacks_exists(msg->session->callbacks,
+        server_authenticated_function)) {
+    msg->session->callbacks->server_authenticated_function(msg->session,
+        msg->session->callbacks->userdata);
   }
   return r;
 }
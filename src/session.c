@@ -34,9 +34,15 @@
 #include "libssh/session.h"
 #include "libssh/misc.h"
 #include "libssh/buffer.h"
+#include "libssh/channels.h"
+#include "libssh/messages.h"
 #include "libssh/poll.h"
-
-#define FIRST_CHANNEL 42 // why not ? it helps to find bugs.
+#include "libssh/timer.h"
+#include "libssh/pipeline.h"
+#ifdef WITH_SERVER
+#include "libssh/admission.h"
+#endif
+#include "libssh/jump.h"
 
 /**
  * @defgroup libssh_session The SSH session functions.
@@ -73,15 +79,18 @@ ssh_session ssh_new(void) {
     goto err;
   }
 
+  /* the packets carry the authentication secrets in clear */
   session->out_buffer = ssh_buffer_new();
   if (session->out_buffer == NULL) {
     goto err;
   }
+  buffer_set_secure(session->out_buffer);
 
   session->in_buffer=ssh_buffer_new();
   if (session->in_buffer == NULL) {
     goto err;
   }
+  buffer_set_secure(session->in_buffer);
 
   session->alive = 0;
   session->auth_methods = 0;
@@ -95,6 +104,12 @@ ssh_session ssh_new(void) {
   session->fd = -1;
   session->ssh2 = 1;
   session->compressionlevel=7;
+  session->read_size_max = SSH_SOCKET_READ_MAX;
+  session->channel_window = SSH_CHANNEL_WINDOW_DEFAULT;
+  session->channel_maxpacket = SSH_CHANNEL_MAXPACKET_DEFAULT;
+  session->channel_window_threshold = SSH_CHANNEL_WINDOW_THRESHOLD_DEFAULT;
+  session->rekey_data = SSH_REKEY_DATA_DEFAULT;
+  session->keepalive_max = SSH_KEEPALIVE_MAX_DEFAULT;
 #ifdef WITH_SSH1
   session->ssh1 = 1;
 #else
@@ -122,6 +137,24 @@ ssh_session ssh_new(void) {
       goto err;
     }
 
+    id = strdup("%d/id_ecdsa");
+    if (id == NULL) {
+      goto err;
+    }
+    rc = ssh_list_append(session->identity, id);
+    if (rc == SSH_ERROR) {
+      goto err;
+    }
+
+    id = strdup("%d/id_ed25519");
+    if (id == NULL) {
+      goto err;
+    }
+    rc = ssh_list_append(session->identity, id);
+    if (rc == SSH_ERROR) {
+      goto err;
+    }
+
     id = strdup("%d/id_dsa");
     if (id == NULL) {
       goto err;
@@ -167,6 +200,8 @@ void ssh_free(ssh_session session) {
   SAFE_FREE(session->clientbanner);
   SAFE_FREE(session->bindaddr);
   SAFE_FREE(session->banner);
+  ssh_log_ring_free(session);
+  ssh_latency_free(session->latency, SSH_LATENCY_PHASES);
 #ifdef WITH_PCAP
   if(session->pcap_ctx){
   	ssh_pcap_context_free(session->pcap_ctx);
@@ -175,14 +210,36 @@ void ssh_free(ssh_session session) {
 #endif
   ssh_buffer_free(session->in_buffer);
   ssh_buffer_free(session->out_buffer);
+  if(session->compress_buffer != NULL)
+    ssh_buffer_free(session->compress_buffer);
   if(session->in_hashbuf != NULL)
     ssh_buffer_free(session->in_hashbuf);
   if(session->out_hashbuf != NULL)
     ssh_buffer_free(session->out_hashbuf);
+  if(session->rekey_held != NULL)
+    ssh_buffer_free(session->rekey_held);
+  pipeline_free(session);
+  ssh_auth_auto_free(session);
+#ifdef WITH_SERVER
+  ssh_admission_leave(&session->admission);
+#endif
   session->in_buffer=session->out_buffer=NULL;
+  session->compress_buffer=NULL;
   crypto_free(session->current_crypto);
   crypto_free(session->next_crypto);
+  /* with their channels and timers */
+  while (session->socks != NULL) {
+    ssh_socks_free(session->socks);
+  }
+  while (session->forwards != NULL) {
+    ssh_forward_remote_free(session->forwards);
+  }
+  /* the socket frees its own timers */
   ssh_socket_free(session->socket);
+  /* the channel on the bastion, if the socket didn't close it */
+  ssh_jump_free(session);
+  /* the channel timers too */
+  ssh_timers_free(&session->timers);
   if(session->default_poll_ctx){
   	ssh_poll_ctx_free(session->default_poll_ctx);
   }
@@ -190,6 +247,8 @@ void ssh_free(ssh_session session) {
   while (session->channels) {
     ssh_channel_free(session->channels);
   }
+  SAFE_FREE(session->channel_ids);
+  SAFE_FREE(session->channel_ids_free);
 #ifndef _WIN32
   agent_free(session->agent);
 #endif /* _WIN32 */
@@ -207,8 +266,12 @@ void ssh_free(ssh_session session) {
   SAFE_FREE(session->client_kex.methods);
   SAFE_FREE(session->server_kex.methods);
 
-  privatekey_free(session->dsa_key);
-  privatekey_free(session->rsa_key);
+#ifdef WITH_SERVER
+  for (i = 0; i < SSH_HOSTKEY_TYPES; i++) {
+    ssh_hostkey_free(session->host_keys[i]);
+  }
+  ssh_message_auth_pending_free(session);
+#endif
   if(session->ssh_message_list){
     ssh_message msg;
     while((msg=ssh_list_pop_head(ssh_message ,session->ssh_message_list))
@@ -220,6 +283,7 @@ void ssh_free(ssh_session session) {
 
   if (session->packet_callbacks)
     ssh_list_free(session->packet_callbacks);
+  SAFE_FREE(session->packet_dispatch);
 
   if (session->identity) {
     char *id;
@@ -238,6 +302,7 @@ void ssh_free(ssh_session session) {
   SAFE_FREE(session->sshdir);
   SAFE_FREE(session->knownhosts);
   SAFE_FREE(session->ProxyCommand);
+  SAFE_FREE(session->compression_skip);
 
   for (i = 0; i < 10; i++) {
     if (session->wanted_methods[i]) {
@@ -287,6 +352,75 @@ void ssh_set_blocking(ssh_session session, int blocking) {
   session->flags |= blocking ? SSH_SESSION_FLAG_BLOCKING : 0;
 }
 
+/**
+ * @brief Hold back the packets sent on the session.
+ *
+ * The packets are queued in the socket output buffer until
+ * ssh_session_uncork() is called, so a burst of small packets goes out with
+ * a single system call. Calls may be nested. Waiting for a packet from the
+ * server still sends what is queued.
+ *
+ * The packets sent by the callbacks while processing the data of one read are
+ * always coalesced this way.
+ *
+ * @param[in]  session  The ssh session to cork.
+ *
+ * @see ssh_session_uncork()
+ */
+void ssh_session_cork(ssh_session session) {
+  if (session == NULL || session->socket == NULL) {
+    return;
+  }
+  ssh_socket_cork(session->socket);
+}
+
+/**
+ * @brief Get the counters of a session.
+ *
+ * The counters start when the session is created and only grow, the
+ * application exports them or computes rates from two calls. The counters
+ * of each channel are given by ssh_channel_get_stats().
+ *
+ * @param[in]  session  The ssh session to use.
+ *
+ * @param[out] stats    The structure to fill.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_session_get_stats(ssh_session session,
+    struct ssh_session_stats_struct *stats) {
+  if (session == NULL || stats == NULL) {
+    return SSH_ERROR;
+  }
+
+  *stats = session->stats;
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Send the packets held back by ssh_session_cork().
+ *
+ * @param[in]  session  The ssh session to uncork.
+ *
+ * @return              SSH_OK if everything was written, SSH_AGAIN if some
+ *                      data is still pending, SSH_ERROR on error.
+ */
+int ssh_session_uncork(ssh_session session) {
+  int rc;
+
+  if (session == NULL || session->socket == NULL) {
+    return SSH_ERROR;
+  }
+  rc = ssh_socket_uncork(session->socket);
+  /* the channel queues go on in the room made */
+  if (rc == SSH_OK && ssh_channels_schedule(session) == SSH_ERROR) {
+    return SSH_ERROR;
+  }
+
+  return rc;
+}
+
 /**
  * @brief Return the blocking mode of libssh
  * @param[in] session The SSH session
@@ -370,6 +504,40 @@ void ssh_set_fd_except(ssh_session session) {
   ssh_socket_set_except(session->socket);
 }
 
+/**
+ * @internal
+ *
+ * @brief Get the poll context watching the socket of a session. A socket
+ * which isn't in any context yet is added to the default one of the session.
+ *
+ * @param[in] session   The session handle to use.
+ *
+ * @return              The poll context, NULL on error.
+ */
+ssh_poll_ctx ssh_session_get_poll_ctx(ssh_session session) {
+  ssh_poll_handle spoll_in, spoll_out;
+  ssh_poll_ctx ctx;
+
+  spoll_in = ssh_socket_get_poll_handle_in(session->socket);
+  spoll_out = ssh_socket_get_poll_handle_out(session->socket);
+  if (spoll_in == NULL || spoll_out == NULL) {
+    return NULL;
+  }
+  ctx = ssh_poll_get_ctx(spoll_in);
+  if (ctx == NULL) {
+    ctx = ssh_poll_get_default_ctx(session);
+    if (ctx == NULL) {
+      return NULL;
+    }
+    ssh_poll_ctx_add(ctx, spoll_in);
+    if (spoll_in != spoll_out) {
+      ssh_poll_ctx_add(ctx, spoll_out);
+    }
+  }
+
+  return ctx;
+}
+
 /**
  * @internal
  *
@@ -388,21 +556,26 @@ void ssh_set_fd_except(ssh_session session) {
  * @return              SSH_OK on success, SSH_ERROR otherwise.
  */
 int ssh_handle_packets(ssh_session session, int timeout) {
-	ssh_poll_handle spoll_in,spoll_out;
+	ssh_poll_handle spoll_in;
 	ssh_poll_ctx ctx;
   if(session==NULL || session->socket==NULL)
   	return SSH_ERROR;
   enter_function();
+  /* the peer may wait for a coalesced window adjust */
+  ssh_channels_flush_windows(session);
+  /* the expected packet may be an answer to a corked one */
+  if (ssh_socket_is_open(session->socket)) {
+    ssh_socket_nonblocking_flush(session->socket);
+  }
+  /* and the channel queues go on in the room made */
+  ssh_channels_schedule(session);
   spoll_in=ssh_socket_get_poll_handle_in(session->socket);
-  spoll_out=ssh_socket_get_poll_handle_out(session->socket);
   if(session->server)
     ssh_poll_add_events(spoll_in, POLLIN | POLLERR);
-  ctx=ssh_poll_get_ctx(spoll_in);
+  ctx=ssh_session_get_poll_ctx(session);
   if(ctx==NULL){
-  	ctx=ssh_poll_get_default_ctx(session);
-  	ssh_poll_ctx_add(ctx,spoll_in);
-  	if(spoll_in != spoll_out)
-  	  ssh_poll_ctx_add(ctx,spoll_out);
+    leave_function();
+    return SSH_ERROR;
   }
   ssh_poll_ctx_dopoll(ctx,timeout);
   leave_function();
@@ -481,6 +654,59 @@ int ssh_get_status(ssh_session session) {
   return r;
 }
 
+/**
+ * @brief Get the number of bytes buffered by a session.
+ *
+ * This is the received channel data the application didn't read yet, plus
+ * what waits in the input and output buffers of the connection.
+ *
+ * @param session       The ssh session to use.
+ *
+ * @returns The number of bytes.
+ *
+ * @see ssh_channel_get_buffered()
+ */
+uint32_t ssh_get_buffered(ssh_session session) {
+  uint32_t total;
+
+  if (session == NULL) {
+    return 0;
+  }
+
+  total = ssh_channels_get_buffered(session);
+  if (session->socket != NULL) {
+    total += ssh_socket_buffered(session->socket);
+  }
+
+  return total;
+}
+
+/**
+ * @brief Get the number of packets processed from a single read of the
+ * socket.
+ *
+ * A read holding many small packets processes them all at once, this tells
+ * how well the reads are batched.
+ *
+ * @param session       The ssh session to use.
+ *
+ * @param max           A pointer to store the largest number of packets
+ *                      processed from one read so far, or NULL.
+ *
+ * @returns The number of packets processed from the last read which
+ *          completed at least one.
+ */
+uint32_t ssh_get_packets_per_read(ssh_session session, uint32_t *max) {
+  if (session == NULL) {
+    return 0;
+  }
+  if (max != NULL) {
+    *max = session->in_packets_max;
+  }
+
+  return session->in_packets_last;
+}
+
 /**
  * @brief Get the disconnect message from the server.
  *
@@ -528,6 +754,44 @@ int ssh_get_version(ssh_session session) {
   return session->version;
 }
 
+/**
+ * @brief Renew the keys of the session.
+ *
+ * This starts a key re-exchange, which goes on while the session is
+ * polled: the function doesn't wait for it. The channels keep running
+ * meanwhile, the data written on them is sent with the new keys. The keys
+ * are also renewed after the limits of SSH_OPTIONS_REKEY_DATA and
+ * SSH_OPTIONS_REKEY_TIME, and when the peer asks for it.
+ *
+ * @param session       The ssh session, after the key exchange.
+ *
+ * @return SSH_OK if the key exchange started or is already running,
+ *         SSH_ERROR on error.
+ */
+int ssh_rekey(ssh_session session) {
+  if (session == NULL) {
+    return SSH_ERROR;
+  }
+  if (session->version != 2 ||
+      (session->session_state != SSH_SESSION_STATE_AUTHENTICATING &&
+       session->session_state != SSH_SESSION_STATE_AUTHENTICATED)) {
+    ssh_set_error(session, SSH_REQUEST_DENIED,
+        "The keys can only be renewed after the key exchange");
+    return SSH_ERROR;
+  }
+  if (session->rekey_state != SSH_REKEY_STATE_NONE) {
+    return SSH_OK;
+  }
+
+  session->rekey_state = SSH_REKEY_STATE_INIT;
+  session->ssh_connection_callback(session);
+  if (session->session_state == SSH_SESSION_STATE_ERROR) {
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
 /**
  * @internal
  *
@@ -545,7 +809,7 @@ SSH_PACKET_CALLBACK(ssh_packet_disconnect_callback){
     error = ssh_string_to_char(error_s);
     ssh_string_free(error_s);
   }
-  ssh_log(session, SSH_LOG_PACKET, "Received SSH_MSG_DISCONNECT %d:%s",code,
+  SSH_LOG(session, SSH_LOG_PACKET, "Received SSH_MSG_DISCONNECT %d:%s",code,
       error != NULL ? error : "no error");
   ssh_set_error(session, SSH_FATAL,
       "Received SSH_MSG_DISCONNECT: %d:%s",code,
@@ -567,7 +831,7 @@ SSH_PACKET_CALLBACK(ssh_packet_ignore_callback){
 	(void)user;
 	(void)type;
 	(void)packet;
-	ssh_log(session,SSH_LOG_PROTOCOL,"Received %s packet",type==SSH2_MSG_IGNORE ? "SSH_MSG_IGNORE" : "SSH_MSG_DEBUG");
+	SSH_LOG(session,SSH_LOG_PROTOCOL,"Received %s packet",type==SSH2_MSG_IGNORE ? "SSH_MSG_IGNORE" : "SSH_MSG_DEBUG");
 	/* TODO: handle a graceful disconnect */
 	return SSH_PACKET_USED;
 }
@@ -580,13 +844,145 @@ SSH_PACKET_CALLBACK(ssh_packet_ignore_callback){
 void ssh_socket_exception_callback(int code, int errno_code, void *user){
     ssh_session session=(ssh_session)user;
     enter_function();
-    ssh_log(session,SSH_LOG_RARE,"Socket exception callback: %d (%d)",code, errno_code);
+    SSH_LOG(session,SSH_LOG_RARE,"Socket exception callback: %d (%d)",code, errno_code);
     session->session_state=SSH_SESSION_STATE_ERROR;
     ssh_set_error(session,SSH_FATAL,"Socket error: %s",strerror(errno_code));
     session->ssh_connection_callback(session);
     leave_function();
 }
 
+/*
+ * The peer answered none of the keepalives: the socket is closed at once,
+ * what was waiting to be sent is freed and the channels are closed.
+ */
+static void ssh_keepalive_dead(ssh_session session) {
+  ssh_set_error(session, SSH_FATAL, "The peer didn't answer %u keepalives",
+      session->keepalive_missed);
+  SSH_LOG(session, SSH_LOG_RARE, "%s", ssh_get_error(session));
+
+  ssh_socket_close(session->socket);
+  ssh_socket_reset(session->socket);
+  session->alive = 0;
+  session->session_state = SSH_SESSION_STATE_ERROR;
+  buffer_reinit(session->in_buffer);
+  buffer_reinit(session->out_buffer);
+  if (session->rekey_held != NULL) {
+    buffer_reinit(session->rekey_held);
+  }
+  session->keepalive_pending = 0;
+  if (session->global_req_state == SSH_CHANNEL_REQ_STATE_PENDING) {
+    session->global_req_state = SSH_CHANNEL_REQ_STATE_ERROR;
+  }
+  ssh_channels_dead(session);
+  if (session->ssh_connection_callback != NULL) {
+    session->ssh_connection_callback(session);
+  }
+}
+
+static int ssh_keepalive_send(ssh_session session) {
+  ssh_string request;
+
+  request = ssh_string_from_char("keepalive@openssh.com");
+  if (request == NULL) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  if (buffer_add_u8(session->out_buffer, SSH2_MSG_GLOBAL_REQUEST) < 0 ||
+      buffer_add_ssh_string(session->out_buffer, request) < 0 ||
+      buffer_add_u8(session->out_buffer, 1) < 0) {
+    ssh_string_free(request);
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+  ssh_string_free(request);
+
+  return packet_send(session);
+}
+
+/* a tick of SSH_OPTIONS_KEEPALIVE_INTERVAL */
+static void ssh_keepalive_timer(ssh_timer timer, void *userdata) {
+  ssh_session session = (ssh_session) userdata;
+
+  if (session->session_state == SSH_SESSION_STATE_ERROR ||
+      !ssh_socket_is_open(session->socket)) {
+    return;
+  }
+
+  if (session->keepalive_received) {
+    session->keepalive_received = 0;
+    session->keepalive_missed = 0;
+  } else if (session->keepalive_missed >= session->keepalive_max) {
+    ssh_keepalive_dead(session);
+    return;
+  } else {
+    session->keepalive_missed++;
+    /* a global request waiting for its answer probes the peer already */
+    if (session->global_req_state != SSH_CHANNEL_REQ_STATE_PENDING) {
+      SSH_LOG(session, SSH_LOG_PROTOCOL, "Sending keepalive %u/%u",
+          session->keepalive_missed, session->keepalive_max);
+      if (ssh_keepalive_send(session) == SSH_OK) {
+        session->keepalive_pending++;
+      }
+    }
+  }
+
+  ssh_timer_reset(timer, session->keepalive_interval * 1000);
+}
+
+/**
+ * @internal
+ *
+ * @brief Start probing the peer every SSH_OPTIONS_KEEPALIVE_INTERVAL, or stop
+ * if it is 0.
+ *
+ * @param[in]  session  The session, with its keys.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_keepalive_start(ssh_session session) {
+  if (session->keepalive_interval == 0) {
+    if (session->keepalive_timer != NULL) {
+      ssh_timer_cancel(session->keepalive_timer);
+    }
+    return SSH_OK;
+  }
+
+  session->keepalive_received = 0;
+  session->keepalive_missed = 0;
+  if (session->keepalive_timer == NULL) {
+    session->keepalive_timer = ssh_session_add_timer(session,
+        session->keepalive_interval * 1000, ssh_keepalive_timer, session);
+    if (session->keepalive_timer == NULL) {
+      return SSH_ERROR;
+    }
+  } else if (ssh_timer_reset(session->keepalive_timer,
+        session->keepalive_interval * 1000) < 0) {
+    ssh_set_error_oom(session);
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
+/**
+ * @internal
+ *
+ * @brief Take the answer of a global request if it is the one of a
+ * keepalive. They come in the order of the requests, and no keepalive is
+ * sent while a global request of the application waits for its answer.
+ *
+ * @return              1 if the answer was for a keepalive, 0 if not.
+ */
+int ssh_keepalive_reply(ssh_session session) {
+  if (session->keepalive_pending == 0) {
+    return 0;
+  }
+  session->keepalive_pending--;
+  SSH_LOG(session, SSH_LOG_PACKET, "Received the answer of a keepalive");
+
+  return 1;
+}
+
 /** @} */
 
 /* vim: set ts=4 sw=4 et cindent: */
@@ -24,6 +24,8 @@
 
 /* This file contains code written by Nick Zitzmann */
 
+#include "config.h"
+
 #include <errno.h>
 #include <ctype.h>
 #include <fcntl.h>
@@ -35,8 +37,13 @@
 #include <sys/stat.h>
 
 #ifndef _WIN32
+#include <unistd.h>
 #include <arpa/inet.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #else
+#include <io.h>
 #define S_IFSOCK 0140000
 #define S_IFLNK  0120000
 
@@ -53,23 +60,61 @@
 #include "libssh/channels.h"
 #include "libssh/session.h"
 #include "libssh/misc.h"
+#include "libssh/hashtable.h"
+#include "libssh/wrapper.h"
+#include "libssh/probes.h"
+#include "libssh/histogram.h"
 
 #ifdef WITH_SFTP
 
 #define sftp_enter_function() _enter_function(sftp->channel->session)
 #define sftp_leave_function() _leave_function(sftp->channel->session)
 
+/* initial number of buckets of the reply queue, a power of two */
+#define SFTP_QUEUE_SIZE 16
+/* freed messages kept for the next replies */
+#define SFTP_FREE_MESSAGES 64
+/* requests timed at once, a power of two */
+#define SFTP_LATENCY_SENT 256
+
+/* the steps of sftp_init_nonblocking() */
+#define SFTP_INIT_OPEN 0
+#define SFTP_INIT_SUBSYSTEM 1
+#define SFTP_INIT_SEND 2
+#define SFTP_INIT_VERSION 3
+#define SFTP_INIT_DONE 4
+
 struct sftp_ext_struct {
   unsigned int count;
   char **name;
   char **data;
 };
 
+/*
+ * The requests in flight are timed in a table hashed by id. The ids are
+ * consecutive, so the table only loses a request when more than its size
+ * are in flight.
+ */
+struct sftp_latency_struct {
+  struct ssh_histogram_struct *histograms[SSH_LATENCY_SFTP_TYPES];
+  struct {
+    uint64_t ts; /* 0 if the slot is free */
+    uint32_t id;
+    uint8_t type;
+  } sent[SFTP_LATENCY_SENT];
+};
+
 /* functions */
 static int sftp_enqueue(sftp_session session, sftp_message msg);
 static void sftp_message_free(sftp_message msg);
 static void sftp_set_error(sftp_session sftp, int errnum);
 static void status_msg_free(sftp_status_message status);
+static uint32_t sftp_limit_chunk(sftp_session sftp, uint32_t len,
+    int writing);
+static void sftp_read_ahead_drop(sftp_file file);
+static int sftp_read_ahead_start(sftp_file file);
+static int sftp_write_behind_send(sftp_file file);
+static int sftp_write_behind_end(sftp_file file);
 
 static sftp_ext sftp_ext_new(void) {
   sftp_ext ext;
@@ -102,6 +147,293 @@ static void sftp_ext_free(sftp_ext ext) {
   SAFE_FREE(ext);
 }
 
+/*
+ * The stat cache keeps the attributes of paths for a TTL, from the stat
+ * replies and from the directory entries, which are those of lstat. The
+ * paths are compared as given. The requests of the session changing a path
+ * forget it, with its parent directory whose times change.
+ */
+#define SFTP_STAT_CACHE_MAX 8192
+
+/* the requests an entry answers */
+#define SFTP_STAT_CACHE_STAT 1
+#define SFTP_STAT_CACHE_LSTAT 2
+
+/* what sftp_stat_cache_forget() forgets with a path */
+#define SFTP_STAT_CACHE_PARENT 1 /* the directory of the path */
+#define SFTP_STAT_CACHE_CHILDREN 2 /* the paths under it */
+
+struct sftp_stat_cache_entry {
+  uint64_t key;
+  uint64_t expires;
+  int kinds;
+  size_t len; /* of the attributes, followed by the path */
+  size_t path_len;
+  unsigned char data[1];
+};
+
+struct sftp_stat_cache_struct {
+  struct ssh_hashtable *paths; /* entries by hash of their path */
+  unsigned int ttl; /* in milliseconds */
+};
+
+/* FNV-1a */
+static uint64_t sftp_stat_cache_hash(const char *path, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) path[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+static struct sftp_stat_cache_entry *sftp_stat_cache_find(
+    struct sftp_stat_cache_struct *cache, const char *path, size_t len) {
+  struct ssh_hashtable_entry *it;
+  struct sftp_stat_cache_entry *e;
+
+  for (it = ssh_hashtable_find(cache->paths, sftp_stat_cache_hash(path, len));
+      it != NULL; it = ssh_hashtable_find_next(it)) {
+    e = it->data;
+    if (e->path_len == len && memcmp(e->data + e->len, path, len) == 0) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+static void sftp_stat_cache_remove(struct sftp_stat_cache_struct *cache,
+    struct sftp_stat_cache_entry *e) {
+  ssh_hashtable_remove(cache->paths, e->key, e);
+  SAFE_FREE(e);
+}
+
+/* Removes the entries, all of them or the expired ones. */
+static void sftp_stat_cache_purge(struct sftp_stat_cache_struct *cache,
+    int all) {
+  struct ssh_hashtable_entry *it;
+  struct sftp_stat_cache_entry *e;
+  uint64_t now = ssh_timestamp_ms();
+
+  it = ssh_hashtable_first(cache->paths);
+  while (it != NULL) {
+    e = it->data;
+    it = ssh_hashtable_next(cache->paths, it);
+    if (all || now >= e->expires) {
+      sftp_stat_cache_remove(cache, e);
+    }
+  }
+}
+
+static void sftp_stat_cache_free(sftp_session sftp) {
+  if (sftp->stat_cache == NULL) {
+    return;
+  }
+  sftp_stat_cache_purge(sftp->stat_cache, 1);
+  ssh_hashtable_free(sftp->stat_cache->paths);
+  SAFE_FREE(sftp->stat_cache);
+}
+
+/* Keeps the attributes of a path, in the format of an ATTRS reply. */
+static void sftp_stat_cache_put(sftp_session sftp, const char *path,
+    size_t path_len, int kinds, const void *attr, size_t len) {
+  struct sftp_stat_cache_struct *cache = sftp->stat_cache;
+  struct sftp_stat_cache_entry *e;
+
+  if (cache == NULL) {
+    return;
+  }
+
+  e = sftp_stat_cache_find(cache, path, path_len);
+  if (e != NULL) {
+    sftp_stat_cache_remove(cache, e);
+  }
+  if (cache->paths->count >= SFTP_STAT_CACHE_MAX) {
+    sftp_stat_cache_purge(cache, 0);
+    if (cache->paths->count >= SFTP_STAT_CACHE_MAX) {
+      sftp_stat_cache_purge(cache, 1);
+    }
+  }
+
+  e = malloc(sizeof(struct sftp_stat_cache_entry) + len + path_len);
+  if (e == NULL) {
+    return;
+  }
+  e->key = sftp_stat_cache_hash(path, path_len);
+  e->expires = ssh_timestamp_ms() + cache->ttl;
+  e->kinds = kinds;
+  e->len = len;
+  e->path_len = path_len;
+  memcpy(e->data, attr, len);
+  memcpy(e->data + len, path, path_len);
+  if (ssh_hashtable_insert(cache->paths, e->key, e) < 0) {
+    SAFE_FREE(e);
+  }
+}
+
+/* Keeps the attributes of a directory entry, at the path of the entry. */
+static void sftp_stat_cache_put_entry(sftp_dir dir, const char *name,
+    const void *attr, size_t len) {
+  size_t dir_len;
+  size_t name_len;
+  char *path;
+
+  if (dir->sftp->stat_cache == NULL ||
+      strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return;
+  }
+
+  dir_len = strlen(dir->name);
+  name_len = strlen(name);
+  path = malloc(dir_len + name_len + 2);
+  if (path == NULL) {
+    return;
+  }
+  memcpy(path, dir->name, dir_len);
+  if (dir_len == 0 || path[dir_len - 1] != '/') {
+    path[dir_len++] = '/';
+  }
+  memcpy(path + dir_len, name, name_len);
+  sftp_stat_cache_put(dir->sftp, path, dir_len + name_len,
+      SFTP_STAT_CACHE_LSTAT, attr, len);
+  SAFE_FREE(path);
+}
+
+/* Gives the attributes kept for a stat or lstat of a path, NULL if none. */
+static sftp_attributes sftp_stat_cache_get(sftp_session sftp,
+    const char *path, int kind) {
+  struct sftp_stat_cache_struct *cache = sftp->stat_cache;
+  struct sftp_stat_cache_entry *e;
+  sftp_attributes attr = NULL;
+  ssh_buffer buffer;
+
+  if (cache == NULL) {
+    return NULL;
+  }
+  e = sftp_stat_cache_find(cache, path, strlen(path));
+  if (e == NULL) {
+    return NULL;
+  }
+  if (ssh_timestamp_ms() >= e->expires) {
+    sftp_stat_cache_remove(cache, e);
+    return NULL;
+  }
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    return NULL;
+  }
+  if (buffer_add_data(buffer, e->data, e->len) == 0) {
+    attr = sftp_parse_attr(sftp, buffer, 0);
+  }
+  ssh_buffer_free(buffer);
+  if (attr == NULL) {
+    sftp_stat_cache_remove(cache, e);
+    return NULL;
+  }
+
+  /* the lstat of what isn't a link is its stat as well */
+  if (!(e->kinds & kind)) {
+    if (kind != SFTP_STAT_CACHE_STAT ||
+        attr->type == SSH_FILEXFER_TYPE_SYMLINK) {
+      sftp_attributes_free(attr);
+      return NULL;
+    }
+    e->kinds |= kind;
+  }
+
+  return attr;
+}
+
+/* Forgets a path changed by a request. */
+static void sftp_stat_cache_forget(sftp_session sftp, const char *path,
+    int flags) {
+  struct sftp_stat_cache_struct *cache = sftp->stat_cache;
+  struct sftp_stat_cache_entry *e;
+  struct ssh_hashtable_entry *it;
+  const char *slash;
+  size_t len;
+
+  if (cache == NULL || path == NULL) {
+    return;
+  }
+
+  len = strlen(path);
+  e = sftp_stat_cache_find(cache, path, len);
+  if (e != NULL) {
+    sftp_stat_cache_remove(cache, e);
+  }
+
+  if (flags & SFTP_STAT_CACHE_CHILDREN) {
+    it = ssh_hashtable_first(cache->paths);
+    while (it != NULL) {
+      e = it->data;
+      it = ssh_hashtable_next(cache->paths, it);
+      if (e->path_len > len && e->data[e->len + len] == '/' &&
+          memcmp(e->data + e->len, path, len) == 0) {
+        sftp_stat_cache_remove(cache, e);
+      }
+    }
+  }
+
+  if (flags & SFTP_STAT_CACHE_PARENT) {
+    slash = strrchr(path, '/');
+    if (slash != NULL) {
+      e = sftp_stat_cache_find(cache, path,
+          slash == path ? 1 : (size_t) (slash - path));
+      if (e != NULL) {
+        sftp_stat_cache_remove(cache, e);
+      }
+    }
+  }
+}
+
+int sftp_set_stat_cache(sftp_session sftp, unsigned int ttl) {
+  struct sftp_stat_cache_struct *cache;
+
+  if (sftp == NULL) {
+    return SSH_ERROR;
+  }
+  if (ttl == 0) {
+    sftp_stat_cache_free(sftp);
+    return SSH_OK;
+  }
+
+  if (sftp->stat_cache == NULL) {
+    cache = malloc(sizeof(struct sftp_stat_cache_struct));
+    if (cache == NULL) {
+      ssh_set_error_oom(sftp->session);
+      return SSH_ERROR;
+    }
+    cache->paths = ssh_hashtable_new();
+    if (cache->paths == NULL) {
+      ssh_set_error_oom(sftp->session);
+      SAFE_FREE(cache);
+      return SSH_ERROR;
+    }
+    sftp->stat_cache = cache;
+  }
+  sftp->stat_cache->ttl = ttl;
+
+  return SSH_OK;
+}
+
+void sftp_stat_cache_invalidate(sftp_session sftp, const char *path) {
+  if (sftp == NULL || sftp->stat_cache == NULL) {
+    return;
+  }
+
+  if (path == NULL) {
+    sftp_stat_cache_purge(sftp->stat_cache, 1);
+  } else {
+    sftp_stat_cache_forget(sftp, path, SFTP_STAT_CACHE_CHILDREN);
+  }
+}
+
 sftp_session sftp_new(ssh_session session){
   sftp_session sftp;
 
@@ -110,10 +442,39 @@ sftp_session sftp_new(ssh_session session){
   }
   enter_function();
 
+  sftp = sftp_new_nonblocking(session);
+  if (sftp == NULL) {
+    leave_function();
+    return NULL;
+  }
+
+  if (ssh_channel_open_session(sftp->channel)) {
+    sftp_free(sftp);
+    leave_function();
+    return NULL;
+  }
+
+  if (ssh_channel_request_sftp(sftp->channel)) {
+    sftp_free(sftp);
+    leave_function();
+    return NULL;
+  }
+  sftp->init_state = SFTP_INIT_SEND;
+
+  leave_function();
+  return sftp;
+}
+
+sftp_session sftp_new_nonblocking(ssh_session session) {
+  sftp_session sftp;
+
+  if (session == NULL) {
+    return NULL;
+  }
+
   sftp = malloc(sizeof(struct sftp_session_struct));
   if (sftp == NULL) {
     ssh_set_error_oom(session);
-    leave_function();
     return NULL;
   }
   ZERO_STRUCTP(sftp);
@@ -122,32 +483,18 @@ sftp_session sftp_new(ssh_session session){
   if (sftp->ext == NULL) {
     ssh_set_error_oom(session);
     SAFE_FREE(sftp);
-    leave_function();
     return NULL;
   }
 
   sftp->session = session;
   sftp->channel = ssh_channel_new(session);
   if (sftp->channel == NULL) {
+    sftp_ext_free(sftp->ext);
     SAFE_FREE(sftp);
-    leave_function();
-    return NULL;
-  }
-
-  if (ssh_channel_open_session(sftp->channel)) {
-    ssh_channel_free(sftp->channel);
-    SAFE_FREE(sftp);
-    leave_function();
-    return NULL;
-  }
-
-  if (ssh_channel_request_sftp(sftp->channel)) {
-    sftp_free(sftp);
-    leave_function();
     return NULL;
   }
+  sftp->init_state = SFTP_INIT_OPEN;
 
-  leave_function();
   return sftp;
 }
 
@@ -169,10 +516,8 @@ sftp_session sftp_server_new(ssh_session session, ssh_channel chan){
 }
 
 int sftp_server_init(sftp_session sftp){
-  ssh_session session = sftp->session;
   sftp_packet packet = NULL;
-  ssh_buffer reply = NULL;
-  uint32_t version;
+  int rc;
 
   sftp_enter_function();
 
@@ -182,47 +527,52 @@ int sftp_server_init(sftp_session sftp){
     return -1;
   }
 
+  rc = sftp_server_reply_init(sftp, packet);
+  sftp_packet_free(packet);
+
+  sftp_leave_function();
+  return rc;
+}
+
+/* Answer the SSH_FXP_INIT packet of the client with our version. */
+int sftp_server_reply_init(sftp_session sftp, sftp_packet packet) {
+  ssh_session session = sftp->session;
+  ssh_buffer reply = NULL;
+  uint32_t version;
+
   if (packet->type != SSH_FXP_INIT) {
     ssh_set_error(session, SSH_FATAL,
         "Packet read of type %d instead of SSH_FXP_INIT",
         packet->type);
-
-    sftp_packet_free(packet);
-    sftp_leave_function();
     return -1;
   }
 
-  ssh_log(session, SSH_LOG_PACKET, "Received SSH_FXP_INIT");
+  SSH_LOG(session, SSH_LOG_PACKET, "Received SSH_FXP_INIT");
 
   buffer_get_u32(packet->payload, &version);
   version = ntohl(version);
-  ssh_log(session, SSH_LOG_PACKET, "Client version: %d", version);
+  SSH_LOG(session, SSH_LOG_PACKET, "Client version: %d", version);
   sftp->client_version = version;
 
-  sftp_packet_free(packet);
-
   reply = ssh_buffer_new();
   if (reply == NULL) {
     ssh_set_error_oom(session);
-    sftp_leave_function();
     return -1;
   }
 
   if (buffer_add_u32(reply, ntohl(LIBSFTP_VERSION)) < 0) {
     ssh_set_error_oom(session);
     ssh_buffer_free(reply);
-    sftp_leave_function();
     return -1;
   }
 
   if (sftp_packet_write(sftp, SSH_FXP_VERSION, reply) < 0) {
     ssh_buffer_free(reply);
-    sftp_leave_function();
     return -1;
   }
   ssh_buffer_free(reply);
 
-  ssh_log(session, SSH_LOG_RARE, "Server version sent");
+  SSH_LOG(session, SSH_LOG_RARE, "Server version sent");
 
   if (version > LIBSFTP_VERSION) {
     sftp->version = LIBSFTP_VERSION;
@@ -230,38 +580,122 @@ int sftp_server_init(sftp_session sftp){
     sftp->version=version;
   }
 
-  sftp_leave_function();
   return 0;
 }
 #endif /* WITH_SERVER */
 
 void sftp_free(sftp_session sftp){
-  sftp_request_queue ptr;
+  sftp_message msg;
+  uint32_t i;
 
   if (sftp == NULL) {
     return;
   }
 
-  ssh_channel_send_eof(sftp->channel);
-  ptr = sftp->queue;
-  while(ptr) {
-    sftp_request_queue old;
-    sftp_message_free(ptr->message);
-    old = ptr->next;
-    SAFE_FREE(ptr);
-    ptr = old;
+  /* a session from sftp_new_nonblocking() may not have opened it */
+  if (ssh_channel_is_open(sftp->channel)) {
+    ssh_channel_send_eof(sftp->channel);
+  }
+  for (i = 0; i < sftp->queue_size; i++) {
+    while (sftp->queue[i] != NULL) {
+      msg = sftp->queue[i];
+      sftp->queue[i] = msg->next;
+      sftp_message_free(msg);
+    }
+  }
+  SAFE_FREE(sftp->queue);
+  if (sftp->free_packet != NULL) {
+    ssh_buffer_free(sftp->free_packet->payload);
+    SAFE_FREE(sftp->free_packet);
+  }
+  while (sftp->free_messages != NULL) {
+    msg = sftp->free_messages;
+    sftp->free_messages = msg->next;
+    ssh_buffer_free(msg->payload);
+    SAFE_FREE(msg);
   }
 
   ssh_channel_free(sftp->channel);
+#ifdef WITH_SERVER
+  /* after the channel, which has its callbacks */
+  sftp_server_dispatch_free(sftp->dispatch);
+  sftp_client_messages_free(sftp);
+#endif
   sftp_ext_free(sftp->ext);
+  sftp_stat_cache_free(sftp);
+  SAFE_FREE(sftp->limits);
+  SAFE_FREE(sftp->handles);
+  if (sftp->latency != NULL) {
+    ssh_latency_free(sftp->latency->histograms, SSH_LATENCY_SFTP_TYPES);
+    SAFE_FREE(sftp->latency);
+  }
   ZERO_STRUCTP(sftp);
 
   SAFE_FREE(sftp);
 }
 
+/* times a request, its payload starts with its id */
+static void sftp_latency_sent(sftp_session sftp, uint8_t type,
+    ssh_buffer payload) {
+  uint32_t id;
+  uint32_t slot;
+
+  if (!((type >= SSH_FXP_OPEN && type <= SSH_FXP_SYMLINK) ||
+        type == SSH_FXP_EXTENDED) ||
+      buffer_get_rest_len(payload) < sizeof(uint32_t)) {
+    return;
+  }
+  if (sftp->latency == NULL) {
+    sftp->latency = malloc(sizeof(struct sftp_latency_struct));
+    if (sftp->latency == NULL) {
+      return;
+    }
+    ZERO_STRUCTP(sftp->latency);
+  }
+
+  memcpy(&id, buffer_get_rest(payload), sizeof(uint32_t));
+  id = ntohl(id);
+  slot = id & (SFTP_LATENCY_SENT - 1);
+  sftp->latency->sent[slot].ts = ssh_timestamp_us();
+  sftp->latency->sent[slot].id = id;
+  sftp->latency->sent[slot].type = type;
+}
+
+/* records the latency of the request of a reply */
+static void sftp_latency_reply(sftp_session sftp, uint32_t id) {
+  uint32_t slot = id & (SFTP_LATENCY_SENT - 1);
+
+  if (sftp->latency == NULL || sftp->latency->sent[slot].ts == 0 ||
+      sftp->latency->sent[slot].id != id) {
+    return;
+  }
+  ssh_latency_sftp_record(sftp->latency->histograms,
+      sftp->latency->sent[slot].type,
+      ssh_timestamp_us() - sftp->latency->sent[slot].ts);
+  sftp->latency->sent[slot].ts = 0;
+}
+
+int sftp_get_latency(sftp_session sftp, uint8_t type,
+    struct ssh_latency_struct *latency) {
+  struct ssh_histogram_struct *none[SSH_LATENCY_SFTP_TYPES];
+
+  if (sftp == NULL) {
+    return ssh_latency_sftp_get(NULL, type, latency);
+  }
+  if (sftp->latency == NULL) {
+    memset(none, 0, sizeof(none));
+    return ssh_latency_sftp_get(none, type, latency);
+  }
+
+  return ssh_latency_sftp_get(sftp->latency->histograms, type, latency);
+}
+
 int sftp_packet_write(sftp_session sftp, uint8_t type, ssh_buffer payload){
   int size;
 
+  SSH_PROBE3(sftp_send, sftp, type, buffer_get_rest_len(payload));
+  sftp_latency_sent(sftp, type, payload);
+
   if (buffer_prepend_data(payload, &type, sizeof(uint8_t)) < 0) {
     ssh_set_error_oom(sftp->session);
     return -1;
@@ -278,7 +712,7 @@ int sftp_packet_write(sftp_session sftp, uint8_t type, ssh_buffer payload){
   if (size < 0) {
     return -1;
   } else if((uint32_t) size != buffer_get_rest_len(payload)) {
-    ssh_log(sftp->session, SSH_LOG_PACKET,
+    SSH_LOG(sftp->session, SSH_LOG_PACKET,
         "Had to write %d bytes, wrote only %d",
         buffer_get_rest_len(payload),
         size);
@@ -287,13 +721,42 @@ int sftp_packet_write(sftp_session sftp, uint8_t type, ssh_buffer payload){
   return size;
 }
 
-sftp_packet sftp_packet_read(sftp_session sftp) {
-  unsigned char buffer[4096];
-  sftp_packet packet = NULL;
-  uint32_t size;
-  int r;
+/* the length and type of a packet, taken in pieces if they came so */
+struct sftp_packet_header {
+  unsigned char data[sizeof(uint32_t) + 1];
+  uint32_t len;
+};
 
-  sftp_enter_function();
+static int sftp_packet_take_header(const void *data, uint32_t len,
+    void *userdata) {
+  struct sftp_packet_header *header = userdata;
+
+  memcpy(header->data + header->len, data, len);
+  header->len += len;
+
+  return len;
+}
+
+/* copies the body from the buffer of the channel to the payload */
+static int sftp_packet_take(const void *data, uint32_t len, void *userdata) {
+  sftp_packet packet = userdata;
+
+  if (buffer_add_data(packet->payload, data, len) < 0) {
+    ssh_set_error_oom(packet->sftp->session);
+    return -1;
+  }
+
+  return len;
+}
+
+/* the packet kept by sftp_packet_free(), or a new one */
+static sftp_packet sftp_packet_new(sftp_session sftp) {
+  sftp_packet packet = sftp->free_packet;
+
+  if (packet != NULL) {
+    sftp->free_packet = NULL;
+    return packet;
+  }
 
   packet = malloc(sizeof(struct sftp_packet_struct));
   if (packet == NULL) {
@@ -308,50 +771,65 @@ sftp_packet sftp_packet_read(sftp_session sftp) {
     return NULL;
   }
 
-  r=ssh_channel_read(sftp->channel, buffer, 4, 0);
-  if (r < 0) {
-    ssh_buffer_free(packet->payload);
-    SAFE_FREE(packet);
-    sftp_leave_function();
-    return NULL;
-  }
-  buffer_add_data(packet->payload,buffer, r);
-  if (buffer_get_u32(packet->payload, &size) != sizeof(uint32_t)) {
-    ssh_set_error(sftp->session, SSH_FATAL, "Short sftp packet!");
-    ssh_buffer_free(packet->payload);
-    SAFE_FREE(packet);
-    sftp_leave_function();
-    return NULL;
-  }
-
-  size = ntohl(size);
-  r=ssh_channel_read(sftp->channel, buffer, 1, 0);
-  if (r <= 0) {
-    /* TODO: check if there are cases where an error needs to be set here */
-    ssh_buffer_free(packet->payload);
-    SAFE_FREE(packet);
-    sftp_leave_function();
-    return NULL;
-  }
-  buffer_add_data(packet->payload, buffer, r);
-  buffer_get_u8(packet->payload, &packet->type);
-  size=size-1;
-  while (size>0){
-    r=ssh_channel_read(sftp->channel,buffer,
-        sizeof(buffer)>size ? size:sizeof(buffer),0);
+  return packet;
+}
 
-    if(r <= 0) {
-      /* TODO: check if there are cases where an error needs to be set here */
-      ssh_buffer_free(packet->payload);
-      SAFE_FREE(packet);
+/*
+ * The length and the type are parsed where the channel received them, and
+ * the body is copied once, from the buffer of the channel to the payload,
+ * which the parsers then read in place.
+ */
+sftp_packet sftp_packet_read(sftp_session sftp) {
+  struct sftp_packet_header header;
+  sftp_packet packet = NULL;
+  uint32_t size;
+  int r;
+
+  sftp_enter_function();
+
+  header.len = 0;
+  while (header.len < sizeof(header.data)) {
+    r = channel_read_in_place(sftp->channel, sizeof(header.data) - header.len,
+        0, -1, sftp_packet_take_header, &header);
+    if (r <= 0) {
+      if (r == 0) {
+        ssh_set_error(sftp->session, SSH_FATAL, "Short sftp packet!");
+      }
       sftp_leave_function();
       return NULL;
     }
-    if(buffer_add_data(packet->payload,buffer,r)==SSH_ERROR){
-      ssh_buffer_free(packet->payload);
-      SAFE_FREE(packet);
+  }
+  memcpy(&size, header.data, sizeof(uint32_t));
+  size = ntohl(size);
+  if (size == 0) {
+    ssh_set_error(sftp->session, SSH_FATAL, "Short sftp packet!");
+    sftp_leave_function();
+    return NULL;
+  }
+
+  packet = sftp_packet_new(sftp);
+  if (packet == NULL) {
+    sftp_leave_function();
+    return NULL;
+  }
+  packet->type = header.data[sizeof(uint32_t)];
+  size--;
+
+  /* the length isn't trusted further than the biggest packet of a server */
+  if (buffer_ensure(packet->payload, size < SFTP_SERVER_PACKET_MAX ?
+        size : SFTP_SERVER_PACKET_MAX) < 0) {
+    ssh_set_error_oom(sftp->session);
+    sftp_packet_free(packet);
+    sftp_leave_function();
+    return NULL;
+  }
+  while (size > 0) {
+    r = channel_read_in_place(sftp->channel, size, 0, -1, sftp_packet_take,
+        packet);
+    if (r <= 0) {
+      /* TODO: check if there are cases where an error needs to be set here */
+      sftp_packet_free(packet);
       sftp_leave_function();
-      ssh_set_error_oom(sftp->session);
       return NULL;
     }
     size -= r;
@@ -361,6 +839,44 @@ sftp_packet sftp_packet_read(sftp_session sftp) {
   return packet;
 }
 
+/*
+ * Tells whether a whole packet is buffered by the channel, after taking what
+ * the session received without waiting: sftp_packet_read() then doesn't
+ * block. Returns 1 if so, 0 if not yet, -1 on error.
+ */
+static int sftp_packet_ready(sftp_session sftp) {
+  ssh_channel channel = sftp->channel;
+  uint32_t size;
+  int pending;
+
+  if (ssh_handle_packets(sftp->session, 0) == SSH_ERROR) {
+    return -1;
+  }
+  pending = ssh_channel_poll(channel, 0);
+  if (pending == SSH_ERROR) {
+    return -1;
+  }
+  if (pending == SSH_EOF) {
+    ssh_set_error(sftp->session, SSH_FATAL, "Short sftp packet!");
+    return -1;
+  }
+  if ((uint32_t) pending < sizeof(uint32_t)) {
+    return 0;
+  }
+
+  memcpy(&size, buffer_get_rest(channel->stdout_buffer), sizeof(uint32_t));
+  size = ntohl(size);
+  if ((uint32_t) pending - sizeof(uint32_t) >= size) {
+    return 1;
+  }
+  if (channel->remote_eof) {
+    ssh_set_error(sftp->session, SSH_FATAL, "Short sftp packet!");
+    return -1;
+  }
+
+  return 0;
+}
+
 static void sftp_set_error(sftp_session sftp, int errnum) {
   if (sftp != NULL) {
     sftp->errnum = errnum;
@@ -381,6 +897,16 @@ static sftp_message sftp_message_new(sftp_session sftp){
 
   sftp_enter_function();
 
+  /* a freed message comes with its empty payload */
+  if (sftp->free_messages != NULL) {
+    msg = sftp->free_messages;
+    sftp->free_messages = msg->next;
+    sftp->free_count--;
+    msg->next = NULL;
+    sftp_leave_function();
+    return msg;
+  }
+
   msg = malloc(sizeof(struct sftp_message_struct));
   if (msg == NULL) {
     ssh_set_error_oom(sftp->session);
@@ -410,6 +936,18 @@ static void sftp_message_free(sftp_message msg) {
   sftp = msg->sftp;
   sftp_enter_function();
 
+  /* sftp_readdir() keeps the payload of its messages */
+  if (msg->payload != NULL && sftp->free_count < SFTP_FREE_MESSAGES &&
+      buffer_reinit(msg->payload) == 0) {
+    msg->packet_type = 0;
+    msg->id = 0;
+    msg->next = sftp->free_messages;
+    sftp->free_messages = msg;
+    sftp->free_count++;
+    sftp_leave_function();
+    return;
+  }
+
   ssh_buffer_free(msg->payload);
   SAFE_FREE(msg);
 
@@ -449,12 +987,15 @@ static sftp_message sftp_get_message(sftp_packet packet) {
     return NULL;
   }
 
-  ssh_log(packet->sftp->session, SSH_LOG_PACKET,
+  SSH_LOG(packet->sftp->session, SSH_LOG_PACKET,
       "Packet with id %d type %d",
       msg->id,
       msg->packet_type);
+  SSH_PROBE3(sftp_reply, sftp, msg->id, msg->packet_type);
+  sftp_latency_reply(sftp, msg->id);
 
-  if (buffer_add_data(msg->payload, buffer_get_rest(packet->payload),
+  /* the packet is freed after this, its memory goes to the message */
+  if (buffer_move(msg->payload, packet->payload,
         buffer_get_rest_len(packet->payload)) < 0) {
     ssh_set_error_oom(sftp->session);
     sftp_message_free(msg);
@@ -466,7 +1007,8 @@ static sftp_message sftp_get_message(sftp_packet packet) {
   return msg;
 }
 
-static int sftp_read_and_dispatch(sftp_session sftp) {
+/* Read the next reply of the server, NULL on error. */
+static sftp_message sftp_read_message(sftp_session sftp) {
   sftp_packet packet = NULL;
   sftp_message msg = NULL;
 
@@ -475,11 +1017,22 @@ static int sftp_read_and_dispatch(sftp_session sftp) {
   packet = sftp_packet_read(sftp);
   if (packet == NULL) {
     sftp_leave_function();
-    return -1; /* something nasty happened reading the packet */
+    return NULL; /* something nasty happened reading the packet */
   }
 
   msg = sftp_get_message(packet);
   sftp_packet_free(packet);
+
+  sftp_leave_function();
+  return msg;
+}
+
+static int sftp_read_and_dispatch(sftp_session sftp) {
+  sftp_message msg = NULL;
+
+  sftp_enter_function();
+
+  msg = sftp_read_message(sftp);
   if (msg == NULL) {
     sftp_leave_function();
     return -1;
@@ -500,60 +1053,60 @@ void sftp_packet_free(sftp_packet packet) {
     return;
   }
 
+  /* the session keeps one with its payload for the next read */
+  if (packet->sftp->free_packet == NULL && packet->payload != NULL &&
+      buffer_reinit(packet->payload) == 0) {
+    packet->sftp->free_packet = packet;
+    return;
+  }
+
   ssh_buffer_free(packet->payload);
   free(packet);
 }
 
-/* Initialize the sftp session with the server. */
-int sftp_init(sftp_session sftp) {
-  sftp_packet packet = NULL;
+/* Sends SSH_FXP_INIT. */
+static int sftp_init_send(sftp_session sftp) {
   ssh_buffer buffer = NULL;
-  ssh_string ext_name_s = NULL;
-  ssh_string ext_data_s = NULL;
-  char *ext_name = NULL;
-  char *ext_data = NULL;
   uint32_t version = htonl(LIBSFTP_VERSION);
 
-  sftp_enter_function();
-
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
-    sftp_leave_function();
     return -1;
   }
 
   if (buffer_add_u32(buffer, version) < 0) {
     ssh_set_error_oom(sftp->session);
     ssh_buffer_free(buffer);
-    sftp_leave_function();
     return -1;
   }
   if (sftp_packet_write(sftp, SSH_FXP_INIT, buffer) < 0) {
     ssh_buffer_free(buffer);
-    sftp_leave_function();
     return -1;
   }
   ssh_buffer_free(buffer);
 
-  packet = sftp_packet_read(sftp);
-  if (packet == NULL) {
-    sftp_leave_function();
-    return -1;
-  }
+  return 0;
+}
+
+/* Takes the version and the extensions of the server from SSH_FXP_VERSION. */
+static int sftp_init_version(sftp_session sftp, sftp_packet packet) {
+  ssh_string ext_name_s = NULL;
+  ssh_string ext_data_s = NULL;
+  char *ext_name = NULL;
+  char *ext_data = NULL;
+  uint32_t version;
 
   if (packet->type != SSH_FXP_VERSION) {
     ssh_set_error(sftp->session, SSH_FATAL,
         "Received a %d messages instead of SSH_FXP_VERSION", packet->type);
-    sftp_packet_free(packet);
-    sftp_leave_function();
     return -1;
   }
 
   /* TODO: are we sure there are 4 bytes ready? */
   buffer_get_u32(packet->payload, &version);
   version = ntohl(version);
-  ssh_log(sftp->session, SSH_LOG_RARE,
+  SSH_LOG(sftp->session, SSH_LOG_RARE,
       "SFTP server version %d",
       version);
 
@@ -578,7 +1131,7 @@ int sftp_init(sftp_session sftp) {
       ssh_string_free(ext_data_s);
       return -1;
     }
-    ssh_log(sftp->session, SSH_LOG_RARE,
+    SSH_LOG(sftp->session, SSH_LOG_RARE,
         "SFTP server extension: %s, version: %s",
         ext_name, ext_data);
 
@@ -615,13 +1168,80 @@ int sftp_init(sftp_session sftp) {
     ext_name_s = buffer_get_ssh_string(packet->payload);
   }
 
-  sftp_packet_free(packet);
-
   sftp->version = sftp->server_version = version;
+  sftp->init_state = SFTP_INIT_DONE;
+
+  return 0;
+}
+
+/* Initialize the sftp session with the server. */
+int sftp_init(sftp_session sftp) {
+  sftp_packet packet = NULL;
+  int rc;
+
+  sftp_enter_function();
+
+  if (sftp_init_send(sftp) < 0) {
+    sftp_leave_function();
+    return -1;
+  }
+
+  packet = sftp_packet_read(sftp);
+  if (packet == NULL) {
+    sftp_leave_function();
+    return -1;
+  }
+  rc = sftp_init_version(sftp, packet);
+  sftp_packet_free(packet);
 
   sftp_leave_function();
+  return rc;
+}
 
-  return 0;
+int sftp_init_nonblocking(sftp_session sftp) {
+  sftp_packet packet;
+  int rc;
+
+  if (sftp == NULL) {
+    return SSH_ERROR;
+  }
+
+  switch (sftp->init_state) {
+    case SFTP_INIT_OPEN:
+      rc = ssh_channel_open_session(sftp->channel);
+      if (rc != SSH_OK) {
+        return rc;
+      }
+      sftp->init_state = SFTP_INIT_SUBSYSTEM;
+      /* FALL THROUGH */
+    case SFTP_INIT_SUBSYSTEM:
+      rc = ssh_channel_request_sftp(sftp->channel);
+      if (rc != SSH_OK) {
+        return rc;
+      }
+      sftp->init_state = SFTP_INIT_SEND;
+      /* FALL THROUGH */
+    case SFTP_INIT_SEND:
+      if (sftp_init_send(sftp) < 0) {
+        return SSH_ERROR;
+      }
+      sftp->init_state = SFTP_INIT_VERSION;
+      /* FALL THROUGH */
+    case SFTP_INIT_VERSION:
+      rc = sftp_packet_ready(sftp);
+      if (rc <= 0) {
+        return rc < 0 ? SSH_ERROR : SSH_AGAIN;
+      }
+      packet = sftp_packet_read(sftp);
+      if (packet == NULL) {
+        return SSH_ERROR;
+      }
+      rc = sftp_init_version(sftp, packet);
+      sftp_packet_free(packet);
+      return rc < 0 ? SSH_ERROR : SSH_OK;
+    default:
+      return SSH_OK;
+  }
 }
 
 unsigned int sftp_extensions_get_count(sftp_session sftp) {
@@ -679,52 +1299,77 @@ int sftp_extension_supported(sftp_session sftp, const char *name,
   return 0;
 }
 
-static sftp_request_queue request_queue_new(sftp_message msg) {
-  sftp_request_queue queue = NULL;
+/*
+ * Grows the table of the queue to size buckets. The messages keep their
+ * order within a bucket.
+ */
+static int sftp_queue_resize(sftp_session sftp, uint32_t size) {
+  sftp_message *queue;
+  sftp_message *tails;
+  sftp_message msg;
+  uint32_t i;
+  uint32_t slot;
 
-  queue = malloc(sizeof(struct sftp_request_queue_struct));
-  if (queue == NULL) {
-    ssh_set_error_oom(msg->sftp->session);
-    return NULL;
+  queue = malloc(size * sizeof(sftp_message));
+  tails = malloc(size * sizeof(sftp_message));
+  if (queue == NULL || tails == NULL) {
+    ssh_set_error_oom(sftp->session);
+    SAFE_FREE(queue);
+    SAFE_FREE(tails);
+    return -1;
   }
-  ZERO_STRUCTP(queue);
-
-  queue->message = msg;
-
-  return queue;
-}
+  memset(queue, 0, size * sizeof(sftp_message));
 
-static void request_queue_free(sftp_request_queue queue) {
-  if (queue == NULL) {
-    return;
+  for (i = 0; i < sftp->queue_size; i++) {
+    while (sftp->queue[i] != NULL) {
+      msg = sftp->queue[i];
+      sftp->queue[i] = msg->next;
+      msg->next = NULL;
+      slot = msg->id & (size - 1);
+      if (queue[slot] == NULL) {
+        queue[slot] = msg;
+      } else {
+        tails[slot]->next = msg;
+      }
+      tails[slot] = msg;
+    }
   }
 
-  ZERO_STRUCTP(queue);
-  SAFE_FREE(queue);
+  SAFE_FREE(tails);
+  SAFE_FREE(sftp->queue);
+  sftp->queue = queue;
+  sftp->queue_size = size;
+
+  return 0;
 }
 
+/*
+ * Queues a reply until sftp_dequeue() asks for its id. The queue is a table
+ * hashed by id, grown to keep about one message per bucket, so the ids of
+ * the requests in flight rarely share a bucket.
+ */
 static int sftp_enqueue(sftp_session sftp, sftp_message msg) {
-  sftp_request_queue queue = NULL;
-  sftp_request_queue ptr;
+  sftp_message *ptr;
 
-  queue = request_queue_new(msg);
-  if (queue == NULL) {
-    return -1;
+  if (sftp->queue_count >= sftp->queue_size) {
+    if (sftp_queue_resize(sftp, sftp->queue_size ?
+          sftp->queue_size * 2 : SFTP_QUEUE_SIZE) < 0) {
+      return -1;
+    }
   }
 
-  ssh_log(sftp->session, SSH_LOG_PACKET,
+  SSH_LOG(sftp->session, SSH_LOG_PACKET,
       "Queued msg type %d id %d",
       msg->id, msg->packet_type);
 
-  if(sftp->queue == NULL) {
-    sftp->queue = queue;
-  } else {
-    ptr = sftp->queue;
-    while(ptr->next) {
-      ptr=ptr->next; /* find end of linked list */
-    }
-    ptr->next = queue; /* add it on bottom */
+  /* add it on bottom of its bucket */
+  ptr = &sftp->queue[msg->id & (sftp->queue_size - 1)];
+  while (*ptr != NULL) {
+    ptr = &(*ptr)->next;
   }
+  msg->next = NULL;
+  *ptr = msg;
+  sftp->queue_count++;
 
   return 0;
 }
@@ -734,33 +1379,27 @@ static int sftp_enqueue(sftp_session sftp, sftp_message msg) {
  * Returns NULL if no message has been found.
  */
 static sftp_message sftp_dequeue(sftp_session sftp, uint32_t id){
-  sftp_request_queue prev = NULL;
-  sftp_request_queue queue;
+  sftp_message *ptr;
   sftp_message msg;
 
-  if(sftp->queue == NULL) {
+  if (sftp->queue_count == 0) {
     return NULL;
   }
 
-  queue = sftp->queue;
-  while (queue) {
-    if(queue->message->id == id) {
+  for (ptr = &sftp->queue[id & (sftp->queue_size - 1)]; *ptr != NULL;
+      ptr = &(*ptr)->next) {
+    if ((*ptr)->id == id) {
       /* remove from queue */
-      if (prev == NULL) {
-        sftp->queue = queue->next;
-      } else {
-        prev->next = queue->next;
-      }
-      msg = queue->message;
-      request_queue_free(queue);
-      ssh_log(sftp->session, SSH_LOG_PACKET,
+      msg = *ptr;
+      *ptr = msg->next;
+      msg->next = NULL;
+      sftp->queue_count--;
+      SSH_LOG(sftp->session, SSH_LOG_PACKET,
           "Dequeued msg id %d type %d",
           msg->id,
           msg->packet_type);
       return msg;
     }
-    prev = queue;
-    queue = queue->next;
   }
 
   return NULL;
@@ -963,6 +1602,143 @@ sftp_dir sftp_opendir(sftp_session sftp, const char *path){
   return NULL;
 }
 
+/*
+ * The strings of an ATTRS being parsed, still in the buffer. They are copied
+ * after the attributes, in the same allocation, once their sizes are known.
+ */
+struct sftp_attr_strings {
+  const char *name;
+  uint32_t name_len;
+  const char *longname;
+  uint32_t longname_len;
+  const char *owner;
+  uint32_t owner_len;
+  const char *group;
+  uint32_t group_len;
+  const char *acl; /* with its length, as a ssh_string */
+  uint32_t acl_len;
+  const char *extended; /* the pairs, as sent */
+  uint32_t extended_len;
+};
+
+static uint8_t sftp_attr_type(uint32_t permissions) {
+  /* FIXME on windows! */
+  switch (permissions & S_IFMT) {
+    case S_IFSOCK:
+    case S_IFBLK:
+    case S_IFCHR:
+    case S_IFIFO:
+      return SSH_FILEXFER_TYPE_SPECIAL;
+    case S_IFLNK:
+      return SSH_FILEXFER_TYPE_SYMLINK;
+    case S_IFREG:
+      return SSH_FILEXFER_TYPE_REGULAR;
+    case S_IFDIR:
+      return SSH_FILEXFER_TYPE_DIRECTORY;
+    default:
+      return SSH_FILEXFER_TYPE_UNKNOWN;
+  }
+}
+
+/* Gets a string with its length in front, NULL if the buffer is too short */
+static const char *sftp_attr_raw_string(ssh_buffer buf, uint32_t *len) {
+  const char *raw = buffer_get_rest(buf);
+
+  if (buffer_get_ssh_string_view(buf, len) == NULL) {
+    return NULL;
+  }
+  *len += sizeof(uint32_t);
+
+  return raw;
+}
+
+/* Steps over count extended pairs, returning where they start */
+static const char *sftp_attr_extended(ssh_buffer buf, uint32_t count,
+    uint32_t *len) {
+  const char *raw = buffer_get_rest(buf);
+  uint32_t n;
+
+  for (; count > 0; count--) {
+    if (buffer_get_ssh_string_view(buf, &n) == NULL ||
+        buffer_get_ssh_string_view(buf, &n) == NULL) {
+      return NULL;
+    }
+  }
+  *len = (const char *) buffer_get_rest(buf) - raw;
+
+  return raw;
+}
+
+/* The string after a string of the extended pairs, checked when parsed */
+static const char *sftp_attr_next_string(const char *raw) {
+  uint32_t len;
+
+  memcpy(&len, raw, sizeof(uint32_t));
+
+  return raw + sizeof(uint32_t) + ntohl(len);
+}
+
+/* Copies a string after the attributes, NUL terminated */
+static char *sftp_attr_copy(char **p, const char *s, uint32_t len) {
+  char *copy = *p;
+
+  if (s == NULL) {
+    return NULL;
+  }
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  *p += len + 1;
+
+  return copy;
+}
+
+/* Builds the attributes and their strings in one allocation */
+static sftp_attributes sftp_attr_pack(sftp_session sftp,
+    sftp_attributes fixed, struct sftp_attr_strings *strings) {
+  sftp_attributes attr;
+  const char *pair;
+  char *p;
+  uint32_t i;
+
+  attr = malloc(sizeof(struct sftp_attributes_struct) +
+      strings->name_len + strings->longname_len + strings->owner_len +
+      strings->group_len + 4 + strings->acl_len + strings->extended_len);
+  if (attr == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+  *attr = *fixed;
+  attr->packed = 1;
+
+  p = (char *) (attr + 1);
+  attr->name = sftp_attr_copy(&p, strings->name, strings->name_len);
+  attr->longname = sftp_attr_copy(&p, strings->longname,
+      strings->longname_len);
+  attr->owner = sftp_attr_copy(&p, strings->owner, strings->owner_len);
+  attr->group = sftp_attr_copy(&p, strings->group, strings->group_len);
+
+  if (strings->acl != NULL) {
+    memcpy(p, strings->acl, strings->acl_len);
+    attr->acl = (ssh_string) p;
+    p += strings->acl_len;
+  }
+
+  /* the pairs are only walked when asked for, the last one stays at hand */
+  if (strings->extended != NULL) {
+    memcpy(p, strings->extended, strings->extended_len);
+    attr->extended = p;
+    attr->extended_len = strings->extended_len;
+    pair = p;
+    for (i = 0; i < attr->extended_count; i++) {
+      attr->extended_type = (ssh_string) pair;
+      attr->extended_data = (ssh_string) sftp_attr_next_string(pair);
+      pair = sftp_attr_next_string((const char *) attr->extended_data);
+    }
+  }
+
+  return attr;
+}
+
 /*
  * Parse the attributes from a payload from some messages. It is coded on
  * baselines from the protocol version 4.
@@ -970,21 +1746,16 @@ sftp_dir sftp_opendir(sftp_session sftp, const char *path){
  */
 static sftp_attributes sftp_parse_attr_4(sftp_session sftp, ssh_buffer buf,
     int expectnames) {
-  sftp_attributes attr;
-  ssh_string owner = NULL;
-  ssh_string group = NULL;
+  struct sftp_attributes_struct attr;
+  struct sftp_attr_strings strings;
   uint32_t flags = 0;
   int ok = 0;
 
   /* unused member variable */
   (void) expectnames;
 
-  attr = malloc(sizeof(struct sftp_attributes_struct));
-  if (attr == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return NULL;
-  }
-  ZERO_STRUCTP(attr);
+  ZERO_STRUCT(attr);
+  ZERO_STRUCT(strings);
 
   /* This isn't really a loop, but it is like a try..catch.. */
   do {
@@ -993,116 +1764,91 @@ static sftp_attributes sftp_parse_attr_4(sftp_session sftp, ssh_buffer buf,
     }
 
     flags = ntohl(flags);
-    attr->flags = flags;
+    attr.flags = flags;
 
     if (flags & SSH_FILEXFER_ATTR_SIZE) {
-      if (buffer_get_u64(buf, &attr->size) != 8) {
+      if (buffer_get_u64(buf, &attr.size) != 8) {
         break;
       }
-      attr->size = ntohll(attr->size);
+      attr.size = ntohll(attr.size);
     }
 
     if (flags & SSH_FILEXFER_ATTR_OWNERGROUP) {
-      if((owner = buffer_get_ssh_string(buf)) == NULL ||
-        (attr->owner = ssh_string_to_char(owner)) == NULL) {
+      strings.owner = buffer_get_ssh_string_view(buf, &strings.owner_len);
+      if (strings.owner == NULL) {
         break;
       }
-      if ((group = buffer_get_ssh_string(buf)) == NULL ||
-        (attr->group = ssh_string_to_char(group)) == NULL) {
+      strings.group = buffer_get_ssh_string_view(buf, &strings.group_len);
+      if (strings.group == NULL) {
         break;
       }
     }
 
     if (flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
-      if (buffer_get_u32(buf, &attr->permissions) != 4) {
+      if (buffer_get_u32(buf, &attr.permissions) != 4) {
         break;
       }
-      attr->permissions = ntohl(attr->permissions);
-
-      /* FIXME on windows! */
-      switch (attr->permissions & S_IFMT) {
-        case S_IFSOCK:
-        case S_IFBLK:
-        case S_IFCHR:
-        case S_IFIFO:
-          attr->type = SSH_FILEXFER_TYPE_SPECIAL;
-          break;
-        case S_IFLNK:
-          attr->type = SSH_FILEXFER_TYPE_SYMLINK;
-          break;
-        case S_IFREG:
-          attr->type = SSH_FILEXFER_TYPE_REGULAR;
-          break;
-        case S_IFDIR:
-          attr->type = SSH_FILEXFER_TYPE_DIRECTORY;
-          break;
-        default:
-          attr->type = SSH_FILEXFER_TYPE_UNKNOWN;
-          break;
-      }
+      attr.permissions = ntohl(attr.permissions);
+      attr.type = sftp_attr_type(attr.permissions);
     }
 
     if (flags & SSH_FILEXFER_ATTR_ACCESSTIME) {
-      if (buffer_get_u64(buf, &attr->atime64) != 8) {
+      if (buffer_get_u64(buf, &attr.atime64) != 8) {
         break;
       }
-      attr->atime64 = ntohll(attr->atime64);
+      attr.atime64 = ntohll(attr.atime64);
     }
 
     if (flags & SSH_FILEXFER_ATTR_SUBSECOND_TIMES) {
-      if (buffer_get_u32(buf, &attr->atime_nseconds) != 4) {
+      if (buffer_get_u32(buf, &attr.atime_nseconds) != 4) {
         break;
       }
-      attr->atime_nseconds = ntohl(attr->atime_nseconds);
+      attr.atime_nseconds = ntohl(attr.atime_nseconds);
     }
 
     if (flags & SSH_FILEXFER_ATTR_CREATETIME) {
-      if (buffer_get_u64(buf, &attr->createtime) != 8) {
+      if (buffer_get_u64(buf, &attr.createtime) != 8) {
         break;
       }
-      attr->createtime = ntohll(attr->createtime);
+      attr.createtime = ntohll(attr.createtime);
     }
 
     if (flags & SSH_FILEXFER_ATTR_SUBSECOND_TIMES) {
-      if (buffer_get_u32(buf, &attr->createtime_nseconds) != 4) {
+      if (buffer_get_u32(buf, &attr.createtime_nseconds) != 4) {
         break;
       }
-      attr->createtime_nseconds = ntohl(attr->createtime_nseconds);
+      attr.createtime_nseconds = ntohl(attr.createtime_nseconds);
     }
 
     if (flags & SSH_FILEXFER_ATTR_MODIFYTIME) {
-      if (buffer_get_u64(buf, &attr->mtime64) != 8) {
+      if (buffer_get_u64(buf, &attr.mtime64) != 8) {
         break;
       }
-      attr->mtime64 = ntohll(attr->mtime64);
+      attr.mtime64 = ntohll(attr.mtime64);
     }
 
     if (flags & SSH_FILEXFER_ATTR_SUBSECOND_TIMES) {
-      if (buffer_get_u32(buf, &attr->mtime_nseconds) != 4) {
+      if (buffer_get_u32(buf, &attr.mtime_nseconds) != 4) {
         break;
       }
-      attr->mtime_nseconds = ntohl(attr->mtime_nseconds);
+      attr.mtime_nseconds = ntohl(attr.mtime_nseconds);
     }
 
     if (flags & SSH_FILEXFER_ATTR_ACL) {
-      if ((attr->acl = buffer_get_ssh_string(buf)) == NULL) {
+      strings.acl = sftp_attr_raw_string(buf, &strings.acl_len);
+      if (strings.acl == NULL) {
         break;
       }
     }
 
     if (flags & SSH_FILEXFER_ATTR_EXTENDED) {
-      if (buffer_get_u32(buf,&attr->extended_count) != 4) {
+      if (buffer_get_u32(buf, &attr.extended_count) != 4) {
         break;
       }
-      attr->extended_count = ntohl(attr->extended_count);
-
-      while(attr->extended_count &&
-          (attr->extended_type = buffer_get_ssh_string(buf)) &&
-          (attr->extended_data = buffer_get_ssh_string(buf))){
-        attr->extended_count--;
-      }
-
-      if (attr->extended_count) {
+      attr.extended_count = ntohl(attr.extended_count);
+      strings.extended = sftp_attr_extended(buf, attr.extended_count,
+          &strings.extended_len);
+      if (strings.extended == NULL) {
         break;
       }
     }
@@ -1111,21 +1857,12 @@ static sftp_attributes sftp_parse_attr_4(sftp_session sftp, ssh_buffer buf,
 
   if (ok == 0) {
     /* break issued somewhere */
-    ssh_string_free(owner);
-    ssh_string_free(group);
-    ssh_string_free(attr->acl);
-    ssh_string_free(attr->extended_type);
-    ssh_string_free(attr->extended_data);
-    SAFE_FREE(attr->owner);
-    SAFE_FREE(attr->group);
-    SAFE_FREE(attr);
-
     ssh_set_error(sftp->session, SSH_FATAL, "Invalid ATTR structure");
 
     return NULL;
   }
 
-  return attr;
+  return sftp_attr_pack(sftp, &attr, &strings);
 }
 
 enum sftp_longname_field_e {
@@ -1139,41 +1876,34 @@ enum sftp_longname_field_e {
   SFTP_LONGNAME_NAME,
 };
 
-static char *sftp_parse_longname(const char *longname,
-        enum sftp_longname_field_e longname_field) {
-    const char *p, *q;
-    size_t len, field = 0;
-    char *x;
-
-    p = longname;
-    /* Find the beginning of the field which is specified by sftp_longanme_field_e. */
-    while(field != longname_field) {
-        if(isspace(*p)) {
-            field++;
-            p++;
-            while(*p && isspace(*p)) {
-                p++;
-            }
-        } else {
-            p++;
-        }
-    }
-
-    q = p;
-    while (! isspace(*q)) {
-        q++;
-    }
-
-    /* There is no strndup on windows */
-    len = q - p + 1;
-    x = malloc(len);
-    if (x == NULL) {
-      return NULL;
+/* Finds a field of a longname, an empty one if the longname is too short */
+static const char *sftp_parse_longname(const char *longname, uint32_t len,
+    enum sftp_longname_field_e longname_field, uint32_t *field_len) {
+  const char *end = longname + len;
+  const char *p, *q;
+  size_t field = 0;
+
+  p = longname;
+  /* Find the beginning of the field which is specified by sftp_longanme_field_e. */
+  while (field != longname_field && p < end) {
+    if (isspace((unsigned char) *p)) {
+      field++;
+      p++;
+      while (p < end && isspace((unsigned char) *p)) {
+        p++;
+      }
+    } else {
+      p++;
     }
+  }
 
-    snprintf(x, len, "%s", p);
+  q = p;
+  while (q < end && !isspace((unsigned char) *q)) {
+    q++;
+  }
+  *field_len = q - p;
 
-    return x;
+  return p;
 }
 
 /* sftp version 0-3 code. It is different from the v4 */
@@ -1193,47 +1923,37 @@ static char *sftp_parse_longname(const char *longname,
                    so that number of pairs equals extended_count              */
 static sftp_attributes sftp_parse_attr_3(sftp_session sftp, ssh_buffer buf,
     int expectname) {
-  ssh_string longname = NULL;
-  ssh_string name = NULL;
-  sftp_attributes attr;
+  struct sftp_attributes_struct attr;
+  struct sftp_attr_strings strings;
   uint32_t flags = 0;
   int ok = 0;
 
-  attr = malloc(sizeof(struct sftp_attributes_struct));
-  if (attr == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return NULL;
-  }
-  ZERO_STRUCTP(attr);
+  ZERO_STRUCT(attr);
+  ZERO_STRUCT(strings);
 
   /* This isn't really a loop, but it is like a try..catch.. */
   do {
     if (expectname) {
-      if ((name = buffer_get_ssh_string(buf)) == NULL ||
-          (attr->name = ssh_string_to_char(name)) == NULL) {
+      strings.name = buffer_get_ssh_string_view(buf, &strings.name_len);
+      if (strings.name == NULL) {
         break;
       }
-      ssh_string_free(name);
 
-      ssh_log(sftp->session, SSH_LOG_RARE, "Name: %s", attr->name);
+      SSH_LOG(sftp->session, SSH_LOG_RARE, "Name: %.*s",
+          (int) strings.name_len, strings.name);
 
-      if ((longname=buffer_get_ssh_string(buf)) == NULL ||
-          (attr->longname=ssh_string_to_char(longname)) == NULL) {
+      strings.longname = buffer_get_ssh_string_view(buf,
+          &strings.longname_len);
+      if (strings.longname == NULL) {
         break;
       }
-      ssh_string_free(longname);
 
       /* Set owner and group if we talk to openssh and have the longname */
       if (ssh_get_openssh_version(sftp->session)) {
-        attr->owner = sftp_parse_longname(attr->longname, SFTP_LONGNAME_OWNER);
-        if (attr->owner == NULL) {
-          break;
-        }
-
-        attr->group = sftp_parse_longname(attr->longname, SFTP_LONGNAME_GROUP);
-        if (attr->group == NULL) {
-          break;
-        }
+        strings.owner = sftp_parse_longname(strings.longname,
+            strings.longname_len, SFTP_LONGNAME_OWNER, &strings.owner_len);
+        strings.group = sftp_parse_longname(strings.longname,
+            strings.longname_len, SFTP_LONGNAME_GROUP, &strings.group_len);
       }
     }
 
@@ -1241,83 +1961,58 @@ static sftp_attributes sftp_parse_attr_3(sftp_session sftp, ssh_buffer buf,
       break;
     }
     flags = ntohl(flags);
-    attr->flags = flags;
-    ssh_log(sftp->session, SSH_LOG_RARE,
+    attr.flags = flags;
+    SSH_LOG(sftp->session, SSH_LOG_RARE,
         "Flags: %.8lx\n", (long unsigned int) flags);
 
     if (flags & SSH_FILEXFER_ATTR_SIZE) {
-      if(buffer_get_u64(buf, &attr->size) != sizeof(uint64_t)) {
+      if(buffer_get_u64(buf, &attr.size) != sizeof(uint64_t)) {
         break;
       }
-      attr->size = ntohll(attr->size);
-      ssh_log(sftp->session, SSH_LOG_RARE,
+      attr.size = ntohll(attr.size);
+      SSH_LOG(sftp->session, SSH_LOG_RARE,
           "Size: %llu\n",
-          (long long unsigned int) attr->size);
+          (long long unsigned int) attr.size);
     }
 
     if (flags & SSH_FILEXFER_ATTR_UIDGID) {
-      if (buffer_get_u32(buf, &attr->uid) != sizeof(uint32_t)) {
+      if (buffer_get_u32(buf, &attr.uid) != sizeof(uint32_t)) {
         break;
       }
-      if (buffer_get_u32(buf, &attr->gid) != sizeof(uint32_t)) {
+      if (buffer_get_u32(buf, &attr.gid) != sizeof(uint32_t)) {
         break;
       }
-      attr->uid = ntohl(attr->uid);
-      attr->gid = ntohl(attr->gid);
+      attr.uid = ntohl(attr.uid);
+      attr.gid = ntohl(attr.gid);
     }
 
     if (flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
-      if (buffer_get_u32(buf, &attr->permissions) != sizeof(uint32_t)) {
+      if (buffer_get_u32(buf, &attr.permissions) != sizeof(uint32_t)) {
         break;
       }
-      attr->permissions = ntohl(attr->permissions);
-
-      switch (attr->permissions & S_IFMT) {
-        case S_IFSOCK:
-        case S_IFBLK:
-        case S_IFCHR:
-        case S_IFIFO:
-          attr->type = SSH_FILEXFER_TYPE_SPECIAL;
-          break;
-        case S_IFLNK:
-          attr->type = SSH_FILEXFER_TYPE_SYMLINK;
-          break;
-        case S_IFREG:
-          attr->type = SSH_FILEXFER_TYPE_REGULAR;
-          break;
-        case S_IFDIR:
-          attr->type = SSH_FILEXFER_TYPE_DIRECTORY;
-          break;
-        default:
-          attr->type = SSH_FILEXFER_TYPE_UNKNOWN;
-          break;
-      }
-    }
+      attr.permissions = ntohl(attr.permissions);
+      attr.type = sftp_attr_type(attr.permissions);
+    }
 
     if (flags & SSH_FILEXFER_ATTR_ACMODTIME) {
-      if (buffer_get_u32(buf, &attr->atime) != sizeof(uint32_t)) {
+      if (buffer_get_u32(buf, &attr.atime) != sizeof(uint32_t)) {
         break;
       }
-      attr->atime = ntohl(attr->atime);
-      if (buffer_get_u32(buf, &attr->mtime) != sizeof(uint32_t)) {
+      attr.atime = ntohl(attr.atime);
+      if (buffer_get_u32(buf, &attr.mtime) != sizeof(uint32_t)) {
         break;
       }
-      attr->mtime = ntohl(attr->mtime);
+      attr.mtime = ntohl(attr.mtime);
     }
 
     if (flags & SSH_FILEXFER_ATTR_EXTENDED) {
-      if (buffer_get_u32(buf, &attr->extended_count) != sizeof(uint32_t)) {
+      if (buffer_get_u32(buf, &attr.extended_count) != sizeof(uint32_t)) {
         break;
       }
-
-      attr->extended_count = ntohl(attr->extended_count);
-      while (attr->extended_count &&
-          (attr->extended_type = buffer_get_ssh_string(buf))
-          && (attr->extended_data = buffer_get_ssh_string(buf))) {
-        attr->extended_count--;
-      }
-
-      if (attr->extended_count) {
+      attr.extended_count = ntohl(attr.extended_count);
+      strings.extended = sftp_attr_extended(buf, attr.extended_count,
+          &strings.extended_len);
+      if (strings.extended == NULL) {
         break;
       }
     }
@@ -1326,23 +2021,13 @@ static sftp_attributes sftp_parse_attr_3(sftp_session sftp, ssh_buffer buf,
 
   if (!ok) {
     /* break issued somewhere */
-    ssh_string_free(name);
-    ssh_string_free(longname);
-    ssh_string_free(attr->extended_type);
-    ssh_string_free(attr->extended_data);
-    SAFE_FREE(attr->name);
-    SAFE_FREE(attr->longname);
-    SAFE_FREE(attr->owner);
-    SAFE_FREE(attr->group);
-    SAFE_FREE(attr);
-
     ssh_set_error(sftp->session, SSH_FATAL, "Invalid ATTR structure");
 
     return NULL;
   }
 
   /* everything went smoothly */
-  return attr;
+  return sftp_attr_pack(sftp, &attr, &strings);
 }
 
 /* FIXME is this really needed as a public function? */
@@ -1412,107 +2097,336 @@ int sftp_server_version(sftp_session sftp) {
   return sftp->server_version;
 }
 
-/* Get a single file attributes structure of a directory. */
-sftp_attributes sftp_readdir(sftp_session sftp, sftp_dir dir) {
+/*
+ * Sends a SSH_FXP_READDIR of the directory, to be read by sftp_dir_fetch().
+ * Returns 0, -1 on error.
+ */
+static int sftp_readdir_request(sftp_dir dir) {
+  sftp_session sftp = dir->sftp;
+  ssh_buffer payload;
+  uint32_t id;
+
+  payload = ssh_buffer_new();
+  if (payload == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(payload, id) < 0 ||
+      buffer_add_ssh_string(payload, dir->handle) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(payload);
+    return -1;
+  }
+
+  if (sftp_packet_write(sftp, SSH_FXP_READDIR, payload) < 0) {
+    ssh_buffer_free(payload);
+    return -1;
+  }
+  ssh_buffer_free(payload);
+
+  SSH_LOG(sftp->session, SSH_LOG_PACKET,
+      "Sent a ssh_fxp_readdir with id %d", id);
+
+  dir->readdir_id = id;
+  dir->readdir_pending = 1;
+
+  return 0;
+}
+
+/* Forget the entries of the current batch */
+static void sftp_dir_release(sftp_dir dir) {
+  uint32_t i;
+
+  for (i = 0; i < dir->entry_count; i++) {
+    sftp_attributes_free(dir->entries[i].attributes);
+  }
+  dir->entry_count = 0;
+  dir->arena_used = 0;
+  dir->count = 0;
+}
+
+/* Wait for the reply of the READDIR in flight and drop it */
+static void sftp_dir_drain(sftp_dir dir) {
+  sftp_message msg = NULL;
+
+  while (dir->readdir_pending && msg == NULL) {
+    msg = sftp_dequeue(dir->sftp, dir->readdir_id);
+    if (msg == NULL && sftp_read_and_dispatch(dir->sftp) < 0) {
+      break;
+    }
+  }
+  dir->readdir_pending = 0;
+  sftp_message_free(msg);
+}
+
+/*
+ * Gets the next batch of names into dir->buffer and sends the READDIR of the
+ * one after it. Returns 1, 0 at the end of the directory, -1 on error.
+ */
+static int sftp_dir_fetch(sftp_dir dir) {
+  sftp_session sftp = dir->sftp;
   sftp_message msg = NULL;
   sftp_status_message status;
-  sftp_attributes attr;
   ssh_buffer payload;
-  uint32_t id;
+  size_t size;
 
-  if (dir->buffer == NULL) {
-    payload = ssh_buffer_new();
-    if (payload == NULL) {
-      ssh_set_error_oom(sftp->session);
-      return NULL;
+  sftp_dir_release(dir);
+  if (dir->eof) {
+    return 0;
+  }
+
+  if (!dir->readdir_pending && sftp_readdir_request(dir) < 0) {
+    return -1;
+  }
+
+  while (msg == NULL) {
+    msg = sftp_dequeue(sftp, dir->readdir_id);
+    if (msg == NULL && sftp_read_and_dispatch(sftp) < 0) {
+      /* something nasty has happened */
+      return -1;
     }
+  }
+  dir->readdir_pending = 0;
+
+  switch (msg->packet_type) {
+    case SSH_FXP_STATUS:
+      status = parse_status_msg(msg);
+      sftp_message_free(msg);
+      if (status == NULL) {
+        return -1;
+      }
+      sftp_set_error(sftp, status->status);
+      if (status->status == SSH_FX_EOF) {
+        dir->eof = 1;
+        status_msg_free(status);
+        return 0;
+      }
+
+      ssh_set_error(sftp->session, SSH_FATAL,
+          "Unknown error status: %d", status->status);
+      status_msg_free(status);
+
+      return -1;
+    case SSH_FXP_NAME:
+      /* swap the buffers, so the message gets the old one back to the pool */
+      payload = msg->payload;
+      if (dir->buffer != NULL && buffer_reinit(dir->buffer) < 0) {
+        ssh_buffer_free(dir->buffer);
+        dir->buffer = NULL;
+      }
+      msg->payload = dir->buffer;
+      dir->buffer = payload;
+      sftp_message_free(msg);
+      break;
+    default:
+      ssh_set_error(sftp->session, SSH_FATAL,
+          "Unsupported message back %d", msg->packet_type);
+      sftp_message_free(msg);
+
+      return -1;
+  }
+
+  if (buffer_get_u32(dir->buffer, &dir->count) != sizeof(uint32_t)) {
+    ssh_set_error(sftp->session, SSH_FATAL, "Invalid SSH_FXP_NAME message");
+    return -1;
+  }
+  dir->count = ntohl(dir->count);
+
+  /* an entry takes at least a name, a longname and the flags */
+  if (dir->count == 0 ||
+      dir->count > buffer_get_rest_len(dir->buffer) / (3 * sizeof(uint32_t))) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Invalid count of %u files sent by the server", dir->count);
+    dir->count = 0;
+    return -1;
+  }
 
-    id = sftp_get_new_id(sftp);
-    if (buffer_add_u32(payload, id) < 0 ||
-        buffer_add_ssh_string(payload, dir->handle) < 0) {
+  /* the strings of the batch can't be bigger than the batch */
+  size = dir->count * sizeof(struct sftp_dir_entry_struct) +
+      buffer_get_rest_len(dir->buffer) + 2 * dir->count;
+  if (size > dir->arena_size) {
+    SAFE_FREE(dir->arena);
+    dir->arena_size = 0;
+    dir->arena = malloc(size);
+    if (dir->arena == NULL) {
       ssh_set_error_oom(sftp->session);
-      ssh_buffer_free(payload);
-      return NULL;
+      dir->count = 0;
+      return -1;
     }
+    dir->arena_size = size;
+  }
+  dir->entries = (sftp_dir_entry) dir->arena;
+  dir->arena_used = dir->count * sizeof(struct sftp_dir_entry_struct);
 
-    if (sftp_packet_write(sftp, SSH_FXP_READDIR, payload) < 0) {
-      ssh_buffer_free(payload);
-      return NULL;
+  /* ask for the next batch while this one is read */
+  sftp_readdir_request(dir);
+
+  return 1;
+}
+
+/* Copies a string of the batch into the arena */
+static const char *sftp_dir_string(sftp_dir dir) {
+  const char *data;
+  uint32_t len;
+  char *s;
+
+  data = buffer_get_ssh_string_view(dir->buffer, &len);
+  if (data == NULL || dir->arena_used + len + 1 > dir->arena_size) {
+    return NULL;
+  }
+  s = dir->arena + dir->arena_used;
+  memcpy(s, data, len);
+  s[len] = '\0';
+  dir->arena_used += len + 1;
+
+  return s;
+}
+
+/* Steps over the attributes of an entry without parsing them */
+static int sftp_skip_attr(sftp_session sftp, ssh_buffer buf) {
+  sftp_attributes attr;
+  uint32_t flags;
+  uint32_t count;
+  uint32_t len = 0;
+
+  if (sftp->version > 3) {
+    attr = sftp_parse_attr(sftp, buf, 0);
+    if (attr == NULL) {
+      return -1;
     }
-    ssh_buffer_free(payload);
+    sftp_attributes_free(attr);
+    return 0;
+  }
 
-    ssh_log(sftp->session, SSH_LOG_PACKET,
-        "Sent a ssh_fxp_readdir with id %d", id);
+  if (buffer_get_u32(buf, &flags) != sizeof(uint32_t)) {
+    return -1;
+  }
+  flags = ntohl(flags);
 
-    while (msg == NULL) {
-      if (sftp_read_and_dispatch(sftp) < 0) {
-        /* something nasty has happened */
-        return NULL;
+  if (flags & SSH_FILEXFER_ATTR_SIZE) {
+    len += sizeof(uint64_t);
+  }
+  if (flags & SSH_FILEXFER_ATTR_UIDGID) {
+    len += 2 * sizeof(uint32_t);
+  }
+  if (flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+    len += sizeof(uint32_t);
+  }
+  if (flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+    len += 2 * sizeof(uint32_t);
+  }
+  /* not buffer_pass_bytes(), which empties a buffer read to the end */
+  if (buffer_get_rest_len(buf) < len) {
+    return -1;
+  }
+  buf->pos += len;
+
+  if (flags & SSH_FILEXFER_ATTR_EXTENDED) {
+    if (buffer_get_u32(buf, &count) != sizeof(uint32_t)) {
+      return -1;
+    }
+    for (count = ntohl(count); count > 0; count--) {
+      if (buffer_get_ssh_string_view(buf, &len) == NULL ||
+          buffer_get_ssh_string_view(buf, &len) == NULL) {
+        return -1;
       }
-      msg = sftp_dequeue(sftp, id);
     }
+  }
 
-    switch (msg->packet_type){
-      case SSH_FXP_STATUS:
-        status = parse_status_msg(msg);
-        sftp_message_free(msg);
-        if (status == NULL) {
-          return NULL;
-        }
-        sftp_set_error(sftp, status->status);
-        switch (status->status) {
-          case SSH_FX_EOF:
-            dir->eof = 1;
-            status_msg_free(status);
-            return NULL;
-          default:
-            break;
-        }
+  return 0;
+}
 
-        ssh_set_error(sftp->session, SSH_FATAL,
-            "Unknown error status: %d", status->status);
-        status_msg_free(status);
+/* Get the next entry of a directory, leaving its attributes for later. */
+sftp_dir_entry sftp_dir_next(sftp_dir dir) {
+  sftp_session sftp = dir->sftp;
+  sftp_dir_entry entry;
+  uint32_t pos;
+  int rc;
 
-        return NULL;
-      case SSH_FXP_NAME:
-        buffer_get_u32(msg->payload, &dir->count);
-        dir->count = ntohl(dir->count);
-        dir->buffer = msg->payload;
-        msg->payload = NULL;
-        sftp_message_free(msg);
-        break;
-      default:
-        ssh_set_error(sftp->session, SSH_FATAL,
-            "Unsupported message back %d", msg->packet_type);
-        sftp_message_free(msg);
+  if (dir->count == 0) {
+    rc = sftp_dir_fetch(dir);
+    if (rc <= 0) {
+      return NULL;
+    }
+  }
 
-        return NULL;
+  entry = &dir->entries[dir->entry_count];
+  ZERO_STRUCTP(entry);
+  entry->offset = dir->buffer->pos;
+
+  entry->name = sftp_dir_string(dir);
+  if (entry->name == NULL) {
+    goto error;
+  }
+  if (sftp->version <= 3) {
+    entry->longname = sftp_dir_string(dir);
+    if (entry->longname == NULL) {
+      goto error;
     }
   }
+  pos = dir->buffer->pos;
+  if (sftp_skip_attr(sftp, dir->buffer) < 0) {
+    goto error;
+  }
+  sftp_stat_cache_put_entry(dir, entry->name, dir->buffer->data + pos,
+      dir->buffer->pos - pos);
 
-  /* now dir->buffer contains a buffer and dir->count != 0 */
-  if (dir->count == 0) {
-    ssh_set_error(sftp->session, SSH_FATAL,
-        "Count of files sent by the server is zero, which is invalid, or "
-        "libsftp bug");
-    return NULL;
+  dir->entry_count++;
+  dir->count--;
+
+  return entry;
+error:
+  ssh_set_error(sftp->session, SSH_FATAL, "Invalid SSH_FXP_NAME entry");
+  dir->count = 0;
+  return NULL;
+}
+
+const char *sftp_dir_entry_name(sftp_dir_entry entry) {
+  return entry->name;
+}
+
+sftp_attributes sftp_dir_entry_attributes(sftp_dir dir,
+    sftp_dir_entry entry) {
+  uint32_t pos;
+
+  if (entry->attributes == NULL) {
+    pos = dir->buffer->pos;
+    dir->buffer->pos = entry->offset;
+    entry->attributes = sftp_parse_attr(dir->sftp, dir->buffer, 1);
+    dir->buffer->pos = pos;
+    if (entry->attributes == NULL) {
+      ssh_set_error(dir->sftp->session, SSH_FATAL,
+          "Couldn't parse the SFTP attributes");
+    }
   }
 
-  ssh_log(sftp->session, SSH_LOG_RARE, "Count is %d", dir->count);
+  return entry->attributes;
+}
+
+/* Get a single file attributes structure of a directory. */
+sftp_attributes sftp_readdir(sftp_session sftp, sftp_dir dir) {
+  sftp_dir_entry entry;
+  sftp_attributes attr;
+  uint32_t pos;
+
+  entry = sftp_dir_next(dir);
+  if (entry == NULL) {
+    return NULL;
+  }
 
+  /* the caller owns these ones */
+  pos = dir->buffer->pos;
+  dir->buffer->pos = entry->offset;
   attr = sftp_parse_attr(sftp, dir->buffer, 1);
+  dir->buffer->pos = pos;
   if (attr == NULL) {
     ssh_set_error(sftp->session, SSH_FATAL,
         "Couldn't parse the SFTP attributes");
     return NULL;
   }
 
-  dir->count--;
-  if (dir->count == 0) {
-    ssh_buffer_free(dir->buffer);
-    dir->buffer = NULL;
-  }
-
   return attr;
 }
 
@@ -1527,21 +2441,50 @@ void sftp_attributes_free(sftp_attributes file){
     return;
   }
 
-  ssh_string_free(file->acl);
-  ssh_string_free(file->extended_data);
-  ssh_string_free(file->extended_type);
+  /* the strings of parsed attributes come in the same allocation */
+  if (!file->packed) {
+    ssh_string_free(file->acl);
+    ssh_string_free(file->extended_data);
+    ssh_string_free(file->extended_type);
 
-  SAFE_FREE(file->name);
-  SAFE_FREE(file->longname);
-  SAFE_FREE(file->group);
-  SAFE_FREE(file->owner);
+    SAFE_FREE(file->name);
+    SAFE_FREE(file->longname);
+    SAFE_FREE(file->group);
+    SAFE_FREE(file->owner);
+  }
 
   SAFE_FREE(file);
 }
 
-static int sftp_handle_close(sftp_session sftp, ssh_string handle) {
-  sftp_status_message status;
-  sftp_message msg = NULL;
+int sftp_attributes_get_extended(sftp_attributes attr, uint32_t index,
+    ssh_string *type, ssh_string *data) {
+  const char *pair;
+  uint32_t i;
+
+  if (attr == NULL || attr->extended == NULL ||
+      index >= attr->extended_count) {
+    return SSH_ERROR;
+  }
+
+  pair = attr->extended;
+  for (i = 0; i < index; i++) {
+    pair = sftp_attr_next_string(sftp_attr_next_string(pair));
+  }
+  if (type != NULL) {
+    *type = (ssh_string) pair;
+  }
+  if (data != NULL) {
+    *data = (ssh_string) sftp_attr_next_string(pair);
+  }
+
+  return SSH_OK;
+}
+
+/*
+ * Sends a SSH_FXP_CLOSE of handle.
+ * Returns the id of the request, -1 on error.
+ */
+static int sftp_close_request(sftp_session sftp, ssh_string handle) {
   ssh_buffer buffer = NULL;
   uint32_t id;
 
@@ -1564,6 +2507,19 @@ static int sftp_handle_close(sftp_session sftp, ssh_string handle) {
   }
   ssh_buffer_free(buffer);
 
+  return id;
+}
+
+static int sftp_handle_close(sftp_session sftp, ssh_string handle) {
+  sftp_status_message status;
+  sftp_message msg = NULL;
+  int id;
+
+  id = sftp_close_request(sftp, handle);
+  if (id < 0) {
+    return -1;
+  }
+
   while (msg == NULL) {
     if (sftp_read_and_dispatch(sftp) < 0) {
       /* something nasty has happened */
@@ -1605,9 +2561,24 @@ static int sftp_handle_close(sftp_session sftp, ssh_string handle) {
 int sftp_close(sftp_file file){
   int err = SSH_NO_ERROR;
 
+  /* the handle of an OPEN in flight gets closed too */
+  if (file->opening) {
+    file->nonblocking = 0;
+    if (sftp_async_open(file) == SSH_ERROR && file->opening) {
+      err = SSH_ERROR;
+    }
+  }
+  sftp_read_ahead_drop(file);
+  SAFE_FREE(file->read_ahead);
+  /* the handle is closed even if the writes behind failed */
+  if (sftp_write_behind_end(file) < 0) {
+    err = SSH_ERROR;
+  }
   SAFE_FREE(file->name);
   if (file->handle){
-    err = sftp_handle_close(file->sftp,file->handle);
+    if (sftp_handle_close(file->sftp,file->handle) < 0) {
+      err = SSH_ERROR;
+    }
     ssh_string_free(file->handle);
   }
   /* FIXME: check server response and implement errno */
@@ -1626,19 +2597,23 @@ int sftp_closedir(sftp_dir dir){
     ssh_string_free(dir->handle);
   }
   /* FIXME: check server response and implement errno */
+  sftp_dir_drain(dir);
+  sftp_dir_release(dir);
   ssh_buffer_free(dir->buffer);
+  SAFE_FREE(dir->arena);
   SAFE_FREE(dir);
 
   return err;
 }
 
 /* Open a file on the server. */
-sftp_file sftp_open(sftp_session sftp, const char *file, int flags,
+/*
+ * Sends a SSH_FXP_OPEN of file.
+ * Returns the id of the request, -1 on error.
+ */
+static int sftp_open_request(sftp_session sftp, const char *file, int flags,
     mode_t mode) {
-  sftp_message msg = NULL;
-  sftp_status_message status;
   struct sftp_attributes_struct attr;
-  sftp_file handle;
   ssh_string filename;
   ssh_buffer buffer;
   uint32_t sftp_flags = 0;
@@ -1647,14 +2622,14 @@ sftp_file sftp_open(sftp_session sftp, const char *file, int flags,
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
-    return NULL;
+    return -1;
   }
 
   filename = ssh_string_from_char(file);
   if (filename == NULL) {
     ssh_set_error_oom(sftp->session);
     ssh_buffer_free(buffer);
-    return NULL;
+    return -1;
   }
 
   ZERO_STRUCT(attr);
@@ -1674,14 +2649,14 @@ sftp_file sftp_open(sftp_session sftp, const char *file, int flags,
     sftp_flags |= SSH_FXF_TRUNC;
   if (flags & O_EXCL)
     sftp_flags |= SSH_FXF_EXCL;
-  ssh_log(sftp->session,SSH_LOG_PACKET,"Opening file %s with sftp flags %x",file,sftp_flags);
+  SSH_LOG(sftp->session,SSH_LOG_PACKET,"Opening file %s with sftp flags %x",file,sftp_flags);
   id = sftp_get_new_id(sftp);
   if (buffer_add_u32(buffer, id) < 0 ||
       buffer_add_ssh_string(buffer, filename) < 0) {
     ssh_set_error_oom(sftp->session);
     ssh_buffer_free(buffer);
     ssh_string_free(filename);
-    return NULL;
+    return -1;
   }
   ssh_string_free(filename);
 
@@ -1689,46 +2664,151 @@ sftp_file sftp_open(sftp_session sftp, const char *file, int flags,
       buffer_add_attributes(buffer, &attr) < 0) {
     ssh_set_error_oom(sftp->session);
     ssh_buffer_free(buffer);
-    return NULL;
+    return -1;
   }
   if (sftp_packet_write(sftp, SSH_FXP_OPEN, buffer) < 0) {
     ssh_buffer_free(buffer);
-    return NULL;
+    return -1;
   }
   ssh_buffer_free(buffer);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
-      /* something nasty has happened */
-      return NULL;
-    }
-    msg = sftp_dequeue(sftp, id);
+  return id;
+}
+
+sftp_file sftp_open(sftp_session sftp, const char *file, int flags,
+    mode_t mode) {
+  sftp_file handle;
+
+  handle = sftp_async_open_begin(sftp, file, flags, mode, 0);
+  if (handle == NULL) {
+    return NULL;
+  }
+  if (sftp_async_open(handle) != SSH_OK) {
+    sftp_close(handle);
+    return NULL;
   }
 
-  switch (msg->packet_type) {
-    case SSH_FXP_STATUS:
-      status = parse_status_msg(msg);
-      sftp_message_free(msg);
-      if (status == NULL) {
-        return NULL;
+  return handle;
+}
+
+sftp_file sftp_async_open_begin(sftp_session sftp, const char *file,
+    int flags, mode_t mode, unsigned int reads) {
+  sftp_file handle;
+  int id;
+
+  if (sftp == NULL) {
+    return NULL;
+  }
+  if (file == NULL) {
+    ssh_set_error_invalid(sftp->session, __FUNCTION__);
+    return NULL;
+  }
+
+  handle = malloc(sizeof(struct sftp_file_struct));
+  if (handle == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+  ZERO_STRUCTP(handle);
+  handle->sftp = sftp;
+  /* its writes change the attributes of the path */
+  handle->name = strdup(file);
+  if (handle->name == NULL) {
+    ssh_set_error_oom(sftp->session);
+    SAFE_FREE(handle);
+    return NULL;
+  }
+
+  if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)) {
+    sftp_stat_cache_forget(sftp, file,
+        (flags & O_CREAT) ? SFTP_STAT_CACHE_PARENT : 0);
+  }
+  id = sftp_open_request(sftp, file, flags, mode);
+  if (id < 0) {
+    SAFE_FREE(handle->name);
+    SAFE_FREE(handle);
+    return NULL;
+  }
+  handle->opening = 1;
+  handle->open_id = id;
+  handle->open_reads = reads;
+
+  return handle;
+}
+
+/* Takes the answer to the OPEN of a file. */
+static int sftp_open_reply(sftp_file file, sftp_message msg) {
+  sftp_session sftp = file->sftp;
+  sftp_status_message status;
+
+  file->opening = 0;
+  switch (msg->packet_type) {
+    case SSH_FXP_STATUS:
+      status = parse_status_msg(msg);
+      sftp_message_free(msg);
+      if (status == NULL) {
+        return SSH_ERROR;
       }
       sftp_set_error(sftp, status->status);
       ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
           "SFTP server: %s", status->errormsg);
       status_msg_free(status);
-
-      return NULL;
+      return SSH_ERROR;
     case SSH_FXP_HANDLE:
-      handle = parse_handle_msg(msg);
+      file->handle = buffer_get_ssh_string(msg->payload);
       sftp_message_free(msg);
-      return handle;
+      if (file->handle == NULL) {
+        ssh_set_error(sftp->session, SSH_FATAL,
+            "Invalid SSH_FXP_HANDLE message");
+        return SSH_ERROR;
+      }
+      /* the first READs go right behind the answer */
+      if (file->open_reads > 0 && sftp_read_ahead_start(file) < 0) {
+        return SSH_ERROR;
+      }
+      return SSH_OK;
     default:
       ssh_set_error(sftp->session, SSH_FATAL,
           "Received message %d during open!", msg->packet_type);
       sftp_message_free(msg);
   }
 
-  return NULL;
+  return SSH_ERROR;
+}
+
+int sftp_async_open(sftp_file file) {
+  sftp_session sftp;
+  sftp_message msg;
+  int rc;
+
+  if (file == NULL) {
+    return SSH_ERROR;
+  }
+  sftp = file->sftp;
+  if (!file->opening) {
+    return file->handle != NULL ? SSH_OK : SSH_ERROR;
+  }
+
+  /* other calls may have read the answer already */
+  msg = sftp_dequeue(sftp, file->open_id);
+  while (msg == NULL) {
+    if (file->nonblocking) {
+      rc = sftp_packet_ready(sftp);
+      if (rc < 0) {
+        return SSH_ERROR;
+      } else if (rc == 0) {
+        /* we cannot block */
+        return SSH_AGAIN;
+      }
+    }
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      /* something nasty has happened */
+      return SSH_ERROR;
+    }
+    msg = sftp_dequeue(sftp, file->open_id);
+  }
+
+  return sftp_open_reply(file, msg);
 }
 
 void sftp_file_set_nonblocking(sftp_file handle){
@@ -1738,39 +2818,310 @@ void sftp_file_set_blocking(sftp_file handle){
     handle->nonblocking=0;
 }
 
-/* Read from a file using an opened sftp file handle. */
-ssize_t sftp_read(sftp_file handle, void *buf, size_t count) {
-  sftp_session sftp = handle->sftp;
-  sftp_message msg = NULL;
-  sftp_status_message status;
-  ssh_string datastring;
+/*
+ * Sends a SSH_FXP_READ of len bytes at offset.
+ * Returns the id of the request, -1 on error.
+ */
+static int sftp_read_request(sftp_file file, uint64_t offset, uint32_t len) {
+  sftp_session sftp = file->sftp;
   ssh_buffer buffer;
-  int id;
-
-  if (handle->eof) {
-    return 0;
-  }
+  uint32_t id;
 
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
     return -1;
   }
-  id = sftp_get_new_id(handle->sftp);
+
+  id = sftp_get_new_id(sftp);
   if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, handle->handle) < 0 ||
-      buffer_add_u64(buffer, htonll(handle->offset)) < 0 ||
-      buffer_add_u32(buffer,htonl(count)) < 0) {
+      buffer_add_ssh_string(buffer, file->handle) < 0 ||
+      buffer_add_u64(buffer, htonll(offset)) < 0 ||
+      buffer_add_u32(buffer, htonl(len)) < 0) {
     ssh_set_error_oom(sftp->session);
     ssh_buffer_free(buffer);
     return -1;
   }
-  if (sftp_packet_write(handle->sftp, SSH_FXP_READ, buffer) < 0) {
+  if (sftp_packet_write(sftp, SSH_FXP_READ, buffer) < 0) {
     ssh_buffer_free(buffer);
     return -1;
   }
   ssh_buffer_free(buffer);
 
+  return id;
+}
+
+/*
+ * Once sftp_read() has been called a few times in a row where the last call
+ * stopped, the READs are sent ahead of the offset and the reads are served
+ * from their replies. The READs in flight double up to SFTP_READ_AHEAD_MAX
+ * as long as the reads stay sequential, a seek or a write drops them.
+ */
+#define SFTP_READ_AHEAD_CHUNK (32 * 1024)
+#define SFTP_READ_AHEAD_MIN 2
+#define SFTP_READ_AHEAD_MAX 16
+/* the sequential reads before the READs are sent ahead */
+#define SFTP_READ_AHEAD_AFTER 2
+
+struct sftp_read_ahead_struct {
+  uint64_t expected; /* where the next sequential read starts */
+  unsigned int sequential; /* the reads in a row at expected */
+  unsigned int window; /* the READs to keep in flight */
+  uint64_t next; /* the offset of the next READ */
+  struct {
+    uint32_t id;
+    uint32_t len;
+  } sent[SFTP_READ_AHEAD_MAX]; /* a ring of the READs in flight */
+  unsigned int first;
+  unsigned int count;
+  sftp_message msg; /* the reply read from, at the offset of the file */
+  const unsigned char *data;
+  uint32_t len; /* left in msg */
+};
+
+/* Drops the READs sent ahead and the data not read yet. */
+static void sftp_read_ahead_drop(sftp_file file) {
+  struct sftp_read_ahead_struct *ra = file->read_ahead;
+  sftp_message msg;
+
+  if (ra == NULL) {
+    return;
+  }
+
+  sftp_message_free(ra->msg);
+  ra->msg = NULL;
+  ra->len = 0;
+  /* the replies are read, not to be queued forever */
+  while (ra->count > 0) {
+    msg = sftp_dequeue(file->sftp, ra->sent[ra->first].id);
+    if (msg == NULL) {
+      if (sftp_read_and_dispatch(file->sftp) < 0) {
+        break;
+      }
+      continue;
+    }
+    sftp_message_free(msg);
+    ra->first = (ra->first + 1) % SFTP_READ_AHEAD_MAX;
+    ra->count--;
+  }
+  ra->first = 0;
+  ra->count = 0;
+  ra->window = SFTP_READ_AHEAD_MIN;
+}
+
+/*
+ * Tells whether the read at the offset of the file is sequential enough to
+ * be read ahead, and drops what was read ahead of another offset.
+ * Returns 1 to read ahead, 0 not to, -1 on error.
+ */
+static int sftp_read_ahead_check(sftp_file file) {
+  struct sftp_read_ahead_struct *ra = file->read_ahead;
+
+  if (ra == NULL) {
+    ra = malloc(sizeof(struct sftp_read_ahead_struct));
+    if (ra == NULL) {
+      ssh_set_error_oom(file->sftp->session);
+      return -1;
+    }
+    ZERO_STRUCTP(ra);
+    ra->expected = file->offset;
+    ra->window = SFTP_READ_AHEAD_MIN;
+    file->read_ahead = ra;
+  }
+
+  if (file->offset != ra->expected) {
+    sftp_read_ahead_drop(file);
+    ra->expected = file->offset;
+    ra->sequential = 0;
+  }
+  if (ra->sequential < SFTP_READ_AHEAD_AFTER) {
+    ra->sequential++;
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Sends READs of len bytes until the window is in flight. */
+static int sftp_read_ahead_send(sftp_file file, uint32_t len) {
+  struct sftp_read_ahead_struct *ra = file->read_ahead;
+  unsigned int slot;
+  int id;
+
+  while (ra->count < ra->window) {
+    id = sftp_read_request(file, ra->next, len);
+    if (id < 0) {
+      return -1;
+    }
+    slot = (ra->first + ra->count) % SFTP_READ_AHEAD_MAX;
+    ra->sent[slot].id = id;
+    ra->sent[slot].len = len;
+    ra->count++;
+    ra->next += len;
+  }
+
+  return 0;
+}
+
+/*
+ * Sends the first READs of a file as soon as its handle arrives, the first
+ * sftp_read() calls read from their replies.
+ */
+static int sftp_read_ahead_start(sftp_file file) {
+  struct sftp_read_ahead_struct *ra;
+  sftp_session sftp = file->sftp;
+  uint32_t len = SFTP_READ_AHEAD_CHUNK;
+
+  if (sftp_read_ahead_check(file) < 0) {
+    return -1;
+  }
+  ra = file->read_ahead;
+  ra->sequential = SFTP_READ_AHEAD_AFTER;
+  ra->window = file->open_reads < SFTP_READ_AHEAD_MAX ?
+    file->open_reads : SFTP_READ_AHEAD_MAX;
+  ra->next = file->offset;
+  /* asking for the limits now would wait for the server */
+  if (sftp->limits_asked) {
+    len = sftp_limit_chunk(sftp, len, 0);
+  }
+  if (sftp_read_ahead_send(file, len) < 0) {
+    return -1;
+  }
+  if (ra->window < SFTP_READ_AHEAD_MIN) {
+    ra->window = SFTP_READ_AHEAD_MIN;
+  }
+
+  return 0;
+}
+
+/* Reads from the READs sent ahead, like sftp_read(). */
+static ssize_t sftp_read_ahead(sftp_file file, void *buf, size_t count) {
+  struct sftp_read_ahead_struct *ra = file->read_ahead;
+  sftp_session sftp = file->sftp;
+  sftp_message msg = NULL;
+  sftp_status_message status;
+  const unsigned char *data;
+  uint32_t len;
+  uint32_t n;
+
+  if (ra->len == 0) {
+    sftp_message_free(ra->msg);
+    ra->msg = NULL;
+    if (ra->count == 0) {
+      ra->next = file->offset;
+    }
+    /* the READs follow the size of the reads, when they are bigger */
+    len = count > SFTP_READ_AHEAD_CHUNK ? count : SFTP_READ_AHEAD_CHUNK;
+    len = sftp_limit_chunk(sftp, len, 0);
+    if (sftp_read_ahead_send(file, len) < 0) {
+      return -1;
+    }
+
+    while (msg == NULL) {
+      if (file->nonblocking) {
+        if (ssh_channel_poll(sftp->channel, 0) == 0) {
+          /* we cannot block */
+          return 0;
+        }
+      }
+      if (sftp_read_and_dispatch(sftp) < 0) {
+        /* something nasty has happened */
+        return -1;
+      }
+      msg = sftp_dequeue(sftp, ra->sent[ra->first].id);
+    }
+    len = ra->sent[ra->first].len;
+    ra->first = (ra->first + 1) % SFTP_READ_AHEAD_MAX;
+    ra->count--;
+
+    switch (msg->packet_type) {
+      case SSH_FXP_STATUS:
+        status = parse_status_msg(msg);
+        sftp_message_free(msg);
+        sftp_read_ahead_drop(file);
+        if (status == NULL) {
+          return -1;
+        }
+        sftp_set_error(sftp, status->status);
+        if (status->status == SSH_FX_EOF) {
+          file->eof = 1;
+          status_msg_free(status);
+          return 0;
+        }
+        ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+            "SFTP server: %s", status->errormsg);
+        status_msg_free(status);
+        return -1;
+      case SSH_FXP_DATA:
+        data = buffer_get_ssh_string_view(msg->payload, &n);
+        if (data == NULL || n > len) {
+          ssh_set_error(sftp->session, SSH_FATAL,
+              "Received an invalid DATA packet from sftp server");
+          sftp_message_free(msg);
+          sftp_read_ahead_drop(file);
+          return -1;
+        }
+        if (n < len) {
+          /* the READs after a short one aren't at the right offsets */
+          sftp_read_ahead_drop(file);
+        } else if (ra->window < SFTP_READ_AHEAD_MAX) {
+          ra->window *= 2;
+        }
+        ra->msg = msg;
+        ra->data = data;
+        ra->len = n;
+        break;
+      default:
+        ssh_set_error(sftp->session, SSH_FATAL,
+            "Received message %d during read!", msg->packet_type);
+        sftp_message_free(msg);
+        sftp_read_ahead_drop(file);
+        return -1;
+    }
+  }
+
+  if (count > ra->len) {
+    count = ra->len;
+  }
+  memcpy(buf, ra->data, count);
+  ra->data += count;
+  ra->len -= count;
+  file->offset += count;
+  ra->expected = file->offset;
+
+  return count;
+}
+
+/* Read from a file using an opened sftp file handle. */
+ssize_t sftp_read(sftp_file handle, void *buf, size_t count) {
+  sftp_session sftp = handle->sftp;
+  sftp_message msg = NULL;
+  sftp_status_message status;
+  const void *data;
+  uint32_t len;
+  int id;
+  int rc;
+
+  if (handle->eof) {
+    return 0;
+  }
+  /* the data written behind is read back */
+  if (sftp_write_behind_send(handle) < 0) {
+    return -1;
+  }
+
+  rc = sftp_read_ahead_check(handle);
+  if (rc < 0) {
+    return -1;
+  } else if (rc > 0) {
+    return sftp_read_ahead(handle, buf, count);
+  }
+
+  id = sftp_read_request(handle, handle->offset, count);
+  if (id < 0) {
+    return -1;
+  }
+
   while (msg == NULL) {
     if (handle->nonblocking) {
       if (ssh_channel_poll(handle->sftp->channel, 0) == 0) {
@@ -1806,26 +3157,28 @@ ssize_t sftp_read(sftp_file handle, void *buf, size_t count) {
       status_msg_free(status);
       return -1;
     case SSH_FXP_DATA:
-      datastring = buffer_get_ssh_string(msg->payload);
-      sftp_message_free(msg);
-      if (datastring == NULL) {
+      /* the data is copied straight from the message to the user buffer */
+      data = buffer_get_ssh_string_view(msg->payload, &len);
+      if (data == NULL) {
         ssh_set_error(sftp->session, SSH_FATAL,
             "Received invalid DATA packet from sftp server");
+        sftp_message_free(msg);
         return -1;
       }
 
-      if (ssh_string_len(datastring) > count) {
+      if (len > count) {
         ssh_set_error(sftp->session, SSH_FATAL,
             "Received a too big DATA packet from sftp server: "
-            "%zu and asked for %zu",
-            ssh_string_len(datastring), count);
-        ssh_string_free(datastring);
+            "%u and asked for %zu",
+            len, count);
+        sftp_message_free(msg);
         return -1;
       }
-      count = ssh_string_len(datastring);
+      count = len;
       handle->offset += count;
-      memcpy(buf, ssh_string_data(datastring), count);
-      ssh_string_free(datastring);
+      handle->read_ahead->expected = handle->offset;
+      memcpy(buf, data, count);
+      sftp_message_free(msg);
       return count;
     default:
       ssh_set_error(sftp->session, SSH_FATAL,
@@ -1840,31 +3193,19 @@ ssize_t sftp_read(sftp_file handle, void *buf, size_t count) {
 /* Start an asynchronous read from a file using an opened sftp file handle. */
 int sftp_async_read_begin(sftp_file file, uint32_t len){
   sftp_session sftp = file->sftp;
-  ssh_buffer buffer;
-  uint32_t id;
+  int id;
 
   sftp_enter_function();
 
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return -1;
-  }
-
-  id = sftp_get_new_id(sftp);
-  if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, file->handle) < 0 ||
-      buffer_add_u64(buffer, htonll(file->offset)) < 0 ||
-      buffer_add_u32(buffer, htonl(len)) < 0) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
+  if (sftp_write_behind_send(file) < 0) {
+    sftp_leave_function();
     return -1;
   }
-  if (sftp_packet_write(sftp, SSH_FXP_READ, buffer) < 0) {
-    ssh_buffer_free(buffer);
+  id = sftp_read_request(file, file->offset, len);
+  if (id < 0) {
+    sftp_leave_function();
     return -1;
   }
-  ssh_buffer_free(buffer);
 
   file->offset += len; /* assume we'll read len bytes */
 
@@ -1877,7 +3218,7 @@ int sftp_async_read(sftp_file file, void *data, uint32_t size, uint32_t id){
   sftp_session sftp = file->sftp;
   sftp_message msg = NULL;
   sftp_status_message status;
-  ssh_string datastring;
+  const void *datap;
   int err = SSH_OK;
   uint32_t len;
 
@@ -1927,29 +3268,28 @@ int sftp_async_read(sftp_file file, void *data, uint32_t size, uint32_t id){
       sftp_leave_function();
       return err;
     case SSH_FXP_DATA:
-      datastring = buffer_get_ssh_string(msg->payload);
-      sftp_message_free(msg);
-      if (datastring == NULL) {
+      datap = buffer_get_ssh_string_view(msg->payload, &len);
+      if (datap == NULL) {
         ssh_set_error(sftp->session, SSH_FATAL,
             "Received invalid DATA packet from sftp server");
+        sftp_message_free(msg);
         sftp_leave_function();
         return SSH_ERROR;
       }
-      if (ssh_string_len(datastring) > size) {
+      if (len > size) {
         ssh_set_error(sftp->session, SSH_FATAL,
             "Received a too big DATA packet from sftp server: "
-            "%zu and asked for %u",
-            ssh_string_len(datastring), size);
-        ssh_string_free(datastring);
+            "%u and asked for %u",
+            len, size);
+        sftp_message_free(msg);
         sftp_leave_function();
         return SSH_ERROR;
       }
-      len = ssh_string_len(datastring);
       //handle->offset+=len;
       /* We already have set the offset previously. All we can do is warn that the expected len
        * and effective lengths are different */
-      memcpy(data, ssh_string_data(datastring), len);
-      ssh_string_free(datastring);
+      memcpy(data, datap, len);
+      sftp_message_free(msg);
       sftp_leave_function();
       return len;
     default:
@@ -1963,466 +3303,3020 @@ int sftp_async_read(sftp_file file, void *data, uint32_t size, uint32_t id){
   return SSH_ERROR;
 }
 
-ssize_t sftp_write(sftp_file file, const void *buf, size_t count) {
-  sftp_session sftp = file->sftp;
-  sftp_message msg = NULL;
-  sftp_status_message status;
-  ssh_string datastring;
-  ssh_buffer buffer;
-  uint32_t id;
-  int len;
-  int packetlen;
+/* Seeks in a local file, with 64 bit offsets on Windows too. */
+static int64_t sftp_local_seek(int fd, int64_t offset, int whence) {
+#ifdef _WIN32
+  return _lseeki64(fd, offset, whence);
+#else
+  return lseek(fd, offset, whence);
+#endif
+}
 
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return -1;
-  }
+/* Reads up to len bytes of a local file at offset, fewer at its end. */
+static ssize_t sftp_local_read(int fd, void *data, size_t len,
+    uint64_t offset) {
+  size_t done = 0;
+  ssize_t r;
 
-  datastring = ssh_string_new(count);
-  if (datastring == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    return -1;
-  }
-  ssh_string_fill(datastring, buf, count);
-
-  id = sftp_get_new_id(file->sftp);
-  if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, file->handle) < 0 ||
-      buffer_add_u64(buffer, htonll(file->offset)) < 0 ||
-      buffer_add_ssh_string(buffer, datastring) < 0) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    ssh_string_free(datastring);
-    return -1;
-  }
-  ssh_string_free(datastring);
-  packetlen=buffer_get_rest_len(buffer);
-  len = sftp_packet_write(file->sftp, SSH_FXP_WRITE, buffer);
-  ssh_buffer_free(buffer);
-  if (len < 0) {
-    return -1;
-  } else  if (len != packetlen) {
-    ssh_log(sftp->session, SSH_LOG_PACKET,
-        "Could not write as much data as expected");
-  }
-
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(file->sftp) < 0) {
-      /* something nasty has happened */
+  while (done < len) {
+#ifdef _WIN32
+    if (_lseeki64(fd, offset + done, SEEK_SET) < 0) {
       return -1;
     }
-    msg = sftp_dequeue(file->sftp, id);
-  }
-
-  switch (msg->packet_type) {
-    case SSH_FXP_STATUS:
-      status = parse_status_msg(msg);
-      sftp_message_free(msg);
-      if (status == NULL) {
-        return -1;
-      }
-      sftp_set_error(sftp, status->status);
-      switch (status->status) {
-        case SSH_FX_OK:
-          file->offset += count;
-          status_msg_free(status);
-          return count;
-        default:
-          break;
+    r = read(fd, (char *) data + done, len - done);
+#else
+    r = pread(fd, (char *) data + done, len - done, offset + done);
+#endif
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
       }
-      ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
-          "SFTP server: %s", status->errormsg);
-      file->offset += count;
-      status_msg_free(status);
-      return -1;
-    default:
-      ssh_set_error(sftp->session, SSH_FATAL,
-          "Received message %d during write!", msg->packet_type);
-      sftp_message_free(msg);
       return -1;
+    }
+    if (r == 0) {
+      break;
+    }
+    done += r;
   }
 
-  return -1; /* not reached */
+  return done;
 }
 
-/* Seek to a specific location in a file. */
-int sftp_seek(sftp_file file, uint32_t new_offset) {
-  if (file == NULL) {
-    return -1;
-  }
+/* Writes len bytes at offset in a local file. */
+static int sftp_local_write(int fd, const void *data, size_t len,
+    uint64_t offset) {
+  const char *p = data;
+  ssize_t w;
 
-  file->offset = new_offset;
+  while (len > 0) {
+#ifdef _WIN32
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+      return -1;
+    }
+    w = write(fd, p, len);
+#else
+    w = pwrite(fd, p, len, offset);
+#endif
+    if (w < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    p += w;
+    len -= w;
+    offset += w;
+  }
 
   return 0;
 }
 
-int sftp_seek64(sftp_file file, uint64_t new_offset) {
-  if (file == NULL) {
-    return -1;
-  }
+/* a read in flight of sftp_download() */
+struct sftp_download_request {
+  uint32_t id;
+  uint64_t offset;
+  uint32_t len;
+  uint32_t received; /* by its last reply */
+  int done;
+};
 
-  file->offset = new_offset;
+/* Write the downloaded data to the sink. */
+static int sftp_download_write(sftp_session sftp, sftp_download_sink sink,
+    const void *data, uint32_t len, uint64_t offset) {
+  const char *p = data;
+  ssize_t w;
 
-  return 0;
-}
+  if (sink->write_function != NULL) {
+    if (sink->write_function(data, len, offset, sink->userdata) < 0) {
+      ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+          "Download stopped by the sink");
+      return SSH_ERROR;
+    }
+    return SSH_OK;
+  }
 
-/* Report current byte position in file. */
-unsigned long sftp_tell(sftp_file file) {
-  return (unsigned long)file->offset;
-}
-/* Report current byte position in file. */
-uint64_t sftp_tell64(sftp_file file) {
-  return (uint64_t) file->offset;
-}
+  while (len > 0) {
+    w = write(sink->fd, p, len);
+    if (w < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ssh_set_error(sftp->session, SSH_FATAL,
+          "Error writing the download: %s", strerror(errno));
+      return SSH_ERROR;
+    }
+    p += w;
+    len -= w;
+  }
 
-/* Rewinds the position of the file pointer to the beginning of the file.*/
-void sftp_rewind(sftp_file file) {
-  file->offset = 0;
+  return SSH_OK;
 }
 
-/* code written by Nick */
-int sftp_unlink(sftp_session sftp, const char *file) {
-  sftp_status_message status = NULL;
-  sftp_message msg = NULL;
-  ssh_string filename;
-  ssh_buffer buffer;
-  uint32_t id;
+/*
+ * Where a download to the descriptor of the sink can write the replies as
+ * they arrive: the position of a seekable descriptor, -1 otherwise.
+ */
+static int64_t sftp_download_direct(sftp_download_sink sink) {
+#ifndef _WIN32
+  int flags;
+#endif
 
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
+  if (sink->write_function != NULL) {
     return -1;
   }
-
-  filename = ssh_string_from_char(file);
-  if (filename == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
+#ifndef _WIN32
+  /* pwrite() appends whatever the offset */
+  flags = fcntl(sink->fd, F_GETFL);
+  if (flags < 0 || (flags & O_APPEND)) {
     return -1;
   }
+#endif
 
-  id = sftp_get_new_id(sftp);
-  if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, filename) < 0) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    ssh_string_free(filename);
+  return sftp_local_seek(sink->fd, 0, SEEK_CUR);
+}
+
+/* Download up to length bytes of a file with several reads in flight. */
+static int64_t sftp_download_range(sftp_file file, sftp_download_sink sink,
+    sftp_download_options opts, uint64_t length) {
+  sftp_session sftp = file->sftp;
+  struct sftp_download_request *requests;
+  struct sftp_download_request *r;
+  sftp_status_message status;
+  sftp_message msg;
+  const void *data;
+  uint32_t nrequests = SFTP_DOWNLOAD_REQUESTS;
+  uint32_t chunk_size = SFTP_DOWNLOAD_CHUNK_SIZE;
+  uint32_t head = 0;
+  uint32_t count = 0;
+  uint32_t len;
+  uint32_t i;
+  uint64_t start = file->offset;
+  uint64_t offset = file->offset;
+  uint64_t eof = (uint64_t) -1;
+  uint64_t end;
+  int64_t local;
+  int64_t total = 0;
+  int contiguous = 1;
+  int rc = SSH_OK;
+  int id;
+
+  sftp_enter_function();
+
+  end = length > (uint64_t) -1 - offset ? (uint64_t) -1 : offset + length;
+  if (opts != NULL && opts->requests > 0) {
+    nrequests = opts->requests;
   }
-  if (sftp_packet_write(sftp, SSH_FXP_REMOVE, buffer) < 0) {
-    ssh_buffer_free(buffer);
-    ssh_string_free(filename);
+  if (opts != NULL && opts->chunk_size > 0) {
+    chunk_size = opts->chunk_size;
   }
-  ssh_string_free(filename);
-  ssh_buffer_free(buffer);
+  chunk_size = sftp_limit_chunk(sftp, chunk_size, 0);
+  local = sftp_download_direct(sink);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp)) {
-      return -1;
-    }
-    msg = sftp_dequeue(sftp, id);
+  requests = malloc(nrequests * sizeof(struct sftp_download_request));
+  if (requests == NULL) {
+    ssh_set_error_oom(sftp->session);
+    sftp_leave_function();
+    return SSH_ERROR;
   }
 
-  if (msg->packet_type == SSH_FXP_STATUS) {
-    /* by specification, this command's only supposed to return SSH_FXP_STATUS */
-    status = parse_status_msg(msg);
-    sftp_message_free(msg);
-    if (status == NULL) {
-      return -1;
+  for (;;) {
+    /* keep the pipeline full until EOF or an error */
+    while (rc == SSH_OK && !file->eof && count < nrequests &&
+        offset < end) {
+      len = end - offset < chunk_size ? end - offset : chunk_size;
+      id = sftp_read_request(file, offset, len);
+      if (id < 0) {
+        rc = SSH_ERROR;
+        break;
+      }
+      r = &requests[(head + count) % nrequests];
+      r->id = id;
+      r->offset = offset;
+      r->len = len;
+      r->received = 0;
+      r->done = 0;
+      offset += len;
+      count++;
     }
-    sftp_set_error(sftp, status->status);
-    switch (status->status) {
-      case SSH_FX_OK:
+
+    /*
+     * The reads are done in file order: the offset of the file moves over
+     * the ones answered in full, up to the first hole.
+     */
+    while (count > 0 && requests[head].done) {
+      r = &requests[head];
+      if (contiguous) {
+        file->offset = r->offset + r->received;
+      }
+      if (r->received < r->len) {
+        contiguous = 0;
+      }
+      head = (head + 1) % nrequests;
+      count--;
+    }
+    if (count == 0) {
+      break;
+    }
+
+    /*
+     * A seekable descriptor gets each reply at its offset as it arrives.
+     * Otherwise the replies are taken in file order and the ones arriving
+     * early wait in the message queue.
+     */
+    r = NULL;
+    if (local >= 0) {
+      msg = sftp_read_message(sftp);
+      if (msg == NULL) {
+        SAFE_FREE(requests);
+        sftp_leave_function();
+        return SSH_ERROR;
+      }
+      for (i = 0; i < count; i++) {
+        r = &requests[(head + i) % nrequests];
+        if (!r->done && r->id == msg->id) {
+          break;
+        }
+      }
+      if (i == count) {
+        /* not ours, it waits for its caller */
+        if (sftp_enqueue(sftp, msg) < 0) {
+          sftp_message_free(msg);
+          SAFE_FREE(requests);
+          sftp_leave_function();
+          return SSH_ERROR;
+        }
+        continue;
+      }
+    } else {
+      r = &requests[head];
+      msg = sftp_dequeue(sftp, r->id);
+      while (msg == NULL) {
+        if (sftp_read_and_dispatch(sftp) < 0) {
+          SAFE_FREE(requests);
+          sftp_leave_function();
+          return SSH_ERROR;
+        }
+        msg = sftp_dequeue(sftp, r->id);
+      }
+    }
+    r->done = 1;
+
+    /* after an error or past EOF, the reads still in flight are drained */
+    if (rc != SSH_OK || r->offset >= eof) {
+      sftp_message_free(msg);
+      continue;
+    }
+
+    switch (msg->packet_type) {
+      case SSH_FXP_STATUS:
+        status = parse_status_msg(msg);
+        sftp_message_free(msg);
+        if (status == NULL) {
+          rc = SSH_ERROR;
+          break;
+        }
+        sftp_set_error(sftp, status->status);
+        if (status->status == SSH_FX_EOF) {
+          file->eof = 1;
+          if (r->offset < eof) {
+            eof = r->offset;
+          }
+        } else {
+          ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+              "SFTP server: %s", status->errormsg);
+          rc = SSH_ERROR;
+        }
         status_msg_free(status);
-        return 0;
+        break;
+      case SSH_FXP_DATA:
+        data = buffer_get_ssh_string_view(msg->payload, &len);
+        if (data == NULL || len > r->len) {
+          ssh_set_error(sftp->session, SSH_FATAL,
+              "Received invalid DATA packet from sftp server");
+          sftp_message_free(msg);
+          rc = SSH_ERROR;
+          break;
+        }
+        if (len > 0 && local >= 0) {
+          if (sftp_local_write(sink->fd, data, len,
+                local + (r->offset - start)) < 0) {
+            ssh_set_error(sftp->session, SSH_FATAL,
+                "Error writing the download: %s", strerror(errno));
+            rc = SSH_ERROR;
+          }
+        } else if (len > 0) {
+          rc = sftp_download_write(sftp, sink, data, len, r->offset);
+        }
+        sftp_message_free(msg);
+        if (rc != SSH_OK) {
+          break;
+        }
+        total += len;
+        r->received = len;
+        if (len == 0) {
+          file->eof = 1;
+          if (r->offset < eof) {
+            eof = r->offset;
+          }
+        } else if (len < r->len) {
+          /* a short read, ask again for the rest */
+          id = sftp_read_request(file, r->offset + len, r->len - len);
+          if (id < 0) {
+            rc = SSH_ERROR;
+            break;
+          }
+          r->id = id;
+          r->offset += len;
+          r->len -= len;
+          r->received = 0;
+          r->done = 0;
+        }
+        break;
       default:
+        ssh_set_error(sftp->session, SSH_FATAL,
+            "Received message %d during read!", msg->packet_type);
+        sftp_message_free(msg);
+        rc = SSH_ERROR;
         break;
     }
+  }
 
-    /*
-     * The status should be SSH_FX_OK if the command was successful, if it
-     * didn't, then there was an error
-     */
-    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
-        "SFTP server: %s", status->errormsg);
-    status_msg_free(status);
-    return -1;
-  } else {
-    ssh_set_error(sftp->session,SSH_FATAL,
-        "Received message %d when attempting to remove file", msg->packet_type);
-    sftp_message_free(msg);
+  SAFE_FREE(requests);
+
+  /* leave the descriptor after the data, as write() would */
+  if (local >= 0 &&
+      sftp_local_seek(sink->fd, local + (file->offset - start),
+        SEEK_SET) < 0 && rc == SSH_OK) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Error seeking in the local file: %s", strerror(errno));
+    rc = SSH_ERROR;
   }
+  sftp_leave_function();
 
-  return -1;
+  if (rc != SSH_OK) {
+    return SSH_ERROR;
+  }
+
+  return total;
 }
 
-/* code written by Nick */
-int sftp_rmdir(sftp_session sftp, const char *directory) {
-  sftp_status_message status = NULL;
-  sftp_message msg = NULL;
-  ssh_string filename;
+/* Download a file with several reads in flight. */
+int64_t sftp_download(sftp_file file, sftp_download_sink sink,
+    sftp_download_options opts) {
+  return sftp_download_range(file, sink, opts, (uint64_t) -1);
+}
+
+/*
+ * Sends a SSH_FXP_WRITE of the count bytes of buf at offset.
+ * Returns the id of the request, -1 on error.
+ */
+static int sftp_write_request(sftp_file file, uint64_t offset,
+    const void *buf, uint32_t count) {
+  sftp_session sftp = file->sftp;
   ssh_buffer buffer;
   uint32_t id;
+  int len;
+  int packetlen;
 
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return -1;
-  }
+  sftp_stat_cache_forget(sftp, file->name, 0);
 
-  filename = ssh_string_from_char(directory);
-  if (filename == NULL) {
+  /* id, handle, offset and data, plus the header of sftp_packet_write() */
+  buffer = ssh_buffer_new_sized(sizeof(uint32_t) * 3 + sizeof(uint64_t) +
+      ssh_string_len(file->handle) + count + 5);
+  if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
     return -1;
   }
 
   id = sftp_get_new_id(sftp);
   if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, filename) < 0) {
+      buffer_pack(buffer, "SqdP", file->handle, offset,
+        count, count, buf) < 0) {
     ssh_set_error_oom(sftp->session);
     ssh_buffer_free(buffer);
-    ssh_string_free(filename);
     return -1;
   }
-  if (sftp_packet_write(sftp, SSH_FXP_RMDIR, buffer) < 0) {
-    ssh_buffer_free(buffer);
-    ssh_string_free(filename);
+  packetlen=buffer_get_rest_len(buffer);
+  len = sftp_packet_write(sftp, SSH_FXP_WRITE, buffer);
+  ssh_buffer_free(buffer);
+  if (len < 0) {
     return -1;
+  } else  if (len != packetlen) {
+    SSH_LOG(sftp->session, SSH_LOG_PACKET,
+        "Could not write as much data as expected");
   }
-  ssh_buffer_free(buffer);
-  ssh_string_free(filename);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
-      return -1;
+  return id;
+}
+
+/*
+ * Checks the reply to a SSH_FXP_WRITE and frees it.
+ * Returns SSH_OK if the data has been written, SSH_ERROR otherwise.
+ */
+static int sftp_write_reply(sftp_session sftp, sftp_message msg) {
+  sftp_status_message status;
+
+  switch (msg->packet_type) {
+    case SSH_FXP_STATUS:
+      status = parse_status_msg(msg);
+      sftp_message_free(msg);
+      if (status == NULL) {
+        return SSH_ERROR;
+      }
+      sftp_set_error(sftp, status->status);
+      if (status->status == SSH_FX_OK) {
+        status_msg_free(status);
+        return SSH_OK;
+      }
+      ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+          "SFTP server: %s", status->errormsg);
+      status_msg_free(status);
+      return SSH_ERROR;
+    default:
+      ssh_set_error(sftp->session, SSH_FATAL,
+          "Received message %d during write!", msg->packet_type);
+      sftp_message_free(msg);
+      return SSH_ERROR;
+  }
+}
+
+/*
+ * With write-behind, the writes of a file are gathered in WRITEs of up to
+ * SFTP_WRITE_BEHIND_CHUNK bytes, sent without waiting for their status, up
+ * to SFTP_WRITE_BEHIND_MAX in flight. A WRITE which failed is reported by
+ * the next call writing, flushing or closing the file.
+ */
+#define SFTP_WRITE_BEHIND_CHUNK (32 * 1024)
+#define SFTP_WRITE_BEHIND_MAX 16
+
+struct sftp_write_behind_struct {
+  ssh_buffer data; /* written and not sent yet, at offset */
+  uint64_t offset;
+  uint32_t chunk; /* the size of the WRITEs */
+  uint32_t ids[SFTP_WRITE_BEHIND_MAX]; /* a ring of the WRITEs in flight */
+  unsigned int first;
+  unsigned int count;
+  int failed; /* a WRITE failed since the last report */
+  int status; /* the sftp error of the first one */
+};
+
+/* Waits for the status of the oldest WRITE in flight. */
+static int sftp_write_behind_wait(sftp_file file) {
+  struct sftp_write_behind_struct *wb = file->write_behind;
+  sftp_session sftp = file->sftp;
+  sftp_message msg;
+  uint32_t id = wb->ids[wb->first];
+  int rc = SSH_ERROR;
+
+  wb->first = (wb->first + 1) % SFTP_WRITE_BEHIND_MAX;
+  wb->count--;
+
+  msg = sftp_dequeue(sftp, id);
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      break;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+  if (msg != NULL) {
+    rc = sftp_write_reply(sftp, msg);
+  }
+  if (rc != SSH_OK && !wb->failed) {
+    wb->failed = 1;
+    wb->status = sftp_get_error(sftp);
+  }
+
+  return rc;
+}
+
+/* Sends a WRITE, once there is room in flight. */
+static int sftp_write_behind_request(sftp_file file, uint64_t offset,
+    const void *data, uint32_t len) {
+  struct sftp_write_behind_struct *wb = file->write_behind;
+  int id;
+
+  if (wb->count == SFTP_WRITE_BEHIND_MAX) {
+    /* a failure is kept for the next call */
+    sftp_write_behind_wait(file);
+  }
+  id = sftp_write_request(file, offset, data, len);
+  if (id < 0) {
+    return SSH_ERROR;
+  }
+  wb->ids[(wb->first + wb->count) % SFTP_WRITE_BEHIND_MAX] = id;
+  wb->count++;
+
+  return SSH_OK;
+}
+
+/* Sends the data gathered, before a request which must come after it. */
+static int sftp_write_behind_send(sftp_file file) {
+  struct sftp_write_behind_struct *wb = file->write_behind;
+  uint32_t len;
+
+  if (wb == NULL) {
+    return SSH_OK;
+  }
+  len = buffer_get_rest_len(wb->data);
+  if (len == 0) {
+    return SSH_OK;
+  }
+  if (sftp_write_behind_request(file, wb->offset, buffer_get_rest(wb->data),
+        len) < 0) {
+    return SSH_ERROR;
+  }
+  wb->offset += len;
+  buffer_reinit(wb->data);
+
+  return SSH_OK;
+}
+
+/* Reports a failed WRITE once, with its sftp error. */
+static int sftp_write_behind_report(sftp_file file) {
+  struct sftp_write_behind_struct *wb = file->write_behind;
+
+  if (!wb->failed) {
+    return SSH_OK;
+  }
+  wb->failed = 0;
+  sftp_set_error(file->sftp, wb->status);
+
+  return SSH_ERROR;
+}
+
+/* Sends the data gathered and waits for all the WRITEs in flight. */
+static int sftp_write_behind_flush(sftp_file file) {
+  struct sftp_write_behind_struct *wb = file->write_behind;
+  int rc;
+
+  if (wb == NULL) {
+    return SSH_OK;
+  }
+  rc = sftp_write_behind_send(file);
+  while (wb->count > 0) {
+    sftp_write_behind_wait(file);
+  }
+  if (sftp_write_behind_report(file) < 0) {
+    return SSH_ERROR;
+  }
+
+  return rc;
+}
+
+/* Flushes the writes behind and stops them. */
+static int sftp_write_behind_end(sftp_file file) {
+  int rc;
+
+  if (file->write_behind == NULL) {
+    return SSH_OK;
+  }
+  rc = sftp_write_behind_flush(file);
+  ssh_buffer_free(file->write_behind->data);
+  SAFE_FREE(file->write_behind);
+
+  return rc;
+}
+
+int sftp_file_set_write_behind(sftp_file file, int enable) {
+  struct sftp_write_behind_struct *wb;
+
+  if (file == NULL) {
+    return SSH_ERROR;
+  }
+  if (!enable) {
+    return sftp_write_behind_end(file);
+  }
+  if (file->write_behind != NULL) {
+    return SSH_OK;
+  }
+
+  wb = malloc(sizeof(struct sftp_write_behind_struct));
+  if (wb == NULL) {
+    ssh_set_error_oom(file->sftp->session);
+    return SSH_ERROR;
+  }
+  ZERO_STRUCTP(wb);
+  wb->data = ssh_buffer_new();
+  if (wb->data == NULL) {
+    ssh_set_error_oom(file->sftp->session);
+    SAFE_FREE(wb);
+    return SSH_ERROR;
+  }
+  wb->chunk = sftp_limit_chunk(file->sftp, SFTP_WRITE_BEHIND_CHUNK, 1);
+  wb->offset = file->offset;
+  file->write_behind = wb;
+
+  return SSH_OK;
+}
+
+int sftp_flush(sftp_file file) {
+  if (file == NULL) {
+    return SSH_ERROR;
+  }
+
+  return sftp_write_behind_flush(file);
+}
+
+/* Writes behind, like sftp_write(). */
+static ssize_t sftp_write_behind(sftp_file file, const void *buf,
+    size_t count) {
+  struct sftp_write_behind_struct *wb = file->write_behind;
+  const unsigned char *p = buf;
+  size_t left = count;
+  uint32_t len;
+  uint32_t n;
+
+  if (sftp_write_behind_report(file) < 0) {
+    return -1;
+  }
+  /* after a seek, the data gathered goes at its own offset */
+  len = buffer_get_rest_len(wb->data);
+  if (len > 0 && wb->offset + len != file->offset &&
+      sftp_write_behind_send(file) < 0) {
+    return -1;
+  }
+  if (buffer_get_rest_len(wb->data) == 0) {
+    wb->offset = file->offset;
+  }
+
+  while (left > 0) {
+    len = buffer_get_rest_len(wb->data);
+    if (len == 0 && left >= wb->chunk) {
+      /* the whole WRITEs aren't copied */
+      if (sftp_write_behind_request(file, wb->offset, p, wb->chunk) < 0) {
+        break;
+      }
+      wb->offset += wb->chunk;
+      p += wb->chunk;
+      left -= wb->chunk;
+      continue;
+    }
+    n = wb->chunk - len;
+    if (n > left) {
+      n = left;
+    }
+    if (buffer_add_data(wb->data, p, n) < 0) {
+      ssh_set_error_oom(file->sftp->session);
+      break;
+    }
+    p += n;
+    left -= n;
+    if (len + n == wb->chunk && sftp_write_behind_send(file) < 0) {
+      break;
+    }
+  }
+  /* what was taken is at the offset, even on error */
+  file->offset += count - left;
+  if (left > 0) {
+    return -1;
+  }
+
+  return count;
+}
+
+ssize_t sftp_write(sftp_file file, const void *buf, size_t count) {
+  sftp_session sftp = file->sftp;
+  sftp_message msg = NULL;
+  int id;
+  int rc;
+
+  sftp_read_ahead_drop(file);
+  if (file->write_behind != NULL) {
+    return sftp_write_behind(file, buf, count);
+  }
+  id = sftp_write_request(file, file->offset, buf, count);
+  if (id < 0) {
+    return -1;
+  }
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(file->sftp) < 0) {
+      /* something nasty has happened */
+      return -1;
+    }
+    msg = sftp_dequeue(file->sftp, id);
+  }
+
+  rc = sftp_write_reply(sftp, msg);
+  file->offset += count;
+  if (rc != SSH_OK) {
+    return -1;
+  }
+
+  return count;
+}
+
+/* Start an asynchronous write to a file using an opened sftp file handle. */
+int sftp_async_write_begin(sftp_file file, const void *buf, uint32_t len) {
+  sftp_session sftp = file->sftp;
+  int id;
+
+  sftp_enter_function();
+
+  sftp_read_ahead_drop(file);
+  if (sftp_write_behind_send(file) < 0) {
+    sftp_leave_function();
+    return -1;
+  }
+  id = sftp_write_request(file, file->offset, buf, len);
+  if (id < 0) {
+    sftp_leave_function();
+    return -1;
+  }
+
+  file->offset += len; /* assume the write will succeed */
+
+  sftp_leave_function();
+  return id;
+}
+
+/* Wait for an asynchronous write to complete. */
+int sftp_async_write_end(sftp_file file, uint32_t id) {
+  sftp_session sftp = file->sftp;
+  sftp_message msg;
+  int rc;
+
+  sftp_enter_function();
+
+  msg = sftp_dequeue(sftp, id);
+  while (msg == NULL) {
+    if (file->nonblocking) {
+      if (ssh_channel_poll(sftp->channel, 0) == 0) {
+        /* we cannot block */
+        sftp_leave_function();
+        return SSH_AGAIN;
+      }
+    }
+
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      /* something nasty has happened */
+      sftp_leave_function();
+      return SSH_ERROR;
+    }
+
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  rc = sftp_write_reply(sftp, msg);
+
+  sftp_leave_function();
+  return rc;
+}
+
+#ifdef HAVE_SYS_MMAN_H
+#define SFTP_MAP_WINDOW (16 * 1024 * 1024)
+/* smaller files are cheaper to read */
+#define SFTP_MAP_MIN (64 * 1024)
+#endif
+
+/*
+ * A window of a regular local file mapped for an upload, the writes are
+ * built from the mapping rather than read into a buffer first. The file is
+ * mapped up to its size when the upload starts.
+ */
+struct sftp_local_map {
+  int fd;
+  uint64_t size; /* 0 if the file isn't mapped */
+  char *data;
+  uint64_t start; /* offset of the window in the file */
+  size_t len;
+};
+
+static void sftp_local_map_init(struct sftp_local_map *map, int fd,
+    int64_t offset) {
+#ifdef HAVE_SYS_MMAN_H
+  struct stat st;
+#endif
+
+  ZERO_STRUCTP(map);
+  map->fd = fd;
+#ifdef HAVE_SYS_MMAN_H
+  if (offset >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size - offset >= SFTP_MAP_MIN) {
+    map->size = st.st_size;
+  }
+#else
+  (void) offset;
+#endif
+}
+
+static void sftp_local_map_free(struct sftp_local_map *map) {
+#ifdef HAVE_SYS_MMAN_H
+  if (map->data != NULL) {
+    munmap(map->data, map->len);
+  }
+#endif
+  map->data = NULL;
+  map->len = 0;
+}
+
+/*
+ * Gets up to *len bytes of the file at offset from the mapping, moving the
+ * window if needed. Returns NULL past the mapped size or if the file can't
+ * be mapped, to be read instead.
+ */
+static const char *sftp_local_map_get(struct sftp_local_map *map,
+    uint64_t offset, uint32_t *len) {
+#ifdef HAVE_SYS_MMAN_H
+  uint64_t start;
+  uint64_t size;
+  void *data;
+
+  if (offset >= map->size) {
+    return NULL;
+  }
+  if (*len > map->size - offset) {
+    *len = map->size - offset;
+  }
+
+  if (map->data == NULL || offset < map->start ||
+      offset + *len > map->start + map->len) {
+    sftp_local_map_free(map);
+    start = offset - offset % sysconf(_SC_PAGESIZE);
+    size = offset + *len - start;
+    if (size < SFTP_MAP_WINDOW) {
+      size = SFTP_MAP_WINDOW;
+    }
+    if (size > map->size - start) {
+      size = map->size - start;
+    }
+    data = mmap(NULL, size, PROT_READ, MAP_SHARED, map->fd, (off_t) start);
+    if (data == MAP_FAILED) {
+      map->size = 0;
+      return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(data, size, MADV_SEQUENTIAL);
+#endif
+    map->data = data;
+    map->start = start;
+    map->len = size;
+  }
+
+  return map->data + (offset - map->start);
+#else
+  (void) map;
+  (void) offset;
+  (void) len;
+  return NULL;
+#endif
+}
+
+/* a write in flight of sftp_upload() */
+struct sftp_upload_request {
+  uint32_t id;
+  uint64_t offset;
+  uint32_t len;
+};
+
+/*
+ * Read the next chunk of the upload from the source.
+ * Returns the number of bytes read, 0 at the end, SSH_ERROR on error.
+ */
+static ssize_t sftp_upload_read(sftp_session sftp, sftp_upload_source source,
+    void *data, uint32_t len, uint64_t offset) {
+  ssize_t r;
+
+  if (source->read_function != NULL) {
+    r = source->read_function(data, len, offset, source->userdata);
+    if (r < 0 || r > (ssize_t) len) {
+      ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+          "Upload stopped by the source");
+      return SSH_ERROR;
+    }
+    return r;
+  }
+
+  do {
+    r = read(source->fd, data, len);
+  } while (r < 0 && errno == EINTR);
+  if (r < 0) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Error reading the upload: %s", strerror(errno));
+    return SSH_ERROR;
+  }
+
+  return r;
+}
+
+/* Upload to a file with several writes in flight. */
+int64_t sftp_upload(sftp_upload_source source, sftp_file file,
+    sftp_upload_options opts) {
+  sftp_session sftp = file->sftp;
+  struct sftp_upload_request *requests;
+  struct sftp_upload_request *r;
+  struct sftp_local_map map;
+  sftp_message msg;
+  uint32_t nrequests = SFTP_UPLOAD_REQUESTS;
+  uint32_t chunk_size = SFTP_UPLOAD_CHUNK_SIZE;
+  uint32_t head = 0;
+  uint32_t count = 0;
+  uint32_t n;
+  uint64_t offset = file->offset;
+  int64_t local = -1;
+  int64_t total = 0;
+  ssize_t len;
+  const char *p;
+  void *data;
+  int done = 0;
+  int rc = SSH_OK;
+  int id;
+
+  sftp_enter_function();
+
+  if (opts != NULL && opts->requests > 0) {
+    nrequests = opts->requests;
+  }
+  if (opts != NULL && opts->chunk_size > 0) {
+    chunk_size = opts->chunk_size;
+  }
+  chunk_size = sftp_limit_chunk(sftp, chunk_size, 1);
+
+  requests = malloc(nrequests * sizeof(struct sftp_upload_request));
+  data = malloc(chunk_size);
+  if (requests == NULL || data == NULL) {
+    ssh_set_error_oom(sftp->session);
+    SAFE_FREE(requests);
+    SAFE_FREE(data);
+    sftp_leave_function();
+    return SSH_ERROR;
+  }
+
+  /* a seekable descriptor is read at its offsets, mapped if it can be */
+  if (source->read_function == NULL) {
+    local = sftp_local_seek(source->fd, 0, SEEK_CUR);
+  }
+  sftp_local_map_init(&map, source->fd, local);
+
+  for (;;) {
+    /* keep the window full until the end of the source or an error */
+    while (rc == SSH_OK && !done && count < nrequests) {
+      n = chunk_size;
+      p = local >= 0 ? sftp_local_map_get(&map, local, &n) : NULL;
+      if (p != NULL) {
+        len = n;
+      } else if (local >= 0) {
+        p = data;
+        len = sftp_local_read(source->fd, data, chunk_size, local);
+        if (len < 0) {
+          ssh_set_error(sftp->session, SSH_FATAL,
+              "Error reading the upload: %s", strerror(errno));
+        }
+      } else {
+        p = data;
+        len = sftp_upload_read(sftp, source, data, chunk_size, offset);
+      }
+      if (len <= 0) {
+        rc = len < 0 ? SSH_ERROR : SSH_OK;
+        done = 1;
+        break;
+      }
+      id = sftp_write_request(file, offset, p, len);
+      if (id < 0) {
+        rc = SSH_ERROR;
+        break;
+      }
+      if (local >= 0) {
+        local += len;
+      }
+      r = &requests[(head + count) % nrequests];
+      r->id = id;
+      r->offset = offset;
+      r->len = len;
+      offset += len;
+      count++;
+
+      /* the replies already received are checked without waiting */
+      if (ssh_channel_poll(sftp->channel, 0) > 0) {
+        break;
+      }
+    }
+    if (count == 0) {
+      break;
+    }
+
+    /*
+     * The replies are checked in file order. The window waits for the
+     * oldest one only when it is full or the source is over; after an
+     * error, the writes still in flight are only drained.
+     */
+    r = &requests[head];
+    msg = sftp_dequeue(sftp, r->id);
+    while (msg == NULL) {
+      if (rc == SSH_OK && !done && count < nrequests &&
+          ssh_channel_poll(sftp->channel, 0) <= 0) {
+        break;
+      }
+      if (sftp_read_and_dispatch(sftp) < 0) {
+        sftp_local_map_free(&map);
+        SAFE_FREE(requests);
+        SAFE_FREE(data);
+        sftp_leave_function();
+        return SSH_ERROR;
+      }
+      msg = sftp_dequeue(sftp, r->id);
+    }
+    if (msg == NULL) {
+      continue;
+    }
+
+    if (rc != SSH_OK) {
+      sftp_message_free(msg);
+    } else {
+      rc = sftp_write_reply(sftp, msg);
+      if (rc == SSH_OK) {
+        total += r->len;
+        file->offset = r->offset + r->len;
+      }
+    }
+    head = (head + 1) % nrequests;
+    count--;
+  }
+
+  sftp_local_map_free(&map);
+  SAFE_FREE(requests);
+  SAFE_FREE(data);
+
+  /* leave the descriptor after the data sent, as read() would */
+  if (local >= 0 && sftp_local_seek(source->fd, local, SEEK_SET) < 0 &&
+      rc == SSH_OK) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Error seeking in the local file: %s", strerror(errno));
+    rc = SSH_ERROR;
+  }
+  sftp_leave_function();
+
+  if (rc != SSH_OK) {
+    return SSH_ERROR;
+  }
+
+  return total;
+}
+
+/* Seek to a specific location in a file. */
+int sftp_seek(sftp_file file, uint32_t new_offset) {
+  return sftp_seek64(file, new_offset);
+}
+
+int sftp_seek64(sftp_file file, uint64_t new_offset) {
+  if (file == NULL) {
+    return -1;
+  }
+
+  /* what was read ahead is kept while the offset doesn't change */
+  if (new_offset != file->offset) {
+    sftp_read_ahead_drop(file);
+  }
+  file->offset = new_offset;
+
+  return 0;
+}
+
+/* Report current byte position in file. */
+unsigned long sftp_tell(sftp_file file) {
+  return (unsigned long)file->offset;
+}
+/* Report current byte position in file. */
+uint64_t sftp_tell64(sftp_file file) {
+  return (uint64_t) file->offset;
+}
+
+/* Rewinds the position of the file pointer to the beginning of the file.*/
+void sftp_rewind(sftp_file file) {
+  sftp_seek64(file, 0);
+}
+
+/* code written by Nick */
+int sftp_unlink(sftp_session sftp, const char *file) {
+  sftp_status_message status = NULL;
+  sftp_message msg = NULL;
+  ssh_string filename;
+  ssh_buffer buffer;
+  uint32_t id;
+
+  sftp_stat_cache_forget(sftp, file, SFTP_STAT_CACHE_PARENT);
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+
+  filename = ssh_string_from_char(file);
+  if (filename == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, filename) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    ssh_string_free(filename);
+  }
+  if (sftp_packet_write(sftp, SSH_FXP_REMOVE, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(filename);
+  }
+  ssh_string_free(filename);
+  ssh_buffer_free(buffer);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp)) {
+      return -1;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  if (msg->packet_type == SSH_FXP_STATUS) {
+    /* by specification, this command's only supposed to return SSH_FXP_STATUS */
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return -1;
+    }
+    sftp_set_error(sftp, status->status);
+    switch (status->status) {
+      case SSH_FX_OK:
+        status_msg_free(status);
+        return 0;
+      default:
+        break;
+    }
+
+    /*
+     * The status should be SSH_FX_OK if the command was successful, if it
+     * didn't, then there was an error
+     */
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+    return -1;
+  } else {
+    ssh_set_error(sftp->session,SSH_FATAL,
+        "Received message %d when attempting to remove file", msg->packet_type);
+    sftp_message_free(msg);
+  }
+
+  return -1;
+}
+
+/* code written by Nick */
+int sftp_rmdir(sftp_session sftp, const char *directory) {
+  sftp_status_message status = NULL;
+  sftp_message msg = NULL;
+  ssh_string filename;
+  ssh_buffer buffer;
+  uint32_t id;
+
+  sftp_stat_cache_forget(sftp, directory, SFTP_STAT_CACHE_PARENT);
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+
+  filename = ssh_string_from_char(directory);
+  if (filename == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, filename) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    ssh_string_free(filename);
+    return -1;
+  }
+  if (sftp_packet_write(sftp, SSH_FXP_RMDIR, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(filename);
+    return -1;
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(filename);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return -1;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  /* By specification, this command returns SSH_FXP_STATUS */
+  if (msg->packet_type == SSH_FXP_STATUS) {
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return -1;
+    }
+    sftp_set_error(sftp, status->status);
+    switch (status->status) {
+      case SSH_FX_OK:
+        status_msg_free(status);
+        return 0;
+        break;
+      default:
+        break;
+    }
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+    return -1;
+  } else {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received message %d when attempting to remove directory",
+        msg->packet_type);
+    sftp_message_free(msg);
+  }
+
+  return -1;
+}
+
+/* Code written by Nick */
+int sftp_mkdir(sftp_session sftp, const char *directory, mode_t mode) {
+  sftp_status_message status = NULL;
+  sftp_message msg = NULL;
+  sftp_attributes errno_attr = NULL;
+  struct sftp_attributes_struct attr;
+  ssh_buffer buffer;
+  ssh_string path;
+  uint32_t id;
+
+  sftp_stat_cache_forget(sftp, directory, SFTP_STAT_CACHE_PARENT);
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+
+  path = ssh_string_from_char(directory);
+  if (path == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+
+  ZERO_STRUCT(attr);
+  attr.permissions = mode;
+  attr.flags = SSH_FILEXFER_ATTR_PERMISSIONS;
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, path) < 0 ||
+      buffer_add_attributes(buffer, &attr) < 0 ||
+      sftp_packet_write(sftp, SSH_FXP_MKDIR, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(path);
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(path);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return -1;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  /* By specification, this command only returns SSH_FXP_STATUS */
+  if (msg->packet_type == SSH_FXP_STATUS) {
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return -1;
+    }
+    sftp_set_error(sftp, status->status);
+    switch (status->status) {
+      case SSH_FX_FAILURE:
+        /*
+         * mkdir always returns a failure, even if the path already exists.
+         * To be POSIX conform and to be able to map it to EEXIST a stat
+         * call is needed here.
+         */
+        errno_attr = sftp_lstat(sftp, directory);
+        if (errno_attr != NULL) {
+          SAFE_FREE(errno_attr);
+          sftp_set_error(sftp, SSH_FX_FILE_ALREADY_EXISTS);
+        }
+        break;
+      case SSH_FX_OK:
+        status_msg_free(status);
+        return 0;
+        break;
+      default:
+        break;
+    }
+    /*
+     * The status should be SSH_FX_OK if the command was successful, if it
+     * didn't, then there was an error
+     */
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+    return -1;
+  } else {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received message %d when attempting to make directory",
+        msg->packet_type);
+    sftp_message_free(msg);
+  }
+
+  return -1;
+}
+
+/* code written by nick */
+int sftp_rename(sftp_session sftp, const char *original, const char *newname) {
+  sftp_status_message status = NULL;
+  sftp_message msg = NULL;
+  ssh_buffer buffer;
+  ssh_string oldpath;
+  ssh_string newpath;
+  uint32_t id;
+
+  sftp_stat_cache_forget(sftp, original,
+      SFTP_STAT_CACHE_PARENT | SFTP_STAT_CACHE_CHILDREN);
+  sftp_stat_cache_forget(sftp, newname,
+      SFTP_STAT_CACHE_PARENT | SFTP_STAT_CACHE_CHILDREN);
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+
+  oldpath = ssh_string_from_char(original);
+  if (oldpath == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+
+  newpath = ssh_string_from_char(newname);
+  if (newpath == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    ssh_string_free(oldpath);
+    return -1;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, oldpath) < 0 ||
+      buffer_add_ssh_string(buffer, newpath) < 0 ||
+      /* POSIX rename atomically replaces newpath, we should do the same
+       * only available on >=v4 */
+      sftp->version>=4 ? (buffer_add_u32(buffer, SSH_FXF_RENAME_OVERWRITE) < 0):0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    ssh_string_free(oldpath);
+    ssh_string_free(newpath);
+    return -1;
+  }
+  if (sftp_packet_write(sftp, SSH_FXP_RENAME, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(oldpath);
+    ssh_string_free(newpath);
+    return -1;
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(oldpath);
+  ssh_string_free(newpath);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return -1;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  /* By specification, this command only returns SSH_FXP_STATUS */
+  if (msg->packet_type == SSH_FXP_STATUS) {
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return -1;
+    }
+    sftp_set_error(sftp, status->status);
+    switch (status->status) {
+      case SSH_FX_OK:
+        status_msg_free(status);
+        return 0;
+      default:
+        break;
+    }
+    /*
+     * Status should be SSH_FX_OK if the command was successful, if it didn't,
+     * then there was an error
+     */
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+    return -1;
+  } else {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received message %d when attempting to rename",
+        msg->packet_type);
+    sftp_message_free(msg);
+  }
+
+  return -1;
+}
+
+/* Code written by Nick */
+/* Set file attributes on a file, directory or symbolic link. */
+int sftp_setstat(sftp_session sftp, const char *file, sftp_attributes attr) {
+  uint32_t id;
+  ssh_buffer buffer;
+  ssh_string path;
+  sftp_message msg = NULL;
+  sftp_status_message status = NULL;
+
+  sftp_stat_cache_forget(sftp, file, 0);
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+
+  path = ssh_string_from_char(file);
+  if (path == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, path) < 0 ||
+      buffer_add_attributes(buffer, attr) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    ssh_string_free(path);
+    return -1;
+  }
+  if (sftp_packet_write(sftp, SSH_FXP_SETSTAT, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(path);
+    return -1;
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(path);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return -1;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  /* By specification, this command only returns SSH_FXP_STATUS */
+  if (msg->packet_type == SSH_FXP_STATUS) {
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return -1;
+    }
+    sftp_set_error(sftp, status->status);
+    switch (status->status) {
+      case SSH_FX_OK:
+        status_msg_free(status);
+        return 0;
+      default:
+        break;
+    }
+    /*
+     * The status should be SSH_FX_OK if the command was successful, if it
+     * didn't, then there was an error
+     */
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+    return -1;
+  } else {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received message %d when attempting to set stats", msg->packet_type);
+    sftp_message_free(msg);
+  }
+
+  return -1;
+}
+
+/* Change the file owner and group */
+int sftp_chown(sftp_session sftp, const char *file, uid_t owner, gid_t group) {
+	struct sftp_attributes_struct attr;
+  ZERO_STRUCT(attr);
+
+  attr.uid = owner;
+  attr.gid = group;
+
+  attr.flags = SSH_FILEXFER_ATTR_UIDGID;
+
+  return sftp_setstat(sftp, file, &attr);
+}
+
+/* Change permissions of a file */
+int sftp_chmod(sftp_session sftp, const char *file, mode_t mode) {
+	struct sftp_attributes_struct attr;
+  ZERO_STRUCT(attr);
+  attr.permissions = mode;
+  attr.flags = SSH_FILEXFER_ATTR_PERMISSIONS;
+
+  return sftp_setstat(sftp, file, &attr);
+}
+
+/* Change the last modification and access time of a file. */
+int sftp_utimes(sftp_session sftp, const char *file,
+    const struct timeval *times) {
+	struct sftp_attributes_struct attr;
+  ZERO_STRUCT(attr);
+
+  attr.atime = times[0].tv_sec;
+  attr.atime_nseconds = times[0].tv_usec;
+
+  attr.mtime = times[1].tv_sec;
+  attr.mtime_nseconds = times[1].tv_usec;
+
+  attr.flags |= SSH_FILEXFER_ATTR_ACCESSTIME | SSH_FILEXFER_ATTR_MODIFYTIME |
+    SSH_FILEXFER_ATTR_SUBSECOND_TIMES;
+
+  return sftp_setstat(sftp, file, &attr);
+}
+
+int sftp_symlink(sftp_session sftp, const char *target, const char *dest) {
+  sftp_status_message status = NULL;
+  sftp_message msg = NULL;
+  ssh_string target_s;
+  ssh_string dest_s;
+  ssh_buffer buffer;
+  uint32_t id;
+
+  if (sftp == NULL)
+    return -1;
+  if (target == NULL || dest == NULL) {
+    ssh_set_error_invalid(sftp->session, __FUNCTION__);
+    return -1;
+  }
+
+  sftp_stat_cache_forget(sftp, dest, SFTP_STAT_CACHE_PARENT);
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+
+  target_s = ssh_string_from_char(target);
+  if (target_s == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+
+  dest_s = ssh_string_from_char(dest);
+  if (dest_s == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_string_free(target_s);
+    ssh_buffer_free(buffer);
+    return -1;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    ssh_string_free(dest_s);
+    ssh_string_free(target_s);
+    return -1;
+  }
+  if (ssh_get_openssh_version(sftp->session)) {
+    /* TODO check for version number if they ever fix it. */
+    if (buffer_add_ssh_string(buffer, target_s) < 0 ||
+      buffer_add_ssh_string(buffer, dest_s) < 0) {
+      ssh_set_error_oom(sftp->session);
+      ssh_buffer_free(buffer);
+      ssh_string_free(dest_s);
+      ssh_string_free(target_s);
+      return -1;
+    }
+  } else {
+    if (buffer_add_ssh_string(buffer, dest_s) < 0 ||
+      buffer_add_ssh_string(buffer, target_s) < 0) {
+      ssh_set_error_oom(sftp->session);
+      ssh_buffer_free(buffer);
+      ssh_string_free(dest_s);
+      ssh_string_free(target_s);
+      return -1;
+    }
+  }
+
+  if (sftp_packet_write(sftp, SSH_FXP_SYMLINK, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(dest_s);
+    ssh_string_free(target_s);
+    return -1;
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(dest_s);
+  ssh_string_free(target_s);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return -1;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  /* By specification, this command only returns SSH_FXP_STATUS */
+  if (msg->packet_type == SSH_FXP_STATUS) {
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return -1;
+    }
+    sftp_set_error(sftp, status->status);
+    switch (status->status) {
+      case SSH_FX_OK:
+        status_msg_free(status);
+        return 0;
+      default:
+        break;
+    }
+    /*
+     * The status should be SSH_FX_OK if the command was successful, if it
+     * didn't, then there was an error
+     */
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+    return -1;
+  } else {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received message %d when attempting to set stats", msg->packet_type);
+    sftp_message_free(msg);
+  }
+
+  return -1;
+}
+
+char *sftp_readlink(sftp_session sftp, const char *path) {
+  sftp_status_message status = NULL;
+  sftp_message msg = NULL;
+  ssh_string path_s = NULL;
+  ssh_string link_s = NULL;
+  ssh_buffer buffer;
+  char *lnk;
+  uint32_t ignored;
+  uint32_t id;
+
+  if (sftp == NULL)
+    return NULL;
+  if (path == NULL) {
+    ssh_set_error_invalid(sftp, __FUNCTION__);
+    return NULL;
+  }
+  if (sftp->version < 3){
+    ssh_set_error(sftp,SSH_REQUEST_DENIED,"sftp version %d does not support sftp_readlink",sftp->version);
+    return NULL;
+  }
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+
+  path_s = ssh_string_from_char(path);
+  if (path_s == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return NULL;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, path_s) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    ssh_string_free(path_s);
+    return NULL;
+  }
+  if (sftp_packet_write(sftp, SSH_FXP_READLINK, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(path_s);
+    return NULL;
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(path_s);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return NULL;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  if (msg->packet_type == SSH_FXP_NAME) {
+    /* we don't care about "count" */
+    buffer_get_u32(msg->payload, &ignored);
+    /* we only care about the file name string */
+    link_s = buffer_get_ssh_string(msg->payload);
+    sftp_message_free(msg);
+    if (link_s == NULL) {
+      /* TODO: what error to set here? */
+      return NULL;
+    }
+    lnk = ssh_string_to_char(link_s);
+    ssh_string_free(link_s);
+
+    return lnk;
+  } else if (msg->packet_type == SSH_FXP_STATUS) { /* bad response (error) */
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return NULL;
+    }
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+  } else { /* this shouldn't happen */
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received message %d when attempting to set stats", msg->packet_type);
+    sftp_message_free(msg);
+  }
+
+  return NULL;
+}
+
+static sftp_statvfs_t sftp_parse_statvfs(sftp_session sftp, ssh_buffer buf) {
+	sftp_statvfs_t  statvfs;
+  uint64_t tmp;
+  int ok = 0;
+
+  statvfs = malloc(sizeof(struct sftp_statvfs_struct));
+  if (statvfs == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+  ZERO_STRUCTP(statvfs);
+
+  /* try .. catch */
+  do {
+    /* file system block size */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_bsize = ntohll(tmp);
+
+    /* fundamental fs block size */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_frsize = ntohll(tmp);
+
+    /* number of blocks (unit f_frsize) */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_blocks = ntohll(tmp);
+
+    /* free blocks in file system */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_bfree = ntohll(tmp);
+
+    /* free blocks for non-root */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_bavail = ntohll(tmp);
+
+    /* total file inodes */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_files = ntohll(tmp);
+
+    /* free file inodes */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_ffree = ntohll(tmp);
+
+    /* free file inodes for to non-root */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_favail = ntohll(tmp);
+
+    /* file system id */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_fsid = ntohll(tmp);
+
+    /* bit mask of f_flag values */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_flag = ntohll(tmp);
+
+    /* maximum filename length */
+    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+      break;
+    }
+    statvfs->f_namemax = ntohll(tmp);
+
+    ok = 1;
+  } while(0);
+
+  if (!ok) {
+    SAFE_FREE(statvfs);
+    ssh_set_error(sftp->session, SSH_FATAL, "Invalid statvfs structure");
+    return NULL;
+  }
+
+  return statvfs;
+}
+
+sftp_statvfs_t sftp_statvfs(sftp_session sftp, const char *path) {
+  sftp_status_message status = NULL;
+  sftp_message msg = NULL;
+  ssh_string pathstr;
+  ssh_string ext;
+  ssh_buffer buffer;
+  uint32_t id;
+
+  if (sftp == NULL)
+    return NULL;
+  if (path == NULL) {
+    ssh_set_error_invalid(sftp->session, __FUNCTION__);
+    return NULL;
+  }
+  if (sftp->version < 3){
+    ssh_set_error(sftp,SSH_REQUEST_DENIED,"sftp version %d does not support sftp_statvfs",sftp->version);
+    return NULL;
+  }
+ 
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+
+  ext = ssh_string_from_char("statvfs@openssh.com");
+  if (ext == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return NULL;
+  }
+
+  pathstr = ssh_string_from_char(path);
+  if (pathstr == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    ssh_string_free(ext);
+    return NULL;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, ext) < 0 ||
+      buffer_add_ssh_string(buffer, pathstr) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    ssh_string_free(ext);
+    ssh_string_free(pathstr);
+    return NULL;
+  }
+  if (sftp_packet_write(sftp, SSH_FXP_EXTENDED, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(ext);
+    ssh_string_free(pathstr);
+    return NULL;
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(ext);
+  ssh_string_free(pathstr);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return NULL;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  if (msg->packet_type == SSH_FXP_EXTENDED_REPLY) {
+  	sftp_statvfs_t  buf = sftp_parse_statvfs(sftp, msg->payload);
+    sftp_message_free(msg);
+    if (buf == NULL) {
+      return NULL;
+    }
+
+    return buf;
+  } else if (msg->packet_type == SSH_FXP_STATUS) { /* bad response (error) */
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return NULL;
+    }
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+  } else { /* this shouldn't happen */
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received message %d when attempting to get statvfs", msg->packet_type);
+    sftp_message_free(msg);
+  }
+
+  return NULL;
+}
+
+sftp_statvfs_t sftp_fstatvfs(sftp_file file) {
+  sftp_status_message status = NULL;
+  sftp_message msg = NULL;
+  sftp_session sftp;
+  ssh_string ext;
+  ssh_buffer buffer;
+  uint32_t id;
+
+  if (file == NULL) {
+    return NULL;
+  }
+  sftp = file->sftp;
+
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+
+  ext = ssh_string_from_char("fstatvfs@openssh.com");
+  if (ext == NULL) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    return NULL;
+  }
+
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(buffer, id) < 0 ||
+      buffer_add_ssh_string(buffer, ext) < 0 ||
+      buffer_add_ssh_string(buffer, file->handle) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(buffer);
+    ssh_string_free(ext);
+    return NULL;
+  }
+  if (sftp_packet_write(sftp, SSH_FXP_EXTENDED, buffer) < 0) {
+    ssh_buffer_free(buffer);
+    ssh_string_free(ext);
+    return NULL;
+  }
+  ssh_buffer_free(buffer);
+  ssh_string_free(ext);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return NULL;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  if (msg->packet_type == SSH_FXP_EXTENDED_REPLY) {
+  	sftp_statvfs_t buf = sftp_parse_statvfs(sftp, msg->payload);
+    sftp_message_free(msg);
+    if (buf == NULL) {
+      return NULL;
+    }
+
+    return buf;
+  } else if (msg->packet_type == SSH_FXP_STATUS) { /* bad response (error) */
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return NULL;
+    }
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+  } else { /* this shouldn't happen */
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received message %d when attempting to set stats", msg->packet_type);
+    sftp_message_free(msg);
+  }
+
+  return NULL;
+}
+
+void sftp_statvfs_free(sftp_statvfs_t statvfs) {
+  if (statvfs == NULL) {
+    return;
+  }
+
+  SAFE_FREE(statvfs);
+}
+
+/* Tell if the server announced the extension name, whatever its data */
+static int sftp_extension_announced(sftp_session sftp, const char *name) {
+  unsigned int i;
+
+  if (sftp->ext == NULL) {
+    return 0;
+  }
+  for (i = 0; i < sftp->ext->count; i++) {
+    if (strcmp(sftp->ext->name[i], name) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Sends a request and waits for its reply. The payload starts with the id
+ * of the request, it is freed.
+ */
+static sftp_message sftp_request(sftp_session sftp, uint8_t type,
+    uint32_t id, ssh_buffer payload) {
+  sftp_message msg = NULL;
+
+  if (sftp_packet_write(sftp, type, payload) < 0) {
+    ssh_buffer_free(payload);
+    return NULL;
+  }
+  ssh_buffer_free(payload);
+
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return NULL;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+
+  return msg;
+}
+
+/* Sets the error of a reply which isn't the expected one, and frees it */
+static void sftp_reply_error(sftp_session sftp, sftp_message msg,
+    const char *name) {
+  sftp_status_message status;
+
+  if (msg->packet_type == SSH_FXP_STATUS) {
+    status = parse_status_msg(msg);
+    sftp_message_free(msg);
+    if (status == NULL) {
+      return;
+    }
+    sftp_set_error(sftp, status->status);
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+    return;
+  }
+
+  ssh_set_error(sftp->session, SSH_FATAL,
+      "Received message %d during %s", msg->packet_type, name);
+  sftp_message_free(msg);
+}
+
+/* Checks a reply which is only a status, and frees it */
+static int sftp_status_reply(sftp_session sftp, sftp_message msg,
+    const char *name) {
+  sftp_status_message status;
+
+  if (msg->packet_type != SSH_FXP_STATUS) {
+    sftp_reply_error(sftp, msg, name);
+    return SSH_ERROR;
+  }
+
+  status = parse_status_msg(msg);
+  sftp_message_free(msg);
+  if (status == NULL) {
+    return SSH_ERROR;
+  }
+  sftp_set_error(sftp, status->status);
+  if (status->status != SSH_FX_OK) {
+    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+        "SFTP server: %s", status->errormsg);
+    status_msg_free(status);
+    return SSH_ERROR;
+  }
+  status_msg_free(status);
+
+  return SSH_OK;
+}
+
+/* The limits of the server, asked the first time they are needed */
+static sftp_limits_t sftp_get_limits(sftp_session sftp) {
+  sftp_limits_t limits;
+  sftp_message msg;
+  ssh_buffer payload;
+  uint32_t id;
+
+  if (sftp->limits_asked) {
+    return sftp->limits;
+  }
+  sftp->limits_asked = 1;
+  if (!sftp_extension_announced(sftp, "limits@openssh.com")) {
+    return NULL;
+  }
+
+  payload = ssh_buffer_new();
+  if (payload == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+  id = sftp_get_new_id(sftp);
+  if (buffer_pack(payload, "ds", id, "limits@openssh.com") < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(payload);
+    return NULL;
+  }
+
+  msg = sftp_request(sftp, SSH_FXP_EXTENDED, id, payload);
+  if (msg == NULL) {
+    return NULL;
+  }
+  if (msg->packet_type != SSH_FXP_EXTENDED_REPLY) {
+    sftp_reply_error(sftp, msg, "limits@openssh.com");
+    return NULL;
+  }
+
+  limits = malloc(sizeof(struct sftp_limits_struct));
+  if (limits == NULL) {
+    ssh_set_error_oom(sftp->session);
+    sftp_message_free(msg);
+    return NULL;
+  }
+  if (buffer_unpack(msg->payload, "qqqq", &limits->max_packet_length,
+        &limits->max_read_length, &limits->max_write_length,
+        &limits->max_open_handles) < 0) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Invalid limits@openssh.com reply");
+    SAFE_FREE(limits);
+    sftp_message_free(msg);
+    return NULL;
+  }
+  sftp_message_free(msg);
+
+  sftp->limits = limits;
+
+  return limits;
+}
+
+/* Keeps the size of the reads or writes within the limits of the server */
+static uint32_t sftp_limit_chunk(sftp_session sftp, uint32_t len,
+    int writing) {
+  sftp_limits_t limits = sftp_get_limits(sftp);
+  uint64_t max;
+
+  if (limits == NULL) {
+    return len;
+  }
+  max = writing ? limits->max_write_length : limits->max_read_length;
+  if (max > 0 && max < len) {
+    len = max;
+  }
+
+  return len;
+}
+
+sftp_limits_t sftp_limits(sftp_session sftp) {
+  sftp_limits_t limits;
+
+  if (sftp == NULL) {
+    return NULL;
+  }
+  if (sftp_get_limits(sftp) == NULL) {
+    return NULL;
+  }
+
+  limits = malloc(sizeof(struct sftp_limits_struct));
+  if (limits == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+  memcpy(limits, sftp->limits, sizeof(struct sftp_limits_struct));
+
+  return limits;
+}
+
+void sftp_limits_free(sftp_limits_t limits) {
+  SAFE_FREE(limits);
+}
+
+int sftp_copy_data(sftp_file source, uint64_t source_offset,
+    uint64_t length, sftp_file dest, uint64_t dest_offset) {
+  sftp_session sftp;
+  sftp_message msg;
+  ssh_buffer payload;
+  uint32_t id;
+
+  if (source == NULL || dest == NULL) {
+    return SSH_ERROR;
+  }
+  sftp = source->sftp;
+
+  payload = ssh_buffer_new();
+  if (payload == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return SSH_ERROR;
+  }
+  id = sftp_get_new_id(sftp);
+  if (buffer_pack(payload, "dsSqqSq", id, "copy-data", source->handle,
+        source_offset, length, dest->handle, dest_offset) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(payload);
+    return SSH_ERROR;
+  }
+
+  msg = sftp_request(sftp, SSH_FXP_EXTENDED, id, payload);
+  if (msg == NULL) {
+    return SSH_ERROR;
+  }
+
+  return sftp_status_reply(sftp, msg, "copy-data");
+}
+
+/*
+ * Sends a check-file-handle or check-file-name request, with the handle or
+ * the path already in payload, after the id and the name.
+ */
+static sftp_file_hash sftp_check_file(sftp_session sftp, uint32_t id,
+    ssh_buffer payload, const char *algorithms, uint64_t offset,
+    uint64_t length, uint32_t block_size) {
+  sftp_file_hash hash;
+  sftp_message msg;
+  char *name = NULL;
+  uint32_t len;
+
+  if (buffer_pack(payload, "sqqd", algorithms, offset, length,
+        block_size) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(payload);
+    return NULL;
+  }
+
+  msg = sftp_request(sftp, SSH_FXP_EXTENDED, id, payload);
+  if (msg == NULL) {
+    return NULL;
+  }
+  if (msg->packet_type != SSH_FXP_EXTENDED_REPLY) {
+    sftp_reply_error(sftp, msg, "check-file");
+    return NULL;
+  }
+
+  hash = malloc(sizeof(struct sftp_file_hash_struct));
+  if (hash == NULL) {
+    ssh_set_error_oom(sftp->session);
+    sftp_message_free(msg);
+    return NULL;
+  }
+  ZERO_STRUCTP(hash);
+
+  /* string "check-file", string algorithm, then the hashes up to the end */
+  if (buffer_unpack(msg->payload, "ss", &name, &hash->algorithm) < 0 ||
+      strcmp(name, "check-file") != 0) {
+    ssh_set_error(sftp->session, SSH_FATAL, "Invalid check-file reply");
+    SAFE_FREE(name);
+    sftp_file_hash_free(hash);
+    sftp_message_free(msg);
+    return NULL;
+  }
+  SAFE_FREE(name);
+
+  len = buffer_get_rest_len(msg->payload);
+  if (len > 0) {
+    hash->hashes = malloc(len);
+    if (hash->hashes == NULL) {
+      ssh_set_error_oom(sftp->session);
+      sftp_file_hash_free(hash);
+      sftp_message_free(msg);
+      return NULL;
+    }
+    buffer_get_data(msg->payload, hash->hashes, len);
+  }
+  hash->len = len;
+  sftp_message_free(msg);
+
+  return hash;
+}
+
+sftp_file_hash sftp_check_file_handle(sftp_file file,
+    const char *algorithms, uint64_t offset, uint64_t length,
+    uint32_t block_size) {
+  sftp_session sftp;
+  ssh_buffer payload;
+  uint32_t id;
+
+  if (file == NULL || algorithms == NULL) {
+    return NULL;
+  }
+  sftp = file->sftp;
+
+  payload = ssh_buffer_new();
+  if (payload == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+  id = sftp_get_new_id(sftp);
+  if (buffer_pack(payload, "dsS", id, "check-file-handle",
+        file->handle) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(payload);
+    return NULL;
+  }
+
+  return sftp_check_file(sftp, id, payload, algorithms, offset, length,
+      block_size);
+}
+
+sftp_file_hash sftp_check_file_name(sftp_session sftp, const char *path,
+    const char *algorithms, uint64_t offset, uint64_t length,
+    uint32_t block_size) {
+  ssh_buffer payload;
+  uint32_t id;
+
+  if (sftp == NULL) {
+    return NULL;
+  }
+  if (path == NULL || algorithms == NULL) {
+    ssh_set_error_invalid(sftp->session, __FUNCTION__);
+    return NULL;
+  }
+
+  payload = ssh_buffer_new();
+  if (payload == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return NULL;
+  }
+  id = sftp_get_new_id(sftp);
+  if (buffer_pack(payload, "dss", id, "check-file-name", path) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(payload);
+    return NULL;
+  }
+
+  return sftp_check_file(sftp, id, payload, algorithms, offset, length,
+      block_size);
+}
+
+void sftp_file_hash_free(sftp_file_hash hash) {
+  if (hash == NULL) {
+    return;
+  }
+
+  SAFE_FREE(hash->algorithm);
+  SAFE_FREE(hash->hashes);
+  SAFE_FREE(hash);
+}
+
+/* the hashes sftp_local_hash() can compute */
+#define SFTP_RESUME_CHECK_ALGORITHMS "sha1,md5"
+
+/* Truncate an open file to size */
+static int sftp_truncate_handle(sftp_file file, uint64_t size) {
+  struct sftp_attributes_struct attr;
+  sftp_session sftp = file->sftp;
+  ssh_buffer payload;
+  sftp_message msg;
+  uint32_t id;
+
+  ZERO_STRUCT(attr);
+  attr.flags = SSH_FILEXFER_ATTR_SIZE;
+  attr.size = size;
+
+  payload = ssh_buffer_new();
+  if (payload == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return SSH_ERROR;
+  }
+  id = sftp_get_new_id(sftp);
+  if (buffer_add_u32(payload, id) < 0 ||
+      buffer_add_ssh_string(payload, file->handle) < 0 ||
+      buffer_add_attributes(payload, &attr) < 0) {
+    ssh_set_error_oom(sftp->session);
+    ssh_buffer_free(payload);
+    return SSH_ERROR;
+  }
+
+  msg = sftp_request(sftp, SSH_FXP_FSETSTAT, id, payload);
+  if (msg == NULL) {
+    return SSH_ERROR;
+  }
+
+  return sftp_status_reply(sftp, msg, "fsetstat");
+}
+
+/*
+ * Hashes len bytes of a local file from offset with algorithm, like
+ * check-file does. Returns the length of the hash, 0 if the algorithm is
+ * unknown, -1 on error.
+ */
+static int sftp_local_hash(sftp_session sftp, int fd, const char *algorithm,
+    uint64_t offset, uint64_t len, unsigned char *md) {
+  SHACTX sha = NULL;
+  MD5CTX md5 = NULL;
+  uint64_t end = offset + len;
+  ssize_t r;
+  char *data;
+  int rc;
+
+  if (strcmp(algorithm, "sha1") != 0 && strcmp(algorithm, "md5") != 0) {
+    return 0;
+  }
+
+  data = malloc(SFTP_DOWNLOAD_CHUNK_SIZE);
+  if (data == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+  if (strcmp(algorithm, "sha1") == 0) {
+    sha = sha1_init();
+  } else {
+    md5 = md5_init();
+  }
+
+  while (offset < end) {
+    r = sftp_local_read(fd, data, end - offset < SFTP_DOWNLOAD_CHUNK_SIZE ?
+        end - offset : SFTP_DOWNLOAD_CHUNK_SIZE, offset);
+    if (r <= 0) {
+      break;
+    }
+    if (sha != NULL) {
+      sha1_update(sha, data, r);
+    } else {
+      md5_update(md5, data, r);
+    }
+    offset += r;
+  }
+  SAFE_FREE(data);
+
+  /* the contexts are freed by the final calls */
+  if (sha != NULL) {
+    sha1_final(md, sha);
+    rc = SHA_DIGEST_LEN;
+  } else {
+    md5_final(md, md5);
+    rc = MD5_DIGEST_LEN;
+  }
+  if (offset < end) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Error reading the local file: %s", strerror(errno));
+    return -1;
+  }
+
+  return rc;
+}
+
+struct sftp_resume_compare {
+  int fd;
+  char *local;
+  int differs;
+};
+
+static int sftp_resume_compare_cb(const void *data, size_t len,
+    uint64_t offset, void *userdata) {
+  struct sftp_resume_compare *compare = userdata;
+
+  if (sftp_local_read(compare->fd, compare->local, len, offset) !=
+      (ssize_t) len || memcmp(compare->local, data, len) != 0) {
+    compare->differs = 1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Tells if the first len bytes of a remote and a local file are the same:
+ * with check-file if the server has it, by reading the end of the range back
+ * otherwise. Returns 1 if they are, 0 if not, -1 on error.
+ */
+static int sftp_resume_check(sftp_file file, int fd, uint64_t len) {
+  struct sftp_download_options_struct opts;
+  struct sftp_download_sink_struct sink;
+  struct sftp_resume_compare compare;
+  unsigned char md[SHA_DIGEST_LEN];
+  sftp_session sftp = file->sftp;
+  sftp_file_hash hash;
+  uint64_t check;
+  int64_t n;
+  int rc;
+
+  hash = sftp_check_file_handle(file, SFTP_RESUME_CHECK_ALGORITHMS, 0, len,
+      0);
+  if (hash != NULL) {
+    rc = sftp_local_hash(sftp, fd, hash->algorithm, 0, len, md);
+    if (rc > 0) {
+      rc = hash->len == (size_t) rc && memcmp(hash->hashes, md, rc) == 0;
+      sftp_file_hash_free(hash);
+      return rc;
     }
-    msg = sftp_dequeue(sftp, id);
+    sftp_file_hash_free(hash);
+    if (rc < 0) {
+      return -1;
+    }
+    /* an algorithm we don't have, read the data back */
+  } else if (ssh_get_error_code(sftp->session) == SSH_FATAL) {
+    /* not a refusal of the server */
+    return -1;
   }
 
-  /* By specification, this command returns SSH_FXP_STATUS */
-  if (msg->packet_type == SSH_FXP_STATUS) {
-    status = parse_status_msg(msg);
-    sftp_message_free(msg);
-    if (status == NULL) {
+  check = len < SFTP_RESUME_CHECK_SIZE ? len : SFTP_RESUME_CHECK_SIZE;
+  ZERO_STRUCT(compare);
+  compare.fd = fd;
+  compare.local = malloc(SFTP_DOWNLOAD_CHUNK_SIZE);
+  if (compare.local == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+  ZERO_STRUCT(sink);
+  sink.write_function = sftp_resume_compare_cb;
+  sink.userdata = &compare;
+  ZERO_STRUCT(opts);
+  opts.chunk_size = SFTP_DOWNLOAD_CHUNK_SIZE;
+
+  file->offset = len - check;
+  file->eof = 0;
+  n = sftp_download_range(file, &sink, &opts, check);
+  SAFE_FREE(compare.local);
+  if (compare.differs) {
+    return 0;
+  }
+  if (n < 0) {
+    return -1;
+  }
+
+  /* a shorter remote file isn't the same */
+  return (uint64_t) n == check;
+}
+
+/* Get a download ready to go on from the end of the local file. */
+int64_t sftp_download_resume(sftp_file file, int fd, int verify) {
+  sftp_session sftp;
+  sftp_attributes attr;
+  struct stat st;
+  uint64_t offset;
+  int rc;
+
+  if (file == NULL) {
+    return -1;
+  }
+  sftp = file->sftp;
+
+  if (fstat(fd, &st) < 0) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Error reading the local file: %s", strerror(errno));
+    return -1;
+  }
+  offset = st.st_size;
+
+  attr = sftp_fstat(file);
+  if (attr == NULL) {
+    return -1;
+  }
+  /* a local file bigger than the remote one isn't a part of it */
+  if (!(attr->flags & SSH_FILEXFER_ATTR_SIZE) || offset > attr->size) {
+    offset = 0;
+  }
+  sftp_attributes_free(attr);
+
+  if (verify && offset > 0) {
+    rc = sftp_resume_check(file, fd, offset);
+    if (rc < 0) {
       return -1;
     }
-    sftp_set_error(sftp, status->status);
-    switch (status->status) {
-      case SSH_FX_OK:
-        status_msg_free(status);
-        return 0;
-        break;
-      default:
-        break;
+    if (rc == 0) {
+      offset = 0;
     }
-    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
-        "SFTP server: %s", status->errormsg);
-    status_msg_free(status);
-    return -1;
-  } else {
+  }
+
+  if (offset == 0 && st.st_size > 0) {
+#ifdef _WIN32
+    rc = _chsize_s(fd, 0);
+#else
+    rc = ftruncate(fd, 0);
+#endif
+    if (rc != 0) {
+      ssh_set_error(sftp->session, SSH_FATAL,
+          "Error truncating the local file: %s", strerror(errno));
+      return -1;
+    }
+  }
+
+  if (sftp_local_seek(fd, offset, SEEK_SET) < 0) {
     ssh_set_error(sftp->session, SSH_FATAL,
-        "Received message %d when attempting to remove directory",
-        msg->packet_type);
-    sftp_message_free(msg);
+        "Error seeking in the local file: %s", strerror(errno));
+    return -1;
   }
+  file->eof = 0;
+  sftp_seek64(file, offset);
 
-  return -1;
+  return offset;
 }
 
-/* Code written by Nick */
-int sftp_mkdir(sftp_session sftp, const char *directory, mode_t mode) {
-  sftp_status_message status = NULL;
-  sftp_message msg = NULL;
-  sftp_attributes errno_attr = NULL;
-  struct sftp_attributes_struct attr;
-  ssh_buffer buffer;
-  ssh_string path;
-  uint32_t id;
+/* Get an upload ready to go on from the end of the remote file. */
+int64_t sftp_upload_resume(int fd, sftp_file file, int verify) {
+  sftp_session sftp;
+  sftp_attributes attr;
+  struct stat st;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  int rc;
 
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
+  if (file == NULL) {
     return -1;
   }
+  sftp = file->sftp;
 
-  path = ssh_string_from_char(directory);
-  if (path == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
+  if (fstat(fd, &st) < 0) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Error reading the local file: %s", strerror(errno));
     return -1;
   }
 
-  ZERO_STRUCT(attr);
-  attr.permissions = mode;
-  attr.flags = SSH_FILEXFER_ATTR_PERMISSIONS;
-
-  id = sftp_get_new_id(sftp);
-  if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, path) < 0 ||
-      buffer_add_attributes(buffer, &attr) < 0 ||
-      sftp_packet_write(sftp, SSH_FXP_MKDIR, buffer) < 0) {
-    ssh_buffer_free(buffer);
-    ssh_string_free(path);
+  attr = sftp_fstat(file);
+  if (attr == NULL) {
+    return -1;
+  }
+  if (attr->flags & SSH_FILEXFER_ATTR_SIZE) {
+    size = attr->size;
+  }
+  sftp_attributes_free(attr);
+  /* a remote file bigger than the local one isn't a part of it */
+  if (size <= (uint64_t) st.st_size) {
+    offset = size;
   }
-  ssh_buffer_free(buffer);
-  ssh_string_free(path);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
+  if (verify && offset > 0) {
+    rc = sftp_resume_check(file, fd, offset);
+    if (rc < 0) {
       return -1;
     }
-    msg = sftp_dequeue(sftp, id);
+    if (rc == 0) {
+      offset = 0;
+    }
   }
 
-  /* By specification, this command only returns SSH_FXP_STATUS */
-  if (msg->packet_type == SSH_FXP_STATUS) {
-    status = parse_status_msg(msg);
-    sftp_message_free(msg);
-    if (status == NULL) {
-      return -1;
+  if (offset == 0 && size > 0 && sftp_truncate_handle(file, 0) < 0) {
+    return -1;
+  }
+
+  if (sftp_local_seek(fd, offset, SEEK_SET) < 0) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Error seeking in the local file: %s", strerror(errno));
+    return -1;
+  }
+  file->eof = 0;
+  sftp_seek64(file, offset);
+
+  return offset;
+}
+
+/* the local data of a run of blocks sent by sftp_upload_delta() */
+struct sftp_delta_source {
+  int fd;
+  uint64_t end;
+};
+
+static ssize_t sftp_delta_read_cb(void *data, size_t len, uint64_t offset,
+    void *userdata) {
+  struct sftp_delta_source *source = userdata;
+
+  if (offset >= source->end) {
+    return 0;
+  }
+  if (len > source->end - offset) {
+    len = source->end - offset;
+  }
+
+  return sftp_local_read(source->fd, data, len, offset);
+}
+
+struct sftp_delta_compare {
+  int fd;
+  char *local;
+  uint32_t block_size;
+  unsigned char *differs;
+};
+
+/* marks the blocks the remote data read doesn't match the local one */
+static int sftp_delta_compare_cb(const void *data, size_t len,
+    uint64_t offset, void *userdata) {
+  struct sftp_delta_compare *compare = userdata;
+  const char *p = data;
+  uint64_t block;
+  size_t n;
+
+  while (len > 0) {
+    block = offset / compare->block_size;
+    n = compare->block_size - offset % compare->block_size;
+    if (n > len) {
+      n = len;
     }
-    sftp_set_error(sftp, status->status);
-    switch (status->status) {
-      case SSH_FX_FAILURE:
-        /*
-         * mkdir always returns a failure, even if the path already exists.
-         * To be POSIX conform and to be able to map it to EEXIST a stat
-         * call is needed here.
-         */
-        errno_attr = sftp_lstat(sftp, directory);
-        if (errno_attr != NULL) {
-          SAFE_FREE(errno_attr);
-          sftp_set_error(sftp, SSH_FX_FILE_ALREADY_EXISTS);
-        }
-        break;
-      case SSH_FX_OK:
-        status_msg_free(status);
-        return 0;
+    if (!compare->differs[block] &&
+        (sftp_local_read(compare->fd, compare->local, n, offset) !=
+         (ssize_t) n || memcmp(compare->local, p, n) != 0)) {
+      compare->differs[block] = 1;
+    }
+    p += n;
+    offset += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/*
+ * Marks in differs the blocks of the first len bytes which aren't the same
+ * in the remote and the local file: from the block hashes of check-file if
+ * the server has it, by reading the remote file through otherwise.
+ */
+static int sftp_delta_blocks(sftp_file file, int fd, uint64_t len,
+    uint32_t block_size, unsigned char *differs) {
+  struct sftp_download_options_struct opts;
+  struct sftp_download_sink_struct sink;
+  struct sftp_delta_compare compare;
+  unsigned char md[SHA_DIGEST_LEN];
+  sftp_session sftp = file->sftp;
+  uint64_t nblocks = (len + block_size - 1) / block_size;
+  uint64_t offset;
+  uint64_t i;
+  sftp_file_hash hash;
+  int64_t n;
+  int rc = 0;
+
+  hash = sftp_check_file_handle(file, SFTP_RESUME_CHECK_ALGORITHMS, 0, len,
+      block_size);
+  if (hash != NULL) {
+    for (i = 0; i < nblocks; i++) {
+      offset = i * block_size;
+      rc = sftp_local_hash(sftp, fd, hash->algorithm, offset,
+          len - offset < block_size ? len - offset : block_size, md);
+      if (rc <= 0) {
         break;
-      default:
+      }
+      if (hash->len != nblocks * rc) {
+        /* not one hash per block */
+        rc = 0;
         break;
+      }
+      differs[i] = memcmp(hash->hashes + i * rc, md, rc) != 0;
     }
-    /*
-     * The status should be SSH_FX_OK if the command was successful, if it
-     * didn't, then there was an error
-     */
-    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
-        "SFTP server: %s", status->errormsg);
-    status_msg_free(status);
+    sftp_file_hash_free(hash);
+    if (rc < 0) {
+      return SSH_ERROR;
+    }
+    if (rc > 0) {
+      return SSH_OK;
+    }
+    /* hashes we can't use, read the data */
+    memset(differs, 0, nblocks);
+  } else if (ssh_get_error_code(sftp->session) == SSH_FATAL) {
+    /* not a refusal of the server */
+    return SSH_ERROR;
+  }
+
+  ZERO_STRUCT(compare);
+  compare.fd = fd;
+  compare.block_size = block_size;
+  compare.differs = differs;
+  compare.local = malloc(SFTP_DOWNLOAD_CHUNK_SIZE);
+  if (compare.local == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return SSH_ERROR;
+  }
+  ZERO_STRUCT(sink);
+  sink.write_function = sftp_delta_compare_cb;
+  sink.userdata = &compare;
+  ZERO_STRUCT(opts);
+  opts.chunk_size = SFTP_DOWNLOAD_CHUNK_SIZE;
+
+  file->offset = 0;
+  file->eof = 0;
+  n = sftp_download_range(file, &sink, &opts, len);
+  SAFE_FREE(compare.local);
+  if (n < 0) {
+    return SSH_ERROR;
+  }
+
+  /* the remote file got shorter since its size was read */
+  for (i = n / block_size; (uint64_t) n < len && i < nblocks; i++) {
+    differs[i] = 1;
+  }
+
+  return SSH_OK;
+}
+
+/* Update a remote file to a local one, sending the blocks which differ. */
+int64_t sftp_upload_delta(int fd, sftp_file file, uint32_t block_size,
+    sftp_upload_options opts) {
+  struct sftp_upload_source_struct source;
+  struct sftp_delta_source delta;
+  sftp_session sftp;
+  sftp_attributes attr;
+  unsigned char *differs;
+  struct stat st;
+  uint64_t nblocks;
+  uint64_t common;
+  uint64_t size;
+  uint64_t remote = 0;
+  uint64_t start;
+  uint64_t i;
+  int64_t total = 0;
+  int64_t n;
+
+  if (file == NULL) {
     return -1;
-  } else {
+  }
+  sftp = file->sftp;
+  if (block_size == 0) {
+    block_size = SFTP_DELTA_BLOCK_SIZE;
+  }
+
+  if (fstat(fd, &st) < 0) {
     ssh_set_error(sftp->session, SSH_FATAL,
-        "Received message %d when attempting to make directory",
-        msg->packet_type);
-    sftp_message_free(msg);
+        "Error reading the local file: %s", strerror(errno));
+    return -1;
   }
+  size = st.st_size;
 
-  return -1;
+  attr = sftp_fstat(file);
+  if (attr == NULL) {
+    return -1;
+  }
+  if (attr->flags & SSH_FILEXFER_ATTR_SIZE) {
+    remote = attr->size;
+  }
+  sftp_attributes_free(attr);
+  common = remote < size ? remote : size;
+
+  nblocks = (size + block_size - 1) / block_size;
+  differs = calloc(nblocks > 0 ? nblocks : 1, 1);
+  if (differs == NULL) {
+    ssh_set_error_oom(sftp->session);
+    return -1;
+  }
+  if (common > 0 && sftp_delta_blocks(file, fd, common, block_size,
+        differs) < 0) {
+    SAFE_FREE(differs);
+    return -1;
+  }
+  /* what the remote file lacks is sent too */
+  for (i = common / block_size; size > common && i < nblocks; i++) {
+    differs[i] = 1;
+  }
+  if (remote > size && sftp_truncate_handle(file, size) < 0) {
+    SAFE_FREE(differs);
+    return -1;
+  }
+
+  /* each run of blocks which differ is one pipelined upload */
+  ZERO_STRUCT(source);
+  source.read_function = sftp_delta_read_cb;
+  source.userdata = &delta;
+  delta.fd = fd;
+  for (i = 0; i < nblocks; ) {
+    if (!differs[i]) {
+      i++;
+      continue;
+    }
+    start = i * block_size;
+    while (i < nblocks && differs[i]) {
+      i++;
+    }
+    delta.end = i * block_size < size ? i * block_size : size;
+
+    file->offset = start;
+    n = sftp_upload(&source, file, opts);
+    if (n < 0) {
+      SAFE_FREE(differs);
+      return -1;
+    }
+    if ((uint64_t) n < delta.end - start) {
+      ssh_set_error(sftp->session, SSH_FATAL,
+          "The local file got shorter during the upload");
+      SAFE_FREE(differs);
+      return -1;
+    }
+    total += n;
+  }
+  SAFE_FREE(differs);
+
+  SSH_LOG(sftp->session, SSH_LOG_PACKET,
+      "Delta upload: %llu of %llu bytes sent", (unsigned long long) total,
+      (unsigned long long) size);
+  sftp_seek64(file, size);
+
+  return total;
 }
 
-/* code written by nick */
-int sftp_rename(sftp_session sftp, const char *original, const char *newname) {
+/* another code written by Nick */
+char *sftp_canonicalize_path(sftp_session sftp, const char *path) {
   sftp_status_message status = NULL;
   sftp_message msg = NULL;
+  ssh_string name = NULL;
+  ssh_string pathstr;
   ssh_buffer buffer;
-  ssh_string oldpath;
-  ssh_string newpath;
+  char *cname;
+  uint32_t ignored;
   uint32_t id;
 
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return -1;
+  if (sftp == NULL)
+    return NULL;
+  if (path == NULL) {
+    ssh_set_error_invalid(sftp->session, __FUNCTION__);
+    return NULL;
   }
 
-  oldpath = ssh_string_from_char(original);
-  if (oldpath == NULL) {
+  buffer = ssh_buffer_new();
+  if (buffer == NULL) {
     ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    return -1;
+    return NULL;
   }
 
-  newpath = ssh_string_from_char(newname);
-  if (newpath == NULL) {
+  pathstr = ssh_string_from_char(path);
+  if (pathstr == NULL) {
     ssh_set_error_oom(sftp->session);
     ssh_buffer_free(buffer);
-    ssh_string_free(oldpath);
-    return -1;
+    return NULL;
   }
 
   id = sftp_get_new_id(sftp);
   if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, oldpath) < 0 ||
-      buffer_add_ssh_string(buffer, newpath) < 0 ||
-      /* POSIX rename atomically replaces newpath, we should do the same
-       * only available on >=v4 */
-      sftp->version>=4 ? (buffer_add_u32(buffer, SSH_FXF_RENAME_OVERWRITE) < 0):0) {
+      buffer_add_ssh_string(buffer, pathstr) < 0) {
     ssh_set_error_oom(sftp->session);
     ssh_buffer_free(buffer);
-    ssh_string_free(oldpath);
-    ssh_string_free(newpath);
-    return -1;
+    ssh_string_free(pathstr);
+    return NULL;
   }
-  if (sftp_packet_write(sftp, SSH_FXP_RENAME, buffer) < 0) {
+  if (sftp_packet_write(sftp, SSH_FXP_REALPATH, buffer) < 0) {
     ssh_buffer_free(buffer);
-    ssh_string_free(oldpath);
-    ssh_string_free(newpath);
-    return -1;
+    ssh_string_free(pathstr);
+    return NULL;
   }
   ssh_buffer_free(buffer);
-  ssh_string_free(oldpath);
-  ssh_string_free(newpath);
+  ssh_string_free(pathstr);
 
   while (msg == NULL) {
     if (sftp_read_and_dispatch(sftp) < 0) {
-      return -1;
+      return NULL;
     }
     msg = sftp_dequeue(sftp, id);
   }
 
-  /* By specification, this command only returns SSH_FXP_STATUS */
-  if (msg->packet_type == SSH_FXP_STATUS) {
+  if (msg->packet_type == SSH_FXP_NAME) {
+    /* we don't care about "count" */
+    buffer_get_u32(msg->payload, &ignored);
+    /* we only care about the file name string */
+    name = buffer_get_ssh_string(msg->payload);
+    sftp_message_free(msg);
+    if (name == NULL) {
+      /* TODO: error message? */
+      return NULL;
+    }
+    cname = ssh_string_to_char(name);
+    ssh_string_free(name);
+    if (cname == NULL) {
+      ssh_set_error_oom(sftp->session);
+    }
+    return cname;
+  } else if (msg->packet_type == SSH_FXP_STATUS) { /* bad response (error) */
     status = parse_status_msg(msg);
     sftp_message_free(msg);
     if (status == NULL) {
-      return -1;
-    }
-    sftp_set_error(sftp, status->status);
-    switch (status->status) {
-      case SSH_FX_OK:
-        status_msg_free(status);
-        return 0;
-      default:
-        break;
+      return NULL;
     }
-    /*
-     * Status should be SSH_FX_OK if the command was successful, if it didn't,
-     * then there was an error
-     */
     ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
         "SFTP server: %s", status->errormsg);
     status_msg_free(status);
-    return -1;
-  } else {
+  } else { /* this shouldn't happen */
     ssh_set_error(sftp->session, SSH_FATAL,
-        "Received message %d when attempting to rename",
-        msg->packet_type);
+        "Received message %d when attempting to set stats", msg->packet_type);
     sftp_message_free(msg);
   }
 
-  return -1;
+  return NULL;
 }
 
-/* Code written by Nick */
-/* Set file attributes on a file, directory or symbolic link. */
-int sftp_setstat(sftp_session sftp, const char *file, sftp_attributes attr) {
-  uint32_t id;
+/*
+ * Sends a SSH_FXP_STAT or SSH_FXP_LSTAT of path.
+ * Returns the id of the request, -1 on error.
+ */
+static int sftp_xstat_request(sftp_session sftp, const char *path,
+    int param) {
+  ssh_string pathstr;
   ssh_buffer buffer;
-  ssh_string path;
-  sftp_message msg = NULL;
-  sftp_status_message status = NULL;
+  uint32_t id;
 
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
@@ -2430,8 +6324,8 @@ int sftp_setstat(sftp_session sftp, const char *file, sftp_attributes attr) {
     return -1;
   }
 
-  path = ssh_string_from_char(file);
-  if (path == NULL) {
+  pathstr = ssh_string_from_char(path);
+  if (pathstr == NULL) {
     ssh_set_error_oom(sftp->session);
     ssh_buffer_free(buffer);
     return -1;
@@ -2439,787 +6333,1418 @@ int sftp_setstat(sftp_session sftp, const char *file, sftp_attributes attr) {
 
   id = sftp_get_new_id(sftp);
   if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, path) < 0 ||
-      buffer_add_attributes(buffer, attr) < 0) {
+      buffer_add_ssh_string(buffer, pathstr) < 0) {
     ssh_set_error_oom(sftp->session);
     ssh_buffer_free(buffer);
-    ssh_string_free(path);
+    ssh_string_free(pathstr);
     return -1;
   }
-  if (sftp_packet_write(sftp, SSH_FXP_SETSTAT, buffer) < 0) {
+  if (sftp_packet_write(sftp, param, buffer) < 0) {
     ssh_buffer_free(buffer);
-    ssh_string_free(path);
+    ssh_string_free(pathstr);
     return -1;
   }
   ssh_buffer_free(buffer);
-  ssh_string_free(path);
+  ssh_string_free(pathstr);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
-      return -1;
-    }
-    msg = sftp_dequeue(sftp, id);
-  }
+  return id;
+}
 
-  /* By specification, this command only returns SSH_FXP_STATUS */
-  if (msg->packet_type == SSH_FXP_STATUS) {
+/* Parses the reply of a stat request and frees it */
+static sftp_attributes sftp_xstat_reply(sftp_session sftp, sftp_message msg) {
+  sftp_status_message status = NULL;
+
+  if (msg->packet_type == SSH_FXP_ATTRS) {
+    sftp_attributes attr = sftp_parse_attr(sftp, msg->payload, 0);
+    sftp_message_free(msg);
+
+    return attr;
+  } else if (msg->packet_type == SSH_FXP_STATUS) {
     status = parse_status_msg(msg);
     sftp_message_free(msg);
     if (status == NULL) {
-      return -1;
+      return NULL;
     }
     sftp_set_error(sftp, status->status);
-    switch (status->status) {
-      case SSH_FX_OK:
-        status_msg_free(status);
-        return 0;
-      default:
-        break;
-    }
-    /*
-     * The status should be SSH_FX_OK if the command was successful, if it
-     * didn't, then there was an error
-     */
     ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
         "SFTP server: %s", status->errormsg);
     status_msg_free(status);
-    return -1;
-  } else {
-    ssh_set_error(sftp->session, SSH_FATAL,
-        "Received message %d when attempting to set stats", msg->packet_type);
-    sftp_message_free(msg);
+    return NULL;
   }
+  ssh_set_error(sftp->session, SSH_FATAL,
+      "Received mesg %d during stat()", msg->packet_type);
+  sftp_message_free(msg);
 
-  return -1;
+  return NULL;
 }
 
-/* Change the file owner and group */
-int sftp_chown(sftp_session sftp, const char *file, uid_t owner, gid_t group) {
-	struct sftp_attributes_struct attr;
-  ZERO_STRUCT(attr);
-
-  attr.uid = owner;
-  attr.gid = group;
+static sftp_attributes sftp_xstat(sftp_session sftp, const char *path,
+    int param) {
+  sftp_message msg = NULL;
+  sftp_attributes attr;
+  int kind;
+  int id;
 
-  attr.flags = SSH_FILEXFER_ATTR_UIDGID;
+  kind = param == SSH_FXP_STAT ? SFTP_STAT_CACHE_STAT : SFTP_STAT_CACHE_LSTAT;
+  attr = sftp_stat_cache_get(sftp, path, kind);
+  if (attr != NULL) {
+    return attr;
+  }
 
-  return sftp_setstat(sftp, file, &attr);
-}
+  id = sftp_xstat_request(sftp, path, param);
+  if (id < 0) {
+    return NULL;
+  }
 
-/* Change permissions of a file */
-int sftp_chmod(sftp_session sftp, const char *file, mode_t mode) {
-	struct sftp_attributes_struct attr;
-  ZERO_STRUCT(attr);
-  attr.permissions = mode;
-  attr.flags = SSH_FILEXFER_ATTR_PERMISSIONS;
+  while (msg == NULL) {
+    if (sftp_read_and_dispatch(sftp) < 0) {
+      return NULL;
+    }
+    msg = sftp_dequeue(sftp, id);
+  }
+  if (msg->packet_type == SSH_FXP_ATTRS) {
+    sftp_stat_cache_put(sftp, path, strlen(path), kind,
+        buffer_get_rest(msg->payload), buffer_get_rest_len(msg->payload));
+  }
 
-  return sftp_setstat(sftp, file, &attr);
+  return sftp_xstat_reply(sftp, msg);
 }
 
-/* Change the last modification and access time of a file. */
-int sftp_utimes(sftp_session sftp, const char *file,
-    const struct timeval *times) {
-	struct sftp_attributes_struct attr;
-  ZERO_STRUCT(attr);
-
-  attr.atime = times[0].tv_sec;
-  attr.atime_nseconds = times[0].tv_usec;
-
-  attr.mtime = times[1].tv_sec;
-  attr.mtime_nseconds = times[1].tv_usec;
-
-  attr.flags |= SSH_FILEXFER_ATTR_ACCESSTIME | SSH_FILEXFER_ATTR_MODIFYTIME |
-    SSH_FILEXFER_ATTR_SUBSECOND_TIMES;
-
-  return sftp_setstat(sftp, file, &attr);
+sftp_attributes sftp_stat(sftp_session session, const char *path) {
+  return sftp_xstat(session, path, SSH_FXP_STAT);
 }
 
-int sftp_symlink(sftp_session sftp, const char *target, const char *dest) {
-  sftp_status_message status = NULL;
-  sftp_message msg = NULL;
-  ssh_string target_s;
-  ssh_string dest_s;
-  ssh_buffer buffer;
-  uint32_t id;
-
-  if (sftp == NULL)
-    return -1;
-  if (target == NULL || dest == NULL) {
-    ssh_set_error_invalid(sftp->session, __FUNCTION__);
-    return -1;
-  }
-
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return -1;
-  }
-
-  target_s = ssh_string_from_char(target);
-  if (target_s == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    return -1;
-  }
+sftp_attributes sftp_lstat(sftp_session session, const char *path) {
+  return sftp_xstat(session, path, SSH_FXP_LSTAT);
+}
 
-  dest_s = ssh_string_from_char(dest);
-  if (dest_s == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_string_free(target_s);
-    ssh_buffer_free(buffer);
-    return -1;
-  }
+/* Get information about many paths, with the requests pipelined. */
+int sftp_stat_many_callback(sftp_session sftp, const char **paths, size_t n,
+    int follow_links, sftp_stat_callback callback, void *userdata) {
+  struct {
+    uint32_t id;
+    size_t index;
+  } inflight[SFTP_STAT_REQUESTS];
+  sftp_attributes attr;
+  sftp_message msg;
+  size_t count = 0;
+  size_t next = 0;
+  size_t i;
+  int param = follow_links ? SSH_FXP_STAT : SSH_FXP_LSTAT;
+  int failed = 0;
+  int stop = 0;
+  int rc = SSH_OK;
+  int id;
 
-  id = sftp_get_new_id(sftp);
-  if (buffer_add_u32(buffer, id) < 0) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    ssh_string_free(dest_s);
-    ssh_string_free(target_s);
-    return -1;
-  }
-  if (ssh_get_openssh_version(sftp->session)) {
-    /* TODO check for version number if they ever fix it. */
-    if (buffer_add_ssh_string(buffer, target_s) < 0 ||
-      buffer_add_ssh_string(buffer, dest_s) < 0) {
-      ssh_set_error_oom(sftp->session);
-      ssh_buffer_free(buffer);
-      ssh_string_free(dest_s);
-      ssh_string_free(target_s);
-      return -1;
+  while (next < n || count > 0) {
+    /* keep the pipe full */
+    while (!stop && next < n && count < SFTP_STAT_REQUESTS) {
+      id = sftp_xstat_request(sftp, paths[next], param);
+      if (id < 0) {
+        failed = 1;
+        break;
+      }
+      inflight[count].id = id;
+      inflight[count].index = next++;
+      count++;
     }
-  } else {
-    if (buffer_add_ssh_string(buffer, dest_s) < 0 ||
-      buffer_add_ssh_string(buffer, target_s) < 0) {
-      ssh_set_error_oom(sftp->session);
-      ssh_buffer_free(buffer);
-      ssh_string_free(dest_s);
-      ssh_string_free(target_s);
-      return -1;
+    if (failed || count == 0) {
+      break;
     }
-  }
 
-  if (sftp_packet_write(sftp, SSH_FXP_SYMLINK, buffer) < 0) {
-    ssh_buffer_free(buffer);
-    ssh_string_free(dest_s);
-    ssh_string_free(target_s);
-    return -1;
-  }
-  ssh_buffer_free(buffer);
-  ssh_string_free(dest_s);
-  ssh_string_free(target_s);
+    msg = sftp_read_message(sftp);
+    if (msg == NULL) {
+      failed = 1;
+      break;
+    }
+    for (i = 0; i < count; i++) {
+      if (inflight[i].id == msg->id) {
+        break;
+      }
+    }
+    if (i == count) {
+      /* somebody else's */
+      if (sftp_enqueue(sftp, msg) < 0) {
+        sftp_message_free(msg);
+        failed = 1;
+        break;
+      }
+      continue;
+    }
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
-      return -1;
+    attr = sftp_xstat_reply(sftp, msg);
+    if (attr == NULL) {
+      rc = SSH_ERROR;
     }
-    msg = sftp_dequeue(sftp, id);
+    if (callback(sftp, inflight[i].index, paths[inflight[i].index], attr,
+          userdata) != 0) {
+      stop = 1;
+    }
+    inflight[i] = inflight[--count];
   }
 
-  /* By specification, this command only returns SSH_FXP_STATUS */
-  if (msg->packet_type == SSH_FXP_STATUS) {
-    status = parse_status_msg(msg);
-    sftp_message_free(msg);
-    if (status == NULL) {
-      return -1;
+  if (next < n) {
+    rc = SSH_ERROR;
+  }
+  if (failed) {
+    /* the session is gone, report what is left */
+    rc = SSH_ERROR;
+    for (i = 0; i < count; i++) {
+      callback(sftp, inflight[i].index, paths[inflight[i].index], NULL,
+          userdata);
     }
-    sftp_set_error(sftp, status->status);
-    switch (status->status) {
-      case SSH_FX_OK:
-        status_msg_free(status);
-        return 0;
-      default:
-        break;
+    for (; next < n; next++) {
+      callback(sftp, next, paths[next], NULL, userdata);
     }
-    /*
-     * The status should be SSH_FX_OK if the command was successful, if it
-     * didn't, then there was an error
-     */
-    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
-        "SFTP server: %s", status->errormsg);
-    status_msg_free(status);
-    return -1;
-  } else {
-    ssh_set_error(sftp->session, SSH_FATAL,
-        "Received message %d when attempting to set stats", msg->packet_type);
-    sftp_message_free(msg);
   }
 
-  return -1;
+  return rc;
 }
 
-char *sftp_readlink(sftp_session sftp, const char *path) {
+static int sftp_stat_many_cb(sftp_session sftp, size_t index,
+    const char *path, sftp_attributes attr, void *userdata) {
+  sftp_attributes *results = userdata;
+
+  (void) sftp;
+  (void) path;
+
+  results[index] = attr;
+
+  return 0;
+}
+
+int sftp_stat_many(sftp_session sftp, const char **paths, size_t n,
+    sftp_attributes *results) {
+  memset(results, 0, n * sizeof(sftp_attributes));
+
+  return sftp_stat_many_callback(sftp, paths, n, 1, sftp_stat_many_cb,
+      results);
+}
+
+int sftp_lstat_many(sftp_session sftp, const char **paths, size_t n,
+    sftp_attributes *results) {
+  memset(results, 0, n * sizeof(sftp_attributes));
+
+  return sftp_stat_many_callback(sftp, paths, n, 0, sftp_stat_many_cb,
+      results);
+}
+sftp_attributes sftp_fstat(sftp_file file) {
   sftp_status_message status = NULL;
   sftp_message msg = NULL;
-  ssh_string path_s = NULL;
-  ssh_string link_s = NULL;
+  sftp_attributes attr;
   ssh_buffer buffer;
-  char *lnk;
-  uint32_t ignored;
   uint32_t id;
 
-  if (sftp == NULL)
-    return NULL;
-  if (path == NULL) {
-    ssh_set_error_invalid(sftp, __FUNCTION__);
-    return NULL;
-  }
-  if (sftp->version < 3){
-    ssh_set_error(sftp,SSH_REQUEST_DENIED,"sftp version %d does not support sftp_readlink",sftp->version);
+  /* the size counts the data written behind */
+  if (sftp_write_behind_send(file) < 0) {
     return NULL;
   }
+
   buffer = ssh_buffer_new();
   if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return NULL;
-  }
-
-  path_s = ssh_string_from_char(path);
-  if (path_s == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
+    ssh_set_error_oom(file->sftp->session);
     return NULL;
   }
 
-  id = sftp_get_new_id(sftp);
+  id = sftp_get_new_id(file->sftp);
   if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, path_s) < 0) {
-    ssh_set_error_oom(sftp->session);
+      buffer_add_ssh_string(buffer, file->handle) < 0) {
+    ssh_set_error_oom(file->sftp->session);
     ssh_buffer_free(buffer);
-    ssh_string_free(path_s);
     return NULL;
   }
-  if (sftp_packet_write(sftp, SSH_FXP_READLINK, buffer) < 0) {
+  if (sftp_packet_write(file->sftp, SSH_FXP_FSTAT, buffer) < 0) {
     ssh_buffer_free(buffer);
-    ssh_string_free(path_s);
     return NULL;
   }
   ssh_buffer_free(buffer);
-  ssh_string_free(path_s);
 
   while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
+    if (sftp_read_and_dispatch(file->sftp) < 0) {
       return NULL;
     }
-    msg = sftp_dequeue(sftp, id);
+    msg = sftp_dequeue(file->sftp, id);
   }
 
-  if (msg->packet_type == SSH_FXP_NAME) {
-    /* we don't care about "count" */
-    buffer_get_u32(msg->payload, &ignored);
-    /* we only care about the file name string */
-    link_s = buffer_get_ssh_string(msg->payload);
+  if (msg->packet_type == SSH_FXP_ATTRS){
+    attr = sftp_parse_attr(file->sftp, msg->payload, 0);
     sftp_message_free(msg);
-    if (link_s == NULL) {
-      /* TODO: what error to set here? */
-      return NULL;
-    }
-    lnk = ssh_string_to_char(link_s);
-    ssh_string_free(link_s);
-
-    return lnk;
-  } else if (msg->packet_type == SSH_FXP_STATUS) { /* bad response (error) */
+    return attr;
+  } else if (msg->packet_type == SSH_FXP_STATUS) {
     status = parse_status_msg(msg);
     sftp_message_free(msg);
     if (status == NULL) {
       return NULL;
     }
-    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+    ssh_set_error(file->sftp->session, SSH_REQUEST_DENIED,
         "SFTP server: %s", status->errormsg);
     status_msg_free(status);
-  } else { /* this shouldn't happen */
-    ssh_set_error(sftp->session, SSH_FATAL,
-        "Received message %d when attempting to set stats", msg->packet_type);
-    sftp_message_free(msg);
+
+    return NULL;
   }
+  ssh_set_error(file->sftp->session, SSH_FATAL,
+      "Received msg %d during fstat()", msg->packet_type);
+  sftp_message_free(msg);
 
   return NULL;
 }
 
-static sftp_statvfs_t sftp_parse_statvfs(sftp_session sftp, ssh_buffer buf) {
-	sftp_statvfs_t  statvfs;
-  uint64_t tmp;
-  int ok = 0;
+/* Transfer manager */
 
-  statvfs = malloc(sizeof(struct sftp_statvfs_struct));
-  if (statvfs == NULL) {
+enum sftp_transfer_state_e {
+  SFTP_TRANSFER_WAITING = 0,
+  SFTP_TRANSFER_OPENING,
+  SFTP_TRANSFER_DATA,
+  SFTP_TRANSFER_CLOSING,
+  SFTP_TRANSFER_DONE
+};
+
+/* a file of the transfer */
+struct sftp_transfer_job {
+  char *remote;
+  char *local;
+  int upload;
+  enum sftp_transfer_state_e state;
+  int fd;
+  struct sftp_local_map map; /* of the file uploaded */
+  sftp_file file;
+  uint64_t offset; /* of the next read or write */
+  uint64_t bytes; /* transferred */
+  uint32_t inflight; /* reads or writes */
+  int eof;
+  char *error;
+};
+
+/* a request in flight, found from the id of its reply */
+struct sftp_transfer_request {
+  uint32_t id;
+  uint8_t type;
+  struct sftp_transfer_job *job;
+  uint64_t offset;
+  uint32_t len;
+  struct sftp_transfer_request *next;
+};
+
+struct sftp_transfer_struct {
+  sftp_session sftp;
+  struct sftp_transfer_job **jobs;
+  uint32_t count;
+  uint32_t allocated;
+  uint32_t started;
+  struct sftp_transfer_job **active;
+  unsigned int nactive;
+  unsigned int files;
+  uint32_t requests;
+  uint32_t chunk_size;
+  uint32_t inflight; /* reads and writes of all the files */
+  struct sftp_transfer_request *pool;
+  struct sftp_transfer_request *free_requests;
+  struct sftp_transfer_request **table;
+  uint32_t table_size;
+  void *chunk;
+  unsigned int failed;
+  sftp_transfer_progress_callback progress_function;
+  sftp_transfer_done_callback done_function;
+  void *userdata;
+};
+
+sftp_transfer sftp_transfer_new(sftp_session sftp) {
+  sftp_transfer transfer;
+
+  if (sftp == NULL) {
+    return NULL;
+  }
+
+  transfer = malloc(sizeof(struct sftp_transfer_struct));
+  if (transfer == NULL) {
     ssh_set_error_oom(sftp->session);
     return NULL;
   }
-  ZERO_STRUCTP(statvfs);
+  ZERO_STRUCTP(transfer);
 
-  /* try .. catch */
-  do {
-    /* file system block size */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+  transfer->sftp = sftp;
+  transfer->files = SFTP_TRANSFER_FILES;
+  transfer->requests = SFTP_DOWNLOAD_REQUESTS;
+  transfer->chunk_size = SFTP_DOWNLOAD_CHUNK_SIZE;
+
+  return transfer;
+}
+
+static void sftp_transfer_job_free(struct sftp_transfer_job *job) {
+  sftp_local_map_free(&job->map);
+  if (job->fd >= 0) {
+    close(job->fd);
+  }
+  if (job->file != NULL) {
+    ssh_string_free(job->file->handle);
+    SAFE_FREE(job->file);
+  }
+  SAFE_FREE(job->remote);
+  SAFE_FREE(job->local);
+  SAFE_FREE(job->error);
+  SAFE_FREE(job);
+}
+
+void sftp_transfer_free(sftp_transfer transfer) {
+  uint32_t i;
+
+  if (transfer == NULL) {
+    return;
+  }
+
+  for (i = 0; i < transfer->count; i++) {
+    sftp_transfer_job_free(transfer->jobs[i]);
+  }
+  SAFE_FREE(transfer->jobs);
+  SAFE_FREE(transfer->active);
+  SAFE_FREE(transfer->pool);
+  SAFE_FREE(transfer->table);
+  SAFE_FREE(transfer->chunk);
+  SAFE_FREE(transfer);
+}
+
+void sftp_transfer_set_limits(sftp_transfer transfer, unsigned int files,
+    uint32_t requests, uint32_t chunk_size) {
+  if (transfer == NULL) {
+    return;
+  }
+
+  transfer->files = files > 0 ? files : SFTP_TRANSFER_FILES;
+  transfer->requests = requests > 0 ? requests : SFTP_DOWNLOAD_REQUESTS;
+  transfer->chunk_size = chunk_size > 0 ? chunk_size :
+    SFTP_DOWNLOAD_CHUNK_SIZE;
+}
+
+void sftp_transfer_set_callbacks(sftp_transfer transfer,
+    sftp_transfer_progress_callback progress,
+    sftp_transfer_done_callback done, void *userdata) {
+  if (transfer == NULL) {
+    return;
+  }
+
+  transfer->progress_function = progress;
+  transfer->done_function = done;
+  transfer->userdata = userdata;
+}
+
+static int sftp_transfer_add(sftp_transfer transfer, const char *remote,
+    const char *local, int upload) {
+  struct sftp_transfer_job **jobs;
+  struct sftp_transfer_job *job;
+  uint32_t allocated;
+
+  if (transfer == NULL || remote == NULL || local == NULL) {
+    return SSH_ERROR;
+  }
+
+  if (transfer->count == transfer->allocated) {
+    allocated = transfer->allocated ? transfer->allocated * 2 : 16;
+    jobs = realloc(transfer->jobs, allocated * sizeof(*jobs));
+    if (jobs == NULL) {
+      ssh_set_error_oom(transfer->sftp->session);
+      return SSH_ERROR;
+    }
+    transfer->jobs = jobs;
+    transfer->allocated = allocated;
+  }
+
+  job = malloc(sizeof(struct sftp_transfer_job));
+  if (job == NULL) {
+    ssh_set_error_oom(transfer->sftp->session);
+    return SSH_ERROR;
+  }
+  ZERO_STRUCTP(job);
+  job->fd = -1;
+  job->upload = upload;
+  job->remote = strdup(remote);
+  job->local = strdup(local);
+  if (job->remote == NULL || job->local == NULL) {
+    ssh_set_error_oom(transfer->sftp->session);
+    sftp_transfer_job_free(job);
+    return SSH_ERROR;
+  }
+
+  transfer->jobs[transfer->count++] = job;
+
+  return SSH_OK;
+}
+
+int sftp_transfer_add_download(sftp_transfer transfer, const char *remote,
+    const char *local) {
+  return sftp_transfer_add(transfer, remote, local, 0);
+}
+
+int sftp_transfer_add_upload(sftp_transfer transfer, const char *local,
+    const char *remote) {
+  return sftp_transfer_add(transfer, remote, local, 1);
+}
+
+int sftp_transfer_add_tree(sftp_transfer transfer, const char *remote,
+    const char *local) {
+  sftp_attributes attr;
+  sftp_dir dir;
+  char *remote_path;
+  char *local_path;
+  size_t len;
+  int rc = SSH_OK;
+
+  if (transfer == NULL || remote == NULL || local == NULL) {
+    return SSH_ERROR;
+  }
+
+  if (ssh_mkdir(local, 0755) < 0 && errno != EEXIST) {
+    ssh_set_error(transfer->sftp->session, SSH_FATAL,
+        "Error creating directory %s: %s", local, strerror(errno));
+    return SSH_ERROR;
+  }
+
+  dir = sftp_opendir(transfer->sftp, remote);
+  if (dir == NULL) {
+    return SSH_ERROR;
+  }
+
+  while (rc == SSH_OK && (attr = sftp_readdir(transfer->sftp, dir)) != NULL) {
+    if (strcmp(attr->name, ".") == 0 || strcmp(attr->name, "..") == 0 ||
+        (attr->type != SSH_FILEXFER_TYPE_REGULAR &&
+         attr->type != SSH_FILEXFER_TYPE_DIRECTORY)) {
+      sftp_attributes_free(attr);
+      continue;
+    }
+    /* the name comes from the server, it must not leave the directory */
+    if (!ssh_path_name_valid(attr->name)) {
+      ssh_set_error(transfer->sftp->session, SSH_FATAL,
+          "Invalid file name %s in %s", attr->name, remote);
+      sftp_attributes_free(attr);
+      rc = SSH_ERROR;
       break;
     }
-    statvfs->f_bsize = ntohll(tmp);
 
-    /* fundamental fs block size */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+    len = strlen(attr->name) + 2;
+    remote_path = malloc(strlen(remote) + len);
+    local_path = malloc(strlen(local) + len);
+    if (remote_path == NULL || local_path == NULL) {
+      ssh_set_error_oom(transfer->sftp->session);
+      SAFE_FREE(remote_path);
+      SAFE_FREE(local_path);
+      sftp_attributes_free(attr);
+      rc = SSH_ERROR;
       break;
     }
-    statvfs->f_frsize = ntohll(tmp);
+    snprintf(remote_path, strlen(remote) + len, "%s/%s", remote, attr->name);
+    snprintf(local_path, strlen(local) + len, "%s/%s", local, attr->name);
+
+    if (attr->type == SSH_FILEXFER_TYPE_DIRECTORY) {
+      rc = sftp_transfer_add_tree(transfer, remote_path, local_path);
+    } else {
+      rc = sftp_transfer_add_download(transfer, remote_path, local_path);
+    }
+    SAFE_FREE(remote_path);
+    SAFE_FREE(local_path);
+    sftp_attributes_free(attr);
+  }
+
+  if (rc == SSH_OK && !sftp_dir_eof(dir)) {
+    rc = SSH_ERROR;
+  }
+  sftp_closedir(dir);
+
+  return rc;
+}
+
+static struct sftp_transfer_request **sftp_transfer_slot(
+    sftp_transfer transfer, uint32_t id) {
+  return &transfer->table[id & (transfer->table_size - 1)];
+}
+
+/* Records a request just sent, SSH_ERROR if sending it failed. */
+static int sftp_transfer_request_add(sftp_transfer transfer,
+    struct sftp_transfer_job *job, int id, uint8_t type, uint64_t offset,
+    uint32_t len) {
+  struct sftp_transfer_request **slot;
+  struct sftp_transfer_request *r;
+
+  if (id < 0) {
+    return SSH_ERROR;
+  }
+
+  /* the pool is as large as the requests which can be in flight */
+  r = transfer->free_requests;
+  transfer->free_requests = r->next;
+  r->id = id;
+  r->type = type;
+  r->job = job;
+  r->offset = offset;
+  r->len = len;
+  slot = sftp_transfer_slot(transfer, r->id);
+  r->next = *slot;
+  *slot = r;
+
+  if (type == SSH_FXP_READ || type == SSH_FXP_WRITE) {
+    job->inflight++;
+    transfer->inflight++;
+  }
+
+  return SSH_OK;
+}
+
+/* Takes the request a reply is for out of the table, NULL if none is. */
+static struct sftp_transfer_request *sftp_transfer_request_get(
+    sftp_transfer transfer, uint32_t id) {
+  struct sftp_transfer_request **ptr;
+  struct sftp_transfer_request *r;
+
+  for (ptr = sftp_transfer_slot(transfer, id); *ptr != NULL;
+      ptr = &(*ptr)->next) {
+    if ((*ptr)->id == id) {
+      r = *ptr;
+      *ptr = r->next;
+      if (r->type == SSH_FXP_READ || r->type == SSH_FXP_WRITE) {
+        r->job->inflight--;
+        transfer->inflight--;
+      }
+      return r;
+    }
+  }
+
+  return NULL;
+}
+
+static void sftp_transfer_request_put(sftp_transfer transfer,
+    struct sftp_transfer_request *r) {
+  r->next = transfer->free_requests;
+  transfer->free_requests = r;
+}
+
+/* Records the first error of a file. */
+static void sftp_transfer_job_error(struct sftp_transfer_job *job,
+    const char *error) {
+  if (job->error == NULL) {
+    job->error = strdup(error != NULL ? error : "Unknown error");
+  }
+}
+
+/* Records the error of a status reply, SSH_OK if it is SSH_FX_OK. */
+static int sftp_transfer_job_status(struct sftp_transfer_job *job,
+    sftp_message msg, int *eof) {
+  sftp_status_message status;
+  char error[256];
+  int rc = SSH_ERROR;
+
+  if (msg->packet_type != SSH_FXP_STATUS) {
+    snprintf(error, sizeof(error), "Received message %d during transfer",
+        msg->packet_type);
+    sftp_transfer_job_error(job, error);
+    return SSH_ERROR;
+  }
+
+  status = parse_status_msg(msg);
+  if (status == NULL) {
+    sftp_transfer_job_error(job, "Invalid status message");
+    return SSH_ERROR;
+  }
+  if (status->status == SSH_FX_OK) {
+    rc = SSH_OK;
+  } else if (status->status == SSH_FX_EOF && eof != NULL) {
+    *eof = 1;
+    rc = SSH_OK;
+  } else {
+    snprintf(error, sizeof(error), "SFTP server: %s", status->errormsg);
+    sftp_transfer_job_error(job, error);
+  }
+  status_msg_free(status);
+
+  return rc;
+}
+
+/* Reports a file as done and takes it out of the active ones. */
+static void sftp_transfer_job_done(sftp_transfer transfer,
+    struct sftp_transfer_job *job) {
+  unsigned int i;
+
+  job->state = SFTP_TRANSFER_DONE;
+  sftp_local_map_free(&job->map);
+  if (job->fd >= 0) {
+    close(job->fd);
+    job->fd = -1;
+  }
+  if (job->file != NULL) {
+    ssh_string_free(job->file->handle);
+    SAFE_FREE(job->file);
+  }
+  if (job->error != NULL) {
+    transfer->failed++;
+  }
 
-    /* number of blocks (unit f_frsize) */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
+  for (i = 0; i < transfer->nactive; i++) {
+    if (transfer->active[i] == job) {
+      transfer->active[i] = transfer->active[--transfer->nactive];
       break;
     }
-    statvfs->f_blocks = ntohll(tmp);
+  }
 
-    /* free blocks in file system */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
-      break;
-    }
-    statvfs->f_bfree = ntohll(tmp);
+  if (transfer->done_function != NULL) {
+    transfer->done_function(transfer, job->remote, job->local,
+        job->error != NULL ? SSH_ERROR : SSH_OK, job->error,
+        transfer->userdata);
+  }
+}
 
-    /* free blocks for non-root */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
-      break;
-    }
-    statvfs->f_bavail = ntohll(tmp);
+/* Closes the remote file once its last read or write is answered. */
+static int sftp_transfer_job_close(sftp_transfer transfer,
+    struct sftp_transfer_job *job) {
+  if (job->state != SFTP_TRANSFER_DATA || job->inflight > 0 ||
+      (!job->eof && job->error == NULL)) {
+    return SSH_OK;
+  }
 
-    /* total file inodes */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
-      break;
-    }
-    statvfs->f_files = ntohll(tmp);
+  job->state = SFTP_TRANSFER_CLOSING;
+  return sftp_transfer_request_add(transfer, job,
+      sftp_close_request(transfer->sftp, job->file->handle), SSH_FXP_CLOSE,
+      0, 0);
+}
 
-    /* free file inodes */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
-      break;
-    }
-    statvfs->f_ffree = ntohll(tmp);
+/* Opens the next file, SSH_ERROR only if the session failed. */
+static int sftp_transfer_job_start(sftp_transfer transfer,
+    struct sftp_transfer_job *job) {
+  char error[256];
+  int id;
 
-    /* free file inodes for to non-root */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
-      break;
+  if (job->upload) {
+    job->fd = open(job->local, O_RDONLY);
+    if (job->fd < 0) {
+      snprintf(error, sizeof(error), "Error opening %s: %s", job->local,
+          strerror(errno));
+      sftp_transfer_job_error(job, error);
+      sftp_transfer_job_done(transfer, job);
+      return SSH_OK;
     }
-    statvfs->f_favail = ntohll(tmp);
+    sftp_local_map_init(&job->map, job->fd, 0);
+    id = sftp_open_request(transfer->sftp, job->remote,
+        O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  } else {
+    id = sftp_open_request(transfer->sftp, job->remote, O_RDONLY, 0);
+  }
 
-    /* file system id */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
-      break;
-    }
-    statvfs->f_fsid = ntohll(tmp);
+  job->state = SFTP_TRANSFER_OPENING;
+  transfer->active[transfer->nactive++] = job;
 
-    /* bit mask of f_flag values */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
-      break;
-    }
-    statvfs->f_flag = ntohll(tmp);
+  return sftp_transfer_request_add(transfer, job, id, SSH_FXP_OPEN, 0, 0);
+}
 
-    /* maximum filename length */
-    if (buffer_get_u64(buf, &tmp) != sizeof(uint64_t)) {
-      break;
-    }
-    statvfs->f_namemax = ntohll(tmp);
+/* Sends the next read or write of a file. */
+static int sftp_transfer_job_send(sftp_transfer transfer,
+    struct sftp_transfer_job *job) {
+  const char *data;
+  char error[256];
+  uint32_t n;
+  ssize_t len;
+  int id;
 
-    ok = 1;
-  } while(0);
+  if (!job->upload) {
+    id = sftp_read_request(job->file, job->offset, transfer->chunk_size);
+    len = transfer->chunk_size;
+  } else {
+    n = transfer->chunk_size;
+    data = sftp_local_map_get(&job->map, job->offset, &n);
+    if (data != NULL) {
+      len = n;
+    } else {
+      data = transfer->chunk;
+      len = sftp_local_read(job->fd, transfer->chunk, transfer->chunk_size,
+          job->offset);
+    }
+    if (len <= 0) {
+      if (len < 0) {
+        snprintf(error, sizeof(error), "Error reading %s: %s", job->local,
+            strerror(errno));
+        sftp_transfer_job_error(job, error);
+      }
+      job->eof = 1;
+      return sftp_transfer_job_close(transfer, job);
+    }
+    id = sftp_write_request(job->file, job->offset, data, len);
+  }
 
-  if (!ok) {
-    SAFE_FREE(statvfs);
-    ssh_set_error(sftp->session, SSH_FATAL, "Invalid statvfs structure");
-    return NULL;
+  if (sftp_transfer_request_add(transfer, job, id,
+        job->upload ? SSH_FXP_WRITE : SSH_FXP_READ, job->offset,
+        len) < 0) {
+    return SSH_ERROR;
   }
+  job->offset += len;
 
-  return statvfs;
+  return SSH_OK;
 }
 
-sftp_statvfs_t sftp_statvfs(sftp_session sftp, const char *path) {
-  sftp_status_message status = NULL;
-  sftp_message msg = NULL;
-  ssh_string pathstr;
-  ssh_string ext;
-  ssh_buffer buffer;
-  uint32_t id;
+/* Handles the reply to a request, SSH_ERROR only if the session failed. */
+static int sftp_transfer_reply(sftp_transfer transfer,
+    struct sftp_transfer_request *r, sftp_message msg) {
+  struct sftp_transfer_job *job = r->job;
+  const void *data;
+  char error[256];
+  uint32_t len;
+  int id;
 
-  if (sftp == NULL)
-    return NULL;
-  if (path == NULL) {
-    ssh_set_error_invalid(sftp->session, __FUNCTION__);
-    return NULL;
+  switch (r->type) {
+    case SSH_FXP_OPEN:
+      if (msg->packet_type == SSH_FXP_HANDLE) {
+        job->file = parse_handle_msg(msg);
+        if (job->file == NULL) {
+          return SSH_ERROR;
+        }
+      } else {
+        sftp_transfer_job_status(job, msg, NULL);
+        sftp_transfer_job_error(job, "Unexpected reply to open");
+        sftp_transfer_job_done(transfer, job);
+        return SSH_OK;
+      }
+
+      job->state = SFTP_TRANSFER_DATA;
+      if (!job->upload) {
+        job->fd = open(job->local, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (job->fd < 0) {
+          snprintf(error, sizeof(error), "Error opening %s: %s", job->local,
+              strerror(errno));
+          sftp_transfer_job_error(job, error);
+        }
+      }
+      break;
+    case SSH_FXP_READ:
+      if (job->error != NULL) {
+        break;
+      }
+      if (msg->packet_type != SSH_FXP_DATA) {
+        sftp_transfer_job_status(job, msg, &job->eof);
+        break;
+      }
+      data = buffer_get_ssh_string_view(msg->payload, &len);
+      if (data == NULL || len > r->len) {
+        sftp_transfer_job_error(job, "Invalid DATA packet");
+        break;
+      }
+      if (len == 0) {
+        job->eof = 1;
+        break;
+      }
+      if (sftp_local_write(job->fd, data, len, r->offset) < 0) {
+        snprintf(error, sizeof(error), "Error writing %s: %s", job->local,
+            strerror(errno));
+        sftp_transfer_job_error(job, error);
+        break;
+      }
+      job->bytes += len;
+      if (transfer->progress_function != NULL) {
+        transfer->progress_function(transfer, job->remote, job->local,
+            job->bytes, transfer->userdata);
+      }
+      if (len < r->len) {
+        /* a short read, ask again for the rest */
+        id = sftp_read_request(job->file, r->offset + len, r->len - len);
+        if (sftp_transfer_request_add(transfer, job, id, SSH_FXP_READ,
+              r->offset + len, r->len - len) < 0) {
+          return SSH_ERROR;
+        }
+      }
+      break;
+    case SSH_FXP_WRITE:
+      if (job->error != NULL ||
+          sftp_transfer_job_status(job, msg, NULL) != SSH_OK) {
+        break;
+      }
+      job->bytes += r->len;
+      if (transfer->progress_function != NULL) {
+        transfer->progress_function(transfer, job->remote, job->local,
+            job->bytes, transfer->userdata);
+      }
+      break;
+    case SSH_FXP_CLOSE:
+      sftp_transfer_job_status(job, msg, NULL);
+      sftp_transfer_job_done(transfer, job);
+      return SSH_OK;
   }
-  if (sftp->version < 3){
-    ssh_set_error(sftp,SSH_REQUEST_DENIED,"sftp version %d does not support sftp_statvfs",sftp->version);
-    return NULL;
+
+  return sftp_transfer_job_close(transfer, job);
+}
+
+/* Fails the files not done yet after the session failed. */
+static void sftp_transfer_abort(sftp_transfer transfer) {
+  const char *error = ssh_get_error(transfer->sftp->session);
+  uint32_t i;
+
+  for (i = 0; i < transfer->started; i++) {
+    if (transfer->jobs[i]->state != SFTP_TRANSFER_DONE) {
+      sftp_transfer_job_error(transfer->jobs[i], error);
+      sftp_transfer_job_done(transfer, transfer->jobs[i]);
+    }
   }
- 
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return NULL;
+  for (; transfer->started < transfer->count; transfer->started++) {
+    sftp_transfer_job_error(transfer->jobs[transfer->started], error);
+    sftp_transfer_job_done(transfer, transfer->jobs[transfer->started]);
   }
+}
 
-  ext = ssh_string_from_char("statvfs@openssh.com");
-  if (ext == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    return NULL;
-  }
+/* Allocates the table and the pool of the requests in flight. */
+static int sftp_transfer_init(sftp_transfer transfer) {
+  sftp_session sftp = transfer->sftp;
+  sftp_limits_t limits;
+  uint32_t max;
+  uint32_t i;
+
+  /* stay within what the server accepts */
+  limits = sftp_get_limits(sftp);
+  if (limits != NULL && limits->max_open_handles > 0 &&
+      limits->max_open_handles < transfer->files) {
+    transfer->files = limits->max_open_handles;
+  }
+  transfer->chunk_size = sftp_limit_chunk(sftp,
+      sftp_limit_chunk(sftp, transfer->chunk_size, 0), 1);
+  max = transfer->requests + transfer->files;
+
+  SAFE_FREE(transfer->active);
+  SAFE_FREE(transfer->pool);
+  SAFE_FREE(transfer->table);
+  SAFE_FREE(transfer->chunk);
+
+  transfer->table_size = 16;
+  while (transfer->table_size < max * 2) {
+    transfer->table_size *= 2;
+  }
+  transfer->active = malloc(transfer->files * sizeof(*transfer->active));
+  transfer->pool = malloc(max * sizeof(struct sftp_transfer_request));
+  transfer->table = malloc(transfer->table_size * sizeof(*transfer->table));
+  transfer->chunk = malloc(transfer->chunk_size);
+  if (transfer->active == NULL || transfer->pool == NULL ||
+      transfer->table == NULL || transfer->chunk == NULL) {
+    ssh_set_error_oom(transfer->sftp->session);
+    return SSH_ERROR;
+  }
+
+  memset(transfer->table, 0, transfer->table_size * sizeof(*transfer->table));
+  transfer->free_requests = NULL;
+  for (i = 0; i < max; i++) {
+    sftp_transfer_request_put(transfer, &transfer->pool[i]);
+  }
+  transfer->nactive = 0;
+  transfer->inflight = 0;
+
+  return SSH_OK;
+}
 
-  pathstr = ssh_string_from_char(path);
-  if (pathstr == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    ssh_string_free(ext);
-    return NULL;
-  }
+int sftp_transfer_run(sftp_transfer transfer) {
+  struct sftp_transfer_request *r;
+  struct sftp_transfer_job *job;
+  sftp_message msg;
+  unsigned int i;
+  unsigned int next = 0;
+  int sent;
 
-  id = sftp_get_new_id(sftp);
-  if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, ext) < 0 ||
-      buffer_add_ssh_string(buffer, pathstr) < 0) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    ssh_string_free(ext);
-    ssh_string_free(pathstr);
-    return NULL;
+  if (transfer == NULL) {
+    return SSH_ERROR;
   }
-  if (sftp_packet_write(sftp, SSH_FXP_EXTENDED, buffer) < 0) {
-    ssh_buffer_free(buffer);
-    ssh_string_free(ext);
-    ssh_string_free(pathstr);
-    return NULL;
+
+  if (sftp_transfer_init(transfer) < 0) {
+    return SSH_ERROR;
   }
-  ssh_buffer_free(buffer);
-  ssh_string_free(ext);
-  ssh_string_free(pathstr);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
-      return NULL;
+  for (;;) {
+    /* open the next files, their opens are in flight together */
+    while (transfer->nactive < transfer->files &&
+        transfer->started < transfer->count) {
+      job = transfer->jobs[transfer->started++];
+      if (sftp_transfer_job_start(transfer, job) < 0) {
+        goto error;
+      }
+    }
+    if (transfer->nactive == 0) {
+      break;
     }
-    msg = sftp_dequeue(sftp, id);
-  }
 
-  if (msg->packet_type == SSH_FXP_EXTENDED_REPLY) {
-  	sftp_statvfs_t  buf = sftp_parse_statvfs(sftp, msg->payload);
-    sftp_message_free(msg);
-    if (buf == NULL) {
-      return NULL;
+    /* share the reads and writes in flight between the open files */
+    sent = 1;
+    while (transfer->inflight < transfer->requests && sent) {
+      sent = 0;
+      for (i = 0; i < transfer->nactive &&
+          transfer->inflight < transfer->requests; i++) {
+        job = transfer->active[(next + i) % transfer->nactive];
+        if (job->state != SFTP_TRANSFER_DATA || job->eof ||
+            job->error != NULL) {
+          continue;
+        }
+        if (sftp_transfer_job_send(transfer, job) < 0) {
+          goto error;
+        }
+        sent = 1;
+      }
+      next++;
     }
 
-    return buf;
-  } else if (msg->packet_type == SSH_FXP_STATUS) { /* bad response (error) */
-    status = parse_status_msg(msg);
-    sftp_message_free(msg);
-    if (status == NULL) {
-      return NULL;
+    msg = sftp_read_message(transfer->sftp);
+    if (msg == NULL) {
+      goto error;
+    }
+    r = sftp_transfer_request_get(transfer, msg->id);
+    if (r == NULL) {
+      /* not ours, it waits for its caller */
+      if (sftp_enqueue(transfer->sftp, msg) < 0) {
+        sftp_message_free(msg);
+        goto error;
+      }
+      continue;
+    }
+    if (sftp_transfer_reply(transfer, r, msg) < 0) {
+      sftp_message_free(msg);
+      sftp_transfer_request_put(transfer, r);
+      goto error;
     }
-    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
-        "SFTP server: %s", status->errormsg);
-    status_msg_free(status);
-  } else { /* this shouldn't happen */
-    ssh_set_error(sftp->session, SSH_FATAL,
-        "Received message %d when attempting to get statvfs", msg->packet_type);
     sftp_message_free(msg);
+    sftp_transfer_request_put(transfer, r);
   }
 
-  return NULL;
+  return transfer->failed > 0 ? SSH_ERROR : SSH_OK;
+
+error:
+  sftp_transfer_abort(transfer);
+  return SSH_ERROR;
 }
 
-sftp_statvfs_t sftp_fstatvfs(sftp_file file) {
-  sftp_status_message status = NULL;
-  sftp_message msg = NULL;
-  sftp_session sftp;
-  ssh_string ext;
-  ssh_buffer buffer;
-  uint32_t id;
+/* Striped transfers */
 
-  if (file == NULL) {
-    return NULL;
-  }
-  sftp = file->sftp;
+/* a read or write in flight of a stripe */
+struct sftp_stripe_request {
+  uint32_t id;
+  uint64_t offset;
+  uint32_t len;
+  int used;
+};
 
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return NULL;
-  }
+/* a contiguous part of a striped transfer, moved over its own session */
+struct sftp_stripe {
+  sftp_session sftp;
+  sftp_file file;
+  uint64_t offset; /* of the next request */
+  uint64_t end;
+  uint32_t chunk_size;
+  struct sftp_stripe_request *requests;
+  uint32_t inflight;
+  struct sftp_local_map map; /* of the file uploaded */
+  char *chunk; /* the data read if it can't be mapped */
+  int eof;
+};
 
-  ext = ssh_string_from_char("fstatvfs@openssh.com");
-  if (ext == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    return NULL;
-  }
+/* Sends the next read or write of a stripe. */
+static int sftp_stripe_send(struct sftp_stripe *stripe, uint32_t nrequests,
+    int fd, int upload) {
+  struct sftp_stripe_request *r = NULL;
+  const char *data;
+  uint32_t len;
+  ssize_t n;
+  uint32_t i;
+  int id;
 
-  id = sftp_get_new_id(sftp);
-  if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, ext) < 0 ||
-      buffer_add_ssh_string(buffer, file->handle) < 0) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    ssh_string_free(ext);
-    return NULL;
+  for (i = 0; i < nrequests; i++) {
+    if (!stripe->requests[i].used) {
+      r = &stripe->requests[i];
+      break;
+    }
   }
-  if (sftp_packet_write(sftp, SSH_FXP_EXTENDED, buffer) < 0) {
-    ssh_buffer_free(buffer);
-    ssh_string_free(ext);
-    return NULL;
+  if (r == NULL) {
+    return SSH_OK;
   }
-  ssh_buffer_free(buffer);
-  ssh_string_free(ext);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
-      return NULL;
+  len = stripe->end - stripe->offset < stripe->chunk_size ?
+    stripe->end - stripe->offset : stripe->chunk_size;
+  if (upload) {
+    data = sftp_local_map_get(&stripe->map, stripe->offset, &len);
+    if (data == NULL) {
+      data = stripe->chunk;
+      n = sftp_local_read(fd, stripe->chunk, len, stripe->offset);
+      if (n < 0) {
+        ssh_set_error(stripe->sftp->session, SSH_FATAL,
+            "Error reading the upload: %s", strerror(errno));
+        return SSH_ERROR;
+      }
+      len = n;
     }
-    msg = sftp_dequeue(sftp, id);
+    if (len == 0) {
+      /* the local file got shorter */
+      stripe->eof = 1;
+      return SSH_OK;
+    }
+    id = sftp_write_request(stripe->file, stripe->offset, data, len);
+  } else {
+    id = sftp_read_request(stripe->file, stripe->offset, len);
+  }
+  if (id < 0) {
+    return SSH_ERROR;
   }
 
-  if (msg->packet_type == SSH_FXP_EXTENDED_REPLY) {
-  	sftp_statvfs_t buf = sftp_parse_statvfs(sftp, msg->payload);
-    sftp_message_free(msg);
-    if (buf == NULL) {
-      return NULL;
-    }
+  r->id = id;
+  r->offset = stripe->offset;
+  r->len = len;
+  r->used = 1;
+  stripe->offset += len;
+  stripe->inflight++;
+
+  return SSH_OK;
+}
+
+/*
+ * Handles a reply to a stripe, freeing it.
+ * Returns the number of bytes moved, SSH_ERROR on error.
+ */
+static int64_t sftp_stripe_reply(struct sftp_stripe *stripe,
+    struct sftp_stripe_request *r, sftp_message msg, int fd, int upload) {
+  sftp_session sftp = stripe->sftp;
+  sftp_status_message status;
+  const void *data;
+  uint32_t len;
+  int id;
 
-    return buf;
-  } else if (msg->packet_type == SSH_FXP_STATUS) { /* bad response (error) */
+  if (upload) {
+    return sftp_write_reply(sftp, msg) == SSH_OK ? (int64_t) r->len :
+      SSH_ERROR;
+  }
+
+  if (msg->packet_type == SSH_FXP_STATUS) {
     status = parse_status_msg(msg);
     sftp_message_free(msg);
     if (status == NULL) {
-      return NULL;
+      return SSH_ERROR;
+    }
+    sftp_set_error(sftp, status->status);
+    if (status->status != SSH_FX_EOF) {
+      ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
+          "SFTP server: %s", status->errormsg);
+      status_msg_free(status);
+      return SSH_ERROR;
     }
-    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
-        "SFTP server: %s", status->errormsg);
     status_msg_free(status);
-  } else { /* this shouldn't happen */
+    stripe->eof = 1;
+    return 0;
+  } else if (msg->packet_type != SSH_FXP_DATA) {
     ssh_set_error(sftp->session, SSH_FATAL,
-        "Received message %d when attempting to set stats", msg->packet_type);
+        "Received message %d during read!", msg->packet_type);
     sftp_message_free(msg);
+    return SSH_ERROR;
   }
 
-  return NULL;
-}
+  data = buffer_get_ssh_string_view(msg->payload, &len);
+  if (data == NULL || len > r->len) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Received invalid DATA packet from sftp server");
+    sftp_message_free(msg);
+    return SSH_ERROR;
+  }
+  if (len > 0 && sftp_local_write(fd, data, len, r->offset) < 0) {
+    ssh_set_error(sftp->session, SSH_FATAL,
+        "Error writing the download: %s", strerror(errno));
+    sftp_message_free(msg);
+    return SSH_ERROR;
+  }
+  sftp_message_free(msg);
 
-void sftp_statvfs_free(sftp_statvfs_t statvfs) {
-  if (statvfs == NULL) {
-    return;
+  if (len == 0) {
+    stripe->eof = 1;
+  } else if (len < r->len) {
+    /* a short read, ask again for the rest */
+    id = sftp_read_request(stripe->file, r->offset + len, r->len - len);
+    if (id < 0) {
+      return SSH_ERROR;
+    }
+    r->id = id;
+    r->offset += len;
+    r->len -= len;
+    r->used = 1;
+    stripe->inflight++;
   }
 
-  SAFE_FREE(statvfs);
+  return len;
 }
 
-/* another code written by Nick */
-char *sftp_canonicalize_path(sftp_session sftp, const char *path) {
-  sftp_status_message status = NULL;
-  sftp_message msg = NULL;
-  ssh_string name = NULL;
-  ssh_string pathstr;
-  ssh_buffer buffer;
-  char *cname;
-  uint32_t ignored;
-  uint32_t id;
+/*
+ * Reads the next reply of a stripe. A reply to another request of its
+ * session is queued for its caller.
+ * Returns the number of bytes moved, SSH_ERROR if the session failed.
+ */
+static int64_t sftp_stripe_read(struct sftp_stripe *stripe,
+    uint32_t nrequests, int fd, int upload, int *rc) {
+  struct sftp_stripe_request *r;
+  sftp_message msg;
+  int64_t n;
+  uint32_t i;
 
-  if (sftp == NULL)
-    return NULL;
-  if (path == NULL) {
-    ssh_set_error_invalid(sftp->session, __FUNCTION__);
-    return NULL;
+  msg = sftp_read_message(stripe->sftp);
+  if (msg == NULL) {
+    return SSH_ERROR;
   }
 
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return NULL;
+  for (i = 0; i < nrequests; i++) {
+    r = &stripe->requests[i];
+    if (r->used && r->id == msg->id) {
+      break;
+    }
   }
-
-  pathstr = ssh_string_from_char(path);
-  if (pathstr == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    return NULL;
+  if (i == nrequests) {
+    if (sftp_enqueue(stripe->sftp, msg) < 0) {
+      sftp_message_free(msg);
+      return SSH_ERROR;
+    }
+    return 0;
   }
+  r->used = 0;
+  stripe->inflight--;
 
-  id = sftp_get_new_id(sftp);
-  if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, pathstr) < 0) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    ssh_string_free(pathstr);
-    return NULL;
+  /* after an error, the requests still in flight are only drained */
+  if (*rc != SSH_OK) {
+    sftp_message_free(msg);
+    return 0;
   }
-  if (sftp_packet_write(sftp, SSH_FXP_REALPATH, buffer) < 0) {
-    ssh_buffer_free(buffer);
-    ssh_string_free(pathstr);
-    return NULL;
+
+  n = sftp_stripe_reply(stripe, r, msg, fd, upload);
+  if (n < 0) {
+    *rc = SSH_ERROR;
+    return 0;
   }
-  ssh_buffer_free(buffer);
-  ssh_string_free(pathstr);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
-      return NULL;
+  return n;
+}
+
+/* Moves a file cut in as many parts as sessions, all in flight together. */
+static int64_t sftp_striped(sftp_session *sessions, size_t count,
+    const char *path, int fd, int upload, uint32_t nrequests,
+    uint32_t chunk_size) {
+  struct sftp_stripe *stripes;
+  struct sftp_stripe *stripe;
+  struct sftp_stripe *failed = NULL;
+  ssh_channel_set set = NULL;
+  sftp_attributes attr;
+  struct stat st;
+  uint64_t size = 0;
+  uint64_t part;
+  int64_t total = 0;
+  int64_t n;
+  size_t used;
+  size_t i;
+  int progress;
+  int rc = SSH_OK;
+
+  if (sessions == NULL || count == 0 || path == NULL) {
+    return SSH_ERROR;
+  }
+  for (i = 0; i < count; i++) {
+    if (sessions[i] == NULL) {
+      return SSH_ERROR;
     }
-    msg = sftp_dequeue(sftp, id);
   }
 
-  if (msg->packet_type == SSH_FXP_NAME) {
-    /* we don't care about "count" */
-    buffer_get_u32(msg->payload, &ignored);
-    /* we only care about the file name string */
-    name = buffer_get_ssh_string(msg->payload);
-    sftp_message_free(msg);
-    if (name == NULL) {
-      /* TODO: error message? */
-      return NULL;
+  stripes = calloc(count, sizeof(struct sftp_stripe));
+  if (stripes == NULL) {
+    ssh_set_error_oom(sessions[0]->session);
+    return SSH_ERROR;
+  }
+  for (i = 0; i < count; i++) {
+    stripes[i].sftp = sessions[i];
+  }
+
+  /* the first session creates the file or gives its size */
+  if (upload) {
+    if (fstat(fd, &st) < 0) {
+      ssh_set_error(sessions[0]->session, SSH_FATAL,
+          "Error reading the local file: %s", strerror(errno));
+      SAFE_FREE(stripes);
+      return SSH_ERROR;
     }
-    cname = ssh_string_to_char(name);
-    ssh_string_free(name);
-    if (cname == NULL) {
-      ssh_set_error_oom(sftp->session);
+    size = st.st_size;
+    stripes[0].file = sftp_open(sessions[0], path,
+        O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  } else {
+    stripes[0].file = sftp_open(sessions[0], path, O_RDONLY, 0);
+  }
+  if (stripes[0].file == NULL) {
+    SAFE_FREE(stripes);
+    return SSH_ERROR;
+  }
+  if (!upload) {
+    attr = sftp_fstat(stripes[0].file);
+    if (attr == NULL) {
+      failed = &stripes[0];
+      rc = SSH_ERROR;
+      used = 1;
+      goto out;
     }
-    return cname;
-  } else if (msg->packet_type == SSH_FXP_STATUS) { /* bad response (error) */
-    status = parse_status_msg(msg);
-    sftp_message_free(msg);
-    if (status == NULL) {
-      return NULL;
+    if (attr->flags & SSH_FILEXFER_ATTR_SIZE) {
+      size = attr->size;
     }
-    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
-        "SFTP server: %s", status->errormsg);
-    status_msg_free(status);
-  } else { /* this shouldn't happen */
-    ssh_set_error(sftp->session, SSH_FATAL,
-        "Received message %d when attempting to set stats", msg->packet_type);
-    sftp_message_free(msg);
-  }
-
-  return NULL;
-}
-
-static sftp_attributes sftp_xstat(sftp_session sftp, const char *path,
-    int param) {
-  sftp_status_message status = NULL;
-  sftp_message msg = NULL;
-  ssh_string pathstr;
-  ssh_buffer buffer;
-  uint32_t id;
-
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(sftp->session);
-    return NULL;
+    sftp_attributes_free(attr);
   }
 
-  pathstr = ssh_string_from_char(path);
-  if (pathstr == NULL) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    return NULL;
+  /* no more parts than chunks, each one a whole number of chunks */
+  used = size / chunk_size + 1;
+  if (used > count) {
+    used = count;
   }
+  part = (size / used + chunk_size - 1) / chunk_size * chunk_size;
 
-  id = sftp_get_new_id(sftp);
-  if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, pathstr) < 0) {
-    ssh_set_error_oom(sftp->session);
-    ssh_buffer_free(buffer);
-    ssh_string_free(pathstr);
-    return NULL;
-  }
-  if (sftp_packet_write(sftp, param, buffer) < 0) {
-    ssh_buffer_free(buffer);
-    ssh_string_free(pathstr);
-    return NULL;
+  set = ssh_channel_set_new();
+  if (set == NULL) {
+    ssh_set_error_oom(sessions[0]->session);
+    rc = SSH_ERROR;
+    goto out;
   }
-  ssh_buffer_free(buffer);
-  ssh_string_free(pathstr);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(sftp) < 0) {
-      return NULL;
+  for (i = 0; i < used; i++) {
+    stripe = &stripes[i];
+    stripe->offset = i * part;
+    stripe->end = stripe->offset + part;
+    if (i == used - 1) {
+      /* a file which grew is read to its end */
+      stripe->end = upload ? size : (uint64_t) -1;
+    }
+    stripe->chunk_size = sftp_limit_chunk(stripe->sftp, chunk_size, upload);
+    stripe->requests = calloc(nrequests, sizeof(struct sftp_stripe_request));
+    if (stripe->requests == NULL) {
+      ssh_set_error_oom(stripe->sftp->session);
+      failed = stripe;
+      rc = SSH_ERROR;
+      goto out;
+    }
+    if (upload) {
+      sftp_local_map_init(&stripe->map, fd, stripe->offset);
+      stripe->chunk = malloc(stripe->chunk_size);
+      if (stripe->chunk == NULL) {
+        ssh_set_error_oom(stripe->sftp->session);
+        failed = stripe;
+        rc = SSH_ERROR;
+        goto out;
+      }
+    }
+    if (i > 0) {
+      stripe->file = sftp_open(stripe->sftp, path,
+          upload ? O_WRONLY : O_RDONLY, 0);
+      if (stripe->file == NULL) {
+        failed = stripe;
+        rc = SSH_ERROR;
+        goto out;
+      }
+    }
+    if (ssh_channel_set_add(set, stripe->sftp->channel,
+          SSH_CHANNEL_SET_READ) < 0) {
+      ssh_set_error_oom(stripe->sftp->session);
+      failed = stripe;
+      rc = SSH_ERROR;
+      goto out;
     }
-    msg = sftp_dequeue(sftp, id);
   }
 
-  if (msg->packet_type == SSH_FXP_ATTRS) {
-    sftp_attributes attr = sftp_parse_attr(sftp, msg->payload, 0);
-    sftp_message_free(msg);
+  for (;;) {
+    /* keep the pipeline of each part full */
+    progress = 0;
+    for (i = 0; i < used; i++) {
+      stripe = &stripes[i];
+      while (rc == SSH_OK && !stripe->eof && stripe->inflight < nrequests &&
+          stripe->offset < stripe->end) {
+        if (sftp_stripe_send(stripe, nrequests, fd, upload) < 0) {
+          failed = stripe;
+          rc = SSH_ERROR;
+        }
+      }
+      progress |= stripe->inflight > 0;
+    }
+    if (!progress) {
+      break;
+    }
 
-    return attr;
-  } else if (msg->packet_type == SSH_FXP_STATUS) {
-    status = parse_status_msg(msg);
-    sftp_message_free(msg);
-    if (status == NULL) {
-      return NULL;
+    /* take the replies already there, or wait for some */
+    progress = 0;
+    for (i = 0; i < used; i++) {
+      stripe = &stripes[i];
+      while (stripe->inflight > 0) {
+        n = ssh_channel_poll(stripe->sftp->channel, 0);
+        if (n == 0) {
+          break;
+        } else if (n < 0) {
+          if (n == SSH_EOF) {
+            ssh_set_error(stripe->sftp->session, SSH_FATAL,
+                "The sftp channel has been closed");
+          }
+          failed = stripe;
+          rc = SSH_ERROR;
+          goto out;
+        }
+        n = sftp_stripe_read(stripe, nrequests, fd, upload, &rc);
+        if (n < 0) {
+          failed = stripe;
+          rc = SSH_ERROR;
+          goto out;
+        }
+        if (rc != SSH_OK && failed == NULL) {
+          failed = stripe;
+        }
+        total += n;
+        progress = 1;
+      }
+    }
+    if (!progress && ssh_channel_set_select(set, -1) == SSH_ERROR) {
+      ssh_set_error(sessions[0]->session, SSH_FATAL,
+          "Error waiting for the sftp channels: %s", strerror(errno));
+      rc = SSH_ERROR;
+      goto out;
     }
-    sftp_set_error(sftp, status->status);
-    ssh_set_error(sftp->session, SSH_REQUEST_DENIED,
-        "SFTP server: %s", status->errormsg);
-    status_msg_free(status);
-    return NULL;
   }
-  ssh_set_error(sftp->session, SSH_FATAL,
-      "Received mesg %d during stat()", msg->packet_type);
-  sftp_message_free(msg);
 
-  return NULL;
-}
+out:
+  /* the error goes to the first session, where the caller looks */
+  if (failed != NULL && failed->sftp->session != sessions[0]->session) {
+    ssh_set_error(sessions[0]->session,
+        ssh_get_error_code(failed->sftp->session), "%s",
+        ssh_get_error(failed->sftp->session));
+  }
+  ssh_channel_set_free(set);
+  for (i = 0; i < count; i++) {
+    stripe = &stripes[i];
+    if (stripe->file != NULL) {
+      sftp_close(stripe->file);
+    }
+    sftp_local_map_free(&stripe->map);
+    SAFE_FREE(stripe->requests);
+    SAFE_FREE(stripe->chunk);
+  }
+  SAFE_FREE(stripes);
 
-sftp_attributes sftp_stat(sftp_session session, const char *path) {
-  return sftp_xstat(session, path, SSH_FXP_STAT);
-}
+  if (rc != SSH_OK) {
+    return SSH_ERROR;
+  }
 
-sftp_attributes sftp_lstat(sftp_session session, const char *path) {
-  return sftp_xstat(session, path, SSH_FXP_LSTAT);
+  return total;
 }
 
-sftp_attributes sftp_fstat(sftp_file file) {
-  sftp_status_message status = NULL;
-  sftp_message msg = NULL;
-  ssh_buffer buffer;
-  uint32_t id;
-
-  buffer = ssh_buffer_new();
-  if (buffer == NULL) {
-    ssh_set_error_oom(file->sftp->session);
-    return NULL;
-  }
+int64_t sftp_download_striped(sftp_session *sessions, size_t count,
+    const char *path, int fd, sftp_download_options opts) {
+  uint32_t nrequests = SFTP_DOWNLOAD_REQUESTS;
+  uint32_t chunk_size = SFTP_DOWNLOAD_CHUNK_SIZE;
 
-  id = sftp_get_new_id(file->sftp);
-  if (buffer_add_u32(buffer, id) < 0 ||
-      buffer_add_ssh_string(buffer, file->handle) < 0) {
-    ssh_set_error_oom(file->sftp->session);
-    ssh_buffer_free(buffer);
-    return NULL;
+  if (opts != NULL && opts->requests > 0) {
+    nrequests = opts->requests;
   }
-  if (sftp_packet_write(file->sftp, SSH_FXP_FSTAT, buffer) < 0) {
-    ssh_buffer_free(buffer);
-    return NULL;
+  if (opts != NULL && opts->chunk_size > 0) {
+    chunk_size = opts->chunk_size;
   }
-  ssh_buffer_free(buffer);
 
-  while (msg == NULL) {
-    if (sftp_read_and_dispatch(file->sftp) < 0) {
-      return NULL;
-    }
-    msg = sftp_dequeue(file->sftp, id);
-  }
+  return sftp_striped(sessions, count, path, fd, 0, nrequests, chunk_size);
+}
 
-  if (msg->packet_type == SSH_FXP_ATTRS){
-    return sftp_parse_attr(file->sftp, msg->payload, 0);
-  } else if (msg->packet_type == SSH_FXP_STATUS) {
-    status = parse_status_msg(msg);
-    sftp_message_free(msg);
-    if (status == NULL) {
-      return NULL;
-    }
-    ssh_set_error(file->sftp->session, SSH_REQUEST_DENIED,
-        "SFTP server: %s", status->errormsg);
-    status_msg_free(status);
+int64_t sftp_upload_striped(int fd, sftp_session *sessions, size_t count,
+    const char *path, sftp_upload_options opts) {
+  uint32_t nrequests = SFTP_UPLOAD_REQUESTS;
+  uint32_t chunk_size = SFTP_UPLOAD_CHUNK_SIZE;
 
-    return NULL;
+  if (opts != NULL && opts->requests > 0) {
+    nrequests = opts->requests;
+  }
+  if (opts != NULL && opts->chunk_size > 0) {
+    chunk_size = opts->chunk_size;
   }
-  ssh_set_error(file->sftp->session, SSH_FATAL,
-      "Received msg %d during fstat()", msg->packet_type);
-  sftp_message_free(msg);
 
-  return NULL;
+  return sftp_striped(sessions, count, path, fd, 1, nrequests, chunk_size);
 }
 
 #endif /* WITH_SFTP */
@@ -21,11 +21,20 @@
  * MA 02111-1307, USA.
  */
 
+#include "config.h"
+
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #endif
 
@@ -34,68 +43,122 @@
 #include "libssh/ssh2.h"
 #include "libssh/priv.h"
 #include "libssh/buffer.h"
+#include "libssh/channels.h"
 #include "libssh/misc.h"
+#include "libssh/callbacks.h"
+#include "libssh/threads.h"
 
-sftp_client_message sftp_get_client_message(sftp_session sftp) {
-  ssh_session session = sftp->session;
-  sftp_packet packet;
+/* the freed requests kept for reuse by a session, with their payload */
+#define SFTP_FREE_CLIENT_MESSAGES 64
+
+/* the strings of a request which point into its payload */
+#define SFTP_VIEW_FILENAME 0x01
+#define SFTP_VIEW_HANDLE 0x02
+#define SFTP_VIEW_DATA 0x04
+
+/* a request with an empty payload, reused if the session has one */
+static sftp_client_message sftp_client_message_new(sftp_session sftp) {
   sftp_client_message msg;
-  ssh_buffer payload;
-  ssh_string tmp;
+
+  if (sftp->free_client_messages != NULL) {
+    msg = sftp->free_client_messages;
+    sftp->free_client_messages = msg->next;
+    sftp->free_client_count--;
+    msg->next = NULL;
+    return msg;
+  }
 
   msg = malloc(sizeof (struct sftp_client_message_struct));
   if (msg == NULL) {
-    ssh_set_error_oom(session);
+    ssh_set_error_oom(sftp->session);
     return NULL;
   }
   ZERO_STRUCTP(msg);
 
-  packet = sftp_packet_read(sftp);
-  if (packet == NULL) {
-    ssh_set_error_oom(session);
-    sftp_client_message_free(msg);
+  msg->payload = ssh_buffer_new();
+  if (msg->payload == NULL) {
+    ssh_set_error_oom(sftp->session);
+    SAFE_FREE(msg);
     return NULL;
   }
-
-  payload = packet->payload;
-  msg->type = packet->type;
   msg->sftp = sftp;
 
+  return msg;
+}
+
+/*
+ * An ssh string of the payload, without copy: the ssh_string_struct has the
+ * layout of the wire, length then data.
+ */
+static ssh_string sftp_client_message_string(sftp_client_message msg,
+    int view) {
+  const unsigned char *data;
+  uint32_t len;
+
+  data = buffer_get_ssh_string_view(msg->payload, &len);
+  if (data == NULL) {
+    return NULL;
+  }
+  msg->views |= view;
+
+  return (ssh_string) (data - sizeof(uint32_t));
+}
+
+/*
+ * A file name of the payload, without copy: it is moved over its length,
+ * which leaves room for the terminating null.
+ */
+static char *sftp_client_message_filename(sftp_client_message msg) {
+  const unsigned char *data;
+  char *filename;
+  uint32_t len;
+
+  data = buffer_get_ssh_string_view(msg->payload, &len);
+  if (data == NULL) {
+    return NULL;
+  }
+  filename = (char *) data - sizeof(uint32_t);
+  memmove(filename, data, len);
+  filename[len] = '\0';
+  msg->views |= SFTP_VIEW_FILENAME;
+
+  return filename;
+}
+
+/* Parse the request in the payload of a message. */
+static int sftp_parse_client_message(sftp_client_message msg, uint8_t type) {
+  sftp_session sftp = msg->sftp;
+  ssh_buffer payload = msg->payload;
+
+  msg->type = type;
+
   buffer_get_u32(payload, &msg->id);
 
   switch(msg->type) {
     case SSH_FXP_CLOSE:
     case SSH_FXP_READDIR:
-      msg->handle = buffer_get_ssh_string(payload);
+      msg->handle = sftp_client_message_string(msg, SFTP_VIEW_HANDLE);
       if (msg->handle == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       break;
     case SSH_FXP_READ:
-      msg->handle = buffer_get_ssh_string(payload);
+      msg->handle = sftp_client_message_string(msg, SFTP_VIEW_HANDLE);
       if (msg->handle == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       buffer_get_u64(payload, &msg->offset);
       buffer_get_u32(payload, &msg->len);
       break;
     case SSH_FXP_WRITE:
-      msg->handle = buffer_get_ssh_string(payload);
+      msg->handle = sftp_client_message_string(msg, SFTP_VIEW_HANDLE);
       if (msg->handle == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       buffer_get_u64(payload, &msg->offset);
-      msg->data = buffer_get_ssh_string(payload);
+      msg->data = sftp_client_message_string(msg, SFTP_VIEW_DATA);
       if (msg->data == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       break;
     case SSH_FXP_REMOVE:
@@ -103,156 +166,184 @@ sftp_client_message sftp_get_client_message(sftp_session sftp) {
     case SSH_FXP_OPENDIR:
     case SSH_FXP_READLINK:
     case SSH_FXP_REALPATH:
-      tmp = buffer_get_ssh_string(payload);
-      if (tmp == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->filename = ssh_string_to_char(tmp);
-      ssh_string_free(tmp);
+      msg->filename = sftp_client_message_filename(msg);
       if (msg->filename == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       break;
     case SSH_FXP_RENAME:
     case SSH_FXP_SYMLINK:
-      tmp = buffer_get_ssh_string(payload);
-      if (tmp == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->filename = ssh_string_to_char(tmp);
-      ssh_string_free(tmp);
+      msg->filename = sftp_client_message_filename(msg);
       if (msg->filename == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
-      msg->data = buffer_get_ssh_string(payload);
+      msg->data = sftp_client_message_string(msg, SFTP_VIEW_DATA);
       if (msg->data == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       break;
     case SSH_FXP_MKDIR:
     case SSH_FXP_SETSTAT:
-      tmp = buffer_get_ssh_string(payload);
-      if (tmp == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->filename=ssh_string_to_char(tmp);
-      ssh_string_free(tmp);
+      msg->filename = sftp_client_message_filename(msg);
       if (msg->filename == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       msg->attr = sftp_parse_attr(sftp, payload, 0);
       if (msg->attr == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       break;
     case SSH_FXP_FSETSTAT:
-      msg->handle = buffer_get_ssh_string(payload);
+      msg->handle = sftp_client_message_string(msg, SFTP_VIEW_HANDLE);
       if (msg->handle == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       msg->attr = sftp_parse_attr(sftp, payload, 0);
       if (msg->attr == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       break;
     case SSH_FXP_LSTAT:
     case SSH_FXP_STAT:
-      tmp = buffer_get_ssh_string(payload);
-      if (tmp == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->filename = ssh_string_to_char(tmp);
-      ssh_string_free(tmp);
+      msg->filename = sftp_client_message_filename(msg);
       if (msg->filename == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       if(sftp->version > 3) {
         buffer_get_u32(payload,&msg->flags);
       }
       break;
     case SSH_FXP_OPEN:
-      tmp=buffer_get_ssh_string(payload);
-      if (tmp == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
-      }
-      msg->filename = ssh_string_to_char(tmp);
-      ssh_string_free(tmp);
+      msg->filename = sftp_client_message_filename(msg);
       if (msg->filename == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       buffer_get_u32(payload,&msg->flags);
       msg->attr = sftp_parse_attr(sftp, payload, 0);
       if (msg->attr == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
+      break;
     case SSH_FXP_FSTAT:
-      msg->handle = buffer_get_ssh_string(payload);
+      msg->handle = sftp_client_message_string(msg, SFTP_VIEW_HANDLE);
       if (msg->handle == NULL) {
-        ssh_set_error_oom(session);
-        sftp_client_message_free(msg);
-        return NULL;
+        goto error;
       }
       buffer_get_u32(payload, &msg->flags);
       break;
+    case SSH_FXP_EXTENDED:
+      /* the name of the extension, then its data up to the end */
+      msg->filename = sftp_client_message_filename(msg);
+      if (msg->filename == NULL) {
+        goto error;
+      }
+      msg->data = ssh_string_new(buffer_get_rest_len(payload));
+      if (msg->data == NULL) {
+        ssh_set_error_oom(sftp->session);
+        return -1;
+      }
+      ssh_string_fill(msg->data, buffer_get_rest(payload),
+          buffer_get_rest_len(payload));
+      break;
     default:
       ssh_set_error(sftp->session, SSH_FATAL,
                     "Received unhandled sftp message %d\n", msg->type);
-      sftp_client_message_free(msg);
-      return NULL;
+      return -1;
   }
 
   msg->flags = ntohl(msg->flags);
   msg->offset = ntohll(msg->offset);
   msg->len = ntohl(msg->len);
+
+  return 0;
+error:
+  ssh_set_error(sftp->session, SSH_FATAL,
+      "Invalid sftp message %d", msg->type);
+  return -1;
+}
+
+sftp_client_message sftp_get_client_message(sftp_session sftp) {
+  sftp_packet packet;
+  sftp_client_message msg;
+  ssh_buffer payload;
+  uint8_t type;
+
+  msg = sftp_client_message_new(sftp);
+  if (msg == NULL) {
+    return NULL;
+  }
+  packet = sftp_packet_read(sftp);
+  if (packet == NULL) {
+    sftp_client_message_free(msg);
+    return NULL;
+  }
+
+  /* the message keeps the request, its strings point into it */
+  type = packet->type;
+  payload = msg->payload;
+  msg->payload = packet->payload;
+  packet->payload = payload;
   sftp_packet_free(packet);
+  if (sftp_parse_client_message(msg, type) < 0) {
+    sftp_client_message_free(msg);
+    return NULL;
+  }
 
   return msg;
 }
 
 void sftp_client_message_free(sftp_client_message msg) {
+  sftp_session sftp;
+  ssh_buffer payload;
+
   if (msg == NULL) {
     return;
   }
 
-  SAFE_FREE(msg->filename);
-  ssh_string_free(msg->data);
-  ssh_string_free(msg->handle);
+  if (!(msg->views & SFTP_VIEW_FILENAME)) {
+    SAFE_FREE(msg->filename);
+  }
+  if (!(msg->views & SFTP_VIEW_DATA)) {
+    ssh_string_free(msg->data);
+  }
+  if (!(msg->views & SFTP_VIEW_HANDLE)) {
+    ssh_string_free(msg->handle);
+  }
   sftp_attributes_free(msg->attr);
 
+  sftp = msg->sftp;
+  payload = msg->payload;
   ZERO_STRUCTP(msg);
+
+  /* kept with its payload for the next request of the session */
+  if (sftp != NULL && payload != NULL &&
+      sftp->free_client_count < SFTP_FREE_CLIENT_MESSAGES &&
+      buffer_reinit(payload) == 0) {
+    msg->sftp = sftp;
+    msg->payload = payload;
+    msg->next = sftp->free_client_messages;
+    sftp->free_client_messages = msg;
+    sftp->free_client_count++;
+    return;
+  }
+
+  ssh_buffer_free(payload);
   SAFE_FREE(msg);
 }
 
+/* frees the requests kept by a session, called by sftp_free() */
+void sftp_client_messages_free(sftp_session sftp) {
+  sftp_client_message msg;
+
+  while (sftp->free_client_messages != NULL) {
+    msg = sftp->free_client_messages;
+    sftp->free_client_messages = msg->next;
+    ssh_buffer_free(msg->payload);
+    SAFE_FREE(msg);
+  }
+  sftp->free_client_count = 0;
+}
+
 int sftp_reply_name(sftp_client_message msg, const char *name,
     sftp_attributes attr) {
   ssh_buffer out;
@@ -389,6 +480,193 @@ int sftp_reply_names(sftp_client_message msg) {
   return 0;
 }
 
+#ifndef _WIN32
+/* the ls -l line of an entry, with the numeric ids not to look them up */
+static int sftp_dir_longname(char *longname, size_t size, const char *name,
+    const struct stat *st, time_t now) {
+  char mode[11] = "----------";
+  char date[16];
+  struct tm tm;
+  int n;
+
+  if (S_ISDIR(st->st_mode)) {
+    mode[0] = 'd';
+  } else if (S_ISLNK(st->st_mode)) {
+    mode[0] = 'l';
+  } else if (S_ISCHR(st->st_mode)) {
+    mode[0] = 'c';
+  } else if (S_ISBLK(st->st_mode)) {
+    mode[0] = 'b';
+  } else if (S_ISFIFO(st->st_mode)) {
+    mode[0] = 'p';
+  } else if (S_ISSOCK(st->st_mode)) {
+    mode[0] = 's';
+  }
+  for (n = 0; n < 9; n++) {
+    if (st->st_mode & (0400 >> n)) {
+      mode[n + 1] = "rwxrwxrwx"[n];
+    }
+  }
+  if (st->st_mode & S_ISUID) {
+    mode[3] = mode[3] == 'x' ? 's' : 'S';
+  }
+  if (st->st_mode & S_ISGID) {
+    mode[6] = mode[6] == 'x' ? 's' : 'S';
+  }
+  if (st->st_mode & S_ISVTX) {
+    mode[9] = mode[9] == 'x' ? 't' : 'T';
+  }
+
+  /* the year instead of the time past six months, as ls does */
+  date[0] = '\0';
+  if (localtime_r(&st->st_mtime, &tm) != NULL) {
+    if (st->st_mtime + 182 * 24 * 3600 > now && st->st_mtime <= now) {
+      strftime(date, sizeof(date), "%b %e %H:%M", &tm);
+    } else {
+      strftime(date, sizeof(date), "%b %e  %Y", &tm);
+    }
+  }
+
+  n = snprintf(longname, size, "%s %3u %-8u %-8u %8llu %s %s", mode,
+      (unsigned int) st->st_nlink, (unsigned int) st->st_uid,
+      (unsigned int) st->st_gid, (unsigned long long) st->st_size, date,
+      name);
+  if (n < 0 || (size_t) n >= size) {
+    return -1;
+  }
+
+  return n;
+}
+
+static unsigned char *sftp_put_u32(unsigned char *p, uint32_t value) {
+  value = htonl(value);
+  memcpy(p, &value, sizeof(uint32_t));
+  return p + sizeof(uint32_t);
+}
+
+static unsigned char *sftp_put_string(unsigned char *p, const char *data,
+    uint32_t len) {
+  p = sftp_put_u32(p, len);
+  memcpy(p, data, len);
+  return p + len;
+}
+
+int sftp_reply_names_dir(sftp_client_message msg, DIR *dir) {
+  char longname[512];
+  struct dirent *entry;
+  unsigned char *p;
+  struct stat st;
+  ssh_buffer out;
+  uint64_t value;
+  uint32_t limit;
+  uint32_t count = 0;
+  uint32_t namelen;
+  uint32_t size;
+  uint32_t flags;
+  int longlen;
+  time_t now;
+  long pos;
+  int fd;
+
+  if (msg == NULL || dir == NULL) {
+    return -1;
+  }
+
+  /* the reply fills a channel packet, and goes in one */
+  limit = channel_maxpacket_out(msg->sftp->channel);
+  if (limit > SFTP_SERVER_PACKET_MAX) {
+    limit = SFTP_SERVER_PACKET_MAX;
+  }
+
+  out = ssh_buffer_new_sized(limit);
+  if (out == NULL) {
+    return -1;
+  }
+  /* room for the length and the type, prepended by sftp_packet_write() */
+  p = buffer_allocate(out, 5 + 2 * sizeof(uint32_t));
+  if (p == NULL) {
+    ssh_buffer_free(out);
+    return -1;
+  }
+  buffer_pass_bytes(out, 5);
+  memcpy(p + 5, &msg->id, sizeof(uint32_t));
+
+  fd = dirfd(dir);
+  now = time(NULL);
+  for (;;) {
+    pos = telldir(dir);
+    errno = 0;
+    entry = readdir(dir);
+    if (entry == NULL) {
+      if (errno != 0) {
+        ssh_buffer_free(out);
+        return -1;
+      }
+      break;
+    }
+
+    /* the entry removed since is listed without its attributes */
+    flags = 0;
+    longlen = 0;
+    if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      flags = SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID |
+        SSH_FILEXFER_ATTR_PERMISSIONS | SSH_FILEXFER_ATTR_ACMODTIME;
+      longlen = sftp_dir_longname(longname, sizeof(longname), entry->d_name,
+          &st, now);
+    }
+    if (longlen <= 0) {
+      longlen = snprintf(longname, sizeof(longname), "%s", entry->d_name);
+    }
+
+    namelen = strlen(entry->d_name);
+    size = 4 + namelen + 4 + (uint32_t) longlen + 4;
+    if (flags != 0) {
+      size += 8 + 4 + 4 + 4 + 4 + 4;
+    }
+    if (count > 0 && 5 + buffer_get_rest_len(out) + size > limit) {
+      /* the next reply starts with it */
+      seekdir(dir, pos);
+      break;
+    }
+
+    p = buffer_allocate(out, size);
+    if (p == NULL) {
+      ssh_buffer_free(out);
+      return -1;
+    }
+    p = sftp_put_string(p, entry->d_name, namelen);
+    p = sftp_put_string(p, longname, longlen);
+    p = sftp_put_u32(p, flags);
+    if (flags != 0) {
+      value = htonll((uint64_t) st.st_size);
+      memcpy(p, &value, sizeof(uint64_t));
+      p += sizeof(uint64_t);
+      p = sftp_put_u32(p, st.st_uid);
+      p = sftp_put_u32(p, st.st_gid);
+      p = sftp_put_u32(p, st.st_mode);
+      p = sftp_put_u32(p, st.st_atime);
+      sftp_put_u32(p, st.st_mtime);
+    }
+    count++;
+  }
+
+  if (count == 0) {
+    ssh_buffer_free(out);
+    return sftp_reply_status(msg, SSH_FX_EOF, NULL) < 0 ? -1 : 0;
+  }
+  sftp_put_u32((unsigned char *) buffer_get_rest(out) + sizeof(uint32_t),
+      count);
+
+  if (sftp_packet_write(msg->sftp, SSH_FXP_NAME, out) < 0) {
+    ssh_buffer_free(out);
+    return -1;
+  }
+  ssh_buffer_free(out);
+
+  return count;
+}
+#endif /* _WIN32 */
+
 int sftp_reply_status(sftp_client_message msg, uint32_t status,
     const char *message) {
   ssh_buffer out;
@@ -441,76 +719,820 @@ int sftp_reply_data(sftp_client_message msg, const void *data, int len) {
   return 0;
 }
 
+/* reads up to len bytes at offset, returns the bytes read or -1 */
+static int sftp_server_pread(int fd, void *data, uint32_t len,
+    uint64_t offset) {
+  uint32_t done = 0;
+  ssize_t r;
+
+#ifdef _WIN32
+  if (lseek(fd, (off_t) offset, SEEK_SET) < 0) {
+    return -1;
+  }
+#endif
+  while (done < len) {
+#ifdef _WIN32
+    r = read(fd, (char *) data + done, len - done);
+#else
+    r = pread(fd, (char *) data + done, len - done, (off_t) (offset + done));
+#endif
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      return -1;
+    }
+    if (r == 0) {
+      break;
+    }
+    done += r;
+  }
+
+  return done;
+}
+
+struct sftp_fd_fill_struct {
+  int fd;
+  uint64_t offset;
+  int failed;
+};
+
+/* the file data is read where the packet is built, or not sent at all */
+static int sftp_fd_fill(void *dest, uint32_t len, void *userdata) {
+  struct sftp_fd_fill_struct *f = userdata;
+
+  if (sftp_server_pread(f->fd, dest, len, f->offset) != (int) len) {
+    f->failed = 1;
+    return -1;
+  }
+
+  return 0;
+}
+
+int sftp_reply_data_fd(sftp_client_message msg, int fd, uint64_t offset,
+    uint32_t len) {
+  struct sftp_fd_fill_struct f;
+  unsigned char prefix[13];
+  ssh_buffer out;
+  struct stat st;
+  uint32_t value;
+  void *data;
+  int rc;
+  int r;
+
+  if (msg == NULL || fd < 0) {
+    return -1;
+  }
+  /* the reply is a packet the clients accept */
+  if (len > SFTP_SERVER_PACKET_MAX - sizeof(prefix)) {
+    len = SFTP_SERVER_PACKET_MAX - sizeof(prefix);
+  }
+
+  /* the size of a regular file says how much the packet holds */
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && len > 0) {
+    if (offset >= (uint64_t) st.st_size) {
+      return sftp_reply_status(msg, SSH_FX_EOF, NULL);
+    }
+    if ((uint64_t) st.st_size - offset < len) {
+      len = (uint32_t) ((uint64_t) st.st_size - offset);
+    }
+
+    value = htonl(1 + 2 * sizeof(uint32_t) + len);
+    memcpy(prefix, &value, sizeof(uint32_t));
+    prefix[4] = SSH_FXP_DATA;
+    memcpy(prefix + 5, &msg->id, sizeof(uint32_t));
+    value = htonl(len);
+    memcpy(prefix + 9, &value, sizeof(uint32_t));
+
+    f.fd = fd;
+    f.offset = offset;
+    f.failed = 0;
+    rc = channel_write_fill(msg->sftp->channel, prefix, sizeof(prefix), len,
+        sftp_fd_fill, &f);
+    if (rc == SSH_OK) {
+      return 0;
+    }
+    if (rc == SSH_ERROR && !f.failed) {
+      return -1;
+    }
+    /* too large for one packet or the file changed, copy it */
+  }
+
+  out = ssh_buffer_new_sized(2 * sizeof(uint32_t) + len);
+  if (out == NULL) {
+    return -1;
+  }
+  data = NULL;
+  if (buffer_add_u32(out, msg->id) < 0 ||
+      buffer_add_u32(out, 0) < 0 ||
+      (data = buffer_reserve(out, len)) == NULL) {
+    ssh_buffer_free(out);
+    return -1;
+  }
+  r = sftp_server_pread(fd, data, len, offset);
+  if (r < 0) {
+    ssh_buffer_free(out);
+    return -1;
+  }
+  if (r == 0 && len > 0) {
+    ssh_buffer_free(out);
+    return sftp_reply_status(msg, SSH_FX_EOF, NULL);
+  }
+  buffer_commit(out, r);
+  value = htonl(r);
+  memcpy((char *) buffer_get_rest(out) + sizeof(uint32_t), &value,
+      sizeof(uint32_t));
+
+  if (sftp_packet_write(msg->sftp, SSH_FXP_DATA, out) < 0) {
+    ssh_buffer_free(out);
+    return -1;
+  }
+  ssh_buffer_free(out);
+
+  return 0;
+}
+
+/* Double the handle table, putting the new slots on the free list. */
+static int sftp_handles_grow(sftp_session sftp) {
+  struct sftp_handle_slot *slots;
+  uint32_t size;
+  uint32_t i;
+
+  if (sftp->handles_size >= SFTP_HANDLES_MAX) {
+    return -1;
+  }
+  size = sftp->handles_size > 0 ? sftp->handles_size * 2 : SFTP_HANDLES;
+
+  slots = realloc(sftp->handles, size * sizeof(struct sftp_handle_slot));
+  if (slots == NULL) {
+    return -1;
+  }
+  for (i = sftp->handles_size; i < size; i++) {
+    slots[i].info = NULL;
+    slots[i].generation = 0;
+    slots[i].next_free = i + 1;
+  }
+
+  /* the free list is empty when the table grows */
+  sftp->handles = slots;
+  sftp->handles_free = sftp->handles_size;
+  sftp->handles_size = size;
+
+  return 0;
+}
+
+/* The slot of a handle, NULL if it isn't the handle of an open slot. */
+static struct sftp_handle_slot *sftp_handle_slot(sftp_session sftp,
+    ssh_string handle) {
+  struct sftp_handle_slot *slot;
+  uint32_t val[2];
+
+  if (sftp->handles == NULL || handle == NULL) {
+    return NULL;
+  }
+
+  if (ssh_string_len(handle) != sizeof(val)) {
+    return NULL;
+  }
+
+  memcpy(val, ssh_string_data(handle), sizeof(val));
+
+  if (val[0] >= sftp->handles_size) {
+    return NULL;
+  }
+  slot = &sftp->handles[val[0]];
+  if (slot->info == NULL || slot->generation != val[1]) {
+    return NULL;
+  }
+
+  return slot;
+}
+
 /*
  * This function will return you a new handle to give the client.
  * the function accepts an info that can be retrieved later with
  * the handle. Care is given that a corrupted handle won't give a
- * valid info (or worse).
+ * valid info (or worse): the handle holds the slot and its generation,
+ * bumped each time the slot is released.
  */
 ssh_string sftp_handle_alloc(sftp_session sftp, void *info) {
+  struct sftp_handle_slot *slot;
   ssh_string ret;
-  uint32_t val;
-  int i;
+  uint32_t val[2];
 
-  if (sftp->handles == NULL) {
-    sftp->handles = malloc(sizeof(void *) * SFTP_HANDLES);
-    if (sftp->handles == NULL) {
-      return NULL;
-    }
-    memset(sftp->handles, 0, sizeof(void *) * SFTP_HANDLES);
-  }
-
-  for (i = 0; i < SFTP_HANDLES; i++) {
-    if (sftp->handles[i] == NULL) {
-      break;
-    }
+  if (info == NULL) {
+    return NULL;
   }
 
-  if (i == SFTP_HANDLES) {
+  if (sftp->handles_free >= sftp->handles_size &&
+      sftp_handles_grow(sftp) < 0) {
     return NULL; /* no handle available */
   }
 
-  val = i;
-  ret = ssh_string_new(4);
+  ret = ssh_string_new(sizeof(val));
   if (ret == NULL) {
     return NULL;
   }
 
-  memcpy(ssh_string_data(ret), &val, sizeof(uint32_t));
-  sftp->handles[i] = info;
+  val[0] = sftp->handles_free;
+  slot = &sftp->handles[val[0]];
+  val[1] = slot->generation;
+  memcpy(ssh_string_data(ret), val, sizeof(val));
+
+  sftp->handles_free = slot->next_free;
+  slot->info = info;
 
   return ret;
 }
 
 void *sftp_handle(sftp_session sftp, ssh_string handle){
-  uint32_t val;
+  struct sftp_handle_slot *slot;
 
-  if (sftp->handles == NULL) {
+  slot = sftp_handle_slot(sftp, handle);
+  if (slot == NULL) {
     return NULL;
   }
 
-  if (ssh_string_len(handle) != sizeof(uint32_t)) {
-    return NULL;
+  return slot->info;
+}
+
+/* Put a slot back on the free list. */
+static void sftp_handle_free_slot(sftp_session sftp,
+    struct sftp_handle_slot *slot) {
+  slot->info = NULL;
+  slot->generation++;
+  slot->next_free = sftp->handles_free;
+  sftp->handles_free = slot - sftp->handles;
+}
+
+int sftp_handle_release(sftp_session sftp, ssh_string handle) {
+  struct sftp_handle_slot *slot;
+
+  slot = sftp_handle_slot(sftp, handle);
+  if (slot == NULL) {
+    return -1;
   }
+  sftp_handle_free_slot(sftp, slot);
+
+  return 0;
+}
 
-  memcpy(&val, ssh_string_data(handle), sizeof(uint32_t));
+void sftp_handle_remove(sftp_session sftp, void *handle) {
+  uint32_t i;
 
-  if (val > SFTP_HANDLES) {
+  if (handle == NULL) {
+    return;
+  }
+
+  for (i = 0; i < sftp->handles_size; i++) {
+    if (sftp->handles[i].info == handle) {
+      sftp_handle_free_slot(sftp, &sftp->handles[i]);
+      break;
+    }
+  }
+}
+
+/* a handler set with sftp_server_set_handler() */
+struct sftp_server_handler_entry {
+  sftp_server_handler function;
+  void *userdata;
+};
+
+/* the requests of a session dispatched as they arrive */
+struct sftp_server_dispatch {
+  struct ssh_channel_callbacks_struct callbacks;
+  struct sftp_server_handler_entry handlers[256];
+  ssh_buffer input; /* data of the channel not dispatched yet */
+  int dispatching;
+  int failed;
+  unsigned int pool_jobs; /* given to a pool and not done yet */
+};
+
+static struct sftp_server_dispatch *sftp_server_get_dispatch(
+    sftp_session sftp) {
+  struct sftp_server_dispatch *dispatch = sftp->dispatch;
+
+  if (dispatch != NULL) {
+    return dispatch;
+  }
+
+  dispatch = malloc(sizeof(struct sftp_server_dispatch));
+  if (dispatch == NULL) {
+    ssh_set_error_oom(sftp->session);
     return NULL;
   }
+  ZERO_STRUCTP(dispatch);
+  dispatch->input = ssh_buffer_new();
+  if (dispatch->input == NULL) {
+    ssh_set_error_oom(sftp->session);
+    SAFE_FREE(dispatch);
+    return NULL;
+  }
+  sftp->dispatch = dispatch;
 
-  return sftp->handles[val];
+  return dispatch;
 }
 
-void sftp_handle_remove(sftp_session sftp, void *handle) {
-  int i;
+void sftp_server_dispatch_free(struct sftp_server_dispatch *dispatch) {
+  if (dispatch == NULL) {
+    return;
+  }
+
+  ssh_buffer_free(dispatch->input);
+  SAFE_FREE(dispatch);
+}
+
+int sftp_server_set_handler(sftp_session sftp, uint8_t type,
+    sftp_server_handler handler, void *userdata) {
+  struct sftp_server_dispatch *dispatch;
+
+  if (sftp == NULL) {
+    return SSH_ERROR;
+  }
+  if (type == SSH_FXP_INIT) {
+    ssh_set_error_invalid(sftp->session, __FUNCTION__);
+    return SSH_ERROR;
+  }
+
+  dispatch = sftp_server_get_dispatch(sftp);
+  if (dispatch == NULL) {
+    return SSH_ERROR;
+  }
+  dispatch->handlers[type].function = handler;
+  dispatch->handlers[type].userdata = userdata;
+
+  return SSH_OK;
+}
+
+/* Answers a request nobody takes with a status. */
+static int sftp_server_refuse(sftp_session sftp, uint32_t id,
+    uint32_t status, const char *message) {
+  struct sftp_client_message_struct msg;
+
+  ZERO_STRUCT(msg);
+  msg.sftp = sftp;
+  msg.id = id;
+
+  return sftp_reply_status(&msg, status, message);
+}
+
+/*
+ * Gives one request, in the payload of msg, to its handler. Returns SSH_ERROR
+ * on a fatal error.
+ */
+static int sftp_server_dispatch_packet(sftp_session sftp, uint8_t type,
+    sftp_client_message msg) {
+  struct sftp_server_dispatch *dispatch = sftp->dispatch;
+  struct sftp_server_handler_entry *entry;
+  struct sftp_packet_struct packet;
+  uint32_t id = 0;
+  int rc;
+
+  if (type == SSH_FXP_INIT) {
+    packet.sftp = sftp;
+    packet.type = type;
+    packet.payload = msg->payload;
+    rc = sftp_server_reply_init(sftp, &packet);
+    sftp_client_message_free(msg);
+    return rc;
+  }
+
+  entry = &dispatch->handlers[type];
+  if (entry->function == NULL) {
+    /* the id stays in network order, as in the messages */
+    if (buffer_get_u32(msg->payload, &id) != sizeof(uint32_t)) {
+      ssh_set_error(sftp->session, SSH_FATAL, "Short sftp packet!");
+      sftp_client_message_free(msg);
+      return SSH_ERROR;
+    }
+    sftp_client_message_free(msg);
+    return sftp_server_refuse(sftp, id, SSH_FX_OP_UNSUPPORTED,
+        "Operation unsupported");
+  }
 
-  for (i = 0; i < SFTP_HANDLES; i++) {
-    if (sftp->handles[i] == handle) {
-      sftp->handles[i] = NULL;
+  if (sftp_parse_client_message(msg, type) < 0) {
+    sftp_client_message_free(msg);
+    return SSH_ERROR;
+  }
+  id = msg->id;
+
+  /* the handler has the message now, even to answer it later */
+  if (entry->function(msg, entry->userdata) != SSH_OK) {
+    sftp_client_message_free(msg);
+    return sftp_server_refuse(sftp, id, SSH_FX_FAILURE, "Failure");
+  }
+
+  return SSH_OK;
+}
+
+/*
+ * Dispatches the requests of the input received in full. Returns the number
+ * of requests dispatched, SSH_ERROR on a fatal error.
+ */
+static int sftp_server_dispatch(sftp_session sftp) {
+  struct sftp_server_dispatch *dispatch = sftp->dispatch;
+  sftp_client_message msg;
+  ssh_buffer input;
+  uint32_t size;
+  uint8_t type;
+  int count = 0;
+  int rc;
+
+  if (dispatch->failed) {
+    return SSH_ERROR;
+  }
+  /* the data received while a handler runs waits for the loop below */
+  if (dispatch->dispatching) {
+    return 0;
+  }
+  input = dispatch->input;
+
+  dispatch->dispatching = 1;
+  while (buffer_get_rest_len(input) >= sizeof(uint32_t)) {
+    memcpy(&size, buffer_get_rest(input), sizeof(uint32_t));
+    size = ntohl(size);
+    if (size == 0 || size > SFTP_SERVER_PACKET_MAX) {
+      ssh_set_error(sftp->session, SSH_FATAL,
+          "Invalid sftp packet size %u", size);
+      dispatch->failed = 1;
+      break;
+    }
+    if (buffer_get_rest_len(input) - sizeof(uint32_t) < size) {
+      break;
+    }
+
+    type = ((uint8_t *) buffer_get_rest(input))[sizeof(uint32_t)];
+    msg = sftp_client_message_new(sftp);
+    if (msg == NULL ||
+        buffer_add_data(msg->payload,
+          (uint8_t *) buffer_get_rest(input) + sizeof(uint32_t) + 1,
+          size - 1) < 0) {
+      ssh_set_error_oom(sftp->session);
+      sftp_client_message_free(msg);
+      dispatch->failed = 1;
+      break;
+    }
+    buffer_pass_bytes(input, sizeof(uint32_t) + size);
+
+    rc = sftp_server_dispatch_packet(sftp, type, msg);
+    if (rc < 0) {
+      dispatch->failed = 1;
       break;
     }
+    count++;
   }
+  dispatch->dispatching = 0;
+
+  if (dispatch->failed) {
+    /* the client gets nothing more from a broken session */
+    ssh_channel_close(sftp->channel);
+    return SSH_ERROR;
+  }
+
+  return count;
+}
+
+static int sftp_server_data_cb(ssh_session session, ssh_channel channel,
+    void *data, uint32_t len, int is_stderr, void *userdata) {
+  sftp_session sftp = userdata;
+
+  (void) session;
+  (void) channel;
+
+  if (is_stderr || sftp->dispatch->failed) {
+    return len;
+  }
+  if (buffer_add_data(sftp->dispatch->input, data, len) < 0) {
+    ssh_set_error_oom(sftp->session);
+    sftp->dispatch->failed = 1;
+    ssh_channel_close(sftp->channel);
+    return len;
+  }
+  sftp_server_dispatch(sftp);
+
+  return len;
+}
+
+int sftp_server_start(sftp_session sftp) {
+  struct sftp_server_dispatch *dispatch;
+  char data[4096];
+  int n;
+
+  if (sftp == NULL) {
+    return SSH_ERROR;
+  }
+  dispatch = sftp_server_get_dispatch(sftp);
+  if (dispatch == NULL) {
+    return SSH_ERROR;
+  }
+
+  /* what the channel got before goes first */
+  while ((n = ssh_channel_read_nonblocking(sftp->channel, data,
+          sizeof(data), 0)) > 0) {
+    if (buffer_add_data(dispatch->input, data, n) < 0) {
+      ssh_set_error_oom(sftp->session);
+      return SSH_ERROR;
+    }
+  }
+  if (n < 0) {
+    return SSH_ERROR;
+  }
+
+  ZERO_STRUCT(dispatch->callbacks);
+  dispatch->callbacks.userdata = sftp;
+  dispatch->callbacks.channel_data_function = sftp_server_data_cb;
+  ssh_callbacks_init(&dispatch->callbacks);
+  if (ssh_set_channel_callbacks(sftp->channel, &dispatch->callbacks) < 0) {
+    return SSH_ERROR;
+  }
+
+  if (sftp_server_dispatch(sftp) < 0) {
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
+#ifndef _WIN32
+/* a request given to the workers of a pool */
+struct sftp_server_job {
+  struct sftp_server_job *next;
+  sftp_client_message msg;
+  sftp_server_work_callback work;
+  sftp_server_done_callback done;
+  void *userdata;
+};
+
+struct sftp_server_pool_struct {
+  ssh_event event;
+  unsigned int quota;
+  unsigned int jobs; /* not done yet, including the held ones */
+  void *lock; /* for the queue, the completed jobs and stopping */
+  int wakeup_fds[2]; /* a byte per job queued, and one to stop */
+  struct sftp_server_job *queue;
+  struct sftp_server_job *queue_tail;
+  struct sftp_server_job *completed;
+  struct sftp_server_job *completed_tail;
+  int posted; /* a task is posted for the completed jobs */
+  int stopping;
+  /* the jobs of sessions at their quota, only seen by the event thread */
+  struct sftp_server_job *held;
+  struct sftp_server_job *held_tail;
+};
+
+static void sftp_server_job_append(struct sftp_server_job **head,
+    struct sftp_server_job **tail, struct sftp_server_job *job) {
+  job->next = NULL;
+  if (*tail != NULL) {
+    (*tail)->next = job;
+  } else {
+    *head = job;
+  }
+  *tail = job;
+}
+
+sftp_server_pool sftp_server_pool_new(ssh_event event, unsigned int quota) {
+  sftp_server_pool pool;
+
+  if (event == NULL) {
+    return NULL;
+  }
+
+  pool = malloc(sizeof(struct sftp_server_pool_struct));
+  if (pool == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(pool);
+  pool->event = event;
+  pool->quota = quota;
+
+  if (pipe(pool->wakeup_fds) < 0) {
+    SAFE_FREE(pool);
+    return NULL;
+  }
+  if (ssh_threads_mutex_init(&pool->lock) != 0) {
+    close(pool->wakeup_fds[0]);
+    close(pool->wakeup_fds[1]);
+    SAFE_FREE(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+/* Gives a job to the workers. */
+static int sftp_server_pool_queue(sftp_server_pool pool,
+    struct sftp_server_job *job) {
+  ssize_t n;
+
+  ssh_threads_mutex_lock(&pool->lock);
+  sftp_server_job_append(&pool->queue, &pool->queue_tail, job);
+  ssh_threads_mutex_unlock(&pool->lock);
+  sftp_server_get_dispatch(job->msg->sftp)->pool_jobs++;
+
+  do {
+    n = write(pool->wakeup_fds[1], "", 1);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    return SSH_ERROR;
+  }
+
+  return SSH_OK;
+}
+
+int sftp_server_pool_submit(sftp_server_pool pool, sftp_client_message msg,
+    sftp_server_work_callback work, sftp_server_done_callback done,
+    void *userdata) {
+  struct sftp_server_dispatch *dispatch;
+  struct sftp_server_job *job;
+
+  if (pool == NULL || msg == NULL || work == NULL || done == NULL) {
+    return SSH_ERROR;
+  }
+  /* the quota is counted on the session */
+  dispatch = sftp_server_get_dispatch(msg->sftp);
+  if (dispatch == NULL) {
+    return SSH_ERROR;
+  }
+
+  job = malloc(sizeof(struct sftp_server_job));
+  if (job == NULL) {
+    ssh_set_error_oom(msg->sftp->session);
+    return SSH_ERROR;
+  }
+  job->msg = msg;
+  job->work = work;
+  job->done = done;
+  job->userdata = userdata;
+  pool->jobs++;
+
+  if (pool->quota > 0 && dispatch->pool_jobs >= pool->quota) {
+    sftp_server_job_append(&pool->held, &pool->held_tail, job);
+    return SSH_OK;
+  }
+
+  return sftp_server_pool_queue(pool, job);
+}
+
+/* Gives the completed jobs back to their sessions, in the event thread. */
+static void sftp_server_pool_done_task(ssh_event event, void *userdata) {
+  sftp_server_pool pool = userdata;
+  struct sftp_server_job *completed;
+  struct sftp_server_job *job;
+  struct sftp_server_job *prev;
+  sftp_session sftp;
+
+  (void) event;
+
+  ssh_threads_mutex_lock(&pool->lock);
+  completed = pool->completed;
+  pool->completed = NULL;
+  pool->completed_tail = NULL;
+  pool->posted = 0;
+  ssh_threads_mutex_unlock(&pool->lock);
+
+  while (completed != NULL) {
+    job = completed;
+    completed = job->next;
+
+    /* the message is gone once done */
+    sftp = job->msg->sftp;
+    job->done(job->msg, job->userdata);
+    SAFE_FREE(job);
+    pool->jobs--;
+    sftp->dispatch->pool_jobs--;
+
+    /* the session has room for the next job it had over its quota */
+    prev = NULL;
+    for (job = pool->held; job != NULL; job = job->next) {
+      if (job->msg->sftp == sftp) {
+        break;
+      }
+      prev = job;
+    }
+    if (job != NULL) {
+      if (prev != NULL) {
+        prev->next = job->next;
+      } else {
+        pool->held = job->next;
+      }
+      if (pool->held_tail == job) {
+        pool->held_tail = prev;
+      }
+      sftp_server_pool_queue(pool, job);
+    }
+  }
+}
+
+int sftp_server_pool_run(sftp_server_pool pool) {
+  struct sftp_server_job *job;
+  ssize_t n;
+  int post;
+  char c;
+
+  if (pool == NULL) {
+    return SSH_ERROR;
+  }
+
+  for (;;) {
+    do {
+      n = read(pool->wakeup_fds[0], &c, 1);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      return SSH_ERROR;
+    }
+
+    ssh_threads_mutex_lock(&pool->lock);
+    job = pool->queue;
+    if (job != NULL) {
+      pool->queue = job->next;
+      if (pool->queue == NULL) {
+        pool->queue_tail = NULL;
+      }
+    }
+    ssh_threads_mutex_unlock(&pool->lock);
+
+    if (job == NULL) {
+      /* the byte of the stop goes on to the next worker */
+      if (write(pool->wakeup_fds[1], "", 1) < 0) {
+        return SSH_ERROR;
+      }
+      return SSH_OK;
+    }
+
+    job->work(job->msg, job->userdata);
+
+    ssh_threads_mutex_lock(&pool->lock);
+    sftp_server_job_append(&pool->completed, &pool->completed_tail, job);
+    post = !pool->posted;
+    pool->posted = 1;
+    ssh_threads_mutex_unlock(&pool->lock);
+
+    /* one task gives back all the jobs completed until it runs */
+    if (post && ssh_event_post(pool->event, sftp_server_pool_done_task,
+          pool) < 0) {
+      ssh_threads_mutex_lock(&pool->lock);
+      pool->posted = 0;
+      ssh_threads_mutex_unlock(&pool->lock);
+    }
+  }
+}
+
+void sftp_server_pool_stop(sftp_server_pool pool) {
+  if (pool == NULL) {
+    return;
+  }
+
+  ssh_threads_mutex_lock(&pool->lock);
+  if (!pool->stopping) {
+    pool->stopping = 1;
+    if (write(pool->wakeup_fds[1], "", 1) < 0) {
+      pool->stopping = 0;
+    }
+  }
+  ssh_threads_mutex_unlock(&pool->lock);
+}
+
+unsigned int sftp_server_pool_jobs(sftp_server_pool pool) {
+  if (pool == NULL) {
+    return 0;
+  }
+
+  return pool->jobs;
+}
+
+void sftp_server_pool_free(sftp_server_pool pool) {
+  struct sftp_server_job *job;
+
+  if (pool == NULL) {
+    return;
+  }
+
+  /* the jobs which never completed aren't answered */
+  while (pool->held != NULL) {
+    job = pool->held;
+    pool->held = job->next;
+    sftp_client_message_free(job->msg);
+    SAFE_FREE(job);
+  }
+  while (pool->queue != NULL) {
+    job = pool->queue;
+    pool->queue = job->next;
+    sftp_client_message_free(job->msg);
+    SAFE_FREE(job);
+  }
+  while (pool->completed != NULL) {
+    job = pool->completed;
+    pool->completed = job->next;
+    sftp_client_message_free(job->msg);
+    SAFE_FREE(job);
+  }
+
+  close(pool->wakeup_fds[0]);
+  close(pool->wakeup_fds[1]);
+  ssh_threads_mutex_destroy(&pool->lock);
+  SAFE_FREE(pool);
 }
+#endif /* _WIN32 */
 
 /* vim: set ts=2 sw=2 et cindent: */
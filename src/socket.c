@@ -50,6 +50,8 @@
 #include "libssh/callbacks.h"
 #include "libssh/socket.h"
 #include "libssh/buffer.h"
+#include "libssh/misc.h"
+#include "libssh/packet.h"
 #include "libssh/poll.h"
 #include "libssh/session.h"
 
@@ -66,6 +68,7 @@
 
 enum ssh_socket_states_e {
 	SSH_SOCKET_NONE,
+	SSH_SOCKET_RESOLVING,
 	SSH_SOCKET_CONNECTING,
 	SSH_SOCKET_CONNECTED,
 	SSH_SOCKET_EOF,
@@ -83,17 +86,35 @@ struct ssh_socket_struct {
   int write_wontblock;
   int data_except;
   enum ssh_socket_states_e state;
+  uint32_t read_size; /* number of bytes of the next read */
+  int corked; /* writes are only buffered while > 0 */
   ssh_buffer out_buffer;
   ssh_buffer in_buffer;
+  /* data read while the data callback runs, it is given to the callback as
+   * soon as the call in progress returns */
+  ssh_buffer deferred;
+  int in_data_callback;
   ssh_session session;
   ssh_socket_callbacks callbacks;
   ssh_poll_handle poll_in;
   ssh_poll_handle poll_out;
+  ssh_transport_callbacks transport; /* replaces the system calls if set */
+  /* while connecting: the addresses not tried yet and the attempts racing
+   * with the one on fd_in */
+  struct ssh_connect_attempts *attempts;
+  ssh_poll_handle attempt_polls[SSH_CONNECT_ATTEMPTS_MAX - 1];
+  int n_attempt_polls;
+  ssh_timer attempt_timer;
 };
 
 static int ssh_socket_unbuffered_read(ssh_socket s, void *buffer, uint32_t len);
 static int ssh_socket_unbuffered_write(ssh_socket s, const void *buffer,
 		uint32_t len);
+static int ssh_socket_unbuffered_writev(ssh_socket s,
+    const struct iovec *iov, int iovcnt);
+static void ssh_socket_attempts_free(ssh_socket s);
+static void ssh_socket_signal_writable(ssh_socket s);
+static int ssh_socket_connect_event(ssh_socket s, socket_t fd, int revents);
 
 /**
  * \internal
@@ -152,11 +173,20 @@ ssh_socket ssh_socket_new(ssh_session session) {
     SAFE_FREE(s);
     return NULL;
   }
+  s->deferred = NULL;
+  s->in_data_callback = 0;
   s->read_wontblock = 0;
   s->write_wontblock = 0;
   s->data_except = 0;
   s->poll_in=s->poll_out=NULL;
+  s->callbacks=NULL;
   s->state=SSH_SOCKET_NONE;
+  s->read_size = SSH_SOCKET_READ_MIN;
+  s->corked = 0;
+  s->transport = NULL;
+  s->attempts = NULL;
+  s->n_attempt_polls = 0;
+  s->attempt_timer = NULL;
   return s;
 }
 
@@ -172,11 +202,17 @@ void ssh_socket_reset(ssh_socket s){
   s->fd_is_socket = 1;
   buffer_reinit(s->in_buffer);
   buffer_reinit(s->out_buffer);
+  if (s->deferred != NULL) {
+    buffer_reinit(s->deferred);
+  }
+  s->read_size = SSH_SOCKET_READ_MIN;
+  s->corked = 0;
   s->read_wontblock = 0;
   s->write_wontblock = 0;
   s->data_except = 0;
   s->poll_in=s->poll_out=NULL;
   s->state=SSH_SOCKET_NONE;
+  s->transport = NULL;
 }
 
 /**
@@ -191,6 +227,22 @@ void ssh_socket_set_callbacks(ssh_socket s, ssh_socket_callbacks callbacks){
 	s->callbacks=callbacks;
 }
 
+/**
+ * @internal
+ * @brief replaces the system calls of the socket by transport callbacks.
+ * The connection the socket had before is closed.
+ * @param s socket to set the transport on.
+ * @param transport the transport callbacks, NULL to go back to system calls.
+ * @param fd the file descriptor polled for the transport.
+ */
+void ssh_socket_set_transport(ssh_socket s, ssh_transport_callbacks transport,
+    socket_t fd){
+  ssh_socket_close(s);
+  s->transport = transport;
+  s->data_except = 0;
+  ssh_socket_set_fd(s, fd);
+}
+
 /**
  * @brief 							SSH poll callback. This callback will be used when an event
  *                      caught on the socket.
@@ -206,34 +258,63 @@ void ssh_socket_set_callbacks(ssh_socket s, ssh_socket_callbacks callbacks){
  */
 int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int revents, void *v_s){
 	ssh_socket s=(ssh_socket )v_s;
-	char buffer[4096];
+	ssh_buffer in;
+	void *buffer;
+	uint32_t read_size;
+	ssh_callback_data data_cb;
+	int deferred;
+	int handover;
+	int drained;
 	int r;
-	int err=0;
-	socklen_t errlen=sizeof(err);
 	/* Do not do anything if this socket was already closed */
 	if(!ssh_socket_is_open(s)){
 	  return -1;
 	}
-	if(revents & POLLERR){
-		/* Check if we are in a connecting state */
-		if(s->state==SSH_SOCKET_CONNECTING){
-			s->state=SSH_SOCKET_ERROR;
-			getsockopt(fd,SOL_SOCKET,SO_ERROR,(void *)&err,&errlen);
-			s->last_errno=err;
-			ssh_socket_close(s);
-			if(s->callbacks && s->callbacks->connected)
-				s->callbacks->connected(SSH_SOCKET_CONNECTED_ERROR,err,
-						s->callbacks->userdata);
+	if(s->state == SSH_SOCKET_CONNECTING){
+		if(ssh_socket_connect_event(s, fd, revents) < 0)
 			return -1;
-		}
-		/* Then we are in a more standard kind of error */
+		return (s->poll_in == NULL || s->poll_out == NULL) ? -1 : 0;
+	}
+	if(revents & POLLERR){
 		/* force a read to get an explanation */
 		revents |= POLLIN;
 	}
 	if(revents & POLLIN){
 		s->read_wontblock=1;
-		r=ssh_socket_unbuffered_read(s,buffer,sizeof(buffer));
-		if(r<0){
+		/* read directly at the tail of the input buffer, after the data the
+		 * callback didn't consume yet. The data callback holds a pointer into
+		 * the input buffer while it runs, a nested read goes aside. */
+		in=s->in_buffer;
+		if(s->in_data_callback ||
+				(s->deferred != NULL && buffer_get_rest_len(s->deferred) > 0)){
+			if(s->deferred == NULL)
+				s->deferred=ssh_buffer_new();
+			in=s->deferred;
+			if(in == NULL){
+				ssh_set_error_oom(s->session);
+				return -1;
+			}
+		}
+		read_size=s->read_size;
+		if(s->session != NULL && read_size > s->session->read_size_max)
+			read_size=s->session->read_size_max;
+		buffer=buffer_allocate(in,read_size);
+		if(buffer==NULL){
+			ssh_set_error_oom(s->session);
+			return -1;
+		}
+		r=ssh_socket_unbuffered_read(s,buffer,read_size);
+		buffer_pass_bytes_end(in,read_size - (r > 0 ? r : 0));
+		drained=r > 0 && (uint32_t)r < read_size;
+		/* a full read means more is waiting in the kernel: read more next
+		 * time. Go back down when the reads are mostly empty. */
+		if((uint32_t)r == read_size && read_size < SSH_SOCKET_READ_MAX)
+			s->read_size=read_size * 2;
+		else if(r > 0 && (uint32_t)r < read_size / 4 &&
+				read_size > SSH_SOCKET_READ_MIN)
+			s->read_size=read_size / 2;
+		/* SSH_AGAIN: a transport signalled its fd without data to read */
+		if(r<0 && r != SSH_AGAIN){
 		  if(p != NULL)
 				ssh_poll_set_events(p,ssh_poll_get_events(p) & ~POLLIN);
 			if(s->callbacks && s->callbacks->exception){
@@ -250,14 +331,58 @@ int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int r
 						0,s->callbacks->userdata);
 			}
 		}
-		if(r>0){
-			/* Bufferize the data and then call the callback */
-			buffer_add_data(s->in_buffer,buffer,r);
+		if(r>0 && !s->in_data_callback){
+			/* The data is already in the buffer, call the callback. The
+			 * packets it sends in reply are written together afterwards. */
 			if(s->callbacks && s->callbacks->data){
-				r= s->callbacks->data(buffer_get_rest(s->in_buffer),
-						buffer_get_rest_len(s->in_buffer),
-						s->callbacks->userdata);
-				buffer_pass_bytes(s->in_buffer,r);
+				ssh_socket_cork(s);
+				do {
+					data_cb=s->callbacks->data;
+					s->in_data_callback=1;
+					r= s->callbacks->data(buffer_get_rest(s->in_buffer),
+							buffer_get_rest_len(s->in_buffer),
+							s->callbacks->userdata);
+					s->in_data_callback=0;
+					buffer_pass_bytes(s->in_buffer,r);
+					/* what the callback read meanwhile is processed right away,
+					 * not at the next wakeup */
+					deferred=s->deferred != NULL &&
+						buffer_get_rest_len(s->deferred) > 0;
+					if(deferred){
+						if(buffer_add_data(s->in_buffer,
+									buffer_get_rest(s->deferred),
+									buffer_get_rest_len(s->deferred)) < 0){
+							/* keep it aside, in order, until the next wakeup */
+							ssh_set_error_oom(s->session);
+							deferred=0;
+						} else {
+							buffer_reinit(s->deferred);
+						}
+					}
+					/* the banner came with the first packets, the packet
+					 * layer which took over reads them now */
+					handover=r > 0 && s->callbacks != NULL &&
+						s->callbacks->data != data_cb &&
+						buffer_get_rest_len(s->in_buffer) > 0;
+				} while((deferred || handover) && ssh_socket_is_open(s) &&
+						s->callbacks && s->callbacks->data);
+				if(ssh_socket_is_open(s)){
+					ssh_socket_uncork(s);
+					ssh_socket_signal_writable(s);
+					/* nothing more was waiting: the connection may stay idle
+					 * for long, the buffers allocate again with the next data */
+					if(drained){
+						buffer_release(s->in_buffer);
+						buffer_release(s->out_buffer);
+						if(s->session != NULL && s->session->in_buffer != NULL &&
+								s->session->packet_state == PACKET_STATE_INIT){
+							/* the packet it held was processed */
+							buffer_reinit(s->session->in_buffer);
+							buffer_release(s->session->in_buffer);
+						}
+					}
+				} else if(s->corked > 0)
+					s->corked--;
 			}
 		}
 	}
@@ -266,16 +391,6 @@ int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int r
 #else
 	if(revents & POLLOUT){
 #endif
-		/* First, POLLOUT is a sign we may be connected */
-		if(s->state == SSH_SOCKET_CONNECTING){
-			ssh_log(s->session,SSH_LOG_PACKET,"Received POLLOUT in connecting state");
-			s->state = SSH_SOCKET_CONNECTED;
-			ssh_poll_set_events(p,POLLOUT | POLLIN | POLLERR);
-			ssh_sock_set_blocking(ssh_socket_get_fd_in(s));
-			if(s->callbacks && s->callbacks->connected)
-				s->callbacks->connected(SSH_SOCKET_CONNECTED_OK,0,s->callbacks->userdata);
-			return 0;
-		}
 		/* So, we can write data */
 		s->write_wontblock=1;
     ssh_poll_remove_events(p,POLLOUT);
@@ -283,16 +398,26 @@ int ssh_socket_pollcallback(struct ssh_poll_handle_struct *p, socket_t fd, int r
 		/* If buffered data is pending, write it */
 		if(buffer_get_rest_len(s->out_buffer) > 0){
 		  ssh_socket_nonblocking_flush(s);
-		} else if(s->callbacks && s->callbacks->controlflow){
-			/* Otherwise advertise the upper level that write can be done */
-			s->callbacks->controlflow(SSH_SOCKET_FLOW_WRITEWONTBLOCK,s->callbacks->userdata);
 		}
+		/* Once it's all written, advertise the upper level that write can be done */
+		ssh_socket_signal_writable(s);
 			/* TODO: Find a way to put back POLLOUT when buffering occurs */
 	}
 	/* Return -1 if one of the poll handlers disappeared */
 	return (s->poll_in == NULL || s->poll_out == NULL) ? -1 : 0;
 }
 
+/* Tells the upper level that it can write again, once the output buffer
+ * is empty */
+static void ssh_socket_signal_writable(ssh_socket s){
+	if(s->corked == 0 && ssh_socket_is_open(s) &&
+			buffer_get_rest_len(s->out_buffer) == 0 &&
+			s->callbacks && s->callbacks->controlflow){
+		s->callbacks->controlflow(SSH_SOCKET_FLOW_WRITEWONTBLOCK,
+				s->callbacks->userdata);
+	}
+}
+
 /** @internal
  * @brief returns the input poll handle corresponding to the socket,
  * creates it if it does not exist.
@@ -321,6 +446,16 @@ ssh_poll_handle ssh_socket_get_poll_handle_out(ssh_socket s){
   return s->poll_out;
 }
 
+/** @internal
+ * @brief returns the poll context the socket is polled by.
+ * @returns the poll context, NULL if the socket isn't in one
+ */
+ssh_poll_ctx ssh_socket_get_poll_ctx(ssh_socket s){
+  if (s == NULL || s->poll_in == NULL)
+    return NULL;
+  return ssh_poll_get_ctx(s->poll_in);
+}
+
 /** \internal
  * \brief Deletes a socket object
  */
@@ -331,6 +466,7 @@ void ssh_socket_free(ssh_socket s){
   ssh_socket_close(s);
   ssh_buffer_free(s->in_buffer);
   ssh_buffer_free(s->out_buffer);
+  ssh_buffer_free(s->deferred);
   SAFE_FREE(s);
 }
 
@@ -373,7 +509,29 @@ int ssh_socket_unix(ssh_socket s, const char *path) {
  * \brief closes a socket
  */
 void ssh_socket_close(ssh_socket s){
-  if (ssh_socket_is_open(s)) {
+  ssh_socket_attempts_free(s);
+  /* a resolution still running is cancelled */
+  if (s->state == SSH_SOCKET_RESOLVING) {
+    s->state = SSH_SOCKET_NONE;
+  }
+  /* the poll objects go first, epoll watches the fds until they're closed */
+  if(s->poll_in != NULL){
+    if(s->poll_out == s->poll_in)
+      s->poll_out = NULL;
+    ssh_poll_free(s->poll_in);
+    s->poll_in=NULL;
+  }
+  if(s->poll_out != NULL){
+    ssh_poll_free(s->poll_out);
+    s->poll_out=NULL;
+  }
+  if (ssh_socket_is_open(s) && s->transport != NULL) {
+    /* the transport owns its fd */
+    if (ssh_callbacks_exists(s->transport, close)) {
+      s->transport->close(s->transport->userdata);
+    }
+    s->fd_in = s->fd_out = SSH_INVALID_SOCKET;
+  } else if (ssh_socket_is_open(s)) {
 #ifdef _WIN32
     closesocket(s->fd_in);
     /* fd_in = fd_out under win32 */
@@ -386,16 +544,6 @@ void ssh_socket_close(ssh_socket s){
 #endif
     s->fd_in = s->fd_out = SSH_INVALID_SOCKET;
   }
-  if(s->poll_in != NULL){
-    if(s->poll_out == s->poll_in)
-      s->poll_out = NULL;
-    ssh_poll_free(s->poll_in);
-    s->poll_in=NULL;
-  }
-  if(s->poll_out != NULL){
-    ssh_poll_free(s->poll_out);
-    s->poll_out=NULL;
-  }
 }
 
 /**
@@ -461,6 +609,15 @@ static int ssh_socket_unbuffered_read(ssh_socket s, void *buffer, uint32_t len)
   if (s->data_except) {
     return -1;
   }
+  if (s->transport != NULL) {
+    rc = s->transport->read(buffer, len, s->transport->userdata);
+    s->last_errno = errno;
+    s->read_wontblock = 0;
+    if (rc < 0 && rc != SSH_AGAIN) {
+      s->data_except = 1;
+    }
+    return rc;
+  }
   if(s->fd_is_socket)
     rc = recv(s->fd_in,buffer, len, 0);
   else
@@ -489,19 +646,85 @@ static int ssh_socket_unbuffered_write(ssh_socket s, const void *buffer,
   if (s->data_except) {
     return -1;
   }
-  if (s->fd_is_socket)
+  if (s->transport != NULL) {
+    w = s->transport->write(buffer, len, s->transport->userdata);
+  } else if (s->fd_is_socket) {
     w = send(s->fd_out,buffer, len, 0);
-  else
+  } else {
     w = write(s->fd_out, buffer, len);
+  }
 #ifdef _WIN32
-  s->last_errno = WSAGetLastError();
+  s->last_errno = (s->transport != NULL) ? errno : WSAGetLastError();
 #else
   s->last_errno = errno;
 #endif
+  if (s->transport != NULL && w == SSH_AGAIN) {
+    w = 0;
+  }
+  s->write_wontblock = 0;
+  /* Reactive the POLLOUT detector in the poll multiplexer system */
+  if(s->poll_out){
+  	SSH_LOG(s->session, SSH_LOG_PACKET, "Enabling POLLOUT for socket");
+  	ssh_poll_set_events(s->poll_out,ssh_poll_get_events(s->poll_out) | POLLOUT);
+  }
+  if (w < 0) {
+    s->data_except = 1;
+  }
+
+  return w;
+}
+
+/** \internal
+ * \brief writes the buffers of iov one after the other
+ */
+static int ssh_socket_writev_each(ssh_socket s,
+    const struct iovec *iov, int iovcnt) {
+  int w = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    int r = ssh_socket_unbuffered_write(s, iov[i].iov_base, iov[i].iov_len);
+    if (r < 0) {
+      return (w > 0) ? w : r;
+    }
+    w += r;
+    if ((size_t) r < iov[i].iov_len) {
+      break;
+    }
+  }
+  return w;
+}
+
+/** \internal
+ * \brief writes the buffers of iov to socket in a single system call
+ */
+static int ssh_socket_unbuffered_writev(ssh_socket s,
+    const struct iovec *iov, int iovcnt) {
+  int w = -1;
+
+  if (s->data_except) {
+    return -1;
+  }
+  if (s->transport != NULL) {
+    if (!ssh_callbacks_exists(s->transport, writev)) {
+      return ssh_socket_writev_each(s, iov, iovcnt);
+    }
+    w = s->transport->writev(iov, iovcnt, s->transport->userdata);
+    if (w == SSH_AGAIN) {
+      w = 0;
+    }
+  } else {
+#ifdef _WIN32
+    return ssh_socket_writev_each(s, iov, iovcnt);
+#else
+    w = writev(s->fd_out, iov, iovcnt);
+#endif
+  }
+  s->last_errno = errno;
   s->write_wontblock = 0;
   /* Reactive the POLLOUT detector in the poll multiplexer system */
   if(s->poll_out){
-  	ssh_log(s->session, SSH_LOG_PACKET, "Enabling POLLOUT for socket");
+  	SSH_LOG(s->session, SSH_LOG_PACKET, "Enabling POLLOUT for socket");
   	ssh_poll_set_events(s->poll_out,ssh_poll_get_events(s->poll_out) | POLLOUT);
   }
   if (w < 0) {
@@ -551,19 +774,135 @@ void ssh_socket_fd_set(ssh_socket s, fd_set *set, socket_t *max_fd) {
  * \warning has no effect on socket before a flush
  */
 int ssh_socket_write(ssh_socket s, const void *buffer, int len) {
+  struct iovec iov;
+
+  if (len <= 0) {
+    return SSH_OK;
+  }
+  iov.iov_base = (void *) buffer;
+  iov.iov_len = len;
+
+  return ssh_socket_writev(s, &iov, 1);
+}
+
+/** \internal
+ * \brief buffered write of an array of buffers
+ *
+ * When no data is pending and the socket is writable, the buffers are
+ * written directly with one system call. Only what couldn't be written is
+ * copied into the output buffer.
+ * \returns SSH_OK, or SSH_ERROR
+ */
+int ssh_socket_writev(ssh_socket s, const struct iovec *iov, int iovcnt) {
   ssh_session session = s->session;
+  size_t total = 0;
+  size_t w = 0;
+  int rc;
+  int i;
+
   enter_function();
-  if(len > 0) {
-    if (buffer_add_data(s->out_buffer, buffer, len) < 0) {
-      ssh_set_error_oom(s->session);
+  for (i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  if (total == 0) {
+    leave_function();
+    return SSH_OK;
+  }
+
+  if (!s->corked && s->write_wontblock && ssh_socket_is_open(s) &&
+      buffer_get_rest_len(s->out_buffer) == 0) {
+    rc = ssh_socket_unbuffered_writev(s, iov, iovcnt);
+    if (rc < 0) {
+      session->alive = 0;
+      ssh_socket_close(s);
+      ssh_set_error(session, SSH_FATAL,
+          "Writing packet: error on socket (or connection closed): %s",
+          strerror(s->last_errno));
+      leave_function();
+      return SSH_ERROR;
+    }
+    w = rc;
+  }
+
+  /* keep the rest for the next flush */
+  for (i = 0; i < iovcnt; i++) {
+    if (w >= iov[i].iov_len) {
+      w -= iov[i].iov_len;
+      continue;
+    }
+    if (buffer_add_data(s->out_buffer, (char *) iov[i].iov_base + w,
+          iov[i].iov_len - w) < 0) {
+      ssh_set_error_oom(session);
+      leave_function();
       return SSH_ERROR;
     }
+    w = 0;
+  }
+  if (!s->corked && buffer_get_rest_len(s->out_buffer) > 0) {
     ssh_socket_nonblocking_flush(s);
   }
+
   leave_function();
   return SSH_OK;
 }
 
+/** \internal
+ * \brief reserves space at the tail of the output buffer
+ *
+ * This is only possible when a write would be buffered anyway: the socket is
+ * corked, not writable, or has data pending. The caller can then build its
+ * data in place and count it with ssh_socket_commit(), which saves the copy
+ * ssh_socket_writev() would do.
+ * \returns a pointer valid until the next write, or NULL when the data has
+ * to go through ssh_socket_writev()
+ */
+void *ssh_socket_reserve(ssh_socket s, uint32_t len) {
+  if (!s->corked && s->write_wontblock && ssh_socket_is_open(s) &&
+      buffer_get_rest_len(s->out_buffer) == 0) {
+    return NULL;
+  }
+
+  return buffer_reserve(s->out_buffer, len);
+}
+
+/** \internal
+ * \brief adds len bytes written in the space of ssh_socket_reserve() to the
+ * output buffer
+ * \returns SSH_OK, or SSH_ERROR
+ */
+int ssh_socket_commit(ssh_socket s, uint32_t len) {
+  if (buffer_commit(s->out_buffer, len) < 0) {
+    return SSH_ERROR;
+  }
+  if (!s->corked && buffer_get_rest_len(s->out_buffer) > 0) {
+    ssh_socket_nonblocking_flush(s);
+  }
+
+  return SSH_OK;
+}
+
+/** \internal
+ * \brief only buffers the data written until ssh_socket_uncork()
+ */
+void ssh_socket_cork(ssh_socket s) {
+  s->corked++;
+}
+
+/** \internal
+ * \brief flushes the buffered data once the last cork is removed
+ * \returns SSH_OK, SSH_AGAIN or SSH_ERROR like ssh_socket_nonblocking_flush()
+ */
+int ssh_socket_uncork(ssh_socket s) {
+  if (s->corked > 0) {
+    s->corked--;
+  }
+  if (s->corked > 0 || buffer_get_rest_len(s->out_buffer) == 0) {
+    return SSH_OK;
+  }
+
+  return ssh_socket_nonblocking_flush(s);
+}
+
 
 /** \internal
  * \brief starts a nonblocking flush of the output buffer
@@ -589,6 +928,7 @@ int ssh_socket_nonblocking_flush(ssh_socket s) {
 
   len = buffer_get_rest_len(s->out_buffer);
   if (!s->write_wontblock && s->poll_out && len > 0) {
+      session->stats.flush_again++;
       /* force the poll system to catch pollout events */
       ssh_poll_add_events(s->poll_out, POLLOUT);
       leave_function();
@@ -613,6 +953,7 @@ int ssh_socket_nonblocking_flush(ssh_socket s) {
   /* Is there some data pending? */
   len = buffer_get_rest_len(s->out_buffer);
   if (s->poll_out && len > 0) {
+      session->stats.flush_again++;
       /* force the poll system to catch pollout events */
       ssh_poll_add_events(s->poll_out, POLLOUT);
       leave_function();
@@ -644,6 +985,21 @@ int ssh_socket_data_writable(ssh_socket s) {
   return s->write_wontblock;
 }
 
+/** @internal
+ * @brief returns the number of bytes waiting in the socket buffers
+ */
+uint32_t ssh_socket_buffered(ssh_socket s) {
+  return buffer_get_rest_len(s->in_buffer) + buffer_get_rest_len(s->out_buffer) +
+    (s->deferred != NULL ? buffer_get_rest_len(s->deferred) : 0);
+}
+
+/** @internal
+ * @brief returns the number of bytes waiting to be written to the socket
+ */
+uint32_t ssh_socket_buffered_out(ssh_socket s) {
+  return buffer_get_rest_len(s->out_buffer);
+}
+
 int ssh_socket_get_status(ssh_socket s) {
   int r = 0;
 
@@ -658,43 +1014,354 @@ int ssh_socket_get_status(ssh_socket s) {
   return r;
 }
 
+/*
+ * The connection attempts: the first one runs on fd_in and the poll objects
+ * of the socket, the ones racing with it have their own poll objects. Every
+ * attempt which fails is replaced by the next address right away, and
+ * attempt_timer starts a new one every SSH_CONNECT_ATTEMPT_DELAY ms.
+ */
+static int ssh_socket_attempt_callback(ssh_poll_handle p, socket_t fd,
+    int revents, void *v_s);
+
+static void ssh_socket_attempt_timer(ssh_timer timer, void *userdata);
+
+/* stops polling a racing attempt and returns its fd */
+static socket_t ssh_socket_attempt_remove(ssh_socket s, int i) {
+  socket_t fd = ssh_poll_get_fd(s->attempt_polls[i]);
+
+  ssh_poll_free(s->attempt_polls[i]);
+  s->attempt_polls[i] = s->attempt_polls[--s->n_attempt_polls];
+
+  return fd;
+}
+
+static void ssh_socket_attempts_free(ssh_socket s) {
+  while (s->n_attempt_polls > 0) {
+    ssh_connect_socket_close(ssh_socket_attempt_remove(s, 0));
+  }
+  ssh_timer_free(s->attempt_timer);
+  s->attempt_timer = NULL;
+  ssh_connect_attempts_free(s->attempts);
+  s->attempts = NULL;
+}
+
+/*
+ * Connects to the next address, on fd_in if no attempt runs there.
+ * Returns SSH_ERROR when no more attempt can be started.
+ */
+static int ssh_socket_attempt_start(ssh_socket s) {
+  ssh_poll_handle p;
+  ssh_poll_ctx ctx;
+  socket_t fd;
+
+  if (s->attempts == NULL ||
+      s->n_attempt_polls == SSH_CONNECT_ATTEMPTS_MAX - 1) {
+    return SSH_ERROR;
+  }
+  fd = ssh_connect_attempts_next(s->session, s->attempts);
+  if (fd == SSH_INVALID_SOCKET) {
+    return SSH_ERROR;
+  }
+
+  if (s->fd_in == SSH_INVALID_SOCKET) {
+    ssh_socket_set_fd(s, fd);
+    /* POLLOUT is the event to wait for in a nonblocking connect */
+    p = ssh_socket_get_poll_handle_in(s);
+    if (p == NULL) {
+      ssh_set_error_oom(s->session);
+      return SSH_ERROR;
+    }
+    ssh_poll_set_events(p, POLLOUT);
+#ifdef _WIN32
+    ssh_poll_add_events(p, POLLWRNORM);
+#endif
+  } else {
+    p = ssh_poll_new(fd, POLLOUT, ssh_socket_attempt_callback, s);
+    ctx = ssh_socket_get_poll_ctx(s);
+    if (ctx == NULL) {
+      ctx = ssh_poll_get_default_ctx(s->session);
+    }
+    if (p == NULL || ctx == NULL || ssh_poll_ctx_add(ctx, p) < 0) {
+      ssh_set_error_oom(s->session);
+      ssh_poll_free(p);
+      ssh_connect_socket_close(fd);
+      return SSH_ERROR;
+    }
+#ifdef _WIN32
+    ssh_poll_add_events(p, POLLWRNORM);
+#endif
+    s->attempt_polls[s->n_attempt_polls++] = p;
+  }
+
+  /* the next address is tried after the delay, unless this one fails first */
+  if (ssh_connect_attempts_left(s->attempts) == 0) {
+    ssh_timer_cancel(s->attempt_timer);
+  } else if (s->attempt_timer == NULL) {
+    s->attempt_timer = ssh_session_add_timer(s->session,
+        SSH_CONNECT_ATTEMPT_DELAY, ssh_socket_attempt_timer, s);
+  } else {
+    ssh_timer_reset(s->attempt_timer, SSH_CONNECT_ATTEMPT_DELAY);
+  }
+
+  return SSH_OK;
+}
+
+static void ssh_socket_attempt_timer(ssh_timer timer, void *userdata) {
+  ssh_socket s = (ssh_socket) userdata;
+
+  (void) timer;
+  if (s->state == SSH_SOCKET_CONNECTING) {
+    ssh_socket_attempt_start(s);
+  }
+}
+
+/*
+ * Checks an attempt which got an event. Returns 1 when it is connected, and
+ * is on fd_in now, 0 while other attempts are running and -1 when all of
+ * them failed.
+ */
+static int ssh_socket_attempt_event(ssh_socket s, socket_t fd) {
+  socket_t old;
+  int err;
+  int i;
+
+  err = ssh_connect_attempt_error(fd);
+  if (err == 0) {
+    if (fd != s->fd_in) {
+      for (i = 0; i < s->n_attempt_polls; i++) {
+        if (ssh_poll_get_fd(s->attempt_polls[i]) == fd) {
+          ssh_socket_attempt_remove(s, i);
+          break;
+        }
+      }
+      old = s->fd_in;
+      ssh_socket_set_fd(s, fd);
+      ssh_connect_socket_close(old);
+    }
+    ssh_socket_attempts_free(s);
+    return 1;
+  }
+
+  s->last_errno = err;
+  SSH_LOG(s->session, SSH_LOG_PROTOCOL, "Connection attempt %d failed: %s",
+      fd, strerror(err));
+  if (fd == s->fd_in) {
+    /* a racing attempt takes its place */
+    if (s->n_attempt_polls > 0) {
+      ssh_socket_set_fd(s,
+          ssh_socket_attempt_remove(s, s->n_attempt_polls - 1));
+    } else {
+      s->fd_in = s->fd_out = SSH_INVALID_SOCKET;
+    }
+  } else {
+    for (i = 0; i < s->n_attempt_polls; i++) {
+      if (ssh_poll_get_fd(s->attempt_polls[i]) == fd) {
+        ssh_socket_attempt_remove(s, i);
+        break;
+      }
+    }
+  }
+  ssh_connect_socket_close(fd);
+
+  /* don't wait for the delay after a failure */
+  if (ssh_socket_attempt_start(s) < 0 && s->fd_in == SSH_INVALID_SOCKET) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Handles an event on a connecting socket. Returns -1 when the connection
+ * failed and the socket is closed.
+ */
+static int ssh_socket_connect_event(ssh_socket s, socket_t fd, int revents) {
+  int rc;
+
+#ifdef _WIN32
+  if (!(revents & (POLLERR | POLLHUP | POLLOUT | POLLWRNORM))) {
+#else
+  if (!(revents & (POLLERR | POLLHUP | POLLOUT))) {
+#endif
+    return 0;
+  }
+
+  rc = ssh_socket_attempt_event(s, fd);
+  if (rc < 0) {
+    s->state=SSH_SOCKET_ERROR;
+    ssh_socket_close(s);
+    if(s->callbacks && s->callbacks->connected)
+      s->callbacks->connected(SSH_SOCKET_CONNECTED_ERROR,s->last_errno,
+          s->callbacks->userdata);
+    return -1;
+  }
+  if (rc == 0) {
+    return 0;
+  }
+
+  SSH_LOG(s->session,SSH_LOG_PACKET,"Received POLLOUT in connecting state");
+  s->state = SSH_SOCKET_CONNECTED;
+  ssh_poll_set_events(s->poll_in,POLLOUT | POLLIN | POLLERR);
+  ssh_sock_set_blocking(ssh_socket_get_fd_in(s));
+  if(s->callbacks && s->callbacks->connected)
+    s->callbacks->connected(SSH_SOCKET_CONNECTED_OK,0,s->callbacks->userdata);
+
+  return 0;
+}
+
+static int ssh_socket_attempt_callback(ssh_poll_handle p, socket_t fd,
+    int revents, void *v_s) {
+  ssh_socket s = (ssh_socket) v_s;
+  int i;
+
+  if (s->state == SSH_SOCKET_CONNECTING) {
+    ssh_socket_connect_event(s, fd, revents);
+  }
+  /* the poll object is gone once its attempt is over */
+  for (i = 0; i < s->n_attempt_polls; i++) {
+    if (s->attempt_polls[i] == p) {
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+static int ssh_socket_connect_attempts(ssh_socket s,
+    struct ssh_connect_attempts *attempts) {
+  s->attempts = attempts;
+  s->state = SSH_SOCKET_CONNECTING;
+  if (ssh_socket_attempt_start(s) < 0) {
+    ssh_socket_attempts_free(s);
+    s->state = SSH_SOCKET_NONE;
+    return SSH_ERROR;
+  }
+  SSH_LOG(s->session,SSH_LOG_PROTOCOL,"Nonblocking connection socket: %d",
+      s->fd_in);
+
+  return SSH_OK;
+}
+
 /**
  * @internal
  * @brief Launches a socket connection
  * If a the socket connected callback has been defined and
  * a poll object exists, this call will be non blocking.
+ *
+ * The addresses of the host are tried in parallel with a delay of
+ * SSH_CONNECT_ATTEMPT_DELAY ms (RFC 8305). When the session has a resolver
+ * callback, the socket waits for ssh_socket_connect_ai() after it.
  * @param s    socket to connect.
  * @param host hostname or ip address to connect to.
  * @param port port number to connect to.
  * @param bind_addr address to bind to, or NULL for default.
- * @returns SSH_OK socket is being connected.
+ * @returns SSH_OK socket is being connected or resolved.
  * @returns SSH_ERROR error while connecting to remote host.
- * @bug It only tries connecting to one of the available AI's
- * which is problematic for hosts having DNS fail-over.
  */
 
 int ssh_socket_connect(ssh_socket s, const char *host, int port, const char *bind_addr){
-	socket_t fd;
+	struct ssh_connect_attempts *attempts;
 	ssh_session session=s->session;
+	int rc;
 	enter_function();
 	if(s->state != SSH_SOCKET_NONE) {
 		ssh_set_error(s->session, SSH_FATAL,
 				"ssh_socket_connect called on socket not unconnected");
+		leave_function();
 		return SSH_ERROR;
 	}
-	fd=ssh_connect_host_nonblocking(s->session,host,bind_addr,port);
-	ssh_log(session,SSH_LOG_PROTOCOL,"Nonblocking connection socket: %d",fd);
-	if(fd == SSH_INVALID_SOCKET)
+	if(ssh_callbacks_exists(session->callbacks, resolve_function) &&
+			!ssh_is_ipaddr(host)){
+		s->state=SSH_SOCKET_RESOLVING;
+		rc=session->callbacks->resolve_function(session,host,port,
+				session->callbacks->userdata);
+		if(rc == SSH_ERROR && s->state == SSH_SOCKET_RESOLVING){
+			s->state=SSH_SOCKET_NONE;
+			ssh_set_error(session, SSH_FATAL,
+					"Failed to resolve hostname %s", host);
+		}
+		leave_function();
+		return (s->state == SSH_SOCKET_RESOLVING ||
+				s->state == SSH_SOCKET_CONNECTING) ? SSH_OK : SSH_ERROR;
+	}
+	attempts=ssh_connect_attempts_resolve(session,host,port,bind_addr);
+	if(attempts == NULL){
+		leave_function();
 		return SSH_ERROR;
-	ssh_socket_set_fd(s,fd);
-	s->state=SSH_SOCKET_CONNECTING;
-	/* POLLOUT is the event to wait for in a nonblocking connect */
-	ssh_poll_set_events(ssh_socket_get_poll_handle_in(s),POLLOUT);
-#ifdef _WIN32
-	ssh_poll_add_events(ssh_socket_get_poll_handle_in(s),POLLWRNORM);
-#endif
+	}
+	rc=ssh_socket_connect_attempts(s,attempts);
 	leave_function();
-	return SSH_OK;
+	return rc;
+}
+
+/**
+ * @internal
+ * @brief Launches a socket connection to resolved addresses, the way
+ * ssh_socket_connect() does.
+ * @param s    socket to connect.
+ * @param ai   addresses to connect to.
+ * @param port port of the addresses without one.
+ * @param bind_addr address to bind to, or NULL for default.
+ * @returns SSH_OK socket is being connected.
+ * @returns SSH_ERROR error while connecting to remote host.
+ */
+int ssh_socket_connect_ai(ssh_socket s, const struct addrinfo *ai, int port,
+    const char *bind_addr){
+  struct ssh_connect_attempts *attempts;
+  ssh_session session=s->session;
+  int rc;
+
+  enter_function();
+  if(s->state != SSH_SOCKET_NONE && s->state != SSH_SOCKET_RESOLVING) {
+    ssh_set_error(session, SSH_FATAL,
+        "ssh_socket_connect_ai called on socket not unconnected");
+    leave_function();
+    return SSH_ERROR;
+  }
+  s->state = SSH_SOCKET_NONE;
+  attempts = ssh_connect_attempts_new(session, ai, port, bind_addr);
+  if (attempts == NULL) {
+    leave_function();
+    return SSH_ERROR;
+  }
+  rc = ssh_socket_connect_attempts(s, attempts);
+  leave_function();
+  return rc;
+}
+
+/** @internal
+ * @brief returns nonzero while the socket waits for a resolver callback
+ */
+int ssh_socket_is_resolving(ssh_socket s) {
+  return s->state == SSH_SOCKET_RESOLVING;
+}
+
+/**
+ * @internal
+ * @brief Uses a file descriptor which is already connected, e.g. the fd of a
+ * transport or one given with SSH_OPTIONS_FD.
+ * @param s    socket to connect.
+ * @param fd   the connected file descriptor.
+ * @returns SSH_OK socket is connected.
+ * @returns SSH_ERROR the socket was already connected.
+ */
+int ssh_socket_connect_fd(ssh_socket s, socket_t fd){
+  ssh_session session=s->session;
+  enter_function();
+  if(s->state != SSH_SOCKET_NONE) {
+    ssh_set_error(s->session, SSH_FATAL,
+        "ssh_socket_connect_fd called on socket not unconnected");
+    leave_function();
+    return SSH_ERROR;
+  }
+  ssh_socket_set_fd(s,fd);
+  s->state=SSH_SOCKET_CONNECTED;
+  ssh_poll_set_events(ssh_socket_get_poll_handle_in(s),POLLIN | POLLERR);
+  ssh_poll_add_events(ssh_socket_get_poll_handle_out(s),POLLOUT);
+  if(s->callbacks && s->callbacks->connected)
+    s->callbacks->connected(SSH_SOCKET_CONNECTED_OK,0,s->callbacks->userdata);
+  leave_function();
+  return SSH_OK;
 }
 
 #ifndef _WIN32
@@ -746,14 +1413,14 @@ int ssh_socket_connect_proxycommand(ssh_socket s, const char *command){
       return SSH_ERROR;
   }
 
-  ssh_log(session,SSH_LOG_PROTOCOL,"Executing proxycommand '%s'",command);
+  SSH_LOG(session,SSH_LOG_PROTOCOL,"Executing proxycommand '%s'",command);
   pid = fork();
   if(pid == 0){
     ssh_execute_command(command,out_pipe[0],in_pipe[1]);
   }
   close(in_pipe[1]);
   close(out_pipe[0]);
-  ssh_log(session,SSH_LOG_PROTOCOL,"ProxyCommand connection pipe: [%d,%d]",in_pipe[0],out_pipe[1]);
+  SSH_LOG(session,SSH_LOG_PROTOCOL,"ProxyCommand connection pipe: [%d,%d]",in_pipe[0],out_pipe[1]);
   ssh_socket_set_fd_in(s,in_pipe[0]);
   ssh_socket_set_fd_out(s,out_pipe[1]);
   s->state=SSH_SOCKET_CONNECTED;
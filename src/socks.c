@@ -0,0 +1,575 @@
+/*
+ * socks.c - dynamic forwarding of the connections of a SOCKS proxy
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#endif
+
+#include "libssh/priv.h"
+#include "libssh/callbacks.h"
+#include "libssh/channels.h"
+#include "libssh/poll.h"
+#include "libssh/session.h"
+
+/**
+ * @defgroup libssh_socks The SSH dynamic forwarding functions.
+ * @ingroup libssh
+ *
+ * A SOCKS proxy on a listening socket, whose connections are forwarded
+ * through direct-tcpip channels of a session, like the -D option of
+ * OpenSSH. The SOCKS4, SOCKS4a and SOCKS5 CONNECT commands are supported,
+ * SOCKS5 without authentication.
+ *
+ * It all runs in the poll context of the session: the connections are
+ * negotiated and their channels opened without blocking, then forwarded by
+ * ssh_channel_bind_fd().
+ *
+ * @{
+ */
+
+/* the longest request: a SOCKS4a user and host, or a SOCKS5 greeting */
+#define SOCKS_REQUEST_MAX 600
+
+/* the connections accepted at most each time the listener is readable */
+#define SOCKS_ACCEPT_MAX 64
+
+#define SOCKS4_GRANTED 90
+#define SOCKS4_REJECTED 91
+
+#define SOCKS5_SUCCEEDED 0
+#define SOCKS5_FAILURE 1
+#define SOCKS5_REFUSED 5
+#define SOCKS5_BAD_COMMAND 7
+#define SOCKS5_BAD_ADDRESS 8
+
+enum ssh_socks_state_e {
+  SOCKS_STATE_GREETING, /* waiting for the version of the client */
+  SOCKS_STATE_REQUEST, /* SOCKS5: the method was chosen, waiting for the
+                          request */
+  SOCKS_STATE_OPENING, /* the channel is being opened */
+  SOCKS_STATE_FORWARDING /* see ssh_channel_bind_fd() */
+};
+
+struct ssh_socks_conn {
+  /* its poll while it negotiates, ssh_channel_bind_fd() polls it afterwards */
+  struct channel_fd_conn base;
+  enum ssh_socks_state_e state;
+  int version;
+  /* what was read and not parsed yet */
+  unsigned char request[SOCKS_REQUEST_MAX];
+  uint32_t len;
+};
+
+struct ssh_socks_struct {
+  ssh_session session;
+  socket_t listener;
+  ssh_poll_handle poll;
+  struct channel_fd_conns conns;
+  ssh_socks next; /* the other proxies of the session */
+};
+
+static void socks_free_conn(struct channel_fd_conn *conn) {
+  SAFE_FREE(conn);
+}
+
+/* the reply is a few bytes, which fit in any socket buffer */
+static void socks_reply(struct ssh_socks_conn *conn, int code) {
+  unsigned char reply[10];
+  size_t len;
+
+  memset(reply, 0, sizeof(reply));
+  if (conn->version == 4) {
+    reply[1] = code;
+    len = 8;
+  } else {
+    reply[0] = 5;
+    reply[1] = code;
+    reply[3] = 1; /* an IPv4 address, which the client ignores */
+    len = 10;
+  }
+  send(conn->base.fd, (const char *) reply, len, 0);
+}
+
+static void socks_fail(struct ssh_socks_conn *conn, int code) {
+  socks_reply(conn, code);
+  channel_fd_conn_close(&conn->base);
+}
+
+static void socks_open_response(ssh_session session, ssh_channel channel,
+    int is_success, void *userdata) {
+  struct ssh_socks_conn *conn = userdata;
+
+  if (conn->state != SOCKS_STATE_OPENING || conn->base.closing) {
+    return;
+  }
+  if (!is_success) {
+    SSH_LOG(session, SSH_LOG_PROTOCOL,
+        "SOCKS connection refused by the server: %s", ssh_get_error(session));
+    socks_fail(conn, conn->version == 4 ? SOCKS4_REJECTED : SOCKS5_REFUSED);
+    return;
+  }
+
+  /* the negotiation is over, ssh_channel_bind_fd() polls the socket now */
+  socks_reply(conn, conn->version == 4 ? SOCKS4_GRANTED : SOCKS5_SUCCEEDED);
+  if (channel_fd_conn_forward(&conn->base) != SSH_OK) {
+    return;
+  }
+  conn->state = SOCKS_STATE_FORWARDING;
+
+  /* what the client sent right after its request */
+  if (conn->len > 0) {
+    ssh_channel_write(channel, conn->request, conn->len);
+    conn->len = 0;
+  }
+}
+
+/* the originator of the channel is the client of the proxy */
+static void socks_peer(struct ssh_socks_conn *conn, char *host,
+    size_t hostlen, int *port) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  char serv[NI_MAXSERV];
+
+  if (getpeername(conn->base.fd, (struct sockaddr *) &addr, &len) == 0 &&
+      getnameinfo((struct sockaddr *) &addr, len, host, hostlen, serv,
+        sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+    *port = atoi(serv);
+    return;
+  }
+  snprintf(host, hostlen, "127.0.0.1");
+  *port = 0;
+}
+
+/*
+ * Opens the channel to host and port, without blocking: its answer goes to
+ * socks_open_response(), maybe before this returns.
+ */
+static void socks_open(struct ssh_socks_conn *conn, const char *host,
+    int port) {
+  ssh_session session = conn->base.conns->session;
+  ssh_channel channel;
+  char source[NI_MAXHOST];
+  int source_port;
+  int blocking;
+  int rc;
+
+  channel = ssh_channel_new(session);
+  if (channel == NULL) {
+    socks_fail(conn, conn->version == 4 ? SOCKS4_REJECTED : SOCKS5_FAILURE);
+    return;
+  }
+  conn->base.callbacks.channel_open_response_function = socks_open_response;
+  channel_fd_conn_set_channel(&conn->base, channel);
+
+  SSH_LOG(session, SSH_LOG_PROTOCOL, "SOCKS%d connection to %s:%d",
+      conn->version, host, port);
+  socks_peer(conn, source, sizeof(source), &source_port);
+  /* the client waits for the reply before it sends more */
+  ssh_poll_set_events(conn->base.poll, 0);
+  conn->state = SOCKS_STATE_OPENING;
+
+  blocking = ssh_is_blocking(session);
+  ssh_set_blocking(session, 0);
+  rc = ssh_channel_open_forward(channel, host, port, source, source_port);
+  ssh_set_blocking(session, blocking);
+
+  if (rc == SSH_ERROR && !conn->base.closing) {
+    socks_fail(conn, conn->version == 4 ? SOCKS4_REJECTED : SOCKS5_FAILURE);
+  }
+}
+
+static void socks_consume(struct ssh_socks_conn *conn, uint32_t len) {
+  conn->len -= len;
+  memmove(conn->request, conn->request + len, conn->len);
+}
+
+/* the end of a string of the request, 0 if it isn't complete */
+static uint32_t socks_string_end(struct ssh_socks_conn *conn, uint32_t from) {
+  uint32_t i;
+
+  for (i = from; i < conn->len; i++) {
+    if (conn->request[i] == '\0') {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * The SOCKS4 request: version, command, port, address, user, and the host
+ * when the address is 0.0.0.x (SOCKS4a). Returns 0 while incomplete, -1 when
+ * the connection was refused.
+ */
+static int socks4_request(struct ssh_socks_conn *conn) {
+  const unsigned char *r = conn->request;
+  char host[256];
+  uint32_t end;
+  uint32_t host_end;
+  int port;
+
+  if (conn->len < 9 || (end = socks_string_end(conn, 8)) == 0) {
+    return 0;
+  }
+  if (r[4] == 0 && r[5] == 0 && r[6] == 0 && r[7] != 0) {
+    host_end = socks_string_end(conn, end);
+    if (host_end == 0) {
+      return 0;
+    }
+    if (host_end - end > sizeof(host)) {
+      socks_fail(conn, SOCKS4_REJECTED);
+      return -1;
+    }
+    memcpy(host, r + end, host_end - end);
+    end = host_end;
+  } else {
+    snprintf(host, sizeof(host), "%u.%u.%u.%u", r[4], r[5], r[6], r[7]);
+  }
+  if (r[1] != 1) {
+    /* only CONNECT, not BIND */
+    socks_fail(conn, SOCKS4_REJECTED);
+    return -1;
+  }
+
+  port = (r[2] << 8) | r[3];
+  socks_consume(conn, end);
+  socks_open(conn, host, port);
+  return 1;
+}
+
+/* the SOCKS5 greeting: version, and the authentication methods offered */
+static int socks5_greeting(struct ssh_socks_conn *conn) {
+  unsigned char reply[2] = {5, 0xff};
+  uint32_t len;
+  int i;
+
+  if (conn->len < 2 || conn->len < 2 + (uint32_t) conn->request[1]) {
+    return 0;
+  }
+  len = 2 + conn->request[1];
+  for (i = 2; i < (int) len; i++) {
+    if (conn->request[i] == 0) {
+      /* no authentication */
+      reply[1] = 0;
+    }
+  }
+  send(conn->base.fd, (const char *) reply, sizeof(reply), 0);
+  if (reply[1] != 0) {
+    channel_fd_conn_close(&conn->base);
+    return -1;
+  }
+
+  socks_consume(conn, len);
+  conn->state = SOCKS_STATE_REQUEST;
+  return 1;
+}
+
+/*
+ * The SOCKS5 request: version, command, reserved, address type, address
+ * and port.
+ */
+static int socks5_request(struct ssh_socks_conn *conn) {
+  const unsigned char *r = conn->request;
+  char host[256];
+  uint32_t len;
+  int port;
+  int i;
+
+  if (conn->len < 5) {
+    return 0;
+  }
+  if (r[0] != 5 || r[1] != 1) {
+    /* only CONNECT, not BIND or UDP ASSOCIATE */
+    socks_fail(conn, SOCKS5_BAD_COMMAND);
+    return -1;
+  }
+  switch (r[3]) {
+    case 1: /* IPv4 */
+      len = 4 + 4 + 2;
+      break;
+    case 3: /* domain name */
+      len = 4 + 1 + r[4] + 2;
+      break;
+    case 4: /* IPv6 */
+      len = 4 + 16 + 2;
+      break;
+    default:
+      socks_fail(conn, SOCKS5_BAD_ADDRESS);
+      return -1;
+  }
+  if (conn->len < len) {
+    return 0;
+  }
+  switch (r[3]) {
+    case 1:
+      snprintf(host, sizeof(host), "%u.%u.%u.%u", r[4], r[5], r[6], r[7]);
+      break;
+    case 3:
+      memcpy(host, r + 5, r[4]);
+      host[r[4]] = '\0';
+      break;
+    default:
+      host[0] = '\0';
+      for (i = 0; i < 16; i += 2) {
+        snprintf(host + strlen(host), sizeof(host) - strlen(host),
+            i > 0 ? ":%x" : "%x", (r[4 + i] << 8) | r[5 + i]);
+      }
+      break;
+  }
+
+  port = (r[len - 2] << 8) | r[len - 1];
+  socks_consume(conn, len);
+  socks_open(conn, host, port);
+  return 1;
+}
+
+/* parses what was read, returns -1 when the connection stopped negotiating */
+static int socks_negotiate(struct ssh_socks_conn *conn) {
+  int rc = 1;
+
+  while (rc > 0 && conn->len > 0) {
+    switch (conn->state) {
+      case SOCKS_STATE_GREETING:
+        conn->version = conn->request[0];
+        if (conn->version == 4) {
+          rc = socks4_request(conn);
+        } else if (conn->version == 5) {
+          rc = socks5_greeting(conn);
+        } else {
+          channel_fd_conn_close(&conn->base);
+          rc = -1;
+        }
+        break;
+      case SOCKS_STATE_REQUEST:
+        rc = socks5_request(conn);
+        break;
+      default:
+        /* kept for the channel */
+        return conn->base.poll == NULL ? -1 : 0;
+    }
+  }
+  if (rc == 0 && conn->len == sizeof(conn->request)) {
+    channel_fd_conn_close(&conn->base);
+    rc = -1;
+  }
+
+  return rc < 0 || conn->base.poll == NULL ? -1 : 0;
+}
+
+static int socks_conn_poll(ssh_poll_handle p, socket_t fd, int revents,
+    void *userdata) {
+  struct ssh_socks_conn *conn = userdata;
+  int r;
+
+  (void) p;
+
+  if (conn->state == SOCKS_STATE_OPENING) {
+    /* a hung up client is seen by the forwarding once the channel opened */
+    if (revents & (POLLERR | POLLHUP)) {
+      channel_fd_conn_stop_poll(&conn->base);
+      return -1;
+    }
+    return 0;
+  }
+  if (!(revents & (POLLIN | POLLERR | POLLHUP))) {
+    return 0;
+  }
+
+  r = recv(fd, (char *) conn->request + conn->len,
+      sizeof(conn->request) - conn->len, 0);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  }
+  if (r <= 0) {
+    channel_fd_conn_close(&conn->base);
+    return -1;
+  }
+  conn->len += r;
+
+  return socks_negotiate(conn);
+}
+
+static void socks_accept(ssh_socks socks) {
+  ssh_session session = socks->session;
+  struct ssh_socks_conn *conn;
+  socket_t fd;
+  int i;
+
+  for (i = 0; i < SOCKS_ACCEPT_MAX; i++) {
+    fd = accept(socks->listener, NULL, NULL);
+    if (fd == SSH_INVALID_SOCKET) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        SSH_LOG(session, SSH_LOG_RARE, "SOCKS accept error: %s",
+            strerror(errno));
+      }
+      return;
+    }
+    ssh_sock_set_nonblocking(fd);
+
+    conn = malloc(sizeof(struct ssh_socks_conn));
+    if (conn == NULL) {
+#ifdef _WIN32
+      closesocket(fd);
+#else
+      close(fd);
+#endif
+      return;
+    }
+    ZERO_STRUCTP(conn);
+    conn->state = SOCKS_STATE_GREETING;
+    channel_fd_conn_add(&socks->conns, &conn->base, fd);
+    if (channel_fd_conn_poll(&conn->base, POLLIN, socks_conn_poll) < 0) {
+      channel_fd_conn_close(&conn->base);
+      return;
+    }
+  }
+}
+
+static int socks_listener_poll(ssh_poll_handle p, socket_t fd, int revents,
+    void *userdata) {
+  (void) p;
+  (void) fd;
+
+  if (revents & POLLIN) {
+    socks_accept(userdata);
+  }
+  return 0;
+}
+
+/**
+ * @brief Start a SOCKS proxy forwarding through a session.
+ *
+ * The connections accepted on the listener are forwarded through
+ * direct-tcpip channels of the session, to the host and port each of them
+ * asks for. It runs in the poll context of the session: from
+ * ssh_event_dopoll() when the session is in an event, else from any call
+ * which waits for the session. Many connections can be proxied at once,
+ * none of them blocks the others.
+ *
+ * @param[in]  session  An authenticated session.
+ *
+ * @param[in]  listener A listening socket, put in nonblocking mode. It isn't
+ *                      closed by the proxy.
+ *
+ * @return              The proxy, NULL on error. It is freed with the
+ *                      session, or by ssh_socks_free().
+ */
+ssh_socks ssh_socks_new(ssh_session session, socket_t listener) {
+  ssh_socks socks;
+  ssh_poll_ctx ctx;
+
+  if (session == NULL) {
+    return NULL;
+  }
+  if (listener == SSH_INVALID_SOCKET) {
+    ssh_set_error_invalid(session, __FUNCTION__);
+    return NULL;
+  }
+  ctx = ssh_session_get_poll_ctx(session);
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  socks = malloc(sizeof(struct ssh_socks_struct));
+  if (socks == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  ZERO_STRUCTP(socks);
+  socks->session = session;
+  socks->listener = listener;
+
+  socks->poll = ssh_poll_new(listener, POLLIN, socks_listener_poll, socks);
+  if (socks->poll == NULL || ssh_poll_ctx_add(ctx, socks->poll) < 0 ||
+      channel_fd_conns_init(&socks->conns, session) < 0) {
+    ssh_set_error_oom(session);
+    if (socks->poll != NULL) {
+      ssh_poll_free(socks->poll);
+    }
+    SAFE_FREE(socks);
+    return NULL;
+  }
+  ssh_poll_set_owner(socks->poll, &session->polls);
+  socks->conns.conn_free = socks_free_conn;
+  ssh_sock_set_nonblocking(listener);
+
+  socks->next = session->socks;
+  session->socks = socks;
+
+  return socks;
+}
+
+/**
+ * @brief Get the connections of a SOCKS proxy.
+ *
+ * @param[in]  socks    The proxy.
+ *
+ * @return              The connections negotiating or forwarded, -1 on
+ *                      error.
+ */
+int ssh_socks_get_count(ssh_socks socks) {
+  if (socks == NULL) {
+    return -1;
+  }
+  return socks->conns.count;
+}
+
+/**
+ * @brief Stop a SOCKS proxy.
+ *
+ * Its connections are closed and their channels freed. The listener is left
+ * open.
+ *
+ * @param[in]  socks    The proxy to free.
+ */
+void ssh_socks_free(ssh_socks socks) {
+  ssh_socks *prev;
+
+  if (socks == NULL) {
+    return;
+  }
+  for (prev = &socks->session->socks; *prev != NULL; prev = &(*prev)->next) {
+    if (*prev == socks) {
+      *prev = socks->next;
+      break;
+    }
+  }
+
+  channel_fd_conns_free(&socks->conns);
+  ssh_poll_free(socks->poll);
+  SAFE_FREE(socks);
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
@@ -30,6 +30,7 @@
 
 #include "libssh/priv.h"
 #include "libssh/string.h"
+#include "libssh/pool.h"
 
 /**
  * @defgroup libssh_string The SSH string functions
@@ -50,7 +51,23 @@
 struct ssh_string_struct *ssh_string_new(size_t size) {
   struct ssh_string_struct *str = NULL;
 
-  str = malloc(size + 4);
+  /*
+   * The small strings are allocated with the capacity of their size class,
+   * so that any of them can go to a pool when it's freed.
+   */
+  if (size <= SSH_POOL_STRING_SMALL_SIZE) {
+    str = ssh_pool_get(SSH_POOL_STRING_SMALL);
+    if (str == NULL) {
+      str = malloc(SSH_POOL_STRING_SMALL_SIZE + 4);
+    }
+  } else if (size <= SSH_POOL_STRING_LARGE_SIZE) {
+    str = ssh_pool_get(SSH_POOL_STRING_LARGE);
+    if (str == NULL) {
+      str = malloc(SSH_POOL_STRING_LARGE_SIZE + 4);
+    }
+  } else {
+    str = malloc(size + 4);
+  }
   if (str == NULL) {
     return NULL;
   }
@@ -100,11 +117,10 @@ struct ssh_string_struct *ssh_string_from_char(const char *what) {
 
   len = strlen(what);
 
-  ptr = malloc(4 + len);
+  ptr = ssh_string_new(len);
   if (ptr == NULL) {
     return NULL;
   }
-  ptr->size = htonl(len);
   memcpy(ptr->string, what, len);
 
   return ptr;
@@ -175,12 +191,10 @@ struct ssh_string_struct *ssh_string_copy(struct ssh_string_struct *s) {
   if(s == NULL || s->string == NULL) {
       return NULL;
   }
-  new = malloc(ntohl(s->size) + 4);
-
+  new = ssh_string_new(ntohl(s->size));
   if (new == NULL) {
     return NULL;
   }
-  new->size = s->size;
   memcpy(new->string, s->string, ntohl(s->size));
 
   return new;
@@ -219,6 +233,23 @@ void *ssh_string_data(struct ssh_string_struct *s) {
  * \param[in] s         The SSH string to delete.
  */
 void ssh_string_free(struct ssh_string_struct *s) {
+  size_t len;
+
+  if (s == NULL) {
+    return;
+  }
+
+  /* the size may have been lowered, the capacity is at least its class */
+  len = ntohl(s->size);
+  if (len <= SSH_POOL_STRING_SMALL_SIZE) {
+    if (ssh_pool_put(SSH_POOL_STRING_SMALL, s) == 0) {
+      return;
+    }
+  } else if (len <= SSH_POOL_STRING_LARGE_SIZE) {
+    if (ssh_pool_put(SSH_POOL_STRING_LARGE, s) == 0) {
+      return;
+    }
+  }
   SAFE_FREE(s);
 }
 
@@ -30,6 +30,15 @@
 #include "libssh/priv.h"
 #include "libssh/threads.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 static int threads_noop (void **lock){
 	(void)lock;
   return 0;
@@ -53,7 +62,118 @@ struct ssh_threads_callbacks_struct *ssh_threads_get_noop(){
 	return &ssh_threads_noop;
 }
 
-static struct ssh_threads_callbacks_struct *user_callbacks =&ssh_threads_noop;
+/*
+ * The native locks of the system, used unless the application sets its own
+ * callbacks. A lock is padded to a cache line, so that two locks taken by
+ * different threads don't share one.
+ */
+#define THREADS_CACHE_LINE 64
+
+#if defined(HAVE_PTHREAD) || defined(_WIN32)
+
+#ifdef HAVE_PTHREAD
+typedef pthread_mutex_t native_mutex_t;
+#else
+typedef CRITICAL_SECTION native_mutex_t;
+#endif
+
+union native_mutex {
+	native_mutex_t mutex;
+	char pad[(sizeof(native_mutex_t) + THREADS_CACHE_LINE - 1) /
+	    THREADS_CACHE_LINE * THREADS_CACHE_LINE];
+};
+
+static int native_mutex_setup(union native_mutex *m){
+#ifdef HAVE_PTHREAD
+	return pthread_mutex_init(&m->mutex, NULL);
+#else
+	InitializeCriticalSection(&m->mutex);
+	return 0;
+#endif
+}
+
+static int native_mutex_teardown(union native_mutex *m){
+#ifdef HAVE_PTHREAD
+	return pthread_mutex_destroy(&m->mutex);
+#else
+	DeleteCriticalSection(&m->mutex);
+	return 0;
+#endif
+}
+
+static int native_mutex_init(void **lock){
+	union native_mutex *m = malloc(sizeof(union native_mutex));
+	int err;
+
+	if (m == NULL)
+		return -1;
+	err = native_mutex_setup(m);
+	if (err != 0) {
+		free(m);
+		return err;
+	}
+	*lock = m;
+	return 0;
+}
+
+static int native_mutex_destroy(void **lock){
+	int err = native_mutex_teardown(*lock);
+
+	free(*lock);
+	*lock = NULL;
+	return err;
+}
+
+static int native_mutex_lock(void **lock){
+#ifdef HAVE_PTHREAD
+	return pthread_mutex_lock(&((union native_mutex *) *lock)->mutex);
+#else
+	EnterCriticalSection(&((union native_mutex *) *lock)->mutex);
+	return 0;
+#endif
+}
+
+static int native_mutex_unlock(void **lock){
+#ifdef HAVE_PTHREAD
+	return pthread_mutex_unlock(&((union native_mutex *) *lock)->mutex);
+#else
+	LeaveCriticalSection(&((union native_mutex *) *lock)->mutex);
+	return 0;
+#endif
+}
+
+static unsigned long native_thread_id(void){
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	return (unsigned long) pthread_self();
+#else
+	return (unsigned long) GetCurrentThreadId();
+#endif
+}
+
+static struct ssh_threads_callbacks_struct ssh_threads_native =
+{
+#ifdef HAVE_PTHREAD
+    "threads_pthread",
+#else
+    "threads_winlocks",
+#endif
+    native_mutex_init,
+    native_mutex_destroy,
+    native_mutex_lock,
+    native_mutex_unlock,
+    native_thread_id
+};
+
+#define THREADS_DEFAULT (&ssh_threads_native)
+#else
+#define THREADS_DEFAULT (&ssh_threads_noop)
+#endif /* HAVE_PTHREAD || _WIN32 */
+
+struct ssh_threads_callbacks_struct *ssh_threads_get_default(void){
+	return THREADS_DEFAULT;
+}
+
+static struct ssh_threads_callbacks_struct *user_callbacks = THREADS_DEFAULT;
 
 #ifdef HAVE_LIBGCRYPT
 
@@ -82,6 +202,31 @@ static int libgcrypt_thread_init(void){
 
 void **libcrypto_mutexes;
 
+#if defined(HAVE_PTHREAD) || defined(_WIN32)
+/* the libcrypto locks with the native callbacks, stored in one array */
+static union native_mutex *libcrypto_native;
+static void *libcrypto_native_mem;
+
+static void libcrypto_native_callback(int mode, int i, const char *file,
+    int line){
+	(void)file;
+	(void)line;
+#ifdef HAVE_PTHREAD
+	if(mode & CRYPTO_LOCK){
+		pthread_mutex_lock(&libcrypto_native[i].mutex);
+	} else {
+		pthread_mutex_unlock(&libcrypto_native[i].mutex);
+	}
+#else
+	if(mode & CRYPTO_LOCK){
+		EnterCriticalSection(&libcrypto_native[i].mutex);
+	} else {
+		LeaveCriticalSection(&libcrypto_native[i].mutex);
+	}
+#endif
+}
+#endif
+
 static void libcrypto_lock_callback(int mode, int i, const char *file, int line){
 	(void)file;
 	(void)line;
@@ -97,6 +242,23 @@ static int libcrypto_thread_init(void){
 	int i;
 	if(user_callbacks == &ssh_threads_noop)
 		return SSH_OK;
+#if defined(HAVE_PTHREAD) || defined(_WIN32)
+	if(user_callbacks == &ssh_threads_native){
+		libcrypto_native_mem=malloc(sizeof(union native_mutex) * n +
+		    THREADS_CACHE_LINE);
+		if (libcrypto_native_mem == NULL)
+			return SSH_ERROR;
+		libcrypto_native=(union native_mutex *)
+		    (((uintptr_t) libcrypto_native_mem + THREADS_CACHE_LINE - 1) &
+		     ~(uintptr_t) (THREADS_CACHE_LINE - 1));
+		for (i=0;i<n;++i){
+			native_mutex_setup(&libcrypto_native[i]);
+		}
+		CRYPTO_set_id_callback(native_thread_id);
+		CRYPTO_set_locking_callback(libcrypto_native_callback);
+		return SSH_OK;
+	}
+#endif
 	libcrypto_mutexes=malloc(sizeof(void *) * n);
 	if (libcrypto_mutexes == NULL)
 		return SSH_ERROR;
@@ -112,8 +274,19 @@ static int libcrypto_thread_init(void){
 static void libcrypto_thread_finalize(void){
 	int n=CRYPTO_num_locks();
 	int i;
+#if defined(HAVE_PTHREAD) || defined(_WIN32)
+	if (libcrypto_native!=NULL){
+		CRYPTO_set_locking_callback(NULL);
+		for (i=0;i<n;++i){
+			native_mutex_teardown(&libcrypto_native[i]);
+		}
+		SAFE_FREE(libcrypto_native_mem);
+		libcrypto_native=NULL;
+	}
+#endif
 	if (libcrypto_mutexes==NULL)
 		return;
+	CRYPTO_set_locking_callback(NULL);
 	for (i=0;i<n;++i){
 			user_callbacks->mutex_destroy(&libcrypto_mutexes[i]);
 	}
@@ -127,8 +300,9 @@ static void libcrypto_thread_finalize(void){
  * @brief inits the threading with the backend cryptographic libraries
  */
 
+static int threads_initialized=0;
+
 int ssh_threads_init(void){
-	static int threads_initialized=0;
 	int ret;
 	if(threads_initialized)
 		return SSH_OK;
@@ -136,7 +310,7 @@ int ssh_threads_init(void){
 	 * already the case
 	 */
 	if(user_callbacks == NULL){
-		user_callbacks=&ssh_threads_noop;
+		user_callbacks=THREADS_DEFAULT;
 	}
 
 	/* Then initialize the crypto libraries threading callbacks */
@@ -155,9 +329,13 @@ void ssh_threads_finalize(void){
 #else
 	libcrypto_thread_finalize();
 #endif
+	threads_initialized=0;
 }
 
 int ssh_threads_set_callbacks(struct ssh_threads_callbacks_struct *cb){
+  /* the locks already created belong to the current callbacks */
+  if(ssh_atomic_load_int(&threads_initialized) && cb != user_callbacks)
+    return SSH_ERROR;
   user_callbacks=cb;
   return SSH_OK;
 }
@@ -168,6 +346,197 @@ const char *ssh_threads_get_type(){
 	return NULL;
 }
 
+/** @internal
+ * @brief mutex functions of the user callbacks, for libssh's own locks
+ */
+int ssh_threads_mutex_init(void **lock){
+	return user_callbacks->mutex_init(lock);
+}
+
+int ssh_threads_mutex_destroy(void **lock){
+	return user_callbacks->mutex_destroy(lock);
+}
+
+int ssh_threads_mutex_lock(void **lock){
+	return user_callbacks->mutex_lock(lock);
+}
+
+int ssh_threads_mutex_unlock(void **lock){
+	return user_callbacks->mutex_unlock(lock);
+}
+
+/*
+ * Atomic operations, for the global state read by all the sessions. They
+ * don't depend on the threading callbacks, so they work before ssh_init().
+ * Without the builtins of gcc/clang or the Interlocked functions of
+ * Windows, they are plain operations and libssh is not thread safe.
+ */
+#if defined(__GNUC__)
+
+int ssh_atomic_load_int(int *ptr){
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+void ssh_atomic_store_int(int *ptr, int value){
+	__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+int ssh_atomic_cas_int(int *ptr, int expected, int desired){
+	return __atomic_compare_exchange_n(ptr, &expected, desired, 0,
+	    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void ssh_atomic_add_u32(uint32_t *ptr, uint32_t value){
+	__atomic_fetch_add(ptr, value, __ATOMIC_RELAXED);
+}
+
+void ssh_atomic_add_u64(uint64_t *ptr, uint64_t value){
+	__atomic_fetch_add(ptr, value, __ATOMIC_RELAXED);
+}
+
+uint64_t ssh_atomic_load_u64(uint64_t *ptr){
+	return __atomic_load_n(ptr, __ATOMIC_RELAXED);
+}
+
+void ssh_atomic_max_u64(uint64_t *ptr, uint64_t value){
+	uint64_t old = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+
+	while (value > old &&
+	    !__atomic_compare_exchange_n(ptr, &old, value, 1,
+	      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+#elif defined(_WIN32)
+
+int ssh_atomic_load_int(int *ptr){
+	return InterlockedCompareExchange((volatile LONG *) ptr, 0, 0);
+}
+
+void ssh_atomic_store_int(int *ptr, int value){
+	InterlockedExchange((volatile LONG *) ptr, value);
+}
+
+int ssh_atomic_cas_int(int *ptr, int expected, int desired){
+	return InterlockedCompareExchange((volatile LONG *) ptr, desired,
+	    expected) == expected;
+}
+
+void ssh_atomic_add_u32(uint32_t *ptr, uint32_t value){
+	InterlockedExchangeAdd((volatile LONG *) ptr, (LONG) value);
+}
+
+void ssh_atomic_add_u64(uint64_t *ptr, uint64_t value){
+	InterlockedExchangeAdd64((volatile LONGLONG *) ptr, (LONGLONG) value);
+}
+
+uint64_t ssh_atomic_load_u64(uint64_t *ptr){
+	return InterlockedCompareExchange64((volatile LONGLONG *) ptr, 0, 0);
+}
+
+void ssh_atomic_max_u64(uint64_t *ptr, uint64_t value){
+	uint64_t old = ssh_atomic_load_u64(ptr);
+
+	while (value > old) {
+		uint64_t seen = InterlockedCompareExchange64((volatile LONGLONG *) ptr,
+		    value, old);
+		if (seen == old)
+			break;
+		old = seen;
+	}
+}
+
+#else
+
+int ssh_atomic_load_int(int *ptr){
+	return *ptr;
+}
+
+void ssh_atomic_store_int(int *ptr, int value){
+	*ptr = value;
+}
+
+int ssh_atomic_cas_int(int *ptr, int expected, int desired){
+	if (*ptr != expected)
+		return 0;
+	*ptr = desired;
+	return 1;
+}
+
+void ssh_atomic_add_u32(uint32_t *ptr, uint32_t value){
+	*ptr += value;
+}
+
+void ssh_atomic_add_u64(uint64_t *ptr, uint64_t value){
+	*ptr += value;
+}
+
+uint64_t ssh_atomic_load_u64(uint64_t *ptr){
+	return *ptr;
+}
+
+void ssh_atomic_max_u64(uint64_t *ptr, uint64_t value){
+	if (value > *ptr)
+		*ptr = value;
+}
+
+#endif
+
+/** @internal
+ * @brief gives the processor to another thread while waiting for it
+ */
+void ssh_threads_yield(void){
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+/** @internal
+ * @brief takes a spin lock, for the rare global changes which can't wait
+ * for the threading callbacks: the initialization and the teardown.
+ */
+void ssh_threads_spin_lock(int *lock){
+	while (!ssh_atomic_cas_int(lock, 0, 1)) {
+		ssh_threads_yield();
+	}
+}
+
+void ssh_threads_spin_unlock(int *lock){
+	ssh_atomic_store_int(lock, 0);
+}
+
+static int threads_once_lock = 0;
+
+/** @internal
+ * @brief creates a lock of the global state on its first use
+ *
+ * Several threads may race for it, only one creates the lock. Once the lock
+ * exists, it costs an atomic read.
+ *
+ * @param[in]  lock         The lock to create.
+ * @param[in]  initialized  Set to 1 once the lock is created.
+ * @return SSH_OK on success, SSH_ERROR if the lock can't be created.
+ */
+int ssh_threads_mutex_once(void **lock, int *initialized){
+	int rc = SSH_OK;
+
+	if (ssh_atomic_load_int(initialized))
+		return SSH_OK;
+
+	ssh_threads_spin_lock(&threads_once_lock);
+	if (!*initialized) {
+		if (ssh_threads_mutex_init(lock) < 0) {
+			rc = SSH_ERROR;
+		} else {
+			ssh_atomic_store_int(initialized, 1);
+		}
+	}
+	ssh_threads_spin_unlock(&threads_once_lock);
+
+	return rc;
+}
+
 /**
  * @}
  */
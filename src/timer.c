@@ -0,0 +1,685 @@
+/*
+ * timer.c - timers of the poll contexts
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+
+#include "libssh/priv.h"
+#include "libssh/misc.h"
+#include "libssh/session.h"
+#include "libssh/socket.h"
+#include "libssh/timer.h"
+
+/**
+ * @addtogroup libssh_poll
+ *
+ * @{
+ */
+
+/*
+ * The wheel has SSH_TIMER_LEVELS levels of SSH_TIMER_SLOTS slots. A slot of
+ * level l holds the timers expiring in a range of 64^l ms, so level 0 has the
+ * timers of the current 64 ms, level 1 the ones of the current 4 s, etc. The
+ * ones further away than ~4.6 hours wait in the overflow list.
+ *
+ * When the time reaches the range of a slot of level l > 0, its timers are
+ * spread over the lower levels (cascading). The bitmaps of the used slots
+ * let the wheel jump to the next slot to process, instead of ticking every
+ * millisecond.
+ */
+#define SSH_TIMER_BITS 6
+#define SSH_TIMER_SLOTS (1 << SSH_TIMER_BITS)
+#define SSH_TIMER_LEVELS 4
+
+/* pseudo levels of the timers which aren't in a slot */
+#define SSH_TIMER_OVERFLOW SSH_TIMER_LEVELS
+#define SSH_TIMER_EXPIRED (-1)
+
+struct ssh_timer_struct {
+  /* the wheel holding the timer while it's pending */
+  struct ssh_timer_wheel *wheel;
+  struct ssh_timer_struct *next;
+  struct ssh_timer_struct *prev;
+  uint64_t expire;
+  int level;
+  int slot;
+
+  /* it runs in the poll context of an event, or in the one of a session */
+  ssh_poll_ctx ctx;
+  ssh_session session;
+  ssh_channel channel;
+
+  /* the list of timers of the event or session */
+  struct ssh_timer_struct **owner;
+  struct ssh_timer_struct *owner_next;
+  struct ssh_timer_struct *owner_prev;
+
+  ssh_timer_callback cb;
+  void *userdata;
+};
+
+struct ssh_timer_wheel {
+  /* the first millisecond not processed yet */
+  uint64_t now;
+  uint64_t used[SSH_TIMER_LEVELS];
+  ssh_timer slots[SSH_TIMER_LEVELS][SSH_TIMER_SLOTS];
+  ssh_timer overflow;
+  /* the ones being run */
+  ssh_timer expired;
+  size_t count;
+};
+
+static int ssh_timer_first_bit(uint64_t mask) {
+#ifdef __GNUC__
+  return __builtin_ctzll(mask);
+#else
+  int i = 0;
+
+  while ((mask & 1) == 0) {
+    mask >>= 1;
+    i++;
+  }
+
+  return i;
+#endif
+}
+
+static ssh_timer *ssh_timer_head(struct ssh_timer_wheel *wheel, int level,
+    int slot) {
+  switch (level) {
+    case SSH_TIMER_EXPIRED:
+      return &wheel->expired;
+    case SSH_TIMER_OVERFLOW:
+      return &wheel->overflow;
+    default:
+      return &wheel->slots[level][slot];
+  }
+}
+
+static void ssh_timer_link(struct ssh_timer_wheel *wheel, ssh_timer timer,
+    int level, int slot) {
+  ssh_timer *head = ssh_timer_head(wheel, level, slot);
+
+  timer->level = level;
+  timer->slot = slot;
+  timer->prev = NULL;
+  timer->next = *head;
+  if (*head != NULL) {
+    (*head)->prev = timer;
+  }
+  *head = timer;
+  if (level >= 0 && level < SSH_TIMER_LEVELS) {
+    wheel->used[level] |= (uint64_t) 1 << slot;
+  }
+  timer->wheel = wheel;
+}
+
+static void ssh_timer_unlink(ssh_timer timer) {
+  struct ssh_timer_wheel *wheel = timer->wheel;
+  ssh_timer *head = ssh_timer_head(wheel, timer->level, timer->slot);
+
+  if (timer->prev != NULL) {
+    timer->prev->next = timer->next;
+  } else {
+    *head = timer->next;
+  }
+  if (timer->next != NULL) {
+    timer->next->prev = timer->prev;
+  }
+  if (*head == NULL && timer->level >= 0 && timer->level < SSH_TIMER_LEVELS) {
+    wheel->used[timer->level] &= ~((uint64_t) 1 << timer->slot);
+  }
+  timer->next = timer->prev = NULL;
+  timer->wheel = NULL;
+}
+
+/* put a timer in the slot of its expiry, relative to the current time */
+static void ssh_timer_place(struct ssh_timer_wheel *wheel, ssh_timer timer) {
+  uint64_t expire = timer->expire < wheel->now ? wheel->now : timer->expire;
+  int level;
+
+  for (level = 0; level < SSH_TIMER_LEVELS; level++) {
+    int shift = SSH_TIMER_BITS * (level + 1);
+
+    if ((expire >> shift) == (wheel->now >> shift)) {
+      ssh_timer_link(wheel, timer, level,
+          (int) (expire >> (SSH_TIMER_BITS * level)) & (SSH_TIMER_SLOTS - 1));
+      return;
+    }
+  }
+
+  ssh_timer_link(wheel, timer, SSH_TIMER_OVERFLOW, 0);
+}
+
+/*
+ * Find the next millisecond where something has to be done: the expiry of
+ * the timers of a level 0 slot, or the cascading of a slot of a higher level
+ * or of the overflow list. Higher levels come first for the same time.
+ *
+ * Returns the level, -1 if the wheel is empty.
+ */
+static int ssh_timer_wheel_next(struct ssh_timer_wheel *wheel,
+    uint64_t *tick) {
+  uint64_t best = 0;
+  uint64_t mask;
+  uint64_t t;
+  int found = -1;
+  int level;
+
+  if (wheel->overflow != NULL) {
+    int shift = SSH_TIMER_BITS * SSH_TIMER_LEVELS;
+
+    best = ((wheel->now >> shift) + 1) << shift;
+    found = SSH_TIMER_OVERFLOW;
+  }
+
+  for (level = SSH_TIMER_LEVELS - 1; level >= 0; level--) {
+    int shift = SSH_TIMER_BITS * level;
+    int current = (int) (wheel->now >> shift) & (SSH_TIMER_SLOTS - 1);
+
+    mask = wheel->used[level] & (~(uint64_t) 0 << current);
+    if (mask == 0) {
+      continue;
+    }
+    t = (wheel->now >> (shift + SSH_TIMER_BITS)) << (shift + SSH_TIMER_BITS);
+    t += (uint64_t) ssh_timer_first_bit(mask) << shift;
+    if (found < 0 || t < best) {
+      best = t;
+      found = level;
+    }
+  }
+
+  *tick = best;
+  return found;
+}
+
+static void ssh_timer_cascade(struct ssh_timer_wheel *wheel, int level,
+    int slot) {
+  ssh_timer timer;
+  ssh_timer next;
+
+  timer = *ssh_timer_head(wheel, level, slot);
+  for (; timer != NULL; timer = next) {
+    next = timer->next;
+    ssh_timer_unlink(timer);
+    ssh_timer_place(wheel, timer);
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Create the timer wheel of a poll context.
+ *
+ * @return              The new timer wheel, NULL on error.
+ */
+struct ssh_timer_wheel *ssh_timer_wheel_new(void) {
+  struct ssh_timer_wheel *wheel;
+
+  wheel = malloc(sizeof(struct ssh_timer_wheel));
+  if (wheel == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(wheel);
+  wheel->now = ssh_timestamp_ms();
+
+  return wheel;
+}
+
+/**
+ * @internal
+ *
+ * @brief Free a timer wheel. The pending timers are cancelled, they stay
+ *        valid.
+ *
+ * @param[in]  wheel    The wheel to free.
+ */
+void ssh_timer_wheel_free(struct ssh_timer_wheel *wheel) {
+  int level, slot;
+
+  if (wheel == NULL) {
+    return;
+  }
+
+  for (level = 0; level < SSH_TIMER_LEVELS; level++) {
+    for (slot = 0; slot < SSH_TIMER_SLOTS; slot++) {
+      while (wheel->slots[level][slot] != NULL) {
+        ssh_timer_unlink(wheel->slots[level][slot]);
+      }
+    }
+  }
+  while (wheel->overflow != NULL) {
+    ssh_timer_unlink(wheel->overflow);
+  }
+  while (wheel->expired != NULL) {
+    ssh_timer_unlink(wheel->expired);
+  }
+
+  SAFE_FREE(wheel);
+}
+
+/**
+ * @internal
+ *
+ * @brief Check if a timer wheel has pending timers.
+ */
+int ssh_timer_wheel_pending(struct ssh_timer_wheel *wheel) {
+  return wheel != NULL && wheel->count > 0;
+}
+
+/**
+ * @internal
+ *
+ * @brief Shorten a poll timeout so it ends at the next expiry.
+ *
+ * @param[in]  wheel    The timer wheel.
+ *
+ * @param[in]  timeout  The timeout in milliseconds, < 0 for an infinite one.
+ *
+ * @return              The timeout to wait.
+ */
+int ssh_timer_wheel_timeout(struct ssh_timer_wheel *wheel, int timeout) {
+  uint64_t expire = 0;
+  uint64_t now;
+  uint64_t tick;
+  ssh_timer timer;
+  int level;
+
+  if (wheel == NULL || wheel->count == 0) {
+    return timeout;
+  }
+  if (wheel->expired != NULL) {
+    return 0;
+  }
+
+  /* the earliest timer is in the first slot to process */
+  level = ssh_timer_wheel_next(wheel, &tick);
+  if (level < 0) {
+    return timeout;
+  }
+  if (level == 0) {
+    expire = tick;
+  } else {
+    timer = *ssh_timer_head(wheel, level,
+        (int) (tick >> (SSH_TIMER_BITS * level)) & (SSH_TIMER_SLOTS - 1));
+    expire = timer->expire;
+    for (; timer != NULL; timer = timer->next) {
+      if (timer->expire < expire) {
+        expire = timer->expire;
+      }
+    }
+  }
+
+  now = ssh_timestamp_ms();
+  if (expire <= now) {
+    return 0;
+  }
+  if (expire - now < (uint64_t) INT_MAX &&
+      (timeout < 0 || (int) (expire - now) < timeout)) {
+    return (int) (expire - now);
+  }
+
+  return timeout < 0 ? INT_MAX : timeout;
+}
+
+/**
+ * @internal
+ *
+ * @brief Run the callbacks of the expired timers.
+ *
+ * @param[in]  wheel    The timer wheel.
+ */
+void ssh_timer_wheel_run(struct ssh_timer_wheel *wheel) {
+  uint64_t target;
+  uint64_t tick;
+  ssh_timer timer;
+  int level;
+  int slot;
+
+  if (wheel == NULL) {
+    return;
+  }
+
+  target = ssh_timestamp_ms();
+  while (wheel->count > 0) {
+    level = ssh_timer_wheel_next(wheel, &tick);
+    if (level < 0 || tick > target) {
+      break;
+    }
+    slot = (int) (tick >> (SSH_TIMER_BITS * (level % SSH_TIMER_LEVELS))) &
+      (SSH_TIMER_SLOTS - 1);
+    wheel->now = tick;
+
+    if (level > 0) {
+      ssh_timer_cascade(wheel, level, level == SSH_TIMER_OVERFLOW ? 0 : slot);
+      continue;
+    }
+
+    /*
+     * The callbacks may schedule, cancel or free any timer. The timers of the
+     * slot are moved aside first, new ones go to the next millisecond.
+     */
+    wheel->now = tick + 1;
+    while (wheel->slots[0][slot] != NULL) {
+      timer = wheel->slots[0][slot];
+      ssh_timer_unlink(timer);
+      ssh_timer_link(wheel, timer, SSH_TIMER_EXPIRED, 0);
+    }
+    while (wheel->expired != NULL) {
+      timer = wheel->expired;
+      ssh_timer_unlink(timer);
+      wheel->count--;
+      if (timer->cb != NULL) {
+        timer->cb(timer, timer->userdata);
+      }
+    }
+  }
+
+  if (wheel->now <= target) {
+    wheel->now = target + 1;
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Allocate a timer, which isn't scheduled.
+ *
+ * @param[in]  owner    The list of timers of the event or session.
+ *
+ * @param[in]  ctx      The poll context it runs in, NULL for the one of the
+ *                      session.
+ *
+ * @param[in]  session  The session when ctx is NULL.
+ *
+ * @param[in]  channel  The channel it belongs to, or NULL.
+ *
+ * @param[in]  cb       The function to call on expiry.
+ *
+ * @param[in]  userdata Userdata to be passed to the callback function.
+ *
+ * @return              The timer, NULL on error.
+ */
+ssh_timer ssh_timer_new(ssh_timer *owner, ssh_poll_ctx ctx,
+    ssh_session session, ssh_channel channel, ssh_timer_callback cb,
+    void *userdata) {
+  ssh_timer timer;
+
+  timer = malloc(sizeof(struct ssh_timer_struct));
+  if (timer == NULL) {
+    return NULL;
+  }
+  ZERO_STRUCTP(timer);
+
+  timer->ctx = ctx;
+  timer->session = session;
+  timer->channel = channel;
+  timer->cb = cb;
+  timer->userdata = userdata;
+
+  timer->owner = owner;
+  timer->owner_next = *owner;
+  if (*owner != NULL) {
+    (*owner)->owner_prev = timer;
+  }
+  *owner = timer;
+
+  return timer;
+}
+
+static void ssh_timer_schedule(struct ssh_timer_wheel *wheel,
+    ssh_timer timer) {
+  ssh_timer_place(wheel, timer);
+  wheel->count++;
+}
+
+/**
+ * @brief Cancel a timer. It isn't freed and can be scheduled again.
+ *
+ * @param[in]  timer    The timer to cancel.
+ */
+void ssh_timer_cancel(ssh_timer timer) {
+  if (timer == NULL || timer->wheel == NULL) {
+    return;
+  }
+  timer->wheel->count--;
+  ssh_timer_unlink(timer);
+}
+
+/**
+ * @brief Check if a timer is scheduled.
+ *
+ * @param[in]  timer    The timer to check.
+ *
+ * @return              1 if it is scheduled, 0 if it expired or was
+ *                      cancelled.
+ */
+int ssh_timer_is_pending(ssh_timer timer) {
+  return timer != NULL && timer->wheel != NULL;
+}
+
+/**
+ * @brief Schedule a timer again, whether it is pending or not. The timers
+ *        run once: the callback calls this to make it periodic.
+ *
+ * @param[in]  timer    The timer to schedule.
+ *
+ * @param[in]  timeout  The time until the expiry, in milliseconds.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_timer_reset(ssh_timer timer, unsigned int timeout) {
+  struct ssh_timer_wheel *wheel;
+  ssh_poll_ctx ctx;
+
+  if (timer == NULL) {
+    return SSH_ERROR;
+  }
+
+  ctx = timer->ctx;
+  if (ctx == NULL) {
+    /* the session may have moved to an event */
+    ctx = ssh_socket_get_poll_ctx(timer->session->socket);
+    if (ctx == NULL) {
+      ctx = ssh_poll_get_default_ctx(timer->session);
+    }
+  }
+  wheel = ctx != NULL ? ssh_poll_ctx_get_timers(ctx) : NULL;
+  if (wheel == NULL) {
+    return SSH_ERROR;
+  }
+
+  ssh_timer_cancel(timer);
+  timer->expire = ssh_timestamp_ms() + timeout;
+  ssh_timer_schedule(wheel, timer);
+
+  return SSH_OK;
+}
+
+/**
+ * @brief Cancel and free a timer.
+ *
+ * @param[in]  timer    The timer to free.
+ */
+void ssh_timer_free(ssh_timer timer) {
+  if (timer == NULL) {
+    return;
+  }
+
+  ssh_timer_cancel(timer);
+  if (timer->owner_prev != NULL) {
+    timer->owner_prev->owner_next = timer->owner_next;
+  } else {
+    *timer->owner = timer->owner_next;
+  }
+  if (timer->owner_next != NULL) {
+    timer->owner_next->owner_prev = timer->owner_prev;
+  }
+
+  SAFE_FREE(timer);
+}
+
+/**
+ * @internal
+ *
+ * @brief Move the pending timers of a session to the poll context it now
+ *        runs in.
+ *
+ * @param[in]  timers   The timers of the session.
+ *
+ * @param[in]  ctx      The new poll context.
+ */
+void ssh_timers_move(ssh_timer timers, ssh_poll_ctx ctx) {
+  struct ssh_timer_wheel *wheel = NULL;
+  ssh_timer timer;
+
+  for (timer = timers; timer != NULL; timer = timer->owner_next) {
+    if (timer->wheel == NULL) {
+      continue;
+    }
+    if (wheel == NULL) {
+      wheel = ssh_poll_ctx_get_timers(ctx);
+      if (wheel == NULL) {
+        return;
+      }
+    }
+    if (timer->wheel != wheel) {
+      ssh_timer_cancel(timer);
+      ssh_timer_schedule(wheel, timer);
+    }
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Free all the timers of an event or session.
+ *
+ * @param[in]  timers   The head of the list of timers.
+ */
+void ssh_timers_free(ssh_timer *timers) {
+  while (*timers != NULL) {
+    ssh_timer_free(*timers);
+  }
+}
+
+/**
+ * @internal
+ *
+ * @brief Free the timers of a channel.
+ *
+ * @param[in]  timers   The head of the list of timers of the session.
+ *
+ * @param[in]  channel  The channel.
+ */
+void ssh_timers_free_channel(ssh_timer *timers, ssh_channel channel) {
+  ssh_timer timer;
+  ssh_timer next;
+
+  for (timer = *timers; timer != NULL; timer = next) {
+    next = timer->owner_next;
+    if (timer->channel == channel) {
+      ssh_timer_free(timer);
+    }
+  }
+}
+
+/**
+ * @brief Create a timer running with a session, wherever it is polled: in
+ *        the blocking functions or in the event it was added to.
+ *
+ * It is freed with the session.
+ *
+ * @param[in]  session  The session.
+ *
+ * @param[in]  timeout  The time until the expiry, in milliseconds.
+ *
+ * @param[in]  cb       The function to call on expiry.
+ *
+ * @param[in]  userdata Userdata to be passed to the callback function.
+ *
+ * @return              The scheduled timer, NULL on error.
+ */
+ssh_timer ssh_session_add_timer(ssh_session session, unsigned int timeout,
+    ssh_timer_callback cb, void *userdata) {
+  ssh_timer timer;
+
+  if (session == NULL || cb == NULL) {
+    return NULL;
+  }
+
+  timer = ssh_timer_new(&session->timers, NULL, session, NULL, cb, userdata);
+  if (timer == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  if (ssh_timer_reset(timer, timeout) < 0) {
+    ssh_set_error_oom(session);
+    ssh_timer_free(timer);
+    return NULL;
+  }
+
+  return timer;
+}
+
+/**
+ * @brief Create a timer running with the session of a channel.
+ *
+ * It is freed with the channel.
+ *
+ * @param[in]  channel  The channel.
+ *
+ * @param[in]  timeout  The time until the expiry, in milliseconds.
+ *
+ * @param[in]  cb       The function to call on expiry.
+ *
+ * @param[in]  userdata Userdata to be passed to the callback function.
+ *
+ * @return              The scheduled timer, NULL on error.
+ */
+ssh_timer ssh_channel_add_timer(ssh_channel channel, unsigned int timeout,
+    ssh_timer_callback cb, void *userdata) {
+  ssh_session session;
+  ssh_timer timer;
+
+  if (channel == NULL || cb == NULL) {
+    return NULL;
+  }
+  session = channel->session;
+
+  timer = ssh_timer_new(&session->timers, NULL, session, channel, cb,
+      userdata);
+  if (timer == NULL) {
+    ssh_set_error_oom(session);
+    return NULL;
+  }
+  if (ssh_timer_reset(timer, timeout) < 0) {
+    ssh_set_error_oom(session);
+    ssh_timer_free(timer);
+    return NULL;
+  }
+
+  return timer;
+}
+
+/** @} */
+
+/* vim: set ts=2 sw=2 et cindent: */
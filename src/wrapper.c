@@ -43,6 +43,41 @@
 #include "libssh/crypto.h"
 #include "libssh/wrapper.h"
 
+/*
+ * The table of supported MACs
+ *
+ * The -etm@openssh.com variants compute the MAC over the encrypted packet,
+ * with the packet length left in clear.
+ */
+static struct ssh_hmac_struct ssh_hmactab[] = {
+  { "hmac-sha1",                     HMAC_SHA1,   SHA_DIGEST_LEN,    0 },
+  { "hmac-sha2-256",                 HMAC_SHA256, SHA256_DIGEST_LEN, 0 },
+  { "hmac-sha2-512",                 HMAC_SHA512, SHA512_DIGEST_LEN, 0 },
+  { "hmac-sha1-etm@openssh.com",     HMAC_SHA1,   SHA_DIGEST_LEN,    1 },
+  { "hmac-sha2-256-etm@openssh.com", HMAC_SHA256, SHA256_DIGEST_LEN, 1 },
+  { "hmac-sha2-512-etm@openssh.com", HMAC_SHA512, SHA512_DIGEST_LEN, 1 },
+  { NULL,                            0,           0,                 0 }
+};
+
+struct ssh_hmac_struct *ssh_get_hmactab(void) {
+  return ssh_hmactab;
+}
+
+static struct ssh_hmac_struct *hmac_find(const char *name) {
+  int i;
+
+  if (name == NULL) {
+    return NULL;
+  }
+  for (i = 0; ssh_hmactab[i].name != NULL; i++) {
+    if (strcmp(name, ssh_hmactab[i].name) == 0) {
+      return &ssh_hmactab[i];
+    }
+  }
+
+  return NULL;
+}
+
 /* it allocates a new cipher structure based on its offset into the global table */
 static struct crypto_struct *cipher_new(int offset) {
   struct crypto_struct *cipher = NULL;
@@ -58,7 +93,7 @@ static struct crypto_struct *cipher_new(int offset) {
   return cipher;
 }
 
-static void cipher_free(struct crypto_struct *cipher) {
+void cipher_free(struct crypto_struct *cipher) {
 #ifdef HAVE_LIBGCRYPT
   unsigned int i;
 #endif
@@ -67,7 +102,9 @@ static void cipher_free(struct crypto_struct *cipher) {
     return;
   }
 
-  if(cipher->key) {
+  if (cipher->cleanup != NULL) {
+    cipher->cleanup(cipher);
+  } else if (cipher->key) {
 #ifdef HAVE_LIBGCRYPT
     for (i = 0; i < (cipher->keylen / sizeof(gcry_cipher_hd_t)); i++) {
       gcry_cipher_close(cipher->key[i]);
@@ -81,6 +118,30 @@ static void cipher_free(struct crypto_struct *cipher) {
   SAFE_FREE(cipher);
 }
 
+/** @internal
+ * @brief copies an AEAD cipher whose key is set, for another thread
+ * @returns the copy, NULL if the cipher can't be copied (yet)
+ */
+struct crypto_struct *cipher_copy(struct crypto_struct *cipher) {
+  struct crypto_struct *copy;
+
+  if (cipher == NULL || cipher->aead_copy == NULL) {
+    return NULL;
+  }
+  copy = malloc(sizeof(struct crypto_struct));
+  if (copy == NULL) {
+    return NULL;
+  }
+  memcpy(copy, cipher, sizeof(*copy));
+  copy->key = NULL;
+  if (cipher->aead_copy(cipher, copy) < 0) {
+    SAFE_FREE(copy);
+    return NULL;
+  }
+
+  return copy;
+}
+
 struct ssh_crypto_struct *crypto_new(void) {
 	struct ssh_crypto_struct *crypto;
 
@@ -89,24 +150,65 @@ struct ssh_crypto_struct *crypto_new(void) {
     return NULL;
   }
   ZERO_STRUCTP(crypto);
+  crypto->kex_type = SSH_KEX_DH_GROUP1_SHA1;
+  crypto->digest_len = SHA_DIGEST_LEN;
   return crypto;
 }
 
+/**
+ * @internal
+ *
+ * @brief Free the values of the key exchange of a crypto structure.
+ *
+ * They are only needed until the session keys are derived. A session
+ * keeps its current crypto as long as it lives, so they are freed when it
+ * takes the new keys instead of with it.
+ *
+ * @param[in]  crypto   The crypto structure, its keys already derived.
+ */
+void crypto_free_kex(struct ssh_crypto_struct *crypto) {
+  bignum_free(crypto->e);
+  bignum_free(crypto->f);
+  bignum_free(crypto->x);
+  bignum_free(crypto->y);
+  bignum_free(crypto->k);
+  crypto->e = crypto->f = crypto->x = crypto->y = crypto->k = NULL;
+  ssh_string_free(crypto->ecdh_client_pubkey);
+  ssh_string_free(crypto->ecdh_server_pubkey);
+  crypto->ecdh_client_pubkey = crypto->ecdh_server_pubkey = NULL;
+#ifdef HAVE_ECDH
+  if (crypto->ecdh_privkey != NULL) {
+    EC_KEY_free(crypto->ecdh_privkey);
+    crypto->ecdh_privkey = NULL;
+  }
+#endif
+  memset(crypto->curve25519_privkey, 0, sizeof(crypto->curve25519_privkey));
+}
+
 void crypto_free(struct ssh_crypto_struct *crypto){
+  int i;
+
   if (crypto == NULL) {
     return;
   }
 
   SAFE_FREE(crypto->server_pubkey);
+  crypto_free_kex(crypto);
 
   cipher_free(crypto->in_cipher);
   cipher_free(crypto->out_cipher);
+  for (i = 0; i < CRYPTO_COPIES; i++) {
+    cipher_free(crypto->in_copies[i]);
+    cipher_free(crypto->out_copies[i]);
+  }
+
+  hmac_free(crypto->in_hmac);
+  hmac_free(crypto->out_hmac);
+
+#if defined(HAVE_LIBZ) && defined(WITH_LIBZ)
+  compress_free(crypto);
+#endif
 
-  bignum_free(crypto->e);
-  bignum_free(crypto->f);
-  bignum_free(crypto->x);
-  bignum_free(crypto->y);
-  bignum_free(crypto->k);
   /* lot of other things */
   /* i'm lost in my own code. good work */
   memset(crypto,0,sizeof(*crypto));
@@ -114,6 +216,79 @@ void crypto_free(struct ssh_crypto_struct *crypto){
   SAFE_FREE(crypto);
 }
 
+/**
+ * @internal
+ *
+ * @brief Set up the key schedules of the ciphers of a crypto structure.
+ *
+ * This is done once, when the keys have been derived and before the
+ * structure becomes the current crypto of a session, so the packet layer
+ * only has to run the cipher functions. The HMAC contexts are keyed here
+ * too and only get reset for every packet. AEAD ciphers don't use them.
+ *
+ * @param[in]  crypto   The crypto structure with ciphers, keys and IVs set.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+int crypt_set_keys(struct ssh_crypto_struct *crypto) {
+  if (crypto->in_cipher == NULL || crypto->out_cipher == NULL) {
+    return SSH_ERROR;
+  }
+  if (crypto->out_cipher->tag_size > 0) {
+    if (crypto->out_cipher->aead_set_key(crypto->out_cipher,
+          crypto->encryptkey, crypto->encryptIV) < 0) {
+      return SSH_ERROR;
+    }
+  } else {
+#ifdef HAVE_LIBGCRYPT
+    if (crypto->out_cipher->set_encrypt_key(crypto->out_cipher,
+          crypto->encryptkey, crypto->encryptIV) < 0) {
+      return SSH_ERROR;
+    }
+#elif defined HAVE_LIBCRYPTO
+    if (crypto->out_cipher->set_encrypt_key(crypto->out_cipher,
+          crypto->encryptkey) < 0) {
+      return SSH_ERROR;
+    }
+#endif
+    if (crypto->out_mac != NULL) {
+      crypto->out_hmac = hmac_init(crypto->encryptMAC, crypto->out_mac->size,
+          crypto->out_mac->type);
+      if (crypto->out_hmac == NULL) {
+        return SSH_ERROR;
+      }
+    }
+  }
+
+  if (crypto->in_cipher->tag_size > 0) {
+    if (crypto->in_cipher->aead_set_key(crypto->in_cipher,
+          crypto->decryptkey, crypto->decryptIV) < 0) {
+      return SSH_ERROR;
+    }
+  } else {
+#ifdef HAVE_LIBGCRYPT
+    if (crypto->in_cipher->set_decrypt_key(crypto->in_cipher,
+          crypto->decryptkey, crypto->decryptIV) < 0) {
+      return SSH_ERROR;
+    }
+#elif defined HAVE_LIBCRYPTO
+    if (crypto->in_cipher->set_decrypt_key(crypto->in_cipher,
+          crypto->decryptkey) < 0) {
+      return SSH_ERROR;
+    }
+#endif
+    if (crypto->in_mac != NULL) {
+      crypto->in_hmac = hmac_init(crypto->decryptMAC, crypto->in_mac->size,
+          crypto->in_mac->type);
+      if (crypto->in_hmac == NULL) {
+        return SSH_ERROR;
+      }
+    }
+  }
+
+  return SSH_OK;
+}
+
 static int crypt_set_algorithms2(ssh_session session){
   const char *wanted;
   int i = 0;
@@ -131,7 +306,7 @@ static int crypt_set_algorithms2(ssh_session session){
         wanted);
     return SSH_ERROR;
   }
-  ssh_log(session, SSH_LOG_PACKET, "Set output algorithm to %s", wanted);
+  SSH_LOG(session, SSH_LOG_PACKET, "Set output algorithm to %s", wanted);
 
   session->next_crypto->out_cipher = cipher_new(i);
   if (session->next_crypto->out_cipher == NULL) {
@@ -152,7 +327,7 @@ static int crypt_set_algorithms2(ssh_session session){
         wanted);
     return SSH_ERROR;
   }
-  ssh_log(session, SSH_LOG_PACKET, "Set input algorithm to %s", wanted);
+  SSH_LOG(session, SSH_LOG_PACKET, "Set input algorithm to %s", wanted);
 
   session->next_crypto->in_cipher = cipher_new(i);
   if (session->next_crypto->in_cipher == NULL) {
@@ -160,6 +335,27 @@ static int crypt_set_algorithms2(ssh_session session){
     return SSH_ERROR;
   }
 
+  /* hmac */
+  wanted = session->client_kex.methods[SSH_MAC_C_S];
+  session->next_crypto->out_mac = hmac_find(wanted);
+  if (session->next_crypto->out_mac == NULL) {
+    ssh_set_error(session, SSH_FATAL,
+        "Crypt_set_algorithms2: no hmac algorithm function found for %s",
+        wanted);
+    return SSH_ERROR;
+  }
+  SSH_LOG(session, SSH_LOG_PACKET, "Set HMAC output algorithm to %s", wanted);
+
+  wanted = session->client_kex.methods[SSH_MAC_S_C];
+  session->next_crypto->in_mac = hmac_find(wanted);
+  if (session->next_crypto->in_mac == NULL) {
+    ssh_set_error(session, SSH_FATAL,
+        "Crypt_set_algorithms2: no hmac algorithm function found for %s",
+        wanted);
+    return SSH_ERROR;
+  }
+  SSH_LOG(session, SSH_LOG_PACKET, "Set HMAC input algorithm to %s", wanted);
+
   /* compression */
   if (strcmp(session->client_kex.methods[SSH_COMP_C_S], "zlib") == 0) {
     session->next_crypto->do_compress_out = 1;
@@ -221,12 +417,26 @@ int crypt_set_algorithms_server(ssh_session session){
 
     /* we must scan the kex entries to find crypto algorithms and set their appropriate structure */
     enter_function();
+    /* key exchange */
+    if (session->client_kex.methods == NULL) {
+        ssh_set_error(session, SSH_FATAL, "Client KEX empty");
+        leave_function();
+        return SSH_ERROR;
+    }
+    match = ssh_find_matching(session->server_kex.methods[SSH_KEX],
+        session->client_kex.methods[SSH_KEX]);
+    if (ssh_kex_set_type(session, match) < 0) {
+        SAFE_FREE(match);
+        leave_function();
+        return SSH_ERROR;
+    }
+    SAFE_FREE(match);
     /* out */
     server = session->server_kex.methods[SSH_CRYPT_S_C];
     if(session && session->client_kex.methods) {
         client = session->client_kex.methods[SSH_CRYPT_S_C];
     } else {
-        ssh_log(session,SSH_LOG_PROTOCOL, "Client KEX empty");
+        SSH_LOG(session,SSH_LOG_PROTOCOL, "Client KEX empty");
     }
     /* That's the client algorithms that are more important */
     match = ssh_find_matching(server,client);
@@ -246,7 +456,7 @@ int crypt_set_algorithms_server(ssh_session session){
         leave_function();
         return SSH_ERROR;
     }
-    ssh_log(session,SSH_LOG_PACKET,"Set output algorithm %s",match);
+    SSH_LOG(session,SSH_LOG_PACKET,"Set output algorithm %s",match);
     SAFE_FREE(match);
 
     session->next_crypto->out_cipher = cipher_new(i);
@@ -274,7 +484,7 @@ int crypt_set_algorithms_server(ssh_session session){
         leave_function();
         return SSH_ERROR;
     }
-    ssh_log(session,SSH_LOG_PACKET,"Set input algorithm %s",match);
+    SSH_LOG(session,SSH_LOG_PACKET,"Set input algorithm %s",match);
     SAFE_FREE(match);
 
     session->next_crypto->in_cipher = cipher_new(i);
@@ -284,22 +494,55 @@ int crypt_set_algorithms_server(ssh_session session){
       return SSH_ERROR;
     }
 
+    /* hmac */
+    client=session->client_kex.methods[SSH_MAC_S_C];
+    server=session->server_kex.methods[SSH_MAC_S_C];
+    match=ssh_find_matching(server,client);
+    session->next_crypto->out_mac = hmac_find(match);
+    if (session->next_crypto->out_mac == NULL) {
+        ssh_set_error(session,SSH_FATAL,"Crypt_set_algorithms_server : no hmac algorithm function found for %s",server);
+        SAFE_FREE(match);
+        leave_function();
+        return SSH_ERROR;
+    }
+    SSH_LOG(session,SSH_LOG_PACKET,"Set HMAC output algorithm %s",match);
+    SAFE_FREE(match);
+
+    client=session->client_kex.methods[SSH_MAC_C_S];
+    server=session->server_kex.methods[SSH_MAC_C_S];
+    match=ssh_find_matching(server,client);
+    session->next_crypto->in_mac = hmac_find(match);
+    if (session->next_crypto->in_mac == NULL) {
+        ssh_set_error(session,SSH_FATAL,"Crypt_set_algorithms_server : no hmac algorithm function found for %s",server);
+        SAFE_FREE(match);
+        leave_function();
+        return SSH_ERROR;
+    }
+    SSH_LOG(session,SSH_LOG_PACKET,"Set HMAC input algorithm %s",match);
+    SAFE_FREE(match);
+
     /* compression */
-    client=session->client_kex.methods[SSH_CRYPT_C_S];
-    server=session->server_kex.methods[SSH_CRYPT_C_S];
+    client=session->client_kex.methods[SSH_COMP_C_S];
+    server=session->server_kex.methods[SSH_COMP_C_S];
     match=ssh_find_matching(server,client);
     if(match && !strcmp(match,"zlib")){
-        ssh_log(session,SSH_LOG_PACKET,"enabling C->S compression");
+        SSH_LOG(session,SSH_LOG_PACKET,"enabling C->S compression");
         session->next_crypto->do_compress_in=1;
+    } else if(match && !strcmp(match,"zlib@openssh.com")){
+        SSH_LOG(session,SSH_LOG_PACKET,"enabling delayed C->S compression");
+        session->next_crypto->delayed_compress_in=1;
     }
     SAFE_FREE(match);
 
-    client=session->client_kex.methods[SSH_CRYPT_S_C];
-    server=session->server_kex.methods[SSH_CRYPT_S_C];
+    client=session->client_kex.methods[SSH_COMP_S_C];
+    server=session->server_kex.methods[SSH_COMP_S_C];
     match=ssh_find_matching(server,client);
     if(match && !strcmp(match,"zlib")){
-        ssh_log(session,SSH_LOG_PACKET,"enabling S->C compression\n");
+        SSH_LOG(session,SSH_LOG_PACKET,"enabling S->C compression");
         session->next_crypto->do_compress_out=1;
+    } else if(match && !strcmp(match,"zlib@openssh.com")){
+        SSH_LOG(session,SSH_LOG_PACKET,"enabling delayed S->C compression");
+        session->next_crypto->delayed_compress_out=1;
     }
     SAFE_FREE(match);
 
@@ -310,6 +553,10 @@ int crypt_set_algorithms_server(ssh_session session){
         session->hostkeys=SSH_KEYTYPE_DSS;
     else if(match && !strcmp(match,"ssh-rsa"))
         session->hostkeys=SSH_KEYTYPE_RSA;
+    else if(match && !strcmp(match,"ecdsa-sha2-nistp256"))
+        session->hostkeys=SSH_KEYTYPE_ECDSA;
+    else if(match && !strcmp(match,"ssh-ed25519"))
+        session->hostkeys=SSH_KEYTYPE_ED25519;
     else {
         ssh_set_error(session, SSH_FATAL, "Cannot know what %s is into %s",
             match ? match : NULL, server);
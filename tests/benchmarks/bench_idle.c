@@ -0,0 +1,152 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * The memory of idle sessions: many sessions each with a channel which did
+ * some work and now waits, as a server holds its mostly idle users. The
+ * heap they take is measured with the allocator of the C library, so it
+ * counts the sessions of the local server too when it runs in the process.
+ */
+
+#include "config.h"
+#include "benchmarks.h"
+#include <libssh/libssh.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/* the data each channel has exchanged before it goes idle */
+#define IDLE_DATA_SIZE 16384
+
+struct idle_session {
+  ssh_session session;
+  ssh_channel channel;
+};
+
+/* the bytes allocated on the heap, -1 when the C library can't tell */
+static long idle_heap_used(void){
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 info=mallinfo2();
+
+  return (long)(info.uordblks + info.hblkhd);
+#elif defined(__GLIBC__)
+  struct mallinfo info=mallinfo();
+
+  return (long)info.uordblks + info.hblkhd;
+#else
+  return -1;
+#endif
+}
+
+/* reads the line the command sends when it starts or ends */
+static int idle_read_line(ssh_channel channel){
+  char buffer[16];
+  int r;
+
+  do {
+    r=ssh_channel_read(channel,buffer,sizeof(buffer),0);
+  } while(r > 0 && buffer[r - 1] != '\n');
+  return r > 0 ? 0 : -1;
+}
+
+/* a session whose channel wrote and read a little, then waits */
+static int idle_open(struct argument_s *args, struct idle_session *idle){
+  static const char zeros[IDLE_DATA_SIZE];
+
+  idle->session=benchmarks_connect(args,args->host);
+  if(idle->session == NULL)
+    return -1;
+  idle->channel=ssh_channel_new(idle->session);
+  if(idle->channel == NULL ||
+      ssh_channel_open_session(idle->channel) != SSH_OK ||
+      ssh_channel_request_exec(idle->channel,args->duration > 0 ? "eater" :
+        "echo go; cat > /dev/null; echo done") != SSH_OK ||
+      idle_read_line(idle->channel) < 0 ||
+      ssh_channel_write(idle->channel,zeros,sizeof(zeros)) !=
+        (int)sizeof(zeros)){
+    fprintf(stderr,"Error opening an idle channel : %s\n",
+        ssh_get_error(idle->session));
+    return -1;
+  }
+  return 0;
+}
+
+static void idle_close(struct idle_session *idle){
+  if(idle->channel != NULL){
+    if(ssh_channel_send_eof(idle->channel) == SSH_OK)
+      idle_read_line(idle->channel);
+    ssh_channel_close(idle->channel);
+    ssh_channel_free(idle->channel);
+  }
+  if(idle->session != NULL){
+    ssh_disconnect(idle->session);
+    ssh_free(idle->session);
+  }
+}
+
+/** @internal
+ * @brief benchmarks the memory of idle sessions: opens sessions with a
+ * channel each, which exchange a little data then wait, and measures the
+ * heap they hold.
+ * @param[in] session Open SSH session, unused
+ * @param[in] args Parsed command line arguments
+ * @param[out] spm The idle sessions per MiB of heap.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_idle_sessions(ssh_session session, struct argument_s *args,
+    float *spm){
+  struct idle_session *idle;
+  long before;
+  long after;
+  int error=0;
+  int i;
+  (void) session;
+
+  if(idle_heap_used() < 0){
+    fprintf(stderr,"%s : idle sessions : no heap statistics on this "
+        "platform\n",args->host);
+    return -1;
+  }
+  idle=calloc(args->sessions,sizeof(struct idle_session));
+  if(idle == NULL)
+    return -1;
+  before=idle_heap_used();
+  for(i=0;i<args->sessions;i++){
+    if(idle_open(args,&idle[i]) < 0){
+      error=1;
+      break;
+    }
+  }
+  after=idle_heap_used();
+
+  if(!error && after > before){
+    *spm=(float)args->sessions * 1024 * 1024 / (after - before);
+    fprintf(stdout,"%s : idle sessions : %d sessions, %ld bytes of heap "
+        "by session%s\n",args->host,args->sessions,
+        (after - before) / args->sessions,
+        args->duration > 0 ? ", client and server" : "");
+  }
+  for(i=0;i<args->sessions;i++)
+    idle_close(&idle[i]);
+  free(idle);
+  return error || after <= before ? -1 : 0;
+}
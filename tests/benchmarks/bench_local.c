@@ -0,0 +1,111 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * The benchmarks against the loopback server of the tests, running in
+ * threads of the benchmarks: the profiles of the client and of the server
+ * are taken without a sshd, a network or a disk. It accepts any user, eats
+ * the data of the "eater" command like the python script of the raw upload,
+ * and serves sftp files of zeros.
+ */
+
+#include "config.h"
+#include "benchmarks.h"
+#include "loopback.h"
+#include <libssh/libssh.h>
+
+#include <stdio.h>
+
+static struct loopback_server *local_server;
+
+/** @internal
+ * @brief starts the loopback server in threads of the benchmarks.
+ * @param[in] args Parsed command line arguments. The files the server
+ * gives are of the size of the benchmarks.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_local_start(struct argument_s *args){
+  local_server=loopback_server_new(args->datasize,args->verbose);
+  if(local_server == NULL){
+    fprintf(stderr,"Error starting the local server\n");
+    return -1;
+  }
+  return 0;
+}
+
+/** @internal
+ * @brief connects a session to the server started by
+ * benchmarks_local_start().
+ * @param[in] session The session, not connected yet.
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+int benchmarks_local_connect(ssh_session session){
+  return loopback_connect(local_server,session);
+}
+
+/** @internal
+ * @brief stops the server started by benchmarks_local_start().
+ */
+void benchmarks_local_stop(void){
+  loopback_server_free(local_server);
+  local_server=NULL;
+}
+
+/** @internal
+ * @brief tells if a benchmark against the local server is still running.
+ * @param[in] args Parsed command line arguments
+ * @param[in] ts The start of the benchmark.
+ * @return 1 until the duration of the benchmarks is elapsed, then 0.
+ */
+int benchmarks_running(struct argument_s *args, struct timestamp_struct *ts){
+  return elapsed_time(ts) < args->duration * 1000.0;
+}
+
+/** @internal
+ * @brief benchmarks the connections: key exchange and authentication,
+ * then the disconnection, one after the other.
+ * @param[in] session Open SSH session, unused
+ * @param[in] args Parsed command line arguments
+ * @param[out] hps The handshakes per second.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_handshakes(ssh_session session, struct argument_s *args,
+    float *hps){
+  struct timestamp_struct ts;
+  ssh_session handshake;
+  int count=0;
+  float ms;
+  (void) session;
+
+  timestamp_init(&ts);
+  while(args->duration > 0 ? benchmarks_running(args,&ts) :
+      count < BENCHMARK_HANDSHAKE_COUNT){
+    handshake=benchmarks_connect(args,args->host);
+    if(handshake == NULL)
+      return -1;
+    ssh_disconnect(handshake);
+    ssh_free(handshake);
+    count++;
+  }
+  ms=elapsed_time(&ts);
+  *hps=1000 * (float)count / ms;
+  if(args->verbose > 0)
+    fprintf(stdout,"%d handshakes took %f ms\n",count,ms);
+  return 0;
+}
@@ -98,7 +98,8 @@ error:
 
 /** @internal
  * @brief benchmarks a raw upload (simple upload in a SSH channel) using an
- * existing SSH session.
+ * existing SSH session. With the local server, the data is sent for the
+ * duration of the benchmark to its eater command.
  * @param[in] session Open SSH session
  * @param[in] args Parsed command line arguments
  * @param[out] bps The calculated bytes per second obtained via benchmark.
@@ -117,16 +118,21 @@ int benchmarks_raw_up (ssh_session session, struct argument_s *args,
   unsigned long total=0;
   (void)bps;
 
-  err=upload_script(session,"/tmp/eater.py",script);
-  free(script);
-  if(err<0)
-    return err;
+  if(args->duration > 0){
+    free(script);
+    snprintf(cmd,sizeof(cmd),"eater");
+  } else {
+    err=upload_script(session,"/tmp/eater.py",script);
+    free(script);
+    if(err<0)
+      return err;
+    snprintf(cmd,sizeof(cmd),"%s /tmp/eater.py", PYTHON_PATH);
+  }
   channel=ssh_channel_new(session);
   if(channel == NULL)
     goto error;
   if(ssh_channel_open_session(channel)==SSH_ERROR)
     goto error;
-  snprintf(cmd,sizeof(cmd),"%s /tmp/eater.py", PYTHON_PATH);
   if(ssh_channel_request_exec(channel,cmd)==SSH_ERROR)
     goto error;
   if((err=ssh_channel_read(channel,buffer,sizeof(buffer)-1,0))==SSH_ERROR)
@@ -141,7 +147,7 @@ int benchmarks_raw_up (ssh_session session, struct argument_s *args,
   if(args->verbose>0)
     fprintf(stdout,"Starting upload of %lu bytes now\n",bytes);
   timestamp_init(&ts);
-  while(total < bytes){
+  while(args->duration > 0 ? benchmarks_running(args,&ts) : total < bytes){
     unsigned long towrite = bytes - total;
     int w;
     if(towrite > 0x1000)
@@ -151,6 +157,11 @@ int benchmarks_raw_up (ssh_session session, struct argument_s *args,
       goto error;
     total += w;
   }
+  if(args->duration > 0){
+    bytes=total;
+    if(ssh_channel_send_eof(channel) == SSH_ERROR)
+      goto error;
+  }
 
   if(args->verbose>0)
     fprintf(stdout,"Finished upload, now waiting the ack\n");
@@ -23,3 +23,166 @@
 #include "benchmarks.h"
 #include <libssh/libssh.h>
 
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SCP_CHUNK 65536
+
+/** @internal
+ * @brief runs a command on the remote host and waits for its end.
+ * @param[in] session an active SSH session
+ * @param[in] cmd the command to run
+ * @return 0 if the command succeeded, -1 on error
+ */
+int benchmarks_exec(ssh_session session, const char *cmd){
+  ssh_channel channel;
+  char buffer[256];
+  int err;
+
+  channel=ssh_channel_new(session);
+  if(channel == NULL)
+    goto error;
+  if(ssh_channel_open_session(channel) == SSH_ERROR)
+    goto error;
+  if(ssh_channel_request_exec(channel,cmd) == SSH_ERROR)
+    goto error;
+  do {
+    err=ssh_channel_read(channel,buffer,sizeof(buffer),0);
+  } while(err > 0);
+  if(err == SSH_ERROR)
+    goto error;
+  ssh_channel_send_eof(channel);
+  err=ssh_channel_get_exit_status(channel);
+  ssh_channel_close(channel);
+  ssh_channel_free(channel);
+  if(err != 0){
+    fprintf(stderr,"Command \"%s\" failed with status %d\n",cmd,err);
+    return -1;
+  }
+  return 0;
+error:
+  fprintf(stderr,"Error running \"%s\" : %s\n",cmd,ssh_get_error(session));
+  if(channel){
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+  }
+  return -1;
+}
+
+/** @internal
+ * @brief creates the remote file the download benchmarks read.
+ * @param[in] session an active SSH session
+ * @param[in] args Parsed command line arguments
+ * @return 0 on success, -1 on error
+ */
+int benchmarks_remote_file(ssh_session session, struct argument_s *args){
+  char cmd[256];
+
+  snprintf(cmd,sizeof(cmd),"head -c %lu /dev/zero > %s",args->datasize,
+      BENCHMARK_REMOTE_FILE);
+  return benchmarks_exec(session,cmd);
+}
+
+/** @internal
+ * @brief benchmarks a scp upload of one file, acknowledged by the remote
+ * scp.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] bps The calculated bits per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_scp_up (ssh_session session, struct argument_s *args,
+    float *bps){
+  unsigned long total=0;
+  struct timestamp_struct ts;
+  ssh_scp scp;
+  char *buffer;
+  float ms;
+
+  buffer=calloc(1,SCP_CHUNK);
+  if(buffer == NULL)
+    return -1;
+  scp=ssh_scp_new(session,SSH_SCP_WRITE,BENCHMARK_REMOTE_FILE);
+  if(scp == NULL)
+    goto error;
+  timestamp_init(&ts);
+  if(ssh_scp_init(scp) != SSH_OK)
+    goto error;
+  if(ssh_scp_push_file(scp,BENCHMARK_REMOTE_FILE,args->datasize,0644)
+      != SSH_OK)
+    goto error;
+  while(total < args->datasize){
+    unsigned long towrite = args->datasize - total;
+    if(towrite > SCP_CHUNK)
+      towrite = SCP_CHUNK;
+    if(ssh_scp_write(scp,buffer,towrite) != SSH_OK)
+      goto error;
+    total += towrite;
+  }
+  if(ssh_scp_close(scp) != SSH_OK)
+    goto error;
+  ms=elapsed_time(&ts);
+  *bps=8000 * (float)total / ms;
+  if(args->verbose > 0)
+    fprintf(stdout,"scp upload took %f ms for %lu bytes\n",ms,total);
+  ssh_scp_free(scp);
+  free(buffer);
+  return 0;
+error:
+  fprintf(stderr,"Error during scp upload : %s\n",ssh_get_error(session));
+  ssh_scp_free(scp);
+  free(buffer);
+  return -1;
+}
+
+/** @internal
+ * @brief benchmarks a scp download of one file, written to /dev/null.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] bps The calculated bits per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_scp_down (ssh_session session, struct argument_s *args,
+    float *bps){
+  struct timestamp_struct ts;
+  ssh_scp scp=NULL;
+  size_t size;
+  float ms;
+  int fd;
+
+  if(benchmarks_remote_file(session,args) < 0)
+    return -1;
+  fd=open("/dev/null",O_WRONLY);
+  if(fd < 0)
+    return -1;
+  scp=ssh_scp_new(session,SSH_SCP_READ,BENCHMARK_REMOTE_FILE);
+  if(scp == NULL)
+    goto error;
+  timestamp_init(&ts);
+  if(ssh_scp_init(scp) != SSH_OK)
+    goto error;
+  if(ssh_scp_pull_request(scp) != SSH_SCP_REQUEST_NEWFILE)
+    goto error;
+  size=ssh_scp_request_get_size(scp);
+  if(ssh_scp_pull_to_fd(scp,fd) != SSH_OK)
+    goto error;
+  if(ssh_scp_pull_request(scp) != SSH_SCP_REQUEST_EOF)
+    goto error;
+  ms=elapsed_time(&ts);
+  *bps=8000 * (float)size / ms;
+  if(args->verbose > 0)
+    fprintf(stdout,"scp download took %f ms for %lu bytes\n",ms,
+        (unsigned long)size);
+  ssh_scp_free(scp);
+  close(fd);
+  return 0;
+error:
+  fprintf(stderr,"Error during scp download : %s\n",ssh_get_error(session));
+  ssh_scp_free(scp);
+  close(fd);
+  return -1;
+}
@@ -0,0 +1,538 @@
+/* bench_sftp.c
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "benchmarks.h"
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SFTP_CHUNK 32768
+/* requests in flight of the asynchronous benchmarks */
+#define SFTP_ASYNC_REQUESTS 16
+
+static sftp_session bench_sftp_new(ssh_session session){
+  sftp_session sftp;
+
+  sftp=sftp_new(session);
+  if(sftp == NULL)
+    return NULL;
+  if(sftp_init(sftp) != SSH_OK){
+    sftp_free(sftp);
+    return NULL;
+  }
+  return sftp;
+}
+
+static void bench_result(struct argument_s *args, const char *name,
+    struct timestamp_struct *ts, unsigned long bytes, float *bps){
+  float ms=elapsed_time(ts);
+
+  *bps=8000 * (float)bytes / ms;
+  if(args->verbose > 0)
+    fprintf(stdout,"%s took %f ms for %lu bytes\n",name,ms,bytes);
+}
+
+/* opens the remote file of the benchmark, created for the downloads */
+static sftp_file bench_open(ssh_session session, sftp_session sftp,
+    struct argument_s *args, int upload){
+  if(upload)
+    return sftp_open(sftp,BENCHMARK_REMOTE_FILE,O_WRONLY|O_CREAT|O_TRUNC,
+        0644);
+  /* the files of the local server are there, of the size asked */
+  if(args->duration == 0 && benchmarks_remote_file(session,args) < 0)
+    return NULL;
+  return sftp_open(sftp,BENCHMARK_REMOTE_FILE,O_RDONLY,0);
+}
+
+/** @internal
+ * @brief benchmarks a sftp upload with one blocking write after the other.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] bps The calculated bits per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_sftp_up (ssh_session session, struct argument_s *args,
+    float *bps){
+  char buffer[SFTP_CHUNK];
+  struct timestamp_struct ts;
+  unsigned long total=0;
+  sftp_session sftp;
+  sftp_file file=NULL;
+
+  memset(buffer,0,sizeof(buffer));
+  sftp=bench_sftp_new(session);
+  if(sftp == NULL)
+    goto error;
+  file=bench_open(session,sftp,args,1);
+  if(file == NULL)
+    goto error;
+  timestamp_init(&ts);
+  while(total < args->datasize){
+    unsigned long towrite = args->datasize - total;
+    ssize_t w;
+    if(towrite > sizeof(buffer))
+      towrite = sizeof(buffer);
+    w=sftp_write(file,buffer,towrite);
+    if(w <= 0)
+      goto error;
+    total += w;
+  }
+  if(sftp_close(file) != SSH_OK){
+    file=NULL;
+    goto error;
+  }
+  bench_result(args,"sftp upload",&ts,total,bps);
+  sftp_free(sftp);
+  return 0;
+error:
+  fprintf(stderr,"Error during sftp upload : %s\n",ssh_get_error(session));
+  if(file)
+    sftp_close(file);
+  sftp_free(sftp);
+  return -1;
+}
+
+/** @internal
+ * @brief benchmarks a sftp download with one blocking read after the other.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] bps The calculated bits per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_sftp_down (ssh_session session, struct argument_s *args,
+    float *bps){
+  char buffer[SFTP_CHUNK];
+  struct timestamp_struct ts;
+  unsigned long total=0;
+  sftp_session sftp;
+  sftp_file file=NULL;
+  ssize_t r;
+
+  sftp=bench_sftp_new(session);
+  if(sftp == NULL)
+    goto error;
+  file=bench_open(session,sftp,args,0);
+  if(file == NULL)
+    goto error;
+  timestamp_init(&ts);
+  while((r=sftp_read(file,buffer,sizeof(buffer))) > 0){
+    total += r;
+  }
+  if(r < 0)
+    goto error;
+  bench_result(args,"sftp download",&ts,total,bps);
+  sftp_close(file);
+  sftp_free(sftp);
+  return 0;
+error:
+  fprintf(stderr,"Error during sftp download : %s\n",ssh_get_error(session));
+  if(file)
+    sftp_close(file);
+  sftp_free(sftp);
+  return -1;
+}
+
+/** @internal
+ * @brief benchmarks a sftp upload with asynchronous writes, a fixed number
+ * of them in flight.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] bps The calculated bits per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_sftp_async_up (ssh_session session, struct argument_s *args,
+    float *bps){
+  char buffer[SFTP_CHUNK];
+  int ids[SFTP_ASYNC_REQUESTS];
+  struct timestamp_struct ts;
+  unsigned long total=0;
+  sftp_session sftp;
+  sftp_file file=NULL;
+  int first=0;
+  int inflight=0;
+  int id;
+
+  memset(buffer,0,sizeof(buffer));
+  sftp=bench_sftp_new(session);
+  if(sftp == NULL)
+    goto error;
+  file=bench_open(session,sftp,args,1);
+  if(file == NULL)
+    goto error;
+  timestamp_init(&ts);
+  while(total < args->datasize || inflight > 0){
+    if(total < args->datasize && inflight < SFTP_ASYNC_REQUESTS){
+      unsigned long towrite = args->datasize - total;
+      if(towrite > sizeof(buffer))
+        towrite = sizeof(buffer);
+      id=sftp_async_write_begin(file,buffer,towrite);
+      if(id < 0)
+        goto error;
+      ids[(first + inflight) % SFTP_ASYNC_REQUESTS]=id;
+      inflight++;
+      total += towrite;
+      continue;
+    }
+    if(sftp_async_write_end(file,ids[first]) != SSH_OK)
+      goto error;
+    first=(first + 1) % SFTP_ASYNC_REQUESTS;
+    inflight--;
+  }
+  if(sftp_close(file) != SSH_OK){
+    file=NULL;
+    goto error;
+  }
+  bench_result(args,"sftp asynchronous upload",&ts,total,bps);
+  sftp_free(sftp);
+  return 0;
+error:
+  fprintf(stderr,"Error during sftp asynchronous upload : %s\n",
+      ssh_get_error(session));
+  if(file)
+    sftp_close(file);
+  sftp_free(sftp);
+  return -1;
+}
+
+/** @internal
+ * @brief benchmarks a sftp download with asynchronous reads, a fixed number
+ * of them in flight.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] bps The calculated bits per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_sftp_async_down (ssh_session session, struct argument_s *args,
+    float *bps){
+  char buffer[SFTP_CHUNK];
+  int ids[SFTP_ASYNC_REQUESTS];
+  struct timestamp_struct ts;
+  unsigned long requested=0;
+  unsigned long total=0;
+  sftp_session sftp;
+  sftp_file file=NULL;
+  int first=0;
+  int inflight=0;
+  int eof=0;
+  int r;
+
+  sftp=bench_sftp_new(session);
+  if(sftp == NULL)
+    goto error;
+  file=bench_open(session,sftp,args,0);
+  if(file == NULL)
+    goto error;
+  timestamp_init(&ts);
+  while(inflight > 0 || (!eof && requested < args->datasize)){
+    if(!eof && requested < args->datasize && inflight < SFTP_ASYNC_REQUESTS){
+      r=sftp_async_read_begin(file,sizeof(buffer));
+      if(r < 0)
+        goto error;
+      ids[(first + inflight) % SFTP_ASYNC_REQUESTS]=r;
+      inflight++;
+      requested += sizeof(buffer);
+      continue;
+    }
+    r=sftp_async_read(file,buffer,sizeof(buffer),ids[first]);
+    if(r == SSH_ERROR)
+      goto error;
+    if(r == 0)
+      eof=1;
+    total += r;
+    first=(first + 1) % SFTP_ASYNC_REQUESTS;
+    inflight--;
+  }
+  bench_result(args,"sftp asynchronous download",&ts,total,bps);
+  sftp_close(file);
+  sftp_free(sftp);
+  return 0;
+error:
+  fprintf(stderr,"Error during sftp asynchronous download : %s\n",
+      ssh_get_error(session));
+  if(file)
+    sftp_close(file);
+  sftp_free(sftp);
+  return -1;
+}
+
+struct bench_source {
+  unsigned long size;
+  struct argument_s *args;
+  struct timestamp_struct ts;
+};
+
+static ssize_t bench_source_read(void *data, size_t len, uint64_t offset,
+    void *userdata){
+  struct bench_source *source=userdata;
+
+  /* with the local server, the file ends with the benchmark */
+  if(source->args->duration > 0){
+    if(!benchmarks_running(source->args,&source->ts))
+      return 0;
+    memset(data,0,len);
+    return len;
+  }
+  if(offset >= source->size)
+    return 0;
+  if(len > source->size - offset)
+    len=source->size - offset;
+  memset(data,0,len);
+  return len;
+}
+
+static int bench_sink_write(const void *data, size_t len, uint64_t offset,
+    void *userdata){
+  (void) data;
+  (void) len;
+  (void) offset;
+  (void) userdata;
+  return 0;
+}
+
+/** @internal
+ * @brief benchmarks a sftp upload with sftp_upload(), which keeps a
+ * pipeline of writes in flight.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] bps The calculated bits per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_sftp_pipelined_up (ssh_session session,
+    struct argument_s *args, float *bps){
+  struct sftp_upload_source_struct source;
+  struct bench_source data;
+  struct timestamp_struct ts;
+  sftp_session sftp;
+  sftp_file file=NULL;
+  int64_t total;
+
+  data.size=args->datasize;
+  data.args=args;
+  source.fd=-1;
+  source.read_function=bench_source_read;
+  source.userdata=&data;
+  sftp=bench_sftp_new(session);
+  if(sftp == NULL)
+    goto error;
+  file=bench_open(session,sftp,args,1);
+  if(file == NULL)
+    goto error;
+  timestamp_init(&ts);
+  data.ts=ts;
+  total=sftp_upload(&source,file,NULL);
+  if(total < 0)
+    goto error;
+  if(sftp_close(file) != SSH_OK){
+    file=NULL;
+    goto error;
+  }
+  bench_result(args,"sftp pipelined upload",&ts,total,bps);
+  sftp_free(sftp);
+  return 0;
+error:
+  fprintf(stderr,"Error during sftp pipelined upload : %s\n",
+      ssh_get_error(session));
+  if(file)
+    sftp_close(file);
+  sftp_free(sftp);
+  return -1;
+}
+
+/** @internal
+ * @brief benchmarks a sftp download with sftp_download(), which keeps a
+ * pipeline of reads in flight.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] bps The calculated bits per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_sftp_pipelined_down (ssh_session session,
+    struct argument_s *args, float *bps){
+  struct sftp_download_sink_struct sink;
+  struct timestamp_struct ts;
+  sftp_session sftp;
+  sftp_file file=NULL;
+  int64_t total;
+
+  sink.fd=-1;
+  sink.write_function=bench_sink_write;
+  sink.userdata=NULL;
+  sftp=bench_sftp_new(session);
+  if(sftp == NULL)
+    goto error;
+  file=bench_open(session,sftp,args,0);
+  if(file == NULL)
+    goto error;
+  timestamp_init(&ts);
+  total=sftp_download(file,&sink,NULL);
+  if(total < 0)
+    goto error;
+  bench_result(args,"sftp pipelined download",&ts,total,bps);
+  sftp_close(file);
+  sftp_free(sftp);
+  return 0;
+error:
+  fprintf(stderr,"Error during sftp pipelined download : %s\n",
+      ssh_get_error(session));
+  if(file)
+    sftp_close(file);
+  sftp_free(sftp);
+  return -1;
+}
+
+/* removes the local files of the small files benchmark */
+static void bench_local_clean(const char *dir, int nfiles){
+  char path[128];
+  int i;
+
+  for(i=0;i<nfiles;++i){
+    snprintf(path,sizeof(path),"%s/f%d",dir,i);
+    unlink(path);
+  }
+  rmdir(dir);
+}
+
+/** @internal
+ * @brief benchmarks the upload of many small files with a sftp_transfer.
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] fps The calculated files per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_sftp_small_files (ssh_session session,
+    struct argument_s *args, float *fps){
+  char dir[]="/tmp/libssh_benchmark_XXXXXX";
+  char buffer[BENCHMARK_SMALL_FILE_SIZE];
+  char local[128];
+  char remote[128];
+  struct timestamp_struct ts;
+  sftp_transfer transfer=NULL;
+  sftp_session sftp=NULL;
+  float ms;
+  int fd;
+  int i;
+
+  if(mkdtemp(dir) == NULL)
+    return -1;
+  memset(buffer,0,sizeof(buffer));
+  for(i=0;i<args->nfiles;++i){
+    snprintf(local,sizeof(local),"%s/f%d",dir,i);
+    fd=open(local,O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(fd < 0 || write(fd,buffer,sizeof(buffer)) != sizeof(buffer)){
+      fprintf(stderr,"Error creating %s\n",local);
+      if(fd >= 0)
+        close(fd);
+      bench_local_clean(dir,args->nfiles);
+      return -1;
+    }
+    close(fd);
+  }
+  if(benchmarks_exec(session,"rm -rf " BENCHMARK_REMOTE_DIR " && mkdir "
+        BENCHMARK_REMOTE_DIR) < 0)
+    goto error;
+
+  sftp=bench_sftp_new(session);
+  if(sftp == NULL)
+    goto error;
+  transfer=sftp_transfer_new(sftp);
+  if(transfer == NULL)
+    goto error;
+  for(i=0;i<args->nfiles;++i){
+    snprintf(local,sizeof(local),"%s/f%d",dir,i);
+    snprintf(remote,sizeof(remote),"%s/f%d",BENCHMARK_REMOTE_DIR,i);
+    if(sftp_transfer_add_upload(transfer,local,remote) != SSH_OK)
+      goto error;
+  }
+  timestamp_init(&ts);
+  if(sftp_transfer_run(transfer) != SSH_OK)
+    goto error;
+  ms=elapsed_time(&ts);
+  *fps=1000 * (float)args->nfiles / ms;
+  if(args->verbose > 0)
+    fprintf(stdout,"sftp small files took %f ms for %d files\n",ms,
+        args->nfiles);
+  sftp_transfer_free(transfer);
+  sftp_free(sftp);
+  bench_local_clean(dir,args->nfiles);
+  return 0;
+error:
+  fprintf(stderr,"Error during sftp small files : %s\n",
+      ssh_get_error(session));
+  sftp_transfer_free(transfer);
+  sftp_free(sftp);
+  bench_local_clean(dir,args->nfiles);
+  return -1;
+}
+
+/** @internal
+ * @brief benchmarks the listing of a remote directory with sftp_dir_next().
+ * @param[in] session Open SSH session
+ * @param[in] args Parsed command line arguments
+ * @param[out] eps The calculated entries per second obtained via benchmark.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_sftp_readdir (ssh_session session, struct argument_s *args,
+    float *eps){
+  struct timestamp_struct ts;
+  sftp_session sftp=NULL;
+  sftp_dir dir=NULL;
+  char cmd[256];
+  int entries=0;
+  float ms;
+
+  snprintf(cmd,sizeof(cmd),"rm -rf %s && mkdir %s && cd %s && i=0 && "
+      "while [ $i -lt %d ]; do : > f$i; i=$((i+1)); done",
+      BENCHMARK_REMOTE_DIR,BENCHMARK_REMOTE_DIR,BENCHMARK_REMOTE_DIR,
+      args->nfiles);
+  if(benchmarks_exec(session,cmd) < 0)
+    return -1;
+
+  sftp=bench_sftp_new(session);
+  if(sftp == NULL)
+    goto error;
+  timestamp_init(&ts);
+  dir=sftp_opendir(sftp,BENCHMARK_REMOTE_DIR);
+  if(dir == NULL)
+    goto error;
+  while(sftp_dir_next(dir) != NULL){
+    entries++;
+  }
+  if(!sftp_dir_eof(dir))
+    goto error;
+  sftp_closedir(dir);
+  ms=elapsed_time(&ts);
+  *eps=1000 * (float)entries / ms;
+  if(args->verbose > 0)
+    fprintf(stdout,"sftp readdir took %f ms for %d entries\n",ms,entries);
+  sftp_free(sftp);
+  return 0;
+error:
+  fprintf(stderr,"Error during sftp readdir : %s\n",ssh_get_error(session));
+  if(dir)
+    sftp_closedir(dir);
+  sftp_free(sftp);
+  return -1;
+}
@@ -0,0 +1,236 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * The handshake storm: clients in threads of their own making full
+ * handshakes (banner, key exchange, authentication and channel open) one
+ * after the other, as a server sees them when many users come at once. The
+ * latencies of the phases are the ones the sessions time themselves, see
+ * ssh_session_get_latency().
+ */
+
+#include "config.h"
+#include "benchmarks.h"
+#include <libssh/libssh.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* the whole handshake, then the phases of enum ssh_latency_e */
+#define STORM_COLUMNS 6
+
+static const char *storm_columns[STORM_COLUMNS]={
+  "handshake",
+  "connect",
+  "banner",
+  "kex",
+  "auth",
+  "channel open"
+};
+
+struct storm_client {
+  pthread_t thread;
+  struct argument_s *args;
+  struct timestamp_struct *start;
+  float (*samples)[STORM_COLUMNS]; /* in ms, one row by handshake */
+  int count;
+  int size;
+  int error;
+};
+
+/* a full handshake, its latencies in row */
+static int storm_handshake(struct argument_s *args, float *row){
+  struct ssh_latency_struct latency;
+  struct timestamp_struct ts;
+  ssh_session session;
+  ssh_channel channel=NULL;
+  int phase;
+  int rc=-1;
+
+  timestamp_init(&ts);
+  session=benchmarks_connect(args,args->host);
+  if(session == NULL)
+    return -1;
+  channel=ssh_channel_new(session);
+  if(channel == NULL || ssh_channel_open_session(channel) != SSH_OK){
+    fprintf(stderr,"Error opening a channel : %s\n",ssh_get_error(session));
+    goto end;
+  }
+  row[0]=elapsed_time(&ts);
+  for(phase=SSH_LATENCY_CONNECT;phase<=SSH_LATENCY_CHANNEL_OPEN;phase++){
+    row[phase + 1]=0.0;
+    if(ssh_session_get_latency(session,phase,&latency) == SSH_OK &&
+        latency.count > 0)
+      row[phase + 1]=(float)latency.max / 1000;
+  }
+  rc=0;
+end:
+  if(channel != NULL)
+    ssh_channel_free(channel);
+  ssh_disconnect(session);
+  ssh_free(session);
+  return rc;
+}
+
+static void *storm_client_thread(void *arg){
+  struct storm_client *client=arg;
+  struct argument_s *args=client->args;
+  void *samples;
+
+  while(args->duration > 0 ? benchmarks_running(args,client->start) :
+      client->count < BENCHMARK_HANDSHAKE_COUNT){
+    if(client->count == client->size){
+      client->size=client->size ? client->size * 2 : 256;
+      samples=realloc(client->samples,
+          client->size * sizeof(client->samples[0]));
+      if(samples == NULL){
+        client->error=1;
+        break;
+      }
+      client->samples=samples;
+    }
+    if(storm_handshake(args,client->samples[client->count]) < 0){
+      client->error=1;
+      break;
+    }
+    client->count++;
+  }
+  return NULL;
+}
+
+static int storm_compare(const void *a, const void *b){
+  float x=*(const float *)a;
+  float y=*(const float *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* the value below which a fraction q of the sorted values are */
+static float storm_percentile(const float *values, int count, double q){
+  int i=(int)(q * count + 0.999999) - 1;
+
+  if(i < 0)
+    i=0;
+  if(i >= count)
+    i=count - 1;
+  return values[i];
+}
+
+static float storm_cpu_ms(const struct rusage *before,
+    const struct rusage *after){
+  return (after->ru_utime.tv_sec - before->ru_utime.tv_sec) * 1000.0 +
+      (after->ru_utime.tv_usec - before->ru_utime.tv_usec) / 1000.0 +
+      (after->ru_stime.tv_sec - before->ru_stime.tv_sec) * 1000.0 +
+      (after->ru_stime.tv_usec - before->ru_stime.tv_usec) / 1000.0;
+}
+
+/* prints the percentiles of the columns and the processor time */
+static void storm_report(struct argument_s *args, struct storm_client *clients,
+    int total, float ms, float cpu){
+  float *values;
+  double sum;
+  int column;
+  int n;
+  int i;
+  int j;
+
+  values=malloc(total * sizeof(float));
+  if(values == NULL)
+    return;
+  fprintf(stdout,"%s : handshake storm : %d clients, %d handshakes in %f ms\n",
+      args->host,args->clients,total,ms);
+  fprintf(stdout,"  %-12s %10s %10s %10s %10s\n","(ms)","p50","p99","p999",
+      "mean");
+  for(column=0;column<STORM_COLUMNS;column++){
+    n=0;
+    sum=0.0;
+    for(i=0;i<args->clients;i++){
+      for(j=0;j<clients[i].count;j++){
+        values[n++]=clients[i].samples[j][column];
+        sum+=clients[i].samples[j][column];
+      }
+    }
+    qsort(values,n,sizeof(float),storm_compare);
+    fprintf(stdout,"  %-12s %10.3f %10.3f %10.3f %10.3f\n",
+        storm_columns[column],storm_percentile(values,n,0.5),
+        storm_percentile(values,n,0.99),storm_percentile(values,n,0.999),
+        sum / n);
+  }
+  fprintf(stdout,"  processor time : %f ms by handshake%s\n",cpu / total,
+      args->duration > 0 ? ", client and server" : "");
+  free(values);
+}
+
+/** @internal
+ * @brief benchmarks the handshakes of concurrent clients: each of them
+ * connects, authenticates and opens a channel, then disconnects, again and
+ * again.
+ * @param[in] session Open SSH session, unused
+ * @param[in] args Parsed command line arguments
+ * @param[out] hps The handshakes per second of all the clients.
+ * @return 0 on success, -1 on error.
+ */
+int benchmarks_handshake_storm(ssh_session session, struct argument_s *args,
+    float *hps){
+  struct storm_client *clients;
+  struct timestamp_struct ts;
+  struct rusage before, after;
+  int started=0;
+  int total=0;
+  int error=0;
+  float ms;
+  int i;
+  (void) session;
+
+  clients=calloc(args->clients,sizeof(struct storm_client));
+  if(clients == NULL)
+    return -1;
+  getrusage(RUSAGE_SELF,&before);
+  timestamp_init(&ts);
+  for(i=0;i<args->clients;i++){
+    clients[i].args=args;
+    clients[i].start=&ts;
+    if(pthread_create(&clients[i].thread,NULL,storm_client_thread,
+          &clients[i]) != 0){
+      error=1;
+      break;
+    }
+    started++;
+  }
+  for(i=0;i<started;i++){
+    pthread_join(clients[i].thread,NULL);
+    error|=clients[i].error;
+    total+=clients[i].count;
+  }
+  ms=elapsed_time(&ts);
+  getrusage(RUSAGE_SELF,&after);
+
+  if(!error && total > 0){
+    *hps=1000 * (float)total / ms;
+    storm_report(args,clients,total,ms,storm_cpu_ms(&before,&after));
+  }
+  for(i=0;i<args->clients;i++)
+    free(clients[i].samples);
+  free(clients);
+  return error || total == 0 ? -1 : 0;
+}
@@ -22,16 +22,86 @@
 #include "config.h"
 #include "benchmarks.h"
 #include <libssh/libssh.h>
+#include <libssh/callbacks.h>
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
 
 const char *libssh_benchmarks_names[]={
     "null",
-    "benchmark_raw_upload"
+    "benchmark_raw_upload",
+    "benchmark_scp_upload",
+    "benchmark_scp_download",
+    "benchmark_sftp_upload",
+    "benchmark_sftp_download",
+    "benchmark_sftp_async_upload",
+    "benchmark_sftp_async_download",
+    "benchmark_sftp_pipelined_upload",
+    "benchmark_sftp_pipelined_download",
+    "benchmark_sftp_small_files",
+    "benchmark_sftp_readdir",
+    "benchmark_handshakes",
+    "benchmark_handshake_storm",
+    "benchmark_idle_sessions"
 };
 
+typedef int (*benchmark_function)(ssh_session session,
+    struct argument_s *args, float *result);
+
+/* the benchmarks, in the order of enum libssh_benchmarks */
+static const struct {
+  benchmark_function function;
+  const char *unit; /* of the result */
+  int local; /* runs against the local server */
+} benchmarks_table[]={
+  {NULL, NULL, 0},
+  {benchmarks_raw_up, "bps", 1},
+  {benchmarks_scp_up, "bps", 0},
+  {benchmarks_scp_down, "bps", 0},
+#ifdef WITH_SFTP
+  {benchmarks_sftp_up, "bps", 1},
+  {benchmarks_sftp_down, "bps", 1},
+  {benchmarks_sftp_async_up, "bps", 1},
+  {benchmarks_sftp_async_down, "bps", 1},
+  {benchmarks_sftp_pipelined_up, "bps", 1},
+  {benchmarks_sftp_pipelined_down, "bps", 1},
+  {benchmarks_sftp_small_files, "files/s", 0},
+  {benchmarks_sftp_readdir, "entries/s", 0},
+#else
+  {NULL, NULL, 0},
+  {NULL, NULL, 0},
+  {NULL, NULL, 0},
+  {NULL, NULL, 0},
+  {NULL, NULL, 0},
+  {NULL, NULL, 0},
+  {NULL, NULL, 0},
+  {NULL, NULL, 0},
+#endif
+  {benchmarks_handshakes, "handshakes/s", 1},
+  {benchmarks_handshake_storm, "handshakes/s", 1},
+  {benchmarks_idle_sessions, "sessions/MiB", 1}
+};
+
+/* the keys of the options without a short one */
+#define KEY_BENCHMARK(n) (0x100 + (n))
+#define KEY_SIZE 0x200
+#define KEY_FILES 0x201
+#define KEY_JSON 0x202
+#define KEY_BASELINE 0x203
+#define KEY_TOLERANCE 0x204
+#define KEY_LOCAL 0x205
+#define KEY_CLIENTS 0x206
+#define KEY_KEX 0x207
+#define KEY_CIPHERS 0x208
+#define KEY_HOSTKEYS 0x209
+#define KEY_SESSIONS 0x20a
+
 #ifdef HAVE_ARGP_H
 #include <argp.h>
 
@@ -41,7 +111,15 @@ const char *argp_program_bug_address = "Aris Adamantiadis <aris@0xbadc0de.be>";
 static char **cmdline;
 
 /* Program documentation. */
-static char doc[] = "libssh benchmarks";
+static char doc[] = "libssh benchmarks"
+"\vRun against a local sshd with -h localhost. Keep the results of a release "
+"with --json as a baseline, and give it to the next runs with --baseline: "
+"the exit status is then a failure if a benchmark regressed. With --local, "
+"the benchmarks run against a server in the process over socketpairs, e.g. "
+"under perf record: the raw upload, the sftp pipelined upload, the "
+"handshakes and the handshake storm for the given seconds each, the other "
+"sftp transfers for --size bytes. The idle sessions count the heap of both "
+"sides with --local.";
 
 
 /* The options we understand. */
@@ -62,6 +140,204 @@ static struct argp_option options[] = {
     .doc   = "Upload raw data using channel",
     .group = 0
   },
+  {
+    .name  = "scp-upload",
+    .key   = KEY_BENCHMARK(BENCHMARK_SCP_UPLOAD),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Upload a file with scp",
+    .group = 0
+  },
+  {
+    .name  = "scp-download",
+    .key   = KEY_BENCHMARK(BENCHMARK_SCP_DOWNLOAD),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Download a file with scp",
+    .group = 0
+  },
+  {
+    .name  = "sftp-upload",
+    .key   = KEY_BENCHMARK(BENCHMARK_SFTP_UPLOAD),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Upload a file with blocking sftp writes",
+    .group = 0
+  },
+  {
+    .name  = "sftp-download",
+    .key   = KEY_BENCHMARK(BENCHMARK_SFTP_DOWNLOAD),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Download a file with blocking sftp reads",
+    .group = 0
+  },
+  {
+    .name  = "sftp-async-upload",
+    .key   = KEY_BENCHMARK(BENCHMARK_SFTP_ASYNC_UPLOAD),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Upload a file with asynchronous sftp writes",
+    .group = 0
+  },
+  {
+    .name  = "sftp-async-download",
+    .key   = KEY_BENCHMARK(BENCHMARK_SFTP_ASYNC_DOWNLOAD),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Download a file with asynchronous sftp reads",
+    .group = 0
+  },
+  {
+    .name  = "sftp-pipelined-upload",
+    .key   = KEY_BENCHMARK(BENCHMARK_SFTP_PIPELINED_UPLOAD),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Upload a file with sftp_upload()",
+    .group = 0
+  },
+  {
+    .name  = "sftp-pipelined-download",
+    .key   = KEY_BENCHMARK(BENCHMARK_SFTP_PIPELINED_DOWNLOAD),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Download a file with sftp_download()",
+    .group = 0
+  },
+  {
+    .name  = "sftp-small-files",
+    .key   = KEY_BENCHMARK(BENCHMARK_SFTP_SMALL_FILES),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Upload many small files with a sftp transfer",
+    .group = 0
+  },
+  {
+    .name  = "sftp-readdir",
+    .key   = KEY_BENCHMARK(BENCHMARK_SFTP_READDIR),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "List a directory of many files with sftp",
+    .group = 0
+  },
+  {
+    .name  = "handshakes",
+    .key   = KEY_BENCHMARK(BENCHMARK_HANDSHAKES),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Connect and authenticate, one connection after the other",
+    .group = 0
+  },
+  {
+    .name  = "handshake-storm",
+    .key   = KEY_BENCHMARK(BENCHMARK_HANDSHAKE_STORM),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Connect, authenticate and open a channel from concurrent "
+             "clients, with the latency percentiles of the phases",
+    .group = 0
+  },
+  {
+    .name  = "idle-sessions",
+    .key   = KEY_BENCHMARK(BENCHMARK_IDLE_SESSIONS),
+    .arg   = NULL,
+    .flags = 0,
+    .doc   = "Hold sessions whose channel exchanged some data and waits, "
+             "with the heap they take",
+    .group = 0
+  },
+  {
+    .name  = "local",
+    .key   = KEY_LOCAL,
+    .arg   = "SECONDS",
+    .flags = 0,
+    .doc   = "Run each benchmark for SECONDS against a server in the process "
+             "instead of a host",
+    .group = 0
+  },
+  {
+    .name  = "size",
+    .key   = KEY_SIZE,
+    .arg   = "BYTES",
+    .flags = 0,
+    .doc   = "Size of the transferred file (default 16 MiB)",
+    .group = 0
+  },
+  {
+    .name  = "files",
+    .key   = KEY_FILES,
+    .arg   = "COUNT",
+    .flags = 0,
+    .doc   = "Number of files of the small files and readdir benchmarks",
+    .group = 0
+  },
+  {
+    .name  = "clients",
+    .key   = KEY_CLIENTS,
+    .arg   = "COUNT",
+    .flags = 0,
+    .doc   = "Number of concurrent clients of the handshake storm "
+             "(default 8)",
+    .group = 0
+  },
+  {
+    .name  = "sessions",
+    .key   = KEY_SESSIONS,
+    .arg   = "COUNT",
+    .flags = 0,
+    .doc   = "Number of sessions of the idle sessions benchmark "
+             "(default 100)",
+    .group = 0
+  },
+  {
+    .name  = "kex",
+    .key   = KEY_KEX,
+    .arg   = "METHODS",
+    .flags = 0,
+    .doc   = "Key exchange methods of the connections",
+    .group = 0
+  },
+  {
+    .name  = "ciphers",
+    .key   = KEY_CIPHERS,
+    .arg   = "CIPHERS",
+    .flags = 0,
+    .doc   = "Ciphers of the connections, both ways",
+    .group = 0
+  },
+  {
+    .name  = "hostkeys",
+    .key   = KEY_HOSTKEYS,
+    .arg   = "ALGORITHMS",
+    .flags = 0,
+    .doc   = "Host key algorithms of the connections",
+    .group = 0
+  },
+  {
+    .name  = "json",
+    .key   = KEY_JSON,
+    .arg   = "FILE",
+    .flags = 0,
+    .doc   = "Write the results to FILE in JSON, to be used as a baseline",
+    .group = 0
+  },
+  {
+    .name  = "baseline",
+    .key   = KEY_BASELINE,
+    .arg   = "FILE",
+    .flags = 0,
+    .doc   = "Compare the results with the JSON results of FILE and fail "
+             "on a regression",
+    .group = 0
+  },
+  {
+    .name  = "tolerance",
+    .key   = KEY_TOLERANCE,
+    .arg   = "PERCENT",
+    .flags = 0,
+    .doc   = "Drop below the baseline taken as a regression (default 10)",
+    .group = 0
+  },
   {
     .name  = "host",
     .key   = 'h',
@@ -80,14 +356,62 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
    */
   struct argument_s *arguments = state->input;
 
-  /* arg is currently not used */
-  (void) arg;
+  if (key > KEY_BENCHMARK(0) && key < KEY_BENCHMARK(BENCHMARK_NUMBER)) {
+    arguments->benchmarks[key - KEY_BENCHMARK(1)] = 1;
+    arguments->ntests ++;
+    return 0;
+  }
 
   switch (key) {
     case '1':
-      arguments->benchmarks[key - '1' + 1] = 1;
+      arguments->benchmarks[BENCHMARK_RAW_UPLOAD - 1] = 1;
       arguments->ntests ++;
       break;
+    case KEY_SIZE:
+      arguments->datasize = strtoul(arg, NULL, 0);
+      break;
+    case KEY_FILES:
+      arguments->nfiles = atoi(arg);
+      break;
+    case KEY_JSON:
+      arguments->json = arg;
+      break;
+    case KEY_BASELINE:
+      arguments->baseline = arg;
+      break;
+    case KEY_TOLERANCE:
+      arguments->tolerance = atoi(arg);
+      break;
+    case KEY_CLIENTS:
+      arguments->clients = atoi(arg);
+      if (arguments->clients <= 0) {
+        fprintf(stderr, "At least one client is needed\n");
+        return ARGP_ERR_UNKNOWN;
+      }
+      break;
+    case KEY_SESSIONS:
+      arguments->sessions = atoi(arg);
+      if (arguments->sessions <= 0) {
+        fprintf(stderr, "At least one session is needed\n");
+        return ARGP_ERR_UNKNOWN;
+      }
+      break;
+    case KEY_KEX:
+      arguments->kex = arg;
+      break;
+    case KEY_CIPHERS:
+      arguments->ciphers = arg;
+      break;
+    case KEY_HOSTKEYS:
+      arguments->hostkeys = arg;
+      break;
+    case KEY_LOCAL:
+      arguments->duration = atoi(arg);
+      if (arguments->duration <= 0) {
+        fprintf(stderr, "The duration must be at least a second\n");
+        return ARGP_ERR_UNKNOWN;
+      }
+      break;
     case 'v':
       arguments->verbose++;
       break;
@@ -132,18 +456,48 @@ static void cmdline_parse(int argc, char **argv, struct argument_s *arguments) {
 
 static void arguments_init(struct argument_s *arguments){
   memset(arguments,0,sizeof(*arguments));
+  arguments->datasize=BENCHMARK_DATA_SIZE;
+  arguments->nfiles=BENCHMARK_FILES;
+  arguments->tolerance=BENCHMARK_TOLERANCE;
+  arguments->clients=BENCHMARK_STORM_CLIENTS;
+  arguments->sessions=BENCHMARK_IDLE_COUNT;
 }
 
-static ssh_session connect_host(const char *host, int verbose){
+/** @internal
+ * @brief connects and authenticates to a host, or to the local server.
+ * @param[in] args Parsed command line arguments
+ * @param[in] host The host, user@hostname.
+ * @return the session, NULL on error.
+ */
+ssh_session benchmarks_connect(struct argument_s *args, const char *host){
   ssh_session session=ssh_new();
+  int verbose=args->verbose;
   if(session==NULL)
     goto error;
   if(ssh_options_set(session,SSH_OPTIONS_HOST, host)<0)
     goto error;
   ssh_options_set(session, SSH_OPTIONS_LOG_VERBOSITY, &verbose);
-  if(ssh_connect(session)==SSH_ERROR)
+  if(args->kex != NULL &&
+      ssh_options_set(session, SSH_OPTIONS_KEY_EXCHANGE, args->kex) < 0)
     goto error;
-  if(ssh_userauth_autopubkey(session,NULL) != SSH_AUTH_SUCCESS)
+  if(args->ciphers != NULL &&
+      (ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, args->ciphers) < 0 ||
+       ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, args->ciphers) < 0))
+    goto error;
+  if(args->hostkeys != NULL &&
+      ssh_options_set(session, SSH_OPTIONS_HOSTKEYS, args->hostkeys) < 0)
+    goto error;
+  if(args->duration > 0){
+    /* the local server accepts anyone */
+    ssh_options_set(session, SSH_OPTIONS_USER, "benchmark");
+    if(benchmarks_local_connect(session)==SSH_ERROR)
+      goto error;
+  } else if(ssh_connect(session)==SSH_ERROR)
+    goto error;
+  if(args->duration > 0){
+    if(ssh_userauth_none(session,NULL) != SSH_AUTH_SUCCESS)
+      goto error;
+  } else if(ssh_userauth_autopubkey(session,NULL) != SSH_AUTH_SUCCESS)
     goto error;
   return session;
 error:
@@ -168,48 +522,174 @@ static char *network_speed(float bps){
   return buffer;
 }
 
-static void do_benchmarks(ssh_session session, struct argument_s *arguments,
-    const char *hostname){
+static char *benchmark_result(float value, const char *unit){
+  static char buffer[128];
+
+  if(strcmp(unit,"bps")==0)
+    return network_speed(value);
+  snprintf(buffer,sizeof(buffer),"%f %s",value,unit);
+  return buffer;
+}
+
+/*
+ * Marks the start and the end of a benchmark for the profilers: in the
+ * ftrace buffer, which perf record -e ftrace:print shows along the samples,
+ * and with static tracepoints if they are built.
+ */
+static void benchmark_marker(const char *name, int start){
+  static int fd=-2;
+  char line[128];
+  int len;
+
+  if(fd == -2){
+    fd=open("/sys/kernel/tracing/trace_marker",O_WRONLY);
+    if(fd < 0)
+      fd=open("/sys/kernel/debug/tracing/trace_marker",O_WRONLY);
+  }
+  if(fd >= 0){
+    len=snprintf(line,sizeof(line),"libssh_benchmark: %s %s\n",name,
+        start ? "start" : "end");
+    if(write(fd,line,len) < 0){
+      close(fd);
+      fd=-1;
+    }
+  }
+#ifdef HAVE_SYS_SDT_H
+  if(start)
+    DTRACE_PROBE1(libssh_benchmark, start, name);
+  else
+    DTRACE_PROBE1(libssh_benchmark, end, name);
+#endif
+}
+
+/* the value of a benchmark in a file of JSON results, -1 if there is none */
+static float baseline_value(FILE *baseline, const char *name){
+  char line[1024];
+  char key[128];
+  char *ptr;
+
+  snprintf(key,sizeof(key),"\"benchmark\": \"%s\"",name);
+  rewind(baseline);
+  while(fgets(line,sizeof(line),baseline)!=NULL){
+    if(strstr(line,key)==NULL)
+      continue;
+    ptr=strstr(line,"\"value\": ");
+    if(ptr==NULL)
+      continue;
+    return strtof(ptr+strlen("\"value\": "),NULL);
+  }
+  return -1;
+}
+
+/* writes a result and compares it with the baseline, -1 on a regression */
+static int report_result(struct argument_s *arguments, FILE *json,
+    FILE *baseline, const char *hostname, int benchmark, float value){
+  const char *name=libssh_benchmarks_names[benchmark];
+  const char *unit=benchmarks_table[benchmark].unit;
+  float base;
+
+  fprintf(stdout, "%s : %s : %s\n",hostname,name,
+      benchmark_result(value,unit));
+  if(json!=NULL){
+    fprintf(json,"%s  {\"host\": \"%s\", \"benchmark\": \"%s\", "
+        "\"value\": %f, \"unit\": \"%s\"}",
+        ftell(json) > 2 ? ",\n" : "",hostname,name,value,unit);
+  }
+  if(baseline==NULL)
+    return 0;
+  base=baseline_value(baseline,name);
+  if(base <= 0)
+    return 0;
+  if(value < base * (100 - arguments->tolerance) / 100){
+    fprintf(stdout, "%s : %s : REGRESSION, %.1f%% below the baseline %s\n",
+        hostname,name,100 * (base - value) / base,
+        benchmark_result(base,unit));
+    return -1;
+  }
+  if(arguments->verbose>0)
+    fprintf(stdout, "%s : %s : %+.1f%% from the baseline\n",hostname,name,
+        100 * (value - base) / base);
+  return 0;
+}
+
+static int do_benchmarks(ssh_session session, struct argument_s *arguments,
+    const char *hostname, FILE *json, FILE *baseline){
   float ping_rtt=0.0;
   float ssh_rtt=0.0;
-  float bps=0.0;
+  float value=0.0;
+  int regressions=0;
   int err;
+  int i;
 
-  if(arguments->verbose>0)
-    fprintf(stdout,"Testing ICMP RTT\n");
-  err=benchmarks_ping_latency(hostname, &ping_rtt);
-  if(err == 0){
-    fprintf(stdout,"ping RTT : %f ms\n",ping_rtt);
+  if(arguments->duration == 0){
+    if(arguments->verbose>0)
+      fprintf(stdout,"Testing ICMP RTT\n");
+    err=benchmarks_ping_latency(hostname, &ping_rtt);
+    if(err == 0){
+      fprintf(stdout,"ping RTT : %f ms\n",ping_rtt);
+    }
   }
   err=benchmarks_ssh_latency(session, &ssh_rtt);
   if(err==0){
     fprintf(stdout, "SSH RTT : %f ms\n",ssh_rtt);
   }
-  if(arguments->benchmarks[BENCHMARK_RAW_UPLOAD-1]){
-    err=benchmarks_raw_up(session,arguments,&bps);
-    if(err==0){
-      fprintf(stdout, "%s : %s : %s\n",hostname,
-          libssh_benchmarks_names[BENCHMARK_RAW_UPLOAD], network_speed(bps));
+  for(i=1;i<BENCHMARK_NUMBER;++i){
+    if(!arguments->benchmarks[i-1])
+      continue;
+    if(benchmarks_table[i].function==NULL){
+      fprintf(stderr,"%s : %s : not built\n",hostname,
+          libssh_benchmarks_names[i]);
+      continue;
+    }
+    if(arguments->duration > 0 && !benchmarks_table[i].local){
+      fprintf(stderr,"%s : %s : not run by the local server\n",hostname,
+          libssh_benchmarks_names[i]);
+      continue;
+    }
+    benchmark_marker(libssh_benchmarks_names[i],1);
+    err=benchmarks_table[i].function(session,arguments,&value);
+    benchmark_marker(libssh_benchmarks_names[i],0);
+    if(err==0 &&
+        report_result(arguments,json,baseline,hostname,i,value) < 0){
+      regressions++;
     }
   }
+  if(arguments->duration == 0)
+    benchmarks_exec(session,"rm -rf " BENCHMARK_REMOTE_FILE " "
+        BENCHMARK_REMOTE_DIR);
+  return regressions;
 }
 
 int main(int argc, char **argv){
   struct argument_s arguments;
   ssh_session session;
+  FILE *json=NULL;
+  FILE *baseline=NULL;
+  int regressions=0;
   int i;
 
   arguments_init(&arguments);
   cmdline_parse(argc, argv, &arguments);
+  /* the handshake storm and the local server run in threads */
+  ssh_threads_set_callbacks(ssh_threads_get_pthread());
+  ssh_init();
+  if (arguments.duration > 0){
+    if (benchmarks_local_start(&arguments) < 0)
+      return EXIT_FAILURE;
+    arguments.hosts[0]="loopback";
+    arguments.nhosts=1;
+  }
   if (arguments.nhosts==0){
     fprintf(stderr,"At least one host (-h) must be specified\n");
     return EXIT_FAILURE;
   }
   if (arguments.ntests==0){
     for(i=1; i < BENCHMARK_NUMBER ; ++i){
+      if(arguments.duration > 0 && !benchmarks_table[i].local)
+        continue;
       arguments.benchmarks[i-1]=1;
+      arguments.ntests++;
     }
-    arguments.ntests=BENCHMARK_NUMBER-1;
   }
   if (arguments.verbose > 0){
     fprintf(stdout, "Will try hosts ");
@@ -224,20 +704,49 @@ int main(int argc, char **argv){
     fprintf(stdout,"\n");
   }
 
+  if(arguments.baseline != NULL){
+    baseline=fopen(arguments.baseline,"r");
+    if(baseline==NULL){
+      fprintf(stderr,"Can't open the baseline %s\n",arguments.baseline);
+      return EXIT_FAILURE;
+    }
+  }
+  if(arguments.json != NULL){
+    json=fopen(arguments.json,"w");
+    if(json==NULL){
+      fprintf(stderr,"Can't open %s\n",arguments.json);
+      return EXIT_FAILURE;
+    }
+    fprintf(json,"[\n");
+  }
+
   for(i=0; i<arguments.nhosts;++i){
     if(arguments.verbose > 0)
       fprintf(stdout,"Connecting to \"%s\"...\n",arguments.hosts[i]);
-    session=connect_host(arguments.hosts[i], arguments.verbose);
+    arguments.host=arguments.hosts[i];
+    session=benchmarks_connect(&arguments, arguments.hosts[i]);
     if(session != NULL && arguments.verbose > 0)
       fprintf(stdout,"Success\n");
     if(session == NULL){
       fprintf(stderr,"Errors occured, stopping\n");
       return EXIT_FAILURE;
     }
-    do_benchmarks(session, &arguments, arguments.hosts[i]);
+    regressions+=do_benchmarks(session, &arguments, arguments.hosts[i], json,
+        baseline);
     ssh_disconnect(session);
     ssh_free(session);
   }
+  if(json != NULL){
+    fprintf(json,"\n]\n");
+    fclose(json);
+  }
+  if(baseline != NULL)
+    fclose(baseline);
+  benchmarks_local_stop();
+  if(regressions > 0){
+    fprintf(stderr,"%d regression(s) from the baseline\n",regressions);
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
 
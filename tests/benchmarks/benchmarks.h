@@ -31,15 +31,59 @@
 
 enum libssh_benchmarks {
     BENCHMARK_RAW_UPLOAD=1,
+    BENCHMARK_SCP_UPLOAD,
+    BENCHMARK_SCP_DOWNLOAD,
+    BENCHMARK_SFTP_UPLOAD,
+    BENCHMARK_SFTP_DOWNLOAD,
+    BENCHMARK_SFTP_ASYNC_UPLOAD,
+    BENCHMARK_SFTP_ASYNC_DOWNLOAD,
+    BENCHMARK_SFTP_PIPELINED_UPLOAD,
+    BENCHMARK_SFTP_PIPELINED_DOWNLOAD,
+    BENCHMARK_SFTP_SMALL_FILES,
+    BENCHMARK_SFTP_READDIR,
+    BENCHMARK_HANDSHAKES,
+    BENCHMARK_HANDSHAKE_STORM,
+    BENCHMARK_IDLE_SESSIONS,
     BENCHMARK_NUMBER
 };
 
+/* size of the file of the transfer benchmarks */
+#define BENCHMARK_DATA_SIZE 0x1000000
+/* number of files of the small files and readdir benchmarks */
+#define BENCHMARK_FILES 200
+/* size of each of the small files */
+#define BENCHMARK_SMALL_FILE_SIZE 4096
+/* number of connections of the handshakes benchmark on a remote host */
+#define BENCHMARK_HANDSHAKE_COUNT 20
+/* number of concurrent clients of the handshake storm */
+#define BENCHMARK_STORM_CLIENTS 8
+/* number of sessions of the idle sessions benchmark */
+#define BENCHMARK_IDLE_COUNT 100
+/* a value below the baseline by more than that many percent is a regression */
+#define BENCHMARK_TOLERANCE 10
+
+/* where the benchmarks put their files on the remote host */
+#define BENCHMARK_REMOTE_FILE "/tmp/libssh_benchmark.dat"
+#define BENCHMARK_REMOTE_DIR "/tmp/libssh_benchmark.d"
+
 struct argument_s {
   const char *hosts[MAX_HOSTS_CONNECT];
   char benchmarks[BENCHMARK_NUMBER -1];
   int verbose;
   int nhosts;
   int ntests;
+  unsigned long datasize;
+  int nfiles;
+  const char *json; /* file the results are written to */
+  const char *baseline; /* results the new ones are compared with */
+  int tolerance;
+  int duration; /* seconds of each benchmark with the local server, or 0 */
+  int clients; /* of the handshake storm */
+  int sessions; /* of the idle sessions benchmark */
+  const char *kex; /* methods of the connections, NULL for the defaults */
+  const char *ciphers;
+  const char *hostkeys;
+  const char *host; /* being benchmarked */
 };
 
 /* latency.c */
@@ -54,9 +98,61 @@ int benchmarks_ssh_latency (ssh_session session, float *average);
 void timestamp_init(struct timestamp_struct *ts);
 float elapsed_time(struct timestamp_struct *ts);
 
+/* benchmarks.c */
+
+ssh_session benchmarks_connect(struct argument_s *args, const char *host);
+
+/* bench_local.c */
+
+int benchmarks_local_start(struct argument_s *args);
+int benchmarks_local_connect(ssh_session session);
+void benchmarks_local_stop(void);
+int benchmarks_running(struct argument_s *args, struct timestamp_struct *ts);
+int benchmarks_handshakes(ssh_session session, struct argument_s *args,
+    float *hps);
+
+/* bench_storm.c */
+
+int benchmarks_handshake_storm(ssh_session session, struct argument_s *args,
+    float *hps);
+
+/* bench_idle.c */
+
+int benchmarks_idle_sessions(ssh_session session, struct argument_s *args,
+    float *spm);
+
 /* bench_raw.c */
 
 int benchmarks_raw_up (ssh_session session, struct argument_s *args,
     float *bps);
 
+/* bench_scp.c */
+
+int benchmarks_exec(ssh_session session, const char *cmd);
+int benchmarks_remote_file(ssh_session session, struct argument_s *args);
+
+int benchmarks_scp_up (ssh_session session, struct argument_s *args,
+    float *bps);
+int benchmarks_scp_down (ssh_session session, struct argument_s *args,
+    float *bps);
+
+/* bench_sftp.c */
+
+int benchmarks_sftp_up (ssh_session session, struct argument_s *args,
+    float *bps);
+int benchmarks_sftp_down (ssh_session session, struct argument_s *args,
+    float *bps);
+int benchmarks_sftp_async_up (ssh_session session, struct argument_s *args,
+    float *bps);
+int benchmarks_sftp_async_down (ssh_session session, struct argument_s *args,
+    float *bps);
+int benchmarks_sftp_pipelined_up (ssh_session session,
+    struct argument_s *args, float *bps);
+int benchmarks_sftp_pipelined_down (ssh_session session,
+    struct argument_s *args, float *bps);
+int benchmarks_sftp_small_files (ssh_session session,
+    struct argument_s *args, float *fps);
+int benchmarks_sftp_readdir (ssh_session session, struct argument_s *args,
+    float *eps);
+
 #endif /* BENCHMARKS_H_ */
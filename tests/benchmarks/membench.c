@@ -0,0 +1,530 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * The memory of the client against the loopback server: what an idle
+ * session, an open channel, an SFTP request in flight and a packet cost,
+ * and what an idle session allocates as time goes by.
+ *
+ * Where the linker can wrap malloc, the allocations of libssh in the client
+ * thread are counted, with the bytes they ask for; those of the crypto
+ * library and of the server threads are not. The heap held (from the
+ * allocator of the C library) and the resident set size are those of the
+ * whole process, so they count the server too.
+ *
+ * The results can be written in JSON and compared with a previous run: the
+ * exit status is a failure if one grew beyond the tolerance.
+ */
+
+#define LIBSSH_STATIC
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <libssh/libssh.h>
+#include <libssh/callbacks.h>
+#ifdef WITH_SFTP
+#include <libssh/sftp.h>
+#endif
+
+#include "loopback.h"
+
+/* the sessions, channels, requests and packets of each scenario */
+#define MEMBENCH_COUNT 64
+/* the size of the packets */
+#define MEMBENCH_PACKET 1024
+/* the packets sent before the ones measured */
+#define MEMBENCH_WARMUP 256
+/* the time the sessions stay idle */
+#define MEMBENCH_IDLE_MS 1000
+/* the growth under which no result is a regression, whatever the baseline */
+#define MEMBENCH_SLACK 1.0
+
+#ifdef MEMBENCH_WRAP_MALLOC
+/* the calls of libssh are sent here by the linker, see CMakeLists.txt */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+/* by thread: only those of the client are looked at */
+static __thread unsigned long allocations;
+static __thread unsigned long allocated;
+
+void *__wrap_malloc(size_t size){
+  allocations++;
+  allocated+=size;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size){
+  allocations++;
+  allocated+=nmemb * size;
+  return __real_calloc(nmemb,size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size){
+  allocations++;
+  allocated+=size;
+  return __real_realloc(ptr,size);
+}
+#endif /* MEMBENCH_WRAP_MALLOC */
+
+struct membench_sample {
+  double heap;
+  double rss;
+  double allocations;
+  double allocated;
+};
+
+struct membench_result {
+  const char *name;
+  const char *unit;
+  double value;
+};
+
+#define MEMBENCH_RESULTS 32
+
+static struct membench_result results[MEMBENCH_RESULTS];
+static int nresults;
+
+/* the bytes held on the heap, -1 when the C library can't tell */
+static double membench_heap(void){
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 info=mallinfo2();
+
+  return (double)(info.uordblks + info.hblkhd);
+#elif defined(__GLIBC__)
+  struct mallinfo info=mallinfo();
+
+  return (double)info.uordblks + info.hblkhd;
+#else
+  return -1;
+#endif
+}
+
+/* the resident set size, -1 without /proc */
+static double membench_rss(void){
+  unsigned long size;
+  unsigned long resident;
+  FILE *statm;
+  int rc;
+
+  statm=fopen("/proc/self/statm","r");
+  if(statm == NULL)
+    return -1;
+  rc=fscanf(statm,"%lu %lu",&size,&resident);
+  fclose(statm);
+  if(rc != 2)
+    return -1;
+  return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+static void membench_sample(struct membench_sample *sample){
+  sample->heap=membench_heap();
+  sample->rss=membench_rss();
+#ifdef MEMBENCH_WRAP_MALLOC
+  sample->allocations=allocations;
+  sample->allocated=allocated;
+#else
+  sample->allocations=-1;
+  sample->allocated=-1;
+#endif
+}
+
+static void membench_add(const char *name, const char *unit, double value){
+  if(nresults == MEMBENCH_RESULTS)
+    return;
+  results[nresults].name=name;
+  results[nresults].unit=unit;
+  results[nresults].value=value;
+  nresults++;
+}
+
+/*
+ * adds what happened between the samples, divided by count: the bytes held,
+ * the resident set, the allocations and the bytes allocated
+ */
+static void membench_add_delta(const char *prefix, const char *by,
+    const struct membench_sample *before, const struct membench_sample *after,
+    unsigned int count){
+  static char names[MEMBENCH_RESULTS][64];
+  static char units[MEMBENCH_RESULTS][32];
+  const char *suffixes[]={"heap", "rss", "allocations", "allocated"};
+  const char *units_by[]={"bytes", "bytes", "allocations", "bytes"};
+  double deltas[4];
+  int i;
+
+  /* what the platform can't tell is -1 */
+  deltas[0]=before->heap < 0 ? -1 : after->heap - before->heap;
+  deltas[1]=before->rss < 0 ? -1 : after->rss - before->rss;
+  deltas[2]=before->allocations < 0 ? -1 :
+    after->allocations - before->allocations;
+  deltas[3]=before->allocated < 0 ? -1 : after->allocated - before->allocated;
+  for(i=0;i<4 && nresults < MEMBENCH_RESULTS;i++){
+    if((i == 0 && before->heap < 0) || (i == 1 && before->rss < 0) ||
+        (i >= 2 && before->allocations < 0))
+      continue;
+    snprintf(names[nresults],sizeof(names[0]),"%s_%s",prefix,suffixes[i]);
+    snprintf(units[nresults],sizeof(units[0]),"%s/%s",units_by[i],by);
+    membench_add(names[nresults],units[nresults],deltas[i] / count);
+  }
+}
+
+static ssh_session membench_connect(struct loopback_server *server){
+  ssh_session session=ssh_new();
+
+  if(session == NULL)
+    return NULL;
+  ssh_options_set(session,SSH_OPTIONS_USER,"benchmark");
+  if(loopback_connect(server,session) != SSH_OK ||
+      ssh_userauth_none(session,NULL) != SSH_AUTH_SUCCESS){
+    fprintf(stderr,"Error connecting to the loopback server : %s\n",
+        ssh_get_error(session));
+    ssh_free(session);
+    return NULL;
+  }
+  return session;
+}
+
+/* reads the line the command sends when it starts or ends */
+static int membench_read_line(ssh_channel channel){
+  char buffer[16];
+  int r;
+
+  do {
+    r=ssh_channel_read(channel,buffer,sizeof(buffer),0);
+  } while(r > 0 && buffer[r - 1] != '\n');
+  return r > 0 ? 0 : -1;
+}
+
+static ssh_channel membench_eater(ssh_session session){
+  ssh_channel channel=ssh_channel_new(session);
+
+  if(channel == NULL)
+    return NULL;
+  if(ssh_channel_open_session(channel) != SSH_OK ||
+      ssh_channel_request_exec(channel,"eater") != SSH_OK ||
+      membench_read_line(channel) < 0){
+    fprintf(stderr,"Error opening a channel : %s\n",ssh_get_error(session));
+    ssh_channel_free(channel);
+    return NULL;
+  }
+  return channel;
+}
+
+/*
+ * the idle sessions: what each one holds once authenticated, then what they
+ * allocate while they are polled without traffic
+ */
+static int membench_sessions(struct loopback_server *server){
+  ssh_session sessions[MEMBENCH_COUNT];
+  struct membench_sample before;
+  struct membench_sample after;
+  ssh_event event=NULL;
+  int rc=-1;
+  int i;
+
+  memset(sessions,0,sizeof(sessions));
+  membench_sample(&before);
+  for(i=0;i<MEMBENCH_COUNT;i++){
+    sessions[i]=membench_connect(server);
+    if(sessions[i] == NULL)
+      goto end;
+  }
+  membench_sample(&after);
+  membench_add_delta("session","session",&before,&after,MEMBENCH_COUNT);
+
+  /* polled together as by a server, nothing comes */
+  event=ssh_event_new();
+  if(event == NULL)
+    goto end;
+  for(i=0;i<MEMBENCH_COUNT;i++){
+    if(ssh_event_add_session(event,sessions[i]) != SSH_OK)
+      goto end;
+  }
+  membench_sample(&before);
+  for(i=0;i<MEMBENCH_IDLE_MS / 10;i++)
+    ssh_event_dopoll(event,10);
+  membench_sample(&after);
+  membench_add_delta("idle","session/s",&before,&after,
+      MEMBENCH_COUNT * MEMBENCH_IDLE_MS / 1000);
+  rc=0;
+end:
+  if(event != NULL){
+    for(i=0;i<MEMBENCH_COUNT && sessions[i] != NULL;i++)
+      ssh_event_remove_session(event,sessions[i]);
+    ssh_event_free(event);
+  }
+  for(i=0;i<MEMBENCH_COUNT && sessions[i] != NULL;i++){
+    ssh_disconnect(sessions[i]);
+    ssh_free(sessions[i]);
+  }
+  return rc;
+}
+
+/* the channels of a session, each running a command */
+static int membench_channels(ssh_session session){
+  ssh_channel channels[MEMBENCH_COUNT];
+  struct membench_sample before;
+  struct membench_sample after;
+  int rc=-1;
+  int i;
+
+  memset(channels,0,sizeof(channels));
+  membench_sample(&before);
+  for(i=0;i<MEMBENCH_COUNT;i++){
+    channels[i]=membench_eater(session);
+    if(channels[i] == NULL)
+      goto end;
+  }
+  membench_sample(&after);
+  membench_add_delta("channel","channel",&before,&after,MEMBENCH_COUNT);
+  rc=0;
+end:
+  for(i=0;i<MEMBENCH_COUNT && channels[i] != NULL;i++){
+    ssh_channel_send_eof(channels[i]);
+    ssh_channel_close(channels[i]);
+    ssh_channel_free(channels[i]);
+  }
+  return rc;
+}
+
+/* the packets of a channel, once its buffers have grown */
+static int membench_packets(ssh_session session){
+  static const char data[MEMBENCH_PACKET];
+  struct membench_sample before;
+  struct membench_sample after;
+  ssh_channel channel;
+  int rc=-1;
+  int i;
+
+  channel=membench_eater(session);
+  if(channel == NULL)
+    return -1;
+  for(i=0;i<MEMBENCH_WARMUP + MEMBENCH_COUNT;i++){
+    if(i == MEMBENCH_WARMUP)
+      membench_sample(&before);
+    if(ssh_channel_write(channel,data,sizeof(data)) != (int)sizeof(data)){
+      fprintf(stderr,"Error writing to a channel : %s\n",
+          ssh_get_error(session));
+      goto end;
+    }
+  }
+  membench_sample(&after);
+  membench_add_delta("packet","packet",&before,&after,MEMBENCH_COUNT);
+  rc=0;
+end:
+  ssh_channel_send_eof(channel);
+  membench_read_line(channel);
+  ssh_channel_close(channel);
+  ssh_channel_free(channel);
+  return rc;
+}
+
+#ifdef WITH_SFTP
+/* the read requests in flight on a file, before their replies are read */
+static int membench_sftp(ssh_session session){
+  struct membench_sample before;
+  struct membench_sample after;
+  uint32_t ids[MEMBENCH_COUNT];
+  char buffer[MEMBENCH_PACKET];
+  sftp_session sftp;
+  sftp_file file=NULL;
+  int rc=-1;
+  int n=0;
+  int i;
+
+  sftp=sftp_new(session);
+  if(sftp == NULL || sftp_init(sftp) < 0){
+    fprintf(stderr,"Error starting sftp : %s\n",ssh_get_error(session));
+    goto end;
+  }
+  file=sftp_open(sftp,"/membench",O_RDONLY,0);
+  if(file == NULL){
+    fprintf(stderr,"Error opening a file : %s\n",ssh_get_error(session));
+    goto end;
+  }
+  membench_sample(&before);
+  for(n=0;n<MEMBENCH_COUNT;n++){
+    rc=sftp_async_read_begin(file,sizeof(buffer));
+    if(rc < 0)
+      goto end;
+    ids[n]=rc;
+  }
+  membench_sample(&after);
+  membench_add_delta("sftp_request","request",&before,&after,MEMBENCH_COUNT);
+  rc=0;
+end:
+  for(i=0;i<n;i++)
+    sftp_async_read(file,buffer,sizeof(buffer),ids[i]);
+  if(file != NULL)
+    sftp_close(file);
+  if(sftp != NULL)
+    sftp_free(sftp);
+  return rc;
+}
+#endif /* WITH_SFTP */
+
+/* the value of a result in a file of JSON results, -1 if there is none */
+static double membench_baseline(FILE *baseline, const char *name){
+  char line[1024];
+  char key[128];
+  char *ptr;
+
+  snprintf(key,sizeof(key),"\"benchmark\": \"%s\"",name);
+  rewind(baseline);
+  while(fgets(line,sizeof(line),baseline) != NULL){
+    if(strstr(line,key) == NULL)
+      continue;
+    ptr=strstr(line,"\"value\": ");
+    if(ptr == NULL)
+      continue;
+    return strtod(ptr + strlen("\"value\": "),NULL);
+  }
+  return -1;
+}
+
+/* prints the results, returns the number of regressions */
+static int membench_report(FILE *json, FILE *baseline, int tolerance){
+  int regressions=0;
+  double base;
+  int i;
+
+  if(json != NULL)
+    fprintf(json,"[\n");
+  for(i=0;i<nresults;i++){
+    fprintf(stdout,"%-24s %14.1f %s\n",results[i].name,results[i].value,
+        results[i].unit);
+    if(json != NULL)
+      fprintf(json,"%s  {\"benchmark\": \"%s\", \"value\": %f, "
+          "\"unit\": \"%s\"}",i > 0 ? ",\n" : "",results[i].name,
+          results[i].value,results[i].unit);
+    if(baseline == NULL)
+      continue;
+    base=membench_baseline(baseline,results[i].name);
+    if(base < 0)
+      continue;
+    /* less is better here */
+    if(results[i].value > base * (100 + tolerance) / 100 + MEMBENCH_SLACK){
+      fprintf(stdout,"%-24s REGRESSION, %.1f above the baseline %.1f\n",
+          results[i].name,results[i].value - base,base);
+      regressions++;
+    }
+  }
+  if(json != NULL)
+    fprintf(json,"\n]\n");
+  return regressions;
+}
+
+static void usage(const char *program){
+  fprintf(stderr,"Usage : %s [--json FILE] [--baseline FILE] "
+      "[--tolerance PERCENT]\n"
+      "Measures the memory of the sessions, channels, sftp requests and\n"
+      "packets against a server in the process. The results written with\n"
+      "--json can be given to the next runs with --baseline: the exit\n"
+      "status is then a failure if one grew by more than the tolerance\n"
+      "(default 10%%).\n",program);
+}
+
+int main(int argc, char **argv){
+  struct loopback_server *server;
+  ssh_session session=NULL;
+  const char *json_file=NULL;
+  const char *baseline_file=NULL;
+  FILE *json=NULL;
+  FILE *baseline=NULL;
+  int tolerance=10;
+  int regressions;
+  int error=1;
+  int i;
+
+  for(i=1;i<argc;i++){
+    if(i + 1 < argc && strcmp(argv[i],"--json") == 0)
+      json_file=argv[++i];
+    else if(i + 1 < argc && strcmp(argv[i],"--baseline") == 0)
+      baseline_file=argv[++i];
+    else if(i + 1 < argc && strcmp(argv[i],"--tolerance") == 0)
+      tolerance=atoi(argv[++i]);
+    else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if(baseline_file != NULL){
+    baseline=fopen(baseline_file,"r");
+    if(baseline == NULL){
+      fprintf(stderr,"Can't open the baseline %s\n",baseline_file);
+      return EXIT_FAILURE;
+    }
+  }
+
+  /* the server runs in threads */
+  ssh_threads_set_callbacks(ssh_threads_get_pthread());
+  ssh_init();
+  server=loopback_server_new(MEMBENCH_PACKET * MEMBENCH_COUNT,1);
+  if(server == NULL)
+    goto end;
+  if(membench_sessions(server) < 0)
+    goto end;
+  session=membench_connect(server);
+  if(session == NULL || membench_channels(session) < 0 ||
+      membench_packets(session) < 0)
+    goto end;
+#ifdef WITH_SFTP
+  if(membench_sftp(session) < 0)
+    goto end;
+#endif
+  error=0;
+end:
+  if(session != NULL){
+    ssh_disconnect(session);
+    ssh_free(session);
+  }
+  loopback_server_free(server);
+  ssh_finalize();
+  if(error){
+    if(baseline != NULL)
+      fclose(baseline);
+    return EXIT_FAILURE;
+  }
+
+  if(json_file != NULL){
+    json=fopen(json_file,"w");
+    if(json == NULL)
+      fprintf(stderr,"Can't open %s\n",json_file);
+  }
+  regressions=membench_report(json,baseline,tolerance);
+  if(json != NULL)
+    fclose(json);
+  if(baseline != NULL)
+    fclose(baseline);
+  if(regressions > 0){
+    fprintf(stdout,"%d regressions\n",regressions);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
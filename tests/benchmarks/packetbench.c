@@ -0,0 +1,399 @@
+/*
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/*
+ * The packet layer alone: a session sends SSH2_MSG_IGNORE packets with
+ * packet_send() to a transport in memory, and another one receives them
+ * with ssh_packet_socket_callback(), for every cipher of the cipher table
+ * and every MAC, with payloads from 1 byte to the largest packet. Both
+ * sessions get the same keys without a key exchange, so nothing but the
+ * packet layer is measured.
+ *
+ * It uses the internal functions, and is linked with the static library.
+ * Where the linker can wrap malloc, the allocations of libssh (but not
+ * those of the crypto library) are counted.
+ */
+
+#define LIBSSH_STATIC
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/buffer.h"
+#include "libssh/crypto.h"
+#include "libssh/wrapper.h"
+#include "libssh/packet.h"
+#include "libssh/socket.h"
+#include "libssh/callbacks.h"
+#include "libssh/ssh2.h"
+#include "libssh/misc.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define PACKETBENCH_CYCLES
+#endif
+
+/* time spent on each combination of cipher, MAC and size */
+#define PACKETBENCH_US 200000
+/* the packets sent before the clock is looked at again */
+#define PACKETBENCH_BATCH 16
+
+static const uint32_t packetbench_sizes[]={
+  1, 64, 1024, 16384, 32768, 65536,
+  /* the largest payload of a packet: type, string length and padding */
+  MAX_PACKET_LEN - 64
+};
+
+#ifdef PACKETBENCH_WRAP_MALLOC
+/* the calls of libssh are sent here by the linker, see CMakeLists.txt */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static unsigned long allocations;
+
+void *__wrap_malloc(size_t size){
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size){
+  allocations++;
+  return __real_calloc(nmemb,size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size){
+  allocations++;
+  return __real_realloc(ptr,size);
+}
+#endif /* PACKETBENCH_WRAP_MALLOC */
+
+/* the bytes written by the sender, read by the benchmark for the receiver */
+struct packetbench_wire {
+  unsigned char *data;
+  size_t len;
+  size_t size;
+};
+
+static int wire_read(void *buffer, uint32_t len, void *userdata){
+  (void) buffer;
+  (void) len;
+  (void) userdata;
+  return SSH_AGAIN;
+}
+
+static int wire_writev(const struct iovec *iov, int iovcnt, void *userdata){
+  struct packetbench_wire *wire=userdata;
+  size_t total=0;
+  int i;
+
+  for(i=0;i<iovcnt;i++){
+    if(wire->len + iov[i].iov_len > wire->size)
+      return SSH_ERROR;
+    memcpy(wire->data + wire->len,iov[i].iov_base,iov[i].iov_len);
+    wire->len+=iov[i].iov_len;
+    total+=iov[i].iov_len;
+  }
+  return total;
+}
+
+static int wire_write(const void *buffer, uint32_t len, void *userdata){
+  struct iovec iov;
+
+  iov.iov_base=(void *)buffer;
+  iov.iov_len=len;
+  return wire_writev(&iov,1,userdata);
+}
+
+static int received;
+
+static int ignore_callback(ssh_session session, uint8_t type,
+    ssh_buffer packet, void *user){
+  (void) session;
+  (void) type;
+  (void) packet;
+  (void) user;
+  received++;
+  return SSH_PACKET_USED;
+}
+
+static ssh_packet_callback ignore_callbacks[]={
+  ignore_callback
+};
+
+static struct ssh_packet_callbacks_struct ignore_packet_callbacks={
+  .start=SSH2_MSG_IGNORE,
+  .n_callbacks=1,
+  .callbacks=ignore_callbacks,
+  .user=NULL
+};
+
+static uint64_t packetbench_ticks(void){
+#ifdef PACKETBENCH_CYCLES
+  return __rdtsc();
+#else
+  return ssh_timestamp_us() * 1000;
+#endif
+}
+
+static struct crypto_struct *packetbench_cipher(struct crypto_struct *tab){
+  struct crypto_struct *cipher=malloc(sizeof(struct crypto_struct));
+
+  if(cipher != NULL)
+    memcpy(cipher,tab,sizeof(*cipher));
+  return cipher;
+}
+
+/*
+ * a session whose current crypto is cipher and mac in both directions, with
+ * keys which only depend on the algorithms: the packets a session sends are
+ * those another one can receive
+ */
+static ssh_session packetbench_session(struct crypto_struct *cipher,
+    struct ssh_hmac_struct *mac, ssh_transport_callbacks transport, int fd){
+  struct ssh_crypto_struct *crypto;
+  ssh_session session;
+
+  session=ssh_new();
+  if(session == NULL)
+    return NULL;
+  session->version=2;
+  crypto=crypto_new();
+  if(crypto == NULL){
+    ssh_free(session);
+    return NULL;
+  }
+  session->current_crypto=crypto;
+  memset(crypto->encryptkey,0x4b,sizeof(crypto->encryptkey));
+  memset(crypto->decryptkey,0x4b,sizeof(crypto->decryptkey));
+  memset(crypto->encryptIV,0x49,sizeof(crypto->encryptIV));
+  memset(crypto->decryptIV,0x49,sizeof(crypto->decryptIV));
+  memset(crypto->encryptMAC,0x4d,sizeof(crypto->encryptMAC));
+  memset(crypto->decryptMAC,0x4d,sizeof(crypto->decryptMAC));
+  crypto->out_cipher=packetbench_cipher(cipher);
+  crypto->in_cipher=packetbench_cipher(cipher);
+  crypto->out_mac=mac;
+  crypto->in_mac=mac;
+  if(crypto->out_cipher == NULL || crypto->in_cipher == NULL ||
+      crypt_set_keys(crypto) < 0 ||
+      ssh_set_transport_callbacks(session,transport,fd) < 0){
+    ssh_free(session);
+    return NULL;
+  }
+  ssh_packet_set_callbacks(session,&ignore_packet_callbacks);
+  return session;
+}
+
+/* sends one SSH2_MSG_IGNORE packet with a string of size bytes */
+static int packetbench_send(ssh_session session, const void *data,
+    uint32_t size){
+  if(buffer_add_u8(session->out_buffer,SSH2_MSG_IGNORE) < 0 ||
+      buffer_add_u32(session->out_buffer,htonl(size)) < 0 ||
+      buffer_add_data(session->out_buffer,data,size) < 0)
+    return -1;
+  ssh_socket_set_write_wontblock(session->socket);
+  return packet_send(session) == SSH_OK ? 0 : -1;
+}
+
+struct packetbench_result {
+  unsigned long packets;
+  uint64_t bytes;
+  uint64_t send_ticks;
+  uint64_t receive_ticks;
+  uint64_t us;
+  unsigned long send_allocations;
+  unsigned long receive_allocations;
+};
+
+/* sends and receives packets of size bytes for PACKETBENCH_US */
+static int packetbench_run(struct crypto_struct *cipher,
+    struct ssh_hmac_struct *mac, uint32_t size,
+    struct packetbench_result *result){
+  struct ssh_transport_callbacks_struct transport;
+  struct packetbench_wire wire;
+  ssh_session sender=NULL;
+  ssh_session receiver=NULL;
+  unsigned char *data=NULL;
+  uint64_t start;
+  uint64_t t;
+  size_t consumed;
+  int fds[2];
+  int rc=-1;
+  int i;
+
+  memset(result,0,sizeof(*result));
+  if(pipe(fds) < 0)
+    return -1;
+  memset(&transport,0,sizeof(transport));
+  transport.userdata=&wire;
+  transport.read=wire_read;
+  transport.write=wire_write;
+  transport.writev=wire_writev;
+  ssh_callbacks_init(&transport);
+  wire.size=MAX_PACKET_LEN + 1024;
+  wire.len=0;
+  wire.data=malloc(wire.size);
+  data=calloc(1,size);
+  sender=packetbench_session(cipher,mac,&transport,fds[1]);
+  receiver=packetbench_session(cipher,mac,&transport,fds[0]);
+  if(wire.data == NULL || data == NULL || sender == NULL || receiver == NULL)
+    goto end;
+
+  received=0;
+  start=ssh_timestamp_us();
+  do {
+    for(i=0;i<PACKETBENCH_BATCH;i++){
+#ifdef PACKETBENCH_WRAP_MALLOC
+      result->send_allocations-=allocations;
+#endif
+      t=packetbench_ticks();
+      if(packetbench_send(sender,data,size) < 0){
+        fprintf(stderr,"Error sending a packet : %s\n",
+            ssh_get_error(sender));
+        goto end;
+      }
+      result->send_ticks+=packetbench_ticks() - t;
+#ifdef PACKETBENCH_WRAP_MALLOC
+      result->send_allocations+=allocations;
+      result->receive_allocations-=allocations;
+#endif
+      t=packetbench_ticks();
+      consumed=ssh_packet_socket_callback(wire.data,wire.len,receiver);
+      result->receive_ticks+=packetbench_ticks() - t;
+#ifdef PACKETBENCH_WRAP_MALLOC
+      result->receive_allocations+=allocations;
+#endif
+      if(consumed != wire.len || received != (int)result->packets + 1){
+        fprintf(stderr,"Error receiving a packet : %s\n",
+            ssh_get_error(receiver));
+        goto end;
+      }
+      wire.len=0;
+      result->packets++;
+      result->bytes+=size;
+    }
+    result->us=ssh_timestamp_us() - start;
+  } while(result->us < PACKETBENCH_US);
+  rc=0;
+end:
+  ssh_free(sender);
+  ssh_free(receiver);
+  free(wire.data);
+  free(data);
+  close(fds[0]);
+  close(fds[1]);
+  return rc;
+}
+
+static void packetbench_report(const char *cipher, const char *mac,
+    uint32_t size, struct packetbench_result *result){
+  char send_allocations[16]="-";
+  char receive_allocations[16]="-";
+
+#ifdef PACKETBENCH_WRAP_MALLOC
+  snprintf(send_allocations,sizeof(send_allocations),"%.2f",
+      (double)result->send_allocations / result->packets);
+  snprintf(receive_allocations,sizeof(receive_allocations),"%.2f",
+      (double)result->receive_allocations / result->packets);
+#endif
+  fprintf(stdout,"%-30s %-30s %7u %10.2f %10.2f %12.0f %9s %9s\n",cipher,mac,
+      size,(double)result->send_ticks / result->bytes,
+      (double)result->receive_ticks / result->bytes,
+      result->packets * 1000000.0 / result->us,send_allocations,
+      receive_allocations);
+}
+
+static int packetbench_wanted(const char *name, const char *wanted){
+  return wanted == NULL || strcmp(name,wanted) == 0;
+}
+
+static void usage(const char *program){
+  fprintf(stderr,"Usage : %s [cipher [mac]]\n"
+      "Sends and receives packets of every size with the ciphers and MACs of\n"
+      "the packet layer, or only the ones given.\n",program);
+}
+
+int main(int argc, char **argv){
+  struct crypto_struct *ciphers;
+  struct ssh_hmac_struct *macs;
+  struct packetbench_result result;
+  const char *wanted_cipher=argc > 1 ? argv[1] : NULL;
+  const char *wanted_mac=argc > 2 ? argv[2] : NULL;
+  unsigned int s;
+  int found=0;
+  int i;
+  int j;
+
+  if(argc > 3 || (argc > 1 && argv[1][0] == '-')){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  ssh_init();
+  ciphers=ssh_get_ciphertab();
+  macs=ssh_get_hmactab();
+  fprintf(stdout,"%-30s %-30s %7s %10s %10s %12s %9s %9s\n","cipher","mac",
+      "bytes",
+#ifdef PACKETBENCH_CYCLES
+      "send c/B","recv c/B",
+#else
+      "send ns/B","recv ns/B",
+#endif
+      "packets/s","send a/p","recv a/p");
+  for(i=0;ciphers[i].name != NULL;i++){
+    /* the ssh1 ciphers have no packets here */
+    if(strstr(ciphers[i].name,"-ssh1") != NULL ||
+        !packetbench_wanted(ciphers[i].name,wanted_cipher))
+      continue;
+    /* the same name twice in the table: only the first one is used */
+    for(j=0;j<i && strcmp(ciphers[j].name,ciphers[i].name) != 0;j++)
+      ;
+    if(j < i)
+      continue;
+    for(j=0;macs[j].name != NULL;j++){
+      /* the AEAD ciphers have their own tag, any MAC does */
+      if(ciphers[i].tag_size > 0 ? j > 0 :
+          !packetbench_wanted(macs[j].name,wanted_mac))
+        continue;
+      for(s=0;s<sizeof(packetbench_sizes) / sizeof(packetbench_sizes[0]);s++){
+        if(packetbench_run(&ciphers[i],&macs[j],packetbench_sizes[s],
+              &result) < 0){
+          fprintf(stderr,"%s %s: failed\n",ciphers[i].name,macs[j].name);
+          ssh_finalize();
+          return EXIT_FAILURE;
+        }
+        packetbench_report(ciphers[i].name,
+            ciphers[i].tag_size > 0 ? "(aead)" : macs[j].name,
+            packetbench_sizes[s],&result);
+        found++;
+      }
+    }
+  }
+  ssh_finalize();
+  if(found == 0){
+    fprintf(stderr,"No such cipher or MAC\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
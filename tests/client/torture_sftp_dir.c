@@ -1,5 +1,8 @@
 #define LIBSSH_STATIC
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "torture.h"
 #include "sftp.c"
 
@@ -57,10 +60,81 @@ static void torture_sftp_mkdir(void **state) {
     assert_false(torture_isdir(tmpdir));
 }
 
+/* more than a batch of names */
+#define DIR_FILES 300
+
+static void torture_sftp_dir_next(void **state) {
+    struct torture_sftp *t = *state;
+    char seen[DIR_FILES];
+    char path[128];
+    sftp_dir_entry entry;
+    sftp_attributes attr;
+    sftp_dir dir;
+    int count = 0;
+    int fd;
+    int i;
+
+    assert_false(t == NULL);
+
+    for (i = 0; i < DIR_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/file%03d", t->testdir, i);
+        fd = open(path, O_WRONLY | O_CREAT, 0644);
+        assert_true(fd >= 0);
+        assert_int_equal(write(fd, path, i % 7), i % 7);
+        close(fd);
+    }
+
+    dir = sftp_opendir(t->sftp, t->testdir);
+    assert_false(dir == NULL);
+    memset(seen, 0, sizeof(seen));
+    while ((entry = sftp_dir_next(dir)) != NULL) {
+        if (strncmp(sftp_dir_entry_name(entry), "file", 4) != 0) {
+            continue;
+        }
+        i = atoi(sftp_dir_entry_name(entry) + 4);
+        assert_true(i >= 0 && i < DIR_FILES);
+        assert_false(seen[i]);
+        seen[i] = 1;
+        count++;
+
+        /* parsed once, on demand */
+        attr = sftp_dir_entry_attributes(dir, entry);
+        assert_false(attr == NULL);
+        assert_true(sftp_dir_entry_attributes(dir, entry) == attr);
+        assert_string_equal(attr->name, sftp_dir_entry_name(entry));
+        assert_true(attr->size == (uint64_t) (i % 7));
+    }
+    assert_true(sftp_dir_eof(dir));
+    assert_int_equal(count, DIR_FILES);
+    assert_int_equal(sftp_closedir(dir), 0);
+
+    /* sftp_readdir() shares the same batches */
+    dir = sftp_opendir(t->sftp, t->testdir);
+    assert_false(dir == NULL);
+    count = 0;
+    while ((attr = sftp_readdir(t->sftp, dir)) != NULL) {
+        if (strncmp(attr->name, "file", 4) == 0) {
+            count++;
+        }
+        sftp_attributes_free(attr);
+    }
+    assert_true(sftp_dir_eof(dir));
+    assert_int_equal(count, DIR_FILES);
+
+    /* the READDIR sent ahead isn't left behind */
+    assert_int_equal(sftp_closedir(dir), 0);
+    dir = sftp_opendir(t->sftp, t->testdir);
+    assert_false(dir == NULL);
+    assert_false(sftp_dir_next(dir) == NULL);
+    assert_int_equal(sftp_closedir(dir), 0);
+    assert_int_equal(t->sftp->queue_count, 0);
+}
+
 int torture_run_tests(void) {
     int rc;
     const UnitTest tests[] = {
-        unit_test_setup_teardown(torture_sftp_mkdir, setup, teardown)
+        unit_test_setup_teardown(torture_sftp_mkdir, setup, teardown),
+        unit_test_setup_teardown(torture_sftp_dir_next, setup, teardown)
     };
 
     ssh_init();
@@ -0,0 +1,233 @@
+#define LIBSSH_STATIC
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "sftp.c"
+
+/* not a multiple of the chunk size, to finish on a short read */
+#define DOWNLOAD_SIZE (256 * 1024 + 123)
+
+struct download_check {
+    const char *expected;
+    uint64_t offset;
+};
+
+static void setup(void **state) {
+    ssh_session session;
+    struct torture_sftp *t;
+    const char *host;
+    const char *user;
+    const char *password;
+
+    host = getenv("TORTURE_HOST");
+    if (host == NULL) {
+        host = "localhost";
+    }
+
+    user = getenv("TORTURE_USER");
+    password = getenv("TORTURE_PASSWORD");
+
+    session = torture_ssh_session(host, user, password);
+    assert_false(session == NULL);
+    t = torture_sftp_session(session);
+    assert_false(t == NULL);
+
+    *state = t;
+}
+
+static void teardown(void **state) {
+    struct torture_sftp *t = *state;
+
+    assert_false(t == NULL);
+
+    torture_rmdirs(t->testdir);
+    torture_sftp_close(t);
+}
+
+static int download_cb(const void *data, size_t len, uint64_t offset,
+    void *userdata) {
+    struct download_check *check = userdata;
+
+    /* the data comes in file order */
+    assert_true(offset == check->offset);
+    assert_true(offset + len <= DOWNLOAD_SIZE);
+    assert_memory_equal(data, check->expected + offset, len);
+    check->offset += len;
+
+    return 0;
+}
+
+static void torture_sftp_download_file(void **state) {
+    struct torture_sftp *t = *state;
+    struct sftp_download_options_struct opts;
+    struct sftp_download_sink_struct sink;
+    struct download_check check;
+    char path[128];
+    char copy[128];
+    char *data;
+    char *read_back;
+    sftp_file file;
+    int64_t n;
+    int fd;
+    int i;
+
+    assert_false(t == NULL);
+
+    data = malloc(DOWNLOAD_SIZE);
+    read_back = malloc(DOWNLOAD_SIZE);
+    assert_true(data != NULL && read_back != NULL);
+    for (i = 0; i < DOWNLOAD_SIZE; i++) {
+        data[i] = (char) (i * 7 + i / 4096);
+    }
+
+    snprintf(path, sizeof(path), "%s/download_test", t->testdir);
+    snprintf(copy, sizeof(copy), "%s/download_copy", t->testdir);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, data, DOWNLOAD_SIZE), DOWNLOAD_SIZE);
+    close(fd);
+
+    /* into a callback, with small reads to have many in flight */
+    file = sftp_open(t->sftp, path, O_RDONLY, 0);
+    assert_false(file == NULL);
+    memset(&sink, 0, sizeof(sink));
+    sink.write_function = download_cb;
+    sink.userdata = &check;
+    check.expected = data;
+    check.offset = 0;
+    opts.requests = 16;
+    opts.chunk_size = 4096;
+    n = sftp_download(file, &sink, &opts);
+    assert_true(n == DOWNLOAD_SIZE);
+    assert_true(check.offset == DOWNLOAD_SIZE);
+    assert_true(sftp_tell64(file) == DOWNLOAD_SIZE);
+    assert_int_equal(sftp_download(file, &sink, &opts), 0);
+    sftp_close(file);
+
+    /* into a file descriptor, from an offset, with the defaults */
+    file = sftp_open(t->sftp, path, O_RDONLY, 0);
+    assert_false(file == NULL);
+    assert_int_equal(sftp_seek(file, 1000), 0);
+    fd = open(copy, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    memset(&sink, 0, sizeof(sink));
+    sink.fd = fd;
+    n = sftp_download(file, &sink, NULL);
+    assert_true(n == DOWNLOAD_SIZE - 1000);
+    assert_true(lseek(fd, 0, SEEK_CUR) == DOWNLOAD_SIZE - 1000);
+    sftp_close(file);
+    assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+    assert_int_equal(read(fd, read_back, DOWNLOAD_SIZE), DOWNLOAD_SIZE - 1000);
+    assert_memory_equal(read_back, data + 1000, DOWNLOAD_SIZE - 1000);
+    close(fd);
+
+    /* appending, where the data is written in file order */
+    file = sftp_open(t->sftp, path, O_RDONLY, 0);
+    assert_false(file == NULL);
+    fd = open(copy, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, "head", 4), 4);
+    sink.fd = fd;
+    n = sftp_download(file, &sink, NULL);
+    assert_true(n == DOWNLOAD_SIZE);
+    sftp_close(file);
+    assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+    assert_int_equal(read(fd, read_back, 4), 4);
+    assert_memory_equal(read_back, "head", 4);
+    assert_int_equal(read(fd, read_back, DOWNLOAD_SIZE), DOWNLOAD_SIZE);
+    assert_memory_equal(read_back, data, DOWNLOAD_SIZE);
+    close(fd);
+
+    free(data);
+    free(read_back);
+}
+
+static void torture_sftp_download_resume(void **state) {
+    struct torture_sftp *t = *state;
+    struct sftp_download_sink_struct sink;
+    char path[128];
+    char copy[128];
+    char *data;
+    char *read_back;
+    sftp_file file;
+    int64_t n;
+    int fd;
+    int i;
+
+    assert_false(t == NULL);
+
+    data = malloc(DOWNLOAD_SIZE);
+    read_back = malloc(DOWNLOAD_SIZE);
+    assert_true(data != NULL && read_back != NULL);
+    for (i = 0; i < DOWNLOAD_SIZE; i++) {
+        data[i] = (char) (i * 13 + i / 1000);
+    }
+
+    snprintf(path, sizeof(path), "%s/resume_test", t->testdir);
+    snprintf(copy, sizeof(copy), "%s/resume_copy", t->testdir);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, data, DOWNLOAD_SIZE), DOWNLOAD_SIZE);
+    close(fd);
+
+    /* an interrupted download goes on from where it stopped */
+    fd = open(copy, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, data, 100000), 100000);
+    file = sftp_open(t->sftp, path, O_RDONLY, 0);
+    assert_false(file == NULL);
+    assert_true(sftp_download_resume(file, fd, 1) == 100000);
+    assert_true(sftp_tell64(file) == 100000);
+    memset(&sink, 0, sizeof(sink));
+    sink.fd = fd;
+    n = sftp_download(file, &sink, NULL);
+    assert_true(n == DOWNLOAD_SIZE - 100000);
+    sftp_close(file);
+    assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+    assert_int_equal(read(fd, read_back, DOWNLOAD_SIZE), DOWNLOAD_SIZE);
+    assert_memory_equal(read_back, data, DOWNLOAD_SIZE);
+    close(fd);
+
+    /* a part which doesn't match starts over */
+    fd = open(copy, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, data, 100000), 100000);
+    assert_int_equal(pwrite(fd, "x", 1, 99000), 1);
+    file = sftp_open(t->sftp, path, O_RDONLY, 0);
+    assert_false(file == NULL);
+    assert_true(sftp_download_resume(file, fd, 0) == 100000);
+    assert_true(sftp_download_resume(file, fd, 1) == 0);
+    assert_true(lseek(fd, 0, SEEK_END) == 0);
+    n = sftp_download(file, &sink, NULL);
+    assert_true(n == DOWNLOAD_SIZE);
+    sftp_close(file);
+
+    /* so does a local file bigger than the remote one */
+    file = sftp_open(t->sftp, path, O_RDONLY, 0);
+    assert_false(file == NULL);
+    assert_int_equal(write(fd, data, 10), 10);
+    assert_true(sftp_download_resume(file, fd, 0) == 0);
+    sftp_close(file);
+    close(fd);
+
+    free(data);
+    free(read_back);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_sftp_download_file, setup, teardown),
+        unit_test_setup_teardown(torture_sftp_download_resume, setup,
+            teardown)
+    };
+
+    ssh_init();
+
+    rc = run_tests(tests);
+    ssh_finalize();
+
+    return rc;
+}
@@ -0,0 +1,138 @@
+#define LIBSSH_STATIC
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "sftp.c"
+
+/* more than SFTP_STAT_REQUESTS */
+#define STAT_FILES 200
+
+struct stat_check {
+    size_t done;
+    size_t failed;
+    char seen[STAT_FILES + 1];
+};
+
+static void setup(void **state) {
+    ssh_session session;
+    struct torture_sftp *t;
+    const char *host;
+    const char *user;
+    const char *password;
+
+    host = getenv("TORTURE_HOST");
+    if (host == NULL) {
+        host = "localhost";
+    }
+
+    user = getenv("TORTURE_USER");
+    password = getenv("TORTURE_PASSWORD");
+
+    session = torture_ssh_session(host, user, password);
+    assert_false(session == NULL);
+    t = torture_sftp_session(session);
+    assert_false(t == NULL);
+
+    *state = t;
+}
+
+static void teardown(void **state) {
+    struct torture_sftp *t = *state;
+
+    assert_false(t == NULL);
+
+    torture_rmdirs(t->testdir);
+    torture_sftp_close(t);
+}
+
+static int stat_cb(sftp_session sftp, size_t index, const char *path,
+    sftp_attributes attr, void *userdata) {
+    struct stat_check *check = userdata;
+
+    (void) sftp;
+    (void) path;
+
+    /* each path is reported once */
+    assert_true(index <= STAT_FILES);
+    assert_false(check->seen[index]);
+    check->seen[index] = 1;
+    check->done++;
+    if (attr == NULL) {
+        check->failed++;
+        return 0;
+    }
+    assert_true(attr->size == index % 11);
+    sftp_attributes_free(attr);
+
+    return 0;
+}
+
+static void torture_sftp_stat_many(void **state) {
+    struct torture_sftp *t = *state;
+    sftp_attributes results[STAT_FILES + 1];
+    const char *paths[STAT_FILES + 1];
+    char names[STAT_FILES + 1][128];
+    struct stat_check check;
+    sftp_attributes attr;
+    int fd;
+    int i;
+
+    assert_false(t == NULL);
+
+    for (i = 0; i < STAT_FILES; i++) {
+        snprintf(names[i], sizeof(names[i]), "%s/file%03d", t->testdir, i);
+        fd = open(names[i], O_WRONLY | O_CREAT, 0644);
+        assert_true(fd >= 0);
+        assert_int_equal(write(fd, names[i], i % 11), i % 11);
+        close(fd);
+        paths[i] = names[i];
+    }
+    /* the last one doesn't exist */
+    snprintf(names[STAT_FILES], sizeof(names[STAT_FILES]), "%s/missing",
+        t->testdir);
+    paths[STAT_FILES] = names[STAT_FILES];
+
+    assert_int_equal(sftp_stat_many(t->sftp, paths, STAT_FILES + 1, results),
+        SSH_ERROR);
+    for (i = 0; i < STAT_FILES; i++) {
+        assert_false(results[i] == NULL);
+        assert_true(results[i]->size == (uint64_t) (i % 11));
+        sftp_attributes_free(results[i]);
+    }
+    assert_true(results[STAT_FILES] == NULL);
+
+    assert_int_equal(sftp_lstat_many(t->sftp, paths, STAT_FILES, results),
+        SSH_OK);
+    for (i = 0; i < STAT_FILES; i++) {
+        assert_false(results[i] == NULL);
+        sftp_attributes_free(results[i]);
+    }
+
+    memset(&check, 0, sizeof(check));
+    assert_int_equal(sftp_stat_many_callback(t->sftp, paths, STAT_FILES + 1,
+        1, stat_cb, &check), SSH_ERROR);
+    assert_int_equal(check.done, STAT_FILES + 1);
+    assert_int_equal(check.failed, 1);
+
+    /* the session is still usable */
+    attr = sftp_stat(t->sftp, paths[0]);
+    assert_false(attr == NULL);
+    sftp_attributes_free(attr);
+    assert_int_equal(t->sftp->queue_count, 0);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_sftp_stat_many, setup, teardown)
+    };
+
+    ssh_init();
+
+    rc = run_tests(tests);
+    ssh_finalize();
+
+    return rc;
+}
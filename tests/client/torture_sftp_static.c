@@ -17,10 +17,183 @@ static void torture_sftp_ext_new(void **state) {
     sftp_ext_free(x);
 }
 
+static void torture_sftp_queue(void **state) {
+    sftp_session sftp;
+    sftp_message msg;
+    ssh_session session;
+    uint32_t id;
+
+    (void) state;
+
+    session = ssh_new();
+    assert_false(session == NULL);
+    sftp = calloc(1, sizeof(struct sftp_session_struct));
+    assert_false(sftp == NULL);
+    sftp->session = session;
+    sftp->channel = ssh_channel_new(session);
+    assert_false(sftp->channel == NULL);
+
+    /* more replies than buckets, queued out of order */
+    for (id = 100; id > 0; id--) {
+        msg = sftp_message_new(sftp);
+        assert_false(msg == NULL);
+        msg->id = id * 3;
+        assert_int_equal(sftp_enqueue(sftp, msg), 0);
+    }
+    assert_true(sftp->queue_size >= 100);
+    assert_true(sftp_dequeue(sftp, 1) == NULL);
+
+    for (id = 1; id <= 100; id++) {
+        msg = sftp_dequeue(sftp, id * 3);
+        assert_false(msg == NULL);
+        assert_int_equal(msg->id, id * 3);
+        sftp_message_free(msg);
+    }
+    assert_int_equal(sftp->queue_count, 0);
+    assert_true(sftp_dequeue(sftp, 3) == NULL);
+
+    /* the freed messages are reused */
+    assert_int_equal(sftp->free_count, SFTP_FREE_MESSAGES);
+    msg = sftp_message_new(sftp);
+    assert_false(msg == NULL);
+    assert_int_equal(sftp->free_count, SFTP_FREE_MESSAGES - 1);
+    assert_int_equal(buffer_get_rest_len(msg->payload), 0);
+    assert_int_equal(sftp_enqueue(sftp, msg), 0);
+
+    /* a message whose payload has been taken isn't kept */
+    msg = sftp_message_new(sftp);
+    assert_false(msg == NULL);
+    ssh_buffer_free(msg->payload);
+    msg->payload = NULL;
+    sftp_message_free(msg);
+    assert_int_equal(sftp->free_count, SFTP_FREE_MESSAGES - 2);
+
+    /* sftp_free() releases the queued and the free messages */
+    sftp_free(sftp);
+    ssh_free(session);
+}
+
+static void torture_sftp_limits(void **state) {
+    sftp_session sftp;
+    sftp_limits_t limits;
+    ssh_session session;
+
+    (void) state;
+
+    session = ssh_new();
+    assert_false(session == NULL);
+    sftp = calloc(1, sizeof(struct sftp_session_struct));
+    assert_false(sftp == NULL);
+    sftp->session = session;
+    sftp->channel = ssh_channel_new(session);
+    assert_false(sftp->channel == NULL);
+
+    /* a server without limits@openssh.com isn't asked */
+    assert_true(sftp_limits(sftp) == NULL);
+    assert_int_equal(sftp->limits_asked, 1);
+    assert_int_equal(sftp_limit_chunk(sftp, 65536, 0), 65536);
+
+    sftp->limits = calloc(1, sizeof(struct sftp_limits_struct));
+    assert_false(sftp->limits == NULL);
+    sftp->limits->max_read_length = 16384;
+    assert_int_equal(sftp_limit_chunk(sftp, 65536, 0), 16384);
+    assert_int_equal(sftp_limit_chunk(sftp, 4096, 0), 4096);
+    /* 0 is no limit */
+    assert_int_equal(sftp_limit_chunk(sftp, 65536, 1), 65536);
+
+    limits = sftp_limits(sftp);
+    assert_false(limits == NULL);
+    assert_true(limits != sftp->limits);
+    assert_true(limits->max_read_length == 16384);
+    sftp_limits_free(limits);
+
+    sftp_free(sftp);
+    ssh_free(session);
+}
+
+static void torture_sftp_parse_attr(void **state) {
+    struct sftp_session_struct sftp;
+    const char *longname = "-rw-r--r--    1 alice    staff  1234 Jan  1 00:00 f";
+    sftp_attributes attr;
+    ssh_session session;
+    ssh_buffer buffer;
+    ssh_string type;
+    ssh_string data;
+
+    (void) state;
+
+    session = ssh_new();
+    assert_false(session == NULL);
+    session->openssh = 1;
+    memset(&sftp, 0, sizeof(sftp));
+    sftp.session = session;
+    sftp.version = 3;
+
+    buffer = ssh_buffer_new();
+    assert_false(buffer == NULL);
+    assert_int_equal(buffer_pack(buffer, "ssdqddsssss", "f", longname,
+          SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_PERMISSIONS |
+          SSH_FILEXFER_ATTR_EXTENDED, (uint64_t) 1234, 0100644, 2,
+          "a@example.com", "1", "b@example.com", "22", "next"), 0);
+
+    /* the fixed fields are parsed, the pairs are kept for later */
+    attr = sftp_parse_attr(&sftp, buffer, 1);
+    assert_false(attr == NULL);
+    assert_string_equal(attr->name, "f");
+    assert_string_equal(attr->longname, longname);
+    assert_string_equal(attr->owner, "alice");
+    assert_string_equal(attr->group, "staff");
+    assert_true(attr->size == 1234);
+    assert_int_equal(attr->type, SSH_FILEXFER_TYPE_REGULAR);
+    assert_int_equal(attr->extended_count, 2);
+    assert_int_equal(ssh_string_len(attr->extended_type), 13);
+    assert_memory_equal(ssh_string_data(attr->extended_data), "22", 2);
+
+    assert_int_equal(sftp_attributes_get_extended(attr, 0, &type, &data),
+        SSH_OK);
+    assert_int_equal(ssh_string_len(type), 13);
+    assert_memory_equal(ssh_string_data(type), "a@example.com", 13);
+    assert_int_equal(ssh_string_len(data), 1);
+    assert_memory_equal(ssh_string_data(data), "1", 1);
+    assert_int_equal(sftp_attributes_get_extended(attr, 1, NULL, &data),
+        SSH_OK);
+    assert_memory_equal(ssh_string_data(data), "22", 2);
+    assert_int_equal(sftp_attributes_get_extended(attr, 2, &type, &data),
+        SSH_ERROR);
+    sftp_attributes_free(attr);
+
+    /* the buffer is left after the attributes */
+    assert_int_equal(buffer_get_rest_len(buffer), 8);
+
+    /* a short longname gives empty fields */
+    buffer_reinit(buffer);
+    assert_int_equal(buffer_pack(buffer, "ssd", "g", "-rw", 0), 0);
+    attr = sftp_parse_attr(&sftp, buffer, 1);
+    assert_false(attr == NULL);
+    assert_string_equal(attr->owner, "");
+    assert_string_equal(attr->group, "");
+    assert_int_equal(attr->extended_count, 0);
+    assert_int_equal(sftp_attributes_get_extended(attr, 0, &type, &data),
+        SSH_ERROR);
+    sftp_attributes_free(attr);
+
+    /* so does a missing pair */
+    buffer_reinit(buffer);
+    assert_int_equal(buffer_pack(buffer, "ssdds", "h", longname,
+          SSH_FILEXFER_ATTR_EXTENDED, 1, "lonely"), 0);
+    assert_true(sftp_parse_attr(&sftp, buffer, 1) == NULL);
+
+    ssh_buffer_free(buffer);
+    ssh_free(session);
+}
+
 int torture_run_tests(void) {
     int rc;
     const UnitTest tests[] = {
         unit_test(torture_sftp_ext_new),
+        unit_test(torture_sftp_queue),
+        unit_test(torture_sftp_limits),
+        unit_test(torture_sftp_parse_attr),
     };
 
     ssh_init();
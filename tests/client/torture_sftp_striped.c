@@ -0,0 +1,146 @@
+#define LIBSSH_STATIC
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "sftp.c"
+
+/* not a multiple of the chunk size */
+#define STRIPED_SIZE (1024 * 1024 + 4321)
+
+/* a second channel on the session of t, and a session of its own */
+struct striped_sessions {
+    struct torture_sftp *t;
+    ssh_session other;
+    sftp_session sftp[3];
+};
+
+static void setup(void **state) {
+    struct striped_sessions *s;
+    const char *host;
+    const char *user;
+    const char *password;
+
+    host = getenv("TORTURE_HOST");
+    if (host == NULL) {
+        host = "localhost";
+    }
+
+    user = getenv("TORTURE_USER");
+    password = getenv("TORTURE_PASSWORD");
+
+    s = calloc(1, sizeof(struct striped_sessions));
+    assert_false(s == NULL);
+    s->t = torture_sftp_session(torture_ssh_session(host, user, password));
+    assert_false(s->t == NULL);
+    s->sftp[0] = s->t->sftp;
+    s->sftp[1] = sftp_new(s->t->ssh);
+    assert_false(s->sftp[1] == NULL);
+    assert_int_equal(sftp_init(s->sftp[1]), 0);
+
+    s->other = torture_ssh_session(host, user, password);
+    assert_false(s->other == NULL);
+    s->sftp[2] = sftp_new(s->other);
+    assert_false(s->sftp[2] == NULL);
+    assert_int_equal(sftp_init(s->sftp[2]), 0);
+
+    *state = s;
+}
+
+static void teardown(void **state) {
+    struct striped_sessions *s = *state;
+
+    assert_false(s == NULL);
+
+    sftp_free(s->sftp[2]);
+    ssh_disconnect(s->other);
+    ssh_free(s->other);
+    sftp_free(s->sftp[1]);
+    torture_rmdirs(s->t->testdir);
+    torture_sftp_close(s->t);
+    free(s);
+}
+
+static void torture_sftp_striped(void **state) {
+    struct striped_sessions *s = *state;
+    struct sftp_download_options_struct opts;
+    char path[128];
+    char copy[128];
+    char *data;
+    char *read_back;
+    int64_t n;
+    int fd;
+    int i;
+
+    data = malloc(STRIPED_SIZE);
+    read_back = malloc(STRIPED_SIZE);
+    assert_true(data != NULL && read_back != NULL);
+    for (i = 0; i < STRIPED_SIZE; i++) {
+        data[i] = (char) (i * 11 + i / 5000);
+    }
+
+    snprintf(path, sizeof(path), "%s/striped_test", s->t->testdir);
+    snprintf(copy, sizeof(copy), "%s/striped_copy", s->t->testdir);
+    fd = open(copy, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, data, STRIPED_SIZE), STRIPED_SIZE);
+
+    /* up over two channels of one session and a second connection */
+    n = sftp_upload_striped(fd, s->sftp, 3, path, NULL);
+    assert_true(n == STRIPED_SIZE);
+    close(fd);
+
+    fd = open(path, O_RDONLY);
+    assert_true(fd >= 0);
+    assert_int_equal(read(fd, read_back, STRIPED_SIZE), STRIPED_SIZE);
+    assert_memory_equal(read_back, data, STRIPED_SIZE);
+    close(fd);
+
+    /* and back, with small reads to have many in flight */
+    fd = open(copy, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    opts.requests = 8;
+    opts.chunk_size = 8192;
+    n = sftp_download_striped(s->sftp, 3, path, fd, &opts);
+    assert_true(n == STRIPED_SIZE);
+    memset(read_back, 0, STRIPED_SIZE);
+    assert_int_equal(pread(fd, read_back, STRIPED_SIZE, 0), STRIPED_SIZE);
+    assert_memory_equal(read_back, data, STRIPED_SIZE);
+    close(fd);
+
+    /* a file smaller than a read takes one session */
+    fd = open(copy, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, data, 100), 100);
+    assert_true(sftp_upload_striped(fd, s->sftp, 3, path, NULL) == 100);
+    assert_int_equal(ftruncate(fd, 0), 0);
+    assert_true(sftp_download_striped(s->sftp, 3, path, fd, NULL) == 100);
+    assert_int_equal(pread(fd, read_back, STRIPED_SIZE, 0), 100);
+    assert_memory_equal(read_back, data, 100);
+    close(fd);
+
+    /* a missing file fails on the first session */
+    snprintf(path, sizeof(path), "%s/striped_missing", s->t->testdir);
+    fd = open(copy, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    assert_true(sftp_download_striped(s->sftp, 3, path, fd, NULL) < 0);
+    close(fd);
+
+    free(data);
+    free(read_back);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_sftp_striped, setup, teardown),
+    };
+
+    ssh_init();
+
+    rc = run_tests(tests);
+    ssh_finalize();
+
+    return rc;
+}
@@ -0,0 +1,171 @@
+#define LIBSSH_STATIC
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "sftp.c"
+
+#define TRANSFER_FILES 50
+
+struct transfer_result {
+    int ok;
+    int failed;
+};
+
+static void setup(void **state) {
+    ssh_session session;
+    struct torture_sftp *t;
+    const char *host;
+    const char *user;
+    const char *password;
+
+    host = getenv("TORTURE_HOST");
+    if (host == NULL) {
+        host = "localhost";
+    }
+
+    user = getenv("TORTURE_USER");
+    password = getenv("TORTURE_PASSWORD");
+
+    session = torture_ssh_session(host, user, password);
+    assert_false(session == NULL);
+    t = torture_sftp_session(session);
+    assert_false(t == NULL);
+
+    *state = t;
+}
+
+static void teardown(void **state) {
+    struct torture_sftp *t = *state;
+
+    assert_false(t == NULL);
+
+    torture_rmdirs(t->testdir);
+    torture_sftp_close(t);
+}
+
+static void transfer_done(sftp_transfer transfer, const char *remote,
+    const char *local, int rc, const char *error, void *userdata) {
+    struct transfer_result *result = userdata;
+
+    (void) transfer;
+    (void) remote;
+    (void) local;
+
+    if (rc == SSH_OK) {
+        assert_true(error == NULL);
+        result->ok++;
+    } else {
+        assert_true(error != NULL);
+        result->failed++;
+    }
+}
+
+/* the size of file i, some of them longer than a chunk */
+static int transfer_size(int i) {
+    return (i % 10 == 0) ? 10000 + i : i * 7;
+}
+
+static void transfer_check(const char *path, int i) {
+    char data[20000];
+    int fd;
+    int j;
+
+    fd = open(path, O_RDONLY);
+    assert_true(fd >= 0);
+    assert_int_equal(read(fd, data, sizeof(data)), transfer_size(i));
+    close(fd);
+    for (j = 0; j < transfer_size(i); j++) {
+        assert_int_equal(data[j], (char) (i + j));
+    }
+}
+
+static void torture_sftp_transfer_tree(void **state) {
+    struct torture_sftp *t = *state;
+    struct transfer_result result;
+    sftp_transfer transfer;
+    char data[20000];
+    char path[256];
+    int fd;
+    int i;
+    int j;
+
+    assert_false(t == NULL);
+
+    /* a tree of small files with a subdirectory */
+    snprintf(path, sizeof(path), "%s/tree", t->testdir);
+    assert_int_equal(ssh_mkdir(path, 0755), 0);
+    snprintf(path, sizeof(path), "%s/tree/sub", t->testdir);
+    assert_int_equal(ssh_mkdir(path, 0755), 0);
+    for (i = 0; i < TRANSFER_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/tree/%sf%d", t->testdir,
+            i % 2 ? "sub/" : "", i);
+        for (j = 0; j < transfer_size(i); j++) {
+            data[j] = (char) (i + j);
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        assert_true(fd >= 0);
+        assert_int_equal(write(fd, data, transfer_size(i)), transfer_size(i));
+        close(fd);
+    }
+
+    /* download it, with small chunks to have short and long files */
+    transfer = sftp_transfer_new(t->sftp);
+    assert_false(transfer == NULL);
+    memset(&result, 0, sizeof(result));
+    sftp_transfer_set_callbacks(transfer, NULL, transfer_done, &result);
+    sftp_transfer_set_limits(transfer, 8, 16, 4096);
+    snprintf(path, sizeof(path), "%s/tree", t->testdir);
+    snprintf(data, sizeof(data), "%s/copy", t->testdir);
+    assert_int_equal(sftp_transfer_add_tree(transfer, path, data), SSH_OK);
+    snprintf(path, sizeof(path), "%s/missing", t->testdir);
+    snprintf(data, sizeof(data), "%s/copy/missing", t->testdir);
+    assert_int_equal(sftp_transfer_add_download(transfer, path, data), SSH_OK);
+    assert_int_equal(sftp_transfer_run(transfer), SSH_ERROR);
+    assert_int_equal(result.ok, TRANSFER_FILES);
+    assert_int_equal(result.failed, 1);
+    sftp_transfer_free(transfer);
+
+    for (i = 0; i < TRANSFER_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/copy/%sf%d", t->testdir,
+            i % 2 ? "sub/" : "", i);
+        transfer_check(path, i);
+    }
+
+    /* and upload the copy back next to it */
+    transfer = sftp_transfer_new(t->sftp);
+    assert_false(transfer == NULL);
+    memset(&result, 0, sizeof(result));
+    sftp_transfer_set_callbacks(transfer, NULL, transfer_done, &result);
+    for (i = 0; i < TRANSFER_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/copy/%sf%d", t->testdir,
+            i % 2 ? "sub/" : "", i);
+        snprintf(data, sizeof(data), "%s/up%d", t->testdir, i);
+        assert_int_equal(sftp_transfer_add_upload(transfer, path, data),
+            SSH_OK);
+    }
+    assert_int_equal(sftp_transfer_run(transfer), SSH_OK);
+    assert_int_equal(result.ok, TRANSFER_FILES);
+    assert_int_equal(result.failed, 0);
+    sftp_transfer_free(transfer);
+
+    for (i = 0; i < TRANSFER_FILES; i++) {
+        snprintf(path, sizeof(path), "%s/up%d", t->testdir, i);
+        transfer_check(path, i);
+    }
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_sftp_transfer_tree, setup, teardown)
+    };
+
+    ssh_init();
+
+    rc = run_tests(tests);
+    ssh_finalize();
+
+    return rc;
+}
@@ -0,0 +1,335 @@
+#define LIBSSH_STATIC
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "sftp.c"
+
+/* not a multiple of the chunk size, to finish on a short write */
+#define UPLOAD_SIZE (256 * 1024 + 123)
+
+struct upload_source {
+    const char *data;
+    uint64_t offset;
+};
+
+static void setup(void **state) {
+    ssh_session session;
+    struct torture_sftp *t;
+    const char *host;
+    const char *user;
+    const char *password;
+
+    host = getenv("TORTURE_HOST");
+    if (host == NULL) {
+        host = "localhost";
+    }
+
+    user = getenv("TORTURE_USER");
+    password = getenv("TORTURE_PASSWORD");
+
+    session = torture_ssh_session(host, user, password);
+    assert_false(session == NULL);
+    t = torture_sftp_session(session);
+    assert_false(t == NULL);
+
+    *state = t;
+}
+
+static void teardown(void **state) {
+    struct torture_sftp *t = *state;
+
+    assert_false(t == NULL);
+
+    torture_rmdirs(t->testdir);
+    torture_sftp_close(t);
+}
+
+static ssize_t upload_cb(void *data, size_t len, uint64_t offset,
+    void *userdata) {
+    struct upload_source *source = userdata;
+
+    /* the data is asked for in file order */
+    assert_true(offset == source->offset);
+    if (len > UPLOAD_SIZE - offset) {
+        len = UPLOAD_SIZE - offset;
+    }
+    memcpy(data, source->data + offset, len);
+    source->offset += len;
+
+    return len;
+}
+
+static void torture_sftp_upload_file(void **state) {
+    struct torture_sftp *t = *state;
+    struct sftp_upload_options_struct opts;
+    struct sftp_upload_source_struct source;
+    struct upload_source cb_source;
+    char path[128];
+    char local[128];
+    char *data;
+    char *read_back;
+    sftp_file file;
+    int64_t n;
+    int fds[2];
+    int fd;
+    int id;
+    int i;
+
+    assert_false(t == NULL);
+
+    data = malloc(UPLOAD_SIZE);
+    read_back = malloc(UPLOAD_SIZE);
+    assert_true(data != NULL && read_back != NULL);
+    for (i = 0; i < UPLOAD_SIZE; i++) {
+        data[i] = (char) (i * 13 + i / 1000);
+    }
+
+    snprintf(path, sizeof(path), "%s/upload_test", t->testdir);
+    snprintf(local, sizeof(local), "%s/upload_source", t->testdir);
+
+    /* from a callback, with small writes to have many in flight */
+    file = sftp_open(t->sftp, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert_false(file == NULL);
+    memset(&source, 0, sizeof(source));
+    source.read_function = upload_cb;
+    source.userdata = &cb_source;
+    cb_source.data = data;
+    cb_source.offset = 0;
+    opts.requests = 16;
+    opts.chunk_size = 4096;
+    n = sftp_upload(&source, file, &opts);
+    assert_true(n == UPLOAD_SIZE);
+    assert_true(sftp_tell64(file) == UPLOAD_SIZE);
+    sftp_close(file);
+
+    fd = open(path, O_RDONLY);
+    assert_true(fd >= 0);
+    assert_int_equal(read(fd, read_back, UPLOAD_SIZE), UPLOAD_SIZE);
+    assert_memory_equal(read_back, data, UPLOAD_SIZE);
+    close(fd);
+
+    /* from a file descriptor, with the defaults, then two async writes */
+    fd = open(local, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, data, UPLOAD_SIZE - 6), UPLOAD_SIZE - 6);
+    assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+    file = sftp_open(t->sftp, path, O_WRONLY | O_TRUNC, 0);
+    assert_false(file == NULL);
+    memset(&source, 0, sizeof(source));
+    source.fd = fd;
+    n = sftp_upload(&source, file, NULL);
+    assert_true(n == UPLOAD_SIZE - 6);
+    assert_true(lseek(fd, 0, SEEK_CUR) == UPLOAD_SIZE - 6);
+    close(fd);
+
+    id = sftp_async_write_begin(file, data + UPLOAD_SIZE - 6, 3);
+    assert_true(id >= 0);
+    i = sftp_async_write_begin(file, data + UPLOAD_SIZE - 3, 3);
+    assert_true(i >= 0);
+    assert_int_equal(sftp_async_write_end(file, i), SSH_OK);
+    assert_int_equal(sftp_async_write_end(file, id), SSH_OK);
+    sftp_close(file);
+
+    memset(read_back, 0, UPLOAD_SIZE);
+    fd = open(path, O_RDONLY);
+    assert_true(fd >= 0);
+    assert_int_equal(read(fd, read_back, UPLOAD_SIZE), UPLOAD_SIZE);
+    assert_memory_equal(read_back, data, UPLOAD_SIZE);
+    close(fd);
+
+    /* from a pipe, which can't be mapped */
+    assert_int_equal(pipe(fds), 0);
+    assert_int_equal(write(fds[1], data, 10000), 10000);
+    close(fds[1]);
+    file = sftp_open(t->sftp, path, O_WRONLY | O_TRUNC, 0);
+    assert_false(file == NULL);
+    memset(&source, 0, sizeof(source));
+    source.fd = fds[0];
+    n = sftp_upload(&source, file, NULL);
+    assert_true(n == 10000);
+    close(fds[0]);
+    sftp_close(file);
+
+    fd = open(path, O_RDONLY);
+    assert_true(fd >= 0);
+    assert_int_equal(read(fd, read_back, UPLOAD_SIZE), 10000);
+    assert_memory_equal(read_back, data, 10000);
+    close(fd);
+
+    free(data);
+    free(read_back);
+}
+
+static void torture_sftp_upload_resume(void **state) {
+    struct torture_sftp *t = *state;
+    struct sftp_upload_source_struct source;
+    char path[128];
+    char local[128];
+    char *data;
+    char *read_back;
+    sftp_file file;
+    struct stat st;
+    int64_t n;
+    int fd;
+    int remote;
+    int i;
+
+    assert_false(t == NULL);
+
+    data = malloc(UPLOAD_SIZE);
+    read_back = malloc(UPLOAD_SIZE);
+    assert_true(data != NULL && read_back != NULL);
+    for (i = 0; i < UPLOAD_SIZE; i++) {
+        data[i] = (char) (i * 7 + i / 4096);
+    }
+
+    snprintf(path, sizeof(path), "%s/resume_test", t->testdir);
+    snprintf(local, sizeof(local), "%s/resume_source", t->testdir);
+    fd = open(local, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, data, UPLOAD_SIZE), UPLOAD_SIZE);
+
+    /* an interrupted upload goes on from where it stopped */
+    remote = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert_true(remote >= 0);
+    assert_int_equal(write(remote, data, 100000), 100000);
+    close(remote);
+    file = sftp_open(t->sftp, path, O_RDWR, 0);
+    assert_false(file == NULL);
+    assert_true(sftp_upload_resume(fd, file, 1) == 100000);
+    assert_true(lseek(fd, 0, SEEK_CUR) == 100000);
+    memset(&source, 0, sizeof(source));
+    source.fd = fd;
+    n = sftp_upload(&source, file, NULL);
+    assert_true(n == UPLOAD_SIZE - 100000);
+    sftp_close(file);
+
+    remote = open(path, O_RDONLY);
+    assert_true(remote >= 0);
+    assert_int_equal(read(remote, read_back, UPLOAD_SIZE), UPLOAD_SIZE);
+    assert_memory_equal(read_back, data, UPLOAD_SIZE);
+    close(remote);
+
+    /* a part which doesn't match starts over */
+    remote = open(path, O_WRONLY | O_TRUNC);
+    assert_true(remote >= 0);
+    assert_int_equal(write(remote, data, 100000), 100000);
+    assert_int_equal(pwrite(remote, "x", 1, 99000), 1);
+    close(remote);
+    file = sftp_open(t->sftp, path, O_RDWR, 0);
+    assert_false(file == NULL);
+    assert_true(sftp_upload_resume(fd, file, 1) == 0);
+    assert_int_equal(stat(path, &st), 0);
+    assert_true(st.st_size == 0);
+    n = sftp_upload(&source, file, NULL);
+    assert_true(n == UPLOAD_SIZE);
+    sftp_close(file);
+
+    /* so does a remote file bigger than the local one */
+    assert_int_equal(ftruncate(fd, 1000), 0);
+    file = sftp_open(t->sftp, path, O_RDWR, 0);
+    assert_false(file == NULL);
+    assert_true(sftp_upload_resume(fd, file, 0) == 0);
+    assert_int_equal(stat(path, &st), 0);
+    assert_true(st.st_size == 0);
+    sftp_close(file);
+    close(fd);
+
+    free(data);
+    free(read_back);
+}
+
+static void torture_sftp_upload_delta(void **state) {
+    struct torture_sftp *t = *state;
+    char path[128];
+    char local[128];
+    char *data;
+    char *read_back;
+    sftp_file file;
+    struct stat st;
+    int fd;
+    int remote;
+    int i;
+
+    assert_false(t == NULL);
+
+    data = malloc(UPLOAD_SIZE);
+    read_back = malloc(UPLOAD_SIZE);
+    assert_true(data != NULL && read_back != NULL);
+    for (i = 0; i < UPLOAD_SIZE; i++) {
+        data[i] = (char) (i * 13 + i / 3000);
+    }
+
+    snprintf(path, sizeof(path), "%s/delta_test", t->testdir);
+    snprintf(local, sizeof(local), "%s/delta_source", t->testdir);
+    fd = open(local, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, data, UPLOAD_SIZE), UPLOAD_SIZE);
+
+    /* only the two blocks changed are sent */
+    remote = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert_true(remote >= 0);
+    assert_int_equal(write(remote, data, UPLOAD_SIZE), UPLOAD_SIZE);
+    assert_int_equal(pwrite(remote, "xy", 2, 5000), 2);
+    assert_int_equal(pwrite(remote, "z", 1, 200000), 1);
+    close(remote);
+    file = sftp_open(t->sftp, path, O_RDWR, 0);
+    assert_false(file == NULL);
+    assert_true(sftp_upload_delta(fd, file, 4096, NULL) == 2 * 4096);
+    assert_true(sftp_tell64(file) == UPLOAD_SIZE);
+
+    /* and nothing once they are the same */
+    assert_true(sftp_upload_delta(fd, file, 4096, NULL) == 0);
+    sftp_close(file);
+
+    remote = open(path, O_RDONLY);
+    assert_true(remote >= 0);
+    assert_int_equal(read(remote, read_back, UPLOAD_SIZE), UPLOAD_SIZE);
+    assert_memory_equal(read_back, data, UPLOAD_SIZE);
+    close(remote);
+
+    /* a longer remote file is truncated */
+    remote = open(path, O_WRONLY | O_APPEND);
+    assert_true(remote >= 0);
+    assert_int_equal(write(remote, "tail", 4), 4);
+    close(remote);
+    file = sftp_open(t->sftp, path, O_RDWR, 0);
+    assert_false(file == NULL);
+    assert_true(sftp_upload_delta(fd, file, 4096, NULL) == 0);
+    assert_int_equal(stat(path, &st), 0);
+    assert_true(st.st_size == UPLOAD_SIZE);
+
+    /* a shorter one gets from its last block on */
+    assert_int_equal(truncate(path, 10000), 0);
+    assert_true(sftp_upload_delta(fd, file, 4096, NULL) ==
+        UPLOAD_SIZE - 2 * 4096);
+    sftp_close(file);
+
+    remote = open(path, O_RDONLY);
+    assert_true(remote >= 0);
+    assert_int_equal(read(remote, read_back, UPLOAD_SIZE), UPLOAD_SIZE);
+    assert_memory_equal(read_back, data, UPLOAD_SIZE);
+    close(remote);
+    close(fd);
+
+    free(data);
+    free(read_back);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_sftp_upload_file, setup, teardown),
+        unit_test_setup_teardown(torture_sftp_upload_resume, setup, teardown),
+        unit_test_setup_teardown(torture_sftp_upload_delta, setup, teardown)
+    };
+
+    ssh_init();
+
+    rc = run_tests(tests);
+    ssh_finalize();
+
+    return rc;
+}
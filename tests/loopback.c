@@ -0,0 +1,597 @@
+/*
+ * loopback.c - a libssh server in the process, for the tests and benchmarks
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <libssh/libssh.h>
+#include <libssh/server.h>
+#include <libssh/callbacks.h>
+#ifdef WITH_SFTP
+#include <libssh/sftp.h>
+#endif
+
+#include "loopback.h"
+
+/* the biggest write of a source, and the biggest read answered at once */
+#define LOOPBACK_ZEROS (256 * 1024)
+
+static const char loopback_zeros[LOOPBACK_ZEROS];
+
+struct loopback_connection;
+
+struct loopback_channel {
+    struct ssh_channel_callbacks_struct cb;
+    struct loopback_connection *conn;
+    ssh_channel channel;
+    uint64_t remaining; /* zeros a source has still to send */
+    int finished;
+#ifdef WITH_SFTP
+    sftp_session sftp;
+#endif
+    struct loopback_channel *next;
+};
+
+struct loopback_connection {
+    struct loopback_server *server;
+    struct ssh_server_callbacks_struct cb;
+    ssh_session session;
+    ssh_event event;
+    int fd;
+    pthread_t thread;
+    int done; /* the thread is about to return */
+    struct loopback_channel *channels;
+    struct loopback_connection *next;
+};
+
+struct loopback_server {
+    ssh_bind bind;
+    unsigned long filesize;
+    int verbose;
+    int stop;
+    pthread_mutex_t mutex;
+    struct loopback_connection *connections;
+};
+
+static int loopback_stopped(struct loopback_server *server) {
+    int stop;
+
+    pthread_mutex_lock(&server->mutex);
+    stop = server->stop;
+    pthread_mutex_unlock(&server->mutex);
+
+    return stop;
+}
+
+/* ends a command: exit status, eof and close */
+static void loopback_finish(struct loopback_channel *lc) {
+    if (lc->finished) {
+        return;
+    }
+    lc->finished = 1;
+    ssh_channel_request_send_exit_status(lc->channel, 0);
+    ssh_channel_send_eof(lc->channel);
+    ssh_channel_close(lc->channel);
+}
+
+static int loopback_eater_data(ssh_session session, ssh_channel channel,
+                               void *data, uint32_t len, int is_stderr,
+                               void *userdata) {
+    (void) session;
+    (void) channel;
+    (void) data;
+    (void) is_stderr;
+    (void) userdata;
+
+    return len;
+}
+
+static void loopback_eater_eof(ssh_session session, ssh_channel channel,
+                               void *userdata) {
+    struct loopback_channel *lc = userdata;
+
+    (void) session;
+    ssh_channel_write(channel, "done\n", 5);
+    loopback_finish(lc);
+}
+
+static void loopback_eater_start(ssh_event event, void *userdata) {
+    struct loopback_channel *lc = userdata;
+
+    (void) event;
+    ssh_channel_write(lc->channel, "go\n", 3);
+}
+
+/* sends as many zeros as the window takes */
+static void loopback_source_writable(ssh_session session, ssh_channel channel,
+                                     uint32_t bytes, void *userdata) {
+    struct loopback_channel *lc = userdata;
+    uint32_t n;
+
+    (void) session;
+    while (bytes > 0 && lc->remaining > 0) {
+        n = bytes < LOOPBACK_ZEROS ? bytes : LOOPBACK_ZEROS;
+        if (n > lc->remaining) {
+            n = (uint32_t) lc->remaining;
+        }
+        if (ssh_channel_write(channel, loopback_zeros, n) == SSH_ERROR) {
+            return;
+        }
+        lc->remaining -= n;
+        bytes -= n;
+    }
+    if (lc->remaining == 0) {
+        loopback_finish(lc);
+    }
+}
+
+static void loopback_source_start(ssh_event event, void *userdata) {
+    struct loopback_channel *lc = userdata;
+
+    (void) event;
+    loopback_source_writable(lc->conn->session, lc->channel,
+        ssh_channel_window_size(lc->channel), lc);
+}
+
+/*
+ * The commands start once the request is answered: they are posted to the
+ * event, run after the packets of the poll.
+ */
+static int loopback_exec(ssh_session session, ssh_channel channel,
+                         const char *command, const char *value,
+                         void *userdata) {
+    struct loopback_channel *lc = userdata;
+    char *end;
+
+    (void) session;
+    (void) channel;
+    (void) value;
+    if (strcmp(command, "eater") == 0) {
+        lc->cb.channel_data_function = loopback_eater_data;
+        lc->cb.channel_eof_function = loopback_eater_eof;
+        return ssh_event_post(lc->conn->event, loopback_eater_start, lc);
+    }
+    if (strncmp(command, "source ", 7) == 0) {
+        lc->remaining = strtoull(command + 7, &end, 10);
+        if (*end != '\0') {
+            return -1;
+        }
+        lc->cb.channel_writable_function = loopback_source_writable;
+        return ssh_event_post(lc->conn->event, loopback_source_start, lc);
+    }
+
+    return -1;
+}
+
+#ifdef WITH_SFTP
+/* the info of the handles: what the file was opened for */
+static int loopback_reader;
+static int loopback_writer;
+
+static int loopback_sftp_open(sftp_client_message msg, void *userdata) {
+    ssh_string handle;
+
+    (void) userdata;
+    handle = sftp_handle_alloc(msg->sftp, (msg->flags & SSH_FXF_WRITE) ?
+        &loopback_writer : &loopback_reader);
+    if (handle == NULL) {
+        return SSH_ERROR;
+    }
+    sftp_reply_handle(msg, handle);
+    ssh_string_free(handle);
+    sftp_client_message_free(msg);
+
+    return SSH_OK;
+}
+
+/* the size of the file of a handle, -1 for a wrong handle */
+static int64_t loopback_sftp_size(struct loopback_server *server,
+                                  sftp_client_message msg) {
+    void *info = sftp_handle(msg->sftp, msg->handle);
+
+    if (info == &loopback_reader) {
+        return server->filesize;
+    }
+    if (info == &loopback_writer) {
+        return 0;
+    }
+
+    return -1;
+}
+
+static int loopback_sftp_read(sftp_client_message msg, void *userdata) {
+    int64_t size = loopback_sftp_size(userdata, msg);
+    uint32_t len = msg->len;
+
+    if (size < 0) {
+        sftp_reply_status(msg, SSH_FX_INVALID_HANDLE, NULL);
+    } else if (msg->offset >= (uint64_t) size) {
+        sftp_reply_status(msg, SSH_FX_EOF, NULL);
+    } else {
+        if (len > size - msg->offset) {
+            len = (uint32_t) (size - msg->offset);
+        }
+        if (len > LOOPBACK_ZEROS) {
+            len = LOOPBACK_ZEROS;
+        }
+        sftp_reply_data(msg, loopback_zeros, len);
+    }
+    sftp_client_message_free(msg);
+
+    return SSH_OK;
+}
+
+static int loopback_sftp_write(sftp_client_message msg, void *userdata) {
+    if (loopback_sftp_size(userdata, msg) < 0) {
+        sftp_reply_status(msg, SSH_FX_INVALID_HANDLE, NULL);
+    } else {
+        sftp_reply_status(msg, SSH_FX_OK, NULL);
+    }
+    sftp_client_message_free(msg);
+
+    return SSH_OK;
+}
+
+/* the attributes of a file of the server, or of the file of a handle */
+static int loopback_sftp_stat(sftp_client_message msg, void *userdata) {
+    struct loopback_server *server = userdata;
+    struct sftp_attributes_struct attr;
+    int64_t size = server->filesize;
+
+    if (msg->type == SSH_FXP_FSTAT) {
+        size = loopback_sftp_size(server, msg);
+    }
+    if (size < 0) {
+        sftp_reply_status(msg, SSH_FX_INVALID_HANDLE, NULL);
+    } else {
+        memset(&attr, 0, sizeof(attr));
+        attr.flags = SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_PERMISSIONS;
+        attr.size = size;
+        attr.permissions = 0100644;
+        sftp_reply_attr(msg, &attr);
+    }
+    sftp_client_message_free(msg);
+
+    return SSH_OK;
+}
+
+static int loopback_sftp_close(sftp_client_message msg, void *userdata) {
+    (void) userdata;
+
+    if (sftp_handle_release(msg->sftp, msg->handle) < 0) {
+        sftp_reply_status(msg, SSH_FX_INVALID_HANDLE, NULL);
+    } else {
+        sftp_reply_status(msg, SSH_FX_OK, NULL);
+    }
+    sftp_client_message_free(msg);
+
+    return SSH_OK;
+}
+
+/* the sftp server takes the callbacks of the channel over */
+static int loopback_subsystem(ssh_session session, ssh_channel channel,
+                              const char *name, const char *value,
+                              void *userdata) {
+    struct loopback_channel *lc = userdata;
+    struct loopback_server *server = lc->conn->server;
+    sftp_session sftp;
+
+    (void) value;
+    if (strcmp(name, "sftp") != 0 || lc->sftp != NULL) {
+        return -1;
+    }
+    sftp = sftp_server_new(session, channel);
+    if (sftp == NULL) {
+        return -1;
+    }
+    lc->sftp = sftp;
+    sftp_server_set_handler(sftp, SSH_FXP_OPEN, loopback_sftp_open, server);
+    sftp_server_set_handler(sftp, SSH_FXP_READ, loopback_sftp_read, server);
+    sftp_server_set_handler(sftp, SSH_FXP_WRITE, loopback_sftp_write, server);
+    sftp_server_set_handler(sftp, SSH_FXP_STAT, loopback_sftp_stat, server);
+    sftp_server_set_handler(sftp, SSH_FXP_LSTAT, loopback_sftp_stat, server);
+    sftp_server_set_handler(sftp, SSH_FXP_FSTAT, loopback_sftp_stat, server);
+    sftp_server_set_handler(sftp, SSH_FXP_CLOSE, loopback_sftp_close, server);
+
+    return sftp_server_start(sftp) == SSH_OK ? 0 : -1;
+}
+#endif /* WITH_SFTP */
+
+static int loopback_auth_none(ssh_session session, const char *user,
+                              void *userdata) {
+    (void) session;
+    (void) user;
+    (void) userdata;
+
+    return SSH_AUTH_SUCCESS;
+}
+
+static int loopback_channel_open(ssh_session session, ssh_channel channel,
+                                 void *userdata) {
+    struct loopback_connection *conn = userdata;
+    struct loopback_channel *lc;
+
+    (void) session;
+    lc = calloc(1, sizeof(struct loopback_channel));
+    if (lc == NULL) {
+        return -1;
+    }
+    lc->conn = conn;
+    lc->channel = channel;
+    lc->cb.userdata = lc;
+    lc->cb.channel_exec_request_function = loopback_exec;
+#ifdef WITH_SFTP
+    lc->cb.channel_subsystem_request_function = loopback_subsystem;
+#endif
+    ssh_callbacks_init(&lc->cb);
+    if (ssh_set_channel_callbacks(channel, &lc->cb) < 0) {
+        free(lc);
+        return -1;
+    }
+    lc->next = conn->channels;
+    conn->channels = lc;
+
+    return 0;
+}
+
+/* the service requests and what the callbacks don't take */
+static int loopback_message(ssh_session session, ssh_message msg,
+                            void *userdata) {
+    (void) session;
+    (void) userdata;
+
+    if (ssh_message_type(msg) == SSH_REQUEST_SERVICE) {
+        ssh_message_service_reply_success(msg);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* serves a connection until the client or the server goes away */
+static void *loopback_serve(void *arg) {
+    struct loopback_connection *conn = arg;
+    struct loopback_server *server = conn->server;
+    struct loopback_channel *lc;
+
+    conn->session = ssh_new();
+    if (conn->session == NULL) {
+        close(conn->fd);
+        goto end;
+    }
+    if (ssh_bind_accept_fd(server->bind, conn->session, conn->fd) != SSH_OK) {
+        close(conn->fd);
+        goto end;
+    }
+
+    conn->cb.userdata = conn;
+    conn->cb.auth_none_function = loopback_auth_none;
+    conn->cb.channel_open_request_session_function = loopback_channel_open;
+    ssh_callbacks_init(&conn->cb);
+    ssh_set_server_callbacks(conn->session, &conn->cb);
+    ssh_set_message_callback(conn->session, loopback_message, conn);
+
+    if (ssh_handle_key_exchange(conn->session) != SSH_OK) {
+        if (server->verbose > 0) {
+            fprintf(stderr, "loopback server: %s\n",
+                ssh_get_error(conn->session));
+        }
+        goto end;
+    }
+    ssh_set_blocking(conn->session, 0);
+
+    conn->event = ssh_event_new();
+    if (conn->event == NULL ||
+        ssh_event_add_session(conn->event, conn->session) != SSH_OK) {
+        goto end;
+    }
+    while (!loopback_stopped(server) && ssh_is_connected(conn->session)) {
+        if (ssh_event_dopoll(conn->event, 100) == SSH_ERROR) {
+            if (server->verbose > 0) {
+                fprintf(stderr, "loopback server: %s\n",
+                    ssh_get_error(conn->session));
+            }
+            break;
+        }
+    }
+
+end:
+    if (conn->event != NULL) {
+        ssh_event_remove_session(conn->event, conn->session);
+        ssh_event_free(conn->event);
+    }
+    for (lc = conn->channels; lc != NULL; lc = conn->channels) {
+        conn->channels = lc->next;
+#ifdef WITH_SFTP
+        sftp_free(lc->sftp);
+#endif
+        free(lc);
+    }
+    if (conn->session != NULL) {
+        ssh_disconnect(conn->session);
+        ssh_free(conn->session);
+    }
+
+    pthread_mutex_lock(&server->mutex);
+    conn->done = 1;
+    pthread_mutex_unlock(&server->mutex);
+
+    return NULL;
+}
+
+/* joins the threads of the connections which are over */
+static void loopback_reap(struct loopback_server *server, int all) {
+    struct loopback_connection **p;
+    struct loopback_connection *conn;
+
+    pthread_mutex_lock(&server->mutex);
+    p = &server->connections;
+    while (*p != NULL) {
+        conn = *p;
+        if (!conn->done && !all) {
+            p = &conn->next;
+            continue;
+        }
+        *p = conn->next;
+        pthread_mutex_unlock(&server->mutex);
+        pthread_join(conn->thread, NULL);
+        free(conn);
+        pthread_mutex_lock(&server->mutex);
+        p = &server->connections;
+    }
+    pthread_mutex_unlock(&server->mutex);
+}
+
+/* the host keys of the server, the first one required */
+static const struct {
+    const char *type;
+    const char *keygen; /* the options of ssh-keygen */
+    enum ssh_bind_options_e option;
+} loopback_hostkeys[] = {
+    { "ed25519", "-t ed25519", SSH_BIND_OPTIONS_ED25519KEY },
+    { "ecdsa", "-t ecdsa -b 256 -m PEM", SSH_BIND_OPTIONS_ECDSAKEY },
+    { "rsa", "-t rsa -b 2048 -m PEM", SSH_BIND_OPTIONS_RSAKEY },
+};
+
+#define LOOPBACK_HOSTKEYS \
+    (sizeof(loopback_hostkeys) / sizeof(loopback_hostkeys[0]))
+
+struct loopback_server *loopback_server_new(unsigned long filesize,
+                                            int verbose) {
+    struct loopback_server *server;
+    char dir[] = "/tmp/libssh_loopback_XXXXXX";
+    char key[64];
+    char cmd[160];
+    size_t i;
+    int rc = 0;
+
+    server = calloc(1, sizeof(struct loopback_server));
+    if (server == NULL) {
+        return NULL;
+    }
+    server->filesize = filesize;
+    server->verbose = verbose;
+    if (pthread_mutex_init(&server->mutex, NULL) != 0) {
+        free(server);
+        return NULL;
+    }
+
+    server->bind = ssh_bind_new();
+    if (server->bind == NULL || mkdtemp(dir) == NULL) {
+        goto error;
+    }
+    /*
+     * The keys are read one after the other: a type ssh-keygen or libssh
+     * can't do leaves the server with the ones before.
+     */
+    for (i = 0; i < LOOPBACK_HOSTKEYS && rc == 0; i++) {
+        snprintf(key, sizeof(key), "%s/%s", dir, loopback_hostkeys[i].type);
+        snprintf(cmd, sizeof(cmd), "ssh-keygen %s -q -N \"\" -f %s",
+            loopback_hostkeys[i].keygen, key);
+        rc = system(cmd);
+        if (rc == 0) {
+            rc = ssh_bind_options_set(server->bind, loopback_hostkeys[i].option,
+                key);
+        }
+        if (rc == 0) {
+            rc = ssh_bind_reload_hostkeys(server->bind);
+        }
+        if (rc != 0 && i == 0) {
+            goto error;
+        }
+    }
+    for (i = 0; i < LOOPBACK_HOSTKEYS; i++) {
+        snprintf(key, sizeof(key), "%s/%s", dir, loopback_hostkeys[i].type);
+        unlink(key);
+        snprintf(key, sizeof(key), "%s/%s.pub", dir, loopback_hostkeys[i].type);
+        unlink(key);
+    }
+    rmdir(dir);
+
+    return server;
+error:
+    if (verbose > 0) {
+        fprintf(stderr, "Can't make the host key of the loopback server\n");
+    }
+    loopback_server_free(server);
+    return NULL;
+}
+
+int loopback_connect(struct loopback_server *server, ssh_session session) {
+    struct loopback_connection *conn;
+    int fds[2];
+
+    loopback_reap(server, 0);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return SSH_ERROR;
+    }
+    conn = calloc(1, sizeof(struct loopback_connection));
+    if (conn == NULL) {
+        goto error;
+    }
+    conn->server = server;
+    conn->fd = fds[1];
+    pthread_mutex_lock(&server->mutex);
+    if (pthread_create(&conn->thread, NULL, loopback_serve, conn) != 0) {
+        pthread_mutex_unlock(&server->mutex);
+        free(conn);
+        goto error;
+    }
+    conn->next = server->connections;
+    server->connections = conn;
+    pthread_mutex_unlock(&server->mutex);
+
+    /* the server end is the thread's now */
+    if (ssh_options_set(session, SSH_OPTIONS_FD, &fds[0]) < 0) {
+        close(fds[0]);
+        return SSH_ERROR;
+    }
+
+    return ssh_connect(session);
+error:
+    close(fds[0]);
+    close(fds[1]);
+    return SSH_ERROR;
+}
+
+void loopback_server_free(struct loopback_server *server) {
+    if (server == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&server->mutex);
+    server->stop = 1;
+    pthread_mutex_unlock(&server->mutex);
+    loopback_reap(server, 1);
+
+    if (server->bind != NULL) {
+        ssh_bind_free(server->bind);
+    }
+    pthread_mutex_destroy(&server->mutex);
+    free(server);
+}
@@ -0,0 +1,67 @@
+/*
+ * loopback.h - a libssh server in the process, for the tests and benchmarks
+ *
+ * This file is part of the SSH Library
+ *
+ * The SSH Library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The SSH Library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the SSH Library; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#ifndef _LOOPBACK_H
+#define _LOOPBACK_H
+
+#include <libssh/libssh.h>
+
+/*
+ * A ssh_bind server talking to the clients of the process over socketpairs,
+ * each connection served by a thread of its own. It lets any user in with
+ * the none method, and has a backend which needs neither a shell nor a disk:
+ *
+ *  - exec "eater": sends "go\n", reads the data until the eof, then sends
+ *    "done\n".
+ *  - exec "source BYTES": sends BYTES zeros.
+ *  - the other commands are refused.
+ *  - the sftp subsystem: every file opened for reading is filesize zeros,
+ *    the writes are acknowledged and dropped.
+ *
+ * The commands exit with the status 0 and close their channel. A connection
+ * may have any number of channels.
+ */
+struct loopback_server;
+
+/*
+ * Creates the server, with new host keys made by ssh-keygen: ed25519, and
+ * ecdsa and rsa when they can be made and read. The files opened with sftp
+ * are filesize bytes long. With verbose > 0, the errors of the server are
+ * printed on stderr.
+ */
+struct loopback_server *loopback_server_new(unsigned long filesize,
+                                            int verbose);
+
+/*
+ * Connects a client session to the server, which starts serving it in a
+ * thread. The session is configured by the caller before, except for
+ * SSH_OPTIONS_FD, and authenticated after, e.g. with ssh_userauth_none().
+ * Returns the result of ssh_connect().
+ */
+int loopback_connect(struct loopback_server *server, ssh_session session);
+
+/*
+ * Stops the server: the connections still open are dropped, and their
+ * threads joined.
+ */
+void loopback_server_free(struct loopback_server *server);
+
+#endif /* _LOOPBACK_H */
@@ -3,89 +3,194 @@
  *
  *  Created on: 22 juin 2009
  *      Author: aris
+ *
+ * An SFTP load generator: threads, each with sessions of its own, run a mix
+ * of operations against a server for a duration, as fast as they can or at
+ * a given rate, and the throughput and the latencies of each kind of
+ * operation are reported at the end.
+ *
+ *  small    writes a small file, reads it back and removes it
+ *  large    writes or reads (one after the other) a large file sequentially
+ *  random   reads a block at a random offset of the large file
+ *  readdir  lists a directory of small files
+ *  meta     stat, lstat and chmod of a file
+ *
+ * With a rate (-r), the operations are started on a schedule which doesn't
+ * wait for the server (open loop), and their latency is counted from the
+ * time they should have started: a server falling behind shows in the
+ * latencies instead of slowing the load down.
  */
 #include <stdio.h>
-#include <libssh/libssh.h>
-#include <libssh/sftp.h>
-#include <time.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
-#define TEST_READ 1
-#define TEST_WRITE 2
-#define NTHREADS 3
-#define FILESIZE 100000
-unsigned char samplefile[FILESIZE];
-volatile int stop=0;
-
-const char* hosts[]={"localhost","barebone"};
-void signal_stop(){
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libssh/libssh.h>
+#include <libssh/callbacks.h>
+#include <libssh/sftp.h>
+
+enum op_e {
+  OP_SMALL,
+  OP_LARGE,
+  OP_RANDOM,
+  OP_READDIR,
+  OP_META,
+  OP_NUMBER
+};
+
+static const char *op_names[OP_NUMBER]={
+  "small", "large", "random", "readdir", "meta"
+};
+
+/* the latencies are kept in microseconds, 16 buckets by power of two */
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct op_stats {
+  unsigned long count;
+  unsigned long errors;
+  uint64_t bytes;
+  uint64_t max;
+  unsigned long hist[HIST_BUCKETS];
+};
+
+struct config {
+  const char *host;
+  const char *user;
+  int port;
+  int threads;
+  int sessions; /* by thread */
+  int duration; /* seconds */
+  double rate; /* operations by second of all the threads, 0 for no limit */
+  int ratios[OP_NUMBER];
+  const char *dir;
+  int keep; /* the files are left on the server */
+  size_t small_size;
+  size_t large_size;
+  size_t block_size;
+  int nfiles; /* in the directory of readdir */
+};
+
+struct worker {
+  pthread_t thread;
+  int id;
+  struct config *config;
+  ssh_session *sessions;
+  sftp_session *sftps;
+  char dir[256];
+  unsigned int seed;
+  int large_written;
+  uint64_t started; /* the time the operations ran */
+  uint64_t ended;
+  int error;
+  struct op_stats stats[OP_NUMBER];
+};
+
+static volatile int stop=0;
+static unsigned char *samplefile;
+
+static void signal_stop(int sig){
+  (void) sig;
   stop=1;
-  printf("Stopping...\n");
-}
-
-SSH_SESSION *connect_host(const char *hostname);
-int sftp_test(SSH_SESSION *session, int test);
-
-int docycle(const char *host, int test){
-  SSH_SESSION *session=connect_host(host);
-  int ret=SSH_ERROR;
-  if(!session){
-    printf("connect failed\n");
-  } else {
-    printf("Connected\n");
-    ret=sftp_test(session,test);
-    if(ret != SSH_OK){
-      printf("Error in sftp\n");
-    }
-    ssh_disconnect(session);
+}
+
+static uint64_t now_us(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hist_bucket(uint64_t us){
+  int e=0;
+
+  if(us < HIST_SUB)
+    return us;
+  while((us >> e) >= 2 * HIST_SUB)
+    e++;
+  /* us is in [16 << e, 32 << e) */
+  return (e + 1) * HIST_SUB + (int)((us >> e) - HIST_SUB);
+}
+
+/* the lowest latency of a bucket */
+static uint64_t hist_value(int bucket){
+  int e;
+
+  if(bucket < HIST_SUB)
+    return bucket;
+  e=bucket / HIST_SUB - 1;
+  return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << e;
+}
+
+static void stats_add(struct op_stats *stats, uint64_t us, size_t bytes,
+    int error){
+  int bucket;
+
+  if(error){
+    stats->errors++;
+    return;
   }
-  return ret;
+  bucket=hist_bucket(us);
+  if(bucket >= HIST_BUCKETS)
+    bucket=HIST_BUCKETS - 1;
+  stats->hist[bucket]++;
+  stats->count++;
+  stats->bytes+=bytes;
+  if(us > stats->max)
+    stats->max=us;
 }
 
-int thread(){
-  while(docycle(hosts[rand()%2],TEST_WRITE) == SSH_OK)
-    if(stop)
-      break;
-  return 0;
+static void stats_merge(struct op_stats *to, const struct op_stats *from){
+  int i;
+
+  to->count+=from->count;
+  to->errors+=from->errors;
+  to->bytes+=from->bytes;
+  if(from->max > to->max)
+    to->max=from->max;
+  for(i=0;i<HIST_BUCKETS;i++)
+    to->hist[i]+=from->hist[i];
 }
 
-int main(int argc, char **argv){
+static double stats_percentile(const struct op_stats *stats, double q){
+  unsigned long n=0;
+  unsigned long rank;
   int i;
-  pthread_t threads[NTHREADS];
-  ssh_init();
-  srand(time(NULL));
-  for(i=0;i<FILESIZE;++i)
-    samplefile[i]=rand() & 0xff;
-  signal(SIGTERM,signal_stop);
-  signal(SIGINT,signal_stop);
 
-  for(i=0;i<NTHREADS;++i){
-    srand(i);
-    pthread_create(&threads[i],NULL,(void *) thread, NULL);
+  if(stats->count == 0)
+    return 0.0;
+  rank=(unsigned long)(q * stats->count);
+  if(rank >= stats->count)
+    rank=stats->count - 1;
+  for(i=0;i<HIST_BUCKETS;i++){
+    n+=stats->hist[i];
+    if(n > rank)
+      return hist_value(i) / 1000.0;
   }
-  for(i=0;i<NTHREADS;++i){
-    pthread_join(threads[i],NULL);
-  }
-  ssh_finalize();
-  printf("Ended\n");
-  return 0;
+  return stats->max / 1000.0;
 }
 
-SSH_SESSION *connect_host(const char *hostname){
-  SSH_SESSION *session;
-  SSH_OPTIONS *options;
+static ssh_session connect_host(struct config *config){
+  ssh_session session;
   int auth=0;
   int state;
 
-  options=ssh_options_new();
-  ssh_options_set_host(options,hostname);
   session=ssh_new();
-  ssh_set_options(session,options);
+  if(session == NULL)
+    return NULL;
+  ssh_options_set(session,SSH_OPTIONS_HOST,config->host);
+  if(config->user != NULL)
+    ssh_options_set(session,SSH_OPTIONS_USER,config->user);
+  if(config->port > 0)
+    ssh_options_set(session,SSH_OPTIONS_PORT,&config->port);
   if(ssh_connect(session)){
     fprintf(stderr,"Connection failed : %s\n",ssh_get_error(session));
-    ssh_disconnect(session);
+    ssh_free(session);
     return NULL;
   }
   state=ssh_is_server_known(session);
@@ -96,79 +201,534 @@ SSH_SESSION *connect_host(const char *hostname){
     case SSH_SERVER_KNOWN_CHANGED:
       fprintf(stderr,"Host key for server changed : server's one is now :\n");
       fprintf(stderr,"For security reason, connection will be stopped\n");
-      ssh_disconnect(session);
-      ssh_finalize();
-      return NULL;
+      goto error;
     case SSH_SERVER_FOUND_OTHER:
       fprintf(stderr,"The host key for this server was not found but an other type of key exists.\n");
       fprintf(stderr,"An attacker might change the default server key to confuse your client"
-          "into thinking the key does not exist\n"
-          "We advise you to rerun the client with -d or -r for more safety.\n");
-      ssh_disconnect(session);
-      ssh_finalize();
-      return NULL;
+          "into thinking the key does not exist\n");
+      goto error;
     case SSH_SERVER_NOT_KNOWN:
-      fprintf(stderr,"The server is unknown. Leaving now");
-      ssh_disconnect(session);
-      return NULL;
+      fprintf(stderr,"The server is unknown. Leaving now\n");
+      goto error;
     case SSH_SERVER_ERROR:
-      fprintf(stderr,"%s",ssh_get_error(session));
-      ssh_disconnect(session);
-      return NULL;
+    default:
+      fprintf(stderr,"%s\n",ssh_get_error(session));
+      goto error;
   }
 
-  ssh_userauth_none(session, NULL);
-
-  auth=ssh_userauth_autopubkey(session, NULL);
+  auth=ssh_userauth_none(session, NULL);
+  if(auth != SSH_AUTH_SUCCESS)
+    auth=ssh_userauth_autopubkey(session, NULL);
   if(auth==SSH_AUTH_ERROR){
     fprintf(stderr,"Authenticating with pubkey: %s\n",ssh_get_error(session));
-    ssh_disconnect(session);
-    return NULL;
+    goto error;
   }
   if(auth!=SSH_AUTH_SUCCESS){
     fprintf(stderr,"Authentication failed: %s\n",ssh_get_error(session));
-    ssh_disconnect(session);
-    return NULL;
+    goto error;
   }
-  ssh_log(session, SSH_LOG_FUNCTIONS, "Authentication success");
   return session;
+error:
+  ssh_disconnect(session);
+  ssh_free(session);
+  return NULL;
 }
 
-int sftp_test(SSH_SESSION *session, int test){
-  SFTP_SESSION *sftp=sftp_new(session);
-  SFTP_FILE *file;
-  int wrote=0;
-  char name[128];
-  if(sftp == NULL)
-    return SSH_ERROR;
-  if(sftp_init(sftp)<0){
-    printf("problem initializing sftp : %s\n",ssh_get_error(session));
-    return SSH_ERROR;
-  }
-  if(test==TEST_WRITE){
-    snprintf(name,sizeof(name),"/tmp/libsshstress%d",rand());
-    file=sftp_open(sftp,name,O_RDWR|O_CREAT,0777);
-    if(!file){
-      printf("Failed to open file : %s\n",ssh_get_error(session));
-      sftp_free(sftp);
-      return SSH_ERROR;
-    }
-    while(wrote<FILESIZE){
-      int max=FILESIZE-wrote;
-      int towrite=rand()%max + 1;
-      int ret=sftp_write(file,&samplefile[wrote],towrite);
-      if(ret<=0){
-        printf("Problem while writing : %s\n",ssh_get_error(session));
-        sftp_free(sftp);
-        return SSH_ERROR;
-      }
-      if(ret != towrite){
-        printf("Asked to write %d, wrote %d\n",towrite,ret);
-      }
-      wrote += ret;
+/* writes size bytes of the sample file at the start of a new file */
+static int write_file(sftp_session sftp, const char *name, size_t size,
+    size_t block){
+  sftp_file file;
+  size_t wrote=0;
+  size_t towrite;
+  ssize_t ret;
+
+  file=sftp_open(sftp,name,O_WRONLY|O_CREAT|O_TRUNC,0644);
+  if(file == NULL)
+    return -1;
+  while(wrote < size){
+    towrite=size - wrote < block ? size - wrote : block;
+    ret=sftp_write(file,samplefile,towrite);
+    if(ret != (ssize_t)towrite){
+      sftp_close(file);
+      return -1;
     }
+    wrote+=ret;
+  }
+  return sftp_close(file) == SSH_OK ? 0 : -1;
+}
+
+/* reads size bytes of a file, from its start */
+static int read_file(sftp_session sftp, const char *name, size_t size,
+    size_t block, char *buffer){
+  sftp_file file;
+  size_t total=0;
+  ssize_t ret;
+
+  file=sftp_open(sftp,name,O_RDONLY,0);
+  if(file == NULL)
+    return -1;
+  while((ret=sftp_read(file,buffer,block)) > 0)
+    total+=ret;
+  sftp_close(file);
+  return ret == 0 && total == size ? 0 : -1;
+}
+
+static int op_small(struct worker *w, sftp_session sftp, char *buffer,
+    size_t *bytes){
+  struct config *config=w->config;
+  char name[300];
+
+  snprintf(name,sizeof(name),"%s/small-%u",w->dir,(unsigned)rand_r(&w->seed));
+  if(write_file(sftp,name,config->small_size,config->block_size) < 0 ||
+      read_file(sftp,name,config->small_size,config->block_size,buffer) < 0){
+    sftp_unlink(sftp,name);
+    return -1;
+  }
+  *bytes=2 * config->small_size;
+  return sftp_unlink(sftp,name);
+}
+
+static int op_large(struct worker *w, sftp_session sftp, char *buffer,
+    size_t *bytes){
+  struct config *config=w->config;
+  char name[300];
+  int rc;
+
+  snprintf(name,sizeof(name),"%s/large",w->dir);
+  /* written by the first operation of the thread, then read and written */
+  if(!w->large_written)
+    rc=write_file(sftp,name,config->large_size,config->block_size);
+  else
+    rc=read_file(sftp,name,config->large_size,config->block_size,buffer);
+  if(rc == 0){
+    w->large_written=!w->large_written;
+    *bytes=config->large_size;
+  }
+  return rc;
+}
+
+static int op_random(struct worker *w, sftp_session sftp, char *buffer,
+    size_t *bytes){
+  struct config *config=w->config;
+  uint64_t blocks=config->large_size / config->block_size;
+  sftp_file file;
+  char name[300];
+  ssize_t ret;
+
+  snprintf(name,sizeof(name),"%s/large",w->dir);
+  file=sftp_open(sftp,name,O_RDONLY,0);
+  if(file == NULL)
+    return -1;
+  if(sftp_seek64(file,(rand_r(&w->seed) % blocks) * config->block_size) < 0){
     sftp_close(file);
+    return -1;
+  }
+  ret=sftp_read(file,buffer,config->block_size);
+  sftp_close(file);
+  if(ret != (ssize_t)config->block_size)
+    return -1;
+  *bytes=ret;
+  return 0;
+}
+
+static int op_readdir(struct worker *w, sftp_session sftp, char *buffer,
+    size_t *bytes){
+  sftp_attributes attr;
+  sftp_dir dir;
+  char name[300];
+  int entries=0;
+  (void) buffer;
+  (void) bytes;
+
+  snprintf(name,sizeof(name),"%s/dir",w->dir);
+  dir=sftp_opendir(sftp,name);
+  if(dir == NULL)
+    return -1;
+  while((attr=sftp_readdir(sftp,dir)) != NULL){
+    entries++;
+    sftp_attributes_free(attr);
+  }
+  if(!sftp_dir_eof(dir)){
+    sftp_closedir(dir);
+    return -1;
+  }
+  sftp_closedir(dir);
+  /* the files, . and .. */
+  return entries >= w->config->nfiles ? 0 : -1;
+}
+
+static int op_meta(struct worker *w, sftp_session sftp, char *buffer,
+    size_t *bytes){
+  sftp_attributes attr;
+  char name[300];
+  (void) buffer;
+  (void) bytes;
+
+  snprintf(name,sizeof(name),"%s/dir/file-0",w->dir);
+  attr=sftp_stat(sftp,name);
+  if(attr == NULL)
+    return -1;
+  sftp_attributes_free(attr);
+  attr=sftp_lstat(sftp,name);
+  if(attr == NULL)
+    return -1;
+  sftp_attributes_free(attr);
+  return sftp_chmod(sftp,name,(rand_r(&w->seed) & 1) ? 0644 : 0600);
+}
+
+static int (*const ops[OP_NUMBER])(struct worker *, sftp_session, char *,
+    size_t *)={
+  op_small, op_large, op_random, op_readdir, op_meta
+};
+
+/* the directory of the thread, its large file and its directory of files */
+static int worker_setup(struct worker *w){
+  struct config *config=w->config;
+  sftp_session sftp=w->sftps[0];
+  char name[300];
+  int i;
+
+  snprintf(w->dir,sizeof(w->dir),"%s/thread-%d",config->dir,w->id);
+  sftp_mkdir(sftp,w->dir,0755);
+  snprintf(name,sizeof(name),"%s/dir",w->dir);
+  sftp_mkdir(sftp,name,0755);
+  for(i=0;i<config->nfiles;i++){
+    snprintf(name,sizeof(name),"%s/dir/file-%d",w->dir,i);
+    if(write_file(sftp,name,config->small_size,config->block_size) < 0)
+      return -1;
+  }
+  snprintf(name,sizeof(name),"%s/large",w->dir);
+  if(write_file(sftp,name,config->large_size,config->block_size) < 0)
+    return -1;
+  w->large_written=1;
+  return 0;
+}
+
+static void worker_cleanup(struct worker *w){
+  struct config *config=w->config;
+  sftp_session sftp=w->sftps[0];
+  char name[300];
+  int i;
+
+  for(i=0;i<config->nfiles;i++){
+    snprintf(name,sizeof(name),"%s/dir/file-%d",w->dir,i);
+    sftp_unlink(sftp,name);
+  }
+  snprintf(name,sizeof(name),"%s/dir",w->dir);
+  sftp_rmdir(sftp,name);
+  snprintf(name,sizeof(name),"%s/large",w->dir);
+  sftp_unlink(sftp,name);
+  sftp_rmdir(sftp,w->dir);
+}
+
+/* an operation drawn with the ratios */
+static enum op_e pick_op(struct worker *w){
+  int total=0;
+  int r;
+  int i;
+
+  for(i=0;i<OP_NUMBER;i++)
+    total+=w->config->ratios[i];
+  r=rand_r(&w->seed) % total;
+  for(i=0;i<OP_NUMBER;i++){
+    if(r < w->config->ratios[i])
+      break;
+    r-=w->config->ratios[i];
+  }
+  return i;
+}
+
+static void *worker_thread(void *arg){
+  struct worker *w=arg;
+  struct config *config=w->config;
+  uint64_t interval=0;
+  uint64_t end;
+  uint64_t scheduled;
+  uint64_t start;
+  uint64_t t;
+  size_t bytes;
+  char *buffer;
+  enum op_e op;
+  int n=0;
+  int i;
+  int rc;
+
+  buffer=malloc(config->block_size);
+  if(buffer == NULL){
+    w->error=1;
+    return NULL;
+  }
+  for(i=0;i<config->sessions;i++){
+    w->sessions[i]=connect_host(config);
+    if(w->sessions[i] == NULL)
+      goto error;
+    w->sftps[i]=sftp_new(w->sessions[i]);
+    if(w->sftps[i] == NULL || sftp_init(w->sftps[i]) < 0){
+      fprintf(stderr,"problem initializing sftp : %s\n",
+          ssh_get_error(w->sessions[i]));
+      goto error;
+    }
+  }
+  if(worker_setup(w) < 0){
+    fprintf(stderr,"Error preparing %s : %s\n",w->dir,
+        ssh_get_error(w->sessions[0]));
+    goto error;
+  }
+
+  if(config->rate > 0)
+    interval=(uint64_t)(1000000.0 * config->threads / config->rate);
+  start=now_us();
+  w->started=start;
+  end=start + (uint64_t)config->duration * 1000000;
+  /* the threads don't start their schedules at the same time */
+  scheduled=start + (interval * w->id) / config->threads;
+  while(!stop){
+    if(interval == 0)
+      scheduled=now_us();
+    if(scheduled >= end)
+      break;
+    t=now_us();
+    if(scheduled > t)
+      usleep(scheduled - t);
+    op=pick_op(w);
+    bytes=0;
+    rc=ops[op](w,w->sftps[n % config->sessions],buffer,&bytes);
+    stats_add(&w->stats[op],now_us() - scheduled,bytes,rc < 0);
+    if(rc < 0 && !ssh_is_connected(w->sessions[n % config->sessions])){
+      fprintf(stderr,"Thread %d lost its session : %s\n",w->id,
+          ssh_get_error(w->sessions[n % config->sessions]));
+      goto error;
+    }
+    scheduled+=interval;
+    n++;
+  }
+  w->ended=now_us();
+  if(!config->keep)
+    worker_cleanup(w);
+  goto end;
+error:
+  w->error=1;
+end:
+  for(i=0;i<config->sessions;i++){
+    if(w->sftps[i] != NULL)
+      sftp_free(w->sftps[i]);
+    if(w->sessions[i] != NULL){
+      ssh_disconnect(w->sessions[i]);
+      ssh_free(w->sessions[i]);
+    }
+  }
+  free(buffer);
+  return NULL;
+}
+
+static void report(struct config *config, struct worker *workers){
+  struct op_stats all[OP_NUMBER];
+  struct op_stats *s;
+  double seconds=0.0;
+  uint64_t bytes=0;
+  unsigned long count=0;
+  int i;
+  int j;
+
+  memset(all,0,sizeof(all));
+  for(i=0;i<config->threads;i++){
+    for(j=0;j<OP_NUMBER;j++)
+      stats_merge(&all[j],&workers[i].stats[j]);
+    if(workers[i].ended > workers[i].started &&
+        (workers[i].ended - workers[i].started) / 1000000.0 > seconds)
+      seconds=(workers[i].ended - workers[i].started) / 1000000.0;
+  }
+  if(seconds == 0.0)
+    return;
+
+  printf("%d threads, %d sessions each, %.1f s", config->threads,
+      config->sessions,seconds);
+  if(config->rate > 0)
+    printf(", %.1f ops/s scheduled",config->rate);
+  printf("\n%-8s %9s %7s %10s %9s %9s %9s %9s %9s %9s\n","op","count",
+      "errors","ops/s","MB/s","p50 ms","p90 ms","p99 ms","p999 ms","max ms");
+  for(j=0;j<OP_NUMBER;j++){
+    s=&all[j];
+    if(s->count == 0 && s->errors == 0)
+      continue;
+    printf("%-8s %9lu %7lu %10.1f %9.2f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+        op_names[j],s->count,s->errors,s->count / seconds,
+        s->bytes / seconds / 1048576,stats_percentile(s,0.5),
+        stats_percentile(s,0.9),stats_percentile(s,0.99),
+        stats_percentile(s,0.999),s->max / 1000.0);
+    count+=s->count;
+    bytes+=s->bytes;
+  }
+  printf("%-8s %9lu %7s %10.1f %9.2f\n","total",count,"",count / seconds,
+      bytes / seconds / 1048576);
+}
+
+/* "small:40,random:30" sets the ratios named, the others to 0 */
+static int parse_mix(struct config *config, const char *mix){
+  char *copy=strdup(mix);
+  char *save=NULL;
+  char *token;
+  char *colon;
+  int total=0;
+  int i;
+
+  if(copy == NULL)
+    return -1;
+  memset(config->ratios,0,sizeof(config->ratios));
+  for(token=strtok_r(copy,",",&save);token != NULL;
+      token=strtok_r(NULL,",",&save)){
+    colon=strchr(token,':');
+    if(colon == NULL)
+      goto error;
+    *colon='\0';
+    for(i=0;i<OP_NUMBER && strcmp(token,op_names[i]) != 0;i++)
+      ;
+    if(i == OP_NUMBER || atoi(colon + 1) < 0)
+      goto error;
+    config->ratios[i]=atoi(colon + 1);
+    total+=config->ratios[i];
+  }
+  free(copy);
+  return total > 0 ? 0 : -1;
+error:
+  free(copy);
+  return -1;
+}
+
+static void usage(const char *program){
+  fprintf(stderr,"Usage : %s [options] host\n"
+      "  -l user      user name\n"
+      "  -p port      port of the server\n"
+      "  -t threads   number of threads (4)\n"
+      "  -s sessions  sessions of each thread (1)\n"
+      "  -d seconds   duration of the test (10)\n"
+      "  -r rate      operations by second of all the threads, open loop\n"
+      "               (as fast as possible by default)\n"
+      "  -m mix       ratios of the operations (small:30,large:5,random:30,\n"
+      "               readdir:5,meta:30)\n"
+      "  -D dir       remote directory of the files (/tmp/libssh_sftp_stress)\n"
+      "  -S bytes     size of the small files (4096)\n"
+      "  -L bytes     size of the large files (8388608)\n"
+      "  -b bytes     size of the reads and writes (32768)\n"
+      "  -n files     files of the readdir directories (100)\n"
+      "  -k           keep the files on the server\n",program);
+}
+
+int main(int argc, char **argv){
+  struct config config;
+  struct worker *workers;
+  int started=0;
+  int errors=0;
+  size_t i;
+  int opt;
+
+  memset(&config,0,sizeof(config));
+  config.threads=4;
+  config.sessions=1;
+  config.duration=10;
+  config.dir="/tmp/libssh_sftp_stress";
+  config.small_size=4096;
+  config.large_size=8 * 1024 * 1024;
+  config.block_size=32768;
+  config.nfiles=100;
+  parse_mix(&config,"small:30,large:5,random:30,readdir:5,meta:30");
+
+  while((opt=getopt(argc,argv,"l:p:t:s:d:r:m:D:S:L:b:n:k")) != -1){
+    switch(opt){
+      case 'l': config.user=optarg; break;
+      case 'p': config.port=atoi(optarg); break;
+      case 't': config.threads=atoi(optarg); break;
+      case 's': config.sessions=atoi(optarg); break;
+      case 'd': config.duration=atoi(optarg); break;
+      case 'r': config.rate=atof(optarg); break;
+      case 'm':
+        if(parse_mix(&config,optarg) < 0){
+          fprintf(stderr,"Invalid mix %s\n",optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'D': config.dir=optarg; break;
+      case 'S': config.small_size=strtoul(optarg,NULL,10); break;
+      case 'L': config.large_size=strtoul(optarg,NULL,10); break;
+      case 'b': config.block_size=strtoul(optarg,NULL,10); break;
+      case 'n': config.nfiles=atoi(optarg); break;
+      case 'k': config.keep=1; break;
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if(optind != argc - 1 || config.threads <= 0 || config.sessions <= 0 ||
+      config.duration <= 0 || config.block_size == 0 ||
+      config.large_size < config.block_size || config.nfiles <= 0){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  config.host=argv[optind];
+
+  /* the data written, one block repeated */
+  samplefile=malloc(config.block_size);
+  workers=calloc(config.threads,sizeof(struct worker));
+  if(samplefile == NULL || workers == NULL){
+    fprintf(stderr,"Out of memory\n");
+    return EXIT_FAILURE;
+  }
+  srand(time(NULL));
+  for(i=0;i<config.block_size;++i)
+    samplefile[i]=rand() & 0xff;
+  signal(SIGTERM,signal_stop);
+  signal(SIGINT,signal_stop);
+
+  ssh_threads_set_callbacks(ssh_threads_get_pthread());
+  ssh_init();
+  {
+    ssh_session session=connect_host(&config);
+    sftp_session sftp;
+
+    /* the directory of all the threads */
+    if(session == NULL)
+      return EXIT_FAILURE;
+    sftp=sftp_new(session);
+    if(sftp == NULL || sftp_init(sftp) < 0){
+      fprintf(stderr,"problem initializing sftp : %s\n",
+          ssh_get_error(session));
+      return EXIT_FAILURE;
+    }
+    sftp_mkdir(sftp,config.dir,0755);
+    sftp_free(sftp);
+    ssh_disconnect(session);
+    ssh_free(session);
+  }
+
+  for(opt=0;opt<config.threads;++opt){
+    struct worker *w=&workers[opt];
+
+    w->id=opt;
+    w->config=&config;
+    w->seed=rand();
+    w->sessions=calloc(config.sessions,sizeof(ssh_session));
+    w->sftps=calloc(config.sessions,sizeof(sftp_session));
+    if(w->sessions == NULL || w->sftps == NULL ||
+        pthread_create(&w->thread,NULL,worker_thread,w) != 0)
+      break;
+    started++;
+  }
+  for(opt=0;opt<started;++opt){
+    pthread_join(workers[opt].thread,NULL);
+    errors+=workers[opt].error;
+  }
+  report(&config,workers);
+  for(opt=0;opt<config.threads;++opt){
+    free(workers[opt].sessions);
+    free(workers[opt].sftps);
+  }
+  free(workers);
+  free(samplefile);
+  ssh_finalize();
+  if(errors > 0 || started < config.threads){
+    fprintf(stderr,"%d threads failed\n",
+        errors + config.threads - started);
+    return EXIT_FAILURE;
   }
-  sftp_free(sftp);
-  return SSH_OK;
+  return EXIT_SUCCESS;
 }
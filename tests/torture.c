@@ -31,9 +31,18 @@
 # include <dirent.h>
 # include <errno.h>
 # include <unistd.h>
+# include <string.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <arpa/inet.h>
 #endif
 
 #include "torture.h"
+#include "libssh/buffer.h"
+#include "libssh/channels.h"
+#include "libssh/packet.h"
+#include "libssh/session.h"
+#include "libssh/socket.h"
 
 static int verbosity = 0;
 
@@ -282,6 +291,146 @@ void torture_sftp_close(struct torture_sftp *t) {
 }
 #endif
 
+#ifndef _WIN32
+/* the two ends of a connection to 127.0.0.1 */
+static void torture_tcp_pair(int fds[2]) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listener;
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(listener >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert_int_equal(bind(listener, (struct sockaddr *) &addr, sizeof(addr)),
+                     0);
+    assert_int_equal(listen(listener, 1), 0);
+    assert_int_equal(getsockname(listener, (struct sockaddr *) &addr, &len),
+                     0);
+    fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(fds[1] >= 0);
+    assert_int_equal(connect(fds[1], (struct sockaddr *) &addr, sizeof(addr)),
+                     0);
+    fds[0] = accept(listener, NULL, NULL);
+    assert_true(fds[0] >= 0);
+    close(listener);
+}
+
+void torture_peer_new(struct torture_peer *peer, int flags) {
+    int fds[2];
+
+    if (flags & TORTURE_PEER_TCP) {
+        torture_tcp_pair(fds);
+    } else {
+        assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    }
+    peer->fd = fds[1];
+    peer->session = ssh_new();
+    assert_true(peer->session != NULL);
+    if (flags & TORTURE_PEER_SERVER) {
+        peer->session->server = 1;
+    }
+    assert_int_equal(ssh_socket_connect_fd(peer->session->socket, fds[0]),
+                     SSH_OK);
+    peer->session->alive = 1;
+    peer->session->version = 2;
+
+    if (flags & TORTURE_PEER_PACKETS) {
+        ssh_packet_register_socket_callback(peer->session,
+                                            peer->session->socket);
+        ssh_packet_set_default_callbacks(peer->session);
+    }
+}
+
+void torture_peer_free(struct torture_peer *peer) {
+    if (peer->session != NULL) {
+        peer->session->alive = 0;
+        ssh_free(peer->session);
+    }
+    close(peer->fd);
+}
+
+ssh_channel torture_peer_channel(struct torture_peer *peer, uint32_t window,
+                                 uint32_t maxpacket) {
+    ssh_channel channel;
+
+    channel = ssh_channel_new(peer->session);
+    assert_true(channel != NULL);
+    assert_true(ssh_channel_new_id(peer->session, channel) != 0);
+    channel->state = SSH_CHANNEL_STATE_OPEN;
+    channel->remote_window = window;
+    channel->remote_maxpacket = maxpacket;
+
+    return channel;
+}
+
+int torture_peer_pending(struct torture_peer *peer) {
+    uint32_t len;
+
+    return recv(peer->fd, &len, sizeof(len), MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+int torture_peer_recv(struct torture_peer *peer, unsigned char *packet,
+                      size_t size) {
+    uint32_t len;
+    size_t done;
+    ssize_t n;
+
+    if (recv(peer->fd, &len, sizeof(len), MSG_WAITALL) != sizeof(len)) {
+        return -1;
+    }
+    len = ntohl(len);
+    if (len > size) {
+        return -1;
+    }
+    for (done = 0; done < len; done += n) {
+        n = recv(peer->fd, packet + done, len - done, 0);
+        if (n <= 0) {
+            return -1;
+        }
+    }
+
+    return len;
+}
+
+uint32_t torture_peer_read(struct torture_peer *peer, unsigned char *packet,
+                           size_t size) {
+    int len;
+    int i;
+
+    for (i = 0; i < 10 && !torture_peer_pending(peer); i++) {
+        assert_int_equal(ssh_handle_packets(peer->session, 100), SSH_OK);
+    }
+    assert_true(torture_peer_pending(peer));
+    len = torture_peer_recv(peer, packet, size);
+    assert_true(len > 0);
+
+    return len;
+}
+
+void torture_peer_send(struct torture_peer *peer, ssh_buffer payload) {
+    unsigned char packet[40000];
+    uint32_t len = buffer_get_rest_len(payload);
+    uint32_t v;
+    uint8_t pad;
+
+    /* length, padding length, payload and padding to 8 bytes */
+    pad = 8 - (4 + 1 + len) % 8;
+    if (pad < 4) {
+        pad += 8;
+    }
+    assert_true(5 + len + pad <= sizeof(packet));
+    v = htonl(1 + len + pad);
+    memcpy(packet, &v, 4);
+    packet[4] = pad;
+    memcpy(packet + 5, buffer_get_rest(payload), len);
+    memset(packet + 5 + len, 0, pad);
+    assert_int_equal(write(peer->fd, packet, 5 + len + pad), 5 + len + pad);
+    ssh_buffer_free(payload);
+}
+#endif /* _WIN32 */
+
 int torture_libssh_verbosity(void){
   return verbosity;
 }
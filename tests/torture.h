@@ -67,6 +67,61 @@ ssh_session torture_ssh_session(const char *host,
 struct torture_sftp *torture_sftp_session(ssh_session session);
 void torture_sftp_close(struct torture_sftp *t);
 
+#ifndef _WIN32
+/*
+ * A session on one end of a socketpair, the test playing its peer on the
+ * other end. The packets are unencrypted, as before the first kex.
+ */
+struct torture_peer {
+    ssh_session session;
+    int fd; /* the end of the peer */
+};
+
+/* the session is a server */
+#define TORTURE_PEER_SERVER 0x01
+/* it reads the packets of the peer from its socket, as after a connection */
+#define TORTURE_PEER_PACKETS 0x02
+/* a TCP connection on the loopback, for the address of the peer */
+#define TORTURE_PEER_TCP 0x04
+
+void torture_peer_new(struct torture_peer *peer, int flags);
+/* the session may be NULL once something else, e.g. a mux, freed it */
+void torture_peer_free(struct torture_peer *peer);
+
+/*
+ * Adds an open channel to the session, whose other end is the peer, with
+ * the window and the packet size of the peer.
+ */
+ssh_channel torture_peer_channel(struct torture_peer *peer, uint32_t window,
+                                 uint32_t maxpacket);
+
+/*
+ * Whether a packet sent by the session waits to be read by the peer.
+ */
+int torture_peer_pending(struct torture_peer *peer);
+
+/*
+ * Reads the next packet sent by the session into packet, from its padding
+ * length, and returns its length. The packets wait for the socket to be
+ * writable, so the session is run until one was sent.
+ */
+uint32_t torture_peer_read(struct torture_peer *peer, unsigned char *packet,
+                           size_t size);
+
+/*
+ * Reads the next packet like torture_peer_read(), but waits for it without
+ * running the session, e.g. from a thread of the peer. Returns -1 once the
+ * socket is closed.
+ */
+int torture_peer_recv(struct torture_peer *peer, unsigned char *packet,
+                      size_t size);
+
+/*
+ * Sends a packet of the payload to the session, which is freed.
+ */
+void torture_peer_send(struct torture_peer *peer, ssh_buffer payload);
+#endif /* _WIN32 */
+
 /*
  * This function must be defined in every unit test file.
  */
@@ -0,0 +1,158 @@
+#define LIBSSH_STATIC
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/admission.h"
+
+/*
+ * Test that the sessions are counted up to the limit, and that the count
+ * outlives the bind
+ */
+static void torture_admission_count(void **state) {
+  struct ssh_admission_struct *bind;
+  struct ssh_admission_struct *s1, *s2, *s3;
+
+  (void) state;
+
+  bind = ssh_admission_new();
+  assert_true(bind != NULL);
+  assert_int_equal(ssh_admission_enter(bind, 2), 0);
+  s1 = bind;
+  assert_int_equal(ssh_admission_enter(bind, 2), 0);
+  s2 = bind;
+  assert_int_equal(ssh_admission_enter(bind, 2), -1);
+  assert_int_equal(ssh_admission_count(bind), 2);
+
+  /* an authenticated session makes room */
+  ssh_admission_leave(&s1);
+  assert_true(s1 == NULL);
+  assert_int_equal(ssh_admission_count(bind), 1);
+  assert_int_equal(ssh_admission_enter(bind, 2), 0);
+  s3 = bind;
+  assert_int_equal(ssh_admission_enter(bind, 0), 0);
+  s1 = bind;
+  assert_int_equal(ssh_admission_count(bind), 3);
+
+  ssh_admission_leave(&bind);
+  ssh_admission_leave(&s1);
+  ssh_admission_leave(&s2);
+  ssh_admission_leave(&s3);
+  ssh_admission_leave(&s3);
+}
+
+/*
+ * Test the sources: an IPv4 address, the same in IPv6, and the /64 network
+ * of an IPv6 address
+ */
+static void torture_admission_key(void **state) {
+  struct sockaddr_in sin;
+  struct sockaddr_in6 sin6;
+  uint64_t key;
+
+  (void) state;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  assert_int_equal(inet_pton(AF_INET, "192.0.2.1", &sin.sin_addr), 1);
+  key = ssh_admission_key((struct sockaddr *) &sin);
+
+  memset(&sin6, 0, sizeof(sin6));
+  sin6.sin6_family = AF_INET6;
+  assert_int_equal(inet_pton(AF_INET6, "::ffff:192.0.2.1", &sin6.sin6_addr),
+      1);
+  assert_true(ssh_admission_key((struct sockaddr *) &sin6) == key);
+  assert_int_equal(inet_pton(AF_INET6, "::ffff:192.0.2.2", &sin6.sin6_addr),
+      1);
+  assert_true(ssh_admission_key((struct sockaddr *) &sin6) != key);
+
+  assert_int_equal(inet_pton(AF_INET6, "2001:db8::1", &sin6.sin6_addr), 1);
+  key = ssh_admission_key((struct sockaddr *) &sin6);
+  assert_int_equal(inet_pton(AF_INET6, "2001:db8::ffff:2", &sin6.sin6_addr),
+      1);
+  assert_true(ssh_admission_key((struct sockaddr *) &sin6) == key);
+  assert_int_equal(inet_pton(AF_INET6, "2001:db8:0:1::1", &sin6.sin6_addr),
+      1);
+  assert_true(ssh_admission_key((struct sockaddr *) &sin6) != key);
+}
+
+/*
+ * Test that a source gets its burst at once, then the rate
+ */
+static void torture_admission_rate(void **state) {
+  struct ssh_admission_sources sources;
+  uint64_t now = 1000000;
+  int i;
+
+  (void) state;
+
+  memset(&sources, 0, sizeof(sources));
+  assert_int_equal(ssh_admission_rate(&sources, 1, 0, 0, now), 0);
+  assert_true(sources.table == NULL);
+
+  /* 2 a second, 5 at once */
+  for (i = 0; i < 5; i++) {
+    assert_int_equal(ssh_admission_rate(&sources, 1, 2, 5, now), 0);
+  }
+  assert_int_equal(ssh_admission_rate(&sources, 1, 2, 5, now), -1);
+  /* the other sources have their own bucket */
+  assert_int_equal(ssh_admission_rate(&sources, 2, 2, 5, now), 0);
+
+  now += 499;
+  assert_int_equal(ssh_admission_rate(&sources, 1, 2, 5, now), -1);
+  now += 1;
+  assert_int_equal(ssh_admission_rate(&sources, 1, 2, 5, now), 0);
+  assert_int_equal(ssh_admission_rate(&sources, 1, 2, 5, now), -1);
+
+  /* the burst is the rate by default */
+  assert_int_equal(ssh_admission_rate(&sources, 3, 2, 0, now), 0);
+  assert_int_equal(ssh_admission_rate(&sources, 3, 2, 0, now), 0);
+  assert_int_equal(ssh_admission_rate(&sources, 3, 2, 0, now), -1);
+
+  ssh_admission_sources_free(&sources);
+  assert_true(sources.table == NULL);
+}
+
+/*
+ * Test that the sources with a full bucket leave the table
+ */
+static void torture_admission_prune(void **state) {
+  struct ssh_admission_sources sources;
+  uint64_t now = 1000000;
+  uint64_t key;
+
+  (void) state;
+
+  memset(&sources, 0, sizeof(sources));
+  for (key = 0; key < 1024; key++) {
+    assert_int_equal(ssh_admission_rate(&sources, key, 1, 1, now), 0);
+  }
+  assert_int_equal(sources.table->count, 1024);
+
+  /* the last ones are still waiting for a token */
+  now += 1000;
+  assert_int_equal(ssh_admission_rate(&sources, 5000, 1, 1, now), 0);
+  assert_int_equal(sources.table->count, 1);
+  assert_int_equal(ssh_admission_rate(&sources, 5000, 1, 1, now), -1);
+
+  ssh_admission_sources_free(&sources);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_admission_count),
+        unit_test(torture_admission_key),
+        unit_test(torture_admission_rate),
+        unit_test(torture_admission_prune),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,192 @@
+#define LIBSSH_STATIC
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/packet.h"
+#include "libssh/buffer.h"
+#include "libssh/ssh2.h"
+
+/* a nonblocking client session on a socketpair, as after the kex */
+static void auth_peer_new(struct torture_peer *peer) {
+  /* without an agent, nor identity files */
+  unsetenv("SSH_AUTH_SOCK");
+  torture_peer_new(peer, TORTURE_PEER_PACKETS);
+  assert_int_equal(ssh_options_set(peer->session, SSH_OPTIONS_USER, "alice"),
+      0);
+  assert_int_equal(ssh_options_set(peer->session, SSH_OPTIONS_SSH_DIR,
+        "/nonexistent"), 0);
+  peer->session->session_state = SSH_SESSION_STATE_AUTHENTICATING;
+  ssh_set_blocking(peer->session, 0);
+}
+
+/* sends an unencrypted packet of the payload packed by the format */
+static void auth_peer_send(struct torture_peer *peer, uint8_t type,
+    const char *format, ...) {
+  ssh_buffer payload;
+  va_list ap;
+
+  payload = ssh_buffer_new();
+  assert_true(payload != NULL);
+  assert_int_equal(buffer_add_u8(payload, type), 0);
+  if (format != NULL) {
+    va_start(ap, format);
+    /* the strings and integers of the tests */
+    for (; *format != '\0'; format++) {
+      if (*format == 's') {
+        const char *str = va_arg(ap, const char *);
+        assert_int_equal(buffer_pack(payload, "s", str), 0);
+      } else if (*format == 'd') {
+        assert_int_equal(buffer_pack(payload, "d", va_arg(ap, uint32_t)), 0);
+      } else {
+        assert_int_equal(buffer_pack(payload, "b",
+              (uint8_t) va_arg(ap, int)), 0);
+      }
+    }
+    va_end(ap);
+  }
+
+  torture_peer_send(peer, payload);
+}
+
+/* reads the packet the client sent, returns its type */
+static uint8_t auth_peer_read(struct torture_peer *peer) {
+  unsigned char packet[4096];
+
+  assert_true(torture_peer_pending(peer));
+  torture_peer_read(peer, packet, sizeof(packet));
+
+  /* padding length, type */
+  return packet[1];
+}
+
+/* nothing was sent by the client */
+static void auth_peer_nothing(struct torture_peer *peer) {
+  assert_false(torture_peer_pending(peer));
+}
+
+static void torture_auth_list(void **state) {
+  struct torture_peer peer;
+
+  (void) state;
+
+  auth_peer_new(&peer);
+
+  /* the service is asked, then the methods with a "none" request */
+  assert_int_equal(ssh_userauth_list(peer.session, NULL), SSH_AUTH_AGAIN);
+  assert_int_equal(auth_peer_read(&peer), SSH2_MSG_SERVICE_REQUEST);
+  auth_peer_nothing(&peer);
+  auth_peer_send(&peer, SSH2_MSG_SERVICE_ACCEPT, "s", "ssh-userauth");
+  assert_int_equal(ssh_userauth_list(peer.session, NULL), SSH_AUTH_AGAIN);
+  assert_int_equal(auth_peer_read(&peer), SSH2_MSG_USERAUTH_REQUEST);
+  assert_int_equal(ssh_userauth_list(peer.session, NULL), SSH_AUTH_AGAIN);
+  auth_peer_nothing(&peer);
+
+  auth_peer_send(&peer, SSH2_MSG_USERAUTH_FAILURE, "sb",
+      "publickey,keyboard-interactive", 0);
+  assert_int_equal(ssh_userauth_list(peer.session, NULL),
+      SSH_AUTH_METHOD_PUBLICKEY | SSH_AUTH_METHOD_INTERACTIVE);
+  assert_int_equal(peer.session->pending_call_state, SSH_PENDING_CALL_NONE);
+
+  torture_peer_free(&peer);
+}
+
+static void torture_auth_kbdint(void **state) {
+  struct torture_peer peer;
+  char echo = 1;
+
+  (void) state;
+
+  auth_peer_new(&peer);
+  peer.session->auth_service_state = SSH_AUTH_SERVICE_ACCEPTED;
+
+  assert_int_equal(ssh_userauth_kbdint(peer.session, NULL, NULL),
+      SSH_AUTH_AGAIN);
+  assert_int_equal(auth_peer_read(&peer), SSH2_MSG_USERAUTH_REQUEST);
+  /* the other methods wait for it */
+  assert_int_equal(ssh_userauth_password(peer.session, NULL, "secret"),
+      SSH_AUTH_ERROR);
+  assert_int_equal(ssh_userauth_kbdint(peer.session, NULL, NULL),
+      SSH_AUTH_AGAIN);
+
+  /* the questions */
+  auth_peer_send(&peer, SSH2_MSG_USERAUTH_INFO_REQUEST, "sssdsb",
+      "name", "instruction", "", 1, "Password: ", 0);
+  assert_int_equal(ssh_userauth_kbdint(peer.session, NULL, NULL),
+      SSH_AUTH_INFO);
+  assert_int_equal(ssh_userauth_kbdint_getnprompts(peer.session), 1);
+  assert_string_equal(ssh_userauth_kbdint_getprompt(peer.session, 0, &echo),
+      "Password: ");
+  assert_int_equal(echo, 0);
+  assert_int_equal(ssh_userauth_kbdint_setanswer(peer.session, 0, "secret"),
+      0);
+
+  /* the answers, sent once */
+  assert_int_equal(ssh_userauth_kbdint(peer.session, NULL, NULL),
+      SSH_AUTH_AGAIN);
+  assert_int_equal(auth_peer_read(&peer), SSH2_MSG_USERAUTH_INFO_RESPONSE);
+  assert_int_equal(ssh_userauth_kbdint(peer.session, NULL, NULL),
+      SSH_AUTH_AGAIN);
+  auth_peer_nothing(&peer);
+  auth_peer_send(&peer, SSH2_MSG_USERAUTH_SUCCESS, NULL);
+  assert_int_equal(ssh_userauth_kbdint(peer.session, NULL, NULL),
+      SSH_AUTH_SUCCESS);
+  assert_int_equal(peer.session->pending_call_state, SSH_PENDING_CALL_NONE);
+
+  torture_peer_free(&peer);
+}
+
+static void torture_auth_autopubkey(void **state) {
+  struct torture_peer peer;
+
+  (void) state;
+
+  auth_peer_new(&peer);
+
+  /* the service and "none" requests go together */
+  assert_int_equal(ssh_userauth_autopubkey(peer.session, NULL),
+      SSH_AUTH_AGAIN);
+  assert_int_equal(auth_peer_read(&peer), SSH2_MSG_SERVICE_REQUEST);
+  assert_int_equal(auth_peer_read(&peer), SSH2_MSG_USERAUTH_REQUEST);
+  auth_peer_send(&peer, SSH2_MSG_SERVICE_ACCEPT, "s", "ssh-userauth");
+  assert_int_equal(ssh_userauth_autopubkey(peer.session, NULL),
+      SSH_AUTH_AGAIN);
+  auth_peer_nothing(&peer);
+
+  /* without keys, nothing else is tried */
+  auth_peer_send(&peer, SSH2_MSG_USERAUTH_FAILURE, "sb", "publickey", 0);
+  assert_int_equal(ssh_userauth_autopubkey(peer.session, NULL),
+      SSH_AUTH_DENIED);
+  assert_int_equal(peer.session->pending_call_state, SSH_PENDING_CALL_NONE);
+  assert_true(peer.session->auth_auto == NULL);
+
+  /* what waits is freed with the session */
+  peer.session->auth_methods = 0;
+  assert_int_equal(ssh_userauth_autopubkey(peer.session, NULL),
+      SSH_AUTH_AGAIN);
+  assert_true(peer.session->auth_auto != NULL);
+
+  torture_peer_free(&peer);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_auth_list),
+        unit_test(torture_auth_kbdint),
+        unit_test(torture_auth_autopubkey),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
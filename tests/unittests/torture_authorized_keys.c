@@ -0,0 +1,179 @@
+#define LIBSSH_STATIC
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/buffer.h"
+#include "libssh/keys.h"
+#include "libssh/messages.h"
+#include "libssh/server.h"
+
+#define AUTHORIZED_KEYS "libssh_testauthorizedkeys"
+
+struct authkeys_state {
+  struct torture_peer peer; /* a client from 127.0.0.1 */
+  struct ssh_message_struct msg;
+  struct ssh_public_key_struct key;
+};
+
+/* the blob of an ed25519 key filled with c */
+static ssh_string authkeys_blob(char c) {
+  unsigned char pub[ED25519_PUBKEY_SIZE];
+  ssh_string type;
+  ssh_string key;
+  ssh_string blob;
+  ssh_buffer buffer;
+
+  memset(pub, c, sizeof(pub));
+  buffer = ssh_buffer_new();
+  type = ssh_string_from_char("ssh-ed25519");
+  key = ssh_string_new(sizeof(pub));
+  assert_true(buffer != NULL && type != NULL && key != NULL);
+  ssh_string_fill(key, pub, sizeof(pub));
+  assert_int_equal(buffer_add_ssh_string(buffer, type), 0);
+  assert_int_equal(buffer_add_ssh_string(buffer, key), 0);
+  blob = ssh_string_new(buffer_get_rest_len(buffer));
+  assert_true(blob != NULL);
+  ssh_string_fill(blob, buffer_get_rest(buffer), buffer_get_rest_len(buffer));
+  ssh_string_free(type);
+  ssh_string_free(key);
+  ssh_buffer_free(buffer);
+
+  return blob;
+}
+
+static void write_key(FILE *file, const char *options, char c,
+    const char *comment) {
+  unsigned char *b64;
+  ssh_string blob;
+
+  blob = authkeys_blob(c);
+  b64 = bin_to_base64(ssh_string_data(blob), ssh_string_len(blob));
+  assert_true(b64 != NULL);
+  fprintf(file, "%s%sssh-ed25519 %s %s\n", options,
+      options[0] != '\0' ? " " : "", b64, comment);
+  SAFE_FREE(b64);
+  ssh_string_free(blob);
+}
+
+/* the request of a key filled with c */
+static struct ssh_message_struct *request(struct authkeys_state *s, char c) {
+  ssh_string_free(s->key.blob);
+  s->key.blob = authkeys_blob(c);
+
+  return &s->msg;
+}
+
+static void setup(void **state) {
+  struct authkeys_state *s;
+  FILE *file;
+
+  s = malloc(sizeof(struct authkeys_state));
+  assert_true(s != NULL);
+  ZERO_STRUCTP(s);
+  torture_peer_new(&s->peer, TORTURE_PEER_TCP);
+  s->key.type = SSH_KEYTYPE_ED25519;
+  s->key.type_c = "ssh-ed25519";
+  s->msg.session = s->peer.session;
+  s->msg.type = SSH_REQUEST_AUTH;
+  s->msg.auth_request.method = SSH_AUTH_METHOD_PUBLICKEY;
+  s->msg.auth_request.public_key = &s->key;
+
+  file = fopen(AUTHORIZED_KEYS, "w");
+  assert_true(file != NULL);
+  fprintf(file, "# the keys of alice\n\n");
+  write_key(file, "", 'a', "alice@laptop");
+  write_key(file, "no-pty,command=\"echo \\\"hi\\\"\"", 'b', "backup");
+  write_key(file, "from=\"127.0.0.1,::1\",environment=\"A=b c\"", 'c',
+      "local");
+  write_key(file, "from=\"!127.0.0.1,*\"", 'd', "remote");
+  fprintf(file, "command=\"unterminated ssh-ed25519 AAAA\n");
+  fclose(file);
+
+  *state = s;
+}
+
+static void teardown(void **state) {
+  struct authkeys_state *s = *state;
+
+  unlink(AUTHORIZED_KEYS);
+  ssh_string_free(s->key.blob);
+  torture_peer_free(&s->peer);
+  SAFE_FREE(s);
+}
+
+static void torture_authorized_keys_lookup(void **state) {
+  struct authkeys_state *s = *state;
+  char *command = (char *) "";
+
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'a'),
+        AUTHORIZED_KEYS, &command), SSH_AUTH_SUCCESS);
+  assert_true(command == NULL);
+
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'b'),
+        AUTHORIZED_KEYS, &command), SSH_AUTH_SUCCESS);
+  assert_string_equal(command, "echo \"hi\"");
+  SAFE_FREE(command);
+
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'z'),
+        AUTHORIZED_KEYS, NULL), SSH_AUTH_DENIED);
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'a'),
+        "/nonexistent/authorized_keys", NULL), SSH_AUTH_DENIED);
+
+  /* without an address, from="" can't match */
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'c'),
+        AUTHORIZED_KEYS, NULL), SSH_AUTH_DENIED);
+
+  s->msg.auth_request.method = SSH_AUTH_METHOD_PASSWORD;
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'a'),
+        AUTHORIZED_KEYS, NULL), SSH_AUTH_ERROR);
+}
+
+static void torture_authorized_keys_from(void **state) {
+  struct authkeys_state *s = *state;
+
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'c'),
+        AUTHORIZED_KEYS, NULL), SSH_AUTH_SUCCESS);
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'd'),
+        AUTHORIZED_KEYS, NULL), SSH_AUTH_DENIED);
+}
+
+static void torture_authorized_keys_reload(void **state) {
+  struct authkeys_state *s = *state;
+  FILE *file;
+
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'a'),
+        AUTHORIZED_KEYS, NULL), SSH_AUTH_SUCCESS);
+
+  /* the file changes size, it is parsed again */
+  file = fopen(AUTHORIZED_KEYS, "w");
+  assert_true(file != NULL);
+  write_key(file, "", 'e', "new");
+  fclose(file);
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'a'),
+        AUTHORIZED_KEYS, NULL), SSH_AUTH_DENIED);
+  assert_int_equal(ssh_message_auth_authorized_key(request(s, 'e'),
+        AUTHORIZED_KEYS, NULL), SSH_AUTH_SUCCESS);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_authorized_keys_lookup, setup,
+            teardown),
+        unit_test_setup_teardown(torture_authorized_keys_from, setup,
+            teardown),
+        unit_test_setup_teardown(torture_authorized_keys_reload, setup,
+            teardown),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
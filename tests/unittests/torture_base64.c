@@ -0,0 +1,82 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/buffer.h"
+
+/* RFC 4648, section 10 */
+static void torture_base64_vectors(void **state) {
+  const char *clear[] = {"f", "fo", "foo", "foob", "fooba", "foobar"};
+  const char *encoded[] = {"Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=",
+    "Zm9vYmFy"};
+  unsigned char *b64;
+  ssh_buffer buffer;
+  int i;
+
+  (void) state;
+
+  for (i = 0; i < 6; i++) {
+    b64 = bin_to_base64((const unsigned char *) clear[i], strlen(clear[i]));
+    assert_true(b64 != NULL);
+    assert_string_equal((char *) b64, encoded[i]);
+    SAFE_FREE(b64);
+
+    buffer = base64_to_bin(encoded[i]);
+    assert_true(buffer != NULL);
+    assert_int_equal(buffer_get_rest_len(buffer), strlen(clear[i]));
+    assert_memory_equal(buffer_get_rest(buffer), clear[i], strlen(clear[i]));
+    ssh_buffer_free(buffer);
+  }
+}
+
+static void torture_base64_roundtrip(void **state) {
+  unsigned char data[256];
+  unsigned char *b64;
+  ssh_buffer buffer;
+  int len;
+
+  (void) state;
+
+  for (len = 0; len < (int) sizeof(data); len++) {
+    data[len] = 0xff - len;
+  }
+
+  for (len = 1; len <= (int) sizeof(data); len++) {
+    b64 = bin_to_base64(data, len);
+    assert_true(b64 != NULL);
+    assert_int_equal(strlen((char *) b64), 4 * ((len + 2) / 3));
+
+    buffer = base64_to_bin((char *) b64);
+    assert_true(buffer != NULL);
+    assert_int_equal(buffer_get_rest_len(buffer), len);
+    assert_memory_equal(buffer_get_rest(buffer), data, len);
+    ssh_buffer_free(buffer);
+    SAFE_FREE(b64);
+  }
+}
+
+static void torture_base64_invalid(void **state) {
+  const char *invalid[] = {"", "Z", "Zg", "Zg=", "Zg===", "Zm8==", "Zm9v=",
+    "Zm9", "Zm9v!A==", "Zg==Zg==", "Zg=x", "Zm9v\nYmFy", "Zm 9v"};
+  int i;
+
+  (void) state;
+
+  for (i = 0; i < (int) (sizeof(invalid) / sizeof(invalid[0])); i++) {
+    assert_true(base64_to_bin(invalid[i]) == NULL);
+  }
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_base64_vectors),
+        unit_test(torture_base64_roundtrip),
+        unit_test(torture_base64_invalid),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,133 @@
+#define LIBSSH_STATIC
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/callbacks.h"
+
+struct batch_result {
+  int refused_port;
+  int silent_port;
+  int done;
+  char errors[3][64];
+};
+
+/* a TCP port on the loopback, listening or not */
+static int batch_port(int *fd, int listening) {
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+
+  *fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert_true(*fd >= 0);
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert_int_equal(bind(*fd, (struct sockaddr *) &sin, sizeof(sin)), 0);
+  assert_int_equal(getsockname(*fd, (struct sockaddr *) &sin, &len), 0);
+  if (listening) {
+    assert_int_equal(listen(*fd, 1), 0);
+  } else {
+    close(*fd);
+    *fd = -1;
+  }
+
+  return ntohs(sin.sin_port);
+}
+
+static int batch_setup(ssh_batch batch, ssh_session session,
+    const char *host, void *userdata) {
+  struct batch_result *result = userdata;
+  unsigned int port;
+
+  (void) batch;
+
+  if (strcmp(host, "skipped") == 0) {
+    return SSH_ERROR;
+  }
+  port = strcmp(host, "refused") == 0 ? result->refused_port :
+    result->silent_port;
+  assert_int_equal(ssh_options_set(session, SSH_OPTIONS_HOST, "127.0.0.1"),
+      0);
+  assert_int_equal(ssh_options_set(session, SSH_OPTIONS_PORT, &port), 0);
+
+  return SSH_OK;
+}
+
+static void batch_done(ssh_batch batch, const char *host, int exit_status,
+    const char *error, void *userdata) {
+  struct batch_result *result = userdata;
+  int i;
+
+  (void) batch;
+
+  assert_int_equal(exit_status, -1);
+  assert_true(error != NULL);
+  if (strcmp(host, "skipped") == 0) {
+    i = 0;
+  } else if (strcmp(host, "refused") == 0) {
+    i = 1;
+  } else {
+    i = 2;
+  }
+  assert_true(result->errors[i][0] == '\0');
+  strncpy(result->errors[i], error, sizeof(result->errors[i]) - 1);
+  result->done++;
+}
+
+static void torture_batch_failures(void **state) {
+  struct ssh_batch_callbacks_struct cb;
+  struct batch_result result;
+  ssh_batch batch;
+  int refused_fd;
+  int silent_fd;
+
+  (void) state;
+
+  memset(&result, 0, sizeof(result));
+  result.refused_port = batch_port(&refused_fd, 0);
+  result.silent_port = batch_port(&silent_fd, 1);
+
+  batch = ssh_batch_new("true");
+  assert_true(batch != NULL);
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &result;
+  cb.host_setup_function = batch_setup;
+  cb.host_done_function = batch_done;
+  ssh_callbacks_init(&cb);
+  assert_int_equal(ssh_batch_set_callbacks(batch, &cb), SSH_OK);
+  assert_int_equal(ssh_batch_set_auth(batch, "nobody", "secret", NULL),
+      SSH_OK);
+  ssh_batch_set_limits(batch, 2, 200);
+  assert_int_equal(ssh_batch_add_host(batch, "skipped"), SSH_OK);
+  assert_int_equal(ssh_batch_add_host(batch, "refused"), SSH_OK);
+  assert_int_equal(ssh_batch_add_host(batch, "silent"), SSH_OK);
+
+  /* each host reports once, the silent one when its time is over */
+  assert_int_equal(ssh_batch_run(batch), SSH_OK);
+  assert_int_equal(result.done, 3);
+  assert_string_equal(result.errors[0], "Skipped by the setup callback");
+  assert_true(result.errors[1][0] != '\0');
+  assert_string_equal(result.errors[2], "Timeout");
+  assert_int_equal(ssh_batch_dopoll(batch, 0), SSH_OK);
+
+  ssh_batch_free(batch);
+  close(silent_fd);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_batch_failures),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,400 @@
+#define LIBSSH_STATIC
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/server.h"
+#include "libssh/bind.h"
+#include "libssh/callbacks.h"
+
+#define LIBSSH_ED25519_TESTKEY "libssh_testkey.id_ed25519"
+
+static void setup(void **state) {
+    ssh_bind sshbind;
+    int rc;
+
+    unlink(LIBSSH_ED25519_TESTKEY);
+    unlink(LIBSSH_ED25519_TESTKEY ".pub");
+
+    rc = system("ssh-keygen -t ed25519 -q -N \"\" -f " LIBSSH_ED25519_TESTKEY);
+    assert_true(rc == 0);
+
+    sshbind = ssh_bind_new();
+    assert_true(sshbind != NULL);
+    rc = ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_ED25519KEY,
+        LIBSSH_ED25519_TESTKEY);
+    assert_true(rc == 0);
+    rc = ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_BINDADDR,
+        "127.0.0.1");
+    assert_true(rc == 0);
+    *state = sshbind;
+}
+
+static void teardown(void **state) {
+    unlink(LIBSSH_ED25519_TESTKEY);
+    unlink(LIBSSH_ED25519_TESTKEY ".pub");
+
+    ssh_bind_free(*state);
+}
+
+static unsigned int bind_port(ssh_bind sshbind) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+
+    assert_true(getsockname(ssh_bind_get_fd(sshbind),
+        (struct sockaddr *) &sin, &len) == 0);
+    return ntohs(sin.sin_port);
+}
+
+static void torture_bind_fork(void **state) {
+    ssh_bind sshbind = *state;
+    unsigned char parent[16];
+    unsigned char child[16];
+    unsigned int port;
+    int reuseport = 1;
+    int fds[2];
+    int status;
+    int worker;
+    int rc;
+
+    rc = ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_REUSEPORT, NULL);
+    assert_true(rc < 0);
+    rc = ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_REUSEPORT, &reuseport);
+    assert_true(rc == 0);
+    rc = ssh_bind_fork(sshbind, 2);
+    assert_true(rc == SSH_ERROR);
+
+    rc = ssh_bind_listen(sshbind);
+    assert_true(rc == 0);
+    port = bind_port(sshbind);
+    assert_true(port != 0);
+    assert_true(pipe(fds) == 0);
+
+    worker = ssh_bind_fork(sshbind, 2);
+    if (worker == 1) {
+        /* a listener of its own on the port, and a random of its own */
+        status = bind_port(sshbind) == port ? 0 : 1;
+        ssh_get_random(child, sizeof(child), 0);
+        if (write(fds[1], child, sizeof(child)) != sizeof(child)) {
+            status = 1;
+        }
+        _exit(status);
+    }
+    assert_int_equal(worker, 0);
+    close(fds[1]);
+
+    ssh_get_random(parent, sizeof(parent), 0);
+    assert_int_equal(read(fds[0], child, sizeof(child)), sizeof(child));
+    assert_true(memcmp(parent, child, sizeof(parent)) != 0);
+    close(fds[0]);
+
+    assert_true(wait(&status) > 0);
+    assert_true(WIFEXITED(status));
+    assert_int_equal(WEXITSTATUS(status), 0);
+}
+
+struct accept_state {
+    ssh_event event;
+    ssh_session session;
+    int rc;
+};
+
+static void incoming_connection(ssh_bind sshbind, void *userdata) {
+    struct accept_state *a = userdata;
+
+    a->session = ssh_new();
+    assert_true(a->session != NULL);
+    assert_int_equal(ssh_bind_accept(sshbind, a->session), SSH_OK);
+    assert_int_equal(ssh_is_blocking(a->session), 0);
+    a->rc = ssh_handle_key_exchange(a->session);
+    assert_int_equal(ssh_event_add_session(a->event, a->session), SSH_OK);
+}
+
+static void torture_bind_accept_nonblocking(void **state) {
+    ssh_bind sshbind = *state;
+    struct ssh_bind_callbacks_struct cb;
+    struct accept_state a;
+    struct sockaddr_in sin;
+    ssh_session session;
+    char banner[8];
+    int port = 0;
+    int fd;
+    int rc;
+
+    rc = ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_BINDPORT, &port);
+    assert_true(rc == 0);
+    ssh_bind_set_blocking(sshbind, 0);
+    rc = ssh_bind_listen(sshbind);
+    assert_true(rc == 0);
+
+    /* nobody is connecting */
+    session = ssh_new();
+    assert_true(session != NULL);
+    assert_int_equal(ssh_bind_accept(sshbind, session), SSH_AGAIN);
+    ssh_free(session);
+
+    memset(&a, 0, sizeof(a));
+    a.event = ssh_event_new();
+    assert_true(a.event != NULL);
+    memset(&cb, 0, sizeof(cb));
+    ssh_callbacks_init(&cb);
+    cb.incoming_connection = incoming_connection;
+    assert_int_equal(ssh_bind_set_callbacks(sshbind, &cb, &a), SSH_OK);
+    assert_int_equal(ssh_event_add_bind(a.event, sshbind), SSH_OK);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(fd >= 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(bind_port(sshbind));
+    assert_true(connect(fd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+
+    /* the connection is accepted, the exchange waits for the client */
+    while (a.session == NULL) {
+        assert_true(ssh_event_dopoll(a.event, 1000) != SSH_ERROR);
+    }
+    assert_int_equal(a.rc, SSH_AGAIN);
+    assert_int_equal(ssh_handle_key_exchange(a.session), SSH_AGAIN);
+    assert_int_equal(read(fd, banner, sizeof(banner)), sizeof(banner));
+    assert_memory_equal(banner, "SSH-2.0-", sizeof(banner));
+
+    /* the client goes away, the exchange fails */
+    close(fd);
+    while (ssh_handle_key_exchange(a.session) == SSH_AGAIN) {
+        assert_true(ssh_event_dopoll(a.event, 1000) != SSH_ERROR);
+    }
+
+    ssh_event_remove_session(a.event, a.session);
+    ssh_event_remove_fd(a.event, ssh_bind_get_fd(sshbind));
+    ssh_event_free(a.event);
+    ssh_free(a.session);
+}
+
+struct admission_state {
+    int calls;
+    unsigned int unauthenticated;
+};
+
+static int admission(ssh_bind sshbind, const char *address, int port,
+    unsigned int unauthenticated, void *userdata) {
+    struct admission_state *a = userdata;
+
+    (void) sshbind;
+    assert_string_equal(address, "127.0.0.1");
+    assert_true(port > 0);
+    a->calls++;
+    a->unauthenticated = unauthenticated;
+    return 0;
+}
+
+static int connect_client(ssh_bind sshbind) {
+    struct sockaddr_in sin;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(fd >= 0);
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sin.sin_port = htons(bind_port(sshbind));
+    assert_true(connect(fd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+
+    return fd;
+}
+
+static void torture_bind_admission(void **state) {
+    ssh_bind sshbind = *state;
+    struct ssh_bind_callbacks_struct cb;
+    ssh_session session1, session2;
+    struct admission_state a = { 0, 0 };
+    int max = 1;
+    int port = 0;
+    int fd1, fd2, fd3;
+    char c;
+    int rc;
+
+    rc = ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_BINDPORT, &port);
+    assert_true(rc == 0);
+    rc = ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_MAX_UNAUTHENTICATED,
+        &max);
+    assert_true(rc == 0);
+    memset(&cb, 0, sizeof(cb));
+    ssh_callbacks_init(&cb);
+    cb.admission = admission;
+    assert_int_equal(ssh_bind_set_callbacks(sshbind, &cb, &a), SSH_OK);
+    ssh_bind_set_blocking(sshbind, 0);
+    rc = ssh_bind_listen(sshbind);
+    assert_true(rc == 0);
+
+    fd1 = connect_client(sshbind);
+    fd2 = connect_client(sshbind);
+    session1 = ssh_new();
+    session2 = ssh_new();
+    assert_true(session1 != NULL && session2 != NULL);
+    assert_int_equal(ssh_bind_accept(sshbind, session1), SSH_OK);
+
+    /* the second one is over the limit, it is closed */
+    while (ssh_bind_accept(sshbind, session2) == SSH_AGAIN && a.calls < 2) {
+        usleep(1000);
+    }
+    assert_int_equal(a.calls, 2);
+    assert_int_equal(a.unauthenticated, 1);
+    assert_int_equal(read(fd2, &c, 1), 0);
+
+    /* the first one makes room when it goes away */
+    ssh_free(session1);
+    fd3 = connect_client(sshbind);
+    while ((rc = ssh_bind_accept(sshbind, session2)) == SSH_AGAIN) {
+        usleep(1000);
+    }
+    assert_int_equal(rc, SSH_OK);
+    assert_int_equal(a.calls, 3);
+    assert_int_equal(a.unauthenticated, 0);
+    ssh_free(session2);
+
+    close(fd1);
+    close(fd2);
+    close(fd3);
+}
+
+struct listen_state {
+    ssh_session sessions[4];
+    int count;
+};
+
+static void listen_incoming(ssh_bind sshbind, void *userdata) {
+    struct listen_state *l = userdata;
+
+    assert_true(l->count < 4);
+    l->sessions[l->count] = ssh_new();
+    assert_true(l->sessions[l->count] != NULL);
+    assert_int_equal(ssh_bind_accept(sshbind, l->sessions[l->count]), SSH_OK);
+    l->count++;
+}
+
+static int connect_listener(ssh_bind sshbind, unsigned int i) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    int fd;
+
+    assert_true(getsockname(sshbind->listeners[i].fd,
+        (struct sockaddr *) &sin, &len) == 0);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(fd >= 0);
+    assert_true(connect(fd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+
+    return fd;
+}
+
+static void torture_bind_listen(void **state) {
+    struct ssh_bind_callbacks_struct cb;
+    struct listen_state l;
+    struct sockaddr_un sun;
+    ssh_session session;
+    ssh_bind sshbind;
+    ssh_event event;
+    char path[256];
+    int port = 0;
+    int fds[4];
+    int i;
+
+    (void) state;
+
+    assert_true(getcwd(path, sizeof(path) - 32) != NULL);
+    strcat(path, "/torture_bind.sock");
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    sshbind = ssh_bind_new();
+    assert_true(sshbind != NULL);
+    assert_true(ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_LISTEN,
+        "[::1") < 0);
+    assert_true(ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_LISTEN,
+        "127.0.0.1:65536") < 0);
+    assert_true(ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_LISTEN,
+        ":22") < 0);
+    assert_int_equal(sshbind->nlisteners, 0);
+
+    /* two ports and a unix socket, without host keys */
+    assert_int_equal(ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_BINDPORT,
+        &port), 0);
+    assert_int_equal(ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_LISTEN,
+        "127.0.0.1"), 0);
+    assert_int_equal(ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_LISTEN,
+        "127.0.0.1:0"), 0);
+    assert_int_equal(ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_LISTEN,
+        path), 0);
+    ssh_bind_set_blocking(sshbind, 0);
+    assert_int_equal(ssh_bind_listen(sshbind), 0);
+    assert_true(ssh_bind_get_fd(sshbind) == sshbind->listeners[0].fd);
+
+    session = ssh_new();
+    assert_true(session != NULL);
+    assert_int_equal(ssh_bind_accept(sshbind, session), SSH_AGAIN);
+
+    /* the connections of every listener come through one event */
+    memset(&l, 0, sizeof(l));
+    memset(&cb, 0, sizeof(cb));
+    ssh_callbacks_init(&cb);
+    cb.incoming_connection = listen_incoming;
+    assert_int_equal(ssh_bind_set_callbacks(sshbind, &cb, &l), SSH_OK);
+    event = ssh_event_new();
+    assert_true(event != NULL);
+    assert_int_equal(ssh_event_add_bind(event, sshbind), SSH_OK);
+
+    fds[0] = connect_listener(sshbind, 0);
+    fds[1] = connect_listener(sshbind, 0);
+    fds[2] = connect_listener(sshbind, 1);
+    fds[3] = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_true(fds[3] >= 0);
+    assert_true(connect(fds[3], (struct sockaddr *) &sun, sizeof(sun)) == 0);
+    while (l.count < 4) {
+        assert_true(ssh_event_dopoll(event, 1000) != SSH_ERROR);
+    }
+    assert_int_equal(sshbind->npending, 0);
+    assert_int_equal(ssh_event_remove_bind(event, sshbind), SSH_OK);
+    assert_int_equal(ssh_event_remove_bind(event, sshbind), SSH_ERROR);
+    ssh_event_free(event);
+
+    /* a blocking accept waits on all of them */
+    ssh_bind_set_blocking(sshbind, 1);
+    close(fds[3]);
+    fds[3] = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_true(fds[3] >= 0);
+    assert_true(connect(fds[3], (struct sockaddr *) &sun, sizeof(sun)) == 0);
+    assert_int_equal(ssh_bind_accept(sshbind, session), SSH_OK);
+
+    for (i = 0; i < 4; i++) {
+        ssh_free(l.sessions[i]);
+        close(fds[i]);
+    }
+    ssh_free(session);
+
+    /* the unix socket goes with the bind */
+    ssh_bind_free(sshbind);
+    assert_true(access(path, F_OK) < 0);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_bind_fork, setup, teardown),
+        unit_test_setup_teardown(torture_bind_accept_nonblocking, setup,
+            teardown),
+        unit_test_setup_teardown(torture_bind_admission, setup, teardown),
+        unit_test(torture_bind_listen),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -84,12 +84,325 @@ static void torture_buffer_prepend(void **state) {
 
 }
 
+/*
+ * Test the behavior of buffer_allocate, the way the socket reads into it
+ */
+static void torture_buffer_allocate(void **state) {
+  ssh_buffer buffer = *state;
+  uint32_t v;
+  char *ptr;
+
+  buffer_add_data(buffer,"abcd",4);
+  ptr = buffer_allocate(buffer, 1000);
+  assert_true(ptr != NULL);
+  assert_int_equal(buffer_get_rest_len(buffer),1004);
+  memcpy(ptr, "efgh", 4);
+  /* give back what wasn't written */
+  buffer_pass_bytes_end(buffer, 996);
+  assert_int_equal(buffer_get_rest_len(buffer),8);
+  assert_int_equal(memcmp(buffer_get_rest(buffer), "abcdefgh", 8), 0);
+  /* the unread data is kept when the buffer has to grow */
+  buffer_get_u32(buffer,&v);
+  ptr = buffer_allocate(buffer, 4096);
+  assert_true(ptr != NULL);
+  memcpy(ptr, "ijkl", 4);
+  buffer_pass_bytes_end(buffer, 4092);
+  assert_int_equal(buffer_get_rest_len(buffer),8);
+  assert_int_equal(memcmp(buffer_get_rest(buffer), "efghijkl", 8), 0);
+}
+
+/*
+ * Test that buffer_reinit keeps the memory of a buffer, up to
+ * BUFFER_REINIT_MAX_SIZE
+ */
+static void torture_buffer_reinit(void **state) {
+  ssh_buffer buffer = *state;
+  uint32_t allocated;
+
+  assert_true(buffer_allocate(buffer, 4096) != NULL);
+  allocated = buffer->allocated;
+  assert_int_equal(buffer_reinit(buffer), 0);
+  assert_int_equal(buffer_get_rest_len(buffer), 0);
+  assert_int_equal(buffer->allocated, allocated);
+
+  assert_true(buffer_allocate(buffer, BUFFER_REINIT_MAX_SIZE + 1) != NULL);
+  assert_int_equal(buffer_reinit(buffer), 0);
+  assert_true(buffer->allocated <= BUFFER_REINIT_MAX_SIZE);
+}
+
+/*
+ * Test that a buffer gives its memory back only once its data was read,
+ * and allocates again when it's written
+ */
+static void torture_buffer_release(void **state) {
+  ssh_buffer buffer = *state;
+  char data[8];
+
+  buffer_release(buffer);
+  assert_true(buffer->data == NULL);
+
+  assert_int_equal(buffer_add_data(buffer, "ABCDEFGH", 8), 0);
+  buffer_release(buffer);
+  assert_true(buffer->data != NULL);
+  assert_int_equal(buffer_get_rest_len(buffer), 8);
+
+  assert_int_equal(buffer_get_data(buffer, data, 8), 8);
+  buffer_release(buffer);
+  assert_true(buffer->data == NULL);
+  assert_int_equal(buffer->allocated, 0);
+  assert_int_equal(buffer_get_rest_len(buffer), 0);
+
+  assert_int_equal(buffer_add_data(buffer, "ABCD", 4), 0);
+  assert_int_equal(buffer_get_rest_len(buffer), 4);
+  assert_memory_equal(buffer_get_rest(buffer), "ABCD", 4);
+}
+
+/*
+ * Test that a secure buffer keeps its data when it grows and shifts
+ */
+static void torture_buffer_secure(void **state) {
+  ssh_buffer buffer = *state;
+  uint32_t v;
+  int i;
+
+  buffer_set_secure(buffer);
+  buffer_add_data(buffer,"abcdefgh",8);
+  buffer_get_u32(buffer,&v);
+  for (i = 0; i < 1000; i++) {
+    buffer_add_data(buffer,"S",1);
+  }
+  assert_int_equal(buffer_get_rest_len(buffer),1004);
+  assert_int_equal(memcmp(buffer_get_rest(buffer), "efghSSSS", 8), 0);
+  assert_int_equal(buffer_reinit(buffer), 0);
+  assert_int_equal(buffer_get_rest_len(buffer), 0);
+}
+
+/*
+ * Test a FIFO use of the buffer: the data keeps its order and the buffer
+ * doesn't grow beyond 4 times the data it holds
+ */
+static void torture_buffer_fifo(void **state) {
+  ssh_buffer buffer = *state;
+  unsigned char in[300], out[300];
+  unsigned char next_in = 0, next_out = 0;
+  int i, j;
+
+  for (i = 0; i < 10000; i++) {
+    for (j = 0; j < (int) sizeof(in); j++) {
+      in[j] = next_in++;
+    }
+    assert_int_equal(buffer_add_data(buffer, in, 100 + i % 200), 0);
+    next_in -= sizeof(in) - (100 + i % 200);
+    if (buffer_get_rest_len(buffer) >= 200) {
+      assert_int_equal(buffer_get_data(buffer, out, 150), 150);
+      for (j = 0; j < 150; j++) {
+        assert_int_equal(out[j], next_out++);
+      }
+    }
+    assert_true(buffer->allocated <= 4 * (buffer_get_rest_len(buffer) + 300));
+  }
+}
+
+/*
+ * Test buffer_move, which hands the memory over when it can
+ */
+static void torture_buffer_move(void **state) {
+  ssh_buffer buffer = *state;
+  ssh_buffer dest = ssh_buffer_new();
+  uint32_t v;
+  char *data;
+
+  buffer_add_data(buffer,"headabcdef",10);
+  buffer_get_u32(buffer,&v);
+  data = buffer->data;
+  assert_int_equal(buffer_move(dest, buffer, 6), 0);
+  assert_true(dest->data == data);
+  assert_int_equal(buffer_get_rest_len(dest),6);
+  assert_int_equal(memcmp(buffer_get_rest(dest), "abcdef", 6), 0);
+  assert_int_equal(buffer_get_rest_len(buffer),0);
+
+  /* data is pending in the destination, it is copied */
+  buffer_add_data(buffer,"ghijkl",6);
+  assert_int_equal(buffer_move(dest, buffer, 3), 0);
+  assert_int_equal(buffer_get_rest_len(dest),9);
+  assert_int_equal(memcmp(buffer_get_rest(dest), "abcdefghi", 9), 0);
+  assert_int_equal(buffer_get_rest_len(buffer),3);
+  assert_true(buffer_move(dest, buffer, 4) < 0);
+
+  ssh_buffer_free(dest);
+}
+
+/*
+ * Test that the pools give the freed buffers and strings back
+ */
+static void torture_buffer_pool(void **state) {
+  ssh_buffer buffer;
+  ssh_string str, str2;
+  char *data;
+
+  (void) state;
+
+  assert_int_equal(ssh_set_pool_sizes(1, 1), SSH_OK);
+  buffer = ssh_buffer_new();
+  buffer_add_data(buffer,"abcdef",6);
+  data = buffer->data;
+  ssh_buffer_free(buffer);
+  assert_true(ssh_buffer_new() == buffer);
+  assert_true(buffer->data == data);
+  assert_int_equal(buffer_get_rest_len(buffer),0);
+  ssh_buffer_free(buffer);
+
+  str = ssh_string_new(10);
+  ssh_string_free(str);
+  str2 = ssh_string_new(20);
+  assert_true(str2 == str);
+  assert_int_equal(ssh_string_len(str2),20);
+  ssh_string_free(str2);
+
+  assert_int_equal(ssh_set_pool_sizes(0, 0), SSH_OK);
+}
+
+/*
+ * Test buffer_pack and buffer_unpack
+ */
+static void torture_buffer_pack(void **state) {
+  ssh_buffer buffer = *state;
+  const unsigned char expected[] =
+      "\x01\x00\x02\x00\x00\x00\x03\x00\x00\x00\x00\x00\x00\x00\x04"
+      "\x00\x00\x00\x02" "ab" "\x00\x00\x00\x03" "cde" "fg";
+  ssh_string str = ssh_string_from_char("ab");
+  ssh_string str2 = NULL;
+  uint8_t b;
+  uint16_t w;
+  uint32_t d;
+  uint64_t q;
+  char *cstr = NULL;
+  void *raw = NULL;
+
+  assert_int_equal(buffer_pack(buffer, "bwdqSsP", 1, 2, (uint32_t) 3,
+        (uint64_t) 4, str, "cde", (uint32_t) 2, "fg"), 0);
+  assert_int_equal(buffer_get_rest_len(buffer), sizeof(expected) - 1);
+  assert_int_equal(memcmp(buffer_get_rest(buffer), expected,
+        sizeof(expected) - 1), 0);
+  assert_true(buffer_pack(buffer, "S", NULL) < 0);
+  assert_true(buffer_pack(buffer, "x", 0) < 0);
+  assert_int_equal(buffer_get_rest_len(buffer), sizeof(expected) - 1);
+
+  /* a truncated message is not read */
+  assert_true(buffer_unpack(buffer, "bwdqSsP", &b, &w, &d, &q, &str2, &cstr,
+        (uint32_t) 3, &raw) < 0);
+  assert_true(str2 == NULL);
+  assert_true(cstr == NULL);
+  assert_int_equal(buffer_get_rest_len(buffer), sizeof(expected) - 1);
+
+  assert_int_equal(buffer_unpack(buffer, "bwdqSsP", &b, &w, &d, &q, &str2,
+        &cstr, (uint32_t) 2, &raw), 0);
+  assert_int_equal(b, 1);
+  assert_int_equal(w, 2);
+  assert_int_equal(d, 3);
+  assert_true(q == 4);
+  assert_int_equal(ssh_string_len(str2), 2);
+  assert_int_equal(memcmp(ssh_string_data(str2), "ab", 2), 0);
+  assert_string_equal(cstr, "cde");
+  assert_int_equal(memcmp(raw, "fg", 2), 0);
+  assert_int_equal(buffer_get_rest_len(buffer), 0);
+
+  ssh_string_free(str);
+  ssh_string_free(str2);
+  free(cstr);
+  free(raw);
+}
+
+/*
+ * Test buffer_get_ssh_string_view, which points into the buffer
+ */
+static void torture_buffer_string_view(void **state) {
+  ssh_buffer buffer = *state;
+  const char *data;
+  uint32_t len;
+
+  buffer_add_data(buffer,"\x00\x00\x00\x03" "abc" "\x00\x00\x00\x05" "de",13);
+  data = buffer_get_ssh_string_view(buffer, &len);
+  assert_true(data == (char *) buffer->data + 4);
+  assert_int_equal(len, 3);
+  assert_int_equal(memcmp(data, "abc", 3), 0);
+  assert_int_equal(buffer_get_rest_len(buffer), 6);
+
+  /* truncated string */
+  assert_true(buffer_get_ssh_string_view(buffer, &len) == NULL);
+  assert_int_equal(buffer_get_rest_len(buffer), 6);
+}
+
+/*
+ * Test buffer_get_ssh_string_cstr, which terminates the string in the buffer
+ */
+static void torture_buffer_string_cstr(void **state) {
+  ssh_buffer buffer = *state;
+  char *str;
+
+  buffer_add_data(buffer, "\x00\x00\x00\x03" "abc" "\x00\x00\x00\x00"
+      "\x00\x00\x00\x02" "d\0", 17);
+  str = buffer_get_ssh_string_cstr(buffer);
+  assert_true(str == (char *) buffer->data);
+  assert_string_equal(str, "abc");
+  str = buffer_get_ssh_string_cstr(buffer);
+  assert_true(str != NULL);
+  assert_string_equal(str, "");
+  assert_int_equal(buffer_get_rest_len(buffer), 6);
+
+  /* a string with a NUL isn't a C string */
+  assert_true(buffer_get_ssh_string_cstr(buffer) == NULL);
+}
+
+/*
+ * Test ssh_buffer_new_sized and buffer_ensure, which allocate once
+ */
+static void torture_buffer_sized(void **state) {
+  ssh_buffer buffer;
+  char *data;
+
+  (void) state;
+
+  buffer = ssh_buffer_new_sized(32 * 1024 + 13);
+  assert_true(buffer != NULL);
+  assert_true(buffer->allocated >= 32 * 1024 + 13);
+  data = buffer->data;
+  assert_true(buffer_allocate(buffer, 32 * 1024 + 13) != NULL);
+  assert_true(buffer->data == data);
+
+  assert_int_equal(buffer_ensure(buffer, 4096), 0);
+  data = buffer->data;
+  assert_true(buffer_allocate(buffer, 4096) != NULL);
+  assert_true(buffer->data == data);
+  ssh_buffer_free(buffer);
+
+  /* nothing to allocate, but not an error */
+  buffer = ssh_buffer_new_sized(0);
+  assert_true(buffer != NULL);
+  assert_int_equal(buffer_ensure(buffer, 0), 0);
+  assert_true(buffer_allocate(buffer, 0) != NULL);
+  assert_int_equal(buffer_add_data(buffer, "", 0), 0);
+  assert_int_equal(buffer_get_rest_len(buffer), 0);
+  ssh_buffer_free(buffer);
+}
+
 int torture_run_tests(void) {
     int rc;
     const UnitTest tests[] = {
         unit_test_setup_teardown(torture_growing_buffer, setup, teardown),
         unit_test_setup_teardown(torture_growing_buffer_shifting, setup, teardown),
         unit_test_setup_teardown(torture_buffer_prepend, setup, teardown),
+        unit_test_setup_teardown(torture_buffer_allocate, setup, teardown),
+        unit_test_setup_teardown(torture_buffer_reinit, setup, teardown),
+        unit_test_setup_teardown(torture_buffer_release, setup, teardown),
+        unit_test_setup_teardown(torture_buffer_secure, setup, teardown),
+        unit_test_setup_teardown(torture_buffer_fifo, setup, teardown),
+        unit_test_setup_teardown(torture_buffer_move, setup, teardown),
+        unit_test(torture_buffer_pool),
+        unit_test_setup_teardown(torture_buffer_pack, setup, teardown),
+        unit_test_setup_teardown(torture_buffer_string_view, setup, teardown),
+        unit_test_setup_teardown(torture_buffer_string_cstr, setup, teardown),
+        unit_test(torture_buffer_sized),
     };
 
     ssh_init();
@@ -0,0 +1,157 @@
+#define LIBSSH_STATIC
+
+#include <string.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/capture.h"
+
+#define DATA_LEN (3 * CAPTURE_BLOCK_SIZE + 100)
+
+struct capture_lines_seen {
+  char lines[8][16];
+  int count;
+};
+
+static void capture_fill(unsigned char *data, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    data[i] = i * 7;
+  }
+}
+
+static void torture_capture_tail(void **state) {
+  struct capture_block *block;
+  struct capture_arena arena;
+  struct capture c;
+  unsigned char data[DATA_LEN];
+  unsigned char out[DATA_LEN];
+  size_t i;
+
+  (void) state;
+
+  memset(&arena, 0, sizeof(arena));
+  memset(&c, 0, sizeof(c));
+  capture_fill(data, sizeof(data));
+
+  /* piece by piece, only the last bytes are kept */
+  for (i = 0; i < DATA_LEN; i += 1000) {
+    assert_int_equal(capture_append(&arena, &c, data + i,
+          i + 1000 <= DATA_LEN ? 1000 : DATA_LEN - i, 5000, 1), SSH_OK);
+  }
+  assert_int_equal(c.len, 5000);
+  assert_int_equal(c.dropped, DATA_LEN - 5000);
+  assert_int_equal(capture_copy(&c, out), 5000);
+  assert_memory_equal(out, data + DATA_LEN - 5000, 5000);
+  /* the blocks dropped went back to the arena, for the next ones */
+  for (i = 0, block = c.head; block != NULL; block = block->next) {
+    i++;
+  }
+  assert_int_equal(i + arena.nfree, 3);
+
+  /* at once, the start isn't copied */
+  capture_clear(&arena, &c);
+  assert_int_equal(capture_append(&arena, &c, data, DATA_LEN, 300, 1),
+      SSH_OK);
+  assert_int_equal(c.len, 300);
+  assert_int_equal(capture_copy(&c, out), 300);
+  assert_memory_equal(out, data + DATA_LEN - 300, 300);
+
+  capture_clear(&arena, &c);
+  capture_arena_free(&arena);
+}
+
+static void torture_capture_full(void **state) {
+  struct capture_arena arena;
+  struct capture c;
+  unsigned char data[DATA_LEN];
+  unsigned char out[DATA_LEN];
+
+  (void) state;
+
+  memset(&arena, 0, sizeof(arena));
+  memset(&c, 0, sizeof(c));
+  capture_fill(data, sizeof(data));
+
+  /* without a limit, everything across the blocks */
+  assert_int_equal(capture_append(&arena, &c, data, 10, 0, 0), SSH_OK);
+  assert_int_equal(capture_append(&arena, &c, data + 10, DATA_LEN - 10, 0, 0),
+      SSH_OK);
+  assert_int_equal(c.len, DATA_LEN);
+  assert_int_equal(c.dropped, 0);
+  assert_int_equal(capture_copy(&c, out), DATA_LEN);
+  assert_memory_equal(out, data, DATA_LEN);
+  capture_clear(&arena, &c);
+  assert_int_equal(arena.nfree, 4);
+
+  /* the first bytes up to the limit */
+  assert_int_equal(capture_append(&arena, &c, data, 150, 100, 0), SSH_OK);
+  assert_int_equal(capture_append(&arena, &c, data + 150, 10, 100, 0),
+      SSH_OK);
+  assert_int_equal(c.len, 100);
+  assert_int_equal(c.dropped, 60);
+  assert_int_equal(capture_copy(&c, out), 100);
+  assert_memory_equal(out, data, 100);
+  assert_int_equal(arena.nfree, 3);
+
+  capture_clear(&arena, &c);
+  capture_arena_free(&arena);
+}
+
+static void capture_line_seen(const void *line, size_t len,
+    void *userdata) {
+  struct capture_lines_seen *seen = userdata;
+
+  assert_true(seen->count < 8);
+  assert_true(len < sizeof(seen->lines[0]));
+  memcpy(seen->lines[seen->count], line, len);
+  seen->lines[seen->count][len] = '\0';
+  seen->count++;
+}
+
+static void torture_capture_lines(void **state) {
+  struct capture_lines_seen seen;
+  struct capture_arena arena;
+  struct capture c;
+
+  (void) state;
+
+  memset(&seen, 0, sizeof(seen));
+  memset(&arena, 0, sizeof(arena));
+  memset(&c, 0, sizeof(c));
+
+  /* the lines split between reads are whole, the long ones cut */
+  assert_int_equal(capture_lines(&arena, &c, "ab\ncd", 5, 8,
+        capture_line_seen, &seen), SSH_OK);
+  assert_int_equal(capture_lines(&arena, &c, "e\n\nfghijklmnop", 14, 8,
+        capture_line_seen, &seen), SSH_OK);
+  assert_int_equal(capture_lines(&arena, &c, "q", 1, 8,
+        capture_line_seen, &seen), SSH_OK);
+  assert_int_equal(seen.count, 4);
+  assert_int_equal(capture_lines_flush(&arena, &c, capture_line_seen, &seen),
+      SSH_OK);
+  assert_int_equal(seen.count, 5);
+  assert_string_equal(seen.lines[0], "ab");
+  assert_string_equal(seen.lines[1], "cde");
+  assert_string_equal(seen.lines[2], "");
+  assert_string_equal(seen.lines[3], "fghijklm");
+  assert_string_equal(seen.lines[4], "nopq");
+  assert_int_equal(c.len, 0);
+
+  capture_arena_free(&arena);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_capture_tail),
+        unit_test(torture_capture_full),
+        unit_test(torture_capture_lines),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,1001 @@
+#define LIBSSH_STATIC
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+#include "libssh/socket.h"
+#include "libssh/buffer.h"
+#include "libssh/ssh2.h"
+#include "libssh/callbacks.h"
+#include "libssh/misc.h"
+
+struct channel_peer {
+  struct torture_peer base;
+  ssh_channel channel;
+};
+
+/* a session on a socketpair, with an open channel */
+static void channel_peer_new(struct channel_peer *peer) {
+  torture_peer_new(&peer->base, 0);
+  peer->channel = torture_peer_channel(&peer->base, 0, 0);
+}
+
+static void channel_peer_free(struct channel_peer *peer) {
+  peer->channel->state = SSH_CHANNEL_STATE_CLOSED;
+  ssh_channel_free(peer->channel);
+  torture_peer_free(&peer->base);
+}
+
+static void torture_channel_select(void **state) {
+  struct channel_peer peer;
+  ssh_channel rchans[2];
+  ssh_channel wchans[2];
+  ssh_channel echans[2];
+  struct timeval tv;
+  char data[] = "abc";
+
+  (void) state;
+
+  channel_peer_new(&peer);
+
+  /* nothing to read: the timeout expires */
+  rchans[0] = peer.channel;
+  rchans[1] = NULL;
+  tv.tv_sec = 0;
+  tv.tv_usec = 50000;
+  assert_int_equal(ssh_channel_select(rchans, NULL, NULL, &tv), SSH_OK);
+  assert_true(rchans[0] == NULL);
+
+  /* buffered data is readable without polling */
+  assert_int_equal(channel_default_bufferize(peer.channel, data, 3, 0), 0);
+  rchans[0] = peer.channel;
+  assert_int_equal(ssh_channel_select(rchans, NULL, NULL, NULL), SSH_OK);
+  assert_true(rchans[0] == peer.channel);
+  assert_true(rchans[1] == NULL);
+
+  /* the socket is polled until it is writable */
+  peer.channel->remote_window = 100;
+  rchans[0] = NULL;
+  wchans[0] = peer.channel;
+  wchans[1] = NULL;
+  tv.tv_sec = 1;
+  tv.tv_usec = 0;
+  assert_int_equal(ssh_channel_select(rchans, wchans, NULL, &tv), SSH_OK);
+  assert_true(wchans[0] == peer.channel);
+
+  /* a closed channel is an exception, only the ready arrays are filled */
+  peer.channel->state = SSH_CHANNEL_STATE_CLOSED;
+  peer.channel->remote_window = 0;
+  wchans[0] = peer.channel;
+  echans[0] = peer.channel;
+  echans[1] = NULL;
+  assert_int_equal(ssh_channel_select(NULL, wchans, echans, NULL), SSH_OK);
+  assert_true(wchans[0] == NULL);
+  assert_true(echans[0] == peer.channel);
+
+  channel_peer_free(&peer);
+}
+
+static void torture_channel_set(void **state) {
+  struct channel_peer peers[3];
+  ssh_channel_set set;
+  ssh_channel channel;
+  char data[] = "abc";
+  int events;
+  int i;
+
+  (void) state;
+
+  set = ssh_channel_set_new();
+  assert_true(set != NULL);
+  for (i = 0; i < 3; i++) {
+    channel_peer_new(&peers[i]);
+    assert_int_equal(ssh_channel_set_add(set, peers[i].channel,
+          SSH_CHANNEL_SET_READ | SSH_CHANNEL_SET_EXCEPT), SSH_OK);
+  }
+
+  assert_int_equal(ssh_channel_set_select(set, 50), 0);
+  assert_true(ssh_channel_set_get_ready(set, 0, NULL) == NULL);
+
+  assert_int_equal(channel_default_bufferize(peers[1].channel, data, 3, 0), 0);
+  assert_int_equal(ssh_channel_set_select(set, -1), 1);
+  channel = ssh_channel_set_get_ready(set, 0, &events);
+  assert_true(channel == peers[1].channel);
+  assert_int_equal(events, SSH_CHANNEL_SET_READ);
+
+  /* the events can be changed, the socket is polled until it is writable */
+  peers[2].channel->remote_window = 100;
+  assert_int_equal(ssh_channel_set_add(set, peers[2].channel,
+        SSH_CHANNEL_SET_WRITE), SSH_OK);
+  assert_int_equal(ssh_channel_set_remove(set, peers[1].channel), SSH_OK);
+  assert_int_equal(ssh_channel_set_remove(set, peers[1].channel), SSH_ERROR);
+  assert_int_equal(ssh_channel_set_select(set, 1000), 1);
+  channel = ssh_channel_set_get_ready(set, 0, &events);
+  assert_true(channel == peers[2].channel);
+  assert_int_equal(events, SSH_CHANNEL_SET_WRITE);
+
+  /* the sessions are back in their own context once the set is gone */
+  ssh_channel_set_free(set);
+  for (i = 0; i < 3; i++) {
+    assert_true(ssh_session_get_poll_ctx(peers[i].base.session) ==
+        peers[i].base.session->default_poll_ctx);
+    channel_peer_free(&peers[i]);
+  }
+}
+
+/* give a data packet to the channel, the way the packet layer does */
+static void channel_peer_data(struct channel_peer *peer, uint32_t len) {
+  ssh_buffer packet;
+  char data[16000];
+  uint32_t n;
+
+  memset(data, 'x', sizeof(data));
+  packet = ssh_buffer_new();
+  assert_true(packet != NULL);
+  assert_int_equal(buffer_add_u32(packet,
+        htonl(peer->channel->local_channel)), 0);
+  assert_int_equal(buffer_add_u32(packet, htonl(len)), 0);
+  for (; len > 0; len -= n) {
+    n = len > sizeof(data) ? sizeof(data) : len;
+    assert_int_equal(buffer_add_data(packet, data, n), 0);
+  }
+  channel_rcv_data(peer->base.session, SSH2_MSG_CHANNEL_DATA, packet, NULL);
+  ssh_buffer_free(packet);
+}
+
+/* the data waiting in the channel, which has no buffer until it gets some */
+static uint32_t channel_peer_buffered(struct channel_peer *peer) {
+  if (peer->channel->stdout_buffer == NULL) {
+    return 0;
+  }
+  return buffer_get_rest_len(peer->channel->stdout_buffer);
+}
+
+/* read everything the channel buffered */
+static void channel_peer_drain(struct channel_peer *peer) {
+  char data[16000];
+
+  while (channel_peer_buffered(peer) > 0) {
+    assert_true(ssh_channel_read(peer->channel, data, sizeof(data), 0) > 0);
+  }
+}
+
+static void torture_channel_window_autotune(void **state) {
+  struct channel_peer peer;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  peer.channel->local_maxpacket = 32000;
+
+  /* a fixed window isn't tuned */
+  assert_int_equal(ssh_channel_set_window(peer.channel, 0, 0), SSH_ERROR);
+  assert_int_equal(ssh_channel_set_window(peer.channel, 64000, 0), SSH_OK);
+  peer.channel->local_window = 64000;
+  channel_peer_data(&peer, 64000);
+  channel_peer_drain(&peer);
+  usleep(20 * 1000);
+  channel_peer_data(&peer, 64000);
+  channel_peer_drain(&peer);
+  assert_true(ssh_channel_get_window(peer.channel) == 64000);
+  assert_true(peer.channel->window_rtt == 0);
+
+  /*
+   * The peer uses the whole window every round trip: the window grows,
+   * within the buffering limits.
+   */
+  peer.base.session->channel_buffer_soft_limit = 100000;
+  peer.base.session->channel_buffer_hard_limit = 200000;
+  assert_int_equal(ssh_channel_set_window(peer.channel, 64000, 1000000),
+      SSH_OK);
+  channel_peer_data(&peer, 64000);
+  channel_peer_drain(&peer);
+  usleep(20 * 1000);
+  channel_peer_data(&peer, 64000);
+  assert_true(peer.channel->window_rtt >= 15);
+  channel_peer_drain(&peer);
+  assert_true(ssh_channel_get_window(peer.channel) > 64000);
+  assert_true(ssh_channel_get_window(peer.channel) <= 100000);
+  assert_true(peer.channel->local_window ==
+      ssh_channel_get_window(peer.channel));
+
+  channel_peer_free(&peer);
+}
+
+/*
+ * Reads the next packet sent to the peer, of the given type. Returns the
+ * integer after the channel: the data length or the window increment.
+ */
+static uint32_t channel_peer_read(struct channel_peer *peer, uint8_t type) {
+  static unsigned char packet[MAX_PACKET_LEN];
+  uint32_t datalen;
+
+  torture_peer_read(&peer->base, packet, sizeof(packet));
+  /* padding length, message type, channel, data length */
+  assert_int_equal(packet[1], type);
+  memcpy(&datalen, packet + 6, sizeof(datalen));
+
+  return ntohl(datalen);
+}
+
+static uint32_t channel_peer_read_data(struct channel_peer *peer) {
+  return channel_peer_read(peer, SSH2_MSG_CHANNEL_DATA);
+}
+
+static void torture_channel_maxpacket(void **state) {
+  struct channel_peer peer;
+  char data[60000];
+  unsigned int maxpacket = 128 * 1024;
+
+  (void) state;
+
+  /* the channels advertise the max packet of the session */
+  channel_peer_new(&peer);
+  assert_int_equal(peer.channel->local_maxpacket, 32000);
+  channel_peer_free(&peer);
+
+  channel_peer_new(&peer);
+  assert_int_equal(ssh_options_set(peer.base.session,
+        SSH_OPTIONS_CHANNEL_MAXPACKET, &maxpacket), 0);
+  peer.channel->state = SSH_CHANNEL_STATE_CLOSED;
+  ssh_channel_free(peer.channel);
+  peer.channel = ssh_channel_new(peer.base.session);
+  assert_true(peer.channel != NULL);
+  peer.channel->state = SSH_CHANNEL_STATE_OPEN;
+  assert_int_equal(peer.channel->local_maxpacket, 128 * 1024);
+
+  /* the writes are split at the max packet of the peer */
+  memset(data, 'x', sizeof(data));
+  peer.channel->remote_window = sizeof(data);
+  peer.channel->remote_maxpacket = 40000;
+  assert_int_equal(ssh_channel_write(peer.channel, data, sizeof(data)),
+      sizeof(data));
+  assert_int_equal(channel_peer_read_data(&peer), 40000 - 10);
+  assert_int_equal(channel_peer_read_data(&peer), sizeof(data) - 40000 + 10);
+
+  /* a larger max packet than the packets can hold is clamped */
+  peer.channel->remote_window = sizeof(data);
+  peer.channel->remote_maxpacket = 0xffffffff;
+  assert_int_equal(ssh_channel_write(peer.channel, data, sizeof(data)),
+      sizeof(data));
+  assert_int_equal(channel_peer_read_data(&peer), sizeof(data));
+
+  channel_peer_free(&peer);
+}
+
+static void torture_channel_window_coalesce(void **state) {
+  struct channel_peer peer;
+  int threshold = 100;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  assert_int_equal(ssh_channel_set_window_strategy(peer.channel, 0, 1),
+      SSH_ERROR);
+  assert_int_equal(ssh_channel_set_window(peer.channel, 64000, 0), SSH_OK);
+  assert_int_equal(ssh_channel_set_window_strategy(peer.channel, 50, 1),
+      SSH_OK);
+  peer.channel->local_window = 64000;
+
+  /* the adjusts of both reads are sent together, when the session polls */
+  channel_peer_data(&peer, 40000);
+  channel_peer_drain(&peer);
+  assert_int_equal(peer.channel->local_window, 24000);
+  channel_peer_data(&peer, 24000);
+  channel_peer_drain(&peer);
+  assert_int_equal(peer.channel->local_window, 0);
+  assert_int_equal(peer.channel->window_pending, 64000);
+  assert_int_equal(channel_peer_read(&peer, SSH2_MSG_CHANNEL_WINDOW_ADJUST),
+      64000);
+  assert_int_equal(peer.channel->local_window, 64000);
+  assert_int_equal(peer.channel->window_pending, 0);
+
+  /* without coalescing, the threshold decides */
+  assert_int_equal(ssh_options_set(peer.base.session,
+        SSH_OPTIONS_CHANNEL_WINDOW_THRESHOLD, &threshold), 0);
+  assert_int_equal(peer.base.session->channel_window_threshold, 100);
+  assert_int_equal(ssh_channel_set_window_strategy(peer.channel, 100, 0),
+      SSH_OK);
+  channel_peer_data(&peer, 1000);
+  channel_peer_drain(&peer);
+  assert_int_equal(peer.channel->local_window, 64000);
+  assert_int_equal(channel_peer_read(&peer, SSH2_MSG_CHANNEL_WINDOW_ADJUST),
+      1000);
+
+  channel_peer_free(&peer);
+}
+
+static void torture_channel_stats(void **state) {
+  struct ssh_session_stats_struct before;
+  struct ssh_session_stats_struct stats;
+  struct ssh_channel_stats_struct cstats;
+  struct channel_peer peer;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  assert_int_equal(ssh_channel_set_window(peer.channel, 64000, 0), SSH_OK);
+  assert_int_equal(ssh_channel_set_window_strategy(peer.channel, 100, 0),
+      SSH_OK);
+  peer.channel->local_window = 64000;
+  peer.channel->remote_window = 100;
+  peer.channel->remote_maxpacket = 100;
+  assert_int_equal(ssh_session_get_stats(peer.base.session, &before), SSH_OK);
+
+  channel_peer_data(&peer, 1000);
+  channel_peer_drain(&peer);
+  assert_int_equal(channel_peer_read(&peer, SSH2_MSG_CHANNEL_WINDOW_ADJUST),
+      1000);
+  assert_int_equal(ssh_channel_write(peer.channel, "abc", 3), 3);
+
+  assert_int_equal(ssh_channel_get_stats(peer.channel, &cstats), SSH_OK);
+  assert_true(cstats.bytes_in == 1000);
+  assert_true(cstats.bytes_out == 3);
+  assert_true(cstats.window_adjusts_in == 0);
+  assert_true(cstats.window_adjusts_out == 1);
+
+  assert_int_equal(ssh_session_get_stats(peer.base.session, &stats), SSH_OK);
+  assert_true(stats.packets_out - before.packets_out == 2);
+  /* without cipher, the packets are padded to 8 bytes */
+  assert_true((stats.bytes_out - before.bytes_out) % 8 == 0);
+  assert_true(stats.window_adjusts_out - before.window_adjusts_out == 1);
+  assert_true(stats.packets_in == 0);
+
+  assert_int_equal(ssh_session_get_stats(NULL, &stats), SSH_ERROR);
+  channel_peer_free(&peer);
+}
+
+struct channel_view {
+  void *data;
+  uint32_t len;
+  int consume;
+};
+
+static int channel_view_data(ssh_session session, ssh_channel channel,
+    void *data, uint32_t len, int is_stderr, void *userdata) {
+  struct channel_view *view = userdata;
+
+  (void) session;
+  (void) channel;
+  (void) is_stderr;
+
+  view->data = data;
+  view->len = len;
+
+  return view->consume;
+}
+
+/* the session counts the data buffered in all its channels */
+static void torture_channel_session_buffered(void **state) {
+  struct channel_peer peer;
+  struct channel_peer other;
+  struct channel_view view;
+  struct ssh_channel_callbacks_struct cb;
+  char data[1000];
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  peer.channel->local_window = 64000;
+  other = peer;
+  other.channel = torture_peer_channel(&peer.base, 0, 0);
+  other.channel->local_window = 64000;
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &view;
+  cb.channel_data_function = channel_view_data;
+  ssh_callbacks_init(&cb);
+  assert_int_equal(ssh_set_channel_callbacks(other.channel, &cb), SSH_OK);
+
+  channel_peer_data(&peer, 1000);
+  assert_int_equal(ssh_channels_get_buffered(peer.base.session), 1000);
+
+  /* what the callback leaves is buffered, and given back with more data */
+  view.consume = 0;
+  channel_peer_data(&other, 500);
+  assert_int_equal(ssh_channels_get_buffered(peer.base.session), 1500);
+  view.consume = 200;
+  channel_peer_data(&other, 300);
+  assert_int_equal(view.len, 800);
+  assert_int_equal(ssh_channels_get_buffered(peer.base.session), 1600);
+
+  assert_int_equal(ssh_channel_read(peer.channel, data, 400, 0), 400);
+  assert_int_equal(ssh_channels_get_buffered(peer.base.session), 1200);
+  assert_int_equal(channel_default_bufferize(peer.channel, data, 100, 1), 0);
+  assert_int_equal(ssh_channels_get_buffered(peer.base.session), 1300);
+
+  /* a freed channel takes its data away */
+  other.channel->state = SSH_CHANNEL_STATE_CLOSED;
+  ssh_channel_free(other.channel);
+  assert_int_equal(ssh_channels_get_buffered(peer.base.session), 700);
+
+  channel_peer_drain(&peer);
+  assert_int_equal(ssh_channel_read(peer.channel, data, sizeof(data), 1),
+      100);
+  assert_int_equal(ssh_channels_get_buffered(peer.base.session), 0);
+
+  channel_peer_free(&peer);
+}
+
+static void torture_channel_unbuffered(void **state) {
+  struct channel_peer peer;
+  struct channel_view view;
+  struct ssh_channel_callbacks_struct cb;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &view;
+  cb.channel_data_function = channel_view_data;
+  ssh_callbacks_init(&cb);
+  assert_int_equal(ssh_set_channel_callbacks(peer.channel, &cb), SSH_OK);
+  assert_int_equal(ssh_channel_set_unbuffered(peer.channel, 1), SSH_OK);
+  assert_int_equal(ssh_channel_set_window(peer.channel, 64000, 0), SSH_OK);
+  peer.channel->local_window = 64000;
+
+  /* the callback gets the data in place, what it leaves isn't buffered */
+  view.consume = 10000;
+  channel_peer_data(&peer, 40000);
+  assert_int_equal(view.len, 40000);
+  assert_int_equal(channel_peer_buffered(&peer), 0);
+  assert_int_equal(peer.channel->window_held, 30000);
+  assert_int_equal(peer.channel->local_window, 24000);
+
+  /* the window follows the consumption, without the data still held */
+  assert_int_equal(ssh_channel_consume(peer.channel, 10000), SSH_OK);
+  assert_int_equal(peer.channel->local_window, 24000);
+  assert_int_equal(ssh_channel_consume(peer.channel, 15000), SSH_OK);
+  assert_int_equal(peer.channel->local_window, 59000);
+  assert_int_equal(channel_peer_read(&peer, SSH2_MSG_CHANNEL_WINDOW_ADJUST),
+      35000);
+  assert_int_equal(ssh_channel_consume(peer.channel, 20000), SSH_OK);
+  assert_int_equal(peer.channel->window_held, 0);
+
+  channel_peer_free(&peer);
+}
+
+/* a packet of the peer with only the channel and an optional integer */
+static void channel_peer_packet(struct channel_peer *peer, uint8_t type,
+    uint32_t value) {
+  ssh_buffer packet;
+
+  packet = ssh_buffer_new();
+  assert_true(packet != NULL);
+  assert_int_equal(buffer_add_u32(packet,
+        htonl(peer->channel->local_channel)), 0);
+  assert_int_equal(buffer_add_u32(packet, htonl(value)), 0);
+  if (type == SSH2_MSG_CHANNEL_WINDOW_ADJUST) {
+    channel_rcv_change_window(peer->base.session, type, packet, NULL);
+  } else {
+    channel_rcv_eof(peer->base.session, type, packet, NULL);
+  }
+  ssh_buffer_free(packet);
+}
+
+static void torture_channel_bind_fd(void **state) {
+  struct channel_peer peer;
+  char data[1000];
+  int fds[2];
+  int i;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  assert_int_equal(ssh_channel_set_window(peer.channel, 64000, 0), SSH_OK);
+  peer.channel->local_window = 64000;
+  peer.channel->remote_window = 1500;
+  peer.channel->remote_maxpacket = 32000;
+  assert_int_equal(ssh_channel_bind_fd(peer.channel, fds[0], fds[0]), SSH_OK);
+  assert_int_equal(ssh_channel_bind_fd(peer.channel, fds[0], fds[0]),
+      SSH_ERROR);
+
+  /* the data of the channel goes to the descriptor, without buffering */
+  channel_peer_data(&peer, 1000);
+  assert_int_equal(recv(fds[1], data, sizeof(data), MSG_WAITALL), 1000);
+  assert_int_equal(channel_peer_buffered(&peer), 0);
+  assert_int_equal(peer.channel->window_held, 0);
+
+  /* what is read is sent within the window of the peer */
+  memset(data, 'y', sizeof(data));
+  assert_int_equal(send(fds[1], data, 1000, 0), 1000);
+  assert_int_equal(channel_peer_read_data(&peer), 1000);
+  assert_int_equal(send(fds[1], data, 1000, 0), 1000);
+  assert_int_equal(channel_peer_read_data(&peer), 500);
+  assert_int_equal(peer.channel->remote_window, 0);
+  for (i = 0; i < 3; i++) {
+    assert_int_equal(ssh_handle_packets(peer.base.session, 10), SSH_OK);
+  }
+  assert_false(torture_peer_pending(&peer.base));
+  channel_peer_packet(&peer, SSH2_MSG_CHANNEL_WINDOW_ADJUST, 10000);
+  assert_int_equal(channel_peer_read_data(&peer), 500);
+
+  /* the ends of file are forwarded, the channel is closed afterwards */
+  assert_int_equal(shutdown(fds[1], SHUT_WR), 0);
+  channel_peer_read(&peer, SSH2_MSG_CHANNEL_EOF);
+  assert_true(peer.channel->fd_bind != NULL);
+  channel_peer_packet(&peer, SSH2_MSG_CHANNEL_EOF, 0);
+  assert_int_equal(recv(fds[1], data, sizeof(data), 0), 0);
+  assert_true(peer.channel->fd_bind == NULL);
+  channel_peer_read(&peer, SSH2_MSG_CHANNEL_CLOSE);
+
+  channel_peer_free(&peer);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static void torture_channel_scheduler(void **state) {
+  struct channel_peer peer;
+  ssh_channel shell;
+  char data[100000];
+  int enabled = 1;
+  int i;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  assert_int_equal(ssh_options_set(peer.base.session,
+        SSH_OPTIONS_CHANNEL_SCHEDULER, &enabled), 0);
+  peer.channel->remote_window = 1000000;
+  peer.channel->remote_maxpacket = 8010;
+  assert_int_equal(ssh_channel_set_priority(peer.channel,
+        SSH_CHANNEL_PRIORITY_BULK), SSH_OK);
+  shell = ssh_channel_new(peer.base.session);
+  assert_true(shell != NULL);
+  shell->state = SSH_CHANNEL_STATE_OPEN;
+  shell->remote_channel = 1;
+  shell->remote_window = 1000000;
+  shell->remote_maxpacket = 8010;
+  assert_int_equal(ssh_channel_set_priority(shell, 3), SSH_ERROR);
+  assert_int_equal(ssh_channel_set_priority(shell,
+        SSH_CHANNEL_PRIORITY_INTERACTIVE), SSH_OK);
+
+  /* the transfer fills the socket backlog, the rest waits in its queue */
+  memset(data, 'x', sizeof(data));
+  ssh_session_cork(peer.base.session);
+  assert_int_equal(ssh_channel_write(peer.channel, data, sizeof(data)),
+      sizeof(data));
+  assert_int_equal(channel_write_window(peer.channel),
+      1000000 - sizeof(data));
+  assert_int_equal(ssh_channel_write(shell, data, 100), 100);
+  assert_true(ssh_session_uncork(peer.base.session) != SSH_ERROR);
+
+  /* the shell doesn't wait behind it */
+  for (i = 0; i < 9; i++) {
+    assert_int_equal(channel_peer_read_data(&peer), 8000);
+  }
+  assert_int_equal(channel_peer_read_data(&peer), 100);
+  for (i = 0; i < 3; i++) {
+    assert_int_equal(channel_peer_read_data(&peer), 8000);
+  }
+  assert_int_equal(channel_peer_read_data(&peer), 4000);
+
+  /* the queue waits for the window, the end of file waits for the queue */
+  peer.channel->remote_window = 5000;
+  assert_int_equal(ssh_channel_write(peer.channel, data, 20000), 20000);
+  assert_int_equal(channel_write_window(peer.channel), 0);
+  assert_int_equal(channel_peer_read_data(&peer), 5000);
+  channel_peer_packet(&peer, SSH2_MSG_CHANNEL_WINDOW_ADJUST, 20000);
+  assert_int_equal(channel_write_window(peer.channel), 5000);
+  assert_int_equal(channel_peer_read_data(&peer), 8000);
+  assert_int_equal(channel_peer_read_data(&peer), 7000);
+  assert_int_equal(ssh_channel_send_eof(peer.channel), SSH_OK);
+  channel_peer_read(&peer, SSH2_MSG_CHANNEL_EOF);
+
+  shell->state = SSH_CHANNEL_STATE_CLOSED;
+  ssh_channel_free(shell);
+  channel_peer_free(&peer);
+}
+
+static void torture_channel_ids(void **state) {
+  struct channel_peer peer;
+  ssh_channel chans[40];
+  uint32_t id;
+  int i;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  for (i = 0; i < 40; i++) {
+    chans[i] = ssh_channel_new(peer.base.session);
+    assert_true(chans[i] != NULL);
+    assert_int_equal(ssh_channel_new_id(peer.base.session, chans[i]),
+        peer.channel->local_channel + 1 + i);
+  }
+  for (i = 0; i < 40; i++) {
+    assert_true(ssh_channel_from_local(peer.base.session,
+          chans[i]->local_channel) == chans[i]);
+  }
+  assert_true(ssh_channel_from_local(peer.base.session, 0) == NULL);
+  assert_true(ssh_channel_from_local(peer.base.session,
+        chans[39]->local_channel + 1) == NULL);
+
+  /* the id of a channel closed by the peer is reused */
+  id = chans[10]->local_channel;
+  chans[10]->remote_close = 1;
+  ssh_channel_free(chans[10]);
+  assert_true(ssh_channel_from_local(peer.base.session, id) == NULL);
+  chans[10] = ssh_channel_new(peer.base.session);
+  assert_true(chans[10] != NULL);
+  assert_int_equal(ssh_channel_new_id(peer.base.session, chans[10]), id);
+  assert_true(ssh_channel_from_local(peer.base.session, id) == chans[10]);
+
+  /* not the one the peer may still send to */
+  id = chans[20]->local_channel;
+  chans[20]->state = SSH_CHANNEL_STATE_CLOSED;
+  ssh_channel_free(chans[20]);
+  assert_true(ssh_channel_from_local(peer.base.session, id) == NULL);
+  chans[20] = ssh_channel_new(peer.base.session);
+  assert_true(chans[20] != NULL);
+  assert_int_equal(ssh_channel_new_id(peer.base.session, chans[20]),
+      chans[39]->local_channel + 1);
+
+  for (i = 0; i < 40; i++) {
+    ssh_channel_free(chans[i]);
+  }
+  channel_peer_free(&peer);
+}
+
+struct channel_answers {
+  int opened;
+  int refused;
+  int accepted;
+  int denied;
+};
+
+static void channel_open_response(ssh_session session, ssh_channel channel,
+    int is_success, void *userdata) {
+  struct channel_answers *answers = userdata;
+
+  (void) session;
+  (void) channel;
+
+  if (is_success) {
+    answers->opened++;
+  } else {
+    answers->refused++;
+  }
+}
+
+static void channel_request_response(ssh_session session, ssh_channel channel,
+    int is_success, void *userdata) {
+  struct channel_answers *answers = userdata;
+
+  (void) session;
+  (void) channel;
+
+  if (is_success) {
+    answers->accepted++;
+  } else {
+    answers->denied++;
+  }
+}
+
+static void global_request_response(ssh_session session, int is_success,
+    void *userdata) {
+  channel_request_response(session, NULL, is_success, userdata);
+}
+
+/* a packet of the peer about a channel, followed by the given values */
+static void channel_peer_answer(struct channel_peer *peer, ssh_channel channel,
+    uint8_t type, uint32_t value) {
+  ssh_buffer packet;
+
+  packet = ssh_buffer_new();
+  assert_true(packet != NULL);
+  if (channel != NULL) {
+    assert_int_equal(buffer_add_u32(packet, htonl(channel->local_channel)),
+        0);
+  }
+  assert_int_equal(buffer_add_u32(packet, htonl(value)), 0);
+  switch (type) {
+    case SSH2_MSG_CHANNEL_OPEN_CONFIRMATION:
+      assert_int_equal(buffer_add_u32(packet, htonl(64000)), 0);
+      assert_int_equal(buffer_add_u32(packet, htonl(32000)), 0);
+      ssh_packet_channel_open_conf(peer->base.session, type, packet, NULL);
+      break;
+    case SSH2_MSG_CHANNEL_OPEN_FAILURE:
+      assert_int_equal(buffer_add_u32(packet, 0), 0);
+      assert_int_equal(buffer_add_u32(packet, 0), 0);
+      ssh_packet_channel_open_fail(peer->base.session, type, packet, NULL);
+      break;
+    case SSH2_MSG_CHANNEL_SUCCESS:
+      ssh_packet_channel_success(peer->base.session, type, packet, NULL);
+      break;
+    case SSH2_MSG_CHANNEL_FAILURE:
+      ssh_packet_channel_failure(peer->base.session, type, packet, NULL);
+      break;
+    case SSH2_MSG_REQUEST_SUCCESS:
+      ssh_request_success(peer->base.session, type, packet, NULL);
+      break;
+  }
+  ssh_buffer_free(packet);
+}
+
+static void torture_channel_nonblocking_requests(void **state) {
+  struct channel_peer peer;
+  struct channel_answers answers;
+  struct ssh_channel_callbacks_struct cb;
+  struct ssh_callbacks_struct session_cb;
+  ssh_channel chans[2];
+  int port = -1;
+  int i;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  ssh_set_blocking(peer.base.session, 0);
+  memset(&answers, 0, sizeof(answers));
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &answers;
+  cb.channel_open_response_function = channel_open_response;
+  cb.channel_request_response_function = channel_request_response;
+  ssh_callbacks_init(&cb);
+
+  /* the opens are sent at once, their answers come later */
+  for (i = 0; i < 2; i++) {
+    chans[i] = ssh_channel_new(peer.base.session);
+    assert_true(chans[i] != NULL);
+    assert_int_equal(ssh_set_channel_callbacks(chans[i], &cb), SSH_OK);
+    assert_int_equal(ssh_channel_open_session(chans[i]), SSH_AGAIN);
+  }
+  for (i = 0; i < 2; i++) {
+    channel_peer_read(&peer, SSH2_MSG_CHANNEL_OPEN);
+  }
+  assert_int_equal(ssh_channel_open_session(chans[0]), SSH_AGAIN);
+  channel_peer_answer(&peer, chans[0], SSH2_MSG_CHANNEL_OPEN_CONFIRMATION, 7);
+  channel_peer_answer(&peer, chans[1], SSH2_MSG_CHANNEL_OPEN_FAILURE, 0);
+  assert_int_equal(answers.opened, 1);
+  assert_int_equal(answers.refused, 1);
+  assert_int_equal(ssh_channel_open_session(chans[0]), SSH_OK);
+  assert_int_equal(ssh_channel_open_session(chans[1]), SSH_ERROR);
+  assert_int_equal(chans[0]->remote_channel, 7);
+
+  /* the answer of a request goes to the callback */
+  assert_int_equal(ssh_channel_request_exec(chans[0], "true"), SSH_AGAIN);
+  assert_int_equal(channel_peer_read(&peer, SSH2_MSG_CHANNEL_REQUEST),
+      strlen("exec"));
+  channel_peer_answer(&peer, chans[0], SSH2_MSG_CHANNEL_SUCCESS, 0);
+  assert_int_equal(answers.accepted, 1);
+  assert_int_equal(ssh_channel_request_env(chans[0], "A", "b"), SSH_AGAIN);
+  assert_int_equal(channel_peer_read(&peer, SSH2_MSG_CHANNEL_REQUEST),
+      strlen("env"));
+  channel_peer_answer(&peer, chans[0], SSH2_MSG_CHANNEL_FAILURE, 0);
+  assert_int_equal(answers.denied, 1);
+
+  /* or to the function called again */
+  chans[0]->callbacks = NULL;
+  assert_int_equal(ssh_channel_request_shell(chans[0]), SSH_AGAIN);
+  assert_int_equal(channel_peer_read(&peer, SSH2_MSG_CHANNEL_REQUEST),
+      strlen("shell"));
+  assert_int_equal(ssh_channel_request_shell(chans[0]), SSH_AGAIN);
+  channel_peer_answer(&peer, chans[0], SSH2_MSG_CHANNEL_SUCCESS, 0);
+  assert_int_equal(ssh_channel_request_shell(chans[0]), SSH_OK);
+  assert_int_equal(chans[0]->request_state, SSH_CHANNEL_REQ_STATE_NONE);
+
+  /* the same for the global requests */
+  assert_int_equal(ssh_forward_listen(peer.base.session, NULL, 0, &port),
+      SSH_AGAIN);
+  channel_peer_read(&peer, SSH2_MSG_GLOBAL_REQUEST);
+  channel_peer_answer(&peer, NULL, SSH2_MSG_REQUEST_SUCCESS, 2222);
+  assert_int_equal(ssh_forward_listen(peer.base.session, NULL, 0, &port),
+      SSH_OK);
+  assert_int_equal(port, 2222);
+
+  memset(&session_cb, 0, sizeof(session_cb));
+  session_cb.userdata = &answers;
+  session_cb.global_request_response_function = global_request_response;
+  ssh_callbacks_init(&session_cb);
+  assert_int_equal(ssh_set_callbacks(peer.base.session, &session_cb), SSH_OK);
+  assert_int_equal(ssh_forward_cancel(peer.base.session, NULL, 2222),
+      SSH_AGAIN);
+  channel_peer_read(&peer, SSH2_MSG_GLOBAL_REQUEST);
+  channel_peer_answer(&peer, NULL, SSH2_MSG_REQUEST_SUCCESS, 0);
+  assert_int_equal(answers.accepted, 2);
+  assert_int_equal(peer.base.session->global_req_state,
+      SSH_CHANNEL_REQ_STATE_NONE);
+
+  chans[0]->state = SSH_CHANNEL_STATE_CLOSED;
+  ssh_channel_free(chans[0]);
+  ssh_channel_free(chans[1]);
+  channel_peer_free(&peer);
+}
+
+static void torture_channel_read_timeout(void **state) {
+  struct channel_peer peer;
+  char data[100];
+  uint64_t start;
+  uint64_t elapsed;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+
+  /* nothing arrives: it waits for the timeout, not forever */
+  start = ssh_timestamp_ms();
+  assert_int_equal(ssh_channel_read_timeout(peer.channel, data, sizeof(data),
+        0, 100), SSH_AGAIN);
+  elapsed = ssh_timestamp_ms() - start;
+  assert_true(elapsed >= 100);
+  assert_true(elapsed < 1000);
+  assert_int_equal(ssh_channel_read_timeout(peer.channel, data, sizeof(data),
+        0, 0), SSH_AGAIN);
+
+  /* buffered data and the end of file return right away */
+  channel_peer_data(&peer, 10);
+  assert_int_equal(ssh_channel_read_timeout(peer.channel, data, sizeof(data),
+        0, 100), 10);
+  peer.channel->remote_eof = 1;
+  assert_int_equal(ssh_channel_read_timeout(peer.channel, data, sizeof(data),
+        0, 100), 0);
+
+  channel_peer_free(&peer);
+}
+
+static void channel_writable(ssh_session session, ssh_channel channel,
+    uint32_t bytes, void *userdata) {
+  char data[4000];
+  uint32_t *called = userdata;
+
+  (void) session;
+
+  *called = bytes;
+  memset(data, 'w', sizeof(data));
+  if (bytes > sizeof(data)) {
+    bytes = sizeof(data);
+  }
+  assert_int_equal(ssh_channel_write(channel, data, bytes), (int) bytes);
+}
+
+static void torture_channel_writable(void **state) {
+  struct ssh_channel_callbacks_struct cb;
+  struct channel_peer peer;
+  char data[1000];
+  uint32_t called = 0;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  peer.channel->remote_window = 1000;
+  peer.channel->remote_maxpacket = 32000;
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &called;
+  cb.channel_writable_function = channel_writable;
+  ssh_callbacks_init(&cb);
+  assert_int_equal(ssh_set_channel_callbacks(peer.channel, &cb), SSH_OK);
+
+  /* a buffered packet is built in the socket buffer only */
+  memset(data, 'x', sizeof(data));
+  ssh_session_cork(peer.base.session);
+  assert_int_equal(ssh_channel_write(peer.channel, data, sizeof(data)),
+      sizeof(data));
+  assert_int_equal(buffer_get_rest_len(peer.base.session->out_buffer), 0);
+  assert_true(ssh_socket_buffered_out(peer.base.session->socket) >
+      sizeof(data) + 14);
+  assert_true(ssh_session_uncork(peer.base.session) != SSH_ERROR);
+  assert_int_equal(channel_peer_read_data(&peer), 1000);
+  assert_int_equal(peer.base.session->send_seq, 1);
+
+  /* the callback fills the window as it grows */
+  channel_peer_packet(&peer, SSH2_MSG_CHANNEL_WINDOW_ADJUST, 3000);
+  assert_int_equal(called, 3000);
+  assert_int_equal(peer.channel->remote_window, 0);
+  assert_int_equal(channel_peer_read_data(&peer), 3000);
+
+  /* nothing after the end of file */
+  called = 0;
+  assert_int_equal(ssh_channel_send_eof(peer.channel), SSH_OK);
+  channel_peer_read(&peer, SSH2_MSG_CHANNEL_EOF);
+  channel_peer_packet(&peer, SSH2_MSG_CHANNEL_WINDOW_ADJUST, 3000);
+  assert_int_equal(called, 0);
+
+  channel_peer_free(&peer);
+}
+
+static void channel_closed(ssh_session session, ssh_channel channel,
+    void *userdata) {
+  int *closed = userdata;
+
+  (void) session;
+  (void) channel;
+  (*closed)++;
+}
+
+/* runs the keepalive timer now */
+static void channel_peer_tick(struct channel_peer *peer) {
+  assert_int_equal(ssh_timer_reset(peer->base.session->keepalive_timer, 1), 0);
+  usleep(5 * 1000);
+  ssh_handle_packets(peer->base.session, 10);
+}
+
+static void torture_channel_keepalive(void **state) {
+  struct ssh_channel_callbacks_struct cb;
+  struct channel_peer peer;
+  unsigned int interval = 60;
+  unsigned int max = 2;
+  char data[100];
+  int closed = 0;
+
+  (void) state;
+
+  channel_peer_new(&peer);
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &closed;
+  cb.channel_close_function = channel_closed;
+  ssh_callbacks_init(&cb);
+  assert_int_equal(ssh_set_channel_callbacks(peer.channel, &cb), SSH_OK);
+  assert_int_equal(ssh_options_set(peer.base.session, SSH_OPTIONS_KEEPALIVE_MAX,
+        &max), 0);
+  assert_int_equal(ssh_options_set(peer.base.session,
+        SSH_OPTIONS_KEEPALIVE_INTERVAL, &interval), 0);
+  assert_true(peer.base.session->keepalive_timer == NULL);
+  assert_int_equal(ssh_keepalive_start(peer.base.session), SSH_OK);
+  assert_true(ssh_timer_is_pending(peer.base.session->keepalive_timer));
+
+  /* a silent peer is probed, its answer isn't a global request's */
+  channel_peer_tick(&peer);
+  channel_peer_read(&peer, SSH2_MSG_GLOBAL_REQUEST);
+  assert_int_equal(peer.base.session->keepalive_missed, 1);
+  channel_peer_answer(&peer, NULL, SSH2_MSG_REQUEST_SUCCESS, 0);
+  assert_int_equal(peer.base.session->keepalive_pending, 0);
+  assert_int_equal(peer.base.session->global_req_state,
+      SSH_CHANNEL_REQ_STATE_NONE);
+
+  /* any packet counts */
+  peer.base.session->keepalive_received = 1;
+  channel_peer_tick(&peer);
+  assert_int_equal(peer.base.session->keepalive_missed, 0);
+  assert_false(torture_peer_pending(&peer.base));
+
+  /* the peer is gone after the last probe, the session is torn down */
+  channel_peer_data(&peer, 10);
+  channel_peer_tick(&peer);
+  channel_peer_read(&peer, SSH2_MSG_GLOBAL_REQUEST);
+  channel_peer_tick(&peer);
+  channel_peer_read(&peer, SSH2_MSG_GLOBAL_REQUEST);
+  assert_int_equal(closed, 0);
+  channel_peer_tick(&peer);
+  assert_int_equal(closed, 1);
+  assert_int_equal(peer.base.session->session_state, SSH_SESSION_STATE_ERROR);
+  assert_true(strstr(ssh_get_error(peer.base.session), "keepalives") != NULL);
+  assert_int_equal(peer.channel->state, SSH_CHANNEL_STATE_CLOSED);
+  assert_int_equal(recv(peer.base.fd, data, 1, 0), 0);
+  /* what came before stays to be read */
+  assert_int_equal(ssh_channel_read(peer.channel, data, sizeof(data), 0), 10);
+
+  channel_peer_free(&peer);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_channel_select),
+        unit_test(torture_channel_set),
+        unit_test(torture_channel_window_autotune),
+        unit_test(torture_channel_maxpacket),
+        unit_test(torture_channel_window_coalesce),
+        unit_test(torture_channel_stats),
+        unit_test(torture_channel_unbuffered),
+        unit_test(torture_channel_session_buffered),
+        unit_test(torture_channel_bind_fd),
+        unit_test(torture_channel_scheduler),
+        unit_test(torture_channel_ids),
+        unit_test(torture_channel_nonblocking_requests),
+        unit_test(torture_channel_read_timeout),
+        unit_test(torture_channel_writable),
+        unit_test(torture_channel_keepalive),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
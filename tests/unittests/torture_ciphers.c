@@ -0,0 +1,212 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/crypto.h"
+#include "libssh/chachapoly.h"
+
+/* RFC 7539, section 2.4.2 */
+static void torture_chacha20(void **state) {
+  const char *plaintext = "Ladies and Gentlemen of the class of '99: If I "
+    "could offer you only one tip for the future, sunscreen would be it.";
+  const uint8_t iv[8] = {0, 0, 0, 0x4a, 0, 0, 0, 0};
+  const uint8_t counter[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+  const uint8_t expected[16] = {
+    0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80,
+    0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81
+  };
+  const uint8_t expected_end[4] = {0x5e, 0x42, 0x87, 0x4d};
+  struct chacha_ctx ctx;
+  uint8_t key[CHACHA20_KEYLEN];
+  uint8_t out[114];
+  int i;
+
+  (void) state;
+
+  for (i = 0; i < CHACHA20_KEYLEN; i++) {
+    key[i] = i;
+  }
+  assert_int_equal(strlen(plaintext), sizeof(out));
+
+  chacha_keysetup(&ctx, key);
+  chacha_ivsetup(&ctx, iv, counter);
+  chacha_encrypt_bytes(&ctx, (const uint8_t *) plaintext, out, sizeof(out));
+  assert_memory_equal(out, expected, sizeof(expected));
+  assert_memory_equal(out + sizeof(out) - 4, expected_end, 4);
+
+  /* in place */
+  chacha_ivsetup(&ctx, iv, counter);
+  chacha_encrypt_bytes(&ctx, out, out, sizeof(out));
+  assert_memory_equal(out, plaintext, sizeof(out));
+}
+
+/* RFC 7539, section 2.5.2 */
+static void torture_poly1305(void **state) {
+  const char *msg = "Cryptographic Forum Research Group";
+  const uint8_t key[POLY1305_KEYLEN] = {
+    0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33,
+    0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+    0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd,
+    0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b
+  };
+  const uint8_t expected[POLY1305_TAGLEN] = {
+    0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+    0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9
+  };
+  uint8_t tag[POLY1305_TAGLEN];
+
+  (void) state;
+
+  poly1305_auth(tag, (const uint8_t *) msg, strlen(msg), key);
+  assert_memory_equal(tag, expected, sizeof(tag));
+}
+
+/*
+ * Encrypt packets with every AEAD cipher of the table and decrypt them with
+ * a second instance, the way the packet layer does.
+ */
+static void torture_aead_roundtrip(void **state) {
+  struct crypto_struct *ciphertab = ssh_get_ciphertab();
+  struct crypto_struct out, in;
+  unsigned char key[SHA_DIGEST_LEN * 4];
+  unsigned char iv[SHA_DIGEST_LEN * 2];
+  unsigned char packet[4 + 64];
+  unsigned char clear[4 + 64];
+  unsigned char tag[EVP_MAX_MD_SIZE];
+  unsigned char len[4];
+  uint32_t seq;
+  int tested = 0;
+  int i;
+
+  (void) state;
+
+  for (i = 0; i < (int) sizeof(key); i++) {
+    key[i] = i * 3;
+  }
+  for (i = 0; i < (int) sizeof(iv); i++) {
+    iv[i] = 0xff - i;
+  }
+  for (i = 0; i < (int) sizeof(clear); i++) {
+    clear[i] = i;
+  }
+  clear[0] = clear[1] = clear[2] = 0;
+  clear[3] = 64;
+
+  for (i = 0; ciphertab[i].name != NULL; i++) {
+    if (ciphertab[i].tag_size == 0) {
+      continue;
+    }
+    memcpy(&out, &ciphertab[i], sizeof(out));
+    memcpy(&in, &ciphertab[i], sizeof(in));
+    assert_int_equal(out.aead_set_key(&out, key, iv), 0);
+    assert_int_equal(in.aead_set_key(&in, key, iv), 0);
+
+    for (seq = 0; seq < 3; seq++) {
+      memcpy(packet, clear, sizeof(packet));
+      out.aead_encrypt(&out, packet, packet, sizeof(packet), tag, seq);
+      assert_false(memcmp(packet + 4, clear + 4, sizeof(packet) - 4) == 0);
+
+      assert_int_equal(in.aead_decrypt_length(&in, packet, len, sizeof(len),
+            seq), 0);
+      assert_memory_equal(len, clear, sizeof(len));
+
+      assert_int_equal(in.aead_decrypt(&in, packet, packet + 4,
+            sizeof(packet) - 4, tag, seq), 0);
+      assert_memory_equal(packet + 4, clear + 4, sizeof(packet) - 4);
+    }
+
+    /* a modified packet must not pass */
+    memcpy(packet, clear, sizeof(packet));
+    out.aead_encrypt(&out, packet, packet, sizeof(packet), tag, seq);
+    packet[10] ^= 1;
+    assert_true(in.aead_decrypt(&in, packet, packet + 4,
+          sizeof(packet) - 4, tag, seq) < 0);
+
+    out.cleanup(&out);
+    in.cleanup(&in);
+    tested++;
+  }
+
+  assert_true(tested > 0);
+}
+
+#ifdef HAVE_LIBCRYPTO
+/*
+ * Encrypt two packets in pieces with every block cipher of the table and
+ * decrypt them with a second instance: the blocks chain across the calls.
+ */
+static void torture_block_roundtrip(void **state) {
+  struct crypto_struct *ciphertab = ssh_get_ciphertab();
+  struct crypto_struct out, in;
+  unsigned char key[SHA_DIGEST_LEN * 4];
+  unsigned char out_iv[SHA_DIGEST_LEN * 2];
+  unsigned char in_iv[SHA_DIGEST_LEN * 2];
+  unsigned char packet[64];
+  unsigned char clear[64];
+  int tested = 0;
+  int i, n;
+
+  (void) state;
+
+  for (i = 0; i < (int) sizeof(key); i++) {
+    key[i] = i * 5;
+  }
+  for (i = 0; i < (int) sizeof(clear); i++) {
+    clear[i] = i;
+  }
+
+  for (i = 0; ciphertab[i].name != NULL; i++) {
+    if (ciphertab[i].tag_size != 0) {
+      continue;
+    }
+    memcpy(&out, &ciphertab[i], sizeof(out));
+    memcpy(&in, &ciphertab[i], sizeof(in));
+    memset(out_iv, 0x5a, sizeof(out_iv));
+    memset(in_iv, 0x5a, sizeof(in_iv));
+    assert_int_equal(out.set_encrypt_key(&out, key), 0);
+    assert_int_equal(in.set_decrypt_key(&in, key), 0);
+
+    for (n = 0; n < 2; n++) {
+      memcpy(packet, clear, sizeof(packet));
+      out.cbc_encrypt(&out, packet, packet, out.blocksize, out_iv);
+      out.cbc_encrypt(&out, packet + out.blocksize, packet + out.blocksize,
+          sizeof(packet) - out.blocksize, out_iv);
+      assert_false(memcmp(packet, clear, sizeof(packet)) == 0);
+
+      in.cbc_decrypt(&in, packet, packet, in.blocksize, in_iv);
+      in.cbc_decrypt(&in, packet + in.blocksize, packet + in.blocksize,
+          sizeof(packet) - in.blocksize, in_iv);
+      assert_memory_equal(packet, clear, sizeof(packet));
+    }
+
+    if (out.cleanup != NULL) {
+      out.cleanup(&out);
+      in.cleanup(&in);
+    } else {
+      SAFE_FREE(out.key);
+      SAFE_FREE(in.key);
+    }
+    tested++;
+  }
+
+  assert_true(tested > 0);
+  assert_true(ssh_get_crypto_implementation() != NULL);
+}
+#endif /* HAVE_LIBCRYPTO */
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_chacha20),
+        unit_test(torture_poly1305),
+        unit_test(torture_aead_roundtrip),
+#ifdef HAVE_LIBCRYPTO
+        unit_test(torture_block_roundtrip),
+#endif
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,108 @@
+#define LIBSSH_STATIC
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+
+#define LIBSSH_TESTCONFIG "libssh_testconfig"
+
+static void setup(void **state) {
+    FILE *file;
+
+    file = fopen(LIBSSH_TESTCONFIG, "w");
+    assert_true(file != NULL);
+    fputs("ConnectTimeout 30\n"
+          "UnknownOption yes\n"
+          "\n"
+          "Host alias\n"
+          "    HostName Real.example.com\n"
+          "Host real.example.com other\n"
+          "    User alice\n"
+          "    Port 2222\n"
+          "Host *.org\n"
+          "    User bob\n"
+          "Host a,b,C\n"
+          "    Port 2200\n"
+          "Host *\n"
+          "    User carol\n"
+          "    StrictHostKeyChecking no\n", file);
+    fclose(file);
+
+    *state = ssh_new();
+    assert_true(*state != NULL);
+}
+
+static void teardown(void **state) {
+    unlink(LIBSSH_TESTCONFIG);
+    ssh_free(*state);
+}
+
+static void torture_config_hostname(void **state) {
+    ssh_session session = *state;
+
+    ssh_options_set(session, SSH_OPTIONS_HOST, "alias");
+    assert_true(ssh_config_parse_file(session, LIBSSH_TESTCONFIG) == 0);
+
+    /* the Host lines after HostName match the new name */
+    assert_string_equal(session->host, "Real.example.com");
+    assert_string_equal(session->username, "alice");
+    assert_true(session->port == 2222);
+    assert_true(session->timeout == 30);
+    assert_true(session->StrictHostKeyChecking == 0);
+}
+
+static void torture_config_patterns(void **state) {
+    ssh_session session = *state;
+
+    ssh_options_set(session, SSH_OPTIONS_HOST, "www.libssh.org");
+    assert_true(ssh_config_parse_file(session, LIBSSH_TESTCONFIG) == 0);
+    assert_string_equal(session->username, "bob");
+    assert_true(session->port == 22);
+
+    ssh_options_set(session, SSH_OPTIONS_HOST, "c");
+    SAFE_FREE(session->username);
+    assert_true(ssh_config_parse_file(session, LIBSSH_TESTCONFIG) == 0);
+    assert_string_equal(session->username, "carol");
+    assert_true(session->port == 2200);
+}
+
+static void torture_config_reload(void **state) {
+    ssh_session session = *state;
+    FILE *file;
+
+    ssh_options_set(session, SSH_OPTIONS_HOST, "other");
+    assert_true(ssh_config_parse_file(session, LIBSSH_TESTCONFIG) == 0);
+    assert_string_equal(session->username, "alice");
+
+    /* a file written since is parsed again */
+    file = fopen(LIBSSH_TESTCONFIG, "w");
+    assert_true(file != NULL);
+    fputs("Host other\n    User dave\n", file);
+    fclose(file);
+
+    SAFE_FREE(session->username);
+    assert_true(ssh_config_parse_file(session, LIBSSH_TESTCONFIG) == 0);
+    assert_string_equal(session->username, "dave");
+
+    /* a missing file sets nothing */
+    SAFE_FREE(session->username);
+    assert_true(ssh_config_parse_file(session, "/nonexistent/config") == 0);
+    assert_true(session->username == NULL);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_config_hostname, setup, teardown),
+        unit_test_setup_teardown(torture_config_patterns, setup, teardown),
+        unit_test_setup_teardown(torture_config_reload, setup, teardown),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
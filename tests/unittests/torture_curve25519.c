@@ -0,0 +1,109 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/curve25519.h"
+
+static void hex_to_bin(const char *hex, uint8_t *bin) {
+  unsigned int byte;
+  int i;
+
+  for (i = 0; i < CURVE25519_PUBKEY_SIZE; i++) {
+    assert_int_equal(sscanf(hex + 2 * i, "%2x", &byte), 1);
+    bin[i] = (uint8_t) byte;
+  }
+}
+
+/* RFC 7748, section 5.2 */
+static void torture_curve25519_scalarmult(void **state) {
+  uint8_t scalar[CURVE25519_PRIVKEY_SIZE];
+  uint8_t u[CURVE25519_PUBKEY_SIZE];
+  uint8_t expected[CURVE25519_PUBKEY_SIZE];
+  uint8_t out[CURVE25519_PUBKEY_SIZE];
+
+  (void) state;
+
+  hex_to_bin("a546e36bf0527c9d3b16154b82465edd"
+      "62144c0ac1fc5a18506a2244ba449ac4", scalar);
+  hex_to_bin("e6db6867583030db3594c1a424b15f7c"
+      "726624ec26b3353b10a903a6d0ab1c4c", u);
+  hex_to_bin("c3da55379de9c6908e94ea4df28d084f"
+      "32eccf03491c71f754b4075577a28552", expected);
+  crypto_scalarmult_curve25519(out, scalar, u);
+  assert_memory_equal(out, expected, sizeof(out));
+
+  /* one iteration from k = u = 9 */
+  memset(scalar, 0, sizeof(scalar));
+  scalar[0] = 9;
+  hex_to_bin("422c8e7a6227d7bca1350b3e2bb7279f"
+      "7897b87bb6854b783c60e80311ae3079", expected);
+  crypto_scalarmult_curve25519_base(out, scalar);
+  assert_memory_equal(out, expected, sizeof(out));
+}
+
+/* RFC 7748, section 6.1 */
+static void torture_curve25519_exchange(void **state) {
+  uint8_t alice[CURVE25519_PRIVKEY_SIZE];
+  uint8_t bob[CURVE25519_PRIVKEY_SIZE];
+  uint8_t alice_pub[CURVE25519_PUBKEY_SIZE];
+  uint8_t bob_pub[CURVE25519_PUBKEY_SIZE];
+  uint8_t expected[CURVE25519_PUBKEY_SIZE];
+  uint8_t k1[CURVE25519_PUBKEY_SIZE];
+  uint8_t k2[CURVE25519_PUBKEY_SIZE];
+
+  (void) state;
+
+  hex_to_bin("77076d0a7318a57d3c16c17251b26645"
+      "df4c2f87ebc0992ab177fba51db92c2a", alice);
+  hex_to_bin("5dab087e624a8a4b79e17f8b83800ee6"
+      "6f3bb1292618b6fd1c2f8b27ff88e0eb", bob);
+
+  crypto_scalarmult_curve25519_base(alice_pub, alice);
+  hex_to_bin("8520f0098930a754748b7ddcb43ef75a"
+      "0dbf3a0d26381af4eba4a98eaa9b4e6a", expected);
+  assert_memory_equal(alice_pub, expected, sizeof(expected));
+
+  crypto_scalarmult_curve25519_base(bob_pub, bob);
+  hex_to_bin("de9edb7d7b7dc1b4d35b61c2ece43537"
+      "3f8343c85b78674dadfc7e146f882b4f", expected);
+  assert_memory_equal(bob_pub, expected, sizeof(expected));
+
+  crypto_scalarmult_curve25519(k1, alice, bob_pub);
+  crypto_scalarmult_curve25519(k2, bob, alice_pub);
+  hex_to_bin("4a5d9d5ba4ce2de1728e3bf480350f25"
+      "e07e21c947d19e3376f09b3c1e161742", expected);
+  assert_memory_equal(k1, expected, sizeof(expected));
+  assert_memory_equal(k2, expected, sizeof(expected));
+}
+
+/* a low order point gives the all zero secret the key exchange rejects */
+static void torture_curve25519_low_order(void **state) {
+  uint8_t scalar[CURVE25519_PRIVKEY_SIZE];
+  uint8_t u[CURVE25519_PUBKEY_SIZE] = {0};
+  uint8_t zero[CURVE25519_PUBKEY_SIZE] = {0};
+  uint8_t out[CURVE25519_PUBKEY_SIZE];
+
+  (void) state;
+
+  memset(scalar, 0x5a, sizeof(scalar));
+  crypto_scalarmult_curve25519(out, scalar, u);
+  assert_memory_equal(out, zero, sizeof(out));
+
+  u[0] = 1;
+  crypto_scalarmult_curve25519(out, scalar, u);
+  assert_memory_equal(out, zero, sizeof(out));
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_curve25519_scalarmult),
+        unit_test(torture_curve25519_exchange),
+        unit_test(torture_curve25519_low_order),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
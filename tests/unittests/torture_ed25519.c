@@ -0,0 +1,150 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/ed25519.h"
+
+static void hex_to_bin(const char *hex, uint8_t *bin, size_t len) {
+  unsigned int byte;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    assert_int_equal(sscanf(hex + 2 * i, "%2x", &byte), 1);
+    bin[i] = (uint8_t) byte;
+  }
+}
+
+struct ed25519_vector {
+  const char *seed;
+  const char *pk;
+  const char *msg;
+  size_t msg_len;
+  const char *sig;
+};
+
+/* RFC 8032, section 7.1, tests 1 to 3 */
+static const struct ed25519_vector vectors[] = {
+  {
+    "9d61b19deffd5a60ba844af492ec2cc44449c5697b326919703bac031cae7f60",
+    "d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a",
+    "", 0,
+    "e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e06522490155"
+    "5fb8821590a33bacc61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b"
+  },
+  {
+    "4ccd089b28ff96da9db6c346ec114e0f5b8a319f35aba624da8cf6ed4fb8a6fb",
+    "3d4017c3e843895a92b70aa74d1b7ebc9c982ccf2ec4968cc0cd55f12af4660c",
+    "72", 1,
+    "92a009a9f0d4cab8720e820b5f642540a2b27b5416503f8fb3762223ebdb69da"
+    "085ac1e43e15996e458f3613d0f11d8c387b2eaeb4302aeeb00d291612bb0c00"
+  },
+  {
+    "c5aa8df43f9f837bedb7442f31dcb7b166d38535076f094b85ce3a2e0b4458f7",
+    "fc51cd8e6218a1a38da47ed00230f0580816ed13ba3303ac5deb911548908025",
+    "af82", 2,
+    "6291d657deec24024827e69c3abe01a30ce548a284743a445e3680d7db5ac3ac"
+    "18ff9b538d16f290ae67f760984dc6594a7c15e9716ed28dc027beceea1ec40a"
+  }
+};
+
+static void torture_ed25519_sign(void **state) {
+  uint8_t seed[32];
+  uint8_t pk[ED25519_PUBKEY_SIZE];
+  uint8_t sk[ED25519_PRIVKEY_SIZE];
+  uint8_t expected_pk[ED25519_PUBKEY_SIZE];
+  uint8_t expected_sig[ED25519_SIG_SIZE];
+  uint8_t sig[ED25519_SIG_SIZE];
+  uint8_t msg[2];
+  size_t i;
+
+  (void) state;
+
+  for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    hex_to_bin(vectors[i].seed, seed, sizeof(seed));
+    hex_to_bin(vectors[i].pk, expected_pk, sizeof(expected_pk));
+    hex_to_bin(vectors[i].msg, msg, vectors[i].msg_len);
+    hex_to_bin(vectors[i].sig, expected_sig, sizeof(expected_sig));
+
+    assert_int_equal(crypto_sign_ed25519_seed_keypair(pk, sk, seed), 0);
+    assert_memory_equal(pk, expected_pk, sizeof(pk));
+    assert_memory_equal(sk, seed, sizeof(seed));
+    assert_memory_equal(sk + 32, expected_pk, sizeof(expected_pk));
+
+    assert_int_equal(crypto_sign_ed25519_detached(sig, msg,
+          vectors[i].msg_len, sk), 0);
+    assert_memory_equal(sig, expected_sig, sizeof(sig));
+  }
+}
+
+static void torture_ed25519_verify(void **state) {
+  uint8_t pk[ED25519_PUBKEY_SIZE];
+  uint8_t sig[ED25519_SIG_SIZE];
+  uint8_t msg[2];
+  size_t i;
+
+  (void) state;
+
+  for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+    hex_to_bin(vectors[i].pk, pk, sizeof(pk));
+    hex_to_bin(vectors[i].msg, msg, vectors[i].msg_len);
+    hex_to_bin(vectors[i].sig, sig, sizeof(sig));
+
+    assert_int_equal(crypto_sign_ed25519_verify_detached(sig, msg,
+          vectors[i].msg_len, pk), 0);
+
+    /* a flipped bit in R, in S or in the message */
+    sig[0] ^= 1;
+    assert_int_equal(crypto_sign_ed25519_verify_detached(sig, msg,
+          vectors[i].msg_len, pk), -1);
+    sig[0] ^= 1;
+    sig[40] ^= 1;
+    assert_int_equal(crypto_sign_ed25519_verify_detached(sig, msg,
+          vectors[i].msg_len, pk), -1);
+    sig[40] ^= 1;
+    if (vectors[i].msg_len > 0) {
+      msg[0] ^= 1;
+      assert_int_equal(crypto_sign_ed25519_verify_detached(sig, msg,
+            vectors[i].msg_len, pk), -1);
+    }
+  }
+}
+
+/* S + l is the same point but a second encoding, it must be rejected */
+static void torture_ed25519_malleability(void **state) {
+  static const uint8_t l[32] = {
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58,
+    0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0x10
+  };
+  uint8_t pk[ED25519_PUBKEY_SIZE];
+  uint8_t sig[ED25519_SIG_SIZE];
+  unsigned int carry = 0;
+  int i;
+
+  (void) state;
+
+  hex_to_bin(vectors[0].pk, pk, sizeof(pk));
+  hex_to_bin(vectors[0].sig, sig, sizeof(sig));
+
+  for (i = 0; i < 32; i++) {
+    carry += sig[32 + i] + l[i];
+    sig[32 + i] = (uint8_t) carry;
+    carry >>= 8;
+  }
+  assert_int_equal(crypto_sign_ed25519_verify_detached(sig, NULL, 0, pk), -1);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_ed25519_sign),
+        unit_test(torture_ed25519_verify),
+        unit_test(torture_ed25519_malleability),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
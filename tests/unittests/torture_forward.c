@@ -0,0 +1,219 @@
+#define LIBSSH_STATIC
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+#include "libssh/buffer.h"
+#include "libssh/messages.h"
+#include "libssh/ssh2.h"
+
+struct forward_peer {
+  struct torture_peer base;
+  int listener; /* the local service */
+  int port;
+};
+
+/* a session on a socketpair, and a local service on a port */
+static void forward_peer_new(struct forward_peer *peer) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+
+  torture_peer_new(&peer->base, 0);
+
+  peer->listener = socket(AF_INET, SOCK_STREAM, 0);
+  assert_true(peer->listener >= 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert_int_equal(bind(peer->listener, (struct sockaddr *) &addr,
+        sizeof(addr)), 0);
+  assert_int_equal(listen(peer->listener, 16), 0);
+  assert_int_equal(getsockname(peer->listener, (struct sockaddr *) &addr,
+        &len), 0);
+  peer->port = ntohs(addr.sin_port);
+}
+
+static void forward_peer_free(struct forward_peer *peer) {
+  torture_peer_free(&peer->base);
+  close(peer->listener);
+}
+
+/* the server opens a channel for a connection to the port it listens on */
+static void forward_peer_open(struct forward_peer *peer, uint32_t sender,
+    uint32_t port) {
+  ssh_buffer packet;
+
+  packet = ssh_buffer_new();
+  assert_true(packet != NULL);
+  assert_int_equal(buffer_pack(packet, "sdddsdsd", "forwarded-tcpip", sender,
+        64000, 32000, "", port, "192.0.2.1", 40000), 0);
+  ssh_packet_channel_open(peer->base.session, SSH2_MSG_CHANNEL_OPEN, packet,
+      NULL);
+  ssh_buffer_free(packet);
+}
+
+/*
+ * Reads the next packet sent to the peer, which must be of the given type
+ * once the window adjustments are skipped.
+ * Returns the integer after the channel: the reason of a failure or the
+ * length of data.
+ */
+static uint32_t forward_peer_read(struct forward_peer *peer, uint8_t type,
+    unsigned char *data) {
+  unsigned char packet[4096];
+  uint32_t value;
+
+again:
+  torture_peer_read(&peer->base, packet, sizeof(packet));
+  /* padding length, message type, channel, integer, data */
+  if (packet[1] == SSH2_MSG_CHANNEL_WINDOW_ADJUST &&
+      type != SSH2_MSG_CHANNEL_WINDOW_ADJUST) {
+    goto again;
+  }
+  assert_int_equal(packet[1], type);
+  memcpy(&value, packet + 6, sizeof(value));
+  if (data != NULL) {
+    memcpy(data, packet + 10, ntohl(value));
+  }
+
+  return ntohl(value);
+}
+
+/* the channel opened last */
+static ssh_channel forward_channel(struct forward_peer *peer) {
+  assert_true(peer->base.session->channels != NULL);
+  return peer->base.session->channels->prev;
+}
+
+static void torture_forward_remote(void **state) {
+  struct ssh_forward_remote_stats_struct stats;
+  struct forward_peer peer;
+  ssh_forward_remote fwd;
+  ssh_channel channel;
+  ssh_buffer packet;
+  unsigned char data[16];
+  int fd;
+  int i;
+
+  (void) state;
+
+  forward_peer_new(&peer);
+  fwd = ssh_forward_remote_new(peer.base.session, NULL, 8080, "127.0.0.1",
+      peer.port);
+  assert_true(fwd != NULL);
+  ssh_forward_remote_set_limit(fwd, 1);
+
+  /* the channel is accepted once the local service is connected */
+  forward_peer_open(&peer, 3, 8080);
+  fd = accept(peer.listener, NULL, NULL);
+  assert_true(fd >= 0);
+  forward_peer_read(&peer, SSH2_MSG_CHANNEL_OPEN_CONFIRMATION, NULL);
+  channel = forward_channel(&peer);
+  assert_int_equal(channel->remote_channel, 3);
+  assert_true(channel->fd_bind != NULL);
+
+  /* and forwarded to it */
+  assert_int_equal(send(fd, "ping", 4, 0), 4);
+  assert_int_equal(forward_peer_read(&peer, SSH2_MSG_CHANNEL_DATA, data), 4);
+  assert_memory_equal(data, "ping", 4);
+  packet = ssh_buffer_new();
+  assert_true(packet != NULL);
+  assert_int_equal(buffer_pack(packet, "ddP", channel->local_channel, 4, 4,
+        "pong"), 0);
+  channel_rcv_data(peer.base.session, SSH2_MSG_CHANNEL_DATA, packet, NULL);
+  ssh_buffer_free(packet);
+  assert_int_equal(recv(fd, data, 4, MSG_WAITALL), 4);
+  assert_memory_equal(data, "pong", 4);
+
+  /* over the limit, the opens are refused */
+  forward_peer_open(&peer, 4, 8080);
+  assert_int_equal(forward_peer_read(&peer, SSH2_MSG_CHANNEL_OPEN_FAILURE,
+        NULL), SSH2_OPEN_RESOURCE_SHORTAGE);
+  assert_int_equal(ssh_forward_remote_get_stats(fwd, &stats), SSH_OK);
+  assert_int_equal(stats.accepted, 1);
+  assert_int_equal(stats.refused, 1);
+  assert_int_equal(stats.active, 1);
+  assert_int_equal(stats.bytes_in, 4);
+  assert_int_equal(stats.bytes_out, 4);
+
+  /* the service leaves, the channel is freed once the peer closed it */
+  close(fd);
+  forward_peer_read(&peer, SSH2_MSG_CHANNEL_EOF, NULL);
+  packet = ssh_buffer_new();
+  assert_true(packet != NULL);
+  assert_int_equal(buffer_add_u32(packet, htonl(channel->local_channel)), 0);
+  channel_rcv_close(peer.base.session, SSH2_MSG_CHANNEL_CLOSE, packet, NULL);
+  ssh_buffer_free(packet);
+  for (i = 0; i < 3; i++) {
+    assert_int_equal(ssh_handle_packets(peer.base.session, 10), SSH_OK);
+  }
+  assert_true(peer.base.session->channels == NULL);
+  assert_int_equal(ssh_forward_remote_get_stats(fwd, &stats), SSH_OK);
+  assert_int_equal(stats.active, 0);
+  assert_int_equal(stats.bytes_in, 4);
+
+  forward_peer_free(&peer);
+}
+
+static void torture_forward_remote_failed(void **state) {
+  struct ssh_forward_remote_stats_struct stats;
+  struct forward_peer peer;
+  ssh_forward_remote fwd;
+  ssh_message msg;
+  uint32_t i;
+
+  (void) state;
+
+  forward_peer_new(&peer);
+  fwd = ssh_forward_remote_new(peer.base.session, "localhost", 8080,
+      "127.0.0.1", peer.port);
+  assert_true(fwd != NULL);
+
+  /* the other ports and addresses aren't for it */
+  forward_peer_open(&peer, 3, 8081);
+  forward_peer_open(&peer, 4, 8080);
+  for (i = 3; i <= 4; i++) {
+    msg = ssh_message_pop_head(peer.base.session);
+    assert_true(msg != NULL);
+    assert_int_equal(msg->channel_request_open.sender, i);
+    ssh_message_free(msg);
+  }
+  ssh_forward_remote_free(fwd);
+
+  /* nothing listens on the local port anymore */
+  fwd = ssh_forward_remote_new(peer.base.session, NULL, 8080, "127.0.0.1",
+      peer.port);
+  assert_true(fwd != NULL);
+  close(peer.listener);
+  peer.listener = -1;
+  forward_peer_open(&peer, 5, 8080);
+  assert_int_equal(forward_peer_read(&peer, SSH2_MSG_CHANNEL_OPEN_FAILURE,
+        NULL), SSH2_OPEN_CONNECT_FAILED);
+  assert_int_equal(ssh_forward_remote_get_stats(fwd, &stats), SSH_OK);
+  assert_int_equal(stats.failed, 1);
+  assert_int_equal(stats.active, 0);
+  assert_true(peer.base.session->channels == NULL);
+
+  forward_peer_free(&peer);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_forward_remote),
+        unit_test(torture_forward_remote_failed),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,203 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/buffer.h"
+#include "libssh/session.h"
+#include "libssh/crypto.h"
+#include "libssh/channels.h"
+
+#define PACKET_LEN 8192
+
+struct gzip_sessions {
+    ssh_session out;
+    ssh_session in;
+};
+
+static void setup(void **state) {
+    struct gzip_sessions *s;
+
+    s = malloc(sizeof(struct gzip_sessions));
+    assert_true(s != NULL);
+    s->out = ssh_new();
+    s->in = ssh_new();
+    assert_true(s->out != NULL && s->in != NULL);
+    s->out->current_crypto = crypto_new();
+    s->in->current_crypto = crypto_new();
+    assert_true(s->out->current_crypto != NULL);
+    assert_true(s->in->current_crypto != NULL);
+
+    *state = s;
+}
+
+static void teardown(void **state) {
+    struct gzip_sessions *s = *state;
+
+    ssh_free(s->out);
+    ssh_free(s->in);
+    free(s);
+}
+
+/* compresses a packet on one side and inflates it on the other */
+static uint32_t round_trip(struct gzip_sessions *s, const unsigned char *data,
+    uint32_t len) {
+    ssh_buffer buf = s->out->out_buffer;
+    uint32_t compressed;
+
+    assert_true(buffer_reinit(buf) == 0);
+    assert_true(buffer_add_data(buf, data, len) == 0);
+    assert_true(compress_buffer(s->out, buf) == 0);
+    compressed = buffer_get_rest_len(buf);
+
+    assert_true(buffer_reinit(s->in->in_buffer) == 0);
+    assert_true(buffer_add_buffer(s->in->in_buffer, buf) == 0);
+    assert_true(decompress_buffer(s->in, s->in->in_buffer, 256 * 1024) == 0);
+    assert_int_equal(buffer_get_rest_len(s->in->in_buffer), len);
+    assert_true(memcmp(buffer_get_rest(s->in->in_buffer), data, len) == 0);
+
+    return compressed;
+}
+
+static void torture_gzip_round_trip(void **state) {
+    struct gzip_sessions *s = *state;
+    unsigned char data[PACKET_LEN];
+    unsigned char *big;
+    int i;
+
+    memset(data, 'a', sizeof(data));
+    for (i = 0; i < 10; i++) {
+        data[i * 100] = 'b' + i;
+        assert_true(round_trip(s, data, sizeof(data)) < sizeof(data) / 10);
+    }
+    assert_true(round_trip(s, data, 1) > 0);
+
+    /* inflates to more than what the first area holds */
+    big = malloc(128 * 1024);
+    assert_true(big != NULL);
+    memset(big, 'c', 128 * 1024);
+    round_trip(s, big, 128 * 1024);
+
+    /* and to more than the limit */
+    assert_true(buffer_reinit(s->out->out_buffer) == 0);
+    assert_true(buffer_add_data(s->out->out_buffer, big, 128 * 1024) == 0);
+    assert_true(compress_buffer(s->out, s->out->out_buffer) == 0);
+    assert_true(decompress_buffer(s->in, s->out->out_buffer, 64 * 1024) < 0);
+    free(big);
+}
+
+static void torture_gzip_strategy(void **state) {
+    struct gzip_sessions *s = *state;
+    unsigned char data[PACKET_LEN];
+    int strategy = SSH_COMPRESSION_STRATEGY_RLE;
+    int i;
+
+    assert_true(ssh_options_set(s->out, SSH_OPTIONS_COMPRESSION_STRATEGY,
+        &strategy) == 0);
+    for (i = 0; i < (int) sizeof(data); i++) {
+        data[i] = i / 64;
+    }
+    assert_true(round_trip(s, data, sizeof(data)) < sizeof(data) / 10);
+
+    strategy = SSH_COMPRESSION_STRATEGY_RLE + 1;
+    assert_true(ssh_options_set(s->out, SSH_OPTIONS_COMPRESSION_STRATEGY,
+        &strategy) < 0);
+}
+
+static void torture_gzip_adaptive(void **state) {
+    struct gzip_sessions *s = *state;
+    struct ssh_crypto_struct *crypto = s->out->current_crypto;
+    unsigned char data[PACKET_LEN];
+    int adaptive = 1;
+    int i;
+
+    assert_true(ssh_options_set(s->out, SSH_OPTIONS_COMPRESSION_ADAPTIVE,
+        &adaptive) == 0);
+
+    /* compressible data keeps the level */
+    memset(data, 'a', sizeof(data));
+    for (i = 0; i < 40; i++) {
+        round_trip(s, data, sizeof(data));
+    }
+    assert_int_equal(crypto->compress_level, 7);
+
+    /* random data is sent stored once a window has been seen */
+    for (i = 0; i < 64; i++) {
+        ssh_get_random(data, sizeof(data), 0);
+        round_trip(s, data, sizeof(data));
+    }
+    assert_int_equal(crypto->compress_level, 0);
+
+    /* the compression is tried again later */
+    memset(data, 'a', sizeof(data));
+    for (i = 0; i < 1024; i++) {
+        round_trip(s, data, 64);
+    }
+    assert_int_equal(crypto->compress_level, 7);
+    assert_true(round_trip(s, data, sizeof(data)) < sizeof(data) / 10);
+}
+
+static void torture_gzip_skip(void **state) {
+    struct gzip_sessions *s = *state;
+    unsigned char data[PACKET_LEN];
+    ssh_channel channel;
+
+    memset(data, 'a', sizeof(data));
+    assert_true(round_trip(s, data, sizeof(data)) < sizeof(data) / 10);
+
+    /* stored blocks in the same stream */
+    s->out->compress_stored = 1;
+    assert_true(round_trip(s, data, sizeof(data)) > sizeof(data));
+    s->out->compress_stored = 0;
+    assert_true(round_trip(s, data, sizeof(data)) < sizeof(data) / 10);
+
+    assert_true(ssh_options_set(s->out, SSH_OPTIONS_COMPRESSION_SKIP,
+        "sftp,*-tcpip") == 0);
+    channel = ssh_channel_new(s->out);
+    assert_true(channel != NULL);
+    channel_compression_check(channel, "session");
+    assert_int_equal(channel->compress_skip, 0);
+    channel_compression_check(channel, "direct-tcpip");
+    assert_int_equal(channel->compress_skip, 1);
+    assert_true(ssh_channel_set_compression(channel, 1) == SSH_OK);
+    assert_int_equal(channel->compress_skip, 0);
+    channel_compression_check(channel, "sftp");
+    assert_int_equal(channel->compress_skip, 1);
+    ssh_channel_free(channel);
+}
+
+static void torture_gzip_delayed(void **state) {
+    struct gzip_sessions *s = *state;
+    struct ssh_crypto_struct *crypto = s->out->current_crypto;
+    unsigned char data[PACKET_LEN];
+
+    crypto->delayed_compress_out = 1;
+    s->in->current_crypto->delayed_compress_in = 1;
+    assert_int_equal(crypto->do_compress_out, 0);
+
+    /* the streams are ready as soon as the user is authenticated */
+    assert_true(compress_start_delayed(s->out) == SSH_OK);
+    assert_true(compress_start_delayed(s->in) == SSH_OK);
+    assert_int_equal(crypto->do_compress_out, 1);
+    assert_true(crypto->compress_out_ctx != NULL);
+    assert_int_equal(s->in->current_crypto->do_compress_in, 1);
+    assert_true(s->in->current_crypto->compress_in_ctx != NULL);
+
+    memset(data, 'a', sizeof(data));
+    assert_true(round_trip(s, data, sizeof(data)) < sizeof(data) / 10);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_gzip_round_trip, setup, teardown),
+        unit_test_setup_teardown(torture_gzip_strategy, setup, teardown),
+        unit_test_setup_teardown(torture_gzip_adaptive, setup, teardown),
+        unit_test_setup_teardown(torture_gzip_skip, setup, teardown),
+        unit_test_setup_teardown(torture_gzip_delayed, setup, teardown),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,113 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/hashtable.h"
+
+static void setup(void **state) {
+  struct ssh_hashtable *table;
+
+  table = ssh_hashtable_new();
+  assert_true(table != NULL);
+
+  *state = table;
+}
+
+static void teardown(void **state) {
+  ssh_hashtable_free(*state);
+}
+
+static void torture_hashtable_insert_remove(void **state) {
+  struct ssh_hashtable *table = *state;
+  static int data[1000];
+  int i;
+
+  /* enough to grow the table several times */
+  for (i = 0; i < 1000; i++) {
+    assert_int_equal(ssh_hashtable_insert(table, i * 7, &data[i]), 0);
+  }
+  assert_int_equal(table->count, 1000);
+
+  for (i = 0; i < 1000; i++) {
+    assert_true(ssh_hashtable_lookup(table, i * 7) == &data[i]);
+  }
+  assert_true(ssh_hashtable_lookup(table, 3) == NULL);
+
+  for (i = 0; i < 1000; i += 2) {
+    assert_int_equal(ssh_hashtable_remove(table, i * 7, &data[i]), 0);
+  }
+  /* the key and the data must match */
+  assert_true(ssh_hashtable_remove(table, 7, &data[0]) < 0);
+  assert_true(ssh_hashtable_remove(table, 0, &data[0]) < 0);
+  assert_int_equal(table->count, 500);
+
+  for (i = 0; i < 1000; i++) {
+    assert_true(ssh_hashtable_lookup(table, i * 7) ==
+        (i % 2 ? &data[i] : NULL));
+  }
+}
+
+static void torture_hashtable_same_key(void **state) {
+  struct ssh_hashtable *table = *state;
+  struct ssh_hashtable_entry *entry;
+  int data[3];
+  int seen = 0;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    assert_int_equal(ssh_hashtable_insert(table, 42, &data[i]), 0);
+  }
+  assert_int_equal(ssh_hashtable_insert(table, 43, &seen), 0);
+
+  for (entry = ssh_hashtable_find(table, 42); entry != NULL;
+       entry = ssh_hashtable_find_next(entry)) {
+    assert_true(entry->key == 42);
+    seen |= 1 << ((int *) entry->data - data);
+  }
+  assert_int_equal(seen, 7);
+
+  assert_int_equal(ssh_hashtable_remove(table, 42, &data[1]), 0);
+  entry = ssh_hashtable_find(table, 42);
+  assert_true(entry != NULL);
+  entry = ssh_hashtable_find_next(entry);
+  assert_true(entry != NULL);
+  assert_true(ssh_hashtable_find_next(entry) == NULL);
+}
+
+static void torture_hashtable_iterate(void **state) {
+  struct ssh_hashtable *table = *state;
+  struct ssh_hashtable_entry *entry, *next;
+  static int data[100];
+  int count = 0;
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    assert_int_equal(ssh_hashtable_insert(table,
+          ssh_hashtable_ptr_key(&data[i]), &data[i]), 0);
+  }
+
+  /* removing the current entry is allowed */
+  for (entry = ssh_hashtable_first(table); entry != NULL; entry = next) {
+    next = ssh_hashtable_next(table, entry);
+    assert_true(entry->key == ssh_hashtable_ptr_key(entry->data));
+    assert_int_equal(ssh_hashtable_remove(table, entry->key, entry->data), 0);
+    count++;
+  }
+  assert_int_equal(count, 100);
+  assert_int_equal(table->count, 0);
+  assert_true(ssh_hashtable_first(table) == NULL);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_hashtable_insert_remove, setup, teardown),
+        unit_test_setup_teardown(torture_hashtable_same_key, setup, teardown),
+        unit_test_setup_teardown(torture_hashtable_iterate, setup, teardown),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,87 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/histogram.h"
+
+static void setup(void **state) {
+    *state = ssh_new();
+    assert_true(*state != NULL);
+}
+
+static void teardown(void **state) {
+    ssh_free(*state);
+}
+
+static void torture_histogram_values(void **state) {
+    struct ssh_histogram_struct h;
+    struct ssh_latency_struct latency;
+    uint64_t i;
+
+    (void) state;
+    memset(&h, 0, sizeof(h));
+    ssh_histogram_get(&h, &latency);
+    assert_true(latency.count == 0);
+
+    for (i = 1; i <= 1000; i++) {
+        ssh_histogram_record(&h, i);
+    }
+    ssh_histogram_get(&h, &latency);
+    assert_true(latency.count == 1000);
+    assert_true(latency.min == 1);
+    assert_true(latency.max == 1000);
+    assert_true(latency.mean == 500);
+    /* the buckets are within 1/8 of the values */
+    assert_true(latency.p50 >= 500 && latency.p50 <= 500 + 500 / 8);
+    assert_true(latency.p90 >= 900 && latency.p90 <= 900 + 900 / 8);
+    assert_true(latency.p99 >= 990 && latency.p99 <= 1000);
+    assert_true(latency.p999 == 1000);
+
+    /* values beyond the last bucket */
+    ssh_histogram_record(&h, (uint64_t) -1);
+    ssh_histogram_get(&h, &latency);
+    assert_true(latency.max == (uint64_t) -1);
+}
+
+static void torture_histogram_session(void **state) {
+    ssh_session session = *state;
+    struct ssh_latency_struct before;
+    struct ssh_latency_struct latency;
+
+    assert_true(ssh_session_get_latency(NULL, SSH_LATENCY_KEX, &before) ==
+        SSH_OK);
+    assert_true(ssh_session_get_latency(session, SSH_LATENCY_KEX, &latency) ==
+        SSH_OK);
+    assert_true(latency.count == 0);
+
+    ssh_latency_record(session, SSH_LATENCY_KEX, 20);
+    ssh_latency_record(session, SSH_LATENCY_KEX, 10);
+    assert_true(ssh_session_get_latency(session, SSH_LATENCY_KEX, &latency) ==
+        SSH_OK);
+    assert_true(latency.count == 2);
+    assert_true(latency.min == 10);
+    assert_true(latency.max == 20);
+    assert_true(latency.mean == 15);
+
+    /* the process totals include the session */
+    assert_true(ssh_session_get_latency(NULL, SSH_LATENCY_KEX, &latency) ==
+        SSH_OK);
+    assert_true(latency.count == before.count + 2);
+
+    assert_true(ssh_session_get_latency(session, SSH_LATENCY_PHASES,
+        &latency) == SSH_ERROR);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_histogram_values),
+        unit_test_setup_teardown(torture_histogram_session, setup, teardown),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,81 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/server.h"
+#include "libssh/bind.h"
+#include "libssh/hostkey.h"
+
+#define LIBSSH_ED25519_TESTKEY "libssh_testkey.id_ed25519"
+
+static void setup(void **state) {
+    ssh_bind sshbind;
+    int rc;
+
+    unlink(LIBSSH_ED25519_TESTKEY);
+    unlink(LIBSSH_ED25519_TESTKEY ".pub");
+
+    rc = system("ssh-keygen -t ed25519 -q -N \"\" -f " LIBSSH_ED25519_TESTKEY);
+    assert_true(rc == 0);
+
+    sshbind = ssh_bind_new();
+    assert_true(sshbind != NULL);
+    rc = ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_ED25519KEY,
+        LIBSSH_ED25519_TESTKEY);
+    assert_true(rc == 0);
+    *state = sshbind;
+}
+
+static void teardown(void **state) {
+    unlink(LIBSSH_ED25519_TESTKEY);
+    unlink(LIBSSH_ED25519_TESTKEY ".pub");
+
+    ssh_bind_free(*state);
+}
+
+static void torture_hostkey_reload(void **state) {
+    ssh_bind sshbind = *state;
+    struct ssh_hostkey_struct *key;
+    int rc;
+
+    rc = ssh_bind_reload_hostkeys(sshbind);
+    assert_true(rc == SSH_OK);
+    assert_true(sshbind->host_keys[SSH_KEYTYPE_RSA] == NULL);
+    assert_true(sshbind->host_keys[SSH_KEYTYPE_ED25519] != NULL);
+
+    /* the blob is serialized once */
+    key = ssh_hostkey_get(&sshbind->host_keys[SSH_KEYTYPE_ED25519]);
+    assert_true(key != NULL);
+    assert_true(key->refs == 2);
+    assert_true(key->blob != NULL);
+
+    /* a new key for the bind, the session keeps its own */
+    rc = ssh_bind_reload_hostkeys(sshbind);
+    assert_true(rc == SSH_OK);
+    assert_true(sshbind->host_keys[SSH_KEYTYPE_ED25519] != key);
+    assert_true(key->refs == 1);
+    assert_true(key->key != NULL);
+    ssh_hostkey_free(key);
+
+    /* a failed reload keeps the loaded keys */
+    key = sshbind->host_keys[SSH_KEYTYPE_ED25519];
+    rc = ssh_bind_options_set(sshbind, SSH_BIND_OPTIONS_RSAKEY,
+        "libssh_testkey.missing");
+    assert_true(rc == 0);
+    rc = ssh_bind_reload_hostkeys(sshbind);
+    assert_true(rc == SSH_ERROR);
+    assert_true(sshbind->host_keys[SSH_KEYTYPE_ED25519] == key);
+    assert_true(sshbind->host_keys[SSH_KEYTYPE_RSA] == NULL);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_hostkey_reload, setup, teardown),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
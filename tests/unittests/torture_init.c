@@ -2,6 +2,9 @@
 
 #include "torture.h"
 #include "libssh/libssh.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/histogram.h"
 
 static void torture_ssh_init(void **state) {
     int rc;
@@ -14,9 +17,36 @@ static void torture_ssh_init(void **state) {
     assert_int_equal(rc, SSH_OK);
 }
 
+static void torture_ssh_init_count(void **state) {
+    struct ssh_latency_struct latency;
+    ssh_session session;
+
+    (void) state;
+
+    assert_int_equal(ssh_init(), SSH_OK);
+    assert_int_equal(ssh_init(), SSH_OK);
+    session = ssh_new();
+    assert_true(session != NULL);
+    ssh_latency_record(session, SSH_LATENCY_CONNECT, 10);
+    ssh_free(session);
+
+    /* the global state stays until the last ssh_finalize() */
+    assert_int_equal(ssh_finalize(), SSH_OK);
+    ssh_session_get_latency(NULL, SSH_LATENCY_CONNECT, &latency);
+    assert_true(latency.count == 1);
+    assert_int_equal(ssh_finalize(), SSH_OK);
+    ssh_session_get_latency(NULL, SSH_LATENCY_CONNECT, &latency);
+    assert_true(latency.count == 0);
+
+    /* and it can be initialized again */
+    assert_int_equal(ssh_init(), SSH_OK);
+    assert_int_equal(ssh_finalize(), SSH_OK);
+}
+
 int torture_run_tests(void) {
     const UnitTest tests[] = {
         unit_test(torture_ssh_init),
+        unit_test(torture_ssh_init_count),
     };
 
     return run_tests(tests);
@@ -0,0 +1,241 @@
+#define LIBSSH_STATIC
+
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/buffer.h"
+#include "libssh/string.h"
+#include "libssh/ssh2.h"
+
+#define BANNER "SSH-2.0-OpenSSH_6.0\r\n"
+
+/* a nonblocking bastion connected to a socketpair, authenticated */
+struct jump_peer {
+  struct torture_peer base; /* the bastion */
+  ssh_session session; /* through the bastion */
+  uint32_t channel; /* the channel of the bastion */
+};
+
+static void jump_peer_new(struct jump_peer *peer) {
+  unsigned int port = 2222;
+
+  torture_peer_new(&peer->base, TORTURE_PEER_PACKETS);
+  peer->base.session->session_state = SSH_SESSION_STATE_AUTHENTICATED;
+  ssh_set_blocking(peer->base.session, 0);
+
+  peer->session = ssh_new();
+  assert_true(peer->session != NULL);
+  assert_int_equal(ssh_options_set(peer->session, SSH_OPTIONS_HOST,
+        "inner.example.com"), 0);
+  assert_int_equal(ssh_options_set(peer->session, SSH_OPTIONS_PORT, &port),
+      0);
+  ssh_set_blocking(peer->session, 0);
+}
+
+static void jump_peer_free(struct jump_peer *peer) {
+  if (peer->session != NULL) {
+    ssh_free(peer->session);
+  }
+  torture_peer_free(&peer->base);
+}
+
+/* sends an unencrypted packet of the integers and strings of the format */
+static void jump_peer_send(struct jump_peer *peer, uint8_t type,
+    const char *format, ...) {
+  ssh_buffer payload;
+  va_list ap;
+
+  payload = ssh_buffer_new();
+  assert_true(payload != NULL);
+  assert_int_equal(buffer_add_u8(payload, type), 0);
+  va_start(ap, format);
+  for (; *format != '\0'; format++) {
+    if (*format == 's') {
+      assert_int_equal(buffer_pack(payload, "s", va_arg(ap, const char *)),
+          0);
+    } else {
+      assert_int_equal(buffer_pack(payload, "d", va_arg(ap, uint32_t)), 0);
+    }
+  }
+  va_end(ap);
+
+  torture_peer_send(&peer->base, payload);
+}
+
+/*
+ * the next packet of the bastion, its payload without the type; the windows
+ * given back as the data is read are skipped
+ */
+static ssh_buffer jump_peer_read(struct jump_peer *peer, uint8_t type) {
+  unsigned char packet[4096];
+  ssh_buffer payload;
+  uint32_t len;
+  int i;
+
+again:
+  /* the session runs too, what it sends goes out through the bastion */
+  for (i = 0; i < 100 && peer->session != NULL &&
+       !torture_peer_pending(&peer->base); i++) {
+    ssh_connect(peer->session);
+    usleep(1000);
+  }
+  len = torture_peer_read(&peer->base, packet, sizeof(packet));
+  /* padding length, type */
+  if (packet[1] == SSH2_MSG_CHANNEL_WINDOW_ADJUST &&
+      type != SSH2_MSG_CHANNEL_WINDOW_ADJUST) {
+    goto again;
+  }
+  assert_int_equal(packet[1], type);
+  payload = ssh_buffer_new();
+  assert_true(payload != NULL);
+  assert_int_equal(buffer_add_data(payload, packet + 2, len - packet[0] - 2),
+      0);
+
+  return payload;
+}
+
+/* the channel is asked for and confirmed */
+static void jump_peer_open(struct jump_peer *peer) {
+  ssh_buffer payload;
+  char *type, *host, *orig;
+  uint32_t window, maxpacket, port, orig_port;
+
+  assert_int_equal(ssh_set_proxy_jump(peer->session, peer->base.session),
+      SSH_AGAIN);
+  payload = jump_peer_read(peer, SSH2_MSG_CHANNEL_OPEN);
+  assert_int_equal(buffer_unpack(payload, "sdddsdsd", &type, &peer->channel,
+        &window, &maxpacket, &host, &port, &orig, &orig_port), 0);
+  assert_string_equal(type, "direct-tcpip");
+  assert_string_equal(host, "inner.example.com");
+  assert_int_equal(port, 2222);
+  SAFE_FREE(type);
+  SAFE_FREE(host);
+  SAFE_FREE(orig);
+  ssh_buffer_free(payload);
+
+  jump_peer_send(peer, SSH2_MSG_CHANNEL_OPEN_CONFIRMATION, "dddd",
+      peer->channel, 7, 1000000, 32768);
+  assert_int_equal(ssh_set_proxy_jump(peer->session, peer->base.session), SSH_OK);
+  assert_true(ssh_get_fd(peer->session) >= 0);
+}
+
+static void torture_jump_connect(void **state) {
+  struct jump_peer peer;
+  ssh_buffer payload;
+  uint32_t channel;
+  ssh_string data;
+  char *banner, *eol;
+  int i;
+
+  (void) state;
+
+  jump_peer_new(&peer);
+  jump_peer_open(&peer);
+
+  /* the banner and the key exchange of the session go through the channel */
+  assert_int_equal(ssh_connect(peer.session), SSH_AGAIN);
+  payload = jump_peer_read(&peer, SSH2_MSG_CHANNEL_DATA);
+  assert_int_equal(buffer_unpack(payload, "dS", &channel, &data), 0);
+  assert_int_equal(channel, 7);
+  banner = ssh_string_data(data);
+  assert_memory_equal(banner, "SSH-2.0-", 8);
+  eol = memchr(banner, '\n', ssh_string_len(data));
+  assert_true(eol != NULL);
+  /* length, padding, then the type */
+  assert_true(eol + 7 <= banner + ssh_string_len(data));
+  assert_int_equal(eol[6], SSH2_MSG_KEXINIT);
+  ssh_string_free(data);
+  ssh_buffer_free(payload);
+
+  /* the banner of the server comes back, read through the bastion */
+  jump_peer_send(&peer, SSH2_MSG_CHANNEL_DATA, "ds", peer.channel, BANNER);
+  for (i = 0; i < 100 && peer.session->serverbanner == NULL; i++) {
+    assert_int_equal(ssh_connect(peer.session), SSH_AGAIN);
+    usleep(1000);
+  }
+  assert_string_equal(peer.session->serverbanner, "SSH-2.0-OpenSSH_6.0");
+  payload = jump_peer_read(&peer, SSH2_MSG_CHANNEL_WINDOW_ADJUST);
+  ssh_buffer_free(payload);
+
+  /* the channel goes with the session */
+  ssh_free(peer.session);
+  peer.session = NULL;
+  payload = jump_peer_read(&peer, SSH2_MSG_CHANNEL_EOF);
+  ssh_buffer_free(payload);
+  payload = jump_peer_read(&peer, SSH2_MSG_CHANNEL_CLOSE);
+  ssh_buffer_free(payload);
+
+  jump_peer_free(&peer);
+}
+
+static void torture_jump_close(void **state) {
+  struct jump_peer peer;
+  ssh_buffer payload;
+  int rc = SSH_AGAIN;
+  int i;
+
+  (void) state;
+
+  jump_peer_new(&peer);
+  jump_peer_open(&peer);
+  assert_int_equal(ssh_connect(peer.session), SSH_AGAIN);
+  payload = jump_peer_read(&peer, SSH2_MSG_CHANNEL_DATA);
+  ssh_buffer_free(payload);
+
+  /* the end of the channel is the end of the connection */
+  jump_peer_send(&peer, SSH2_MSG_CHANNEL_EOF, "d", peer.channel);
+  jump_peer_send(&peer, SSH2_MSG_CHANNEL_CLOSE, "d", peer.channel);
+  for (i = 0; i < 100; i++) {
+    rc = ssh_connect(peer.session);
+    if (rc != SSH_AGAIN) {
+      break;
+    }
+    usleep(1000);
+  }
+  assert_int_equal(rc, SSH_ERROR);
+  assert_true(peer.session->jump == NULL);
+
+  jump_peer_free(&peer);
+}
+
+static void torture_jump_refused(void **state) {
+  struct jump_peer peer;
+  ssh_buffer payload;
+
+  (void) state;
+
+  jump_peer_new(&peer);
+  assert_int_equal(ssh_set_proxy_jump(peer.session, peer.session),
+      SSH_ERROR);
+  assert_int_equal(ssh_set_proxy_jump(peer.session, peer.base.session),
+      SSH_AGAIN);
+  payload = jump_peer_read(&peer, SSH2_MSG_CHANNEL_OPEN);
+  ssh_buffer_free(payload);
+
+  jump_peer_send(&peer, SSH2_MSG_CHANNEL_OPEN_FAILURE, "ddss",
+      peer.base.session->channels->local_channel, 2, "refused", "");
+  assert_int_equal(ssh_set_proxy_jump(peer.session, peer.base.session),
+      SSH_ERROR);
+  assert_true(peer.session->jump == NULL);
+  assert_true(strstr(ssh_get_error(peer.session), "refused") != NULL);
+
+  jump_peer_free(&peer);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_jump_connect),
+        unit_test(torture_jump_close),
+        unit_test(torture_jump_refused),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,101 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/server.h"
+#include "libssh/kexpool.h"
+
+#ifdef HAVE_ECDH
+#define KEX_METHODS 3
+#else
+#define KEX_METHODS 2
+#endif
+
+static void setup(void **state) {
+  (void) state;
+  assert_int_equal(ssh_set_kex_pool_size(2), SSH_OK);
+}
+
+static void teardown(void **state) {
+  (void) state;
+  assert_int_equal(ssh_set_kex_pool_size(0), SSH_OK);
+}
+
+/*
+ * Test that a refill computes the missing keys of every method
+ */
+static void torture_kexpool_refill(void **state) {
+  bignum y = NULL, f = NULL;
+
+  (void) state;
+
+  assert_int_equal(ssh_kex_pool_refill(), 2 * KEX_METHODS);
+  assert_int_equal(ssh_kex_pool_refill(), 0);
+
+  assert_int_equal(ssh_kex_pool_take_dh(&y, &f), 0);
+  assert_true(y != NULL);
+  assert_true(f != NULL);
+  bignum_free(y);
+  bignum_free(f);
+  assert_int_equal(ssh_kex_pool_refill(), 1);
+}
+
+/*
+ * Test that every key is given once, and that the pool then runs dry
+ */
+static void torture_kexpool_take(void **state) {
+  unsigned char priv1[CURVE25519_PRIVKEY_SIZE], pub1[CURVE25519_PUBKEY_SIZE];
+  unsigned char priv2[CURVE25519_PRIVKEY_SIZE], pub2[CURVE25519_PUBKEY_SIZE];
+  unsigned char pub[CURVE25519_PUBKEY_SIZE];
+
+  (void) state;
+
+  assert_int_equal(ssh_kex_pool_take_curve25519(priv1, pub1), -1);
+  assert_int_equal(ssh_kex_pool_refill(), 2 * KEX_METHODS);
+
+  assert_int_equal(ssh_kex_pool_take_curve25519(priv1, pub1), 0);
+  assert_int_equal(ssh_kex_pool_take_curve25519(priv2, pub2), 0);
+  assert_int_equal(ssh_kex_pool_take_curve25519(priv2, pub2), -1);
+  assert_true(memcmp(priv1, priv2, sizeof(priv1)) != 0);
+
+  /* the public key goes with the private one */
+  crypto_scalarmult_curve25519_base(pub, priv1);
+  assert_memory_equal(pub, pub1, sizeof(pub));
+
+#ifdef HAVE_ECDH
+  EC_KEY_free(ssh_kex_pool_take_ecdh());
+#endif
+}
+
+/*
+ * Test that shrinking the pool releases the keys
+ */
+static void torture_kexpool_shrink(void **state) {
+  bignum y = NULL, f = NULL;
+
+  (void) state;
+
+  assert_int_equal(ssh_kex_pool_refill(), 2 * KEX_METHODS);
+  assert_int_equal(ssh_set_kex_pool_size(1), SSH_OK);
+  assert_int_equal(ssh_kex_pool_take_dh(&y, &f), 0);
+  bignum_free(y);
+  bignum_free(f);
+  assert_int_equal(ssh_kex_pool_take_dh(&y, &f), -1);
+
+  assert_int_equal(ssh_set_kex_pool_size(0), SSH_OK);
+  assert_int_equal(ssh_kex_pool_refill(), 0);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_kexpool_refill, setup, teardown),
+        unit_test_setup_teardown(torture_kexpool_take, setup, teardown),
+        unit_test_setup_teardown(torture_kexpool_shrink, setup, teardown),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -1,5 +1,7 @@
 #define LIBSSH_STATIC
 
+#include <utime.h>
+
 #include "torture.h"
 #include "keyfiles.c"
 
@@ -238,6 +240,57 @@ static void torture_privatekey_from_file_passphrase(void **state) {
     }
 }
 
+/**
+ * @brief tests the key cache of privatekey_from_file
+ */
+static void torture_privatekey_from_file_cache(void **state) {
+    ssh_session session = *state;
+    ssh_private_key key = NULL;
+    struct utimbuf times;
+    struct stat st;
+    FILE *fp;
+    off_t i;
+    int rc;
+
+    rc = ssh_key_cache_preload(session, LIBSSH_RSA_TESTKEY, NULL);
+    assert_true(rc == SSH_ERROR);
+
+    rc = ssh_set_key_cache_size(2);
+    assert_true(rc == SSH_OK);
+    rc = ssh_key_cache_preload(session, LIBSSH_RSA_TESTKEY, NULL);
+    assert_true(rc == SSH_OK);
+
+    /* same size and time: the file isn't parsed again */
+    rc = stat(LIBSSH_RSA_TESTKEY, &st);
+    assert_true(rc == 0);
+    fp = fopen(LIBSSH_RSA_TESTKEY, "w");
+    assert_true(fp != NULL);
+    for (i = 0; i < st.st_size; i++) {
+        fputc('x', fp);
+    }
+    fclose(fp);
+    times.actime = st.st_atime;
+    times.modtime = st.st_mtime;
+    rc = utime(LIBSSH_RSA_TESTKEY, &times);
+    assert_true(rc == 0);
+
+    key = privatekey_from_file(session, LIBSSH_RSA_TESTKEY, 0, NULL);
+    assert_true(key != NULL);
+    assert_true(key->type == SSH_KEYTYPE_RSA);
+    privatekey_free(key);
+
+    /* the file was written since */
+    times.modtime = st.st_mtime + 10;
+    rc = utime(LIBSSH_RSA_TESTKEY, &times);
+    assert_true(rc == 0);
+
+    key = privatekey_from_file(session, LIBSSH_RSA_TESTKEY, 0, NULL);
+    assert_true(key == NULL);
+
+    rc = ssh_set_key_cache_size(0);
+    assert_true(rc == SSH_OK);
+}
+
 int torture_run_tests(void) {
     int rc;
     const UnitTest tests[] = {
@@ -251,6 +304,8 @@ int torture_run_tests(void) {
                                  teardown),
         unit_test_setup_teardown(torture_privatekey_from_file_passphrase,
                                  setup_both_keys_passphrase, teardown),
+        unit_test_setup_teardown(torture_privatekey_from_file_cache,
+                                 setup_rsa_key, teardown),
     };
 
 
@@ -0,0 +1,245 @@
+#define LIBSSH_STATIC
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/crypto.h"
+#include "libssh/wrapper.h"
+#include "libssh/callbacks.h"
+
+#define KNOWNHOSTS "libssh_testknownhosts"
+
+static const unsigned char host_key[] = "a server public key";
+static const unsigned char other_key[] = "another public key";
+
+static void setup(void **state) {
+    ssh_session session;
+    ssh_string pubkey;
+    int rc;
+
+    unlink(KNOWNHOSTS);
+
+    session = ssh_new();
+    assert_true(session != NULL);
+    rc = ssh_options_set(session, SSH_OPTIONS_HOST, "Example.com");
+    assert_true(rc == 0);
+    rc = ssh_options_set(session, SSH_OPTIONS_KNOWNHOSTS, KNOWNHOSTS);
+    assert_true(rc == 0);
+
+    session->current_crypto = crypto_new();
+    assert_true(session->current_crypto != NULL);
+    pubkey = ssh_string_new(sizeof(host_key));
+    assert_true(pubkey != NULL);
+    ssh_string_fill(pubkey, host_key, sizeof(host_key));
+    session->current_crypto->server_pubkey = pubkey;
+    session->current_crypto->server_pubkey_type = "ssh-rsa";
+
+    *state = session;
+}
+
+static void teardown(void **state) {
+    unlink(KNOWNHOSTS);
+    ssh_free(*state);
+}
+
+static void write_line(const char *host, const char *type,
+    const unsigned char *key, int len) {
+    unsigned char *b64;
+    FILE *file;
+
+    b64 = bin_to_base64(key, len);
+    assert_true(b64 != NULL);
+    file = fopen(KNOWNHOSTS, "a");
+    assert_true(file != NULL);
+    fprintf(file, "%s %s %s\n", host, type, b64);
+    fclose(file);
+    SAFE_FREE(b64);
+}
+
+/* the openssh hashed form of the host, with the given salt */
+static char *hashed_host(const char *host, const unsigned char *salt) {
+    unsigned char hash[SHA_DIGEST_LEN];
+    unsigned int size = sizeof(hash);
+    unsigned char *b64salt;
+    unsigned char *b64hash;
+    char *ret;
+    HMACCTX mac;
+
+    mac = hmac_init(salt, SHA_DIGEST_LEN, HMAC_SHA1);
+    assert_true(mac != NULL);
+    hmac_update(mac, host, strlen(host));
+    hmac_final(mac, hash, &size);
+
+    b64salt = bin_to_base64(salt, SHA_DIGEST_LEN);
+    b64hash = bin_to_base64(hash, size);
+    assert_true(b64salt != NULL && b64hash != NULL);
+    ret = malloc(strlen((char *) b64salt) + strlen((char *) b64hash) + 5);
+    assert_true(ret != NULL);
+    sprintf(ret, "|1|%s|%s", b64salt, b64hash);
+    SAFE_FREE(b64salt);
+    SAFE_FREE(b64hash);
+
+    return ret;
+}
+
+static void torture_knownhosts_plain(void **state) {
+    ssh_session session = *state;
+
+    /* a missing file */
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_NOT_KNOWN);
+
+    write_line("foo.org,bar.org", "ssh-rsa", host_key, sizeof(host_key));
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_NOT_KNOWN);
+
+    /* the file is parsed again once written */
+    write_line("foo.org,example.COM", "ssh-rsa", other_key,
+        sizeof(other_key));
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_KNOWN_CHANGED);
+
+    write_line("example.com", "ssh-rsa", host_key, sizeof(host_key));
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_KNOWN_OK);
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_KNOWN_OK);
+}
+
+static void torture_knownhosts_other(void **state) {
+    ssh_session session = *state;
+
+    write_line("example.com", "ssh-dss", other_key, sizeof(other_key));
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_FOUND_OTHER);
+
+    /* the lines are checked in the order of the file */
+    write_line("*.com", "ssh-rsa", host_key, sizeof(host_key));
+    write_line("example.com", "ssh-rsa", other_key, sizeof(other_key));
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_KNOWN_OK);
+}
+
+static void torture_knownhosts_hashed(void **state) {
+    ssh_session session = *state;
+    unsigned char salt[SHA_DIGEST_LEN];
+    char *host;
+    int i;
+
+    memset(salt, 'a', sizeof(salt));
+    host = hashed_host("other.com", salt);
+    write_line(host, "ssh-rsa", host_key, sizeof(host_key));
+    SAFE_FREE(host);
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_NOT_KNOWN);
+
+    /* hashed names sharing a salt and names with their own */
+    for (i = 0; i < 3; i++) {
+        salt[0] = 'a' + i;
+        host = hashed_host("example.com", salt);
+        write_line(host, "ssh-rsa", i < 2 ? other_key : host_key,
+            i < 2 ? sizeof(other_key) : sizeof(host_key));
+        SAFE_FREE(host);
+        assert_true(ssh_is_server_known(session) ==
+            (i < 2 ? SSH_SERVER_KNOWN_CHANGED : SSH_SERVER_KNOWN_OK));
+    }
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_KNOWN_OK);
+
+    /* the host with a port */
+    assert_true(ssh_options_set(session, SSH_OPTIONS_HOST, "test.com") == 0);
+    session->port = 2222;
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_NOT_KNOWN);
+    host = hashed_host("[test.com]:2222", salt);
+    write_line(host, "ssh-rsa", host_key, sizeof(host_key));
+    SAFE_FREE(host);
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_KNOWN_OK);
+}
+
+static void torture_knownhosts_write(void **state) {
+    ssh_session session = *state;
+    char line[256];
+    FILE *file;
+    int lines = 0;
+
+    write_line("foo.org", "ssh-rsa", other_key, sizeof(other_key));
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_NOT_KNOWN);
+
+    /* known from the index */
+    assert_true(ssh_write_knownhost(session) == SSH_OK);
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_KNOWN_OK);
+
+    session->StrictHostKeyChecking = 0;
+    assert_true(ssh_options_set(session, SSH_OPTIONS_HOST, "bar.org") == 0);
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_KNOWN_OK);
+    session->StrictHostKeyChecking = 1;
+    assert_true(ssh_is_server_known(session) == SSH_SERVER_KNOWN_OK);
+
+    file = fopen(KNOWNHOSTS, "r");
+    assert_true(file != NULL);
+    while (fgets(line, sizeof(line), file) != NULL) {
+        lines++;
+    }
+    fclose(file);
+    assert_true(lines == 3);
+}
+
+/* a nonblocking client whose key exchange is done */
+static ssh_session deferred_session(int *fd) {
+    ssh_session session;
+    int fds[2];
+
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    *fd = fds[1];
+    session = ssh_new();
+    assert_true(session != NULL);
+    assert_true(ssh_options_set(session, SSH_OPTIONS_HOST, "example.com") == 0);
+    assert_true(ssh_options_set(session, SSH_OPTIONS_FD, &fds[0]) == 0);
+    ssh_set_blocking(session, 0);
+    assert_true(ssh_connect(session) == SSH_AGAIN);
+    assert_true(ssh_host_key_verified(session, 1) == SSH_ERROR);
+
+    /* the host key callback returned SSH_AGAIN */
+    session->session_state = SSH_SESSION_STATE_DH;
+    session->dh_handshake_state = DH_STATE_FINISHED;
+    session->host_key_state = SSH_HOST_KEY_PENDING;
+
+    return session;
+}
+
+static void torture_knownhosts_deferred(void **state) {
+    ssh_session session;
+    int fd;
+
+    (void) state;
+
+    /* the connection waits for the answer */
+    session = deferred_session(&fd);
+    assert_true(ssh_connect(session) == SSH_AGAIN);
+    assert_true(ssh_connect(session) == SSH_AGAIN);
+    assert_true(ssh_host_key_verified(session, 1) == SSH_OK);
+    assert_true(session->session_state == SSH_SESSION_STATE_AUTHENTICATING);
+    assert_true(ssh_connect(session) == SSH_OK);
+    assert_true(ssh_host_key_verified(session, 1) == SSH_ERROR);
+    ssh_free(session);
+    close(fd);
+
+    session = deferred_session(&fd);
+    assert_true(ssh_connect(session) == SSH_AGAIN);
+    assert_true(ssh_host_key_verified(session, 0) == SSH_OK);
+    assert_true(ssh_connect(session) == SSH_ERROR);
+    assert_true(strstr(ssh_get_error(session), "rejected") != NULL);
+    ssh_free(session);
+    close(fd);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_knownhosts_plain, setup, teardown),
+        unit_test_setup_teardown(torture_knownhosts_other, setup, teardown),
+        unit_test_setup_teardown(torture_knownhosts_hashed, setup, teardown),
+        unit_test_setup_teardown(torture_knownhosts_write, setup, teardown),
+        unit_test(torture_knownhosts_deferred),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -76,12 +76,56 @@ static void torture_ssh_list_prepend(void **state) {
     ssh_list_free(xlist);
 }
 
+static void torture_ssh_list_remove(void **state) {
+    struct ssh_list *xlist;
+    struct ssh_iterator *it;
+    struct ssh_iterator *spare;
+    int rc;
+
+    (void) state;
+
+    xlist = ssh_list_new();
+    assert_true(xlist != NULL);
+    assert_int_equal(ssh_list_append(xlist, "item1"), 0);
+    assert_int_equal(ssh_list_append(xlist, "item2"), 0);
+    assert_int_equal(ssh_list_append(xlist, "item3"), 0);
+
+    /* in the middle, then at the end, then at the head */
+    ssh_list_remove(xlist, xlist->root->next);
+    assert_string_equal((const char *) xlist->root->data, "item1");
+    assert_string_equal((const char *) xlist->root->next->data, "item3");
+    assert_true(xlist->end->prev == xlist->root);
+    ssh_list_remove(xlist, xlist->end);
+    assert_true(xlist->root == xlist->end);
+    assert_true(xlist->root->next == NULL);
+    ssh_list_remove(xlist, xlist->root);
+    assert_true(xlist->root == NULL);
+    assert_true(xlist->end == NULL);
+
+    /* the nodes removed are used again */
+    spare = xlist->spare;
+    assert_int_equal(xlist->nspare, 3);
+    rc = ssh_list_prepend(xlist, "item4");
+    assert_true(rc == 0);
+    assert_true(xlist->root == spare);
+    assert_int_equal(xlist->nspare, 2);
+    assert_int_equal(ssh_list_prepend(xlist, "item5"), 0);
+    assert_true(xlist->root->next->prev == xlist->root);
+    assert_string_equal(ssh_list_pop_head(const char *, xlist), "item5");
+    assert_true(xlist->root->prev == NULL);
+    it = ssh_list_get_iterator(xlist);
+    assert_string_equal((const char *) it->data, "item4");
+
+    ssh_list_free(xlist);
+}
+
 int torture_run_tests(void) {
     int rc;
     const UnitTest tests[] = {
         unit_test(torture_ssh_list_new),
         unit_test(torture_ssh_list_append),
         unit_test(torture_ssh_list_prepend),
+        unit_test(torture_ssh_list_remove),
     };
 
     ssh_init();
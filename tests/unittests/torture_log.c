@@ -0,0 +1,119 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+
+struct drained {
+    char text[4][256];
+    int events[4];
+    int count;
+};
+
+static void drain(ssh_session session, ssh_log_entry entry, void *userdata) {
+    struct drained *d = userdata;
+
+    (void) session;
+    assert_true(d->count < 4);
+    d->events[d->count] = ssh_log_entry_event(entry);
+    ssh_log_entry_format(entry, d->text[d->count], sizeof(d->text[0]));
+    d->count++;
+}
+
+static void setup(void **state) {
+    ssh_session session = ssh_new();
+
+    assert_true(session != NULL);
+    session->log_verbosity = SSH_LOG_PACKET;
+    assert_true(ssh_set_log_ring(session, 4) == SSH_OK);
+    *state = session;
+}
+
+static void teardown(void **state) {
+    ssh_free(*state);
+}
+
+static void torture_log_messages(void **state) {
+    ssh_session session = *state;
+    struct drained d;
+    char name[16];
+
+    memset(&d, 0, sizeof(d));
+    strcpy(name, "world");
+    ssh_log(session, SSH_LOG_PROTOCOL, "hello %s, %d%% %5.2s|%.*s %lu %zu",
+        name, 42, "abc", 3, "defgh", 7UL, (size_t) 8);
+    /* the arguments were copied */
+    strcpy(name, "moon");
+    /* kept as text */
+    ssh_log(session, SSH_LOG_RARE, "%f", 1.5);
+    /* too verbose */
+    ssh_log(session, SSH_LOG_FUNCTIONS, "ignored");
+
+    assert_true(ssh_log_drain(session, drain, &d) == 2);
+    assert_true(d.events[0] == SSH_LOG_EVENT_MESSAGE);
+    assert_string_equal(d.text[0], "hello world, 42%    ab|def 7 8");
+    assert_string_equal(d.text[1], "1.500000");
+    assert_true(ssh_log_drain(session, drain, &d) == 0);
+}
+
+static void torture_log_events(void **state) {
+    ssh_session session = *state;
+    struct drained d;
+    int i;
+
+    memset(&d, 0, sizeof(d));
+    SSH_LOG_EVENT(session, SSH_LOG_PACKET, SSH_LOG_EVENT_PACKET_READ,
+        94U, 32U, 4U);
+    for (i = 0; i < 5; i++) {
+        ssh_log(session, SSH_LOG_PACKET, "packet %d", i);
+    }
+
+    /* the last free entry counts the dropped ones */
+    assert_true(ssh_log_drain(session, drain, &d) == 4);
+    assert_true(d.events[0] == SSH_LOG_EVENT_PACKET_READ);
+    assert_string_equal(d.text[0], "packet_read type=94 length=32 padding=4");
+    assert_string_equal(d.text[2], "packet 1");
+    assert_true(d.events[3] == SSH_LOG_EVENT_DROPPED);
+    assert_string_equal(d.text[3], "dropped count=3");
+}
+
+static void check_fields(ssh_session session, ssh_log_entry entry,
+    void *userdata) {
+    char buffer[8];
+
+    (void) session;
+    assert_string_equal(ssh_log_entry_name(entry), "packet_encrypt");
+    assert_true(ssh_log_entry_field_count(entry) == 2);
+    assert_string_equal(ssh_log_entry_field_key(entry, 1), "length");
+    assert_true(ssh_log_entry_field_value(entry, 1) == 64);
+    assert_true(ssh_log_entry_field_key(entry, 2) == NULL);
+
+    /* truncated */
+    assert_true(ssh_log_entry_format(entry, buffer, sizeof(buffer)) == 7);
+    assert_string_equal(buffer, "packet_");
+    (*(int *) userdata)++;
+}
+
+static void torture_log_fields(void **state) {
+    ssh_session session = *state;
+    int count = 0;
+
+    SSH_LOG_EVENT(session, SSH_LOG_PACKET, SSH_LOG_EVENT_PACKET_ENCRYPT,
+        5U, 64U);
+    assert_true(ssh_log_drain(session, check_fields, &count) == 1);
+    assert_true(count == 1);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_log_messages, setup, teardown),
+        unit_test_setup_teardown(torture_log_events, setup, teardown),
+        unit_test_setup_teardown(torture_log_fields, setup, teardown),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,223 @@
+#define LIBSSH_STATIC
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "torture.h"
+#include "loopback.h"
+#include "libssh/callbacks.h"
+
+#define LOOPBACK_FILESIZE 300000
+
+static void setup(void **state) {
+    struct loopback_server *server;
+
+    server = loopback_server_new(LOOPBACK_FILESIZE, torture_libssh_verbosity());
+    assert_true(server != NULL);
+    *state = server;
+}
+
+static void teardown(void **state) {
+    loopback_server_free(*state);
+}
+
+static ssh_session loopback_session(struct loopback_server *server) {
+    ssh_session session;
+    int verbosity = torture_libssh_verbosity();
+
+    session = ssh_new();
+    assert_true(session != NULL);
+    ssh_options_set(session, SSH_OPTIONS_LOG_VERBOSITY, &verbosity);
+    assert_int_equal(ssh_options_set(session, SSH_OPTIONS_USER, "torture"), 0);
+    assert_int_equal(loopback_connect(server, session), SSH_OK);
+    assert_int_equal(ssh_userauth_none(session, NULL), SSH_AUTH_SUCCESS);
+
+    return session;
+}
+
+static ssh_channel loopback_exec(ssh_session session, const char *command) {
+    ssh_channel channel;
+
+    channel = ssh_channel_new(session);
+    assert_true(channel != NULL);
+    assert_int_equal(ssh_channel_open_session(channel), SSH_OK);
+    if (ssh_channel_request_exec(channel, command) != SSH_OK) {
+        ssh_channel_free(channel);
+        return NULL;
+    }
+
+    return channel;
+}
+
+/* reads a channel until its eof, returns the number of bytes */
+static unsigned long loopback_drain(ssh_channel channel, char *data,
+                                    size_t size) {
+    char buffer[16384];
+    unsigned long total = 0;
+    int n;
+
+    while ((n = ssh_channel_read(channel, buffer, sizeof(buffer), 0)) > 0) {
+        if (data != NULL && total + n <= size) {
+            memcpy(data + total, buffer, n);
+        }
+        total += n;
+    }
+    assert_true(n == 0);
+
+    return total;
+}
+
+static void torture_loopback_exec(void **state) {
+    struct loopback_server *server = *state;
+    ssh_session session;
+    ssh_channel channel;
+    char buffer[65536];
+    char reply[8];
+    int i;
+
+    session = loopback_session(server);
+
+    /* the zeros of a source, over several windows */
+    channel = loopback_exec(session, "source 3000000");
+    assert_true(channel != NULL);
+    assert_int_equal(loopback_drain(channel, NULL, 0), 3000000);
+    assert_int_equal(ssh_channel_get_exit_status(channel), 0);
+    ssh_channel_free(channel);
+
+    /* on the same connection, the eater takes what it is given */
+    channel = loopback_exec(session, "eater");
+    assert_true(channel != NULL);
+    assert_int_equal(ssh_channel_read(channel, reply, 3, 0), 3);
+    assert_memory_equal(reply, "go\n", 3);
+    memset(buffer, 'x', sizeof(buffer));
+    for (i = 0; i < 32; i++) {
+        assert_int_equal(ssh_channel_write(channel, buffer, sizeof(buffer)),
+            sizeof(buffer));
+    }
+    assert_int_equal(ssh_channel_send_eof(channel), SSH_OK);
+    memset(reply, 0, sizeof(reply));
+    assert_int_equal(loopback_drain(channel, reply, sizeof(reply)), 5);
+    assert_memory_equal(reply, "done\n", 5);
+    ssh_channel_free(channel);
+
+    /* there is no shell behind */
+    assert_true(loopback_exec(session, "ls") == NULL);
+    assert_true(loopback_exec(session, "source 12 ") == NULL);
+
+    ssh_disconnect(session);
+    ssh_free(session);
+}
+
+static void *loopback_client(void *arg) {
+    struct loopback_server *server = arg;
+    ssh_session session;
+    ssh_channel channel;
+    unsigned long *total;
+
+    total = malloc(sizeof(unsigned long));
+    assert_true(total != NULL);
+    session = loopback_session(server);
+    channel = loopback_exec(session, "source 500000");
+    assert_true(channel != NULL);
+    *total = loopback_drain(channel, NULL, 0);
+    ssh_channel_free(channel);
+    ssh_disconnect(session);
+    ssh_free(session);
+
+    return total;
+}
+
+/* connections at the same time, each served by a thread */
+static void torture_loopback_connections(void **state) {
+    struct loopback_server *server = *state;
+    pthread_t clients[4];
+    void *total;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        assert_int_equal(pthread_create(&clients[i], NULL, loopback_client,
+            server), 0);
+    }
+    for (i = 0; i < 4; i++) {
+        assert_int_equal(pthread_join(clients[i], &total), 0);
+        assert_int_equal(*(unsigned long *) total, 500000);
+        free(total);
+    }
+
+    /* and one after the other, the threads being reaped */
+    for (i = 0; i < 20; i++) {
+        ssh_session session = loopback_session(server);
+
+        ssh_disconnect(session);
+        ssh_free(session);
+    }
+}
+
+#ifdef WITH_SFTP
+static void torture_loopback_sftp(void **state) {
+    struct loopback_server *server = *state;
+    ssh_session session;
+    sftp_session sftp;
+    sftp_attributes attr;
+    sftp_file file;
+    char buffer[32768];
+    unsigned long total = 0;
+    ssize_t n;
+
+    session = loopback_session(server);
+    sftp = sftp_new(session);
+    assert_true(sftp != NULL);
+    assert_int_equal(sftp_init(sftp), SSH_OK);
+
+    /* every file is the same zeros */
+    file = sftp_open(sftp, "/any/file", O_RDONLY, 0);
+    assert_true(file != NULL);
+    while ((n = sftp_read(file, buffer, sizeof(buffer))) > 0) {
+        assert_true(buffer[0] == 0 && buffer[n - 1] == 0);
+        total += n;
+    }
+    assert_true(n == 0);
+    assert_int_equal(total, LOOPBACK_FILESIZE);
+    attr = sftp_fstat(file);
+    assert_true(attr != NULL);
+    assert_true(attr->size == LOOPBACK_FILESIZE);
+    sftp_attributes_free(attr);
+    assert_int_equal(sftp_close(file), SSH_OK);
+
+    /* the writes are taken, and dropped */
+    file = sftp_open(sftp, "/any/file", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert_true(file != NULL);
+    memset(buffer, 'x', sizeof(buffer));
+    assert_int_equal(sftp_write(file, buffer, sizeof(buffer)),
+        sizeof(buffer));
+    assert_int_equal(sftp_close(file), SSH_OK);
+    attr = sftp_stat(sftp, "/any/file");
+    assert_true(attr != NULL);
+    assert_true(attr->size == LOOPBACK_FILESIZE);
+    sftp_attributes_free(attr);
+
+    sftp_free(sftp);
+    ssh_disconnect(session);
+    ssh_free(session);
+}
+#endif /* WITH_SFTP */
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_loopback_exec, setup, teardown),
+        unit_test_setup_teardown(torture_loopback_connections, setup,
+            teardown),
+#ifdef WITH_SFTP
+        unit_test_setup_teardown(torture_loopback_sftp, setup, teardown),
+#endif
+    };
+
+    ssh_threads_set_callbacks(ssh_threads_get_pthread());
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,57 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+
+static void torture_match_hostname(void **state) {
+    (void) state;
+
+    assert_true(match_hostname("example.com", "example.com", 11) == 1);
+    assert_true(match_hostname("example.com", "EXAMPLE.com", 11) == 1);
+    assert_true(match_hostname("example.com", "*.com", 5) == 1);
+    assert_true(match_hostname("example.com", "*.org", 5) == 0);
+    assert_true(match_hostname("example.com", "ex?mple.*", 9) == 1);
+    assert_true(match_hostname("example.com", "e*a*e.c*m", 9) == 1);
+    assert_true(match_hostname("example.com", "e*x*x*.com", 10) == 0);
+    assert_true(match_hostname("example.com", "foo,*.com", 9) == 1);
+    assert_true(match_hostname("example.com", "*.com,!example.*", 16) == -1);
+    assert_true(match_hostname("", "*", 1) == 1);
+    assert_true(match_hostname("", "", 0) == 0);
+
+    /* several '*' don't match the end of the string, as in OpenSSH */
+    assert_true(match_hostname("a", "a**", 3) == 0);
+    assert_true(match_hostname("ab", "a**", 3) == 1);
+    assert_true(match_hostname("ab", "a**b", 4) == 1);
+}
+
+static void torture_match_list(void **state) {
+    struct match_list *list;
+    char pattern[1100];
+    (void) state;
+
+    list = match_list_compile("*.example.com,!bad.*,h?st", 25);
+    assert_true(list != NULL);
+    assert_true(match_list_exec(list, "www.example.com") == 1);
+    assert_true(match_list_exec(list, "bad.example.com") == -1);
+    assert_true(match_list_exec(list, "host") == 1);
+    assert_true(match_list_exec(list, "hoost") == 0);
+    assert_true(match_list_exec(list, "example.com") == 0);
+    match_list_free(list);
+
+    /* a subpattern too long makes the list fail */
+    memset(pattern, 'a', sizeof(pattern));
+    memcpy(pattern, "host,", 5);
+    list = match_list_compile(pattern, sizeof(pattern));
+    assert_true(list != NULL);
+    assert_true(match_list_exec(list, "host") == 0);
+    match_list_free(list);
+}
+
+int torture_run_tests(void) {
+    const UnitTest tests[] = {
+        unit_test(torture_match_hostname),
+        unit_test(torture_match_list),
+    };
+
+    return run_tests(tests);
+}
@@ -0,0 +1,428 @@
+#define LIBSSH_STATIC
+
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+#include "libssh/buffer.h"
+#include "libssh/ssh2.h"
+#include "libssh/messages.h"
+#include "libssh/server.h"
+#include "libssh/callbacks.h"
+
+struct server_peer {
+  struct torture_peer base; /* a server session */
+  /* what the callbacks saw */
+  ssh_channel channel;
+  int refuse;
+  int calls;
+  char user[32];
+  char password[32];
+  char name[32];
+  int width;
+  int height;
+};
+
+static void server_peer_new(struct server_peer *peer) {
+  memset(peer, 0, sizeof(*peer));
+  torture_peer_new(&peer->base, TORTURE_PEER_SERVER);
+}
+
+/* reads the next packet sent to the client, of the given type */
+static void server_peer_read(struct server_peer *peer, uint8_t type) {
+  unsigned char packet[1024];
+
+  torture_peer_read(&peer->base, packet, sizeof(packet));
+  /* padding length, message type */
+  assert_int_equal(packet[1], type);
+}
+
+/* a packet of the client made of strings, the integers given as "#n" */
+static ssh_buffer server_peer_packet(const char *fields[]) {
+  ssh_buffer packet;
+  ssh_string s;
+  int i;
+
+  packet = ssh_buffer_new();
+  assert_true(packet != NULL);
+  for (i = 0; fields[i] != NULL; i++) {
+    if (fields[i][0] == '#') {
+      assert_int_equal(buffer_add_u32(packet, htonl(atoi(fields[i] + 1))), 0);
+    } else if (fields[i][0] == '?') {
+      assert_int_equal(buffer_add_u8(packet, atoi(fields[i] + 1)), 0);
+    } else {
+      s = ssh_string_from_char(fields[i]);
+      assert_true(s != NULL);
+      assert_int_equal(buffer_add_ssh_string(packet, s), 0);
+      ssh_string_free(s);
+    }
+  }
+
+  return packet;
+}
+
+static int auth_password(ssh_session session, const char *user,
+    const char *password, void *userdata) {
+  struct server_peer *peer = userdata;
+
+  (void) session;
+  peer->calls++;
+  strncpy(peer->user, user, sizeof(peer->user) - 1);
+  strncpy(peer->password, password, sizeof(peer->password) - 1);
+  return strcmp(password, "secret") == 0 ? SSH_AUTH_SUCCESS : SSH_AUTH_DENIED;
+}
+
+static void torture_messages_auth(void **state) {
+  struct server_peer peer;
+  struct ssh_server_callbacks_struct cb;
+  const char *wrong[] = { "alice", "ssh-connection", "password", "?0",
+    "guess", NULL };
+  const char *right[] = { "alice", "ssh-connection", "password", "?0",
+    "secret", NULL };
+  const char *none[] = { "alice", "ssh-connection", "none", NULL };
+  ssh_buffer packet;
+  ssh_message msg;
+
+  (void) state;
+
+  server_peer_new(&peer);
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &peer;
+  cb.auth_password_function = auth_password;
+  ssh_callbacks_init(&cb);
+  assert_int_equal(ssh_set_server_callbacks(peer.base.session, &cb), SSH_OK);
+
+  /* the password goes to the callback, the answer to the client */
+  packet = server_peer_packet(wrong);
+  ssh_packet_userauth_request(peer.base.session, SSH2_MSG_USERAUTH_REQUEST,
+      packet, NULL);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_USERAUTH_FAILURE);
+  assert_int_equal(peer.calls, 1);
+  assert_string_equal(peer.user, "alice");
+  assert_string_equal(peer.password, "guess");
+
+  packet = server_peer_packet(right);
+  ssh_packet_userauth_request(peer.base.session, SSH2_MSG_USERAUTH_REQUEST,
+      packet, NULL);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_USERAUTH_SUCCESS);
+  assert_int_equal(peer.calls, 2);
+  assert_int_equal(peer.base.session->session_state,
+      SSH_SESSION_STATE_AUTHENTICATED);
+  assert_true(ssh_message_pop_head(peer.base.session) == NULL);
+
+  /* without a callback for the method, it is a message */
+  packet = server_peer_packet(none);
+  ssh_packet_userauth_request(peer.base.session, SSH2_MSG_USERAUTH_REQUEST,
+      packet, NULL);
+  ssh_buffer_free(packet);
+  msg = ssh_message_pop_head(peer.base.session);
+  assert_true(msg != NULL);
+  assert_int_equal(ssh_message_type(msg), SSH_REQUEST_AUTH);
+  assert_int_equal(ssh_message_subtype(msg), SSH_AUTH_METHOD_NONE);
+  assert_string_equal(ssh_message_auth_user(msg), "alice");
+  ssh_message_free(msg);
+
+  torture_peer_free(&peer.base);
+}
+
+static int auth_password_later(ssh_session session, const char *user,
+    const char *password, void *userdata) {
+  struct server_peer *peer = userdata;
+
+  (void) session;
+  (void) user;
+  peer->calls++;
+  strncpy(peer->password, password, sizeof(peer->password) - 1);
+  return SSH_AUTH_AGAIN;
+}
+
+static void torture_messages_auth_pending(void **state) {
+  struct server_peer peer;
+  struct ssh_server_callbacks_struct cb;
+  const char *wrong[] = { "alice", "ssh-connection", "password", "?0",
+    "guess", NULL };
+  const char *right[] = { "alice", "ssh-connection", "password", "?0",
+    "secret", NULL };
+  ssh_buffer packet;
+  ssh_event event;
+
+  (void) state;
+
+  server_peer_new(&peer);
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &peer;
+  cb.auth_password_function = auth_password_later;
+  ssh_callbacks_init(&cb);
+  assert_int_equal(ssh_set_server_callbacks(peer.base.session, &cb), SSH_OK);
+  assert_int_equal(ssh_auth_reply_pending(peer.base.session, SSH_AUTH_DENIED),
+      SSH_ERROR);
+
+  /* the client isn't answered, its next request waits */
+  packet = server_peer_packet(wrong);
+  ssh_packet_userauth_request(peer.base.session, SSH2_MSG_USERAUTH_REQUEST,
+      packet, NULL);
+  ssh_buffer_free(packet);
+  packet = server_peer_packet(right);
+  ssh_packet_userauth_request(peer.base.session, SSH2_MSG_USERAUTH_REQUEST,
+      packet, NULL);
+  ssh_buffer_free(packet);
+  assert_int_equal(ssh_handle_packets(peer.base.session, 10), SSH_OK);
+  assert_false(torture_peer_pending(&peer.base));
+  assert_int_equal(peer.calls, 1);
+  assert_string_equal(peer.password, "guess");
+
+  /* once answered, the next request goes to the callback */
+  assert_int_equal(ssh_auth_reply_pending(peer.base.session, SSH_AUTH_DENIED),
+      SSH_OK);
+  server_peer_read(&peer, SSH2_MSG_USERAUTH_FAILURE);
+  assert_int_equal(peer.calls, 2);
+  assert_string_equal(peer.password, "secret");
+
+  /* answered through the event, as another thread would */
+  event = ssh_event_new();
+  assert_true(event != NULL);
+  assert_int_equal(ssh_event_add_session(event, peer.base.session), SSH_OK);
+  assert_int_equal(ssh_event_auth_reply_pending(event, peer.base.session,
+        SSH_AUTH_SUCCESS), SSH_OK);
+  assert_int_equal(ssh_event_dopoll(event, 1000), SSH_OK);
+  assert_int_equal(ssh_event_remove_session(event, peer.base.session), SSH_OK);
+  ssh_event_free(event);
+  server_peer_read(&peer, SSH2_MSG_USERAUTH_SUCCESS);
+  assert_int_equal(peer.base.session->session_state,
+      SSH_SESSION_STATE_AUTHENTICATED);
+  assert_true(peer.base.session->auth_pending == NULL);
+
+  torture_peer_free(&peer.base);
+}
+
+static int channel_pty(ssh_session session, ssh_channel channel,
+    const char *term, int width, int height, int pxwidth, int pxheight,
+    void *userdata) {
+  struct server_peer *peer = userdata;
+
+  (void) session;
+  (void) channel;
+  (void) pxwidth;
+  (void) pxheight;
+  peer->calls++;
+  strncpy(peer->name, term != NULL ? term : "", sizeof(peer->name) - 1);
+  peer->width = width;
+  peer->height = height;
+  return 0;
+}
+
+static int channel_exec(ssh_session session, ssh_channel channel,
+    const char *command, const char *value, void *userdata) {
+  struct server_peer *peer = userdata;
+
+  (void) session;
+  (void) channel;
+  assert_true(value == NULL);
+  peer->calls++;
+  strncpy(peer->name, command, sizeof(peer->name) - 1);
+  return -1;
+}
+
+static struct ssh_channel_callbacks_struct channel_cb = {
+  .channel_pty_request_function = channel_pty,
+  .channel_exec_request_function = channel_exec,
+};
+
+static int channel_open(ssh_session session, ssh_channel channel,
+    void *userdata) {
+  struct server_peer *peer = userdata;
+
+  (void) session;
+  peer->calls++;
+  if (peer->refuse) {
+    return -1;
+  }
+  peer->channel = channel;
+  channel_cb.userdata = peer;
+  ssh_callbacks_init(&channel_cb);
+  assert_int_equal(ssh_set_channel_callbacks(channel, &channel_cb), SSH_OK);
+  return 0;
+}
+
+static void torture_messages_channel(void **state) {
+  struct server_peer peer;
+  struct ssh_server_callbacks_struct cb;
+  const char *open[] = { "session", "#5", "#64000", "#32000", NULL };
+  const char *pty[] = { "xterm", "#80", "#24", "#0", "#0", "", NULL };
+  const char *resize[] = { "#132", "#50", "#0", "#0", NULL };
+  const char *exec[] = { "ls", NULL };
+  ssh_buffer packet;
+  ssh_message msg;
+
+  (void) state;
+
+  server_peer_new(&peer);
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &peer;
+  cb.channel_open_request_session_function = channel_open;
+  ssh_callbacks_init(&cb);
+  assert_int_equal(ssh_set_server_callbacks(peer.base.session, &cb), SSH_OK);
+
+  /* a refused channel is gone */
+  peer.refuse = 1;
+  packet = server_peer_packet(open);
+  ssh_packet_channel_open(peer.base.session, SSH2_MSG_CHANNEL_OPEN, packet,
+      NULL);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_CHANNEL_OPEN_FAILURE);
+  assert_int_equal(peer.calls, 1);
+  assert_true(peer.base.session->channels == NULL);
+
+  peer.refuse = 0;
+  packet = server_peer_packet(open);
+  ssh_packet_channel_open(peer.base.session, SSH2_MSG_CHANNEL_OPEN, packet,
+      NULL);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_CHANNEL_OPEN_CONFIRMATION);
+  assert_true(peer.channel != NULL);
+  assert_int_equal(peer.channel->remote_channel, 5);
+  assert_int_equal(peer.channel->state, SSH_CHANNEL_STATE_OPEN);
+  assert_true(ssh_message_pop_head(peer.base.session) == NULL);
+
+  /* the requests with a callback are answered at once */
+  packet = server_peer_packet(pty);
+  ssh_message_handle_channel_request(peer.base.session, peer.channel, packet,
+      "pty-req", 1);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_CHANNEL_SUCCESS);
+  assert_string_equal(peer.name, "xterm");
+  assert_int_equal(peer.width, 80);
+  assert_int_equal(peer.height, 24);
+
+  packet = server_peer_packet(resize);
+  ssh_message_handle_channel_request(peer.base.session, peer.channel, packet,
+      "window-change", 0);
+  ssh_buffer_free(packet);
+  assert_string_equal(peer.name, "");
+  assert_int_equal(peer.width, 132);
+  assert_int_equal(peer.height, 50);
+
+  packet = server_peer_packet(exec);
+  ssh_message_handle_channel_request(peer.base.session, peer.channel, packet,
+      "exec", 1);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_CHANNEL_FAILURE);
+  assert_string_equal(peer.name, "ls");
+  assert_int_equal(peer.calls, 5);
+
+  /* the others are still messages */
+  packet = server_peer_packet(exec + 1);
+  ssh_message_handle_channel_request(peer.base.session, peer.channel, packet,
+      "shell", 1);
+  ssh_buffer_free(packet);
+  msg = ssh_message_pop_head(peer.base.session);
+  assert_true(msg != NULL);
+  assert_int_equal(ssh_message_subtype(msg), SSH_CHANNEL_REQUEST_SHELL);
+  assert_true(ssh_message_channel_request_channel(msg) == peer.channel);
+  ssh_message_free(msg);
+
+  peer.channel->state = SSH_CHANNEL_STATE_CLOSED;
+  ssh_channel_free(peer.channel);
+  torture_peer_free(&peer.base);
+}
+
+static void torture_messages_policy(void **state) {
+  struct server_peer peer;
+  const char *x11[] = { "x11", "#3", "#64000", "#32000", "127.0.0.1", "#6010",
+    NULL };
+  const char *env[] = { "LANG", "C", NULL };
+  const char *keepalive[] = { "keepalive@openssh.com", "?1", NULL };
+  const char *unknown[] = { "unknown@example.com", "?1", NULL };
+  ssh_channel channel;
+  ssh_buffer packet;
+
+  (void) state;
+
+  server_peer_new(&peer);
+  channel = ssh_channel_new(peer.base.session);
+  assert_true(channel != NULL);
+  assert_true(ssh_channel_new_id(peer.base.session, channel) != 0);
+  channel->state = SSH_CHANNEL_STATE_OPEN;
+
+  /* nobody would handle these */
+  assert_int_equal(ssh_message_set_policy(peer.base.session,
+        SSH_REQUEST_CHANNEL_OPEN, SSH_CHANNEL_SESSION,
+        SSH_MESSAGE_POLICY_ACCEPT), SSH_ERROR);
+  assert_int_equal(ssh_message_set_policy(peer.base.session, SSH_REQUEST_GLOBAL,
+        SSH_GLOBAL_REQUEST_TCPIP_FORWARD, SSH_MESSAGE_POLICY_ACCEPT),
+      SSH_ERROR);
+  assert_int_equal(ssh_message_set_policy(peer.base.session, SSH_REQUEST_AUTH,
+      0,
+        SSH_MESSAGE_POLICY_REJECT), SSH_ERROR);
+
+  assert_int_equal(ssh_message_set_policy(peer.base.session,
+        SSH_REQUEST_CHANNEL_OPEN, SSH_CHANNEL_X11, SSH_MESSAGE_POLICY_REJECT),
+      SSH_OK);
+  assert_int_equal(ssh_message_set_policy(peer.base.session,
+      SSH_REQUEST_CHANNEL,
+        SSH_CHANNEL_REQUEST_ENV, SSH_MESSAGE_POLICY_REJECT), SSH_OK);
+  assert_int_equal(ssh_message_set_policy(peer.base.session,
+      SSH_REQUEST_CHANNEL,
+        SSH_CHANNEL_REQUEST_X11, SSH_MESSAGE_POLICY_ACCEPT), SSH_OK);
+  assert_int_equal(ssh_message_set_policy(peer.base.session, SSH_REQUEST_GLOBAL,
+        SSH_GLOBAL_REQUEST_KEEPALIVE, SSH_MESSAGE_POLICY_ACCEPT), SSH_OK);
+
+  /* the requests with a policy are answered without a message */
+  packet = server_peer_packet(x11);
+  ssh_packet_channel_open(peer.base.session, SSH2_MSG_CHANNEL_OPEN, packet,
+      NULL);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_CHANNEL_OPEN_FAILURE);
+
+  packet = server_peer_packet(env);
+  ssh_message_handle_channel_request(peer.base.session, channel, packet, "env",
+      1);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_CHANNEL_FAILURE);
+
+  packet = server_peer_packet(env + 2);
+  ssh_message_handle_channel_request(peer.base.session, channel, packet,
+      "x11-req", 1);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_CHANNEL_SUCCESS);
+
+  packet = server_peer_packet(keepalive);
+  ssh_packet_global_request(peer.base.session, SSH2_MSG_GLOBAL_REQUEST, packet,
+      NULL);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_REQUEST_SUCCESS);
+  assert_true(ssh_message_pop_head(peer.base.session) == NULL);
+
+  /* the unknown global requests are refused by default */
+  packet = server_peer_packet(unknown);
+  ssh_packet_global_request(peer.base.session, SSH2_MSG_GLOBAL_REQUEST, packet,
+      NULL);
+  ssh_buffer_free(packet);
+  server_peer_read(&peer, SSH2_MSG_REQUEST_FAILURE);
+
+  channel->state = SSH_CHANNEL_STATE_CLOSED;
+  ssh_channel_free(channel);
+  torture_peer_free(&peer.base);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_messages_auth),
+        unit_test(torture_messages_auth_pending),
+        unit_test(torture_messages_channel),
+        unit_test(torture_messages_policy),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -161,6 +161,20 @@ static void torture_path_expand_known_hosts(void **state) {
     free(tmp);
 }
 
+static void torture_path_name_valid(void **state) {
+    (void) state;
+
+    assert_true(ssh_path_name_valid("file.txt"));
+    assert_true(ssh_path_name_valid("..hidden"));
+    assert_false(ssh_path_name_valid(NULL));
+    assert_false(ssh_path_name_valid(""));
+    assert_false(ssh_path_name_valid("."));
+    assert_false(ssh_path_name_valid(".."));
+    assert_false(ssh_path_name_valid("../../.ssh/authorized_keys"));
+    assert_false(ssh_path_name_valid("/etc/passwd"));
+    assert_false(ssh_path_name_valid("dir/"));
+}
+
 int torture_run_tests(void) {
     int rc;
     const UnitTest tests[] = {
@@ -175,6 +189,7 @@ int torture_run_tests(void) {
 #endif
         unit_test_setup_teardown(torture_path_expand_escape, setup, teardown),
         unit_test_setup_teardown(torture_path_expand_known_hosts, setup, teardown),
+        unit_test(torture_path_name_valid),
     };
 
     ssh_init();
@@ -0,0 +1,132 @@
+#define LIBSSH_STATIC
+
+#include <string.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+
+/* the sessions given to the mux, the test playing their servers */
+struct mux_peers {
+  struct torture_peer peer[8];
+  int count;
+  int connects;
+};
+
+/* a session looking connected and authenticated to host as user */
+static ssh_session mux_session(struct mux_peers *peers, const char *host,
+    const char *user) {
+  struct torture_peer *peer;
+
+  assert_true(peers->count < (int) (sizeof(peers->peer) /
+        sizeof(peers->peer[0])));
+  peer = &peers->peer[peers->count++];
+  torture_peer_new(peer, 0);
+  assert_int_equal(ssh_options_set(peer->session, SSH_OPTIONS_HOST, host), 0);
+  assert_int_equal(ssh_options_set(peer->session, SSH_OPTIONS_USER, user), 0);
+  peer->session->session_state = SSH_SESSION_STATE_AUTHENTICATED;
+
+  return peer->session;
+}
+
+static ssh_session mux_connect(const char *host, const char *user,
+    unsigned int port, void *userdata) {
+  struct mux_peers *peers = userdata;
+
+  (void) port;
+
+  peers->connects++;
+  return mux_session(peers, host, user != NULL ? user : "nobody");
+}
+
+static void torture_mux_sessions(void **state) {
+  ssh_mux mux;
+  ssh_session a;
+  ssh_session b;
+  ssh_session c;
+  ssh_channel channel;
+  struct mux_peers peers;
+  int i;
+
+  (void) state;
+
+  memset(&peers, 0, sizeof(peers));
+  mux = ssh_mux_new();
+  assert_true(mux != NULL);
+  ssh_mux_set_limits(mux, 1, 0);
+
+  /* only the authenticated sessions are shared */
+  a = mux_session(&peers, "alpha", "alice");
+  a->session_state = SSH_SESSION_STATE_AUTHENTICATING;
+  assert_int_equal(ssh_mux_add_session(mux, a), SSH_ERROR);
+  a->session_state = SSH_SESSION_STATE_AUTHENTICATED;
+  assert_int_equal(ssh_mux_add_session(mux, a), SSH_OK);
+  assert_int_equal(ssh_mux_add_session(mux, a), SSH_ERROR);
+  b = mux_session(&peers, "beta", "bob");
+  assert_int_equal(ssh_mux_add_session(mux, b), SSH_OK);
+
+  /* the sessions are matched by host, user and port */
+  assert_true(ssh_mux_get_session(mux, "alpha", "alice", 0) == a);
+  assert_true(ssh_mux_get_session(mux, "alpha", NULL, 22) == a);
+  assert_true(ssh_mux_get_session(mux, "alpha", "bob", 0) == NULL);
+  assert_true(ssh_mux_get_session(mux, "alpha", "alice", 2222) == NULL);
+  assert_true(ssh_mux_get_session(mux, "beta", "bob", 0) == b);
+
+  /* a full session makes the mux connect another one */
+  channel = ssh_channel_new(a);
+  assert_true(channel != NULL);
+  channel->state = SSH_CHANNEL_STATE_OPEN;
+  assert_true(ssh_mux_get_session(mux, "alpha", "alice", 0) == NULL);
+  ssh_mux_set_connect_callback(mux, mux_connect, &peers);
+  c = ssh_mux_get_session(mux, "alpha", "alice", 0);
+  assert_true(c != NULL && c != a);
+  assert_int_equal(peers.connects, 1);
+  assert_true(ssh_mux_get_session(mux, "alpha", "alice", 0) == c);
+  assert_int_equal(peers.connects, 1);
+
+  /* a closed channel doesn't count */
+  channel->state = SSH_CHANNEL_STATE_CLOSED;
+  assert_true(ssh_mux_get_session(mux, "alpha", "alice", 0) == a);
+  ssh_channel_free(channel);
+
+  /* the disconnected sessions are freed */
+  b->alive = 0;
+  assert_int_equal(ssh_mux_expire(mux), 1);
+  assert_true(ssh_mux_get_session(mux, "beta", "bob", 0) != NULL);
+  assert_int_equal(peers.connects, 2);
+
+  /* and the idle ones after the timeout */
+  ssh_mux_set_limits(mux, 1, 10);
+  assert_int_equal(ssh_mux_expire(mux), 0);
+  usleep(30 * 1000);
+  assert_int_equal(ssh_mux_expire(mux), 3);
+  /* all of them are gone, the peers only keep their end */
+  for (i = 0; i < peers.count; i++) {
+    peers.peer[i].session = NULL;
+  }
+
+  /* a session taken back isn't freed with the mux */
+  a = mux_session(&peers, "alpha", "alice");
+  assert_int_equal(ssh_mux_add_session(mux, a), SSH_OK);
+  assert_int_equal(ssh_mux_remove_session(mux, a), SSH_OK);
+  assert_int_equal(ssh_mux_remove_session(mux, a), SSH_ERROR);
+  ssh_mux_free(mux);
+
+  for (i = 0; i < peers.count; i++) {
+    torture_peer_free(&peers.peer[i]);
+  }
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_mux_sessions),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -8,6 +8,8 @@
 #include "torture.h"
 #include <libssh/session.h>
 #include <libssh/misc.h>
+#include <libssh/socket.h>
+#include <libssh/channels.h>
 
 static void setup(void **state) {
     ssh_session session = ssh_new();
@@ -119,6 +121,226 @@ static void torture_options_set_identity(void **state) {
     assert_string_equal(session->identity->root->next->data, "identity1");
 }
 
+static void torture_options_set_read_size_max(void **state) {
+    ssh_session session = *state;
+    unsigned int size = 65536;
+    int rc;
+
+    assert_true(session->read_size_max == SSH_SOCKET_READ_MAX);
+
+    rc = ssh_options_set(session, SSH_OPTIONS_READ_SIZE_MAX, &size);
+    assert_true(rc == 0);
+    assert_true(session->read_size_max == 65536);
+
+    size = 0;
+    rc = ssh_options_set(session, SSH_OPTIONS_READ_SIZE_MAX, &size);
+    assert_true(rc < 0);
+    assert_true(session->read_size_max == 65536);
+}
+
+static void torture_options_set_buffer_limits(void **state) {
+    ssh_session session = *state;
+    ssh_channel channel;
+    unsigned int size = 100;
+    char data[50] = {0};
+    int rc;
+
+    rc = ssh_options_set(session, SSH_OPTIONS_CHANNEL_BUFFER_HARD_LIMIT, &size);
+    assert_true(rc == 0);
+    assert_true(session->channel_buffer_hard_limit == 100);
+    size = 150;
+    rc = ssh_options_set(session, SSH_OPTIONS_SESSION_BUFFER_HARD_LIMIT, &size);
+    assert_true(rc == 0);
+    assert_true(session->session_buffer_hard_limit == 150);
+
+    /* the data beyond the hard limits is refused */
+    channel = ssh_channel_new(session);
+    assert_true(channel != NULL);
+    assert_true(channel_default_bufferize(channel, data, 10, 0) == 0);
+    assert_true(channel_default_bufferize(channel, data, 10, 1) == 0);
+    assert_true(ssh_channel_get_buffered(channel) == 20);
+    assert_true(ssh_get_buffered(session) == 20);
+    while (ssh_channel_get_buffered(channel) + 10 <= 100) {
+        assert_true(channel_default_bufferize(channel, data, 10, 0) == 0);
+    }
+    assert_true(channel_default_bufferize(channel, data, 10, 0) < 0);
+    assert_true(ssh_channel_get_buffered(channel) == 100);
+
+    size = 0;
+    ssh_options_set(session, SSH_OPTIONS_CHANNEL_BUFFER_HARD_LIMIT, &size);
+    assert_true(channel_default_bufferize(channel, data, 10, 0) == 0);
+    assert_true(channel_default_bufferize(channel, data, sizeof(data), 0) < 0);
+    ssh_channel_free(channel);
+}
+
+static void torture_options_set_tcp(void **state) {
+    ssh_session session = *state;
+    ssh_session copy;
+    unsigned int window;
+    int value;
+    int rc;
+
+    assert_true(session->channel_window == 128000);
+
+    value = SSH_TCP_PROFILE_BULK;
+    rc = ssh_options_set(session, SSH_OPTIONS_TCP_PROFILE, &value);
+    assert_true(rc == 0);
+    assert_true(session->channel_window == 2 * 1024 * 1024);
+    assert_true(session->tcp.sndbuf == 4 * 1024 * 1024);
+    assert_true(session->tcp.nodelay == 0);
+
+    /* the options adjust the profile */
+    value = 1;
+    rc = ssh_options_set(session, SSH_OPTIONS_TCP_NODELAY, &value);
+    assert_true(rc == 0);
+    assert_true(session->tcp.nodelay == 1);
+    value = 60;
+    rc = ssh_options_set(session, SSH_OPTIONS_TCP_KEEPALIVE, &value);
+    assert_true(rc == 0);
+    assert_true(session->tcp.keepalive == 60);
+    window = 1024 * 1024;
+    rc = ssh_options_set(session, SSH_OPTIONS_CHANNEL_WINDOW, &window);
+    assert_true(rc == 0);
+    assert_true(session->channel_window == 1024 * 1024);
+    assert_true(session->channel_window_max == 0);
+    window = 16 * 1024 * 1024;
+    rc = ssh_options_set(session, SSH_OPTIONS_CHANNEL_WINDOW_MAX, &window);
+    assert_true(rc == 0);
+    assert_true(session->channel_window_max == 16 * 1024 * 1024);
+    assert_true(session->channel_maxpacket == 32000);
+    window = 0;
+    rc = ssh_options_set(session, SSH_OPTIONS_CHANNEL_MAXPACKET, &window);
+    assert_true(rc < 0);
+    window = 512 * 1024;
+    rc = ssh_options_set(session, SSH_OPTIONS_CHANNEL_MAXPACKET, &window);
+    assert_true(rc < 0);
+    window = 128 * 1024;
+    rc = ssh_options_set(session, SSH_OPTIONS_CHANNEL_MAXPACKET, &window);
+    assert_true(rc == 0);
+    assert_true(session->channel_maxpacket == 128 * 1024);
+
+    copy = ssh_new();
+    assert_true(copy != NULL);
+    rc = ssh_options_copy(session, &copy);
+    assert_true(rc == 0);
+    assert_true(copy->tcp.nodelay == 1);
+    assert_true(copy->tcp.rcvbuf == 4 * 1024 * 1024);
+    assert_true(copy->channel_window == 1024 * 1024);
+    assert_true(copy->channel_window_max == 16 * 1024 * 1024);
+    assert_true(copy->channel_maxpacket == 128 * 1024);
+    ssh_free(copy);
+
+    value = SSH_TCP_PROFILE_INTERACTIVE;
+    rc = ssh_options_set(session, SSH_OPTIONS_TCP_PROFILE, &value);
+    assert_true(rc == 0);
+    assert_true(session->tcp.nodelay == 1);
+    assert_true(session->tcp.sndbuf == 0);
+    assert_true(session->tcp.keepalive == 0);
+    assert_true(session->channel_window == 128000);
+
+    value = 42;
+    rc = ssh_options_set(session, SSH_OPTIONS_TCP_PROFILE, &value);
+    assert_true(rc < 0);
+    value = -1;
+    rc = ssh_options_set(session, SSH_OPTIONS_TCP_SNDBUF, &value);
+    assert_true(rc < 0);
+    window = 0;
+    rc = ssh_options_set(session, SSH_OPTIONS_CHANNEL_WINDOW, &window);
+    assert_true(rc < 0);
+    rc = ssh_options_set(session, SSH_OPTIONS_TCP_RCVBUF, NULL);
+    assert_true(rc < 0);
+    assert_true(session->channel_window == 128000);
+}
+
+static void torture_options_set_rekey(void **state) {
+    ssh_session session = *state;
+    uint64_t data = 1 << 20;
+    unsigned int seconds = 3600;
+    int rc;
+
+    assert_true(session->rekey_data == SSH_REKEY_DATA_DEFAULT);
+    assert_true(session->rekey_time == 0);
+
+    rc = ssh_options_set(session, SSH_OPTIONS_REKEY_DATA, &data);
+    assert_true(rc == 0);
+    assert_true(session->rekey_data == 1 << 20);
+    rc = ssh_options_set(session, SSH_OPTIONS_REKEY_TIME, &seconds);
+    assert_true(rc == 0);
+    assert_true(session->rekey_time == 3600);
+
+    /* the timers can't count that many milliseconds */
+    seconds = 5000000;
+    rc = ssh_options_set(session, SSH_OPTIONS_REKEY_TIME, &seconds);
+    assert_true(rc < 0);
+    assert_true(session->rekey_time == 3600);
+
+    /* not before the key exchange */
+    assert_true(ssh_rekey(session) == SSH_ERROR);
+}
+
+static void torture_options_set_algorithms(void **state) {
+    ssh_session session = *state;
+    int rc;
+
+    rc = ssh_options_set(session, SSH_OPTIONS_KEY_EXCHANGE,
+        "curve25519-sha256@libssh.org");
+    assert_true(rc == 0);
+    assert_string_equal(session->wanted_methods[SSH_KEX],
+        "curve25519-sha256@libssh.org");
+    rc = ssh_options_set(session, SSH_OPTIONS_HOSTKEYS, "ssh-ed25519,ssh-rsa");
+    assert_true(rc == 0);
+    assert_string_equal(session->wanted_methods[SSH_HOSTKEYS],
+        "ssh-ed25519,ssh-rsa");
+
+    /* nothing known, nothing changed */
+    rc = ssh_options_set(session, SSH_OPTIONS_KEY_EXCHANGE, "unknown-kex");
+    assert_true(rc < 0);
+    assert_string_equal(session->wanted_methods[SSH_KEX],
+        "curve25519-sha256@libssh.org");
+    rc = ssh_options_set(session, SSH_OPTIONS_HOSTKEYS, NULL);
+    assert_true(rc < 0);
+}
+
+static void torture_options_template(void **state) {
+    ssh_session session = *state;
+    ssh_options_template tmpl;
+    ssh_session copy;
+    unsigned int port = 2222;
+    char *id;
+    int rc;
+
+    rc = ssh_options_set(session, SSH_OPTIONS_HOST, "alice@localhost");
+    assert_true(rc == 0);
+    rc = ssh_options_set(session, SSH_OPTIONS_PORT, &port);
+    assert_true(rc == 0);
+    rc = ssh_options_set(session, SSH_OPTIONS_ADD_IDENTITY, "identity1");
+    assert_true(rc == 0);
+
+    tmpl = ssh_options_template_new(session);
+    assert_true(tmpl != NULL);
+    ssh_options_set(session, SSH_OPTIONS_HOST, "otherhost");
+
+    copy = ssh_new();
+    assert_true(copy != NULL);
+    rc = ssh_options_template_apply(tmpl, copy);
+    assert_true(rc == SSH_OK);
+    assert_string_equal(copy->host, "localhost");
+    assert_string_equal(copy->username, "alice");
+    assert_true(copy->port == 2222);
+    assert_true(copy->sshdir != NULL);
+    id = ssh_list_pop_head(char *, copy->identity);
+    assert_string_equal(id, "identity1");
+    free(id);
+
+    /* the session overrides the template */
+    rc = ssh_options_set(copy, SSH_OPTIONS_HOST, "bob@example.com");
+    assert_true(rc == 0);
+    ssh_options_template_free(tmpl);
+    assert_string_equal(copy->host, "example.com");
+    assert_string_equal(copy->username, "bob");
+    ssh_free(copy);
+}
+
 int torture_run_tests(void) {
     int rc;
     const UnitTest tests[] = {
@@ -127,6 +349,12 @@ int torture_run_tests(void) {
         unit_test_setup_teardown(torture_options_set_fd, setup, teardown),
         unit_test_setup_teardown(torture_options_set_user, setup, teardown),
         unit_test_setup_teardown(torture_options_set_identity, setup, teardown),
+        unit_test_setup_teardown(torture_options_set_read_size_max, setup, teardown),
+        unit_test_setup_teardown(torture_options_set_buffer_limits, setup, teardown),
+        unit_test_setup_teardown(torture_options_set_tcp, setup, teardown),
+        unit_test_setup_teardown(torture_options_set_rekey, setup, teardown),
+        unit_test_setup_teardown(torture_options_set_algorithms, setup, teardown),
+        unit_test_setup_teardown(torture_options_template, setup, teardown),
     };
 
     ssh_init();
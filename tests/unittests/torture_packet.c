@@ -0,0 +1,193 @@
+#define LIBSSH_STATIC
+
+#include <string.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/buffer.h"
+#include "libssh/packet.h"
+#include "libssh/ssh2.h"
+
+/* an unencrypted SSH_MSG_IGNORE packet with an empty string, 16 bytes */
+static const unsigned char ignore_packet[16] = {
+  0, 0, 0, 12, /* length */
+  6,           /* padding */
+  SSH2_MSG_IGNORE, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0
+};
+
+static int ignore_count;
+
+static int ignore_callback(ssh_session session, uint8_t type,
+    ssh_buffer packet, void *user) {
+  (void) session;
+  (void) type;
+  (void) packet;
+  (void) user;
+
+  ignore_count++;
+  return SSH_PACKET_USED;
+}
+
+static ssh_packet_callback ignore_callbacks[] = {
+  ignore_callback
+};
+
+static struct ssh_packet_callbacks_struct ignore_packet_callbacks = {
+  .start = SSH2_MSG_IGNORE,
+  .n_callbacks = 1,
+  .callbacks = ignore_callbacks,
+  .user = NULL
+};
+
+/* a read holding many packets processes them all in one call */
+static void torture_packet_socket_callback(void **state) {
+  unsigned char data[sizeof(ignore_packet) * 100 + 10];
+  ssh_session session;
+  uint32_t max;
+  int i;
+
+  (void) state;
+
+  session = ssh_new();
+  assert_true(session != NULL);
+  ssh_packet_set_callbacks(session, &ignore_packet_callbacks);
+  for (i = 0; i < 100; i++) {
+    memcpy(data + i * sizeof(ignore_packet), ignore_packet,
+        sizeof(ignore_packet));
+  }
+
+  ignore_count = 0;
+  assert_int_equal(ssh_packet_socket_callback(data,
+        sizeof(ignore_packet) * 100, session), sizeof(ignore_packet) * 100);
+  assert_int_equal(ignore_count, 100);
+  assert_int_equal(ssh_get_packets_per_read(session, &max), 100);
+  assert_int_equal(max, 100);
+  assert_int_equal(session->recv_seq, 100);
+  /* the traffic of the keys, see SSH_OPTIONS_REKEY_DATA */
+  assert_int_equal(session->kex_packets, 100);
+  assert_true(session->kex_bytes == 100 * 12);
+
+  /* the beginning of an incomplete packet is kept */
+  memcpy(data + sizeof(ignore_packet) * 3, ignore_packet, 10);
+  ignore_count = 0;
+  assert_int_equal(ssh_packet_socket_callback(data,
+        sizeof(ignore_packet) * 3 + 4, session), sizeof(ignore_packet) * 3);
+  assert_int_equal(ignore_count, 3);
+  assert_int_equal(ssh_packet_socket_callback(data,
+        sizeof(ignore_packet) * 3 + 10, session),
+      sizeof(ignore_packet) * 3 + 8);
+  assert_int_equal(ignore_count, 6);
+  assert_int_equal(ssh_get_packets_per_read(session, &max), 3);
+  assert_int_equal(max, 100);
+
+  /* the rest of the packet completes it */
+  assert_int_equal(ssh_packet_socket_callback(ignore_packet + 8, 8, session),
+      8);
+  assert_int_equal(ignore_count, 7);
+  assert_int_equal(ssh_get_packets_per_read(session, NULL), 1);
+
+  ssh_free(session);
+}
+
+/* during a key re-exchange, the packets wait for the new keys */
+static void torture_packet_rekey_hold(void **state) {
+  unsigned char header[9] = {SSH2_MSG_CHANNEL_DATA, 0, 0, 0, 1, 0, 0, 0, 4};
+  ssh_session session;
+
+  (void) state;
+
+  session = ssh_new();
+  assert_true(session != NULL);
+  session->version = 2;
+  session->rekey_state = SSH_REKEY_STATE_DH;
+
+  assert_int_equal(buffer_add_u8(session->out_buffer, SSH2_MSG_IGNORE), 0);
+  assert_int_equal(buffer_add_u32(session->out_buffer, 0), 0);
+  assert_int_equal(packet_send(session), SSH_OK);
+  assert_int_equal(buffer_get_rest_len(session->out_buffer), 0);
+
+  assert_int_equal(packet_send_payload(session, header, sizeof(header),
+        "data", 4), SSH_OK);
+
+  /* nothing went out, the payloads are kept with their lengths */
+  assert_int_equal(session->send_seq, 0);
+  assert_true(session->rekey_held != NULL);
+  assert_int_equal(buffer_get_rest_len(session->rekey_held),
+      4 + 5 + 4 + sizeof(header) + 4);
+  assert_memory_equal((unsigned char *) buffer_get_rest(session->rekey_held)
+      + 4 + 5 + 4, header, sizeof(header));
+
+  ssh_free(session);
+}
+
+static int declined_count;
+
+static int declined_callback(ssh_session session, uint8_t type,
+    ssh_buffer packet, void *user) {
+  (void) session;
+  (void) type;
+  (void) packet;
+  (void) user;
+
+  declined_count++;
+  return SSH_PACKET_NOT_USED;
+}
+
+static ssh_packet_callback declined_callbacks[] = {
+  declined_callback
+};
+
+static struct ssh_packet_callbacks_struct declined_packet_callbacks = {
+  .start = SSH2_MSG_IGNORE,
+  .n_callbacks = 1,
+  .callbacks = declined_callbacks,
+  .user = NULL
+};
+
+/* the callbacks are called in their order, until one uses the packet */
+static void torture_packet_dispatch(void **state) {
+  ssh_session session;
+
+  (void) state;
+
+  session = ssh_new();
+  assert_true(session != NULL);
+  ssh_packet_set_callbacks(session, &declined_packet_callbacks);
+
+  declined_count = 0;
+  ignore_count = 0;
+  assert_int_equal(ssh_packet_socket_callback(ignore_packet,
+        sizeof(ignore_packet), session), sizeof(ignore_packet));
+  assert_int_equal(declined_count, 1);
+  assert_int_equal(ignore_count, 0);
+
+  /* callbacks set after the first packets are used as well */
+  ssh_packet_set_callbacks(session, &ignore_packet_callbacks);
+  assert_int_equal(ssh_packet_socket_callback(ignore_packet,
+        sizeof(ignore_packet), session), sizeof(ignore_packet));
+  assert_int_equal(declined_count, 2);
+  assert_int_equal(ignore_count, 1);
+
+  /* a type without callbacks isn't one of its neighbours */
+  ssh_packet_process(session, SSH2_MSG_IGNORE + 1);
+  assert_int_equal(declined_count, 2);
+  assert_int_equal(ignore_count, 1);
+
+  ssh_free(session);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_packet_socket_callback),
+        unit_test(torture_packet_rekey_hold),
+        unit_test(torture_packet_dispatch),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,207 @@
+#define LIBSSH_STATIC
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/socket.h"
+#include "libssh/pcap.h"
+
+#define PCAP_FILE "libssh_testpcap"
+
+struct pcap_test {
+  ssh_session session;
+  ssh_pcap_file pcap;
+  int fds[3];
+};
+
+/* a session with a socket connected on the loopback */
+static void setup(void **state) {
+  struct pcap_test *test;
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+
+  test = malloc(sizeof(struct pcap_test));
+  assert_true(test != NULL);
+
+  test->fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+  assert_true(test->fds[0] >= 0);
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert_int_equal(bind(test->fds[0], (struct sockaddr *) &sin, sizeof(sin)),
+      0);
+  assert_int_equal(getsockname(test->fds[0], (struct sockaddr *) &sin, &len),
+      0);
+  assert_int_equal(listen(test->fds[0], 1), 0);
+  test->fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+  assert_true(test->fds[1] >= 0);
+  assert_int_equal(connect(test->fds[1], (struct sockaddr *) &sin,
+      sizeof(sin)), 0);
+  test->fds[2] = accept(test->fds[0], NULL, NULL);
+  assert_true(test->fds[2] >= 0);
+
+  test->session = ssh_new();
+  assert_true(test->session != NULL);
+  ssh_socket_set_fd(test->session->socket, test->fds[1]);
+
+  test->pcap = ssh_pcap_file_new();
+  assert_true(test->pcap != NULL);
+
+  *state = test;
+}
+
+static void teardown(void **state) {
+  struct pcap_test *test = *state;
+  char name[64];
+  int i;
+
+  ssh_free(test->session);
+  ssh_pcap_file_free(test->pcap);
+  close(test->fds[0]);
+  close(test->fds[2]);
+  unlink(PCAP_FILE);
+  for (i = 1; i < 4; i++) {
+    snprintf(name, sizeof(name), "%s.%d", PCAP_FILE, i);
+    unlink(name);
+  }
+  free(test);
+}
+
+static off_t file_size(const char *name) {
+  struct stat st;
+
+  if (stat(name, &st) < 0) {
+    return -1;
+  }
+
+  return st.st_size;
+}
+
+static void write_packet(ssh_session session, uint32_t len) {
+  char data[256];
+
+  memset(data, 'x', sizeof(data));
+  assert_true(len <= sizeof(data));
+  ssh_pcap_context_write(session->pcap_ctx, SSH_PCAP_DIR_OUT, data, len, len);
+}
+
+static void torture_pcap_buffer(void **state) {
+  struct pcap_test *test = *state;
+  unsigned char record[16];
+  FILE *file;
+
+  assert_int_equal(ssh_pcap_file_set_buffer(test->pcap, 4096, 0), SSH_OK);
+  assert_int_equal(ssh_pcap_file_set_snaplen(test->pcap, 20), SSH_ERROR);
+  assert_int_equal(ssh_pcap_file_set_snaplen(test->pcap, 60), SSH_OK);
+  assert_int_equal(ssh_pcap_file_open(test->pcap, PCAP_FILE), SSH_OK);
+  assert_int_equal(ssh_set_pcap_file(test->session, test->pcap), SSH_OK);
+
+  /* kept in the buffer until it is flushed */
+  write_packet(test->session, 100);
+  assert_true(file_size(PCAP_FILE) <= 24);
+  assert_int_equal(ssh_pcap_file_flush(test->pcap), SSH_OK);
+  assert_int_equal(file_size(PCAP_FILE), 24 + 16 + 60);
+
+  /* the packet is truncated, its original size is kept */
+  file = fopen(PCAP_FILE, "rb");
+  assert_true(file != NULL);
+  assert_int_equal(fseek(file, 24, SEEK_SET), 0);
+  assert_int_equal(fread(record, sizeof(record), 1, file), 1);
+  fclose(file);
+  assert_int_equal(record[11], 60);
+  assert_int_equal(record[15], 140);
+
+  /* the buffer is written when closing */
+  write_packet(test->session, 10);
+  assert_int_equal(ssh_pcap_file_close(test->pcap), SSH_OK);
+  assert_int_equal(file_size(PCAP_FILE), 24 + 16 + 60 + 16 + 50);
+}
+
+static void torture_pcap_background(void **state) {
+  struct pcap_test *test = *state;
+
+  assert_int_equal(ssh_pcap_file_set_buffer(test->pcap, 0, 1), SSH_ERROR);
+  assert_int_equal(ssh_pcap_file_set_buffer(test->pcap, 200, 1), SSH_OK);
+  assert_int_equal(ssh_pcap_file_open(test->pcap, PCAP_FILE), SSH_OK);
+  assert_int_equal(ssh_set_pcap_file(test->session, test->pcap), SSH_OK);
+
+  /* the sessions never write, the packets not fitting are dropped */
+  write_packet(test->session, 100);
+  write_packet(test->session, 100);
+  assert_true(file_size(PCAP_FILE) <= 24);
+  assert_true(ssh_pcap_file_get_dropped(test->pcap) == 1);
+  assert_int_equal(ssh_pcap_file_flush(test->pcap), SSH_OK);
+  assert_int_equal(file_size(PCAP_FILE), 24 + 156);
+  write_packet(test->session, 100);
+  assert_true(ssh_pcap_file_get_dropped(test->pcap) == 1);
+}
+
+static void torture_pcap_rotation(void **state) {
+  struct pcap_test *test = *state;
+  int i;
+
+  assert_int_equal(ssh_pcap_file_set_rotation(test->pcap, 400, 0), SSH_ERROR);
+  assert_int_equal(ssh_pcap_file_set_rotation(test->pcap, 400, 3), SSH_OK);
+  assert_int_equal(ssh_pcap_file_open(test->pcap, PCAP_FILE), SSH_OK);
+  assert_int_equal(ssh_set_pcap_file(test->session, test->pcap), SSH_OK);
+
+  /* two records of 156 bytes in each file */
+  for (i = 0; i < 6; i++) {
+    write_packet(test->session, 100);
+  }
+  assert_int_equal(ssh_pcap_file_flush(test->pcap), SSH_OK);
+  assert_int_equal(file_size(PCAP_FILE), 24 + 2 * 156);
+  assert_int_equal(file_size(PCAP_FILE ".1"), 24 + 2 * 156);
+  assert_int_equal(file_size(PCAP_FILE ".2"), 24 + 2 * 156);
+
+  /* then the first file is written again */
+  write_packet(test->session, 100);
+  assert_int_equal(ssh_pcap_file_flush(test->pcap), SSH_OK);
+  assert_int_equal(file_size(PCAP_FILE), 24 + 156);
+  assert_int_equal(file_size(PCAP_FILE ".3"), -1);
+}
+
+static void torture_pcap_sampling(void **state) {
+  struct pcap_test *test = *state;
+  ssh_session sessions[3];
+  int i;
+
+  assert_int_equal(ssh_pcap_file_set_sampling(test->pcap, 2), SSH_OK);
+  assert_int_equal(ssh_pcap_file_open(test->pcap, PCAP_FILE), SSH_OK);
+
+  /* one session in two is traced */
+  for (i = 0; i < 3; i++) {
+    sessions[i] = ssh_new();
+    assert_true(sessions[i] != NULL);
+    assert_int_equal(ssh_set_pcap_file(sessions[i], test->pcap), SSH_OK);
+  }
+  assert_true(sessions[0]->pcap_ctx != NULL);
+  assert_true(sessions[1]->pcap_ctx == NULL);
+  assert_true(sessions[2]->pcap_ctx != NULL);
+  for (i = 0; i < 3; i++) {
+    ssh_free(sessions[i]);
+  }
+}
+
+int torture_run_tests(void) {
+  int rc;
+  const UnitTest tests[] = {
+    unit_test_setup_teardown(torture_pcap_buffer, setup, teardown),
+    unit_test_setup_teardown(torture_pcap_background, setup, teardown),
+    unit_test_setup_teardown(torture_pcap_rotation, setup, teardown),
+    unit_test_setup_teardown(torture_pcap_sampling, setup, teardown),
+  };
+
+  ssh_init();
+  rc = run_tests(tests);
+  ssh_finalize();
+  return rc;
+}
@@ -0,0 +1,353 @@
+#define LIBSSH_STATIC
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+#include "libssh/socket.h"
+#include "libssh/buffer.h"
+#include "libssh/crypto.h"
+#include "libssh/wrapper.h"
+#include "libssh/packet.h"
+#include "libssh/pipeline.h"
+#include "libssh/ssh2.h"
+
+#define WORKERS 3
+#define DATA_LEN (64 * 1024)
+#define MAX_PACKET 512
+
+struct pipeline_peers {
+  ssh_crypto_pool pool;
+  pthread_t workers[WORKERS];
+  struct torture_peer base; /* the sending side */
+  ssh_channel channel;
+  ssh_session in;
+  ssh_buffer received;
+};
+
+static void *worker_thread(void *arg) {
+  ssh_crypto_pool pool = arg;
+
+  assert_int_equal(ssh_crypto_pool_run(pool), SSH_OK);
+  return NULL;
+}
+
+/* keeps the data of the SSH2_MSG_CHANNEL_DATA packets */
+static int data_callback(ssh_session session, uint8_t type,
+    ssh_buffer packet, void *user) {
+  struct pipeline_peers *p = user;
+  uint32_t channel;
+  ssh_string data;
+
+  (void) session;
+  (void) type;
+
+  assert_int_equal(buffer_get_u32(packet, &channel), sizeof(uint32_t));
+  data = buffer_get_ssh_string(packet);
+  assert_true(data != NULL);
+  assert_int_equal(buffer_add_data(p->received, ssh_string_data(data),
+        ssh_string_len(data)), 0);
+  ssh_string_free(data);
+
+  return SSH_PACKET_USED;
+}
+
+static ssh_packet_callback data_callbacks[] = {
+  data_callback
+};
+
+static struct ssh_packet_callbacks_struct data_packet_callbacks = {
+  .start = SSH2_MSG_CHANNEL_DATA,
+  .n_callbacks = 1,
+  .callbacks = data_callbacks,
+  .user = NULL
+};
+
+static struct crypto_struct *new_cipher(struct crypto_struct *entry) {
+  struct crypto_struct *cipher;
+  unsigned char key[SHA_DIGEST_LEN * 4];
+  unsigned char iv[SHA_DIGEST_LEN * 2];
+  int i;
+
+  for (i = 0; i < (int) sizeof(key); i++) {
+    key[i] = i * 7;
+  }
+  memset(iv, 0x42, sizeof(iv));
+
+  cipher = malloc(sizeof(struct crypto_struct));
+  assert_true(cipher != NULL);
+  memcpy(cipher, entry, sizeof(struct crypto_struct));
+  assert_int_equal(cipher->aead_set_key(cipher, key, iv), 0);
+
+  return cipher;
+}
+
+static void setup(void **state) {
+  struct pipeline_peers *p;
+  int i;
+
+  p = malloc(sizeof(struct pipeline_peers));
+  assert_true(p != NULL);
+
+  p->pool = ssh_crypto_pool_new();
+  assert_true(p->pool != NULL);
+  for (i = 0; i < WORKERS; i++) {
+    assert_int_equal(pthread_create(&p->workers[i], NULL, worker_thread,
+          p->pool), 0);
+  }
+
+  /* the sending side writes on a socketpair */
+  torture_peer_new(&p->base, 0);
+  p->base.session->current_crypto = crypto_new();
+  assert_true(p->base.session->current_crypto != NULL);
+  /* the headers of the data packets are 10 bytes */
+  p->channel = torture_peer_channel(&p->base, 4 * DATA_LEN, MAX_PACKET + 10);
+
+  /* the receiving side is given what was read */
+  p->in = ssh_new();
+  assert_true(p->in != NULL);
+  p->in->version = 2;
+  p->in->current_crypto = crypto_new();
+  assert_true(p->in->current_crypto != NULL);
+  data_packet_callbacks.user = p;
+  ssh_packet_set_callbacks(p->in, &data_packet_callbacks);
+  p->received = ssh_buffer_new();
+  assert_true(p->received != NULL);
+
+  assert_int_equal(ssh_set_crypto_pool(p->base.session, p->pool), SSH_OK);
+  assert_int_equal(ssh_set_crypto_pool(p->in, p->pool), SSH_OK);
+
+  *state = p;
+}
+
+static void teardown(void **state) {
+  struct pipeline_peers *p = *state;
+  int i;
+
+  p->channel->state = SSH_CHANNEL_STATE_CLOSED;
+  ssh_channel_free(p->channel);
+  torture_peer_free(&p->base);
+  ssh_free(p->in);
+  ssh_buffer_free(p->received);
+
+  ssh_crypto_pool_stop(p->pool);
+  for (i = 0; i < WORKERS; i++) {
+    assert_int_equal(pthread_join(p->workers[i], NULL), 0);
+  }
+  ssh_crypto_pool_free(p->pool);
+  free(p);
+}
+
+/* writes the data on the channel, and reads all of what was sent */
+static unsigned char *write_and_read(struct pipeline_peers *p,
+    const unsigned char *data, uint32_t *len) {
+  ssh_session out = p->base.session;
+  uint64_t sent = out->stats.bytes_out;
+  unsigned char *wire;
+  uint32_t wire_len;
+  uint32_t n = 0;
+  ssize_t r;
+
+  /* the socketpair takes all of it without polling */
+  ssh_socket_set_write_wontblock(out->socket);
+  assert_int_equal(ssh_channel_write(p->channel, data, DATA_LEN), DATA_LEN);
+  ssh_socket_set_write_wontblock(out->socket);
+  assert_int_equal(ssh_socket_nonblocking_flush(out->socket), SSH_OK);
+  assert_int_equal(ssh_socket_buffered_out(out->socket), 0);
+  wire_len = out->stats.bytes_out - sent;
+  wire = malloc(wire_len);
+  assert_true(wire != NULL);
+  while (n < wire_len) {
+    r = read(p->base.fd, wire + n, wire_len - n);
+    assert_true(r > 0);
+    n += r;
+  }
+  *len = wire_len;
+
+  return wire;
+}
+
+/*
+ * A large write is encrypted in batches by the pool, and the packets read
+ * at once are decrypted by it, with every AEAD cipher of the table.
+ */
+static void torture_pipeline_round_trip(void **state) {
+  struct pipeline_peers *p = *state;
+  ssh_session out = p->base.session;
+  struct crypto_struct *ciphertab = ssh_get_ciphertab();
+  unsigned char data[DATA_LEN];
+  unsigned char *wire;
+  uint32_t wire_len;
+  int tested = 0;
+  int i, n;
+
+  for (i = 0; i < (int) sizeof(data); i++) {
+    data[i] = i * 13;
+  }
+
+  for (i = 0; ciphertab[i].name != NULL; i++) {
+    if (ciphertab[i].tag_size == 0 || ciphertab[i].aead_copy == NULL) {
+      continue;
+    }
+    cipher_free(out->current_crypto->out_cipher);
+    cipher_free(p->in->current_crypto->in_cipher);
+    out->current_crypto->out_cipher = new_cipher(&ciphertab[i]);
+    p->in->current_crypto->in_cipher = new_cipher(&ciphertab[i]);
+
+    /* the copies of the keys are made after the first batch */
+    for (n = 0; n < 2; n++) {
+      wire = write_and_read(p, data, &wire_len);
+      assert_int_equal(out->send_seq, p->in->recv_seq + DATA_LEN / MAX_PACKET);
+
+      assert_int_equal(buffer_reinit(p->received), 0);
+      assert_int_equal(ssh_packet_socket_callback(wire, wire_len, p->in),
+          wire_len);
+      assert_int_equal(p->in->recv_seq, out->send_seq);
+      assert_int_equal(buffer_get_rest_len(p->received), DATA_LEN);
+      assert_memory_equal(buffer_get_rest(p->received), data, DATA_LEN);
+      free(wire);
+    }
+
+    /* a forged packet stops the read, the packets before it are taken */
+    wire = write_and_read(p, data, &wire_len);
+    wire[wire_len / 4 + 100] ^= 1;
+    assert_int_equal(buffer_reinit(p->received), 0);
+    assert_true(ssh_packet_socket_callback(wire, wire_len, p->in) <
+        (int) wire_len / 4 + 100);
+    assert_true(buffer_get_rest_len(p->received) > 0);
+    assert_true(buffer_get_rest_len(p->received) <= DATA_LEN / 4);
+    assert_memory_equal(buffer_get_rest(p->received), data,
+        buffer_get_rest_len(p->received));
+    free(wire);
+    p->in->packet_state = PACKET_STATE_INIT;
+    p->in->recv_seq = out->send_seq;
+    tested++;
+  }
+
+  assert_true(tested > 0);
+}
+
+/* a copy of the keys processes the packets like the original */
+static void torture_pipeline_copy(void **state) {
+  struct crypto_struct *ciphertab = ssh_get_ciphertab();
+  struct crypto_struct *cipher;
+  struct crypto_struct *copy;
+  unsigned char packet[4 + 64];
+  unsigned char other[4 + 64];
+  unsigned char tag[EVP_MAX_MD_SIZE];
+  unsigned char other_tag[EVP_MAX_MD_SIZE];
+  int tested = 0;
+  int i;
+
+  (void) state;
+
+  for (i = 0; ciphertab[i].name != NULL; i++) {
+    if (ciphertab[i].tag_size == 0 || ciphertab[i].aead_copy == NULL) {
+      continue;
+    }
+    cipher = new_cipher(&ciphertab[i]);
+    memset(packet, 0x17, sizeof(packet));
+    cipher->aead_encrypt(cipher, packet, packet, sizeof(packet), tag, 5);
+
+    copy = cipher_copy(cipher);
+    assert_true(copy != NULL);
+    memset(packet, 0x17, sizeof(packet));
+    memset(other, 0x17, sizeof(other));
+    cipher->aead_encrypt(cipher, packet, packet, sizeof(packet), tag, 9);
+    copy->aead_encrypt(copy, other, other, sizeof(other), other_tag, 9);
+    assert_memory_equal(packet, other, sizeof(packet));
+    assert_memory_equal(tag, other_tag, cipher->tag_size);
+
+    cipher_free(copy);
+    cipher_free(cipher);
+    tested++;
+  }
+
+  assert_true(tested > 0);
+}
+
+struct pipeline_job {
+  pthread_t thread;
+  int done;
+};
+
+static void job_run(void *userdata) {
+  struct pipeline_job *job = userdata;
+
+  job->thread = pthread_self();
+}
+
+static void job_done(ssh_event event, void *userdata) {
+  struct pipeline_job *job = userdata;
+
+  (void) event;
+  assert_true(job->thread != pthread_self());
+  job->done++;
+}
+
+/* the jobs run by the workers are done in the thread of the event */
+static void torture_pipeline_jobs(void **state) {
+  struct pipeline_peers *p = *state;
+  struct pipeline_job jobs[16];
+  ssh_crypto_pool idle;
+  ssh_event event;
+  int done;
+  int i, n;
+
+  memset(jobs, 0, sizeof(jobs));
+  event = ssh_event_new();
+  assert_true(event != NULL);
+
+  /* without a worker, the caller runs the job itself */
+  idle = ssh_crypto_pool_new();
+  assert_true(idle != NULL);
+  assert_int_equal(crypto_pool_post(idle, event, job_run, job_done, &jobs[0]),
+      SSH_ERROR);
+  ssh_crypto_pool_free(idle);
+
+  /* the workers of the setup may not run yet */
+  for (n = 0; n < 100; n++) {
+    if (crypto_pool_post(p->pool, event, job_run, job_done, &jobs[0]) ==
+        SSH_OK) {
+      break;
+    }
+    usleep(10000);
+  }
+  assert_true(n < 100);
+  for (i = 1; i < 16; i++) {
+    assert_int_equal(crypto_pool_post(p->pool, event, job_run, job_done,
+          &jobs[i]), SSH_OK);
+  }
+
+  for (n = 0, done = 0; n < 100 && done < 16; n++) {
+    assert_int_equal(ssh_event_dopoll(event, 100), SSH_OK);
+    for (i = 0, done = 0; i < 16; i++) {
+      done += jobs[i].done;
+    }
+  }
+  assert_int_equal(done, 16);
+
+  ssh_event_free(event);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_pipeline_round_trip, setup,
+            teardown),
+        unit_test(torture_pipeline_copy),
+        unit_test_setup_teardown(torture_pipeline_jobs, setup, teardown),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,337 @@
+#define LIBSSH_STATIC
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/callbacks.h"
+#include "libssh/poll.h"
+
+#define PAIRS 3
+
+struct poll_test {
+  ssh_poll_ctx ctx;
+  ssh_poll_handle p[PAIRS];
+  int calls[PAIRS];
+  int remove_others;
+};
+
+static struct poll_test *current;
+
+static int poll_test_cb(ssh_poll_handle p, socket_t fd, int revents,
+    void *userdata) {
+  int i = *(int *) userdata;
+  int j;
+
+  (void) fd;
+  assert_true(revents & POLLIN);
+  current->calls[i]++;
+
+  if (current->remove_others) {
+    for (j = 0; j < PAIRS; j++) {
+      if (current->p[j] != p && ssh_poll_get_ctx(current->p[j]) != NULL) {
+        ssh_poll_ctx_remove(current->ctx, current->p[j]);
+      }
+    }
+  }
+
+  return 0;
+}
+
+static void torture_poll_backend(enum ssh_poll_backend_e type) {
+  struct poll_test test;
+  int index[PAIRS];
+  int fds[PAIRS][2];
+  int i;
+
+  ZERO_STRUCT(test);
+  current = &test;
+  test.ctx = ssh_poll_ctx_new(0);
+  assert_true(test.ctx != NULL);
+  if (ssh_poll_ctx_set_backend(test.ctx, type) < 0) {
+    /* not available here */
+    assert_true(type != SSH_POLL_BACKEND_POLL);
+    ssh_poll_ctx_free(test.ctx);
+    return;
+  }
+  assert_int_equal(ssh_poll_ctx_get_backend(test.ctx), type);
+
+  for (i = 0; i < PAIRS; i++) {
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]), 0);
+    index[i] = i;
+    test.p[i] = ssh_poll_new(fds[i][0], POLLIN, poll_test_cb, &index[i]);
+    assert_true(test.p[i] != NULL);
+    assert_int_equal(ssh_poll_ctx_add(test.ctx, test.p[i]), 0);
+  }
+
+  /* only the sockets with data are dispatched */
+  assert_int_equal(write(fds[0][1], "x", 1), 1);
+  assert_int_equal(write(fds[2][1], "x", 1), 1);
+  assert_int_equal(ssh_poll_ctx_dopoll(test.ctx, 1000), 0);
+  assert_int_equal(test.calls[0], 1);
+  assert_int_equal(test.calls[1], 0);
+  assert_int_equal(test.calls[2], 1);
+
+  /* level triggered: the unread data is reported again */
+  assert_int_equal(ssh_poll_ctx_dopoll(test.ctx, 1000), 0);
+  assert_int_equal(test.calls[0], 2);
+  assert_int_equal(test.calls[2], 2);
+
+  /* the events of removed poll objects aren't dispatched */
+  assert_int_equal(write(fds[1][1], "x", 1), 1);
+  test.remove_others = 1;
+  assert_int_equal(ssh_poll_ctx_dopoll(test.ctx, 1000), 0);
+  assert_int_equal(test.calls[0] + test.calls[1] + test.calls[2], 5);
+  test.remove_others = 0;
+
+  /* the edge triggered ones are only reported for new data */
+  for (i = 0; i < PAIRS; i++) {
+    if (ssh_poll_get_ctx(test.p[i]) != NULL) {
+      break;
+    }
+  }
+  assert_true(i < PAIRS);
+  ssh_poll_set_edge_triggered(test.p[i], 1);
+  test.calls[i] = 0;
+  assert_int_equal(write(fds[i][1], "x", 1), 1);
+  assert_int_equal(ssh_poll_ctx_dopoll(test.ctx, 1000), 0);
+  assert_int_equal(test.calls[i], 1);
+  assert_int_equal(ssh_poll_ctx_dopoll(test.ctx, 0), 0);
+  /* poll() and the completion port have no edges */
+  assert_int_equal(test.calls[i], (type == SSH_POLL_BACKEND_POLL ||
+        type == SSH_POLL_BACKEND_IOCP) ? 2 : 1);
+
+  for (i = 0; i < PAIRS; i++) {
+    ssh_poll_free(test.p[i]);
+    close(fds[i][0]);
+    close(fds[i][1]);
+  }
+  ssh_poll_ctx_free(test.ctx);
+}
+
+static void torture_poll_backend_poll(void **state) {
+  (void) state;
+  torture_poll_backend(SSH_POLL_BACKEND_POLL);
+}
+
+static void torture_poll_backend_epoll(void **state) {
+  (void) state;
+  torture_poll_backend(SSH_POLL_BACKEND_EPOLL);
+}
+
+static void torture_poll_backend_kqueue(void **state) {
+  (void) state;
+  torture_poll_backend(SSH_POLL_BACKEND_KQUEUE);
+}
+
+static void torture_poll_backend_io_uring(void **state) {
+  (void) state;
+  torture_poll_backend(SSH_POLL_BACKEND_IO_URING);
+}
+
+static void torture_poll_backend_iocp(void **state) {
+  (void) state;
+  torture_poll_backend(SSH_POLL_BACKEND_IOCP);
+}
+
+static int poll_count_cb(ssh_poll_handle p, socket_t fd, int revents,
+    void *userdata) {
+  (void) p;
+  (void) fd;
+  (void) revents;
+  (*(int *) userdata)++;
+  return 0;
+}
+
+/* big contexts switch to epoll or kqueue by themselves */
+static void torture_poll_backend_auto(void **state) {
+  ssh_poll_handle p[100];
+  ssh_poll_ctx ctx;
+  int fds[100][2];
+  int calls = 0;
+  int i;
+
+  (void) state;
+
+  ctx = ssh_poll_ctx_new(0);
+  assert_true(ctx != NULL);
+  for (i = 0; i < 100; i++) {
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]), 0);
+    p[i] = ssh_poll_new(fds[i][0], POLLIN, poll_count_cb, &calls);
+    assert_true(p[i] != NULL);
+    assert_int_equal(ssh_poll_ctx_add(ctx, p[i]), 0);
+  }
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+  assert_true(ssh_poll_ctx_get_backend(ctx) != SSH_POLL_BACKEND_POLL);
+#endif
+
+  assert_int_equal(write(fds[7][1], "x", 1), 1);
+  assert_int_equal(write(fds[93][1], "x", 1), 1);
+  assert_int_equal(ssh_poll_ctx_dopoll(ctx, 1000), 0);
+  assert_int_equal(calls, 2);
+
+  for (i = 0; i < 100; i++) {
+    ssh_poll_free(p[i]);
+    close(fds[i][0]);
+    close(fds[i][1]);
+  }
+  ssh_poll_ctx_free(ctx);
+}
+
+static void torture_poll_find_fd(void **state) {
+  ssh_poll_handle p[10];
+  ssh_poll_ctx ctx;
+  int calls = 0;
+  int i;
+
+  (void) state;
+
+  ctx = ssh_poll_ctx_new(0);
+  assert_true(ctx != NULL);
+  for (i = 0; i < 10; i++) {
+    p[i] = ssh_poll_new(100 + i, POLLIN, poll_count_cb, &calls);
+    assert_true(p[i] != NULL);
+    assert_int_equal(ssh_poll_ctx_add(ctx, p[i]), 0);
+  }
+  assert_int_equal(ssh_poll_ctx_index_fds(ctx), 0);
+
+  for (i = 0; i < 10; i++) {
+    assert_true(ssh_poll_ctx_find_fd(ctx, 100 + i) == p[i]);
+  }
+  assert_true(ssh_poll_ctx_find_fd(ctx, 99) == NULL);
+
+  /* the index follows the removals (which move the last poll object)... */
+  ssh_poll_ctx_remove(ctx, p[0]);
+  assert_true(ssh_poll_ctx_find_fd(ctx, 100) == NULL);
+  assert_true(ssh_poll_ctx_find_fd(ctx, 109) == p[9]);
+  assert_int_equal(ssh_poll_get_fd(p[9]), 109);
+
+  /* ...and the fd changes */
+  ssh_poll_set_fd(p[5], 200);
+  assert_true(ssh_poll_ctx_find_fd(ctx, 105) == NULL);
+  assert_true(ssh_poll_ctx_find_fd(ctx, 200) == p[5]);
+
+  for (i = 0; i < 10; i++) {
+    ssh_poll_free(p[i]);
+  }
+  ssh_poll_ctx_free(ctx);
+}
+
+#define TASKS 100
+
+struct post_test {
+  ssh_event event;
+  pthread_t loop;
+  int done;
+};
+
+static void post_test_task(ssh_event event, void *userdata) {
+  struct post_test *test = userdata;
+
+  assert_true(event == test->event);
+  assert_true(pthread_equal(pthread_self(), test->loop));
+  test->done++;
+}
+
+static void torture_polls_move(void **state) {
+  ssh_poll_handle owned = NULL;
+  ssh_poll_handle p[3];
+  ssh_poll_ctx from;
+  ssh_poll_ctx to;
+  int calls = 0;
+  int i;
+
+  (void) state;
+
+  from = ssh_poll_ctx_new(0);
+  to = ssh_poll_ctx_new(0);
+  assert_true(from != NULL && to != NULL);
+  for (i = 0; i < 3; i++) {
+    p[i] = ssh_poll_new(100 + i, POLLIN, poll_count_cb, &calls);
+    assert_true(p[i] != NULL);
+    assert_int_equal(ssh_poll_ctx_add(from, p[i]), 0);
+  }
+  ssh_poll_set_owner(p[0], &owned);
+  ssh_poll_set_owner(p[2], &owned);
+
+  /* only the owned poll objects move */
+  ssh_polls_move(owned, to);
+  assert_true(ssh_poll_get_ctx(p[0]) == to);
+  assert_true(ssh_poll_get_ctx(p[1]) == from);
+  assert_true(ssh_poll_get_ctx(p[2]) == to);
+
+  /* a freed one leaves its owner */
+  ssh_poll_free(p[2]);
+  assert_true(owned == p[0]);
+  ssh_poll_free(p[0]);
+  assert_true(owned == NULL);
+
+  ssh_poll_free(p[1]);
+  ssh_poll_ctx_free(from);
+  ssh_poll_ctx_free(to);
+}
+
+static void *post_test_thread(void *userdata) {
+  struct post_test *test = userdata;
+  int i;
+
+  for (i = 0; i < TASKS; i++) {
+    assert_int_equal(ssh_event_post(test->event, post_test_task, test),
+        SSH_OK);
+    if (i % 10 == 0) {
+      usleep(1000);
+    }
+  }
+
+  return NULL;
+}
+
+/* the tasks posted by another thread wake up the poll and run in its thread */
+static void torture_event_post(void **state) {
+  struct post_test test;
+  pthread_t thread;
+  int i;
+
+  (void) state;
+
+  test.event = ssh_event_new();
+  assert_true(test.event != NULL);
+  test.loop = pthread_self();
+  test.done = 0;
+
+  assert_int_equal(pthread_create(&thread, NULL, post_test_thread, &test), 0);
+  for (i = 0; test.done < TASKS && i < 1000; i++) {
+    assert_int_equal(ssh_event_dopoll(test.event, -1), SSH_OK);
+  }
+  assert_int_equal(pthread_join(thread, NULL), 0);
+  assert_int_equal(test.done, TASKS);
+
+  /* the ones which didn't run are freed with the event */
+  assert_int_equal(ssh_event_post(test.event, post_test_task, &test), SSH_OK);
+  ssh_event_free(test.event);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_poll_backend_poll),
+        unit_test(torture_poll_backend_epoll),
+        unit_test(torture_poll_backend_kqueue),
+        unit_test(torture_poll_backend_io_uring),
+        unit_test(torture_poll_backend_iocp),
+        unit_test(torture_poll_backend_auto),
+        unit_test(torture_poll_find_fd),
+        unit_test(torture_polls_move),
+        unit_test(torture_event_post),
+    };
+
+    ssh_threads_set_callbacks(ssh_threads_get_pthread());
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
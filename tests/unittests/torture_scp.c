@@ -0,0 +1,367 @@
+#define LIBSSH_STATIC
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+#include "libssh/buffer.h"
+#include "libssh/ssh2.h"
+#include "libssh/scp.h"
+
+struct scp_peer {
+  struct torture_peer base;
+  ssh_channel channel;
+  ssh_scp scp;
+  /* what the sink received */
+  char stream[4096];
+  size_t len;
+};
+
+/* a scp in sink mode over an open channel on a socketpair */
+static void scp_peer_new(struct scp_peer *peer, int mode) {
+  memset(peer, 0, sizeof(*peer));
+  torture_peer_new(&peer->base, 0);
+  peer->channel = torture_peer_channel(&peer->base, 1000000, 32768);
+
+  peer->scp = ssh_scp_new(peer->base.session, mode, ".");
+  assert_true(peer->scp != NULL);
+  peer->scp->channel = peer->channel;
+  peer->scp->state = SSH_SCP_WRITE_INITED;
+}
+
+static void scp_peer_free(struct scp_peer *peer) {
+  /* the close would wait for the sink */
+  peer->scp->channel = NULL;
+  peer->scp->state = SSH_SCP_NEW;
+  ssh_scp_free(peer->scp);
+  peer->channel->state = SSH_CHANNEL_STATE_CLOSED;
+  ssh_channel_free(peer->channel);
+  torture_peer_free(&peer->base);
+}
+
+/* the acknowledgments of the sink */
+static void scp_peer_ack(struct scp_peer *peer, const char *acks,
+    size_t len) {
+  assert_int_equal(channel_default_bufferize(peer->channel, (void *) acks,
+        len, 0), 0);
+}
+
+/* reads the data packets sent so far */
+static void scp_peer_read(struct scp_peer *peer) {
+  unsigned char packet[40000];
+  uint32_t len;
+
+  /* the packets wait for the socket to be writable */
+  assert_int_equal(ssh_handle_packets(peer->base.session, 100), SSH_OK);
+  while (torture_peer_pending(&peer->base)) {
+    torture_peer_read(&peer->base, packet, sizeof(packet));
+    /* padding length, type, channel, length of the data */
+    if (packet[1] == SSH2_MSG_CHANNEL_WINDOW_ADJUST) {
+      continue;
+    }
+    assert_int_equal(packet[1], SSH2_MSG_CHANNEL_DATA);
+    memcpy(&len, packet + 6, sizeof(len));
+    len = ntohl(len);
+    assert_true(peer->len + len < sizeof(peer->stream));
+    memcpy(peer->stream + peer->len, packet + 10, len);
+    peer->len += len;
+  }
+  peer->stream[peer->len] = '\0';
+}
+
+static void torture_scp_pipeline(void **state) {
+  struct scp_peer peer;
+  const char expected[] = "C0644 3 a\nabc" "\0" "C0600 0 b\n" "\0";
+
+  (void) state;
+
+  scp_peer_new(&peer, SSH_SCP_WRITE | SSH_SCP_PIPELINE);
+
+  /* two files go out without an acknowledgment */
+  assert_int_equal(ssh_scp_push_file(peer.scp, "dir/a", 3, 0644), SSH_OK);
+  assert_int_equal(ssh_scp_write(peer.scp, "abc", 3), SSH_OK);
+  assert_int_equal(ssh_scp_push_file(peer.scp, "b", 0, 0600), SSH_OK);
+  assert_int_equal(ssh_scp_write(peer.scp, "", 0), SSH_OK);
+  assert_int_equal(peer.scp->acks, 4);
+
+  /* in one write, once flushed */
+  scp_peer_read(&peer);
+  assert_int_equal(peer.len, 0);
+  scp_peer_ack(&peer, "\0\0\0\0", 4);
+  assert_int_equal(ssh_scp_flush(peer.scp), SSH_OK);
+  assert_int_equal(peer.scp->acks, 0);
+  scp_peer_read(&peer);
+  assert_int_equal(peer.len, sizeof(expected) - 1);
+  assert_memory_equal(peer.stream, expected, sizeof(expected) - 1);
+
+  /* a refusal fails the transfer */
+  assert_int_equal(ssh_scp_push_file(peer.scp, "c", 1, 0644), SSH_OK);
+  assert_int_equal(ssh_scp_write(peer.scp, "c", 1), SSH_OK);
+  scp_peer_ack(&peer, "\2c: No space left\n", 18);
+  assert_int_equal(ssh_scp_flush(peer.scp), SSH_ERROR);
+  assert_true(strstr(ssh_get_error(peer.base.session),
+      "No space left") != NULL);
+  assert_true(peer.scp->state == SSH_SCP_ERROR);
+
+  scp_peer_free(&peer);
+}
+
+static void scp_tree_file(const char *path, const char *data, int mode) {
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+  assert_true(fd >= 0);
+  assert_int_equal(write(fd, data, strlen(data)), strlen(data));
+  close(fd);
+  assert_int_equal(chmod(path, mode), 0);
+}
+
+static void torture_scp_push_tree(void **state) {
+  struct scp_peer peer;
+  char tree[] = "scp_tree_XXXXXX";
+  char path[64];
+  char *p;
+
+  (void) state;
+
+  assert_true(mkdtemp(tree) != NULL);
+  assert_int_equal(chmod(tree, 0750), 0);
+  snprintf(path, sizeof(path), "%s/sub", tree);
+  assert_int_equal(mkdir(path, 0700), 0);
+  snprintf(path, sizeof(path), "%s/sub/file", tree);
+  scp_tree_file(path, "nested", 0640);
+
+  /* a directory needs a recursive scp */
+  scp_peer_new(&peer, SSH_SCP_WRITE);
+  assert_int_equal(ssh_scp_push_tree(peer.scp, tree), SSH_ERROR);
+  scp_peer_free(&peer);
+
+  /* the acknowledgments of D, D, C, end of C, E and E */
+  scp_peer_new(&peer, SSH_SCP_WRITE | SSH_SCP_RECURSIVE);
+  scp_peer_ack(&peer, "\0\0\0\0\0\0", 6);
+  assert_int_equal(ssh_scp_push_tree(peer.scp, tree), SSH_OK);
+  assert_int_equal(peer.scp->acks, 0);
+  assert_int_equal(peer.scp->pipeline, 0);
+  scp_peer_read(&peer);
+
+  p = peer.stream;
+  assert_true(strncmp(p, "D0750 0 scp_tree_", 17) == 0);
+  p = strchr(p, '\n') + 1;
+  assert_true(strncmp(p, "D0700 0 sub\nC0640 6 file\nnested", 31) == 0);
+  p += 31;
+  assert_memory_equal(p, "\0E\nE\n", 5);
+  assert_int_equal(p + 5 - peer.stream, peer.len);
+
+  scp_peer_free(&peer);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/sub", tree);
+  rmdir(path);
+  rmdir(tree);
+}
+
+struct scp_progress {
+  int calls;
+  uint64_t sent;
+  uint64_t total;
+};
+
+static void scp_progress_cb(const char *path, uint64_t bytes, uint64_t sent,
+    uint64_t total, void *userdata) {
+  struct scp_progress *p = userdata;
+
+  (void) path;
+  assert_true(bytes <= sent);
+  assert_true(sent >= p->sent);
+  p->calls++;
+  p->sent = sent;
+  p->total = total;
+}
+
+static void torture_scp_push_files(void **state) {
+  struct scp_peer peers[2];
+  struct scp_progress progress;
+  char tree[] = "scp_files_XXXXXX";
+  char a[64], b[64], c[64];
+  const char *paths[3];
+  ssh_scp scps[2];
+
+  (void) state;
+
+  assert_true(mkdtemp(tree) != NULL);
+  snprintf(a, sizeof(a), "%s/a", tree);
+  scp_tree_file(a, "abc", 0644);
+  snprintf(b, sizeof(b), "%s/b", tree);
+  scp_tree_file(b, "", 0600);
+  snprintf(c, sizeof(c), "%s/c", tree);
+  scp_tree_file(c, "cc", 0640);
+  paths[0] = a;
+  paths[1] = b;
+  paths[2] = c;
+
+  scp_peer_new(&peers[0], SSH_SCP_WRITE);
+  scp_peer_new(&peers[1], SSH_SCP_WRITE);
+  scps[0] = peers[0].scp;
+  scps[1] = peers[1].scp;
+
+  /* a is done first, so its scp takes c as well */
+  scp_peer_ack(&peers[0], "\0\0\0\0", 4);
+  scp_peer_ack(&peers[1], "\0\0", 2);
+  memset(&progress, 0, sizeof(progress));
+  assert_int_equal(ssh_scp_push_files(scps, 2, paths, 3, scp_progress_cb,
+        &progress), SSH_OK);
+  assert_int_equal(progress.calls, 3);
+  assert_int_equal(progress.sent, 5);
+  assert_int_equal(progress.total, 5);
+  assert_int_equal(peers[0].scp->acks, 0);
+  assert_int_equal(peers[0].scp->pipeline, 0);
+
+  scp_peer_read(&peers[0]);
+  assert_int_equal(peers[0].len, 27);
+  assert_memory_equal(peers[0].stream,
+      "C0644 3 a\nabc" "\0" "C0640 2 c\ncc" "\0", 27);
+  scp_peer_read(&peers[1]);
+  assert_int_equal(peers[1].len, 11);
+  assert_memory_equal(peers[1].stream, "C0600 0 b\n" "\0", 11);
+
+  /* a refusal fails the transfer, on the first session */
+  scp_peer_ack(&peers[0], "\2a: Permission denied\n", 23);
+  assert_int_equal(ssh_scp_push_files(scps, 2, paths, 1, NULL, NULL),
+      SSH_ERROR);
+  assert_true(peers[0].scp->state == SSH_SCP_ERROR);
+  assert_true(strstr(ssh_get_error(peers[0].base.session), "Permission denied")
+      != NULL);
+  assert_int_equal(ssh_scp_push_files(scps, 2, paths, 1, NULL, NULL),
+      SSH_ERROR);
+  assert_true(strstr(ssh_get_error(peers[0].base.session), "invalid state")
+      != NULL);
+
+  scp_peer_free(&peers[0]);
+  scp_peer_free(&peers[1]);
+  unlink(a);
+  unlink(b);
+  unlink(c);
+  rmdir(tree);
+}
+
+/* a scp in source mode, which sent what the source stream holds */
+static void scp_peer_source(struct scp_peer *peer, const char *stream,
+    size_t len) {
+  scp_peer_new(peer, SSH_SCP_READ);
+  peer->scp->state = SSH_SCP_READ_INITED;
+  scp_peer_ack(peer, stream, len);
+  peer->channel->remote_eof = 1;
+}
+
+static void torture_scp_pull_to_fd(void **state) {
+  struct scp_peer peer;
+  const char stream[] = "C0644 5 a\nhello" "\0" "C0644 4 b\nhel";
+  char data[16];
+  int fds[2];
+
+  (void) state;
+
+  assert_int_equal(pipe(fds), 0);
+  scp_peer_source(&peer, stream, sizeof(stream) - 1);
+
+  /* accepted, written and acknowledged at once */
+  assert_int_equal(ssh_scp_pull_request(peer.scp), SSH_SCP_REQUEST_NEWFILE);
+  assert_int_equal(ssh_scp_pull_to_fd(peer.scp, fds[1]), SSH_OK);
+  assert_true(peer.scp->state == SSH_SCP_READ_INITED);
+  assert_int_equal(read(fds[0], data, sizeof(data)), 5);
+  assert_memory_equal(data, "hello", 5);
+
+  /* a file cut short */
+  assert_int_equal(ssh_scp_pull_request(peer.scp), SSH_SCP_REQUEST_NEWFILE);
+  assert_int_equal(ssh_scp_pull_to_fd(peer.scp, fds[1]), SSH_ERROR);
+  assert_true(strstr(ssh_get_error(peer.base.session), "End of file") != NULL);
+  assert_true(peer.scp->state == SSH_SCP_ERROR);
+  assert_int_equal(read(fds[0], data, sizeof(data)), 3);
+
+  scp_peer_free(&peer);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static void scp_tree_check(const char *path, const char *data, int mode) {
+  struct stat st;
+  char buf[64];
+  int fd;
+
+  assert_int_equal(stat(path, &st), 0);
+  assert_int_equal(st.st_mode & 0777, mode);
+  fd = open(path, O_RDONLY);
+  assert_true(fd >= 0);
+  assert_int_equal(read(fd, buf, sizeof(buf)), strlen(data));
+  assert_memory_equal(buf, data, strlen(data));
+  close(fd);
+}
+
+static void torture_scp_pull_tree(void **state) {
+  struct scp_peer peer;
+  const char stream[] = "D0750 0 sub\nC0640 6 file\nnested" "\0"
+      "E\nC0600 1 x\nx" "\0";
+  const char evil[] = "C0644 1 ../x\nx" "\0";
+  char tree[] = "scp_tree_XXXXXX";
+  char path[64];
+  struct stat st;
+  mode_t mask;
+
+  (void) state;
+
+  mask = umask(0);
+  assert_true(mkdtemp(tree) != NULL);
+  scp_peer_source(&peer, stream, sizeof(stream) - 1);
+  assert_int_equal(ssh_scp_pull_tree(peer.scp, tree), SSH_OK);
+  assert_true(peer.scp->state == SSH_SCP_TERMINATED);
+  scp_peer_free(&peer);
+
+  snprintf(path, sizeof(path), "%s/sub", tree);
+  assert_int_equal(stat(path, &st), 0);
+  assert_true(S_ISDIR(st.st_mode));
+  assert_int_equal(st.st_mode & 0777, 0750);
+  snprintf(path, sizeof(path), "%s/sub/file", tree);
+  scp_tree_check(path, "nested", 0640);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/x", tree);
+  scp_tree_check(path, "x", 0600);
+  unlink(path);
+
+  /* a name leaving the directory is refused */
+  scp_peer_source(&peer, evil, sizeof(evil) - 1);
+  assert_int_equal(ssh_scp_pull_tree(peer.scp, tree), SSH_ERROR);
+  assert_true(strstr(ssh_get_error(peer.base.session),
+      "invalid file name") != NULL);
+  scp_peer_free(&peer);
+  assert_true(access("x", F_OK) < 0);
+
+  snprintf(path, sizeof(path), "%s/sub", tree);
+  rmdir(path);
+  rmdir(tree);
+  umask(mask);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_scp_pipeline),
+        unit_test(torture_scp_push_tree),
+        unit_test(torture_scp_pull_to_fd),
+        unit_test(torture_scp_pull_tree),
+        unit_test(torture_scp_push_files),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
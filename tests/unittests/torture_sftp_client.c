@@ -0,0 +1,702 @@
+#define LIBSSH_STATIC
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+#include "libssh/packet.h"
+#include "libssh/buffer.h"
+#include "libssh/ssh2.h"
+#include "libssh/sftp.h"
+
+#define FILE_LEN 100000
+
+/* a client session connected to a socketpair, a thread serves the file */
+struct sftp_server_peer {
+  struct torture_peer base;
+  ssh_channel channel;
+  sftp_session sftp;
+  sftp_file file;
+  pthread_t thread;
+  int reads; /* the READs received */
+  int writes;
+  unsigned char written[FILE_LEN];
+  uint64_t written_len;
+  uint64_t fail_at; /* the WRITEs after it fail */
+  int stats; /* the STATs and LSTATs received */
+};
+
+static unsigned char file_byte(uint64_t offset) {
+  return (unsigned char) (offset * 7 + offset / 256);
+}
+
+/* sends the data on the channel */
+static void peer_write(struct sftp_server_peer *peer,
+    const unsigned char *data, uint32_t len) {
+  ssh_buffer payload;
+
+  payload = ssh_buffer_new();
+  assert_true(payload != NULL);
+  assert_int_equal(buffer_pack(payload, "bddP", SSH2_MSG_CHANNEL_DATA,
+        peer->channel->local_channel, len, (size_t) len, data), 0);
+  torture_peer_send(&peer->base, payload);
+}
+
+/* sends a status of the code for a request */
+static void peer_status(struct sftp_server_peer *peer, uint32_t id,
+    uint32_t code) {
+  unsigned char reply[21];
+  uint32_t v;
+
+  /* length, type, id, code, message, language */
+  v = htonl(sizeof(reply) - 4);
+  memcpy(reply, &v, 4);
+  reply[4] = SSH_FXP_STATUS;
+  memcpy(reply + 5, &id, 4);
+  v = htonl(code);
+  memcpy(reply + 9, &v, 4);
+  memset(reply + 13, 0, 8);
+  peer_write(peer, reply, sizeof(reply));
+}
+
+/* answers a READ with the bytes of the file or its end */
+static void peer_read(struct sftp_server_peer *peer, uint32_t id,
+    uint64_t offset, uint32_t len) {
+  unsigned char reply[40000];
+  uint32_t v;
+  uint32_t i;
+  uint32_t n;
+
+  peer->reads++;
+  if (offset >= FILE_LEN) {
+    peer_status(peer, id, SSH_FX_EOF);
+    return;
+  }
+  if (offset + len > FILE_LEN) {
+    len = FILE_LEN - offset;
+  }
+  assert_true(13 + len <= sizeof(reply));
+  v = htonl(1 + 4 + 4 + len);
+  memcpy(reply, &v, 4);
+  reply[4] = SSH_FXP_DATA;
+  memcpy(reply + 5, &id, 4);
+  v = htonl(len);
+  memcpy(reply + 9, &v, 4);
+  for (i = 0; i < len; i++) {
+    reply[13 + i] = file_byte(offset + i);
+  }
+  /* in pieces, as a channel would */
+  for (i = 0; i < 13 + len; i += n) {
+    n = 13 + len - i > 16384 ? 16384 : 13 + len - i;
+    peer_write(peer, reply + i, n);
+  }
+}
+
+/* keeps the data of a WRITE, it fails from fail_at */
+static void peer_write_data(struct sftp_server_peer *peer, uint32_t id,
+    uint64_t offset, const unsigned char *data, uint32_t len) {
+  peer->writes++;
+  if (offset + len > peer->fail_at) {
+    peer_status(peer, id, SSH_FX_FAILURE);
+    return;
+  }
+  assert_true(offset + len <= sizeof(peer->written));
+  memcpy(peer->written + offset, data, len);
+  if (offset + len > peer->written_len) {
+    peer->written_len = offset + len;
+  }
+  peer_status(peer, id, SSH_FX_OK);
+}
+
+/* sends a reply of the type, its id and the rest packed by the caller */
+static void peer_reply(struct sftp_server_peer *peer, ssh_buffer reply) {
+  unsigned char data[1000];
+  uint32_t len = buffer_get_rest_len(reply);
+  uint32_t v = htonl(len);
+
+  assert_true(4 + len <= sizeof(data));
+  memcpy(data, &v, 4);
+  memcpy(data + 4, buffer_get_rest(reply), len);
+  peer_write(peer, data, 4 + len);
+  ssh_buffer_free(reply);
+}
+
+/* the attributes of a path: its size and its type, from its name */
+static void peer_pack_attr(ssh_buffer reply, const char *path,
+    uint64_t size) {
+  uint32_t perm = 0100644;
+
+  if (strstr(path, "link") != NULL) {
+    perm = 0120777;
+  }
+  assert_int_equal(buffer_pack(reply, "dqd",
+        SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_PERMISSIONS, size, perm),
+      0);
+}
+
+/* answers the stats, and the directories with a, b and link */
+static void peer_metadata(struct sftp_server_peer *peer, uint8_t type,
+    uint32_t id, const char *path) {
+  static int listed;
+  ssh_buffer reply;
+
+  reply = ssh_buffer_new();
+  assert_true(reply != NULL);
+  switch (type) {
+    case SSH_FXP_STAT:
+    case SSH_FXP_LSTAT:
+      peer->stats++;
+      assert_int_equal(buffer_pack(reply, "bd", SSH_FXP_ATTRS, id), 0);
+      peer_pack_attr(reply, path, strlen(path) * 10);
+      break;
+    case SSH_FXP_OPEN:
+      if (strstr(path, "missing") != NULL) {
+        ssh_buffer_free(reply);
+        peer_status(peer, htonl(id), SSH_FX_NO_SUCH_FILE);
+        return;
+      }
+      assert_int_equal(buffer_pack(reply, "bds", SSH_FXP_HANDLE, id, "h"),
+          0);
+      break;
+    case SSH_FXP_OPENDIR:
+      listed = 0;
+      assert_int_equal(buffer_pack(reply, "bds", SSH_FXP_HANDLE, id, "d"),
+          0);
+      break;
+    case SSH_FXP_READDIR:
+      if (listed++ > 0) {
+        ssh_buffer_free(reply);
+        peer_status(peer, htonl(id), SSH_FX_EOF);
+        return;
+      }
+      assert_int_equal(buffer_pack(reply, "bdd", SSH_FXP_NAME, id, 4), 0);
+      assert_int_equal(buffer_pack(reply, "ss", ".", "."), 0);
+      peer_pack_attr(reply, ".", 1);
+      assert_int_equal(buffer_pack(reply, "ss", "a", "a"), 0);
+      peer_pack_attr(reply, "a", 1);
+      assert_int_equal(buffer_pack(reply, "ss", "b", "b"), 0);
+      peer_pack_attr(reply, "b", 2);
+      assert_int_equal(buffer_pack(reply, "ss", "link", "link"), 0);
+      peer_pack_attr(reply, "link", 3);
+      break;
+    default:
+      /* setstat, remove and rename */
+      ssh_buffer_free(reply);
+      peer_status(peer, htonl(id), SSH_FX_OK);
+      return;
+  }
+  peer_reply(peer, reply);
+}
+
+/*
+ * A request: type, id, then a path, or the handle "h" with the offset and
+ * length for IO
+ */
+static void peer_request(struct sftp_server_peer *peer,
+    const unsigned char *req) {
+  ssh_buffer reply;
+  char path[256];
+  uint64_t offset;
+  uint32_t len;
+  uint32_t id;
+  uint32_t v;
+
+  if (req[0] == SSH_FXP_INIT) {
+    reply = ssh_buffer_new();
+    assert_true(reply != NULL);
+    assert_int_equal(buffer_pack(reply, "bdss", SSH_FXP_VERSION, 3,
+          "x@example.com", "1"), 0);
+    peer_reply(peer, reply);
+    return;
+  }
+  memcpy(&id, req + 1, 4);
+  if (req[0] == SSH_FXP_CLOSE) {
+    peer_status(peer, id, SSH_FX_OK);
+    return;
+  }
+  if (req[0] != SSH_FXP_READ && req[0] != SSH_FXP_WRITE) {
+    memcpy(&len, req + 5, 4);
+    len = ntohl(len);
+    assert_true(len < sizeof(path));
+    memcpy(path, req + 9, len);
+    path[len] = '\0';
+    peer_metadata(peer, req[0], ntohl(id), path);
+    return;
+  }
+  memcpy(&v, req + 10, 4);
+  offset = (uint64_t) ntohl(v) << 32;
+  memcpy(&v, req + 14, 4);
+  offset |= ntohl(v);
+  memcpy(&len, req + 18, 4);
+  len = ntohl(len);
+  if (req[0] == SSH_FXP_READ) {
+    peer_read(peer, id, offset, len);
+  } else {
+    assert_int_equal(req[0], SSH_FXP_WRITE);
+    peer_write_data(peer, id, offset, req + 22, len);
+  }
+}
+
+/* serves the requests of the channel data, they may come in pieces */
+static void *peer_serve(void *arg) {
+  struct sftp_server_peer *peer = arg;
+  unsigned char packet[40000];
+  unsigned char stream[80000];
+  size_t got = 0;
+  uint32_t len;
+
+  /* until the socket is shut down */
+  while (torture_peer_recv(&peer->base, packet, sizeof(packet)) > 0) {
+    /* padding length, type, channel, data length, data */
+    if (packet[1] != SSH2_MSG_CHANNEL_DATA) {
+      continue;
+    }
+    memcpy(&len, packet + 6, 4);
+    len = ntohl(len);
+    assert_true(got + len <= sizeof(stream));
+    memcpy(stream + got, packet + 10, len);
+    got += len;
+
+    while (got >= 4) {
+      memcpy(&len, stream, 4);
+      len = ntohl(len);
+      if (got < 4 + len) {
+        break;
+      }
+      peer_request(peer, stream + 4);
+      memmove(stream, stream + 4 + len, got - 4 - len);
+      got -= 4 + len;
+    }
+  }
+
+  return NULL;
+}
+
+static void peer_new(struct sftp_server_peer *peer) {
+  memset(peer, 0, sizeof(*peer));
+  peer->fail_at = FILE_LEN;
+  /* the replies are read from the socket, as after a connection */
+  torture_peer_new(&peer->base, TORTURE_PEER_PACKETS);
+  peer->channel = torture_peer_channel(&peer->base, 10000000, 32768);
+  peer->channel->local_window = 10000000;
+
+  /* a session without the init, with a file opened as "h" */
+  peer->sftp = sftp_server_new(peer->base.session, peer->channel);
+  assert_true(peer->sftp != NULL);
+  peer->sftp->version = 3;
+  peer->file = calloc(1, sizeof(struct sftp_file_struct));
+  assert_true(peer->file != NULL);
+  peer->file->sftp = peer->sftp;
+  peer->file->handle = ssh_string_from_char("h");
+
+  assert_int_equal(pthread_create(&peer->thread, NULL, peer_serve, peer), 0);
+}
+
+static void peer_free(struct sftp_server_peer *peer) {
+  assert_int_equal(sftp_close(peer->file), 0);
+  peer->channel->state = SSH_CHANNEL_STATE_CLOSED;
+  sftp_free(peer->sftp);
+  shutdown(peer->base.fd, SHUT_RDWR);
+  pthread_join(peer->thread, NULL);
+  torture_peer_free(&peer->base);
+}
+
+static void check_data(const unsigned char *data, uint64_t offset,
+    size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    assert_int_equal(data[i], file_byte(offset + i));
+  }
+}
+
+static void torture_sftp_client_packet_read(void **state) {
+  /* a status, then a handle "h" of the same length */
+  static const unsigned char data[] = {
+    0, 0, 0, 10, SSH_FXP_STATUS, 0, 0, 0, 1, 0, 0, 0, 0, 0xaa,
+    0, 0, 0, 10, SSH_FXP_HANDLE, 0, 0, 0, 2, 0, 0, 0, 1, 'h'
+  };
+  struct sftp_server_peer peer;
+  sftp_packet packet;
+  sftp_packet first;
+
+  (void) state;
+
+  peer_new(&peer);
+
+  /* the header in pieces, then the body with the next packet */
+  peer_write(&peer, data, 2);
+  peer_write(&peer, data + 2, 4);
+  peer_write(&peer, data + 6, sizeof(data) - 6);
+  packet = sftp_packet_read(peer.sftp);
+  assert_true(packet != NULL);
+  assert_int_equal(packet->type, SSH_FXP_STATUS);
+  assert_int_equal(buffer_get_rest_len(packet->payload), 9);
+  assert_memory_equal(buffer_get_rest(packet->payload), data + 5, 9);
+  first = packet;
+  sftp_packet_free(packet);
+
+  /* the freed packet is read again */
+  packet = sftp_packet_read(peer.sftp);
+  assert_true(packet == first);
+  assert_int_equal(packet->type, SSH_FXP_HANDLE);
+  assert_int_equal(buffer_get_rest_len(packet->payload), 9);
+  assert_memory_equal(buffer_get_rest(packet->payload), data + 19, 9);
+  sftp_packet_free(packet);
+
+  peer_free(&peer);
+}
+
+static void torture_sftp_client_read_ahead(void **state) {
+  struct sftp_server_peer peer;
+  unsigned char data[4096];
+  uint64_t total = 0;
+  ssize_t n;
+
+  (void) state;
+
+  peer_new(&peer);
+
+  /* small sequential reads, the file comes in fewer and bigger READs */
+  while ((n = sftp_read(peer.file, data, sizeof(data))) > 0) {
+    check_data(data, total, n);
+    total += n;
+    assert_int_equal(sftp_tell64(peer.file), total);
+  }
+  assert_int_equal(n, 0);
+  assert_int_equal(total, FILE_LEN);
+  assert_true(peer.reads < FILE_LEN / (int) sizeof(data));
+
+  peer_free(&peer);
+}
+
+static void torture_sftp_client_read_seek(void **state) {
+  struct sftp_server_peer peer;
+  unsigned char data[1000];
+  uint64_t offset;
+  ssize_t n;
+  int i;
+
+  (void) state;
+
+  peer_new(&peer);
+
+  for (i = 0; i < 5; i++) {
+    assert_int_equal(sftp_read(peer.file, data, sizeof(data)), sizeof(data));
+  }
+  check_data(data, 4000, sizeof(data));
+
+  /* a seek drops what was read ahead, the reads are right after it */
+  assert_int_equal(sftp_seek64(peer.file, 50000), 0);
+  for (i = 0; i < 5; i++) {
+    n = sftp_read(peer.file, data, sizeof(data));
+    assert_int_equal(n, sizeof(data));
+    check_data(data, 50000 + i * sizeof(data), sizeof(data));
+  }
+  sftp_rewind(peer.file);
+  assert_int_equal(sftp_read(peer.file, data, 10), 10);
+  check_data(data, 0, 10);
+
+  /* the end of the file, in the middle of a read ahead */
+  offset = FILE_LEN - 2500;
+  assert_int_equal(sftp_seek64(peer.file, offset), 0);
+  while ((n = sftp_read(peer.file, data, sizeof(data))) > 0) {
+    check_data(data, offset, n);
+    offset += n;
+  }
+  assert_int_equal(n, 0);
+  assert_int_equal(offset, FILE_LEN);
+
+  peer_free(&peer);
+}
+
+static void torture_sftp_client_write_behind(void **state) {
+  struct sftp_server_peer peer;
+  unsigned char data[FILE_LEN];
+  uint64_t offset;
+
+  (void) state;
+
+  peer_new(&peer);
+  for (offset = 0; offset < FILE_LEN; offset++) {
+    data[offset] = file_byte(offset);
+  }
+
+  /* small writes, the file goes in WRITEs of 32k */
+  assert_int_equal(sftp_file_set_write_behind(peer.file, 1), SSH_OK);
+  for (offset = 0; offset < FILE_LEN; offset += 100) {
+    assert_int_equal(sftp_write(peer.file, data + offset, 100), 100);
+  }
+  assert_int_equal(sftp_tell64(peer.file), FILE_LEN);
+  assert_int_equal(sftp_flush(peer.file), SSH_OK);
+  assert_int_equal(peer.writes, (FILE_LEN + 32767) / 32768);
+  assert_int_equal(peer.written_len, FILE_LEN);
+  assert_memory_equal(peer.written, data, FILE_LEN);
+
+  /* after a seek, the writes gathered go at their own offset */
+  assert_int_equal(sftp_seek64(peer.file, 10), 0);
+  assert_int_equal(sftp_write(peer.file, "xyz", 3), 3);
+  assert_int_equal(sftp_seek64(peer.file, 20), 0);
+  assert_int_equal(sftp_write(peer.file, "uv", 2), 2);
+  assert_int_equal(sftp_file_set_write_behind(peer.file, 0), SSH_OK);
+  assert_memory_equal(peer.written + 10, "xyz", 3);
+  assert_memory_equal(peer.written + 13, data + 13, 7);
+  assert_memory_equal(peer.written + 20, "uv", 2);
+
+  peer_free(&peer);
+}
+
+static void torture_sftp_client_write_behind_failed(void **state) {
+  struct sftp_server_peer peer;
+  unsigned char data[1000];
+  uint64_t offset;
+
+  (void) state;
+
+  peer_new(&peer);
+  peer.fail_at = 50000;
+  memset(data, 'a', sizeof(data));
+
+  /* the WRITEs fail after the writes returned, the flush tells it */
+  assert_int_equal(sftp_file_set_write_behind(peer.file, 1), SSH_OK);
+  for (offset = 0; offset < FILE_LEN; offset += sizeof(data)) {
+    assert_int_equal(sftp_write(peer.file, data, sizeof(data)),
+        sizeof(data));
+  }
+  assert_int_equal(sftp_flush(peer.file), SSH_ERROR);
+  assert_int_equal(sftp_get_error(peer.sftp), SSH_FX_FAILURE);
+  assert_int_equal(peer.written_len, 32768);
+
+  /* once */
+  assert_int_equal(sftp_flush(peer.file), SSH_OK);
+
+  peer_free(&peer);
+}
+
+static void torture_sftp_client_stat_cache(void **state) {
+  struct sftp_server_peer peer;
+  sftp_attributes attr;
+  sftp_dir dir;
+  int stats;
+
+  (void) state;
+
+  peer_new(&peer);
+  assert_int_equal(sftp_set_stat_cache(peer.sftp, 60000), SSH_OK);
+
+  /* a stat is asked once, it doesn't answer the lstat */
+  attr = sftp_stat(peer.sftp, "/dir/a");
+  assert_true(attr != NULL);
+  assert_int_equal(attr->size, 60);
+  sftp_attributes_free(attr);
+  attr = sftp_stat(peer.sftp, "/dir/a");
+  assert_true(attr != NULL);
+  assert_int_equal(attr->size, 60);
+  sftp_attributes_free(attr);
+  assert_int_equal(peer.stats, 1);
+  attr = sftp_lstat(peer.sftp, "/dir/a");
+  assert_true(attr != NULL);
+  sftp_attributes_free(attr);
+  assert_int_equal(peer.stats, 2);
+
+  /* the entries of a directory answer their lstat, and their stat too */
+  dir = sftp_opendir(peer.sftp, "/dir");
+  assert_true(dir != NULL);
+  while ((attr = sftp_readdir(peer.sftp, dir)) != NULL) {
+    sftp_attributes_free(attr);
+  }
+  assert_int_equal(sftp_closedir(dir), 0);
+  attr = sftp_stat(peer.sftp, "/dir/a");
+  assert_true(attr != NULL);
+  assert_int_equal(attr->size, 1);
+  sftp_attributes_free(attr);
+  attr = sftp_lstat(peer.sftp, "/dir/link");
+  assert_true(attr != NULL);
+  assert_int_equal(attr->size, 3);
+  sftp_attributes_free(attr);
+  assert_int_equal(peer.stats, 2);
+  /* unless they are links */
+  attr = sftp_stat(peer.sftp, "/dir/link");
+  assert_true(attr != NULL);
+  assert_int_equal(attr->size, 90);
+  sftp_attributes_free(attr);
+  assert_int_equal(peer.stats, 3);
+
+  /* what the session changes is asked again */
+  stats = peer.stats;
+  assert_int_equal(sftp_chmod(peer.sftp, "/dir/b", 0600), 0);
+  attr = sftp_stat(peer.sftp, "/dir/b");
+  assert_true(attr != NULL);
+  assert_int_equal(attr->size, 60);
+  sftp_attributes_free(attr);
+  assert_int_equal(peer.stats, stats + 1);
+  assert_int_equal(sftp_rename(peer.sftp, "/dir", "/other"), 0);
+  attr = sftp_lstat(peer.sftp, "/dir/link");
+  assert_true(attr != NULL);
+  assert_int_equal(attr->size, 90);
+  sftp_attributes_free(attr);
+  assert_int_equal(peer.stats, stats + 2);
+  sftp_stat_cache_invalidate(peer.sftp, NULL);
+  attr = sftp_lstat(peer.sftp, "/dir/link");
+  assert_true(attr != NULL);
+  sftp_attributes_free(attr);
+  assert_int_equal(peer.stats, stats + 3);
+
+  /* and once the time is over */
+  assert_int_equal(sftp_set_stat_cache(peer.sftp, 1), SSH_OK);
+  attr = sftp_stat(peer.sftp, "/dir/a");
+  assert_true(attr != NULL);
+  sftp_attributes_free(attr);
+  usleep(5000);
+  attr = sftp_stat(peer.sftp, "/dir/a");
+  assert_true(attr != NULL);
+  sftp_attributes_free(attr);
+  assert_int_equal(peer.stats, stats + 5);
+
+  assert_int_equal(sftp_set_stat_cache(peer.sftp, 0), SSH_OK);
+  peer_free(&peer);
+}
+
+/* calls sftp_init_nonblocking() until it doesn't return SSH_AGAIN */
+static int init_wait(sftp_session sftp) {
+  int rc = SSH_AGAIN;
+  int i;
+
+  for (i = 0; i < 1000 && rc == SSH_AGAIN; i++) {
+    rc = sftp_init_nonblocking(sftp);
+    if (rc == SSH_AGAIN) {
+      usleep(1000);
+    }
+  }
+
+  return rc;
+}
+
+static void torture_sftp_client_init_nonblocking(void **state) {
+  struct sftp_server_peer peer;
+  ssh_channel channel;
+  ssh_buffer payload;
+  sftp_session sftp;
+
+  (void) state;
+
+  peer_new(&peer);
+  ssh_set_blocking(peer.base.session, 0);
+
+  /* nothing is sent before the first call */
+  sftp = sftp_new_nonblocking(peer.base.session);
+  assert_true(sftp != NULL);
+  assert_int_equal(sftp_init_nonblocking(sftp), SSH_AGAIN);
+  assert_int_equal(sftp_init_nonblocking(sftp), SSH_AGAIN);
+
+  /* the channel is opened, then the subsystem started */
+  payload = ssh_buffer_new();
+  assert_true(payload != NULL);
+  assert_int_equal(buffer_pack(payload, "bdddd",
+        SSH2_MSG_CHANNEL_OPEN_CONFIRMATION, sftp->channel->local_channel,
+        7, 1000000, 32768), 0);
+  torture_peer_send(&peer.base, payload);
+  assert_int_equal(init_wait(sftp), SSH_AGAIN);
+  assert_true(ssh_channel_is_open(sftp->channel));
+
+  /* the server answers the init on the new channel */
+  channel = peer.channel;
+  peer.channel = sftp->channel;
+  payload = ssh_buffer_new();
+  assert_true(payload != NULL);
+  assert_int_equal(buffer_pack(payload, "bd", SSH2_MSG_CHANNEL_SUCCESS,
+        sftp->channel->local_channel), 0);
+  torture_peer_send(&peer.base, payload);
+  assert_int_equal(init_wait(sftp), SSH_OK);
+  assert_int_equal(sftp_server_version(sftp), 3);
+  assert_int_equal(sftp_extensions_get_count(sftp), 1);
+  assert_int_equal(sftp_extension_supported(sftp, "x@example.com", "1"), 1);
+  assert_int_equal(sftp_init_nonblocking(sftp), SSH_OK);
+
+  sftp_free(sftp);
+  peer.channel = channel;
+  ssh_set_blocking(peer.base.session, 1);
+  peer_free(&peer);
+}
+
+static void torture_sftp_client_async_open(void **state) {
+  struct sftp_server_peer peer;
+  unsigned char data[4096];
+  sftp_file missing;
+  sftp_file file;
+  uint64_t total = 0;
+  ssize_t n;
+  int rc = SSH_AGAIN;
+  int i;
+
+  (void) state;
+
+  peer_new(&peer);
+
+  /* both OPENs are in flight at once */
+  file = sftp_async_open_begin(peer.sftp, "/f", O_RDONLY, 0, 4);
+  assert_true(file != NULL);
+  missing = sftp_async_open_begin(peer.sftp, "/missing", O_RDONLY, 0, 4);
+  assert_true(missing != NULL);
+  sftp_file_set_nonblocking(missing);
+  for (i = 0; i < 1000 && rc == SSH_AGAIN; i++) {
+    rc = sftp_async_open(missing);
+    usleep(1000);
+  }
+  assert_int_equal(rc, SSH_ERROR);
+  assert_int_equal(sftp_get_error(peer.sftp), SSH_FX_NO_SUCH_FILE);
+  assert_int_equal(sftp_close(missing), 0);
+
+  /* the answer to the other one was queued, the READs follow it */
+  sftp_file_set_nonblocking(file);
+  assert_int_equal(sftp_async_open(file), SSH_OK);
+  for (i = 0; i < 1000 && peer.reads < 4; i++) {
+    ssh_handle_packets(peer.base.session, 0);
+    usleep(1000);
+  }
+  assert_int_equal(peer.reads, 4);
+
+  sftp_file_set_blocking(file);
+  while ((n = sftp_read(file, data, sizeof(data))) > 0) {
+    check_data(data, total, n);
+    total += n;
+  }
+  assert_int_equal(n, 0);
+  assert_int_equal(total, FILE_LEN);
+  assert_int_equal(sftp_close(file), 0);
+
+  /* an OPEN in flight gets its handle closed */
+  file = sftp_async_open_begin(peer.sftp, "/g", O_RDONLY, 0, 0);
+  assert_true(file != NULL);
+  assert_int_equal(sftp_close(file), 0);
+
+  peer_free(&peer);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_sftp_client_packet_read),
+        unit_test(torture_sftp_client_read_ahead),
+        unit_test(torture_sftp_client_read_seek),
+        unit_test(torture_sftp_client_write_behind),
+        unit_test(torture_sftp_client_write_behind_failed),
+        unit_test(torture_sftp_client_stat_cache),
+        unit_test(torture_sftp_client_init_nonblocking),
+        unit_test(torture_sftp_client_async_open),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
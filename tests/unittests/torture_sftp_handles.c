@@ -0,0 +1,73 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/sftp.h"
+
+#define HANDLES_COUNT 3000
+
+static void torture_sftp_handles(void **state) {
+    ssh_session session;
+    sftp_session sftp;
+    ssh_string handles[HANDLES_COUNT];
+    ssh_string stale;
+    int infos[HANDLES_COUNT];
+    int i;
+
+    (void) state;
+
+    session = ssh_new();
+    assert_true(session != NULL);
+    sftp = sftp_server_new(session, NULL);
+    assert_true(sftp != NULL);
+
+    /* the table grows past its first size */
+    for (i = 0; i < HANDLES_COUNT; i++) {
+        handles[i] = sftp_handle_alloc(sftp, &infos[i]);
+        assert_true(handles[i] != NULL);
+    }
+    assert_true(sftp->handles_size >= HANDLES_COUNT);
+    for (i = 0; i < HANDLES_COUNT; i++) {
+        assert_true(sftp_handle(sftp, handles[i]) == &infos[i]);
+    }
+
+    /* a released handle doesn't find the info given to its slot again */
+    stale = handles[10];
+    assert_int_equal(sftp_handle_release(sftp, stale), 0);
+    assert_true(sftp_handle(sftp, stale) == NULL);
+    assert_int_equal(sftp_handle_release(sftp, stale), -1);
+    handles[10] = sftp_handle_alloc(sftp, &infos[10]);
+    assert_true(handles[10] != NULL);
+    assert_true(sftp_handle(sftp, handles[10]) == &infos[10]);
+    assert_true(sftp_handle(sftp, stale) == NULL);
+    ssh_string_free(stale);
+
+    /* nor does one removed by its info */
+    sftp_handle_remove(sftp, &infos[20]);
+    assert_true(sftp_handle(sftp, handles[20]) == NULL);
+
+    /* handles which aren't ours */
+    stale = ssh_string_new(4);
+    assert_true(stale != NULL);
+    assert_true(sftp_handle(sftp, stale) == NULL);
+    ssh_string_free(stale);
+
+    for (i = 0; i < HANDLES_COUNT; i++) {
+        sftp_handle_release(sftp, handles[i]);
+        ssh_string_free(handles[i]);
+    }
+
+    sftp_free(sftp);
+    ssh_free(session);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_sftp_handles),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
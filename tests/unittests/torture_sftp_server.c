@@ -0,0 +1,591 @@
+#define LIBSSH_STATIC
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+#include "libssh/buffer.h"
+#include "libssh/ssh2.h"
+#include "libssh/sftp.h"
+#include "libssh/callbacks.h"
+
+struct sftp_peer {
+  struct torture_peer base;
+  ssh_channel channel;
+  sftp_session sftp;
+  /* the last reply read */
+  uint8_t type;
+  uint32_t id;
+  uint32_t value;
+  unsigned char reply[40000];
+};
+
+/* a server session on a socketpair, with an open channel */
+static void sftp_peer_new(struct sftp_peer *peer) {
+  torture_peer_new(&peer->base, TORTURE_PEER_SERVER);
+  peer->channel = torture_peer_channel(&peer->base, 1000000, 32768);
+
+  peer->sftp = sftp_server_new(peer->base.session, peer->channel);
+  assert_true(peer->sftp != NULL);
+}
+
+static void sftp_peer_free(struct sftp_peer *peer) {
+  peer->channel->state = SSH_CHANNEL_STATE_CLOSED;
+  sftp_free(peer->sftp);
+  torture_peer_free(&peer->base);
+}
+
+/* sends the first len bytes of data as channel data of the client */
+static void sftp_peer_data(struct sftp_peer *peer, const void *data,
+    uint32_t len) {
+  ssh_buffer packet;
+
+  packet = ssh_buffer_new();
+  assert_true(packet != NULL);
+  assert_int_equal(buffer_pack(packet, "ddP",
+        peer->channel->local_channel, len, (size_t) len, data), 0);
+  channel_rcv_data(peer->base.session, SSH2_MSG_CHANNEL_DATA, packet, NULL);
+  ssh_buffer_free(packet);
+}
+
+/* a request of the client with an id and a string */
+static void sftp_peer_request(struct sftp_peer *peer, uint8_t type,
+    uint32_t id, const char *path) {
+  ssh_buffer req;
+
+  req = ssh_buffer_new();
+  assert_true(req != NULL);
+  assert_int_equal(buffer_pack(req, "dbds",
+        (uint32_t) (9 + strlen(path)), type, id, path), 0);
+  sftp_peer_data(peer, buffer_get_rest(req), buffer_get_rest_len(req));
+  ssh_buffer_free(req);
+}
+
+/* reads one reply of the server: its type, its id and the integer after */
+static void sftp_peer_reply(struct sftp_peer *peer) {
+  unsigned char packet[40000];
+  uint32_t len;
+  uint32_t got = 0;
+  uint32_t v[3];
+
+  do {
+    torture_peer_read(&peer->base, packet, sizeof(packet));
+    /* padding length and message type, the window adjusts are skipped */
+    if (packet[1] == SSH2_MSG_CHANNEL_WINDOW_ADJUST) {
+      continue;
+    }
+
+    /* channel, data length, then the sftp packet, maybe in pieces */
+    assert_int_equal(packet[1], SSH2_MSG_CHANNEL_DATA);
+    memcpy(&len, packet + 6, sizeof(len));
+    len = ntohl(len);
+    assert_true(got + len <= sizeof(peer->reply));
+    memcpy(peer->reply + got, packet + 10, len);
+    got += len;
+    memcpy(&len, peer->reply, sizeof(len));
+  } while (got < sizeof(len) || got < sizeof(len) + ntohl(len));
+  assert_int_equal(got, sizeof(len) + ntohl(len));
+
+  peer->type = peer->reply[4];
+  memcpy(v, peer->reply + 5, sizeof(v));
+  peer->id = ntohl(v[0]);
+  peer->value = ntohl(v[1]);
+}
+
+static sftp_client_message held;
+
+/* keeps the reads to answer them later */
+static int sftp_peer_read(sftp_client_message msg, void *userdata) {
+  int *count = userdata;
+
+  (*count)++;
+  held = msg;
+
+  return SSH_OK;
+}
+
+static int sftp_peer_stat(sftp_client_message msg, void *userdata) {
+  struct sftp_attributes_struct attr;
+
+  (void) userdata;
+
+  assert_string_equal(msg->filename, "/stat");
+  ZERO_STRUCT(attr);
+  attr.flags = SSH_FILEXFER_ATTR_SIZE;
+  attr.size = 42;
+  assert_int_equal(sftp_reply_attr(msg, &attr), 0);
+  sftp_client_message_free(msg);
+
+  return SSH_OK;
+}
+
+static int sftp_peer_refuse(sftp_client_message msg, void *userdata) {
+  (void) msg;
+  (void) userdata;
+
+  return SSH_ERROR;
+}
+
+static void torture_sftp_server_dispatch(void **state) {
+  struct sftp_peer peer;
+  unsigned char init[9] = { 0, 0, 0, 5, SSH_FXP_INIT, 0, 0, 0, 3 };
+  ssh_buffer read;
+  int reads = 0;
+
+  (void) state;
+
+  sftp_peer_new(&peer);
+  assert_int_equal(sftp_server_set_handler(peer.sftp, SSH_FXP_READ,
+        sftp_peer_read, &reads), SSH_OK);
+  assert_int_equal(sftp_server_set_handler(peer.sftp, SSH_FXP_STAT,
+        sftp_peer_stat, NULL), SSH_OK);
+  assert_int_equal(sftp_server_set_handler(peer.sftp, SSH_FXP_REMOVE,
+        sftp_peer_refuse, NULL), SSH_OK);
+  assert_int_equal(sftp_server_set_handler(peer.sftp, SSH_FXP_INIT,
+        sftp_peer_refuse, NULL), SSH_ERROR);
+
+  /* the data received before the start is dispatched first */
+  assert_int_equal(channel_default_bufferize(peer.channel, init, 3, 0), 0);
+  assert_int_equal(sftp_server_start(peer.sftp), SSH_OK);
+  sftp_peer_data(&peer, init + 3, sizeof(init) - 3);
+  sftp_peer_reply(&peer);
+  assert_int_equal(peer.type, SSH_FXP_VERSION);
+  assert_int_equal(peer.id, LIBSFTP_VERSION);
+  assert_int_equal(peer.sftp->version, 3);
+
+  /* a read cut in two waits for its end */
+  read = ssh_buffer_new();
+  assert_true(read != NULL);
+  assert_int_equal(buffer_pack(read, "dbdsqd", 25, SSH_FXP_READ, 7, "ABCD",
+        (uint64_t) 16, 4096), 0);
+  sftp_peer_data(&peer, buffer_get_rest(read), 10);
+  assert_int_equal(reads, 0);
+  sftp_peer_data(&peer, (char *) buffer_get_rest(read) + 10,
+      buffer_get_rest_len(read) - 10);
+  ssh_buffer_free(read);
+  assert_int_equal(reads, 1);
+  assert_true(held != NULL);
+  assert_true(held->offset == 16);
+  assert_int_equal(held->len, 4096);
+
+  /* the stat behind it is answered before the read */
+  sftp_peer_request(&peer, SSH_FXP_STAT, 8, "/stat");
+  sftp_peer_reply(&peer);
+  assert_int_equal(peer.type, SSH_FXP_ATTRS);
+  assert_int_equal(peer.id, 8);
+  assert_int_equal(peer.value, SSH_FILEXFER_ATTR_SIZE);
+  assert_int_equal(sftp_reply_data(held, "data", 4), 0);
+  sftp_client_message_free(held);
+  sftp_peer_reply(&peer);
+  assert_int_equal(peer.type, SSH_FXP_DATA);
+  assert_int_equal(peer.id, 7);
+  assert_int_equal(peer.value, 4);
+
+  /* no handler, or a handler which doesn't take the request */
+  sftp_peer_request(&peer, SSH_FXP_RMDIR, 9, "/dir");
+  sftp_peer_reply(&peer);
+  assert_int_equal(peer.type, SSH_FXP_STATUS);
+  assert_int_equal(peer.id, 9);
+  assert_int_equal(peer.value, SSH_FX_OP_UNSUPPORTED);
+  sftp_peer_request(&peer, SSH_FXP_REMOVE, 10, "/file");
+  sftp_peer_reply(&peer);
+  assert_int_equal(peer.type, SSH_FXP_STATUS);
+  assert_int_equal(peer.id, 10);
+  assert_int_equal(peer.value, SSH_FX_FAILURE);
+
+  /* a broken packet closes the channel */
+  sftp_peer_data(&peer, "\x7f\0\0\0", 4);
+  assert_true(peer.channel->state == SSH_CHANNEL_STATE_CLOSED);
+
+  sftp_peer_free(&peer);
+}
+
+/* answers the reads from the file */
+static int sftp_peer_read_fd(sftp_client_message msg, void *userdata) {
+  int *fd = userdata;
+  int rc;
+
+  rc = sftp_reply_data_fd(msg, *fd, msg->offset, msg->len);
+  sftp_client_message_free(msg);
+
+  return rc == 0 ? SSH_OK : SSH_ERROR;
+}
+
+static void sftp_peer_read_file(struct sftp_peer *peer, uint32_t id,
+    uint64_t offset, uint32_t len) {
+  ssh_buffer read;
+
+  read = ssh_buffer_new();
+  assert_true(read != NULL);
+  assert_int_equal(buffer_pack(read, "dbdsqd", 25, SSH_FXP_READ, id, "ABCD",
+        offset, len), 0);
+  sftp_peer_data(peer, buffer_get_rest(read), buffer_get_rest_len(read));
+  ssh_buffer_free(read);
+  sftp_peer_reply(peer);
+}
+
+static void torture_sftp_server_data_fd(void **state) {
+  struct sftp_peer peer;
+  unsigned char init[9] = { 0, 0, 0, 5, SSH_FXP_INIT, 0, 0, 0, 3 };
+  char path[] = "sftp_data_fd_XXXXXX";
+  char data[20000];
+  int fd;
+  int i;
+
+  (void) state;
+
+  for (i = 0; i < (int) sizeof(data); i++) {
+    data[i] = (char) (i * 7 + i / 251);
+  }
+  fd = mkstemp(path);
+  assert_true(fd >= 0);
+  assert_int_equal(write(fd, data, sizeof(data)), sizeof(data));
+
+  sftp_peer_new(&peer);
+  assert_int_equal(sftp_server_set_handler(peer.sftp, SSH_FXP_READ,
+        sftp_peer_read_fd, &fd), SSH_OK);
+  assert_int_equal(sftp_server_start(peer.sftp), SSH_OK);
+  sftp_peer_data(&peer, init, sizeof(init));
+  sftp_peer_reply(&peer);
+  assert_int_equal(peer.type, SSH_FXP_VERSION);
+
+  /* in the middle of the file, then cut at its end */
+  sftp_peer_read_file(&peer, 1, 100, 4096);
+  assert_int_equal(peer.type, SSH_FXP_DATA);
+  assert_int_equal(peer.id, 1);
+  assert_int_equal(peer.value, 4096);
+  assert_memory_equal(peer.reply + 13, data + 100, 4096);
+  sftp_peer_read_file(&peer, 2, 19000, 4096);
+  assert_int_equal(peer.type, SSH_FXP_DATA);
+  assert_int_equal(peer.id, 2);
+  assert_int_equal(peer.value, 1000);
+  assert_memory_equal(peer.reply + 13, data + 19000, 1000);
+
+  /* nothing left to read */
+  sftp_peer_read_file(&peer, 3, sizeof(data), 4096);
+  assert_int_equal(peer.type, SSH_FXP_STATUS);
+  assert_int_equal(peer.id, 3);
+  assert_int_equal(peer.value, SSH_FX_EOF);
+
+  /* larger than a packet, the reply is copied and split */
+  peer.channel->remote_maxpacket = 1034;
+  sftp_peer_read_file(&peer, 4, 0, 3000);
+  assert_int_equal(peer.type, SSH_FXP_DATA);
+  assert_int_equal(peer.id, 4);
+  assert_int_equal(peer.value, 3000);
+  assert_memory_equal(peer.reply + 13, data, 3000);
+
+  sftp_peer_free(&peer);
+  close(fd);
+  unlink(path);
+}
+
+/* keeps the request to look at it */
+static int sftp_peer_keep(sftp_client_message msg, void *userdata) {
+  sftp_client_message *kept = userdata;
+
+  *kept = msg;
+
+  return SSH_OK;
+}
+
+static void torture_sftp_server_messages(void **state) {
+  struct sftp_peer peer;
+  unsigned char init[9] = { 0, 0, 0, 5, SSH_FXP_INIT, 0, 0, 0, 3 };
+  sftp_client_message kept = NULL;
+  sftp_client_message first;
+  ssh_buffer req;
+
+  (void) state;
+
+  sftp_peer_new(&peer);
+  assert_int_equal(sftp_server_set_handler(peer.sftp, SSH_FXP_WRITE,
+        sftp_peer_keep, &kept), SSH_OK);
+  assert_int_equal(sftp_server_set_handler(peer.sftp, SSH_FXP_RENAME,
+        sftp_peer_keep, &kept), SSH_OK);
+  assert_int_equal(sftp_server_start(peer.sftp), SSH_OK);
+  sftp_peer_data(&peer, init, sizeof(init));
+  sftp_peer_reply(&peer);
+  assert_int_equal(peer.type, SSH_FXP_VERSION);
+
+  /* the handle and the data of a write are in its packet */
+  req = ssh_buffer_new();
+  assert_true(req != NULL);
+  assert_int_equal(buffer_pack(req, "dbdsqs", 32, SSH_FXP_WRITE, 1, "ABCD",
+        (uint64_t) 5, "written"), 0);
+  sftp_peer_data(&peer, buffer_get_rest(req), buffer_get_rest_len(req));
+  assert_true(kept != NULL);
+  assert_true(kept->offset == 5);
+  assert_int_equal(ssh_string_len(kept->handle), 4);
+  assert_memory_equal(ssh_string_data(kept->handle), "ABCD", 4);
+  assert_int_equal(ssh_string_len(kept->data), 7);
+  assert_memory_equal(ssh_string_data(kept->data), "written", 7);
+  first = kept;
+  sftp_client_message_free(kept);
+  kept = NULL;
+
+  /* the freed request is reused, the names end where they should */
+  buffer_reinit(req);
+  assert_int_equal(buffer_pack(req, "dbdss", 23, SSH_FXP_RENAME, 2, "/old",
+        "/newer"), 0);
+  sftp_peer_data(&peer, buffer_get_rest(req), buffer_get_rest_len(req));
+  ssh_buffer_free(req);
+  assert_true(kept == first);
+  assert_int_equal(kept->type, SSH_FXP_RENAME);
+  assert_string_equal(kept->filename, "/old");
+  assert_int_equal(ssh_string_len(kept->data), 6);
+  assert_memory_equal(ssh_string_data(kept->data), "/newer", 6);
+  assert_true(kept->handle == NULL);
+  sftp_client_message_free(kept);
+
+  sftp_peer_free(&peer);
+}
+
+/* lists the directory */
+static int sftp_peer_readdir(sftp_client_message msg, void *userdata) {
+  DIR *dir = userdata;
+  int rc;
+
+  rc = sftp_reply_names_dir(msg, dir);
+  sftp_client_message_free(msg);
+
+  return rc < 0 ? SSH_ERROR : SSH_OK;
+}
+
+static void torture_sftp_server_names_dir(void **state) {
+  struct sftp_peer peer;
+  unsigned char init[9] = { 0, 0, 0, 5, SSH_FXP_INIT, 0, 0, 0, 3 };
+  char path[] = "sftp_names_dir_XXXXXX";
+  char name[64];
+  int seen[40] = {0};
+  unsigned char *p;
+  uint32_t count;
+  uint32_t len;
+  uint32_t flags;
+  uint32_t value;
+  int replies = 0;
+  int entries = 0;
+  DIR *dir;
+  int fd;
+  int i;
+
+  (void) state;
+
+  assert_true(mkdtemp(path) != NULL);
+  for (i = 0; i < 40; i++) {
+    snprintf(name, sizeof(name), "%s/file_with_a_long_name_%02d", path, i);
+    fd = open(name, O_WRONLY | O_CREAT, 0640);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, name, i), i);
+    close(fd);
+  }
+  dir = opendir(path);
+  assert_true(dir != NULL);
+
+  sftp_peer_new(&peer);
+  /* a few entries a reply */
+  peer.channel->remote_maxpacket = 1034;
+  assert_int_equal(sftp_server_set_handler(peer.sftp, SSH_FXP_READDIR,
+        sftp_peer_readdir, dir), SSH_OK);
+  assert_int_equal(sftp_server_start(peer.sftp), SSH_OK);
+  sftp_peer_data(&peer, init, sizeof(init));
+  sftp_peer_reply(&peer);
+  assert_int_equal(peer.type, SSH_FXP_VERSION);
+
+  for (;;) {
+    sftp_peer_request(&peer, SSH_FXP_READDIR, 100 + replies, "ABCD");
+    sftp_peer_reply(&peer);
+    assert_int_equal(peer.id, 100 + replies);
+    if (peer.type == SSH_FXP_STATUS) {
+      assert_int_equal(peer.value, SSH_FX_EOF);
+      break;
+    }
+    assert_int_equal(peer.type, SSH_FXP_NAME);
+    memcpy(&len, peer.reply, sizeof(len));
+    assert_true(ntohl(len) + 4 <= 1024);
+    replies++;
+
+    /* name, long name and attributes of each entry */
+    count = peer.value;
+    assert_true(count > 0);
+    p = peer.reply + 13;
+    while (count-- > 0) {
+      memcpy(&len, p, sizeof(len));
+      len = ntohl(len);
+      assert_true(len < sizeof(name));
+      memcpy(name, p + 4, len);
+      name[len] = '\0';
+      p += 4 + len;
+      memcpy(&len, p, sizeof(len));
+      p += 4 + ntohl(len);
+      memcpy(&flags, p, sizeof(flags));
+      p += 4;
+      assert_int_equal(ntohl(flags), SSH_FILEXFER_ATTR_SIZE |
+          SSH_FILEXFER_ATTR_UIDGID | SSH_FILEXFER_ATTR_PERMISSIONS |
+          SSH_FILEXFER_ATTR_ACMODTIME);
+      if (strncmp(name, "file_with_a_long_name_", 22) == 0) {
+        i = atoi(name + 22);
+        assert_int_equal(seen[i], 0);
+        seen[i] = 1;
+        /* the low half of the size, and the permissions */
+        memcpy(&value, p + 4, sizeof(value));
+        assert_int_equal(ntohl(value), i);
+        memcpy(&value, p + 16, sizeof(value));
+        assert_int_equal(ntohl(value) & 0777, 0640);
+      }
+      p += 8 + 5 * 4;
+      entries++;
+    }
+    assert_true(p == peer.reply + 4 + ntohl(*(uint32_t *) peer.reply));
+  }
+
+  /* each file once, with . and .. */
+  assert_int_equal(entries, 42);
+  assert_true(replies > 1);
+  for (i = 0; i < 40; i++) {
+    assert_int_equal(seen[i], 1);
+  }
+
+  sftp_peer_free(&peer);
+  closedir(dir);
+  for (i = 0; i < 40; i++) {
+    snprintf(name, sizeof(name), "%s/file_with_a_long_name_%02d", path, i);
+    unlink(name);
+  }
+  rmdir(path);
+}
+
+struct pool_test {
+  sftp_server_pool pool;
+  pthread_mutex_t lock;
+  int running;
+  int most;
+};
+
+/* the first read is slow: the ones behind it are answered before */
+static void pool_test_work(sftp_client_message msg, void *userdata) {
+  struct pool_test *test = userdata;
+
+  pthread_mutex_lock(&test->lock);
+  test->running++;
+  if (test->running > test->most) {
+    test->most = test->running;
+  }
+  pthread_mutex_unlock(&test->lock);
+
+  usleep(msg->offset == 0 ? 200 * 1000 : 10 * 1000);
+
+  pthread_mutex_lock(&test->lock);
+  test->running--;
+  pthread_mutex_unlock(&test->lock);
+}
+
+static void pool_test_done(sftp_client_message msg, void *userdata) {
+  (void) userdata;
+
+  assert_int_equal(sftp_reply_data(msg, "data", 4), 0);
+  sftp_client_message_free(msg);
+}
+
+static int pool_test_read(sftp_client_message msg, void *userdata) {
+  struct pool_test *test = userdata;
+
+  return sftp_server_pool_submit(test->pool, msg, pool_test_work,
+      pool_test_done, test);
+}
+
+static void *pool_test_worker(void *userdata) {
+  struct pool_test *test = userdata;
+
+  assert_int_equal(sftp_server_pool_run(test->pool), SSH_OK);
+
+  return NULL;
+}
+
+static void torture_sftp_server_pool(void **state) {
+  struct sftp_peer peer;
+  struct pool_test test;
+  pthread_t workers[3];
+  ssh_buffer read;
+  ssh_event event;
+  uint32_t i;
+
+  (void) state;
+
+  sftp_peer_new(&peer);
+  event = ssh_event_new();
+  assert_true(event != NULL);
+  memset(&test, 0, sizeof(test));
+  assert_int_equal(pthread_mutex_init(&test.lock, NULL), 0);
+  test.pool = sftp_server_pool_new(event, 2);
+  assert_true(test.pool != NULL);
+  for (i = 0; i < 3; i++) {
+    assert_int_equal(pthread_create(&workers[i], NULL, pool_test_worker,
+          &test), 0);
+  }
+  assert_int_equal(sftp_server_set_handler(peer.sftp, SSH_FXP_READ,
+        pool_test_read, &test), SSH_OK);
+  assert_int_equal(sftp_server_start(peer.sftp), SSH_OK);
+
+  /* four reads at four offsets, two at a time for the session */
+  read = ssh_buffer_new();
+  assert_true(read != NULL);
+  for (i = 1; i <= 4; i++) {
+    assert_int_equal(buffer_pack(read, "dbdsqd", 25, SSH_FXP_READ, i, "ABCD",
+          (uint64_t) (i - 1) * 4096, 4096), 0);
+  }
+  sftp_peer_data(&peer, buffer_get_rest(read), buffer_get_rest_len(read));
+  ssh_buffer_free(read);
+  assert_int_equal(sftp_server_pool_jobs(test.pool), 4);
+
+  for (i = 0; sftp_server_pool_jobs(test.pool) > 0 && i < 100; i++) {
+    assert_int_equal(ssh_event_dopoll(event, 100), SSH_OK);
+  }
+  assert_int_equal(sftp_server_pool_jobs(test.pool), 0);
+  assert_int_equal(test.most, 2);
+
+  for (i = 2; i <= 4; i++) {
+    sftp_peer_reply(&peer);
+    assert_int_equal(peer.type, SSH_FXP_DATA);
+    assert_int_equal(peer.id, i);
+  }
+  sftp_peer_reply(&peer);
+  assert_int_equal(peer.id, 1);
+
+  /* the workers all return */
+  sftp_server_pool_stop(test.pool);
+  for (i = 0; i < 3; i++) {
+    assert_int_equal(pthread_join(workers[i], NULL), 0);
+  }
+  sftp_server_pool_free(test.pool);
+  pthread_mutex_destroy(&test.lock);
+  ssh_event_free(event);
+  sftp_peer_free(&peer);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_sftp_server_dispatch),
+        unit_test(torture_sftp_server_messages),
+        unit_test(torture_sftp_server_pool),
+        unit_test(torture_sftp_server_data_fd),
+        unit_test(torture_sftp_server_names_dir),
+    };
+
+    ssh_threads_set_callbacks(ssh_threads_get_pthread());
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,507 @@
+#define LIBSSH_STATIC
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/callbacks.h"
+#include "libssh/socket.h"
+#include "libssh/poll.h"
+#include "libssh/misc.h"
+
+/* an in-memory transport signalling its data on one end of a socketpair */
+struct memory_transport {
+  int fds[2];
+  char in[64];
+  size_t in_len;
+  char out[64];
+  size_t out_len;
+  int write_again;
+  int closed;
+  char received[64];
+  size_t received_len;
+  int exceptions;
+};
+
+static int memory_read(void *buffer, uint32_t len, void *userdata) {
+  struct memory_transport *t = userdata;
+  char c;
+
+  /* consume the signal */
+  while (read(t->fds[0], &c, 1) == 1);
+  if (t->in_len == 0) {
+    return SSH_AGAIN;
+  }
+  if (len > t->in_len) {
+    len = t->in_len;
+  }
+  memcpy(buffer, t->in, len);
+  memmove(t->in, t->in + len, t->in_len - len);
+  t->in_len -= len;
+
+  return len;
+}
+
+static int memory_write(const void *buffer, uint32_t len, void *userdata) {
+  struct memory_transport *t = userdata;
+
+  if (t->write_again) {
+    return SSH_AGAIN;
+  }
+  assert_true(t->out_len + len <= sizeof(t->out));
+  memcpy(t->out + t->out_len, buffer, len);
+  t->out_len += len;
+
+  return len;
+}
+
+static void memory_close(void *userdata) {
+  struct memory_transport *t = userdata;
+
+  t->closed++;
+}
+
+static int memory_data(const void *data, size_t len, void *userdata) {
+  struct memory_transport *t = userdata;
+
+  assert_true(t->received_len + len <= sizeof(t->received));
+  memcpy(t->received + t->received_len, data, len);
+  t->received_len += len;
+
+  return len;
+}
+
+static void memory_exception(int code, int errno_code, void *userdata) {
+  struct memory_transport *t = userdata;
+
+  (void) code;
+  (void) errno_code;
+  t->exceptions++;
+}
+
+static void memory_signal(struct memory_transport *t, const char *data) {
+  size_t len = strlen(data);
+
+  memcpy(t->in + t->in_len, data, len);
+  t->in_len += len;
+  assert_int_equal(write(t->fds[1], "x", 1), 1);
+}
+
+static void torture_socket_transport(void **state) {
+  struct memory_transport t;
+  struct ssh_transport_callbacks_struct cb;
+  struct ssh_socket_callbacks_struct socket_cb;
+  struct iovec iov[2];
+  char v1[] = "de";
+  char v2[] = "f";
+  ssh_session session;
+  ssh_poll_ctx ctx;
+  ssh_socket s;
+
+  (void) state;
+
+  memset(&t, 0, sizeof(t));
+  assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, t.fds), 0);
+  assert_int_equal(fcntl(t.fds[0], F_SETFL, O_NONBLOCK), 0);
+
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &t;
+  cb.read = memory_read;
+  cb.write = memory_write;
+  cb.close = memory_close;
+  ssh_callbacks_init(&cb);
+
+  memset(&socket_cb, 0, sizeof(socket_cb));
+  socket_cb.userdata = &t;
+  socket_cb.data = memory_data;
+  socket_cb.exception = memory_exception;
+
+  session = ssh_new();
+  assert_true(session != NULL);
+  s = ssh_socket_new(session);
+  assert_true(s != NULL);
+  ssh_socket_set_transport(s, &cb, t.fds[0]);
+  ssh_socket_set_callbacks(s, &socket_cb);
+  assert_true(ssh_socket_is_open(s));
+
+  ctx = ssh_poll_ctx_new(2);
+  assert_true(ctx != NULL);
+  assert_int_equal(ssh_poll_ctx_add(ctx, ssh_socket_get_poll_handle_in(s)),
+      SSH_OK);
+  ssh_poll_set_events(ssh_socket_get_poll_handle_in(s), POLLIN);
+
+  /* data goes from the transport to the data callback */
+  memory_signal(&t, "hello");
+  assert_int_equal(ssh_poll_ctx_dopoll(ctx, 1000), SSH_OK);
+  assert_int_equal(t.received_len, 5);
+  assert_memory_equal(t.received, "hello", 5);
+
+  /* a signal without data is not an error */
+  memory_signal(&t, "");
+  assert_int_equal(ssh_poll_ctx_dopoll(ctx, 1000), SSH_OK);
+  assert_int_equal(t.received_len, 5);
+  assert_int_equal(t.exceptions, 0);
+  assert_true(ssh_socket_is_open(s));
+
+  /* writes go to the transport, writev without a writev callback too */
+  ssh_socket_set_write_wontblock(s);
+  assert_int_equal(ssh_socket_write(s, "abc", 3), SSH_OK);
+  ssh_socket_set_write_wontblock(s);
+  iov[0].iov_base = v1;
+  iov[0].iov_len = 2;
+  iov[1].iov_base = v2;
+  iov[1].iov_len = 1;
+  assert_int_equal(ssh_socket_writev(s, iov, 2), SSH_OK);
+  assert_int_equal(t.out_len, 6);
+  assert_memory_equal(t.out, "abcdef", 6);
+
+  /* a full transport keeps the data until its fd is writable */
+  t.write_again = 1;
+  ssh_socket_set_write_wontblock(s);
+  assert_int_equal(ssh_socket_write(s, "ghi", 3), SSH_OK);
+  assert_int_equal(ssh_socket_buffered(s), 3);
+  assert_int_equal(t.out_len, 6);
+  t.write_again = 0;
+  assert_int_equal(ssh_poll_ctx_dopoll(ctx, 1000), SSH_OK);
+  assert_int_equal(ssh_socket_buffered(s), 0);
+  assert_int_equal(t.out_len, 9);
+  assert_memory_equal(t.out, "abcdefghi", 9);
+
+  /* the transport is closed once and keeps its fd */
+  ssh_socket_close(s);
+  assert_int_equal(t.closed, 1);
+  assert_false(ssh_socket_is_open(s));
+  assert_true(fcntl(t.fds[0], F_GETFD) != -1);
+  ssh_socket_free(s);
+  assert_int_equal(t.closed, 1);
+
+  ssh_poll_ctx_free(ctx);
+  ssh_free(session);
+  close(t.fds[0]);
+  close(t.fds[1]);
+}
+
+static ssh_poll_ctx nested_ctx;
+static int nested_calls;
+
+/* the first call polls again, as a callback waiting for a reply would */
+static int nested_data(const void *data, size_t len, void *userdata) {
+  struct memory_transport *t = userdata;
+
+  nested_calls++;
+  if (nested_calls == 1) {
+    memory_signal(t, "world");
+    assert_int_equal(ssh_poll_ctx_dopoll(nested_ctx, 0), SSH_OK);
+    /* the nested read doesn't call the callback again */
+    assert_int_equal(nested_calls, 1);
+  }
+
+  return memory_data(data, len, userdata);
+}
+
+static void torture_socket_nested_read(void **state) {
+  struct memory_transport t;
+  struct ssh_transport_callbacks_struct cb;
+  struct ssh_socket_callbacks_struct socket_cb;
+  ssh_session session;
+  ssh_socket s;
+
+  (void) state;
+
+  memset(&t, 0, sizeof(t));
+  assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, t.fds), 0);
+  assert_int_equal(fcntl(t.fds[0], F_SETFL, O_NONBLOCK), 0);
+
+  memset(&cb, 0, sizeof(cb));
+  cb.userdata = &t;
+  cb.read = memory_read;
+  cb.write = memory_write;
+  ssh_callbacks_init(&cb);
+
+  memset(&socket_cb, 0, sizeof(socket_cb));
+  socket_cb.userdata = &t;
+  socket_cb.data = nested_data;
+  socket_cb.exception = memory_exception;
+
+  session = ssh_new();
+  assert_true(session != NULL);
+  s = ssh_socket_new(session);
+  assert_true(s != NULL);
+  ssh_socket_set_transport(s, &cb, t.fds[0]);
+  ssh_socket_set_callbacks(s, &socket_cb);
+
+  nested_ctx = ssh_poll_ctx_new(2);
+  assert_true(nested_ctx != NULL);
+  assert_int_equal(ssh_poll_ctx_add(nested_ctx,
+        ssh_socket_get_poll_handle_in(s)), SSH_OK);
+  ssh_poll_set_events(ssh_socket_get_poll_handle_in(s), POLLIN);
+
+  /* the data read by the nested poll is given as soon as the callback
+   * returns, within the same wakeup */
+  nested_calls = 0;
+  memory_signal(&t, "hello");
+  assert_int_equal(ssh_poll_ctx_dopoll(nested_ctx, 1000), SSH_OK);
+  assert_int_equal(nested_calls, 2);
+  assert_int_equal(t.received_len, 10);
+  assert_memory_equal(t.received, "helloworld", 10);
+  assert_int_equal(ssh_socket_buffered(s), 0);
+  assert_int_equal(t.exceptions, 0);
+
+  ssh_socket_free(s);
+  ssh_poll_ctx_free(nested_ctx);
+  ssh_free(session);
+  close(t.fds[0]);
+  close(t.fds[1]);
+}
+
+static void torture_socket_transport_invalid(void **state) {
+  struct ssh_transport_callbacks_struct cb;
+  ssh_session session;
+
+  (void) state;
+
+  session = ssh_new();
+  assert_true(session != NULL);
+
+  memset(&cb, 0, sizeof(cb));
+  ssh_callbacks_init(&cb);
+  cb.read = memory_read;
+  assert_int_equal(ssh_set_transport_callbacks(session, &cb, 0), SSH_ERROR);
+  cb.write = memory_write;
+  assert_int_equal(ssh_set_transport_callbacks(session, &cb,
+        SSH_INVALID_SOCKET), SSH_ERROR);
+  assert_int_equal(ssh_get_fd(session), SSH_INVALID_SOCKET);
+
+  ssh_free(session);
+}
+
+/* a listening socket on the loopback, its port in addr */
+static int torture_listen(struct sockaddr_in *addr, int backlog) {
+  socklen_t len = sizeof(*addr);
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert_true(fd >= 0);
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert_int_equal(bind(fd, (struct sockaddr *) addr, sizeof(*addr)), 0);
+  assert_int_equal(listen(fd, backlog), 0);
+  assert_int_equal(getsockname(fd, (struct sockaddr *) addr, &len), 0);
+
+  return fd;
+}
+
+static void torture_ai(struct addrinfo *ai, struct sockaddr_in *addr,
+    struct addrinfo *next) {
+  memset(ai, 0, sizeof(*ai));
+  ai->ai_family = AF_INET;
+  ai->ai_socktype = SOCK_STREAM;
+  ai->ai_addr = (struct sockaddr *) addr;
+  ai->ai_addrlen = sizeof(*addr);
+  ai->ai_next = next;
+}
+
+static int connected_code;
+
+static void connected(int code, int errno_code, void *userdata) {
+  (void) errno_code;
+  (void) userdata;
+  connected_code = code;
+}
+
+/* connects to the addresses, returns the time it took in ms */
+static int torture_connect_ai(struct addrinfo *ai,
+    struct sockaddr_in *expected) {
+  struct ssh_socket_callbacks_struct socket_cb;
+  struct sockaddr_in peer;
+  socklen_t len = sizeof(peer);
+  ssh_session session;
+  ssh_poll_ctx ctx;
+  ssh_socket s;
+  uint64_t start;
+  int i;
+
+  memset(&socket_cb, 0, sizeof(socket_cb));
+  socket_cb.connected = connected;
+  connected_code = 0;
+
+  session = ssh_new();
+  assert_true(session != NULL);
+  s = ssh_socket_new(session);
+  assert_true(s != NULL);
+  ssh_socket_set_callbacks(s, &socket_cb);
+
+  start = ssh_timestamp_ms();
+  assert_int_equal(ssh_socket_connect_ai(s, ai, 0, NULL), SSH_OK);
+  ctx = ssh_poll_get_default_ctx(session);
+  assert_true(ctx != NULL);
+  assert_int_equal(ssh_poll_ctx_add(ctx, ssh_socket_get_poll_handle_in(s)),
+      SSH_OK);
+  for (i = 0; i < 100 && connected_code == 0; i++) {
+    ssh_poll_ctx_dopoll(ctx, 100);
+  }
+  assert_int_equal(connected_code, SSH_SOCKET_CONNECTED_OK);
+
+  /* the poll object of the socket got the fd of the winner */
+  assert_int_equal(ssh_poll_get_fd(ssh_socket_get_poll_handle_in(s)),
+      ssh_socket_get_fd_in(s));
+  assert_int_equal(getpeername(ssh_socket_get_fd_in(s),
+        (struct sockaddr *) &peer, &len), 0);
+  assert_int_equal(peer.sin_port, expected->sin_port);
+
+  ssh_socket_free(s);
+  ssh_free(session);
+
+  return ssh_timestamp_ms() - start;
+}
+
+static void torture_socket_connect_refused(void **state) {
+  struct sockaddr_in refused, listening;
+  struct addrinfo ai[2];
+  int fd;
+
+  (void) state;
+
+  /* nothing listens on the port of a closed listening socket */
+  fd = torture_listen(&refused, 1);
+  close(fd);
+  fd = torture_listen(&listening, 1);
+  torture_ai(&ai[1], &listening, NULL);
+  torture_ai(&ai[0], &refused, &ai[1]);
+
+  /* a refused attempt doesn't wait for the delay */
+  assert_true(torture_connect_ai(ai, &listening) < SSH_CONNECT_ATTEMPT_DELAY);
+  close(fd);
+}
+
+static void torture_socket_connect_stalled(void **state) {
+  struct sockaddr_in stalled, listening;
+  struct addrinfo ai[2];
+  int fds[3];
+  int elapsed;
+
+  (void) state;
+
+  /* the SYNs sent to a full listen queue are dropped */
+  fds[0] = torture_listen(&stalled, 0);
+  fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+  assert_int_equal(connect(fds[1], (struct sockaddr *) &stalled,
+        sizeof(stalled)), 0);
+  fds[2] = torture_listen(&listening, 1);
+  torture_ai(&ai[1], &listening, NULL);
+  torture_ai(&ai[0], &stalled, &ai[1]);
+
+  /* the second attempt starts after the delay, not after a timeout */
+  elapsed = torture_connect_ai(ai, &listening);
+  assert_true(elapsed >= SSH_CONNECT_ATTEMPT_DELAY - 10);
+  assert_true(elapsed < 4 * SSH_CONNECT_ATTEMPT_DELAY);
+
+  close(fds[0]);
+  close(fds[1]);
+  close(fds[2]);
+}
+
+static int resolve_calls;
+
+static int resolve(ssh_session session, const char *host, int port,
+    void *userdata) {
+  (void) session;
+  (void) userdata;
+  assert_string_equal(host, "host.invalid");
+  assert_int_equal(port, 2222);
+  resolve_calls++;
+
+  return SSH_OK;
+}
+
+static void torture_socket_resolver(void **state) {
+  struct ssh_callbacks_struct cb;
+  ssh_session session;
+  int port = 2222;
+
+  (void) state;
+
+  memset(&cb, 0, sizeof(cb));
+  cb.resolve_function = resolve;
+  ssh_callbacks_init(&cb);
+  resolve_calls = 0;
+
+  session = ssh_new();
+  assert_true(session != NULL);
+  assert_int_equal(ssh_options_set(session, SSH_OPTIONS_HOST, "host.invalid"),
+      0);
+  assert_int_equal(ssh_options_set(session, SSH_OPTIONS_PORT, &port), 0);
+  assert_int_equal(ssh_set_callbacks(session, &cb), 0);
+  ssh_set_blocking(session, 0);
+
+  /* nothing happens until the resolver is done */
+  assert_int_equal(ssh_connect(session), SSH_AGAIN);
+  assert_int_equal(ssh_connect(session), SSH_AGAIN);
+  assert_int_equal(resolve_calls, 1);
+
+  assert_int_equal(ssh_resolve_done(session, NULL), SSH_ERROR);
+  assert_int_equal(ssh_connect(session), SSH_ERROR);
+  assert_int_equal(ssh_resolve_done(session, NULL), SSH_ERROR);
+
+  ssh_free(session);
+}
+
+/* the TCP options of the session are set on the sockets */
+static void torture_socket_tcp_options(void **state) {
+  struct ssh_tcp_options tcp;
+  uint32_t window;
+  socklen_t len;
+  int value;
+  int s;
+
+  (void) state;
+
+  ssh_tcp_options_profile(&tcp, &window, SSH_TCP_PROFILE_INTERACTIVE);
+  assert_int_equal(window, SSH_CHANNEL_WINDOW_DEFAULT);
+  tcp.keepalive = 30;
+  tcp.rcvbuf = 65536;
+
+  s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  assert_true(s >= 0);
+  assert_int_equal(ssh_sock_set_options(s, &tcp), 0);
+
+  len = sizeof(value);
+  assert_int_equal(getsockopt(s, IPPROTO_TCP, TCP_NODELAY, &value, &len), 0);
+  assert_true(value != 0);
+  len = sizeof(value);
+  assert_int_equal(getsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &value, &len), 0);
+  assert_true(value != 0);
+  len = sizeof(value);
+  assert_int_equal(getsockopt(s, SOL_SOCKET, SO_RCVBUF, &value, &len), 0);
+  /* some kernels double the size for their bookkeeping */
+  assert_true(value >= 65536);
+  close(s);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_socket_transport),
+        unit_test(torture_socket_transport_invalid),
+        unit_test(torture_socket_nested_read),
+        unit_test(torture_socket_connect_refused),
+        unit_test(torture_socket_connect_stalled),
+        unit_test(torture_socket_resolver),
+        unit_test(torture_socket_tcp_options),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
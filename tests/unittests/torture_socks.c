@@ -0,0 +1,264 @@
+#define LIBSSH_STATIC
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/session.h"
+#include "libssh/channels.h"
+#include "libssh/buffer.h"
+#include "libssh/ssh2.h"
+
+struct socks_peer {
+  struct torture_peer base;
+  ssh_socks socks;
+  int listener;
+  struct sockaddr_in addr;
+};
+
+/* a session on a socketpair, with a proxy on a local port */
+static void socks_peer_new(struct socks_peer *peer) {
+  socklen_t len = sizeof(peer->addr);
+
+  torture_peer_new(&peer->base, 0);
+
+  peer->listener = socket(AF_INET, SOCK_STREAM, 0);
+  assert_true(peer->listener >= 0);
+  memset(&peer->addr, 0, sizeof(peer->addr));
+  peer->addr.sin_family = AF_INET;
+  peer->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  assert_int_equal(bind(peer->listener, (struct sockaddr *) &peer->addr,
+        sizeof(peer->addr)), 0);
+  assert_int_equal(listen(peer->listener, 16), 0);
+  assert_int_equal(getsockname(peer->listener,
+        (struct sockaddr *) &peer->addr, &len), 0);
+
+  peer->socks = ssh_socks_new(peer->base.session, peer->listener);
+  assert_true(peer->socks != NULL);
+}
+
+static void socks_peer_free(struct socks_peer *peer) {
+  torture_peer_free(&peer->base);
+  close(peer->listener);
+}
+
+/* a client of the proxy which sent its request */
+static int socks_client(struct socks_peer *peer, const void *request,
+    size_t len) {
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert_true(fd >= 0);
+  assert_int_equal(connect(fd, (struct sockaddr *) &peer->addr,
+        sizeof(peer->addr)), 0);
+  assert_int_equal(send(fd, request, len, 0), (ssize_t) len);
+
+  return fd;
+}
+
+/*
+ * Reads the next packet sent to the peer, which must be of the given type.
+ * Returns its length, the message type first.
+ */
+static uint32_t socks_peer_read(struct socks_peer *peer, uint8_t type,
+    unsigned char *payload, size_t size) {
+  unsigned char packet[4096];
+  uint32_t len;
+
+  len = torture_peer_read(&peer->base, packet, sizeof(packet));
+  /* padding length, then the payload and the padding */
+  assert_int_equal(packet[1], type);
+  len -= packet[0] + 1;
+  assert_true(len <= size);
+  memcpy(payload, packet + 1, len);
+
+  return len;
+}
+
+/* the channel the proxy opened last */
+static ssh_channel socks_channel(struct socks_peer *peer) {
+  assert_true(peer->base.session->channels != NULL);
+  return peer->base.session->channels->prev;
+}
+
+/* an answer of the peer about a channel */
+static void socks_peer_answer(struct socks_peer *peer, ssh_channel channel,
+    uint8_t type) {
+  ssh_buffer packet;
+
+  packet = ssh_buffer_new();
+  assert_true(packet != NULL);
+  assert_int_equal(buffer_add_u32(packet, htonl(channel->local_channel)), 0);
+  switch (type) {
+    case SSH2_MSG_CHANNEL_OPEN_CONFIRMATION:
+      assert_int_equal(buffer_add_u32(packet, htonl(7)), 0);
+      assert_int_equal(buffer_add_u32(packet, htonl(64000)), 0);
+      assert_int_equal(buffer_add_u32(packet, htonl(32000)), 0);
+      ssh_packet_channel_open_conf(peer->base.session, type, packet, NULL);
+      break;
+    case SSH2_MSG_CHANNEL_OPEN_FAILURE:
+      assert_int_equal(buffer_add_u32(packet, htonl(2)), 0);
+      assert_int_equal(buffer_add_u32(packet, 0), 0);
+      assert_int_equal(buffer_add_u32(packet, 0), 0);
+      ssh_packet_channel_open_fail(peer->base.session, type, packet, NULL);
+      break;
+    case SSH2_MSG_CHANNEL_CLOSE:
+      channel_rcv_close(peer->base.session, type, packet, NULL);
+      break;
+  }
+  ssh_buffer_free(packet);
+}
+
+static void torture_socks5(void **state) {
+  static const unsigned char request[] = {
+    5, 2, 2, 0, /* user and password, or no authentication */
+    5, 1, 0, 3, 11, 'e', 'x', 'a', 'm', 'p', 'l', 'e', '.', 'c', 'o', 'm',
+    0, 80,
+    'G', 'E', 'T' /* sent before the reply */
+  };
+  struct socks_peer peer;
+  unsigned char payload[1024];
+  unsigned char reply[10];
+  ssh_channel channel;
+  uint32_t len;
+  int fd;
+  int i;
+
+  (void) state;
+
+  socks_peer_new(&peer);
+  fd = socks_client(&peer, request, sizeof(request));
+
+  /* the channel to the host of the request */
+  len = socks_peer_read(&peer, SSH2_MSG_CHANNEL_OPEN, payload,
+      sizeof(payload));
+  assert_true(len > 40);
+  assert_memory_equal(payload + 5, "direct-tcpip", 12);
+  assert_memory_equal(payload + 33, "example.com", 11);
+  assert_int_equal(payload[44 + 3], 80);
+  assert_int_equal(recv(fd, reply, 2, MSG_WAITALL), 2);
+  assert_int_equal(reply[0], 5);
+  assert_int_equal(reply[1], 0);
+  assert_int_equal(ssh_socks_get_count(peer.socks), 1);
+
+  /* once it is open, the connection is forwarded */
+  channel = socks_channel(&peer);
+  socks_peer_answer(&peer, channel, SSH2_MSG_CHANNEL_OPEN_CONFIRMATION);
+  assert_int_equal(recv(fd, reply, 10, MSG_WAITALL), 10);
+  assert_int_equal(reply[0], 5);
+  assert_int_equal(reply[1], 0);
+  assert_true(channel->fd_bind != NULL);
+  len = socks_peer_read(&peer, SSH2_MSG_CHANNEL_DATA, payload,
+      sizeof(payload));
+  assert_int_equal(len, 1 + 4 + 4 + 3);
+  assert_memory_equal(payload + 9, "GET", 3);
+  assert_int_equal(send(fd, "/", 1, 0), 1);
+  len = socks_peer_read(&peer, SSH2_MSG_CHANNEL_DATA, payload,
+      sizeof(payload));
+  assert_int_equal(len, 1 + 4 + 4 + 1);
+
+  /* the client leaves, the channel is freed once the peer closed it */
+  close(fd);
+  socks_peer_read(&peer, SSH2_MSG_CHANNEL_EOF, payload, sizeof(payload));
+  assert_int_equal(ssh_socks_get_count(peer.socks), 1);
+  socks_peer_answer(&peer, channel, SSH2_MSG_CHANNEL_CLOSE);
+  assert_int_equal(ssh_socks_get_count(peer.socks), 0);
+  for (i = 0; i < 3; i++) {
+    assert_int_equal(ssh_handle_packets(peer.base.session, 10), SSH_OK);
+  }
+  assert_true(peer.base.session->channels == NULL);
+
+  socks_peer_free(&peer);
+}
+
+static void torture_socks4_refused(void **state) {
+  /* SOCKS4a: the host follows the user */
+  static const unsigned char request[] = {
+    4, 1, 0, 22, 0, 0, 0, 1, 'u', 0, 'h', 'o', 's', 't', 0
+  };
+  struct socks_peer peer;
+  unsigned char payload[1024];
+  unsigned char reply[8];
+  int fd;
+  int i;
+
+  (void) state;
+
+  socks_peer_new(&peer);
+  fd = socks_client(&peer, request, sizeof(request));
+  socks_peer_read(&peer, SSH2_MSG_CHANNEL_OPEN, payload, sizeof(payload));
+  assert_memory_equal(payload + 33, "host", 4);
+  assert_int_equal(payload[37 + 3], 22);
+
+  socks_peer_answer(&peer, socks_channel(&peer),
+      SSH2_MSG_CHANNEL_OPEN_FAILURE);
+  assert_int_equal(recv(fd, reply, 8, MSG_WAITALL), 8);
+  assert_int_equal(reply[1], 91);
+  assert_int_equal(recv(fd, reply, 1, 0), 0);
+  assert_int_equal(ssh_socks_get_count(peer.socks), 0);
+  for (i = 0; i < 3; i++) {
+    assert_int_equal(ssh_handle_packets(peer.base.session, 10), SSH_OK);
+  }
+  assert_true(peer.base.session->channels == NULL);
+  close(fd);
+
+  socks_peer_free(&peer);
+}
+
+static void torture_socks_unsupported(void **state) {
+  static const unsigned char password[] = {5, 1, 2};
+  static const unsigned char bind[] = {4, 2, 0, 22, 10, 0, 0, 1, 0};
+  struct socks_peer peer;
+  unsigned char reply[8];
+  int fds[2];
+  int i;
+
+  (void) state;
+
+  socks_peer_new(&peer);
+  /* SOCKS5 with authentication only, SOCKS4 BIND */
+  fds[0] = socks_client(&peer, password, sizeof(password));
+  fds[1] = socks_client(&peer, bind, sizeof(bind));
+  for (i = 0; i < 3; i++) {
+    assert_int_equal(ssh_handle_packets(peer.base.session, 10), SSH_OK);
+  }
+  assert_int_equal(recv(fds[0], reply, 2, MSG_WAITALL), 2);
+  assert_int_equal(reply[1], 0xff);
+  assert_int_equal(recv(fds[0], reply, 1, 0), 0);
+  assert_int_equal(recv(fds[1], reply, 8, MSG_WAITALL), 8);
+  assert_int_equal(reply[1], 91);
+  assert_int_equal(recv(fds[1], reply, 1, 0), 0);
+  assert_int_equal(ssh_socks_get_count(peer.socks), 0);
+  assert_true(peer.base.session->channels == NULL);
+  close(fds[0]);
+  close(fds[1]);
+
+  /* the connections still open are closed with the session */
+  fds[0] = socks_client(&peer, password, 1);
+  for (i = 0; i < 3; i++) {
+    assert_int_equal(ssh_handle_packets(peer.base.session, 10), SSH_OK);
+  }
+  assert_int_equal(ssh_socks_get_count(peer.socks), 1);
+  socks_peer_free(&peer);
+  assert_int_equal(recv(fds[0], reply, 1, 0), 0);
+  close(fds[0]);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_socks5),
+        unit_test(torture_socks4_refused),
+        unit_test(torture_socks_unsupported),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}
@@ -0,0 +1,99 @@
+#define LIBSSH_STATIC
+#include <libssh/priv.h>
+#include <libssh/callbacks.h>
+#include <libssh/session.h>
+#include <libssh/histogram.h>
+#include <libssh/threads.h>
+#include <pthread.h>
+#include "torture.h"
+
+#define NUM_LOOPS 200
+#define NUM_THREADS 16
+
+static void setup(void **state) {
+    (void) state;
+
+    ssh_init();
+}
+
+static void teardown(void **state) {
+    (void) state;
+
+    ssh_finalize();
+}
+
+/* each thread has its own sessions, and initializes libssh again */
+static void *torture_threads_session(void *arg) {
+    ssh_session session;
+    int i;
+
+    (void) arg;
+
+    for (i = 0; i < NUM_LOOPS; i++) {
+        assert_int_equal(ssh_init(), 0);
+        assert_int_equal(ssh_init_once(), 0);
+        session = ssh_new();
+        assert_true(session != NULL);
+        assert_int_equal(ssh_options_set(session, SSH_OPTIONS_HOST,
+            "localhost"), 0);
+        ssh_latency_record(session, SSH_LATENCY_CONNECT, i + 1);
+        ssh_free(session);
+        assert_int_equal(ssh_finalize(), 0);
+    }
+
+    return NULL;
+}
+
+static void torture_threads_sessions(void **state) {
+    pthread_t threads[NUM_THREADS];
+    struct ssh_latency_struct latency;
+    int i;
+
+    (void) state;
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        assert_int_equal(pthread_create(&threads[i], NULL,
+            torture_threads_session, NULL), 0);
+    }
+    for (i = 0; i < NUM_THREADS; i++) {
+        assert_int_equal(pthread_join(threads[i], NULL), 0);
+    }
+
+    /* the totals of the process were updated without a lock */
+    assert_int_equal(ssh_session_get_latency(NULL, SSH_LATENCY_CONNECT,
+        &latency), SSH_OK);
+    assert_true(latency.count == NUM_THREADS * NUM_LOOPS);
+    assert_true(latency.min == 1);
+    assert_true(latency.max == NUM_LOOPS);
+    assert_true(latency.mean == (NUM_LOOPS + 1) / 2);
+}
+
+static void torture_threads_default(void **state) {
+    void *lock = NULL;
+
+    (void) state;
+
+    /* the native locks are used without setting the callbacks */
+    assert_true(ssh_threads_get_default() != ssh_threads_get_noop());
+    assert_string_equal(ssh_threads_get_type(), "threads_pthread");
+    assert_int_equal(ssh_threads_mutex_init(&lock), 0);
+    assert_true(lock != NULL);
+    assert_int_equal(ssh_threads_mutex_lock(&lock), 0);
+    assert_int_equal(ssh_threads_mutex_unlock(&lock), 0);
+    assert_int_equal(ssh_threads_mutex_destroy(&lock), 0);
+
+    /* and can't be swapped under the initialized library */
+    assert_int_equal(ssh_threads_set_callbacks(ssh_threads_get_noop()),
+        SSH_ERROR);
+    assert_int_equal(ssh_threads_set_callbacks(ssh_threads_get_default()),
+        SSH_OK);
+}
+
+int torture_run_tests(void) {
+    const UnitTest tests[] = {
+        unit_test_setup_teardown(torture_threads_default, setup, teardown),
+        unit_test_setup_teardown(torture_threads_sessions, setup, teardown),
+    };
+
+    return run_tests(tests);
+}
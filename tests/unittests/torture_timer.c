@@ -0,0 +1,173 @@
+#define LIBSSH_STATIC
+
+#include "torture.h"
+#include "libssh/priv.h"
+#include "libssh/misc.h"
+#include "libssh/timer.h"
+
+struct timer_test {
+  int order[8];
+  int fired;
+  int repeat;
+  ssh_timer other;
+};
+
+static struct timer_test *current;
+
+static void timer_test_cb(ssh_timer timer, void *userdata) {
+  assert_false(ssh_timer_is_pending(timer));
+  current->order[current->fired++] = *(int *) userdata;
+
+  if (current->repeat > 0) {
+    current->repeat--;
+    assert_int_equal(ssh_timer_reset(timer, 5), SSH_OK);
+  }
+  if (current->other != NULL && current->other != timer) {
+    ssh_timer_free(current->other);
+    current->other = NULL;
+  }
+}
+
+static void timer_test_run(ssh_event event, int count) {
+  uint64_t start = ssh_timestamp_ms();
+
+  while (current->fired < count) {
+    assert_int_equal(ssh_event_dopoll(event, -1), SSH_OK);
+    assert_true(ssh_timestamp_ms() - start < 5000);
+  }
+}
+
+static void torture_timer_order(void **state) {
+  struct timer_test test;
+  int values[] = {30, 10, 20, 140, 0};
+  uint64_t start;
+  ssh_event event;
+  int i;
+
+  (void) state;
+  ZERO_STRUCT(test);
+  current = &test;
+  event = ssh_event_new();
+  assert_true(event != NULL);
+
+  start = ssh_timestamp_ms();
+  for (i = 0; i < 5; i++) {
+    assert_true(ssh_event_add_timer(event, values[i], timer_test_cb,
+          &values[i]) != NULL);
+  }
+  /* without any fd, the poll sleeps until the next timer */
+  timer_test_run(event, 5);
+  assert_true(ssh_timestamp_ms() - start >= 140);
+
+  assert_int_equal(test.order[0], 0);
+  assert_int_equal(test.order[1], 10);
+  assert_int_equal(test.order[2], 20);
+  assert_int_equal(test.order[3], 30);
+  assert_int_equal(test.order[4], 140);
+
+  ssh_event_free(event);
+}
+
+static void torture_timer_reset(void **state) {
+  struct timer_test test;
+  int one = 1, two = 2;
+  ssh_timer t1, t2;
+  ssh_event event;
+
+  (void) state;
+  ZERO_STRUCT(test);
+  current = &test;
+  event = ssh_event_new();
+  assert_true(event != NULL);
+
+  t1 = ssh_event_add_timer(event, 10, timer_test_cb, &one);
+  t2 = ssh_event_add_timer(event, 20, timer_test_cb, &two);
+  assert_true(t1 != NULL && t2 != NULL);
+
+  /* a cancelled one doesn't run, not even once reset and cancelled again */
+  ssh_timer_cancel(t1);
+  assert_false(ssh_timer_is_pending(t1));
+  assert_int_equal(ssh_timer_reset(t1, 5), SSH_OK);
+  ssh_timer_cancel(t1);
+
+  /* a callback resetting its timer runs it again */
+  test.repeat = 2;
+  timer_test_run(event, 3);
+  assert_int_equal(test.order[0], 2);
+  assert_int_equal(test.order[1], 2);
+  assert_int_equal(test.order[2], 2);
+  assert_false(ssh_timer_is_pending(t2));
+
+  /* a callback may free another expired one */
+  test.fired = 0;
+  assert_int_equal(ssh_timer_reset(t1, 0), SSH_OK);
+  assert_int_equal(ssh_timer_reset(t2, 0), SSH_OK);
+  test.other = t2;
+  timer_test_run(event, 1);
+  assert_int_equal(test.order[0], 1);
+  assert_true(test.other == NULL);
+  assert_int_equal(ssh_event_dopoll(event, 20), SSH_OK);
+  assert_int_equal(test.fired, 1);
+
+  ssh_event_free(event);
+}
+
+static void torture_timer_timeout(void **state) {
+  struct timer_test test;
+  int one = 1;
+  ssh_poll_ctx ctx;
+  ssh_timer timers = NULL;
+  ssh_timer t;
+  int timeout;
+
+  (void) state;
+  ZERO_STRUCT(test);
+  current = &test;
+  ctx = ssh_poll_ctx_new(0);
+  assert_true(ctx != NULL);
+
+  t = ssh_timer_new(&timers, ctx, NULL, NULL, timer_test_cb, &one);
+  assert_true(t != NULL);
+  assert_int_equal(ssh_poll_ctx_dopoll(ctx, 0), SSH_OK);
+  assert_int_equal(ssh_timer_wheel_timeout(ssh_poll_ctx_get_timers(ctx), 50),
+      50);
+
+  /* the poll timeout is exact on every level of the wheel */
+  assert_int_equal(ssh_timer_reset(t, 10 * 1000), SSH_OK);
+  timeout = ssh_timer_wheel_timeout(ssh_poll_ctx_get_timers(ctx), -1);
+  assert_true(timeout <= 10 * 1000 && timeout > 9 * 1000);
+  assert_int_equal(ssh_timer_wheel_timeout(ssh_poll_ctx_get_timers(ctx),
+        100), 100);
+
+  assert_int_equal(ssh_timer_reset(t, 10 * 3600 * 1000), SSH_OK);
+  timeout = ssh_timer_wheel_timeout(ssh_poll_ctx_get_timers(ctx), -1);
+  assert_true(timeout <= 10 * 3600 * 1000 && timeout > 9 * 3600 * 1000);
+
+  /* a long timer cascades down and still expires on time */
+  assert_int_equal(ssh_timer_reset(t, 300), SSH_OK);
+  while (test.fired == 0) {
+    assert_int_equal(ssh_poll_ctx_dopoll(ctx, -1), SSH_OK);
+  }
+  assert_false(ssh_timer_is_pending(t));
+
+  /* freeing the context cancels the pending timers */
+  assert_int_equal(ssh_timer_reset(t, 1000), SSH_OK);
+  ssh_poll_ctx_free(ctx);
+  assert_false(ssh_timer_is_pending(t));
+  ssh_timers_free(&timers);
+  assert_true(timers == NULL);
+}
+
+int torture_run_tests(void) {
+    int rc;
+    const UnitTest tests[] = {
+        unit_test(torture_timer_order),
+        unit_test(torture_timer_reset),
+        unit_test(torture_timer_timeout),
+    };
+
+    ssh_init();
+    rc = run_tests(tests);
+    ssh_finalize();
+    return rc;
+}